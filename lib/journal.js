@@ -113,6 +113,131 @@
                 options.count = null;
         }
 
+        var dfd = new $.Deferred();
+        var promise;
+        var entries = [];
+        var streamers = null;
+        var interval = null;
+        var proc = null;
+
+        function fire_streamers() {
+            if (streamers && entries.length > 0) {
+                var ents = entries;
+                entries = [];
+                streamers.fireWith(promise, [ents]);
+            } else {
+                window.clearInterval(interval);
+                interval = null;
+            }
+        }
+
+        function received(ents) {
+            entries.push.apply(entries, ents);
+            if (streamers && interval === null)
+                interval = window.setInterval(fire_streamers, 300);
+        }
+
+        function finished() {
+            window.clearInterval(interval);
+            fire_streamers();
+            dfd.resolve(entries);
+        }
+
+        /*
+         * The journal1 channel reads the journal in the bridge, without
+         * a journalctl process. It takes the same matches, but times in
+         * microseconds rather than journalctl's date strings.
+         */
+        function native_matches() {
+            if (options.since || options.until)
+                return false;
+            for (var i = 0; i < matches.length; i++) {
+                if (matches[i] != "+" && matches[i].indexOf("=") <= 0)
+                    return false;
+            }
+            return true;
+        }
+
+        function start_channel() {
+            var opts = { payload: "journal1", host: options.host, superuser: "try",
+                         match: matches, follow: !!options.follow };
+            if (options.count)
+                opts.count = options.count;
+            if (options.directory)
+                opts.directory = options.directory;
+            if (options.boot)
+                opts.boot = options.boot;
+            else if (options.boot !== undefined)
+                opts.boot = "";
+            if (options.cursor)
+                opts.cursor = options.cursor;
+            if (options.after)
+                opts.after = options.after;
+            if (options.reverse)
+                opts.reverse = true;
+
+            var channel = cockpit.channel(opts);
+            proc = channel;
+
+            $(channel).
+                on("message", function(event, data) {
+                    var ents;
+                    try {
+                        ents = JSON.parse(data);
+                    } catch (e) {
+                        console.warn(e, data);
+                        return;
+                    }
+                    received(ents);
+                }).
+                on("close", function(event, ex) {
+                    $(channel).off();
+                    if (ex.problem == "not-supported") {
+                        start_spawn();
+                    } else if (ex.problem && ex.problem != "cancelled") {
+                        window.clearInterval(interval);
+                        dfd.reject(ex);
+                    } else {
+                        finished();
+                    }
+                });
+        }
+
+        function start_spawn() {
+            proc = spawn_journalctl(matches, options, received, finished, function(ex) {
+                window.clearInterval(interval);
+                dfd.reject(ex);
+            });
+        }
+
+        if (native_matches())
+            start_channel();
+        else
+            start_spawn();
+
+        var jpromise = dfd.promise;
+        dfd.promise = function() {
+            return $.extend(jpromise.apply(this, arguments), {
+                stream: function stream(callback) {
+                    if (streamers === null)
+                        streamers = $.Callbacks("" /* no flags */);
+                    streamers.add(callback);
+                    return this;
+                },
+                stop: function stop() {
+                    proc.close("cancelled");
+                },
+                promise: this.promise
+            });
+        };
+
+        /* Used above so save a ref */
+        promise = dfd.promise();
+        return promise;
+    };
+
+    /* For bridges without the journal1 payload, and for journalctl only options */
+    function spawn_journalctl(matches, options, received, finished, failed) {
         var cmd = [ "journalctl", "-q", "--output=json" ];
         if (!options.count)
             cmd.push("--no-tail");
@@ -142,29 +267,11 @@
         cmd.push("--");
         cmd.push.apply(cmd, matches);
 
-        var dfd = new $.Deferred();
-        var promise;
         var buffer = "";
-        var entries = [];
-        var streamers = null;
-        var interval = null;
-        var entry;
-
-        function fire_streamers() {
-            if (streamers && entries.length > 0) {
-                var ents = entries;
-                entries = [];
-                streamers.fireWith(promise, [ents]);
-            } else {
-                window.clearInterval(interval);
-                interval = null;
-            }
-        }
 
-        var proc = cockpit.spawn(cmd, { host: options.host, batch: 8192, latency: 300, superuser: "try" }).
+        return cockpit.spawn(cmd, { host: options.host, batch: 8192, latency: 300, superuser: "try" }).
             stream(function(data) {
-                var pos = 0;
-                var next;
+                var ents = [];
 
                 if (buffer)
                     data = buffer + data;
@@ -177,55 +284,29 @@
                         buffer = line;
                     } else if (line && line.indexOf("-- ") !== 0) {
                         try {
-                            entries.push(JSON.parse(line));
+                            ents.push(JSON.parse(line));
                         } catch (e) {
                             console.warn(e, line);
                         }
                     }
                 });
 
-                if (streamers && interval === null)
-                    interval = window.setInterval(fire_streamers, 300);
+                received(ents);
             }).
             done(function() {
-                fire_streamers();
-                dfd.resolve(entries);
+                finished();
             }).
             fail(function(ex) {
                 /* The journalctl command fails when no entries are matched
                  * so we just ignore this status code */
                 if (ex.problem == "cancelled" ||
                     ex.exit_status === 1) {
-                    fire_streamers();
-                    dfd.resolve(entries);
+                    finished();
                 } else {
-                    dfd.reject(ex);
+                    failed(ex);
                 }
-            }).
-            always(function() {
-                window.clearInterval(interval);
-            });
-
-        var jpromise = dfd.promise;
-        dfd.promise = function() {
-            return $.extend(jpromise.apply(this, arguments), {
-                stream: function stream(callback) {
-                    if (streamers === null)
-                        streamers = $.Callbacks("" /* no flags */);
-                    streamers.add(callback);
-                    return this;
-                },
-                stop: function stop() {
-                    proc.close("cancelled");
-                },
-                promise: this.promise
             });
-        };
-
-        /* Used above so save a ref */
-        promise = dfd.promise();
-        return promise;
-    };
+    }
 
     module.printable = function printable(value) {
         if (value === undefined)
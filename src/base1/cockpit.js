@@ -355,8 +355,30 @@ function Transport() {
         window.mock.last_transport = self;
 
     var ws;
+    var ws_loc;
     var check_health_timer;
     var got_message = false;
+    var busy_attempts = 0;
+    var retry_timer = null;
+
+    /* Resuming the connection after it drops, see resume_socket() */
+    var resume_token = null;
+    var resuming = false;
+    var resume_attempts = 0;
+    var received = 0;
+    var sent = 0;
+    var sent_log = [];
+    var sent_log_size = 0;
+    var sent_log_max = 256 * 1024;
+
+    function open_socket(loc) {
+        if ("WebSocket" in window)
+            return new window.WebSocket(loc, "cockpit1");
+        else if ("MozWebSocket" in window) // Firefox 6
+            return new window.MozWebSocket(loc);
+        console.error("WebSocket not supported, application will not work!");
+        return null;
+    }
 
     /* See if we should communicate via parent */
     if (window.parent !== window && window.name.indexOf("cockpit1:") === 0)
@@ -374,23 +396,26 @@ function Transport() {
     }
 
     if (!ws) {
-        var ws_loc = calculate_url();
+        ws_loc = calculate_url();
         transport_debug("connecting to " + ws_loc);
 
-        if (ws_loc) {
-            if ("WebSocket" in window) {
-                ws = new window.WebSocket(ws_loc, "cockpit1");
-            } else if ("MozWebSocket" in window) { // Firefox 6
-                ws = new window.MozWebSocket(ws_loc);
-            } else {
-                console.error("WebSocket not supported, application will not work!");
-            }
-        }
+        if (ws_loc)
+            ws = open_socket(ws_loc);
 
         check_health_timer = window.setInterval(function () {
             if (!got_message) {
                 console.log("health check failed");
-                self.close({ "problem": "timeout" });
+                if (can_resume()) {
+                    /* Leave it be, the web service closes it once resumed */
+                    if (ws) {
+                        ws.onclose = null;
+                        ws.onmessage = null;
+                        ws = null;
+                    }
+                    resume_socket();
+                } else {
+                    self.close({ "problem": "timeout" });
+                }
             }
             got_message = false;
         }, 30000);
@@ -418,17 +443,22 @@ function Transport() {
         }
     }
 
-    ws.onopen = function() {
+    function on_open() {
         if (ws) {
             if (typeof ws.binaryType !== "undefined" && have_array_buffer) {
                 ws.binaryType = "arraybuffer";
                 binary_type_available = true;
             }
-            ws.send("\n{ \"command\": \"init\", \"version\": 1 }");
+            if (resuming) {
+                ws.send("\n" + JSON.stringify({ "command": "init", "version": 1,
+                                                "resume": resume_token, "received": received }));
+            } else {
+                self.send_data("\n{ \"command\": \"init\", \"version\": 1 }");
+            }
         }
-    };
+    }
 
-    ws.onclose = function() {
+    function on_close() {
         transport_debug("WebSocket onclose");
         ws = null;
         if (reload_after_disconnect) {
@@ -437,10 +467,13 @@ function Transport() {
         }
         if (expect_disconnect)
             return;
-        self.close();
-    };
+        if (can_resume())
+            resume_socket();
+        else
+            self.close();
+    }
 
-    ws.onmessage = function(event) {
+    function on_message(event) {
         got_message = true;
 
         /* The first line of a message is the channel */
@@ -492,6 +525,18 @@ function Transport() {
             transport_debug("recv " + channel + ":", payload);
         }
 
+        /* Only the web service's answer matters until it has resumed */
+        if (resuming) {
+            if (control && control.command == "resume")
+                finish_resume(control.received);
+            else if (control && control.command == "close" && !control.channel)
+                self.close({ "problem": control.problem || "disconnected" });
+            return;
+        }
+
+        if (!control || control.command != "ping")
+            received++;
+
         length = filters.length;
         for (var i = 0; i < length; i++) {
             if (filters[i](data, channel, control) === false)
@@ -504,13 +549,110 @@ function Transport() {
             process_message(channel, payload);
 
         phantom_checkpoint();
-    };
+    }
+
+    function attach_socket() {
+        ws.onopen = on_open;
+        ws.onclose = on_close;
+        ws.onmessage = on_message;
+    }
+
+    attach_socket();
+
+    /*
+     * The web service is letting connections in slowly, as when every
+     * tab reconnects at once. It suggests when to come back. Back off
+     * more each time, with jitter so the tabs don't come back together.
+     */
+    function retry_socket(seconds) {
+        var delay = Math.min(seconds * Math.pow(2, busy_attempts), 16) * (0.5 + Math.random());
+        busy_attempts++;
+        transport_debug("server busy, connecting again in " + delay + " seconds");
+
+        var ows = ws;
+        ws = null;
+        ows.onclose = null;
+        ows.onmessage = null;
+        ows.close();
+
+        /* Don't let the health check fire while waiting */
+        got_message = true;
+        retry_timer = window.setTimeout(function() {
+            retry_timer = null;
+            got_message = true;
+            ws = open_socket(ws_loc);
+            if (ws)
+                attach_socket();
+            else
+                self.close({ "problem": "busy" });
+        }, delay * 1000);
+    }
+
+    function can_resume() {
+        return !!(resume_token && ws_loc && self.ready && !waiting_for_init && resume_attempts < 8);
+    }
+
+    /*
+     * The connection dropped without being closed, which is often the
+     * network going away for a moment. The web service keeps the channels
+     * around for a while, so connect again and pick up where we were.
+     * Anything sent in the meantime is kept and sent once resumed.
+     */
+    function resume_socket() {
+        var delay = Math.min(Math.pow(2, resume_attempts), 16) * (0.5 + Math.random());
+        resume_attempts++;
+        resuming = true;
+        transport_debug("connection lost, resuming in " + delay + " seconds");
+
+        got_message = true;
+        window.clearTimeout(retry_timer);
+        retry_timer = window.setTimeout(function() {
+            retry_timer = null;
+            got_message = true;
+            ws = open_socket(ws_loc);
+            if (ws)
+                attach_socket();
+            else
+                self.close({ "problem": "disconnected" });
+        }, delay * 1000);
+    }
+
+    function finish_resume(count) {
+        var before = sent - sent_log.length;
+        if (typeof count !== "number" || count < before || count > sent) {
+            console.warn("can't resume, too many messages were lost");
+            self.close({ "problem": "disconnected" });
+            return;
+        }
+
+        transport_debug("resumed connection at " + count + " of " + sent);
+        resuming = false;
+        resume_attempts = 0;
+        for (var i = count - before; i < sent_log.length; i++)
+            ws.send(sent_log[i]);
+    }
+
+    /* Keep what was sent recently in case it needs to be sent again */
+    function remember_sent(data) {
+        sent_log.push(data);
+        sent_log_size += data.byteLength || data.length;
+        while (sent_log_size > sent_log_max && sent_log.length > 1) {
+            data = sent_log.shift();
+            sent_log_size -= data.byteLength || data.length;
+        }
+    }
 
     self.close = function close(options) {
         if (!options)
             options = { "problem": "disconnected" };
         options.command = "close";
         window.clearInterval(check_health_timer);
+        window.clearTimeout(retry_timer);
+        retry_timer = null;
+        resume_token = null;
+        resuming = false;
+        sent_log = [];
+        sent_log_size = 0;
         var ows = ws;
         ws = null;
         if (ows)
@@ -528,6 +670,12 @@ function Transport() {
     };
 
     function process_init(options) {
+        if (options.problem == "busy" && options.retry > 0 && ws_loc &&
+            waiting_for_init && busy_attempts < 8) {
+            retry_socket(options.retry);
+            return;
+        }
+
         if (options.problem){
             self.close({ "problem": options.problem });
             return;
@@ -545,6 +693,7 @@ function Transport() {
             channel_seed = String(options["channel-seed"]);
         if (options["host"])
             default_host = options["host"];
+        resume_token = options["resume"] || null;
 
         if (public_transport) {
             public_transport.options = options;
@@ -598,13 +747,17 @@ function Transport() {
     }
 
     self.send_data = function send_data(data) {
-        if (!ws) {
+        if (!ws && !resuming) {
             console.log("transport closed, dropped message: ", data);
             return false;
-        } else {
-            ws.send(data);
-            return true;
         }
+
+        sent++;
+        if (resume_token || waiting_for_init)
+            remember_sent(data);
+        if (!resuming)
+            ws.send(data);
+        return true;
     };
 
     self.send_message = function send_message(channel, payload) {
@@ -3189,6 +3342,10 @@ function basic_scope(cockpit, jquery) {
         var read_promise = null;
         var read_channel;
 
+        /* The last content read, sent again when the file is unchanged */
+        var last_data = null;
+        var last_tag = null;
+
         function read() {
             if (read_promise)
                 return read_promise;
@@ -3200,6 +3357,8 @@ function basic_scope(cockpit, jquery) {
             });
 
             function try_read() {
+                if (last_tag)
+                    opts["if-tag"] = last_tag;
                 read_channel = cockpit.channel(opts);
                 var content_parts = [ ];
                 read_channel.addEventListener("message", function (event, message) {
@@ -3222,12 +3381,18 @@ function basic_scope(cockpit, jquery) {
                         return;
                     }
 
-                    var content;
+                    var content, data;
                     if (message.tag == "-")
                         content = null;
                     else {
+                        if (message.tag == last_tag && content_parts.length === 0)
+                            data = last_data;
+                        else
+                            data = join_data(content_parts, binary);
+                        last_data = data;
+                        last_tag = message.tag;
                         try {
-                            content = parse(join_data(content_parts, binary));
+                            content = parse(data);
                         } catch (e) {
                             fire_watch_callbacks(null, null, e);
                             dfd.reject(e);
@@ -3518,6 +3683,8 @@ function basic_scope(cockpit, jquery) {
             return _("Your session has been terminated.");
         else if (problem == "no-session")
             return _("Your session has expired. Please log in again.");
+        else if (problem == "busy")
+            return _("The server is too busy. Please try again later.");
         else if (problem == "access-denied")
             return _("Not permitted to perform this action.");
         else if (problem == "authentication-failed")
@@ -34,6 +34,33 @@ function common_dbus_tests(channel_options, bus_name)
             });
     });
 
+    asyncTest("batched calls", function() {
+        expect(4);
+
+        var options = $.extend({ }, channel_options, { "payload": "dbus-json3", "name": bus_name });
+        var channel = cockpit.channel(options);
+        $(channel).on("message", function(event, payload) {
+            var msg = JSON.parse(payload);
+            if (msg.id !== "batch")
+                return;
+            equal(msg.replies.length, 2, "two replies");
+            deepEqual(msg.replies[0].reply, [ [ "Word! You said `One'. I'm Skeleton, btw!" ] ], "first reply");
+            deepEqual(msg.replies[1].reply, [ [ "Word! You said `Two'. I'm Skeleton, btw!" ] ], "second reply");
+            equal(msg.replies[0].id, undefined, "no id in replies");
+            $(channel).off();
+            channel.close();
+            start();
+        });
+
+        channel.send(JSON.stringify({
+            "calls": [
+                [ "/otree/frobber", "com.redhat.Cockpit.DBusTests.Frobber", "HelloWorld", [ "One" ] ],
+                [ "/otree/frobber", "com.redhat.Cockpit.DBusTests.Frobber", "HelloWorld", [ "Two" ] ]
+            ],
+            "id": "batch"
+        }));
+    });
+
     asyncTest("close immediately", function() {
         expect(1);
         var dbus = cockpit.dbus(bus_name, channel_options);
@@ -355,6 +382,24 @@ function common_dbus_tests(channel_options, bus_name)
             });
     });
 
+    asyncTest("with escapes", function() {
+        expect(2);
+
+        var dbus = cockpit.dbus(bus_name, channel_options);
+        dbus.call("/bork", "borkety.Bork", "Echo",
+                  [ "quote \" slash \\ line\n tab\t \u0001 \u00e9 \ud83d\ude00",
+                    { "k\"ey": [ "\u2603" ] }, { "1": "one", "-2": "two" } ],
+                  { type: "sa{sas}a{is}" }).
+            done(function(reply, options) {
+                deepEqual(reply, [ "quote \" slash \\ line\n tab\t \u0001 \u00e9 \ud83d\ude00",
+                                   { "k\"ey": [ "\u2603" ] }, { "1": "one", "-2": "two" } ], "round trip");
+            }).
+            always(function() {
+                equal(this.state(), "resolved", "finished successfuly");
+                start();
+            });
+    });
+
     asyncTest("empty base64", function() {
         expect(3);
 
@@ -494,6 +539,82 @@ function common_dbus_tests(channel_options, bus_name)
             });
     });
 
+    asyncTest("watch properties", function() {
+        expect(1);
+
+        var cache = { };
+
+        var dbus = cockpit.dbus(bus_name, channel_options);
+        $(dbus).on("notify", function(event, data) {
+            $.extend(true, cache, data);
+        });
+
+        dbus.watch({ "path": "/otree/frobber",
+                     "interface": "com.redhat.Cockpit.DBusTests.Frobber",
+                     "properties": [ "y", "ReadonlyProperty" ] }).
+            done(function() {
+                deepEqual(cache, { "/otree/frobber": { "com.redhat.Cockpit.DBusTests.Frobber":
+                          { "ReadonlyProperty": "blah", "y": 42 } } }, "only those properties");
+                $(dbus).off();
+                start();
+            });
+    });
+
+    asyncTest("watch shared", function() {
+        expect(4);
+
+        var first = cockpit.dbus(bus_name, channel_options);
+        var second = cockpit.dbus(bus_name, channel_options);
+        var cache = { };
+        var meta = { };
+
+        $(second).on("notify", function(event, data) {
+            $.extend(true, cache, data);
+        });
+        $(second).on("meta", function(event, data) {
+            $.extend(meta, data);
+        });
+
+        first.watch("/otree/frobber").
+            done(function() {
+                second.watch("/otree/frobber").
+                    done(function() {
+                        equal(typeof cache["/otree/frobber"], "object", "has path");
+                        var frobber = cache["/otree/frobber"]["com.redhat.Cockpit.DBusTests.Frobber"];
+                        equal(frobber["y"], 42, "correct data");
+                        equal(frobber["ReadonlyProperty"], "blah", "more data");
+                        equal(typeof meta["com.redhat.Cockpit.DBusTests.Frobber"], "object", "has meta");
+                        $(second).off();
+                        first.close();
+                        second.close();
+                        start();
+                    });
+            });
+    });
+
+    asyncTest("watch batched notify", function() {
+        expect(3);
+
+        var cache = { };
+        var notifies = 0;
+
+        var options = $.extend({ }, channel_options, { "notify-latency": 200 });
+        var dbus = cockpit.dbus(bus_name, options);
+        $(dbus).on("notify", function(event, data) {
+            notifies++;
+            $.extend(true, cache, data);
+        });
+
+        dbus.watch({ "path_namespace": "/otree" }).
+            done(function() {
+                equal(notifies, 1, "one notify");
+                equal(typeof cache["/otree/frobber"], "object", "has path");
+                equal(cache["/otree/frobber"]["com.redhat.Cockpit.DBusTests.Frobber"]["y"], 42, "correct data");
+                $(dbus).off();
+                start();
+            });
+    });
+
     asyncTest("watch object manager", function() {
         expect(1);
 
@@ -0,0 +1,398 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2016 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitechochannel.h"
+#include "cockpitnullchannel.h"
+
+#include "common/cockpitjson.h"
+
+#include "mock-transport.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Opens a batch of echo channels at once, the way a page does when it
+ * loads, and times how long it takes from opening them until each one
+ * has sent its "ready" message. Also reports how much memory each idle
+ * channel takes, from the growth of the resident set while many of them
+ * are open. That includes the "ready" message the mock transport keeps
+ * for each one.
+ *
+ * Then, for each message size, sends messages round robin to a number of
+ * open channels: echo channels for the round trip latency and how many
+ * bytes come back per second, and null channels for how many bytes per
+ * second a channel takes in and drops. Everything here happens over the
+ * mock transport, so this is the cost of the channel layer alone; see
+ * bench-transport for the transport itself, and load-ws --echo for the
+ * whole path through cockpit-ws.
+ *
+ * This is not run as part of 'make check'.
+ */
+
+static gint opt_channels = 200;
+static gint opt_rounds = 50;
+static gint opt_idle = 10000;
+static gint opt_messages = 100000;
+static gint opt_concurrent = 16;
+static gchar *opt_payload = NULL;
+static gchar *opt_sizes = NULL;
+
+static GType channel_type;
+
+typedef struct {
+  gint64 start;
+  gint64 *ready;
+  guint count;
+} Batch;
+
+static void
+on_channel_ready (MockTransport *transport,
+                  Batch *batch)
+{
+  JsonObject *control;
+  const gchar *command;
+  gint64 now;
+
+  now = g_get_monotonic_time ();
+  while ((control = mock_transport_pop_control (transport)) != NULL)
+    {
+      if (cockpit_json_get_string (control, "command", NULL, &command) &&
+          g_strcmp0 (command, "ready") == 0)
+        batch->ready[batch->count++] = now - batch->start;
+    }
+}
+
+static int
+compare_time (gconstpointer a,
+              gconstpointer b)
+{
+  const gint64 *ta = a;
+  const gint64 *tb = b;
+  return (*ta > *tb) - (*ta < *tb);
+}
+
+static gint64
+resident_bytes (void)
+{
+  gchar *contents = NULL;
+  gint64 pages = 0;
+  gchar **fields;
+
+  if (g_file_get_contents ("/proc/self/statm", &contents, NULL, NULL))
+    {
+      fields = g_strsplit (contents, " ", 3);
+      if (fields[0] && fields[1])
+        pages = g_ascii_strtoll (fields[1], NULL, 10);
+      g_strfreev (fields);
+    }
+
+  g_free (contents);
+  return pages * sysconf (_SC_PAGESIZE);
+}
+
+static CockpitChannel **
+open_typed_channels (MockTransport *transport,
+                     GType type,
+                     gint count)
+{
+  CockpitChannel **channels;
+  JsonObject *options;
+  gchar *id;
+  gint i;
+
+  channels = g_new0 (CockpitChannel *, count);
+  options = json_object_new ();
+  json_object_set_string_member (options, "payload",
+                                 type == COCKPIT_TYPE_NULL_CHANNEL ? "null" : "echo");
+
+  for (i = 0; i < count; i++)
+    {
+      id = g_strdup_printf ("%d", i);
+      channels[i] = g_object_new (type,
+                                  "transport", transport,
+                                  "id", id,
+                                  "options", options,
+                                  NULL);
+      g_free (id);
+    }
+
+  json_object_unref (options);
+  return channels;
+}
+
+static CockpitChannel **
+open_channels (MockTransport *transport,
+               gint count)
+{
+  return open_typed_channels (transport, channel_type, count);
+}
+
+static void
+close_channels (MockTransport *transport,
+                CockpitChannel **channels,
+                gint count,
+                Batch *batch)
+{
+  gint i;
+
+  for (i = 0; i < count; i++)
+    g_object_unref (channels[i]);
+  while (g_main_context_iteration (NULL, FALSE));
+  on_channel_ready (transport, batch);
+  g_free (channels);
+}
+
+static gdouble
+bench_idle (MockTransport *transport)
+{
+  CockpitChannel **channels;
+  Batch batch = { 0, };
+  gint64 before;
+  gint64 after;
+
+  batch.ready = g_new0 (gint64, opt_idle);
+
+  /* Warm up type and stats registration */
+  channels = open_channels (transport, 1);
+  while (g_main_context_iteration (NULL, FALSE));
+  close_channels (transport, channels, 1, &batch);
+
+  before = resident_bytes ();
+  batch.count = 0;
+  channels = open_channels (transport, opt_idle);
+  while (batch.count < (guint)opt_idle)
+    {
+      g_main_context_iteration (NULL, TRUE);
+      on_channel_ready (transport, &batch);
+    }
+  after = resident_bytes ();
+
+  close_channels (transport, channels, opt_idle, &batch);
+  g_free (batch.ready);
+  return (gdouble)(after - before) / opt_idle;
+}
+
+static void
+bench_batch (MockTransport *transport,
+             Batch *batch)
+{
+  CockpitChannel **channels;
+
+  batch->count = 0;
+  batch->start = g_get_monotonic_time ();
+  channels = open_channels (transport, opt_channels);
+
+  while (batch->count < (guint)opt_channels)
+    {
+      g_main_context_iteration (NULL, TRUE);
+      on_channel_ready (transport, batch);
+    }
+
+  close_channels (transport, channels, opt_channels, batch);
+}
+
+static void
+bench_messages (GType type,
+                gint size)
+{
+  MockTransport *transport;
+  CockpitChannel **channels;
+  Batch batch = { 0, };
+  GBytes *message;
+  GBytes *echoed;
+  gint64 *times = NULL;
+  gint64 start;
+  gint64 begin;
+  gint64 elapsed;
+  gint64 total = 0;
+  gboolean echo;
+  const gchar *id;
+  guint8 *data;
+  gint i;
+
+  echo = (type == COCKPIT_TYPE_ECHO_CHANNEL);
+  transport = mock_transport_new ();
+
+  batch.ready = g_new0 (gint64, opt_concurrent);
+  channels = open_typed_channels (transport, type, opt_concurrent);
+  while (batch.count < (guint)opt_concurrent)
+    {
+      g_main_context_iteration (NULL, TRUE);
+      on_channel_ready (transport, &batch);
+    }
+
+  data = g_malloc (size);
+  memset (data, 'x', size);
+  message = g_bytes_new_take (data, size);
+
+  if (echo)
+    times = g_new0 (gint64, opt_messages);
+
+  begin = g_get_monotonic_time ();
+  for (i = 0; i < opt_messages; i++)
+    {
+      id = cockpit_channel_get_id (channels[i % opt_concurrent]);
+      start = g_get_monotonic_time ();
+      cockpit_transport_emit_recv (COCKPIT_TRANSPORT (transport), id, message);
+      if (echo)
+        {
+          while ((echoed = mock_transport_pop_channel (transport, id)) == NULL)
+            g_main_context_iteration (NULL, TRUE);
+          times[i] = g_get_monotonic_time () - start;
+          total += times[i];
+        }
+    }
+  elapsed = g_get_monotonic_time () - begin;
+
+  printf ("  %s, %d bytes: %.1f MB/s, %.0f messages/s", echo ? "echo" : "null", size,
+          ((gdouble)size * opt_messages) / elapsed, (gdouble)opt_messages * G_USEC_PER_SEC / elapsed);
+  if (echo)
+    {
+      qsort (times, opt_messages, sizeof (gint64), compare_time);
+      printf (", round trip p50: %.1f us, p99: %.1f us, mean: %.1f us",
+              (gdouble)times[opt_messages / 2], (gdouble)times[(opt_messages * 99) / 100],
+              (gdouble)total / opt_messages);
+    }
+  printf ("\n");
+
+  g_bytes_unref (message);
+  close_channels (transport, channels, opt_concurrent, &batch);
+  g_object_unref (transport);
+  g_free (batch.ready);
+  g_free (times);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  GOptionContext *context;
+  MockTransport *transport;
+  GError *error = NULL;
+  gint64 *times;
+  gint64 total = 0;
+  gint64 batches = 0;
+  gdouble idle_bytes;
+  gchar **sizes = NULL;
+  gint64 size;
+  gint64 wall;
+  Batch batch;
+  gint n = 0;
+  gint i;
+
+  static GOptionEntry entries[] = {
+    { "channels", 'c', 0, G_OPTION_ARG_INT, &opt_channels, "Channels opened at once", "count" },
+    { "rounds", 'r', 0, G_OPTION_ARG_INT, &opt_rounds, "Number of times to open them", "count" },
+    { "idle", 'i', 0, G_OPTION_ARG_INT, &opt_idle, "Idle channels to measure memory with", "count" },
+    { "payload", 'p', 0, G_OPTION_ARG_STRING, &opt_payload, "Payload to open: echo or null", "payload" },
+    { "sizes", 's', 0, G_OPTION_ARG_STRING, &opt_sizes, "Message sizes to send, comma separated", "bytes" },
+    { "messages", 'm', 0, G_OPTION_ARG_INT, &opt_messages, "Messages to send at each size", "count" },
+    { "concurrent", 'n', 0, G_OPTION_ARG_INT, &opt_concurrent, "Channels to send the messages to", "count" },
+    { NULL }
+  };
+
+  g_type_init ();
+
+  context = g_option_context_new (NULL);
+  g_option_context_add_main_entries (context, entries, NULL);
+  g_option_context_set_description (context, "Measure how long channels take from open to ready\n");
+
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("bench-channels: %s\n", error->message);
+      g_error_free (error);
+      return 2;
+    }
+
+  g_option_context_free (context);
+
+  if (opt_payload == NULL || g_str_equal (opt_payload, "echo"))
+    channel_type = COCKPIT_TYPE_ECHO_CHANNEL;
+  else if (g_str_equal (opt_payload, "null"))
+    channel_type = COCKPIT_TYPE_NULL_CHANNEL;
+  else
+    channel_type = G_TYPE_INVALID;
+
+  sizes = g_strsplit (opt_sizes ? opt_sizes : "64,1024,65536", ",", -1);
+  for (i = 0; sizes[i] != NULL; i++)
+    {
+      size = g_ascii_strtoll (sizes[i], NULL, 10);
+      if (size < 1 || size > G_MAXINT)
+        channel_type = G_TYPE_INVALID;
+    }
+
+  if (opt_channels < 1 || opt_rounds < 1 || opt_idle < 1 || opt_messages < 1 ||
+      opt_concurrent < 1 || channel_type == G_TYPE_INVALID)
+    {
+      g_printerr ("bench-channels: invalid arguments\n");
+      return 2;
+    }
+
+  transport = mock_transport_new ();
+  idle_bytes = bench_idle (transport);
+
+  batch.ready = g_new0 (gint64, opt_channels);
+  times = g_new0 (gint64, (gsize)opt_channels * opt_rounds);
+
+  wall = g_get_monotonic_time ();
+  for (i = 0; i < opt_rounds; i++)
+    {
+      bench_batch (transport, &batch);
+      memcpy (times + n, batch.ready, sizeof (gint64) * opt_channels);
+      n += opt_channels;
+      batches += batch.ready[opt_channels - 1];
+    }
+  wall = g_get_monotonic_time () - wall;
+
+  for (i = 0; i < n; i++)
+    total += times[i];
+
+  qsort (times, n, sizeof (gint64), compare_time);
+
+  printf ("%s channels: %d opened at once, %d rounds\n",
+          channel_type == COCKPIT_TYPE_NULL_CHANNEL ? "null" : "echo", opt_channels, opt_rounds);
+  printf ("  open to ready p50: %.1f us, p99: %.1f us, mean: %.1f us, max: %.1f us\n",
+          (gdouble)times[n / 2], (gdouble)times[(n * 99) / 100],
+          (gdouble)total / n, (gdouble)times[n - 1]);
+  printf ("  whole batch mean: %.1f us\n", (gdouble)batches / opt_rounds);
+  printf ("  opened and closed: %.0f channels/s\n", (gdouble)n * G_USEC_PER_SEC / wall);
+  printf ("  memory per idle channel: %.0f bytes, with %d open\n", idle_bytes, opt_idle);
+
+  g_object_unref (transport);
+  g_free (batch.ready);
+  g_free (times);
+
+  printf ("messages: %d at each size, to %d channels\n", opt_messages, opt_concurrent);
+  for (i = 0; sizes[i] != NULL; i++)
+    {
+      size = g_ascii_strtoll (sizes[i], NULL, 10);
+      bench_messages (COCKPIT_TYPE_ECHO_CHANNEL, size);
+      bench_messages (COCKPIT_TYPE_NULL_CHANNEL, size);
+    }
+
+  g_strfreev (sizes);
+  g_free (opt_payload);
+  g_free (opt_sizes);
+  return 0;
+}
@@ -0,0 +1,492 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2016 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitdbusjson.h"
+
+#include "common/cockpitjson.h"
+#include "common/mock-service.h"
+
+#include "mock-transport.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Runs the mock D-Bus service on a private bus, and measures dbus-json3
+ * channels talking to it:
+ *
+ *  - How many method calls a channel gets through, with a number of
+ *    them in flight at once.
+ *  - How long a "watch" of many objects takes until its reply, with the
+ *    whole initial dump before it. Each round uses a new channel, and
+ *    so starts with an empty cache.
+ *  - How long a signal takes to reach each of a number of channels
+ *    that have all asked for it, timed from the call that makes the
+ *    service emit it.
+ *
+ * The service, the objects and the order of everything is the same on
+ * each run, so numbers from before and after a change can be compared.
+ *
+ * This is not run as part of 'make check'.
+ */
+
+#define SERVICE    "com.redhat.Cockpit.DBusTests.Test"
+#define FROBBER    "com.redhat.Cockpit.DBusTests.Frobber"
+
+static gint opt_calls = 20000;
+static gint opt_window = 64;
+static gint opt_objects = 10000;
+static gint opt_rounds = 5;
+static gint opt_channels = 100;
+static gint opt_signals = 100;
+
+static int
+compare_time (gconstpointer a,
+              gconstpointer b)
+{
+  const gint64 *ta = a;
+  const gint64 *tb = b;
+  return (*ta > *tb) - (*ta < *tb);
+}
+
+static void
+send_message (MockTransport *transport,
+              const gchar *channel,
+              const gchar *format,
+              ...)
+{
+  GBytes *payload;
+  va_list va;
+  gchar *data;
+
+  va_start (va, format);
+  data = g_strdup_vprintf (format, va);
+  va_end (va);
+
+  payload = g_bytes_new_take (data, strlen (data));
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (transport), channel, payload);
+  g_bytes_unref (payload);
+}
+
+static JsonObject *
+pop_message (MockTransport *transport,
+             const gchar *channel)
+{
+  GError *error = NULL;
+  JsonObject *object;
+  GBytes *payload;
+
+  payload = mock_transport_pop_channel (transport, channel);
+  if (!payload)
+    return NULL;
+
+  object = cockpit_json_parse_bytes (payload, &error);
+  g_assert_no_error (error);
+
+  if (json_object_has_member (object, "error"))
+    {
+      g_printerr ("bench-dbus-json: a call failed on channel %s\n", channel);
+      exit (1);
+    }
+
+  return object;
+}
+
+static gboolean
+is_reply (JsonObject *object,
+          const gchar *id)
+{
+  const gchar *value;
+
+  if (!json_object_has_member (object, "reply"))
+    return FALSE;
+  if (!cockpit_json_get_string (object, "id", NULL, &value))
+    return FALSE;
+  return id == NULL || g_strcmp0 (value, id) == 0;
+}
+
+static void
+wait_ready (MockTransport *transport,
+            gint count)
+{
+  JsonObject *control;
+  const gchar *command;
+
+  while (count > 0)
+    {
+      while ((control = mock_transport_pop_control (transport)) == NULL)
+        g_main_context_iteration (NULL, TRUE);
+
+      if (!cockpit_json_get_string (control, "command", NULL, &command))
+        command = NULL;
+      if (g_strcmp0 (command, "ready") == 0)
+        {
+          count--;
+        }
+      else if (g_strcmp0 (command, "close") == 0)
+        {
+          g_printerr ("bench-dbus-json: channel closed before it was ready\n");
+          exit (1);
+        }
+    }
+}
+
+static CockpitChannel *
+open_channel (MockTransport *transport,
+              const gchar *id)
+{
+  CockpitChannel *channel;
+
+  channel = cockpit_dbus_json_open (COCKPIT_TRANSPORT (transport), id, SERVICE);
+  wait_ready (transport, 1);
+  return channel;
+}
+
+static void
+close_channel (MockTransport *transport,
+               CockpitChannel *channel)
+{
+  cockpit_channel_close (channel, NULL);
+  g_object_unref (channel);
+
+  /* Let the cache go away, and throw away what was left */
+  while (g_main_context_iteration (NULL, FALSE));
+  while (mock_transport_pop_control (transport));
+}
+
+static void
+create_objects (void)
+{
+  GDBusConnection *connection;
+  GError *error = NULL;
+  GVariant *retval;
+  gchar *path;
+  gint i;
+
+  connection = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, &error);
+  g_assert_no_error (error);
+
+  for (i = 0; i < opt_objects; i++)
+    {
+      path = g_strdup_printf ("/otree/bench/%d", i);
+      retval = g_dbus_connection_call_sync (connection, SERVICE, "/otree/frobber", FROBBER,
+                                            "CreateObject", g_variant_new ("(o)", path),
+                                            NULL, G_DBUS_CALL_FLAGS_NONE, -1, NULL, &error);
+      g_assert_no_error (error);
+      g_variant_unref (retval);
+      g_free (path);
+    }
+
+  g_object_unref (connection);
+}
+
+static void
+send_call (MockTransport *transport,
+           gint serial)
+{
+  send_message (transport, "calls",
+                "{\"call\":[\"/otree/frobber\",\"" FROBBER "\",\"HelloWorld\",[\"bench\"]],\"id\":\"%d\"}",
+                serial);
+}
+
+static void
+bench_calls (MockTransport *transport)
+{
+  CockpitChannel *channel;
+  JsonObject *object;
+  gint64 start;
+  gint64 elapsed;
+  gint sent = 0;
+  gint replies = 0;
+
+  channel = open_channel (transport, "calls");
+
+  /* Introspection of the interface happens on the first call */
+  send_call (transport, 0);
+  while (replies < 1)
+    {
+      g_main_context_iteration (NULL, TRUE);
+      while ((object = pop_message (transport, "calls")) != NULL)
+        {
+          if (is_reply (object, NULL))
+            replies++;
+          json_object_unref (object);
+        }
+    }
+
+  replies = 0;
+  start = g_get_monotonic_time ();
+  while (sent < opt_window && sent < opt_calls)
+    send_call (transport, ++sent);
+
+  while (replies < opt_calls)
+    {
+      g_main_context_iteration (NULL, TRUE);
+      while ((object = pop_message (transport, "calls")) != NULL)
+        {
+          if (is_reply (object, NULL))
+            {
+              replies++;
+              if (sent < opt_calls)
+                send_call (transport, ++sent);
+            }
+          json_object_unref (object);
+        }
+    }
+
+  elapsed = g_get_monotonic_time () - start;
+  close_channel (transport, channel);
+
+  printf ("calls: %d, %d in flight\n", opt_calls, opt_window);
+  printf ("  %.0f calls/s, %.1f us per call\n",
+          (gdouble)opt_calls * G_USEC_PER_SEC / elapsed, (gdouble)elapsed / opt_calls);
+}
+
+static void
+bench_watch (MockTransport *transport)
+{
+  CockpitChannel *channel;
+  JsonObject *object;
+  gint64 *times;
+  gint64 start;
+  gint64 total = 0;
+  gsize bytes = 0;
+  gboolean done;
+  GBytes *payload;
+  gchar *id;
+  gint i;
+
+  times = g_new0 (gint64, opt_rounds);
+
+  for (i = 0; i < opt_rounds; i++)
+    {
+      id = g_strdup_printf ("watch%d", i);
+      channel = open_channel (transport, id);
+
+      start = g_get_monotonic_time ();
+      send_message (transport, id, "{\"watch\":{\"path_namespace\":\"/otree\"},\"id\":\"w\"}");
+
+      done = FALSE;
+      bytes = 0;
+      while (!done)
+        {
+          g_main_context_iteration (NULL, TRUE);
+          while (!done && (payload = mock_transport_pop_channel (transport, id)) != NULL)
+            {
+              bytes += g_bytes_get_size (payload);
+              object = cockpit_json_parse_bytes (payload, NULL);
+              g_assert (object != NULL);
+              done = is_reply (object, "w");
+              json_object_unref (object);
+            }
+        }
+
+      times[i] = g_get_monotonic_time () - start;
+      total += times[i];
+
+      close_channel (transport, channel);
+      g_free (id);
+    }
+
+  qsort (times, opt_rounds, sizeof (gint64), compare_time);
+
+  printf ("watch: %d objects, %d rounds, %" G_GSIZE_FORMAT " bytes sent\n",
+          opt_objects, opt_rounds, bytes);
+  printf ("  initial dump min: %.1f ms, mean: %.1f ms, max: %.1f ms\n",
+          (gdouble)times[0] / 1000, (gdouble)total / opt_rounds / 1000,
+          (gdouble)times[opt_rounds - 1] / 1000);
+
+  g_free (times);
+}
+
+static void
+bench_signals (MockTransport *transport)
+{
+  CockpitChannel **channels;
+  JsonObject *object;
+  gboolean *received;
+  gint64 *times;
+  gint64 *last;
+  gint64 start;
+  gint64 now;
+  gint64 total = 0;
+  gboolean replied;
+  gint pending;
+  gint n = 0;
+  gchar *id;
+  gint i, j;
+
+  channels = g_new0 (CockpitChannel *, opt_channels);
+  received = g_new0 (gboolean, opt_channels);
+  times = g_new0 (gint64, (gsize)opt_channels * opt_signals);
+  last = g_new0 (gint64, opt_signals);
+
+  for (i = 0; i < opt_channels; i++)
+    {
+      id = g_strdup_printf ("%d", i);
+      channels[i] = cockpit_dbus_json_open (COCKPIT_TRANSPORT (transport), id, SERVICE);
+      g_free (id);
+    }
+
+  wait_ready (transport, opt_channels);
+
+  for (i = 0; i < opt_channels; i++)
+    {
+      send_message (transport, cockpit_channel_get_id (channels[i]),
+                    "{\"add-match\":{\"path\":\"/otree/frobber\",\"interface\":\"" FROBBER "\","
+                    "\"member\":\"TestSignal\"}}");
+    }
+
+  /*
+   * The matches are added on the same connection as this call, so once
+   * it returns the bus has them all.
+   */
+  send_message (transport, "0",
+                "{\"call\":[\"/otree/frobber\",\"" FROBBER "\",\"HelloWorld\",[\"sync\"]],\"id\":\"sync\"}");
+  replied = FALSE;
+  while (!replied)
+    {
+      g_main_context_iteration (NULL, TRUE);
+      while ((object = pop_message (transport, "0")) != NULL)
+        {
+          replied = replied || is_reply (object, "sync");
+          json_object_unref (object);
+        }
+    }
+
+  for (i = 0; i < opt_signals; i++)
+    {
+      memset (received, 0, sizeof (gboolean) * opt_channels);
+      pending = opt_channels;
+      replied = FALSE;
+
+      start = g_get_monotonic_time ();
+      send_message (transport, "0",
+                    "{\"call\":[\"/otree/frobber\",\"" FROBBER "\",\"RequestSignalEmission\",[0]],"
+                    "\"id\":\"emit\"}");
+
+      while (pending > 0 || !replied)
+        {
+          g_main_context_iteration (NULL, TRUE);
+          now = g_get_monotonic_time ();
+
+          for (j = 0; j < opt_channels; j++)
+            {
+              while ((object = pop_message (transport, cockpit_channel_get_id (channels[j]))) != NULL)
+                {
+                  if (json_object_has_member (object, "signal") && !received[j])
+                    {
+                      received[j] = TRUE;
+                      times[n++] = now - start;
+                      last[i] = now - start;
+                      pending--;
+                    }
+                  else if (j == 0 && is_reply (object, "emit"))
+                    {
+                      replied = TRUE;
+                    }
+                  json_object_unref (object);
+                }
+            }
+        }
+
+      total += last[i];
+    }
+
+  for (i = 0; i < opt_channels; i++)
+    close_channel (transport, channels[i]);
+
+  qsort (times, n, sizeof (gint64), compare_time);
+
+  printf ("signals: %d emitted, %d channels listening\n", opt_signals, opt_channels);
+  printf ("  to each channel p50: %.1f us, p99: %.1f us, max: %.1f us\n",
+          (gdouble)times[n / 2], (gdouble)times[(n * 99) / 100], (gdouble)times[n - 1]);
+  printf ("  to all channels mean: %.1f us\n", (gdouble)total / opt_signals);
+
+  g_free (channels);
+  g_free (received);
+  g_free (times);
+  g_free (last);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  GOptionContext *context;
+  MockTransport *transport;
+  GError *error = NULL;
+  GTestDBus *bus;
+
+  static GOptionEntry entries[] = {
+    { "calls", 'c', 0, G_OPTION_ARG_INT, &opt_calls, "Method calls to make", "count" },
+    { "window", 'w', 0, G_OPTION_ARG_INT, &opt_window, "Method calls in flight at once", "count" },
+    { "objects", 'o', 0, G_OPTION_ARG_INT, &opt_objects, "Objects to watch", "count" },
+    { "rounds", 'r', 0, G_OPTION_ARG_INT, &opt_rounds, "Number of times to watch them", "count" },
+    { "channels", 'n', 0, G_OPTION_ARG_INT, &opt_channels, "Channels listening for signals", "count" },
+    { "signals", 's', 0, G_OPTION_ARG_INT, &opt_signals, "Signals to emit", "count" },
+    { NULL }
+  };
+
+  g_type_init ();
+
+  context = g_option_context_new (NULL);
+  g_option_context_add_main_entries (context, entries, NULL);
+  g_option_context_set_description (context, "Measure dbus-json3 channels against the mock service\n");
+
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("bench-dbus-json: %s\n", error->message);
+      g_error_free (error);
+      return 2;
+    }
+
+  g_option_context_free (context);
+
+  if (opt_calls < 1 || opt_window < 1 || opt_objects < 0 || opt_rounds < 1 ||
+      opt_channels < 1 || opt_signals < 1)
+    {
+      g_printerr ("bench-dbus-json: invalid arguments\n");
+      return 2;
+    }
+
+  /* A bus of our own, so nothing else on it gets in the way */
+  bus = g_test_dbus_new (G_TEST_DBUS_NONE);
+  g_test_dbus_up (bus);
+
+  mock_service_start ();
+  create_objects ();
+
+  transport = mock_transport_new ();
+
+  bench_calls (transport);
+  bench_watch (transport);
+  bench_signals (transport);
+
+  g_object_unref (transport);
+
+  mock_service_stop ();
+  g_test_dbus_down (bus);
+  g_object_unref (bus);
+  return 0;
+}
@@ -0,0 +1,369 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2016 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitmetrics.h"
+#include "cockpitpcpmetrics.h"
+#include "mock-transport.h"
+
+#include "common/cockpitjson.h"
+
+#include <glib/gstdio.h>
+
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <pcp/pmapi.h>
+#include <pcp/impl.h>
+#include <pcp/import.h>
+
+/*
+ * Measures pcp metrics channels without a pmcd. First against the mock
+ * PMDA loaded directly, with an instance domain of many instances, some
+ * of whose values change and some of which get replaced on each tick:
+ * the CPU time each tick takes, and how often the meta gets rebuilt.
+ * Then how fast a channel plays back an archive of the same size.
+ *
+ * Run it from the build directory, where mock-pmda.so is.
+ *
+ * This is not run as part of 'make check'.
+ */
+
+static gint opt_instances = 1000;
+static gint opt_ticks = 1000;
+static gint opt_changed = 100;
+static gint opt_replaced = 0;
+static gint opt_samples = 1000;
+
+static void (*mock_pmda_control) (const char *cmd, ...);
+
+typedef struct {
+  gint meta;
+  gint data;
+  gboolean closed;
+  gchar *problem;
+} Counts;
+
+static void
+on_channel_close (CockpitChannel *channel,
+                  const gchar *problem,
+                  gpointer user_data)
+{
+  Counts *counts = user_data;
+  counts->closed = TRUE;
+  counts->problem = g_strdup (problem);
+}
+
+static gint64
+cpu_time (void)
+{
+  struct timespec ts;
+
+  if (clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &ts) < 0)
+    return 0;
+  return (gint64)ts.tv_sec * G_USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+static CockpitChannel *
+open_channel (MockTransport *transport,
+              const gchar *json,
+              Counts *counts)
+{
+  CockpitChannel *channel;
+  JsonObject *options;
+  GError *error = NULL;
+
+  options = cockpit_json_parse_object (json, -1, &error);
+  g_assert_no_error (error);
+
+  channel = g_object_new (COCKPIT_TYPE_PCP_METRICS,
+                          "transport", transport,
+                          "id", "1",
+                          "options", options,
+                          NULL);
+  g_signal_connect (channel, "closed", G_CALLBACK (on_channel_close), counts);
+  cockpit_channel_prepare (channel);
+
+  json_object_unref (options);
+  return channel;
+}
+
+/* Returns TRUE for each data message, and counts the meta ones too */
+static gboolean
+pop_data (MockTransport *transport,
+          Counts *counts)
+{
+  GBytes *payload;
+  const gchar *data;
+
+  while ((payload = mock_transport_pop_channel (transport, "1")) != NULL)
+    {
+      data = g_bytes_get_data (payload, NULL);
+      if (g_bytes_get_size (payload) > 0 && data[0] == '{')
+        {
+          counts->meta++;
+        }
+      else
+        {
+          counts->data++;
+          return TRUE;
+        }
+    }
+
+  return FALSE;
+}
+
+static gboolean
+init_mock_pmda (void)
+{
+  void *handle;
+
+  if (pmLoadNameSpace (SRCDIR "/src/bridge/mock-pmns") < 0)
+    return FALSE;
+
+  if (__pmLocalPMDA (PM_LOCAL_CLEAR, 0, NULL, NULL) < 0 ||
+      __pmLocalPMDA (PM_LOCAL_ADD, 333, "./mock-pmda.so", "mock_init") < 0)
+    return FALSE;
+
+  handle = dlopen ("./mock-pmda.so", RTLD_NOW);
+  if (!handle)
+    return FALSE;
+
+  mock_pmda_control = dlsym (handle, "mock_control");
+  return mock_pmda_control != NULL;
+}
+
+static void
+bench_direct (void)
+{
+  MockTransport *transport;
+  CockpitChannel *channel;
+  Counts counts = { 0, };
+  gint64 cpu;
+  gint64 start;
+
+  mock_pmda_control ("reset");
+  mock_pmda_control ("add-many", opt_instances);
+
+  transport = mock_transport_new ();
+  channel = open_channel (transport,
+                          "{ \"source\": \"direct\", \"interval\": 1,"
+                          "  \"metrics\": [ { \"name\": \"mock.instances\" } ] }",
+                          &counts);
+
+  /* The first tick sets everything up */
+  while (!counts.closed && !pop_data (transport, &counts))
+    g_main_context_iteration (NULL, TRUE);
+
+  counts.meta = 0;
+  counts.data = 0;
+  start = g_get_monotonic_time ();
+  cpu = cpu_time ();
+
+  while (!counts.closed && counts.data < opt_ticks)
+    {
+      g_main_context_iteration (NULL, TRUE);
+      if (pop_data (transport, &counts))
+        mock_pmda_control ("churn-many", opt_changed, opt_replaced);
+    }
+
+  cpu = cpu_time () - cpu;
+  start = g_get_monotonic_time () - start;
+
+  if (counts.closed)
+    {
+      g_printerr ("bench-pcp: channel closed: %s\n", counts.problem);
+      exit (1);
+    }
+
+  printf ("direct: %d instances, %d changed and %d replaced each tick\n",
+          opt_instances, opt_changed, opt_replaced);
+  printf ("  %.1f us cpu per tick, %.1f us wall, meta rebuilt on %.1f%% of ticks\n",
+          (gdouble)cpu / counts.data, (gdouble)start / counts.data,
+          (100.0 * counts.meta) / counts.data);
+
+  cockpit_channel_close (channel, NULL);
+  g_object_unref (channel);
+  g_object_unref (transport);
+  g_free (counts.problem);
+}
+
+static void
+write_archive (const gchar *path)
+{
+  pmInDom indom;
+  gchar name[32];
+  gchar value[32];
+  gint i, j;
+
+  indom = pmiInDom (333, 5);
+
+  g_assert (pmiStart (path, 0) >= 0);
+  g_assert (pmiAddMetric ("mock.many", PM_ID_NULL, PM_TYPE_U32, indom, PM_SEM_INSTANT,
+                          pmiUnits (0, 0, 0, 0, 0, 0)) >= 0);
+
+  for (i = 0; i < opt_instances; i++)
+    {
+      g_snprintf (name, sizeof (name), "inst-%d", i);
+      g_assert (pmiAddInstance (indom, name, i) >= 0);
+    }
+
+  for (j = 0; j < opt_samples; j++)
+    {
+      for (i = 0; i < opt_instances; i++)
+        {
+          g_snprintf (name, sizeof (name), "inst-%d", i);
+          g_snprintf (value, sizeof (value), "%d", (i < opt_changed) ? i + j : i);
+          g_assert (pmiPutValue ("mock.many", name, value) >= 0);
+        }
+      g_assert (pmiWrite (j, 0) >= 0);
+    }
+
+  g_assert (pmiEnd () >= 0);
+}
+
+static void
+remove_directory (const gchar *directory)
+{
+  const gchar *name;
+  gchar *path;
+  GDir *dir;
+
+  dir = g_dir_open (directory, 0, NULL);
+  if (dir)
+    {
+      while ((name = g_dir_read_name (dir)) != NULL)
+        {
+          path = g_build_filename (directory, name, NULL);
+          g_unlink (path);
+          g_free (path);
+        }
+      g_dir_close (dir);
+    }
+
+  g_rmdir (directory);
+}
+
+static void
+bench_archive (void)
+{
+  MockTransport *transport;
+  CockpitChannel *channel;
+  Counts counts = { 0, };
+  gchar *directory;
+  gchar *path;
+  gchar *json;
+  gint64 start;
+  gint64 cpu;
+
+  directory = g_dir_make_tmp ("bench-pcp.XXXXXX", NULL);
+  g_assert (directory != NULL);
+  path = g_build_filename (directory, "0", NULL);
+  write_archive (path);
+
+  transport = mock_transport_new ();
+
+  start = g_get_monotonic_time ();
+  cpu = cpu_time ();
+
+  json = g_strdup_printf ("{ \"source\": \"%s\", \"interval\": 1000,"
+                          "  \"metrics\": [ { \"name\": \"mock.many\" } ] }", path);
+  channel = open_channel (transport, json, &counts);
+  g_free (json);
+
+  while (!counts.closed)
+    {
+      g_main_context_iteration (NULL, TRUE);
+      while (pop_data (transport, &counts));
+    }
+
+  cpu = cpu_time () - cpu;
+  start = g_get_monotonic_time () - start;
+
+  if (counts.problem)
+    {
+      g_printerr ("bench-pcp: archive channel closed: %s\n", counts.problem);
+      exit (1);
+    }
+
+  printf ("archive: %d samples of %d instances\n", opt_samples, opt_instances);
+  printf ("  %.0f samples/s, %.1f us cpu per sample, in %d messages\n",
+          (gdouble)opt_samples * G_USEC_PER_SEC / start, (gdouble)cpu / opt_samples, counts.data);
+
+  g_object_unref (channel);
+  g_object_unref (transport);
+
+  remove_directory (directory);
+  g_free (directory);
+  g_free (path);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  GOptionContext *context;
+  GError *error = NULL;
+
+  static GOptionEntry entries[] = {
+    { "instances", 'i', 0, G_OPTION_ARG_INT, &opt_instances, "Instances of the metric", "count" },
+    { "ticks", 't', 0, G_OPTION_ARG_INT, &opt_ticks, "Ticks to time", "count" },
+    { "changed", 'c', 0, G_OPTION_ARG_INT, &opt_changed, "Values that change each tick", "count" },
+    { "replaced", 'r', 0, G_OPTION_ARG_INT, &opt_replaced, "Instances replaced each tick", "count" },
+    { "samples", 's', 0, G_OPTION_ARG_INT, &opt_samples, "Samples in the archive", "count" },
+    { NULL }
+  };
+
+  g_type_init ();
+
+  context = g_option_context_new (NULL);
+  g_option_context_add_main_entries (context, entries, NULL);
+  g_option_context_set_description (context, "Measure pcp metrics channels against the mock PMDA\n");
+
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("bench-pcp: %s\n", error->message);
+      g_error_free (error);
+      return 2;
+    }
+
+  g_option_context_free (context);
+
+  if (opt_instances < 1 || opt_ticks < 1 || opt_changed < 0 || opt_replaced < 0 ||
+      opt_samples < 1)
+    {
+      g_printerr ("bench-pcp: invalid arguments\n");
+      return 2;
+    }
+
+  if (!init_mock_pmda ())
+    {
+      g_printerr ("bench-pcp: couldn't load mock-pmda.so, run from the build directory\n");
+      return 1;
+    }
+
+  bench_direct ();
+  bench_archive ();
+
+  return 0;
+}
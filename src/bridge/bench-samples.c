@@ -0,0 +1,199 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2016 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitblocksamples.h"
+#include "cockpitcpusamples.h"
+#include "cockpitdisksamples.h"
+#include "cockpitmemorysamples.h"
+#include "cockpitmountsamples.h"
+#include "cockpitpressuresamples.h"
+#include "cockpitprocesssamples.h"
+#include "cockpitnetworksamples.h"
+#include "cockpitsamples.h"
+
+#include <stdio.h>
+
+/*
+ * Times one tick of each of the internal metrics samplers. For
+ * comparison, also times loading and splitting the same /proc
+ * files the way the samplers used to, with g_file_get_contents()
+ * and g_strsplit().
+ *
+ * This is not run as part of 'make check'.
+ */
+
+static gint opt_count = 10000;
+
+typedef struct {
+  GObject parent;
+  guint count;
+} NullSamples;
+
+typedef GObjectClass NullSamplesClass;
+
+static void null_samples_interface_init (CockpitSamplesIface *iface);
+
+static GType null_samples_get_type (void) G_GNUC_CONST;
+
+G_DEFINE_TYPE_WITH_CODE (NullSamples, null_samples, G_TYPE_OBJECT,
+                         G_IMPLEMENT_INTERFACE (COCKPIT_TYPE_SAMPLES,
+                                                null_samples_interface_init))
+
+static void
+null_samples_init (NullSamples *self)
+{
+}
+
+static void
+null_samples_class_init (NullSamplesClass *klass)
+{
+}
+
+static void
+null_samples_sample (CockpitSamples *samples,
+                     const gchar *metric,
+                     const gchar *instance,
+                     gint64 value)
+{
+  ((NullSamples *)samples)->count++;
+}
+
+static void
+null_samples_interface_init (CockpitSamplesIface *iface)
+{
+  iface->sample = null_samples_sample;
+}
+
+static void
+cpu_samples (CockpitSamples *samples)
+{
+  cockpit_cpu_samples (samples, FALSE);
+}
+
+static void
+cpu_core_samples (CockpitSamples *samples)
+{
+  cockpit_cpu_samples (samples, TRUE);
+}
+
+typedef struct {
+  const gchar *name;
+  const gchar *path;
+  void (* sampler) (CockpitSamples *);
+} Sampler;
+
+static const Sampler samplers[] = {
+  { "cpu", "/proc/stat", cpu_samples },
+  { "cpu-core", "/proc/stat", cpu_core_samples },
+  { "memory", "/proc/meminfo", cockpit_memory_samples },
+  { "block", "/proc/diskstats", cockpit_block_samples },
+  { "network", "/proc/net/dev", cockpit_network_samples },
+  { "mount", "/proc/self/mountinfo", cockpit_mount_samples },
+  { "disk", "/proc/diskstats", cockpit_disk_samples },
+  { "pressure", "/proc/pressure/io", cockpit_pressure_samples },
+  { "process", "/proc/self/stat", cockpit_process_samples },
+};
+
+static gdouble
+time_sampler (const Sampler *sampler,
+              CockpitSamples *samples)
+{
+  gint64 start;
+  gint i;
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < opt_count; i++)
+    (sampler->sampler) (samples);
+  return ((gdouble)(g_get_monotonic_time () - start) * 1000) / opt_count;
+}
+
+static gdouble
+time_load_and_split (const Sampler *sampler)
+{
+  gchar *contents;
+  gchar **lines;
+  gint64 start;
+  gint i;
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < opt_count; i++)
+    {
+      if (!g_file_get_contents (sampler->path, &contents, NULL, NULL))
+        return -1;
+      lines = g_strsplit (contents, "\n", -1);
+      g_strfreev (lines);
+      g_free (contents);
+    }
+  return ((gdouble)(g_get_monotonic_time () - start) * 1000) / opt_count;
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  GOptionContext *context;
+  GError *error = NULL;
+  NullSamples *samples;
+  gdouble total = 0;
+  gdouble ns;
+  gint i;
+
+  static GOptionEntry entries[] = {
+    { "count", 'n', 0, G_OPTION_ARG_INT, &opt_count, "Number of ticks to time", "count" },
+    { NULL }
+  };
+
+  g_type_init ();
+
+  context = g_option_context_new (NULL);
+  g_option_context_add_main_entries (context, entries, NULL);
+  g_option_context_set_description (context, "Measure internal metrics samplers\n");
+
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("bench-samples: %s\n", error->message);
+      g_error_free (error);
+      return 2;
+    }
+
+  g_option_context_free (context);
+
+  if (opt_count < 1)
+    {
+      g_printerr ("bench-samples: invalid arguments\n");
+      return 2;
+    }
+
+  samples = g_object_new (null_samples_get_type (), NULL);
+
+  for (i = 0; i < G_N_ELEMENTS (samplers); i++)
+    {
+      ns = time_sampler (samplers + i, COCKPIT_SAMPLES (samples));
+      total += ns;
+      printf ("%s: %.0f ns/tick, load and split %s: %.0f ns\n", samplers[i].name, ns,
+              samplers[i].path, time_load_and_split (samplers + i));
+    }
+
+  printf ("all: %.0f ns/tick\n", total);
+
+  g_object_unref (samples);
+  return 0;
+}
@@ -0,0 +1,180 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2016 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "common/cockpitpipe.h"
+#include "common/cockpitpipetransport.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Starts cockpit-bridge over and over, and reports how long it takes from
+ * spawning the process until its "init" message arrives. This is what a
+ * remote host costs each time cockpit-ws connects to it.
+ *
+ * This is not run as part of 'make check'.
+ */
+
+static gint opt_count = 20;
+static gchar *opt_bridge = NULL;
+
+typedef struct {
+  gboolean init;
+  gboolean closed;
+} Startup;
+
+static gboolean
+on_control (CockpitTransport *transport,
+            const gchar *command,
+            const gchar *channel,
+            JsonObject *options,
+            GBytes *payload,
+            gpointer user_data)
+{
+  Startup *startup = user_data;
+  if (g_str_equal (command, "init"))
+    startup->init = TRUE;
+  return TRUE;
+}
+
+static void
+on_closed (CockpitTransport *transport,
+           const gchar *problem,
+           gpointer user_data)
+{
+  Startup *startup = user_data;
+  if (problem && !startup->init)
+    g_printerr ("bench-startup: bridge failed: %s\n", problem);
+  startup->closed = TRUE;
+}
+
+static int
+compare_time (gconstpointer a,
+              gconstpointer b)
+{
+  const gint64 *ta = a;
+  const gint64 *tb = b;
+  return (*ta > *tb) - (*ta < *tb);
+}
+
+static gboolean
+bench_startup (gint64 *elapsed)
+{
+  const gchar *argv[] = { opt_bridge, NULL };
+  Startup startup = { FALSE, FALSE };
+  CockpitTransport *transport;
+  CockpitPipe *pipe;
+  gint64 start;
+
+  start = g_get_monotonic_time ();
+
+  pipe = cockpit_pipe_spawn (argv, NULL, NULL, COCKPIT_PIPE_FLAGS_NONE);
+  transport = cockpit_pipe_transport_new (pipe);
+  g_object_unref (pipe);
+
+  g_signal_connect (transport, "control", G_CALLBACK (on_control), &startup);
+  g_signal_connect (transport, "closed", G_CALLBACK (on_closed), &startup);
+
+  while (!startup.init && !startup.closed)
+    g_main_context_iteration (NULL, TRUE);
+
+  *elapsed = g_get_monotonic_time () - start;
+
+  /* Closing stdin makes the bridge exit, wait for it */
+  if (!startup.closed)
+    cockpit_transport_close (transport, NULL);
+  while (!startup.closed)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_object_unref (transport);
+  return startup.init;
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  GOptionContext *context;
+  GError *error = NULL;
+  gint64 *times;
+  gint64 total = 0;
+  gint done = 0;
+  gint i;
+
+  static GOptionEntry entries[] = {
+    { "count", 'n', 0, G_OPTION_ARG_INT, &opt_count, "Number of times to start the bridge", "count" },
+    { "bridge", 'b', 0, G_OPTION_ARG_FILENAME, &opt_bridge, "The bridge to start", "path" },
+    { NULL }
+  };
+
+  signal (SIGPIPE, SIG_IGN);
+  g_type_init ();
+
+  context = g_option_context_new (NULL);
+  g_option_context_add_main_entries (context, entries, NULL);
+  g_option_context_set_description (context, "Measure how long cockpit-bridge takes to start\n");
+
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("bench-startup: %s\n", error->message);
+      g_error_free (error);
+      return 2;
+    }
+
+  g_option_context_free (context);
+
+  if (opt_count < 1)
+    {
+      g_printerr ("bench-startup: invalid arguments\n");
+      return 2;
+    }
+
+  if (!opt_bridge)
+    opt_bridge = g_strdup ("./cockpit-bridge");
+
+  times = g_new0 (gint64, opt_count);
+  for (i = 0; i < opt_count; i++)
+    {
+      if (!bench_startup (times + done))
+        break;
+      total += times[done];
+      done++;
+    }
+
+  if (done == 0)
+    {
+      g_printerr ("bench-startup: %s never sent init\n", opt_bridge);
+      return 1;
+    }
+
+  qsort (times, done, sizeof (gint64), compare_time);
+
+  printf ("startup: %s, %d runs\n", opt_bridge, done);
+  printf ("  execve to init min: %.1f ms, p50: %.1f ms, mean: %.1f ms, max: %.1f ms\n",
+          times[0] / 1000.0, times[done / 2] / 1000.0,
+          (total / done) / 1000.0, times[done - 1] / 1000.0);
+
+  g_free (times);
+  g_free (opt_bridge);
+  return 0;
+}
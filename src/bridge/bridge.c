@@ -27,20 +27,24 @@
 #include "cockpitfslist.h"
 #include "cockpitfsread.h"
 #include "cockpitfswatch.h"
+#include "cockpitfsmirror.h"
 #include "cockpitfsreplace.h"
 #include "cockpithttpstream.h"
 #include "cockpitinteracttransport.h"
+#include "cockpitjournal.h"
 #include "cockpitnullchannel.h"
 #include "cockpitpackages.h"
 #include "cockpitpipechannel.h"
 #include "cockpitinternalmetrics.h"
 #include "cockpitpolkitagent.h"
 #include "cockpitportal.h"
+#include "cockpitspawnpool.h"
 #include "cockpitwebsocketstream.h"
 
 #include "common/cockpitassets.h"
 #include "common/cockpitjson.h"
 #include "common/cockpitlog.h"
+#include "common/cockpitlogring.h"
 #include "common/cockpitpipetransport.h"
 #include "common/cockpittest.h"
 #include "common/cockpitunixfd.h"
@@ -70,10 +74,13 @@ static CockpitPayloadType payload_types[] = {
   { "http-stream1", cockpit_http_stream_get_type },
   { "http-stream2", cockpit_http_stream_get_type },
   { "stream", cockpit_pipe_channel_get_type },
+  { "spawn-pool1", cockpit_spawn_pool_get_type },
   { "fsread1", cockpit_fsread_get_type },
   { "fsreplace1", cockpit_fsreplace_get_type },
   { "fswatch1", cockpit_fswatch_get_type },
   { "fslist1", cockpit_fslist_get_type },
+  { "fsmirror1", cockpit_fsmirror_get_type },
+  { "journal1", cockpit_journal_get_type },
   { "null", cockpit_null_channel_get_type },
   { "echo", cockpit_echo_channel_get_type },
   { "metrics1", cockpit_internal_metrics_get_type },
@@ -81,6 +88,26 @@ static CockpitPayloadType payload_types[] = {
   { NULL },
 };
 
+/* For the startup timing report, see startup_phase() */
+static gint64 startup_started = 0;
+static gint64 startup_last = 0;
+
+static void
+startup_phase (const gchar *phase)
+{
+  gint64 now = g_get_monotonic_time ();
+
+  if (startup_started == 0)
+    {
+      startup_started = startup_last = now;
+      return;
+    }
+
+  g_debug ("startup: %s took %.1f ms, %.1f ms so far", phase,
+           (now - startup_last) / 1000.0, (now - startup_started) / 1000.0);
+  startup_last = now;
+}
+
 static void
 on_closed_set_flag (CockpitTransport *transport,
                     const gchar *problem,
@@ -94,6 +121,7 @@ static void
 send_init_command (CockpitTransport *transport)
 {
   const gchar *checksum;
+  JsonArray *capabilities;
   const gchar *name;
   JsonObject *object;
   GBytes *bytes;
@@ -102,6 +130,16 @@ send_init_command (CockpitTransport *transport)
   json_object_set_string_member (object, "command", "init");
   json_object_set_int_member (object, "version", 1);
 
+  /* Many channels can be closed with one "kill", and channels can ack what they receive */
+  capabilities = json_array_new ();
+  json_array_add_string_element (capabilities, "kill");
+  json_array_add_string_element (capabilities, "send-acks");
+  json_object_set_array_member (object, "capabilities", capabilities);
+
+  /* Our pipe transport can receive binary frames */
+  if (COCKPIT_IS_PIPE_TRANSPORT (transport))
+    json_object_set_string_member (object, "framing", "binary");
+
   checksum = cockpit_packages_get_checksum (packages);
   if (checksum)
     json_object_set_string_member (object, "checksum", checksum);
@@ -118,6 +156,33 @@ send_init_command (CockpitTransport *transport)
   g_bytes_unref (bytes);
 }
 
+static void
+export_internal_objects (gpointer user_data)
+{
+  cockpit_dbus_user_startup (user_data);
+  cockpit_dbus_setup_startup ();
+  cockpit_dbus_environment_startup ();
+}
+
+typedef struct {
+  CockpitTransport *transport;
+  gpointer handle;
+  guint source;
+} PolkitAgentLater;
+
+static gboolean
+on_register_polkit_agent (gpointer user_data)
+{
+  PolkitAgentLater *later = user_data;
+  gint64 started = g_get_monotonic_time ();
+
+  later->source = 0;
+  later->handle = cockpit_polkit_agent_register (later->transport, NULL);
+  g_debug ("startup: polkit agent took %.1f ms after init",
+           (g_get_monotonic_time () - started) / 1000.0);
+  return FALSE;
+}
+
 static void
 setup_dbus_daemon (gpointer addrfd)
 {
@@ -329,6 +394,13 @@ on_signal_done (gpointer data)
   return TRUE;
 }
 
+static gboolean
+on_signal_dump (gpointer data)
+{
+  cockpit_log_ring_dump ();
+  return TRUE;
+}
+
 static struct passwd *
 getpwuid_a (uid_t uid)
 {
@@ -366,16 +438,18 @@ run_bridge (const gchar *interactive,
   gboolean init_received = FALSE;
   CockpitPortal *super = NULL;
   CockpitPortal *pcp = NULL;
-  gpointer polkit_agent = NULL;
+  PolkitAgentLater polkit_agent = { NULL, NULL, 0 };
   const gchar *directory;
   struct passwd *pwd;
   GPid daemon_pid = 0;
   GPid agent_pid = 0;
   guint sig_term;
   guint sig_int;
+  guint sig_usr2;
   int outfd;
   uid_t uid;
 
+  startup_phase (NULL);
   cockpit_set_journal_logging (G_LOG_DOMAIN, !isatty (2));
 
   /*
@@ -423,8 +497,10 @@ run_bridge (const gchar *interactive,
 
   sig_term = g_unix_signal_add (SIGTERM, on_signal_done, &terminated);
   sig_int = g_unix_signal_add (SIGINT, on_signal_done, &interupted);
+  sig_usr2 = g_unix_signal_add (SIGUSR2, on_signal_dump, NULL);
 
   g_type_init ();
+  startup_phase ("environment");
 
   /* Start daemons if necessary */
   if (!interactive && !privileged_slave)
@@ -433,10 +509,29 @@ run_bridge (const gchar *interactive,
         daemon_pid = start_dbus_daemon ();
       if (!have_env ("SSH_AUTH_SOCK"))
         agent_pid = start_ssh_agent ();
+      startup_phase ("daemons");
     }
 
+  /* The checksum of the packages is part of the init message */
   packages = cockpit_packages_new ();
-  cockpit_dbus_internal_startup (interactive != NULL);
+  startup_phase ("packages");
+
+  /*
+   * Only interactive mode announces its internal bus name in the init
+   * message. Otherwise nothing is set up until a channel uses the bus.
+   */
+  if (interactive)
+    {
+      cockpit_dbus_internal_startup (TRUE);
+      export_internal_objects (pwd);
+      g_free (pwd);
+      startup_phase ("internal dbus");
+    }
+  else
+    {
+      cockpit_dbus_internal_startup_lazy (export_internal_objects, pwd, g_free);
+    }
+  pwd = NULL;
 
   if (interactive)
     {
@@ -451,8 +546,18 @@ run_bridge (const gchar *interactive,
 
   if (uid != 0)
     {
+      /*
+       * Registering with polkit takes several round trips on the system
+       * bus. Don't hold up the init message for it, but register before
+       * any channel gets far enough to ask for authentication.
+       */
       if (!interactive)
-        polkit_agent = cockpit_polkit_agent_register (transport, NULL);
+        {
+          polkit_agent.transport = transport;
+          polkit_agent.source = g_idle_add_full (G_PRIORITY_DEFAULT,
+                                                   on_register_polkit_agent,
+                                                   &polkit_agent, NULL);
+        }
       super = cockpit_portal_new_superuser (transport);
     }
 
@@ -462,21 +567,19 @@ run_bridge (const gchar *interactive,
   pcp = cockpit_portal_new_pcp (transport);
 
   bridge = cockpit_bridge_new (transport, payload_types, init_received);
-  cockpit_dbus_user_startup (pwd);
-  cockpit_dbus_setup_startup ();
-  cockpit_dbus_environment_startup ();
-
-  g_free (pwd);
-  pwd = NULL;
+  startup_phase ("transport and portals");
 
   g_signal_connect (transport, "closed", G_CALLBACK (on_closed_set_flag), &closed);
   send_init_command (transport);
+  startup_phase ("init");
 
   while (!terminated && !closed && !interupted)
     g_main_context_iteration (NULL, TRUE);
 
-  if (polkit_agent)
-    cockpit_polkit_agent_unregister (polkit_agent);
+  if (polkit_agent.handle)
+    cockpit_polkit_agent_unregister (polkit_agent.handle);
+  if (polkit_agent.source)
+    g_source_remove (polkit_agent.source);
   if (super)
     g_object_unref (super);
 
@@ -495,6 +598,7 @@ run_bridge (const gchar *interactive,
 
   g_source_remove (sig_term);
   g_source_remove (sig_int);
+  g_source_remove (sig_usr2);
 
   /* So the caller gets the right signal */
   if (terminated)
@@ -545,6 +649,7 @@ main (int argc,
   int ret;
 
   static gboolean opt_packages = FALSE;
+  static gboolean opt_packages_index = FALSE;
   static gboolean opt_privileged = FALSE;
   static gboolean opt_version = FALSE;
   static gchar *opt_interactive = NULL;
@@ -553,6 +658,7 @@ main (int argc,
     { "interact", 0, 0, G_OPTION_ARG_STRING, &opt_interactive, "Interact with the raw protocol", "boundary" },
     { "privileged", 0, 0, G_OPTION_ARG_NONE, &opt_privileged, "Privileged copy of bridge", NULL },
     { "packages", 0, 0, G_OPTION_ARG_NONE, &opt_packages, "Show Cockpit package information", NULL },
+    { "packages-index", 0, 0, G_OPTION_ARG_NONE, &opt_packages_index, "Write the index of system Cockpit packages", NULL },
     { "version", 0, 0, G_OPTION_ARG_NONE, &opt_version, "Show Cockpit version information", NULL },
     { NULL }
   };
@@ -599,6 +705,16 @@ main (int argc,
       cockpit_packages_dump ();
       return 0;
     }
+  else if (opt_packages_index)
+    {
+      if (!cockpit_packages_write_index (&error))
+        {
+          g_printerr ("cockpit-bridge: couldn't write package index: %s\n", error->message);
+          g_error_free (error);
+          return 1;
+        }
+      return 0;
+    }
   else if (opt_version)
     {
       print_version ();
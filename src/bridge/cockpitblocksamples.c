@@ -20,37 +20,31 @@
 #include "config.h"
 
 #include "cockpitblocksamples.h"
+#include "cockpitprocreader.h"
 
-#include <stdio.h>
 #include <string.h>
 
 void
 cockpit_block_samples (CockpitSamples *samples)
 {
-  gchar *contents = NULL;
-  gsize len;
-  GError *error = NULL;
-  gchar **lines = NULL;
+  static CockpitProcReader reader = COCKPIT_PROC_READER_INIT ("/proc/diskstats");
+  gchar *contents;
+  gchar *line;
   guint n;
 
-  if (!g_file_get_contents ("/proc/diskstats", &contents, &len, &error))
-    {
-      g_message ("error loading contents /proc/diskstats: %s", error->message);
-      goto out;
-    }
+  contents = cockpit_proc_reader_read (&reader, NULL);
+  if (!contents)
+    return;
 
-  lines = g_strsplit (contents, "\n", -1);
-  for (n = 0; lines != NULL && lines[n] != NULL; n++)
+  for (n = 0; (line = cockpit_proc_next_line (&contents)) != NULL; n++)
     {
-      const gchar *line = lines[n];
-      guint num_parsed;
-      gint dev_major, dev_minor;
-      gchar dev_name[64]; /* TODO: big enough? */
-      guint64 num_reads,  num_reads_merged,  num_sectors_read,    num_msec_reading;
-      guint64 num_writes, num_writes_merged, num_sectors_written, num_msec_writing;
-      guint64 num_io_in_progress, num_msec_doing_io, weighted_num_msec_doing_io;
+      guint64 dev_major, dev_minor;
+      gchar *dev_name;
+      guint64 fields[11];
+      gchar *pos;
+      gint i;
 
-      if (strlen (line) == 0)
+      if (line[0] == '\0')
         continue;
 
       /* From http://www.kernel.org/doc/Documentation/iostats.txt
@@ -87,27 +81,26 @@ cockpit_block_samples (CockpitSamples *samples)
        *     I/O completion time and the backlog that may be accumulating.
        */
 
-      num_parsed = sscanf (line,
-                           "%d %d %64s"
-                           " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT
-                           " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT
-                           " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT,
-                           &dev_major, &dev_minor, dev_name,
-                           &num_reads,  &num_reads_merged, &num_sectors_read, &num_msec_reading,
-                           &num_writes, &num_writes_merged, &num_sectors_written, &num_msec_writing,
-                           &num_io_in_progress, &num_msec_doing_io, &weighted_num_msec_doing_io);
-      if (num_parsed != 14)
+      pos = line;
+      dev_name = NULL;
+      if (cockpit_proc_next_u64 (&pos, &dev_major) &&
+          cockpit_proc_next_u64 (&pos, &dev_minor))
+        dev_name = cockpit_proc_next_word (&pos);
+      if (dev_name != NULL && !cockpit_samples_wanted (samples, dev_name))
+        continue;
+      for (i = 0; dev_name != NULL && i < G_N_ELEMENTS (fields); i++)
         {
-          g_message ("error parsing line %d of file /proc/diskstats (num_parsed = %d): %s", n, num_parsed, line);
+          if (!cockpit_proc_next_u64 (&pos, fields + i))
+            break;
+        }
+      if (dev_name == NULL || i != G_N_ELEMENTS (fields))
+        {
+          g_message ("error parsing line %d of file /proc/diskstats: %s", n, line);
           continue;
         }
 
-      cockpit_samples_sample (samples, "block.device.read", dev_name, num_sectors_read * 512);
-      cockpit_samples_sample (samples, "block.device.written", dev_name, num_sectors_written * 512);
+      /* Field 3 and field 7 */
+      cockpit_samples_sample (samples, "block.device.read", dev_name, fields[2] * 512);
+      cockpit_samples_sample (samples, "block.device.written", dev_name, fields[6] * 512);
     }
-
-out:
-  g_clear_error (&error);
-  g_strfreev (lines);
-  g_free (contents);
 }
@@ -23,6 +23,7 @@
 #include "cockpitbridge.h"
 
 #include "common/cockpitjson.h"
+#include "common/cockpitpipetransport.h"
 #include "common/cockpittransport.h"
 
 struct _CockpitBridge {
@@ -77,6 +78,7 @@ process_init (CockpitBridge *self,
     {
       g_debug ("received init message");
       self->init_received = TRUE;
+      cockpit_pipe_transport_negotiate (transport, options);
     }
   else
     {
@@ -133,6 +135,56 @@ process_open (CockpitBridge *self,
     }
 }
 
+/*
+ * cockpit-ws sends one "kill" for all the channels of a page that
+ * goes away, and has already forgotten them. So they close without
+ * sending a "close" each, and just one "killed" answers for them all.
+ */
+static void
+process_kill (CockpitBridge *self,
+              CockpitTransport *transport,
+              JsonObject *options)
+{
+  CockpitChannel *channel;
+  const gchar *problem;
+  JsonObject *object;
+  JsonArray *killed;
+  gchar **channels;
+  GBytes *bytes;
+  gint i;
+
+  if (!cockpit_json_get_strv (options, "channels", NULL, &channels) ||
+      !cockpit_json_get_string (options, "problem", "terminated", &problem))
+    {
+      g_warning ("received invalid kill command");
+      cockpit_transport_close (transport, "protocol-error");
+      return;
+    }
+
+  killed = json_array_new ();
+  for (i = 0; channels && channels[i] != NULL; i++)
+    {
+      /* Channels of a portal were already handed to it, or already closed */
+      channel = g_hash_table_lookup (self->channels, channels[i]);
+      if (channel)
+        {
+          g_debug ("killing channel %s", channels[i]);
+          json_array_add_string_element (killed, channels[i]);
+          cockpit_channel_kill (channel, problem);
+        }
+    }
+
+  object = json_object_new ();
+  json_object_set_string_member (object, "command", "killed");
+  json_object_set_array_member (object, "channels", killed);
+  bytes = cockpit_json_write_bytes (object);
+  json_object_unref (object);
+
+  cockpit_transport_send (transport, NULL, bytes);
+  g_bytes_unref (bytes);
+  g_free (channels);
+}
+
 static gboolean
 on_transport_control (CockpitTransport *transport,
                       const char *command,
@@ -161,6 +213,11 @@ on_transport_control (CockpitTransport *transport,
       process_open (self, transport, channel_id, options);
       return TRUE;
     }
+  else if (g_str_equal (command, "kill"))
+    {
+      process_kill (self, transport, options);
+      return TRUE;
+    }
   else if (g_str_equal (command, "close"))
     {
       if (!channel_id)
@@ -21,6 +21,12 @@
 
 #include "cockpitcgroupsamples.h"
 
+#include "cockpitprocreader.h"
+
+#include <sys/inotify.h>
+
+#include <errno.h>
+#include <fcntl.h>
 #include <fts.h>
 #include <stdio.h>
 #include <string.h>
@@ -28,6 +34,7 @@
 
 const gchar *cockpit_cgroup_memory_root = "/sys/fs/cgroup/memory";
 const gchar *cockpit_cgroup_cpuacct_root = "/sys/fs/cgroup/cpuacct";
+const gchar *cockpit_cgroup_unified_root = "/sys/fs/cgroup";
 
 static double
 read_double (const gchar *prefix,
@@ -133,24 +140,433 @@ notice_cgroups_in_hierarchy (CockpitSamples *samples,
               const char *f = ent->fts_path + prefix_len;
               if (*f == '/')
                 f++;
-              collect (samples, ent->fts_path, f);
+
+              /* Still walk below it, a wanted cgroup may be further down */
+              if (cockpit_samples_wanted (samples, f))
+                collect (samples, ent->fts_path, f);
             }
         }
       fts_close (fs);
     }
 }
 
+/*
+ * On the unified cgroup v2 hierarchy we keep a table of the cgroups,
+ * and only walk the tree again when inotify tells us that a cgroup
+ * directory was created or removed. The stat files of each cgroup are
+ * kept open and re-read with pread(), up to a limit of open files.
+ */
+
+enum {
+  MEMORY_CURRENT,
+  MEMORY_MAX,
+  MEMORY_SWAP_CURRENT,
+  MEMORY_SWAP_MAX,
+  CPU_STAT,
+  CPU_WEIGHT,
+  IO_STAT,
+  N_UNIFIED_FILES
+};
+
+static const gchar *unified_files[N_UNIFIED_FILES] = {
+  "memory.current",
+  "memory.max",
+  "memory.swap.current",
+  "memory.swap.max",
+  "cpu.stat",
+  "cpu.weight",
+  "io.stat",
+};
+
+#define UNIFIED_FDS_MAX 512
+
+typedef struct {
+  gchar *path;
+  gchar *name;
+  gint fds[N_UNIFIED_FILES];
+  gboolean seen;
+} UnifiedCgroup;
+
+typedef struct {
+  GHashTable *cgroups;
+  gint inotify_fd;
+  gboolean dirty;
+  gint open_fds;
+  gchar *buffer;
+  gsize allocated;
+} UnifiedState;
+
+static UnifiedState unified = { NULL, -1, TRUE, 0, NULL, 0 };
+
+static void
+unified_cgroup_free (gpointer data)
+{
+  UnifiedCgroup *cg = data;
+  gint i;
+
+  for (i = 0; i < N_UNIFIED_FILES; i++)
+    {
+      if (cg->fds[i] >= 0)
+        {
+          close (cg->fds[i]);
+          unified.open_fds--;
+        }
+    }
+
+  g_free (cg->path);
+  g_free (cg);
+}
+
+static gchar *
+read_unified_file (UnifiedCgroup *cg,
+                   gint file)
+{
+  gchar *path;
+  gsize offset = 0;
+  gssize ret;
+  gint fd;
+
+  fd = cg->fds[file];
+  if (fd < 0)
+    {
+      path = g_build_filename (cg->path, unified_files[file], NULL);
+      fd = open (path, O_RDONLY | O_CLOEXEC);
+      if (fd < 0)
+        {
+          /* Controller not enabled for this cgroup */
+          if (errno != ENOENT)
+            g_message ("couldn't open %s: %s", path, g_strerror (errno));
+          g_free (path);
+          return NULL;
+        }
+      g_free (path);
+
+      if (unified.open_fds < UNIFIED_FDS_MAX)
+        {
+          cg->fds[file] = fd;
+          unified.open_fds++;
+        }
+    }
+
+  if (unified.buffer == NULL)
+    {
+      unified.allocated = 4096;
+      unified.buffer = g_malloc (unified.allocated);
+    }
+
+  for (;;)
+    {
+      if (offset + 1 >= unified.allocated)
+        {
+          unified.allocated *= 2;
+          unified.buffer = g_realloc (unified.buffer, unified.allocated);
+        }
+
+      ret = pread (fd, unified.buffer + offset, unified.allocated - offset - 1, offset);
+      if (ret < 0)
+        {
+          if (errno == EINTR)
+            continue;
+
+          /* Most likely the cgroup went away */
+          g_debug ("couldn't read %s/%s: %s", cg->path, unified_files[file], g_strerror (errno));
+          unified.dirty = TRUE;
+          offset = 0;
+          break;
+        }
+      else if (ret == 0)
+        {
+          break;
+        }
+      offset += ret;
+    }
+
+  if (cg->fds[file] != fd)
+    close (fd);
+
+  if (offset == 0)
+    return NULL;
+
+  unified.buffer[offset] = '\0';
+  return unified.buffer;
+}
+
+static double
+read_unified_double (UnifiedCgroup *cg,
+                     gint file)
+{
+  gchar *contents;
+
+  contents = read_unified_file (cg, file);
+  if (!contents)
+    return -1;
+
+  /* No limit => zero, as with v1 */
+  if (g_str_has_prefix (contents, "max"))
+    return 0;
+
+  return g_ascii_strtod (contents, NULL);
+}
+
+static double
+read_unified_key (UnifiedCgroup *cg,
+                  gint file,
+                  const gchar *key)
+{
+  gchar *contents;
+  gchar *line;
+  gchar *word;
+  guint64 value;
+
+  contents = read_unified_file (cg, file);
+  if (!contents)
+    return -1;
+
+  while ((line = cockpit_proc_next_line (&contents)) != NULL)
+    {
+      word = cockpit_proc_next_word (&line);
+      if (word && g_str_equal (word, key) && cockpit_proc_next_u64 (&line, &value))
+        return value;
+    }
+
+  return -1;
+}
+
+static void
+read_unified_io (UnifiedCgroup *cg,
+                 double *read_bytes,
+                 double *written_bytes)
+{
+  gchar *contents;
+  gchar *line;
+  gchar *word;
+
+  *read_bytes = *written_bytes = -1;
+
+  contents = read_unified_file (cg, IO_STAT);
+  if (!contents)
+    return;
+
+  *read_bytes = *written_bytes = 0;
+
+  /* Lines like: 8:0 rbytes=90112 wbytes=0 rios=3 wios=0 dbytes=0 dios=0 */
+  while ((line = cockpit_proc_next_line (&contents)) != NULL)
+    {
+      cockpit_proc_next_word (&line);
+      while ((word = cockpit_proc_next_word (&line)) != NULL)
+        {
+          if (g_str_has_prefix (word, "rbytes="))
+            *read_bytes += g_ascii_strtod (word + 7, NULL);
+          else if (g_str_has_prefix (word, "wbytes="))
+            *written_bytes += g_ascii_strtod (word + 7, NULL);
+        }
+    }
+}
+
+static void
+collect_unified (CockpitSamples *samples,
+                 UnifiedCgroup *cg)
+{
+  double mem_current, mem_max;
+  double swap_current, swap_max;
+  double usage_usec, weight;
+  double io_read, io_written;
+
+  mem_current = read_unified_double (cg, MEMORY_CURRENT);
+  if (mem_current >= 0)
+    {
+      mem_max = read_unified_double (cg, MEMORY_MAX);
+      swap_current = read_unified_double (cg, MEMORY_SWAP_CURRENT);
+      swap_max = read_unified_double (cg, MEMORY_SWAP_MAX);
+
+      cockpit_samples_sample (samples, "cgroup.memory.usage", cg->name, mem_current);
+      cockpit_samples_sample (samples, "cgroup.memory.limit", cg->name, mem_max);
+
+      /* Like memsw in v1, these include memory and swap */
+      if (swap_current >= 0)
+        {
+          cockpit_samples_sample (samples, "cgroup.memory.sw-usage", cg->name, mem_current + swap_current);
+          cockpit_samples_sample (samples, "cgroup.memory.sw-limit", cg->name,
+                                  (mem_max > 0 && swap_max > 0) ? mem_max + swap_max : 0);
+        }
+    }
+
+  usage_usec = read_unified_key (cg, CPU_STAT, "usage_usec");
+  if (usage_usec >= 0)
+    cockpit_samples_sample (samples, "cgroup.cpu.usage", cg->name, usage_usec / 1000);
+
+  /* cpu.weight defaults to 100, v1 cpu.shares to 1024 */
+  weight = read_unified_double (cg, CPU_WEIGHT);
+  if (weight >= 0)
+    cockpit_samples_sample (samples, "cgroup.cpu.shares", cg->name, weight * 1024 / 100);
+
+  read_unified_io (cg, &io_read, &io_written);
+  if (io_read >= 0)
+    {
+      cockpit_samples_sample (samples, "cgroup.io.read", cg->name, io_read);
+      cockpit_samples_sample (samples, "cgroup.io.written", cg->name, io_written);
+    }
+}
+
+static void
+drain_unified_inotify (void)
+{
+  struct inotify_event *event;
+  gchar buf[4096] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+  gssize len;
+  gchar *p;
+
+  for (;;)
+    {
+      len = read (unified.inotify_fd, buf, sizeof (buf));
+      if (len < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          if (errno != EAGAIN)
+            {
+              g_message ("couldn't read cgroup inotify events: %s", g_strerror (errno));
+              close (unified.inotify_fd);
+              unified.inotify_fd = -1;
+              unified.dirty = TRUE;
+            }
+          break;
+        }
+      else if (len == 0)
+        {
+          break;
+        }
+
+      for (p = buf; p < buf + len; p += sizeof (struct inotify_event) + event->len)
+        {
+          event = (struct inotify_event *)p;
+          if (event->mask & (IN_ISDIR | IN_Q_OVERFLOW | IN_IGNORED))
+            unified.dirty = TRUE;
+        }
+    }
+}
+
+static gboolean
+remove_unseen (gpointer key,
+               gpointer value,
+               gpointer user_data)
+{
+  UnifiedCgroup *cg = value;
+  gboolean unseen = !cg->seen;
+  cg->seen = FALSE;
+  return unseen;
+}
+
+static void
+scan_unified (const gchar *root)
+{
+  const gchar *paths[] = { root, NULL };
+  UnifiedCgroup *cg;
+  gsize root_len;
+  FTSENT *ent;
+  FTS *fs;
+  gint i;
+
+  root_len = strlen (root);
+
+  fs = fts_open ((gchar **)paths, FTS_NOCHDIR | FTS_COMFOLLOW, NULL);
+  if (!fs)
+    return;
+
+  while ((ent = fts_read (fs)) != NULL)
+    {
+      if (ent->fts_info != FTS_D)
+        continue;
+
+      cg = g_hash_table_lookup (unified.cgroups, ent->fts_path);
+      if (!cg)
+        {
+          cg = g_new0 (UnifiedCgroup, 1);
+          cg->path = g_strdup (ent->fts_path);
+          cg->name = cg->path + root_len;
+          if (*cg->name == '/')
+            cg->name++;
+          for (i = 0; i < N_UNIFIED_FILES; i++)
+            cg->fds[i] = -1;
+          g_hash_table_insert (unified.cgroups, cg->path, cg);
+
+          /* If we run out of watches, we just scan every time */
+          if (unified.inotify_fd >= 0 &&
+              inotify_add_watch (unified.inotify_fd, cg->path, IN_CREATE | IN_DELETE | IN_MOVE | IN_ONLYDIR) < 0)
+            {
+              g_debug ("couldn't watch cgroup %s: %s", cg->path, g_strerror (errno));
+              close (unified.inotify_fd);
+              unified.inotify_fd = -1;
+            }
+        }
+      cg->seen = TRUE;
+    }
+
+  fts_close (fs);
+
+  g_hash_table_foreach_remove (unified.cgroups, remove_unseen, NULL);
+}
+
+static void
+sample_unified (CockpitSamples *samples,
+                const gchar *root)
+{
+  GHashTableIter iter;
+  gpointer value;
+
+  if (!unified.cgroups)
+    {
+      unified.cgroups = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, unified_cgroup_free);
+      unified.inotify_fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+      if (unified.inotify_fd < 0)
+        g_message ("couldn't watch cgroups: %s", g_strerror (errno));
+      unified.dirty = TRUE;
+    }
+
+  if (unified.inotify_fd >= 0)
+    drain_unified_inotify ();
+  else
+    unified.dirty = TRUE;
+
+  if (unified.dirty)
+    {
+      unified.dirty = FALSE;
+      scan_unified (root);
+    }
+
+  /* Files of cgroups that aren't wanted aren't opened at all */
+  g_hash_table_iter_init (&iter, unified.cgroups);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      if (cockpit_samples_wanted (samples, ((UnifiedCgroup *)value)->name))
+        collect_unified (samples, value);
+    }
+}
 
 void
 cockpit_cgroup_samples (CockpitSamples *samples)
 {
   /* We are looking for files like
 
+     /sys/fs/cgroup/.../memory.current
+     /sys/fs/cgroup/.../cpu.stat
      /sys/fs/cgroup/memory/.../memory.usage_in_bytes
      /sys/fs/cgroup/memory/.../memory.limit_in_bytes
      /sys/fs/cgroup/cpuacct/.../cpuacct.usage
   */
 
+  gchar *controllers;
+
+  /* The unified hierarchy, cgroup v2 */
+  controllers = g_build_filename (cockpit_cgroup_unified_root, "cgroup.controllers", NULL);
+  if (access (controllers, F_OK) == 0)
+    {
+      g_free (controllers);
+      sample_unified (samples, cockpit_cgroup_unified_root);
+      return;
+    }
+  g_free (controllers);
+
   notice_cgroups_in_hierarchy (samples, cockpit_cgroup_memory_root, collect_memory);
   notice_cgroups_in_hierarchy (samples, cockpit_cgroup_cpuacct_root, collect_cpu);
 }
@@ -21,8 +21,13 @@
 
 #include "cockpitchannel.h"
 
+#include "common/cockpitbase64.h"
 #include "common/cockpitjson.h"
 #include "common/cockpitloopback.h"
+#include "common/cockpitmemory.h"
+#include "common/cockpitprobes.h"
+#include "common/cockpitstats.h"
+#include "common/cockpittrace.h"
 #include "common/cockpitunicode.h"
 
 #include <json-glib/json-glib.h>
@@ -55,9 +60,8 @@ const gchar * cockpit_bridge_local_address = NULL;
  */
 
 struct _CockpitChannelPrivate {
-    gulong recv_sig;
-    gulong close_sig;
-    gulong control_sig;
+    gboolean routed;
+    GList *transport_link;
 
     /* Construct arguments */
     CockpitTransport *transport;
@@ -86,11 +90,45 @@ struct _CockpitChannelPrivate {
     gboolean binary_ok;
     gboolean base64_encoding;
 
+    /* Send batching options and state */
+    gint64 batch;
+    gint64 latency;
+    GByteArray *batched;
+    gboolean batched_utf8;
+    guint batch_timeout;
+
+    /* Partial UTF-8 character held back from the last send, for streams */
+    gboolean hold_incomplete;
+    GBytes *incomplete;
+
+    /* Record framing option, and a partial record held back */
+    gint framing;
+    GByteArray *partial;
+
+    /* Flow control window, sent but not acknowledged, and held back */
+    gint64 window;
+    gint64 unacked;
+    GQueue *held;
+    gsize held_size;
+
+    /* With "send-acks", acknowledge payload once it's handled */
+    gboolean send_acks;
+
+    /* Stats for this payload type, and when the channel was opened */
+    CockpitStats *stats;
+    gint64 opened;
+
+    /* Stats for the "group" open option, if any */
+    CockpitStats *group;
+
+    /* With the "trace" open option, when messages pass through */
+    CockpitTrace *trace;
+
     /* Other state */
     JsonObject *close_options;
 
-    /* If we've gotten to the main-loop yet */
-    guint prepare_tag;
+    /* If we've gotten to the main-loop yet, in pending_prepare */
+    GList *prepare_link;
 };
 
 enum {
@@ -101,27 +139,73 @@ enum {
     PROP_CAPABILITIES,
 };
 
+enum {
+    FRAMING_NONE,
+    FRAMING_LINES,
+    FRAMING_JSON_SEQ,
+};
+
+/* The record separator from RFC 7464 */
+#define JSON_SEQ_RS  '\x1e'
+
 static guint cockpit_channel_sig_closed;
 
 G_DEFINE_TYPE (CockpitChannel, cockpit_channel, G_TYPE_OBJECT);
 
+/*
+ * Channels that haven't been prepared yet. When a page opens many
+ * channels at once, they are all prepared in one dispatch, instead
+ * of each needing its own idle and loop iteration.
+ */
+static GQueue pending_prepare = G_QUEUE_INIT;
+static guint pending_prepare_tag = 0;
+
 static gboolean
-on_idle_prepare (gpointer data)
+on_idle_prepare (gpointer unused)
 {
-  CockpitChannel *self = COCKPIT_CHANNEL (data);
-  g_object_ref (self);
-  cockpit_channel_prepare (self);
-  g_object_unref (self);
+  CockpitChannel *self;
+  guint count;
+
+  pending_prepare_tag = 0;
+
+  /* Channels opened while preparing wait for the next dispatch */
+  count = g_queue_get_length (&pending_prepare);
+  while (count-- > 0 && !g_queue_is_empty (&pending_prepare))
+    {
+      self = g_object_ref (g_queue_peek_head (&pending_prepare));
+      cockpit_channel_prepare (self);
+      g_object_unref (self);
+    }
+
   return FALSE;
 }
 
+static void
+cancel_prepare (CockpitChannel *self)
+{
+  g_queue_delete_link (&pending_prepare, self->priv->prepare_link);
+  self->priv->prepare_link = NULL;
+
+  if (g_queue_is_empty (&pending_prepare) && pending_prepare_tag)
+    {
+      g_source_remove (pending_prepare_tag);
+      pending_prepare_tag = 0;
+    }
+}
+
 static void
 cockpit_channel_init (CockpitChannel *self)
 {
   self->priv = G_TYPE_INSTANCE_GET_PRIVATE (self, COCKPIT_TYPE_CHANNEL,
                                             CockpitChannelPrivate);
 
-  self->priv->prepare_tag = g_idle_add_full (G_PRIORITY_HIGH, on_idle_prepare, self, NULL);
+  g_queue_push_tail (&pending_prepare, self);
+  self->priv->prepare_link = g_queue_peek_tail_link (&pending_prepare);
+  if (!pending_prepare_tag)
+    pending_prepare_tag = g_idle_add_full (G_PRIORITY_HIGH, on_idle_prepare, NULL, NULL);
+
+  /* Has no effect until batch is set */
+  self->priv->latency = 75;
 }
 
 static GBytes *
@@ -130,18 +214,14 @@ base64_decode (GBytes *bytes)
   gconstpointer data;
   guchar *decoded;
   gsize length;
-  gint state = 0;
-  guint save = 0;
 
   data = g_bytes_get_data (bytes, &length);
 
   if (length == 0)
     return g_bytes_new_static ("", 0);
 
-  /* We can use a smaller limit here, since we know the saved state is 0,
-     +1 used to avoid calling g_malloc0(0), and hence returning NULL */
-  decoded = g_malloc0 ((length / 4) * 3 + 3);
-  length = g_base64_decode_step (data, length, decoded, &state, &save);
+  decoded = g_malloc (COCKPIT_BASE64_DECODED_MAX (length));
+  length = cockpit_base64_decode (data, length, decoded);
 
   return g_bytes_new_take (decoded, length);
 }
@@ -152,27 +232,424 @@ base64_encode (GBytes *bytes)
   gconstpointer data;
   gchar *encoded;
   gsize length;
-  gint state = 0;
-  gint save = 0;
 
   data = g_bytes_get_data (bytes, &length);
 
   if (length == 0)
     return g_bytes_new_static ("", 0);
 
-  /* We can use a smaller limit here, since we know the saved state is 0,
-     +1 is needed for trailing \0, also check for unlikely integer overflow */
-
+  /* Check for unlikely integer overflow */
   if (length >= ((G_MAXSIZE - 1) / 4 - 1) * 3)
     g_error ("%s: input too large for Base64 encoding (%"G_GSIZE_FORMAT" chars)", G_STRLOC, length);
 
-  encoded = g_malloc ((length / 3 + 1) * 4 + 4);
-  length = g_base64_encode_step (data, length, FALSE, encoded, &state, &save);
-  length += g_base64_encode_close (FALSE, encoded + length, &state, &save);
+  encoded = g_malloc (COCKPIT_BASE64_ENCODED_MAX (length));
+  length = cockpit_base64_encode (data, length, encoded);
 
   return g_bytes_new_take (encoded, length);
 }
 
+static gboolean
+parse_batch_options (CockpitChannel *self,
+                     JsonObject *options)
+{
+  if (!cockpit_json_get_int (options, "batch", self->priv->batch, &self->priv->batch) ||
+      self->priv->batch < 0 || self->priv->batch > G_MAXUINT)
+    {
+      g_warning ("%s: channel has invalid \"batch\" option", self->priv->id);
+      return FALSE;
+    }
+
+  if (!cockpit_json_get_int (options, "latency", self->priv->latency, &self->priv->latency) ||
+      self->priv->latency < 0 || self->priv->latency >= G_MAXUINT)
+    {
+      g_warning ("%s: channel has invalid \"latency\" option", self->priv->id);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static GBytes *
+hold_incomplete (CockpitChannel *self,
+                 GBytes *payload)
+{
+  GByteArray *joined;
+  gconstpointer data;
+  GBytes *whole;
+  gsize length;
+  gsize tail;
+
+  /* Complete any character cut off at the end of the last send */
+  if (self->priv->incomplete)
+    {
+      joined = g_bytes_unref_to_array (self->priv->incomplete);
+      self->priv->incomplete = NULL;
+      data = g_bytes_get_data (payload, &length);
+      g_byte_array_append (joined, data, length);
+      payload = g_byte_array_free_to_bytes (joined);
+    }
+  else
+    {
+      g_bytes_ref (payload);
+    }
+
+  data = g_bytes_get_data (payload, &length);
+  tail = cockpit_unicode_incomplete_tail (data, length);
+  if (tail > 0)
+    {
+      whole = payload;
+      self->priv->incomplete = g_bytes_new ((const guchar *)data + (length - tail), tail);
+      payload = g_bytes_new_from_bytes (whole, 0, length - tail);
+      g_bytes_unref (whole);
+    }
+
+  return payload;
+}
+
+static void
+send_to_transport (CockpitChannel *self,
+                   GBytes *payload)
+{
+  cockpit_stats_add (self->priv->stats, COCKPIT_STAT_CHANNEL_MESSAGES, 1);
+  cockpit_stats_add (self->priv->stats, COCKPIT_STAT_CHANNEL_BYTES, g_bytes_get_size (payload));
+  if (self->priv->group)
+    cockpit_stats_add (self->priv->group, COCKPIT_STAT_GROUP_BYTES_OUT, g_bytes_get_size (payload));
+  if (self->priv->trace)
+    cockpit_trace_mark (self->priv->trace, "bridge-sent");
+  cockpit_transport_send (self->priv->transport, self->priv->id, payload);
+}
+
+/*
+ * With a "window" open option, at most that many bytes of payload are
+ * sent before the peer acknowledges some with an "ack" command. Beyond
+ * that payloads are held back, and the implementation is told about
+ * the pressure so it can stop producing more.
+ */
+static void
+transmit (CockpitChannel *self,
+          GBytes *payload)
+{
+  CockpitChannelClass *klass;
+
+  if (self->priv->window > 0 &&
+      (self->priv->held || self->priv->unacked >= self->priv->window))
+    {
+      if (!self->priv->held)
+        {
+          self->priv->held = g_queue_new ();
+          g_debug ("%s: channel window is full", self->priv->id);
+          klass = COCKPIT_CHANNEL_GET_CLASS (self);
+          if (klass->pressure && !self->priv->emitted_close)
+            (klass->pressure) (self, TRUE);
+        }
+      g_queue_push_tail (self->priv->held, g_bytes_ref (payload));
+      self->priv->held_size += g_bytes_get_size (payload);
+      if (self->priv->group)
+        cockpit_stats_add (self->priv->group, COCKPIT_STAT_GROUP_QUEUED, g_bytes_get_size (payload));
+      return;
+    }
+
+  self->priv->unacked += g_bytes_get_size (payload);
+  send_to_transport (self, payload);
+}
+
+static void
+flush_held (CockpitChannel *self,
+            gboolean force)
+{
+  CockpitChannelClass *klass;
+  GQueue *held;
+  GBytes *payload;
+
+  held = self->priv->held;
+  if (!held)
+    return;
+
+  while (force || self->priv->unacked < self->priv->window)
+    {
+      payload = g_queue_pop_head (held);
+      if (!payload)
+        break;
+      self->priv->held_size -= g_bytes_get_size (payload);
+      if (self->priv->group)
+        cockpit_stats_add (self->priv->group, COCKPIT_STAT_GROUP_QUEUED, -(gssize)g_bytes_get_size (payload));
+      self->priv->unacked += g_bytes_get_size (payload);
+      if (!self->priv->transport_closed)
+        send_to_transport (self, payload);
+      g_bytes_unref (payload);
+    }
+
+  if (g_queue_is_empty (held))
+    {
+      g_queue_free (held);
+      self->priv->held = NULL;
+      g_debug ("%s: channel window has room", self->priv->id);
+      klass = COCKPIT_CHANNEL_GET_CLASS (self);
+      if (klass->pressure && !self->priv->emitted_close)
+        (klass->pressure) (self, FALSE);
+    }
+}
+
+static gboolean
+on_batch_timeout (gpointer user_data);
+
+static void
+send_payload (CockpitChannel *self,
+              GBytes *payload,
+              gboolean trust_is_utf8)
+{
+  GBytes *encoded = NULL;
+  GBytes *validated = NULL;
+  GBytes *held = NULL;
+
+  if (!trust_is_utf8)
+    {
+      if (!self->priv->binary_ok)
+        {
+          /*
+           * Streams are read in arbitrary blocks, so hold back a
+           * character that was split, rather than replacing it.
+           * Not for longer than the batch latency though.
+           */
+          if (self->priv->hold_incomplete)
+            {
+              payload = held = hold_incomplete (self, payload);
+              if (self->priv->incomplete && !self->priv->batch_timeout)
+                self->priv->batch_timeout = g_timeout_add (self->priv->latency, on_batch_timeout, self);
+              if (g_bytes_get_size (payload) == 0 && self->priv->incomplete)
+                {
+                  g_bytes_unref (held);
+                  return;
+                }
+            }
+          payload = validated = cockpit_unicode_force_utf8 (payload);
+        }
+    }
+
+  if (self->priv->base64_encoding)
+    payload = encoded = base64_encode (payload);
+
+  transmit (self, payload);
+
+  if (encoded)
+    g_bytes_unref (encoded);
+  if (validated)
+    g_bytes_unref (validated);
+  if (held)
+    g_bytes_unref (held);
+}
+
+static void
+flush_incomplete (CockpitChannel *self)
+{
+  GBytes *incomplete;
+  GBytes *validated;
+
+  incomplete = self->priv->incomplete;
+  self->priv->incomplete = NULL;
+
+  if (!incomplete)
+    return;
+
+  /* Nothing more is coming to complete it */
+  if (!self->priv->transport_closed)
+    {
+      validated = cockpit_unicode_force_utf8 (incomplete);
+      send_payload (self, validated, TRUE);
+      g_bytes_unref (validated);
+    }
+  g_bytes_unref (incomplete);
+}
+
+static void
+flush_batched (CockpitChannel *self)
+{
+  GByteArray *batched;
+  GBytes *payload;
+
+  batched = self->priv->batched;
+  self->priv->batched = NULL;
+
+  /* Otherwise the timeout may be for a held back character */
+  if (!batched)
+    return;
+
+  if (self->priv->batch_timeout)
+    {
+      g_source_remove (self->priv->batch_timeout);
+      self->priv->batch_timeout = 0;
+    }
+
+  /*
+   * The payload is validated and encoded as a whole, so that
+   * base64 and UTF-8 sequences split across sends come out right.
+   */
+  payload = g_byte_array_free_to_bytes (batched);
+  if (!self->priv->transport_closed)
+    send_payload (self, payload, self->priv->batched_utf8);
+  g_bytes_unref (payload);
+}
+
+/*
+ * Returns the length of @data up to and including the end of the
+ * last complete record, or zero when there is none.
+ */
+static gsize
+framed_length (CockpitChannel *self,
+               const gchar *data,
+               gsize length)
+{
+  const gchar *pos;
+  const gchar *nl;
+
+  if (length == 0)
+    return 0;
+
+  if (self->priv->framing == FRAMING_JSON_SEQ)
+    {
+      /* A record followed by a line feed at the end is complete */
+      if (data[length - 1] == '\n')
+        return length;
+
+      /* Otherwise each record ends where the next one starts */
+      for (pos = data + length - 1; pos > data; pos--)
+        {
+          if (*pos == JSON_SEQ_RS)
+            return pos - data;
+        }
+      return 0;
+    }
+
+  /* FRAMING_LINES */
+  nl = NULL;
+  pos = data;
+  while ((pos = memchr (pos, '\n', length - (pos - data))) != NULL)
+    nl = ++pos;
+  return nl ? nl - data : 0;
+}
+
+/*
+ * With a "framing" option, only whole records are sent. A record cut
+ * off at the end of a send is held back until the rest arrives. When
+ * nothing is held back and the payload ends on a record boundary, the
+ * payload is sent as is.
+ */
+static GBytes *
+frame_records (CockpitChannel *self,
+               GBytes *payload)
+{
+  GByteArray *partial;
+  const gchar *data;
+  GBytes *whole;
+  gsize length;
+  gsize framed;
+
+  data = g_bytes_get_data (payload, &length);
+  framed = framed_length (self, data, length);
+  partial = self->priv->partial;
+
+  if (partial)
+    {
+      /* A record separator at the very start also ends the partial record */
+      if (framed == 0 && length > 0 && self->priv->framing == FRAMING_JSON_SEQ &&
+          data[0] == JSON_SEQ_RS)
+        {
+          self->priv->partial = g_byte_array_new ();
+          g_byte_array_append (self->priv->partial, (const guint8 *)data, length);
+          return g_byte_array_free_to_bytes (partial);
+        }
+
+      if (framed == 0)
+        {
+          g_byte_array_append (partial, (const guint8 *)data, length);
+          return NULL;
+        }
+
+      self->priv->partial = NULL;
+      g_byte_array_append (partial, (const guint8 *)data, framed);
+      whole = g_byte_array_free_to_bytes (partial);
+    }
+  else if (framed == length)
+    {
+      return g_bytes_ref (payload);
+    }
+  else if (framed == 0)
+    {
+      whole = NULL;
+    }
+  else
+    {
+      whole = g_bytes_new_from_bytes (payload, 0, framed);
+    }
+
+  if (framed < length)
+    {
+      self->priv->partial = g_byte_array_new ();
+      g_byte_array_append (self->priv->partial, (const guint8 *)data + framed, length - framed);
+    }
+
+  return whole;
+}
+
+static void
+send_framed (CockpitChannel *self,
+             GBytes *payload,
+             gboolean trust_is_utf8);
+
+static void
+flush_partial (CockpitChannel *self)
+{
+  GByteArray *partial;
+  GBytes *payload;
+
+  partial = self->priv->partial;
+  self->priv->partial = NULL;
+
+  if (!partial)
+    return;
+
+  /* Nothing more is coming to complete it */
+  payload = g_byte_array_free_to_bytes (partial);
+  if (!self->priv->transport_closed && g_bytes_get_size (payload) > 0)
+    send_framed (self, payload, FALSE);
+  g_bytes_unref (payload);
+}
+
+static gboolean
+on_batch_timeout (gpointer user_data)
+{
+  CockpitChannel *self = user_data;
+  self->priv->batch_timeout = 0;
+
+  /* A character held back for a whole latency isn't being completed */
+  if (!self->priv->batched)
+    flush_incomplete (self);
+  flush_batched (self);
+  return FALSE;
+}
+
+/* Tell the peer how much of its payload has been handled */
+static void
+send_ack (CockpitChannel *self,
+          gsize bytes)
+{
+  JsonObject *object;
+  GBytes *message;
+
+  if (!self->priv->send_acks || self->priv->sent_close || bytes == 0)
+    return;
+
+  object = json_object_new ();
+  json_object_set_string_member (object, "command", "ack");
+  json_object_set_string_member (object, "channel", self->priv->id);
+  json_object_set_int_member (object, "bytes", bytes);
+  message = cockpit_json_write_bytes (object);
+  json_object_unref (object);
+
+  cockpit_transport_send (self->priv->transport, NULL, message);
+  g_bytes_unref (message);
+}
+
 static gboolean
 on_transport_recv (CockpitTransport *transport,
                    const gchar *channel_id,
@@ -182,10 +659,16 @@ on_transport_recv (CockpitTransport *transport,
   CockpitChannel *self = user_data;
   CockpitChannelClass *klass;
   GBytes *decoded = NULL;
+  gsize size;
 
   if (g_strcmp0 (channel_id, self->priv->id) != 0)
     return FALSE;
 
+  if (self->priv->trace)
+    cockpit_trace_mark (self->priv->trace, "bridge-received");
+  if (self->priv->group)
+    cockpit_stats_add (self->priv->group, COCKPIT_STAT_GROUP_BYTES_IN, g_bytes_get_size (data));
+
   if (self->priv->received_done)
     {
       g_warning ("%s: channel received message after done", self->priv->id);
@@ -195,11 +678,15 @@ on_transport_recv (CockpitTransport *transport,
 
   if (self->priv->ready)
     {
+      size = g_bytes_get_size (data);
       if (self->priv->base64_encoding)
         data = decoded = base64_decode (data);
       klass = COCKPIT_CHANNEL_GET_CLASS (self);
       g_assert (klass->recv);
+      g_object_ref (self);
       (klass->recv) (self, data);
+      send_ack (self, size);
+      g_object_unref (self);
     }
   else
     {
@@ -214,6 +701,22 @@ on_transport_recv (CockpitTransport *transport,
   return TRUE;
 }
 
+static void
+send_trace (CockpitChannel *self)
+{
+  JsonObject *object;
+  JsonArray *events;
+
+  events = json_array_new ();
+  if (self->priv->trace)
+    cockpit_trace_take (self->priv->trace, events);
+
+  object = json_object_new ();
+  json_object_set_array_member (object, "events", events);
+  cockpit_channel_control (self, "trace", object);
+  json_object_unref (object);
+}
+
 static gboolean
 on_transport_control (CockpitTransport *transport,
                       const char *command,
@@ -225,6 +728,7 @@ on_transport_control (CockpitTransport *transport,
   CockpitChannel *self = user_data;
   CockpitChannelClass *klass;
   const gchar *problem;
+  gint64 bytes;
 
   if (g_strcmp0 (channel_id, self->priv->id) != 0)
     return FALSE;
@@ -239,6 +743,27 @@ on_transport_control (CockpitTransport *transport,
       return TRUE;
     }
 
+  /* The peer has consumed some of what was sent */
+  if (g_str_equal (command, "ack"))
+    {
+      if (!cockpit_json_get_int (options, "bytes", 0, &bytes) || bytes < 0)
+        {
+          g_warning ("%s: channel received invalid \"ack\" command", self->priv->id);
+          cockpit_channel_close (self, "protocol-error");
+          return TRUE;
+        }
+      self->priv->unacked = MAX (self->priv->unacked - bytes, 0);
+      flush_held (self, FALSE);
+      return TRUE;
+    }
+
+  /* Send back the timestamps of a traced channel */
+  if (g_str_equal (command, "trace"))
+    {
+      send_trace (self);
+      return TRUE;
+    }
+
   if (g_str_equal (command, "done"))
     {
       if (self->priv->received_done)
@@ -254,41 +779,150 @@ on_transport_control (CockpitTransport *transport,
         }
     }
 
+  /* New set of options for channel */
+  if (g_str_equal (command, "options"))
+    {
+      if (!parse_batch_options (self, options))
+        {
+          cockpit_channel_close (self, "protocol-error");
+          return TRUE;
+        }
+      flush_batched (self);
+      if (klass->control)
+        (klass->control) (self, command, options);
+      return TRUE;
+    }
+
   if (klass->control)
     return (klass->control) (self, command, options);
 
   return FALSE;
 }
 
+static void
+router_add (CockpitChannel *self)
+{
+  /* As with signal handlers, the first channel with an id gets its messages */
+  self->priv->routed = cockpit_transport_route (self->priv->transport, self->priv->id,
+                                                on_transport_recv, on_transport_control, self);
+}
+
+static void
+router_remove (CockpitChannel *self)
+{
+  if (self->priv->routed)
+    cockpit_transport_unroute (self->priv->transport, self->priv->id, self);
+  self->priv->routed = FALSE;
+}
+
+/*
+ * The channels on a transport, so that one "closed" handler per transport
+ * closes them all. A signal handler for each channel costs memory, and
+ * disconnecting one gets slower the more channels there are.
+ */
+static const gchar *channels_key = "cockpit-channel-list";
+
 static void
 on_transport_closed (CockpitTransport *transport,
                      const gchar *problem,
                      gpointer user_data)
 {
-  CockpitChannel *self = COCKPIT_CHANNEL (user_data);
-  self->priv->transport_closed = TRUE;
+  GQueue *channels = user_data;
+  CockpitChannel *self;
+  GList *copy, *l;
+
   if (problem == NULL)
     problem = "disconnected";
-  if (!self->priv->emitted_close)
-    cockpit_channel_close (self, problem);
+
+  /* Channels remove themselves as they close */
+  copy = g_list_copy (channels->head);
+  g_list_foreach (copy, (GFunc)g_object_ref, NULL);
+
+  for (l = copy; l != NULL; l = g_list_next (l))
+    {
+      self = l->data;
+      if (!self->priv->transport_link)
+        continue;
+      self->priv->transport_closed = TRUE;
+      if (!self->priv->emitted_close)
+        cockpit_channel_close (self, problem);
+    }
+
+  g_list_free_full (copy, g_object_unref);
+}
+
+static void
+transport_list_add (CockpitChannel *self)
+{
+  GObject *transport = G_OBJECT (self->priv->transport);
+  GQueue *channels;
+
+  channels = g_object_get_data (transport, channels_key);
+  if (!channels)
+    {
+      /* Freed with the transport, which each channel holds a reference to */
+      channels = g_queue_new ();
+      g_signal_connect (transport, "closed", G_CALLBACK (on_transport_closed), channels);
+      g_object_set_data_full (transport, channels_key, channels, (GDestroyNotify)g_queue_free);
+    }
+
+  g_queue_push_tail (channels, self);
+  self->priv->transport_link = g_queue_peek_tail_link (channels);
+}
+
+static void
+transport_list_remove (CockpitChannel *self)
+{
+  GQueue *channels;
+
+  if (!self->priv->transport_link)
+    return;
+
+  channels = g_object_get_data (G_OBJECT (self->priv->transport), channels_key);
+  g_queue_delete_link (channels, self->priv->transport_link);
+  self->priv->transport_link = NULL;
 }
 
 static void
 cockpit_channel_constructed (GObject *object)
 {
   CockpitChannel *self = COCKPIT_CHANNEL (object);
+  const gchar *payload = NULL;
+  const gchar *group = NULL;
+  gboolean trace = FALSE;
 
   G_OBJECT_CLASS (cockpit_channel_parent_class)->constructed (object);
 
   g_return_if_fail (self->priv->id != NULL);
 
+  if (!self->priv->open_options ||
+      !cockpit_json_get_string (self->priv->open_options, "payload", NULL, &payload) || !payload)
+    payload = "unknown";
+  COCKPIT_PROBE2 (channel_open, self->priv->id, payload);
+  self->priv->stats = cockpit_stats_lookup (payload);
+  self->priv->opened = g_get_monotonic_time ();
+  cockpit_stats_add (self->priv->stats, COCKPIT_STAT_CHANNEL_OPEN, 1);
+  cockpit_stats_add (self->priv->stats, COCKPIT_STAT_CHANNEL_OPENED, 1);
+
+  /* An invalid group is checked by cockpit-ws, and just not counted here */
+  if (self->priv->open_options &&
+      cockpit_json_get_string (self->priv->open_options, "group", NULL, &group) && group)
+    {
+      self->priv->group = cockpit_stats_lookup_group (group);
+      cockpit_stats_add (self->priv->group, COCKPIT_STAT_GROUP_CHANNELS, 1);
+    }
+
+  /* An invalid value is just no tracing */
+  if (self->priv->open_options &&
+      cockpit_json_get_bool (self->priv->open_options, "trace", FALSE, &trace) && trace)
+    {
+      self->priv->trace = cockpit_trace_new ();
+      cockpit_trace_mark (self->priv->trace, "bridge-open");
+    }
+
   self->priv->capabilities = NULL;
-  self->priv->recv_sig = g_signal_connect (self->priv->transport, "recv",
-                                           G_CALLBACK (on_transport_recv), self);
-  self->priv->control_sig = g_signal_connect (self->priv->transport, "control",
-                                              G_CALLBACK (on_transport_control), self);
-  self->priv->close_sig = g_signal_connect (self->priv->transport, "closed",
-                                            G_CALLBACK (on_transport_closed), self);
+  router_add (self);
+  transport_list_add (self);
 }
 
 
@@ -372,6 +1006,8 @@ cockpit_channel_real_prepare (CockpitChannel *channel)
   JsonObject *options;
   const gchar *binary;
   const gchar *payload;
+  const gchar *framing;
+  const gchar *acks;
 
   options = cockpit_channel_get_options (self);
 
@@ -412,8 +1048,54 @@ cockpit_channel_real_prepare (CockpitChannel *channel)
         {
           g_warning ("%s: channel has invalid \"binary\" option: %s", self->priv->id, binary);
           cockpit_channel_close (self, "protocol-error");
+          return;
         }
     }
+
+  if (!parse_batch_options (self, options))
+    {
+      cockpit_channel_close (self, "protocol-error");
+      return;
+    }
+
+  if (!cockpit_json_get_string (options, "framing", NULL, &framing))
+    {
+      g_warning ("%s: channel has invalid \"framing\" option", self->priv->id);
+      cockpit_channel_close (self, "protocol-error");
+      return;
+    }
+  else if (framing == NULL)
+    self->priv->framing = FRAMING_NONE;
+  else if (g_str_equal (framing, "lines"))
+    self->priv->framing = FRAMING_LINES;
+  else if (g_str_equal (framing, "json-seq"))
+    self->priv->framing = FRAMING_JSON_SEQ;
+  else
+    {
+      g_warning ("%s: channel has invalid \"framing\" option: %s", self->priv->id, framing);
+      cockpit_channel_close (self, "protocol-error");
+      return;
+    }
+
+  if (!cockpit_json_get_int (options, "window", 0, &self->priv->window) ||
+      self->priv->window < 0)
+    {
+      g_warning ("%s: channel has invalid \"window\" option", self->priv->id);
+      cockpit_channel_close (self, "protocol-error");
+      return;
+    }
+
+  if (!cockpit_json_get_string (options, "send-acks", NULL, &acks))
+    acks = "invalid";
+  if (acks == NULL)
+    self->priv->send_acks = FALSE;
+  else if (g_str_equal (acks, "bytes"))
+    self->priv->send_acks = TRUE;
+  else
+    {
+      g_warning ("%s: channel has invalid \"send-acks\" option", self->priv->id);
+      cockpit_channel_close (self, "protocol-error");
+    }
 }
 
 static void
@@ -476,23 +1158,15 @@ cockpit_channel_dispose (GObject *object)
    * This object was destroyed before going to the main loop
    * no need to wait until later before we fire various signals.
    */
-  if (self->priv->prepare_tag)
-    {
-      g_source_remove (self->priv->prepare_tag);
-      self->priv->prepare_tag = 0;
-    }
-
-  if (self->priv->recv_sig)
-    g_signal_handler_disconnect (self->priv->transport, self->priv->recv_sig);
-  self->priv->recv_sig = 0;
+  if (self->priv->prepare_link)
+    cancel_prepare (self);
 
-  if (self->priv->control_sig)
-    g_signal_handler_disconnect (self->priv->transport, self->priv->control_sig);
-  self->priv->control_sig = 0;
+  router_remove (self);
+  transport_list_remove (self);
 
-  if (self->priv->close_sig)
-    g_signal_handler_disconnect (self->priv->transport, self->priv->close_sig);
-  self->priv->close_sig = 0;
+  if (self->priv->batch_timeout)
+    g_source_remove (self->priv->batch_timeout);
+  self->priv->batch_timeout = 0;
 
   if (self->priv->received)
     g_queue_free_full (self->priv->received, (GDestroyNotify)g_bytes_unref);
@@ -515,9 +1189,31 @@ cockpit_channel_finalize (GObject *object)
   if (self->priv->close_options)
     json_object_unref (self->priv->close_options);
 
+  if (self->priv->batched)
+    g_byte_array_unref (self->priv->batched);
+  if (self->priv->partial)
+    g_byte_array_unref (self->priv->partial);
+  if (self->priv->incomplete)
+    g_bytes_unref (self->priv->incomplete);
+  if (self->priv->held)
+    g_queue_free_full (self->priv->held, (GDestroyNotify)g_bytes_unref);
+
   g_strfreev (self->priv->capabilities);
   g_free (self->priv->id);
 
+  if (self->priv->stats)
+    cockpit_stats_add (self->priv->stats, COCKPIT_STAT_CHANNEL_OPEN, -1);
+  if (self->priv->group)
+    {
+      cockpit_stats_add (self->priv->group, COCKPIT_STAT_GROUP_CHANNELS, -1);
+      cockpit_stats_add (self->priv->group, COCKPIT_STAT_GROUP_QUEUED, -(gssize)self->priv->held_size);
+    }
+  if (self->priv->trace)
+    cockpit_trace_unref (self->priv->trace);
+
+  /* Whatever the channel held on to may be worth giving back */
+  cockpit_memory_idle ();
+
   G_OBJECT_CLASS (cockpit_channel_parent_class)->finalize (object);
 }
 
@@ -531,6 +1227,12 @@ cockpit_channel_real_close (CockpitChannel *self,
   if (self->priv->sent_close)
     return;
 
+  /* Anything batched or held goes out before the close message */
+  flush_partial (self);
+  flush_batched (self);
+  flush_incomplete (self);
+  flush_held (self, TRUE);
+
   self->priv->sent_close = TRUE;
 
   if (!self->priv->transport_closed)
@@ -539,20 +1241,22 @@ cockpit_channel_real_close (CockpitChannel *self,
         {
           object = self->priv->close_options;
           self->priv->close_options = NULL;
+
+          json_object_set_string_member (object, "command", "close");
+          json_object_set_string_member (object, "channel", self->priv->id);
+          if (problem)
+            json_object_set_string_member (object, "problem", problem);
+
+          message = cockpit_json_write_bytes (object);
+          json_object_unref (object);
         }
       else
         {
-          object = json_object_new ();
+          message = cockpit_transport_build_control ("command", "close",
+                                                     "channel", self->priv->id,
+                                                     "problem", problem, NULL);
         }
 
-      json_object_set_string_member (object, "command", "close");
-      json_object_set_string_member (object, "channel", self->priv->id);
-      if (problem)
-        json_object_set_string_member (object, "problem", problem);
-
-      message = cockpit_json_write_bytes (object);
-      json_object_unref (object);
-
       cockpit_transport_send (self->priv->transport, NULL, message);
       g_bytes_unref (message);
     }
@@ -676,17 +1380,10 @@ cockpit_channel_close (CockpitChannel *self,
   g_return_if_fail (COCKPIT_IS_CHANNEL (self));
 
   /* No further messages should be received */
-  if (self->priv->recv_sig)
-    g_signal_handler_disconnect (self->priv->transport, self->priv->recv_sig);
-  self->priv->recv_sig = 0;
+  router_remove (self);
+  transport_list_remove (self);
 
-  if (self->priv->control_sig)
-    g_signal_handler_disconnect (self->priv->transport, self->priv->control_sig);
-  self->priv->control_sig = 0;
-
-  if (self->priv->close_sig)
-    g_signal_handler_disconnect (self->priv->transport, self->priv->close_sig);
-  self->priv->close_sig = 0;
+  COCKPIT_PROBE2 (channel_close, self->priv->id, problem);
 
   klass = COCKPIT_CHANNEL_GET_CLASS (self);
   g_assert (klass->close != NULL);
@@ -694,6 +1391,28 @@ cockpit_channel_close (CockpitChannel *self,
   (klass->close) (self, problem);
 }
 
+/**
+ * cockpit_channel_kill:
+ * @self: a channel
+ * @problem: the problem
+ *
+ * Close the channel without sending anything more for it, not even a
+ * "close" message. This is used when the other end has already
+ * forgotten about the channel, such as after a "kill" command.
+ *
+ * The channel still emits the CockpitChannel::closed signal.
+ */
+void
+cockpit_channel_kill (CockpitChannel *self,
+                      const gchar *problem)
+{
+  g_return_if_fail (COCKPIT_IS_CHANNEL (self));
+
+  self->priv->transport_closed = TRUE;
+  if (!self->priv->emitted_close)
+    cockpit_channel_close (self, problem);
+}
+
 /* Used by implementations */
 
 /**
@@ -716,6 +1435,9 @@ cockpit_channel_ready (CockpitChannel *self)
   GBytes *decoded;
   GBytes *payload;
   GQueue *queue;
+  gsize size;
+
+  COCKPIT_PROBE1 (channel_ready, self->priv->id);
 
   klass = COCKPIT_CHANNEL_GET_CLASS (self);
   g_assert (klass->recv != NULL);
@@ -731,6 +1453,7 @@ cockpit_channel_ready (CockpitChannel *self)
           payload = g_queue_pop_head (queue);
           if (payload == NULL)
             break;
+          size = g_bytes_get_size (payload);
           if (self->priv->base64_encoding)
             {
               decoded = base64_decode (payload);
@@ -738,6 +1461,7 @@ cockpit_channel_ready (CockpitChannel *self)
               payload = decoded;
             }
           (klass->recv) (self, payload);
+          send_ack (self, size);
           g_bytes_unref (payload);
         }
       g_queue_free (queue);
@@ -746,6 +1470,12 @@ cockpit_channel_ready (CockpitChannel *self)
   cockpit_channel_control (self, "ready", NULL);
   self->priv->ready = TRUE;
 
+  if (self->priv->trace)
+    cockpit_trace_mark (self->priv->trace, "bridge-ready");
+
+  cockpit_stats_add (self->priv->stats, COCKPIT_STAT_CHANNEL_READY_TIME,
+                     (g_get_monotonic_time () - self->priv->opened) / 1000);
+
   /* No more data coming? */
   if (self->priv->received_done)
     {
@@ -766,30 +1496,146 @@ cockpit_channel_ready (CockpitChannel *self)
  * on the right channel.
  *
  * This message is queued, and sent once the transport can.
+ *
+ * If the "batch" option is set for the channel, small payloads are
+ * held back and sent together once at least that many bytes have
+ * accumulated, or after "latency" milliseconds. Only use this for
+ * payloads where message boundaries are not significant.
+ *
+ * If the "framing" option is set, payloads are cut at record boundaries
+ * so that each message sent contains only whole records.
  */
 void
 cockpit_channel_send (CockpitChannel *self,
                       GBytes *payload,
                       gboolean trust_is_utf8)
 {
-  GBytes *encoded = NULL;
-  GBytes *validated = NULL;
+  GBytes *framed;
+  gboolean joined;
 
-  if (!trust_is_utf8)
+  if (self->priv->framing == FRAMING_NONE)
     {
-      if (!self->priv->binary_ok)
-        payload = validated = cockpit_unicode_force_utf8 (payload);
+      send_framed (self, payload, trust_is_utf8);
+      return;
     }
 
-  if (self->priv->base64_encoding)
-    payload = encoded = base64_encode (payload);
+  /* Held back data may not have been valid UTF-8 */
+  joined = self->priv->partial != NULL;
+  framed = frame_records (self, payload);
+  if (framed)
+    {
+      send_framed (self, framed, trust_is_utf8 && !joined);
+      g_bytes_unref (framed);
+    }
+}
 
-  cockpit_transport_send (self->priv->transport, self->priv->id, payload);
+static void
+send_framed (CockpitChannel *self,
+             GBytes *payload,
+             gboolean trust_is_utf8)
+{
+  gconstpointer data;
+  gsize length;
 
-  if (encoded)
-    g_bytes_unref (encoded);
-  if (validated)
-    g_bytes_unref (validated);
+  if (self->priv->batch <= 0 && !self->priv->batched)
+    {
+      send_payload (self, payload, trust_is_utf8);
+      return;
+    }
+
+  data = g_bytes_get_data (payload, &length);
+
+  /* Large payloads with nothing pending need not be copied */
+  if (!self->priv->batched && (gint64)length >= self->priv->batch)
+    {
+      send_payload (self, payload, trust_is_utf8);
+      return;
+    }
+
+  if (!self->priv->batched)
+    {
+      self->priv->batched = g_byte_array_new ();
+      self->priv->batched_utf8 = TRUE;
+    }
+
+  g_byte_array_append (self->priv->batched, data, length);
+  if (!trust_is_utf8)
+    self->priv->batched_utf8 = FALSE;
+
+  if (self->priv->batched->len >= self->priv->batch)
+    flush_batched (self);
+  else if (!self->priv->batch_timeout)
+    self->priv->batch_timeout = g_timeout_add (self->priv->latency, on_batch_timeout, self);
+}
+
+/**
+ * cockpit_channel_hold_incomplete:
+ * @self: a channel
+ * @hold: whether to hold back split characters
+ *
+ * Called by implementations that send a stream read in arbitrary
+ * blocks. A UTF-8 character cut off at the end of a send is held back
+ * and sent with the next one, rather than being replaced. If nothing
+ * follows within the "latency" it is sent as is, and replaced.
+ */
+void
+cockpit_channel_hold_incomplete (CockpitChannel *self,
+                                 gboolean hold)
+{
+  g_return_if_fail (COCKPIT_IS_CHANNEL (self));
+  self->priv->hold_incomplete = hold;
+  if (!hold)
+    flush_incomplete (self);
+}
+
+/**
+ * cockpit_channel_splice:
+ * @self: a channel
+ * @fd: file descriptor to take the payload from
+ * @max: the most bytes to send
+ *
+ * Called by implementations to send data that can be read from @fd
+ * without copying it through user space. This only works for binary
+ * channels without batching, with room in the window, and on a
+ * transport that supports cockpit_transport_splice().
+ *
+ * Returns: the number of bytes sent, zero at the end of @fd, or -1
+ *     with errno set. When errno is ENOTSUP the data should be read
+ *     and sent with cockpit_channel_send() instead.
+ */
+gssize
+cockpit_channel_splice (CockpitChannel *self,
+                        gint fd,
+                        gsize max)
+{
+  gssize ret;
+
+  g_return_val_if_fail (COCKPIT_IS_CHANNEL (self), -1);
+
+  /* Anything that needs to look at or hold on to the payload */
+  if (!self->priv->binary_ok || self->priv->base64_encoding ||
+      self->priv->batch > 0 || self->priv->batched || self->priv->incomplete ||
+      self->priv->framing != FRAMING_NONE ||
+      self->priv->held || self->priv->transport_closed)
+    {
+      errno = ENOTSUP;
+      return -1;
+    }
+
+  if (self->priv->window > 0)
+    {
+      if (self->priv->unacked >= self->priv->window)
+        {
+          errno = ENOTSUP;
+          return -1;
+        }
+      max = MIN (max, self->priv->window - self->priv->unacked);
+    }
+
+  ret = cockpit_transport_splice (self->priv->transport, self->priv->id, fd, max);
+  if (ret > 0)
+    self->priv->unacked += ret;
+  return ret;
 }
 
 /**
@@ -854,11 +1700,10 @@ cockpit_channel_prepare (CockpitChannel *self)
 
   g_return_if_fail (COCKPIT_IS_CHANNEL (self));
 
-  if (!self->priv->prepare_tag)
+  if (!self->priv->prepare_link)
     return;
 
-  g_source_remove (self->priv->prepare_tag);
-  self->priv->prepare_tag = 0;
+  cancel_prepare (self);
 
   if (!self->priv->emitted_close)
     {
@@ -893,6 +1738,14 @@ cockpit_channel_control (CockpitChannel *self,
   g_return_if_fail (COCKPIT_IS_CHANNEL (self));
   g_return_if_fail (command != NULL);
 
+  /*
+   * Keep the control message ordered after any batched data. Data held
+   * for the window goes too, rather than holding up the message.
+   */
+  flush_batched (self);
+  flush_incomplete (self);
+  flush_held (self, TRUE);
+
   if (g_str_equal (command, "done"))
     {
       g_return_if_fail (self->priv->sent_done == FALSE);
@@ -900,15 +1753,19 @@ cockpit_channel_control (CockpitChannel *self,
     }
 
   if (options)
-    object = json_object_ref (options);
+    {
+      object = json_object_ref (options);
+      json_object_set_string_member (object, "command", command);
+      json_object_set_string_member (object, "channel", self->priv->id);
+      message = cockpit_json_write_bytes (object);
+      json_object_unref (object);
+    }
   else
-    object = json_object_new ();
-
-  json_object_set_string_member (object, "command", command);
-  json_object_set_string_member (object, "channel", self->priv->id);
-
-  message = cockpit_json_write_bytes (object);
-  json_object_unref (object);
+    {
+      /* The usual "ready" and "done" don't need a JsonObject */
+      message = cockpit_transport_build_control ("command", command,
+                                                 "channel", self->priv->id, NULL);
+    }
 
   cockpit_transport_send (self->priv->transport, NULL, message);
   g_bytes_unref (message);
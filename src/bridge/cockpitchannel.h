@@ -66,6 +66,9 @@ struct _CockpitChannelClass
 
   void        (* close)       (CockpitChannel *channel,
                                const gchar *problem);
+
+  void        (* pressure)    (CockpitChannel *channel,
+                               gboolean pressure);
 };
 
 GType               cockpit_channel_get_type          (void) G_GNUC_CONST;
@@ -73,6 +76,9 @@ GType               cockpit_channel_get_type          (void) G_GNUC_CONST;
 void                cockpit_channel_close             (CockpitChannel *self,
                                                        const gchar *problem);
 
+void                cockpit_channel_kill              (CockpitChannel *self,
+                                                       const gchar *problem);
+
 const gchar *       cockpit_channel_get_id            (CockpitChannel *self);
 
 /* Used by implementations */
@@ -89,6 +95,13 @@ void                cockpit_channel_send              (CockpitChannel *self,
                                                        GBytes *payload,
                                                        gboolean valid_utf8);
 
+void                cockpit_channel_hold_incomplete   (CockpitChannel *self,
+                                                       gboolean hold);
+
+gssize              cockpit_channel_splice            (CockpitChannel *self,
+                                                       gint fd,
+                                                       gsize max);
+
 JsonObject *        cockpit_channel_get_options       (CockpitChannel *self);
 
 JsonObject *        cockpit_channel_close_options     (CockpitChannel *self);
@@ -20,8 +20,9 @@
 #include "config.h"
 
 #include "cockpitcpusamples.h"
+#include "cockpitprocreader.h"
 
-#include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 
 gint cockpit_cpu_user_hz = -1;
@@ -41,61 +42,85 @@ ensure_user_hz (void)
   return cockpit_cpu_user_hz;
 }
 
-/* TODO: this should be optimized so we don't allocate memory and call open()/close() all the time */
-
+/*
+ * The per CPU lines are only parsed when @cores is set. The instance
+ * names point into the reader's buffer, so nothing is allocated.
+ */
 void
-cockpit_cpu_samples (CockpitSamples *samples)
+cockpit_cpu_samples (CockpitSamples *samples,
+                     gboolean cores)
 {
-  gchar *contents = NULL;
-  GError *error = NULL;
-  gchar **lines = NULL;
+  static CockpitProcReader reader = COCKPIT_PROC_READER_INIT ("/proc/stat");
+  gchar *contents;
+  gchar *line;
+  gchar *name;
+  gchar *pos;
   guint64 user_hz;
-  gsize len;
+  guint64 values[8];
   guint n;
+  gint i;
 
-  if (!g_file_get_contents ("/proc/stat", &contents, &len, &error))
-    {
-      g_message ("error loading contents /proc/stat: %s", error->message);
-      g_error_free (error);
-      goto out;
-    }
+  contents = cockpit_proc_reader_read (&reader, NULL);
+  if (!contents)
+    return;
+
+  user_hz = ensure_user_hz ();
 
   /* see 'man proc' for the format of /proc/stat */
 
-  lines = g_strsplit (contents, "\n", -1);
-  for (n = 0; lines != NULL && lines[n] != NULL; n++)
+  for (n = 0; (line = cockpit_proc_next_line (&contents)) != NULL; n++)
     {
-      const gchar *line = lines[n];
-      guint64 user;
-      guint64 nice;
-      guint64 system;
-      guint64 idle;
-      guint64 iowait;
-
-      if (!(g_str_has_prefix (line, "cpu ")))
-        continue;
-
-      #define FMT64 "%" G_GUINT64_FORMAT " "
-      if (sscanf (line + sizeof ("cpu ") - 1, FMT64 FMT64 FMT64 FMT64 FMT64,
-                  &user,
-                  &nice,
-                  &system,
-                  &idle,
-                  &iowait) != 5)
+      if (strncmp (line, "cpu", 3) != 0)
         {
-          g_warning ("Error parsing line %d of /proc/stat with content `%s'", n, line);
+          /* The cpu lines are all at the start */
+          if (n > 0)
+            break;
           continue;
         }
 
-      user_hz = ensure_user_hz ();
-      cockpit_samples_sample (samples, "cpu.basic.nice", NULL, nice*1000/user_hz);
-      cockpit_samples_sample (samples, "cpu.basic.user", NULL, user*1000/user_hz);
-      cockpit_samples_sample (samples, "cpu.basic.system", NULL, system*1000/user_hz);
-      cockpit_samples_sample (samples, "cpu.basic.iowait", NULL, iowait*1000/user_hz);
-      break;
-    }
+      pos = line;
+      name = cockpit_proc_next_word (&pos);
+
+      /* user nice system idle iowait irq softirq steal */
+      memset (values, 0, sizeof (values));
+      for (i = 0; i < G_N_ELEMENTS (values); i++)
+        {
+          if (!cockpit_proc_next_u64 (&pos, values + i))
+            break;
+        }
+
+      if (g_str_equal (name, "cpu"))
+        {
+          if (i < 5)
+            {
+              g_warning ("Error parsing line %d of /proc/stat", n);
+              continue;
+            }
 
-out:
-  g_strfreev (lines);
-  g_free (contents);
+          cockpit_samples_sample (samples, "cpu.basic.nice", NULL, values[1]*1000/user_hz);
+          cockpit_samples_sample (samples, "cpu.basic.user", NULL, values[0]*1000/user_hz);
+          cockpit_samples_sample (samples, "cpu.basic.system", NULL, values[2]*1000/user_hz);
+          cockpit_samples_sample (samples, "cpu.basic.iowait", NULL, values[4]*1000/user_hz);
+
+          if (!cores)
+            break;
+        }
+      else if (cores)
+        {
+          if (i < 5)
+            {
+              g_warning ("Error parsing line %d of /proc/stat", n);
+              continue;
+            }
+
+          /* Fields that older kernels don't have stay at zero */
+          cockpit_samples_sample (samples, "cpu.core.user", name, values[0]*1000/user_hz);
+          cockpit_samples_sample (samples, "cpu.core.nice", name, values[1]*1000/user_hz);
+          cockpit_samples_sample (samples, "cpu.core.system", name, values[2]*1000/user_hz);
+          cockpit_samples_sample (samples, "cpu.core.iowait", name, values[4]*1000/user_hz);
+          cockpit_samples_sample (samples, "cpu.core.irq", name, values[5]*1000/user_hz);
+          cockpit_samples_sample (samples, "cpu.core.softirq", name, values[6]*1000/user_hz);
+          cockpit_samples_sample (samples, "cpu.core.steal", name, values[7]*1000/user_hz);
+        }
+    }
 }
@@ -24,7 +24,8 @@
 
 G_BEGIN_DECLS
 
-void            cockpit_cpu_samples         (CockpitSamples *samples);
+void            cockpit_cpu_samples         (CockpitSamples *samples,
+                                             gboolean cores);
 
 
 G_END_DECLS
@@ -24,10 +24,32 @@
 #include "cockpitdbusrules.h"
 #include "cockpitpaths.h"
 
+#include "common/cockpitmemory.h"
+
+#include <errno.h>
 #include <string.h>
 
 #define DEBUG_BATCHES 0
 
+/* Values up to this size are interned, and only so many of them */
+#define INTERN_VALUE_SIZE 16
+#define INTERN_VALUE_MAX 4096
+
+/* Most GetAll() calls in flight at once, dbus-daemon allows 128 pending replies */
+#define GET_ALL_WINDOW 64
+
+/* How long to wait after an introspection before writing it to disk */
+#define DISK_SAVE_DELAY 5
+
+/* Larger updates are emitted in pieces of this many paths */
+#define UPDATE_CHUNK_PATHS 200
+
+enum {
+  DISK_NONE = 0,
+  DISK_LOADING,
+  DISK_READY
+};
+
 /*
  * This is a cache of properties which tracks updates. The best way to do
  * this is via ObjectManager. But it also does introspection and uses that
@@ -42,11 +64,20 @@
  * Also information about an interface will be available before we notify
  * about properties on an interface. This is a further ordering guarantee.
  *
+ * A large batch, like the GetManagedObjects() reply of a manager with
+ * thousands of objects, is emitted as several updates, one per main loop
+ * iteration, so the first ones reach the peer early. Barriers and later
+ * batches wait until the last of them has gone out.
+ *
  * Since there are lots of strings, to help with allocation churn, we have our
  * own string intern table, where path, interface and property names are
  * stored while the cache is active. Each time we get a path etc. from an
  * external source source (such as GVariant) and we know we'll need it later
  * then we intern it, so it sticks around.
+ *
+ * Small property values are interned too. Lots of objects have the same
+ * booleans, zeros and short strings, and that way they share one GVariant
+ * instead of each holding on to a piece of its own GetAll() reply.
  */
 
 struct _CockpitDBusCache {
@@ -68,12 +99,29 @@ struct _CockpitDBusCache {
   GHashTable *introsent;
   GList *trash;
 
+  /* Introspection data kept on disk between runs */
+  gint disk_state;
+  gchar *disk_path;
+  gchar *disk_identity;
+  GHashTable *disk;
+  GHashTable *disk_checked;
+  guint disk_save;
+
   /* The main data cache: paths > interfaces -> properties -> values */
   GHashTable *cache;
 
   /* The paths and interfaces we should watch */
   CockpitDBusRules *rules;
 
+  /* GetAll() calls waiting for a slot, and paths asked for by name */
+  GQueue *get_alls;
+  GQueue *get_alls_priority;
+  GHashTable *priority;
+  guint get_all_flight;
+  guint get_all_peak;
+  guint get_all_count;
+  gint64 get_all_time;
+
   /* Accumulated information about these various paths */
   GTree *managed;
 
@@ -87,9 +135,12 @@ struct _CockpitDBusCache {
   GQueue *barriers;
   guint number;
   GHashTable *update;
+  GQueue *chunks;
+  guint chunks_idle;
 
-  /* Interned strings */
+  /* Interned strings and small values */
   GHashTable *interned;
+  GHashTable *values;
 };
 
 enum {
@@ -129,6 +180,32 @@ intern_string (CockpitDBusCache *self,
   return interned;
 }
 
+static GVariant *
+intern_value (CockpitDBusCache *self,
+              GVariant *value)
+{
+  GVariant *interned;
+
+  /* g_variant_hash() only works on basic types */
+  if (!g_variant_type_is_basic (g_variant_get_type (value)) ||
+      g_variant_get_size (value) > INTERN_VALUE_SIZE)
+    return value;
+
+  interned = g_hash_table_lookup (self->values, value);
+  if (interned)
+    {
+      g_variant_ref (interned);
+      g_variant_unref (value);
+      return interned;
+    }
+
+  /* Don't let ever changing values grow this without bound */
+  if (g_hash_table_size (self->values) < INTERN_VALUE_MAX)
+    g_hash_table_add (self->values, g_variant_ref (value));
+
+  return value;
+}
+
 typedef struct {
   guint number;
   CockpitDBusBarrierFunc callback;
@@ -150,6 +227,10 @@ barrier_progress (CockpitDBusCache *self)
   BarrierData *barrier;
   BatchData *batch;
 
+  /* Still emitting the pieces of an earlier update */
+  if (self->chunks_idle)
+    return;
+
   batch = g_queue_peek_head (self->batches);
 
   for (;;)
@@ -208,6 +289,69 @@ batch_free (BatchData *batch)
   g_slice_free (BatchData, batch);
 }
 
+static void batch_progress (CockpitDBusCache *self);
+
+static gboolean
+on_chunks_idle (gpointer user_data)
+{
+  CockpitDBusCache *self = user_data;
+  GHashTable *update;
+
+  update = g_queue_pop_head (self->chunks);
+  g_signal_emit (self, signal_update, 0, update);
+  g_hash_table_unref (update);
+
+  if (!g_queue_is_empty (self->chunks))
+    return TRUE;
+
+  self->chunks_idle = 0;
+  batch_progress (self);
+  barrier_progress (self);
+  return FALSE;
+}
+
+/*
+ * Emits the first UPDATE_CHUNK_PATHS paths of the update, and queues
+ * the rest to go out from an idle handler.
+ */
+static void
+emit_update (CockpitDBusCache *self,
+             GHashTable *update)
+{
+  GHashTableIter iter;
+  GHashTable *chunk;
+  gpointer path;
+  gpointer interfaces;
+
+  if (g_hash_table_size (update) <= UPDATE_CHUNK_PATHS)
+    {
+      g_signal_emit (self, signal_update, 0, update);
+      return;
+    }
+
+  chunk = NULL;
+  g_hash_table_iter_init (&iter, update);
+  while (g_hash_table_iter_next (&iter, &path, &interfaces))
+    {
+      if (!chunk || g_hash_table_size (chunk) >= UPDATE_CHUNK_PATHS)
+        {
+          chunk = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                         NULL, hash_table_unref_or_null);
+          g_queue_push_tail (self->chunks, chunk);
+        }
+      g_hash_table_iter_steal (&iter);
+      g_hash_table_replace (chunk, path, interfaces);
+    }
+
+  g_debug ("%s: emitting update in %u pieces", self->logname, g_queue_get_length (self->chunks));
+
+  chunk = g_queue_pop_head (self->chunks);
+  g_signal_emit (self, signal_update, 0, chunk);
+  g_hash_table_unref (chunk);
+
+  self->chunks_idle = g_idle_add (on_chunks_idle, self);
+}
+
 static void
 batch_progress (CockpitDBusCache *self)
 {
@@ -216,6 +360,10 @@ batch_progress (CockpitDBusCache *self)
 
   for (;;)
     {
+      /* The rest waits until an earlier update is out */
+      if (self->chunks_idle)
+        return;
+
       batch = g_queue_peek_head (self->batches);
 
       /*
@@ -233,7 +381,7 @@ batch_progress (CockpitDBusCache *self)
 
       if (update)
         {
-          g_signal_emit (self, signal_update, 0, update);
+          emit_update (self, update);
           g_hash_table_unref (update);
         }
 
@@ -335,14 +483,20 @@ cockpit_dbus_cache_init (CockpitDBusCache *self)
   self->rules = cockpit_dbus_rules_new ();
 
   self->introspects = g_queue_new ();
+  self->get_alls = g_queue_new ();
+  self->get_alls_priority = g_queue_new ();
+  self->priority = g_hash_table_new (g_direct_hash, g_direct_equal);
   self->introsent = g_hash_table_new (g_direct_hash, g_direct_equal);
 
   self->batches = g_queue_new ();
   self->barriers = g_queue_new ();
+  self->chunks = g_queue_new ();
 
   /* Put allocations we need to keep around, but can't handily track */
   self->trash = NULL;
   self->interned = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  self->values = g_hash_table_new_full (g_variant_hash, g_variant_equal,
+                                        (GDestroyNotify)g_variant_unref, NULL);
 }
 
 typedef struct {
@@ -357,6 +511,270 @@ typedef struct {
 static void
 introspect_next (CockpitDBusCache *self);
 
+/*
+ * Introspection data for a name is kept in the user's cache directory,
+ * so that a new bridge doesn't have to introspect every interface again.
+ * Interface data is only good for the process that provided it. So the
+ * file records the pid and start time of the name owner, and is ignored
+ * when that doesn't match. An interface that is later introspected for
+ * real is checked once against what was loaded, and replaced on disk if
+ * it changed.
+ */
+
+static gchar *
+disk_owner_identity (guint32 pid)
+{
+  gchar *identity = NULL;
+  gchar *contents = NULL;
+  gchar **fields = NULL;
+  gchar *filename;
+  gchar *pos;
+
+  filename = g_strdup_printf ("/proc/%u/stat", (guint)pid);
+  if (!g_file_get_contents (filename, &contents, NULL, NULL))
+    goto out;
+
+  /* The process name can contain anything, skip past it */
+  pos = strrchr (contents, ')');
+  if (!pos)
+    goto out;
+
+  /* The start time is field 22, and the field after the name is 3 */
+  fields = g_strsplit (pos + 1, " ", 0);
+  if (g_strv_length (fields) > 20 && fields[20][0])
+    identity = g_strdup_printf ("%u %s", (guint)pid, fields[20]);
+
+out:
+  g_strfreev (fields);
+  g_free (contents);
+  g_free (filename);
+  return identity;
+}
+
+static void
+disk_load (CockpitDBusCache *self)
+{
+  GDBusAnnotationInfo **annotations;
+  GDBusNodeInfo *node = NULL;
+  GError *error = NULL;
+  gchar *contents = NULL;
+  const gchar *identity;
+  guint i;
+
+  if (!g_file_get_contents (self->disk_path, &contents, NULL, &error))
+    {
+      if (!g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        g_message ("%s: couldn't read introspection cache: %s", self->logname, error->message);
+      goto out;
+    }
+
+  node = g_dbus_node_info_new_for_xml (contents, &error);
+  if (!node)
+    {
+      g_message ("%s: couldn't parse introspection cache: %s", self->logname, error->message);
+      goto out;
+    }
+
+  annotations = node->annotations;
+  identity = g_dbus_annotation_info_lookup (annotations, "org.cockpit_project.Owner");
+  if (g_strcmp0 (identity, self->disk_identity) != 0)
+    {
+      g_debug ("%s: introspection cache is for another owner", self->logname);
+      goto out;
+    }
+
+  for (i = 0; node->interfaces && node->interfaces[i]; i++)
+    {
+      if (node->interfaces[i]->name)
+        {
+          g_hash_table_replace (self->disk, node->interfaces[i]->name,
+                                g_dbus_interface_info_ref (node->interfaces[i]));
+        }
+    }
+
+  g_debug ("%s: loaded %u interfaces from introspection cache",
+           self->logname, g_hash_table_size (self->disk));
+
+out:
+  g_clear_error (&error);
+  if (node)
+    g_dbus_node_info_unref (node);
+  g_free (contents);
+}
+
+static void
+disk_write (CockpitDBusCache *self)
+{
+  GError *error = NULL;
+  GHashTableIter iter;
+  GDBusInterfaceInfo *iface;
+  gchar *directory;
+  gchar *escaped;
+  GString *out;
+
+  out = g_string_new ("<node>\n");
+  escaped = g_markup_printf_escaped ("  <annotation name=\"org.cockpit_project.Owner\" value=\"%s\"/>\n",
+                                     self->disk_identity);
+  g_string_append (out, escaped);
+  g_free (escaped);
+
+  g_hash_table_iter_init (&iter, self->disk);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&iface))
+    g_dbus_interface_info_generate_xml (iface, 2, out);
+  g_string_append (out, "</node>\n");
+
+  directory = g_path_get_dirname (self->disk_path);
+  if (g_mkdir_with_parents (directory, 0700) < 0)
+    {
+      g_message ("%s: couldn't create directory: %s: %s", self->logname,
+                 directory, g_strerror (errno));
+    }
+  else if (!g_file_set_contents (self->disk_path, out->str, out->len, &error))
+    {
+      g_message ("%s: couldn't write introspection cache: %s", self->logname, error->message);
+      g_error_free (error);
+    }
+  else
+    {
+      g_debug ("%s: wrote %u interfaces to introspection cache",
+               self->logname, g_hash_table_size (self->disk));
+    }
+
+  g_free (directory);
+  g_string_free (out, TRUE);
+}
+
+static gboolean
+on_disk_save (gpointer user_data)
+{
+  CockpitDBusCache *self = user_data;
+  self->disk_save = 0;
+  disk_write (self);
+  return FALSE;
+}
+
+static gboolean
+interface_info_equal (GDBusInterfaceInfo *one,
+                      GDBusInterfaceInfo *two)
+{
+  GString *a = g_string_new ("");
+  GString *b = g_string_new ("");
+  gboolean ret;
+
+  g_dbus_interface_info_generate_xml (one, 0, a);
+  g_dbus_interface_info_generate_xml (two, 0, b);
+  ret = g_string_equal (a, b);
+
+  g_string_free (a, TRUE);
+  g_string_free (b, TRUE);
+  return ret;
+}
+
+static void
+disk_remember (CockpitDBusCache *self,
+               GDBusInterfaceInfo *iface)
+{
+  GDBusInterfaceInfo *prev;
+
+  if (self->disk_state != DISK_READY)
+    return;
+
+  /* Each interface is only checked once */
+  if (g_hash_table_lookup (self->disk_checked, iface->name))
+    return;
+
+  g_hash_table_add (self->disk_checked, (gchar *)intern_string (self, iface->name));
+
+  prev = g_hash_table_lookup (self->disk, iface->name);
+  if (prev && interface_info_equal (prev, iface))
+    return;
+
+  if (prev)
+    g_debug ("%s: introspection cache of %s is out of date", self->logname, iface->name);
+
+  g_hash_table_replace (self->disk, iface->name, g_dbus_interface_info_ref (iface));
+
+  if (!self->disk_save)
+    self->disk_save = g_timeout_add_seconds (DISK_SAVE_DELAY, on_disk_save, self);
+}
+
+static GDBusInterfaceInfo *
+lookup_introspected (CockpitDBusCache *self,
+                     const gchar *interface)
+{
+  GDBusInterfaceInfo *iface;
+
+  iface = g_hash_table_lookup (self->introspected, interface);
+  if (!iface && self->disk)
+    {
+      iface = g_hash_table_lookup (self->disk, interface);
+      if (iface)
+        {
+          g_debug ("%s: using cached introspection of %s", self->logname, interface);
+          g_hash_table_replace (self->introspected, iface->name, g_dbus_interface_info_ref (iface));
+        }
+    }
+
+  return iface;
+}
+
+static void
+on_disk_owner_pid (GObject *source,
+                   GAsyncResult *result,
+                   gpointer user_data)
+{
+  CockpitDBusCache *self = user_data;
+  GError *error = NULL;
+  GVariant *retval;
+  guint32 pid;
+  gchar *checksum;
+  gchar *filename;
+
+  retval = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source), result, &error);
+
+  if (g_cancellable_is_cancelled (self->cancellable))
+    {
+      g_clear_error (&error);
+      if (retval)
+        g_variant_unref (retval);
+      g_object_unref (self);
+      return;
+    }
+
+  self->disk_state = DISK_NONE;
+
+  if (error)
+    {
+      g_debug ("%s: couldn't get owner process: %s", self->logname, error->message);
+      g_error_free (error);
+    }
+  else
+    {
+      g_variant_get (retval, "(u)", &pid);
+      g_variant_unref (retval);
+
+      self->disk_identity = disk_owner_identity (pid);
+      if (self->disk_identity)
+        {
+          checksum = g_compute_checksum_for_string (G_CHECKSUM_SHA1, self->name, -1);
+          filename = g_strconcat (checksum, ".xml", NULL);
+          self->disk_path = g_build_filename (g_get_user_cache_dir (), "cockpit", "dbus", filename, NULL);
+          g_free (filename);
+          g_free (checksum);
+
+          self->disk = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                              (GDestroyNotify)g_dbus_interface_info_unref);
+          self->disk_checked = g_hash_table_new (g_str_hash, g_str_equal);
+          self->disk_state = DISK_READY;
+          disk_load (self);
+        }
+    }
+
+  /* Introspection waits for the above */
+  introspect_next (self);
+  g_object_unref (self);
+}
+
 static void
 scrape_variant (CockpitDBusCache *self,
                 BatchData *batch,
@@ -506,26 +924,41 @@ introspect_next (CockpitDBusCache *self)
 {
   IntrospectData *id;
 
-  id = g_queue_peek_head (self->introspects);
-  if (id && !id->introspecting)
+  for (;;)
     {
+      id = g_queue_peek_head (self->introspects);
+      if (!id || id->introspecting)
+        return;
+
       if (g_cancellable_is_cancelled (self->cancellable))
         {
           g_queue_pop_head (self->introspects);
           introspect_complete (self, id);
+          return;
         }
-      else
+
+      /* See on_disk_owner_pid() */
+      if (self->disk_state == DISK_LOADING)
+        return;
+
+      /* May have been found on disk since this was queued */
+      if (id->interface && lookup_introspected (self, id->interface))
         {
-          g_debug ("%s: calling Introspect() on %s", self->logname, id->path);
-
-          id->introspecting = TRUE;
-          g_dbus_connection_call (self->connection, self->name, id->path,
-                                  "org.freedesktop.DBus.Introspectable", "Introspect",
-                                  g_variant_new ("()"), G_VARIANT_TYPE ("(s)"),
-                                  G_DBUS_CALL_FLAGS_NONE, -1,
-                                  self->cancellable, on_introspect_reply,
-                                  g_object_ref (self));
+          g_queue_pop_head (self->introspects);
+          introspect_complete (self, id);
+          continue;
         }
+
+      g_debug ("%s: calling Introspect() on %s", self->logname, id->path);
+
+      id->introspecting = TRUE;
+      g_dbus_connection_call (self->connection, self->name, id->path,
+                              "org.freedesktop.DBus.Introspectable", "Introspect",
+                              g_variant_new ("()"), G_VARIANT_TYPE ("(s)"),
+                              G_DBUS_CALL_FLAGS_NONE, -1,
+                              self->cancellable, on_introspect_reply,
+                              g_object_ref (self));
+      return;
     }
 }
 
@@ -602,7 +1035,7 @@ introspect_maybe (CockpitDBusCache *self,
   g_assert (path);
   g_assert (interface);
 
-  iface = g_hash_table_lookup (self->introspected, interface);
+  iface = lookup_introspected (self, interface);
   if (iface)
     {
       (callback) (self, iface, user_data);
@@ -757,7 +1190,7 @@ process_value (CockpitDBusCache *self,
   GVariant *value;
   gpointer key;
 
-  value = g_variant_get_variant (variant);
+  value = intern_value (self, g_variant_get_variant (variant));
 
   if (g_hash_table_lookup_extended (properties, property, &key, &prev))
     {
@@ -1191,6 +1624,12 @@ on_manager_signal (GDBusConnection *connection,
     }
 }
 
+static gsize
+report_memory (gpointer user_data)
+{
+  return cockpit_dbus_cache_get_memory (user_data);
+}
+
 static void
 cockpit_dbus_cache_constructed (GObject *object)
 {
@@ -1198,6 +1637,8 @@ cockpit_dbus_cache_constructed (GObject *object)
 
   g_return_if_fail (self->connection != NULL);
 
+  cockpit_memory_add_reporter (COCKPIT_STAT_MEMORY_DBUS_CACHE, report_memory, self);
+
   self->subscribe_properties = g_dbus_connection_signal_subscribe (self->connection,
                                                                    self->name,
                                                                    "org.freedesktop.DBus.Properties",
@@ -1219,6 +1660,18 @@ cockpit_dbus_cache_constructed (GObject *object)
                                                                 self, NULL);
 
   self->subscribed = TRUE;
+
+  /* Only names on a bus have an owner process to go by */
+  if (self->name && g_dbus_connection_get_unique_name (self->connection))
+    {
+      self->disk_state = DISK_LOADING;
+      g_dbus_connection_call (self->connection, "org.freedesktop.DBus", "/org/freedesktop/DBus",
+                              "org.freedesktop.DBus", "GetConnectionUnixProcessID",
+                              g_variant_new ("(s)", self->name), G_VARIANT_TYPE ("(u)"),
+                              G_DBUS_CALL_FLAGS_NONE, -1,
+                              self->cancellable, on_disk_owner_pid,
+                              g_object_ref (self));
+    }
 }
 
 static void
@@ -1246,6 +1699,9 @@ cockpit_dbus_cache_set_property (GObject *obj,
     }
 }
 
+static void
+get_all_flush (CockpitDBusCache *self);
+
 static void
 cockpit_dbus_cache_dispose (GObject *object)
 {
@@ -1260,8 +1716,25 @@ cockpit_dbus_cache_dispose (GObject *object)
       self->subscribed = FALSE;
     }
 
+  if (self->disk_save)
+    {
+      g_source_remove (self->disk_save);
+      self->disk_save = 0;
+      disk_write (self);
+    }
+
+  get_all_flush (self);
   introspect_flush (self);
   batch_flush (self);
+
+  if (self->chunks_idle)
+    {
+      g_source_remove (self->chunks_idle);
+      self->chunks_idle = 0;
+    }
+  while (!g_queue_is_empty (self->chunks))
+    g_hash_table_unref (g_queue_pop_head (self->chunks));
+
   barrier_flush (self);
 
   G_OBJECT_CLASS (cockpit_dbus_cache_parent_class)->dispose (object);
@@ -1272,6 +1745,8 @@ cockpit_dbus_cache_finalize (GObject *object)
 {
   CockpitDBusCache *self = COCKPIT_DBUS_CACHE (object);
 
+  cockpit_memory_remove_reporter (report_memory, self);
+
   g_clear_object (&self->connection);
   g_object_unref (self->cancellable);
 
@@ -1283,14 +1758,26 @@ cockpit_dbus_cache_finalize (GObject *object)
 
   g_queue_free (self->batches);
   g_queue_free (self->barriers);
+  g_queue_free (self->chunks);
 
   g_queue_free (self->introspects);
+  g_queue_free (self->get_alls);
+  g_queue_free (self->get_alls_priority);
+  g_hash_table_unref (self->priority);
 
   g_hash_table_unref (self->introsent);
   g_hash_table_unref (self->introspected);
   g_hash_table_unref (self->cache);
 
+  if (self->disk)
+    g_hash_table_unref (self->disk);
+  if (self->disk_checked)
+    g_hash_table_unref (self->disk_checked);
+  g_free (self->disk_path);
+  g_free (self->disk_identity);
+
   g_hash_table_destroy (self->interned);
+  g_hash_table_destroy (self->values);
   g_list_free_full (self->trash, g_free);
 
   G_OBJECT_CLASS (cockpit_dbus_cache_parent_class)->finalize (object);
@@ -1532,8 +2019,12 @@ typedef struct {
   const gchar *path;
   GDBusInterfaceInfo *iface;
   BatchData *batch;
+  gint64 started;
 } GetAllData;
 
+static void
+get_all_next (CockpitDBusCache *self);
+
 static void
 on_get_all_reply (GObject *source,
                   GAsyncResult *result,
@@ -1544,6 +2035,11 @@ on_get_all_reply (GObject *source,
   GError *error = NULL;
   GVariant *retval;
 
+  g_assert (self->get_all_flight > 0);
+  self->get_all_flight--;
+  self->get_all_count++;
+  self->get_all_time += g_get_monotonic_time () - gad->started;
+
   retval = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source), result, &error);
   if (error)
     {
@@ -1577,10 +2073,72 @@ on_get_all_reply (GObject *source,
 
   batch_unref (self, gad->batch);
 
+  if (!g_cancellable_is_cancelled (self->cancellable))
+    get_all_next (self);
+
   g_object_unref (gad->self);
   g_slice_free (GetAllData, gad);
 }
 
+static void
+get_all_next (CockpitDBusCache *self)
+{
+  GetAllData *gad;
+  guint depth;
+
+  depth = self->get_alls->length + self->get_alls_priority->length;
+  if (depth > self->get_all_peak)
+    self->get_all_peak = depth;
+
+  while (self->get_all_flight < GET_ALL_WINDOW)
+    {
+      gad = g_queue_pop_head (self->get_alls_priority);
+      if (!gad)
+        gad = g_queue_pop_head (self->get_alls);
+      if (!gad)
+        break;
+
+      g_debug ("%s: calling GetAll() for %s at %s", self->logname, gad->iface->name, gad->path);
+
+      self->get_all_flight++;
+      gad->started = g_get_monotonic_time ();
+      g_dbus_connection_call (self->connection, self->name, gad->path,
+                              "org.freedesktop.DBus.Properties", "GetAll",
+                              g_variant_new ("(s)", gad->iface->name), G_VARIANT_TYPE ("(a{sv})"),
+                              G_DBUS_CALL_FLAGS_NONE, -1,
+                              self->cancellable, on_get_all_reply, gad);
+    }
+
+  if (self->get_all_flight == 0 && self->get_all_count > 0)
+    {
+      g_debug ("%s: %u GetAll() replies, up to %u waiting, %.1f ms on average",
+               self->logname, self->get_all_count, self->get_all_peak,
+               (self->get_all_time / 1000.0) / self->get_all_count);
+      self->get_all_count = 0;
+      self->get_all_peak = 0;
+      self->get_all_time = 0;
+    }
+}
+
+static void
+get_all_flush (CockpitDBusCache *self)
+{
+  GetAllData *gad;
+
+  for (;;)
+    {
+      gad = g_queue_pop_head (self->get_alls_priority);
+      if (!gad)
+        gad = g_queue_pop_head (self->get_alls);
+      if (!gad)
+        return;
+
+      batch_unref (self, gad->batch);
+      g_object_unref (gad->self);
+      g_slice_free (GetAllData, gad);
+    }
+}
+
 static void
 retrieve_properties (CockpitDBusCache *self,
                      BatchData *batch,
@@ -1595,19 +2153,23 @@ retrieve_properties (CockpitDBusCache *self,
   if (g_strcmp0 (iface->name, "org.freedesktop.DBus.Properties") == 0)
     return;
 
-  g_debug ("%s: calling GetAll() for %s at %s", self->logname, iface->name, path);
-
   gad = g_slice_new0 (GetAllData);
   gad->self = g_object_ref (self);
   gad->batch = batch_ref (batch);
   gad->path = path;
   gad->iface = iface;
 
-  g_dbus_connection_call (self->connection, self->name, path,
-                          "org.freedesktop.DBus.Properties", "GetAll",
-                          g_variant_new ("(s)", iface->name), G_VARIANT_TYPE ("(a{sv})"),
-                          G_DBUS_CALL_FLAGS_NONE, -1,
-                          self->cancellable, on_get_all_reply, gad);
+  /*
+   * Only so many calls go out at once, so a large tree doesn't run into
+   * the bus's limit of pending replies. Paths that were asked for by
+   * name go ahead of ones found while walking the tree.
+   */
+  if (g_hash_table_lookup (self->priority, path))
+    g_queue_push_tail (self->get_alls_priority, gad);
+  else
+    g_queue_push_tail (self->get_alls, gad);
+
+  get_all_next (self);
 }
 
 static void
@@ -1638,6 +2200,8 @@ process_introspect_node (CockpitDBusCache *self,
           continue;
         }
 
+      disk_remember (self, iface);
+
       /* Cache this interface for later use elsewhere */
       prev = g_hash_table_lookup (self->introspected, iface->name);
       if (prev)
@@ -1782,6 +2346,8 @@ cockpit_dbus_cache_watch (CockpitDBusCache *self,
   path = intern_string (self, path);
 
   namespace_path = is_namespace ? path : NULL;
+  if (!is_namespace)
+    g_hash_table_add (self->priority, (gchar *)path);
 
   if (!namespace_path)
     namespace_path = cockpit_paths_contain_or_ancestor (self->managed, path);
@@ -1829,6 +2395,165 @@ scrape_variant_paths (GVariant *data,
     }
 }
 
+/**
+ * cockpit_dbus_cache_snapshot:
+ * @self: the cache
+ * @path: the path or path namespace
+ * @is_namespace: whether @path is a namespace
+ * @interface: the interface, or %NULL for all
+ *
+ * Collects what's currently in the cache for the given watch. This is
+ * for when more than one party uses the cache, and already cached data
+ * won't be sent out again in an "update".
+ *
+ * The strings in the table belong to the cache and are only valid until
+ * the cache next changes.
+ *
+ * Returns: (transfer full): a table in the same form as "update" uses
+ */
+GHashTable *
+cockpit_dbus_cache_snapshot (CockpitDBusCache *self,
+                             const gchar *path,
+                             gboolean is_namespace,
+                             const gchar *interface)
+{
+  GHashTableIter i, j;
+  GHashTable *snapshot;
+  GHashTable *interfaces;
+  GHashTable *properties;
+  GHashTable *result;
+  const gchar *key;
+  const gchar *name;
+
+  g_return_val_if_fail (COCKPIT_IS_DBUS_CACHE (self), NULL);
+
+  if (!path)
+    {
+      path = "/";
+      is_namespace = TRUE;
+    }
+
+  snapshot = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                    NULL, hash_table_unref_or_null);
+
+  g_hash_table_iter_init (&i, self->cache);
+  while (g_hash_table_iter_next (&i, (gpointer *)&key, (gpointer *)&interfaces))
+    {
+      if (!g_str_equal (key, path) &&
+          !(is_namespace && cockpit_path_equal_or_ancestor (key, path)))
+        continue;
+
+      result = NULL;
+      g_hash_table_iter_init (&j, interfaces);
+      while (g_hash_table_iter_next (&j, (gpointer *)&name, (gpointer *)&properties))
+        {
+          if (interface && !g_str_equal (interface, name))
+            continue;
+
+          if (!result)
+            {
+              result = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                              NULL, hash_table_unref_or_null);
+              g_hash_table_replace (snapshot, (gchar *)key, result);
+            }
+
+          g_hash_table_replace (result, (gchar *)name, g_hash_table_ref (properties));
+        }
+    }
+
+  return snapshot;
+}
+
+static gsize
+estimate_table (guint size)
+{
+  guint buckets = 8;
+
+  /* GHashTable keeps a key, value and hash per bucket, and grows in powers of two */
+  while (buckets < size * 2)
+    buckets *= 2;
+  return 64 + buckets * (sizeof (gpointer) * 2 + sizeof (guint));
+}
+
+/**
+ * cockpit_dbus_cache_get_memory:
+ * @self: the cache
+ *
+ * Estimates how much memory the cached data takes. This counts the
+ * tables, values, and interned strings, but not introspection data.
+ * Values shared between properties are counted once.
+ *
+ * This walks the whole cache, so is meant for debugging, and for
+ * cockpit_memory_trim() when the bridge is idle.
+ *
+ * Returns: an estimate in bytes
+ */
+gsize
+cockpit_dbus_cache_get_memory (CockpitDBusCache *self)
+{
+  GHashTableIter i, j, k;
+  GHashTable *interfaces;
+  GHashTable *properties;
+  GHashTable *seen;
+  GVariant *value;
+  const gchar *string;
+  gsize total;
+
+  g_return_val_if_fail (COCKPIT_IS_DBUS_CACHE (self), 0);
+
+  seen = g_hash_table_new (g_direct_hash, g_direct_equal);
+  total = estimate_table (g_hash_table_size (self->cache));
+
+  g_hash_table_iter_init (&i, self->cache);
+  while (g_hash_table_iter_next (&i, NULL, (gpointer *)&interfaces))
+    {
+      total += estimate_table (g_hash_table_size (interfaces));
+      g_hash_table_iter_init (&j, interfaces);
+      while (g_hash_table_iter_next (&j, NULL, (gpointer *)&properties))
+        {
+          total += estimate_table (g_hash_table_size (properties));
+          g_hash_table_iter_init (&k, properties);
+          while (g_hash_table_iter_next (&k, NULL, (gpointer *)&value))
+            {
+              if (g_hash_table_lookup (seen, value))
+                continue;
+              g_hash_table_add (seen, value);
+
+              /* A GVariant instance is about this big, plus its data */
+              total += 64 + g_variant_get_size (value);
+            }
+        }
+    }
+
+  g_hash_table_destroy (seen);
+
+  total += estimate_table (g_hash_table_size (self->interned));
+  g_hash_table_iter_init (&i, self->interned);
+  while (g_hash_table_iter_next (&i, (gpointer *)&string, NULL))
+    total += strlen (string) + 1;
+
+  total += estimate_table (g_hash_table_size (self->values));
+
+  return total;
+}
+
+/**
+ * cockpit_dbus_cache_lookup_interface:
+ * @self: the cache
+ * @interface: the interface name
+ *
+ * Returns: (transfer none): the introspection data, or %NULL if not known
+ */
+GDBusInterfaceInfo *
+cockpit_dbus_cache_lookup_interface (CockpitDBusCache *self,
+                                     const gchar *interface)
+{
+  g_return_val_if_fail (COCKPIT_IS_DBUS_CACHE (self), NULL);
+  g_return_val_if_fail (interface != NULL, NULL);
+
+  return g_hash_table_lookup (self->introspected, interface);
+}
+
 void
 cockpit_dbus_cache_barrier (CockpitDBusCache *self,
                             CockpitDBusBarrierFunc callback,
@@ -1840,10 +2565,10 @@ cockpit_dbus_cache_barrier (CockpitDBusCache *self,
   g_return_if_fail (callback != NULL);
 
   batch = g_queue_peek_head (self->batches);
-  if (batch)
+  if (batch || self->chunks_idle)
     {
       barrier = g_slice_new0 (BarrierData);
-      barrier->number = batch->number;
+      barrier->number = batch ? batch->number : self->number;
       barrier->callback = callback;
       barrier->user_data = user_data;
       g_queue_push_tail (self->barriers, barrier);
@@ -1954,6 +2679,7 @@ cockpit_dbus_cache_poke (CockpitDBusCache *self,
 
   batch = batch_create (self);
   path = intern_string (self, path);
+  g_hash_table_add (self->priority, (gchar *)path);
 
   if (interface)
     {
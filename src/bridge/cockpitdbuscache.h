@@ -82,6 +82,16 @@ void                  cockpit_dbus_cache_introspect        (CockpitDBusCache *se
                                                             CockpitDBusIntrospectFunc callback,
                                                             gpointer user_data);
 
+GHashTable *          cockpit_dbus_cache_snapshot          (CockpitDBusCache *self,
+                                                            const gchar *path,
+                                                            gboolean is_namespace,
+                                                            const gchar *interface);
+
+GDBusInterfaceInfo *  cockpit_dbus_cache_lookup_interface  (CockpitDBusCache *self,
+                                                            const gchar *interface);
+
+gsize                 cockpit_dbus_cache_get_memory        (CockpitDBusCache *self);
+
 G_END_DECLS
 
 #endif /* __COCKPIT_DBUS_CACHE_H */
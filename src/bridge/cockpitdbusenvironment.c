@@ -79,22 +79,16 @@ generate_environment_variant (void)
 void
 cockpit_dbus_environment_startup (void)
 {
-  GDBusConnection *connection;
   GError *error = NULL;
   GVariant *variables = generate_environment_variant();
 
-  connection = cockpit_dbus_internal_server ();
-  g_return_if_fail (connection != NULL);
-
-  g_dbus_connection_register_object (connection, "/environment", &environment_interface,
-                                     &environment_vtable, variables,
-                                     (GDestroyNotify)g_variant_unref, &error);
+  cockpit_dbus_internal_register_object ("/environment", &environment_interface,
+                                         &environment_vtable, variables,
+                                         (GDestroyNotify)g_variant_unref, &error);
 
   if (error != NULL)
     {
       g_critical ("couldn't register DBus environment object: %s", error->message);
       g_error_free (error);
     }
-
-  g_object_unref (connection);
 }
@@ -152,9 +152,27 @@ static GDBusConnection *the_server = NULL;
 static GDBusConnection *the_client = NULL;
 const gchar *the_name = NULL;
 
+/* Set by cockpit_dbus_internal_startup_lazy() until first use */
+static gboolean lazy_pending = FALSE;
+static CockpitDBusInternalFunc lazy_setup = NULL;
+static gpointer lazy_data = NULL;
+static GDestroyNotify lazy_destroy = NULL;
+
+/* "path\ninterface" to DirectObject, see cockpit_dbus_internal_register_object() */
+static GHashTable *direct_objects = NULL;
+
+typedef struct {
+  GDBusInterfaceInfo *info;
+  const GDBusInterfaceVTable *vtable;
+  gpointer user_data;
+} DirectObject;
+
+static void       ensure_connections       (void);
+
 GDBusConnection *
 cockpit_dbus_internal_client (void)
 {
+  ensure_connections ();
   g_return_val_if_fail (the_client != NULL, NULL);
   return g_object_ref (the_client);
 }
@@ -168,6 +186,7 @@ cockpit_dbus_internal_name (void)
 GDBusConnection *
 cockpit_dbus_internal_server (void)
 {
+  ensure_connections ();
   g_return_val_if_fail (the_server != NULL, NULL);
   return g_object_ref (the_server);
 }
@@ -182,8 +201,8 @@ on_complete_get_result (GObject *source,
   *ret = g_object_ref (result);
 }
 
-void
-cockpit_dbus_internal_startup (gboolean interact)
+static void
+create_peer_connections (GMainContext *context)
 {
   GAsyncResult *rclient = NULL;
   GAsyncResult *rserver = NULL;
@@ -192,32 +211,15 @@ cockpit_dbus_internal_startup (gboolean interact)
   gchar *guid;
   int fds[2];
 
-  /*
-   * When in interactive mode, we allow poking and prodding our internal
-   * DBus interface. Therefore be on the session bus instead of peer-to-peer.
-   */
-  if (interact)
-    {
-      the_server = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, &error);
-      if (the_server)
-        {
-          the_name = g_dbus_connection_get_unique_name (the_server);
-          the_client = g_object_ref (the_server);
-          return;
-        }
-      else
-        {
-          g_message ("couldn't connect to session bus: %s", error->message);
-          g_clear_error (&error);
-        }
-    }
-
   if (socketpair (PF_LOCAL, SOCK_STREAM, 0, fds) < 0)
     {
       g_warning ("couldn't create loopback socket: %s", g_strerror (errno));
       return;
     }
 
+  if (context)
+    g_main_context_push_thread_default (context);
+
   io = unix_io_stream_new (fds[0]);
   guid = g_dbus_generate_guid ();
   g_dbus_connection_new (io, guid,
@@ -232,7 +234,10 @@ cockpit_dbus_internal_startup (gboolean interact)
   g_object_unref (io);
 
   while (!rserver || !rclient)
-    g_main_context_iteration (NULL, TRUE);
+    g_main_context_iteration (context, TRUE);
+
+  if (context)
+    g_main_context_pop_thread_default (context);
 
   the_server = g_dbus_connection_new_finish (rserver, &error);
   if (the_server == NULL)
@@ -253,9 +258,296 @@ cockpit_dbus_internal_startup (gboolean interact)
   g_free (guid);
 }
 
+static void
+ensure_connections (void)
+{
+  GMainContext *context;
+  gint64 started;
+
+  if (!lazy_pending)
+    return;
+  lazy_pending = FALSE;
+
+  /*
+   * We may be called from the middle of some other dispatch, such as a
+   * channel being opened. Do the handshake in a private main context so
+   * that nothing else gets dispatched underneath our caller. The
+   * internal connections are never closed, so it doesn't matter that
+   * their "closed" signal would be emitted in that context.
+   */
+  started = g_get_monotonic_time ();
+  context = g_main_context_new ();
+  create_peer_connections (context);
+  g_main_context_unref (context);
+
+  if (lazy_setup && the_server)
+    (lazy_setup) (lazy_data);
+  if (lazy_destroy)
+    (lazy_destroy) (lazy_data);
+  lazy_setup = NULL;
+  lazy_destroy = NULL;
+  lazy_data = NULL;
+
+  g_debug ("startup: internal dbus took %.1f ms on first use",
+           (g_get_monotonic_time () - started) / 1000.0);
+}
+
+/**
+ * cockpit_dbus_internal_startup_lazy:
+ * @setup: called to export objects once the connections exist
+ * @user_data: data for @setup
+ * @destroy: called to free @user_data
+ *
+ * Like cockpit_dbus_internal_startup() in non-interactive mode, except
+ * that the peer to peer connections are only set up, and @setup is only
+ * called, when cockpit_dbus_internal_client() or
+ * cockpit_dbus_internal_server() are first used.
+ */
+void
+cockpit_dbus_internal_startup_lazy (CockpitDBusInternalFunc setup,
+                                    gpointer user_data,
+                                    GDestroyNotify destroy)
+{
+  g_return_if_fail (!lazy_pending && the_server == NULL);
+
+  lazy_pending = TRUE;
+  lazy_setup = setup;
+  lazy_data = user_data;
+  lazy_destroy = destroy;
+}
+
+void
+cockpit_dbus_internal_startup (gboolean interact)
+{
+  GError *error = NULL;
+
+  /*
+   * When in interactive mode, we allow poking and prodding our internal
+   * DBus interface. Therefore be on the session bus instead of peer-to-peer.
+   */
+  if (interact)
+    {
+      the_server = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, &error);
+      if (the_server)
+        {
+          the_name = g_dbus_connection_get_unique_name (the_server);
+          the_client = g_object_ref (the_server);
+          return;
+        }
+      else
+        {
+          g_message ("couldn't connect to session bus: %s", error->message);
+          g_clear_error (&error);
+        }
+    }
+
+  create_peer_connections (NULL);
+}
+
+/**
+ * cockpit_dbus_internal_register_object:
+ * @path: the object path
+ * @info: the interface, which must stay around
+ * @vtable: the handlers, which must stay around
+ * @user_data: passed to the handlers
+ * @destroy: frees @user_data
+ * @error: location to place an error
+ *
+ * Exports an object on the internal server connection, like
+ * g_dbus_connection_register_object(). Its properties can also
+ * be read by cockpit_dbus_internal_dispatch() without going
+ * through the connection.
+ *
+ * Returns: whether the object was registered
+ */
+gboolean
+cockpit_dbus_internal_register_object (const gchar *path,
+                                       GDBusInterfaceInfo *info,
+                                       const GDBusInterfaceVTable *vtable,
+                                       gpointer user_data,
+                                       GDestroyNotify destroy,
+                                       GError **error)
+{
+  DirectObject *direct;
+
+  ensure_connections ();
+  g_return_val_if_fail (the_server != NULL, FALSE);
+
+  if (!g_dbus_connection_register_object (the_server, path, info, (GDBusInterfaceVTable *)vtable,
+                                          user_data, destroy, error))
+    return FALSE;
+
+  if (!direct_objects)
+    direct_objects = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+  direct = g_new0 (DirectObject, 1);
+  direct->info = info;
+  direct->vtable = vtable;
+  direct->user_data = user_data;
+  g_hash_table_replace (direct_objects, g_strconcat (path, "\n", info->name, NULL), direct);
+  return TRUE;
+}
+
+static DirectObject *
+lookup_direct (const gchar *path,
+               const gchar *interface)
+{
+  DirectObject *direct;
+  gchar *key;
+
+  if (!direct_objects || !path || !interface)
+    return NULL;
+
+  key = g_strconcat (path, "\n", interface, NULL);
+  direct = g_hash_table_lookup (direct_objects, key);
+  g_free (key);
+
+  if (direct && direct->vtable->get_property)
+    return direct;
+  return NULL;
+}
+
+static GVariant *
+direct_get_property (DirectObject *direct,
+                     const gchar *path,
+                     GDBusPropertyInfo *prop,
+                     GError **error)
+{
+  GVariant *value;
+
+  value = (direct->vtable->get_property) (the_server, NULL, path, direct->info->name,
+                                          prop->name, error, direct->user_data);
+  if (value)
+    g_variant_take_ref (value);
+  else if (error && *error == NULL)
+    g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                 "Couldn't get property %s", prop->name);
+  return value;
+}
+
+/**
+ * cockpit_dbus_internal_dispatch:
+ * @connection: the connection the message would be sent on
+ * @message: a method call
+ *
+ * A call from the internal client to the internal server would be
+ * turned into D-Bus wire format and back again, all in this process.
+ * Properties of objects registered with
+ * cockpit_dbus_internal_register_object() are answered here instead,
+ * handing the values straight over. Method calls still go through the
+ * connection, since GDBusMethodInvocation can only come from there.
+ *
+ * Returns: the reply or error, or NULL if @message should be sent
+ */
+GDBusMessage *
+cockpit_dbus_internal_dispatch (GDBusConnection *connection,
+                                GDBusMessage *message)
+{
+  GDBusPropertyInfo *prop;
+  GVariantBuilder builder;
+  DirectObject *direct;
+  GDBusMessage *reply;
+  GError *error = NULL;
+  const gchar *interface;
+  const gchar *name;
+  const gchar *path;
+  GVariant *value;
+  GVariant *body;
+  gboolean get_all;
+  gchar *error_name;
+  guint i;
+
+  if (!connection || connection != the_client || !the_server)
+    return NULL;
+  if (g_strcmp0 (g_dbus_message_get_destination (message), the_name) != 0)
+    return NULL;
+  if (g_dbus_message_get_message_type (message) != G_DBUS_MESSAGE_TYPE_METHOD_CALL ||
+      g_strcmp0 (g_dbus_message_get_interface (message), "org.freedesktop.DBus.Properties") != 0)
+    return NULL;
+
+  body = g_dbus_message_get_body (message);
+  path = g_dbus_message_get_path (message);
+
+  if (g_strcmp0 (g_dbus_message_get_member (message), "GetAll") == 0 &&
+      body && g_variant_is_of_type (body, G_VARIANT_TYPE ("(s)")))
+    {
+      get_all = TRUE;
+      g_variant_get (body, "(&s)", &interface);
+      name = NULL;
+    }
+  else if (g_strcmp0 (g_dbus_message_get_member (message), "Get") == 0 &&
+           body && g_variant_is_of_type (body, G_VARIANT_TYPE ("(ss)")))
+    {
+      get_all = FALSE;
+      g_variant_get (body, "(&s&s)", &interface, &name);
+    }
+  else
+    {
+      return NULL;
+    }
+
+  direct = lookup_direct (path, interface);
+  if (!direct)
+    return NULL;
+
+  if (get_all)
+    {
+      g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sv}"));
+      for (i = 0; direct->info->properties && direct->info->properties[i]; i++)
+        {
+          prop = direct->info->properties[i];
+          if (!(prop->flags & G_DBUS_PROPERTY_INFO_FLAGS_READABLE))
+            continue;
+
+          /* Like GDBus, leave out properties that fail */
+          value = direct_get_property (direct, path, prop, NULL);
+          if (value)
+            {
+              g_variant_builder_add (&builder, "{sv}", prop->name, value);
+              g_variant_unref (value);
+            }
+        }
+
+      reply = g_dbus_message_new_method_reply (message);
+      g_dbus_message_set_body (reply, g_variant_new ("(a{sv})", &builder));
+      return reply;
+    }
+
+  /* Unknown properties get their error from the connection */
+  prop = g_dbus_interface_info_lookup_property (direct->info, name);
+  if (!prop || !(prop->flags & G_DBUS_PROPERTY_INFO_FLAGS_READABLE))
+    return NULL;
+
+  value = direct_get_property (direct, path, prop, &error);
+  if (!value)
+    {
+      error_name = g_dbus_error_encode_gerror (error);
+      reply = g_dbus_message_new_method_error_literal (message, error_name, error->message);
+      g_free (error_name);
+      g_error_free (error);
+      return reply;
+    }
+
+  reply = g_dbus_message_new_method_reply (message);
+  g_dbus_message_set_body (reply, g_variant_new ("(v)", value));
+  g_variant_unref (value);
+  return reply;
+}
+
 void
 cockpit_dbus_internal_cleanup (void)
 {
+  if (lazy_destroy)
+    (lazy_destroy) (lazy_data);
+  lazy_pending = FALSE;
+  lazy_setup = NULL;
+  lazy_destroy = NULL;
+  lazy_data = NULL;
+
+  if (direct_objects)
+    g_hash_table_destroy (direct_objects);
+  direct_objects = NULL;
+
   g_clear_object (&the_client);
   g_clear_object (&the_server);
 }
@@ -31,10 +31,26 @@ GDBusConnection *     cockpit_dbus_internal_server       (void);
 
 const gchar *         cockpit_dbus_internal_name         (void);
 
+typedef void       (* CockpitDBusInternalFunc)            (gpointer user_data);
+
 void                  cockpit_dbus_internal_startup      (gboolean interact);
 
+void                  cockpit_dbus_internal_startup_lazy (CockpitDBusInternalFunc setup,
+                                                          gpointer user_data,
+                                                          GDestroyNotify destroy);
+
 void                  cockpit_dbus_internal_cleanup      (void);
 
+gboolean              cockpit_dbus_internal_register_object (const gchar *path,
+                                                             GDBusInterfaceInfo *info,
+                                                             const GDBusInterfaceVTable *vtable,
+                                                             gpointer user_data,
+                                                             GDestroyNotify destroy,
+                                                             GError **error);
+
+GDBusMessage *        cockpit_dbus_internal_dispatch     (GDBusConnection *connection,
+                                                          GDBusMessage *message);
+
 void                  cockpit_dbus_user_startup          (struct passwd *pwd);
 
 void                  cockpit_dbus_setup_startup         (void);
@@ -25,8 +25,11 @@
 #include "cockpitdbuscache.h"
 #include "cockpitdbusinternal.h"
 #include "cockpitdbusrules.h"
+#include "cockpitpaths.h"
 
 #include "common/cockpitjson.h"
+#include "common/cockpitprobes.h"
+#include "common/cockpitstats.h"
 
 #include <json-glib/json-glib.h>
 
@@ -65,8 +68,19 @@ typedef struct {
 
   /* Watch related */
   CockpitDBusCache *cache;
+  SharedCache *shared;
   gulong meta_sig;
   gulong update_sig;
+  CockpitDBusRules *watches;
+  GList *watch_list;
+  gint property_watches;
+  GHashTable *introsent;
+
+  /* Notify coalescing */
+  gint64 notify_latency;
+  gint64 notify_batch;
+  GHashTable *notify_pending;
+  guint notify_timeout;
 } CockpitDBusJson;
 
 typedef struct {
@@ -75,10 +89,52 @@ typedef struct {
 
 G_DEFINE_TYPE (CockpitDBusJson, cockpit_dbus_json, COCKPIT_TYPE_CHANNEL);
 
+/*
+ * Channels talking to the same name over the same connection share a
+ * cache, so the same objects aren't retrieved and held once per channel.
+ * Each channel keeps track of its own watches and which interfaces it
+ * has sent "meta" for, and only forwards the updates it asked for.
+ *
+ * The JSON text of larger property values is kept here too. The cache
+ * hands out the same GVariant until a value changes, so it is the key,
+ * and a changed value never finds the old text.
+ */
+typedef struct {
+  gchar *key;
+  CockpitDBusCache *cache;
+  gint users;
+  GHashTable *texts;
+} SharedCache;
+
+/* Smaller values are quicker to write out again than to look up */
+#define TEXT_VALUE_SIZE 64
+
+/* Replaced values stay in the table until it is this full */
+#define TEXT_VALUE_MAX 4096
+
+static GHashTable *shared_caches = NULL;
+
+typedef struct {
+  gchar *path;
+  gboolean is_namespace;
+  gchar *interface;
+  GHashTable *properties;
+} WatchEntry;
+
+static void
+watch_entry_free (gpointer data)
+{
+  WatchEntry *we = data;
+  g_free (we->path);
+  g_free (we->interface);
+  if (we->properties)
+    g_hash_table_unref (we->properties);
+  g_slice_free (WatchEntry, we);
+}
+
 static const gchar *
-value_type_name (JsonNode *node)
+type_name (GType type)
 {
-  GType type = json_node_get_value_type (node);
   if (type == G_TYPE_STRING)
     return "string";
   else if (type == G_TYPE_INT64)
@@ -89,6 +145,12 @@ value_type_name (JsonNode *node)
     return g_type_name (type);
 }
 
+static const gchar *
+value_type_name (JsonNode *node)
+{
+  return type_name (json_node_get_value_type (node));
+}
+
 static gboolean
 check_type (JsonNode *node,
             JsonNodeType type,
@@ -169,21 +231,15 @@ out:
 }
 
 static GVariant *
-parse_json_byte_array (JsonNode *node,
-                       GError **error)
+new_byte_array_variant (const gchar *value,
+                        GError **error)
 {
   static const char valid[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
   GVariant *result = NULL;
-  const gchar *value;
   gpointer data = NULL;
   gsize length;
   gsize pos;
 
-  if (!check_type (node, JSON_NODE_VALUE, G_TYPE_STRING, error))
-    goto out;
-
-  value = json_node_get_string (node);
-
   pos = strspn (value, valid);
   while (value[pos] == '=')
     pos++;
@@ -215,6 +271,16 @@ out:
   return result;
 }
 
+static GVariant *
+parse_json_byte_array (JsonNode *node,
+                       GError **error)
+{
+  if (!check_type (node, JSON_NODE_VALUE, G_TYPE_STRING, error))
+    return NULL;
+
+  return new_byte_array_variant (json_node_get_string (node), error);
+}
+
 static GVariant *
 parse_json_array (JsonNode *node,
                   const GVariantType *child_type,
@@ -381,16 +447,11 @@ out:
 }
 
 static GVariant *
-parse_json_object_path (JsonNode *node,
-                        GError **error)
+new_object_path_variant (const gchar *str,
+                         GError **error)
 {
   GVariant *result = NULL;
-  const gchar *str;
 
-  if (!check_type (node, JSON_NODE_VALUE, G_TYPE_STRING, error))
-    return NULL;
-
-  str = json_node_get_string (node);
   if (g_variant_is_object_path (str))
     {
       result = g_variant_new_object_path (str);
@@ -405,15 +466,19 @@ parse_json_object_path (JsonNode *node,
 }
 
 static GVariant *
-parse_json_signature (JsonNode *node,
-                      GError **error)
+parse_json_object_path (JsonNode *node,
+                        GError **error)
 {
-  const gchar *str;
-
   if (!check_type (node, JSON_NODE_VALUE, G_TYPE_STRING, error))
     return NULL;
 
-  str = json_node_get_string (node);
+  return new_object_path_variant (json_node_get_string (node), error);
+}
+
+static GVariant *
+new_signature_variant (const gchar *str,
+                       GError **error)
+{
   if (g_variant_is_signature (str))
     return g_variant_new_signature (str);
   else
@@ -424,6 +489,16 @@ parse_json_signature (JsonNode *node,
     }
 }
 
+static GVariant *
+parse_json_signature (JsonNode *node,
+                      GError **error)
+{
+  if (!check_type (node, JSON_NODE_VALUE, G_TYPE_STRING, error))
+    return NULL;
+
+  return new_signature_variant (json_node_get_string (node), error);
+}
+
 static void
 parse_not_supported (const GVariantType *type,
                      GError **error)
@@ -543,247 +618,830 @@ parse_json (JsonNode *node,
   return NULL;
 }
 
-static JsonNode *
-build_json (GVariant *value);
+/*
+ * Call arguments are usually the bulk of a message. Rather than building
+ * a JsonNode tree for them and then walking that, they are parsed straight
+ * from the JSON text, driven by the expected type. Variants, dictionaries
+ * with non-string keys and dictionaries with duplicate keys go through
+ * the tree code above.
+ */
+
+/* Deeper than DBus allows, and keeps recursion in check */
+#define SCAN_MAX_DEPTH 128
 
-static JsonObject *
-build_json_variant (GVariant *value)
+static void
+scan_init (CockpitJsonScan *scan,
+           GBytes *bytes)
 {
-  GVariant *child;
-  JsonObject *object;
+  gconstpointer data;
+  gsize length;
 
-  child = g_variant_get_variant (value);
-  object = json_object_new ();
-  json_object_set_string_member (object, "t", g_variant_get_type_string (child));
-  json_object_set_member (object, "v", build_json (child));
+  data = g_bytes_get_data (bytes, &length);
+  cockpit_json_scan_init (scan, data, length);
+}
 
-  g_variant_unref (child);
+/*
+ * Reads a string and unescapes it into @out, if not NULL. Anything
+ * questionable, like invalid UTF-8 or an embedded nul, is refused
+ * here so that the tree parser gets to decide what to do with it.
+ */
+static gboolean
+scan_string (CockpitJsonScan *scan,
+             GString *out)
+{
+  const gchar *start;
+  gunichar uc;
 
-  return object;
+  if (!cockpit_json_scan_char (scan, '"'))
+    return FALSE;
+
+  for (;;)
+    {
+      start = cockpit_json_scan_chars (scan);
+
+      /* None of the stop characters can be part of a multibyte sequence */
+      if (!g_utf8_validate (start, scan->pos - start, NULL))
+        return FALSE;
+      if (out)
+        g_string_append_len (out, start, scan->pos - start);
+
+      if (scan->pos == scan->end)
+        return FALSE;
+      if (*scan->pos == '"')
+        {
+          scan->pos++;
+          return TRUE;
+        }
+      if (!cockpit_json_scan_escape (scan, &uc) || uc == 0)
+        return FALSE;
+      if (out)
+        g_string_append_unichar (out, uc);
+    }
 }
 
-static JsonNode *
-build_json_byte_array (GVariant *value)
+/* The same types as json_node_get_value_type() would return */
+static GType
+scan_value_type (CockpitJsonScan *scan)
 {
-  JsonNode *node;
-  gconstpointer data;
-  gsize length = 0;
-  gchar *string;
+  CockpitJsonScan copy;
+  gboolean is_double;
+
+  switch (cockpit_json_scan_peek (scan))
+    {
+    case '"':
+      return G_TYPE_STRING;
+    case '{':
+      return JSON_TYPE_OBJECT;
+    case '[':
+      return JSON_TYPE_ARRAY;
+    case 't':
+    case 'f':
+      return G_TYPE_BOOLEAN;
+    default:
+      copy = *scan;
+      if (cockpit_json_scan_number (&copy, &is_double))
+        return is_double ? G_TYPE_DOUBLE : G_TYPE_INT64;
+      return G_TYPE_INVALID;
+    }
+}
 
-  data = g_variant_get_fixed_array (value, &length, 1);
-  if (length > 0)
-    string = g_base64_encode (data, length);
-  else
-    string = NULL;
-  node = json_node_new (JSON_NODE_VALUE);
-  json_node_set_string (node, string ? string : "");
-  g_free (string); /* unfortunately :S */
+static gboolean
+scan_check_type (CockpitJsonScan *scan,
+                 GType sub_type,
+                 GError **error)
+{
+  GType type = scan_value_type (scan);
+  if (type != sub_type)
+    {
+      g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                   "Unexpected type '%s' in argument", type_name (type));
+      return FALSE;
+    }
+  return TRUE;
+}
 
-  return node;
+static gboolean
+scan_invalid (GError **error)
+{
+  /* The arguments are checked when received, so this shouldn't happen */
+  g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+               "Invalid JSON in argument");
+  return FALSE;
 }
 
-static JsonArray *
-build_json_array_or_tuple (GVariant *value)
+static gboolean
+scan_int (CockpitJsonScan *scan,
+          gint64 *value,
+          GError **error)
 {
-  GVariantIter iter;
-  GVariant *child;
-  JsonArray *array;
+  gchar buffer[64];
+  const gchar *start;
+  gchar *text;
+  gsize length;
 
-  array = json_array_new ();
+  if (!scan_check_type (scan, G_TYPE_INT64, error))
+    return FALSE;
 
-  g_variant_iter_init (&iter, value);
-  while ((child = g_variant_iter_next_value (&iter)) != NULL)
+  start = scan->pos;
+  if (!cockpit_json_scan_number (scan, NULL))
+    return scan_invalid (error);
+
+  /* The text isn't nul terminated */
+  length = scan->pos - start;
+  if (length < sizeof (buffer))
     {
-      json_array_add_element (array, build_json (child));
-      g_variant_unref (child);
+      memcpy (buffer, start, length);
+      buffer[length] = '\0';
+      *value = g_ascii_strtoll (buffer, NULL, 10);
+    }
+  else
+    {
+      text = g_strndup (start, length);
+      *value = g_ascii_strtoll (text, NULL, 10);
+      g_free (text);
     }
 
-  return array;
+  return TRUE;
 }
 
-static JsonObject *
-build_json_dictionary (const GVariantType *entry_type,
-                       GVariant *dict)
+static gboolean
+scan_double (CockpitJsonScan *scan,
+             gdouble *value,
+             GError **error)
 {
-  const GVariantType *key_type;
-  GVariantIter iter;
-  GVariant *child;
-  GVariant *key;
-  GVariant *value;
-  gboolean is_string;
-  gchar *key_string;
-  JsonObject *object;
-
-  object = json_object_new ();
-  key_type = g_variant_type_key (entry_type);
-
-  is_string = (g_variant_type_equal (key_type, G_VARIANT_TYPE_STRING) ||
-               g_variant_type_equal (key_type, G_VARIANT_TYPE_OBJECT_PATH) ||
-               g_variant_type_equal (key_type, G_VARIANT_TYPE_SIGNATURE));
+  gchar buffer[G_ASCII_DTOSTR_BUF_SIZE];
+  const gchar *start;
+  gchar *text;
+  gsize length;
+  gint64 integer;
 
-  g_variant_iter_init (&iter, dict);
-  while ((child = g_variant_iter_next_value (&iter)) != NULL)
+  if (scan_value_type (scan) == G_TYPE_INT64)
     {
-      key = g_variant_get_child_value (child, 0);
-      value = g_variant_get_child_value (child, 1);
+      if (!scan_int (scan, &integer, error))
+        return FALSE;
+      *value = integer;
+      return TRUE;
+    }
 
-      if (is_string)
-        {
-          json_object_set_member (object, g_variant_get_string (key, NULL), build_json (value));
-        }
-      else
-        {
-          key_string = g_variant_print (key, FALSE);
-          json_object_set_member (object, key_string, build_json (value));
-          g_free (key_string);
-        }
+  if (!scan_check_type (scan, G_TYPE_DOUBLE, error))
+    return FALSE;
 
-      g_variant_unref (key);
-      g_variant_unref (value);
+  start = scan->pos;
+  if (!cockpit_json_scan_number (scan, NULL))
+    return scan_invalid (error);
+
+  length = scan->pos - start;
+  if (length < sizeof (buffer))
+    {
+      memcpy (buffer, start, length);
+      buffer[length] = '\0';
+      *value = g_ascii_strtod (buffer, NULL);
+    }
+  else
+    {
+      text = g_strndup (start, length);
+      *value = g_ascii_strtod (text, NULL);
+      g_free (text);
     }
 
-  return object;
+  return TRUE;
 }
 
-static JsonNode *
-build_json (GVariant *value)
+static GString *
+scan_string_value (CockpitJsonScan *scan,
+                   GError **error)
 {
-  const GVariantType *type;
-  const GVariantType *element_type;
-  JsonObject *object;
-  JsonArray *array;
-  JsonNode *node;
+  GString *string;
 
-  switch (g_variant_classify (value))
+  if (!scan_check_type (scan, G_TYPE_STRING, error))
+    return NULL;
+
+  string = g_string_new ("");
+  if (!scan_string (scan, string))
     {
-    case G_VARIANT_CLASS_BOOLEAN:
-      node = json_node_new (JSON_NODE_VALUE);
-      json_node_set_boolean (node, g_variant_get_boolean (value));
-      return node;
+      g_string_free (string, TRUE);
+      scan_invalid (error);
+      return NULL;
+    }
 
-    case G_VARIANT_CLASS_BYTE:
-      node = json_node_new (JSON_NODE_VALUE);
-      json_node_set_int (node, g_variant_get_byte (value));
-      return node;
+  return string;
+}
 
-    case G_VARIANT_CLASS_INT16:
-      node = json_node_new (JSON_NODE_VALUE);
-      json_node_set_int (node, g_variant_get_int16 (value));
-      return node;
+static GVariant *
+scan_json (CockpitJsonScan *scan,
+           const GVariantType *type,
+           GError **error);
 
-    case G_VARIANT_CLASS_UINT16:
-      node = json_node_new (JSON_NODE_VALUE);
-      json_node_set_int (node, g_variant_get_uint16 (value));
-      return node;
+static GVariant *
+scan_json_tree (CockpitJsonScan *scan,
+                const GVariantType *type,
+                GError **error)
+{
+  GVariant *result;
+  const gchar *start;
+  JsonNode *node;
 
-    case G_VARIANT_CLASS_INT32:
-      node = json_node_new (JSON_NODE_VALUE);
-      json_node_set_int (node, g_variant_get_int32 (value));
-      return node;
+  cockpit_json_scan_space (scan);
+  start = scan->pos;
+  if (!cockpit_json_scan_skip (scan, SCAN_MAX_DEPTH))
+    {
+      scan_invalid (error);
+      return NULL;
+    }
 
-    case G_VARIANT_CLASS_UINT32:
-      node = json_node_new (JSON_NODE_VALUE);
-      json_node_set_int (node, g_variant_get_uint32 (value));
-      return node;
+  node = cockpit_json_parse (start, scan->pos - start, NULL);
+  if (!node)
+    {
+      scan_invalid (error);
+      return NULL;
+    }
 
-    case G_VARIANT_CLASS_INT64:
-      node = json_node_new (JSON_NODE_VALUE);
-      json_node_set_int (node, g_variant_get_int64 (value));
-      return node;
+  result = parse_json (node, type, error);
+  json_node_free (node);
+  return result;
+}
 
-    case G_VARIANT_CLASS_UINT64:
-      node = json_node_new (JSON_NODE_VALUE);
-      json_node_set_int (node, g_variant_get_uint64 (value));
-      return node;
+static GVariant *
+scan_json_tuple (CockpitJsonScan *scan,
+                 const GVariantType *type,
+                 GError **error)
+{
+  const GVariantType *child_type;
+  GVariantBuilder builder;
+  GVariant *child;
 
-    case G_VARIANT_CLASS_HANDLE:
-      node = json_node_new (JSON_NODE_VALUE);
-      json_node_set_int (node, g_variant_get_handle (value));
-      return node;
+  if (!scan_check_type (scan, JSON_TYPE_ARRAY, error))
+    return NULL;
 
-    case G_VARIANT_CLASS_DOUBLE:
-      node = json_node_new (JSON_NODE_VALUE);
-      json_node_set_double (node, g_variant_get_double (value));
-      return node;
+  scan->pos++;
+  child_type = g_variant_type_first (type);
+  g_variant_builder_init (&builder, type);
 
-    case G_VARIANT_CLASS_STRING:      /* explicit fall-through */
-    case G_VARIANT_CLASS_OBJECT_PATH: /* explicit fall-through */
-    case G_VARIANT_CLASS_SIGNATURE:
-      node = json_node_new (JSON_NODE_VALUE);
-      json_node_set_string (node, g_variant_get_string (value, NULL));
-      return node;
+  if (!cockpit_json_scan_char (scan, ']'))
+    {
+      do
+        {
+          if (child_type == NULL)
+            {
+              g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                           "Too many values in tuple/struct");
+              goto fail;
+            }
 
-    case G_VARIANT_CLASS_VARIANT:
-      object = build_json_variant (value);
-      node = json_node_new (JSON_NODE_OBJECT);
-      json_node_take_object (node, object);
-      return node;
+          child = scan_json (scan, child_type, error);
+          if (!child)
+            goto fail;
 
-    case G_VARIANT_CLASS_ARRAY:
-      type = g_variant_get_type (value);
-      element_type = g_variant_type_element (type);
-      if (g_variant_type_is_dict_entry (element_type))
-        {
-          object = build_json_dictionary (element_type, value);
-          node = json_node_new (JSON_NODE_OBJECT);
-          json_node_take_object (node, object);
-        }
-      else if (g_variant_type_equal (element_type, G_VARIANT_TYPE_BYTE))
-        {
-          node = build_json_byte_array (value);
+          g_variant_builder_add_value (&builder, child);
+          child_type = g_variant_type_next (child_type);
         }
-      else
+      while (cockpit_json_scan_char (scan, ','));
+
+      if (!cockpit_json_scan_char (scan, ']'))
         {
-          array = build_json_array_or_tuple (value);
-          node = json_node_new (JSON_NODE_ARRAY);
-          json_node_set_array (node, array);
-          json_array_unref (array);
+          scan_invalid (error);
+          goto fail;
         }
-      return node;
-
-    case G_VARIANT_CLASS_TUPLE:
-      array = build_json_array_or_tuple (value);
-      node = json_node_new (JSON_NODE_ARRAY);
-      json_node_set_array (node, array);
-      json_array_unref (array);
-      return node;
+    }
 
-    case G_VARIANT_CLASS_DICT_ENTRY:
-    case G_VARIANT_CLASS_MAYBE:
-    default:
-      g_return_val_if_reached (NULL);
-      break;
+  if (child_type)
+    {
+      g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                   "Too few values in tuple/struct");
+      goto fail;
     }
-}
 
-static void
-send_json_object (CockpitDBusJson *self,
-                  JsonObject *object)
-{
-  GBytes *bytes;
+  return g_variant_builder_end (&builder);
 
-  bytes = cockpit_json_write_bytes (object);
-  cockpit_channel_send (COCKPIT_CHANNEL (self), bytes, TRUE);
-  g_bytes_unref (bytes);
+fail:
+  g_variant_builder_clear (&builder);
+  return NULL;
 }
 
-static JsonObject *
-build_json_error (GError *error)
+static GVariant *
+scan_json_array (CockpitJsonScan *scan,
+                 const GVariantType *type,
+                 GError **error)
 {
-  JsonObject *object;
-  JsonArray *reply;
-  JsonArray *args;
-  gchar *error_name;
+  const GVariantType *element_type;
+  GVariantBuilder builder;
+  GVariant *child;
 
-  object = json_object_new ();
-  reply = json_array_new ();
-  args = json_array_new ();
+  if (!scan_check_type (scan, JSON_TYPE_ARRAY, error))
+    return NULL;
 
-  error_name = g_dbus_error_get_remote_error (error);
-  g_dbus_error_strip_remote_error (error);
+  scan->pos++;
+  element_type = g_variant_type_element (type);
+  g_variant_builder_init (&builder, type);
 
-  json_array_add_string_element (reply, error_name != NULL ? error_name : "");
-  g_free (error_name);
+  if (!cockpit_json_scan_char (scan, ']'))
+    {
+      do
+        {
+          child = scan_json (scan, element_type, error);
+          if (!child)
+            goto fail;
+          g_variant_builder_add_value (&builder, child);
+        }
+      while (cockpit_json_scan_char (scan, ','));
+
+      if (!cockpit_json_scan_char (scan, ']'))
+        {
+          scan_invalid (error);
+          goto fail;
+        }
+    }
+
+  return g_variant_builder_end (&builder);
+
+fail:
+  g_variant_builder_clear (&builder);
+  return NULL;
+}
+
+static GVariant *
+scan_json_dictionary (CockpitJsonScan *scan,
+                      const GVariantType *type,
+                      GError **error)
+{
+  const GVariantType *entry_type;
+  const GVariantType *key_type;
+  GVariantBuilder builder;
+  GHashTable *seen = NULL;
+  GVariant *result = NULL;
+  GVariant *value;
+  GVariant *key;
+  GString *name;
+  CockpitJsonScan start;
+
+  entry_type = g_variant_type_element (type);
+  key_type = g_variant_type_key (entry_type);
+
+  if (!g_variant_type_equal (key_type, G_VARIANT_TYPE_STRING) &&
+      !g_variant_type_equal (key_type, G_VARIANT_TYPE_OBJECT_PATH) &&
+      !g_variant_type_equal (key_type, G_VARIANT_TYPE_SIGNATURE))
+    return scan_json_tree (scan, type, error);
+
+  if (!scan_check_type (scan, JSON_TYPE_OBJECT, error))
+    return NULL;
+
+  start = *scan;
+  scan->pos++;
+  name = g_string_new ("");
+  g_variant_builder_init (&builder, type);
+
+  if (!cockpit_json_scan_char (scan, '}'))
+    {
+      do
+        {
+          g_string_truncate (name, 0);
+          if (!scan_string (scan, name) || !cockpit_json_scan_char (scan, ':'))
+            {
+              scan_invalid (error);
+              goto out;
+            }
+
+          /* The last of several equal keys wins, leave that to the tree parser */
+          if (!seen)
+            seen = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+          if (g_hash_table_contains (seen, name->str))
+            {
+              g_variant_builder_clear (&builder);
+              *scan = start;
+              result = scan_json_tree (scan, type, error);
+              goto done;
+            }
+          g_hash_table_add (seen, g_strdup (name->str));
+
+          if (g_variant_type_equal (key_type, G_VARIANT_TYPE_STRING))
+            key = g_variant_new_string (name->str);
+          else if (g_variant_type_equal (key_type, G_VARIANT_TYPE_OBJECT_PATH))
+            key = new_object_path_variant (name->str, error);
+          else
+            key = new_signature_variant (name->str, error);
+          if (!key)
+            goto out;
+
+          value = scan_json (scan, g_variant_type_value (entry_type), error);
+          if (!value)
+            {
+              g_variant_unref (g_variant_ref_sink (key));
+              goto out;
+            }
+
+          g_variant_builder_add_value (&builder, g_variant_new_dict_entry (key, value));
+        }
+      while (cockpit_json_scan_char (scan, ','));
+
+      if (!cockpit_json_scan_char (scan, '}'))
+        {
+          scan_invalid (error);
+          goto out;
+        }
+    }
+
+  result = g_variant_builder_end (&builder);
+  goto done;
+
+out:
+  g_variant_builder_clear (&builder);
+done:
+  if (seen)
+    g_hash_table_destroy (seen);
+  g_string_free (name, TRUE);
+  return result;
+}
+
+static GVariant *
+scan_json (CockpitJsonScan *scan,
+           const GVariantType *type,
+           GError **error)
+{
+  const GVariantType *element_type;
+  GVariant *result = NULL;
+  GString *string;
+  gint64 integer;
+  gdouble number;
+
+  if (!g_variant_type_is_definite (type))
+    {
+      g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                   "Indefinite type '%.*s' is not supported",
+                   (int)g_variant_type_get_string_length (type),
+                   g_variant_type_peek_string (type));
+      return NULL;
+    }
+
+  if (g_variant_type_is_basic (type))
+    {
+      if (g_variant_type_equal (type, G_VARIANT_TYPE_BOOLEAN))
+        {
+          if (scan_check_type (scan, G_TYPE_BOOLEAN, error))
+            {
+              if (cockpit_json_scan_word (scan, "true"))
+                return g_variant_new_boolean (TRUE);
+              else if (cockpit_json_scan_word (scan, "false"))
+                return g_variant_new_boolean (FALSE);
+              scan_invalid (error);
+            }
+        }
+      else if (g_variant_type_equal (type, G_VARIANT_TYPE_BYTE))
+        {
+          if (scan_int (scan, &integer, error))
+            return g_variant_new_byte (integer);
+        }
+      else if (g_variant_type_equal (type, G_VARIANT_TYPE_INT16))
+        {
+          if (scan_int (scan, &integer, error))
+            return g_variant_new_int16 (integer);
+        }
+      else if (g_variant_type_equal (type, G_VARIANT_TYPE_UINT16))
+        {
+          if (scan_int (scan, &integer, error))
+            return g_variant_new_uint16 (integer);
+        }
+      else if (g_variant_type_equal (type, G_VARIANT_TYPE_INT32))
+        {
+          if (scan_int (scan, &integer, error))
+            return g_variant_new_int32 (integer);
+        }
+      else if (g_variant_type_equal (type, G_VARIANT_TYPE_UINT32))
+        {
+          if (scan_int (scan, &integer, error))
+            return g_variant_new_uint32 (integer);
+        }
+      else if (g_variant_type_equal (type, G_VARIANT_TYPE_INT64))
+        {
+          if (scan_int (scan, &integer, error))
+            return g_variant_new_int64 (integer);
+        }
+      else if (g_variant_type_equal (type, G_VARIANT_TYPE_UINT64))
+        {
+          if (scan_int (scan, &integer, error))
+            return g_variant_new_uint64 (integer);
+        }
+      else if (g_variant_type_equal (type, G_VARIANT_TYPE_DOUBLE))
+        {
+          if (scan_double (scan, &number, error))
+            return g_variant_new_double (number);
+        }
+      else if (g_variant_type_equal (type, G_VARIANT_TYPE_STRING) ||
+               g_variant_type_equal (type, G_VARIANT_TYPE_OBJECT_PATH) ||
+               g_variant_type_equal (type, G_VARIANT_TYPE_SIGNATURE))
+        {
+          string = scan_string_value (scan, error);
+          if (string)
+            {
+              if (g_variant_type_equal (type, G_VARIANT_TYPE_STRING))
+                result = g_variant_new_string (string->str);
+              else if (g_variant_type_equal (type, G_VARIANT_TYPE_OBJECT_PATH))
+                result = new_object_path_variant (string->str, error);
+              else
+                result = new_signature_variant (string->str, error);
+              g_string_free (string, TRUE);
+            }
+          return result;
+        }
+      else
+        {
+          parse_not_supported (type, error);
+        }
+    }
+  else if (g_variant_type_is_variant (type))
+    {
+      return scan_json_tree (scan, type, error);
+    }
+  else if (g_variant_type_is_array (type))
+    {
+      element_type = g_variant_type_element (type);
+      if (g_variant_type_equal (element_type, G_VARIANT_TYPE_BYTE))
+        {
+          string = scan_string_value (scan, error);
+          if (string)
+            {
+              result = new_byte_array_variant (string->str, error);
+              g_string_free (string, TRUE);
+            }
+          return result;
+        }
+      else if (g_variant_type_is_dict_entry (element_type))
+        {
+          return scan_json_dictionary (scan, type, error);
+        }
+      else
+        {
+          return scan_json_array (scan, type, error);
+        }
+    }
+  else if (g_variant_type_is_tuple (type))
+    {
+      return scan_json_tuple (scan, type, error);
+    }
+  else
+    {
+      parse_not_supported (type, error);
+    }
+
+  return NULL;
+}
+
+/*
+ * These write the JSON for a GVariant directly into a buffer, rather
+ * than building a tree of JsonNode first and then serializing that.
+ * The output is the same as cockpit_json_write() would produce.
+ */
+
+static void
+write_json (GString *out,
+            GVariant *value);
+
+static void
+write_json_variant (GString *out,
+                    GVariant *value)
+{
+  GVariant *child;
+
+  child = g_variant_get_variant (value);
+  g_string_append (out, "{\"t\":");
+  cockpit_json_append_string (out, g_variant_get_type_string (child));
+  g_string_append (out, ",\"v\":");
+  write_json (out, child);
+  g_string_append_c (out, '}');
+
+  g_variant_unref (child);
+}
+
+static void
+write_json_byte_array (GString *out,
+                       GVariant *value)
+{
+  gconstpointer data;
+  gsize length = 0;
+  gsize before;
+  gint state = 0;
+  gint save = 0;
+
+  data = g_variant_get_fixed_array (value, &length, 1);
+
+  /* Base64 never needs escaping, so encode straight into the buffer */
+  g_string_append_c (out, '"');
+  if (length > 0)
+    {
+      before = out->len;
+      g_string_set_size (out, before + (length / 3 + 1) * 4 + 4);
+      before += g_base64_encode_step (data, length, FALSE, out->str + before, &state, &save);
+      before += g_base64_encode_close (FALSE, out->str + before, &state, &save);
+      g_string_truncate (out, before);
+    }
+  g_string_append_c (out, '"');
+}
+
+static void
+write_json_array_or_tuple (GString *out,
+                           GVariant *value)
+{
+  GVariantIter iter;
+  GVariant *child;
+  gboolean first = TRUE;
+
+  g_string_append_c (out, '[');
+
+  g_variant_iter_init (&iter, value);
+  while ((child = g_variant_iter_next_value (&iter)) != NULL)
+    {
+      if (!first)
+        g_string_append_c (out, ',');
+      first = FALSE;
+      write_json (out, child);
+      g_variant_unref (child);
+    }
+
+  g_string_append_c (out, ']');
+}
+
+static void
+write_json_dictionary (GString *out,
+                       const GVariantType *entry_type,
+                       GVariant *dict)
+{
+  const GVariantType *key_type;
+  GVariantIter iter;
+  GVariant *child;
+  GVariant *key;
+  GVariant *value;
+  gboolean is_string;
+  gchar *key_string;
+  gboolean first = TRUE;
+
+  key_type = g_variant_type_key (entry_type);
+
+  is_string = (g_variant_type_equal (key_type, G_VARIANT_TYPE_STRING) ||
+               g_variant_type_equal (key_type, G_VARIANT_TYPE_OBJECT_PATH) ||
+               g_variant_type_equal (key_type, G_VARIANT_TYPE_SIGNATURE));
+
+  /*
+   * Duplicate keys are written out as they come. A JSON parser keeps
+   * the last one, just like a JsonObject would have.
+   */
+  g_string_append_c (out, '{');
+
+  g_variant_iter_init (&iter, dict);
+  while ((child = g_variant_iter_next_value (&iter)) != NULL)
+    {
+      key = g_variant_get_child_value (child, 0);
+      value = g_variant_get_child_value (child, 1);
+
+      if (!first)
+        g_string_append_c (out, ',');
+      first = FALSE;
+
+      if (is_string)
+        {
+          cockpit_json_append_string (out, g_variant_get_string (key, NULL));
+        }
+      else
+        {
+          key_string = g_variant_print (key, FALSE);
+          cockpit_json_append_string (out, key_string);
+          g_free (key_string);
+        }
+
+      g_string_append_c (out, ':');
+      write_json (out, value);
+
+      g_variant_unref (key);
+      g_variant_unref (value);
+      g_variant_unref (child);
+    }
+
+  g_string_append_c (out, '}');
+}
+
+static void
+write_json (GString *out,
+            GVariant *value)
+{
+  const GVariantType *element_type;
+
+  switch (g_variant_classify (value))
+    {
+    case G_VARIANT_CLASS_BOOLEAN:
+      g_string_append (out, g_variant_get_boolean (value) ? "true" : "false");
+      break;
+
+    case G_VARIANT_CLASS_BYTE:
+      g_string_append_printf (out, "%u", (guint)g_variant_get_byte (value));
+      break;
+
+    case G_VARIANT_CLASS_INT16:
+      g_string_append_printf (out, "%d", (gint)g_variant_get_int16 (value));
+      break;
+
+    case G_VARIANT_CLASS_UINT16:
+      g_string_append_printf (out, "%u", (guint)g_variant_get_uint16 (value));
+      break;
+
+    case G_VARIANT_CLASS_INT32:
+      g_string_append_printf (out, "%" G_GINT32_FORMAT, g_variant_get_int32 (value));
+      break;
+
+    case G_VARIANT_CLASS_UINT32:
+      g_string_append_printf (out, "%" G_GUINT32_FORMAT, g_variant_get_uint32 (value));
+      break;
+
+    case G_VARIANT_CLASS_INT64:
+      g_string_append_printf (out, "%" G_GINT64_FORMAT, g_variant_get_int64 (value));
+      break;
+
+    case G_VARIANT_CLASS_UINT64:
+      /* Same as a JsonNode, which only holds a gint64 */
+      g_string_append_printf (out, "%" G_GINT64_FORMAT, (gint64)g_variant_get_uint64 (value));
+      break;
+
+    case G_VARIANT_CLASS_HANDLE:
+      g_string_append_printf (out, "%" G_GINT32_FORMAT, g_variant_get_handle (value));
+      break;
+
+    case G_VARIANT_CLASS_DOUBLE:
+      cockpit_json_append_double (out, g_variant_get_double (value));
+      break;
+
+    case G_VARIANT_CLASS_STRING:      /* explicit fall-through */
+    case G_VARIANT_CLASS_OBJECT_PATH: /* explicit fall-through */
+    case G_VARIANT_CLASS_SIGNATURE:
+      cockpit_json_append_string (out, g_variant_get_string (value, NULL));
+      break;
+
+    case G_VARIANT_CLASS_VARIANT:
+      write_json_variant (out, value);
+      break;
+
+    case G_VARIANT_CLASS_ARRAY:
+      element_type = g_variant_type_element (g_variant_get_type (value));
+      if (g_variant_type_is_dict_entry (element_type))
+        write_json_dictionary (out, element_type, value);
+      else if (g_variant_type_equal (element_type, G_VARIANT_TYPE_BYTE))
+        write_json_byte_array (out, value);
+      else
+        write_json_array_or_tuple (out, value);
+      break;
+
+    case G_VARIANT_CLASS_TUPLE:
+      write_json_array_or_tuple (out, value);
+      break;
+
+    case G_VARIANT_CLASS_DICT_ENTRY:
+    case G_VARIANT_CLASS_MAYBE:
+    default:
+      g_string_append (out, "null");
+      g_return_if_reached ();
+      break;
+    }
+}
+
+static void
+write_json_body (GString *out,
+                 GVariant *body)
+{
+  if (body)
+    write_json (out, body);
+  else
+    g_string_append (out, "null");
+}
+
+static void
+flush_notify (CockpitDBusJson *self);
+
+static void
+send_json_object (CockpitDBusJson *self,
+                  JsonObject *object)
+{
+  GBytes *bytes;
+
+  flush_notify (self);
+
+  bytes = cockpit_json_write_bytes (object);
+  cockpit_channel_send (COCKPIT_CHANNEL (self), bytes, TRUE);
+  g_bytes_unref (bytes);
+}
+
+static JsonObject *
+build_json_error (GError *error)
+{
+  JsonObject *object;
+  JsonArray *reply;
+  JsonArray *args;
+  gchar *error_name;
+
+  object = json_object_new ();
+  reply = json_array_new ();
+  args = json_array_new ();
+
+  error_name = g_dbus_error_get_remote_error (error);
+  g_dbus_error_strip_remote_error (error);
+
+  json_array_add_string_element (reply, error_name != NULL ? error_name : "");
+  g_free (error_name);
 
   if (error->message)
     json_array_add_string_element (args, error->message);
@@ -812,42 +1470,26 @@ build_signature (GVariant *variant)
   return g_string_free (sig, FALSE);
 }
 
-static JsonNode *
-build_json_body (GVariant *body,
-                 gchar **type)
-{
-  if (body)
-    {
-      if (type)
-        *type = build_signature (body);
-      return build_json (body);
-    }
-  else
-    {
-      if (type)
-        *type = NULL;
-      return json_node_new (JSON_NODE_NULL);
-    }
-}
-
-static JsonObject *
-build_json_signal (const gchar *path,
-                   const gchar *interface,
-                   const gchar *member,
-                   GVariant *body)
+static GBytes *
+build_signal_bytes (const gchar *path,
+                    const gchar *interface,
+                    const gchar *member,
+                    GVariant *body)
 {
-  JsonObject *object;
-  JsonArray *signal;
-
-  object = json_object_new ();
-  signal = json_array_new ();
-  json_array_add_string_element (signal, path);
-  json_array_add_string_element (signal, interface);
-  json_array_add_string_element (signal, member);
-  json_array_add_element (signal, build_json_body (body, NULL));
-  json_object_set_array_member (object, "signal", signal);
-
-  return object;
+  GString *out;
+
+  out = g_string_sized_new (128);
+  g_string_append (out, "{\"signal\":[");
+  cockpit_json_append_string (out, path);
+  g_string_append_c (out, ',');
+  cockpit_json_append_string (out, interface);
+  g_string_append_c (out, ',');
+  cockpit_json_append_string (out, member);
+  g_string_append_c (out, ',');
+  write_json_body (out, body);
+  g_string_append (out, "]}");
+
+  return g_string_free_to_bytes (out);
 }
 
 static JsonArray *
@@ -926,11 +1568,27 @@ build_json_meta (GDBusInterfaceInfo *iface)
 
 /* ---------------------------------------------------------------------------------------------------- */
 
+/*
+ * A "calls" message carries several calls. They're all dispatched at once,
+ * and the replies are collected here and sent back together.
+ */
+typedef struct {
+  CockpitDBusJson *dbus_json;
+  gchar *cookie;
+  gchar **replies;
+  guint n_replies;
+  guint pending;
+} CallBatch;
+
 typedef struct {
   /* Cleared by dispose */
   GList *link;
   CockpitDBusJson *dbus_json;
 
+  /* When part of a "calls" message */
+  CallBatch *batch;
+  guint slot;
+
   /* Request data */
   JsonObject *request;
 
@@ -945,6 +1603,12 @@ typedef struct {
   const gchar *type;
   const gchar *flags;
   JsonNode *args;
+
+  /* Text of the arguments, if not in the request */
+  GBytes *args_data;
+
+  /* When the method call was sent */
+  gint64 sent;
 } CallData;
 
 static void
@@ -963,16 +1627,29 @@ send_dbus_error (CockpitDBusJson *self,
   g_debug ("%s: failed %s", self->logname, call->method);
 
   object = build_json_error (error);
-  json_object_set_string_member (object, "id", call->cookie);
-  send_json_object (self, object);
+  if (call->batch)
+    {
+      g_free (call->batch->replies[call->slot]);
+      call->batch->replies[call->slot] = cockpit_json_write_object (object, NULL);
+    }
+  else
+    {
+      json_object_set_string_member (object, "id", call->cookie);
+      send_json_object (self, object);
+    }
   json_object_unref (object);
 }
 
 typedef struct {
   CockpitDBusJson *dbus_json;
-  JsonObject *message;
+  GBytes *message;
+  WatchEntry *snapshot;
 } WaitData;
 
+static void
+send_snapshot (CockpitDBusJson *self,
+               WatchEntry *watch);
+
 static void
 on_wait_complete (CockpitDBusCache *cache,
                   gpointer user_data)
@@ -981,20 +1658,29 @@ on_wait_complete (CockpitDBusCache *cache,
   CockpitDBusJson *self = wd->dbus_json;
 
   if (!g_cancellable_is_cancelled (self->cancellable))
-    send_json_object (self, wd->message);
+    {
+      if (wd->snapshot)
+        send_snapshot (self, wd->snapshot);
+      flush_notify (self);
+      if (wd->message)
+        cockpit_channel_send (COCKPIT_CHANNEL (self), wd->message, TRUE);
+    }
 
   g_object_unref (wd->dbus_json);
-  json_object_unref (wd->message);
+  if (wd->message)
+    g_bytes_unref (wd->message);
+  if (wd->snapshot)
+    watch_entry_free (wd->snapshot);
   g_slice_free (WaitData, wd);
 }
 
 static void
 send_with_barrier (CockpitDBusJson *self,
-                   JsonObject *message)
+                   GBytes *message)
 {
-  WaitData *wd = g_slice_new (WaitData);
+  WaitData *wd = g_slice_new0 (WaitData);
   wd->dbus_json = g_object_ref (self);
-  wd->message = json_object_ref (message);
+  wd->message = g_bytes_ref (message);
   cockpit_dbus_cache_barrier (self->cache, on_wait_complete, wd);
 }
 
@@ -1004,57 +1690,124 @@ send_dbus_reply (CockpitDBusJson *self,
                  GDBusMessage *message)
 {
   GVariant *scrape = NULL;
-  JsonObject *object;
-  GString *flags;
+  GVariant *body;
+  GBytes *bytes;
+  GString *out;
+  gchar *type;
 
   g_return_if_fail (call->cookie != NULL);
 
-  JsonArray *reply;
-  gchar *type = NULL;
+  body = g_dbus_message_get_body (message);
 
-  object = json_object_new ();
-  reply = json_array_new ();
+  out = g_string_sized_new (128);
   if (g_dbus_message_get_message_type (message) == G_DBUS_MESSAGE_TYPE_ERROR)
     {
       g_debug ("%s: errorc for %s", self->logname, call->method);
-      json_array_add_string_element (reply, g_dbus_message_get_error_name (message));
-      json_object_set_array_member (object, "error", reply);
+      g_string_append (out, "{\"error\":[");
+      cockpit_json_append_string (out, g_dbus_message_get_error_name (message));
+      g_string_append_c (out, ',');
     }
   else
     {
       g_debug ("%s: reply for %s", self->logname, call->method);
-      json_object_set_array_member (object, "reply", reply);
-      scrape = g_dbus_message_get_body (message);
+      g_string_append (out, "{\"reply\":[");
+      scrape = body;
     }
 
-  json_array_add_element (reply, build_json_body (g_dbus_message_get_body (message),
-                                                  call->type != NULL ? &type : NULL));
+  write_json_body (out, body);
+  g_string_append_c (out, ']');
 
-  if (type)
+  if (call->type != NULL && body != NULL)
     {
-      json_object_set_string_member (object, "type", type);
+      type = build_signature (body);
+      g_string_append (out, ",\"type\":");
+      cockpit_json_append_string (out, type);
       g_free (type);
     }
 
-  json_object_set_string_member (object, "id", call->cookie);
+  if (!call->batch)
+    {
+      g_string_append (out, ",\"id\":");
+      cockpit_json_append_string (out, call->cookie);
+    }
 
   if (call->flags)
     {
-      flags = g_string_new ("");
       if (g_dbus_message_get_byte_order (message) == G_DBUS_MESSAGE_BYTE_ORDER_BIG_ENDIAN)
-        g_string_append_c (flags, '>');
+        g_string_append (out, ",\"flags\":\">\"");
       else
-        g_string_append_c (flags, '<');
-      json_object_set_string_member (object, "flags", flags->str);
-      g_string_free (flags, TRUE);
+        g_string_append (out, ",\"flags\":\"<\"");
     }
 
+  g_string_append_c (out, '}');
+
   cockpit_dbus_cache_poke (self->cache, call->path, call->interface);
   if (scrape)
     cockpit_dbus_cache_scrape (self->cache, scrape);
-  send_with_barrier (self, object);
 
-  json_object_unref (object);
+  /* Sent along with the others in call_batch_release() */
+  if (call->batch)
+    {
+      g_free (call->batch->replies[call->slot]);
+      call->batch->replies[call->slot] = g_string_free (out, FALSE);
+      return;
+    }
+
+  bytes = g_string_free_to_bytes (out);
+  send_with_barrier (self, bytes);
+  g_bytes_unref (bytes);
+}
+
+static CallBatch *
+call_batch_new (CockpitDBusJson *self,
+                const gchar *cookie,
+                guint n_replies)
+{
+  CallBatch *batch = g_slice_new0 (CallBatch);
+  batch->dbus_json = g_object_ref (self);
+  batch->cookie = g_strdup (cookie);
+  batch->replies = g_new0 (gchar *, n_replies + 1);
+  batch->n_replies = n_replies;
+  batch->pending = 1;
+  return batch;
+}
+
+static void
+call_batch_release (CallBatch *batch)
+{
+  CockpitDBusJson *self = batch->dbus_json;
+  GBytes *bytes;
+  GString *out;
+  guint i;
+
+  g_assert (batch->pending > 0);
+  batch->pending--;
+  if (batch->pending > 0)
+    return;
+
+  if (!g_cancellable_is_cancelled (self->cancellable))
+    {
+      out = g_string_sized_new (256);
+      g_string_append (out, "{\"replies\":[");
+      for (i = 0; i < batch->n_replies; i++)
+        {
+          if (i > 0)
+            g_string_append_c (out, ',');
+          g_string_append (out, batch->replies[i] ? batch->replies[i] : "null");
+        }
+      g_string_append (out, "],\"id\":");
+      cockpit_json_append_string (out, batch->cookie);
+      g_string_append_c (out, '}');
+
+      bytes = g_string_free_to_bytes (out);
+      send_with_barrier (self, bytes);
+      g_bytes_unref (bytes);
+    }
+
+  g_strfreev (batch->replies);
+  g_free (batch->cookie);
+  g_object_unref (batch->dbus_json);
+  g_slice_free (CallBatch, batch);
 }
 
 static GVariantType *
@@ -1107,6 +1860,10 @@ call_data_free (CallData *call)
     json_object_unref (call->request);
   if (call->param_type)
     g_variant_type_free (call->param_type);
+  if (call->args_data)
+    g_bytes_unref (call->args_data);
+  if (call->batch)
+    call_batch_release (call->batch);
   g_slice_free (CallData, call);
 }
 
@@ -1122,6 +1879,11 @@ on_send_message_reply (GObject *source,
   message = g_dbus_connection_send_message_with_reply_finish (G_DBUS_CONNECTION (source),
                                                               result, &error);
 
+  cockpit_stats_time (NULL, COCKPIT_STAT_DBUS_LATENCY, g_get_monotonic_time () - call->sent);
+  COCKPIT_PROBE3 (dbus_call_reply,
+                  call->dbus_json ? cockpit_channel_get_id ((CockpitChannel *)call->dbus_json) : NULL,
+                  call->method, g_get_monotonic_time () - call->sent);
+
   if (call->dbus_json)
     {
       if (error)
@@ -1143,9 +1905,19 @@ handle_dbus_call_on_interface (CockpitDBusJson *self,
   GVariant *parameters = NULL;
   GError *error = NULL;
   GDBusMessage *message = NULL;
+  GDBusMessage *reply;
+  CockpitJsonScan scan;
 
   g_return_if_fail (call->param_type != NULL);
-  parameters = parse_json (call->args, call->param_type, &error);
+  if (call->args_data)
+    {
+      scan_init (&scan, call->args_data);
+      parameters = scan_json (&scan, call->param_type, &error);
+    }
+  else
+    {
+      parameters = parse_json (call->args, call->param_type, &error);
+    }
 
   if (!parameters)
     goto out;
@@ -1159,6 +1931,22 @@ handle_dbus_call_on_interface (CockpitDBusJson *self,
 
   g_dbus_message_set_body (message, parameters);
 
+  call->sent = g_get_monotonic_time ();
+  cockpit_stats_add (NULL, COCKPIT_STAT_DBUS_CALLS, 1);
+  COCKPIT_PROBE3 (dbus_call_start, cockpit_channel_get_id ((CockpitChannel *)self),
+                  call->interface, call->method);
+
+  /* Properties of our own internal objects are answered right here */
+  reply = cockpit_dbus_internal_dispatch (call->dbus_json->connection, message);
+  if (reply)
+    {
+      cockpit_stats_time (NULL, COCKPIT_STAT_DBUS_LATENCY, g_get_monotonic_time () - call->sent);
+      if (call->cookie)
+        send_dbus_reply (self, call, reply);
+      g_object_unref (reply);
+      goto out;
+    }
+
   g_dbus_connection_send_message_with_reply (call->dbus_json->connection,
                                              message,
                                              G_DBUS_SEND_MESSAGE_FLAGS_NONE,
@@ -1231,9 +2019,26 @@ array_string_element (JsonArray *array,
 #define G_DBUS_ERROR_UNKNOWN_OBJECT G_DBUS_ERROR_UNKNOWN_METHOD
 #endif
 
+static gboolean
+call_has_args (CallData *call)
+{
+  CockpitJsonScan scan;
+
+  if (call->args_data)
+    {
+      scan_init (&scan, call->args_data);
+      return cockpit_json_scan_char (&scan, '[') && !cockpit_json_scan_char (&scan, ']');
+    }
+
+  return json_array_get_length (json_node_get_array (call->args)) > 0;
+}
+
 static void
-handle_dbus_call (CockpitDBusJson *self,
-                  JsonObject *object)
+dispatch_dbus_call (CockpitDBusJson *self,
+                    JsonObject *object,
+                    GBytes *args,
+                    CallBatch *batch,
+                    guint slot)
 {
   GError *error = NULL;
   CallData *call;
@@ -1254,6 +2059,13 @@ handle_dbus_call (CockpitDBusJson *self,
   call = g_slice_new0 (CallData);
   array = json_node_get_array (node);
 
+  if (batch)
+    {
+      call->batch = batch;
+      call->slot = slot;
+      batch->pending++;
+    }
+
   call->path = array_string_element (array, 0);
   call->interface = array_string_element (array, 1);
   call->method = array_string_element (array, 2);
@@ -1267,6 +2079,9 @@ handle_dbus_call (CockpitDBusJson *self,
       return;
     }
 
+  if (args)
+    call->args_data = g_bytes_ref (args);
+
   if (!cockpit_json_get_string (object, "id", NULL, &call->cookie))
     {
       g_set_error (&error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
@@ -1323,7 +2138,7 @@ handle_dbus_call (CockpitDBusJson *self,
   /* No arguments or zero arguments, can make call without introspecting */
   if (!call->param_type)
     {
-      if (json_array_get_length (json_node_get_array (call->args)) == 0)
+      if (!call_has_args (call))
         call->param_type = g_variant_type_new ("()");
     }
 
@@ -1344,6 +2159,61 @@ handle_dbus_call (CockpitDBusJson *self,
     }
 }
 
+static void
+handle_dbus_call (CockpitDBusJson *self,
+                  JsonObject *object,
+                  GBytes *args)
+{
+  dispatch_dbus_call (self, object, args, NULL, 0);
+}
+
+static void
+handle_dbus_calls (CockpitDBusJson *self,
+                   JsonObject *object)
+{
+  JsonObject *request;
+  JsonArray *array;
+  JsonNode *node;
+  const gchar *cookie;
+  const gchar *flags;
+  CallBatch *batch;
+  guint i, length;
+
+  node = json_object_get_member (object, "calls");
+  g_return_if_fail (node != NULL);
+
+  if (!JSON_NODE_HOLDS_ARRAY (node) ||
+      !cockpit_json_get_string (object, "id", NULL, &cookie) || !cookie ||
+      !cockpit_json_get_string (object, "flags", NULL, &flags))
+    {
+      g_warning ("incorrect calls field in dbus command");
+      cockpit_channel_close (COCKPIT_CHANNEL (self), "protocol-error");
+      return;
+    }
+
+  array = json_node_get_array (node);
+  length = json_array_get_length (array);
+  batch = call_batch_new (self, cookie, length);
+
+  /* Each call looks like its own "call" message to the code above */
+  for (i = 0; i < length; i++)
+    {
+      request = json_object_new ();
+      json_object_set_member (request, "call", json_node_copy (json_array_get_element (array, i)));
+      json_object_set_string_member (request, "id", cookie);
+      if (flags)
+        json_object_set_string_member (request, "flags", flags);
+      dispatch_dbus_call (self, request, NULL, batch, i);
+      json_object_unref (request);
+
+      if (g_cancellable_is_cancelled (self->cancellable))
+        break;
+    }
+
+  /* Sends the replies once the calls are done */
+  call_batch_release (batch);
+}
+
 static void
 on_add_match_ready (GObject *source,
                     GAsyncResult *result,
@@ -1376,11 +2246,13 @@ parse_json_rule (CockpitDBusJson *self,
                  const gchar **path_namespace,
                  const gchar **interface,
                  const gchar **signal,
-                 const gchar **arg0)
+                 const gchar **arg0,
+                 gchar ***properties)
 {
   JsonObject *object;
   gboolean valid;
   GList *names, *l;
+  gint i;
 
   if (!JSON_NODE_HOLDS_OBJECT (node))
     {
@@ -1400,6 +2272,8 @@ parse_json_rule (CockpitDBusJson *self,
     *interface = NULL;
   if (arg0)
     *arg0 = NULL;
+  if (properties)
+    *properties = NULL;
 
   names = json_object_get_members (object);
   for (l = names; l != NULL; l = g_list_next (l))
@@ -1415,6 +2289,8 @@ parse_json_rule (CockpitDBusJson *self,
         valid = cockpit_json_get_string (object, "path_namespace", NULL, path_namespace);
       else if (arg0 && g_str_equal (l->data, "arg0"))
         valid = cockpit_json_get_string (object, "arg0", NULL, arg0);
+      else if (properties && g_str_equal (l->data, "properties"))
+        valid = cockpit_json_get_strv (object, "properties", NULL, properties);
 
       if (!valid)
         {
@@ -1441,6 +2317,15 @@ parse_json_rule (CockpitDBusJson *self,
   else
     valid = TRUE;
 
+  for (i = 0; valid && properties && *properties && (*properties)[i]; i++)
+    {
+      if (!g_dbus_is_member_name ((*properties)[i]))
+        {
+          g_warning ("match property is not valid: %s", (*properties)[i]);
+          valid = FALSE;
+        }
+    }
+
   return valid;
 }
 
@@ -1483,7 +2368,7 @@ handle_dbus_add_match (CockpitDBusJson *self,
   node = json_object_get_member (object, "add-match");
   g_return_if_fail (node != NULL);
 
-  if (!parse_json_rule (self, node, &path, &path_namespace, &interface, &signal, &arg0))
+  if (!parse_json_rule (self, node, &path, &path_namespace, &interface, &signal, &arg0, NULL))
     {
       cockpit_channel_close (COCKPIT_CHANNEL (self), "protocol-error");
       return;
@@ -1513,129 +2398,535 @@ handle_dbus_add_match (CockpitDBusJson *self,
 }
 
 static void
-on_remove_match_ready (GObject *source,
-                       GAsyncResult *result,
-                       gpointer user_data)
+on_remove_match_ready (GObject *source,
+                       GAsyncResult *result,
+                       gpointer user_data)
+{
+  CockpitDBusJson *self = COCKPIT_DBUS_JSON (user_data);
+  GError *error = NULL;
+  GVariant *retval;
+
+  retval = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source), result, &error);
+  if (error)
+    {
+      if (!g_cancellable_is_cancelled (self->cancellable) &&
+          !g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CLOSED))
+        {
+          g_warning ("couldn't remove match from bus: %s", error->message);
+          cockpit_channel_close (COCKPIT_CHANNEL (self), "internal-error");
+        }
+      g_error_free (error);
+    }
+  if (retval)
+    g_variant_unref (retval);
+  g_object_unref (self);
+}
+
+static void
+handle_dbus_remove_match (CockpitDBusJson *self,
+                          JsonObject *object)
+{
+  JsonNode *node;
+  const gchar *path;
+  const gchar *path_namespace;
+  const gchar *interface;
+  const gchar *signal;
+  const gchar *arg0;
+  gchar *match;
+
+  node = json_object_get_member (object, "remove-match");
+  g_return_if_fail (node != NULL);
+
+  if (!parse_json_rule (self, node, &path, &path_namespace, &interface, &signal, &arg0, NULL))
+    {
+      cockpit_channel_close (COCKPIT_CHANNEL (self), "protocol-error");
+      return;
+    }
+
+  if (cockpit_dbus_rules_remove (self->rules,
+                                 path ? path : path_namespace,
+                                 path_namespace ? TRUE : FALSE,
+                                 interface, signal, arg0))
+    {
+      if (self->name)
+        {
+          match = build_dbus_match (self, path, path_namespace, interface, signal, arg0);
+          g_dbus_connection_call (self->connection,
+                                  "org.freedesktop.DBus",
+                                  "/org/freedesktop/DBus",
+                                  "org.freedesktop.DBus",
+                                  "RemoveMatch",
+                                  g_variant_new ("(s)", match),
+                                  NULL, G_DBUS_CALL_FLAGS_NO_AUTO_START, -1,
+                                  NULL, /* don't cancel removes */
+                                  on_remove_match_ready,
+                                  g_object_ref (self));
+          g_free (match);
+        }
+    }
+}
+
+static void
+on_cache_meta (CockpitDBusCache *cache,
+               GDBusInterfaceInfo *iface,
+               gpointer user_data)
+{
+  CockpitDBusJson *self = user_data;
+  JsonObject *object;
+
+  /* The cache only emits this once, whichever channel it was for */
+  if (g_hash_table_lookup (self->introsent, iface))
+    return;
+
+  g_hash_table_add (self->introsent, iface);
+  object = build_json_meta (iface);
+  send_json_object (self, object);
+  json_object_unref (object);
+}
+
+static void
+send_missing_meta (CockpitDBusJson *self,
+                   GHashTable *update)
+{
+  GHashTableIter i, j;
+  GHashTable *interfaces;
+  GHashTable *properties;
+  GDBusInterfaceInfo *iface;
+  const gchar *interface;
+
+  g_hash_table_iter_init (&i, update);
+  while (g_hash_table_iter_next (&i, NULL, (gpointer *)&interfaces))
+    {
+      g_hash_table_iter_init (&j, interfaces);
+      while (g_hash_table_iter_next (&j, (gpointer *)&interface, (gpointer *)&properties))
+        {
+          if (!properties)
+            continue;
+          iface = cockpit_dbus_cache_lookup_interface (self->cache, interface);
+          if (iface)
+            on_cache_meta (self->cache, iface, self);
+        }
+    }
+}
+
+static void
+write_json_property (GString *out,
+                     GHashTable *texts,
+                     GVariant *value)
+{
+  const gchar *text;
+  gsize before;
+
+  if (g_variant_get_size (value) < TEXT_VALUE_SIZE)
+    {
+      write_json (out, value);
+      return;
+    }
+
+  text = g_hash_table_lookup (texts, value);
+  if (text)
+    {
+      g_string_append (out, text);
+      return;
+    }
+
+  before = out->len;
+  write_json (out, value);
+
+  if (g_hash_table_size (texts) >= TEXT_VALUE_MAX)
+    g_hash_table_remove_all (texts);
+  g_hash_table_insert (texts, g_variant_ref (value),
+                       g_strndup (out->str + before, out->len - before));
+}
+
+static void
+write_json_update (GString *out,
+                   GHashTable *texts,
+                   GHashTable *paths)
+{
+  GHashTableIter i, j, k;
+  GHashTable *interfaces;
+  GHashTable *properties;
+  const gchar *interface;
+  const gchar *property;
+  const gchar *path;
+  GVariant *value;
+  gboolean first_path = TRUE;
+  gboolean first_iface;
+  gboolean first_prop;
+
+  g_string_append_c (out, '{');
+
+  g_hash_table_iter_init (&i, paths);
+  while (g_hash_table_iter_next (&i, (gpointer *)&path, (gpointer *)&interfaces))
+    {
+      if (!first_path)
+        g_string_append_c (out, ',');
+      first_path = FALSE;
+
+      cockpit_json_append_string (out, path);
+      g_string_append (out, ":{");
+
+      first_iface = TRUE;
+      g_hash_table_iter_init (&j, interfaces);
+      while (g_hash_table_iter_next (&j, (gpointer *)&interface, (gpointer *)&properties))
+        {
+          if (!first_iface)
+            g_string_append_c (out, ',');
+          first_iface = FALSE;
+
+          cockpit_json_append_string (out, interface);
+          g_string_append_c (out, ':');
+
+          if (properties == NULL)
+            {
+              g_string_append (out, "null");
+            }
+          else
+            {
+              g_string_append_c (out, '{');
+
+              first_prop = TRUE;
+              g_hash_table_iter_init (&k, properties);
+              while (g_hash_table_iter_next (&k, (gpointer *)&property, (gpointer *)&value))
+                {
+                  if (!first_prop)
+                    g_string_append_c (out, ',');
+                  first_prop = FALSE;
+
+                  cockpit_json_append_string (out, property);
+                  g_string_append_c (out, ':');
+                  write_json_property (out, texts, value);
+                }
+
+              g_string_append_c (out, '}');
+            }
+        }
+
+      g_string_append_c (out, '}');
+    }
+
+  g_string_append_c (out, '}');
+}
+
+static void
+send_notify (CockpitDBusJson *self,
+             GHashTable *update)
+{
+  GBytes *bytes;
+  GString *out;
+
+  out = g_string_sized_new (256);
+  g_string_append (out, "{\"notify\":");
+  write_json_update (out, self->shared->texts, update);
+  g_string_append_c (out, '}');
+
+  bytes = g_string_free_to_bytes (out);
+  cockpit_channel_send (COCKPIT_CHANNEL (self), bytes, TRUE);
+  g_bytes_unref (bytes);
+}
+
+static void
+unref_properties (gpointer data)
+{
+  /* NULL means the interface went away */
+  if (data)
+    g_hash_table_unref (data);
+}
+
+/*
+ * Merges an update from the cache into the pending one. Later values
+ * replace earlier ones. An interface that went away and came back
+ * can't be told apart from one that only changed, so in that case
+ * nothing is merged and FALSE is returned.
+ */
+static gboolean
+merge_notify (GHashTable *pending,
+              GHashTable *update)
+{
+  GHashTableIter i, j, k;
+  GHashTable *interfaces;
+  GHashTable *properties;
+  GHashTable *merged_interfaces;
+  GHashTable *merged_properties;
+  const gchar *interface;
+  const gchar *property;
+  const gchar *path;
+  GVariant *value;
+
+  g_hash_table_iter_init (&i, update);
+  while (g_hash_table_iter_next (&i, (gpointer *)&path, (gpointer *)&interfaces))
+    {
+      merged_interfaces = g_hash_table_lookup (pending, path);
+      if (!merged_interfaces)
+        continue;
+
+      g_hash_table_iter_init (&j, interfaces);
+      while (g_hash_table_iter_next (&j, (gpointer *)&interface, (gpointer *)&properties))
+        {
+          if (properties &&
+              g_hash_table_lookup_extended (merged_interfaces, interface, NULL, (gpointer *)&merged_properties) &&
+              merged_properties == NULL)
+            return FALSE;
+        }
+    }
+
+  g_hash_table_iter_init (&i, update);
+  while (g_hash_table_iter_next (&i, (gpointer *)&path, (gpointer *)&interfaces))
+    {
+      merged_interfaces = g_hash_table_lookup (pending, path);
+      if (!merged_interfaces)
+        {
+          merged_interfaces = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, unref_properties);
+          g_hash_table_insert (pending, g_strdup (path), merged_interfaces);
+        }
+
+      g_hash_table_iter_init (&j, interfaces);
+      while (g_hash_table_iter_next (&j, (gpointer *)&interface, (gpointer *)&properties))
+        {
+          if (properties == NULL)
+            {
+              g_hash_table_replace (merged_interfaces, g_strdup (interface), NULL);
+              continue;
+            }
+
+          merged_properties = g_hash_table_lookup (merged_interfaces, interface);
+          if (!merged_properties)
+            {
+              merged_properties = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                         (GDestroyNotify)g_variant_unref);
+              g_hash_table_replace (merged_interfaces, g_strdup (interface), merged_properties);
+            }
+
+          g_hash_table_iter_init (&k, properties);
+          while (g_hash_table_iter_next (&k, (gpointer *)&property, (gpointer *)&value))
+            g_hash_table_replace (merged_properties, g_strdup (property), g_variant_ref (value));
+        }
+    }
+
+  return TRUE;
+}
+
+static void
+flush_notify (CockpitDBusJson *self)
 {
-  CockpitDBusJson *self = COCKPIT_DBUS_JSON (user_data);
-  GError *error = NULL;
-  GVariant *retval;
+  GHashTable *pending;
 
-  retval = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source), result, &error);
-  if (error)
+  if (self->notify_timeout)
     {
-      if (!g_cancellable_is_cancelled (self->cancellable) &&
-          !g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CLOSED))
-        {
-          g_warning ("couldn't remove match from bus: %s", error->message);
-          cockpit_channel_close (COCKPIT_CHANNEL (self), "internal-error");
-        }
-      g_error_free (error);
+      g_source_remove (self->notify_timeout);
+      self->notify_timeout = 0;
+    }
+
+  pending = self->notify_pending;
+  self->notify_pending = NULL;
+
+  if (pending)
+    {
+      send_notify (self, pending);
+      g_hash_table_unref (pending);
     }
-  if (retval)
-    g_variant_unref (retval);
-  g_object_unref (self);
 }
 
-static void
-handle_dbus_remove_match (CockpitDBusJson *self,
-                          JsonObject *object)
+static gboolean
+on_notify_timeout (gpointer user_data)
 {
-  JsonNode *node;
-  const gchar *path;
-  const gchar *path_namespace;
-  const gchar *interface;
-  const gchar *signal;
-  const gchar *arg0;
-  gchar *match;
+  CockpitDBusJson *self = user_data;
+  self->notify_timeout = 0;
+  flush_notify (self);
+  return FALSE;
+}
 
-  node = json_object_get_member (object, "remove-match");
-  g_return_if_fail (node != NULL);
+static void
+queue_notify (CockpitDBusJson *self,
+              GHashTable *update)
+{
+  if (self->shared->users > 1)
+    send_missing_meta (self, update);
 
-  if (!parse_json_rule (self, node, &path, &path_namespace, &interface, &signal, &arg0))
+  if (self->notify_latency <= 0)
     {
-      cockpit_channel_close (COCKPIT_CHANNEL (self), "protocol-error");
+      send_notify (self, update);
       return;
     }
 
-  if (cockpit_dbus_rules_remove (self->rules,
-                                 path ? path : path_namespace,
-                                 path_namespace ? TRUE : FALSE,
-                                 interface, signal, arg0))
+  /*
+   * Hold back updates for a while, and send them as one notify. Anything
+   * else sent on the channel flushes them first, so the ordering with
+   * replies and barriers stays the same.
+   */
+  if (self->notify_pending && !merge_notify (self->notify_pending, update))
+    flush_notify (self);
+
+  if (!self->notify_pending)
     {
-      if (self->name)
-        {
-          match = build_dbus_match (self, path, path_namespace, interface, signal, arg0);
-          g_dbus_connection_call (self->connection,
-                                  "org.freedesktop.DBus",
-                                  "/org/freedesktop/DBus",
-                                  "org.freedesktop.DBus",
-                                  "RemoveMatch",
-                                  g_variant_new ("(s)", match),
-                                  NULL, G_DBUS_CALL_FLAGS_NO_AUTO_START, -1,
-                                  NULL, /* don't cancel removes */
-                                  on_remove_match_ready,
-                                  g_object_ref (self));
-          g_free (match);
-        }
+      self->notify_pending = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                    (GDestroyNotify)g_hash_table_unref);
+      merge_notify (self->notify_pending, update);
     }
+
+  if (g_hash_table_size (self->notify_pending) >= self->notify_batch)
+    flush_notify (self);
+  else if (!self->notify_timeout)
+    self->notify_timeout = g_timeout_add (self->notify_latency, on_notify_timeout, self);
 }
 
-static void
-on_cache_meta (CockpitDBusCache *cache,
-               GDBusInterfaceInfo *iface,
-               gpointer user_data)
+static gboolean
+watch_matches (WatchEntry *watch,
+               const gchar *path,
+               const gchar *interface)
 {
-  CockpitDBusJson *self = user_data;
-  JsonObject *object = build_json_meta (iface);
-  send_json_object (self, object);
-  json_object_unref (object);
+  if (watch->interface && !g_str_equal (watch->interface, interface))
+    return FALSE;
+  if (!watch->path)
+    return TRUE;
+  if (watch->is_namespace)
+    return cockpit_path_equal_or_ancestor (path, watch->path);
+  return g_str_equal (watch->path, path);
 }
 
-static JsonObject *
-build_json_update (GHashTable *paths)
+/*
+ * Watches with a "properties" list only get those properties. When
+ * none of them changed the interface is left out, unless it came
+ * without any properties in the first place.
+ */
+static GHashTable *
+filter_properties (CockpitDBusJson *self,
+                   GHashTable *update)
 {
   GHashTableIter i, j, k;
+  GHashTable *filtered;
   GHashTable *interfaces;
   GHashTable *properties;
+  GHashTable *wanted;
+  GHashTable *result;
+  GHashTable *subset;
   const gchar *interface;
   const gchar *property;
   const gchar *path;
-  JsonObject *notify;
-  JsonObject *object;
-  JsonObject *iface;
+  gboolean all;
   GVariant *value;
+  GList *l;
 
-  notify = json_object_new ();
+  filtered = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                    (GDestroyNotify)g_hash_table_unref);
+  wanted = g_hash_table_new (g_str_hash, g_str_equal);
 
-  g_hash_table_iter_init (&i, paths);
+  g_hash_table_iter_init (&i, update);
   while (g_hash_table_iter_next (&i, (gpointer *)&path, (gpointer *)&interfaces))
     {
-      object = json_object_new ();
+      result = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, unref_properties);
 
       g_hash_table_iter_init (&j, interfaces);
       while (g_hash_table_iter_next (&j, (gpointer *)&interface, (gpointer *)&properties))
         {
-          if (properties == NULL)
+          subset = properties ? g_hash_table_ref (properties) : NULL;
+
+          all = TRUE;
+          g_hash_table_remove_all (wanted);
+          for (l = self->watch_list; properties && l != NULL; l = g_list_next (l))
             {
-              json_object_set_null_member (object, interface);
+              WatchEntry *watch = l->data;
+              if (!watch_matches (watch, path, interface))
+                continue;
+              if (!watch->properties)
+                {
+                  all = TRUE;
+                  break;
+                }
+
+              all = FALSE;
+              g_hash_table_iter_init (&k, watch->properties);
+              while (g_hash_table_iter_next (&k, (gpointer *)&property, NULL))
+                g_hash_table_add (wanted, (gpointer)property);
             }
-          else
-            {
-              iface = json_object_new ();
 
+          if (!all)
+            {
+              subset = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                              (GDestroyNotify)g_variant_unref);
               g_hash_table_iter_init (&k, properties);
               while (g_hash_table_iter_next (&k, (gpointer *)&property, (gpointer *)&value))
-                json_object_set_member (iface, property, build_json (value));
-
-              json_object_set_object_member (object, interface, iface);
+                {
+                  if (g_hash_table_contains (wanted, property))
+                    g_hash_table_replace (subset, (gchar *)property, g_variant_ref (value));
+                }
+
+              if (g_hash_table_size (subset) == 0 && g_hash_table_size (properties) > 0)
+                {
+                  g_hash_table_unref (subset);
+                  continue;
+                }
             }
+
+          g_hash_table_replace (result, (gchar *)interface, subset);
         }
 
-      json_object_set_object_member (notify, path, object);
+      if (g_hash_table_size (result) > 0)
+        g_hash_table_replace (filtered, (gchar *)path, result);
+      else
+        g_hash_table_unref (result);
+    }
+
+  g_hash_table_unref (wanted);
+  return filtered;
+}
+
+static void
+emit_notify (CockpitDBusJson *self,
+             GHashTable *update)
+{
+  GHashTable *filtered;
+
+  if (self->property_watches == 0)
+    {
+      queue_notify (self, update);
+      return;
+    }
+
+  filtered = filter_properties (self, update);
+  if (g_hash_table_size (filtered) > 0)
+    queue_notify (self, filtered);
+  g_hash_table_unref (filtered);
+}
+
+static GHashTable *
+filter_update (CockpitDBusJson *self,
+               GHashTable *update)
+{
+  GHashTableIter i, j;
+  GHashTable *filtered;
+  GHashTable *interfaces;
+  GHashTable *properties;
+  GHashTable *result;
+  const gchar *interface;
+  const gchar *path;
+
+  filtered = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                    (GDestroyNotify)g_hash_table_unref);
+
+  g_hash_table_iter_init (&i, update);
+  while (g_hash_table_iter_next (&i, (gpointer *)&path, (gpointer *)&interfaces))
+    {
+      result = NULL;
+      g_hash_table_iter_init (&j, interfaces);
+      while (g_hash_table_iter_next (&j, (gpointer *)&interface, (gpointer *)&properties))
+        {
+          if (!cockpit_dbus_rules_match (self->watches, path, interface, NULL, NULL))
+            continue;
+
+          if (!result)
+            {
+              result = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, unref_properties);
+              g_hash_table_replace (filtered, (gchar *)path, result);
+            }
+
+          g_hash_table_replace (result, (gchar *)interface,
+                                properties ? g_hash_table_ref (properties) : NULL);
+        }
     }
 
-  return notify;
+  return filtered;
 }
 
 static void
@@ -1644,10 +2935,32 @@ on_cache_update (CockpitDBusCache *cache,
                  gpointer user_data)
 {
   CockpitDBusJson *self = user_data;
-  JsonObject *object = json_object_new ();
-  json_object_set_object_member (object, "notify", build_json_update (update));
-  send_json_object (self, object);
-  json_object_unref (object);
+  GHashTable *filtered;
+
+  /* Only the channel using the cache, it asked for all of this */
+  if (self->shared->users <= 1)
+    {
+      emit_notify (self, update);
+      return;
+    }
+
+  filtered = filter_update (self, update);
+  if (g_hash_table_size (filtered) > 0)
+    emit_notify (self, filtered);
+  g_hash_table_unref (filtered);
+}
+
+static void
+send_snapshot (CockpitDBusJson *self,
+               WatchEntry *watch)
+{
+  GHashTable *snapshot;
+
+  snapshot = cockpit_dbus_cache_snapshot (self->cache, watch->path,
+                                          watch->is_namespace, watch->interface);
+  if (g_hash_table_size (snapshot) > 0)
+    emit_notify (self, snapshot);
+  g_hash_table_unref (snapshot);
 }
 
 static void
@@ -1658,14 +2971,19 @@ handle_dbus_watch (CockpitDBusJson *self,
   const gchar *path_namespace;
   const gchar *interface;
   gboolean is_namespace = FALSE;
+  gchar **properties;
   const gchar *cookie;
+  WatchEntry *watch;
+  WaitData *wd;
   JsonNode *node;
+  gint i;
 
   node = json_object_get_member (object, "watch");
   g_return_if_fail (node != NULL);
 
-  if (!parse_json_rule (self, node, &path, &path_namespace, &interface, NULL, NULL))
+  if (!parse_json_rule (self, node, &path, &path_namespace, &interface, NULL, NULL, &properties))
     {
+      g_free (properties);
       cockpit_channel_close (COCKPIT_CHANNEL (self), "protocol-error");
       return;
     }
@@ -1676,20 +2994,56 @@ handle_dbus_watch (CockpitDBusJson *self,
       is_namespace = TRUE;
     }
 
+  watch = g_slice_new0 (WatchEntry);
+  watch->path = g_strdup (path);
+  watch->is_namespace = is_namespace;
+  watch->interface = g_strdup (interface);
+  if (properties)
+    {
+      watch->properties = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+      for (i = 0; properties[i] != NULL; i++)
+        g_hash_table_add (watch->properties, g_strdup (properties[i]));
+      self->property_watches++;
+      g_free (properties);
+    }
+  self->watch_list = g_list_prepend (self->watch_list, watch);
+
+  cockpit_dbus_rules_add (self->watches, path, is_namespace, interface, NULL, NULL);
   cockpit_dbus_cache_watch (self->cache, path, is_namespace, interface);
 
   if (!path)
     path = "/";
 
+  /* Another channel may already have had the data retrieved */
+  wd = g_slice_new0 (WaitData);
+  if (self->shared->users > 1)
+    {
+      wd->snapshot = g_slice_new0 (WatchEntry);
+      wd->snapshot->path = g_strdup (watch->path);
+      wd->snapshot->is_namespace = is_namespace;
+      wd->snapshot->interface = g_strdup (interface);
+    }
+
   /* Send back a reply when this has completed */
   if (cockpit_json_get_string (object, "id", NULL, &cookie))
     {
       object = json_object_new ();
       json_object_set_array_member (object, "reply", json_array_new ());
       json_object_set_string_member (object, "id", cookie);
-      cockpit_dbus_cache_poke (self->cache, path, NULL);
-      send_with_barrier (self, object);
+      wd->message = cockpit_json_write_bytes (object);
       json_object_unref (object);
+
+      cockpit_dbus_cache_poke (self->cache, path, NULL);
+    }
+
+  if (wd->message || wd->snapshot)
+    {
+      wd->dbus_json = g_object_ref (self);
+      cockpit_dbus_cache_barrier (self->cache, on_wait_complete, wd);
+    }
+  else
+    {
+      g_slice_free (WaitData, wd);
     }
 }
 
@@ -1701,15 +3055,20 @@ handle_dbus_unwatch (CockpitDBusJson *self,
   const gchar *path_namespace;
   const gchar *interface;
   gboolean is_namespace = FALSE;
+  gchar **properties;
+  WatchEntry *watch;
   JsonNode *node;
+  GList *l;
 
   node = json_object_get_member (object, "unwatch");
   g_return_if_fail (node != NULL);
 
-  if (!parse_json_rule (self, node, &path, &path_namespace, &interface, NULL, NULL))
+  /* The same "properties" as the watch may be passed, they don't matter here */
+  if (!parse_json_rule (self, node, &path, &path_namespace, &interface, NULL, NULL, &properties))
     {
       cockpit_channel_close (COCKPIT_CHANNEL (self), "protocol-error");
     }
+  g_free (properties);
 
   if (path_namespace)
     {
@@ -1717,7 +3076,117 @@ handle_dbus_unwatch (CockpitDBusJson *self,
       is_namespace = TRUE;
     }
 
-  cockpit_dbus_cache_unwatch (self->cache, path, is_namespace, interface);
+  /* Only drop watches from the cache that this channel added */
+  for (l = self->watch_list; l != NULL; l = g_list_next (l))
+    {
+      watch = l->data;
+      if (watch->is_namespace == is_namespace &&
+          g_strcmp0 (watch->path, path) == 0 &&
+          g_strcmp0 (watch->interface, interface) == 0)
+        {
+          self->watch_list = g_list_delete_link (self->watch_list, l);
+          if (watch->properties)
+            self->property_watches--;
+          watch_entry_free (watch);
+          cockpit_dbus_rules_remove (self->watches, path, is_namespace, interface, NULL, NULL);
+          cockpit_dbus_cache_unwatch (self->cache, path, is_namespace, interface);
+          break;
+        }
+    }
+}
+
+/*
+ * Looks for the arguments of a "call" message in the JSON text, and
+ * checks that they're well formed. The rest of the message is parsed
+ * as usual, with an empty array in place of the arguments. Returns
+ * NULL if the message doesn't look like that, or anything else is off.
+ */
+static JsonObject *
+parse_call_message (GBytes *message,
+                    GBytes **args)
+{
+  JsonObject *object = NULL;
+  const gchar *args_start = NULL;
+  const gchar *args_end = NULL;
+  gboolean seen_call = FALSE;
+  const gchar *data;
+  GString *envelope;
+  GString *name;
+  CockpitJsonScan scan;
+  gsize length;
+  guint i;
+
+  scan_init (&scan, message);
+  data = scan.pos;
+  length = scan.end - scan.pos;
+  name = g_string_new ("");
+
+  if (!cockpit_json_scan_char (&scan, '{') || cockpit_json_scan_char (&scan, '}'))
+    goto out;
+
+  do
+    {
+      g_string_truncate (name, 0);
+      if (!scan_string (&scan, name) || !cockpit_json_scan_char (&scan, ':'))
+        goto out;
+
+      if (g_str_equal (name->str, "call"))
+        {
+          if (seen_call || !cockpit_json_scan_char (&scan, '['))
+            goto out;
+          seen_call = TRUE;
+
+          for (i = 0; ; i++)
+            {
+              cockpit_json_scan_space (&scan);
+              if (i == 3)
+                args_start = scan.pos;
+              if (!cockpit_json_scan_skip (&scan, SCAN_MAX_DEPTH))
+                goto out;
+              if (i == 3)
+                args_end = scan.pos;
+              if (!cockpit_json_scan_char (&scan, ','))
+                break;
+            }
+
+          if (!cockpit_json_scan_char (&scan, ']'))
+            goto out;
+        }
+      else if (!cockpit_json_scan_skip (&scan, SCAN_MAX_DEPTH))
+        {
+          goto out;
+        }
+    }
+  while (cockpit_json_scan_char (&scan, ','));
+
+  if (!cockpit_json_scan_char (&scan, '}') || !args_start || *args_start != '[')
+    goto out;
+  cockpit_json_scan_space (&scan);
+  if (scan.pos != scan.end)
+    goto out;
+
+  /*
+   * Skipping only checks structure. Leave arguments with anything that
+   * scan_string() would refuse to the tree parser. A false positive on
+   * an escaped backslash just takes the slower path.
+   */
+  if (!g_utf8_validate (args_start, args_end - args_start, NULL) ||
+      g_strstr_len (args_start, args_end - args_start, "\\u0000"))
+    goto out;
+
+  envelope = g_string_sized_new (length - (args_end - args_start) + 2);
+  g_string_append_len (envelope, data, args_start - data);
+  g_string_append (envelope, "[]");
+  g_string_append_len (envelope, args_end, (data + length) - args_end);
+  object = cockpit_json_parse_object (envelope->str, envelope->len, NULL);
+  g_string_free (envelope, TRUE);
+
+  if (object)
+    *args = g_bytes_new_from_bytes (message, args_start - data, args_end - args_start);
+
+out:
+  g_string_free (name, TRUE);
+  return object;
 }
 
 static void
@@ -1727,8 +3196,11 @@ cockpit_dbus_json_recv (CockpitChannel *channel,
   CockpitDBusJson *self = COCKPIT_DBUS_JSON (channel);
   GError *error = NULL;
   JsonObject *object = NULL;
+  GBytes *args = NULL;
 
-  object = cockpit_json_parse_bytes (message, &error);
+  object = parse_call_message (message, &args);
+  if (!object)
+    object = cockpit_json_parse_bytes (message, &error);
   if (!object)
     {
       g_warning ("failed to parse request: %s", error->message);
@@ -1738,7 +3210,9 @@ cockpit_dbus_json_recv (CockpitChannel *channel,
     }
 
   if (json_object_has_member (object, "call"))
-    handle_dbus_call (self, object);
+    handle_dbus_call (self, object, args);
+  else if (json_object_has_member (object, "calls"))
+    handle_dbus_calls (self, object);
   else if (json_object_has_member (object, "add-match"))
     handle_dbus_add_match (self, object);
   else if (json_object_has_member (object, "remove-match"))
@@ -1753,6 +3227,8 @@ cockpit_dbus_json_recv (CockpitChannel *channel,
       cockpit_channel_close (channel, "protocol-error");
     }
 
+  if (args)
+    g_bytes_unref (args);
   json_object_unref (object);
 }
 
@@ -1775,10 +3251,14 @@ on_signal_message (GDBusConnection *connection,
 
   CockpitDBusJson *self = user_data;
   const gchar *arg0 = NULL;
-  JsonObject *object;
+  GBytes *bytes;
 
-  /* Unfortunately we also have to recalculate this */
-  if (parameters &&
+  /*
+   * Unfortunately we also have to recalculate this. But only bother when
+   * a rule looks at arg0, otherwise the header fields decide.
+   */
+  if (cockpit_dbus_rules_need_arg0 (self->rules) &&
+      parameters &&
       g_variant_is_of_type (parameters, G_VARIANT_TYPE_TUPLE) &&
       g_variant_n_children (parameters) > 0)
     {
@@ -1791,10 +3271,10 @@ on_signal_message (GDBusConnection *connection,
 
   if (cockpit_dbus_rules_match (self->rules, path, interface, signal, arg0))
     {
-      object = build_json_signal (path, interface, signal, parameters);
+      bytes = build_signal_bytes (path, interface, signal, parameters);
       cockpit_dbus_cache_poke (self->cache, path, interface);
-      send_with_barrier (self, object);
-      json_object_unref (object);
+      send_with_barrier (self, bytes);
+      g_bytes_unref (bytes);
     }
 }
 
@@ -1812,6 +3292,8 @@ cockpit_dbus_json_init (CockpitDBusJson *self)
   self->cancellable = g_cancellable_new ();
 
   self->rules = cockpit_dbus_rules_new ();
+  self->watches = cockpit_dbus_rules_new ();
+  self->introsent = g_hash_table_new (g_direct_hash, g_direct_equal);
 }
 
 static void
@@ -1860,9 +3342,31 @@ on_name_vanished (GDBusConnection *connection,
 static void
 subscribe_and_cache (CockpitDBusJson *self)
 {
+  gchar *key;
+
   g_dbus_connection_set_exit_on_close (self->connection, FALSE);
 
-  self->cache = cockpit_dbus_cache_new (self->connection, self->name, self->logname);
+  if (!shared_caches)
+    shared_caches = g_hash_table_new (g_str_hash, g_str_equal);
+
+  key = g_strdup_printf ("%p %s", self->connection, self->name ? self->name : "");
+  self->shared = g_hash_table_lookup (shared_caches, key);
+  if (self->shared)
+    {
+      g_free (key);
+    }
+  else
+    {
+      self->shared = g_slice_new0 (SharedCache);
+      self->shared->key = key;
+      self->shared->cache = cockpit_dbus_cache_new (self->connection, self->name, self->logname);
+      self->shared->texts = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                                   (GDestroyNotify)g_variant_unref, g_free);
+      g_hash_table_insert (shared_caches, key, self->shared);
+    }
+
+  self->shared->users++;
+  self->cache = g_object_ref (self->shared->cache);
   self->meta_sig = g_signal_connect (self->cache, "meta", G_CALLBACK (on_cache_meta), self);
   self->update_sig = g_signal_connect (self->cache, "update",
                                        G_CALLBACK (on_cache_update), self);
@@ -1972,6 +3476,18 @@ cockpit_dbus_json_prepare (CockpitChannel *channel)
       g_warning ("invalid \"address\" option in dbus channel");
       goto out;
     }
+  if (!cockpit_json_get_int (options, "notify-latency", 0, &self->notify_latency) ||
+      self->notify_latency < 0 || self->notify_latency >= G_MAXUINT)
+    {
+      g_warning ("invalid \"notify-latency\" option in dbus channel");
+      goto out;
+    }
+  if (!cockpit_json_get_int (options, "notify-batch", 100, &self->notify_batch) ||
+      self->notify_batch < 1)
+    {
+      g_warning ("invalid \"notify-batch\" option in dbus channel");
+      goto out;
+    }
 
   /*
    * The default bus is the "user" bus which doesn't exist in many
@@ -2104,6 +3620,17 @@ cockpit_dbus_json_dispose (GObject *object)
 
   g_cancellable_cancel (self->cancellable);
 
+  if (self->notify_timeout)
+    {
+      g_source_remove (self->notify_timeout);
+      self->notify_timeout = 0;
+    }
+  if (self->notify_pending)
+    {
+      g_hash_table_unref (self->notify_pending);
+      self->notify_pending = NULL;
+    }
+
   if (self->name_watched)
     {
       g_bus_unwatch_name (self->name_watch);
@@ -2114,11 +3641,36 @@ cockpit_dbus_json_dispose (GObject *object)
     {
       g_signal_handler_disconnect (self->cache, self->meta_sig);
       g_signal_handler_disconnect (self->cache, self->update_sig);
-      g_object_run_dispose (G_OBJECT (self->cache));
+
+      /* Give back the watches this channel added */
+      for (l = self->watch_list; l != NULL; l = g_list_next (l))
+        {
+          WatchEntry *watch = l->data;
+          cockpit_dbus_cache_unwatch (self->cache, watch->path, watch->is_namespace, watch->interface);
+        }
+
       g_object_unref (self->cache);
       self->cache = NULL;
     }
 
+  g_list_free_full (self->watch_list, watch_entry_free);
+  self->watch_list = NULL;
+
+  if (self->shared)
+    {
+      self->shared->users--;
+      if (self->shared->users == 0)
+        {
+          g_hash_table_remove (shared_caches, self->shared->key);
+          g_object_run_dispose (G_OBJECT (self->shared->cache));
+          g_object_unref (self->shared->cache);
+          g_hash_table_destroy (self->shared->texts);
+          g_free (self->shared->key);
+          g_slice_free (SharedCache, self->shared);
+        }
+      self->shared = NULL;
+    }
+
   /* Divorce ourselves the outstanding calls */
   for (l = self->active_calls; l != NULL; l = g_list_next (l))
     ((CallData *)l->data)->dbus_json = NULL;
@@ -2142,6 +3694,8 @@ cockpit_dbus_json_finalize (GObject *object)
   g_clear_object (&self->connection);
   g_object_unref (self->cancellable);
   cockpit_dbus_rules_free (self->rules);
+  cockpit_dbus_rules_free (self->watches);
+  g_hash_table_destroy (self->introsent);
 
   G_OBJECT_CLASS (cockpit_dbus_json_parent_class)->finalize (object);
 }
@@ -2208,3 +3762,76 @@ cockpit_dbus_json_open (CockpitTransport *transport,
   json_object_unref (options);
   return channel;
 }
+
+/**
+ * cockpit_dbus_json_parse_call:
+ * @message: a "call" message
+ * @args: location to return the call arguments
+ *
+ * This function is used by tests. This is how a channel looks for the
+ * arguments of a "call" message, before falling back to parsing the
+ * whole message as a tree.
+ *
+ * Returns: (transfer full): the message with empty arguments, or NULL
+ */
+JsonObject *
+cockpit_dbus_json_parse_call (GBytes *message,
+                              GBytes **args)
+{
+  g_return_val_if_fail (message != NULL, NULL);
+  g_return_val_if_fail (args != NULL, NULL);
+
+  return parse_call_message (message, args);
+}
+
+/**
+ * cockpit_dbus_json_scan_args:
+ * @args: JSON text of call arguments
+ * @type: the expected type
+ * @error: location to return an error
+ *
+ * This function is used by tests. Converts arguments straight from
+ * the JSON text, the way a channel does for most calls.
+ *
+ * Returns: (transfer full): the arguments, or NULL
+ */
+GVariant *
+cockpit_dbus_json_scan_args (GBytes *args,
+                             const GVariantType *type,
+                             GError **error)
+{
+  CockpitJsonScan scan;
+  GVariant *result;
+
+  g_return_val_if_fail (args != NULL, NULL);
+  g_return_val_if_fail (type != NULL, NULL);
+
+  scan_init (&scan, args);
+  result = scan_json (&scan, type, error);
+  return result ? g_variant_ref_sink (result) : NULL;
+}
+
+/**
+ * cockpit_dbus_json_build_args:
+ * @args: call arguments as a JSON tree
+ * @type: the expected type
+ * @error: location to return an error
+ *
+ * This function is used by tests. Converts arguments from a JSON tree,
+ * the way a channel does when the JSON text can't be used directly.
+ *
+ * Returns: (transfer full): the arguments, or NULL
+ */
+GVariant *
+cockpit_dbus_json_build_args (JsonNode *args,
+                              const GVariantType *type,
+                              GError **error)
+{
+  GVariant *result;
+
+  g_return_val_if_fail (args != NULL, NULL);
+  g_return_val_if_fail (type != NULL, NULL);
+
+  result = parse_json (args, type, error);
+  return result ? g_variant_ref_sink (result) : NULL;
+}
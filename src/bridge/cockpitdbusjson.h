@@ -34,4 +34,15 @@ CockpitChannel *   cockpit_dbus_json_open       (CockpitTransport *transport,
                                                  const gchar *channel_id,
                                                  const gchar *dbus_service);
 
+JsonObject *       cockpit_dbus_json_parse_call (GBytes *message,
+                                                 GBytes **args);
+
+GVariant *         cockpit_dbus_json_scan_args  (GBytes *args,
+                                                 const GVariantType *type,
+                                                 GError **error);
+
+GVariant *         cockpit_dbus_json_build_args (JsonNode *args,
+                                                 const GVariantType *type,
+                                                 GError **error);
+
 #endif /* COCKPIT_DBUS_JSON_H__ */
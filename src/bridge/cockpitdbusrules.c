@@ -36,6 +36,10 @@
  * We use several speed ups to quickly identify paths that are not matched
  * by the rules ... before then going into matching each rule in turn.
  *
+ * The rules are also indexed by path, and within each path by interface
+ * and member. So for a signal only the rules on its path, and on the
+ * namespaces that contain it, are looked at.
+ *
  * An empty rule set forwards nothing. It has a fast bypass flag which
  * disables all the logic.
  */
@@ -102,9 +106,15 @@ struct _CockpitDBusRules {
   GHashTable *all;
   GHashTable *paths;
   GTree *path_namespaces;
+
+  /* path -> bucket, see rule_key () */
+  GHashTable *by_path;
+  GHashTable *by_namespace;
+
   gboolean all_paths;
   gboolean only_paths;
   gboolean nothing;
+  gboolean any_arg0;
 };
 
 gchar *
@@ -150,6 +160,126 @@ rule_match (RuleData *rule,
   return TRUE;
 }
 
+/*
+ * A bucket holds the rules for one path, in lists keyed by interface
+ * and member. A rule without an interface or member has an empty
+ * string in its place, as neither can be empty themselves.
+ */
+static gboolean
+rule_key (gchar *key,
+          gsize length,
+          const gchar *interface,
+          const gchar *member)
+{
+  gint ret = g_snprintf (key, length, "%s\n%s", interface ? interface : "",
+                         member ? member : "");
+  return ret >= 0 && (gsize)ret < length;
+}
+
+static GHashTable *
+bucket_new (void)
+{
+  return g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                (GDestroyNotify)g_ptr_array_unref);
+}
+
+static void
+bucket_add (GHashTable *index,
+            RuleData *rule)
+{
+  GHashTable *bucket;
+  GPtrArray *list;
+  gchar *key;
+
+  bucket = g_hash_table_lookup (index, rule->path);
+  if (!bucket)
+    {
+      bucket = bucket_new ();
+      g_hash_table_insert (index, rule->path, bucket);
+    }
+
+  key = g_strdup_printf ("%s\n%s", rule->interface ? rule->interface : "",
+                         rule->member ? rule->member : "");
+  list = g_hash_table_lookup (bucket, key);
+  if (list)
+    {
+      g_free (key);
+    }
+  else
+    {
+      list = g_ptr_array_new ();
+      g_hash_table_insert (bucket, key, list);
+    }
+
+  g_ptr_array_add (list, rule);
+}
+
+static gboolean
+list_match (GPtrArray *list,
+            const gchar *path,
+            const gchar *interface,
+            const gchar *member,
+            const gchar *arg0)
+{
+  guint i;
+
+  if (list)
+    {
+      for (i = 0; i < list->len; i++)
+        {
+          if (rule_match (list->pdata[i], path, interface, member, arg0))
+            return TRUE;
+        }
+    }
+
+  return FALSE;
+}
+
+static gboolean
+bucket_match (GHashTable *bucket,
+              const gchar *path,
+              const gchar *interface,
+              const gchar *member,
+              const gchar *arg0)
+{
+  /* Interface and member names are limited to 255 characters each */
+  gchar key[520];
+  GHashTableIter iter;
+  GPtrArray *list;
+  const gchar *ifaces[] = { interface, NULL };
+  const gchar *members[] = { member, NULL };
+  guint i, j;
+
+  if (!bucket)
+    return FALSE;
+
+  if (interface && member)
+    {
+      for (i = 0; i < G_N_ELEMENTS (ifaces); i++)
+        {
+          for (j = 0; j < G_N_ELEMENTS (members); j++)
+            {
+              if (!rule_key (key, sizeof (key), ifaces[i], members[j]))
+                goto slow;
+              if (list_match (g_hash_table_lookup (bucket, key), path, interface, member, arg0))
+                return TRUE;
+            }
+        }
+      return FALSE;
+    }
+
+slow:
+  /* Without an interface or member any list may match */
+  g_hash_table_iter_init (&iter, bucket);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&list))
+    {
+      if (list_match (list, path, interface, member, arg0))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
 gboolean
 cockpit_dbus_rules_match (CockpitDBusRules *rules,
                           const gchar *path,
@@ -157,8 +287,9 @@ cockpit_dbus_rules_match (CockpitDBusRules *rules,
                           const gchar *member,
                           const gchar *arg0)
 {
-  GHashTableIter iter;
-  RuleData *rule;
+  gboolean ret = FALSE;
+  gchar *parent;
+  gchar *slash;
 
   g_return_val_if_fail (path != NULL, FALSE);
 
@@ -175,14 +306,34 @@ cockpit_dbus_rules_match (CockpitDBusRules *rules,
   if (rules->only_paths)
     return TRUE;
 
-  g_hash_table_iter_init (&iter, rules->all);
-  while (g_hash_table_iter_next (&iter, (gpointer *)&rule, NULL))
+  if (bucket_match (g_hash_table_lookup (rules->by_path, path), path, interface, member, arg0))
+    return TRUE;
+
+  if (g_hash_table_size (rules->by_namespace) == 0)
+    return FALSE;
+
+  /* Walk up through the path and each of its ancestors */
+  parent = g_strdup (path);
+  for (;;)
     {
-      if (rule_match (rule, path, interface, member, arg0))
-        return TRUE;
+      if (bucket_match (g_hash_table_lookup (rules->by_namespace, parent),
+                        path, interface, member, arg0))
+        {
+          ret = TRUE;
+          break;
+        }
+
+      slash = strrchr (parent, '/');
+      if (!slash || (slash == parent && parent[1] == '\0'))
+        break;
+      if (slash == parent)
+        slash[1] = '\0';
+      else
+        slash[0] = '\0';
     }
 
-  return FALSE;
+  g_free (parent);
+  return ret;
 }
 
 CockpitDBusRules *
@@ -227,9 +378,21 @@ recompile_rules (CockpitDBusRules *rules)
     g_tree_destroy (rules->path_namespaces);
   rules->path_namespaces = cockpit_paths_new ();
 
+  if (rules->by_path)
+    g_hash_table_remove_all (rules->by_path);
+  else
+    rules->by_path = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                            (GDestroyNotify)g_hash_table_unref);
+  if (rules->by_namespace)
+    g_hash_table_remove_all (rules->by_namespace);
+  else
+    rules->by_namespace = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                                 (GDestroyNotify)g_hash_table_unref);
+
   rules->all_paths = FALSE;
   rules->nothing = TRUE;
   rules->only_paths = TRUE;
+  rules->any_arg0 = FALSE;
 
   g_hash_table_iter_init (&iter, rules->all);
   while (g_hash_table_iter_next (&iter, (gpointer *)&rule, NULL))
@@ -241,17 +404,31 @@ recompile_rules (CockpitDBusRules *rules)
           if (g_str_equal (rule->path, "/"))
             rules->all_paths = TRUE;
           cockpit_paths_add (rules->path_namespaces, rule->path);
+          bucket_add (rules->by_namespace, rule);
         }
       else
         {
           g_hash_table_add (rules->paths, rule->path);
+          bucket_add (rules->by_path, rule);
         }
 
       if (rule->interface || rule->member || rule->arg0)
         rules->only_paths = FALSE;
+      if (rule->arg0)
+        rules->any_arg0 = TRUE;
     }
 }
 
+/*
+ * Whether any of the rules look at arg0. If not, then callers can skip
+ * pulling arg0 out of a message, and pass NULL to cockpit_dbus_rules_match().
+ */
+gboolean
+cockpit_dbus_rules_need_arg0 (CockpitDBusRules *rules)
+{
+  return rules->any_arg0;
+}
+
 gboolean
 cockpit_dbus_rules_add (CockpitDBusRules *rules,
                         const gchar *path,
@@ -337,5 +514,9 @@ cockpit_dbus_rules_free (CockpitDBusRules *rules)
     g_hash_table_destroy (rules->paths);
   if (rules->path_namespaces)
     g_tree_destroy (rules->path_namespaces);
+  if (rules->by_path)
+    g_hash_table_destroy (rules->by_path);
+  if (rules->by_namespace)
+    g_hash_table_destroy (rules->by_namespace);
   g_free (rules);
 }
@@ -800,20 +800,14 @@ static GDBusInterfaceVTable setup_vtable = {
 void
 cockpit_dbus_setup_startup (void)
 {
-  GDBusConnection *connection;
   GError *error = NULL;
 
-  connection = cockpit_dbus_internal_server ();
-  g_return_if_fail (connection != NULL);
-
-  g_dbus_connection_register_object (connection, "/setup", &setup_interface,
-                                     &setup_vtable, NULL, NULL, &error);
+  cockpit_dbus_internal_register_object ("/setup", &setup_interface,
+                                         &setup_vtable, NULL, NULL, &error);
 
   if (error != NULL)
     {
       g_critical ("couldn't register setup object: %s", error->message);
       g_error_free (error);
     }
-
-  g_object_unref (connection);
 }
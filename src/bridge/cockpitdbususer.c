@@ -185,19 +185,15 @@ static GDBusInterfaceVTable user_vtable = {
 void
 cockpit_dbus_user_startup (struct passwd *pwd)
 {
-  GDBusConnection *connection;
   GHashTable *props;
   GError *error = NULL;
 
-  connection = cockpit_dbus_internal_server ();
-  g_return_if_fail (connection != NULL);
-
   props = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GDestroyNotify)g_variant_unref);
   populate_passwd_props (props, pwd);
 
-  g_dbus_connection_register_object (connection, "/user", &user_interface,
-                                     &user_vtable, props, (GDestroyNotify)g_hash_table_unref,
-                                     &error);
+  cockpit_dbus_internal_register_object ("/user", &user_interface,
+                                         &user_vtable, props, (GDestroyNotify)g_hash_table_unref,
+                                         &error);
 
   if (error != NULL)
     {
@@ -205,6 +201,4 @@ cockpit_dbus_user_startup (struct passwd *pwd)
       g_hash_table_unref (props);
       g_error_free (error);
     }
-
-  g_object_unref (connection);
 }
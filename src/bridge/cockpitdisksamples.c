@@ -20,48 +20,39 @@
 #include "config.h"
 
 #include "cockpitdisksamples.h"
+#include "cockpitprocreader.h"
 
-#include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 
-/* TODO: this should be optimized so we don't allocate network and call open()/close() all the time */
-
 void
 cockpit_disk_samples (CockpitSamples *samples)
 {
-  gchar *contents = NULL;
-  GError *error = NULL;
-  gchar **lines = NULL;
+  static CockpitProcReader reader = COCKPIT_PROC_READER_INIT ("/proc/diskstats");
+  gchar *contents;
+  gchar *line;
   guint64 bytes_read;
   guint64 bytes_written;
   guint64 num_ops;
-  gsize len;
   guint n;
 
-  if (!g_file_get_contents ("/proc/diskstats", &contents, &len, &error))
-    {
-      g_message ("error loading contents /proc/vmstat: %s", error->message);
-      g_error_free (error);
-      goto out;
-    }
+  contents = cockpit_proc_reader_read (&reader, NULL);
+  if (!contents)
+    return;
 
   bytes_read = 0;
   bytes_written = 0;
   num_ops = 0;
 
-  lines = g_strsplit (contents, "\n", -1);
-  for (n = 0; lines != NULL && lines[n] != NULL; n++)
+  for (n = 0; (line = cockpit_proc_next_line (&contents)) != NULL; n++)
     {
-      const gchar *line = lines[n];
-      guint num_parsed;
-      gint dev_major, dev_minor;
-      gchar dev_name[64]; /* TODO: big enough? */
-      guint64 num_reads,  num_reads_merged,  num_sectors_read,    num_msec_reading;
-      guint64 num_writes, num_writes_merged, num_sectors_written, num_msec_writing;
-      guint64 num_io_in_progress, num_msec_doing_io, weighted_num_msec_doing_io;
+      guint64 dev_major, dev_minor;
+      gchar *dev_name;
+      guint64 fields[11];
+      gchar *pos;
+      gint i;
 
-      if (strlen (line) == 0)
+      if (line[0] == '\0')
         continue;
 
       /* From http://www.kernel.org/doc/Documentation/iostats.txt
@@ -98,18 +89,19 @@ cockpit_disk_samples (CockpitSamples *samples)
        *     I/O completion time and the backlog that may be accumulating.
        */
 
-      num_parsed = sscanf (line,
-                           "%d %d %64s"
-                           " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT
-                           " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT
-                           " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT,
-                           &dev_major, &dev_minor, dev_name,
-                           &num_reads,  &num_reads_merged, &num_sectors_read, &num_msec_reading,
-                           &num_writes, &num_writes_merged, &num_sectors_written, &num_msec_writing,
-                           &num_io_in_progress, &num_msec_doing_io, &weighted_num_msec_doing_io);
-      if (num_parsed != 14)
+      pos = line;
+      dev_name = NULL;
+      if (cockpit_proc_next_u64 (&pos, &dev_major) &&
+          cockpit_proc_next_u64 (&pos, &dev_minor))
+        dev_name = cockpit_proc_next_word (&pos);
+      for (i = 0; dev_name != NULL && i < G_N_ELEMENTS (fields); i++)
         {
-          g_warning ("Error parsing line %d of file /proc/diskstats (num_parsed=%d): `%s'", n, num_parsed, line);
+          if (!cockpit_proc_next_u64 (&pos, fields + i))
+            break;
+        }
+      if (dev_name == NULL || i != G_N_ELEMENTS (fields))
+        {
+          g_warning ("Error parsing line %d of file /proc/diskstats: `%s'", n, line);
           continue;
         }
 
@@ -130,16 +122,13 @@ cockpit_disk_samples (CockpitSamples *samples)
           && g_ascii_isdigit (dev_name[strlen (dev_name) - 1]))
         continue;
 
-      bytes_read += num_sectors_read * 512;
-      bytes_written += num_sectors_written * 512;
-      num_ops += num_reads_merged + num_writes_merged;
+      /* Field 3 and field 7, field 2 and field 6 */
+      bytes_read += fields[2] * 512;
+      bytes_written += fields[6] * 512;
+      num_ops += fields[1] + fields[5];
     }
 
   cockpit_samples_sample (samples, "disk.all.read", NULL, bytes_read);
   cockpit_samples_sample (samples, "disk.all.written", NULL, bytes_written);
   cockpit_samples_sample (samples, "disk.all.ops", NULL, num_ops);
-
-out:
-  g_strfreev (lines);
-  g_free (contents);
 }
@@ -28,7 +28,9 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <dirent.h>
 #include <errno.h>
+#include <stdlib.h>
 #include <string.h>
 
 /**
@@ -46,9 +48,28 @@ typedef struct {
   const gchar *path;
   GFileMonitor *monitor;
   guint sig_changed;
+  CockpitFswatchBatch *batch;
   GCancellable *cancellable;
+
+  /* For paged listing */
+  DIR *dir;
+  guint idler;
+  gboolean paused;
+  gint64 page_size;
+  gint64 limit;
+  gint64 listed;
+  guint attrs;
 } CockpitFslist;
 
+enum {
+  ATTR_SIZE = 1 << 0,
+  ATTR_MTIME = 1 << 1,
+  ATTR_MODE = 1 << 2,
+};
+
+/* How many entries to read at once, when not sending arrays */
+#define LIST_CHUNK 64
+
 typedef struct {
   CockpitChannelClass parent_class;
 } CockpitFslistClass;
@@ -81,6 +102,18 @@ error_to_problem (GError *error)
     return NULL;
 }
 
+static void
+listing_done (CockpitFslist *self)
+{
+  cockpit_channel_ready (COCKPIT_CHANNEL (self));
+
+  if (self->monitor == NULL)
+    {
+      cockpit_channel_control (COCKPIT_CHANNEL (self), "done", NULL);
+      cockpit_channel_close (COCKPIT_CHANNEL (self), NULL);
+    }
+}
+
 static void
 on_files_listed (GObject *source_object,
                  GAsyncResult *res,
@@ -111,14 +144,7 @@ on_files_listed (GObject *source_object,
     {
       g_clear_object (&self->cancellable);
       g_object_unref (source_object);
-
-      cockpit_channel_ready (COCKPIT_CHANNEL (self));
-
-      if (self->monitor == NULL)
-        {
-          cockpit_channel_control (COCKPIT_CHANNEL (self), "done", NULL);
-          cockpit_channel_close (COCKPIT_CHANNEL (self), NULL);
-        }
+      listing_done (self);
       return;
     }
 
@@ -197,7 +223,292 @@ on_changed (GFileMonitor      *monitor,
             gpointer           user_data)
 {
   CockpitFslist *self = COCKPIT_FSLIST(user_data);
-  cockpit_fswatch_emit_event (COCKPIT_CHANNEL(self), file, other_file, event_type);
+  if (self->batch)
+    cockpit_fswatch_batch_add (self->batch, file, other_file, event_type);
+  else
+    cockpit_fswatch_emit_event (COCKPIT_CHANNEL(self), file, other_file, event_type);
+}
+
+/*
+ * The paged listing reads the directory with readdir () rather than a
+ * GFileEnumerator, which would make a GFileInfo for every entry. The
+ * type comes from the directory entry itself, and a stat is only done
+ * for symlinks or when further attributes were asked for. Entries can
+ * be sent as arrays, and a listing can be cut short and resumed with a
+ * cursor.
+ */
+
+static JsonObject *
+build_entry (CockpitFslist *self,
+             struct dirent *entry)
+{
+  gboolean need_stat;
+  JsonObject *msg;
+  const gchar *type;
+  struct stat st;
+
+  switch (entry->d_type)
+    {
+    case DT_REG:
+      type = "file";
+      break;
+    case DT_DIR:
+      type = "directory";
+      break;
+    case DT_CHR:
+    case DT_BLK:
+    case DT_FIFO:
+    case DT_SOCK:
+      type = "special";
+      break;
+    default:
+      type = NULL;
+      break;
+    }
+
+  /* Symlinks are followed, the same as in the GFileEnumerator listing */
+  need_stat = (type == NULL || self->attrs != 0);
+  if (need_stat && fstatat (dirfd (self->dir), entry->d_name, &st, 0) < 0)
+    {
+      need_stat = FALSE;
+      if (!type)
+        type = entry->d_type == DT_LNK ? "link" : "unknown";
+    }
+
+  if (!type)
+    {
+      if (S_ISREG (st.st_mode))
+        type = "file";
+      else if (S_ISDIR (st.st_mode))
+        type = "directory";
+      else
+        type = "special";
+    }
+
+  msg = json_object_new ();
+  json_object_set_string_member (msg, "event", "present");
+  json_object_set_string_member (msg, "path", entry->d_name);
+  json_object_set_string_member (msg, "type", type);
+
+  if (need_stat)
+    {
+      if (self->attrs & ATTR_SIZE)
+        json_object_set_int_member (msg, "size", st.st_size);
+      if (self->attrs & ATTR_MTIME)
+        json_object_set_int_member (msg, "mtime", st.st_mtime);
+      if (self->attrs & ATTR_MODE)
+        json_object_set_int_member (msg, "mode", st.st_mode & 07777);
+    }
+
+  return msg;
+}
+
+static void
+send_entries (CockpitFslist *self,
+              JsonArray *array)
+{
+  JsonNode *node;
+  GBytes *bytes;
+  gchar *data;
+  gsize length;
+
+  node = json_node_new (JSON_NODE_ARRAY);
+  json_node_take_array (node, array);
+  data = cockpit_json_write (node, &length);
+  json_node_free (node);
+
+  bytes = g_bytes_new_take (data, length);
+  cockpit_channel_send (COCKPIT_CHANNEL (self), bytes, FALSE);
+  g_bytes_unref (bytes);
+}
+
+static void
+send_object (CockpitFslist *self,
+             JsonObject *msg)
+{
+  GBytes *bytes;
+
+  bytes = cockpit_json_write_bytes (msg);
+  cockpit_channel_send (COCKPIT_CHANNEL (self), bytes, FALSE);
+  g_bytes_unref (bytes);
+}
+
+static gboolean
+on_idle_list_entries (gpointer user_data)
+{
+  CockpitFslist *self = COCKPIT_FSLIST (user_data);
+  JsonArray *array = NULL;
+  struct dirent *entry;
+  JsonObject *msg;
+  gchar *cursor;
+  gint64 count;
+  glong pos;
+
+  count = self->page_size > 0 ? self->page_size : LIST_CHUNK;
+  if (self->page_size > 0)
+    array = json_array_new ();
+
+  for (;;)
+    {
+      pos = telldir (self->dir);
+      errno = 0;
+      entry = readdir (self->dir);
+      if (entry == NULL)
+        break;
+
+      if (g_str_equal (entry->d_name, ".") || g_str_equal (entry->d_name, ".."))
+        continue;
+
+      /* Stop before this entry, and tell the caller where to pick up */
+      if (self->limit > 0 && self->listed == self->limit)
+        {
+          if (array)
+            send_entries (self, array);
+          array = NULL;
+
+          cursor = g_strdup_printf ("%ld", pos);
+          msg = json_object_new ();
+          json_object_set_string_member (msg, "event", "more");
+          json_object_set_string_member (msg, "cursor", cursor);
+          send_object (self, msg);
+          json_object_unref (msg);
+          g_free (cursor);
+          break;
+        }
+
+      msg = build_entry (self, entry);
+      self->listed++;
+      count--;
+
+      if (array)
+        {
+          json_array_add_object_element (array, msg);
+        }
+      else
+        {
+          send_object (self, msg);
+          json_object_unref (msg);
+        }
+
+      if (count == 0)
+        {
+          if (array)
+            send_entries (self, array);
+          return TRUE;
+        }
+    }
+
+  if (entry == NULL && errno != 0)
+    {
+      msg = cockpit_channel_close_options (COCKPIT_CHANNEL (self));
+      json_object_set_string_member (msg, "message", g_strerror (errno));
+      g_message ("%s: couldn't list directory: %s", self->path, g_strerror (errno));
+      if (array)
+        json_array_unref (array);
+      self->idler = 0;
+      cockpit_channel_close (COCKPIT_CHANNEL (self), "internal-error");
+      return FALSE;
+    }
+
+  if (array)
+    {
+      if (json_array_get_length (array) > 0)
+        send_entries (self, array);
+      else
+        json_array_unref (array);
+    }
+
+  closedir (self->dir);
+  self->dir = NULL;
+  self->idler = 0;
+  listing_done (self);
+  return FALSE;
+}
+
+static void
+cockpit_fslist_pressure (CockpitChannel *channel,
+                         gboolean pressure)
+{
+  CockpitFslist *self = COCKPIT_FSLIST (channel);
+
+  /* Stop listing until the peer catches up */
+  if (pressure && self->idler)
+    {
+      g_source_remove (self->idler);
+      self->idler = 0;
+      self->paused = TRUE;
+    }
+  else if (!pressure && self->paused)
+    {
+      self->paused = FALSE;
+      self->idler = g_idle_add (on_idle_list_entries, self);
+    }
+}
+
+static gboolean
+parse_paged_options (CockpitFslist *self,
+                     JsonObject *options,
+                     gboolean *paged,
+                     glong *cursor)
+{
+  const gchar *cursor_str;
+  gchar **attributes;
+  gchar *end;
+  gint i;
+
+  if (!cockpit_json_get_int (options, "batch", 0, &self->page_size) || self->page_size < 0)
+    {
+      g_warning ("invalid \"batch\" option for fslist1 channel");
+      return FALSE;
+    }
+  if (!cockpit_json_get_int (options, "limit", 0, &self->limit) || self->limit < 0)
+    {
+      g_warning ("invalid \"limit\" option for fslist1 channel");
+      return FALSE;
+    }
+  if (!cockpit_json_get_string (options, "cursor", NULL, &cursor_str))
+    {
+      g_warning ("invalid \"cursor\" option for fslist1 channel");
+      return FALSE;
+    }
+  if (!cockpit_json_get_strv (options, "attributes", NULL, &attributes))
+    {
+      g_warning ("invalid \"attributes\" option for fslist1 channel");
+      return FALSE;
+    }
+
+  *cursor = -1;
+  if (cursor_str)
+    {
+      errno = 0;
+      *cursor = strtol (cursor_str, &end, 10);
+      if (errno != 0 || *end != '\0' || end == cursor_str || *cursor < 0)
+        {
+          g_warning ("invalid \"cursor\" option for fslist1 channel");
+          g_free (attributes);
+          return FALSE;
+        }
+    }
+
+  for (i = 0; attributes && attributes[i]; i++)
+    {
+      if (g_str_equal (attributes[i], "size"))
+        self->attrs |= ATTR_SIZE;
+      else if (g_str_equal (attributes[i], "mtime"))
+        self->attrs |= ATTR_MTIME;
+      else if (g_str_equal (attributes[i], "mode"))
+        self->attrs |= ATTR_MODE;
+      else if (!g_str_equal (attributes[i], "type"))
+        {
+          g_warning ("unsupported \"attributes\" option for fslist1 channel: %s", attributes[i]);
+          g_free (attributes);
+          return FALSE;
+        }
+    }
+
+  *paged = (self->page_size > 0 || self->limit > 0 || cursor_str || attributes);
+  g_free (attributes);
+  return TRUE;
 }
 
 static void
@@ -209,6 +520,9 @@ cockpit_fslist_prepare (CockpitChannel *channel)
   GError *error = NULL;
   GFile *file = NULL;
   gboolean watch;
+  gboolean paged;
+  guint debounce;
+  glong cursor;
 
   COCKPIT_CHANNEL_CLASS (cockpit_fslist_parent_class)->prepare (channel);
 
@@ -230,6 +544,15 @@ cockpit_fslist_prepare (CockpitChannel *channel)
       goto out;
     }
 
+  if (!cockpit_fswatch_parse_debounce (channel, &debounce))
+    {
+      g_warning ("invalid \"debounce\" option for fslist1 channel");
+      goto out;
+    }
+
+  if (!parse_paged_options (self, options, &paged, &cursor))
+    goto out;
+
   self->cancellable = g_cancellable_new ();
 
   file = g_file_new_for_path (self->path);
@@ -246,9 +569,37 @@ cockpit_fslist_prepare (CockpitChannel *channel)
           goto out;
         }
 
+      if (debounce > 0)
+        self->batch = cockpit_fswatch_batch_new (channel, debounce);
       self->sig_changed = g_signal_connect (self->monitor, "changed", G_CALLBACK (on_changed), self);
     }
 
+  if (paged)
+    {
+      self->dir = opendir (self->path);
+      if (self->dir == NULL)
+        {
+          options = cockpit_channel_close_options (channel);
+          json_object_set_string_member (options, "message", g_strerror (errno));
+          if (errno == EACCES || errno == EPERM)
+            problem = "access-denied";
+          else if (errno == ENOENT || errno == ENOTDIR)
+            problem = "not-found";
+          else
+            {
+              g_warning ("%s: couldn't list directory: %s", self->path, g_strerror (errno));
+              problem = "internal-error";
+            }
+          goto out;
+        }
+
+      if (cursor >= 0)
+        seekdir (self->dir, cursor);
+      self->idler = g_idle_add (on_idle_list_entries, self);
+      problem = NULL;
+      goto out;
+    }
+
   g_file_enumerate_children_async (file,
                                    G_FILE_ATTRIBUTE_STANDARD_NAME "," G_FILE_ATTRIBUTE_STANDARD_TYPE,
                                    G_FILE_QUERY_INFO_NONE,
@@ -271,9 +622,21 @@ cockpit_fslist_dispose (GObject *object)
 {
   CockpitFslist *self = COCKPIT_FSLIST (object);
 
+  /* Before spinning the main loop below, so the window can't fire */
+  if (self->batch)
+    cockpit_fswatch_batch_free (self->batch);
+  self->batch = NULL;
+
   if (self->cancellable)
     g_cancellable_cancel (self->cancellable);
 
+  if (self->idler)
+    g_source_remove (self->idler);
+  self->idler = 0;
+  if (self->dir)
+    closedir (self->dir);
+  self->dir = NULL;
+
   if (self->monitor)
     {
       if (self->sig_changed)
@@ -323,6 +686,7 @@ cockpit_fslist_class_init (CockpitFslistClass *klass)
 
   channel_class->prepare = cockpit_fslist_prepare;
   channel_class->recv = cockpit_fslist_recv;
+  channel_class->pressure = cockpit_fslist_pressure;
 }
 
 /**
@@ -0,0 +1,551 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2016 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitfsmirror.h"
+#include "cockpitfsread.h"
+#include "cockpitfswatch.h"
+
+#include "common/cockpitjson.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * CockpitFsmirror:
+ *
+ * A #CockpitChannel that sends the content of a file, and then the
+ * parts that change each time the file changes.
+ *
+ * The payload type for this channel is 'fsmirror1'.
+ *
+ * The channel doesn't keep a copy of the file. It keeps a hash of
+ * each block the peer has, and on each change reads the file again
+ * a block at a time, sending the blocks whose hash is different.
+ * When the same file has grown, like a log, and its last block is
+ * as before, only the new part is read.
+ */
+
+#define MIRROR_BLOCK_SIZE 4096
+
+#define COCKPIT_FSMIRROR(o)    (G_TYPE_CHECK_INSTANCE_CAST ((o), COCKPIT_TYPE_FSMIRROR, CockpitFsmirror))
+
+typedef struct {
+  CockpitChannel parent;
+  const gchar *path;
+  GFileMonitor *monitor;
+  guint sig_changed;
+  guint debounce;
+  guint timeout;
+  gboolean pressure;
+
+  /* The content the peer has, a hash per block */
+  gchar *tag;
+  gint64 size;
+  dev_t dev;
+  ino_t ino;
+  GArray *hashes;
+
+  /* The pass in progress, reading the file a block at a time */
+  int fd;
+  gchar *pass_tag;
+  gint64 pass_size;
+  gint64 offset;
+  gint64 unchanged;
+  gint64 next;
+  guint idler;
+  gboolean dirty;
+} CockpitFsmirror;
+
+typedef struct {
+  CockpitChannelClass parent_class;
+} CockpitFsmirrorClass;
+
+G_DEFINE_TYPE (CockpitFsmirror, cockpit_fsmirror, COCKPIT_TYPE_CHANNEL);
+
+static gboolean    on_idle_read       (gpointer data);
+
+static guint64
+hash_block (const guchar *data,
+            gsize length)
+{
+  guint64 hash = G_GUINT64_CONSTANT (14695981039346656037);
+  gsize i;
+
+  /* FNV-1a, only used to tell whether a block has changed */
+  for (i = 0; i < length; i++)
+    {
+      hash ^= data[i];
+      hash *= G_GUINT64_CONSTANT (1099511628211);
+    }
+
+  return hash;
+}
+
+static void
+mirror_failed (CockpitFsmirror *self,
+               const gchar *what,
+               int err)
+{
+  CockpitChannel *channel = COCKPIT_CHANNEL (self);
+  JsonObject *options;
+
+  if (err == EPERM || err == EACCES)
+    {
+      g_debug ("%s: couldn't %s: %s", self->path, what, g_strerror (err));
+      cockpit_channel_close (channel, "access-denied");
+    }
+  else
+    {
+      g_message ("%s: couldn't %s: %s", self->path, what, g_strerror (err));
+      options = cockpit_channel_close_options (channel);
+      json_object_set_string_member (options, "message", g_strerror (err));
+      cockpit_channel_close (channel, "internal-error");
+    }
+}
+
+static void
+send_change (CockpitFsmirror *self,
+             gint64 offset)
+{
+  JsonObject *options;
+
+  options = json_object_new ();
+  json_object_set_int_member (options, "offset", offset);
+  cockpit_channel_control (COCKPIT_CHANNEL (self), "change", options);
+  json_object_unref (options);
+}
+
+static void
+send_sync (CockpitFsmirror *self,
+           gchar *tag,
+           gint64 size)
+{
+  JsonObject *options;
+
+  g_free (self->tag);
+  self->tag = tag;
+  self->size = size;
+
+  options = json_object_new ();
+  json_object_set_int_member (options, "size", size);
+  json_object_set_string_member (options, "tag", tag);
+  cockpit_channel_control (COCKPIT_CHANNEL (self), "sync", options);
+  json_object_unref (options);
+}
+
+static void
+end_pass (CockpitFsmirror *self)
+{
+  if (self->idler)
+    g_source_remove (self->idler);
+  self->idler = 0;
+  if (self->fd >= 0)
+    close (self->fd);
+  self->fd = -1;
+  g_free (self->pass_tag);
+  self->pass_tag = NULL;
+}
+
+static gboolean
+read_at (CockpitFsmirror *self,
+         guchar *data,
+         gsize length,
+         gint64 offset,
+         gssize *ret)
+{
+  do
+    *ret = pread (self->fd, data, length, offset);
+  while (*ret < 0 && errno == EINTR);
+
+  if (*ret < 0)
+    {
+      mirror_failed (self, "read", errno);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+start_pass (CockpitFsmirror *self)
+{
+  guchar data[MIRROR_BLOCK_SIZE];
+  struct stat buf;
+  gint64 check;
+  gssize ret;
+  gchar *tag;
+
+  self->dirty = FALSE;
+  self->fd = open (self->path, O_RDONLY | O_CLOEXEC);
+  if (self->fd < 0)
+    {
+      if (errno != ENOENT)
+        {
+          mirror_failed (self, "open", errno);
+          return FALSE;
+        }
+
+      /* Tell the peer once that it's gone */
+      if (g_strcmp0 (self->tag, "-") != 0)
+        {
+          g_array_set_size (self->hashes, 0);
+          send_sync (self, g_strdup ("-"), 0);
+        }
+      return FALSE;
+    }
+
+  if (fstat (self->fd, &buf) < 0)
+    {
+      mirror_failed (self, "stat", errno);
+      return FALSE;
+    }
+  if (!S_ISREG (buf.st_mode))
+    {
+      mirror_failed (self, "mirror", S_ISDIR (buf.st_mode) ? EISDIR : EINVAL);
+      return FALSE;
+    }
+
+  /* Nothing changed since what was last sent, the mtime may be coarse so check the size too */
+  tag = cockpit_get_file_tag_from_fd (self->fd);
+  if (g_strcmp0 (tag, self->tag) == 0 && buf.st_size == self->size)
+    {
+      g_free (tag);
+      end_pass (self);
+      return FALSE;
+    }
+
+  self->pass_tag = tag;
+  self->pass_size = buf.st_size;
+  self->offset = 0;
+  self->unchanged = 0;
+  self->next = -1;
+
+  /*
+   * The same file grown, like a log. When the block the peer's copy
+   * ends in is unchanged, assume that everything before it is too.
+   */
+  if (self->size > 0 && buf.st_dev == self->dev && buf.st_ino == self->ino &&
+      buf.st_size >= self->size)
+    {
+      check = ((self->size - 1) / MIRROR_BLOCK_SIZE) * MIRROR_BLOCK_SIZE;
+      if (!read_at (self, data, self->size - check, check, &ret))
+        return FALSE;
+      if (ret == self->size - check &&
+          hash_block (data, ret) == g_array_index (self->hashes, guint64, check / MIRROR_BLOCK_SIZE))
+        {
+          self->offset = check;
+          self->unchanged = self->size;
+        }
+    }
+
+  self->dev = buf.st_dev;
+  self->ino = buf.st_ino;
+  return TRUE;
+}
+
+static void
+finish_pass (CockpitFsmirror *self)
+{
+  gchar *tag;
+
+  /* Changed while it was being read, there's another pass to come */
+  tag = cockpit_get_file_tag_from_fd (self->fd);
+  if (g_strcmp0 (tag, self->pass_tag) != 0)
+    self->dirty = TRUE;
+  g_free (tag);
+
+  g_array_set_size (self->hashes, (self->pass_size + MIRROR_BLOCK_SIZE - 1) / MIRROR_BLOCK_SIZE);
+  send_sync (self, self->pass_tag, self->pass_size);
+  self->pass_tag = NULL;
+}
+
+static gboolean
+on_timeout_pass (gpointer data)
+{
+  CockpitFsmirror *self = data;
+
+  self->timeout = 0;
+  if (start_pass (self) && !self->pressure)
+    self->idler = g_idle_add (on_idle_read, self);
+  return FALSE;
+}
+
+static void
+schedule_pass (CockpitFsmirror *self)
+{
+  /* Once the pass in progress is done */
+  if (self->fd >= 0)
+    self->dirty = TRUE;
+  else if (!self->timeout)
+    self->timeout = g_timeout_add (self->debounce, on_timeout_pass, self);
+}
+
+static gboolean
+on_idle_read (gpointer data)
+{
+  CockpitChannel *channel = data;
+  CockpitFsmirror *self = data;
+  GBytes *block;
+  GBytes *payload;
+  guchar *buffer;
+  gint64 start;
+  gssize length;
+  gssize ret;
+  guint index;
+  guint64 hash;
+
+  if (self->offset >= self->pass_size)
+    {
+      self->idler = 0;
+      finish_pass (self);
+      end_pass (self);
+      if (self->dirty)
+        schedule_pass (self);
+      return FALSE;
+    }
+
+  length = MIN (MIRROR_BLOCK_SIZE, self->pass_size - self->offset);
+  buffer = g_malloc (length);
+  if (!read_at (self, buffer, length, self->offset, &ret))
+    {
+      g_free (buffer);
+      return FALSE;
+    }
+
+  /* Truncated while being read, this is the last block */
+  if (ret < length)
+    {
+      self->pass_size = self->offset + ret;
+      self->dirty = TRUE;
+      if (ret == 0)
+        {
+          g_free (buffer);
+          return TRUE;
+        }
+    }
+
+  hash = hash_block (buffer, ret);
+  index = self->offset / MIRROR_BLOCK_SIZE;
+  start = MAX (self->offset, self->unchanged);
+
+  if ((index >= self->hashes->len || g_array_index (self->hashes, guint64, index) != hash) &&
+      start < self->offset + ret)
+    {
+      if (self->next != start)
+        send_change (self, start);
+
+      block = g_bytes_new_take (buffer, ret);
+      payload = g_bytes_new_from_bytes (block, start - self->offset, self->offset + ret - start);
+      cockpit_channel_send (channel, payload, FALSE);
+      g_bytes_unref (payload);
+      g_bytes_unref (block);
+
+      self->next = self->offset + ret;
+    }
+  else
+    {
+      g_free (buffer);
+    }
+
+  if (index >= self->hashes->len)
+    g_array_set_size (self->hashes, index + 1);
+  g_array_index (self->hashes, guint64, index) = hash;
+
+  self->offset += ret;
+  return TRUE;
+}
+
+static void
+on_changed (GFileMonitor      *monitor,
+            GFile             *file,
+            GFile             *other_file,
+            GFileMonitorEvent  event_type,
+            gpointer           user_data)
+{
+  schedule_pass (user_data);
+}
+
+static void
+cockpit_fsmirror_recv (CockpitChannel *channel,
+                       GBytes *message)
+{
+  g_warning ("received unexpected message in fsmirror channel");
+  cockpit_channel_close (channel, "protocol-error");
+}
+
+static void
+cockpit_fsmirror_pressure (CockpitChannel *channel,
+                           gboolean pressure)
+{
+  CockpitFsmirror *self = COCKPIT_FSMIRROR (channel);
+
+  /* Stop reading blocks until the peer catches up */
+  self->pressure = pressure;
+  if (pressure && self->idler)
+    {
+      g_source_remove (self->idler);
+      self->idler = 0;
+    }
+  else if (!pressure && self->fd >= 0 && !self->idler)
+    {
+      self->idler = g_idle_add (on_idle_read, self);
+    }
+}
+
+static void
+cockpit_fsmirror_init (CockpitFsmirror *self)
+{
+  self->fd = -1;
+  self->hashes = g_array_new (FALSE, TRUE, sizeof (guint64));
+}
+
+static void
+cockpit_fsmirror_prepare (CockpitChannel *channel)
+{
+  CockpitFsmirror *self = COCKPIT_FSMIRROR (channel);
+  const gchar *problem = "protocol-error";
+  JsonObject *options;
+  GError *error = NULL;
+  GFile *file;
+
+  COCKPIT_CHANNEL_CLASS (cockpit_fsmirror_parent_class)->prepare (channel);
+
+  options = cockpit_channel_get_options (channel);
+  if (!cockpit_json_get_string (options, "path", NULL, &self->path))
+    {
+      g_warning ("invalid \"path\" option for fsmirror channel");
+      goto out;
+    }
+  if (self->path == NULL || *(self->path) == 0)
+    {
+      g_warning ("missing \"path\" option for fsmirror channel");
+      goto out;
+    }
+  if (!cockpit_fswatch_parse_debounce (channel, &self->debounce))
+    {
+      g_warning ("invalid \"debounce\" option for fsmirror channel");
+      goto out;
+    }
+
+  /* Watch first, so no change between the first read and the watch is missed */
+  file = g_file_new_for_path (self->path);
+  self->monitor = g_file_monitor (file, 0, NULL, &error);
+  g_object_unref (file);
+
+  if (self->monitor == NULL)
+    {
+      g_message ("%s: %s", self->path, error->message);
+      options = cockpit_channel_close_options (channel);
+      json_object_set_string_member (options, "message", error->message);
+      problem = "internal-error";
+      goto out;
+    }
+
+  self->sig_changed = g_signal_connect (self->monitor, "changed", G_CALLBACK (on_changed), self);
+
+  cockpit_channel_ready (channel);
+  self->timeout = g_idle_add (on_timeout_pass, self);
+  problem = NULL;
+
+out:
+  g_clear_error (&error);
+  if (problem)
+    cockpit_channel_close (channel, problem);
+}
+
+static void
+cockpit_fsmirror_close (CockpitChannel *channel,
+                        const gchar *problem)
+{
+  CockpitFsmirror *self = COCKPIT_FSMIRROR (channel);
+
+  /* No more passes, the monitor itself goes in dispose */
+  if (self->sig_changed)
+    g_signal_handler_disconnect (self->monitor, self->sig_changed);
+  self->sig_changed = 0;
+
+  end_pass (self);
+  if (self->timeout)
+    g_source_remove (self->timeout);
+  self->timeout = 0;
+
+  COCKPIT_CHANNEL_CLASS (cockpit_fsmirror_parent_class)->close (channel, problem);
+}
+
+static void
+cockpit_fsmirror_dispose (GObject *object)
+{
+  CockpitFsmirror *self = COCKPIT_FSMIRROR (object);
+
+  end_pass (self);
+  if (self->timeout)
+    g_source_remove (self->timeout);
+  self->timeout = 0;
+
+  if (self->monitor)
+    {
+      if (self->sig_changed)
+        g_signal_handler_disconnect (self->monitor, self->sig_changed);
+      self->sig_changed = 0;
+
+      /* See cockpit_fswatch_dispose() for why this spins the main loop */
+      g_file_monitor_cancel (self->monitor);
+      for (int tries = 0; tries < 10; tries ++)
+        {
+          if (!g_main_context_iteration (NULL, FALSE))
+            break;
+        }
+    }
+
+  G_OBJECT_CLASS (cockpit_fsmirror_parent_class)->dispose (object);
+}
+
+static void
+cockpit_fsmirror_finalize (GObject *object)
+{
+  CockpitFsmirror *self = COCKPIT_FSMIRROR (object);
+
+  g_clear_object (&self->monitor);
+  g_array_free (self->hashes, TRUE);
+  g_free (self->tag);
+  g_assert (self->idler == 0);
+
+  G_OBJECT_CLASS (cockpit_fsmirror_parent_class)->finalize (object);
+}
+
+static void
+cockpit_fsmirror_class_init (CockpitFsmirrorClass *klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+  CockpitChannelClass *channel_class = COCKPIT_CHANNEL_CLASS (klass);
+
+  gobject_class->dispose = cockpit_fsmirror_dispose;
+  gobject_class->finalize = cockpit_fsmirror_finalize;
+
+  channel_class->prepare = cockpit_fsmirror_prepare;
+  channel_class->recv = cockpit_fsmirror_recv;
+  channel_class->close = cockpit_fsmirror_close;
+  channel_class->pressure = cockpit_fsmirror_pressure;
+}
@@ -29,6 +29,7 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
+#include <unistd.h>
 
 /**
  * CockpitFsread:
@@ -36,8 +37,17 @@
  * A #CockpitChannel that reads the content of a file.
  *
  * The payload type for this channel is 'fsread1'.
+ *
+ * The file is read a block at a time from the main loop, and reading
+ * stops while the channel is under back pressure. So a large file is
+ * never held in memory all at once.
  */
 
+/* Files smaller than this are sent in a single message */
+#define SINGLE_BLOCK_SIZE 8192
+
+#define BLOCK_SIZE 4096
+
 #define COCKPIT_FSREAD(o)    (G_TYPE_CHECK_INSTANCE_CAST ((o), COCKPIT_TYPE_FSREAD, CockpitFsread))
 
 typedef struct {
@@ -45,8 +55,12 @@ typedef struct {
   const gchar *path;
   int fd;
   gchar *start_tag;
-  GQueue *queue;
+  gsize block_size;
+  gint64 remaining;
+  gboolean eof;
+  GConverter *compressor;
   guint idler;
+  gboolean paused;
 } CockpitFsread;
 
 typedef struct {
@@ -55,17 +69,129 @@ typedef struct {
 
 G_DEFINE_TYPE (CockpitFsread, cockpit_fsread, COCKPIT_TYPE_CHANNEL);
 
+static GBytes *
+read_block (CockpitFsread *self,
+            const gchar **problem)
+{
+  JsonObject *options;
+  gssize ret;
+  gchar *data;
+
+  gsize size;
+
+  /* A "length" was given and has all been read */
+  if (self->remaining == 0)
+    return NULL;
+
+  size = self->block_size;
+  if (self->remaining > 0 && (gint64)size > self->remaining)
+    size = self->remaining;
+
+  data = g_malloc (size);
+  do
+    ret = read (self->fd, data, size);
+  while (ret < 0 && errno == EINTR);
+
+  if (ret < 0)
+    {
+      g_message ("%s: couldn't read: %s", self->path, g_strerror (errno));
+      options = cockpit_channel_close_options (COCKPIT_CHANNEL (self));
+      json_object_set_string_member (options, "message", g_strerror (errno));
+      *problem = "internal-error";
+      g_free (data);
+      return NULL;
+    }
+  else if (ret == 0)
+    {
+      g_free (data);
+      return NULL;
+    }
+
+  if (self->remaining > 0)
+    self->remaining -= ret;
+
+  /* After the first block, the rest go in even sized pieces */
+  self->block_size = BLOCK_SIZE;
+  return g_bytes_new_take (g_realloc (data, ret), ret);
+}
+
+static GBytes *
+compress_block (CockpitFsread *self,
+                GBytes *input,
+                const gchar **problem)
+{
+  GError *error = NULL;
+  JsonObject *options;
+  GBytes *output;
+
+  /* Input of NULL means the end of the file, flush what's left */
+  output = cockpit_convert_bytes (self->compressor, input, input == NULL, &error);
+  if (input)
+    g_bytes_unref (input);
+
+  if (!output)
+    {
+      g_message ("%s: couldn't compress: %s", self->path, error->message);
+      options = cockpit_channel_close_options (COCKPIT_CHANNEL (self));
+      json_object_set_string_member (options, "message", error->message);
+      *problem = "internal-error";
+      g_error_free (error);
+      return NULL;
+    }
+
+  if (input == NULL)
+    {
+      g_clear_object (&self->compressor);
+
+      /* The last of the compressed data goes out before "done" */
+      if (g_bytes_get_size (output) > 0)
+        cockpit_channel_send (COCKPIT_CHANNEL (self), output, FALSE);
+      g_bytes_unref (output);
+      return NULL;
+    }
+
+  return output;
+}
+
 static gboolean
 on_idle_send_block (gpointer data)
 {
   CockpitChannel *channel = data;
   CockpitFsread *self = data;
-  const gchar *problem;
+  const gchar *problem = NULL;
   JsonObject *options;
-  GBytes *payload;
+  GBytes *payload = NULL;
   gchar *tag;
 
-  payload = g_queue_pop_head (self->queue);
+  if (!self->eof)
+    {
+      payload = read_block (self, &problem);
+      if (problem)
+        {
+          self->idler = 0;
+          cockpit_channel_close (channel, problem);
+          return FALSE;
+        }
+    }
+
+  if (self->compressor)
+    {
+      payload = compress_block (self, payload, &problem);
+      if (problem)
+        {
+          self->idler = 0;
+          cockpit_channel_close (channel, problem);
+          return FALSE;
+        }
+
+      /* Compressor is still collecting input */
+      if (payload && g_bytes_get_size (payload) == 0)
+        {
+          g_bytes_unref (payload);
+          return TRUE;
+        }
+    }
+
   if (payload == NULL)
     {
       self->idler = 0;
@@ -106,6 +232,26 @@ cockpit_fsread_recv (CockpitChannel *channel,
   cockpit_channel_close (channel, "protocol-error");
 }
 
+static void
+cockpit_fsread_pressure (CockpitChannel *channel,
+                         gboolean pressure)
+{
+  CockpitFsread *self = COCKPIT_FSREAD (channel);
+
+  /* Stop sending blocks until the peer catches up */
+  if (pressure && self->idler)
+    {
+      g_source_remove (self->idler);
+      self->idler = 0;
+      self->paused = TRUE;
+    }
+  else if (!pressure && self->paused)
+    {
+      self->paused = FALSE;
+      self->idler = g_idle_add (on_idle_send_block, self);
+    }
+}
+
 static gchar *
 file_tag_from_stat (int res,
                     int err,
@@ -126,6 +272,75 @@ file_tag_from_stat (int res,
     return NULL;
 }
 
+/**
+ * cockpit_convert_bytes:
+ * @converter: a compressor or decompressor
+ * @input: (allow-none): the data to convert
+ * @at_end: whether this is the end of the input
+ * @error: location to place an error
+ *
+ * Runs the next piece of a stream through @converter. The output
+ * may be empty when the converter is waiting for more input. When
+ * @at_end is set, everything still held by the converter comes out.
+ *
+ * Returns: (transfer full): the converted data, or %NULL on error
+ */
+GBytes *
+cockpit_convert_bytes (GConverter *converter,
+                       GBytes *input,
+                       gboolean at_end,
+                       GError **error)
+{
+  GConverterResult result;
+  GError *local = NULL;
+  const guint8 *in = NULL;
+  gsize inl = 0;
+  gsize outl, space, read, written;
+  GByteArray *out;
+
+  if (input)
+    in = g_bytes_get_data (input, &inl);
+
+  out = g_byte_array_new ();
+  space = MAX (inl, 4096);
+
+  while (inl > 0 || at_end)
+    {
+      outl = out->len;
+      g_byte_array_set_size (out, outl + space);
+
+      result = g_converter_convert (converter, in, inl, out->data + outl, space,
+                                    at_end ? G_CONVERTER_INPUT_AT_END : G_CONVERTER_NO_FLAGS,
+                                    &read, &written, &local);
+
+      if (result == G_CONVERTER_ERROR)
+        {
+          g_byte_array_set_size (out, outl);
+
+          /* Output didn't fit, try again with more room */
+          if (g_error_matches (local, G_IO_ERROR, G_IO_ERROR_NO_SPACE))
+            {
+              g_clear_error (&local);
+              space *= 2;
+              continue;
+            }
+
+          g_propagate_error (error, local);
+          g_byte_array_unref (out);
+          return NULL;
+        }
+
+      g_byte_array_set_size (out, outl + written);
+      in += read;
+      inl -= read;
+
+      if (result == G_CONVERTER_FINISHED)
+        break;
+    }
+
+  return g_byte_array_free_to_bytes (out);
+}
+
 gchar *
 cockpit_get_file_tag (const gchar *path)
 {
@@ -157,6 +372,8 @@ cockpit_fsread_close (CockpitChannel *channel,
   if (self->fd >= 0)
     close (self->fd);
 
+  g_clear_object (&self->compressor);
+
   COCKPIT_CHANNEL_CLASS (cockpit_fsread_parent_class)->close (channel, problem);
 }
 
@@ -164,30 +381,8 @@ static void
 cockpit_fsread_init (CockpitFsread *self)
 {
   self->fd = -1;
-}
-
-static void
-push_bytes (GQueue *queue,
-            GBytes *bytes)
-{
-  gsize size;
-  gsize length;
-  gsize offset;
-
-  size = g_bytes_get_size (bytes);
-  if (size < 8192)
-    {
-      g_queue_push_tail (queue, bytes);
-    }
-  else
-    {
-      for (offset = 0; offset < size; offset += 4096)
-        {
-          length = MIN (4096, size - offset);
-          g_queue_push_tail (queue, g_bytes_new_from_bytes (bytes, offset, length));
-        }
-      g_bytes_unref (bytes);
-    }
+  self->block_size = BLOCK_SIZE;
+  self->remaining = -1;
 }
 
 static void
@@ -196,8 +391,13 @@ cockpit_fsread_prepare (CockpitChannel *channel)
   CockpitFsread *self = COCKPIT_FSREAD (channel);
   const gchar *problem = "protocol-error";
   JsonObject *options;
-  GMappedFile *mapped;
-  GError *error = NULL;
+  struct stat buf;
+  const gchar *compress;
+  const gchar *if_tag;
+  gchar *tag;
+  gint64 offset;
+  gint64 length;
+  gint64 tail;
 
   COCKPIT_CHANNEL_CLASS (cockpit_fsread_parent_class)->prepare (channel);
 
@@ -212,6 +412,37 @@ cockpit_fsread_prepare (CockpitChannel *channel)
       g_warning ("missing \"path\" option for fsread channel");
       goto out;
     }
+  if (!cockpit_json_get_int (options, "offset", -1, &offset) || offset < -1)
+    {
+      g_warning ("invalid \"offset\" option for fsread channel");
+      goto out;
+    }
+  if (!cockpit_json_get_int (options, "length", -1, &length) || length < -1)
+    {
+      g_warning ("invalid \"length\" option for fsread channel");
+      goto out;
+    }
+  if (!cockpit_json_get_int (options, "tail", -1, &tail) || tail < -1)
+    {
+      g_warning ("invalid \"tail\" option for fsread channel");
+      goto out;
+    }
+  if (offset >= 0 && tail >= 0)
+    {
+      g_warning ("can't use both \"offset\" and \"tail\" options for fsread channel");
+      goto out;
+    }
+  if (!cockpit_json_get_string (options, "compress", NULL, &compress) ||
+      (compress && !g_str_equal (compress, "gzip")))
+    {
+      g_warning ("invalid or unsupported \"compress\" option for fsread channel");
+      goto out;
+    }
+  if (!cockpit_json_get_string (options, "if-tag", NULL, &if_tag))
+    {
+      g_warning ("invalid \"if-tag\" option for fsread channel");
+      goto out;
+    }
 
   self->fd = open (self->path, O_RDONLY);
   if (self->fd < 0)
@@ -242,22 +473,57 @@ cockpit_fsread_prepare (CockpitChannel *channel)
       goto out;
     }
 
-  mapped = g_mapped_file_new_from_fd (self->fd, FALSE, &error);
-  if (error)
+  if (fstat (self->fd, &buf) < 0)
     {
-      g_message ("%s: couldn't map: %s", cockpit_channel_get_id (channel), error->message);
+      int err = errno;
+      g_message ("%s: couldn't stat: %s", self->path, strerror (err));
       options = cockpit_channel_close_options (channel);
-      json_object_set_string_member (options, "message", error->message);
+      json_object_set_string_member (options, "message", strerror (err));
+      problem = "internal-error";
+      goto out;
+    }
+
+  /* The peer already has this content, don't send it again */
+  tag = file_tag_from_stat (0, 0, &buf);
+  if (if_tag && g_str_equal (tag, if_tag))
+    {
+      options = cockpit_channel_close_options (channel);
+      json_object_set_string_member (options, "tag", tag);
+      cockpit_channel_close (channel, NULL);
+      g_free (tag);
+      problem = NULL;
+      goto out;
+    }
+  self->start_tag = tag;
+
+  /* Only regular files have an end to read up to */
+  if (!S_ISREG (buf.st_mode))
+    self->eof = TRUE;
+  else if (buf.st_size < SINGLE_BLOCK_SIZE)
+    self->block_size = SINGLE_BLOCK_SIZE;
+
+  if (tail >= 0)
+    offset = MAX (0, buf.st_size - tail);
+  if (offset > 0 && !self->eof && lseek (self->fd, offset, SEEK_SET) < 0)
+    {
+      int err = errno;
+      g_message ("%s: couldn't seek: %s", self->path, strerror (err));
+      options = cockpit_channel_close_options (channel);
+      json_object_set_string_member (options, "message", strerror (err));
       problem = "internal-error";
       goto out;
     }
+  self->remaining = length;
+
+#ifdef POSIX_FADV_SEQUENTIAL
+  posix_fadvise (self->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+  if (compress)
+    self->compressor = G_CONVERTER (g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP, -1));
 
-  self->start_tag = cockpit_get_file_tag_from_fd (self->fd);
-  self->queue = g_queue_new ();
-  push_bytes (self->queue, g_mapped_file_get_bytes (mapped));
   self->idler = g_idle_add (on_idle_send_block, self);
   cockpit_channel_ready (channel);
-  g_mapped_file_unref (mapped);
   problem = NULL;
 
 out:
@@ -271,12 +537,6 @@ cockpit_fsread_finalize (GObject *object)
   CockpitFsread *self = COCKPIT_FSREAD (object);
 
   g_free (self->start_tag);
-  if (self->queue)
-    {
-      while (!g_queue_is_empty (self->queue))
-        g_bytes_unref (g_queue_pop_head (self->queue));
-      g_queue_free (self->queue);
-    }
   g_assert (self->idler == 0);
 
   G_OBJECT_CLASS (cockpit_fsread_parent_class)->finalize (object);
@@ -293,6 +553,7 @@ cockpit_fsread_class_init (CockpitFsreadClass *klass)
   channel_class->prepare = cockpit_fsread_prepare;
   channel_class->recv = cockpit_fsread_recv;
   channel_class->close = cockpit_fsread_close;
+  channel_class->pressure = cockpit_fsread_pressure;
 }
 
 /**
@@ -36,6 +36,11 @@ CockpitChannel *   cockpit_fsread_open         (CockpitTransport *transport,
 
 gchar *            cockpit_get_file_tag         (const gchar *path);
 
+GBytes *           cockpit_convert_bytes        (GConverter *converter,
+                                                 GBytes *input,
+                                                 gboolean at_end,
+                                                 GError **error);
+
 gchar *            cockpit_get_file_tag_from_fd (int fd);
 
 #endif /* COCKPIT_FSREAD_H__ */
@@ -31,6 +31,7 @@
 #include <errno.h>
 #include <string.h>
 #include <stdio.h>
+#include <unistd.h>
 
 /**
  * CockpitFsreplace:
@@ -38,8 +39,22 @@
  * A #CockpitChannel that writes/replaces the content of a file.
  *
  * The payload type for this channel is 'fsreplace1'.
+ *
+ * The content goes into an anonymous O_TMPFILE where the file system
+ * supports it, which is only linked in when done. Otherwise into a
+ * temporary file next to the target. Small messages are collected and
+ * written out in larger pieces.
  */
 
+/* How much content to collect before writing it out */
+#define WRITE_BUFFER_SIZE (64 * 1024)
+
+enum {
+  SYNC_FULL,
+  SYNC_DATA,
+  SYNC_NONE
+};
+
 #define COCKPIT_FSREPLACE(o)    (G_TYPE_CHECK_INSTANCE_CAST ((o), COCKPIT_TYPE_FSREPLACE, CockpitFsreplace))
 
 typedef struct {
@@ -47,8 +62,13 @@ typedef struct {
   const gchar *path;
   gchar *tmp_path;
   int fd;
+  gboolean anonymous;
+  gint sync;
+  GByteArray *buffer;
   gboolean got_content;
   const gchar *expected_tag;
+  GConverter *decompressor;
+  gboolean got_compressed;
   guint sig_close;
 } CockpitFsreplace;
 
@@ -89,16 +109,11 @@ close_with_errno (CockpitFsreplace *self,
                          prepare_for_close_with_errno (self, diagnostic, err));
 }
 
-static void
-cockpit_fsreplace_recv (CockpitChannel *channel,
-                      GBytes *message)
+static gboolean
+write_all (CockpitFsreplace *self,
+           const gchar *data,
+           gsize size)
 {
-  CockpitFsreplace *self = COCKPIT_FSREPLACE (channel);
-  gsize size;
-  const char *data = g_bytes_get_data (message, &size);
-
-  self->got_content = TRUE;
-
   while (size > 0)
     {
       ssize_t n = write (self->fd, data, size);
@@ -108,21 +123,109 @@ cockpit_fsreplace_recv (CockpitChannel *channel,
             continue;
 
           close_with_errno (self, "couldn't write", errno);
-          return;
+          return FALSE;
         }
 
-      g_return_if_fail (n > 0);
+      g_return_val_if_fail (n > 0, FALSE);
       size -= n;
       data += n;
     }
+
+  return TRUE;
+}
+
+static gboolean
+flush_buffer (CockpitFsreplace *self)
+{
+  gboolean ret;
+
+  ret = write_all (self, (const gchar *)self->buffer->data, self->buffer->len);
+  g_byte_array_set_size (self->buffer, 0);
+  return ret;
+}
+
+static gboolean
+write_bytes (CockpitFsreplace *self,
+             GBytes *bytes)
+{
+  gsize size;
+  const gchar *data = g_bytes_get_data (bytes, &size);
+
+  /* Large pieces go straight out, small ones are collected */
+  if (self->buffer->len + size > WRITE_BUFFER_SIZE)
+    {
+      if (!flush_buffer (self))
+        return FALSE;
+      if (size >= WRITE_BUFFER_SIZE)
+        return write_all (self, data, size);
+    }
+
+  g_byte_array_append (self->buffer, (const guint8 *)data, size);
+  return TRUE;
+}
+
+static GBytes *
+decompress_bytes (CockpitFsreplace *self,
+                  GBytes *input)
+{
+  GError *error = NULL;
+  JsonObject *options;
+  GBytes *output;
+
+  /* Input of NULL means the end, the data must be complete */
+  output = cockpit_convert_bytes (self->decompressor, input, input == NULL, &error);
+  if (!output)
+    {
+      g_message ("%s: couldn't decompress: %s", self->path, error->message);
+      options = cockpit_channel_close_options (COCKPIT_CHANNEL (self));
+      json_object_set_string_member (options, "message", error->message);
+      cockpit_channel_close (COCKPIT_CHANNEL (self), "protocol-error");
+      g_error_free (error);
+    }
+
+  return output;
+}
+
+static void
+cockpit_fsreplace_recv (CockpitChannel *channel,
+                      GBytes *message)
+{
+  CockpitFsreplace *self = COCKPIT_FSREPLACE (channel);
+  GBytes *data;
+
+  self->got_content = TRUE;
+
+  if (self->decompressor)
+    {
+      if (g_bytes_get_size (message) > 0)
+        self->got_compressed = TRUE;
+      data = decompress_bytes (self, message);
+      if (data)
+        {
+          write_bytes (self, data);
+          g_bytes_unref (data);
+        }
+    }
+  else
+    {
+      write_bytes (self, message);
+    }
 }
 
 static int
-xfsync (int fd)
+xfsync (int fd,
+        gint sync)
 {
   while (TRUE)
     {
-      int res = fsync (fd);
+      int res;
+
+      if (sync == SYNC_NONE)
+        res = 0;
+      else if (sync == SYNC_DATA)
+        res = fdatasync (fd);
+      else
+        res = fsync (fd);
       if (res < 0 && errno == EINTR)
         continue;
 
@@ -142,6 +245,70 @@ xclose (int fd)
     return res;
 }
 
+static int
+open_temp (CockpitFsreplace *self)
+{
+  gchar *directory;
+
+#ifdef O_TMPFILE
+  directory = g_path_get_dirname (self->path);
+  self->fd = open (directory, O_TMPFILE | O_WRONLY, 0666);
+  g_free (directory);
+
+  if (self->fd >= 0)
+    {
+      self->anonymous = TRUE;
+      return self->fd;
+    }
+
+  /* Not supported by the kernel or the file system */
+  if (errno != EISDIR && errno != EOPNOTSUPP && errno != EINVAL)
+    return -1;
+#endif
+
+  for (int i = 1; i < 10000; i++)
+    {
+      self->tmp_path = g_strdup_printf ("%s.%d", self->path, i);
+      self->fd = open (self->tmp_path, O_WRONLY | O_CREAT | O_EXCL, 0666);
+      if (self->fd >= 0 || errno != EEXIST)
+        break;
+      g_free (self->tmp_path);
+      self->tmp_path = NULL;
+    }
+
+  return self->fd;
+}
+
+static gboolean
+link_temp (CockpitFsreplace *self)
+{
+  gchar *proc;
+  int res = -1;
+
+  /* Linking an O_TMPFILE by descriptor needs no special privileges via /proc */
+  proc = g_strdup_printf ("/proc/self/fd/%d", self->fd);
+  for (int i = 1; i < 10000; i++)
+    {
+      self->tmp_path = g_strdup_printf ("%s.%d", self->path, i);
+      res = linkat (AT_FDCWD, proc, AT_FDCWD, self->tmp_path, AT_SYMLINK_FOLLOW);
+      if (res >= 0 || errno != EEXIST)
+        break;
+      g_free (self->tmp_path);
+      self->tmp_path = NULL;
+    }
+  g_free (proc);
+
+  if (res < 0)
+    {
+      g_free (self->tmp_path);
+      self->tmp_path = NULL;
+      return FALSE;
+    }
+
+  self->anonymous = FALSE;
+  return TRUE;
+}
+
 static gboolean
 cockpit_fsreplace_control (CockpitChannel *channel,
                            const gchar *command,
@@ -154,8 +321,32 @@ cockpit_fsreplace_control (CockpitChannel *channel,
   if (!g_str_equal (command, "done"))
     return FALSE;
 
+  /* Write out whatever the decompressor still holds */
+  if (self->decompressor && self->got_compressed)
+    {
+      GBytes *data = decompress_bytes (self, NULL);
+      if (!data)
+        return TRUE;
+      if (!write_bytes (self, data))
+        {
+          g_bytes_unref (data);
+          return TRUE;
+        }
+      g_bytes_unref (data);
+    }
+
+  if (!flush_buffer (self))
+    return TRUE;
+
+  /* An anonymous file needs a name before it can be renamed into place */
+  if (self->anonymous && self->got_content && !link_temp (self))
+    {
+      problem = prepare_for_close_with_errno (self, "couldn't link", errno);
+      close (self->fd);
+    }
+
   /* Commit the changes when there was no problem  */
-  if (xfsync (self->fd) < 0 || xclose (self->fd) < 0)
+  else if (xfsync (self->fd, self->sync) < 0 || xclose (self->fd) < 0)
     {
       problem = prepare_for_close_with_errno (self, "couldn't sync", errno);
     }
@@ -174,7 +365,7 @@ cockpit_fsreplace_control (CockpitChannel *channel,
               json_object_set_string_member (options, "tag", "-");
               if (unlink (self->path) < 0 && errno != ENOENT)
                 problem = prepare_for_close_with_errno (self, "couldn't unlink", errno);
-              if (unlink (self->tmp_path) < 0)
+              if (self->tmp_path && unlink (self->tmp_path) < 0)
                 g_message ("%s: couldn't remove temp file: %s", self->tmp_path, g_strerror (errno));
             }
           else
@@ -204,6 +395,8 @@ cockpit_fsreplace_close (CockpitChannel *channel,
     close (self->fd);
   self->fd = -1;
 
+  g_clear_object (&self->decompressor);
+
   /* Cleanup in case of problem */
   if (problem)
     {
@@ -219,6 +412,7 @@ static void
 cockpit_fsreplace_init (CockpitFsreplace *self)
 {
   self->fd = -1;
+  self->buffer = g_byte_array_new ();
 }
 
 static void
@@ -228,6 +422,9 @@ cockpit_fsreplace_prepare (CockpitChannel *channel)
   const gchar *problem = "protocol-error";
   JsonObject *options;
   gchar *actual_tag = NULL;
+  const gchar *compress;
+  const gchar *sync;
+  gint64 size;
 
   COCKPIT_CHANNEL_CLASS (cockpit_fsreplace_parent_class)->prepare (channel);
 
@@ -249,6 +446,16 @@ cockpit_fsreplace_prepare (CockpitChannel *channel)
       goto out;
     }
 
+  if (!cockpit_json_get_string (options, "compress", NULL, &compress) ||
+      (compress && !g_str_equal (compress, "gzip")))
+    {
+      g_warning ("%s: invalid or unsupported \"compress\" option for fsreplace1 channel", self->path);
+      goto out;
+    }
+
+  if (compress)
+    self->decompressor = G_CONVERTER (g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP));
+
   actual_tag = cockpit_get_file_tag (self->path);
   if (self->expected_tag && g_strcmp0 (self->expected_tag, actual_tag))
     {
@@ -256,25 +463,47 @@ cockpit_fsreplace_prepare (CockpitChannel *channel)
       goto out;
     }
 
+  if (!cockpit_json_get_string (options, "fsync", NULL, &sync))
+    {
+      g_warning ("%s: invalid \"fsync\" option for fsreplace1 channel", self->path);
+      goto out;
+    }
+  if (sync == NULL || g_str_equal (sync, "full"))
+    self->sync = SYNC_FULL;
+  else if (g_str_equal (sync, "data"))
+    self->sync = SYNC_DATA;
+  else if (g_str_equal (sync, "none"))
+    self->sync = SYNC_NONE;
+  else
+    {
+      g_warning ("%s: unsupported \"fsync\" option for fsreplace1 channel: %s", self->path, sync);
+      goto out;
+    }
+
+  if (!cockpit_json_get_int (options, "size", -1, &size))
+    {
+      g_warning ("%s: invalid \"size\" option for fsreplace1 channel", self->path);
+      goto out;
+    }
+
   // TODO - delay the opening until the first content message.  That
   // way, we don't create a useless temporary file (which might even
   // fail).
 
-  for (int i = 1; i < 10000; i++)
+  problem = NULL;
+  if (open_temp (self) < 0)
     {
-      self->tmp_path = g_strdup_printf ("%s.%d", self->path, i);
-      self->fd = open (self->tmp_path, O_WRONLY | O_CREAT | O_EXCL, 0666);
-      if (self->fd >= 0 || errno != EEXIST)
-        break;
-      g_free (self->tmp_path);
-      self->tmp_path = NULL;
+      close_with_errno (self, "couldn't open unique file", errno);
     }
-
-  problem = NULL;
-  if (self->fd < 0)
-    close_with_errno (self, "couldn't open unique file", errno);
   else
-    cockpit_channel_ready (channel);
+    {
+#ifdef FALLOC_FL_KEEP_SIZE
+      /* Only a hint, so don't fall back to writing zeros */
+      if (size > 0)
+        fallocate (self->fd, FALLOC_FL_KEEP_SIZE, 0, size);
+#endif
+      cockpit_channel_ready (channel);
+    }
 
 out:
   g_free (actual_tag);
@@ -288,6 +517,7 @@ cockpit_fsreplace_finalize (GObject *object)
   CockpitFsreplace *self = COCKPIT_FSREPLACE (object);
 
   g_free (self->tmp_path);
+  g_byte_array_unref (self->buffer);
 
   G_OBJECT_CLASS (cockpit_fsreplace_parent_class)->finalize (object);
 }
@@ -23,13 +23,17 @@
 #include "cockpitfsread.h"
 
 #include "common/cockpitjson.h"
+#include "common/cockpitunixfd.h"
 
+#include <sys/inotify.h>
 #include <sys/wait.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <dirent.h>
 #include <errno.h>
 #include <string.h>
+#include <unistd.h>
 
 /**
  * CockpitFswatch:
@@ -46,6 +50,13 @@ typedef struct {
   const gchar *path;
   GFileMonitor *monitor;
   guint sig_changed;
+  CockpitFswatchBatch *batch;
+
+  /* For recursive watches */
+  gint inotify_fd;
+  guint inotify_source;
+  gint root_wd;
+  GHashTable *wds;
 } CockpitFswatch;
 
 typedef struct {
@@ -65,6 +76,8 @@ cockpit_fswatch_recv (CockpitChannel *channel,
 static void
 cockpit_fswatch_init (CockpitFswatch *self)
 {
+  self->inotify_fd = -1;
+  self->root_wd = -1;
 }
 
 gchar *
@@ -109,14 +122,12 @@ event_type_to_string (GFileMonitorEvent event_type)
   }
 }
 
-void
-cockpit_fswatch_emit_event (CockpitChannel    *channel,
-                            GFile             *file,
-                            GFile             *other_file,
-                            GFileMonitorEvent  event_type)
+static JsonObject *
+build_event (GFile *file,
+             GFile *other_file,
+             GFileMonitorEvent event_type)
 {
   JsonObject *msg;
-  GBytes *msg_bytes;
 
   msg = json_object_new ();
   json_object_set_string_member (msg, "event", event_type_to_string (event_type));
@@ -152,12 +163,219 @@ cockpit_fswatch_emit_event (CockpitChannel    *channel,
       json_object_set_string_member (msg, "other", p);
       g_free (p);
     }
+
+  return msg;
+}
+
+void
+cockpit_fswatch_emit_event (CockpitChannel    *channel,
+                            GFile             *file,
+                            GFile             *other_file,
+                            GFileMonitorEvent  event_type)
+{
+  JsonObject *msg;
+  GBytes *msg_bytes;
+
+  msg = build_event (file, other_file, event_type);
   msg_bytes = cockpit_json_write_bytes (msg);
   json_object_unref (msg);
   cockpit_channel_send (channel, msg_bytes, TRUE);
   g_bytes_unref (msg_bytes);
 }
 
+/*
+ * CockpitFswatchBatch:
+ *
+ * Collects the events of a monitor for a short window and then sends
+ * them together as a single JSON array. Only the last event for each
+ * path is kept, and the file tag is only computed when the batch is
+ * sent. This keeps event storms from swamping the channel.
+ */
+
+struct _CockpitFswatchBatch {
+  CockpitChannel *channel;
+  guint debounce;
+  GHashTable *pending;
+  GQueue order;
+  guint timeout;
+};
+
+typedef struct {
+  GFile *file;
+  GFile *other_file;
+  GFileMonitorEvent event_type;
+} PendingEvent;
+
+static void
+pending_event_free (gpointer data)
+{
+  PendingEvent *pending = data;
+  g_object_unref (pending->file);
+  if (pending->other_file)
+    g_object_unref (pending->other_file);
+  g_slice_free (PendingEvent, pending);
+}
+
+/**
+ * cockpit_fswatch_batch_new:
+ * @channel: the channel to send the events on
+ * @debounce: the window in milliseconds
+ *
+ * The batch doesn't hold a reference to the @channel, it's
+ * expected that the channel frees the batch in its dispose.
+ *
+ * Returns: (transfer full): the new batch
+ */
+CockpitFswatchBatch *
+cockpit_fswatch_batch_new (CockpitChannel *channel,
+                           guint debounce)
+{
+  CockpitFswatchBatch *batch;
+
+  batch = g_slice_new0 (CockpitFswatchBatch);
+  batch->channel = channel;
+  batch->debounce = debounce;
+  batch->pending = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, pending_event_free);
+  g_queue_init (&batch->order);
+  return batch;
+}
+
+static void
+batch_flush (CockpitFswatchBatch *batch)
+{
+  PendingEvent *pending;
+  JsonArray *array;
+  JsonNode *node;
+  GBytes *bytes;
+  gchar *path;
+  gchar *data;
+  gsize length;
+
+  if (g_queue_is_empty (&batch->order))
+    return;
+
+  array = json_array_new ();
+  while ((path = g_queue_pop_head (&batch->order)) != NULL)
+    {
+      pending = g_hash_table_lookup (batch->pending, path);
+      g_assert (pending != NULL);
+      json_array_add_object_element (array, build_event (pending->file, pending->other_file,
+                                                         pending->event_type));
+    }
+  g_hash_table_remove_all (batch->pending);
+
+  node = json_node_new (JSON_NODE_ARRAY);
+  json_node_take_array (node, array);
+  data = cockpit_json_write (node, &length);
+  json_node_free (node);
+
+  bytes = g_bytes_new_take (data, length);
+  cockpit_channel_send (batch->channel, bytes, TRUE);
+  g_bytes_unref (bytes);
+}
+
+static gboolean
+on_batch_timeout (gpointer user_data)
+{
+  CockpitFswatchBatch *batch = user_data;
+  batch->timeout = 0;
+  batch_flush (batch);
+  return FALSE;
+}
+
+/**
+ * cockpit_fswatch_batch_add:
+ * @batch: the batch
+ * @file: the file from the GFileMonitor::changed signal
+ * @other_file: the other file, or %NULL
+ * @event_type: the type of event
+ *
+ * Queue an event. It replaces any earlier event for the same path
+ * in the current window, except that a "created" event is not
+ * replaced by following changes, so that the "type" isn't lost.
+ */
+void
+cockpit_fswatch_batch_add (CockpitFswatchBatch *batch,
+                           GFile *file,
+                           GFile *other_file,
+                           GFileMonitorEvent event_type)
+{
+  PendingEvent *pending;
+  gchar *path;
+
+  if (!file)
+    {
+      batch_flush (batch);
+      cockpit_fswatch_emit_event (batch->channel, file, other_file, event_type);
+      return;
+    }
+
+  path = g_file_get_path (file);
+  pending = g_hash_table_lookup (batch->pending, path);
+  if (pending)
+    {
+      g_free (path);
+      if (pending->event_type == G_FILE_MONITOR_EVENT_CREATED &&
+          (event_type == G_FILE_MONITOR_EVENT_CHANGED ||
+           event_type == G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT ||
+           event_type == G_FILE_MONITOR_EVENT_ATTRIBUTE_CHANGED))
+        return;
+
+      if (pending->other_file)
+        g_object_unref (pending->other_file);
+      pending->other_file = other_file ? g_object_ref (other_file) : NULL;
+      pending->event_type = event_type;
+    }
+  else
+    {
+      pending = g_slice_new0 (PendingEvent);
+      pending->file = g_object_ref (file);
+      pending->other_file = other_file ? g_object_ref (other_file) : NULL;
+      pending->event_type = event_type;
+      g_hash_table_insert (batch->pending, path, pending);
+      g_queue_push_tail (&batch->order, path);
+    }
+
+  /* A fixed window, not reset by further events, so a constant storm can't delay forever */
+  if (!batch->timeout)
+    batch->timeout = g_timeout_add (batch->debounce, on_batch_timeout, batch);
+}
+
+void
+cockpit_fswatch_batch_free (CockpitFswatchBatch *batch)
+{
+  if (batch->timeout)
+    g_source_remove (batch->timeout);
+  g_queue_clear (&batch->order);
+  g_hash_table_destroy (batch->pending);
+  g_slice_free (CockpitFswatchBatch, batch);
+}
+
+/**
+ * cockpit_fswatch_parse_debounce:
+ * @channel: the channel
+ * @debounce: location to place the window in milliseconds
+ *
+ * Reads the "debounce" option of an fswatch1 or fslist1 channel.
+ *
+ * Returns: FALSE if the option is invalid
+ */
+gboolean
+cockpit_fswatch_parse_debounce (CockpitChannel *channel,
+                                guint *debounce)
+{
+  JsonObject *options;
+  gint64 value;
+
+  options = cockpit_channel_get_options (channel);
+  if (!cockpit_json_get_int (options, "debounce", 0, &value) ||
+      value < 0 || value > G_MAXINT)
+    return FALSE;
+
+  *debounce = value;
+  return TRUE;
+}
+
 static void
 on_changed (GFileMonitor      *monitor,
             GFile             *file,
@@ -166,7 +384,263 @@ on_changed (GFileMonitor      *monitor,
             gpointer           user_data)
 {
   CockpitFswatch *self = COCKPIT_FSWATCH (user_data);
-  cockpit_fswatch_emit_event (COCKPIT_CHANNEL(self), file, other_file, event_type);
+  if (self->batch)
+    cockpit_fswatch_batch_add (self->batch, file, other_file, event_type);
+  else
+    cockpit_fswatch_emit_event (COCKPIT_CHANNEL(self), file, other_file, event_type);
+}
+
+/*
+ * Recursive watches don't use GFileMonitor, which would need an
+ * object and an inotify watch descriptor per directory in its own
+ * thread. Instead there's one inotify fd per channel, and a table
+ * from watch descriptor to directory path. fanotify would avoid the
+ * per directory watches, but needs privileges the bridge usually
+ * doesn't have.
+ */
+
+#define RECURSIVE_MASK (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | \
+                        IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+
+static void
+recursive_event (CockpitFswatch *self,
+                 const gchar *path,
+                 GFileMonitorEvent event_type)
+{
+  GFile *file = g_file_new_for_path (path);
+  on_changed (NULL, file, NULL, event_type, self);
+  g_object_unref (file);
+}
+
+static gboolean
+recursive_add (CockpitFswatch *self,
+               const gchar *path,
+               gboolean announce,
+               GError **error)
+{
+  GQueue queue = G_QUEUE_INIT;
+  struct dirent *entry;
+  gboolean ret = TRUE;
+  gchar *dir;
+  gchar *child;
+  DIR *dp;
+  gint wd;
+
+  g_queue_push_tail (&queue, g_strdup (path));
+  while ((dir = g_queue_pop_head (&queue)) != NULL)
+    {
+      wd = inotify_add_watch (self->inotify_fd, dir, RECURSIVE_MASK | IN_ONLYDIR | IN_DONT_FOLLOW | IN_MASK_ADD);
+      if (wd < 0)
+        {
+          /* Went away or was replaced in the meantime, its parent will tell */
+          if (ret && errno != ENOENT && errno != ENOTDIR)
+            {
+              g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                           "couldn't watch %s: %s", dir, g_strerror (errno));
+              ret = FALSE;
+            }
+          g_free (dir);
+          continue;
+        }
+
+      /* The same descriptor comes back for a directory that moved */
+      g_hash_table_replace (self->wds, GINT_TO_POINTER (wd), dir);
+
+      if (!ret)
+        continue;
+
+      /* Anything created before the watch was added wasn't seen */
+      dp = opendir (dir);
+      if (!dp)
+        continue;
+
+      while ((entry = readdir (dp)) != NULL)
+        {
+          if (g_str_equal (entry->d_name, ".") || g_str_equal (entry->d_name, ".."))
+            continue;
+
+          child = g_build_filename (dir, entry->d_name, NULL);
+          if (announce)
+            recursive_event (self, child, G_FILE_MONITOR_EVENT_CREATED);
+          if (entry->d_type == DT_DIR || entry->d_type == DT_UNKNOWN)
+            g_queue_push_tail (&queue, child);
+          else
+            g_free (child);
+        }
+
+      closedir (dp);
+    }
+
+  return ret;
+}
+
+static void
+recursive_remove (CockpitFswatch *self,
+                  const gchar *path)
+{
+  GHashTableIter iter;
+  gpointer key;
+  gpointer value;
+  gsize len;
+
+  /* A directory moved out of the tree, stop watching below it */
+  len = strlen (path);
+  g_hash_table_iter_init (&iter, self->wds);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      if (strncmp (value, path, len) == 0 && (((gchar *)value)[len] == '\0' || ((gchar *)value)[len] == '/'))
+        {
+          inotify_rm_watch (self->inotify_fd, GPOINTER_TO_INT (key));
+          g_hash_table_iter_remove (&iter);
+        }
+    }
+}
+
+static void
+recursive_failed (CockpitFswatch *self,
+                  const gchar *message)
+{
+  JsonObject *options;
+
+  /* The caller returns FALSE, and closing may drop the last reference */
+  self->inotify_source = 0;
+
+  g_message ("%s", message);
+  options = cockpit_channel_close_options (COCKPIT_CHANNEL (self));
+  json_object_set_string_member (options, "message", message);
+  cockpit_channel_close (COCKPIT_CHANNEL (self), "internal-error");
+}
+
+static gboolean
+on_inotify_ready (gint fd,
+                  GIOCondition cond,
+                  gpointer user_data)
+{
+  CockpitFswatch *self = COCKPIT_FSWATCH (user_data);
+  gchar buffer[16 * 1024] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+  const struct inotify_event *event;
+  GFileMonitorEvent event_type;
+  GError *error = NULL;
+  const gchar *dir;
+  gchar *path;
+  gssize len;
+  gchar *p;
+
+  for (;;)
+    {
+      len = read (fd, buffer, sizeof (buffer));
+      if (len < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          if (errno == EAGAIN)
+            return TRUE;
+          path = g_strdup_printf ("couldn't read file change events: %s", g_strerror (errno));
+          recursive_failed (self, path);
+          g_free (path);
+          return FALSE;
+        }
+
+      for (p = buffer; p < buffer + len; p += sizeof (struct inotify_event) + event->len)
+        {
+          event = (const struct inotify_event *)p;
+
+          if (event->mask & IN_Q_OVERFLOW)
+            {
+              recursive_failed (self, "too many file changes");
+              return FALSE;
+            }
+
+          if (event->mask & IN_IGNORED)
+            {
+              g_hash_table_remove (self->wds, GINT_TO_POINTER (event->wd));
+              continue;
+            }
+
+          dir = g_hash_table_lookup (self->wds, GINT_TO_POINTER (event->wd));
+          if (!dir)
+            continue;
+
+          if (event->mask & IN_UNMOUNT)
+            event_type = G_FILE_MONITOR_EVENT_UNMOUNTED;
+          else if (event->mask & (IN_CREATE | IN_MOVED_TO))
+            event_type = G_FILE_MONITOR_EVENT_CREATED;
+          else if (event->mask & (IN_DELETE | IN_MOVED_FROM | IN_DELETE_SELF | IN_MOVE_SELF))
+            event_type = G_FILE_MONITOR_EVENT_DELETED;
+          else if (event->mask & IN_CLOSE_WRITE)
+            event_type = G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT;
+          else if (event->mask & IN_ATTRIB)
+            event_type = G_FILE_MONITOR_EVENT_ATTRIBUTE_CHANGED;
+          else if (event->mask & IN_MODIFY)
+            event_type = G_FILE_MONITOR_EVENT_CHANGED;
+          else
+            continue;
+
+          /* Events for subdirectories themselves are reported by their parents */
+          if (event->len == 0 && event->wd != self->root_wd)
+            continue;
+
+          if (event->len > 0)
+            path = g_build_filename (dir, event->name, NULL);
+          else
+            path = g_strdup (dir);
+
+          if (event->mask & IN_ISDIR)
+            {
+              if (event->mask & (IN_CREATE | IN_MOVED_TO))
+                {
+                  if (!recursive_add (self, path, TRUE, &error))
+                    {
+                      g_free (path);
+                      recursive_failed (self, error->message);
+                      g_error_free (error);
+                      return FALSE;
+                    }
+                }
+              else if (event->mask & IN_MOVED_FROM)
+                {
+                  recursive_remove (self, path);
+                }
+            }
+
+          /* The directory entries announced by recursive_add () come after this one */
+          recursive_event (self, path, event_type);
+          g_free (path);
+        }
+    }
+}
+
+static gboolean
+recursive_prepare (CockpitFswatch *self,
+                   const gchar *path,
+                   GError **error)
+{
+  self->inotify_fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+  if (self->inotify_fd < 0)
+    {
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                   "couldn't watch file changes: %s", g_strerror (errno));
+      return FALSE;
+    }
+
+  self->wds = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, g_free);
+
+  /* The root gets its own watch, which also lets it be a plain file */
+  self->root_wd = inotify_add_watch (self->inotify_fd, path,
+                                     RECURSIVE_MASK | IN_DELETE_SELF | IN_MOVE_SELF);
+  if (self->root_wd < 0)
+    {
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                   "%s: %s", path, g_strerror (errno));
+      return FALSE;
+    }
+
+  g_hash_table_replace (self->wds, GINT_TO_POINTER (self->root_wd), g_strdup (path));
+  if (g_file_test (path, G_FILE_TEST_IS_DIR) && !recursive_add (self, path, FALSE, error))
+    return FALSE;
+
+  self->inotify_source = cockpit_unix_fd_add (self->inotify_fd, G_IO_IN, on_inotify_ready, self);
+  return TRUE;
 }
 
 static void
@@ -177,6 +651,8 @@ cockpit_fswatch_prepare (CockpitChannel *channel)
   JsonObject *options;
   GError *error = NULL;
   const gchar *path;
+  gboolean recursive;
+  guint debounce;
 
   COCKPIT_CHANNEL_CLASS (cockpit_fswatch_parent_class)->prepare (channel);
 
@@ -191,6 +667,35 @@ cockpit_fswatch_prepare (CockpitChannel *channel)
       g_warning ("missing \"path\" option for fswatch channel");
       goto out;
     }
+  if (!cockpit_fswatch_parse_debounce (channel, &debounce))
+    {
+      g_warning ("invalid \"debounce\" option for fswatch channel");
+      goto out;
+    }
+  if (!cockpit_json_get_bool (options, "recursive", FALSE, &recursive))
+    {
+      g_warning ("invalid \"recursive\" option for fswatch channel");
+      goto out;
+    }
+
+  if (debounce > 0)
+    self->batch = cockpit_fswatch_batch_new (channel, debounce);
+
+  if (recursive)
+    {
+      if (!recursive_prepare (self, path, &error))
+        {
+          g_message ("%s", error->message);
+          options = cockpit_channel_close_options (channel);
+          json_object_set_string_member (options, "message", error->message);
+          problem = "internal-error";
+          goto out;
+        }
+
+      cockpit_channel_ready (channel);
+      problem = NULL;
+      goto out;
+    }
 
   GFile *file = g_file_new_for_path (path);
   GFileMonitor *monitor = g_file_monitor (file, 0, NULL, &error);
@@ -222,6 +727,18 @@ cockpit_fswatch_dispose (GObject *object)
 {
   CockpitFswatch *self = COCKPIT_FSWATCH (object);
 
+  /* Before spinning the main loop below, so the window can't fire */
+  if (self->batch)
+    cockpit_fswatch_batch_free (self->batch);
+  self->batch = NULL;
+
+  if (self->inotify_source)
+    g_source_remove (self->inotify_source);
+  self->inotify_source = 0;
+  if (self->inotify_fd >= 0)
+    close (self->inotify_fd);
+  self->inotify_fd = -1;
+
   if (self->monitor)
     {
       if (self->sig_changed)
@@ -255,6 +772,8 @@ cockpit_fswatch_finalize (GObject *object)
   CockpitFswatch *self = COCKPIT_FSWATCH (object);
 
   g_clear_object (&self->monitor);
+  if (self->wds)
+    g_hash_table_destroy (self->wds);
 
   G_OBJECT_CLASS (cockpit_fswatch_parent_class)->finalize (object);
 }
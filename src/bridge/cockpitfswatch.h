@@ -42,4 +42,19 @@ cockpit_fswatch_emit_event (CockpitChannel    *channel,
                             GFile             *other_file,
                             GFileMonitorEvent  event_type);
 
+typedef struct _CockpitFswatchBatch CockpitFswatchBatch;
+
+gboolean           cockpit_fswatch_parse_debounce (CockpitChannel *channel,
+                                                   guint *debounce);
+
+CockpitFswatchBatch * cockpit_fswatch_batch_new   (CockpitChannel *channel,
+                                                   guint debounce);
+
+void               cockpit_fswatch_batch_add      (CockpitFswatchBatch *batch,
+                                                   GFile *file,
+                                                   GFile *other_file,
+                                                   GFileMonitorEvent event_type);
+
+void               cockpit_fswatch_batch_free     (CockpitFswatchBatch *batch);
+
 #endif /* COCKPIT_FSWATCH_H__ */
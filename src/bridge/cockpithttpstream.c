@@ -38,35 +38,60 @@
  *
  * Information about a certain set of HTTP connections that
  * have been given a connection name, grouping them together as
- * a client. In this mode we cache connections and reuse them
+ * a client. In this mode we pool connections and reuse them
  * as well as share options and address info.
+ *
+ * Idle connections are kept most recently used first, so a
+ * checkout gets the one least likely to have been closed by
+ * the server, and the oldest is dropped when the pool is full.
  */
 
+/* Defaults for the "pool-size" and "pool-timeout" options */
+#define POOL_SIZE      4
+#define POOL_TIMEOUT   10
+
 typedef struct {
   gint refs;
   gchar *name;
   CockpitConnectable *connectable;
+
+  /* Idle connections, CockpitHttpIdle */
+  GQueue *idle;
+  gint64 pool_size;
+  gint64 pool_timeout;
+
+  /* Statistics, shown in debug output */
+  guint connects;
+  guint reuses;
+  guint expired;
+  guint dropped;
+} CockpitHttpClient;
+
+typedef struct {
+  CockpitHttpClient *client;
   CockpitStream *stream;
   gulong sig_close;
   guint timeout;
-} CockpitHttpClient;
+} CockpitHttpIdle;
 
 static GHashTable *clients;
 
 static void
-cockpit_http_client_reset (CockpitHttpClient *client)
+cockpit_http_idle_free (CockpitHttpIdle *idle)
 {
-  if (client->timeout)
-    g_source_remove (client->timeout);
-  if (client->stream)
-    {
-      g_signal_handler_disconnect (client->stream, client->sig_close);
-      g_object_unref (client->stream);
-    }
+  if (idle->timeout)
+    g_source_remove (idle->timeout);
+  g_signal_handler_disconnect (idle->stream, idle->sig_close);
+  g_object_unref (idle->stream);
+  g_slice_free (CockpitHttpIdle, idle);
+}
 
-  client->sig_close = 0;
-  client->stream = NULL;
-  client->timeout = 0;
+static void
+cockpit_http_client_debug (CockpitHttpClient *client)
+{
+  g_debug ("%s: pool has %u idle, %u connects, %u reuses, %u expired, %u dropped",
+           client->name, g_queue_get_length (client->idle), client->connects,
+           client->reuses, client->expired, client->dropped);
 }
 
 static void
@@ -75,7 +100,7 @@ cockpit_http_client_unref (gpointer data)
   CockpitHttpClient *client = data;
   if (--client->refs == 0)
     {
-      cockpit_http_client_reset (client);
+      g_queue_free_full (client->idle, (GDestroyNotify)cockpit_http_idle_free);
       if (client->connectable)
         cockpit_connectable_unref (client->connectable);
       g_free (client->name);
@@ -91,21 +116,25 @@ cockpit_http_client_ref (CockpitHttpClient *client)
 }
 
 static void
-on_client_close (CockpitStream *stream,
-                 const gchar *problem,
-                 gpointer data)
+on_idle_close (CockpitStream *stream,
+               const gchar *problem,
+               gpointer data)
 {
-  CockpitHttpClient *client = data;
-  g_debug ("%s: connection closed", client->name);
-  cockpit_http_client_reset (client);
+  CockpitHttpIdle *idle = data;
+  g_debug ("%s: idle connection closed", idle->client->name);
+  g_queue_remove (idle->client->idle, idle);
+  cockpit_http_idle_free (idle);
 }
 
 static gboolean
-on_client_timeout (gpointer data)
+on_idle_timeout (gpointer data)
 {
-  CockpitHttpClient *client = data;
-  g_debug ("%s: connection timed out", client->name);
-  cockpit_http_client_reset (client);
+  CockpitHttpIdle *idle = data;
+  g_debug ("%s: idle connection timed out", idle->client->name);
+  idle->timeout = 0;
+  idle->client->expired++;
+  g_queue_remove (idle->client->idle, idle);
+  cockpit_http_idle_free (idle);
   return FALSE;
 }
 
@@ -125,6 +154,9 @@ cockpit_http_client_ensure (const gchar *name)
     {
       client = g_slice_new0 (CockpitHttpClient);
       client->name = g_strdup (name);
+      client->idle = g_queue_new ();
+      client->pool_size = POOL_SIZE;
+      client->pool_timeout = POOL_TIMEOUT;
 
       if (clients && name)
         {
@@ -145,28 +177,88 @@ static void
 cockpit_http_client_checkin (CockpitHttpClient *client,
                              CockpitStream *stream)
 {
-  cockpit_http_client_reset (client);
-  client->stream = g_object_ref (stream);
-  client->sig_close = g_signal_connect (stream, "close", G_CALLBACK (on_client_close), client);
-  client->timeout = g_timeout_add_seconds (10, on_client_timeout, client);
+  CockpitHttpIdle *idle;
+
+  if (client->pool_size == 0)
+    {
+      client->dropped++;
+      return;
+    }
+
+  while (g_queue_get_length (client->idle) >= client->pool_size)
+    {
+      client->dropped++;
+      cockpit_http_idle_free (g_queue_pop_tail (client->idle));
+    }
+
+  idle = g_slice_new0 (CockpitHttpIdle);
+  idle->client = client;
+  idle->stream = g_object_ref (stream);
+  idle->sig_close = g_signal_connect (stream, "close", G_CALLBACK (on_idle_close), idle);
+  idle->timeout = g_timeout_add_seconds (client->pool_timeout, on_idle_timeout, idle);
+  g_queue_push_head (client->idle, idle);
+
+  cockpit_http_client_debug (client);
 }
 
 static CockpitStream *
 cockpit_http_client_checkout (CockpitHttpClient *client)
 {
   CockpitStream *stream = NULL;
+  CockpitHttpIdle *idle;
 
-  if (client->stream)
+  idle = g_queue_pop_head (client->idle);
+  if (idle)
     {
       g_debug ("%s: reusing connection", client->name);
 
-      stream = g_object_ref (client->stream);
-      cockpit_http_client_reset (client);
+      stream = g_object_ref (idle->stream);
+      cockpit_http_idle_free (idle);
+      client->reuses++;
+    }
+  else
+    {
+      client->connects++;
     }
 
+  cockpit_http_client_debug (client);
   return stream;
 }
 
+static gboolean
+cockpit_http_client_parse_pool (CockpitHttpClient *client,
+                                JsonObject *options)
+{
+  gint64 size;
+  gint64 timeout;
+
+  if (!cockpit_json_get_int (options, "pool-size", client->pool_size, &size) ||
+      size < 0 || size > G_MAXINT)
+    {
+      g_warning ("bad \"pool-size\" field in HTTP stream request");
+      return FALSE;
+    }
+
+  if (!cockpit_json_get_int (options, "pool-timeout", client->pool_timeout, &timeout) ||
+      timeout <= 0 || timeout > G_MAXUINT / 1000)
+    {
+      g_warning ("bad \"pool-timeout\" field in HTTP stream request");
+      return FALSE;
+    }
+
+  client->pool_size = size;
+  client->pool_timeout = timeout;
+
+  /* Shrink the pool right away, if it got smaller */
+  while (g_queue_get_length (client->idle) > client->pool_size)
+    {
+      client->dropped++;
+      cockpit_http_idle_free (g_queue_pop_tail (client->idle));
+    }
+
+  return TRUE;
+}
+
 /**
  * CockpitHttpStream:
  *
@@ -185,6 +277,14 @@ cockpit_http_client_checkout (CockpitHttpClient *client)
 
 #define COCKPIT_HTTP_STREAM(o)    (G_TYPE_CHECK_INSTANCE_CAST ((o), COCKPIT_TYPE_HTTP_STREAM, CockpitHttpStream))
 
+/* Where relay_chunked() is, when not in the middle of chunk data */
+#define CHUNK_HEADER   -1
+#define CHUNK_TRAILER  -2
+#define CHUNK_LAST     -3
+
+/* Chunks smaller than this are merged into messages of up to this size */
+#define CHUNK_MERGE_MAX  8192
+
 enum {
     BUFFER_REQUEST,
     RELAY_REQUEST,
@@ -218,6 +318,7 @@ typedef struct _CockpitHttpStream {
   /* From parsing the response */
   gboolean response_chunked;
   gssize response_length;
+  gssize chunk_remaining;
 } CockpitHttpStream;
 
 typedef struct {
@@ -458,70 +559,153 @@ relay_data (CockpitChannel *channel,
     }
 }
 
+/*
+ * Flush chunk data that was gathered together, see below. Small chunks
+ * are copied into one message, rather than sending many tiny ones.
+ */
+static void
+relay_merged (CockpitChannel *channel,
+              GByteArray **merged)
+{
+  GBytes *message;
+
+  if (*merged)
+    {
+      message = g_byte_array_free_to_bytes (*merged);
+      *merged = NULL;
+      relay_data (channel, message);
+      g_bytes_unref (message);
+    }
+}
+
+/*
+ * All complete parts of the buffer are handled in one go. The buffer
+ * is taken over as a GBytes, and large chunks are sent as slices of
+ * it without copying. Chunk data is relayed as it arrives, so all that
+ * is left over at the end is a partial chunk header or line ending,
+ * which is put back in the buffer.
+ */
 static gboolean
 relay_chunked (CockpitHttpStream *self,
                CockpitChannel *channel,
                GByteArray *buffer)
 {
+  GByteArray *merged = NULL;
+  GBytes *frozen = NULL;
   GBytes *message;
+  const gchar *problem = NULL;
+  gboolean finished = FALSE;
   const gchar *data;
   const gchar *pos;
   guint64 size;
+  gsize offset;
   gsize length;
-  gsize beg;
+  gsize block;
   gchar *end;
 
-  data = (const gchar *)buffer->data;
-  length = buffer->len;
-
-  pos = memchr (data, '\r', length);
-  if (pos == NULL)
+  if (buffer->len == 0)
     return FALSE; /* want more data */
 
-  beg = (pos + 2) - data;
-  if (length < beg)
-    {
-      /* have to have a least the ending chars */
-      return FALSE; /* want more data */
-    }
+  /* When array is reffed, this just clears byte array */
+  g_byte_array_ref (buffer);
+  frozen = g_byte_array_free_to_bytes (buffer);
+  data = g_bytes_get_data (frozen, &length);
 
-  size = g_ascii_strtoull (data, &end, 16);
-  if (pos[1] != '\n' || end != pos)
-    {
-      g_message ("%s: received invalid HTTP chunk", self->name);
-      cockpit_channel_close (channel, "protocol-error");
-    }
-  else if (size > G_MAXSSIZE)
-    {
-      g_message ("%s: received extremely large HTTP chunk", self->name);
-      cockpit_channel_close (channel, "protocol-error");
-    }
-  else if (length < beg + size + 2)
+  offset = 0;
+  while (offset < length && !finished && !problem)
     {
-      return FALSE; /* want more data */
+      if (self->chunk_remaining > 0)
+        {
+          block = MIN (self->chunk_remaining, length - offset);
+          if (block >= CHUNK_MERGE_MAX)
+            {
+              relay_merged (channel, &merged);
+              message = g_bytes_new_from_bytes (frozen, offset, block);
+              relay_data (channel, message);
+              g_bytes_unref (message);
+            }
+          else
+            {
+              if (merged && merged->len + block > CHUNK_MERGE_MAX)
+                relay_merged (channel, &merged);
+              if (!merged)
+                merged = g_byte_array_sized_new (CHUNK_MERGE_MAX);
+              g_byte_array_append (merged, (const guint8 *)data + offset, block);
+            }
+
+          offset += block;
+          self->chunk_remaining -= block;
+          if (self->chunk_remaining == 0)
+            self->chunk_remaining = CHUNK_TRAILER;
+        }
+      else if (self->chunk_remaining == CHUNK_TRAILER ||
+               self->chunk_remaining == CHUNK_LAST)
+        {
+          if (length - offset < 2)
+            break; /* want more data */
+          if (data[offset] != '\r' || data[offset + 1] != '\n')
+            {
+              g_message ("%s: received invalid HTTP chunk data", self->name);
+              problem = "protocol-error";
+              break;
+            }
+
+          offset += 2;
+          if (self->chunk_remaining == CHUNK_LAST)
+            finished = TRUE;
+          self->chunk_remaining = CHUNK_HEADER;
+        }
+      else
+        {
+          pos = memchr (data + offset, '\r', length - offset);
+          if (pos == NULL || pos + 1 == data + length)
+            break; /* want more data */
+
+          size = g_ascii_strtoull (data + offset, &end, 16);
+          if (pos[1] != '\n' || end != pos)
+            {
+              g_message ("%s: received invalid HTTP chunk", self->name);
+              problem = "protocol-error";
+            }
+          else if (size > G_MAXSSIZE)
+            {
+              g_message ("%s: received extremely large HTTP chunk", self->name);
+              problem = "protocol-error";
+            }
+          else if (size == 0)
+            {
+              g_debug ("%s: received last chunk", self->name);
+              self->chunk_remaining = CHUNK_LAST;
+            }
+          else
+            {
+              self->chunk_remaining = size;
+            }
+
+          offset = (pos + 2) - data;
+        }
     }
-  else if (data[beg + size] != '\r' || data[beg + size + 1] != '\n')
+
+  relay_merged (channel, &merged);
+
+  /* Put back what wasn't used */
+  if (!problem && offset < length)
+    g_byte_array_append (buffer, (const guint8 *)data + offset, length - offset);
+  g_bytes_unref (frozen);
+
+  if (problem)
     {
-      g_message ("%s: received invalid HTTP chunk data", self->name);
-      cockpit_channel_close (channel, "protocol-error");
+      cockpit_channel_close (channel, problem);
     }
-  else if (size == 0)
+  else if (finished)
     {
       /* All done, yay */
-      g_debug ("%s: received last chunk", self->name);
-      cockpit_pipe_skip (buffer, beg + 2);
       cockpit_channel_close (channel, NULL);
       g_assert (self->state == FINISHED);
     }
-  else
-    {
-      message = cockpit_pipe_consume (buffer, beg, size, 2);
-      relay_data (channel, message);
-      g_bytes_unref (message);
-      return TRUE;
-    }
 
-  return TRUE;
+  /* Everything available was handled */
+  return FALSE;
 }
 
 static gboolean
@@ -963,6 +1147,7 @@ static void
 cockpit_http_stream_init (CockpitHttpStream *self)
 {
   self->response_length = -1;
+  self->chunk_remaining = CHUNK_HEADER;
   self->keep_alive = FALSE;
   self->state = BUFFER_REQUEST;
 }
@@ -1009,6 +1194,12 @@ cockpit_http_stream_prepare (CockpitChannel *channel)
 
   self->client = cockpit_http_client_ensure (connection);
 
+  if (!cockpit_http_client_parse_pool (self->client, options))
+    {
+      cockpit_channel_close (channel, "protocol-error");
+      goto out;
+    }
+
   if (!self->client->connectable ||
       json_object_has_member (options, "unix") ||
       json_object_has_member (options, "port") ||
@@ -20,11 +20,14 @@
 #include "config.h"
 
 #include <math.h>
+#include <string.h>
 #include <sys/time.h>
 
 #include "cockpitmetrics.h"
 #include "cockpitinternalmetrics.h"
+#include "cockpitmetricsring.h"
 #include "cockpitsamples.h"
+#include "cockpitsampleset.h"
 #include "cockpitcpusamples.h"
 #include "cockpitmemorysamples.h"
 #include "cockpitblocksamples.h"
@@ -32,6 +35,9 @@
 #include "cockpitmountsamples.h"
 #include "cockpitcgroupsamples.h"
 #include "cockpitdisksamples.h"
+#include "cockpitselfsamples.h"
+#include "cockpitpressuresamples.h"
+#include "cockpitprocesssamples.h"
 
 #include "common/cockpitjson.h"
 
@@ -53,7 +59,11 @@ typedef enum {
   NETWORK_SAMPLER = 1 << 3,
   MOUNT_SAMPLER = 1 << 4,
   CGROUP_SAMPLER = 1 << 5,
-  DISK_SAMPLER = 1 << 6
+  DISK_SAMPLER = 1 << 6,
+  CPU_CORE_SAMPLER = 1 << 7,
+  SELF_SAMPLER = 1 << 8,
+  PRESSURE_SAMPLER = 1 << 9,
+  PROCESS_SAMPLER = 1 << 10
 } SamplerSet;
 
 typedef struct {
@@ -70,6 +80,14 @@ static MetricDescription metric_descriptions[] = {
   { "cpu.basic.system", "millisec", "counter", FALSE, CPU_SAMPLER },
   { "cpu.basic.iowait", "millisec", "counter", FALSE, CPU_SAMPLER },
 
+  { "cpu.core.user",    "millisec", "counter", TRUE, CPU_CORE_SAMPLER },
+  { "cpu.core.nice",    "millisec", "counter", TRUE, CPU_CORE_SAMPLER },
+  { "cpu.core.system",  "millisec", "counter", TRUE, CPU_CORE_SAMPLER },
+  { "cpu.core.iowait",  "millisec", "counter", TRUE, CPU_CORE_SAMPLER },
+  { "cpu.core.irq",     "millisec", "counter", TRUE, CPU_CORE_SAMPLER },
+  { "cpu.core.softirq", "millisec", "counter", TRUE, CPU_CORE_SAMPLER },
+  { "cpu.core.steal",   "millisec", "counter", TRUE, CPU_CORE_SAMPLER },
+
   { "memory.free",      "bytes", "instant", FALSE, MEMORY_SAMPLER },
   { "memory.used",      "bytes", "instant", FALSE, MEMORY_SAMPLER },
   { "memory.cached",    "bytes", "instant", FALSE, MEMORY_SAMPLER },
@@ -95,6 +113,33 @@ static MetricDescription metric_descriptions[] = {
   { "cgroup.memory.sw-limit", "bytes",    "instant", TRUE, CGROUP_SAMPLER },
   { "cgroup.cpu.usage",       "millisec", "counter", TRUE, CGROUP_SAMPLER },
   { "cgroup.cpu.shares",      "count",    "instant", TRUE, CGROUP_SAMPLER },
+  { "cgroup.io.read",         "bytes",    "counter", TRUE, CGROUP_SAMPLER },
+  { "cgroup.io.written",      "bytes",    "counter", TRUE, CGROUP_SAMPLER },
+
+  { "pressure.some", "millisec", "counter", TRUE, PRESSURE_SAMPLER },
+  { "pressure.full", "millisec", "counter", TRUE, PRESSURE_SAMPLER },
+
+  { "process.cpu", "millisec", "counter", TRUE, PROCESS_SAMPLER },
+  { "process.rss", "bytes",    "instant", TRUE, PROCESS_SAMPLER },
+
+  /* Only with a "source" of "self" */
+  { "bridge.channel.open",       "count",    "instant", TRUE,  SELF_SAMPLER },
+  { "bridge.channel.opened",     "count",    "counter", TRUE,  SELF_SAMPLER },
+  { "bridge.channel.messages",   "count",    "counter", TRUE,  SELF_SAMPLER },
+  { "bridge.channel.bytes",      "bytes",    "counter", TRUE,  SELF_SAMPLER },
+  { "bridge.channel.ready-time", "millisec", "counter", TRUE,  SELF_SAMPLER },
+  { "bridge.group.channels",     "count",    "instant", TRUE,  SELF_SAMPLER },
+  { "bridge.group.received",     "bytes",    "counter", TRUE,  SELF_SAMPLER },
+  { "bridge.group.sent",         "bytes",    "counter", TRUE,  SELF_SAMPLER },
+  { "bridge.group.queued",       "bytes",    "instant", TRUE,  SELF_SAMPLER },
+  { "bridge.pipe.queued",        "count",    "instant", FALSE, SELF_SAMPLER },
+  { "bridge.pipe.written",       "bytes",    "counter", FALSE, SELF_SAMPLER },
+  { "bridge.dbus.calls",         "count",    "counter", FALSE, SELF_SAMPLER },
+  { "bridge.dbus.latency",       "count",    "counter", TRUE,  SELF_SAMPLER },
+  { "bridge.metrics.samples",    "count",    "counter", FALSE, SELF_SAMPLER },
+  { "bridge.memory.rss",         "bytes",    "instant", FALSE, SELF_SAMPLER },
+  { "bridge.memory.trimmed",     "bytes",    "counter", FALSE, SELF_SAMPLER },
+  { "bridge.memory.used",        "bytes",    "instant", TRUE,  SELF_SAMPLER },
 
   { NULL }
 };
@@ -112,9 +157,11 @@ find_metric_description (const gchar *name)
 }
 
 typedef struct {
-  gboolean seen;
+  guint seen;
   int index;
   double value;
+  guint key;
+  gint column;
 } InstanceInfo;
 
 typedef struct {
@@ -122,21 +169,53 @@ typedef struct {
   const gchar *derive;
 
   GHashTable *instances;
+  guint n_seen;
   double value;
+  gint column;
 } MetricInfo;
 
+/*
+ * What a sample set key means to this channel, looked up the first
+ * time it is seen. The metric is an index into self->metrics plus one,
+ * or one of the values below.
+ */
+typedef struct {
+  gint metric;
+  InstanceInfo *inst;
+} Handle;
+
+#define HANDLE_UNRESOLVED 0
+#define HANDLE_UNWANTED -1
+#define HANDLE_BY_NAME -2
+
 typedef struct {
   CockpitMetrics parent;
   const gchar *name;
 
   gint64 interval;
+  gint64 since;
   int n_metrics;
   MetricInfo *metrics;
   const gchar **instances;
   const gchar **omit_instances;
   SamplerSet samplers;
+  gboolean self_source;
+
+  struct _SamplerHub *hub;
+  gboolean resumed;
+  GArray *handles;
+  guint generation;
 
   gboolean need_meta;
+
+  /* With a "source" of "history" */
+  CockpitMetricsRing *ring;
+  gint n_columns;
+  guint64 row;
+  gint64 step;
+  gint64 limit;
+  gint64 last_timestamp;
+  guint idler;
 } CockpitInternalMetrics;
 
 typedef struct {
@@ -150,6 +229,7 @@ G_DEFINE_TYPE_WITH_CODE (CockpitInternalMetrics, cockpit_internal_metrics, COCKP
 static void
 cockpit_internal_metrics_init (CockpitInternalMetrics *self)
 {
+  self->handles = g_array_new (FALSE, TRUE, sizeof (Handle));
 }
 
 static gint64
@@ -159,7 +239,8 @@ timestamp_from_timeval (struct timeval *tv)
 }
 
 static void
-send_meta (CockpitInternalMetrics *self)
+send_meta (CockpitInternalMetrics *self,
+           gint64 timestamp)
 {
   JsonArray *metrics;
   JsonObject *metric;
@@ -171,7 +252,7 @@ send_meta (CockpitInternalMetrics *self)
   now = timestamp_from_timeval (&now_timeval);
 
   root = json_object_new ();
-  json_object_set_int_member (root, "timestamp", now);
+  json_object_set_int_member (root, "timestamp", timestamp);
   json_object_set_int_member (root, "now", now);
   json_object_set_int_member (root, "interval", self->interval);
 
@@ -229,11 +310,67 @@ send_meta (CockpitInternalMetrics *self)
 
   json_object_set_array_member (root, "metrics", metrics);
 
-  cockpit_metrics_send_meta (COCKPIT_METRICS (self), root, FALSE);
+  /* After a pause, don't follow on from what was sent before */
+  cockpit_metrics_send_meta (COCKPIT_METRICS (self), root, self->resumed);
+  self->resumed = FALSE;
 
   json_object_unref (root);
 }
 
+static gboolean
+strv_contains (const gchar **strv,
+               const gchar *str)
+{
+  for (; *strv != NULL; strv++)
+    {
+      if (g_str_equal (*strv, str))
+        return TRUE;
+    }
+  return FALSE;
+}
+
+static gboolean
+instance_wanted (CockpitInternalMetrics *self,
+                 const gchar *instance)
+{
+  if (self->instances)
+    return strv_contains (self->instances, instance);
+  if (self->omit_instances)
+    return !strv_contains (self->omit_instances, instance);
+  return TRUE;
+}
+
+static InstanceInfo *
+lookup_instance (CockpitInternalMetrics *self,
+                 MetricInfo *info,
+                 const gchar *instance)
+{
+  InstanceInfo *inst = g_hash_table_lookup (info->instances, instance);
+  if (inst == NULL)
+    {
+      g_debug ("%s + %s", info->desc->name, instance);
+      inst = g_new0 (InstanceInfo, 1);
+      inst->key = G_MAXUINT;
+      g_hash_table_insert (info->instances, g_strdup (instance), inst);
+      self->need_meta = TRUE;
+    }
+  return inst;
+}
+
+static void
+sample_instance (CockpitInternalMetrics *self,
+                 MetricInfo *info,
+                 InstanceInfo *inst,
+                 gint64 value)
+{
+  if (inst->seen != self->generation)
+    {
+      inst->seen = self->generation;
+      info->n_seen++;
+    }
+  inst->value = value == COCKPIT_SAMPLES_NONE ? NAN : value;
+}
+
 static void
 cockpit_internal_metrics_sample (CockpitSamples *samples,
                                  const gchar *metric,
@@ -250,29 +387,89 @@ cockpit_internal_metrics_sample (CockpitSamples *samples,
 
       if (info->desc->instanced)
         {
-          InstanceInfo *inst = g_hash_table_lookup (info->instances, instance);
-          if (inst == NULL)
-            {
-              g_debug ("%s + %s", metric, instance);
-              inst = g_new0 (InstanceInfo, 1);
-              g_hash_table_insert (info->instances, g_strdup (instance), inst);
-              self->need_meta = TRUE;
-            }
-          inst->seen = TRUE;
-          inst->value = value;
+          if (!instance_wanted (self, instance))
+            return;
+
+          sample_instance (self, info, lookup_instance (self, info, instance), value);
         }
       else
-        info->value = value;
+        info->value = value == COCKPIT_SAMPLES_NONE ? NAN : value;
     }
 }
 
+static gboolean
+cockpit_internal_metrics_wanted (CockpitSamples *samples,
+                                 const gchar *instance)
+{
+  return instance_wanted (COCKPIT_INTERNAL_METRICS (samples), instance);
+}
+
 static void
-instance_reset (gpointer key,
-                gpointer value,
-                gpointer user_data)
+resolve_handle (CockpitInternalMetrics *self,
+                Handle *handle,
+                guint key,
+                const gchar *metric,
+                const gchar *instance)
 {
-  InstanceInfo *info = value;
-  info->seen = FALSE;
+  handle->metric = HANDLE_UNWANTED;
+  handle->inst = NULL;
+
+  for (int i = 0; i < self->n_metrics; i++)
+    {
+      MetricInfo *info = &self->metrics[i];
+      if (g_strcmp0 (metric, info->desc->name) != 0)
+        continue;
+
+      /* Asked for more than once, so one key means several metrics */
+      if (handle->metric != HANDLE_UNWANTED)
+        {
+          handle->metric = HANDLE_BY_NAME;
+          handle->inst = NULL;
+          return;
+        }
+
+      if (info->desc->instanced)
+        {
+          if (!instance_wanted (self, instance))
+            return;
+          handle->inst = lookup_instance (self, info, instance);
+          handle->inst->key = key;
+        }
+
+      handle->metric = i + 1;
+    }
+}
+
+static void
+on_sample (guint key,
+           const gchar *metric,
+           const gchar *instance,
+           gint64 value,
+           gpointer user_data)
+{
+  CockpitInternalMetrics *self = user_data;
+  MetricInfo *info;
+  Handle *handle;
+
+  if (key >= self->handles->len)
+    g_array_set_size (self->handles, key + 1);
+
+  handle = &g_array_index (self->handles, Handle, key);
+  if (handle->metric == HANDLE_UNRESOLVED)
+    resolve_handle (self, handle, key, metric, instance);
+
+  if (handle->metric > 0)
+    {
+      info = &self->metrics[handle->metric - 1];
+      if (handle->inst)
+        sample_instance (self, info, handle->inst, value);
+      else
+        info->value = value == COCKPIT_SAMPLES_NONE ? NAN : value;
+    }
+  else if (handle->metric == HANDLE_BY_NAME)
+    {
+      cockpit_internal_metrics_sample (COCKPIT_SAMPLES (self), metric, instance, value);
+    }
 }
 
 static gboolean
@@ -280,56 +477,75 @@ instance_unseen (gpointer key,
                  gpointer value,
                  gpointer user_data)
 {
-  InstanceInfo *info = value;
-  return !info->seen;
+  CockpitInternalMetrics *self = user_data;
+  InstanceInfo *inst = value;
+
+  if (inst->seen == self->generation)
+    return FALSE;
+
+  /* Look it up again if it comes back */
+  if (inst->key < self->handles->len)
+    g_array_index (self->handles, Handle, inst->key).metric = HANDLE_UNRESOLVED;
+  return TRUE;
 }
 
 static void
-cockpit_internal_metrics_tick (CockpitMetrics *metrics,
-                               gint64 timestamp)
+collect_samples (CockpitSamples *samples,
+                 guint flags)
 {
-  CockpitInternalMetrics *self = (CockpitInternalMetrics *)metrics;
-  struct timeval now_timeval;
-  gint64 now;
-
-  gettimeofday (&now_timeval, NULL);
-  now = timestamp_from_timeval (&now_timeval);
+  SamplerSet samplers = flags;
+
+  /* Runs on the sampler thread */
+  if (samplers & (CPU_SAMPLER | CPU_CORE_SAMPLER))
+    cockpit_cpu_samples (samples, (samplers & CPU_CORE_SAMPLER) != 0);
+  if (samplers & MEMORY_SAMPLER)
+    cockpit_memory_samples (samples);
+  if (samplers & BLOCK_SAMPLER)
+    cockpit_block_samples (samples);
+  if (samplers & NETWORK_SAMPLER)
+    cockpit_network_samples (samples);
+  if (samplers & MOUNT_SAMPLER)
+    cockpit_mount_samples (samples);
+  if (samplers & CGROUP_SAMPLER)
+    cockpit_cgroup_samples (samples);
+  if (samplers & DISK_SAMPLER)
+    cockpit_disk_samples (samples);
+  if (samplers & SELF_SAMPLER)
+    cockpit_self_samples (samples);
+  if (samplers & PRESSURE_SAMPLER)
+    cockpit_pressure_samples (samples);
+  if (samplers & PROCESS_SAMPLER)
+    cockpit_process_samples (samples);
+}
 
-  /* Reset samples
+static void
+send_samples (CockpitInternalMetrics *self,
+              CockpitSampleSet *set,
+              gint64 sampled)
+{
+  /* Reset samples, instances are seen in a new generation
    */
+  self->generation++;
   for (int i = 0; i < self->n_metrics; i++)
     {
       MetricInfo *info = &self->metrics[i];
       if (info->desc->instanced)
-        g_hash_table_foreach (info->instances, instance_reset, NULL);
+        info->n_seen = 0;
       else
         info->value = NAN;
     }
 
   /* Sample
    */
-  if (self->samplers & CPU_SAMPLER)
-    cockpit_cpu_samples (COCKPIT_SAMPLES (self));
-  if (self->samplers & MEMORY_SAMPLER)
-    cockpit_memory_samples (COCKPIT_SAMPLES (self));
-  if (self->samplers & BLOCK_SAMPLER)
-    cockpit_block_samples (COCKPIT_SAMPLES (self));
-  if (self->samplers & NETWORK_SAMPLER)
-    cockpit_network_samples (COCKPIT_SAMPLES (self));
-  if (self->samplers & MOUNT_SAMPLER)
-    cockpit_mount_samples (COCKPIT_SAMPLES (self));
-  if (self->samplers & CGROUP_SAMPLER)
-    cockpit_cgroup_samples (COCKPIT_SAMPLES (self));
-  if (self->samplers & DISK_SAMPLER)
-    cockpit_disk_samples (COCKPIT_SAMPLES (self));
-
-  /* Check for disappeared instances
+  cockpit_sample_set_foreach (set, on_sample, self);
+
+  /* Check for disappeared instances, only if some weren't seen
    */
   for (int i = 0; i < self->n_metrics; i++)
     {
       MetricInfo *info = &self->metrics[i];
-      if (info->desc->instanced)
-        if (g_hash_table_foreach_remove (info->instances, instance_unseen, NULL) > 0)
+      if (info->desc->instanced && info->n_seen != g_hash_table_size (info->instances))
+        if (g_hash_table_foreach_remove (info->instances, instance_unseen, self) > 0)
           self->need_meta = TRUE;
     }
 
@@ -338,7 +554,7 @@ cockpit_internal_metrics_tick (CockpitMetrics *metrics,
    */
   if (self->need_meta)
     {
-      send_meta (self);
+      send_meta (self, sampled);
       self->need_meta = FALSE;
     }
 
@@ -364,8 +580,516 @@ cockpit_internal_metrics_tick (CockpitMetrics *metrics,
         buffer[i][0] = info->value;
     }
 
-  cockpit_metrics_send_data (COCKPIT_METRICS (self), now);
+  cockpit_metrics_send_data (COCKPIT_METRICS (self), sampled);
+}
+
+/*
+ * All internal metrics channels that want the same samplers at the
+ * same interval share a SamplerHub. It samples once per interval
+ * and hands the result to each channel, which picks out the metrics
+ * and instances it asked for.
+ *
+ * The samplers run on their own thread, so that a slow read (such as
+ * statvfs on a hung mount) doesn't block the main loop. If the last
+ * round hasn't come back yet, a tick is skipped rather than queued.
+ * Hubs tick on a cockpit_metronome_add(), so that those of related
+ * intervals wake up together.
+ *
+ * The samplers skip instances that the channels filter out, so
+ * channels only share a hub when they filter instances the same way.
+ *
+ * Each hub keeps a ring of its recent sample sets, so that a channel
+ * opened with a "timestamp" in the past can be sent a backfill right
+ * away. After the last channel goes away, the hub keeps sampling for
+ * as long as that history lasts, so that a reloaded page finds it.
+ */
+
+gint64 cockpit_internal_metrics_history = 10 * 60 * 1000;
+
+/* Upper limit on the number of sample sets kept per hub */
+#define HISTORY_MAX 3600
+
+typedef struct _SamplerHub {
+  SamplerSet samplers;
+  gint64 interval;
+  gchar *filter_key;
+  GHashTable *filter;
+  gboolean omit;
+  gint refs;
+  GPtrArray *channels;
+  gboolean collecting;
+  gint64 sampled;
+  guint timeout;
+  guint linger;
+
+  /* The ring of sample sets, the one at 'next' is being collected */
+  CockpitSampleSet **ring;
+  gint64 *stamps;
+  guint n_ring;
+  guint next;
+} SamplerHub;
+
+static GHashTable *sampler_hubs;
+
+static guint
+sampler_hub_hash (gconstpointer v)
+{
+  const SamplerHub *hub = v;
+  return hub->samplers ^ (guint)hub->interval ^
+         (hub->filter_key ? g_str_hash (hub->filter_key) : 0);
+}
+
+static gboolean
+sampler_hub_equal (gconstpointer v1,
+                   gconstpointer v2)
+{
+  const SamplerHub *hub1 = v1;
+  const SamplerHub *hub2 = v2;
+  return hub1->samplers == hub2->samplers && hub1->interval == hub2->interval &&
+         g_strcmp0 (hub1->filter_key, hub2->filter_key) == 0;
+}
+
+static void
+sampler_hub_unref (SamplerHub *hub)
+{
+  guint i;
+
+  if (--hub->refs > 0)
+    return;
+
+  g_assert (hub->timeout == 0);
+  g_assert (hub->linger == 0);
+  g_assert (hub->channels->len == 0);
+  g_ptr_array_free (hub->channels, TRUE);
+  for (i = 0; i < hub->n_ring; i++)
+    {
+      if (hub->ring[i])
+        g_object_unref (hub->ring[i]);
+    }
+  g_free (hub->ring);
+  g_free (hub->stamps);
+  g_free (hub->filter_key);
+  if (hub->filter)
+    g_hash_table_unref (hub->filter);
+  g_free (hub);
+}
+
+static gboolean
+on_hub_collected (gpointer user_data)
+{
+  SamplerHub *hub = user_data;
+  CockpitSampleSet *set;
+  GPtrArray *channels;
+  guint i;
+
+  hub->collecting = FALSE;
+  set = hub->ring[hub->next];
+  hub->stamps[hub->next] = hub->sampled;
+  hub->next = (hub->next + 1) % hub->n_ring;
+
+  /* Channels may close, and unsubscribe, while we deliver */
+  channels = g_ptr_array_new_with_free_func (g_object_unref);
+  for (i = 0; i < hub->channels->len; i++)
+    g_ptr_array_add (channels, g_object_ref (hub->channels->pdata[i]));
+
+  for (i = 0; i < channels->len; i++)
+    {
+      CockpitInternalMetrics *self = channels->pdata[i];
+      if (self->hub == hub)
+        {
+          send_samples (self, set, hub->sampled);
+          cockpit_metrics_flush_data (COCKPIT_METRICS (self));
+        }
+    }
+
+  g_ptr_array_free (channels, TRUE);
+  sampler_hub_unref (hub);
+  return FALSE;
+}
+
+static void
+on_hub_tick (gint64 timestamp,
+             gpointer user_data)
+{
+  SamplerHub *hub = user_data;
+  struct timeval now_timeval;
+
+  if (hub->collecting)
+    {
+      g_debug ("still collecting samples, skipping tick");
+      return;
+    }
+
+  gettimeofday (&now_timeval, NULL);
+  hub->sampled = timestamp_from_timeval (&now_timeval);
+
+  /* Overwrites the oldest sample set in the ring, all share keys with the first */
+  if (!hub->ring[hub->next])
+    {
+      if (hub->ring[0])
+        hub->ring[hub->next] = cockpit_sample_set_new_sharing (hub->ring[0]);
+      else
+        hub->ring[hub->next] = cockpit_sample_set_new ();
+      cockpit_sample_set_filter (hub->ring[hub->next], hub->filter, hub->omit);
+    }
+  hub->stamps[hub->next] = 0;
+
+  hub->collecting = TRUE;
+  hub->refs++;
+  cockpit_sample_set_collect (hub->ring[hub->next], collect_samples, hub->samplers,
+                              on_hub_collected, hub);
+}
+
+static void
+sampler_hub_backfill (SamplerHub *hub,
+                      CockpitInternalMetrics *self)
+{
+  gboolean sent = FALSE;
+  guint i, slot;
+
+  /* Oldest first, all that are newer than requested */
+  for (i = 0; i < hub->n_ring; i++)
+    {
+      slot = (hub->next + i) % hub->n_ring;
+      if (hub->stamps[slot] == 0 || hub->stamps[slot] < self->since)
+        continue;
+
+      /* Without a "timestamp" only the most recent one */
+      if (self->since == 0 && slot != (hub->next + hub->n_ring - 1) % hub->n_ring)
+        continue;
+
+      send_samples (self, hub->ring[slot], hub->stamps[slot]);
+      sent = TRUE;
+    }
+
+  if (sent)
+    cockpit_metrics_flush_data (COCKPIT_METRICS (self));
+}
+
+static gboolean
+on_hub_linger (gpointer user_data)
+{
+  SamplerHub *hub = user_data;
+
+  hub->linger = 0;
+  cockpit_metronome_remove (hub->timeout);
+  hub->timeout = 0;
+  g_hash_table_remove (sampler_hubs, hub);
+  sampler_hub_unref (hub);
+
+  return FALSE;
+}
+
+static gint
+compare_strings (gconstpointer a,
+                 gconstpointer b)
+{
+  return strcmp (*(const gchar **)a, *(const gchar **)b);
+}
+
+/* The same for all channels that filter instances the same way, or NULL */
+static gchar *
+build_filter_key (CockpitInternalMetrics *self)
+{
+  const gchar **strv;
+  GPtrArray *sorted;
+  GString *key;
+  guint i;
+
+  strv = self->instances ? self->instances : self->omit_instances;
+  if (!strv)
+    return NULL;
+
+  sorted = g_ptr_array_new ();
+  for (; *strv != NULL; strv++)
+    g_ptr_array_add (sorted, (gpointer)*strv);
+  g_ptr_array_sort (sorted, compare_strings);
+
+  key = g_string_new (self->instances ? "+" : "-");
+  for (i = 0; i < sorted->len; i++)
+    {
+      g_string_append (key, sorted->pdata[i]);
+      g_string_append_c (key, '\n');
+    }
+
+  g_ptr_array_free (sorted, TRUE);
+  return g_string_free (key, FALSE);
+}
+
+static void
+sampler_hub_subscribe (CockpitInternalMetrics *self)
+{
+  SamplerHub key = { self->samplers, self->interval, };
+  const gchar **strv;
+  SamplerHub *hub;
+
+  g_assert (self->hub == NULL);
+
+  if (!sampler_hubs)
+    sampler_hubs = g_hash_table_new (sampler_hub_hash, sampler_hub_equal);
+
+  key.filter_key = build_filter_key (self);
+  hub = g_hash_table_lookup (sampler_hubs, &key);
+  if (hub)
+    {
+      g_free (key.filter_key);
+
+      /* The hub's own reference is handed over to us */
+      if (hub->linger)
+        {
+          g_source_remove (hub->linger);
+          hub->linger = 0;
+        }
+      else
+        {
+          hub->refs++;
+        }
+
+      /* Don't make the new channel wait a whole interval */
+      sampler_hub_backfill (hub, self);
+    }
+  else
+    {
+      hub = g_new0 (SamplerHub, 1);
+      hub->samplers = self->samplers;
+      hub->interval = self->interval;
+      hub->filter_key = key.filter_key;
+      hub->refs = 1;
+
+      /* A copy, the hub may outlive the channel */
+      strv = self->instances ? self->instances : self->omit_instances;
+      if (strv)
+        {
+          hub->filter = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+          for (; *strv != NULL; strv++)
+            g_hash_table_add (hub->filter, g_strdup (*strv));
+          hub->omit = self->instances == NULL;
+        }
+
+      hub->channels = g_ptr_array_new ();
+      hub->n_ring = CLAMP (cockpit_internal_metrics_history / hub->interval, 0, HISTORY_MAX) + 1;
+      hub->ring = g_new0 (CockpitSampleSet *, hub->n_ring);
+      hub->stamps = g_new0 (gint64, hub->n_ring);
+      g_hash_table_add (sampler_hubs, hub);
+
+      hub->timeout = cockpit_metronome_add (hub->interval, on_hub_tick, hub);
+      on_hub_tick (0, hub);
+    }
+
+  g_ptr_array_add (hub->channels, self);
+  self->hub = hub;
+}
+
+static void
+sampler_hub_unsubscribe (CockpitInternalMetrics *self)
+{
+  SamplerHub *hub = self->hub;
+
+  if (!hub)
+    return;
+
+  self->hub = NULL;
+  g_ptr_array_remove (hub->channels, self);
+
+  if (hub->channels->len > 0)
+    {
+      sampler_hub_unref (hub);
+    }
+
+  /* Last channel gone, keep our reference while the history lasts */
+  else if (hub->n_ring > 1 && cockpit_internal_metrics_history <= G_MAXUINT)
+    {
+      g_assert (hub->linger == 0);
+      hub->linger = g_timeout_add (cockpit_internal_metrics_history, on_hub_linger, hub);
+    }
+
+  /* Otherwise stop sampling */
+  else
+    {
+      cockpit_metronome_remove (hub->timeout);
+      hub->timeout = 0;
+      g_hash_table_remove (sampler_hubs, hub);
+      sampler_hub_unref (hub);
+    }
+}
+
+/*
+ * A "history" channel plays back what cockpit-recorder wrote into
+ * its ring file, the same way an archive would be. Each column of
+ * the file is one instance of a metric, and is picked up as soon
+ * as the recorder adds it.
+ */
+
+const gchar *cockpit_internal_metrics_ring_file = COCKPIT_METRICS_RING_FILE;
+
+/* Most rows sent in each 'data' message */
+#define HISTORY_BATCH_MAX 1000
+
+static void
+history_columns (CockpitInternalMetrics *self)
+{
+  const gchar *metric;
+  const gchar *instance;
+  InstanceInfo *inst;
+  gint n_columns;
+
+  n_columns = cockpit_metrics_ring_get_n_columns (self->ring);
+  for (; self->n_columns < n_columns; self->n_columns++)
+    {
+      cockpit_metrics_ring_get_column (self->ring, self->n_columns, &metric, &instance);
+      if (!metric)
+        continue;
+
+      for (int i = 0; i < self->n_metrics; i++)
+        {
+          MetricInfo *info = &self->metrics[i];
+          if (!g_str_equal (info->desc->name, metric))
+            continue;
+
+          if (!info->desc->instanced)
+            {
+              info->column = self->n_columns;
+            }
+          else if (instance_wanted (self, instance))
+            {
+              inst = lookup_instance (self, info, instance);
+              inst->column = self->n_columns;
+            }
+        }
+    }
+}
+
+static void
+send_history_row (CockpitInternalMetrics *self,
+                  gint64 timestamp)
+{
+  GHashTableIter iter;
+  gpointer value;
+  double **buffer;
+
+  /* Nothing was recorded for a while, don't derive across that */
+  if (self->last_timestamp && timestamp - self->last_timestamp > 2 * self->interval)
+    {
+      self->need_meta = TRUE;
+      self->resumed = TRUE;
+    }
+
+  if (self->need_meta)
+    {
+      send_meta (self, timestamp);
+      self->need_meta = FALSE;
+    }
+
+  buffer = cockpit_metrics_get_data_buffer (COCKPIT_METRICS (self));
+  for (int i = 0; i < self->n_metrics; i++)
+    {
+      MetricInfo *info = &self->metrics[i];
+      if (info->desc->instanced)
+        {
+          g_hash_table_iter_init (&iter, info->instances);
+          while (g_hash_table_iter_next (&iter, NULL, &value))
+            {
+              InstanceInfo *inst = value;
+              buffer[i][inst->index] = cockpit_metrics_ring_get_value (self->ring, self->row, inst->column);
+            }
+        }
+      else
+        {
+          buffer[i][0] = cockpit_metrics_ring_get_value (self->ring, self->row, info->column);
+        }
+    }
+
+  cockpit_metrics_send_data (COCKPIT_METRICS (self), timestamp);
+  self->last_timestamp = timestamp;
+}
+
+static void
+send_history_progress (CockpitInternalMetrics *self)
+{
+  JsonObject *options;
+
+  if (!self->last_timestamp)
+    return;
+
+  options = json_object_new ();
+  json_object_set_int_member (options, "timestamp", self->last_timestamp);
+  cockpit_channel_control (COCKPIT_CHANNEL (self), "progress", options);
+  json_object_unref (options);
+}
+
+static gboolean
+on_history_batch (gpointer user_data)
+{
+  CockpitInternalMetrics *self = user_data;
+  guint64 first, end;
+  gint64 timestamp;
+
+  history_columns (self);
+
+  /* The recorder may have overwritten rows we didn't get to yet */
+  cockpit_metrics_ring_get_rows (self->ring, &first, &end);
+  if (self->row < first)
+    self->row = first;
+
+  for (int i = 0; i < HISTORY_BATCH_MAX; i++)
+    {
+      if (self->limit <= 0 || self->row >= end)
+        {
+          cockpit_metrics_flush_data (COCKPIT_METRICS (self));
+          self->idler = 0;
+          cockpit_channel_close (COCKPIT_CHANNEL (self), NULL);
+          return FALSE;
+        }
+
+      /* Skips a row that's being written */
+      timestamp = cockpit_metrics_ring_get_timestamp (self->ring, self->row);
+      if (timestamp > 0)
+        {
+          send_history_row (self, timestamp);
+          self->limit--;
+        }
+
+      self->row += self->step;
+    }
+
   cockpit_metrics_flush_data (COCKPIT_METRICS (self));
+  send_history_progress (self);
+  return TRUE;
+}
+
+static const gchar *
+history_start (CockpitInternalMetrics *self)
+{
+  GError *error = NULL;
+  gint64 interval;
+
+  self->ring = cockpit_metrics_ring_open (cockpit_internal_metrics_ring_file, &error);
+  if (!self->ring)
+    {
+      g_message ("couldn't read metrics history: %s", error->message);
+      g_error_free (error);
+      return "not-found";
+    }
+
+  /* Whole rows of the file only, at least one per sample */
+  interval = cockpit_metrics_ring_get_interval (self->ring);
+  self->step = MAX ((self->interval + interval - 1) / interval, 1);
+  self->interval = self->step * interval;
+
+  for (int i = 0; i < self->n_metrics; i++)
+    self->metrics[i].column = -1;
+
+  self->row = cockpit_metrics_ring_seek (self->ring, self->since);
+  self->idler = g_idle_add (on_history_batch, self);
+  return NULL;
+}
+
+static void
+history_stop (CockpitInternalMetrics *self)
+{
+  if (self->idler)
+    g_source_remove (self->idler);
+  self->idler = 0;
 }
 
 static gboolean
@@ -404,7 +1128,11 @@ convert_metric_description (CockpitInternalMetrics *self,
       return FALSE;
     }
 
+  /* The bridge's own metrics are a source of their own */
   MetricDescription *desc = find_metric_description (name);
+  if (desc && (desc->sampler == SELF_SAMPLER) != self->self_source)
+    desc = NULL;
+
   if (desc == NULL)
     {
       g_message ("unknown internal metric %s", name);
@@ -434,12 +1162,23 @@ cockpit_internal_metrics_prepare (CockpitChannel *channel)
   const gchar *problem = "protocol-error";
   JsonObject *options;
   JsonArray *metrics;
+  const gchar *source;
+  gboolean history;
   int i;
 
   COCKPIT_CHANNEL_CLASS (cockpit_internal_metrics_parent_class)->prepare (channel);
 
   options = cockpit_channel_get_options (channel);
 
+  /* "source" option, anything else than "self" or "history" is taken as "internal" */
+  if (!cockpit_json_get_string (options, "source", NULL, &source))
+    {
+      g_warning ("invalid \"source\" option (not a string)");
+      goto out;
+    }
+  self->self_source = (g_strcmp0 (source, "self") == 0);
+  history = (g_strcmp0 (source, "history") == 0);
+
   /* "instances" option */
   if (!cockpit_json_get_strv (options, "instances", NULL, (gchar ***)&self->instances))
     {
@@ -489,23 +1228,99 @@ cockpit_internal_metrics_prepare (CockpitChannel *channel)
       goto out;
     }
 
+  /* "timestamp" option, backfill from history */
+  if (!cockpit_json_get_int (options, "timestamp", 0, &self->since))
+    {
+      g_warning ("invalid \"timestamp\" option");
+      goto out;
+    }
+  if (self->since < 0)
+    {
+      struct timeval now_timeval;
+      gettimeofday (&now_timeval, NULL);
+      self->since += timestamp_from_timeval (&now_timeval);
+    }
+
+  /* "limit" option, only for history */
+  if (!cockpit_json_get_int (options, "limit", G_MAXINT64, &self->limit))
+    {
+      g_warning ("invalid \"limit\" option");
+      goto out;
+    }
+  else if (self->limit <= 0)
+    {
+      g_warning ("invalid \"limit\" value: %" G_GINT64_FORMAT, self->limit);
+      goto out;
+    }
+
   self->need_meta = TRUE;
 
-  problem = NULL;
-  cockpit_metrics_metronome (COCKPIT_METRICS (self), self->interval);
-  cockpit_channel_ready (channel);
+  if (history)
+    {
+      problem = history_start (self);
+      if (problem)
+        goto out;
+      cockpit_channel_ready (channel);
+    }
+  else
+    {
+      /* Joining a running hub sends a backfill straight away */
+      problem = NULL;
+      cockpit_channel_ready (channel);
+      sampler_hub_subscribe (self);
+    }
 
 out:
   if (problem)
     cockpit_channel_close (channel, problem);
 }
 
+static void
+cockpit_internal_metrics_pause (CockpitMetrics *metrics,
+                                gboolean paused)
+{
+  CockpitInternalMetrics *self = COCKPIT_INTERNAL_METRICS (metrics);
+  struct timeval now_timeval;
+
+  /* Like archives, history is sent at its own pace */
+  if (self->ring)
+    return;
+
+  if (paused)
+    {
+      /* On resume, backfill what the hub sampled meanwhile */
+      gettimeofday (&now_timeval, NULL);
+      self->since = timestamp_from_timeval (&now_timeval);
+      sampler_hub_unsubscribe (self);
+    }
+  else
+    {
+      self->need_meta = TRUE;
+      self->resumed = TRUE;
+      sampler_hub_subscribe (self);
+    }
+}
+
+static void
+cockpit_internal_metrics_close (CockpitChannel *channel,
+                                const gchar *problem)
+{
+  CockpitInternalMetrics *self = COCKPIT_INTERNAL_METRICS (channel);
+
+  sampler_hub_unsubscribe (self);
+  history_stop (self);
+
+  COCKPIT_CHANNEL_CLASS (cockpit_internal_metrics_parent_class)->close (channel, problem);
+}
+
 static void
 cockpit_internal_metrics_dispose (GObject *object)
 {
-#if 0
   CockpitInternalMetrics *self = COCKPIT_INTERNAL_METRICS (object);
-#endif
+
+  sampler_hub_unsubscribe (self);
+  history_stop (self);
+
   G_OBJECT_CLASS (cockpit_internal_metrics_parent_class)->dispose (object);
 }
 
@@ -517,6 +1332,8 @@ cockpit_internal_metrics_finalize (GObject *object)
   g_free (self->instances);
   g_free (self->omit_instances);
   g_free (self->metrics);
+  g_array_free (self->handles, TRUE);
+  cockpit_metrics_ring_free (self->ring);
 
   G_OBJECT_CLASS (cockpit_internal_metrics_parent_class)->finalize (object);
 }
@@ -525,18 +1342,21 @@ static void
 cockpit_internal_metrics_class_init (CockpitInternalMetricsClass *klass)
 {
   GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
-  CockpitMetricsClass *metrics_class = COCKPIT_METRICS_CLASS (klass);
   CockpitChannelClass *channel_class = COCKPIT_CHANNEL_CLASS (klass);
+  CockpitMetricsClass *metrics_class = COCKPIT_METRICS_CLASS (klass);
 
   gobject_class->dispose = cockpit_internal_metrics_dispose;
   gobject_class->finalize = cockpit_internal_metrics_finalize;
 
   channel_class->prepare = cockpit_internal_metrics_prepare;
-  metrics_class->tick = cockpit_internal_metrics_tick;
+  channel_class->close = cockpit_internal_metrics_close;
+
+  metrics_class->pause = cockpit_internal_metrics_pause;
 }
 
 static void
 cockpit_samples_interface_init (CockpitSamplesIface *iface)
 {
   iface->sample = cockpit_internal_metrics_sample;
+  iface->wanted = cockpit_internal_metrics_wanted;
 }
@@ -28,4 +28,12 @@ G_BEGIN_DECLS
 
 GType              cockpit_internal_metrics_get_type     (void) G_GNUC_CONST;
 
+/* Milliseconds of recent samples kept for backfill */
+extern gint64      cockpit_internal_metrics_history;
+
+/* The file that "history" channels read */
+extern const gchar *cockpit_internal_metrics_ring_file;
+
+G_END_DECLS
+
 #endif /* COCKPIT_INTERNAL_METRICS_H__ */
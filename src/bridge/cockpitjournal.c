@@ -0,0 +1,687 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2016 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitjournal.h"
+
+#include "common/cockpitjson.h"
+#include "common/cockpitunixfd.h"
+
+#include <systemd/sd-journal.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * CockpitJournal:
+ *
+ * A #CockpitChannel that reads journal entries with sd_journal, and
+ * optionally follows new ones as they are written. This saves running
+ * journalctl and parsing its output.
+ *
+ * The payload type for this channel is 'journal1'.
+ */
+
+#define COCKPIT_JOURNAL(o)    (G_TYPE_CHECK_INSTANCE_CAST ((o), COCKPIT_TYPE_JOURNAL, CockpitJournal))
+
+typedef struct {
+  CockpitChannel parent;
+  sd_journal *journal;
+
+  /* Options */
+  gchar **fields;
+  gint64 batch;
+  gint64 count;
+  gint64 since;
+  gint64 until;
+  gboolean reverse;
+  gboolean follow;
+
+  /* The journal is already positioned on an entry to send */
+  gboolean positioned;
+  gint64 limit;
+  gint64 sent;
+
+  guint idler;
+  guint watch;
+  gboolean paused;
+} CockpitJournal;
+
+/* How many entries to send in one message, when not asked for */
+#define JOURNAL_BATCH 64
+
+typedef struct {
+  CockpitChannelClass parent_class;
+} CockpitJournalClass;
+
+G_DEFINE_TYPE (CockpitJournal, cockpit_journal, COCKPIT_TYPE_CHANNEL);
+
+static void
+cockpit_journal_recv (CockpitChannel *channel,
+                      GBytes *message)
+{
+  g_warning ("received unexpected message in journal1 channel");
+  cockpit_channel_close (channel, "protocol-error");
+}
+
+static void
+cockpit_journal_init (CockpitJournal *self)
+{
+}
+
+static void
+journal_failed (CockpitJournal *self,
+                const gchar *what,
+                int r)
+{
+  JsonObject *options;
+
+  if (self->watch)
+    g_source_remove (self->watch);
+  self->watch = 0;
+
+  g_message ("couldn't %s journal: %s", what, g_strerror (-r));
+  options = cockpit_channel_close_options (COCKPIT_CHANNEL (self));
+  json_object_set_string_member (options, "message", g_strerror (-r));
+  cockpit_channel_close (COCKPIT_CHANNEL (self), "internal-error");
+}
+
+/* The same as journalctl --output=json: strings, or arrays of bytes */
+static JsonNode *
+build_value (const gchar *value,
+             gsize len)
+{
+  JsonArray *array;
+  JsonNode *node;
+  gchar *string;
+  gsize i;
+
+  if (g_utf8_validate (value, len, NULL))
+    {
+      string = g_strndup (value, len);
+      node = json_node_new (JSON_NODE_VALUE);
+      json_node_set_string (node, string);
+      g_free (string);
+    }
+  else
+    {
+      array = json_array_new ();
+      for (i = 0; i < len; i++)
+        json_array_add_int_element (array, (guchar)value[i]);
+      node = json_node_new (JSON_NODE_ARRAY);
+      json_node_take_array (node, array);
+    }
+
+  return node;
+}
+
+/* An array of several values, rather than the bytes of one */
+static gboolean
+is_value_list (JsonNode *node)
+{
+  JsonArray *array;
+  JsonNode *first;
+
+  if (!JSON_NODE_HOLDS_ARRAY (node))
+    return FALSE;
+
+  /* Byte arrays are never empty, empty values are strings */
+  array = json_node_get_array (node);
+  first = json_array_get_element (array, 0);
+  return JSON_NODE_HOLDS_ARRAY (first) || json_node_get_value_type (first) == G_TYPE_STRING;
+}
+
+static gboolean
+is_field_wanted (gchar **fields,
+                 const gchar *name)
+{
+  gint i;
+
+  if (!fields)
+    return TRUE;
+
+  for (i = 0; fields[i] != NULL; i++)
+    {
+      if (g_str_equal (fields[i], name))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+/*
+ * A field that appears several times in an entry gets an array of
+ * all its values, in order, as journalctl does.
+ */
+static void
+add_field (JsonObject *entry,
+           gchar **fields,
+           const void *data,
+           size_t length)
+{
+  const gchar *value;
+  JsonArray *array;
+  JsonNode *previous;
+  gchar *name;
+  gsize len;
+
+  value = memchr (data, '=', length);
+  if (!value)
+    return;
+
+  name = g_strndup (data, value - (const gchar *)data);
+  value++;
+  len = length - (value - (const gchar *)data);
+
+  if (!is_field_wanted (fields, name))
+    goto out;
+
+  previous = json_object_get_member (entry, name);
+
+  /* Already filled in by build_entry(), from the monotonic timestamp */
+  if (previous && g_str_equal (name, "_BOOT_ID"))
+    goto out;
+
+  if (!previous)
+    {
+      json_object_set_member (entry, name, build_value (value, len));
+    }
+  else if (is_value_list (previous))
+    {
+      json_array_add_element (json_node_get_array (previous), build_value (value, len));
+    }
+  else
+    {
+      array = json_array_new ();
+      json_array_add_element (array, json_node_copy (previous));
+      json_array_add_element (array, build_value (value, len));
+      json_object_set_array_member (entry, name, array);
+    }
+
+out:
+  g_free (name);
+}
+
+static JsonObject *
+build_entry (CockpitJournal *self)
+{
+  JsonObject *entry;
+  const void *data;
+  sd_id128_t boot_id;
+  gchar id[33];
+  size_t length;
+  gchar *cursor;
+  gchar *string;
+  uint64_t usec;
+
+  entry = json_object_new ();
+
+  if (sd_journal_get_cursor (self->journal, &cursor) >= 0)
+    {
+      json_object_set_string_member (entry, "__CURSOR", cursor);
+      free (cursor);
+    }
+  if (sd_journal_get_realtime_usec (self->journal, &usec) >= 0)
+    {
+      string = g_strdup_printf ("%" G_GUINT64_FORMAT, (guint64)usec);
+      json_object_set_string_member (entry, "__REALTIME_TIMESTAMP", string);
+      g_free (string);
+    }
+  if (sd_journal_get_monotonic_usec (self->journal, &usec, &boot_id) >= 0)
+    {
+      string = g_strdup_printf ("%" G_GUINT64_FORMAT, (guint64)usec);
+      json_object_set_string_member (entry, "__MONOTONIC_TIMESTAMP", string);
+      g_free (string);
+      json_object_set_string_member (entry, "_BOOT_ID", sd_id128_to_string (boot_id, id));
+    }
+
+  /* The sd_journal_get_data() of each field would only find its first value */
+  sd_journal_restart_data (self->journal);
+  while (sd_journal_enumerate_data (self->journal, &data, &length) > 0)
+    add_field (entry, self->fields, data, length);
+
+  return entry;
+}
+
+static void
+send_entries (CockpitJournal *self,
+              JsonArray *array)
+{
+  JsonNode *node;
+  GBytes *bytes;
+  gchar *data;
+  gsize length;
+
+  node = json_node_new (JSON_NODE_ARRAY);
+  json_node_take_array (node, array);
+  data = cockpit_json_write (node, &length);
+  json_node_free (node);
+
+  bytes = g_bytes_new_take (data, length);
+  cockpit_channel_send (COCKPIT_CHANNEL (self), bytes, FALSE);
+  g_bytes_unref (bytes);
+}
+
+static gboolean
+step_entry (CockpitJournal *self,
+            int *r)
+{
+  uint64_t usec;
+
+  if (self->limit > 0 && self->sent >= self->limit)
+    {
+      *r = 0;
+      return FALSE;
+    }
+
+  if (self->positioned)
+    {
+      self->positioned = FALSE;
+      *r = 1;
+    }
+  else if (self->reverse)
+    {
+      *r = sd_journal_previous (self->journal);
+    }
+  else
+    {
+      *r = sd_journal_next (self->journal);
+    }
+
+  if (*r <= 0)
+    return FALSE;
+
+  /* Past the end of the range, the same as the end of the journal */
+  if (sd_journal_get_realtime_usec (self->journal, &usec) >= 0 &&
+      ((!self->reverse && self->until >= 0 && usec > (uint64_t)self->until) ||
+       (self->reverse && self->since >= 0 && usec < (uint64_t)self->since)))
+    {
+      self->follow = FALSE;
+      *r = 0;
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+on_idle_read_entries (gpointer user_data)
+{
+  CockpitJournal *self = COCKPIT_JOURNAL (user_data);
+  JsonArray *array;
+  gint64 count;
+  int r = 0;
+
+  array = json_array_new ();
+
+  for (count = 0; count < self->batch; count++)
+    {
+      if (!step_entry (self, &r))
+        break;
+      json_array_add_object_element (array, build_entry (self));
+      self->sent++;
+    }
+
+  if (json_array_get_length (array) > 0)
+    send_entries (self, array);
+  else
+    json_array_unref (array);
+
+  if (r < 0)
+    {
+      self->idler = 0;
+      journal_failed (self, "read", r);
+      return FALSE;
+    }
+
+  /* More to read, come back after other work */
+  if (r > 0)
+    return TRUE;
+
+  self->idler = 0;
+
+  /* At the end, wait for new entries, if following */
+  if (!self->follow || self->reverse)
+    {
+      if (self->watch)
+        g_source_remove (self->watch);
+      self->watch = 0;
+      cockpit_channel_control (COCKPIT_CHANNEL (self), "done", NULL);
+      cockpit_channel_close (COCKPIT_CHANNEL (self), NULL);
+    }
+
+  return FALSE;
+}
+
+static gboolean
+on_journal_changed (gint fd,
+                    GIOCondition cond,
+                    gpointer user_data)
+{
+  CockpitJournal *self = COCKPIT_JOURNAL (user_data);
+  int r;
+
+  r = sd_journal_process (self->journal);
+  if (r < 0)
+    {
+      self->watch = 0;
+      journal_failed (self, "watch", r);
+      return FALSE;
+    }
+
+  if (r != SD_JOURNAL_NOP && !self->paused && !self->idler)
+    self->idler = g_idle_add (on_idle_read_entries, self);
+
+  return TRUE;
+}
+
+static void
+cockpit_journal_pressure (CockpitChannel *channel,
+                          gboolean pressure)
+{
+  CockpitJournal *self = COCKPIT_JOURNAL (channel);
+
+  /* Stop reading until the peer catches up, the journal keeps our place */
+  if (pressure && !self->paused)
+    {
+      if (self->idler)
+        g_source_remove (self->idler);
+      self->idler = 0;
+      self->paused = TRUE;
+    }
+  else if (!pressure && self->paused)
+    {
+      self->paused = FALSE;
+      if (!self->idler)
+        self->idler = g_idle_add (on_idle_read_entries, self);
+    }
+}
+
+static int
+add_matches (CockpitJournal *self,
+             gchar **matches,
+             const gchar *boot)
+{
+  sd_id128_t boot_id;
+  gchar *match;
+  gchar id[33];
+  int r = 0;
+  gint i;
+
+  /* The same as journalctl: a "+" separates alternatives */
+  for (i = 0; r >= 0 && matches && matches[i] != NULL; i++)
+    {
+      if (g_str_equal (matches[i], "+"))
+        r = sd_journal_add_disjunction (self->journal);
+      else
+        r = sd_journal_add_match (self->journal, matches[i], 0);
+    }
+
+  if (r >= 0 && boot)
+    {
+      if (boot[0] == '\0')
+        r = sd_id128_get_boot (&boot_id);
+      else
+        r = sd_id128_from_string (boot, &boot_id);
+      if (r >= 0)
+        {
+          r = matches && matches[0] ? sd_journal_add_conjunction (self->journal) : 0;
+          if (r >= 0)
+            {
+              match = g_strconcat ("_BOOT_ID=", sd_id128_to_string (boot_id, id), NULL);
+              r = sd_journal_add_match (self->journal, match, 0);
+              g_free (match);
+            }
+        }
+    }
+
+  return r;
+}
+
+static int
+seek_start (CockpitJournal *self,
+            const gchar *cursor,
+            const gchar *after)
+{
+  int r;
+
+  /* Unless it picks entries from the end, count is how many to send */
+  if (!self->follow || self->reverse)
+    self->limit = self->count;
+
+  if (cursor || after)
+    {
+      r = sd_journal_seek_cursor (self->journal, cursor ? cursor : after);
+      if (r < 0)
+        return r;
+
+      /* Land on the entry with the cursor, or the nearest one */
+      r = self->reverse ? sd_journal_previous (self->journal) : sd_journal_next (self->journal);
+      if (r > 0)
+        {
+          if (after && sd_journal_test_cursor (self->journal, after) > 0)
+            self->positioned = FALSE;
+          else
+            self->positioned = TRUE;
+        }
+      return r < 0 ? r : 0;
+    }
+
+  if (self->reverse && self->until >= 0)
+    return sd_journal_seek_realtime_usec (self->journal, self->until);
+  if (self->reverse)
+    return sd_journal_seek_tail (self->journal);
+
+  if (self->count > 0 && self->since < 0)
+    {
+      self->limit = 0;
+      r = sd_journal_seek_tail (self->journal);
+      if (r >= 0)
+        r = sd_journal_previous_skip (self->journal, self->count);
+      if (r > 0)
+        self->positioned = TRUE;
+      return r < 0 ? r : 0;
+    }
+
+  if (self->since >= 0)
+    return sd_journal_seek_realtime_usec (self->journal, self->since);
+
+  return sd_journal_seek_head (self->journal);
+}
+
+static void
+cockpit_journal_prepare (CockpitChannel *channel)
+{
+  CockpitJournal *self = COCKPIT_JOURNAL (channel);
+  const gchar *problem = "protocol-error";
+  const gchar *directory;
+  const gchar *cursor;
+  const gchar *after;
+  const gchar *boot;
+  gchar **matches = NULL;
+  gchar **fields = NULL;
+  JsonObject *options;
+  int fd;
+  int r;
+  gint i;
+
+  COCKPIT_CHANNEL_CLASS (cockpit_journal_parent_class)->prepare (channel);
+
+  options = cockpit_channel_get_options (channel);
+  if (!cockpit_json_get_strv (options, "match", NULL, &matches))
+    {
+      g_warning ("invalid \"match\" option for journal1 channel");
+      goto out;
+    }
+  if (!cockpit_json_get_strv (options, "fields", NULL, &fields))
+    {
+      g_warning ("invalid \"fields\" option for journal1 channel");
+      goto out;
+    }
+  if (!cockpit_json_get_string (options, "directory", NULL, &directory))
+    {
+      g_warning ("invalid \"directory\" option for journal1 channel");
+      goto out;
+    }
+  if (!cockpit_json_get_string (options, "boot", NULL, &boot))
+    {
+      g_warning ("invalid \"boot\" option for journal1 channel");
+      goto out;
+    }
+  if (!cockpit_json_get_string (options, "cursor", NULL, &cursor) ||
+      !cockpit_json_get_string (options, "after", NULL, &after) ||
+      (cursor && after))
+    {
+      g_warning ("invalid \"cursor\" or \"after\" option for journal1 channel");
+      goto out;
+    }
+  if (!cockpit_json_get_int (options, "since", -1, &self->since) ||
+      !cockpit_json_get_int (options, "until", -1, &self->until))
+    {
+      g_warning ("invalid \"since\" or \"until\" option for journal1 channel");
+      goto out;
+    }
+  if (!cockpit_json_get_int (options, "count", 0, &self->count) || self->count < 0)
+    {
+      g_warning ("invalid \"count\" option for journal1 channel");
+      goto out;
+    }
+  if (!cockpit_json_get_int (options, "batch", JOURNAL_BATCH, &self->batch) || self->batch <= 0)
+    {
+      g_warning ("invalid \"batch\" option for journal1 channel");
+      goto out;
+    }
+  if (!cockpit_json_get_bool (options, "reverse", FALSE, &self->reverse) ||
+      !cockpit_json_get_bool (options, "follow", TRUE, &self->follow))
+    {
+      g_warning ("invalid \"reverse\" or \"follow\" option for journal1 channel");
+      goto out;
+    }
+
+  for (i = 0; fields && fields[i] != NULL; i++)
+    {
+      if (fields[i][0] == '\0' || strchr (fields[i], '='))
+        {
+          g_warning ("invalid field in \"fields\" option for journal1 channel: %s", fields[i]);
+          goto out;
+        }
+    }
+  self->fields = g_strdupv (fields);
+
+  if (directory)
+    r = sd_journal_open_directory (&self->journal, directory, 0);
+  else
+    r = sd_journal_open (&self->journal, SD_JOURNAL_LOCAL_ONLY);
+  if (r < 0)
+    {
+      self->journal = NULL;
+      options = cockpit_channel_close_options (channel);
+      json_object_set_string_member (options, "message", g_strerror (-r));
+      if (r == -ENOENT || r == -ENOTDIR)
+        problem = "not-found";
+      else if (r == -EACCES || r == -EPERM)
+        problem = "access-denied";
+      else
+        {
+          g_message ("couldn't open journal: %s", g_strerror (-r));
+          problem = "internal-error";
+        }
+      goto out;
+    }
+
+  r = add_matches (self, matches, boot);
+  if (r < 0)
+    {
+      g_warning ("invalid \"match\" or \"boot\" option for journal1 channel: %s", g_strerror (-r));
+      goto out;
+    }
+
+  /* Get the fd before reading, so no changes are missed while doing so */
+  if (self->follow && !self->reverse)
+    {
+      fd = sd_journal_get_fd (self->journal);
+      if (fd < 0)
+        {
+          journal_failed (self, "watch", fd);
+          problem = NULL;
+          goto out;
+        }
+      self->watch = cockpit_unix_fd_add (fd, G_IO_IN, on_journal_changed, self);
+    }
+
+  r = seek_start (self, cursor, after);
+  if (r < 0)
+    {
+      g_warning ("couldn't seek in journal for journal1 channel: %s", g_strerror (-r));
+      goto out;
+    }
+
+  cockpit_channel_ready (channel);
+  self->idler = g_idle_add (on_idle_read_entries, self);
+  problem = NULL;
+
+out:
+  g_free (matches);
+  g_free (fields);
+  if (problem)
+    cockpit_channel_close (channel, problem);
+}
+
+static void
+cockpit_journal_dispose (GObject *object)
+{
+  CockpitJournal *self = COCKPIT_JOURNAL (object);
+
+  if (self->idler)
+    g_source_remove (self->idler);
+  self->idler = 0;
+  if (self->watch)
+    g_source_remove (self->watch);
+  self->watch = 0;
+
+  G_OBJECT_CLASS (cockpit_journal_parent_class)->dispose (object);
+}
+
+static void
+cockpit_journal_finalize (GObject *object)
+{
+  CockpitJournal *self = COCKPIT_JOURNAL (object);
+
+  if (self->journal)
+    sd_journal_close (self->journal);
+  g_strfreev (self->fields);
+
+  G_OBJECT_CLASS (cockpit_journal_parent_class)->finalize (object);
+}
+
+static void
+cockpit_journal_class_init (CockpitJournalClass *klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+  CockpitChannelClass *channel_class = COCKPIT_CHANNEL_CLASS (klass);
+
+  gobject_class->dispose = cockpit_journal_dispose;
+  gobject_class->finalize = cockpit_journal_finalize;
+
+  channel_class->prepare = cockpit_journal_prepare;
+  channel_class->recv = cockpit_journal_recv;
+  channel_class->pressure = cockpit_journal_pressure;
+}
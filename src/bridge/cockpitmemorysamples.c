@@ -20,19 +20,16 @@
 #include "config.h"
 
 #include "cockpitmemorysamples.h"
-
-#include <stdio.h>
-
-/* TODO: this should be optimized so we don't allocate memory and call open()/close() all the time */
+#include "cockpitprocreader.h"
 
 void
 cockpit_memory_samples (CockpitSamples *samples)
 {
-  gchar *contents = NULL;
-  GError *error = NULL;
-  gchar **lines = NULL;
-  gsize len;
-  guint n;
+  static CockpitProcReader reader = COCKPIT_PROC_READER_INIT ("/proc/meminfo");
+  gchar *contents;
+  gchar *line;
+  gchar *name;
+  guint64 value;
 
   guint64 free_kb = 0;
   guint64 total_kb = 0;
@@ -41,39 +38,34 @@ cockpit_memory_samples (CockpitSamples *samples)
   guint64 swap_total_kb = 0;
   guint64 swap_free_kb = 0;
 
-  if (!g_file_get_contents ("/proc/meminfo", &contents, &len, &error))
-    {
-      g_message ("error loading contents /proc/meminfo: %s", error->message);
-      g_error_free (error);
-      goto out;
-    }
+  contents = cockpit_proc_reader_read (&reader, NULL);
+  if (!contents)
+    return;
 
-  /* see 'man proc' for the format of /proc/stat */
+  /* see 'man proc' for the format of /proc/meminfo */
 
-  lines = g_strsplit (contents, "\n", -1);
-  for (n = 0; lines != NULL && lines[n] != NULL; n++)
+  while ((line = cockpit_proc_next_line (&contents)) != NULL)
     {
-      const gchar *line = lines[n];
-      if (g_str_has_prefix (line, "MemTotal:"))
-        g_warn_if_fail (sscanf (line + sizeof ("MemTotal:") - 1, "%" G_GUINT64_FORMAT, &total_kb) == 1);
-      else if (g_str_has_prefix (line, "MemFree:"))
-        g_warn_if_fail (sscanf (line + sizeof ("MemFree:") - 1, "%" G_GUINT64_FORMAT, &free_kb) == 1);
-      else if (g_str_has_prefix (line, "SwapTotal:"))
-        g_warn_if_fail (sscanf (line + sizeof ("SwapTotal:") - 1, "%" G_GUINT64_FORMAT, &swap_total_kb) == 1);
-      else if (g_str_has_prefix (line, "SwapFree:"))
-        g_warn_if_fail (sscanf (line + sizeof ("SwapFree:") - 1, "%" G_GUINT64_FORMAT, &swap_free_kb) == 1);
-      else if (g_str_has_prefix (line, "Buffers:"))
-        g_warn_if_fail (sscanf (line + sizeof ("Buffers:") - 1, "%" G_GUINT64_FORMAT, &buffers_kb) == 1);
-      else if (g_str_has_prefix (line, "Cached:"))
-        g_warn_if_fail (sscanf (line + sizeof ("Cached:") - 1, "%" G_GUINT64_FORMAT, &cached_kb) == 1);
+      name = cockpit_proc_next_word (&line);
+      if (!name || !cockpit_proc_next_u64 (&line, &value))
+        continue;
+
+      if (g_str_equal (name, "MemTotal:"))
+        total_kb = value;
+      else if (g_str_equal (name, "MemFree:"))
+        free_kb = value;
+      else if (g_str_equal (name, "SwapTotal:"))
+        swap_total_kb = value;
+      else if (g_str_equal (name, "SwapFree:"))
+        swap_free_kb = value;
+      else if (g_str_equal (name, "Buffers:"))
+        buffers_kb = value;
+      else if (g_str_equal (name, "Cached:"))
+        cached_kb = value;
     }
 
   cockpit_samples_sample (samples, "memory.free", NULL, free_kb * 1024);
   cockpit_samples_sample (samples, "memory.used", NULL, (total_kb - free_kb) * 1024);
   cockpit_samples_sample (samples, "memory.cached", NULL, (buffers_kb + cached_kb) * 1024);
   cockpit_samples_sample (samples, "memory.swap-used", NULL, (swap_total_kb - swap_free_kb) * 1024);
-
-out:
-  g_strfreev (lines);
-  g_free (contents);
 }
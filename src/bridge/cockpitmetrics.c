@@ -22,8 +22,10 @@
 #include "cockpitmetrics.h"
 
 #include "common/cockpitjson.h"
+#include "common/cockpitstats.h"
 
 #include <math.h>
+#include <string.h>
 
 enum {
   DERIVE_NONE = 0,
@@ -38,13 +40,26 @@ typedef struct {
   gint n_next_instances;
 } MetricInfo;
 
+/* Conditions from the "metrics" option for "triggered" delivery */
+typedef struct {
+  gboolean has_threshold;
+  double threshold;
+  double change;
+} Trigger;
+
 struct _CockpitMetricsPrivate {
   gboolean interpolate;
   gboolean compress;
+  gboolean binary;
+
+  gboolean triggered;
+  gint n_triggers;
+  Trigger *triggers;
+  gint64 heartbeat;
 
   guint timeout;
-  gint64 next;
   gint64 interval;
+  gboolean paused;
 
   gint64 meta_interval;
   gboolean meta_reset;
@@ -60,7 +75,15 @@ struct _CockpitMetricsPrivate {
   gboolean derived_valid;
   double **derived;
 
-  JsonArray *message;
+  /* What the last frame sent had, when only some are sent */
+  gboolean reported_valid;
+  gboolean skipped;
+  gint64 reported_timestamp;
+  double *reported;
+  GString *frame;
+
+  GString *message;
+  gsize message_size;
 };
 
 G_DEFINE_ABSTRACT_TYPE (CockpitMetrics, cockpit_metrics, COCKPIT_TYPE_CHANNEL);
@@ -83,6 +106,112 @@ cockpit_metrics_recv (CockpitChannel *channel,
   cockpit_channel_close (channel, "protocol-error");
 }
 
+static gboolean
+parse_triggers (CockpitMetrics *self,
+                JsonObject *options)
+{
+  JsonArray *metrics;
+  JsonObject *metric;
+  Trigger *trigger;
+  guint length;
+
+  if (!cockpit_json_get_int (options, "heartbeat", 0, &self->priv->heartbeat) ||
+      self->priv->heartbeat < 0)
+    {
+      g_warning ("invalid \"heartbeat\" option for metrics channel");
+      return FALSE;
+    }
+
+  if (!cockpit_json_get_array (options, "metrics", NULL, &metrics))
+    metrics = NULL;
+
+  length = metrics ? json_array_get_length (metrics) : 0;
+  self->priv->triggers = g_new0 (Trigger, length);
+  self->priv->n_triggers = length;
+
+  for (guint i = 0; i < length; i++)
+    {
+      trigger = self->priv->triggers + i;
+      metric = json_node_get_object (json_array_get_element (metrics, i));
+      if (!metric)
+        continue;
+
+      if (!cockpit_json_get_double (metric, "threshold", NAN, &trigger->threshold))
+        {
+          g_warning ("invalid \"threshold\" in metrics option");
+          return FALSE;
+        }
+      trigger->has_threshold = !isnan (trigger->threshold);
+
+      if (!cockpit_json_get_double (metric, "change", 0, &trigger->change) ||
+          trigger->change < 0)
+        {
+          g_warning ("invalid \"change\" in metrics option");
+          return FALSE;
+        }
+    }
+
+  self->priv->triggered = TRUE;
+  return TRUE;
+}
+
+static void
+cockpit_metrics_prepare (CockpitChannel *channel)
+{
+  CockpitMetrics *self = COCKPIT_METRICS (channel);
+  const gchar *format;
+  const gchar *binary;
+  const gchar *deliver;
+  JsonObject *options;
+
+  COCKPIT_CHANNEL_CLASS (cockpit_metrics_parent_class)->prepare (channel);
+
+  options = cockpit_channel_get_options (channel);
+  if (!cockpit_json_get_string (options, "format", "json", &format))
+    {
+      g_warning ("invalid \"format\" option for metrics channel");
+      cockpit_channel_close (channel, "protocol-error");
+      return;
+    }
+  else if (g_str_equal (format, "binary"))
+    {
+      /* Data messages are not valid UTF-8 */
+      if (!cockpit_json_get_string (options, "binary", NULL, &binary) || !binary)
+        {
+          g_warning ("the \"binary\" metrics format needs a binary channel");
+          cockpit_channel_close (channel, "protocol-error");
+          return;
+        }
+      self->priv->binary = TRUE;
+    }
+  else if (!g_str_equal (format, "json"))
+    {
+      g_warning ("unsupported \"format\" for metrics channel: %s", format);
+      cockpit_channel_close (channel, "protocol-error");
+      return;
+    }
+
+  if (!cockpit_json_get_string (options, "deliver", "always", &deliver))
+    {
+      g_warning ("invalid \"deliver\" option for metrics channel");
+      cockpit_channel_close (channel, "protocol-error");
+    }
+  else if (g_str_equal (deliver, "triggered"))
+    {
+      if (!parse_triggers (self, options))
+        cockpit_channel_close (channel, "protocol-error");
+    }
+  else if (!g_str_equal (deliver, "always"))
+    {
+      g_warning ("unsupported \"deliver\" for metrics channel: %s", deliver);
+      cockpit_channel_close (channel, "protocol-error");
+    }
+}
+
+static gboolean cockpit_metrics_control (CockpitChannel *channel,
+                                         const gchar *command,
+                                         JsonObject *options);
+
 static void
 cockpit_metrics_close (CockpitChannel *channel,
                        const gchar *problem)
@@ -91,7 +220,7 @@ cockpit_metrics_close (CockpitChannel *channel,
 
   if (self->priv->timeout)
     {
-      g_source_remove (self->priv->timeout);
+      cockpit_metronome_remove (self->priv->timeout);
       self->priv->timeout = 0;
     }
 
@@ -105,7 +234,7 @@ cockpit_metrics_dispose (GObject *object)
 
   if (self->priv->timeout)
     {
-      g_source_remove (self->priv->timeout);
+      cockpit_metronome_remove (self->priv->timeout);
       self->priv->timeout = 0;
     }
 
@@ -145,6 +274,25 @@ cockpit_metrics_dispose (GObject *object)
   g_free (self->priv->metric_info);
   self->priv->metric_info = NULL;
 
+  g_free (self->priv->triggers);
+  self->priv->triggers = NULL;
+  self->priv->n_triggers = 0;
+
+  g_free (self->priv->reported);
+  self->priv->reported = NULL;
+
+  if (self->priv->frame)
+    {
+      g_string_free (self->priv->frame, TRUE);
+      self->priv->frame = NULL;
+    }
+
+  if (self->priv->message)
+    {
+      g_string_free (self->priv->message, TRUE);
+      self->priv->message = NULL;
+    }
+
   G_OBJECT_CLASS (cockpit_metrics_parent_class)->dispose (object);
 }
 
@@ -156,47 +304,220 @@ cockpit_metrics_class_init (CockpitMetricsClass *klass)
 
   object_class->dispose = cockpit_metrics_dispose;
 
+  channel_class->prepare = cockpit_metrics_prepare;
   channel_class->recv = cockpit_metrics_recv;
+  channel_class->control = cockpit_metrics_control;
   channel_class->close = cockpit_metrics_close;
 
   g_type_class_add_private (klass, sizeof (CockpitMetricsPrivate));
 }
 
-static gboolean
-on_timeout_tick (gpointer data)
+/*
+ * All metronomes with the same interval share one timeout, and tick
+ * on multiples of that interval since the epoch. So channels of equal
+ * intervals wake the bridge once between them, and those of harmonic
+ * intervals, like 1000 and 5000 milliseconds, wake it at the same
+ * moments.
+ *
+ * Long intervals don't need millisecond precision, those use
+ * g_timeout_add_seconds() to also wake up together with the other
+ * timeouts in the bridge.
+ */
+
+#define METRONOME_COARSE (60 * 1000)
+
+typedef struct {
+  guint id;
+  CockpitMetronomeFunc func;
+  gpointer user_data;
+} Listener;
+
+typedef struct {
+  gint64 interval;
+  gint64 next;
+  guint timeout;
+  GArray *listeners;
+  gboolean dispatching;
+} Beat;
+
+/* interval -> Beat, and listener id -> Beat */
+static GHashTable *beats;
+static GHashTable *beat_listeners;
+static guint beat_listener_ids;
+
+static gboolean on_beat (gpointer user_data);
+
+static void
+beat_schedule (Beat *beat)
 {
-  CockpitMetrics *self = data;
-  CockpitMetricsClass *klass;
-  gint64 next_interval;
+  gint64 now = g_get_real_time () / 1000;
+  gint64 delay;
 
-  if (self->priv->timeout > 0)
+  /* Fell behind, or the clock changed, so find the next boundary */
+  delay = beat->next - now;
+  if (delay <= 0 || delay > beat->interval)
     {
-      g_source_remove (self->priv->timeout);
-      self->priv->timeout = 0;
+      beat->next = (now / beat->interval + 1) * beat->interval;
+      delay = beat->next - now;
     }
 
-  klass = COCKPIT_METRICS_GET_CLASS (self);
-  if (klass->tick)
-    (klass->tick) (self, self->priv->next);
+  if (beat->interval >= METRONOME_COARSE && delay >= 1000)
+    beat->timeout = g_timeout_add_seconds (delay / 1000, on_beat, beat);
+  else
+    beat->timeout = g_timeout_add (delay, on_beat, beat);
+}
 
-  self->priv->next += self->priv->interval;
-  next_interval = self->priv->next - g_get_monotonic_time() / 1000;
-  if (next_interval < 0)
-    next_interval = 0;
+static void
+beat_free (Beat *beat)
+{
+  if (beat->timeout)
+    g_source_remove (beat->timeout);
+  g_array_free (beat->listeners, TRUE);
+  g_free (beat);
+}
 
-  if (next_interval <= G_MAXUINT)
-    self->priv->timeout = g_timeout_add (next_interval, on_timeout_tick, self);
-  else if (next_interval / 1000 <= G_MAXUINT)
-    self->priv->timeout = g_timeout_add_seconds (next_interval / 1000, on_timeout_tick, self);
+static gboolean
+on_beat (gpointer user_data)
+{
+  Beat *beat = user_data;
+  Listener *listener;
+  gint64 timestamp;
+  guint i, len;
+
+  beat->timeout = 0;
+  timestamp = beat->next;
+
+  /* Listeners added while dispatching wait for the next tick */
+  beat->dispatching = TRUE;
+  len = beat->listeners->len;
+  for (i = 0; i < len; i++)
+    {
+      listener = &g_array_index (beat->listeners, Listener, i);
+      if (listener->func)
+        (listener->func) (timestamp, listener->user_data);
+    }
+  beat->dispatching = FALSE;
+
+  /* And those removed meanwhile are only cleared out now */
+  for (i = 0; i < beat->listeners->len; )
+    {
+      if (g_array_index (beat->listeners, Listener, i).func)
+        i++;
+      else
+        g_array_remove_index (beat->listeners, i);
+    }
+
+  if (beat->listeners->len == 0)
+    {
+      g_hash_table_remove (beats, &beat->interval);
+    }
   else
     {
-      g_warning ("invalid metric timeout tick offset");
-      cockpit_channel_close (COCKPIT_CHANNEL (self), "internal-error");
+      beat->next += beat->interval;
+      beat_schedule (beat);
     }
 
   return FALSE;
 }
 
+/**
+ * cockpit_metronome_add:
+ * @interval: the interval in milliseconds
+ * @func: called at each tick
+ * @user_data: passed to @func
+ *
+ * Call @func every @interval milliseconds, at the same moments as all
+ * other metronomes of that interval. @func gets the wall clock time
+ * of the tick in milliseconds, a multiple of @interval. The first tick
+ * is at the next such multiple, not right away.
+ *
+ * Returns: an id for cockpit_metronome_remove()
+ */
+guint
+cockpit_metronome_add (gint64 interval,
+                       CockpitMetronomeFunc func,
+                       gpointer user_data)
+{
+  Listener listener = { 0, func, user_data };
+  Beat *beat;
+
+  g_return_val_if_fail (interval > 0, 0);
+  g_return_val_if_fail (func != NULL, 0);
+
+  if (!beats)
+    {
+      beats = g_hash_table_new_full (g_int64_hash, g_int64_equal, NULL, (GDestroyNotify)beat_free);
+      beat_listeners = g_hash_table_new (g_direct_hash, g_direct_equal);
+    }
+
+  beat = g_hash_table_lookup (beats, &interval);
+  if (!beat)
+    {
+      beat = g_new0 (Beat, 1);
+      beat->interval = interval;
+      beat->listeners = g_array_new (FALSE, FALSE, sizeof (Listener));
+      g_hash_table_insert (beats, &beat->interval, beat);
+      beat_schedule (beat);
+    }
+
+  /* Zero is never an id */
+  do
+    listener.id = ++beat_listener_ids;
+  while (listener.id == 0 || g_hash_table_lookup (beat_listeners, GUINT_TO_POINTER (listener.id)));
+
+  g_array_append_val (beat->listeners, listener);
+  g_hash_table_insert (beat_listeners, GUINT_TO_POINTER (listener.id), beat);
+  return listener.id;
+}
+
+/**
+ * cockpit_metronome_remove:
+ * @id: as returned by cockpit_metronome_add()
+ *
+ * Stop calling the function of that metronome. This can be done from
+ * within the function itself.
+ */
+void
+cockpit_metronome_remove (guint id)
+{
+  Listener *listener;
+  Beat *beat;
+  guint i;
+
+  beat = beat_listeners ? g_hash_table_lookup (beat_listeners, GUINT_TO_POINTER (id)) : NULL;
+  g_return_if_fail (beat != NULL);
+
+  g_hash_table_remove (beat_listeners, GUINT_TO_POINTER (id));
+
+  for (i = 0; i < beat->listeners->len; i++)
+    {
+      listener = &g_array_index (beat->listeners, Listener, i);
+      if (listener->id != id)
+        continue;
+
+      if (beat->dispatching)
+        listener->func = NULL;
+      else
+        g_array_remove_index (beat->listeners, i);
+      break;
+    }
+
+  if (beat->listeners->len == 0)
+    g_hash_table_remove (beats, &beat->interval);
+}
+
+static void
+on_metronome_tick (gint64 timestamp,
+                   gpointer user_data)
+{
+  CockpitMetrics *self = user_data;
+  CockpitMetricsClass *klass;
+
+  klass = COCKPIT_METRICS_GET_CLASS (self);
+  if (klass->tick)
+    (klass->tick) (self, g_get_monotonic_time () / 1000);
+}
+
 void
 cockpit_metrics_metronome (CockpitMetrics *self,
                            gint64 interval)
@@ -204,9 +525,96 @@ cockpit_metrics_metronome (CockpitMetrics *self,
   g_return_if_fail (self->priv->timeout == 0);
   g_return_if_fail (interval > 0);
 
-  self->priv->next = g_get_monotonic_time() / 1000;
+  /* A first sample right away, then in step with the others */
   self->priv->interval = interval;
-  on_timeout_tick (self);
+  self->priv->timeout = cockpit_metronome_add (interval, on_metronome_tick, self);
+  on_metronome_tick (0, self);
+}
+
+/*
+ * After a pause the samples don't follow on from the last 'meta'
+ * message, so send it again, as of now, and don't derive from or
+ * compress against what was sent before.
+ */
+static JsonObject *
+copy_meta (CockpitMetrics *self,
+           gint64 timestamp,
+           gint64 now)
+{
+  JsonObject *meta;
+  GList *members, *l;
+
+  meta = json_object_new ();
+  members = json_object_get_members (self->priv->next_meta);
+  for (l = members; l != NULL; l = g_list_next (l))
+    {
+      json_object_set_member (meta, l->data,
+                              json_node_copy (json_object_get_member (self->priv->next_meta, l->data)));
+    }
+  g_list_free (members);
+
+  json_object_set_int_member (meta, "timestamp", timestamp);
+  json_object_set_int_member (meta, "now", now);
+  return meta;
+}
+
+static void
+resend_meta (CockpitMetrics *self)
+{
+  JsonObject *meta;
+  gint64 now;
+
+  if (!self->priv->next_meta)
+    return;
+
+  now = g_get_real_time () / 1000;
+  meta = copy_meta (self, now, now);
+  cockpit_metrics_send_meta (self, meta, TRUE);
+  json_object_unref (meta);
+}
+
+static gboolean
+cockpit_metrics_control (CockpitChannel *channel,
+                         const gchar *command,
+                         JsonObject *options)
+{
+  CockpitMetrics *self = COCKPIT_METRICS (channel);
+  CockpitMetricsClass *klass = COCKPIT_METRICS_GET_CLASS (self);
+
+  if (g_str_equal (command, "pause"))
+    {
+      if (!self->priv->paused)
+        {
+          self->priv->paused = TRUE;
+          cockpit_metrics_flush_data (self);
+          if (self->priv->timeout)
+            {
+              cockpit_metronome_remove (self->priv->timeout);
+              self->priv->timeout = 0;
+            }
+          if (klass->pause)
+            (klass->pause) (self, TRUE);
+        }
+      return TRUE;
+    }
+  else if (g_str_equal (command, "resume"))
+    {
+      if (self->priv->paused)
+        {
+          self->priv->paused = FALSE;
+          if (klass->pause)
+            (klass->pause) (self, FALSE);
+          if (self->priv->interval > 0)
+            {
+              resend_meta (self);
+              self->priv->timeout = cockpit_metronome_add (self->priv->interval, on_metronome_tick, self);
+              on_metronome_tick (0, self);
+            }
+        }
+      return TRUE;
+    }
+
+  return FALSE;
 }
 
 static void
@@ -232,6 +640,13 @@ realloc_derived_buffer (CockpitMetrics *self)
   for (int i = 1; i < self->priv->n_metrics; i++)
       self->priv->derived[i] = self->priv->derived[i-1] + self->priv->metric_info[i-1].n_next_instances;
   self->priv->derived_valid = FALSE;
+
+  if (self->priv->triggered)
+    {
+      g_free (self->priv->reported);
+      self->priv->reported = g_new (double, total_next_instances);
+      self->priv->reported_valid = FALSE;
+    }
 }
 
 static gboolean
@@ -359,56 +774,57 @@ cockpit_metrics_send_meta (CockpitMetrics *self,
       return;
     }
 
+  self->priv->skipped = FALSE;
   send_object (self, meta);
 }
 
+/*
+ * The data messages are written out directly as JSON, rather than
+ * building up JsonNode trees for every sample. This writes the
+ * separator and any null padding for an element at @index of an
+ * array that so far has @count elements.
+ */
 static void
-send_array (CockpitMetrics *self,
-            JsonArray *array)
+append_element_at (GString *out,
+                   gint *count,
+                   gint index)
 {
-  CockpitChannel *channel = (CockpitChannel *)self;
-  GBytes *bytes;
-  JsonNode *node;
-  gsize length;
-  gchar *ret;
+  g_assert (index >= *count);
 
-  node = json_node_new (JSON_NODE_ARRAY);
-  json_node_set_array (node, array);
-  ret = cockpit_json_write (node, &length);
-  json_node_free (node);
+  while (*count < index)
+    {
+      if (*count > 0)
+        g_string_append_c (out, ',');
+      g_string_append (out, "null");
+      (*count)++;
+    }
 
-  bytes = g_bytes_new_take (ret, length);
-  cockpit_channel_send (channel, bytes, TRUE);
-  g_bytes_unref (bytes);
+  if (*count > 0)
+    g_string_append_c (out, ',');
+  (*count)++;
 }
 
-static JsonArray *
-push_array_at (JsonArray *array,
-               guint index,
-               JsonNode *node)
+static void
+append_value (GString *out,
+              double val)
 {
-  if (array == NULL)
-    array = json_array_new ();
-
-  g_assert (index >= json_array_get_length (array));
-
-  while (index > json_array_get_length (array))
-    json_array_add_null_element (array);
+  gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
 
-  if (node)
-    json_array_add_element (array, node);
-
-  return array;
+  /* Same as cockpit_json_write() would produce */
+  if (isnan (val))
+    g_string_append (out, "false");
+  else if (isinf (val))
+    g_string_append (out, "null");
+  else
+    g_string_append (out, g_ascii_dtostr (buf, sizeof (buf), val));
 }
 
-static JsonArray *
-compute_and_maybe_push_value (CockpitMetrics *self,
-                              double interpol_r,
-                              int metric,
-                              int next_instance,
-                              int last_instance,
-                              JsonArray *array,
-                              int index)
+static double
+compute_value (CockpitMetrics *self,
+               double interpol_r,
+               int metric,
+               int next_instance,
+               int last_instance)
 {
   double val = self->priv->next_data[metric][next_instance];
 
@@ -440,34 +856,45 @@ compute_and_maybe_push_value (CockpitMetrics *self,
         val = NAN;
     }
 
+  return val;
+}
+
+static void
+compute_and_maybe_push_value (CockpitMetrics *self,
+                              double interpol_r,
+                              int metric,
+                              int next_instance,
+                              int last_instance,
+                              GString *out,
+                              gint *count,
+                              int index)
+{
+  double val = compute_value (self, interpol_r, metric, next_instance, last_instance);
+
   if (self->priv->compress == FALSE
       || next_instance != last_instance
       || !self->priv->derived_valid
       || val != self->priv->derived[metric][next_instance])
     {
       self->priv->derived[metric][next_instance] = val;
-
-      JsonNode *node = json_node_new (JSON_NODE_VALUE);
-      if (!isnan (val))
-        json_node_set_double (node, val);
-      else
-        json_node_set_boolean (node, FALSE);
-      array = push_array_at (array, index, node);
+      append_element_at (out, count, index);
+      append_value (out, val);
     }
-
-  return array;
 }
 
-static int
-find_last_instance (CockpitMetrics *self,
-                    int metric,
-                    int instance)
+/*
+ * When the meta changes, the instances of a metric may have been
+ * added, removed or reordered. Map the index of each next instance to
+ * the index of the last instance with the same name, or -1.
+ */
+static gint *
+build_instance_map (CockpitMetrics *self,
+                    int metric)
 {
-  if (self->priv->meta_reset)
-    return -1;
-
-  if (self->priv->last_meta == self->priv->next_meta)
-    return instance;
+  GHashTable *last_index;
+  const gchar *name;
+  gpointer value;
+  gint *map;
 
   JsonArray *last_metrics = json_object_get_array_member (self->priv->last_meta, "metrics");
   JsonArray *next_metrics = json_object_get_array_member (self->priv->next_meta, "metrics");
@@ -475,56 +902,159 @@ find_last_instance (CockpitMetrics *self,
       || next_metrics == NULL
       || json_array_get_length (last_metrics) <= metric
       || json_array_get_length (next_metrics) <= metric)
-    return -1;
+    return NULL;
 
   JsonObject *last_metric = json_array_get_object_element (last_metrics, metric);
   JsonObject *next_metric = json_array_get_object_element (next_metrics, metric);
   if (last_metric == NULL
       || next_metric == NULL)
-    return -1;
+    return NULL;
 
   JsonArray *last_instances = json_object_get_array_member (last_metric, "instances");
   JsonArray *next_instances = json_object_get_array_member (next_metric, "instances");
   if (last_instances == NULL
-      || next_instances == NULL
-      || json_array_get_length (next_instances) <= instance)
-    return -1;
+      || next_instances == NULL)
+    return NULL;
 
   int n_last_instances = json_array_get_length (last_instances);
-  const gchar *next_instance = json_array_get_string_element (next_instances, instance);
+  int n_next_instances = json_array_get_length (next_instances);
+
+  last_index = g_hash_table_new (g_str_hash, g_str_equal);
   for (int i = 0; i < n_last_instances; i++)
     {
-      if (g_strcmp0 (json_array_get_string_element (last_instances, i), next_instance) == 0)
-        return i;
+      /* The first of any duplicates wins */
+      name = json_array_get_string_element (last_instances, i);
+      if (name && !g_hash_table_lookup_extended (last_index, name, NULL, NULL))
+        g_hash_table_insert (last_index, (gpointer)name, GINT_TO_POINTER (i));
+    }
+
+  map = g_new (gint, n_next_instances);
+  for (int i = 0; i < n_next_instances; i++)
+    {
+      name = json_array_get_string_element (next_instances, i);
+      if (name && g_hash_table_lookup_extended (last_index, name, NULL, &value))
+        map[i] = GPOINTER_TO_INT (value);
+      else
+        map[i] = -1;
     }
 
-  return -1;
+  g_hash_table_destroy (last_index);
+  return map;
 }
 
-static JsonArray *
-build_json_data (CockpitMetrics *self, double interpol_r)
+static int
+find_last_instance (CockpitMetrics *self,
+                    int instance,
+                    const gint *map,
+                    int n_map)
 {
-  JsonArray *output = NULL;
-  JsonNode *node;
+  if (self->priv->meta_reset)
+    return -1;
+
+  if (self->priv->last_meta == self->priv->next_meta)
+    return instance;
+
+  if (map == NULL || instance >= n_map)
+    return -1;
+
+  return map[instance];
+}
+
+static void
+build_json_data (CockpitMetrics *self,
+                 double interpol_r,
+                 GString *out)
+{
+  gboolean remap;
+  gint count = 0;
+  gint instances;
+  gint *map;
+  gint n;
+
+  /* Only need to match up instances by name when the meta changed */
+  remap = !self->priv->meta_reset && self->priv->last_meta != self->priv->next_meta;
+
+  g_string_append_c (out, '[');
 
   for (int i = 0; i < self->priv->n_metrics; i++)
     {
       if (self->priv->metric_info[i].has_instances)
         {
-          JsonArray *res = NULL;
-          for (int j = 0; j < self->priv->metric_info[i].n_next_instances; j++)
-            res = compute_and_maybe_push_value (self, interpol_r, i, j, find_last_instance (self, i, j), res, j);
-          node = json_node_new (JSON_NODE_ARRAY);
-          json_node_take_array (node, res ? res : json_array_new ());
-          output = push_array_at (output, i, node);
+          map = remap ? build_instance_map (self, i) : NULL;
+          n = self->priv->metric_info[i].n_next_instances;
+
+          append_element_at (out, &count, i);
+          g_string_append_c (out, '[');
+          instances = 0;
+          for (int j = 0; j < n; j++)
+            {
+              compute_and_maybe_push_value (self, interpol_r, i, j, find_last_instance (self, j, map, n),
+                                            out, &instances, j);
+            }
+          g_string_append_c (out, ']');
+
+          g_free (map);
         }
       else
-        output = compute_and_maybe_push_value (self, interpol_r, i, 0, (self->priv->meta_reset? -1 : 0), output, i);
+        {
+          compute_and_maybe_push_value (self, interpol_r, i, 0, (self->priv->meta_reset? -1 : 0),
+                                        out, &count, i);
+        }
     }
 
-  if (output == NULL)
-    output = json_array_new ();
-  return output;
+  g_string_append_c (out, ']');
+}
+
+/*
+ * The "binary" format has no interframe compression, each point in
+ * time has a little endian float32 for every column described by the
+ * meta. NaN is where the JSON would have false.
+ */
+static void
+append_float (GString *out,
+              double val)
+{
+  gfloat f = val;
+  guint32 bits;
+
+  memcpy (&bits, &f, sizeof (bits));
+  bits = GUINT32_TO_LE (bits);
+  g_string_append_len (out, (const gchar *)&bits, sizeof (bits));
+}
+
+static void
+build_binary_data (CockpitMetrics *self,
+                   double interpol_r,
+                   GString *out)
+{
+  gboolean remap;
+  double val;
+  gint *map;
+  gint n;
+
+  remap = !self->priv->meta_reset && self->priv->last_meta != self->priv->next_meta;
+
+  for (int i = 0; i < self->priv->n_metrics; i++)
+    {
+      if (self->priv->metric_info[i].has_instances)
+        {
+          map = remap ? build_instance_map (self, i) : NULL;
+          n = self->priv->metric_info[i].n_next_instances;
+          for (int j = 0; j < n; j++)
+            {
+              val = compute_value (self, interpol_r, i, j, find_last_instance (self, j, map, n));
+              self->priv->derived[i][j] = val;
+              append_float (out, val);
+            }
+          g_free (map);
+        }
+      else
+        {
+          val = compute_value (self, interpol_r, i, 0, (self->priv->meta_reset? -1 : 0));
+          self->priv->derived[i][0] = val;
+          append_float (out, val);
+        }
+    }
 }
 
 double **
@@ -533,6 +1063,139 @@ cockpit_metrics_get_data_buffer (CockpitMetrics *self)
   return self->priv->next_data;
 }
 
+static void
+begin_frame (CockpitMetrics *self)
+{
+  /* Sized for what the last message needed */
+  if (self->priv->message == NULL)
+    {
+      self->priv->message = g_string_sized_new (self->priv->message_size);
+
+      /* Binary data starts with a zero byte, meta starts with '{' */
+      if (self->priv->binary)
+        g_string_append_len (self->priv->message, "\0\0\0\0", 4);
+      else
+        g_string_append_c (self->priv->message, '[');
+    }
+  else if (!self->priv->binary)
+    {
+      g_string_append_c (self->priv->message, ',');
+    }
+}
+
+static gboolean
+value_triggers (Trigger *trigger,
+                double reported,
+                double val)
+{
+  if (isnan (reported) || isnan (val))
+    return isnan (reported) != isnan (val);
+
+  if (trigger->has_threshold &&
+      (reported < trigger->threshold) != (val < trigger->threshold))
+    return TRUE;
+
+  if (trigger->change > 0)
+    {
+      if (reported == 0)
+        return val != 0;
+      if (fabs (val - reported) * 100 >= trigger->change * fabs (reported))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+static gboolean
+frame_triggers (CockpitMetrics *self)
+{
+  Trigger *trigger;
+  double *reported;
+
+  /* After a meta message or with nothing sent yet */
+  if (!self->priv->reported_valid)
+    return TRUE;
+
+  if (self->priv->heartbeat > 0 &&
+      self->priv->next_timestamp - self->priv->reported_timestamp >= self->priv->heartbeat)
+    return TRUE;
+
+  reported = self->priv->reported;
+  for (int i = 0; i < self->priv->n_metrics; i++)
+    {
+      int n = self->priv->metric_info[i].n_next_instances;
+
+      /* Metrics without conditions are only carried along */
+      trigger = i < self->priv->n_triggers ? self->priv->triggers + i : NULL;
+      if (trigger && (trigger->has_threshold || trigger->change > 0))
+        {
+          for (int j = 0; j < n; j++)
+            {
+              if (value_triggers (trigger, reported[j], self->priv->derived[i][j]))
+                return TRUE;
+            }
+        }
+
+      reported += n;
+    }
+
+  return FALSE;
+}
+
+/*
+ * With "triggered" delivery every frame is still computed, so that
+ * derivation and interpolation carry on, but only those that meet a
+ * condition are sent. They are never compressed, the peer may not
+ * have the frame before. When frames were skipped, a copy of the meta
+ * tells the peer the time of this one.
+ */
+static void
+send_triggered_data (CockpitMetrics *self,
+                     double interpol_r)
+{
+  gboolean compress = self->priv->compress;
+  JsonObject *meta;
+  GString *frame;
+  gint total = 0;
+
+  if (self->priv->frame == NULL)
+    self->priv->frame = g_string_new (NULL);
+  frame = self->priv->frame;
+  g_string_truncate (frame, 0);
+
+  self->priv->compress = FALSE;
+  if (self->priv->binary)
+    build_binary_data (self, interpol_r, frame);
+  else
+    build_json_data (self, interpol_r, frame);
+  self->priv->compress = compress;
+
+  if (!frame_triggers (self))
+    {
+      self->priv->skipped = TRUE;
+      return;
+    }
+
+  if (self->priv->skipped)
+    {
+      cockpit_metrics_flush_data (self);
+      meta = copy_meta (self, self->priv->next_timestamp, g_get_real_time () / 1000);
+      send_object (self, meta);
+      json_object_unref (meta);
+      self->priv->skipped = FALSE;
+    }
+
+  begin_frame (self);
+  g_string_append_len (self->priv->message, frame->str, frame->len);
+
+  for (int i = 0; i < self->priv->n_metrics; i++)
+    total += self->priv->metric_info[i].n_next_instances;
+  if (total > 0)
+    memcpy (self->priv->reported, self->priv->derived[0], sizeof (double) * total);
+  self->priv->reported_valid = TRUE;
+  self->priv->reported_timestamp = self->priv->next_timestamp;
+}
+
 /*
  * cockpit_metrics_send_data:
  * @self: The CockpitMetrics
@@ -544,11 +1207,9 @@ cockpit_metrics_get_data_buffer (CockpitMetrics *self)
 void
 cockpit_metrics_send_data (CockpitMetrics *self, gint64 timestamp)
 {
-  JsonArray *res;
   double interpol_r = 1.0;
 
-  if (self->priv->message == NULL)
-    self->priv->message = json_array_new ();
+  cockpit_stats_add (NULL, COCKPIT_STAT_METRICS_SAMPLES, 1);
 
   if (self->priv->interpolate && !self->priv->meta_reset)
     {
@@ -562,8 +1223,18 @@ cockpit_metrics_send_data (CockpitMetrics *self, gint64 timestamp)
 
   self->priv->next_timestamp = timestamp;
 
-  res = build_json_data (self, interpol_r);
-  json_array_add_array_element (self->priv->message, res);
+  if (self->priv->triggered)
+    {
+      send_triggered_data (self, interpol_r);
+    }
+  else
+    {
+      begin_frame (self);
+      if (self->priv->binary)
+        build_binary_data (self, interpol_r, self->priv->message);
+      else
+        build_json_data (self, interpol_r, self->priv->message);
+    }
 
   /* Now setup for the next round by swapping buffers and then making
      sure that the new 'next' buffer has the right layout.
@@ -593,11 +1264,18 @@ cockpit_metrics_send_data (CockpitMetrics *self, gint64 timestamp)
 void
 cockpit_metrics_flush_data (CockpitMetrics *self)
 {
+  CockpitChannel *channel = (CockpitChannel *)self;
+  GBytes *bytes;
+
   if (self->priv->message)
     {
-      send_array (self, self->priv->message);
-      json_array_unref (self->priv->message);
+      if (!self->priv->binary)
+        g_string_append_c (self->priv->message, ']');
+      self->priv->message_size = self->priv->message->len;
+      bytes = g_string_free_to_bytes (self->priv->message);
       self->priv->message = NULL;
+      cockpit_channel_send (channel, bytes, TRUE);
+      g_bytes_unref (bytes);
     }
 }
 
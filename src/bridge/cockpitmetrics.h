@@ -52,6 +52,9 @@ struct _CockpitMetricsClass {
   void        (* tick)         (CockpitMetrics *metrics,
                                 gint64 current_monotic_time);
 
+  void        (* pause)        (CockpitMetrics *metrics,
+                                gboolean paused);
+
 };
 
 GType              cockpit_metrics_get_type     (void) G_GNUC_CONST;
@@ -65,6 +68,15 @@ void               cockpit_metrics_set_compress    (CockpitMetrics *self,
 void               cockpit_metrics_metronome    (CockpitMetrics *self,
                                                  gint64 interval);
 
+typedef void       (* CockpitMetronomeFunc)     (gint64 timestamp,
+                                                 gpointer user_data);
+
+guint              cockpit_metronome_add        (gint64 interval,
+                                                 CockpitMetronomeFunc func,
+                                                 gpointer user_data);
+
+void               cockpit_metronome_remove     (guint id);
+
 /* Sending samples
  *
  * Derived classes need to call the following functions in a carefully
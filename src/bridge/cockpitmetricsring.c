@@ -0,0 +1,633 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2016 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitmetricsring.h"
+
+#include <gio/gio.h>
+#include <glib/gstdio.h>
+
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * A CockpitMetricsRing is a file of a fixed size holding the most recent
+ * samples of a set of metric instances, taken at a regular interval.
+ * It's mapped into memory, both by the one process that writes to it
+ * and by any that read from it.
+ *
+ * After the header come the names of the columns, one for each metric
+ * instance that has been seen, then a timestamp for each row, and then
+ * the values column by column. The rows are a ring: the header counts
+ * how many have ever been written, and the next one goes into the
+ * oldest slot.
+ *
+ * A row's timestamp is zeroed while it is being written, and the count
+ * of rows is only changed after it's complete. Readers skip rows with
+ * no timestamp. The file is in host byte order, it's never copied to
+ * another machine.
+ *
+ * The layout of a file never changes once it's in place. A ring with a
+ * different layout is written next to it and renamed over it, so that
+ * readers who have the old one mapped carry on without new rows, rather
+ * than finding the file shrunk underneath them.
+ */
+
+#define RING_MAGIC      "CKPTRING"
+#define RING_NAME_SIZE  64
+
+/* Keep files at a sane size */
+#define RING_MAX_LENGTH (G_GUINT64_CONSTANT (1) << 30)
+
+typedef struct {
+  gchar magic[8];
+  guint32 n_columns;
+  guint32 n_rows;
+  gint64 interval;
+  guint32 used_columns;
+  guint32 reserved;
+  guint64 written;
+  guint8 padding[24];
+} RingHeader;
+
+G_STATIC_ASSERT (sizeof (RingHeader) == 64);
+
+struct _CockpitMetricsRing {
+  gint fd;
+  gboolean writable;
+  gpointer map;
+  gsize length;
+
+  RingHeader *header;
+  gchar *names;
+  gint64 *stamps;
+  gdouble *values;
+
+  /* From the header when it was checked, never read again */
+  guint n_rows;
+  guint n_columns;
+  gint64 interval;
+
+  /* "metric\ninstance" to column plus one */
+  GHashTable *columns;
+  guint indexed;
+
+  guint slot;
+  gint64 timestamp;
+};
+
+static guint64
+ring_length (guint n_rows,
+             guint n_columns)
+{
+  return sizeof (RingHeader) +
+         (guint64)n_columns * RING_NAME_SIZE +
+         (guint64)n_rows * sizeof (gint64) +
+         (guint64)n_rows * n_columns * sizeof (gdouble);
+}
+
+static void
+ring_layout (CockpitMetricsRing *self)
+{
+  self->header = self->map;
+  self->names = (gchar *)self->map + sizeof (RingHeader);
+  self->stamps = (gint64 *)(self->names + (gsize)self->n_columns * RING_NAME_SIZE);
+  self->values = (gdouble *)(self->stamps + self->n_rows);
+}
+
+static gboolean
+column_name (CockpitMetricsRing *self,
+             guint column,
+             const gchar **metric,
+             const gchar **instance)
+{
+  const gchar *name = self->names + (gsize)column * RING_NAME_SIZE;
+  const gchar *end;
+
+  /* The other process might have written anything here */
+  end = memchr (name, '\0', RING_NAME_SIZE);
+  if (!end || end == name || !memchr (end + 1, '\0', RING_NAME_SIZE - (end + 1 - name)))
+    return FALSE;
+
+  *metric = name;
+  *instance = end + 1;
+  return TRUE;
+}
+
+static void
+index_columns (CockpitMetricsRing *self)
+{
+  const gchar *metric;
+  const gchar *instance;
+  guint used;
+
+  used = MIN (self->header->used_columns, self->n_columns);
+  for (; self->indexed < used; self->indexed++)
+    {
+      if (column_name (self, self->indexed, &metric, &instance))
+        {
+          g_hash_table_insert (self->columns, g_strdup_printf ("%s\n%s", metric, instance),
+                               GUINT_TO_POINTER (self->indexed + 1));
+        }
+    }
+}
+
+static CockpitMetricsRing *
+ring_new (gint fd,
+          gboolean writable)
+{
+  CockpitMetricsRing *self = g_new0 (CockpitMetricsRing, 1);
+  self->fd = fd;
+  self->writable = writable;
+  self->map = MAP_FAILED;
+  self->columns = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  return self;
+}
+
+static gboolean
+ring_map (CockpitMetricsRing *self,
+          const gchar *path,
+          const RingHeader *header,
+          GError **error)
+{
+  self->n_rows = header->n_rows;
+  self->n_columns = header->n_columns;
+  self->interval = header->interval;
+  self->length = ring_length (self->n_rows, self->n_columns);
+
+  self->map = mmap (NULL, self->length, self->writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                    MAP_SHARED, self->fd, 0);
+  if (self->map == MAP_FAILED)
+    {
+      int errn = errno;
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errn),
+                   "couldn't map %s: %s", path, g_strerror (errn));
+      return FALSE;
+    }
+
+  ring_layout (self);
+  return TRUE;
+}
+
+/*
+ * Writes an empty ring next to @path and renames it into place. The
+ * new file is locked before anyone else can open it.
+ */
+static gint
+ring_replace (const gchar *path,
+              const RingHeader *header,
+              GError **error)
+{
+  gchar *tmp;
+  gint errn;
+  gint fd;
+
+  tmp = g_strdup_printf ("%s.XXXXXX", path);
+  fd = g_mkstemp_full (tmp, O_RDWR | O_CLOEXEC, 0644);
+  if (fd < 0)
+    {
+      errn = errno;
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errn),
+                   "couldn't create %s: %s", tmp, g_strerror (errn));
+      g_free (tmp);
+      return -1;
+    }
+
+  if (flock (fd, LOCK_EX | LOCK_NB) < 0 ||
+      ftruncate (fd, ring_length (header->n_rows, header->n_columns)) < 0 ||
+      pwrite (fd, header, sizeof (RingHeader), 0) != sizeof (RingHeader) ||
+      rename (tmp, path) < 0)
+    {
+      errn = errno;
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errn),
+                   "couldn't write %s: %s", path, g_strerror (errn));
+      g_unlink (tmp);
+      close (fd);
+      fd = -1;
+    }
+
+  g_free (tmp);
+  return fd;
+}
+
+/**
+ * cockpit_metrics_ring_create:
+ * @path: the file
+ * @interval: milliseconds between rows
+ * @n_rows: number of rows to keep
+ * @n_columns: most metric instances to keep
+ * @error: location to place an error
+ *
+ * Opens the file for writing, and takes a lock on it so that nothing
+ * else records into it at the same time. If it has a different layout
+ * it's replaced with an empty one, otherwise the new rows follow on
+ * from the old ones.
+ *
+ * Returns: the ring, or NULL on failure
+ */
+CockpitMetricsRing *
+cockpit_metrics_ring_create (const gchar *path,
+                             gint64 interval,
+                             guint n_rows,
+                             guint n_columns,
+                             GError **error)
+{
+  CockpitMetricsRing *self;
+  RingHeader header;
+  struct stat st;
+  guint64 length;
+  gint fd;
+
+  g_return_val_if_fail (path != NULL, NULL);
+  g_return_val_if_fail (interval > 0, NULL);
+
+  length = ring_length (n_rows, n_columns);
+  if (n_rows == 0 || n_columns == 0 || length > RING_MAX_LENGTH)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                   "invalid size for %s: %u rows of %u columns", path, n_rows, n_columns);
+      return NULL;
+    }
+
+  fd = open (path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0)
+    {
+      int errn = errno;
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errn),
+                   "couldn't open %s: %s", path, g_strerror (errn));
+      return NULL;
+    }
+
+  self = ring_new (fd, TRUE);
+
+  if (flock (fd, LOCK_EX | LOCK_NB) < 0)
+    {
+      int errn = errno;
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errn),
+                   "couldn't lock %s: %s", path,
+                   errn == EWOULDBLOCK ? "something else is recording" : g_strerror (errn));
+      cockpit_metrics_ring_free (self);
+      return NULL;
+    }
+
+  memset (&header, 0, sizeof (header));
+  if (fstat (fd, &st) < 0 || st.st_size != (off_t)length ||
+      pread (fd, &header, sizeof (header), 0) != sizeof (header) ||
+      memcmp (header.magic, RING_MAGIC, sizeof (header.magic)) != 0 ||
+      header.n_rows != n_rows || header.n_columns != n_columns ||
+      header.interval != interval)
+    {
+      g_debug ("%s: starting a new ring file", path);
+
+      memset (&header, 0, sizeof (header));
+      memcpy (header.magic, RING_MAGIC, sizeof (header.magic));
+      header.n_rows = n_rows;
+      header.n_columns = n_columns;
+      header.interval = interval;
+
+      /* Still holding the lock on the old file, so no one else does this */
+      fd = ring_replace (path, &header, error);
+      if (fd < 0)
+        {
+          cockpit_metrics_ring_free (self);
+          return NULL;
+        }
+
+      close (self->fd);
+      self->fd = fd;
+    }
+
+  if (!ring_map (self, path, &header, error))
+    {
+      cockpit_metrics_ring_free (self);
+      return NULL;
+    }
+
+  index_columns (self);
+  return self;
+}
+
+/**
+ * cockpit_metrics_ring_open:
+ * @path: the file
+ * @error: location to place an error
+ *
+ * Opens the file for reading. Rows and columns that
+ * get added meanwhile show up as they are written.
+ *
+ * Returns: the ring, or NULL on failure
+ */
+CockpitMetricsRing *
+cockpit_metrics_ring_open (const gchar *path,
+                           GError **error)
+{
+  CockpitMetricsRing *self;
+  RingHeader header;
+  struct stat st;
+  gint fd;
+
+  g_return_val_if_fail (path != NULL, NULL);
+
+  fd = open (path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    {
+      int errn = errno;
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errn),
+                   "couldn't open %s: %s", path, g_strerror (errn));
+      return NULL;
+    }
+
+  self = ring_new (fd, FALSE);
+
+  if (fstat (fd, &st) < 0 ||
+      pread (fd, &header, sizeof (header), 0) != sizeof (header) ||
+      memcmp (header.magic, RING_MAGIC, sizeof (header.magic)) != 0 ||
+      header.n_rows == 0 || header.n_columns == 0 || header.interval <= 0 ||
+      ring_length (header.n_rows, header.n_columns) > RING_MAX_LENGTH ||
+      st.st_size != (off_t)ring_length (header.n_rows, header.n_columns))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "%s is not a metrics ring file", path);
+      cockpit_metrics_ring_free (self);
+      return NULL;
+    }
+
+  if (!ring_map (self, path, &header, error))
+    {
+      cockpit_metrics_ring_free (self);
+      return NULL;
+    }
+
+  index_columns (self);
+  return self;
+}
+
+void
+cockpit_metrics_ring_free (CockpitMetricsRing *self)
+{
+  if (!self)
+    return;
+
+  if (self->map != MAP_FAILED)
+    munmap (self->map, self->length);
+  if (self->fd >= 0)
+    close (self->fd);
+  g_hash_table_destroy (self->columns);
+  g_free (self);
+}
+
+gint64
+cockpit_metrics_ring_get_interval (CockpitMetricsRing *self)
+{
+  return self->interval;
+}
+
+/**
+ * cockpit_metrics_ring_get_n_columns:
+ * @self: the ring
+ *
+ * Returns: the number of columns so far, some of which
+ *     may have unusable names
+ */
+gint
+cockpit_metrics_ring_get_n_columns (CockpitMetricsRing *self)
+{
+  index_columns (self);
+  return self->indexed;
+}
+
+/**
+ * cockpit_metrics_ring_get_column:
+ * @self: the ring
+ * @column: the column
+ * @metric: location for the metric name
+ * @instance: location for the instance, empty if the metric has none
+ *
+ * Both are set to NULL if the column isn't usable.
+ */
+void
+cockpit_metrics_ring_get_column (CockpitMetricsRing *self,
+                                 gint column,
+                                 const gchar **metric,
+                                 const gchar **instance)
+{
+  if (column < 0 || column >= (gint)self->indexed ||
+      !column_name (self, column, metric, instance))
+    {
+      *metric = NULL;
+      *instance = NULL;
+    }
+}
+
+/**
+ * cockpit_metrics_ring_add_column:
+ * @self: a ring opened for writing
+ * @metric: the metric name
+ * @instance: the instance, or NULL
+ *
+ * Finds the column for this metric instance, or adds one.
+ *
+ * Returns: the column, or -1 if the ring is full
+ */
+gint
+cockpit_metrics_ring_add_column (CockpitMetricsRing *self,
+                                 const gchar *metric,
+                                 const gchar *instance)
+{
+  gchar *name;
+  gsize metric_len;
+  gsize instance_len;
+  gpointer value;
+  guint column;
+  guint i;
+
+  g_return_val_if_fail (self->writable, -1);
+  g_return_val_if_fail (metric != NULL && metric[0] != '\0', -1);
+
+  if (!instance)
+    instance = "";
+
+  name = g_strdup_printf ("%s\n%s", metric, instance);
+  value = g_hash_table_lookup (self->columns, name);
+  if (value)
+    {
+      g_free (name);
+      return GPOINTER_TO_UINT (value) - 1;
+    }
+
+  metric_len = strlen (metric);
+  instance_len = strlen (instance);
+  if (self->header->used_columns >= self->n_columns ||
+      metric_len + instance_len + 2 > RING_NAME_SIZE)
+    {
+      g_free (name);
+      return -1;
+    }
+
+  column = self->header->used_columns;
+
+  /* Rows from before this column have no values in it */
+  for (i = 0; i < self->n_rows; i++)
+    self->values[(gsize)column * self->n_rows + i] = NAN;
+
+  memcpy (self->names + (gsize)column * RING_NAME_SIZE, metric, metric_len + 1);
+  memcpy (self->names + (gsize)column * RING_NAME_SIZE + metric_len + 1, instance, instance_len + 1);
+
+  /* Only then is the column there for readers */
+  __sync_synchronize ();
+  self->header->used_columns = column + 1;
+
+  g_hash_table_insert (self->columns, name, GUINT_TO_POINTER (column + 1));
+  self->indexed = column + 1;
+  return column;
+}
+
+/**
+ * cockpit_metrics_ring_begin_row:
+ * @self: a ring opened for writing
+ * @timestamp: milliseconds since the epoch
+ *
+ * Starts writing a row over the oldest one. All its values
+ * are NAN until they are set.
+ */
+void
+cockpit_metrics_ring_begin_row (CockpitMetricsRing *self,
+                                gint64 timestamp)
+{
+  guint i;
+
+  g_return_if_fail (self->writable);
+
+  self->slot = self->header->written % self->n_rows;
+  self->timestamp = timestamp;
+
+  self->stamps[self->slot] = 0;
+  __sync_synchronize ();
+
+  for (i = 0; i < self->header->used_columns; i++)
+    self->values[(gsize)i * self->n_rows + self->slot] = NAN;
+}
+
+void
+cockpit_metrics_ring_set_value (CockpitMetricsRing *self,
+                                gint column,
+                                gdouble value)
+{
+  g_return_if_fail (self->writable);
+  g_return_if_fail (column >= 0 && column < (gint)self->header->used_columns);
+
+  self->values[(gsize)column * self->n_rows + self->slot] = value;
+}
+
+void
+cockpit_metrics_ring_commit_row (CockpitMetricsRing *self)
+{
+  g_return_if_fail (self->writable);
+
+  __sync_synchronize ();
+  self->stamps[self->slot] = self->timestamp;
+  __sync_synchronize ();
+  self->header->written++;
+}
+
+/**
+ * cockpit_metrics_ring_get_rows:
+ * @self: the ring
+ * @first: location for the oldest row
+ * @end: location for one past the newest row
+ *
+ * Rows are numbered by how many were written before them, so
+ * the numbers stay the same as the ring moves along.
+ */
+void
+cockpit_metrics_ring_get_rows (CockpitMetricsRing *self,
+                               guint64 *first,
+                               guint64 *end)
+{
+  guint64 written = self->header->written;
+
+  *end = written;
+  *first = written > self->n_rows ? written - self->n_rows : 0;
+}
+
+/**
+ * cockpit_metrics_ring_get_timestamp:
+ * @self: the ring
+ * @row: the row
+ *
+ * Returns: the timestamp of the row, or zero if it's not
+ *     there or is being written to
+ */
+gint64
+cockpit_metrics_ring_get_timestamp (CockpitMetricsRing *self,
+                                    guint64 row)
+{
+  guint64 first, end;
+
+  cockpit_metrics_ring_get_rows (self, &first, &end);
+  if (row < first || row >= end)
+    return 0;
+  return self->stamps[row % self->n_rows];
+}
+
+/**
+ * cockpit_metrics_ring_seek:
+ * @self: the ring
+ * @timestamp: milliseconds since the epoch
+ *
+ * Returns: the oldest row at or after @timestamp, or the end
+ */
+guint64
+cockpit_metrics_ring_seek (CockpitMetricsRing *self,
+                           gint64 timestamp)
+{
+  guint64 first, end, mid;
+
+  cockpit_metrics_ring_get_rows (self, &first, &end);
+
+  /* The rows are in order, one being written counts as the oldest */
+  while (first < end)
+    {
+      mid = first + (end - first) / 2;
+      if (cockpit_metrics_ring_get_timestamp (self, mid) < timestamp)
+        first = mid + 1;
+      else
+        end = mid;
+    }
+
+  return first;
+}
+
+gdouble
+cockpit_metrics_ring_get_value (CockpitMetricsRing *self,
+                                guint64 row,
+                                gint column)
+{
+  if (column < 0 || column >= (gint)self->indexed)
+    return NAN;
+  return self->values[(gsize)column * self->n_rows + row % self->n_rows];
+}
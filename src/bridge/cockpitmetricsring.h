@@ -0,0 +1,81 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2016 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COCKPIT_METRICS_RING_H__
+#define COCKPIT_METRICS_RING_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _CockpitMetricsRing CockpitMetricsRing;
+
+/* Where cockpit-recorder keeps the samples by default */
+#define COCKPIT_METRICS_RING_FILE PACKAGE_LOCALSTATE_DIR "/metrics-history"
+
+CockpitMetricsRing *  cockpit_metrics_ring_create        (const gchar *path,
+                                                          gint64 interval,
+                                                          guint n_rows,
+                                                          guint n_columns,
+                                                          GError **error);
+
+CockpitMetricsRing *  cockpit_metrics_ring_open          (const gchar *path,
+                                                          GError **error);
+
+void                  cockpit_metrics_ring_free          (CockpitMetricsRing *self);
+
+gint64                cockpit_metrics_ring_get_interval  (CockpitMetricsRing *self);
+
+gint                  cockpit_metrics_ring_get_n_columns (CockpitMetricsRing *self);
+
+void                  cockpit_metrics_ring_get_column    (CockpitMetricsRing *self,
+                                                          gint column,
+                                                          const gchar **metric,
+                                                          const gchar **instance);
+
+gint                  cockpit_metrics_ring_add_column    (CockpitMetricsRing *self,
+                                                          const gchar *metric,
+                                                          const gchar *instance);
+
+void                  cockpit_metrics_ring_begin_row     (CockpitMetricsRing *self,
+                                                          gint64 timestamp);
+
+void                  cockpit_metrics_ring_set_value     (CockpitMetricsRing *self,
+                                                          gint column,
+                                                          gdouble value);
+
+void                  cockpit_metrics_ring_commit_row    (CockpitMetricsRing *self);
+
+void                  cockpit_metrics_ring_get_rows      (CockpitMetricsRing *self,
+                                                          guint64 *first,
+                                                          guint64 *end);
+
+guint64               cockpit_metrics_ring_seek          (CockpitMetricsRing *self,
+                                                          gint64 timestamp);
+
+gint64                cockpit_metrics_ring_get_timestamp (CockpitMetricsRing *self,
+                                                          guint64 row);
+
+gdouble               cockpit_metrics_ring_get_value     (CockpitMetricsRing *self,
+                                                          guint64 row,
+                                                          gint column);
+
+G_END_DECLS
+
+#endif /* COCKPIT_METRICS_RING_H__ */
@@ -20,75 +20,252 @@
 #include "config.h"
 
 #include "cockpitmountsamples.h"
+#include "cockpitprocreader.h"
 
-#include <stdio.h>
+#include <poll.h>
 #include <string.h>
-#include <unistd.h>
-#include <math.h>
-#include <fts.h>
-#include <ctype.h>
 #include <sys/statvfs.h>
 
-void
-cockpit_mount_samples (CockpitSamples *samples)
+/*
+ * statvfs() on a network filesystem whose server has gone away can
+ * block until the kernel gives up, which may be minutes. So each
+ * statvfs runs in a thread pool, and the sampler waits at most
+ * MOUNT_TIMEOUT for them. A mount that doesn't answer in time is
+ * reported as COCKPIT_SAMPLES_NONE, and isn't asked again until its
+ * earlier statvfs has returned.
+ *
+ * The mount table is only parsed again when the kernel says it has
+ * changed, by flagging POLLPRI on /proc/self/mountinfo.
+ */
+
+#define MOUNT_TIMEOUT (1 * G_USEC_PER_SEC)
+
+typedef struct {
+  volatile gint refs;
+  gchar *dir;
+  gboolean seen;
+
+  /* The rest is protected by mutex */
+  gboolean busy;
+  guint round;
+  gboolean valid;
+  gint64 total;
+  gint64 used;
+} Mount;
+
+static CockpitProcReader reader = COCKPIT_PROC_READER_INIT ("/proc/self/mountinfo");
+
+/* Only touched by the sampler thread */
+static GHashTable *mounts;
+static GThreadPool *pool;
+
+static GMutex mutex;
+static GCond cond;
+static guint mount_round;
+static gint outstanding;
+
+static void
+mount_unref (gpointer data)
 {
-  gchar *contents = NULL;
-  GError *error = NULL;
-  gchar **lines = NULL;
-  gchar *line;
-  gchar *esc_dir, *dir;
+  Mount *mount = data;
+
+  if (g_atomic_int_dec_and_test (&mount->refs))
+    {
+      g_free (mount->dir);
+      g_free (mount);
+    }
+}
+
+static void
+mount_statvfs (gpointer data,
+               gpointer user_data)
+{
+  Mount *mount = data;
   struct statvfs buf;
-  gint64 total;
-  gsize len;
-  guint n;
+  gboolean valid;
+  gint64 frsize;
+
+  valid = statvfs (mount->dir, &buf) >= 0;
+
+  g_mutex_lock (&mutex);
 
-  if (!g_file_get_contents ("/proc/mounts", &contents, &len, &error))
+  mount->busy = FALSE;
+  mount->valid = valid;
+  if (valid)
     {
-      g_message ("error loading contents /proc/mounts: %s", error->message);
-      g_error_free (error);
-      goto out;
+      // We explicitly store the fragment size as 64 bits so that
+      // computations with it don't overflow on 32 bit
+      // architectures.
+
+      frsize = buf.f_frsize;
+      mount->total = frsize * buf.f_blocks;
+      mount->used = mount->total - frsize * buf.f_bfree;
     }
 
-  lines = g_strsplit (contents, "\n", -1);
-  for (n = 0; lines != NULL && lines[n] != NULL; n++)
+  if (mount->round == mount_round)
     {
-      line = lines[n];
+      outstanding--;
+      g_cond_broadcast (&cond);
+    }
+
+  g_mutex_unlock (&mutex);
+
+  mount_unref (mount);
+}
+
+static gboolean
+mount_table_changed (void)
+{
+  struct pollfd pfd = { reader.fd, POLLPRI, 0 };
 
-      if (strlen (line) == 0)
+  if (mounts == NULL || reader.fd < 0)
+    return TRUE;
+
+  /* Read it again if we can't tell */
+  if (poll (&pfd, 1, 0) < 0)
+    return TRUE;
+
+  return (pfd.revents & (POLLPRI | POLLERR)) != 0;
+}
+
+static gboolean
+mount_unseen (gpointer key,
+              gpointer value,
+              gpointer user_data)
+{
+  Mount *mount = value;
+  return !mount->seen;
+}
+
+static void
+read_mount_table (void)
+{
+  GHashTableIter iter;
+  gpointer value;
+  gchar *contents;
+  gchar *line;
+  gchar *esc_dir, *dir;
+  gchar *word;
+  Mount *mount;
+  gint i;
+
+  contents = cockpit_proc_reader_read (&reader, NULL);
+  if (!contents)
+    return;
+
+  if (!mounts)
+    mounts = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, mount_unref);
+
+  g_hash_table_iter_init (&iter, mounts);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    ((Mount *)value)->seen = FALSE;
+
+  while ((line = cockpit_proc_next_line (&contents)) != NULL)
+    {
+      /* Mount id, parent id, device number and root come first */
+      for (i = 0; i < 4; i++)
+        {
+          if (!cockpit_proc_next_word (&line))
+            break;
+        }
+      esc_dir = cockpit_proc_next_word (&line);
+      if (!esc_dir)
+        continue;
+
+      /* The optional fields end with a dash, then the type and source */
+      while ((word = cockpit_proc_next_word (&line)) != NULL)
+        {
+          if (g_str_equal (word, "-"))
+            break;
+        }
+      if (!word || !cockpit_proc_next_word (&line))
         continue;
+      word = cockpit_proc_next_word (&line);
 
       /* Only look at real devices
        */
-      if (line[0] != '/')
+      if (!word || word[0] != '/')
         continue;
 
-      while (*line && !isspace (*line))
-        line++;
-      while (*line && isspace (*line))
-        line++;
-      esc_dir = line;
-      while (*line && !isspace (*line))
-        line++;
-      *line = '\0';
-
       dir = g_strcompress (esc_dir);
-
-      if (statvfs (dir, &buf) >= 0)
+      mount = g_hash_table_lookup (mounts, dir);
+      if (mount)
+        {
+          g_free (dir);
+        }
+      else
         {
-          // We explicitly store the fragment size as 64 bits so that
-          // computations with it don't overflow on 32 bit
-          // architectures.
-
-          gint64 frsize = buf.f_frsize;
-          total = frsize * buf.f_blocks;
-          cockpit_samples_sample (samples, "mount.total", dir, total);
-          cockpit_samples_sample (samples, "mount.used", dir, total - frsize * buf.f_bfree);
+          mount = g_new0 (Mount, 1);
+          mount->refs = 1;
+          mount->dir = dir;
+          g_hash_table_insert (mounts, mount->dir, mount);
         }
+      mount->seen = TRUE;
+    }
+
+  g_hash_table_foreach_remove (mounts, mount_unseen, NULL);
+}
+
+void
+cockpit_mount_samples (CockpitSamples *samples)
+{
+  GHashTableIter iter;
+  gpointer value;
+  Mount *mount;
+  gint64 deadline;
+
+  if (mount_table_changed ())
+    read_mount_table ();
+  if (!mounts)
+    return;
+
+  if (!pool)
+    pool = g_thread_pool_new (mount_statvfs, NULL, -1, FALSE, NULL);
+
+  g_mutex_lock (&mutex);
+
+  mount_round++;
+  outstanding = 0;
+
+  /* Mounts still busy from an earlier round are left alone */
+  g_hash_table_iter_init (&iter, mounts);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      mount = value;
+      if (mount->busy || !cockpit_samples_wanted (samples, mount->dir))
+        continue;
+
+      mount->busy = TRUE;
+      mount->round = mount_round;
+      outstanding++;
+      g_atomic_int_inc (&mount->refs);
+      g_thread_pool_push (pool, mount, NULL);
+    }
 
-      g_free (dir);
+  deadline = g_get_monotonic_time () + MOUNT_TIMEOUT;
+  while (outstanding > 0)
+    {
+      if (!g_cond_wait_until (&cond, &mutex, deadline))
+        break;
+    }
+
+  g_hash_table_iter_init (&iter, mounts);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      mount = value;
+      if (!cockpit_samples_wanted (samples, mount->dir))
+        continue;
+      if (mount->busy)
+        {
+          cockpit_samples_sample (samples, "mount.total", mount->dir, COCKPIT_SAMPLES_NONE);
+          cockpit_samples_sample (samples, "mount.used", mount->dir, COCKPIT_SAMPLES_NONE);
+        }
+      else if (mount->valid)
+        {
+          cockpit_samples_sample (samples, "mount.total", mount->dir, mount->total);
+          cockpit_samples_sample (samples, "mount.used", mount->dir, mount->used);
+        }
     }
 
- out:
-  g_strfreev (lines);
-  g_free (contents);
+  g_mutex_unlock (&mutex);
 }
@@ -20,41 +20,33 @@
 #include "config.h"
 
 #include "cockpitnetworksamples.h"
+#include "cockpitprocreader.h"
 
-#include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 
-/* TODO: this should be optimized so we don't allocate network and call open()/close() all the time */
-
 void
 cockpit_network_samples (CockpitSamples *samples)
 {
-  gchar *contents = NULL;
-  GError *error = NULL;
-  gchar **lines = NULL;
-  gsize len;
+  static CockpitProcReader reader = COCKPIT_PROC_READER_INIT ("/proc/net/dev");
+  gchar *contents;
+  gchar *line;
   guint n;
 
   guint64 total_rx = 0;
   guint64 total_tx = 0;
 
-  if (!g_file_get_contents ("/proc/net/dev", &contents, &len, &error))
-    {
-      g_warning ("error loading contents /proc/net/dev: %s", error->message);
-      g_error_free (error);
-      goto out;
-    }
+  contents = cockpit_proc_reader_read (&reader, NULL);
+  if (!contents)
+    return;
 
-  lines = g_strsplit (contents, "\n", -1);
-  for (n = 0; lines != NULL && lines[n] != NULL; n++)
+  for (n = 0; (line = cockpit_proc_next_line (&contents)) != NULL; n++)
     {
-      const gchar *line = lines[n];
-      gchar iface_name[64]; /* guaranteed to be max 16 chars */
-      guint64 bytes_rx, packets_rx, errors_rx, dropped_rx, fifo_rx, frame_rx, compressed_rx, multicast_rx;
-      guint64 bytes_tx, packets_tx, errors_tx, dropped_tx, fifo_tx, frame_tx, compressed_tx, multicast_tx;
-      gint num_parsed;
-      gchar *ptr;
+      gchar *iface_name;
+      guint64 bytes_rx, bytes_tx;
+      guint64 fields[16];
+      gchar *pos;
+      gint i;
 
       /* Format is
        *
@@ -66,29 +58,31 @@ cockpit_network_samples (CockpitSamples *samples)
        * tap0:    7714      81    0    0    0     0          0         0     7714      81    0    0    0     0       0          0
        */
 
-      if (n < 2 || strlen (line) == 0)
+      if (n < 2 || line[0] == '\0')
         continue;
 
-      num_parsed = sscanf (line,
-                           "%s %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT
-                           " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT
-                           " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT
-                           " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT,
-                           iface_name,
-                           &bytes_rx, &packets_rx, &errors_rx, &dropped_rx,
-                           &fifo_rx, &frame_rx, &compressed_rx, &multicast_rx,
-                           &bytes_tx, &packets_tx, &errors_tx, &dropped_tx,
-                           &fifo_tx, &frame_tx, &compressed_tx, &multicast_tx);
-      if (num_parsed != 17)
+      /* The interface name ends with a ':' which may not be followed by a space */
+      iface_name = line;
+      while (*iface_name == ' ')
+        iface_name++;
+      pos = strchr (iface_name, ':');
+      if (pos)
+        *(pos++) = '\0';
+
+      for (i = 0; pos != NULL && i < G_N_ELEMENTS (fields); i++)
         {
-          g_warning ("Error parsing line %d of file /proc/net/dev (num_parsed=%d): `%s'", n, num_parsed, line);
+          if (!cockpit_proc_next_u64 (&pos, fields + i))
+            break;
+        }
+      if (pos == NULL || i != G_N_ELEMENTS (fields))
+        {
+          g_warning ("Error parsing line %d of file /proc/net/dev: `%s'", n, line);
           continue;
         }
 
-      /* remove trailing ':' from interface name */
-      ptr = strrchr (iface_name, ':');
-      if (ptr)
-        *ptr = '\0';
+      /* Receive bytes is the first field, transmit bytes the ninth */
+      bytes_rx = fields[0];
+      bytes_tx = fields[8];
 
       cockpit_samples_sample (samples, "network.interface.rx", iface_name, bytes_rx);
       cockpit_samples_sample (samples, "network.interface.tx", iface_name, bytes_tx);
@@ -99,8 +93,4 @@ cockpit_network_samples (CockpitSamples *samples)
 
   cockpit_samples_sample (samples, "network.all.rx", NULL, total_rx);
   cockpit_samples_sample (samples, "network.all.tx", NULL, total_tx);
-
-out:
-  g_strfreev (lines);
-  g_free (contents);
 }
@@ -26,6 +26,7 @@
 #include "common/cockpitenums.h"
 #include "common/cockpithex.h"
 #include "common/cockpitjson.h"
+#include "common/cockpitmemory.h"
 #include "common/cockpitsystem.h"
 #include "common/cockpitwebinject.h"
 #include "common/cockpitwebresponse.h"
@@ -33,20 +34,60 @@
 
 #include <glib.h>
 
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <string.h>
+#include <unistd.h>
 
 /* Overridable from tests */
 const gchar **cockpit_bridge_data_dirs = NULL; /* default */
 
 gint cockpit_bridge_packages_port = 0;
 
+const gchar *cockpit_bridge_packages_index = PACKAGE_LOCALSTATE_DIR "/packages-index.json";
+
 struct _CockpitPackages {
   CockpitWebServer *web_server;
   GHashTable *listing;
   gchar *checksum;
   JsonObject *json;
+
+  /* Serialized manifests, the listing doesn't change after it's built */
+  GBytes *manifests_js;
+  GBytes *manifests_js_gz;
+  GBytes *manifests_json;
+  GBytes *manifests_json_gz;
+
+  /* Negotiated resources, when they're addressed by checksum */
+  GHashTable *negotiated;
+  GHashTable *mapped;
+  gsize mapped_size;
 };
 
+/*
+ * When the packages have a checksum, their files don't change while the
+ * bridge runs. So the outcome of negotiating a resource (which variant
+ * of the file, and its contents) is kept and reused for the same path
+ * and language.
+ *
+ * The contents are read only mappings of the files, kept once for each
+ * file however many paths and languages negotiate to it. Serving them
+ * again copies nothing, and their pages are the page cache, shared with
+ * every other bridge serving the same packages. Within limits, since
+ * they still take up address space.
+ */
+
+typedef struct {
+  CockpitPackage *package;
+  GBytes *bytes;
+  gchar *chosen;
+} NegotiatedResource;
+
+#define NEGOTIATED_MAX_ENTRIES  4096
+#define MAPPED_MAX_FILE         (16 * 1024 * 1024)
+#define MAPPED_MAX_TOTAL        (256 * 1024 * 1024)
+
 struct _CockpitPackage {
   gchar *name;
   gchar *directory;
@@ -67,9 +108,31 @@ struct _CockpitPackage {
  * on different machines.
  *
  * So we use the fastest, good ol' SHA1.
+ *
+ * Hashing every file at every bridge start is slow though. So the digest
+ * of each file is kept in a per-user cache, keyed by the identity and
+ * change times of the file, and only files that changed are hashed again.
+ * That happens in a few threads, and the results are then put into the
+ * overall checksum in the same order as before.
  */
 
-static gboolean   package_walk_directory   (GChecksum *checksum,
+typedef struct {
+  gchar *path;
+  gchar *filename;
+  guint64 dev;
+  guint64 ino;
+  guint64 size;
+  guint64 mtime;
+  guint64 mtime_nsec;
+  guint64 ctime;
+  guint64 ctime_nsec;
+  gchar *digest;
+} FileDigest;
+
+/* At most this many threads hash files or scan packages */
+#define MAX_THREADS 8
+
+static gboolean   package_walk_directory   (GPtrArray *digests,
                                             GHashTable *paths,
                                             const gchar *root,
                                             const gchar *directory);
@@ -129,18 +192,27 @@ validate_path (const gchar *name)
   return len && name[len] == '\0';
 }
 
+static void
+file_digest_free (gpointer data)
+{
+  FileDigest *fd = data;
+  g_free (fd->path);
+  g_free (fd->filename);
+  g_free (fd->digest);
+  g_slice_free (FileDigest, fd);
+}
+
 static gboolean
-package_walk_file (GChecksum *checksum,
+package_walk_file (GPtrArray *digests,
                    GHashTable *paths,
                    const gchar *root,
                    const gchar *filename)
 {
   gchar *path = NULL;
-  gchar *string = NULL;
-  GError *error = NULL;
-  GMappedFile *mapped = NULL;
   gboolean ret = FALSE;
-  GBytes *bytes;
+  FileDigest *fd;
+  struct stat st;
+  int file;
 
   /* Skip invalid files: we refuse to serve them (below) */
   if (!validate_path (filename))
@@ -153,33 +225,34 @@ package_walk_file (GChecksum *checksum,
   path = g_build_filename (root, filename, NULL);
   if (g_file_test (path, G_FILE_TEST_IS_DIR))
     {
-      ret = package_walk_directory (checksum, paths, root, filename);
+      ret = package_walk_directory (digests, paths, root, filename);
       goto out;
     }
 
-  mapped = g_mapped_file_new (path, FALSE, &error);
-  if (error)
+  /* The file is hashed later, but must be readable now */
+  file = open (path, O_RDONLY | O_CLOEXEC);
+  if (file < 0 || fstat (file, &st) < 0)
     {
-      g_warning ("couldn't open file: %s: %s", path, error->message);
-      g_error_free (error);
+      g_warning ("couldn't open file: %s: %s", path, g_strerror (errno));
+      if (file >= 0)
+        close (file);
       goto out;
     }
+  close (file);
 
-  if (checksum)
+  if (digests)
     {
-      bytes = g_mapped_file_get_bytes (mapped);
-      string = g_compute_checksum_for_bytes (G_CHECKSUM_SHA1, bytes);
-      g_bytes_unref (bytes);
-
-      /*
-       * Place file name and hex checksum into checksum,
-       * include the null terminators so these values
-       * cannot be accidentally have a boundary discrepancy.
-       */
-      g_checksum_update (checksum, (const guchar *)filename,
-                         strlen (filename) + 1);
-      g_checksum_update (checksum, (const guchar *)string,
-                         strlen (string) + 1);
+      fd = g_slice_new0 (FileDigest);
+      fd->path = g_strdup (path);
+      fd->filename = g_strdup (filename);
+      fd->dev = st.st_dev;
+      fd->ino = st.st_ino;
+      fd->size = st.st_size;
+      fd->mtime = st.st_mtim.tv_sec;
+      fd->mtime_nsec = st.st_mtim.tv_nsec;
+      fd->ctime = st.st_ctim.tv_sec;
+      fd->ctime_nsec = st.st_ctim.tv_nsec;
+      g_ptr_array_add (digests, fd);
     }
 
   if (paths)
@@ -191,9 +264,6 @@ package_walk_file (GChecksum *checksum,
   ret = TRUE;
 
 out:
-  if (mapped)
-    g_mapped_file_unref (mapped);
-  g_free (string);
   g_free (path);
   return ret;
 }
@@ -243,7 +313,7 @@ directory_filenames (const char *directory)
 }
 
 static gboolean
-package_walk_directory (GChecksum *checksum,
+package_walk_directory (GPtrArray *digests,
                         GHashTable *paths,
                         const gchar *root,
                         const gchar *directory)
@@ -266,7 +336,7 @@ package_walk_directory (GChecksum *checksum,
         filename = g_build_filename (directory, names[i], NULL);
       else
         filename = g_strdup (names[i]);
-      ret = package_walk_file (checksum, paths, root, filename);
+      ret = package_walk_file (digests, paths, root, filename);
       g_free (filename);
       if (!ret)
         goto out;
@@ -576,46 +646,124 @@ calc_package_directory (JsonObject *manifest,
     }
 }
 
-static CockpitPackage *
-maybe_add_package (GHashTable *listing,
-                   const gchar *parent,
-                   const gchar *name,
-                   GChecksum *checksum,
-                   gboolean system)
+/* Calls func for each of items, in a few threads when there are several */
+static void
+run_in_threads (GFunc func,
+                GPtrArray *items)
+{
+  GThreadPool *pool = NULL;
+  GError *error = NULL;
+  glong threads;
+  guint i;
+
+  threads = sysconf (_SC_NPROCESSORS_ONLN);
+  threads = CLAMP (threads, 1, MAX_THREADS);
+  threads = MIN (threads, (glong)items->len);
+
+  if (threads > 1)
+    {
+      pool = g_thread_pool_new (func, NULL, threads, FALSE, &error);
+      if (!pool)
+        {
+          g_debug ("couldn't start threads for packages: %s", error->message);
+          g_clear_error (&error);
+        }
+    }
+
+  for (i = 0; i < items->len; i++)
+    {
+      if (pool)
+        g_thread_pool_push (pool, items->pdata[i], NULL);
+      else
+        func (items->pdata[i], NULL);
+    }
+
+  /* Waits for all of them to be done */
+  if (pool)
+    g_thread_pool_free (pool, FALSE, TRUE);
+}
+
+/*
+ * Reading the manifests and walking the files of packages is slow on
+ * network filesystems, such as NFS home directories, when done one file
+ * at a time. So the packages in a directory are each scanned in a few
+ * threads, and then added to the listing in order, as before. Where two
+ * have the same name, the first wins.
+ */
+
+typedef struct {
+  gchar *parent;
+  gchar *name;
+  gboolean system;
+  gboolean walk;
+
+  /* Filled in by scan_package() */
+  CockpitPackage *package;
+  GPtrArray *digests;
+} PackageScan;
+
+static PackageScan *
+package_scan_new (const gchar *parent,
+                  const gchar *name,
+                  gboolean system,
+                  gboolean walk)
 {
+  PackageScan *scan = g_slice_new0 (PackageScan);
+  scan->parent = g_strdup (parent);
+  scan->name = g_strdup (name);
+  scan->system = system;
+  scan->walk = walk;
+  return scan;
+}
+
+static void
+package_scan_free (gpointer data)
+{
+  PackageScan *scan = data;
+  g_free (scan->parent);
+  g_free (scan->name);
+  if (scan->package)
+    cockpit_package_free (scan->package);
+  if (scan->digests)
+    g_ptr_array_free (scan->digests, TRUE);
+  g_slice_free (PackageScan, scan);
+}
+
+static void
+scan_package (gpointer data,
+              gpointer unused)
+{
+  PackageScan *scan = data;
   CockpitPackage *package = NULL;
   gchar *path = NULL;
   gchar *directory = NULL;
   JsonObject *manifest = NULL;
   GHashTable *paths = NULL;
+  const gchar *name;
 
-  path = g_build_filename (parent, name, NULL);
+  path = g_build_filename (scan->parent, scan->name, NULL);
 
-  manifest = read_package_manifest (path, name);
+  manifest = read_package_manifest (path, scan->name);
   if (!manifest)
     goto out;
 
   /* Manifest could specify a different name */
-  name = read_package_name (manifest, name);
+  name = read_package_name (manifest, scan->name);
   if (!name)
     goto out;
 
-  /* In case the package is already present */
-  package = g_hash_table_lookup (listing, name);
-  if (package)
-    {
-      package = NULL;
-      goto out;
-    }
-
   directory = calc_package_directory (manifest, name, path);
+  if (!directory)
+    goto out;
 
-  if (system)
+  if (scan->system)
     paths = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  if (scan->walk)
+    scan->digests = g_ptr_array_new_with_free_func (file_digest_free);
 
-  if (checksum || paths)
+  if (scan->digests || paths)
     {
-      if (!package_walk_directory (checksum, paths, directory, NULL))
+      if (!package_walk_directory (scan->digests, paths, directory, NULL))
         goto out;
     }
 
@@ -633,8 +781,7 @@ maybe_add_package (GHashTable *listing,
       goto out;
     }
 
-  g_hash_table_replace (listing, package->name, package);
-  g_debug ("%s: added package at %s", package->name, package->directory);
+  scan->package = package;
 
 out:
   g_free (directory);
@@ -643,41 +790,498 @@ out:
     json_object_unref (manifest);
   if (paths)
     g_hash_table_unref (paths);
+}
 
-  return package;
+/* Returns whether any were added */
+static gboolean
+add_packages (GHashTable *listing,
+              GPtrArray *scans,
+              GPtrArray *digests)
+{
+  gboolean added = FALSE;
+  PackageScan *scan;
+  guint i, j;
+
+  run_in_threads (scan_package, scans);
+
+  for (i = 0; i < scans->len; i++)
+    {
+      scan = scans->pdata[i];
+
+      /* In case the package is already present */
+      if (!scan->package || g_hash_table_lookup (listing, scan->package->name))
+        continue;
+
+      g_hash_table_replace (listing, scan->package->name, scan->package);
+      g_debug ("%s: added package at %s", scan->package->name, scan->package->directory);
+      scan->package = NULL;
+      added = TRUE;
+
+      if (digests && scan->digests)
+        {
+          for (j = 0; j < scan->digests->len; j++)
+            g_ptr_array_add (digests, scan->digests->pdata[j]);
+          g_ptr_array_set_free_func (scan->digests, NULL);
+        }
+    }
+
+  return added;
 }
 
 static gboolean
-build_package_listing (GHashTable *listing,
-                       GChecksum *checksum)
+parse_digest_entry (gchar **fields,
+                    FileDigest *fd)
 {
-  const gchar *const *directories;
-  gchar *directory = NULL;
-  gchar **packages;
-  gint i, j;
+  guint64 *values[] = { &fd->dev, &fd->ino, &fd->size, &fd->mtime, &fd->mtime_nsec,
+                        &fd->ctime, &fd->ctime_nsec };
+  gchar *end;
+  guint i;
 
-  /* User package directory: no checksums */
-  if (!cockpit_bridge_data_dirs)
-    directory = g_build_filename (g_get_user_data_dir (), "cockpit", NULL);
-  if (directory && g_file_test (directory, G_FILE_TEST_IS_DIR))
+  for (i = 0; i < G_N_ELEMENTS (values); i++)
     {
-      packages = directory_filenames (directory);
-      for (j = 0; packages[j] != NULL; j++)
+      *(values[i]) = g_ascii_strtoull (fields[i + 1], &end, 10);
+      if (end == fields[i + 1] || *end != '\0')
+        return FALSE;
+    }
+
+  /* A hex SHA1 */
+  if (strlen (fields[8]) != 40 || strspn (fields[8], "0123456789abcdef") != 40)
+    return FALSE;
+
+  fd->path = g_strdup (fields[0]);
+  fd->digest = g_strdup (fields[8]);
+  return TRUE;
+}
+
+static GHashTable *
+load_digest_cache (const gchar *filename)
+{
+  GHashTable *cache;
+  gchar *contents;
+  gchar **lines;
+  gchar **fields;
+  FileDigest *fd;
+  gint i;
+
+  cache = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, file_digest_free);
+
+  if (!g_file_get_contents (filename, &contents, NULL, NULL))
+    return cache;
+
+  lines = g_strsplit (contents, "\n", -1);
+  for (i = 0; lines[i] != NULL; i++)
+    {
+      fields = g_strsplit (lines[i], "\t", 9);
+      if (g_strv_length (fields) == 9)
         {
-          /* If any user packages installed, no checksum */
-          if (maybe_add_package (listing, directory, packages[j], checksum, FALSE))
-            checksum = NULL;
+          fd = g_slice_new0 (FileDigest);
+          if (parse_digest_entry (fields, fd))
+            g_hash_table_replace (cache, fd->path, fd);
+          else
+            file_digest_free (fd);
         }
-      g_strfreev (packages);
+      g_strfreev (fields);
     }
-  g_free (directory);
 
-  /* System package directories */
+  g_strfreev (lines);
+  g_free (contents);
+  return cache;
+}
+
+static void
+save_digest_cache (const gchar *filename,
+                   GPtrArray *digests)
+{
+  GError *error = NULL;
+  FileDigest *fd;
+  GString *out;
+  gchar *dir;
+  guint i;
+
+  out = g_string_new ("");
+  for (i = 0; i < digests->len; i++)
+    {
+      fd = digests->pdata[i];
+      if (!fd->digest || strpbrk (fd->path, "\t\n"))
+        continue;
+      g_string_append_printf (out, "%s\t%" G_GUINT64_FORMAT "\t%" G_GUINT64_FORMAT
+                              "\t%" G_GUINT64_FORMAT "\t%" G_GUINT64_FORMAT "\t%" G_GUINT64_FORMAT
+                              "\t%" G_GUINT64_FORMAT "\t%" G_GUINT64_FORMAT "\t%s\n",
+                              fd->path, fd->dev, fd->ino, fd->size, fd->mtime, fd->mtime_nsec,
+                              fd->ctime, fd->ctime_nsec, fd->digest);
+    }
+
+  dir = g_path_get_dirname (filename);
+  if (g_mkdir_with_parents (dir, 0700) < 0)
+    g_debug ("couldn't create cache directory: %s: %s", dir, g_strerror (errno));
+  else if (!g_file_set_contents (filename, out->str, out->len, &error))
+    g_debug ("couldn't write package digest cache: %s", error->message);
+
+  g_clear_error (&error);
+  g_string_free (out, TRUE);
+  g_free (dir);
+}
+
+static void
+compute_digest (gpointer data,
+                gpointer user_data)
+{
+  FileDigest *fd = data;
+  GError *error = NULL;
+  GMappedFile *mapped;
+  GBytes *bytes;
+
+  mapped = g_mapped_file_new (fd->path, FALSE, &error);
+  if (error)
+    {
+      g_warning ("couldn't open file: %s: %s", fd->path, error->message);
+      g_error_free (error);
+      return;
+    }
+
+  bytes = g_mapped_file_get_bytes (mapped);
+  fd->digest = g_compute_checksum_for_bytes (G_CHECKSUM_SHA1, bytes);
+  g_bytes_unref (bytes);
+  g_mapped_file_unref (mapped);
+}
+
+static gchar *
+calculate_checksum (GPtrArray *digests,
+                    const gchar *filename)
+{
+  GHashTable *cache;
+  GPtrArray *missing;
+  GChecksum *checksum;
+  FileDigest *cached;
+  FileDigest *fd;
+  gchar *result;
+  guint i;
+
+  if (filename)
+    cache = load_digest_cache (filename);
+  else
+    cache = g_hash_table_new (g_str_hash, g_str_equal);
+
+  missing = g_ptr_array_new ();
+  for (i = 0; i < digests->len; i++)
+    {
+      fd = digests->pdata[i];
+      cached = g_hash_table_lookup (cache, fd->path);
+      if (cached && cached->dev == fd->dev && cached->ino == fd->ino &&
+          cached->size == fd->size && cached->mtime == fd->mtime &&
+          cached->mtime_nsec == fd->mtime_nsec && cached->ctime == fd->ctime &&
+          cached->ctime_nsec == fd->ctime_nsec)
+        fd->digest = g_strdup (cached->digest);
+      else
+        g_ptr_array_add (missing, fd);
+    }
+
+  run_in_threads (compute_digest, missing);
+
+  g_debug ("hashed %u of %u package files", missing->len, digests->len);
+
+  /* Also rewrite the cache when files have gone away */
+  if (filename && (missing->len > 0 || g_hash_table_size (cache) != digests->len))
+    save_digest_cache (filename, digests);
+
+  checksum = g_checksum_new (G_CHECKSUM_SHA1);
+  for (i = 0; i < digests->len; i++)
+    {
+      fd = digests->pdata[i];
+      if (!fd->digest)
+        continue;
+
+      /*
+       * Place file name and hex checksum into checksum,
+       * include the null terminators so these values
+       * cannot be accidentally have a boundary discrepancy.
+       */
+      g_checksum_update (checksum, (const guchar *)fd->filename,
+                         strlen (fd->filename) + 1);
+      g_checksum_update (checksum, (const guchar *)fd->digest,
+                         strlen (fd->digest) + 1);
+    }
+
+  result = g_strdup (g_checksum_get_string (checksum));
+  g_checksum_free (checksum);
+
+  g_ptr_array_free (missing, TRUE);
+  g_hash_table_destroy (cache);
+  return result;
+}
+
+static const gchar *const *
+system_data_dirs (void)
+{
   if (cockpit_bridge_data_dirs)
-    directories = cockpit_bridge_data_dirs;
+    return cockpit_bridge_data_dirs;
   else
-    directories = g_get_system_data_dirs ();
+    return g_get_system_data_dirs ();
+}
+
+/*
+ * The package index holds the listing of the system packages and their
+ * checksum, so a bridge doesn't have to read every manifest and hash
+ * every file. It's written by 'cockpit-bridge --packages-index' after
+ * packages are installed.
+ *
+ * The index is only used when none of the directories it was built from
+ * changed since. Packages are installed by renaming files into place,
+ * which changes the directory.
+ */
+
+#define PACKAGE_INDEX_VERSION 1
+
+static JsonNode *
+directory_stamp (const gchar *path)
+{
+  JsonNode *node;
+  JsonArray *array;
+  struct stat st;
+
+  if (stat (path, &st) < 0)
+    return json_node_new (JSON_NODE_NULL);
+
+  array = json_array_new ();
+  json_array_add_int_element (array, st.st_mtim.tv_sec);
+  json_array_add_int_element (array, st.st_mtim.tv_nsec);
+  node = json_node_new (JSON_NODE_ARRAY);
+  json_node_take_array (node, array);
+  return node;
+}
+
+static void
+add_directory_stamps (JsonObject *stamps,
+                      const gchar *directory)
+{
+  gchar **names;
+  gchar *path;
+  gint i;
+
+  if (json_object_has_member (stamps, directory))
+    return;
+
+  json_object_set_member (stamps, directory, directory_stamp (directory));
+
+  names = directory_filenames (directory);
+  for (i = 0; names && names[i] != NULL; i++)
+    {
+      path = g_build_filename (directory, names[i], NULL);
+      if (g_file_test (path, G_FILE_TEST_IS_DIR))
+        add_directory_stamps (stamps, path);
+      g_free (path);
+    }
+  g_strfreev (names);
+}
+
+static gboolean
+check_directory_stamps (JsonObject *stamps)
+{
+  gboolean ret = TRUE;
+  JsonNode *current;
+  GList *paths, *l;
+
+  paths = json_object_get_members (stamps);
+  for (l = paths; ret && l != NULL; l = g_list_next (l))
+    {
+      current = directory_stamp (l->data);
+      ret = cockpit_json_equal (json_object_get_member (stamps, l->data), current);
+      if (!ret)
+        g_debug ("package index is out of date: %s changed", (gchar *)l->data);
+      json_node_free (current);
+    }
 
+  g_list_free (paths);
+  return ret;
+}
+
+static JsonObject *
+read_package_index (void)
+{
+  JsonObject *index = NULL;
+  GError *error = NULL;
+  GMappedFile *mapped;
+  struct stat st;
+  GBytes *bytes;
+  int fd;
+
+  fd = open (cockpit_bridge_packages_index, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    {
+      if (errno != ENOENT)
+        g_message ("couldn't open package index: %s: %s", cockpit_bridge_packages_index, g_strerror (errno));
+      return NULL;
+    }
+
+  /* Only trust an index that nobody else could have written */
+  if (fstat (fd, &st) < 0 || (st.st_uid != 0 && st.st_uid != geteuid ()) || (st.st_mode & 022))
+    {
+      g_message ("ignoring package index with bad permissions: %s", cockpit_bridge_packages_index);
+      close (fd);
+      return NULL;
+    }
+
+  mapped = g_mapped_file_new_from_fd (fd, FALSE, &error);
+  close (fd);
+
+  if (mapped)
+    {
+      bytes = g_mapped_file_get_bytes (mapped);
+      index = cockpit_json_parse_bytes (bytes, &error);
+      g_bytes_unref (bytes);
+      g_mapped_file_unref (mapped);
+    }
+
+  if (error)
+    {
+      g_message ("couldn't read package index: %s: %s", cockpit_bridge_packages_index, error->message);
+      g_error_free (error);
+    }
+
+  return index;
+}
+
+static CockpitPackage *
+package_from_index (const gchar *name,
+                    JsonObject *object)
+{
+  CockpitPackage *package;
+  JsonObject *manifest;
+  const gchar *directory;
+  const gchar *policy;
+  gchar **paths = NULL;
+  gint i;
+
+  if (!validate_package (name) ||
+      !cockpit_json_get_string (object, "directory", NULL, &directory) || !directory ||
+      !cockpit_json_get_string (object, "content-security-policy", NULL, &policy) ||
+      !cockpit_json_get_object (object, "manifest", NULL, &manifest) || !manifest ||
+      !cockpit_json_get_strv (object, "paths", NULL, &paths) || !paths)
+    {
+      g_message ("%s: invalid package in package index", name);
+      g_free (paths);
+      return NULL;
+    }
+
+  package = cockpit_package_new (name);
+  package->directory = g_strdup (directory);
+  package->paths = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  for (i = 0; paths[i] != NULL; i++)
+    g_hash_table_add (package->paths, g_strdup (paths[i]));
+  g_free (paths);
+
+  /* The policy was already completed when the index was written, but needs a new key */
+  if (!setup_content_security_policy (package, policy))
+    {
+      cockpit_package_free (package);
+      return NULL;
+    }
+
+  package->manifest = json_object_ref (manifest);
+  return package;
+}
+
+static gboolean
+load_package_index (GHashTable *listing,
+                    gchar **checksum)
+{
+  const gchar *const *directories;
+  CockpitPackage *package;
+  JsonObject *packages;
+  JsonObject *stamps;
+  JsonObject *index;
+  GHashTable *loaded;
+  GHashTableIter iter;
+  const gchar *value;
+  gchar **dirs = NULL;
+  JsonObject *object;
+  gboolean ret = FALSE;
+  gint64 version;
+  GList *names = NULL, *l;
+  gint i;
+
+  index = read_package_index ();
+  if (!index)
+    return FALSE;
+
+  loaded = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, cockpit_package_free);
+
+  if (!cockpit_json_get_int (index, "version", 0, &version) || version != PACKAGE_INDEX_VERSION ||
+      !cockpit_json_get_strv (index, "data-dirs", NULL, &dirs) || !dirs ||
+      !cockpit_json_get_object (index, "directories", NULL, &stamps) || !stamps ||
+      !cockpit_json_get_object (index, "packages", NULL, &packages) || !packages ||
+      !cockpit_json_get_string (index, "checksum", NULL, &value))
+    {
+      g_message ("ignoring invalid package index: %s", cockpit_bridge_packages_index);
+      goto out;
+    }
+
+  /* Built for a different set of directories */
+  directories = system_data_dirs ();
+  if (g_strv_length ((gchar **)directories) != g_strv_length (dirs))
+    goto out;
+  for (i = 0; dirs[i] != NULL; i++)
+    {
+      if (!g_str_equal (directories[i], dirs[i]))
+        goto out;
+    }
+
+  if (!check_directory_stamps (stamps))
+    goto out;
+
+  names = json_object_get_members (packages);
+  for (l = names; l != NULL; l = g_list_next (l))
+    {
+      if (!cockpit_json_get_object (packages, l->data, NULL, &object) || !object)
+        {
+          g_message ("%s: invalid package in package index", (gchar *)l->data);
+          goto out;
+        }
+      package = package_from_index (l->data, object);
+      if (!package)
+        goto out;
+      g_hash_table_replace (loaded, package->name, package);
+    }
+
+  /* User packages come first and win */
+  g_hash_table_iter_init (&iter, loaded);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&package))
+    {
+      g_hash_table_iter_steal (&iter);
+      if (g_hash_table_lookup (listing, package->name))
+        {
+          cockpit_package_free (package);
+          continue;
+        }
+      g_hash_table_replace (listing, package->name, package);
+      g_debug ("%s: added package at %s from index", package->name, package->directory);
+    }
+
+  if (checksum)
+    *checksum = g_strdup (value);
+  ret = TRUE;
+
+out:
+  g_list_free (names);
+  g_hash_table_unref (loaded);
+  json_object_unref (index);
+  g_free (dirs);
+  return ret;
+}
+
+static void
+build_system_listing (GHashTable *listing,
+                      GPtrArray *digests)
+{
+  const gchar *const *directories;
+  gchar *directory = NULL;
+  gchar **packages;
+  GPtrArray *scans;
+  gint i, j;
+
+  scans = g_ptr_array_new_with_free_func (package_scan_free);
+
+  directories = system_data_dirs ();
   for (i = 0; directories[i] != NULL; i++)
     {
       directory = g_build_filename (directories[i], "cockpit", NULL);
@@ -685,13 +1289,49 @@ build_package_listing (GHashTable *listing,
         {
           packages = directory_filenames (directory);
           for (j = 0; packages && packages[j] != NULL; j++)
-            maybe_add_package (listing, directory, packages[j], checksum, TRUE);
+            g_ptr_array_add (scans, package_scan_new (directory, packages[j], TRUE, digests != NULL));
           g_strfreev (packages);
         }
       g_free (directory);
     }
 
-  return checksum != NULL;
+  add_packages (listing, scans, digests);
+  g_ptr_array_free (scans, TRUE);
+}
+
+static gboolean
+build_package_listing (GHashTable *listing,
+                       GPtrArray *digests,
+                       gchar **checksum)
+{
+  gchar *directory = NULL;
+  gchar **packages;
+  GPtrArray *scans;
+  gint j;
+
+  /* User package directory: no checksums */
+  if (!cockpit_bridge_data_dirs)
+    directory = g_build_filename (g_get_user_data_dir (), "cockpit", NULL);
+  if (directory && g_file_test (directory, G_FILE_TEST_IS_DIR))
+    {
+      scans = g_ptr_array_new_with_free_func (package_scan_free);
+      packages = directory_filenames (directory);
+      for (j = 0; packages && packages[j] != NULL; j++)
+        g_ptr_array_add (scans, package_scan_new (directory, packages[j], FALSE, FALSE));
+      g_strfreev (packages);
+
+      /* If any user packages installed, no checksum */
+      if (add_packages (listing, scans, NULL))
+        digests = NULL;
+      g_ptr_array_free (scans, TRUE);
+    }
+  g_free (directory);
+
+  /* System package directories */
+  if (!load_package_index (listing, digests ? checksum : NULL))
+    build_system_listing (listing, digests);
+
+  return digests != NULL;
 }
 
 static void
@@ -699,17 +1339,22 @@ build_packages (CockpitPackages *packages)
 {
   JsonObject *root = NULL;
   CockpitPackage *package;
-  GChecksum *checksum;
+  GPtrArray *digests;
+  gchar *filename;
   GList *names, *l;
   const gchar *name;
 
   packages->listing = g_hash_table_new_full (g_str_hash, g_str_equal,
                                              NULL, cockpit_package_free);
 
-  checksum = g_checksum_new (G_CHECKSUM_SHA1);
-  if (build_package_listing (packages->listing, checksum))
-    packages->checksum = g_strdup (g_checksum_get_string (checksum));
-  g_checksum_free (checksum);
+  digests = g_ptr_array_new_with_free_func (file_digest_free);
+  if (build_package_listing (packages->listing, digests, &packages->checksum) && !packages->checksum)
+    {
+      filename = g_build_filename (g_get_user_cache_dir (), "cockpit", "package-digests", NULL);
+      packages->checksum = calculate_checksum (digests, filename);
+      g_free (filename);
+    }
+  g_ptr_array_free (digests, TRUE);
 
   /* Build JSON packages block */
   packages->json = root = json_object_new ();
@@ -789,6 +1434,48 @@ handle_package_checksum (CockpitWebServer *server,
   return TRUE;
 }
 
+static void
+respond_manifests (CockpitPackages *packages,
+                   GHashTable *headers,
+                   CockpitWebResponse *response,
+                   GBytes *plain,
+                   GBytes **compressed)
+{
+  GHashTable *out_headers;
+  GError *error = NULL;
+  GBytes *content = plain;
+
+  out_headers = cockpit_web_server_new_table ();
+
+  /* Only when asked for, a missing Accept-Encoding doesn't mean gzip is fine here */
+  if (g_hash_table_lookup (headers, "Accept-Encoding") &&
+      cockpit_web_server_parse_encoding (headers, "gzip"))
+    {
+      if (!*compressed)
+        {
+          *compressed = cockpit_web_response_gzip (plain, &error);
+          if (error)
+            {
+              g_message ("couldn't compress manifests: %s", error->message);
+              g_clear_error (&error);
+            }
+        }
+      if (*compressed)
+        {
+          content = *compressed;
+          g_hash_table_insert (out_headers, g_strdup ("Content-Encoding"), g_strdup ("gzip"));
+        }
+      g_hash_table_insert (out_headers, g_strdup ("Vary"), g_strdup ("Accept-Encoding"));
+    }
+
+  /* With a checksum cockpit-ws uses it as the ETag of the manifests */
+  if (!packages->checksum)
+    cockpit_web_response_set_cache_type (response, COCKPIT_WEB_RESPONSE_NO_CACHE);
+
+  cockpit_web_response_content (response, out_headers, content, NULL);
+  g_hash_table_unref (out_headers);
+}
+
 static gboolean
 handle_package_manifests_js (CockpitWebServer *server,
                              const gchar *path,
@@ -800,26 +1487,24 @@ handle_package_manifests_js (CockpitWebServer *server,
     "(function (root, data) { if (typeof define === 'function' && define.amd) { define(data); }"
     " if(typeof cockpit === 'object') { cockpit.manifests = data; }"
     " else { root.manifests = data; } }(this, ";
-  GHashTable *out_headers;
   GBytes *content;
-  GBytes *prefix;
-  GBytes *suffix;
-
-  prefix = g_bytes_new_static (template, strlen (template));
-  content = cockpit_json_write_bytes (packages->json);
-  suffix = g_bytes_new_static ("));", 3);
-
-  out_headers = cockpit_web_server_new_table ();
-
-  if (!packages->checksum)
-    cockpit_web_response_set_cache_type (response, COCKPIT_WEB_RESPONSE_NO_CACHE);
+  GString *string;
+  gconstpointer data;
+  gsize length;
 
-  cockpit_web_response_content (response, out_headers, prefix, content, suffix, NULL);
+  if (!packages->manifests_js)
+    {
+      content = cockpit_json_write_bytes (packages->json);
+      data = g_bytes_get_data (content, &length);
+      string = g_string_sized_new (strlen (template) + length + 3);
+      g_string_append (string, template);
+      g_string_append_len (string, data, length);
+      g_string_append (string, "));");
+      packages->manifests_js = g_string_free_to_bytes (string);
+      g_bytes_unref (content);
+    }
 
-  g_hash_table_unref (out_headers);
-  g_bytes_unref (prefix);
-  g_bytes_unref (suffix);
-  g_bytes_unref (content);
+  respond_manifests (packages, headers, response, packages->manifests_js, &packages->manifests_js_gz);
   return TRUE;
 }
 
@@ -830,22 +1515,104 @@ handle_package_manifests_json (CockpitWebServer *server,
                                CockpitWebResponse *response,
                                CockpitPackages *packages)
 {
-  GHashTable *out_headers;
-  GBytes *content;
+  if (!packages->manifests_json)
+    packages->manifests_json = cockpit_json_write_bytes (packages->json);
 
-  out_headers = cockpit_web_server_new_table ();
+  respond_manifests (packages, headers, response, packages->manifests_json, &packages->manifests_json_gz);
+  return TRUE;
+}
 
-  content = cockpit_json_write_bytes (packages->json);
+static void
+negotiated_resource_free (gpointer data)
+{
+  NegotiatedResource *resource = data;
+  if (resource->bytes)
+    g_bytes_unref (resource->bytes);
+  g_free (resource->chosen);
+  g_slice_free (NegotiatedResource, resource);
+}
 
-  if (!packages->checksum)
-    cockpit_web_response_set_cache_type (response, COCKPIT_WEB_RESPONSE_NO_CACHE);
+/* Returns bytes, or the mapping already kept for the same file */
+static GBytes *
+share_mapped_file (CockpitPackages *packages,
+                   const gchar *chosen,
+                   GBytes *bytes)
+{
+  GBytes *shared;
+  gsize size;
 
-  cockpit_web_response_content (response, out_headers, content, NULL);
+  shared = g_hash_table_lookup (packages->mapped, chosen);
+  if (shared)
+    {
+      g_bytes_unref (bytes);
+      return g_bytes_ref (shared);
+    }
 
-  g_hash_table_unref (out_headers);
-  g_bytes_unref (content);
+  size = g_bytes_get_size (bytes);
+  if (size <= MAPPED_MAX_FILE && packages->mapped_size + size <= MAPPED_MAX_TOTAL)
+    {
+      g_hash_table_replace (packages->mapped, g_strdup (chosen), g_bytes_ref (bytes));
+      packages->mapped_size += size;
+    }
 
-  return TRUE;
+  return bytes;
+}
+
+static GBytes *
+negotiate_resource (CockpitPackages *packages,
+                    const gchar *name,
+                    const gchar *path,
+                    const gchar *language,
+                    CockpitPackage **package,
+                    gchar **chosen,
+                    GError **error)
+{
+  NegotiatedResource *resource;
+  CockpitPackage *found = NULL;
+  gchar *filename;
+  GBytes *bytes = NULL;
+  gchar *key = NULL;
+
+  if (packages->negotiated)
+    {
+      key = g_strdup_printf ("%s\n%s\n%s", name, path, language ? language : "");
+      resource = g_hash_table_lookup (packages->negotiated, key);
+      if (resource)
+        {
+          g_free (key);
+          *package = resource->package;
+          *chosen = g_strdup (resource->chosen);
+          return resource->bytes ? g_bytes_ref (resource->bytes) : NULL;
+        }
+    }
+
+  filename = cockpit_packages_resolve (packages, name, path, &found);
+  if (filename)
+    bytes = cockpit_web_response_negotiation (filename, found->paths, language, chosen, error);
+  g_free (filename);
+
+  /* Errors such as access denied might be temporary, so aren't kept */
+  if (key && !(error && *error))
+    {
+      if (bytes)
+        bytes = share_mapped_file (packages, *chosen, bytes);
+
+      /* Only kept when the file is, so it's not mapped for each entry */
+      if (g_hash_table_size (packages->negotiated) < NEGOTIATED_MAX_ENTRIES &&
+          (!bytes || g_hash_table_lookup (packages->mapped, *chosen) == bytes))
+        {
+          resource = g_slice_new0 (NegotiatedResource);
+          resource->package = found;
+          resource->bytes = bytes ? g_bytes_ref (bytes) : NULL;
+          resource->chosen = g_strdup (*chosen);
+          g_hash_table_replace (packages->negotiated, key, resource);
+          key = NULL;
+        }
+    }
+
+  g_free (key);
+  *package = found;
+  return bytes;
 }
 
 static gboolean
@@ -857,7 +1624,6 @@ handle_packages (CockpitWebServer *server,
 {
   CockpitPackage *package;
   CockpitWebFilter *inject;
-  gchar *filename = NULL;
   GError *error = NULL;
   gchar *name;
   const gchar *path;
@@ -880,16 +1646,9 @@ handle_packages (CockpitWebServer *server,
 
   out_headers = cockpit_web_server_new_table ();
 
-  filename = cockpit_packages_resolve (packages, name, path, &package);
-  if (!filename)
-    {
-      cockpit_web_response_error (response, 404, NULL, NULL);
-      goto out;
-    }
-
   languages = cockpit_web_server_parse_languages (headers, NULL);
 
-  bytes = cockpit_web_response_negotiation (filename, package->paths, languages[0], &chosen, &error);
+  bytes = negotiate_resource (packages, name, path, languages[0], &package, &chosen, &error);
   if (error)
     {
       if (g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_ACCES) ||
@@ -958,7 +1717,6 @@ out:
   g_free (name);
   g_free (chosen);
   g_clear_error (&error);
-  g_free (filename);
   return TRUE;
 }
 
@@ -1031,6 +1789,14 @@ cockpit_packages_new (void)
                     G_CALLBACK (handle_packages), packages);
 
   build_packages (packages);
+  if (packages->checksum)
+    {
+      packages->negotiated = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                    g_free, negotiated_resource_free);
+      packages->mapped = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                g_free, (GDestroyNotify)g_bytes_unref);
+    }
+  cockpit_memory_add_reporter (COCKPIT_STAT_MEMORY_PACKAGES, report_memory, packages);
   ret = TRUE;
 
 out:
@@ -1047,6 +1813,25 @@ out:
   return packages;
 }
 
+static gsize
+bytes_size (GBytes *bytes)
+{
+  return bytes ? g_bytes_get_size (bytes) : 0;
+}
+
+/* The serialized manifests and the files mapped for negotiated resources, the rest is small */
+static gsize
+report_memory (gpointer user_data)
+{
+  CockpitPackages *packages = user_data;
+
+  return bytes_size (packages->manifests_js) +
+         bytes_size (packages->manifests_js_gz) +
+         bytes_size (packages->manifests_json) +
+         bytes_size (packages->manifests_json_gz) +
+         packages->mapped_size;
+}
+
 const gchar *
 cockpit_packages_get_checksum (CockpitPackages *packages)
 {
@@ -1059,9 +1844,22 @@ cockpit_packages_free (CockpitPackages *packages)
 {
   if (!packages)
     return;
+  cockpit_memory_remove_reporter (report_memory, packages);
   if (packages->json)
     json_object_unref (packages->json);
+  if (packages->manifests_js)
+    g_bytes_unref (packages->manifests_js);
+  if (packages->manifests_js_gz)
+    g_bytes_unref (packages->manifests_js_gz);
+  if (packages->manifests_json)
+    g_bytes_unref (packages->manifests_json);
+  if (packages->manifests_json_gz)
+    g_bytes_unref (packages->manifests_json_gz);
   g_free (packages->checksum);
+  if (packages->negotiated)
+    g_hash_table_unref (packages->negotiated);
+  if (packages->mapped)
+    g_hash_table_unref (packages->mapped);
   if (packages->listing)
     g_hash_table_unref (packages->listing);
   g_clear_object (&packages->web_server);
@@ -1101,3 +1899,96 @@ cockpit_packages_dump (void)
   g_hash_table_unref (by_name);
   cockpit_packages_free (packages);
 }
+
+/**
+ * cockpit_packages_write_index:
+ * @error: location to place an error
+ *
+ * Scan the system package directories and write the package index
+ * that bridges then use instead of scanning themselves. User packages
+ * are not part of the index.
+ *
+ * Returns: whether the index was written
+ */
+gboolean
+cockpit_packages_write_index (GError **error)
+{
+  const gchar *const *directories;
+  CockpitPackage *package;
+  GHashTableIter iter;
+  GPtrArray *digests;
+  GHashTable *listing;
+  JsonObject *index;
+  JsonObject *packages;
+  JsonObject *stamps;
+  JsonObject *object;
+  JsonArray *array;
+  gchar *checksum;
+  gchar *directory;
+  gchar *data;
+  gsize length;
+  gboolean ret;
+  GList *paths, *l;
+  gint i;
+
+  listing = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, cockpit_package_free);
+  digests = g_ptr_array_new_with_free_func (file_digest_free);
+
+  build_system_listing (listing, digests);
+  checksum = calculate_checksum (digests, NULL);
+
+  index = json_object_new ();
+  json_object_set_int_member (index, "version", PACKAGE_INDEX_VERSION);
+  json_object_set_string_member (index, "checksum", checksum);
+
+  /* Stamps for everything that could change the listing */
+  stamps = json_object_new ();
+  array = json_array_new ();
+  directories = system_data_dirs ();
+  for (i = 0; directories[i] != NULL; i++)
+    {
+      json_array_add_string_element (array, directories[i]);
+      directory = g_build_filename (directories[i], "cockpit", NULL);
+      if (g_file_test (directory, G_FILE_TEST_IS_DIR))
+        add_directory_stamps (stamps, directory);
+      else
+        json_object_set_member (stamps, directory, directory_stamp (directory));
+      g_free (directory);
+    }
+  json_object_set_array_member (index, "data-dirs", array);
+
+  packages = json_object_new ();
+  g_hash_table_iter_init (&iter, listing);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&package))
+    {
+      object = json_object_new ();
+      json_object_set_string_member (object, "directory", package->directory);
+      json_object_set_string_member (object, "content-security-policy", package->content_security_policy);
+      json_object_set_object_member (object, "manifest", json_object_ref (package->manifest));
+
+      array = json_array_new ();
+      paths = g_hash_table_get_keys (package->paths);
+      paths = g_list_sort (paths, (GCompareFunc)strcmp);
+      for (l = paths; l != NULL; l = g_list_next (l))
+        json_array_add_string_element (array, l->data);
+      g_list_free (paths);
+      json_object_set_array_member (object, "paths", array);
+
+      json_object_set_object_member (packages, package->name, object);
+      add_directory_stamps (stamps, package->directory);
+    }
+  json_object_set_object_member (index, "packages", packages);
+  json_object_set_object_member (index, "directories", stamps);
+
+  data = cockpit_json_write_object (index, &length);
+  ret = g_file_set_contents (cockpit_bridge_packages_index, data, length, error);
+  if (ret && chmod (cockpit_bridge_packages_index, 0644) < 0)
+    g_message ("couldn't set permissions on package index: %s", g_strerror (errno));
+
+  g_free (data);
+  g_free (checksum);
+  json_object_unref (index);
+  g_ptr_array_free (digests, TRUE);
+  g_hash_table_unref (listing);
+  return ret;
+}
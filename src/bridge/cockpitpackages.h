@@ -38,4 +38,6 @@ void              cockpit_packages_free             (CockpitPackages *packages);
 
 void              cockpit_packages_dump             (void);
 
+gboolean          cockpit_packages_write_index      (GError **error);
+
 #endif /* COCKPIT_PACKAGES_H_ */
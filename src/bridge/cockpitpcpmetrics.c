@@ -27,7 +27,11 @@
 #include "common/cockpitjson.h"
 
 #include <pcp/pmapi.h>
+#include <sys/stat.h>
+#include <errno.h>
 #include <math.h>
+#include <string.h>
+#include <unistd.h>
 
 /**
  * CockpitPcpMetrics:
@@ -48,13 +52,35 @@ typedef struct {
   gdouble factor;
 
   pmUnits units_buf;
+
+  /* Instances of the last meta sent */
+  int *insts;
+  int n_insts;
 } MetricInfo;
 
 typedef struct {
-  int context;
+  GHashTable *names;     /* instance id -> name */
+  guint fetched;         /* The meta it was last fetched for */
+} InDomInfo;
+
+typedef struct {
+  gchar *path;
+  int context;     /* Only opened when played back */
   gint64 start;
 } ArchiveInfo;
 
+typedef enum {
+  AGGREGATE_NONE,
+  AGGREGATE_MIN,
+  AGGREGATE_MAX,
+  AGGREGATE_AVG,
+} AggregateMode;
+
+typedef struct {
+  double value;
+  gint count;
+} Aggregate;
+
 typedef struct {
   CockpitMetrics parent;
   const gchar *name;
@@ -66,11 +92,33 @@ typedef struct {
   gint64 limit;
   guint idler;
 
+  /* Archive samples read per output sample, and combined how */
+  AggregateMode aggregate;
+  gint64 resolution;
+  gint n_aggregate;
+
+  /* The bucket being combined, laid out like the data buffer */
+  Aggregate *buckets;
+  gint *bucket_offsets;
+  gint n_buckets;
+  gint n_bucket_samples;
+  gint64 bucket_timestamp;
+
+  /* The raw values of the previous archive sample, to derive from */
+  double *raw_samples;
+  gboolean have_raw_samples;
+  gint64 raw_timestamp;
+
   GList *archives;  /* of ArchiveInfo */
   GList *cur_archive;
 
   /* The previous samples sent */
-  pmResult *last;
+  gboolean have_meta;
+  gint64 last_timestamp;
+  guint n_metas;
+
+  /* InDomInfo for each instance domain */
+  GHashTable *indoms;
 } CockpitPcpMetrics;
 
 typedef struct {
@@ -79,40 +127,65 @@ typedef struct {
 
 G_DEFINE_TYPE (CockpitPcpMetrics, cockpit_pcp_metrics, COCKPIT_TYPE_METRICS);
 
+static void
+indom_info_free (gpointer data)
+{
+  InDomInfo *info = data;
+  if (info->names)
+    g_hash_table_unref (info->names);
+  g_free (info);
+}
+
 static void
 cockpit_pcp_metrics_init (CockpitPcpMetrics *self)
 {
   self->direct_context = -1;
+  self->indoms = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, indom_info_free);
+}
+
+static void
+free_metrics (CockpitPcpMetrics *self)
+{
+  int i;
+
+  for (i = 0; self->metrics && i < self->numpmid; i++)
+    g_free (self->metrics[i].insts);
+  g_free (self->metrics);
+  self->metrics = NULL;
 }
 
+/*
+ * Only the instance ids of the last meta are kept, rather than the
+ * whole previous result, so that the result can be freed right away
+ * and the comparison only walks a plain array for each metric.
+ */
 static gboolean
 result_meta_equal (CockpitPcpMetrics *self,
-                   pmResult *r1,
-                   pmResult *r2)
+                   pmResult *result)
 {
-  pmValueSet *vs1;
-  pmValueSet *vs2;
+  MetricInfo *info;
+  pmValueSet *vs;
   int i, j;
 
   /* PCP guarantees that the result ids are same as requested */
-  for (i = 0; i < r1->numpmid; i++)
+  for (i = 0; i < result->numpmid; i++)
     {
+      info = &self->metrics[i];
+
       /* We only care about instanced metrics.
        */
-      if (self->metrics[i].desc.indom == PM_INDOM_NULL)
+      if (info->desc.indom == PM_INDOM_NULL)
         continue;
 
-      vs1 = r1->vset[i];
-      vs2 = r2->vset[i];
-
-      g_assert (vs1 && vs2);
+      vs = result->vset[i];
+      g_assert (vs);
 
-      if (vs1->numval != vs2->numval)
+      if (vs->numval != info->n_insts)
         return FALSE;
 
-      for (j = 0; j < vs1->numval; j++)
+      for (j = 0; j < vs->numval; j++)
         {
-          if (vs1->vlist[j].inst != vs2->vlist[j].inst)
+          if (vs->vlist[j].inst != info->insts[j])
             return FALSE;
         }
     }
@@ -120,6 +193,89 @@ result_meta_equal (CockpitPcpMetrics *self,
   return TRUE;
 }
 
+static void
+remember_instances (CockpitPcpMetrics *self,
+                    pmResult *result)
+{
+  MetricInfo *info;
+  pmValueSet *vs;
+  int i, j;
+
+  for (i = 0; i < result->numpmid; i++)
+    {
+      info = &self->metrics[i];
+      if (info->desc.indom == PM_INDOM_NULL)
+        continue;
+
+      vs = result->vset[i];
+      if (vs->numval > info->n_insts || !info->insts)
+        info->insts = g_renew (int, info->insts, MAX (vs->numval, 1));
+      for (j = 0; j < vs->numval; j++)
+        info->insts[j] = vs->vlist[j].inst;
+      info->n_insts = vs->numval;
+    }
+}
+
+/*
+ * Large instance domains, such as one instance per process, change
+ * often and so need a new meta often. Instead of asking for each
+ * instance name on its own, the names of the whole domain are fetched
+ * in one call, once per meta, and shared by all metrics that use it.
+ */
+static const gchar *
+lookup_instance_name (CockpitPcpMetrics *self,
+                      pmInDom indom,
+                      int inst)
+{
+  InDomInfo *info;
+  const gchar *name;
+  char **namelist;
+  char *instance;
+  int *instlist;
+  int i, n, rc;
+
+  info = g_hash_table_lookup (self->indoms, GUINT_TO_POINTER (indom));
+  if (!info)
+    {
+      info = g_new0 (InDomInfo, 1);
+      g_hash_table_insert (self->indoms, GUINT_TO_POINTER (indom), info);
+    }
+
+  /* Instance ids can be reused, so names don't outlive a meta */
+  if (!info->names || info->fetched != self->n_metas)
+    {
+      info->fetched = self->n_metas;
+      if (info->names)
+        g_hash_table_unref (info->names);
+      info->names = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, g_free);
+
+      n = pmGetInDom (indom, &instlist, &namelist);
+      for (i = 0; i < n; i++)
+        g_hash_table_insert (info->names, GINT_TO_POINTER (instlist[i]), g_strdup (namelist[i]));
+      if (n > 0)
+        {
+          free (instlist);
+          free (namelist);
+        }
+    }
+
+  name = g_hash_table_lookup (info->names, GINT_TO_POINTER (inst));
+  if (name)
+    return name;
+
+  rc = pmNameInDom (indom, inst, &instance);
+  if (rc != 0)
+    {
+      g_warning ("%s: instance name lookup failed: %s", self->name, pmErrStr (rc));
+      return "";
+    }
+
+  name = g_strdup (instance);
+  free (instance);
+  g_hash_table_insert (info->names, GINT_TO_POINTER (inst), (gpointer)name);
+  return name;
+}
+
 static gint64
 timestamp_from_timeval (struct timeval *tv)
 {
@@ -137,10 +293,9 @@ build_meta (CockpitPcpMetrics *self,
   pmValueSet *vs;
   struct timeval now_timeval;
   gint64 timestamp, now;
-  char *instance;
   int i, j;
-  int rc;
 
+  self->n_metas++;
   gettimeofday (&now_timeval, NULL);
 
   timestamp = timestamp_from_timeval (&result->timestamp);
@@ -159,7 +314,7 @@ build_meta (CockpitPcpMetrics *self,
       /* Name and derivation mode
        */
       json_object_set_string_member (metric, "name", self->metrics[i].name);
-      if (self->metrics[i].derive)
+      if (self->metrics[i].derive && self->aggregate == AGGREGATE_NONE)
         json_object_set_string_member (metric, "derive", self->metrics[i].derive);
 
       /* Instances
@@ -176,13 +331,6 @@ build_meta (CockpitPcpMetrics *self,
           for (j = 0; j < vs->numval; j++)
             {
               /* PCP guarantees that the result is in the same order as requested */
-              rc = pmNameInDom (self->metrics[i].desc.indom, vs->vlist[j].inst, &instance);
-              if (rc != 0)
-                {
-                  g_warning ("%s: instance name lookup failed: %s", self->name, pmErrStr (rc));
-                  instance = NULL;
-                }
-
               /* HACK: We can't use json_builder_add_string_value here since
                  it turns empty strings into 'null' values inside arrays.
 
@@ -190,12 +338,11 @@ build_meta (CockpitPcpMetrics *self,
               */
               {
                 JsonNode *string_element = json_node_alloc ();
-                json_node_init_string (string_element, instance? instance : "");
+                json_node_init_string (string_element,
+                                       lookup_instance_name (self, self->metrics[i].desc.indom,
+                                                             vs->vlist[j].inst));
                 json_array_add_element (instances, string_element);
               }
-
-              if (instance)
-                free (instance);
             }
           json_object_set_array_member (metric, "instances", instances);
         }
@@ -240,17 +387,19 @@ static JsonObject *
 build_meta_if_necessary (CockpitPcpMetrics *self,
                          pmResult *result)
 {
-  if (self->last)
+  if (self->have_meta)
     {
       /*
        * If we've already sent the first meta message, then only send
        * another when the set of instances in the results change.
        */
 
-      if (result_meta_equal (self, self->last, result))
+      if (result_meta_equal (self, result))
         return NULL;
     }
 
+  remember_instances (self, result);
+  self->have_meta = TRUE;
   return build_meta (self, result);
 }
 
@@ -371,21 +520,161 @@ cockpit_pcp_metrics_tick (CockpitMetrics *metrics,
   cockpit_metrics_send_data (metrics, timestamp_from_timeval (&result->timestamp));
   cockpit_metrics_flush_data (metrics);
 
-  if (self->last)
-    pmFreeResult (self->last);
-  self->last = result;
+  pmFreeResult (result);
 }
 
 static void next_archive (CockpitPcpMetrics *self);
 
+/*
+ * Archive samples are read for up to this many microseconds per main
+ * loop iteration, and what was read goes out in one 'data' message.
+ */
+#define ARCHIVE_BATCH_BUDGET (20 * 1000)
+#define ARCHIVE_BATCH_MAX 10000
+
+static gint
+value_count (CockpitPcpMetrics *self,
+             pmResult *result,
+             int metric)
+{
+  if (self->metrics[metric].desc.indom == PM_INDOM_NULL)
+    return 1;
+  return MAX (result->vset[metric]->numval, 0);
+}
+
+static void
+send_aggregate (CockpitPcpMetrics *self)
+{
+  double **buffer;
+  Aggregate *agg;
+  int i, j;
+
+  if (self->n_bucket_samples == 0)
+    return;
+
+  buffer = cockpit_metrics_get_data_buffer (COCKPIT_METRICS (self));
+  for (i = 0; i < self->numpmid; i++)
+    {
+      for (j = self->bucket_offsets[i]; j < self->bucket_offsets[i + 1]; j++)
+        {
+          agg = &self->buckets[j];
+          if (agg->count == 0)
+            buffer[i][j - self->bucket_offsets[i]] = NAN;
+          else if (self->aggregate == AGGREGATE_AVG)
+            buffer[i][j - self->bucket_offsets[i]] = agg->value / agg->count;
+          else
+            buffer[i][j - self->bucket_offsets[i]] = agg->value;
+        }
+    }
+
+  cockpit_metrics_send_data (COCKPIT_METRICS (self), self->bucket_timestamp);
+  self->n_bucket_samples = 0;
+  self->limit--;
+}
+
+/*
+ * Combine the samples that build_samples() put in the data buffer
+ * into the current bucket. Returns TRUE when the bucket is complete.
+ *
+ * Metrics with a "derive" mode are derived here, from one archive
+ * sample to the next, and it's those values that are combined. The
+ * meta then leaves "derive" out, so a rate keeps its peaks.
+ */
+static gboolean
+add_aggregate (CockpitPcpMetrics *self,
+               pmResult *result)
+{
+  double **buffer;
+  Aggregate *agg;
+  double value;
+  double raw;
+  gint64 timestamp;
+  int i, j;
+
+  timestamp = timestamp_from_timeval (&result->timestamp);
+
+  /* A new bucket, the layout may have changed with the meta */
+  if (self->n_bucket_samples == 0)
+    {
+      self->bucket_timestamp = timestamp;
+      self->bucket_offsets = g_renew (gint, self->bucket_offsets, self->numpmid + 1);
+      self->bucket_offsets[0] = 0;
+      for (i = 0; i < self->numpmid; i++)
+        self->bucket_offsets[i + 1] = self->bucket_offsets[i] + value_count (self, result, i);
+      if (self->n_buckets < self->bucket_offsets[self->numpmid])
+        {
+          self->n_buckets = self->bucket_offsets[self->numpmid];
+          self->buckets = g_renew (Aggregate, self->buckets, self->n_buckets);
+          self->raw_samples = g_renew (double, self->raw_samples, self->n_buckets);
+        }
+      memset (self->buckets, 0, sizeof (Aggregate) * self->bucket_offsets[self->numpmid]);
+    }
+
+  buffer = cockpit_metrics_get_data_buffer (COCKPIT_METRICS (self));
+  for (i = 0; i < self->numpmid; i++)
+    {
+      for (j = self->bucket_offsets[i]; j < self->bucket_offsets[i + 1]; j++)
+        {
+          value = buffer[i][j - self->bucket_offsets[i]];
+
+          if (self->metrics[i].derive)
+            {
+              raw = value;
+              if (!self->have_raw_samples || timestamp == self->raw_timestamp)
+                value = NAN;
+              else if (g_str_equal (self->metrics[i].derive, "rate"))
+                value = (raw - self->raw_samples[j]) / (timestamp - self->raw_timestamp) * 1000;
+              else
+                value = raw - self->raw_samples[j];
+              self->raw_samples[j] = raw;
+            }
+
+          if (isnan (value))
+            continue;
+
+          agg = &self->buckets[j];
+          if (agg->count == 0)
+            agg->value = value;
+          else if (self->aggregate == AGGREGATE_MIN)
+            agg->value = MIN (agg->value, value);
+          else if (self->aggregate == AGGREGATE_MAX)
+            agg->value = MAX (agg->value, value);
+          else
+            agg->value += value;
+          agg->count++;
+        }
+    }
+
+  self->have_raw_samples = TRUE;
+  self->raw_timestamp = timestamp;
+
+  self->n_bucket_samples++;
+  return self->n_bucket_samples >= self->n_aggregate;
+}
+
+static void
+send_progress (CockpitPcpMetrics *self)
+{
+  JsonObject *options;
+
+  if (!self->have_meta)
+    return;
+
+  options = json_object_new ();
+  json_object_set_int_member (options, "timestamp", self->last_timestamp);
+  cockpit_channel_control (COCKPIT_CHANNEL (self), "progress", options);
+  json_object_unref (options);
+}
+
 static gboolean
 on_idle_batch (gpointer user_data)
 {
-  const int archive_batch = 60;
   CockpitPcpMetrics *self = user_data;
   ArchiveInfo *info;
   JsonObject *meta;
   pmResult *result;
+  gint64 deadline;
+  gboolean reset;
   gint i;
   int rc;
 
@@ -397,11 +686,12 @@ on_idle_batch (gpointer user_data)
       return FALSE;
     }
 
-  for (i = 0; i < archive_batch; i++)
+  deadline = g_get_monotonic_time () + ARCHIVE_BATCH_BUDGET;
+
+  for (i = 0; i < ARCHIVE_BATCH_MAX && g_get_monotonic_time () < deadline; i++)
     {
       /* Sent enough samples? */
-      self->limit--;
-      if (self->limit < 0)
+      if (self->limit <= 0)
         {
           cockpit_metrics_flush_data (COCKPIT_METRICS (self));
           cockpit_channel_close (COCKPIT_CHANNEL (self), NULL);
@@ -416,6 +706,7 @@ on_idle_batch (gpointer user_data)
 
           if (rc == PM_ERR_EOL)
             {
+              send_aggregate (self);
               cockpit_metrics_flush_data (COCKPIT_METRICS (self));
               next_archive (self);
             }
@@ -428,22 +719,34 @@ on_idle_batch (gpointer user_data)
           return FALSE;
         }
 
+      reset = !self->have_meta;
       meta = build_meta_if_necessary (self, result);
       if (meta)
         {
-          cockpit_metrics_send_meta (COCKPIT_METRICS (self), meta, self->last == NULL);
+          /* The bucket so far has the layout of the old meta */
+          send_aggregate (self);
+          self->have_raw_samples = FALSE;
+          cockpit_metrics_send_meta (COCKPIT_METRICS (self), meta, reset);
           json_object_unref (meta);
         }
 
       build_samples (self, result);
-      cockpit_metrics_send_data (COCKPIT_METRICS (self), timestamp_from_timeval (&result->timestamp));
+      if (self->aggregate == AGGREGATE_NONE)
+        {
+          cockpit_metrics_send_data (COCKPIT_METRICS (self), timestamp_from_timeval (&result->timestamp));
+          self->limit--;
+        }
+      else if (add_aggregate (self, result))
+        {
+          send_aggregate (self);
+        }
 
-      if (self->last)
-        pmFreeResult (self->last);
-      self->last = result;
+      self->last_timestamp = timestamp_from_timeval (&result->timestamp);
+      pmFreeResult (result);
     }
 
   cockpit_metrics_flush_data (COCKPIT_METRICS (self));
+  send_progress (self);
   return TRUE;
 }
 
@@ -501,6 +804,12 @@ convert_metric_description (CockpitPcpMetrics *self,
                      self->name, info->name);
           goto out;
         }
+      else if (info->derive && !g_str_equal (info->derive, "delta") && !g_str_equal (info->derive, "rate"))
+        {
+          g_warning ("%s: invalid derivation mode for metric %s: %s",
+                     self->name, info->name, info->derive);
+          goto out;
+        }
     }
   else
     {
@@ -565,11 +874,10 @@ prepare_current_context (CockpitPcpMetrics *self)
   JsonArray *metrics;
   int i;
 
-  g_free (self->metrics);
+  free_metrics (self);
   g_free (self->pmidlist);
 
   self->numpmid = 0;
-  self->metrics = NULL;
   self->pmidlist = NULL;
 
   options = cockpit_channel_get_options (COCKPIT_CHANNEL (self));
@@ -643,46 +951,303 @@ prepare_current_context (CockpitPcpMetrics *self)
 
 static void start_archive (CockpitPcpMetrics *self, gint64 timestamp);
 
-static const gchar *
-add_archive (CockpitPcpMetrics *self,
-             const gchar *name)
+/*
+ * Finding the start of each archive means opening it, and a pmlogger
+ * directory can have hundreds. So the start times are kept in a
+ * per-user cache, keyed by the size and change time of the .meta file,
+ * and archives not in there are opened in a few threads at once.
+ * Contexts for playback are only created once an archive is reached.
+ */
+
+typedef struct {
+  gchar *path;
+  guint64 size;
+  guint64 mtime;
+  guint64 mtime_nsec;
+  gint64 start;
+  int error;
+} ArchiveProbe;
+
+/* At most this many threads open archives */
+#define MAX_PROBE_THREADS 8
+
+static void
+archive_probe_free (gpointer data)
 {
-  const gchar *problem = NULL;
-  ArchiveInfo *info;
+  ArchiveProbe *probe = data;
+  g_free (probe->path);
+  g_slice_free (ArchiveProbe, probe);
+}
+
+static gboolean
+parse_probe_entry (gchar **fields,
+                   ArchiveProbe *probe)
+{
+  guint64 *values[] = { &probe->size, &probe->mtime, &probe->mtime_nsec };
+  gchar *end;
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (values); i++)
+    {
+      *(values[i]) = g_ascii_strtoull (fields[i + 1], &end, 10);
+      if (end == fields[i + 1] || *end != '\0')
+        return FALSE;
+    }
+
+  probe->start = g_ascii_strtoll (fields[4], &end, 10);
+  if (end == fields[4] || *end != '\0')
+    return FALSE;
+
+  probe->path = g_strdup (fields[0]);
+  return TRUE;
+}
+
+static GHashTable *
+load_archive_cache (const gchar *filename)
+{
+  ArchiveProbe *probe;
+  GHashTable *cache;
+  gchar *contents;
+  gchar **lines;
+  gchar **fields;
+  gint i;
+
+  cache = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, archive_probe_free);
+
+  if (!g_file_get_contents (filename, &contents, NULL, NULL))
+    return cache;
+
+  lines = g_strsplit (contents, "\n", -1);
+  for (i = 0; lines[i] != NULL; i++)
+    {
+      fields = g_strsplit (lines[i], "\t", 5);
+      if (g_strv_length (fields) == 5)
+        {
+          probe = g_slice_new0 (ArchiveProbe);
+          if (parse_probe_entry (fields, probe))
+            g_hash_table_replace (cache, probe->path, probe);
+          else
+            archive_probe_free (probe);
+        }
+      g_strfreev (fields);
+    }
+
+  g_strfreev (lines);
+  g_free (contents);
+  return cache;
+}
+
+static void
+append_probe_entry (GString *out,
+                    ArchiveProbe *probe)
+{
+  if (probe->error != 0 || strpbrk (probe->path, "\t\n"))
+    return;
+  g_string_append_printf (out, "%s\t%" G_GUINT64_FORMAT "\t%" G_GUINT64_FORMAT
+                          "\t%" G_GUINT64_FORMAT "\t%" G_GINT64_FORMAT "\n",
+                          probe->path, probe->size, probe->mtime, probe->mtime_nsec, probe->start);
+}
+
+static guint
+count_cached (GHashTable *cache,
+              const gchar *directory)
+{
+  GHashTableIter iter;
+  ArchiveProbe *probe;
+  gchar *parent;
+  guint count = 0;
+
+  g_hash_table_iter_init (&iter, cache);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&probe))
+    {
+      parent = g_path_get_dirname (probe->path);
+      if (g_str_equal (parent, directory))
+        count++;
+      g_free (parent);
+    }
+
+  return count;
+}
+
+/* Entries of other directories are kept, those of this one replaced */
+static void
+save_archive_cache (const gchar *filename,
+                    GHashTable *cache,
+                    const gchar *directory,
+                    GPtrArray *probes)
+{
+  GError *error = NULL;
+  GHashTableIter iter;
+  ArchiveProbe *probe;
+  GString *out;
+  gchar *parent;
+  gchar *dir;
+  guint i;
+
+  out = g_string_new ("");
+  g_hash_table_iter_init (&iter, cache);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&probe))
+    {
+      parent = g_path_get_dirname (probe->path);
+      if (!g_str_equal (parent, directory))
+        append_probe_entry (out, probe);
+      g_free (parent);
+    }
+  for (i = 0; i < probes->len; i++)
+    append_probe_entry (out, probes->pdata[i]);
+
+  dir = g_path_get_dirname (filename);
+  if (g_mkdir_with_parents (dir, 0700) < 0)
+    g_debug ("couldn't create cache directory: %s: %s", dir, g_strerror (errno));
+  else if (!g_file_set_contents (filename, out->str, out->len, &error))
+    g_debug ("couldn't write pcp archive cache: %s", error->message);
+
+  g_clear_error (&error);
+  g_string_free (out, TRUE);
+  g_free (dir);
+}
+
+static void
+probe_archive (gpointer data,
+               gpointer user_data)
+{
+  ArchiveProbe *probe = data;
   pmLogLabel label;
+  int context;
   int rc;
 
+  /* The current context is per thread */
+  context = pmNewContext (PM_CONTEXT_ARCHIVE, probe->path);
+  if (context < 0)
+    {
+      probe->error = context;
+      return;
+    }
+
+  rc = pmGetArchiveLabel (&label);
+  if (rc < 0)
+    probe->error = rc;
+  else
+    probe->start = label.ll_start.tv_sec * 1000 + label.ll_start.tv_usec / 1000;
+
+  pmDestroyContext (context);
+}
+
+static void
+add_archive (CockpitPcpMetrics *self,
+             const gchar *path,
+             gint64 start)
+{
+  ArchiveInfo *info;
+
   info = g_new0 (ArchiveInfo, 1);
-  info->context = pmNewContext (PM_CONTEXT_ARCHIVE, name);
-  if (info->context < 0)
+  info->path = g_strdup (path);
+  info->context = -1;
+  info->start = start;
+  self->archives = g_list_prepend (self->archives, info);
+}
+
+static const gchar *
+probe_archives (CockpitPcpMetrics *self,
+                GPtrArray *probes,
+                GHashTable *cache)
+{
+  const gchar *problem = NULL;
+  GThreadPool *pool = NULL;
+  GError *error = NULL;
+  GPtrArray *missing;
+  ArchiveProbe *cached;
+  ArchiveProbe *probe;
+  gchar *directory;
+  gchar *filename;
+  struct stat sb;
+  glong threads;
+  guint i;
+
+  missing = g_ptr_array_new ();
+  for (i = 0; i < probes->len; i++)
     {
-      if (info->context == -ENOENT)
+      probe = probes->pdata[i];
+      filename = g_strconcat (probe->path, ".meta", NULL);
+      if (stat (filename, &sb) == 0)
         {
-          g_debug ("%s: couldn't find pcp archive for %s", self->name, name);
-          problem = "not-found";
+          probe->size = sb.st_size;
+          probe->mtime = sb.st_mtim.tv_sec;
+          probe->mtime_nsec = sb.st_mtim.tv_nsec;
         }
+      g_free (filename);
+
+      cached = cache ? g_hash_table_lookup (cache, probe->path) : NULL;
+      if (cached && cached->size == probe->size && cached->mtime == probe->mtime &&
+          cached->mtime_nsec == probe->mtime_nsec)
+        probe->start = cached->start;
       else
+        g_ptr_array_add (missing, probe);
+    }
+
+  threads = sysconf (_SC_NPROCESSORS_ONLN);
+  threads = CLAMP (threads, 1, MAX_PROBE_THREADS);
+  threads = MIN (threads, (glong)missing->len);
+
+  if (threads > 1)
+    {
+      pool = g_thread_pool_new (probe_archive, NULL, threads, FALSE, &error);
+      if (!pool)
         {
-          g_message ("%s: couldn't create pcp archive context for %s: %s",
-                     self->name, name, pmErrStr (info->context));
+          g_debug ("%s: couldn't start threads to open archives: %s", self->name, error->message);
+          g_clear_error (&error);
+        }
+    }
+
+  for (i = 0; i < missing->len; i++)
+    {
+      if (pool)
+        g_thread_pool_push (pool, missing->pdata[i], NULL);
+      else
+        probe_archive (missing->pdata[i], NULL);
+    }
+
+  /* Waits for all the archives to be opened */
+  if (pool)
+    g_thread_pool_free (pool, FALSE, TRUE);
+
+  g_debug ("%s: opened %u of %u archives", self->name, missing->len, probes->len);
+
+  for (i = 0; i < probes->len; i++)
+    {
+      probe = probes->pdata[i];
+      if (probe->error == -ENOENT)
+        {
+          g_debug ("%s: couldn't find pcp archive for %s", self->name, probe->path);
+          problem = "not-found";
+        }
+      else if (probe->error < 0)
+        {
+          g_message ("%s: couldn't open pcp archive %s: %s",
+                     self->name, probe->path, pmErrStr (probe->error));
           problem = "internal-error";
         }
-      g_free (info);
-      return problem;
+      else
+        {
+          add_archive (self, probe->path, probe->start);
+        }
     }
 
-  rc = pmGetArchiveLabel (&label);
-  if (rc < 0)
+  /* Also rewrite the cache when archives have gone away */
+  if (cache)
     {
-      g_message ("%s: couldn't read archive label of %s: %s", self->name, name, pmErrStr (rc));
-      pmDestroyContext (info->context);
-      g_free (info);
-      return "internal-error";
+      directory = g_path_get_dirname (((ArchiveProbe *)probes->pdata[0])->path);
+      if (missing->len > 0 || count_cached (cache, directory) != probes->len)
+        {
+          filename = g_build_filename (g_get_user_cache_dir (), "cockpit", "pcp-archives", NULL);
+          save_archive_cache (filename, cache, directory, probes);
+          g_free (filename);
+        }
+      g_free (directory);
     }
 
-  info->start = label.ll_start.tv_sec * 1000 + label.ll_start.tv_usec / 1000;
-  self->archives = g_list_prepend (self->archives, info);
-  return NULL;
+  g_ptr_array_free (missing, TRUE);
+  return problem;
 }
 
 static gint
@@ -706,11 +1271,16 @@ prepare_archives (CockpitPcpMetrics *self,
                   gint64 timestamp)
 {
   const gchar *problem = NULL;
-  const gchar *ret = NULL;
+  GHashTable *cache = NULL;
+  ArchiveProbe *probe;
+  GPtrArray *probes;
+  gchar *filename;
   GDir *dir;
   int count;
   GError *error = NULL;
 
+  probes = g_ptr_array_new_with_free_func (archive_probe_free);
+
   dir = g_dir_open (name, 0, &error);
   if (dir)
     {
@@ -720,22 +1290,24 @@ prepare_archives (CockpitPcpMetrics *self,
         {
           if (g_str_has_suffix (entry, ".meta"))
             {
-              gchar *path = g_build_filename (name, entry, NULL);
-              path[strlen(path)-strlen(".meta")] = '\0';
-              ret = add_archive (self, path);
-              if (ret != NULL)
-                problem = ret;
-              g_free (path);
+              probe = g_slice_new0 (ArchiveProbe);
+              probe->path = g_build_filename (name, entry, NULL);
+              probe->path[strlen(probe->path)-strlen(".meta")] = '\0';
+              g_ptr_array_add (probes, probe);
               count += 1;
             }
         }
       g_dir_close (dir);
+
+      filename = g_build_filename (g_get_user_cache_dir (), "cockpit", "pcp-archives", NULL);
+      cache = load_archive_cache (filename);
+      g_free (filename);
     }
   else if (g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
     {
-      ret = add_archive (self, name);
-      if (ret != NULL)
-        problem = ret;
+      probe = g_slice_new0 (ArchiveProbe);
+      probe->path = g_strdup (name);
+      g_ptr_array_add (probes, probe);
     }
   else
     {
@@ -745,6 +1317,13 @@ prepare_archives (CockpitPcpMetrics *self,
 
   g_clear_error (&error);
 
+  if (probes->len > 0)
+    problem = probe_archives (self, probes, cache);
+
+  if (cache)
+    g_hash_table_unref (cache);
+  g_ptr_array_free (probes, TRUE);
+
   if (self->archives == NULL) {
     if (problem == NULL)
       problem = "not-found";
@@ -779,6 +1358,18 @@ start_archive (CockpitPcpMetrics *self, gint64 timestamp)
 
   info = self->cur_archive->data;
 
+  if (info->context < 0)
+    {
+      info->context = pmNewContext (PM_CONTEXT_ARCHIVE, info->path);
+      if (info->context < 0)
+        {
+          g_message ("%s: couldn't create pcp archive context for %s: %s",
+                     self->name, info->path, pmErrStr (info->context));
+          self->cur_archive = self->cur_archive->next;
+          goto again;
+        }
+    }
+
   if (timestamp < info->start)
     timestamp = info->start;
 
@@ -793,7 +1384,8 @@ start_archive (CockpitPcpMetrics *self, gint64 timestamp)
       return;
     }
 
-  rc = pmSetMode (PM_MODE_INTERP | PM_XTB_SET(PM_TIME_MSEC), &stamp, self->interval);
+  rc = pmSetMode (PM_MODE_INTERP | PM_XTB_SET(PM_TIME_MSEC), &stamp,
+                  self->aggregate == AGGREGATE_NONE ? self->interval : self->resolution);
   if (rc < 0)
     {
       g_message ("%s: couldn't set pcp mode: %s", self->name, pmErrStr (rc));
@@ -813,11 +1405,10 @@ start_archive (CockpitPcpMetrics *self, gint64 timestamp)
       return;
     }
 
-  /* Make sure we send a meta message.
+  /* Make sure we send a meta message, with the names of this archive.
    */
-  if (self->last)
-    pmFreeResult (self->last);
-  self->last = NULL;
+  self->have_meta = FALSE;
+  g_hash_table_remove_all (self->indoms);
 
   g_assert (self->idler == 0);
   self->idler = g_idle_add (on_idle_batch, self);
@@ -826,6 +1417,12 @@ start_archive (CockpitPcpMetrics *self, gint64 timestamp)
 static void
 next_archive (CockpitPcpMetrics *self)
 {
+  ArchiveInfo *info = self->cur_archive->data;
+
+  /* Played back archives aren't needed again */
+  pmDestroyContext (info->context);
+  info->context = -1;
+
   self->cur_archive = self->cur_archive->next;
   start_archive (self, 0);
 }
@@ -875,6 +1472,7 @@ cockpit_pcp_metrics_prepare (CockpitChannel *channel)
   const gchar *problem = "protocol-error";
   JsonObject *options;
   const gchar *source;
+  const gchar *aggregate;
   int type;
   char *name = NULL;
   gint64 timestamp;
@@ -981,6 +1579,46 @@ cockpit_pcp_metrics_prepare (CockpitChannel *channel)
       goto out;
     }
 
+  /* "aggregate" option */
+  if (!cockpit_json_get_string (options, "aggregate", NULL, &aggregate))
+    {
+      g_warning ("%s: invalid \"aggregate\" option", self->name);
+      goto out;
+    }
+  else if (aggregate == NULL)
+    self->aggregate = AGGREGATE_NONE;
+  else if (g_str_equal (aggregate, "min"))
+    self->aggregate = AGGREGATE_MIN;
+  else if (g_str_equal (aggregate, "max"))
+    self->aggregate = AGGREGATE_MAX;
+  else if (g_str_equal (aggregate, "avg"))
+    self->aggregate = AGGREGATE_AVG;
+  else
+    {
+      g_warning ("%s: invalid \"aggregate\" value: %s", self->name, aggregate);
+      goto out;
+    }
+
+  /* "resolution" option */
+  if (!cockpit_json_get_int (options, "resolution", MIN (60000, self->interval), &self->resolution))
+    {
+      g_warning ("%s: invalid \"resolution\" option", self->name);
+      goto out;
+    }
+  else if (self->resolution <= 0 || self->resolution > self->interval)
+    {
+      g_warning ("%s: invalid \"resolution\" value: %" G_GINT64_FORMAT, self->name, self->resolution);
+      goto out;
+    }
+
+  /* Read evenly spaced samples, that fill each interval */
+  self->n_aggregate = (self->interval + self->resolution - 1) / self->resolution;
+  self->resolution = self->interval / self->n_aggregate;
+
+  /* Only archives are aggregated, see add_aggregate() */
+  if (type != PM_CONTEXT_ARCHIVE)
+    self->aggregate = AGGREGATE_NONE;
+
   if (type == PM_CONTEXT_ARCHIVE)
     {
       problem = prepare_archives (self, name, timestamp);
@@ -1032,17 +1670,12 @@ cockpit_pcp_metrics_dispose (GObject *object)
       self->idler = 0;
     }
 
-  if (self->last)
-    {
-      pmFreeResult (self->last);
-      self->last = NULL;
-    }
-
   for (GList *a = self->archives; a; a = a->next)
     {
       ArchiveInfo *info = a->data;
       if (info->context >= 0)
         pmDestroyContext (info->context);
+      g_free (info->path);
       g_free (info);
     }
   g_list_free (self->archives);
@@ -1062,8 +1695,12 @@ cockpit_pcp_metrics_finalize (GObject *object)
 {
   CockpitPcpMetrics *self = COCKPIT_PCP_METRICS (object);
 
-  g_free (self->metrics);
+  free_metrics (self);
   g_free (self->pmidlist);
+  g_free (self->buckets);
+  g_free (self->raw_samples);
+  g_hash_table_destroy (self->indoms);
+  g_free (self->bucket_offsets);
 
   G_OBJECT_CLASS (cockpit_pcp_metrics_parent_class)->finalize (object);
 }
@@ -30,6 +30,7 @@
 
 #include <sys/wait.h>
 #include <string.h>
+#include <unistd.h>
 
 /**
  * CockpitPipeChannel:
@@ -44,6 +45,12 @@
  * The payload type for this channel is 'stream'.
  */
 
+/* The most we splice into a single message */
+#define SPLICE_MAX  (256 * 1024)
+
+/* Coalesced output is sent early once this much has built up */
+#define COALESCE_MAX  (64 * 1024)
+
 #define COCKPIT_PIPE_CHANNEL(o)    (G_TYPE_CHECK_INSTANCE_CAST ((o), COCKPIT_TYPE_PIPE_CHANNEL, CockpitPipeChannel))
 
 typedef struct {
@@ -55,9 +62,11 @@ typedef struct {
   gboolean closing;
   guint sig_read;
   guint sig_close;
-  gint64 batch;
-  gint64 latency;
-  guint timeout;
+
+  /* Terminal output options */
+  gint64 coalesce;
+  guint coalesce_timeout;
+  gboolean hidden;
 } CockpitPipeChannel;
 
 typedef struct {
@@ -88,12 +97,6 @@ process_pipe_buffer (CockpitPipeChannel *self,
   if (!data)
     return;
 
-  if (self->timeout)
-    {
-      g_source_remove (self->timeout);
-      self->timeout = 0;
-    }
-
   if (data->len)
     {
       /* When array is reffed, this just clears byte array */
@@ -104,38 +107,50 @@ process_pipe_buffer (CockpitPipeChannel *self,
     }
 }
 
+static void
+stop_coalescing (CockpitPipeChannel *self)
+{
+  if (self->coalesce_timeout)
+    {
+      g_source_remove (self->coalesce_timeout);
+      self->coalesce_timeout = 0;
+    }
+}
+
+static gboolean
+parse_output_options (CockpitPipeChannel *self,
+                      JsonObject *options)
+{
+  gboolean visible;
+
+  if (!cockpit_json_get_int (options, "coalesce", self->coalesce, &self->coalesce) ||
+      self->coalesce < 0 || self->coalesce > 1000)
+    {
+      g_warning ("invalid \"coalesce\" option for stream channel");
+      return FALSE;
+    }
+  if (!cockpit_json_get_bool (options, "visible", !self->hidden, &visible))
+    {
+      g_warning ("invalid \"visible\" option for stream channel");
+      return FALSE;
+    }
+
+  self->hidden = !visible;
+  if (self->coalesce == 0 || self->hidden)
+    stop_coalescing (self);
+  return TRUE;
+}
+
 static gboolean
 cockpit_pipe_channel_control (CockpitChannel *channel,
                               const gchar *command,
                               JsonObject *message)
 {
   CockpitPipeChannel *self = COCKPIT_PIPE_CHANNEL (channel);
-  const gchar *problem = NULL;
   gboolean ret = TRUE;
 
-  /* New set of options for channel */
-  if (g_str_equal (command, "options"))
-    {
-      problem = "protocol-error";
-      if (!cockpit_json_get_int (message, "batch", self->batch, &self->batch))
-        {
-          g_warning ("invalid \"batch\" option for stream channel");
-          goto out;
-        }
-
-      if (!cockpit_json_get_int (message, "latency", self->latency, &self->latency) ||
-          self->latency < 0 || self->latency >= G_MAXUINT)
-        {
-          g_warning ("invalid \"latency\" option for stream channel");
-          goto out;
-        }
-
-      problem = NULL;
-      process_pipe_buffer (self, NULL);
-    }
-
   /* Channel input is done */
-  else if (g_str_equal (command, "done"))
+  if (g_str_equal (command, "done"))
     {
       self->closing = TRUE;
       process_pipe_buffer (self, NULL);
@@ -148,14 +163,28 @@ cockpit_pipe_channel_control (CockpitChannel *channel,
         cockpit_pipe_close (self->pipe, NULL);
     }
 
+  /* Output options can change, eg: when a terminal is hidden */
+  else if (g_str_equal (command, "options"))
+    {
+      if (!parse_output_options (self, message))
+        {
+          cockpit_channel_close (channel, "protocol-error");
+          return TRUE;
+        }
+      if (self->open)
+        {
+          if (self->hidden)
+            g_byte_array_set_size (cockpit_pipe_get_buffer (self->pipe), 0);
+          else if (!self->coalesce_timeout)
+            process_pipe_buffer (self, NULL);
+        }
+    }
+
   else
     {
       ret = FALSE;
     }
 
-out:
-  if (problem)
-    cockpit_channel_close (channel, problem);
   return ret;
 }
 
@@ -166,6 +195,7 @@ cockpit_pipe_channel_close (CockpitChannel *channel,
   CockpitPipeChannel *self = COCKPIT_PIPE_CHANNEL (channel);
 
   self->closing = TRUE;
+  stop_coalescing (self);
   process_pipe_buffer (self, NULL);
 
   /*
@@ -178,15 +208,54 @@ cockpit_pipe_channel_close (CockpitChannel *channel,
     COCKPIT_CHANNEL_CLASS (cockpit_pipe_channel_parent_class)->close (channel, problem);
 }
 
+static void
+cockpit_pipe_channel_pressure (CockpitChannel *channel,
+                               gboolean pressure)
+{
+  CockpitPipeChannel *self = COCKPIT_PIPE_CHANNEL (channel);
+  if (self->open)
+    cockpit_pipe_throttle (self->pipe, pressure);
+}
+
 static gboolean
-on_batch_timeout (gpointer user_data)
+on_coalesce_timeout (gpointer user_data)
 {
   CockpitPipeChannel *self = user_data;
-  self->timeout = 0;
-  process_pipe_buffer (self, NULL);
+  GByteArray *buffer;
+
+  /* Still busy, so keep holding back output for another period */
+  buffer = self->pipe ? cockpit_pipe_get_buffer (self->pipe) : NULL;
+  if (buffer && buffer->len > 0)
+    {
+      process_pipe_buffer (self, buffer);
+      return TRUE;
+    }
+
+  self->coalesce_timeout = 0;
   return FALSE;
 }
 
+/*
+ * Output that shows up while things are quiet, like the echo of a
+ * keystroke, is sent right away. After that, output is held back
+ * for the "coalesce" period and then sent in one message, until
+ * a period goes by with no output.
+ */
+static void
+coalesce_pipe_buffer (CockpitPipeChannel *self,
+                      GByteArray *data)
+{
+  if (!self->coalesce_timeout)
+    {
+      process_pipe_buffer (self, data);
+      self->coalesce_timeout = g_timeout_add (self->coalesce, on_coalesce_timeout, self);
+    }
+  else if (data->len >= COALESCE_MAX)
+    {
+      process_pipe_buffer (self, data);
+    }
+}
+
 static void
 on_pipe_read (CockpitPipe *pipe,
               GByteArray *data,
@@ -195,16 +264,15 @@ on_pipe_read (CockpitPipe *pipe,
 {
   CockpitPipeChannel *self = user_data;
 
-  if (!end_of_data && self->batch > 0 && data->len < self->batch)
-    {
-      /* Delay the processing of this data */
-      if (!self->timeout)
-        self->timeout = g_timeout_add (self->latency, on_batch_timeout, self);
-    }
+  /* Nobody is looking, the program shouldn't block on its output though */
+  if (self->hidden)
+    g_byte_array_set_size (data, 0);
+
+  /* Any "batch" option is handled by CockpitChannel */
+  else if (self->coalesce > 0 && !end_of_data)
+    coalesce_pipe_buffer (self, data);
   else
-    {
-      process_pipe_buffer (self, data);
-    }
+    process_pipe_buffer (self, data);
 
   /* Close the pipe when writing is done */
   if (end_of_data && self->open)
@@ -214,6 +282,14 @@ on_pipe_read (CockpitPipe *pipe,
     }
 }
 
+static gssize
+on_pipe_splice (CockpitPipe *pipe,
+                gint fd,
+                gpointer user_data)
+{
+  return cockpit_channel_splice (user_data, fd, SPLICE_MAX);
+}
+
 static void
 return_stderr_message (CockpitChannel *channel,
                        CockpitPipe *pipe)
@@ -258,6 +334,7 @@ on_pipe_close (CockpitPipe *pipe,
   gint status;
   gchar *signal;
 
+  stop_coalescing (self);
   process_pipe_buffer (self, NULL);
 
   self->open = FALSE;
@@ -297,8 +374,6 @@ on_pipe_close (CockpitPipe *pipe,
 static void
 cockpit_pipe_channel_init (CockpitPipeChannel *self)
 {
-  /* Has no effect until batch is set */
-  self->latency = 75;
 }
 
 static gint
@@ -374,6 +449,82 @@ parse_environ (JsonObject *options,
   return env;
 }
 
+/*
+ * Resource controls are applied by running the command through
+ * systemd-run, nice and ionice, which each exec the next one. This
+ * works the same for ptys, and the fast spawn path in CockpitPipe
+ * stays simple.
+ */
+static gchar **
+parse_resource_options (JsonObject *options,
+                        gchar **argv)
+{
+  GPtrArray *wrapped;
+  const gchar *ionice;
+  gint64 nice;
+  gint64 cpu_quota;
+  gint64 memory_max;
+  gint i;
+
+  if (!cockpit_json_get_int (options, "nice", 0, &nice) || nice < -20 || nice > 19)
+    {
+      g_warning ("invalid \"nice\" option for stream channel");
+      return NULL;
+    }
+  if (!cockpit_json_get_string (options, "ionice", NULL, &ionice) ||
+      (ionice && !g_str_equal (ionice, "idle") && !g_str_equal (ionice, "best-effort")))
+    {
+      g_warning ("invalid \"ionice\" option for stream channel");
+      return NULL;
+    }
+  if (!cockpit_json_get_int (options, "cpu-quota", 0, &cpu_quota) || cpu_quota < 0)
+    {
+      g_warning ("invalid \"cpu-quota\" option for stream channel");
+      return NULL;
+    }
+  if (!cockpit_json_get_int (options, "memory-max", 0, &memory_max) || memory_max < 0)
+    {
+      g_warning ("invalid \"memory-max\" option for stream channel");
+      return NULL;
+    }
+
+  wrapped = g_ptr_array_new ();
+
+  if (cpu_quota || memory_max)
+    {
+      g_ptr_array_add (wrapped, g_strdup ("systemd-run"));
+      if (geteuid () != 0)
+        g_ptr_array_add (wrapped, g_strdup ("--user"));
+      g_ptr_array_add (wrapped, g_strdup ("--scope"));
+      g_ptr_array_add (wrapped, g_strdup ("--quiet"));
+      if (cpu_quota)
+        g_ptr_array_add (wrapped, g_strdup_printf ("--property=CPUQuota=%" G_GINT64_FORMAT "%%", cpu_quota));
+      if (memory_max)
+        g_ptr_array_add (wrapped, g_strdup_printf ("--property=MemoryMax=%" G_GINT64_FORMAT, memory_max));
+      g_ptr_array_add (wrapped, g_strdup ("--"));
+    }
+
+  if (nice)
+    {
+      g_ptr_array_add (wrapped, g_strdup ("nice"));
+      g_ptr_array_add (wrapped, g_strdup_printf ("--adjustment=%" G_GINT64_FORMAT, nice));
+      g_ptr_array_add (wrapped, g_strdup ("--"));
+    }
+
+  if (ionice)
+    {
+      g_ptr_array_add (wrapped, g_strdup ("ionice"));
+      g_ptr_array_add (wrapped, g_strdup (g_str_equal (ionice, "idle") ? "--class=3" : "--class=2"));
+      g_ptr_array_add (wrapped, g_strdup ("--"));
+    }
+
+  for (i = 0; argv[i] != NULL; i++)
+    g_ptr_array_add (wrapped, g_strdup (argv[i]));
+  g_ptr_array_add (wrapped, NULL);
+
+  return (gchar **)g_ptr_array_free (wrapped, FALSE);
+}
+
 static void
 cockpit_pipe_channel_prepare (CockpitChannel *channel)
 {
@@ -384,25 +535,36 @@ cockpit_pipe_channel_prepare (CockpitChannel *channel)
   JsonObject *options;
   gchar **argv = NULL;
   gchar **env = NULL;
-  gboolean pty;
+  gchar **command = NULL;
+  gboolean splice;
+  gboolean pty = FALSE;
   const gchar *dir;
   const gchar *error;
 
   COCKPIT_CHANNEL_CLASS (cockpit_pipe_channel_parent_class)->prepare (channel);
+  if (self->closing)
+    goto out;
 
   options = cockpit_channel_get_options (channel);
 
+  /* Characters may be split across reads */
+  cockpit_channel_hold_incomplete (channel, TRUE);
+
+  if (!parse_output_options (self, options))
+    goto out;
+
+  if (!cockpit_json_get_bool (options, "splice", FALSE, &splice))
+    {
+      g_warning ("invalid \"splice\" option for stream channel");
+      goto out;
+    }
+
   if (!cockpit_json_get_strv (options, "spawn", NULL, &argv))
     {
       g_warning ("invalid \"spawn\" option for stream channel");
       goto out;
     }
 
-  /* Support our options in the open message too */
-  cockpit_pipe_channel_control (channel, "options", options);
-  if (self->closing)
-    goto out;
-
   if (argv)
     {
       if (!cockpit_json_get_string (options, "err", NULL, &error))
@@ -433,10 +595,16 @@ cockpit_pipe_channel_prepare (CockpitChannel *channel)
       env = parse_environ (options, dir);
       if (!env)
         goto out;
+      command = parse_resource_options (options, argv);
+      if (!command)
+        goto out;
       if (pty)
-        self->pipe = cockpit_pipe_pty ((const gchar **)argv, (const gchar **)env, dir);
+        self->pipe = cockpit_pipe_pty ((const gchar **)command, (const gchar **)env, dir);
       else
-        self->pipe = cockpit_pipe_spawn ((const gchar **)argv, (const gchar **)env, dir, flags);
+        {
+          self->pipe = cockpit_pipe_spawn ((const gchar **)command, (const gchar **)env, dir, flags);
+          g_object_set (self->pipe, "adaptive-read", TRUE, NULL);
+        }
     }
   else
     {
@@ -445,9 +613,14 @@ cockpit_pipe_channel_prepare (CockpitChannel *channel)
       if (!address)
         goto out;
       self->pipe = cockpit_pipe_connect (self->name, address);
+      g_object_set (self->pipe, "adaptive-read", TRUE, NULL);
       g_object_unref (address);
     }
 
+  /* A terminal needs its output read, the rest can be spliced */
+  if (splice && !pty)
+    cockpit_pipe_splice_input (self->pipe, on_pipe_splice, self);
+
   self->sig_read = g_signal_connect (self->pipe, "read", G_CALLBACK (on_pipe_read), self);
   self->sig_close = g_signal_connect (self->pipe, "close", G_CALLBACK (on_pipe_close), self);
   self->open = TRUE;
@@ -457,6 +630,7 @@ cockpit_pipe_channel_prepare (CockpitChannel *channel)
 out:
   g_free (argv);
   g_strfreev (env);
+  g_strfreev (command);
   if (problem)
     cockpit_channel_close (channel, problem);
 }
@@ -466,6 +640,8 @@ cockpit_pipe_channel_dispose (GObject *object)
 {
   CockpitPipeChannel *self = COCKPIT_PIPE_CHANNEL (object);
 
+  stop_coalescing (self);
+
   if (self->pipe)
     {
       if (self->open)
@@ -505,6 +681,7 @@ cockpit_pipe_channel_class_init (CockpitPipeChannelClass *klass)
   channel_class->control = cockpit_pipe_channel_control;
   channel_class->recv = cockpit_pipe_channel_recv;
   channel_class->close = cockpit_pipe_channel_close;
+  channel_class->pressure = cockpit_pipe_channel_pressure;
 }
 
 /**
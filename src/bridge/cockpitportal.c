@@ -81,6 +81,11 @@ struct _CockpitPortal {
   const gchar ***argvs;
   gint argvi;
 
+  /* Member of the "init" message with options for this portal */
+  gchar *init_member;
+  guint idle_timeout;
+  guint idle_tag;
+
   /* Transport talking back to web service */
   CockpitTransport *transport;
   gulong transport_recv_sig;
@@ -108,7 +113,8 @@ enum {
     PROP_0,
     PROP_TRANSPORT,
     PROP_FILTER,
-    PROP_ARGVS
+    PROP_ARGVS,
+    PROP_INIT_MEMBER
 };
 
 G_DEFINE_TYPE (CockpitPortal, cockpit_portal, G_TYPE_OBJECT);
@@ -149,6 +155,68 @@ current_argv (CockpitPortal *self)
   return argv;
 }
 
+static gboolean
+on_idle_timeout (gpointer user_data)
+{
+  CockpitPortal *self = user_data;
+
+  self->idle_tag = 0;
+  g_debug ("closing idle portal bridge");
+  transition_none (self);
+  return FALSE;
+}
+
+/*
+ * With an "idle-timeout" the other bridge is closed once it has had
+ * no channels for that long. Otherwise it stays around for as long as
+ * this bridge does, so later channels don't have to wait for it.
+ */
+static void
+check_idle (CockpitPortal *self)
+{
+  gboolean idle;
+
+  idle = self->state == PORTAL_OPEN && self->idle_timeout > 0 &&
+         (!self->channels || g_hash_table_size (self->channels) == 0);
+
+  if (idle && !self->idle_tag)
+    {
+      self->idle_tag = g_timeout_add_seconds (self->idle_timeout, on_idle_timeout, self);
+    }
+  else if (!idle && self->idle_tag)
+    {
+      g_source_remove (self->idle_tag);
+      self->idle_tag = 0;
+    }
+}
+
+/*
+ * Channel messages are relayed in the frame they came in when it
+ * can, so the header isn't taken apart and put back together again.
+ */
+static void
+relay_message (CockpitTransport *from,
+               CockpitTransport *to,
+               const gchar *channel,
+               GBytes *payload)
+{
+  gboolean binary;
+  GBytes *frame;
+
+  frame = cockpit_pipe_transport_peek_frame (from, payload, &binary);
+  if (frame)
+    {
+      if (cockpit_pipe_transport_send_frame (to, frame, binary))
+        {
+          g_bytes_unref (frame);
+          return;
+        }
+      g_bytes_unref (frame);
+    }
+
+  cockpit_transport_send (to, channel, payload);
+}
+
 static gboolean
 on_other_recv (CockpitTransport *transport,
                const gchar *channel,
@@ -160,7 +228,7 @@ on_other_recv (CockpitTransport *transport,
   if (channel)
     {
       if (self->transport)
-        cockpit_transport_send (self->transport, channel, payload);
+        relay_message (transport, self->transport, channel, payload);
       return TRUE;
     }
 
@@ -178,6 +246,7 @@ on_other_control (CockpitTransport *transport,
   CockpitPortal *self = user_data;
   if (g_str_equal (command, "init"))
     {
+      cockpit_pipe_transport_negotiate (transport, options);
       if (self->state == PORTAL_OPENING)
         transition_open (self);
     }
@@ -186,13 +255,21 @@ on_other_control (CockpitTransport *transport,
   else if (g_str_equal (command, "close") ||
            g_str_equal (command, "done"))
     {
-      if (self->channels && channel)
-        g_hash_table_remove (self->channels, channel);
+      /* A channel that was killed has already been forgotten */
+      if (self->channels && channel &&
+          !g_hash_table_remove (self->channels, channel) &&
+          g_str_equal (command, "close"))
+        {
+          g_debug ("portal channel already killed: %s", channel);
+          return TRUE;
+        }
 
       g_debug ("portal channel closed: %s", channel);
 
       if (self->transport)
         cockpit_transport_send (self->transport, NULL, payload);
+
+      check_idle (self);
     }
 
   return TRUE;
@@ -363,7 +440,10 @@ send_to_portal (CockpitPortal *self,
       return TRUE;
 
     case PORTAL_OPEN:
-      if (self->transport)
+      /* Control messages may have been changed by the filter */
+      if (self->transport && channel)
+        relay_message (self->transport, self->other, channel, payload);
+      else if (self->transport)
         cockpit_transport_send (self->other, channel, payload);
       return TRUE;
 
@@ -405,6 +485,7 @@ transition_none (CockpitPortal *self)
   self->problem = NULL;
 
   disconnect_portal_bridge (self);
+  check_idle (self);
 
   if (queue)
     g_queue_free_full (queue, cockpit_portal_message_free);
@@ -469,6 +550,7 @@ transition_open (CockpitPortal *self)
   g_assert (self->state == PORTAL_OPENING);
   self->state = PORTAL_OPEN;
   flush_queue (self);
+  check_idle (self);
 }
 
 static void
@@ -480,6 +562,89 @@ transition_failed (CockpitPortal *self)
   flush_queue (self);
 }
 
+static void
+parse_init_options (CockpitPortal *self,
+                    JsonObject *options)
+{
+  gboolean prewarm = FALSE;
+  JsonObject *object;
+  gint64 timeout = 0;
+
+  if (!cockpit_json_get_object (options, self->init_member, NULL, &object))
+    {
+      g_message ("invalid \"%s\" field in init message", self->init_member);
+      return;
+    }
+
+  if (object)
+    {
+      if (!cockpit_json_get_bool (object, "prewarm", FALSE, &prewarm))
+        {
+          g_message ("invalid \"prewarm\" field in init message");
+          prewarm = FALSE;
+        }
+      if (!cockpit_json_get_int (object, "idle-timeout", 0, &timeout) ||
+          timeout < 0 || timeout > G_MAXUINT)
+        {
+          g_message ("invalid \"idle-timeout\" field in init message");
+          timeout = 0;
+        }
+    }
+
+  self->idle_timeout = timeout;
+  check_idle (self);
+
+  /* Start the other bridge now, rather than when it's first used */
+  if (prewarm && self->state == PORTAL_NONE)
+    {
+      g_debug ("prewarming portal bridge");
+      transition_opening (self);
+    }
+}
+
+/*
+ * The other bridge is told to close the channels of a "kill" one by
+ * one, but over its own pipe. Only one "killed" goes back out, from
+ * our own bridge, which sees the "kill" after us.
+ */
+static void
+kill_portal_channels (CockpitPortal *self,
+                      JsonObject *options)
+{
+  const gchar *problem;
+  gchar **channels;
+  GBytes *bytes;
+  gint i;
+
+  if (!self->channels || g_hash_table_size (self->channels) == 0)
+    return;
+
+  /* Our bridge complains about invalid ones */
+  if (!cockpit_json_get_strv (options, "channels", NULL, &channels) ||
+      !cockpit_json_get_string (options, "problem", "terminated", &problem))
+    return;
+
+  for (i = 0; channels && channels[i] != NULL; i++)
+    {
+      if (!g_hash_table_remove (self->channels, channels[i]))
+        continue;
+
+      g_debug ("killing portal channel: %s", channels[i]);
+      if (self->state == PORTAL_OPENING || self->state == PORTAL_OPEN)
+        {
+          bytes = cockpit_transport_build_control ("command", "close",
+                                                   "channel", channels[i],
+                                                   "problem", problem,
+                                                   NULL);
+          send_to_portal (self, NULL, bytes, COCKPIT_PORTAL_NORMAL);
+          g_bytes_unref (bytes);
+        }
+    }
+
+  g_free (channels);
+  check_idle (self);
+}
+
 static gboolean
 on_transport_control (CockpitTransport *transport,
                       const char *command,
@@ -497,6 +662,14 @@ on_transport_control (CockpitTransport *transport,
       if (self->last_init)
         g_bytes_unref (self->last_init);
       self->last_init = g_bytes_ref (payload);
+      if (self->init_member)
+        parse_init_options (self, options);
+      return FALSE;
+    }
+
+  if (g_str_equal (command, "kill"))
+    {
+      kill_portal_channels (self, options);
       return FALSE;
     }
 
@@ -604,6 +777,9 @@ cockpit_portal_get_property (GObject *object,
     case PROP_ARGVS:
       g_value_set_pointer (value, self->argvs);
       break;
+    case PROP_INIT_MEMBER:
+      g_value_set_string (value, self->init_member);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -629,6 +805,9 @@ cockpit_portal_set_property (GObject *object,
     case PROP_ARGVS:
       self->argvs = g_value_get_pointer (value);
       break;
+    case PROP_INIT_MEMBER:
+      self->init_member = g_value_dup_string (value);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -667,6 +846,7 @@ cockpit_portal_finalize (GObject *object)
 
   if (self->last_init)
     g_bytes_unref (self->last_init);
+  g_free (self->init_member);
 
   G_OBJECT_CLASS (cockpit_portal_parent_class)->finalize (object);
 }
@@ -693,6 +873,10 @@ cockpit_portal_class_init (CockpitPortalClass *klass)
   g_object_class_install_property (gobject_class, PROP_ARGVS,
               g_param_spec_pointer ("argvs", NULL, NULL,
                                     G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_INIT_MEMBER,
+              g_param_spec_string ("init-member", NULL, NULL, NULL,
+                                   G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS));
 }
 
 void
@@ -710,6 +894,7 @@ cockpit_portal_add_channel (CockpitPortal *self,
   g_hash_table_replace (self->channels,
                         (gchar *)intern_string (self, channel),
                         GINT_TO_POINTER (flags));
+  check_idle (self);
 }
 
 static gboolean
@@ -774,6 +959,10 @@ superuser_filter (CockpitPortal *self,
  *
  * Create a new CockpitPortal to a privileged bridge
  *
+ * The "superuser" field of the "init" message can ask for the
+ * privileged bridge to be started right away, and for it to be
+ * closed when it has been idle for a while.
+ *
  * Returns: (transfer full): the new transport
  */
 CockpitPortal *
@@ -802,6 +991,7 @@ cockpit_portal_new_superuser (CockpitTransport *transport)
                        "transport", transport,
                        "filter", superuser_filter,
                        "argvs", argvs,
+                       "init-member", "superuser",
                        NULL);
 }
 
@@ -823,7 +1013,9 @@ pcp_filter (CockpitPortal *self,
         source = NULL;
 
       if (g_strcmp0 (type, "metrics1") != 0 ||
-          g_strcmp0 (source, "internal") == 0)
+          g_strcmp0 (source, "internal") == 0 ||
+          g_strcmp0 (source, "self") == 0 ||
+          g_strcmp0 (source, "history") == 0)
         {
           return FALSE;
         }
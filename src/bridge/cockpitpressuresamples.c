@@ -0,0 +1,97 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2016 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "config.h"
+
+#include "cockpitpressuresamples.h"
+#include "cockpitprocreader.h"
+
+#include <string.h>
+
+/*
+ * Pressure stall information, the time tasks were stalled waiting for
+ * a resource. The "some" line counts time when at least one task was
+ * stalled, and "full" when all of them were. Kernels without PSI
+ * don't have these files, and older ones have no "full" line for cpu.
+ */
+
+static CockpitProcReader readers[] = {
+  COCKPIT_PROC_READER_INIT ("/proc/pressure/cpu"),
+  COCKPIT_PROC_READER_INIT ("/proc/pressure/memory"),
+  COCKPIT_PROC_READER_INIT ("/proc/pressure/io"),
+};
+
+static const gchar *resources[] = { "cpu", "memory", "io" };
+
+static gboolean missing = FALSE;
+
+void
+cockpit_pressure_samples (CockpitSamples *samples)
+{
+  gchar *contents;
+  gchar *line;
+  gchar *kind;
+  gchar *word;
+  guint64 total;
+  gint i;
+
+  /* Don't complain about a missing file every tick */
+  if (missing)
+    return;
+
+  for (i = 0; i < G_N_ELEMENTS (readers); i++)
+    {
+      if (readers[i].fd < 0 && !g_file_test (readers[i].path, G_FILE_TEST_EXISTS))
+        {
+          g_debug ("no pressure stall information in this kernel");
+          missing = TRUE;
+          return;
+        }
+
+      contents = cockpit_proc_reader_read (&readers[i], NULL);
+      if (!contents)
+        continue;
+
+      /* some avg10=0.00 avg60=0.00 avg300=0.00 total=12345 */
+      while ((line = cockpit_proc_next_line (&contents)) != NULL)
+        {
+          kind = cockpit_proc_next_word (&line);
+          if (!kind)
+            continue;
+
+          while ((word = cockpit_proc_next_word (&line)) != NULL)
+            {
+              if (strncmp (word, "total=", 6) != 0)
+                continue;
+
+              word += 6;
+              if (!cockpit_proc_next_u64 (&word, &total))
+                break;
+
+              /* Microseconds in the file */
+              if (g_str_equal (kind, "some"))
+                cockpit_samples_sample (samples, "pressure.some", resources[i], total / 1000);
+              else if (g_str_equal (kind, "full"))
+                cockpit_samples_sample (samples, "pressure.full", resources[i], total / 1000);
+              break;
+            }
+        }
+    }
+}
@@ -0,0 +1,423 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2016 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "config.h"
+
+#include "cockpitprocesssamples.h"
+#include "cockpitprocreader.h"
+
+#include <linux/cn_proc.h>
+#include <linux/connector.h>
+#include <linux/netlink.h>
+#include <sys/socket.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * The processes that used the most CPU since the last tick, with their
+ * CPU time and resident memory. The instances are "<pid> <command>".
+ *
+ * Every process has its /proc/<pid>/stat read once per tick, about a
+ * microsecond each. These files are kept open and re-read with
+ * pread(), up to a limit of open files.
+ *
+ * New and exited processes are found through the netlink proc connector,
+ * when the bridge may listen to it, which needs CAP_NET_ADMIN. Otherwise,
+ * or when events were lost, /proc is listed again.
+ */
+
+#define PROCESS_TOP 10
+#define PROCESS_FDS_MAX 512
+
+typedef struct {
+  gint pid;
+  gint fd;
+  gboolean seen;
+  guint64 cpu;
+  guint64 delta;
+  guint64 rss;
+  gchar *instance;
+} Process;
+
+static GHashTable *processes;
+static gint open_fds;
+static guint64 user_hz;
+static guint64 page_size;
+
+static gint connector = -1;
+static gboolean connector_failed;
+static gboolean rescan = TRUE;
+
+static void
+process_free (gpointer data)
+{
+  Process *proc = data;
+
+  if (proc->fd >= 0)
+    {
+      close (proc->fd);
+      open_fds--;
+    }
+  g_free (proc->instance);
+  g_free (proc);
+}
+
+static Process *
+process_add (gint pid)
+{
+  Process *proc = g_new0 (Process, 1);
+
+  proc->pid = pid;
+  proc->fd = -1;
+  proc->cpu = G_MAXUINT64;
+
+  /* A pid that is used again starts over */
+  g_hash_table_replace (processes, GINT_TO_POINTER (pid), proc);
+  return proc;
+}
+
+static gboolean
+read_stat (Process *proc)
+{
+  gchar buffer[1024];
+  gchar path[64];
+  gchar *comm;
+  gchar *pos;
+  guint64 utime, stime, rss;
+  gssize len;
+  gint fd;
+  gint i;
+
+  fd = proc->fd;
+  if (fd < 0)
+    {
+      g_snprintf (path, sizeof (path), "/proc/%d/stat", proc->pid);
+      fd = open (path, O_RDONLY | O_CLOEXEC);
+      if (fd < 0)
+        return FALSE;
+      if (open_fds < PROCESS_FDS_MAX)
+        {
+          proc->fd = fd;
+          open_fds++;
+        }
+    }
+
+  do
+    len = pread (fd, buffer, sizeof (buffer) - 1, 0);
+  while (len < 0 && errno == EINTR);
+
+  if (fd != proc->fd)
+    close (fd);
+
+  if (len <= 0)
+    return FALSE;
+  buffer[len] = '\0';
+
+  /* pid (comm) state ... and the command may contain anything, even ')' */
+  comm = strchr (buffer, '(');
+  pos = strrchr (buffer, ')');
+  if (!comm || !pos || pos < comm)
+    return FALSE;
+  *(pos++) = '\0';
+  comm++;
+
+  /* Skip from the state to cmajflt, to get utime and stime */
+  for (i = 3; i < 14; i++)
+    {
+      if (!cockpit_proc_next_word (&pos))
+        return FALSE;
+    }
+  if (!cockpit_proc_next_u64 (&pos, &utime) ||
+      !cockpit_proc_next_u64 (&pos, &stime))
+    return FALSE;
+
+  /* Then on to rss, some in between can be negative */
+  for (i = 16; i < 24; i++)
+    {
+      if (!cockpit_proc_next_word (&pos))
+        return FALSE;
+    }
+  if (!cockpit_proc_next_u64 (&pos, &rss))
+    return FALSE;
+
+  if (!proc->instance)
+    proc->instance = g_strdup_printf ("%d %s", proc->pid, comm);
+
+  utime += stime;
+  proc->delta = proc->cpu == G_MAXUINT64 ? utime : utime - proc->cpu;
+  proc->cpu = utime;
+  proc->rss = rss * page_size;
+  return TRUE;
+}
+
+static void
+scan_processes (void)
+{
+  GHashTableIter iter;
+  gpointer value;
+  struct dirent *ent;
+  Process *proc;
+  gchar *end;
+  DIR *dir;
+  glong pid;
+
+  dir = opendir ("/proc");
+  if (!dir)
+    {
+      g_message ("couldn't list /proc: %s", g_strerror (errno));
+      return;
+    }
+
+  g_hash_table_iter_init (&iter, processes);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    ((Process *)value)->seen = FALSE;
+
+  while ((ent = readdir (dir)) != NULL)
+    {
+      if (ent->d_name[0] < '0' || ent->d_name[0] > '9')
+        continue;
+      pid = strtol (ent->d_name, &end, 10);
+      if (*end != '\0' || pid <= 0 || pid > G_MAXINT)
+        continue;
+
+      proc = g_hash_table_lookup (processes, GINT_TO_POINTER (pid));
+      if (!proc)
+        proc = process_add (pid);
+      proc->seen = TRUE;
+    }
+
+  closedir (dir);
+
+  g_hash_table_iter_init (&iter, processes);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      if (!((Process *)value)->seen)
+        g_hash_table_iter_remove (&iter);
+    }
+
+  rescan = FALSE;
+}
+
+static void
+connector_open (void)
+{
+  struct sockaddr_nl addr;
+  struct cn_msg *msg;
+  gint fd;
+
+  union {
+    struct nlmsghdr header;
+    gchar data[NLMSG_SPACE (sizeof (struct cn_msg) + sizeof (enum proc_cn_mcast_op))];
+  } request;
+
+  connector_failed = TRUE;
+
+  fd = socket (PF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_CONNECTOR);
+  if (fd < 0)
+    {
+      g_debug ("couldn't open proc connector: %s", g_strerror (errno));
+      return;
+    }
+
+  memset (&addr, 0, sizeof (addr));
+  addr.nl_family = AF_NETLINK;
+  addr.nl_groups = CN_IDX_PROC;
+
+  memset (&request, 0, sizeof (request));
+  request.header.nlmsg_len = NLMSG_LENGTH (sizeof (struct cn_msg) + sizeof (enum proc_cn_mcast_op));
+  request.header.nlmsg_type = NLMSG_DONE;
+  msg = NLMSG_DATA (&request.header);
+  msg->id.idx = CN_IDX_PROC;
+  msg->id.val = CN_VAL_PROC;
+  msg->len = sizeof (enum proc_cn_mcast_op);
+  *((enum proc_cn_mcast_op *)msg->data) = PROC_CN_MCAST_LISTEN;
+
+  /* Only privileged processes may listen, the rest list /proc */
+  if (bind (fd, (struct sockaddr *)&addr, sizeof (addr)) < 0 ||
+      send (fd, &request, request.header.nlmsg_len, 0) < 0)
+    {
+      g_debug ("couldn't listen to proc connector: %s", g_strerror (errno));
+      close (fd);
+      return;
+    }
+
+  connector = fd;
+  connector_failed = FALSE;
+  rescan = TRUE;
+}
+
+static void
+connector_close (void)
+{
+  close (connector);
+  connector = -1;
+  connector_failed = TRUE;
+}
+
+static void
+connector_drain (void)
+{
+  struct nlmsghdr *header;
+  struct proc_event *ev;
+  struct cn_msg *msg;
+  Process *proc;
+  gssize len;
+
+  union {
+    struct nlmsghdr header;
+    gchar data[8192];
+  } buffer;
+
+  for (;;)
+    {
+      len = recv (connector, &buffer, sizeof (buffer), 0);
+      if (len < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          if (errno == EAGAIN)
+            return;
+
+          /* Events were dropped, find out what we missed */
+          if (errno == ENOBUFS)
+            {
+              rescan = TRUE;
+              continue;
+            }
+
+          g_message ("couldn't read from proc connector: %s", g_strerror (errno));
+          connector_close ();
+          return;
+        }
+
+      for (header = &buffer.header; NLMSG_OK (header, len); header = NLMSG_NEXT (header, len))
+        {
+          if (header->nlmsg_type == NLMSG_NOOP || header->nlmsg_type == NLMSG_ERROR)
+            continue;
+
+          msg = NLMSG_DATA (header);
+          if (msg->id.idx != CN_IDX_PROC || msg->id.val != CN_VAL_PROC)
+            continue;
+
+          ev = (struct proc_event *)msg->data;
+          switch (ev->what)
+            {
+            case PROC_EVENT_NONE:
+              /* The answer to our PROC_CN_MCAST_LISTEN */
+              if (ev->event_data.ack.err != 0)
+                {
+                  g_debug ("not allowed to listen to proc connector");
+                  connector_close ();
+                  return;
+                }
+              break;
+
+            /* Threads are counted as part of their process */
+            case PROC_EVENT_FORK:
+              if (ev->event_data.fork.child_pid == ev->event_data.fork.child_tgid)
+                process_add (ev->event_data.fork.child_tgid);
+              break;
+
+            case PROC_EVENT_EXEC:
+              proc = g_hash_table_lookup (processes, GINT_TO_POINTER (ev->event_data.exec.process_tgid));
+              if (proc)
+                {
+                  g_free (proc->instance);
+                  proc->instance = NULL;
+                }
+              break;
+
+            case PROC_EVENT_EXIT:
+              if (ev->event_data.exit.process_pid == ev->event_data.exit.process_tgid)
+                g_hash_table_remove (processes, GINT_TO_POINTER (ev->event_data.exit.process_tgid));
+              break;
+
+            default:
+              break;
+            }
+        }
+    }
+}
+
+void
+cockpit_process_samples (CockpitSamples *samples)
+{
+  Process *top[PROCESS_TOP];
+  GHashTableIter iter;
+  gpointer value;
+  Process *proc;
+  gint n_top;
+  gint i;
+
+  if (!processes)
+    {
+      processes = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, process_free);
+      user_hz = sysconf (_SC_CLK_TCK);
+      if (user_hz <= 0)
+        user_hz = 100;
+      page_size = sysconf (_SC_PAGESIZE);
+    }
+
+  if (connector < 0 && !connector_failed)
+    connector_open ();
+  if (connector >= 0)
+    connector_drain ();
+  if (connector < 0 || rescan)
+    scan_processes ();
+
+  /* Keep the busiest processes, in order */
+  n_top = 0;
+  g_hash_table_iter_init (&iter, processes);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      proc = value;
+      if (!read_stat (proc))
+        {
+          g_hash_table_iter_remove (&iter);
+          continue;
+        }
+
+      if (proc->delta == 0 || (n_top == PROCESS_TOP && proc->delta <= top[n_top - 1]->delta))
+        continue;
+
+      i = MIN (n_top, PROCESS_TOP - 1);
+      if (n_top < PROCESS_TOP)
+        n_top++;
+      while (i > 0 && top[i - 1]->delta < proc->delta)
+        {
+          top[i] = top[i - 1];
+          i--;
+        }
+      top[i] = proc;
+    }
+
+  for (i = 0; i < n_top; i++)
+    {
+      proc = top[i];
+      cockpit_samples_sample (samples, "process.cpu", proc->instance, proc->cpu * 1000 / user_hz);
+      cockpit_samples_sample (samples, "process.rss", proc->instance, proc->rss);
+    }
+}
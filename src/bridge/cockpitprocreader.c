@@ -0,0 +1,203 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2016 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitprocreader.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * cockpit_proc_reader_read:
+ * @reader: the reader
+ * @length: location to place the length of the contents
+ *
+ * Read the whole file from the start. The file is opened on the
+ * first call and then kept open. The returned contents are null
+ * terminated, and valid until the next call.
+ *
+ * Returns: (transfer none): the contents or NULL on failure
+ */
+gchar *
+cockpit_proc_reader_read (CockpitProcReader *reader,
+                          gsize *length)
+{
+  gsize offset = 0;
+  gssize ret;
+
+  if (reader->fd < 0)
+    {
+      reader->fd = open (reader->path, O_RDONLY | O_CLOEXEC);
+      if (reader->fd < 0)
+        {
+          g_message ("error opening %s: %s", reader->path, g_strerror (errno));
+          return NULL;
+        }
+    }
+
+  if (reader->buffer == NULL)
+    {
+      reader->allocated = 4096;
+      reader->buffer = g_malloc (reader->allocated);
+    }
+
+  for (;;)
+    {
+      /* Leave room for the null terminator */
+      if (offset + 1 >= reader->allocated)
+        {
+          reader->allocated *= 2;
+          reader->buffer = g_realloc (reader->buffer, reader->allocated);
+        }
+
+      ret = pread (reader->fd, reader->buffer + offset, reader->allocated - offset - 1, offset);
+      if (ret < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          g_message ("error reading %s: %s", reader->path, g_strerror (errno));
+          cockpit_proc_reader_close (reader);
+          return NULL;
+        }
+      else if (ret == 0)
+        {
+          break;
+        }
+
+      offset += ret;
+    }
+
+  reader->buffer[offset] = '\0';
+  if (length)
+    *length = offset;
+  return reader->buffer;
+}
+
+/**
+ * cockpit_proc_reader_close:
+ * @reader: the reader
+ *
+ * Close the file and free the buffer. The reader can be used
+ * again afterwards, and will reopen the file.
+ */
+void
+cockpit_proc_reader_close (CockpitProcReader *reader)
+{
+  if (reader->fd >= 0)
+    close (reader->fd);
+  reader->fd = -1;
+  g_free (reader->buffer);
+  reader->buffer = NULL;
+  reader->allocated = 0;
+}
+
+/**
+ * cockpit_proc_next_line:
+ * @pos: the current position, advanced past the line
+ *
+ * Returns: (transfer none): the next line, null terminated, or NULL at the end
+ */
+gchar *
+cockpit_proc_next_line (gchar **pos)
+{
+  gchar *line = *pos;
+  gchar *end;
+
+  if (line == NULL || *line == '\0')
+    return NULL;
+
+  end = strchr (line, '\n');
+  if (end)
+    {
+      *end = '\0';
+      *pos = end + 1;
+    }
+  else
+    {
+      *pos = line + strlen (line);
+    }
+
+  return line;
+}
+
+/**
+ * cockpit_proc_next_word:
+ * @pos: the current position, advanced past the word
+ *
+ * Returns: (transfer none): the next white space separated word, null
+ *          terminated, or NULL when there are no more
+ */
+gchar *
+cockpit_proc_next_word (gchar **pos)
+{
+  gchar *p = *pos;
+  gchar *word;
+
+  while (*p == ' ' || *p == '\t')
+    p++;
+
+  if (*p == '\0')
+    {
+      *pos = p;
+      return NULL;
+    }
+
+  word = p;
+  while (*p != '\0' && *p != ' ' && *p != '\t')
+    p++;
+
+  if (*p != '\0')
+    *(p++) = '\0';
+
+  *pos = p;
+  return word;
+}
+
+/**
+ * cockpit_proc_next_u64:
+ * @pos: the current position, advanced past the number
+ * @value: location to place the number
+ *
+ * Parse the next white space separated unsigned decimal number.
+ *
+ * Returns: FALSE if there is no number at @pos
+ */
+gboolean
+cockpit_proc_next_u64 (gchar **pos,
+                       guint64 *value)
+{
+  gchar *p = *pos;
+  guint64 v = 0;
+
+  while (*p == ' ' || *p == '\t')
+    p++;
+
+  if (*p < '0' || *p > '9')
+    return FALSE;
+
+  while (*p >= '0' && *p <= '9')
+    v = v * 10 + (*(p++) - '0');
+
+  *pos = p;
+  *value = v;
+  return TRUE;
+}
@@ -0,0 +1,59 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2016 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COCKPIT_PROC_READER_H__
+#define COCKPIT_PROC_READER_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Reads a /proc file over and over, keeping the file descriptor
+ * open and reusing the buffer between reads. Declare one statically:
+ *
+ *   static CockpitProcReader reader = COCKPIT_PROC_READER_INIT ("/proc/stat");
+ */
+
+typedef struct {
+  const gchar *path;
+  gint fd;
+  gchar *buffer;
+  gsize allocated;
+} CockpitProcReader;
+
+#define COCKPIT_PROC_READER_INIT(path) { (path), -1, NULL, 0 }
+
+gchar *         cockpit_proc_reader_read      (CockpitProcReader *reader,
+                                               gsize *length);
+
+void            cockpit_proc_reader_close     (CockpitProcReader *reader);
+
+/* Tokenizing the contents, these modify the buffer in place */
+
+gchar *         cockpit_proc_next_line        (gchar **pos);
+
+gchar *         cockpit_proc_next_word        (gchar **pos);
+
+gboolean        cockpit_proc_next_u64         (gchar **pos,
+                                               guint64 *value);
+
+G_END_DECLS
+
+#endif /* COCKPIT_PROC_READER_H__ */
@@ -0,0 +1,220 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2016 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitblocksamples.h"
+#include "cockpitcpusamples.h"
+#include "cockpitdisksamples.h"
+#include "cockpitmemorysamples.h"
+#include "cockpitmetricsring.h"
+#include "cockpitmountsamples.h"
+#include "cockpitnetworksamples.h"
+#include "cockpitpressuresamples.h"
+#include "cockpitsamples.h"
+
+#include "common/cockpitlog.h"
+
+#include <glib-unix.h>
+
+#include <sys/time.h>
+
+#include <signal.h>
+#include <unistd.h>
+
+/*
+ * Records the system wide internal metrics into a ring file, for
+ * hosts that don't run pmlogger. A metrics1 channel with a "source"
+ * of "history" plays it back. The file never grows past the number
+ * of rows and columns it was started with.
+ */
+
+static gchar *opt_file = NULL;
+static gint opt_interval = 60000;
+static gint opt_rows = 1440;
+static gint opt_columns = 512;
+
+typedef struct {
+  GObject parent;
+  CockpitMetricsRing *ring;
+  gboolean full;
+} RingSamples;
+
+typedef GObjectClass RingSamplesClass;
+
+static void ring_samples_interface_init (CockpitSamplesIface *iface);
+
+static GType ring_samples_get_type (void) G_GNUC_CONST;
+
+G_DEFINE_TYPE_WITH_CODE (RingSamples, ring_samples, G_TYPE_OBJECT,
+                         G_IMPLEMENT_INTERFACE (COCKPIT_TYPE_SAMPLES,
+                                                ring_samples_interface_init))
+
+static void
+ring_samples_init (RingSamples *self)
+{
+}
+
+static void
+ring_samples_class_init (RingSamplesClass *klass)
+{
+}
+
+static void
+ring_samples_sample (CockpitSamples *samples,
+                     const gchar *metric,
+                     const gchar *instance,
+                     gint64 value)
+{
+  RingSamples *self = (RingSamples *)samples;
+  gint column;
+
+  if (value == COCKPIT_SAMPLES_NONE)
+    return;
+
+  column = cockpit_metrics_ring_add_column (self->ring, metric, instance);
+  if (column < 0)
+    {
+      if (!self->full)
+        g_message ("no room to record %s %s, not recording new instances",
+                   metric, instance ? instance : "");
+      self->full = TRUE;
+      return;
+    }
+
+  cockpit_metrics_ring_set_value (self->ring, column, value);
+}
+
+static void
+ring_samples_interface_init (CockpitSamplesIface *iface)
+{
+  iface->sample = ring_samples_sample;
+}
+
+static gboolean
+on_timeout (gpointer user_data)
+{
+  CockpitSamples *samples = user_data;
+  RingSamples *self = user_data;
+  struct timeval now;
+
+  gettimeofday (&now, NULL);
+
+  cockpit_metrics_ring_begin_row (self->ring, (gint64)now.tv_sec * 1000 + now.tv_usec / 1000);
+  cockpit_cpu_samples (samples, TRUE);
+  cockpit_memory_samples (samples);
+  cockpit_block_samples (samples);
+  cockpit_disk_samples (samples);
+  cockpit_network_samples (samples);
+  cockpit_mount_samples (samples);
+  cockpit_pressure_samples (samples);
+  cockpit_metrics_ring_commit_row (self->ring);
+
+  return TRUE;
+}
+
+static gboolean
+on_signal_done (gpointer data)
+{
+  gboolean *closed = data;
+  *closed = TRUE;
+  return TRUE;
+}
+
+int
+main (int argc,
+      char **argv)
+{
+  GOptionContext *context;
+  GError *error = NULL;
+  RingSamples *samples;
+  gboolean terminated = FALSE;
+  guint sig_term;
+  guint sig_int;
+  guint timeout;
+
+  static GOptionEntry entries[] = {
+    { "file", 0, 0, G_OPTION_ARG_FILENAME, &opt_file, "Ring file to record into", "path" },
+    { "interval", 0, 0, G_OPTION_ARG_INT, &opt_interval, "Milliseconds between samples", "msec" },
+    { "rows", 0, 0, G_OPTION_ARG_INT, &opt_rows, "Samples to keep", "count" },
+    { "columns", 0, 0, G_OPTION_ARG_INT, &opt_columns, "Most metric instances to keep", "count" },
+    { NULL }
+  };
+
+  signal (SIGPIPE, SIG_IGN);
+
+  g_setenv ("GSETTINGS_BACKEND", "memory", TRUE);
+  g_setenv ("GIO_USE_PROXY_RESOLVER", "dummy", TRUE);
+  g_setenv ("GIO_USE_VFS", "local", TRUE);
+
+  context = g_option_context_new (NULL);
+  g_option_context_add_main_entries (context, entries, NULL);
+  g_option_context_set_description (context,
+                                    "cockpit-recorder keeps a history of system metrics for Cockpit.\n");
+
+  g_option_context_parse (context, &argc, &argv, &error);
+  g_option_context_free (context);
+
+  if (error)
+    {
+      g_printerr ("cockpit-recorder: %s\n", error->message);
+      g_error_free (error);
+      return 2;
+    }
+
+  if (opt_interval <= 0 || opt_rows <= 0 || opt_columns <= 0)
+    {
+      g_printerr ("cockpit-recorder: invalid arguments\n");
+      return 2;
+    }
+
+  cockpit_set_journal_logging (G_LOG_DOMAIN, !isatty (2));
+
+  g_type_init ();
+
+  samples = g_object_new (ring_samples_get_type (), NULL);
+  samples->ring = cockpit_metrics_ring_create (opt_file ? opt_file : COCKPIT_METRICS_RING_FILE,
+                                               opt_interval, opt_rows, opt_columns, &error);
+  if (!samples->ring)
+    {
+      g_warning ("%s", error->message);
+      g_error_free (error);
+      g_object_unref (samples);
+      return 1;
+    }
+
+  sig_term = g_unix_signal_add (SIGTERM, on_signal_done, &terminated);
+  sig_int = g_unix_signal_add (SIGINT, on_signal_done, &terminated);
+
+  on_timeout (samples);
+  timeout = g_timeout_add (opt_interval, on_timeout, samples);
+
+  while (!terminated)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_source_remove (timeout);
+  g_source_remove (sig_term);
+  g_source_remove (sig_int);
+
+  cockpit_metrics_ring_free (samples->ring);
+  g_object_unref (samples);
+  g_free (opt_file);
+
+  return 0;
+}
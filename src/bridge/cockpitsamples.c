@@ -44,3 +44,28 @@ cockpit_samples_sample (CockpitSamples *self,
   g_assert (iface->sample);
   (iface->sample) (self, metric, instance, value);
 }
+
+/**
+ * cockpit_samples_wanted:
+ * @self: the samples
+ * @instance: an instance name
+ *
+ * Samplers check this before they read anything for @instance, so
+ * that instances nobody asked for cost nothing. The samples of an
+ * instance that isn't wanted may still be passed, and are dropped.
+ *
+ * Returns: whether samples for @instance are wanted
+ */
+gboolean
+cockpit_samples_wanted (CockpitSamples *self,
+                        const gchar *instance)
+{
+  CockpitSamplesIface *iface;
+
+  iface = COCKPIT_SAMPLES_GET_IFACE (self);
+  g_return_val_if_fail (iface != NULL, TRUE);
+
+  if (!iface->wanted)
+    return TRUE;
+  return (iface->wanted) (self, instance);
+}
@@ -39,8 +39,14 @@ struct _CockpitSamplesIface {
                                    const gchar *metric,
                                    const gchar *instance,
                                    gint64 value);
+
+  gboolean   (* wanted)           (CockpitSamples *samples,
+                                   const gchar *instance);
 };
 
+/* A value for an instance that exists, but couldn't be sampled this time */
+#define COCKPIT_SAMPLES_NONE G_MININT64
+
 GType               cockpit_samples_get_type        (void) G_GNUC_CONST;
 
 void                cockpit_samples_sample          (CockpitSamples *self,
@@ -48,6 +54,9 @@ void                cockpit_samples_sample          (CockpitSamples *self,
                                                      const gchar *instance,
                                                      gint64 value);
 
+gboolean            cockpit_samples_wanted          (CockpitSamples *self,
+                                                     const gchar *instance);
+
 G_END_DECLS
 
 #endif /* COCKPIT_SAMPLES_H__ */
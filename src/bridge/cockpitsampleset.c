@@ -0,0 +1,406 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2016 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitsampleset.h"
+
+/**
+ * CockpitSampleSet:
+ *
+ * A #CockpitSamples implementation that records the samples it
+ * is given, so they can be collected on the sampler thread and later
+ * handed to another #CockpitSamples on the main loop.
+ *
+ * All collection runs on a single sampler thread, so the samplers
+ * themselves never run concurrently and can keep static state.
+ *
+ * Each metric and instance pair is given a numeric key the first time
+ * it is sampled. Sets made with cockpit_sample_set_new_sharing() use
+ * the same keys, so a consumer can look it up by key rather than by
+ * name. Keys are kept for as long as any set that shares them.
+ */
+
+typedef struct {
+  guint id;
+  const gchar *metric;
+  gchar *instance;
+} Key;
+
+typedef struct {
+  volatile gint refs;
+  /* metric name -> instance name -> Key, only used on the sampler thread */
+  GHashTable *metrics;
+  GPtrArray *keys;
+} Keys;
+
+typedef struct {
+  const Key *key;
+  gint64 value;
+} Sample;
+
+struct _CockpitSampleSet {
+  GObject parent;
+  GArray *samples;
+  Keys *keys;
+
+  /* Read on the sampler thread, never changed once set */
+  GHashTable *filter;
+  gboolean omit;
+
+  /* Only valid while collecting */
+  gboolean collecting;
+  CockpitSampleFunc func;
+  guint flags;
+  GSourceFunc done;
+  gpointer user_data;
+  GMainContext *context;
+};
+
+typedef struct {
+  GObjectClass parent_class;
+} CockpitSampleSetClass;
+
+static void cockpit_samples_interface_init (CockpitSamplesIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (CockpitSampleSet, cockpit_sample_set, G_TYPE_OBJECT,
+                         G_IMPLEMENT_INTERFACE (COCKPIT_TYPE_SAMPLES,
+                                                cockpit_samples_interface_init))
+
+static GAsyncQueue *sampler_queue;
+
+static void
+key_free (gpointer data)
+{
+  Key *key = data;
+  g_free (key->instance);
+  g_free (key);
+}
+
+static Keys *
+keys_new (void)
+{
+  Keys *keys = g_new0 (Keys, 1);
+  keys->refs = 1;
+  keys->metrics = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                         (GDestroyNotify)g_hash_table_unref);
+  keys->keys = g_ptr_array_new_with_free_func (key_free);
+  return keys;
+}
+
+static void
+keys_unref (Keys *keys)
+{
+  if (g_atomic_int_dec_and_test (&keys->refs))
+    {
+      g_hash_table_unref (keys->metrics);
+      g_ptr_array_free (keys->keys, TRUE);
+      g_free (keys);
+    }
+}
+
+static const Key *
+keys_lookup (Keys *keys,
+             const gchar *metric,
+             const gchar *instance)
+{
+  GHashTable *instances;
+  gpointer name;
+  Key *key;
+
+  if (!g_hash_table_lookup_extended (keys->metrics, metric, &name, (gpointer *)&instances))
+    {
+      name = g_strdup (metric);
+      instances = g_hash_table_new (g_str_hash, g_str_equal);
+      g_hash_table_insert (keys->metrics, name, instances);
+    }
+
+  key = g_hash_table_lookup (instances, instance ? instance : "");
+  if (!key)
+    {
+      key = g_new0 (Key, 1);
+      key->id = keys->keys->len;
+      key->metric = name;
+      key->instance = g_strdup (instance);
+      g_ptr_array_add (keys->keys, key);
+      g_hash_table_insert (instances, key->instance ? key->instance : (gchar *)"", key);
+    }
+
+  return key;
+}
+
+static void
+cockpit_sample_set_init (CockpitSampleSet *self)
+{
+  self->samples = g_array_new (FALSE, FALSE, sizeof (Sample));
+}
+
+static void
+cockpit_sample_set_finalize (GObject *object)
+{
+  CockpitSampleSet *self = COCKPIT_SAMPLE_SET (object);
+
+  g_assert (!self->collecting);
+
+  g_array_free (self->samples, TRUE);
+  keys_unref (self->keys);
+  if (self->filter)
+    g_hash_table_unref (self->filter);
+
+  G_OBJECT_CLASS (cockpit_sample_set_parent_class)->finalize (object);
+}
+
+static void
+cockpit_sample_set_class_init (CockpitSampleSetClass *klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+  gobject_class->finalize = cockpit_sample_set_finalize;
+}
+
+static void
+cockpit_sample_set_sample (CockpitSamples *samples,
+                           const gchar *metric,
+                           const gchar *instance,
+                           gint64 value)
+{
+  CockpitSampleSet *self = COCKPIT_SAMPLE_SET (samples);
+  Sample sample;
+
+  /* Samplers pass instance names that point into their read buffers */
+  sample.key = keys_lookup (self->keys, metric, instance);
+  sample.value = value;
+  g_array_append_val (self->samples, sample);
+}
+
+static gboolean
+cockpit_sample_set_wanted (CockpitSamples *samples,
+                           const gchar *instance)
+{
+  CockpitSampleSet *self = COCKPIT_SAMPLE_SET (samples);
+
+  if (!self->filter)
+    return TRUE;
+  return g_hash_table_contains (self->filter, instance) != self->omit;
+}
+
+static void
+cockpit_samples_interface_init (CockpitSamplesIface *iface)
+{
+  iface->sample = cockpit_sample_set_sample;
+  iface->wanted = cockpit_sample_set_wanted;
+}
+
+CockpitSampleSet *
+cockpit_sample_set_new (void)
+{
+  CockpitSampleSet *self = g_object_new (COCKPIT_TYPE_SAMPLE_SET, NULL);
+  self->keys = keys_new ();
+  return self;
+}
+
+/**
+ * cockpit_sample_set_new_sharing:
+ * @other: a set to share keys with
+ *
+ * Create a set whose samples have the same keys as those of @other,
+ * as passed to cockpit_sample_set_foreach().
+ *
+ * Returns: (transfer full): the new set
+ */
+CockpitSampleSet *
+cockpit_sample_set_new_sharing (CockpitSampleSet *other)
+{
+  CockpitSampleSet *self;
+
+  g_return_val_if_fail (COCKPIT_IS_SAMPLE_SET (other), NULL);
+
+  self = g_object_new (COCKPIT_TYPE_SAMPLE_SET, NULL);
+  self->keys = other->keys;
+  g_atomic_int_inc (&self->keys->refs);
+  return self;
+}
+
+void
+cockpit_sample_set_clear (CockpitSampleSet *self)
+{
+  g_return_if_fail (COCKPIT_IS_SAMPLE_SET (self));
+  g_return_if_fail (!self->collecting);
+
+  g_array_set_size (self->samples, 0);
+}
+
+/**
+ * cockpit_sample_set_filter:
+ * @self: the set
+ * @instances: (allow-none): a set of instance names
+ * @omit: whether @instances are the ones not wanted
+ *
+ * Tell the samplers which instances to read, see
+ * cockpit_samples_wanted(). Without @instances all of them are.
+ * The table must not change after this, since it's used on the
+ * sampler thread. Sets that share keys don't share the filter.
+ */
+void
+cockpit_sample_set_filter (CockpitSampleSet *self,
+                           GHashTable *instances,
+                           gboolean omit)
+{
+  g_return_if_fail (COCKPIT_IS_SAMPLE_SET (self));
+  g_return_if_fail (!self->collecting);
+
+  if (instances)
+    g_hash_table_ref (instances);
+  if (self->filter)
+    g_hash_table_unref (self->filter);
+  self->filter = instances;
+  self->omit = omit;
+}
+
+void
+cockpit_sample_set_replay (CockpitSampleSet *self,
+                           CockpitSamples *samples)
+{
+  Sample *sample;
+  guint i;
+
+  g_return_if_fail (COCKPIT_IS_SAMPLE_SET (self));
+  g_return_if_fail (!self->collecting);
+
+  for (i = 0; i < self->samples->len; i++)
+    {
+      sample = &g_array_index (self->samples, Sample, i);
+      cockpit_samples_sample (samples, sample->key->metric, sample->key->instance, sample->value);
+    }
+}
+
+/**
+ * cockpit_sample_set_foreach:
+ * @self: the set
+ * @func: called for each sample
+ * @user_data: passed to @func
+ *
+ * Like cockpit_sample_set_replay() but also passes the key of each
+ * sample. The key is a small number, the same for every sample of a
+ * given metric and instance, in this set and all that share its keys.
+ */
+void
+cockpit_sample_set_foreach (CockpitSampleSet *self,
+                            CockpitSampleSetFunc func,
+                            gpointer user_data)
+{
+  Sample *sample;
+  guint i;
+
+  g_return_if_fail (COCKPIT_IS_SAMPLE_SET (self));
+  g_return_if_fail (!self->collecting);
+
+  for (i = 0; i < self->samples->len; i++)
+    {
+      sample = &g_array_index (self->samples, Sample, i);
+      (func) (sample->key->id, sample->key->metric, sample->key->instance, sample->value, user_data);
+    }
+}
+
+static gboolean
+on_collected (gpointer data)
+{
+  CockpitSampleSet *self = data;
+  GSourceFunc done;
+  gpointer user_data;
+
+  done = self->done;
+  user_data = self->user_data;
+
+  self->collecting = FALSE;
+  self->func = NULL;
+  self->done = NULL;
+  self->user_data = NULL;
+  g_main_context_unref (self->context);
+  self->context = NULL;
+
+  (done) (user_data);
+
+  g_object_unref (self);
+  return FALSE;
+}
+
+static gpointer
+sampler_thread (gpointer data)
+{
+  CockpitSampleSet *self;
+  GSource *source;
+
+  for (;;)
+    {
+      self = g_async_queue_pop (sampler_queue);
+
+      (self->func) (COCKPIT_SAMPLES (self), self->flags);
+
+      source = g_idle_source_new ();
+      g_source_set_priority (source, G_PRIORITY_DEFAULT);
+      g_source_set_callback (source, on_collected, self, NULL);
+      g_source_attach (source, self->context);
+      g_source_unref (source);
+    }
+
+  return NULL;
+}
+
+/**
+ * cockpit_sample_set_collect:
+ * @self: the set to collect into
+ * @func: the function which calls the samplers
+ * @flags: passed to @func
+ * @done: called when collection is complete
+ * @user_data: passed to @done
+ *
+ * Clears the set and runs @func on the sampler thread to fill it.
+ * @done is then invoked from the thread default main context
+ * of the caller. The set must not be touched until then.
+ */
+void
+cockpit_sample_set_collect (CockpitSampleSet *self,
+                            CockpitSampleFunc func,
+                            guint flags,
+                            GSourceFunc done,
+                            gpointer user_data)
+{
+  static gsize started = 0;
+
+  g_return_if_fail (COCKPIT_IS_SAMPLE_SET (self));
+  g_return_if_fail (!self->collecting);
+
+  if (g_once_init_enter (&started))
+    {
+      sampler_queue = g_async_queue_new ();
+      g_thread_unref (g_thread_new ("sampler", sampler_thread, NULL));
+      g_once_init_leave (&started, 1);
+    }
+
+  cockpit_sample_set_clear (self);
+
+  self->collecting = TRUE;
+  self->func = func;
+  self->flags = flags;
+  self->done = done;
+  self->user_data = user_data;
+  self->context = g_main_context_ref_thread_default ();
+
+  g_async_queue_push (sampler_queue, g_object_ref (self));
+}
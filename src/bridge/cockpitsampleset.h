@@ -0,0 +1,69 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2016 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COCKPIT_SAMPLE_SET_H__
+#define COCKPIT_SAMPLE_SET_H__
+
+#include "cockpitsamples.h"
+
+G_BEGIN_DECLS
+
+#define COCKPIT_TYPE_SAMPLE_SET         (cockpit_sample_set_get_type ())
+#define COCKPIT_SAMPLE_SET(o)           (G_TYPE_CHECK_INSTANCE_CAST ((o), COCKPIT_TYPE_SAMPLE_SET, CockpitSampleSet))
+#define COCKPIT_IS_SAMPLE_SET(o)        (G_TYPE_CHECK_INSTANCE_TYPE ((o), COCKPIT_TYPE_SAMPLE_SET))
+
+typedef struct _CockpitSampleSet CockpitSampleSet;
+
+typedef void        (* CockpitSampleFunc)             (CockpitSamples *samples,
+                                                       guint flags);
+
+typedef void        (* CockpitSampleSetFunc)          (guint key,
+                                                       const gchar *metric,
+                                                       const gchar *instance,
+                                                       gint64 value,
+                                                       gpointer user_data);
+
+GType               cockpit_sample_set_get_type       (void) G_GNUC_CONST;
+
+CockpitSampleSet *  cockpit_sample_set_new            (void);
+
+CockpitSampleSet *  cockpit_sample_set_new_sharing    (CockpitSampleSet *other);
+
+void                cockpit_sample_set_clear          (CockpitSampleSet *self);
+
+void                cockpit_sample_set_filter         (CockpitSampleSet *self,
+                                                       GHashTable *instances,
+                                                       gboolean omit);
+
+void                cockpit_sample_set_replay         (CockpitSampleSet *self,
+                                                       CockpitSamples *samples);
+
+void                cockpit_sample_set_foreach        (CockpitSampleSet *self,
+                                                       CockpitSampleSetFunc func,
+                                                       gpointer user_data);
+
+void                cockpit_sample_set_collect        (CockpitSampleSet *self,
+                                                       CockpitSampleFunc func,
+                                                       guint flags,
+                                                       GSourceFunc done,
+                                                       gpointer user_data);
+
+G_END_DECLS
+
+#endif /* COCKPIT_SAMPLE_SET_H__ */
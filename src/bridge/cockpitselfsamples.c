@@ -0,0 +1,102 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2016 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitselfsamples.h"
+
+#include "common/cockpitmemory.h"
+#include "common/cockpitstats.h"
+
+/* Samples the bridge's own stats, see cockpitstats.c */
+
+static void
+on_stats (const gchar *instance,
+          const gssize *values,
+          gpointer user_data)
+{
+  CockpitSamples *samples = user_data;
+  gssize rss;
+  guint i;
+
+  if (instance)
+    {
+      cockpit_samples_sample (samples, "bridge.channel.open", instance,
+                              values[COCKPIT_STAT_CHANNEL_OPEN]);
+      cockpit_samples_sample (samples, "bridge.channel.opened", instance,
+                              values[COCKPIT_STAT_CHANNEL_OPENED]);
+      cockpit_samples_sample (samples, "bridge.channel.messages", instance,
+                              values[COCKPIT_STAT_CHANNEL_MESSAGES]);
+      cockpit_samples_sample (samples, "bridge.channel.bytes", instance,
+                              values[COCKPIT_STAT_CHANNEL_BYTES]);
+      cockpit_samples_sample (samples, "bridge.channel.ready-time", instance,
+                              values[COCKPIT_STAT_CHANNEL_READY_TIME]);
+    }
+  else
+    {
+      cockpit_samples_sample (samples, "bridge.pipe.queued", NULL,
+                              values[COCKPIT_STAT_PIPE_QUEUED]);
+      cockpit_samples_sample (samples, "bridge.pipe.written", NULL,
+                              values[COCKPIT_STAT_PIPE_WRITTEN]);
+      cockpit_samples_sample (samples, "bridge.dbus.calls", NULL,
+                              values[COCKPIT_STAT_DBUS_CALLS]);
+      for (i = 0; i < COCKPIT_STATS_BUCKETS; i++)
+        {
+          cockpit_samples_sample (samples, "bridge.dbus.latency", cockpit_stats_bucket_names[i],
+                                  values[COCKPIT_STAT_DBUS_LATENCY + i]);
+        }
+      cockpit_samples_sample (samples, "bridge.metrics.samples", NULL,
+                              values[COCKPIT_STAT_METRICS_SAMPLES]);
+      rss = cockpit_memory_rss ();
+      cockpit_samples_sample (samples, "bridge.memory.rss", NULL,
+                              rss < 0 ? COCKPIT_SAMPLES_NONE : rss);
+      cockpit_samples_sample (samples, "bridge.memory.trimmed", NULL,
+                              values[COCKPIT_STAT_MEMORY_TRIMMED]);
+      cockpit_samples_sample (samples, "bridge.memory.used", "dbus-cache",
+                              values[COCKPIT_STAT_MEMORY_DBUS_CACHE]);
+      cockpit_samples_sample (samples, "bridge.memory.used", "packages",
+                              values[COCKPIT_STAT_MEMORY_PACKAGES]);
+      cockpit_samples_sample (samples, "bridge.memory.used", "buffers",
+                              values[COCKPIT_STAT_PIPE_QUEUED_BYTES]);
+    }
+}
+
+static void
+on_group_stats (const gchar *group,
+                const gssize *values,
+                gpointer user_data)
+{
+  CockpitSamples *samples = user_data;
+
+  cockpit_samples_sample (samples, "bridge.group.channels", group,
+                          values[COCKPIT_STAT_GROUP_CHANNELS]);
+  cockpit_samples_sample (samples, "bridge.group.received", group,
+                          values[COCKPIT_STAT_GROUP_BYTES_IN]);
+  cockpit_samples_sample (samples, "bridge.group.sent", group,
+                          values[COCKPIT_STAT_GROUP_BYTES_OUT]);
+  cockpit_samples_sample (samples, "bridge.group.queued", group,
+                          values[COCKPIT_STAT_GROUP_QUEUED]);
+}
+
+void
+cockpit_self_samples (CockpitSamples *samples)
+{
+  cockpit_stats_foreach (on_stats, samples);
+  cockpit_stats_foreach_group (on_group_stats, samples);
+}
@@ -0,0 +1,607 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitspawnpool.h"
+
+#include "common/cockpitjson.h"
+#include "common/cockpitpipe.h"
+#include "common/cockpitsystem.h"
+#include "common/cockpitunicode.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Most output one command may produce before its request fails */
+gsize cockpit_spawn_pool_output_maximum = 16 * 1024 * 1024;
+
+/**
+ * CockpitSpawnPool:
+ *
+ * A #CockpitChannel that runs many short commands through one
+ * long lived shell. Each message on the channel is a request to
+ * run a command, and each reply carries the output and exit status
+ * of one command, in the order the requests were sent.
+ *
+ * The shell stays around for as long as the channel, so polling a
+ * command doesn't cost a channel and a bridge fork each time. The
+ * commands run one after another, never in parallel.
+ *
+ * The payload type for this channel is 'spawn-pool1'.
+ */
+
+#define COCKPIT_SPAWN_POOL(o)    (G_TYPE_CHECK_INSTANCE_CAST ((o), COCKPIT_TYPE_SPAWN_POOL, CockpitSpawnPool))
+
+typedef struct {
+  CockpitChannel parent;
+  CockpitPipe *pipe;
+  gboolean open;
+  gboolean closing;
+  guint sig_read;
+  guint sig_close;
+
+  /* Line that the shell prints after each command */
+  gchar *boundary;
+  gsize scanned;
+
+  /* The current command produced too much, its output is dropped */
+  gboolean overflowed;
+
+  /* Request ids of the commands that are running or queued */
+  GQueue *pending;
+} CockpitSpawnPool;
+
+typedef struct {
+  CockpitChannelClass parent_class;
+} CockpitSpawnPoolClass;
+
+G_DEFINE_TYPE (CockpitSpawnPool, cockpit_spawn_pool, COCKPIT_TYPE_CHANNEL);
+
+/*
+ * Each line that the shell reads is one command, already quoted by
+ * us. It runs in a subshell so that it can't change the state of the
+ * pool shell. When it's done a line with the boundary and the exit
+ * status is printed, which starts with a newline in case the output
+ * of the command didn't end with one.
+ */
+static const gchar pool_script[] =
+  "nl='\n'\n"
+  "while IFS= read -r line; do\n"
+  "  (eval \"$line\") </dev/null\n"
+  "  printf '\\n%s %d\\n' \"$1\" \"$?\"\n"
+  "done\n";
+
+static void
+append_quoted (GString *line,
+               const gchar *arg)
+{
+  const gchar *p;
+
+  /* Newlines would end the command line, so they come from $nl */
+  g_string_append_c (line, '\'');
+  for (p = arg; *p != '\0'; p++)
+    {
+      if (*p == '\'')
+        g_string_append (line, "'\\''");
+      else if (*p == '\n')
+        g_string_append (line, "'\"$nl\"'");
+      else
+        g_string_append_c (line, *p);
+    }
+  g_string_append_c (line, '\'');
+}
+
+static gboolean
+valid_variable_name (const gchar *name,
+                     gsize length)
+{
+  gsize i;
+
+  if (length == 0 || g_ascii_isdigit (name[0]))
+    return FALSE;
+  for (i = 0; i < length; i++)
+    {
+      if (!g_ascii_isalnum (name[i]) && name[i] != '_')
+        return FALSE;
+    }
+  return TRUE;
+}
+
+static gchar *
+build_command_line (JsonObject *request)
+{
+  const gchar *directory;
+  const gchar *error;
+  gchar **argv = NULL;
+  gchar **env = NULL;
+  GString *line = NULL;
+  const gchar *pos;
+  gint i;
+
+  if (!cockpit_json_get_strv (request, "spawn", NULL, &argv) || !argv || !argv[0])
+    {
+      g_warning ("invalid or missing \"spawn\" field in spawn-pool1 request");
+      goto out;
+    }
+  if (!cockpit_json_get_strv (request, "environ", NULL, &env))
+    {
+      g_warning ("invalid \"environ\" field in spawn-pool1 request");
+      goto out;
+    }
+  if (!cockpit_json_get_string (request, "directory", NULL, &directory))
+    {
+      g_warning ("invalid \"directory\" field in spawn-pool1 request");
+      goto out;
+    }
+  if (!cockpit_json_get_string (request, "err", NULL, &error))
+    {
+      g_warning ("invalid \"err\" field in spawn-pool1 request");
+      goto out;
+    }
+
+  line = g_string_new ("");
+
+  if (directory)
+    {
+      g_string_append (line, "cd -- ");
+      append_quoted (line, directory);
+      g_string_append (line, " && ");
+    }
+
+  for (i = 0; env && env[i] != NULL; i++)
+    {
+      pos = strchr (env[i], '=');
+      if (!pos || !valid_variable_name (env[i], pos - env[i]))
+        {
+          g_warning ("invalid variable in \"environ\" field of spawn-pool1 request: %s", env[i]);
+          g_string_free (line, TRUE);
+          line = NULL;
+          goto out;
+        }
+      g_string_append_len (line, env[i], (pos - env[i]) + 1);
+      append_quoted (line, pos + 1);
+      g_string_append_c (line, ' ');
+    }
+
+  for (i = 0; argv[i] != NULL; i++)
+    {
+      if (i > 0)
+        g_string_append_c (line, ' ');
+      append_quoted (line, argv[i]);
+    }
+
+  /* By default stderr goes wherever the bridge's stderr goes */
+  if (g_strcmp0 (error, "out") == 0)
+    g_string_append (line, " 2>&1");
+  else if (g_strcmp0 (error, "ignore") == 0)
+    g_string_append (line, " 2>/dev/null");
+
+  g_string_append_c (line, '\n');
+
+out:
+  g_free (argv);
+  g_free (env);
+  return line ? g_string_free (line, FALSE) : NULL;
+}
+
+static void
+cockpit_spawn_pool_recv (CockpitChannel *channel,
+                         GBytes *message)
+{
+  CockpitSpawnPool *self = COCKPIT_SPAWN_POOL (channel);
+  JsonObject *request = NULL;
+  GError *error = NULL;
+  const gchar *id;
+  gchar *line = NULL;
+  GBytes *bytes;
+
+  if (!self->open)
+    return;
+
+  request = cockpit_json_parse_bytes (message, &error);
+  if (!request)
+    {
+      g_warning ("failed to parse spawn-pool1 request: %s", error->message);
+      g_error_free (error);
+      cockpit_channel_close (channel, "protocol-error");
+      goto out;
+    }
+
+  if (!cockpit_json_get_string (request, "id", NULL, &id) || !id)
+    {
+      g_warning ("invalid or missing \"id\" field in spawn-pool1 request");
+      cockpit_channel_close (channel, "protocol-error");
+      goto out;
+    }
+
+  line = build_command_line (request);
+  if (!line)
+    {
+      cockpit_channel_close (channel, "protocol-error");
+      goto out;
+    }
+
+  g_queue_push_tail (self->pending, g_strdup (id));
+
+  bytes = g_bytes_new_take (line, strlen (line));
+  cockpit_pipe_write (self->pipe, bytes);
+  g_bytes_unref (bytes);
+
+out:
+  if (request)
+    json_object_unref (request);
+}
+
+/*
+ * Forced into UTF-8 between the nul bytes, which would otherwise become
+ * replacement characters. The nul bytes are kept, as \u0000 escapes.
+ */
+static void
+append_output (GString *json,
+               const guint8 *data,
+               gsize length)
+{
+  const guint8 *nul;
+  GString *output;
+  GBytes *bytes;
+  GBytes *clean;
+  gconstpointer part;
+  gsize size;
+
+  output = g_string_sized_new (length);
+  for (;;)
+    {
+      nul = memchr (data, '\0', length);
+      size = nul ? nul - data : length;
+
+      bytes = g_bytes_new_static (data, size);
+      clean = cockpit_unicode_force_utf8 (bytes);
+      part = g_bytes_get_data (clean, &size);
+      g_string_append_len (output, part, size);
+      g_bytes_unref (clean);
+      g_bytes_unref (bytes);
+
+      if (!nul)
+        break;
+
+      g_string_append_c (output, '\0');
+      length -= (nul - data) + 1;
+      data = nul + 1;
+    }
+
+  cockpit_json_append_string_len (json, output->str, output->len);
+  g_string_free (output, TRUE);
+}
+
+static void
+send_result (CockpitSpawnPool *self,
+             const gchar *id,
+             const guint8 *output,
+             gsize length,
+             gint status)
+{
+  GString *json;
+  GBytes *bytes;
+
+  /* Written by hand, as a JSON string member can't hold nul bytes */
+  json = g_string_new ("{\"id\":");
+  cockpit_json_append_string (json, id);
+  g_string_append_printf (json, ",\"exit-status\":%d,\"output\":", status);
+  append_output (json, output, length);
+  g_string_append_c (json, '}');
+
+  bytes = g_string_free_to_bytes (json);
+  cockpit_channel_send (COCKPIT_CHANNEL (self), bytes, TRUE);
+  g_bytes_unref (bytes);
+}
+
+static void
+send_too_large (CockpitSpawnPool *self,
+                const gchar *id)
+{
+  JsonObject *object;
+  GBytes *bytes;
+
+  object = json_object_new ();
+  json_object_set_string_member (object, "id", id);
+  json_object_set_string_member (object, "problem", "too-large");
+  json_object_set_string_member (object, "message", "the command produced too much output");
+
+  bytes = cockpit_json_write_bytes (object);
+  json_object_unref (object);
+
+  cockpit_channel_send (COCKPIT_CHANNEL (self), bytes, TRUE);
+  g_bytes_unref (bytes);
+}
+
+static void
+process_output (CockpitSpawnPool *self,
+                GByteArray *buffer)
+{
+  gsize blen = strlen (self->boundary);
+  const guint8 *line;
+  const guint8 *end;
+  gchar *status;
+  gchar *id;
+  gsize pos;
+
+  while (self->scanned < buffer->len)
+    {
+      line = memchr (buffer->data + self->scanned, '\n', buffer->len - self->scanned);
+      if (!line)
+        {
+          self->scanned = buffer->len;
+          break;
+        }
+
+      pos = line - buffer->data;
+
+      /* Not enough data yet to know if this is the boundary */
+      end = memchr (line + 1, '\n', buffer->len - (pos + 1));
+      if (!end)
+        {
+          /* Longer than a boundary line with any exit status */
+          if (buffer->len - (pos + 1) > blen + 16)
+            {
+              self->scanned = pos + 1;
+              continue;
+            }
+
+          self->scanned = pos;
+          break;
+        }
+
+      if ((gsize)(end - line) <= blen + 1 ||
+          memcmp (line + 1, self->boundary, blen) != 0 ||
+          line[blen + 1] != ' ')
+        {
+          self->scanned = pos + 1;
+          continue;
+        }
+
+      /* Its request has already failed */
+      if (self->overflowed)
+        {
+          self->overflowed = FALSE;
+        }
+      else
+        {
+          status = g_strndup ((const gchar *)line + blen + 2, end - (line + blen + 2));
+          id = g_queue_pop_head (self->pending);
+          if (id)
+            send_result (self, id, buffer->data, pos, atoi (status));
+          else
+            g_warning ("spawn-pool1 shell reported a command that wasn't requested");
+          g_free (status);
+          g_free (id);
+        }
+
+      g_byte_array_remove_range (buffer, 0, (end - buffer->data) + 1);
+      self->scanned = 0;
+    }
+
+  /*
+   * The command keeps running to the end, but its request fails now,
+   * and the output scanned so far is dropped as it comes in.
+   */
+  if (!self->overflowed && buffer->len > cockpit_spawn_pool_output_maximum)
+    {
+      id = g_queue_pop_head (self->pending);
+      if (id)
+        send_too_large (self, id);
+      g_free (id);
+      self->overflowed = TRUE;
+    }
+
+  if (self->overflowed && self->scanned > 0)
+    {
+      g_byte_array_remove_range (buffer, 0, self->scanned);
+      self->scanned = 0;
+    }
+}
+
+static void
+on_pipe_read (CockpitPipe *pipe,
+              GByteArray *data,
+              gboolean end_of_data,
+              gpointer user_data)
+{
+  CockpitSpawnPool *self = user_data;
+
+  process_output (self, data);
+
+  if (end_of_data && self->open)
+    cockpit_pipe_close (pipe, NULL);
+}
+
+static void
+on_pipe_close (CockpitPipe *pipe,
+               const gchar *problem,
+               gpointer user_data)
+{
+  CockpitSpawnPool *self = user_data;
+  CockpitChannel *channel = user_data;
+  JsonObject *options;
+
+  process_output (self, cockpit_pipe_get_buffer (pipe));
+
+  self->open = FALSE;
+
+  if (problem == NULL && !g_queue_is_empty (self->pending))
+    {
+      options = cockpit_channel_close_options (channel);
+      json_object_set_string_member (options, "message", "spawn pool shell exited unexpectedly");
+      problem = "internal-error";
+    }
+
+  if (problem == NULL)
+    cockpit_channel_control (channel, "done", NULL);
+
+  cockpit_channel_close (channel, problem);
+}
+
+static gboolean
+cockpit_spawn_pool_control (CockpitChannel *channel,
+                            const gchar *command,
+                            JsonObject *message)
+{
+  CockpitSpawnPool *self = COCKPIT_SPAWN_POOL (channel);
+
+  /* No more requests, close when the queued commands are done */
+  if (g_str_equal (command, "done"))
+    {
+      if (self->open)
+        cockpit_pipe_close (self->pipe, NULL);
+      return TRUE;
+    }
+
+  return FALSE;
+}
+
+static void
+cockpit_spawn_pool_close (CockpitChannel *channel,
+                          const gchar *problem)
+{
+  CockpitSpawnPool *self = COCKPIT_SPAWN_POOL (channel);
+
+  self->closing = TRUE;
+
+  /*
+   * If closed, call base class handler directly. Otherwise ask
+   * our pipe to close first, which will come back here.
+  */
+  if (self->open)
+    cockpit_pipe_close (self->pipe, problem);
+  else
+    COCKPIT_CHANNEL_CLASS (cockpit_spawn_pool_parent_class)->close (channel, problem);
+}
+
+static void
+cockpit_spawn_pool_pressure (CockpitChannel *channel,
+                             gboolean pressure)
+{
+  CockpitSpawnPool *self = COCKPIT_SPAWN_POOL (channel);
+  if (self->open)
+    cockpit_pipe_throttle (self->pipe, pressure);
+}
+
+static gchar *
+generate_boundary (void)
+{
+  const guint8 *data;
+  GString *string;
+  GBytes *nonce;
+  gsize length;
+  gsize i;
+
+  nonce = cockpit_system_random_nonce (16);
+  if (!nonce)
+    return NULL;
+
+  data = g_bytes_get_data (nonce, &length);
+  string = g_string_new ("cockpit-");
+  for (i = 0; i < length; i++)
+    g_string_append_printf (string, "%02x", (guint)data[i]);
+  g_bytes_unref (nonce);
+
+  return g_string_free (string, FALSE);
+}
+
+static void
+cockpit_spawn_pool_prepare (CockpitChannel *channel)
+{
+  CockpitSpawnPool *self = COCKPIT_SPAWN_POOL (channel);
+  const gchar *argv[] = { "/bin/sh", "-c", pool_script, "cockpit-spawn-pool", NULL, NULL };
+  JsonObject *options;
+
+  COCKPIT_CHANNEL_CLASS (cockpit_spawn_pool_parent_class)->prepare (channel);
+  if (self->closing)
+    return;
+
+  self->boundary = generate_boundary ();
+  if (!self->boundary)
+    {
+      options = cockpit_channel_close_options (channel);
+      json_object_set_string_member (options, "message", "couldn't generate spawn pool boundary");
+      cockpit_channel_close (channel, "internal-error");
+      return;
+    }
+
+  argv[4] = self->boundary;
+  self->pipe = cockpit_pipe_spawn (argv, NULL, NULL, COCKPIT_PIPE_FLAGS_NONE);
+
+  self->sig_read = g_signal_connect (self->pipe, "read", G_CALLBACK (on_pipe_read), self);
+  self->sig_close = g_signal_connect (self->pipe, "close", G_CALLBACK (on_pipe_close), self);
+  self->open = TRUE;
+  cockpit_channel_ready (channel);
+}
+
+static void
+cockpit_spawn_pool_init (CockpitSpawnPool *self)
+{
+  self->pending = g_queue_new ();
+}
+
+static void
+cockpit_spawn_pool_dispose (GObject *object)
+{
+  CockpitSpawnPool *self = COCKPIT_SPAWN_POOL (object);
+
+  if (self->pipe)
+    {
+      if (self->open)
+        cockpit_pipe_close (self->pipe, "terminated");
+      if (self->sig_read)
+        g_signal_handler_disconnect (self->pipe, self->sig_read);
+      if (self->sig_close)
+        g_signal_handler_disconnect (self->pipe, self->sig_close);
+      self->sig_read = self->sig_close = 0;
+    }
+
+  G_OBJECT_CLASS (cockpit_spawn_pool_parent_class)->dispose (object);
+}
+
+static void
+cockpit_spawn_pool_finalize (GObject *object)
+{
+  CockpitSpawnPool *self = COCKPIT_SPAWN_POOL (object);
+
+  g_clear_object (&self->pipe);
+  g_queue_free_full (self->pending, g_free);
+  g_free (self->boundary);
+
+  G_OBJECT_CLASS (cockpit_spawn_pool_parent_class)->finalize (object);
+}
+
+static void
+cockpit_spawn_pool_class_init (CockpitSpawnPoolClass *klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+  CockpitChannelClass *channel_class = COCKPIT_CHANNEL_CLASS (klass);
+
+  gobject_class->dispose = cockpit_spawn_pool_dispose;
+  gobject_class->finalize = cockpit_spawn_pool_finalize;
+
+  channel_class->prepare = cockpit_spawn_pool_prepare;
+  channel_class->control = cockpit_spawn_pool_control;
+  channel_class->recv = cockpit_spawn_pool_recv;
+  channel_class->close = cockpit_spawn_pool_close;
+  channel_class->pressure = cockpit_spawn_pool_pressure;
+}
@@ -30,6 +30,362 @@
 
 #include <string.h>
 
+/**
+ * CockpitWebSocketUpstream
+ *
+ * Channels that have been given the same connection name share an
+ * upstream. It keeps a few spare connections that have already
+ * connected and done their TLS handshake, so that a new channel only
+ * needs to do the WebSocket handshake. A WebSocket never gives its
+ * connection back, so each time a spare is taken another one is made.
+ *
+ * Spares are closed after a short while, or when the server closes
+ * them. When glib supports it, new TLS connections also resume the
+ * TLS session of an earlier one.
+ */
+
+/* Defaults for the "pool-size" and "pool-timeout" options */
+#define SPARE_SIZE     1
+#define SPARE_TIMEOUT  10
+
+typedef struct {
+  gint refs;
+  gchar *name;
+  CockpitConnectable *connectable;
+
+  /* Spare connections, CockpitWebSocketSpare */
+  GQueue *spares;
+  guint connecting;
+  gint64 pool_size;
+  gint64 pool_timeout;
+
+  /* A connection whose TLS session can be resumed */
+  GTlsConnection *session;
+
+  /* Statistics, shown in debug output */
+  guint connects;
+  guint reuses;
+  guint expired;
+} CockpitWebSocketUpstream;
+
+typedef struct {
+  CockpitWebSocketUpstream *upstream;
+  GIOStream *io;
+  GSource *watch;
+  guint timeout;
+} CockpitWebSocketSpare;
+
+static GHashTable *upstreams;
+
+static void
+cockpit_web_socket_spare_free (CockpitWebSocketSpare *spare)
+{
+  if (spare->timeout)
+    g_source_remove (spare->timeout);
+  if (spare->watch)
+    {
+      g_source_destroy (spare->watch);
+      g_source_unref (spare->watch);
+    }
+  if (spare->io)
+    {
+      g_io_stream_close (spare->io, NULL, NULL);
+      g_object_unref (spare->io);
+    }
+  g_slice_free (CockpitWebSocketSpare, spare);
+}
+
+static void
+cockpit_web_socket_upstream_debug (CockpitWebSocketUpstream *upstream)
+{
+  g_debug ("%s: upstream has %u spare, %u connecting, %u connects, %u reuses, %u expired",
+           upstream->name, g_queue_get_length (upstream->spares), upstream->connecting,
+           upstream->connects, upstream->reuses, upstream->expired);
+}
+
+static void
+cockpit_web_socket_upstream_unref (gpointer data)
+{
+  CockpitWebSocketUpstream *upstream = data;
+  if (--upstream->refs == 0)
+    {
+      g_queue_free_full (upstream->spares, (GDestroyNotify)cockpit_web_socket_spare_free);
+      if (upstream->connectable)
+        cockpit_connectable_unref (upstream->connectable);
+      if (upstream->session)
+        g_object_unref (upstream->session);
+      g_free (upstream->name);
+      g_slice_free (CockpitWebSocketUpstream, upstream);
+    }
+}
+
+static CockpitWebSocketUpstream *
+cockpit_web_socket_upstream_ref (CockpitWebSocketUpstream *upstream)
+{
+  upstream->refs++;
+  return upstream;
+}
+
+static CockpitWebSocketUpstream *
+cockpit_web_socket_upstream_ensure (const gchar *name)
+{
+  CockpitWebSocketUpstream *upstream;
+
+  if (!upstreams)
+    upstreams = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, cockpit_web_socket_upstream_unref);
+
+  upstream = g_hash_table_lookup (upstreams, name);
+  if (!upstream)
+    {
+      g_debug ("%s: registering upstream", name);
+      upstream = g_slice_new0 (CockpitWebSocketUpstream);
+      upstream->refs = 1;
+      upstream->name = g_strdup (name);
+      upstream->spares = g_queue_new ();
+      upstream->pool_size = SPARE_SIZE;
+      upstream->pool_timeout = SPARE_TIMEOUT;
+      g_hash_table_replace (upstreams, upstream->name, upstream);
+    }
+
+  return cockpit_web_socket_upstream_ref (upstream);
+}
+
+static gboolean
+cockpit_web_socket_upstream_parse_pool (CockpitWebSocketUpstream *upstream,
+                                        JsonObject *options)
+{
+  gint64 size;
+  gint64 timeout;
+
+  if (!cockpit_json_get_int (options, "pool-size", upstream->pool_size, &size) ||
+      size < 0 || size > G_MAXINT)
+    {
+      g_warning ("bad \"pool-size\" field in WebSocket stream request");
+      return FALSE;
+    }
+
+  if (!cockpit_json_get_int (options, "pool-timeout", upstream->pool_timeout, &timeout) ||
+      timeout <= 0 || timeout > G_MAXUINT / 1000)
+    {
+      g_warning ("bad \"pool-timeout\" field in WebSocket stream request");
+      return FALSE;
+    }
+
+  upstream->pool_size = size;
+  upstream->pool_timeout = timeout;
+
+  while (g_queue_get_length (upstream->spares) > upstream->pool_size)
+    cockpit_web_socket_spare_free (g_queue_pop_tail (upstream->spares));
+
+  return TRUE;
+}
+
+/* Called with each new connection before it does any I/O */
+static void
+cockpit_web_socket_upstream_resume (CockpitWebSocketUpstream *upstream,
+                                    GIOStream *io)
+{
+#if defined (GLIB_VERSION_2_46) && GLIB_VERSION_MAX_ALLOWED >= GLIB_VERSION_2_46
+  if (upstream && upstream->session && G_IS_TLS_CLIENT_CONNECTION (io))
+    {
+      g_tls_client_connection_copy_session_state (G_TLS_CLIENT_CONNECTION (io),
+                                                  G_TLS_CLIENT_CONNECTION (upstream->session));
+    }
+#endif
+}
+
+/* Called with each connection that completed its TLS handshake */
+static void
+cockpit_web_socket_upstream_remember (CockpitWebSocketUpstream *upstream,
+                                      GIOStream *io)
+{
+#if defined (GLIB_VERSION_2_46) && GLIB_VERSION_MAX_ALLOWED >= GLIB_VERSION_2_46
+  if (upstream && G_IS_TLS_CONNECTION (io) && (GIOStream *)upstream->session != io)
+    {
+      if (upstream->session)
+        g_object_unref (upstream->session);
+      upstream->session = g_object_ref (io);
+    }
+#endif
+}
+
+static void
+on_spare_gone (CockpitWebSocketSpare *spare)
+{
+  g_queue_remove (spare->upstream->spares, spare);
+  cockpit_web_socket_spare_free (spare);
+}
+
+static gboolean
+on_spare_timeout (gpointer data)
+{
+  CockpitWebSocketSpare *spare = data;
+  g_debug ("%s: spare connection timed out", spare->upstream->name);
+  spare->timeout = 0;
+  spare->upstream->expired++;
+  on_spare_gone (spare);
+  return FALSE;
+}
+
+static gboolean
+on_spare_input (GObject *stream,
+                gpointer data)
+{
+  CockpitWebSocketSpare *spare = data;
+  GError *error = NULL;
+  gchar buffer[1];
+  gssize ret;
+
+  /*
+   * A server doesn't send anything before the WebSocket handshake. But TLS
+   * can process records of its own, like session tickets, and then there
+   * is nothing to read.
+   */
+  ret = g_pollable_input_stream_read_nonblocking (G_POLLABLE_INPUT_STREAM (stream),
+                                                  buffer, sizeof (buffer), NULL, &error);
+  if (ret < 0 && g_error_matches (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK))
+    {
+      g_error_free (error);
+      return TRUE;
+    }
+
+  g_debug ("%s: spare connection closed: %s", spare->upstream->name,
+           error ? error->message : (ret == 0 ? "end of data" : "unexpected data"));
+  g_clear_error (&error);
+
+  /* Don't destroy the source while in it */
+  g_source_unref (spare->watch);
+  spare->watch = NULL;
+  on_spare_gone (spare);
+  return FALSE;
+}
+
+static void
+cockpit_web_socket_upstream_add_spare (CockpitWebSocketUpstream *upstream,
+                                       GIOStream *io)
+{
+  CockpitWebSocketSpare *spare;
+  GInputStream *input;
+
+  if (g_queue_get_length (upstream->spares) >= upstream->pool_size)
+    {
+      g_io_stream_close (io, NULL, NULL);
+      return;
+    }
+
+  spare = g_slice_new0 (CockpitWebSocketSpare);
+  spare->upstream = upstream;
+  spare->io = g_object_ref (io);
+
+  input = g_io_stream_get_input_stream (io);
+  if (G_IS_POLLABLE_INPUT_STREAM (input))
+    {
+      spare->watch = g_pollable_input_stream_create_source (G_POLLABLE_INPUT_STREAM (input), NULL);
+      g_source_set_callback (spare->watch, (GSourceFunc)on_spare_input, spare, NULL);
+      g_source_attach (spare->watch, NULL);
+    }
+
+  spare->timeout = g_timeout_add_seconds (upstream->pool_timeout, on_spare_timeout, spare);
+  g_queue_push_head (upstream->spares, spare);
+
+  cockpit_web_socket_upstream_debug (upstream);
+}
+
+static void
+on_spare_handshake (GObject *object,
+                    GAsyncResult *result,
+                    gpointer user_data)
+{
+  CockpitWebSocketUpstream *upstream = user_data;
+  GError *error = NULL;
+
+  upstream->connecting--;
+
+  if (g_tls_connection_handshake_finish (G_TLS_CONNECTION (object), result, &error))
+    {
+      cockpit_web_socket_upstream_remember (upstream, G_IO_STREAM (object));
+      cockpit_web_socket_upstream_add_spare (upstream, G_IO_STREAM (object));
+    }
+  else
+    {
+      g_debug ("%s: couldn't handshake spare connection: %s", upstream->name, error->message);
+      g_error_free (error);
+    }
+
+  cockpit_web_socket_upstream_unref (upstream);
+}
+
+static void
+on_spare_connect (GObject *object,
+                  GAsyncResult *result,
+                  gpointer user_data)
+{
+  CockpitWebSocketUpstream *upstream = user_data;
+  GError *error = NULL;
+  GIOStream *io;
+
+  io = cockpit_connect_stream_finish (result, &error);
+  if (io && G_IS_TLS_CONNECTION (io))
+    {
+      /* Still connecting until the handshake is done */
+      cockpit_web_socket_upstream_resume (upstream, io);
+      g_tls_connection_handshake_async (G_TLS_CONNECTION (io), G_PRIORITY_DEFAULT, NULL,
+                                        on_spare_handshake, cockpit_web_socket_upstream_ref (upstream));
+    }
+  else
+    {
+      upstream->connecting--;
+      if (io)
+        {
+          cockpit_web_socket_upstream_add_spare (upstream, io);
+        }
+      else
+        {
+          g_debug ("%s: couldn't connect spare connection: %s", upstream->name, error->message);
+          g_error_free (error);
+        }
+    }
+
+  if (io)
+    g_object_unref (io);
+  cockpit_web_socket_upstream_unref (upstream);
+}
+
+static void
+cockpit_web_socket_upstream_fill (CockpitWebSocketUpstream *upstream)
+{
+  while (g_queue_get_length (upstream->spares) + upstream->connecting < upstream->pool_size)
+    {
+      upstream->connecting++;
+      cockpit_connect_stream_full (upstream->connectable, NULL, on_spare_connect,
+                                   cockpit_web_socket_upstream_ref (upstream));
+    }
+}
+
+static GIOStream *
+cockpit_web_socket_upstream_checkout (CockpitWebSocketUpstream *upstream)
+{
+  CockpitWebSocketSpare *spare;
+  GIOStream *io = NULL;
+
+  spare = g_queue_pop_head (upstream->spares);
+  if (spare)
+    {
+      g_debug ("%s: using spare connection", upstream->name);
+      io = spare->io;
+      spare->io = NULL;
+      cockpit_web_socket_spare_free (spare);
+      upstream->reuses++;
+    }
+  else
+    {
+      upstream->connects++;
+    }
+
+  cockpit_web_socket_upstream_debug (upstream);
+  return io;
+}
+
 /**
  * CockpitWebSocketStream:
  *
@@ -46,6 +402,7 @@ typedef struct _CockpitWebSocketStream {
   /* The nickname for debugging and logging */
   gchar *url;
   gchar *origin;
+  CockpitWebSocketUpstream *upstream;
 
   /* The connection */
   WebSocketConnection *client;
@@ -158,6 +515,8 @@ on_web_socket_open (WebSocketConnection *connection,
   GHashTableIter iter;
   gpointer key, value;
 
+  cockpit_web_socket_upstream_remember (self->upstream, web_socket_connection_get_io_stream (connection));
+
   headers = json_object_new ();
 
   g_hash_table_iter_init (&iter, web_socket_client_get_headers (WEB_SOCKET_CLIENT (self->client)));
@@ -255,28 +614,17 @@ on_web_socket_close (WebSocketConnection *connection,
 }
 
 static void
-on_socket_connect (GObject *object,
-                   GAsyncResult *result,
-                   gpointer user_data)
+start_web_socket (CockpitWebSocketStream *self,
+                  GIOStream *io)
 {
-  CockpitWebSocketStream *self = COCKPIT_WEB_SOCKET_STREAM (user_data);
   CockpitChannel *channel = COCKPIT_CHANNEL (self);
   const gchar *problem = "protocol-error";
   gchar **protocols = NULL;
   GList *l, *names = NULL;
-  GError *error = NULL;
   JsonObject *options;
   JsonObject *headers;
   const gchar *value;
   JsonNode *node;
-  GIOStream *io;
-
-  io = cockpit_connect_stream_finish (result, &error);
-  if (error)
-    {
-      problem = cockpit_stream_problem (error, self->origin, "couldn't connect", NULL);
-      goto out;
-    }
 
   options = cockpit_channel_get_options (channel);
 
@@ -338,21 +686,44 @@ on_socket_connect (GObject *object,
 out:
   if (problem)
     cockpit_channel_close (channel, problem);
-  g_clear_error (&error);
   g_strfreev (protocols);
-  if (io)
-    g_object_unref (io);
   g_list_free (names);
 }
 
+static void
+on_socket_connect (GObject *object,
+                   GAsyncResult *result,
+                   gpointer user_data)
+{
+  CockpitWebSocketStream *self = COCKPIT_WEB_SOCKET_STREAM (user_data);
+  GError *error = NULL;
+  GIOStream *io;
+
+  io = cockpit_connect_stream_finish (result, &error);
+  if (error)
+    {
+      cockpit_channel_close (COCKPIT_CHANNEL (self),
+                             cockpit_stream_problem (error, self->origin, "couldn't connect", NULL));
+      g_error_free (error);
+    }
+  else
+    {
+      cockpit_web_socket_upstream_resume (self->upstream, io);
+      start_web_socket (self, io);
+      g_object_unref (io);
+    }
+}
+
 static void
 cockpit_web_socket_stream_prepare (CockpitChannel *channel)
 {
   CockpitWebSocketStream *self = COCKPIT_WEB_SOCKET_STREAM (channel);
   CockpitConnectable *connectable = NULL;
+  const gchar *connection;
   JsonObject *options;
   const gchar *path;
   gboolean started = FALSE;
+  GIOStream *io = NULL;
 
   COCKPIT_CHANNEL_CLASS (cockpit_web_socket_stream_parent_class)->prepare (channel);
 
@@ -375,15 +746,47 @@ cockpit_web_socket_stream_prepare (CockpitChannel *channel)
       goto out;
     }
 
+  if (!cockpit_json_get_string (options, "connection", NULL, &connection))
+    {
+      g_warning ("%s: bad \"connection\" field in WebSocket stream request", self->origin);
+      goto out;
+    }
+
+  if (connection)
+    {
+      self->upstream = cockpit_web_socket_upstream_ensure (connection);
+      if (!cockpit_web_socket_upstream_parse_pool (self->upstream, options))
+        goto out;
+
+      /* The most recent options are used for spares */
+      if (self->upstream->connectable)
+        cockpit_connectable_unref (self->upstream->connectable);
+      self->upstream->connectable = cockpit_connectable_ref (connectable);
+    }
+
   self->url = g_strdup_printf ("%s://%s%s", connectable->tls ? "wss" : "ws", connectable->name, path);
   self->origin = g_strdup_printf ("%s://%s", connectable->tls ? "https" : "http", connectable->name);
 
   /* Parsed elsewhere */
   self->binary = json_object_has_member (options, "binary");
 
-  cockpit_connect_stream_full (connectable, NULL, on_socket_connect, g_object_ref (self));
+  if (self->upstream)
+    io = cockpit_web_socket_upstream_checkout (self->upstream);
+
+  if (io)
+    {
+      start_web_socket (self, io);
+      g_object_unref (io);
+    }
+  else
+    {
+      cockpit_connect_stream_full (connectable, NULL, on_socket_connect, g_object_ref (self));
+    }
   started = TRUE;
 
+  if (self->upstream)
+    cockpit_web_socket_upstream_fill (self->upstream);
+
 out:
   if (connectable)
     {
@@ -427,6 +830,8 @@ cockpit_web_socket_stream_finalize (GObject *object)
 
   g_free (self->url);
   g_free (self->origin);
+  if (self->upstream)
+    cockpit_web_socket_upstream_unref (self->upstream);
   g_assert (self->client == NULL);
 
   G_OBJECT_CLASS (cockpit_web_socket_stream_parent_class)->finalize (object);
@@ -71,6 +71,33 @@ static const char *string_value = "foobar";
 static int counter = 0;
 static int64_t counter64 = INT64_MAX - 100;
 
+/*
+ * For benchmarks, the instances of mock.instances can be a long run of
+ * "inst-N" names, with some of their values changing and some of them
+ * replaced by new ones on each churn.
+ */
+static int many_first = 0;
+static int many_count = 0;
+static int many_cursor = 0;
+static int many_tick = 0;
+
+static void
+store_many (int n,
+            int value)
+{
+  char name[32];
+  snprintf (name, sizeof (name), "inst-%d", n);
+  pmdaCacheStore (instances_indom, PMDA_CACHE_ADD, name, (void *)(intptr_t)value);
+}
+
+static void
+cull_many (int n)
+{
+  char name[32];
+  snprintf (name, sizeof (name), "inst-%d", n);
+  pmdaCacheStore (instances_indom, PMDA_CACHE_CULL, name, NULL);
+}
+
 static int
 mock_fetchCallBack(pmdaMetric *mdesc, unsigned int inst, pmAtomValue *atom)
 {
@@ -135,6 +162,7 @@ mock_control (const char *cmd, ...)
       string_value = "foobar";
       counter = 0;
       counter64 = INT64_MAX - 100;
+      many_first = many_count = many_cursor = many_tick = 0;
     }
   else if (strcmp (cmd, "set-value") == 0)
     {
@@ -168,6 +196,32 @@ mock_control (const char *cmd, ...)
       int val = va_arg (ap, int);
       counter64 += val;
     }
+  else if (strcmp (cmd, "add-many") == 0)
+    {
+      int count = va_arg (ap, int);
+      int i;
+      for (i = 0; i < count; i++)
+        store_many (many_first + many_count + i, i);
+      many_count += count;
+    }
+  else if (strcmp (cmd, "churn-many") == 0)
+    {
+      int changed = va_arg (ap, int);
+      int replaced = va_arg (ap, int);
+      int i;
+      many_tick++;
+      for (i = 0; i < changed && many_count > 0; i++)
+        {
+          many_cursor = (many_cursor + 1) % many_count;
+          store_many (many_first + many_cursor, many_tick + many_cursor);
+        }
+      for (i = 0; i < replaced && many_count > 0; i++)
+        {
+          cull_many (many_first);
+          many_first++;
+          store_many (many_first + many_count - 1, many_tick);
+        }
+    }
   va_end(ap);
 }
 
@@ -139,6 +139,14 @@ mock_transport_send (CockpitTransport *transport,
   self->count++;
 }
 
+static void
+mock_transport_pressure (CockpitTransport *transport,
+                         gboolean pressure)
+{
+  MockTransport *self = (MockTransport *)transport;
+  self->pressure = pressure;
+}
+
 static void
 mock_transport_close (CockpitTransport *transport,
                       const gchar *problem)
@@ -161,6 +169,7 @@ mock_transport_class_init (MockTransportClass *klass)
   g_object_class_override_property (object_class, 1, "name");
   transport_class->send = mock_transport_send;
   transport_class->close = mock_transport_close;
+  transport_class->pressure = mock_transport_pressure;
 }
 
 MockTransport *
@@ -32,6 +32,7 @@ typedef struct {
   CockpitTransport parent;
   gboolean closed;
   gchar *problem;
+  gboolean pressure;
   guint count;
   GQueue *control;
   GHashTable *channels;
@@ -30,6 +30,8 @@
 
 #include <gio/gio.h>
 
+#include <string.h>
+
 extern const gchar *cockpit_bridge_local_address;
 
 /* ----------------------------------------------------------------------------
@@ -170,6 +172,367 @@ test_recv_and_queue (TestCase *tc,
   g_bytes_unref (payload);
 }
 
+static void
+test_route_channels (void)
+{
+  MockTransport *transport;
+  CockpitChannel *channels[3];
+  GBytes *payload;
+  GBytes *sent;
+  gchar *id;
+  guint i;
+
+  transport = g_object_new (mock_transport_get_type (), NULL);
+  for (i = 0; i < G_N_ELEMENTS (channels); i++)
+    {
+      id = g_strdup_printf ("%u", i);
+      channels[i] = mock_echo_channel_open (COCKPIT_TRANSPORT (transport), id);
+      cockpit_channel_ready (channels[i]);
+      g_free (id);
+    }
+  while (g_main_context_iteration (NULL, FALSE));
+
+  /* Each message goes to its own channel */
+  payload = g_bytes_new_static ("Yeehaw!", 7);
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (transport), "1", payload);
+  g_assert (mock_transport_pop_channel (transport, "0") == NULL);
+  g_assert (mock_transport_pop_channel (transport, "2") == NULL);
+  sent = mock_transport_pop_channel (transport, "1");
+  g_assert (sent != NULL);
+  cockpit_assert_bytes_eq (sent, "Yeehaw!", 7);
+
+  /* A closed channel no longer gets messages, and others still do */
+  cockpit_channel_close (channels[1], NULL);
+  g_assert (mock_transport_pop_channel (transport, "1") == NULL);
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (transport), "1", payload);
+  g_assert (mock_transport_pop_channel (transport, "1") == NULL);
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (transport), "2", payload);
+  sent = mock_transport_pop_channel (transport, "2");
+  g_assert (sent != NULL);
+  cockpit_assert_bytes_eq (sent, "Yeehaw!", 7);
+
+  g_bytes_unref (payload);
+  for (i = 0; i < G_N_ELEMENTS (channels); i++)
+    g_object_unref (channels[i]);
+  g_object_add_weak_pointer (G_OBJECT (transport), (gpointer *)&transport);
+  g_object_unref (transport);
+  g_assert (transport == NULL);
+}
+
+static void
+test_batch_send (void)
+{
+  MockTransport *transport;
+  CockpitChannel *channel;
+  JsonObject *options;
+  GBytes *payload;
+  GBytes *sent;
+
+  transport = g_object_new (mock_transport_get_type (), NULL);
+
+  options = json_object_new ();
+  json_object_set_int_member (options, "batch", 10);
+  json_object_set_int_member (options, "latency", 10);
+  channel = g_object_new (mock_echo_channel_get_type (),
+                          "transport", transport,
+                          "id", "554",
+                          "options", options,
+                          NULL);
+  json_object_unref (options);
+
+  cockpit_channel_prepare (channel);
+  cockpit_channel_ready (channel);
+  g_assert (mock_transport_pop_control (transport) != NULL);
+
+  payload = g_bytes_new_static ("Yeehaw!", 7);
+
+  /* Held back until batch size is reached */
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (transport), "554", payload);
+  g_assert (mock_transport_pop_channel (transport, "554") == NULL);
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (transport), "554", payload);
+  sent = mock_transport_pop_channel (transport, "554");
+  g_assert (sent != NULL);
+  cockpit_assert_bytes_eq (sent, "Yeehaw!Yeehaw!", 14);
+
+  /* Flushed after the latency timeout */
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (transport), "554", payload);
+  g_assert (mock_transport_pop_channel (transport, "554") == NULL);
+  while ((sent = mock_transport_pop_channel (transport, "554")) == NULL)
+    g_main_context_iteration (NULL, TRUE);
+  cockpit_assert_bytes_eq (sent, "Yeehaw!", 7);
+
+  /* Flushed before the close message */
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (transport), "554", payload);
+  cockpit_channel_close (channel, NULL);
+  sent = mock_transport_pop_channel (transport, "554");
+  g_assert (sent != NULL);
+  cockpit_assert_bytes_eq (sent, "Yeehaw!", 7);
+
+  g_bytes_unref (payload);
+  g_object_unref (channel);
+  g_object_unref (transport);
+}
+
+static void
+test_framing_send (gconstpointer data)
+{
+  const gchar *framing = data;
+  gboolean lines = g_str_equal (framing, "lines");
+  MockTransport *transport;
+  CockpitChannel *channel;
+  JsonObject *options;
+  GBytes *payload;
+  GBytes *sent;
+
+  transport = g_object_new (mock_transport_get_type (), NULL);
+
+  options = json_object_new ();
+  json_object_set_string_member (options, "framing", framing);
+  channel = g_object_new (mock_echo_channel_get_type (),
+                          "transport", transport,
+                          "id", "554",
+                          "options", options,
+                          NULL);
+  json_object_unref (options);
+
+  cockpit_channel_prepare (channel);
+  cockpit_channel_ready (channel);
+  g_assert (mock_transport_pop_control (transport) != NULL);
+
+  /* Whole records go out as they are */
+  payload = g_bytes_new_static (lines ? "one\ntwo\n" : "\x1e" "1\n\x1e" "2\n", lines ? 8 : 6);
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (transport), "554", payload);
+  g_bytes_unref (payload);
+  sent = mock_transport_pop_channel (transport, "554");
+  g_assert (sent != NULL);
+  cockpit_assert_bytes_eq (sent, lines ? "one\ntwo\n" : "\x1e" "1\n\x1e" "2\n", -1);
+
+  /* A cut off record is held back until the rest arrives */
+  payload = g_bytes_new_static (lines ? "three\nfo" : "\x1e" "3\n\x1e" "[4,", lines ? 8 : 7);
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (transport), "554", payload);
+  g_bytes_unref (payload);
+  sent = mock_transport_pop_channel (transport, "554");
+  g_assert (sent != NULL);
+  cockpit_assert_bytes_eq (sent, lines ? "three\n" : "\x1e" "3\n", -1);
+
+  payload = g_bytes_new_static (lines ? "u" : "\n", 1);
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (transport), "554", payload);
+  g_bytes_unref (payload);
+  if (lines)
+    g_assert (mock_transport_pop_channel (transport, "554") == NULL);
+
+  payload = g_bytes_new_static (lines ? "r\nfive" : "5]\n\x1e" "6", lines ? 6 : 5);
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (transport), "554", payload);
+  g_bytes_unref (payload);
+  sent = mock_transport_pop_channel (transport, "554");
+  g_assert (sent != NULL);
+  if (lines)
+    {
+      cockpit_assert_bytes_eq (sent, "four\n", -1);
+    }
+  else
+    {
+      /* A json-seq record ending in a line feed counts as complete */
+      cockpit_assert_bytes_eq (sent, "\x1e" "[4,\n", -1);
+      sent = mock_transport_pop_channel (transport, "554");
+      g_assert (sent != NULL);
+      cockpit_assert_bytes_eq (sent, "5]\n", -1);
+    }
+
+  /* The last partial record is sent before the close message */
+  g_assert (mock_transport_pop_channel (transport, "554") == NULL);
+  cockpit_channel_close (channel, NULL);
+  sent = mock_transport_pop_channel (transport, "554");
+  g_assert (sent != NULL);
+  cockpit_assert_bytes_eq (sent, lines ? "five" : "\x1e" "6", -1);
+
+  g_object_unref (channel);
+  g_object_unref (transport);
+}
+
+static void
+test_framing_invalid (void)
+{
+  MockTransport *transport;
+  CockpitChannel *channel;
+  JsonObject *options;
+  JsonObject *sent;
+
+  cockpit_expect_warning ("*invalid \"framing\" option*");
+
+  transport = g_object_new (mock_transport_get_type (), NULL);
+
+  options = json_object_new ();
+  json_object_set_string_member (options, "framing", "paragraphs");
+  channel = g_object_new (mock_echo_channel_get_type (),
+                          "transport", transport,
+                          "id", "554",
+                          "options", options,
+                          NULL);
+  json_object_unref (options);
+
+  cockpit_channel_prepare (channel);
+  sent = mock_transport_pop_control (transport);
+  g_assert (sent != NULL);
+  cockpit_assert_json_eq (sent, "{ \"command\": \"close\", \"channel\": \"554\", \"problem\": \"protocol-error\" }");
+
+  g_object_unref (channel);
+  g_object_unref (transport);
+}
+
+static void
+test_window_send (void)
+{
+  const gchar *ack = "{ \"command\": \"ack\", \"channel\": \"554\", \"bytes\": 14 }";
+  MockTransport *transport;
+  CockpitChannel *channel;
+  JsonObject *options;
+  GBytes *payload;
+  GBytes *control;
+  GBytes *sent;
+
+  transport = g_object_new (mock_transport_get_type (), NULL);
+
+  options = json_object_new ();
+  json_object_set_int_member (options, "window", 10);
+  channel = g_object_new (mock_echo_channel_get_type (),
+                          "transport", transport,
+                          "id", "554",
+                          "options", options,
+                          NULL);
+  json_object_unref (options);
+
+  cockpit_channel_prepare (channel);
+  cockpit_channel_ready (channel);
+  g_assert (mock_transport_pop_control (transport) != NULL);
+
+  payload = g_bytes_new_static ("Yeehaw!", 7);
+
+  /* Sent until the window is used up, then held back */
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (transport), "554", payload);
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (transport), "554", payload);
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (transport), "554", payload);
+  g_assert (mock_transport_pop_channel (transport, "554") != NULL);
+  g_assert (mock_transport_pop_channel (transport, "554") != NULL);
+  g_assert (mock_transport_pop_channel (transport, "554") == NULL);
+
+  /* An ack lets the rest through */
+  control = g_bytes_new_static (ack, strlen (ack));
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (transport), NULL, control);
+  g_bytes_unref (control);
+  sent = mock_transport_pop_channel (transport, "554");
+  g_assert (sent != NULL);
+  cockpit_assert_bytes_eq (sent, "Yeehaw!", 7);
+
+  /* Held data is flushed before the close message */
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (transport), "554", payload);
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (transport), "554", payload);
+  g_assert (mock_transport_pop_channel (transport, "554") != NULL);
+  g_assert (mock_transport_pop_channel (transport, "554") == NULL);
+  cockpit_channel_close (channel, NULL);
+  g_assert (mock_transport_pop_channel (transport, "554") != NULL);
+
+  g_bytes_unref (payload);
+  g_object_unref (channel);
+  g_object_unref (transport);
+}
+
+static void
+test_trace (void)
+{
+  const gchar *trace = "{ \"command\": \"trace\", \"channel\": \"555\" }";
+  MockTransport *transport;
+  CockpitChannel *channel;
+  JsonObject *options;
+  JsonObject *control;
+  JsonArray *events;
+  JsonArray *event;
+  GBytes *payload;
+  GBytes *command;
+
+  transport = g_object_new (mock_transport_get_type (), NULL);
+
+  options = json_object_new ();
+  json_object_set_boolean_member (options, "trace", TRUE);
+  channel = g_object_new (mock_echo_channel_get_type (),
+                          "transport", transport,
+                          "id", "555",
+                          "options", options,
+                          NULL);
+  json_object_unref (options);
+
+  cockpit_channel_prepare (channel);
+  cockpit_channel_ready (channel);
+  g_assert (mock_transport_pop_control (transport) != NULL);
+
+  payload = g_bytes_new_static ("Yeehaw!", 7);
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (transport), "555", payload);
+  g_bytes_unref (payload);
+  g_assert (mock_transport_pop_channel (transport, "555") != NULL);
+
+  command = g_bytes_new_static (trace, strlen (trace));
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (transport), NULL, command);
+
+  control = mock_transport_pop_control (transport);
+  g_assert (control != NULL);
+  g_assert_cmpstr (json_object_get_string_member (control, "command"), ==, "trace");
+  g_assert_cmpstr (json_object_get_string_member (control, "channel"), ==, "555");
+  events = json_object_get_array_member (control, "events");
+  g_assert_cmpuint (json_array_get_length (events), ==, 4);
+
+  event = json_array_get_array_element (events, 0);
+  g_assert_cmpstr (json_array_get_string_element (event, 0), ==, "bridge-open");
+  event = json_array_get_array_element (events, 1);
+  g_assert_cmpstr (json_array_get_string_element (event, 0), ==, "bridge-ready");
+  event = json_array_get_array_element (events, 2);
+  g_assert_cmpstr (json_array_get_string_element (event, 0), ==, "bridge-received");
+  event = json_array_get_array_element (events, 3);
+  g_assert_cmpstr (json_array_get_string_element (event, 0), ==, "bridge-sent");
+
+  /* The events were handed out */
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (transport), NULL, command);
+  control = mock_transport_pop_control (transport);
+  g_assert (control != NULL);
+  events = json_object_get_array_member (control, "events");
+  g_assert_cmpuint (json_array_get_length (events), ==, 0);
+
+  g_bytes_unref (command);
+  g_object_unref (channel);
+  g_object_unref (transport);
+}
+
+static void
+test_send_split_utf8 (TestCase *tc,
+                      gconstpointer unused)
+{
+  GBytes *payload;
+  GBytes *sent;
+
+  cockpit_channel_hold_incomplete (tc->channel, TRUE);
+  cockpit_channel_ready (tc->channel);
+
+  /* A character split across two sends is held back, not replaced */
+  payload = g_bytes_new_static ("split \344\275", 8);
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (tc->transport), "554", payload);
+  g_bytes_unref (payload);
+  sent = mock_transport_pop_channel (tc->transport, "554");
+  g_assert (sent != NULL);
+  cockpit_assert_bytes_eq (sent, "split ", 6);
+
+  payload = g_bytes_new_static ("\240 here \303", 8);
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (tc->transport), "554", payload);
+  g_bytes_unref (payload);
+  sent = mock_transport_pop_channel (tc->transport, "554");
+  g_assert (sent != NULL);
+  cockpit_assert_bytes_eq (sent, "\344\275\240 here ", 9);
+
+  /* Replaced when nothing further can complete it */
+  cockpit_channel_close (tc->channel, NULL);
+  sent = mock_transport_pop_channel (tc->transport, "554");
+  g_assert (sent != NULL);
+  cockpit_assert_bytes_eq (sent, "\357\277\275", 3);
+}
+
 static void
 test_close_immediately (TestCase *tc,
                         gconstpointer unused)
@@ -282,6 +645,78 @@ test_close_transport (TestCase *tc,
   g_free (problem);
 }
 
+static void
+test_kill (TestCase *tc,
+           gconstpointer unused)
+{
+  MockEchoChannel *chan;
+  GBytes *payload;
+  gchar *problem = NULL;
+
+  chan = (MockEchoChannel *)tc->channel;
+
+  payload = g_bytes_new ("Yeehaw!", 7);
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (tc->transport), "554", payload);
+  g_bytes_unref (payload);
+
+  g_signal_connect (tc->channel, "closed", G_CALLBACK (on_closed_get_problem), &problem);
+  cockpit_channel_kill (tc->channel, "terminated");
+
+  g_assert (chan->close_called == TRUE);
+  g_assert_cmpstr (problem, ==, "terminated");
+
+  /* The other end has already forgotten the channel, so nothing is sent */
+  g_assert_cmpuint (mock_transport_count_sent (tc->transport), ==, 0);
+
+  g_free (problem);
+}
+
+static void
+test_close_transport_many (void)
+{
+  MockTransport *transport;
+  CockpitChannel *channels[3];
+  gchar *problems[3] = { NULL, };
+  JsonObject *options;
+  gchar *id;
+  guint i;
+
+  options = json_object_new ();
+  transport = g_object_new (mock_transport_get_type (), NULL);
+
+  for (i = 0; i < G_N_ELEMENTS (channels); i++)
+    {
+      id = g_strdup_printf ("%u", i);
+      channels[i] = g_object_new (mock_echo_channel_get_type (),
+                                  "transport", transport,
+                                  "id", id,
+                                  "options", options,
+                                  NULL);
+      g_signal_connect (channels[i], "closed", G_CALLBACK (on_closed_get_problem), problems + i);
+      g_free (id);
+    }
+  json_object_unref (options);
+
+  /* Gone before the transport closes, so it's not told */
+  g_object_unref (channels[1]);
+  channels[1] = NULL;
+
+  cockpit_transport_close (COCKPIT_TRANSPORT (transport), "disconnected");
+
+  for (i = 0; i < G_N_ELEMENTS (channels); i++)
+    {
+      if (!channels[i])
+        continue;
+      g_assert (((MockEchoChannel *)channels[i])->close_called);
+      g_assert_cmpstr (problems[i], ==, "disconnected");
+      g_free (problems[i]);
+      g_object_unref (channels[i]);
+    }
+
+  g_assert (problems[1] == NULL);
+  g_object_unref (transport);
+}
+
 static void
 test_get_option (void)
 {
@@ -396,6 +831,65 @@ test_close_not_capable (void)
   g_object_unref (transport);
 }
 
+static void
+test_prepare_batch (void)
+{
+  MockTransport *transport;
+  CockpitChannel *channels[4];
+  JsonArray *capabilities;
+  JsonObject *options;
+  JsonObject *sent;
+  gchar *expected;
+  gchar *id;
+  guint i;
+
+  cockpit_expect_message ("unsupported capability required: unsupported");
+  cockpit_expect_message ("unsupported capability required: unsupported");
+  cockpit_expect_message ("unsupported capability required: unsupported");
+
+  /* Each one closes when prepared, which shows when that happens */
+  options = json_object_new ();
+  capabilities = json_array_new ();
+  json_array_add_string_element (capabilities, "unsupported");
+  json_object_set_array_member (options, "capabilities", capabilities);
+  transport = g_object_new (mock_transport_get_type (), NULL);
+
+  for (i = 0; i < G_N_ELEMENTS (channels); i++)
+    {
+      id = g_strdup_printf ("%u", i);
+      channels[i] = g_object_new (mock_echo_channel_get_type (),
+                                  "transport", transport,
+                                  "id", id,
+                                  "options", options,
+                                  NULL);
+      g_free (id);
+    }
+  json_object_unref (options);
+
+  /* Never gets prepared */
+  g_object_unref (channels[1]);
+  channels[1] = NULL;
+
+  /* All the others are prepared in one go, in order */
+  g_main_context_iteration (NULL, FALSE);
+
+  for (i = 0; i < G_N_ELEMENTS (channels); i++)
+    {
+      if (!channels[i])
+        continue;
+      sent = mock_transport_pop_control (transport);
+      g_assert (sent != NULL);
+      expected = g_strdup_printf ("{ \"command\": \"close\", \"channel\": \"%u\","
+                                  " \"problem\": \"not-supported\", \"capabilities\":[]}", i);
+      cockpit_assert_json_eq (sent, expected);
+      g_free (expected);
+      g_object_unref (channels[i]);
+    }
+
+  g_assert (mock_transport_pop_control (transport) == NULL);
+  g_object_unref (transport);
+}
+
 static void
 test_capable (void)
 {
@@ -580,10 +1074,12 @@ main (int argc,
 
   cockpit_test_init (&argc, &argv);
 
+  g_test_add_func ("/channel/close-transport-many", test_close_transport_many);
   g_test_add_func ("/channel/get-option", test_get_option);
   g_test_add_func ("/channel/properties", test_properties);
   g_test_add_func ("/channel/test_close_not_capable",
                    test_close_not_capable);
+  g_test_add_func ("/channel/prepare-batch", test_prepare_batch);
   g_test_add_func ("/channel/test_capable",
                    test_capable);
   g_test_add_func ("/channel/internal-null-registered",
@@ -593,11 +1089,20 @@ main (int argc,
 
   g_test_add_func ("/channel/parse-port", test_parse_port);
   g_test_add_func ("/channel/parse-address", test_parse_address);
+  g_test_add_func ("/channel/route-channels", test_route_channels);
+  g_test_add_func ("/channel/batch-send", test_batch_send);
+  g_test_add_func ("/channel/window-send", test_window_send);
+  g_test_add_func ("/channel/trace", test_trace);
+  g_test_add_data_func ("/channel/framing-lines", "lines", test_framing_send);
+  g_test_add_data_func ("/channel/framing-json-seq", "json-seq", test_framing_send);
+  g_test_add_func ("/channel/framing-invalid", test_framing_invalid);
 
   g_test_add ("/channel/recv-send", TestCase, NULL,
               setup, test_recv_and_send, teardown);
   g_test_add ("/channel/recv-queue", TestCase, NULL,
               setup, test_recv_and_queue, teardown);
+  g_test_add ("/channel/send-split-utf8", TestCase, NULL,
+              setup, test_send_split_utf8, teardown);
   g_test_add ("/channel/close-immediately", TestCase, NULL,
               setup, test_close_immediately, teardown);
   g_test_add ("/channel/close-option", TestCase, NULL,
@@ -606,6 +1111,8 @@ main (int argc,
               setup, test_close_json_option, teardown);
   g_test_add ("/channel/close-transport", TestCase, NULL,
               setup, test_close_transport, teardown);
+  g_test_add ("/channel/kill", TestCase, NULL,
+              setup, test_kill, teardown);
 
   return g_test_run ();
 }
@@ -0,0 +1,367 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2016 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitdbusjson.h"
+
+#include "common/cockpitjson.h"
+#include "common/cockpittest.h"
+
+#include <string.h>
+
+/*
+ * These check how a dbus-json3 channel reads "call" messages straight
+ * from the JSON text, without a D-Bus service to talk to.
+ */
+
+typedef struct {
+  const gchar *name;
+  const gchar *message;
+  const gchar *args;
+} CallFixture;
+
+static const CallFixture call_fixtures[] = {
+  { "simple", "{\"call\":[\"/p\",\"org.I\",\"M\",[\"a\",1]],\"id\":\"1\"}", "[\"a\",1]" },
+  { "spaces", " { \"id\" : \"2\" , \"call\" : [ \"/p\" , \"org.I\" , \"M\" , [ ] ] } ", "[ ]" },
+  { "nested", "{\"call\":[\"/p\",\"org.I\",\"M\",[{\"a\":[1,{}]},[]]]}", "[{\"a\":[1,{}]},[]]" },
+  { "escapes", "{\"call\":[\"/p\",\"org.I\",\"M\",[\"\\\"\\\\\\/\\b\\f\\n\\r\\t\\u00e9\"]]}",
+    "[\"\\\"\\\\\\/\\b\\f\\n\\r\\t\\u00e9\"]" },
+  { "surrogate-pair", "{\"call\":[\"/p\",\"org.I\",\"M\",[\"\\ud83d\\ude00\"]]}", "[\"\\ud83d\\ude00\"]" },
+
+  /* Malformed */
+  { "empty", "", NULL },
+  { "empty-object", "{}", NULL },
+  { "not-object", "[\"/p\",\"org.I\",\"M\",[]]", NULL },
+  { "no-call", "{\"id\":\"1\"}", NULL },
+  { "no-colon", "{\"call\" [\"/p\",\"org.I\",\"M\",[]]}", NULL },
+  { "no-comma", "{\"call\":[\"/p\",\"org.I\",\"M\",[]] \"id\":\"1\"}", NULL },
+  { "trailing-comma", "{\"call\":[\"/p\",\"org.I\",\"M\",[1,]]}", NULL },
+  { "trailing-garbage", "{\"call\":[\"/p\",\"org.I\",\"M\",[]]} x", NULL },
+  { "too-few", "{\"call\":[\"/p\",\"org.I\",\"M\"]}", NULL },
+  { "args-object", "{\"call\":[\"/p\",\"org.I\",\"M\",{}]}", NULL },
+  { "two-calls", "{\"call\":[\"/p\",\"org.I\",\"M\",[]],\"call\":[\"/p\",\"org.I\",\"M\",[]]}", NULL },
+  { "bad-number", "{\"call\":[\"/p\",\"org.I\",\"M\",[01]]}", NULL },
+  { "bad-literal", "{\"call\":[\"/p\",\"org.I\",\"M\",[tru]]}", NULL },
+  { "control-char", "{\"call\":[\"/p\",\"org.I\",\"M\",[\"a\tb\"]]}", NULL },
+
+  /* Truncated */
+  { "truncated-key", "{\"cal", NULL },
+  { "truncated-object", "{\"call\":[\"/p\",\"org.I\",\"M\",[\"a\"]]", NULL },
+  { "truncated-string", "{\"call\":[\"/p\",\"org.I\",\"M\",[\"abc", NULL },
+  { "truncated-escape", "{\"call\":[\"/p\",\"org.I\",\"M\",[\"abc\\", NULL },
+  { "truncated-unicode", "{\"call\":[\"/p\",\"org.I\",\"M\",[\"\\u00", NULL },
+  { "truncated-pair", "{\"call\":[\"/p\",\"org.I\",\"M\",[\"\\ud83d\\u", NULL },
+
+  /* Escapes the scanner won't handle, left to the tree parser */
+  { "bad-escape", "{\"call\":[\"/p\",\"org.I\",\"M\",[\"\\x\"]]}", NULL },
+  { "bad-hex", "{\"call\":[\"/p\",\"org.I\",\"M\",[\"\\u12G4\"]]}", NULL },
+  { "lone-high", "{\"call\":[\"/p\",\"org.I\",\"M\",[\"\\ud83d\"]]}", NULL },
+  { "lone-low", "{\"call\":[\"/p\",\"org.I\",\"M\",[\"\\ude00\"]]}", NULL },
+  { "high-high", "{\"call\":[\"/p\",\"org.I\",\"M\",[\"\\ud83d\\ud83d\"]]}", NULL },
+  { "high-letter", "{\"call\":[\"/p\",\"org.I\",\"M\",[\"\\ud83d\\u0041\"]]}", NULL },
+  { "nul", "{\"call\":[\"/p\",\"org.I\",\"M\",[\"a\\u0000b\"]]}", NULL },
+  { "invalid-utf8", "{\"call\":[\"/p\",\"org.I\",\"M\",[\"\xff\"]]}", NULL },
+};
+
+static JsonNode *
+parse_with_json_glib (const gchar *data,
+                      gssize length)
+{
+  JsonParser *parser;
+  JsonNode *node;
+  GError *error = NULL;
+
+  parser = json_parser_new ();
+  json_parser_load_from_data (parser, data, length, &error);
+  g_assert_no_error (error);
+  node = json_node_copy (json_parser_get_root (parser));
+  g_object_unref (parser);
+
+  return node;
+}
+
+static void
+test_parse_call (gconstpointer data)
+{
+  const CallFixture *fixture = data;
+  JsonObject *object;
+  JsonArray *call;
+  JsonNode *expect;
+  JsonNode *node;
+  GBytes *message;
+  GBytes *args = NULL;
+  gconstpointer text;
+  gsize length;
+
+  message = g_bytes_new_static (fixture->message, strlen (fixture->message));
+  object = cockpit_dbus_json_parse_call (message, &args);
+
+  if (!fixture->args)
+    {
+      g_assert (object == NULL);
+      g_assert (args == NULL);
+      g_bytes_unref (message);
+      return;
+    }
+
+  g_assert (object != NULL);
+  g_assert (args != NULL);
+  cockpit_assert_bytes_eq (args, fixture->args, -1);
+
+  /* Everything else in the message is just as json-glib sees it */
+  expect = parse_with_json_glib (fixture->message, -1);
+  call = json_object_get_array_member (json_node_get_object (expect), "call");
+
+  text = g_bytes_get_data (args, &length);
+  node = parse_with_json_glib (text, length);
+  g_assert (cockpit_json_equal (json_array_get_element (call, 3), node));
+  json_node_free (node);
+
+  json_array_remove_element (call, 3);
+  json_array_add_array_element (call, json_array_new ());
+  node = json_node_new (JSON_NODE_OBJECT);
+  json_node_set_object (node, object);
+  g_assert (cockpit_json_equal (expect, node));
+
+  json_node_free (node);
+  json_node_free (expect);
+  json_object_unref (object);
+  g_bytes_unref (args);
+  g_bytes_unref (message);
+}
+
+static GBytes *
+build_nested (const gchar *prefix,
+              gint depth,
+              const gchar *suffix)
+{
+  GString *string;
+  gsize length;
+  gint i;
+
+  string = g_string_new (prefix);
+  for (i = 0; i < depth; i++)
+    g_string_append_c (string, '[');
+  for (i = 0; i < depth; i++)
+    g_string_append_c (string, ']');
+  g_string_append (string, suffix);
+
+  length = string->len;
+  return g_bytes_new_take (g_string_free (string, FALSE), length);
+}
+
+static void
+test_parse_call_nesting (void)
+{
+  JsonObject *object;
+  GBytes *message;
+  GBytes *args = NULL;
+
+  /* The arguments array itself counts as one level */
+  message = build_nested ("{\"call\":[\"/p\",\"org.I\",\"M\",", 128, "]}");
+  object = cockpit_dbus_json_parse_call (message, &args);
+  g_assert (object != NULL);
+  g_assert_cmpuint (g_bytes_get_size (args), ==, 256);
+  json_object_unref (object);
+  g_bytes_unref (args);
+  g_bytes_unref (message);
+
+  args = NULL;
+  message = build_nested ("{\"call\":[\"/p\",\"org.I\",\"M\",", 129, "]}");
+  object = cockpit_dbus_json_parse_call (message, &args);
+  g_assert (object == NULL);
+  g_assert (args == NULL);
+  g_bytes_unref (message);
+
+  /* As do other members */
+  message = build_nested ("{\"call\":[\"/p\",\"org.I\",\"M\",[]],\"x\":", 129, "}");
+  object = cockpit_dbus_json_parse_call (message, &args);
+  g_assert (object == NULL);
+  g_bytes_unref (message);
+}
+
+typedef struct {
+  const gchar *name;
+  const gchar *type;
+  const gchar *args;
+} ArgsFixture;
+
+static const ArgsFixture agree_fixtures[] = {
+  { "string", "(s)", "[\"hello\"]" },
+  { "string-empty", "(s)", "[\"\"]" },
+  { "string-escapes", "(s)", "[\"a\\\"b\\\\c\\/d\\b\\f\\n\\r\\t\\u00e9\\u20ac\"]" },
+  { "string-surrogates", "(s)", "[\"\\ud83d\\ude00 \\uD834\\uDD1E\"]" },
+  { "string-utf8", "(s)", "[\"caf\xc3\xa9 \xf0\x9f\x98\x80\"]" },
+  { "int-bool", "(ib)", "[-5,true]" },
+  { "bool-false", "(b)", "[false]" },
+  { "small-ints", "(yqnu)", "[255,65535,-32768,4294967295]" },
+  { "large-ints", "(xt)", "[-9223372036854775807,42]" },
+  { "double", "(d)", "[1.5]" },
+  { "double-integer", "(d)", "[3]" },
+  { "double-exponent", "(d)", "[-2.5e-3]" },
+  { "object-path", "(o)", "[\"/a/b\"]" },
+  { "signature", "(g)", "[\"a{sv}\"]" },
+  { "bytes", "(ay)", "[\"aGVsbG8=\"]" },
+  { "string-array", "(as)", "[[\"a\",\"b\",\"\"]]" },
+  { "empty-array", "(ai)", "[[]]" },
+  { "dict", "(a{si})", "[{\"a\":1,\"b\":2}]" },
+  { "dict-duplicate", "(a{si})", "[{\"a\":1,\"a\":2}]" },
+  { "dict-int-keys", "(a{is})", "[{\"1\":\"x\",\"2\":\"y\"}]" },
+  { "dict-escaped-key", "(a{sb})", "[{\"\\u00e9\\n\":true}]" },
+  { "variant", "(v)", "[{\"t\":\"s\",\"v\":\"x\"}]" },
+  { "variant-dict", "(a{sv})", "[{\"a\":{\"t\":\"i\",\"v\":1}}]" },
+  { "struct", "((sb)a(ii))", "[[\"x\",false],[[1,2],[3,4]]]" },
+  { "spaces", "(si)", " [ \"x\" ,\n\t2 ] " },
+  { "no-args", "()", "[]" },
+};
+
+static void
+test_agree (gconstpointer data)
+{
+  const ArgsFixture *fixture = data;
+  GVariantType *type;
+  GVariant *scanned;
+  GVariant *built;
+  GError *error = NULL;
+  GBytes *args;
+  JsonNode *node;
+  gchar *one;
+  gchar *two;
+
+  type = g_variant_type_new (fixture->type);
+
+  args = g_bytes_new_static (fixture->args, strlen (fixture->args));
+  scanned = cockpit_dbus_json_scan_args (args, type, &error);
+  g_assert_no_error (error);
+
+  node = parse_with_json_glib (fixture->args, -1);
+  built = cockpit_dbus_json_build_args (node, type, &error);
+  g_assert_no_error (error);
+
+  one = g_variant_print (scanned, TRUE);
+  two = g_variant_print (built, TRUE);
+  g_assert_cmpstr (one, ==, two);
+  g_assert (g_variant_equal (scanned, built));
+
+  g_free (one);
+  g_free (two);
+  g_variant_unref (scanned);
+  g_variant_unref (built);
+  json_node_free (node);
+  g_bytes_unref (args);
+  g_variant_type_free (type);
+}
+
+static void
+test_scan_escapes (void)
+{
+  const gchar *json = "[\"\\\"\\\\\\/\\b\\f\\n\\r\\t\\u00e9\\ud83d\\ude00\"]";
+  GError *error = NULL;
+  GVariant *result;
+  GBytes *args;
+  const gchar *string;
+
+  args = g_bytes_new_static (json, strlen (json));
+  result = cockpit_dbus_json_scan_args (args, G_VARIANT_TYPE ("(s)"), &error);
+  g_assert_no_error (error);
+
+  g_variant_get (result, "(&s)", &string);
+  g_assert_cmpstr (string, ==, "\"\\/\b\f\n\r\t\xc3\xa9\xf0\x9f\x98\x80");
+
+  g_variant_unref (result);
+  g_bytes_unref (args);
+}
+
+static const ArgsFixture invalid_fixtures[] = {
+  { "truncated-array", "(i)", "[1" },
+  { "truncated-string", "(s)", "[\"abc" },
+  { "truncated-escape", "(s)", "[\"abc\\" },
+  { "truncated-unicode", "(s)", "[\"\\u00" },
+  { "truncated-pair", "(s)", "[\"\\ud83d" },
+  { "truncated-dict", "(a{si})", "[{\"a\":" },
+  { "empty", "(s)", "" },
+  { "lone-surrogate", "(s)", "[\"\\ude00\"]" },
+  { "control-char", "(s)", "[\"a\nb\"]" },
+  { "wrong-type", "(s)", "[1]" },
+  { "too-many", "(s)", "[\"a\",\"b\"]" },
+  { "too-few", "(ss)", "[\"a\"]" },
+  { "bad-literal", "(b)", "[tru]" },
+  { "missing-colon", "(a{si})", "[{\"a\" 1}]" },
+  { "missing-comma", "(as)", "[[\"a\" \"b\"]]" },
+  { "bad-object-path", "(o)", "[\"a/b\"]" },
+};
+
+static void
+test_scan_invalid (gconstpointer data)
+{
+  const ArgsFixture *fixture = data;
+  GVariantType *type;
+  GError *error = NULL;
+  GVariant *result;
+  GBytes *args;
+
+  type = g_variant_type_new (fixture->type);
+  args = g_bytes_new_static (fixture->args, strlen (fixture->args));
+
+  result = cockpit_dbus_json_scan_args (args, type, &error);
+  g_assert (result == NULL);
+  g_assert_error (error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS);
+
+  g_error_free (error);
+  g_bytes_unref (args);
+  g_variant_type_free (type);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  gchar *name;
+  gint i;
+
+  cockpit_test_init (&argc, &argv);
+
+  for (i = 0; i < G_N_ELEMENTS (call_fixtures); i++)
+    {
+      name = g_strdup_printf ("/dbus-json/parse-call/%s", call_fixtures[i].name);
+      g_test_add_data_func (name, call_fixtures + i, test_parse_call);
+      g_free (name);
+    }
+
+  g_test_add_func ("/dbus-json/parse-call-nesting", test_parse_call_nesting);
+
+  for (i = 0; i < G_N_ELEMENTS (agree_fixtures); i++)
+    {
+      name = g_strdup_printf ("/dbus-json/agree/%s", agree_fixtures[i].name);
+      g_test_add_data_func (name, agree_fixtures + i, test_agree);
+      g_free (name);
+    }
+
+  g_test_add_func ("/dbus-json/scan-escapes", test_scan_escapes);
+
+  for (i = 0; i < G_N_ELEMENTS (invalid_fixtures); i++)
+    {
+      name = g_strdup_printf ("/dbus-json/scan-invalid/%s", invalid_fixtures[i].name);
+      g_test_add_data_func (name, invalid_fixtures + i, test_scan_invalid);
+      g_free (name);
+    }
+
+  return g_test_run ();
+}
@@ -121,6 +121,56 @@ test_get_properties (TestCase *tc,
   g_strfreev (environ);
 }
 
+static void
+test_direct (TestCase *tc,
+             gconstpointer unused)
+{
+  GDBusMessage *message;
+  GDBusMessage *reply;
+  GVariant *retval;
+  GError *error = NULL;
+
+  retval = dbus_call_with_main_loop (tc, "/environment", "org.freedesktop.DBus.Properties", "GetAll",
+                                     g_variant_new ("(s)", "cockpit.Environment"),
+                                     G_VARIANT_TYPE ("(a{sv})"), &error);
+  g_assert_no_error (error);
+
+  /* The same answer, without going through the connection */
+  message = g_dbus_message_new_method_call (cockpit_dbus_internal_name (), "/environment",
+                                            "org.freedesktop.DBus.Properties", "GetAll");
+  g_dbus_message_set_body (message, g_variant_new ("(s)", "cockpit.Environment"));
+  reply = cockpit_dbus_internal_dispatch (tc->connection, message);
+  g_assert (reply != NULL);
+  g_assert_cmpint (g_dbus_message_get_message_type (reply), ==, G_DBUS_MESSAGE_TYPE_METHOD_RETURN);
+  g_assert (g_variant_equal (g_dbus_message_get_body (reply), retval));
+  g_object_unref (reply);
+  g_object_unref (message);
+
+  message = g_dbus_message_new_method_call (cockpit_dbus_internal_name (), "/environment",
+                                            "org.freedesktop.DBus.Properties", "Get");
+  g_dbus_message_set_body (message, g_variant_new ("(ss)", "cockpit.Environment", "Variables"));
+  reply = cockpit_dbus_internal_dispatch (tc->connection, message);
+  g_assert (reply != NULL);
+  g_assert (g_variant_is_of_type (g_dbus_message_get_body (reply), G_VARIANT_TYPE ("(v)")));
+  g_object_unref (reply);
+  g_object_unref (message);
+
+  /* Anything else still goes over the connection */
+  message = g_dbus_message_new_method_call (cockpit_dbus_internal_name (), "/environment",
+                                            "org.freedesktop.DBus.Properties", "Get");
+  g_dbus_message_set_body (message, g_variant_new ("(ss)", "cockpit.Environment", "Unknown"));
+  g_assert (cockpit_dbus_internal_dispatch (tc->connection, message) == NULL);
+  g_object_unref (message);
+
+  message = g_dbus_message_new_method_call (cockpit_dbus_internal_name (), "/other",
+                                            "org.freedesktop.DBus.Properties", "GetAll");
+  g_dbus_message_set_body (message, g_variant_new ("(s)", "cockpit.Environment"));
+  g_assert (cockpit_dbus_internal_dispatch (tc->connection, message) == NULL);
+  g_object_unref (message);
+
+  g_variant_unref (retval);
+}
+
 int
 main (int argc,
       char *argv[])
@@ -129,6 +179,8 @@ main (int argc,
 
   g_test_add ("/environment/get-properties", TestCase, NULL,
               setup, test_get_properties, teardown);
+  g_test_add ("/environment/direct", TestCase, NULL,
+              setup, test_direct, teardown);
 
   return g_test_run ();
 }
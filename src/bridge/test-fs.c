@@ -23,6 +23,7 @@
 #include "cockpitfsreplace.h"
 #include "cockpitfswatch.h"
 #include "cockpitfslist.h"
+#include "cockpitfsmirror.h"
 #include "mock-transport.h"
 
 #include "common/cockpittest.h"
@@ -98,6 +99,107 @@ setup_fsread_channel (TestCase *tc,
   cockpit_channel_prepare (tc->channel);
 }
 
+static void
+setup_fsread_range_channel (TestCase *tc,
+                            const gchar *path,
+                            const gchar *option,
+                            gint64 value,
+                            gint64 length)
+{
+  JsonObject *options;
+
+  options = json_object_new ();
+  json_object_set_string_member (options, "path", path);
+  json_object_set_string_member (options, "payload", "fsread1");
+  json_object_set_int_member (options, option, value);
+  if (length >= 0)
+    json_object_set_int_member (options, "length", length);
+
+  tc->channel = g_object_new (COCKPIT_TYPE_FSREAD,
+                              "transport", tc->transport,
+                              "id", "1234",
+                              "options", options,
+                              NULL);
+  json_object_unref (options);
+
+  tc->channel_closed = FALSE;
+  g_signal_connect (tc->channel, "closed", G_CALLBACK (on_channel_close), tc);
+  cockpit_channel_prepare (tc->channel);
+}
+
+static void
+setup_fsread_if_tag_channel (TestCase *tc,
+                             const gchar *path,
+                             const gchar *tag)
+{
+  JsonObject *options;
+
+  options = json_object_new ();
+  json_object_set_string_member (options, "path", path);
+  json_object_set_string_member (options, "payload", "fsread1");
+  json_object_set_string_member (options, "if-tag", tag);
+
+  tc->channel = g_object_new (COCKPIT_TYPE_FSREAD,
+                              "transport", tc->transport,
+                              "id", "1234",
+                              "options", options,
+                              NULL);
+  json_object_unref (options);
+
+  tc->channel_closed = FALSE;
+  g_signal_connect (tc->channel, "closed", G_CALLBACK (on_channel_close), tc);
+  cockpit_channel_prepare (tc->channel);
+}
+
+static void
+setup_fsmirror_channel (TestCase *tc,
+                        const gchar *path)
+{
+  JsonObject *options;
+
+  options = json_object_new ();
+  json_object_set_string_member (options, "path", path);
+  json_object_set_string_member (options, "payload", "fsmirror1");
+
+  /* So that each change below is read once it's complete */
+  json_object_set_int_member (options, "debounce", 100);
+
+  tc->channel = g_object_new (COCKPIT_TYPE_FSMIRROR,
+                              "transport", tc->transport,
+                              "id", "1234",
+                              "options", options,
+                              NULL);
+  json_object_unref (options);
+
+  tc->channel_closed = FALSE;
+  g_signal_connect (tc->channel, "closed", G_CALLBACK (on_channel_close), tc);
+  cockpit_channel_prepare (tc->channel);
+}
+
+static void
+setup_compress_channel (TestCase *tc,
+                        const gchar *payload,
+                        const gchar *path)
+{
+  JsonObject *options;
+
+  options = json_object_new ();
+  json_object_set_string_member (options, "path", path);
+  json_object_set_string_member (options, "payload", payload);
+  json_object_set_string_member (options, "compress", "gzip");
+
+  tc->channel = g_object_new (g_str_equal (payload, "fsread1") ? COCKPIT_TYPE_FSREAD : COCKPIT_TYPE_FSREPLACE,
+                              "transport", tc->transport,
+                              "id", "1234",
+                              "options", options,
+                              NULL);
+  json_object_unref (options);
+
+  tc->channel_closed = FALSE;
+  g_signal_connect (tc->channel, "closed", G_CALLBACK (on_channel_close), tc);
+  cockpit_channel_prepare (tc->channel);
+}
+
 static void
 setup_fsreplace_channel (TestCase *tc,
                        const gchar *path,
@@ -119,6 +221,34 @@ setup_fswatch_channel (TestCase *tc,
   cockpit_channel_prepare (tc->channel);
 }
 
+static void
+setup_fswatch_options_channel (TestCase *tc,
+                               const gchar *path,
+                               gint64 debounce,
+                               gboolean recursive)
+{
+  JsonObject *options;
+
+  options = json_object_new ();
+  json_object_set_string_member (options, "path", path);
+  json_object_set_string_member (options, "payload", "fswatch1");
+  if (debounce)
+    json_object_set_int_member (options, "debounce", debounce);
+  if (recursive)
+    json_object_set_boolean_member (options, "recursive", TRUE);
+
+  tc->channel = g_object_new (COCKPIT_TYPE_FSWATCH,
+                              "transport", tc->transport,
+                              "id", "1234",
+                              "options", options,
+                              NULL);
+  json_object_unref (options);
+
+  tc->channel_closed = FALSE;
+  g_signal_connect (tc->channel, "closed", G_CALLBACK (on_channel_close), tc);
+  cockpit_channel_prepare (tc->channel);
+}
+
 static void
 setup_fslist_channel (TestCase *tc,
                      const gchar *path,
@@ -129,6 +259,40 @@ setup_fslist_channel (TestCase *tc,
   g_signal_connect (tc->channel, "closed", G_CALLBACK (on_channel_close), tc);
 }
 
+static void
+setup_fslist_paged_channel (TestCase *tc,
+                            const gchar *path,
+                            gint64 batch,
+                            gint64 limit,
+                            const gchar *cursor)
+{
+  JsonObject *options;
+  JsonArray *attributes;
+
+  options = json_object_new ();
+  json_object_set_string_member (options, "path", path);
+  json_object_set_string_member (options, "payload", "fslist1");
+  json_object_set_boolean_member (options, "watch", FALSE);
+  json_object_set_int_member (options, "batch", batch);
+  json_object_set_int_member (options, "limit", limit);
+  if (cursor)
+    json_object_set_string_member (options, "cursor", cursor);
+  attributes = json_array_new ();
+  json_array_add_string_element (attributes, "size");
+  json_object_set_array_member (options, "attributes", attributes);
+
+  tc->channel = g_object_new (COCKPIT_TYPE_FSLIST,
+                              "transport", tc->transport,
+                              "id", "1234",
+                              "options", options,
+                              NULL);
+  json_object_unref (options);
+
+  tc->channel_closed = FALSE;
+  g_signal_connect (tc->channel, "closed", G_CALLBACK (on_channel_close), tc);
+  cockpit_channel_prepare (tc->channel);
+}
+
 static void
 send_string (TestCase *tc,
              const gchar *str)
@@ -299,6 +463,160 @@ test_read_simple (TestCase *tc,
   g_free (tag);
 }
 
+static void
+test_read_large (TestCase *tc,
+                 gconstpointer unused)
+{
+  JsonObject *control;
+  GString *string;
+  GBytes *data;
+  guint count;
+  guint i;
+
+  string = g_string_new ("");
+  for (i = 0; i < 10000; i++)
+    g_string_append_printf (string, "line %u\n", i);
+  set_contents (tc->test_path, string->str);
+
+  setup_fsread_channel (tc, tc->test_path);
+  wait_channel_closed (tc);
+
+  data = combine_output (tc, &count);
+  cockpit_assert_bytes_eq (data, string->str, string->len);
+  g_bytes_unref (data);
+
+  /* Sent in blocks, not all at once */
+  g_assert_cmpuint (count, >, 1);
+
+  control = mock_transport_pop_control (tc->transport);
+  g_assert_cmpstr (json_object_get_string_member (control, "command"), ==, "ready");
+  control = mock_transport_pop_control (tc->transport);
+  g_assert_cmpstr (json_object_get_string_member (control, "command"), ==, "done");
+  control = mock_transport_pop_control (tc->transport);
+  g_assert (json_object_get_member (control, "problem") == NULL);
+
+  g_string_free (string, TRUE);
+}
+
+static void
+test_read_range (TestCase *tc,
+                 gconstpointer unused)
+{
+  JsonObject *control;
+  gchar *tag;
+
+  set_contents (tc->test_path, "Hello there world!");
+  tag = cockpit_get_file_tag (tc->test_path);
+
+  setup_fsread_range_channel (tc, tc->test_path, "offset", 6, 5);
+  wait_channel_closed (tc);
+
+  assert_received (tc, "there");
+
+  control = mock_transport_pop_control (tc->transport);
+  g_assert_cmpstr (json_object_get_string_member (control, "command"), ==, "ready");
+  control = mock_transport_pop_control (tc->transport);
+  g_assert_cmpstr (json_object_get_string_member (control, "command"), ==, "done");
+  control = mock_transport_pop_control (tc->transport);
+  g_assert (json_object_get_member (control, "problem") == NULL);
+  g_assert_cmpstr (json_object_get_string_member (control, "tag"), ==, tag);
+  g_free (tag);
+}
+
+static void
+test_read_tail (TestCase *tc,
+                gconstpointer unused)
+{
+  set_contents (tc->test_path, "Hello there world!");
+
+  setup_fsread_range_channel (tc, tc->test_path, "tail", 6, -1);
+  wait_channel_closed (tc);
+  assert_received (tc, "world!");
+}
+
+static void
+test_read_tail_short (TestCase *tc,
+                      gconstpointer unused)
+{
+  set_contents (tc->test_path, "Hello!");
+
+  setup_fsread_range_channel (tc, tc->test_path, "tail", 1000, -1);
+  wait_channel_closed (tc);
+  assert_received (tc, "Hello!");
+}
+
+static void
+test_read_gzip (TestCase *tc,
+                gconstpointer unused)
+{
+  GConverter *converter;
+  GString *string;
+  GBytes *compressed;
+  GBytes *data;
+  guint i;
+
+  string = g_string_new ("");
+  for (i = 0; i < 10000; i++)
+    g_string_append_printf (string, "line %u\n", i);
+  set_contents (tc->test_path, string->str);
+
+  setup_compress_channel (tc, "fsread1", tc->test_path);
+  wait_channel_closed (tc);
+
+  compressed = combine_output (tc, NULL);
+  g_assert_cmpuint (g_bytes_get_size (compressed), <, string->len);
+
+  converter = G_CONVERTER (g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP));
+  data = cockpit_convert_bytes (converter, compressed, TRUE, NULL);
+  g_assert (data != NULL);
+  cockpit_assert_bytes_eq (data, string->str, string->len);
+
+  g_object_unref (converter);
+  g_bytes_unref (compressed);
+  g_bytes_unref (data);
+  g_string_free (string, TRUE);
+}
+
+static void
+test_read_if_tag (TestCase *tc,
+                  gconstpointer unused)
+{
+  JsonObject *control;
+  gchar *tag;
+
+  set_contents (tc->test_path, "Hello!");
+  tag = cockpit_get_file_tag (tc->test_path);
+
+  /* Unchanged, so nothing is sent */
+  setup_fsread_if_tag_channel (tc, tc->test_path, tag);
+  wait_channel_closed (tc);
+
+  assert_received (tc, "");
+
+  control = mock_transport_pop_control (tc->transport);
+  g_assert_cmpstr (json_object_get_string_member (control, "command"), ==, "close");
+  g_assert (json_object_get_member (control, "problem") == NULL);
+  g_assert_cmpstr (json_object_get_string_member (control, "tag"), ==, tag);
+  g_assert (mock_transport_pop_control (tc->transport) == NULL);
+
+  g_object_unref (tc->channel);
+
+  /* A different tag reads the file as usual */
+  setup_fsread_if_tag_channel (tc, tc->test_path, "1:0-0.0");
+  wait_channel_closed (tc);
+
+  assert_received (tc, "Hello!");
+
+  control = mock_transport_pop_control (tc->transport);
+  g_assert_cmpstr (json_object_get_string_member (control, "command"), ==, "ready");
+  control = mock_transport_pop_control (tc->transport);
+  g_assert_cmpstr (json_object_get_string_member (control, "command"), ==, "done");
+  control = mock_transport_pop_control (tc->transport);
+  g_assert (json_object_get_member (control, "problem") == NULL);
+  g_assert_cmpstr (json_object_get_string_member (control, "tag"), ==, tag);
+  g_free (tag);
+}
+
 static void
 test_read_non_existent (TestCase *tc,
                         gconstpointer unused)
@@ -460,6 +778,39 @@ test_write_simple (TestCase *tc,
   g_free (tag);
 }
 
+static void
+test_write_gzip (TestCase *tc,
+                 gconstpointer unused)
+{
+  GConverter *converter;
+  GBytes *compressed;
+  GBytes *input;
+  JsonObject *control;
+
+  input = g_bytes_new_static ("Hello compressed!", 17);
+  converter = G_CONVERTER (g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP, -1));
+  compressed = cockpit_convert_bytes (converter, input, TRUE, NULL);
+  g_assert (compressed != NULL);
+
+  setup_compress_channel (tc, "fsreplace1", tc->test_path);
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (tc->transport), "1234", compressed);
+  send_done (tc);
+  close_channel (tc, NULL);
+
+  wait_channel_closed (tc);
+
+  assert_contents (tc->test_path, "Hello compressed!");
+
+  control = mock_transport_pop_control (tc->transport);
+  g_assert_cmpstr (json_object_get_string_member (control, "command"), ==, "ready");
+  control = mock_transport_pop_control (tc->transport);
+  g_assert (json_object_get_member (control, "problem") == NULL);
+
+  g_object_unref (converter);
+  g_bytes_unref (compressed);
+  g_bytes_unref (input);
+}
+
 static void
 test_write_multiple (TestCase *tc,
                      gconstpointer unused)
@@ -696,6 +1047,154 @@ test_write_expect_tag_fail (TestCase *tc,
   g_free (tag);
 }
 
+/* Waits for the next "sync", returns the "change" offsets before it */
+static gchar *
+recv_mirror_sync (TestCase *tc,
+                  gint64 size,
+                  const gchar *tag)
+{
+  GString *offsets = g_string_new ("");
+  JsonObject *control;
+  const gchar *command;
+
+  for (;;)
+    {
+      control = recv_control (tc);
+      command = json_object_get_string_member (control, "command");
+      if (g_str_equal (command, "sync"))
+        break;
+      g_assert_cmpstr (command, ==, "change");
+      g_string_append_printf (offsets, "%s%" G_GINT64_FORMAT, offsets->len ? " " : "",
+                              json_object_get_int_member (control, "offset"));
+    }
+
+  g_assert_cmpint (json_object_get_int_member (control, "size"), ==, size);
+  if (tag)
+    g_assert_cmpstr (json_object_get_string_member (control, "tag"), ==, tag);
+  return g_string_free (offsets, FALSE);
+}
+
+static void
+test_mirror_simple (TestCase *tc,
+                    gconstpointer unused)
+{
+  JsonObject *control;
+  gchar *offsets;
+  gchar *tag;
+  FILE *f;
+
+  set_contents (tc->test_path, "Hello!");
+  tag = cockpit_get_file_tag (tc->test_path);
+
+  setup_fsmirror_channel (tc, tc->test_path);
+  control = recv_control (tc);
+  g_assert_cmpstr (json_object_get_string_member (control, "command"), ==, "ready");
+
+  offsets = recv_mirror_sync (tc, 6, tag);
+  g_assert_cmpstr (offsets, ==, "0");
+  assert_received (tc, "Hello!");
+  g_free (offsets);
+  g_free (tag);
+
+  /* Appended, only the new part is sent */
+  f = fopen (tc->test_path, "a");
+  g_assert (f != NULL);
+  fputs (" World", f);
+  fclose (f);
+
+  offsets = recv_mirror_sync (tc, 12, NULL);
+  g_assert_cmpstr (offsets, ==, "6");
+  assert_received (tc, " World");
+  g_free (offsets);
+
+  /* Rewritten in place */
+  f = fopen (tc->test_path, "w");
+  g_assert (f != NULL);
+  fputs ("Jello!", f);
+  fclose (f);
+
+  offsets = recv_mirror_sync (tc, 6, NULL);
+  g_assert_cmpstr (offsets, ==, "0");
+  assert_received (tc, "Jello!");
+  g_free (offsets);
+
+  /* Removed */
+  g_assert (unlink (tc->test_path) >= 0);
+  offsets = recv_mirror_sync (tc, 0, "-");
+  g_assert_cmpstr (offsets, ==, "");
+  assert_received (tc, "");
+  g_free (offsets);
+
+  close_channel (tc, NULL);
+  wait_channel_closed (tc);
+}
+
+static void
+test_mirror_blocks (TestCase *tc,
+                    gconstpointer unused)
+{
+  GString *content;
+  JsonObject *control;
+  gchar *offsets;
+  gchar *tag;
+
+  content = g_string_new ("");
+  while (content->len < 3 * 4096)
+    g_string_append_c (content, 'a' + content->len % 26);
+  set_contents (tc->test_path, content->str);
+
+  setup_fsmirror_channel (tc, tc->test_path);
+  control = recv_control (tc);
+  g_assert_cmpstr (json_object_get_string_member (control, "command"), ==, "ready");
+
+  offsets = recv_mirror_sync (tc, 3 * 4096, NULL);
+  g_assert_cmpstr (offsets, ==, "0");
+  assert_received (tc, content->str);
+  g_free (offsets);
+
+  /* Replaced by another file, only the changed block is sent */
+  content->str[5000] = 'X';
+  set_contents (tc->test_path, content->str);
+  tag = cockpit_get_file_tag (tc->test_path);
+
+  offsets = recv_mirror_sync (tc, 3 * 4096, tag);
+  g_assert_cmpstr (offsets, ==, "4096");
+  content->str[2 * 4096] = '\0';
+  assert_received (tc, content->str + 4096);
+  g_free (offsets);
+  g_free (tag);
+
+  close_channel (tc, NULL);
+  wait_channel_closed (tc);
+  g_string_free (content, TRUE);
+}
+
+static void
+test_mirror_non_existent (TestCase *tc,
+                          gconstpointer unused)
+{
+  JsonObject *control;
+  gchar *offsets;
+
+  setup_fsmirror_channel (tc, tc->test_path);
+  control = recv_control (tc);
+  g_assert_cmpstr (json_object_get_string_member (control, "command"), ==, "ready");
+
+  offsets = recv_mirror_sync (tc, 0, "-");
+  g_assert_cmpstr (offsets, ==, "");
+  g_free (offsets);
+
+  /* Shows up when it's created */
+  set_contents (tc->test_path, "Hi");
+  offsets = recv_mirror_sync (tc, 2, NULL);
+  g_assert_cmpstr (offsets, ==, "0");
+  assert_received (tc, "Hi");
+  g_free (offsets);
+
+  close_channel (tc, NULL);
+  wait_channel_closed (tc);
+}
+
 static void
 test_watch_simple (TestCase *tc,
                    gconstpointer unused)
@@ -748,6 +1247,94 @@ test_watch_remove (TestCase *tc,
   json_object_unref (event);
 }
 
+static void
+test_watch_debounce (TestCase *tc,
+                     gconstpointer unused)
+{
+  GError *error = NULL;
+  JsonNode *node;
+  JsonArray *array;
+  JsonObject *event;
+  GBytes *msg;
+  gchar *tag;
+  guint i, seen;
+
+  setup_fswatch_options_channel (tc, tc->test_dir, 500, FALSE);
+
+  set_contents (tc->test_path, "One");
+  set_contents (tc->test_path, "Two");
+  set_contents (tc->test_path, "Three");
+  tag = cockpit_get_file_tag (tc->test_path);
+
+  /* All the events for the path arrive together, coalesced into one */
+  msg = recv_bytes (tc);
+  node = cockpit_json_parse (g_bytes_get_data (msg, NULL), g_bytes_get_size (msg), &error);
+  g_assert_no_error (error);
+  g_assert (JSON_NODE_HOLDS_ARRAY (node));
+
+  array = json_node_get_array (node);
+  seen = 0;
+  for (i = 0; i < json_array_get_length (array); i++)
+    {
+      event = json_array_get_object_element (array, i);
+      if (g_strcmp0 (json_object_get_string_member (event, "path"), tc->test_path) != 0)
+        continue;
+      g_assert_cmpstr (json_object_get_string_member (event, "event"), ==, "created");
+      g_assert_cmpstr (json_object_get_string_member (event, "tag"), ==, tag);
+      seen++;
+    }
+  g_assert_cmpuint (seen, ==, 1);
+
+  json_node_free (node);
+  g_free (tag);
+}
+
+static JsonObject *
+recv_event_for (TestCase *tc,
+                const gchar *path,
+                const gchar *type)
+{
+  JsonObject *event;
+
+  for (;;)
+    {
+      event = recv_json (tc);
+      if (g_strcmp0 (json_object_get_string_member (event, "path"), path) == 0 &&
+          g_strcmp0 (json_object_get_string_member (event, "event"), type) == 0)
+        return event;
+      json_object_unref (event);
+    }
+}
+
+static void
+test_watch_recursive (TestCase *tc,
+                      gconstpointer unused)
+{
+  JsonObject *event;
+  gchar *path;
+
+  setup_fswatch_options_channel (tc, tc->test_dir, 0, TRUE);
+
+  g_assert (mkdir (tc->test_subdir, 0700) >= 0);
+  event = recv_event_for (tc, tc->test_subdir, "created");
+  g_assert_cmpstr (json_object_get_string_member (event, "type"), ==, "directory");
+  json_object_unref (event);
+
+  /* The new directory is watched as well */
+  path = g_build_filename (tc->test_subdir, "file", NULL);
+  set_contents (path, "Deep");
+  event = recv_event_for (tc, path, "created");
+  g_assert_cmpstr (json_object_get_string_member (event, "type"), ==, "file");
+  json_object_unref (event);
+
+  g_assert (unlink (path) >= 0);
+  event = recv_event_for (tc, path, "deleted");
+  g_assert_cmpstr (json_object_get_string_member (event, "tag"), ==, "-");
+  json_object_unref (event);
+
+  g_free (path);
+}
+
 static void
 test_watch_directory (TestCase *tc,
                       gconstpointer unused)
@@ -817,6 +1404,78 @@ test_dir_simple (TestCase *tc,
   g_assert (json_object_get_member (control, "problem") == NULL);
 }
 
+static JsonArray *
+recv_array (TestCase *tc)
+{
+  GBytes *msg = recv_bytes (tc);
+  JsonNode *node = cockpit_json_parse (g_bytes_get_data (msg, NULL), g_bytes_get_size (msg), NULL);
+  JsonArray *array;
+
+  g_assert (node != NULL);
+  g_assert (JSON_NODE_HOLDS_ARRAY (node));
+  array = json_array_ref (json_node_get_array (node));
+  json_node_free (node);
+  return array;
+}
+
+static void
+test_dir_paged (TestCase *tc,
+                gconstpointer unused)
+{
+  JsonObject *event, *control;
+  JsonArray *array;
+  gchar *first, *second;
+  gchar *cursor;
+
+  set_contents (tc->test_path, "Hello!");
+  set_contents (tc->test_path_2, "Hi");
+
+  setup_fslist_paged_channel (tc, tc->test_dir, 10, 1, NULL);
+
+  array = recv_array (tc);
+  g_assert_cmpuint (json_array_get_length (array), ==, 1);
+  event = json_array_get_object_element (array, 0);
+  g_assert_cmpstr (json_object_get_string_member (event, "event"), ==, "present");
+  g_assert_cmpstr (json_object_get_string_member (event, "type"), ==, "file");
+  first = g_strdup (json_object_get_string_member (event, "path"));
+  g_assert_cmpint (json_object_get_int_member (event, "size"), ==,
+                   g_str_equal (first, "foo") ? 6 : 2);
+  json_array_unref (array);
+
+  event = recv_json (tc);
+  g_assert_cmpstr (json_object_get_string_member (event, "event"), ==, "more");
+  cursor = g_strdup (json_object_get_string_member (event, "cursor"));
+  g_assert (cursor != NULL);
+  json_object_unref (event);
+
+  wait_channel_closed (tc);
+  control = mock_transport_pop_control (tc->transport);
+  g_assert_cmpstr (json_object_get_string_member (control, "command"), ==, "ready");
+  while (!g_str_equal (json_object_get_string_member (control, "command"), "close"))
+    control = mock_transport_pop_control (tc->transport);
+  g_assert (json_object_get_member (control, "problem") == NULL);
+  g_object_unref (tc->channel);
+
+  /* Resume where the first page stopped */
+  setup_fslist_paged_channel (tc, tc->test_dir, 10, 1, cursor);
+
+  array = recv_array (tc);
+  g_assert_cmpuint (json_array_get_length (array), ==, 1);
+  event = json_array_get_object_element (array, 0);
+  second = g_strdup (json_object_get_string_member (event, "path"));
+  g_assert_cmpstr (second, !=, first);
+  g_assert (g_str_equal (second, "foo") || g_str_equal (second, "bar"));
+  json_array_unref (array);
+
+  wait_channel_closed (tc);
+  control = mock_transport_pop_control (tc->transport);
+  g_assert_cmpstr (json_object_get_string_member (control, "command"), ==, "ready");
+
+  g_free (first);
+  g_free (second);
+  g_free (cursor);
+}
+
 static void
 test_dir_simple_no_watch (TestCase *tc,
                  gconstpointer unused)
@@ -960,6 +1619,18 @@ main (int argc,
 
   g_test_add ("/fsread/simple", TestCase, NULL,
               setup, test_read_simple, teardown);
+  g_test_add ("/fsread/large", TestCase, NULL,
+              setup, test_read_large, teardown);
+  g_test_add ("/fsread/range", TestCase, NULL,
+              setup, test_read_range, teardown);
+  g_test_add ("/fsread/tail", TestCase, NULL,
+              setup, test_read_tail, teardown);
+  g_test_add ("/fsread/tail-short", TestCase, NULL,
+              setup, test_read_tail_short, teardown);
+  g_test_add ("/fsread/gzip", TestCase, NULL,
+              setup, test_read_gzip, teardown);
+  g_test_add ("/fsread/if-tag", TestCase, NULL,
+              setup, test_read_if_tag, teardown);
   g_test_add ("/fsread/non-existent", TestCase, NULL,
               setup, test_read_non_existent, teardown);
   g_test_add ("/fsread/denied", TestCase, NULL,
@@ -973,6 +1644,8 @@ main (int argc,
 
   g_test_add ("/fsreplace/simple", TestCase, NULL,
               setup, test_write_simple, teardown);
+  g_test_add ("/fsreplace/gzip", TestCase, NULL,
+              setup, test_write_gzip, teardown);
   g_test_add ("/fsreplace/multiple", TestCase, NULL,
               setup, test_write_multiple, teardown);
   g_test_add ("/fsreplace/remove", TestCase, NULL,
@@ -992,17 +1665,30 @@ main (int argc,
   g_test_add ("/fsreplace/expect-tag-fail", TestCase, NULL,
               setup, test_write_expect_tag_fail, teardown);
 
+  g_test_add ("/fsmirror/simple", TestCase, NULL,
+              setup, test_mirror_simple, teardown);
+  g_test_add ("/fsmirror/blocks", TestCase, NULL,
+              setup, test_mirror_blocks, teardown);
+  g_test_add ("/fsmirror/non-existent", TestCase, NULL,
+              setup, test_mirror_non_existent, teardown);
+
   g_test_add ("/fswatch/simple", TestCase, NULL,
               setup, test_watch_simple, teardown);
   g_test_add ("/fswatch/remove", TestCase, NULL,
               setup, test_watch_remove, teardown);
   g_test_add ("/fswatch/directory", TestCase, NULL,
               setup, test_watch_directory, teardown);
+  g_test_add ("/fswatch/debounce", TestCase, NULL,
+              setup, test_watch_debounce, teardown);
+  g_test_add ("/fswatch/recursive", TestCase, NULL,
+              setup, test_watch_recursive, teardown);
 
   g_test_add ("/fslist/simple", TestCase, NULL,
               setup, test_dir_simple, teardown);
   g_test_add ("/fslist/simple_no_watch", TestCase, NULL,
               setup, test_dir_simple_no_watch, teardown);
+  g_test_add ("/fslist/paged", TestCase, NULL,
+              setup, test_dir_paged, teardown);
   g_test_add ("/fslist/early-close", TestCase, NULL,
               setup, test_dir_early_close, teardown);
   g_test_add ("/fslist/watch", TestCase, NULL,
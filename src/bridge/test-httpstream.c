@@ -230,6 +230,99 @@ test_http_stream2 (TestGeneral *tt,
   g_bytes_unref (data);
 }
 
+static gboolean
+handle_count_streams (CockpitWebServer *server,
+                      const gchar *path,
+                      GHashTable *headers,
+                      CockpitWebResponse *response,
+                      gpointer user_data)
+{
+  GHashTable *streams = user_data;
+  GIOStream *io = cockpit_web_response_get_stream (response);
+
+  /* Hold on to them, so that addresses aren't reused */
+  if (!g_hash_table_lookup (streams, io))
+    g_hash_table_insert (streams, g_object_ref (io), io);
+
+  return handle_default (server, path, headers, response, NULL);
+}
+
+static CockpitChannel *
+open_pooled (TestGeneral *tt,
+             const gchar *id,
+             gint pool_size,
+             gboolean *closed)
+{
+  CockpitChannel *channel;
+  JsonObject *options;
+  gchar *control;
+  GBytes *bytes;
+
+  options = json_object_new ();
+  json_object_set_int_member (options, "port", tt->port);
+  json_object_set_string_member (options, "payload", "http-stream2");
+  json_object_set_string_member (options, "method", "GET");
+  json_object_set_string_member (options, "path", "/");
+  json_object_set_string_member (options, "connection", "pooled");
+  json_object_set_int_member (options, "pool-size", pool_size);
+
+  channel = g_object_new (COCKPIT_TYPE_HTTP_STREAM,
+                          "transport", tt->transport,
+                          "id", id,
+                          "options", options,
+                          NULL);
+  json_object_unref (options);
+
+  control = g_strdup_printf ("{\"command\": \"done\", \"channel\": \"%s\"}", id);
+  bytes = g_bytes_new_take (control, strlen (control));
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (tt->transport), NULL, bytes);
+  g_bytes_unref (bytes);
+
+  *closed = FALSE;
+  g_signal_connect (channel, "closed", G_CALLBACK (on_closed_set_flag), closed);
+  return channel;
+}
+
+static void
+test_pool (TestGeneral *tt,
+           gconstpointer unused)
+{
+  CockpitChannel *one, *two;
+  gboolean closed1, closed2;
+  GHashTable *streams;
+
+  streams = g_hash_table_new_full (g_direct_hash, g_direct_equal, g_object_unref, NULL);
+  g_signal_connect (tt->web_server, "handle-resource::/", G_CALLBACK (handle_count_streams), streams);
+
+  /* Two at once need two connections */
+  one = open_pooled (tt, "401", 2, &closed1);
+  two = open_pooled (tt, "402", 2, &closed2);
+  while (!closed1 || !closed2)
+    g_main_context_iteration (NULL, TRUE);
+  g_object_unref (one);
+  g_object_unref (two);
+  g_assert_cmpuint (g_hash_table_size (streams), ==, 2);
+
+  /* Both are kept around and reused */
+  one = open_pooled (tt, "403", 2, &closed1);
+  two = open_pooled (tt, "404", 2, &closed2);
+  while (!closed1 || !closed2)
+    g_main_context_iteration (NULL, TRUE);
+  g_object_unref (one);
+  g_object_unref (two);
+  g_assert_cmpuint (g_hash_table_size (streams), ==, 2);
+
+  /* An empty pool keeps nothing, so a new connection is made */
+  one = open_pooled (tt, "405", 0, &closed1);
+  while (!closed1)
+    g_main_context_iteration (NULL, TRUE);
+  g_object_unref (one);
+  g_assert_cmpuint (g_hash_table_size (streams), ==, 3);
+
+  g_signal_handlers_disconnect_by_func (tt->web_server, handle_count_streams, streams);
+  g_hash_table_destroy (streams);
+}
+
 static void
 test_cannot_connect (TestGeneral *tt,
                      gconstpointer unused)
@@ -406,6 +499,102 @@ test_http_chunked (void)
   g_slice_free (TestResult, tr);
 }
 
+static const gint SMALL_CHUNKS = 300;
+
+static gboolean
+handle_small_chunks (CockpitWebServer *server,
+                     const gchar *path,
+                     GHashTable *headers,
+                     CockpitWebResponse *response,
+                     gpointer user_data)
+{
+  GBytes *bytes;
+  gint i;
+
+  cockpit_web_response_headers (response, 200, "OK", -1, NULL);
+  for (i = 0; i < SMALL_CHUNKS; i++)
+    {
+      bytes = g_bytes_new_take (g_strdup_printf ("%03d ", i), 4);
+      cockpit_web_response_queue (response, bytes);
+      g_bytes_unref (bytes);
+    }
+  cockpit_web_response_complete (response);
+  return TRUE;
+}
+
+static void
+test_http_small_chunks (void)
+{
+  MockTransport *transport = NULL;
+  CockpitChannel *channel = NULL;
+  CockpitWebServer *web_server = NULL;
+  JsonObject *options = NULL;
+  TestResult *tr = g_slice_new (TestResult);
+  GString *expected;
+  GBytes *bytes = NULL;
+  GBytes *data = NULL;
+  const gchar *control;
+  guint count;
+  guint port;
+  gint i;
+
+  web_server = cockpit_web_server_new (0, NULL, NULL, NULL, NULL);
+  g_assert (web_server);
+  port = cockpit_web_server_get_port (web_server);
+  g_signal_connect (web_server, "handle-resource::/",
+                    G_CALLBACK (handle_small_chunks), NULL);
+
+  transport = mock_transport_new ();
+  g_signal_connect (transport, "closed", G_CALLBACK (on_transport_closed), NULL);
+
+  options = json_object_new ();
+  json_object_set_int_member (options, "port", port);
+  json_object_set_string_member (options, "payload", "http-stream2");
+  json_object_set_string_member (options, "method", "GET");
+  json_object_set_string_member (options, "path", "/");
+
+  channel = g_object_new (COCKPIT_TYPE_HTTP_STREAM,
+                          "transport", transport,
+                          "id", "444",
+                          "options", options,
+                          NULL);
+
+  json_object_unref (options);
+
+  control = "{\"command\": \"done\", \"channel\": \"444\"}";
+  bytes = g_bytes_new_static (control, strlen (control));
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (transport), NULL, bytes);
+  g_bytes_unref (bytes);
+
+  tr->done = FALSE;
+  g_signal_connect (channel, "closed", G_CALLBACK (on_channel_close), tr);
+
+  while (tr->done == FALSE)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_cmpstr (tr->problem, ==, NULL);
+
+  expected = g_string_new ("");
+  for (i = 0; i < SMALL_CHUNKS; i++)
+    g_string_append_printf (expected, "%03d ", i);
+
+  /* The small chunks are merged into far fewer messages */
+  data = mock_transport_combine_output (transport, "444", &count);
+  cockpit_assert_bytes_eq (data, expected->str, expected->len);
+  g_assert_cmpuint (count, <, SMALL_CHUNKS / 10);
+
+  g_bytes_unref (data);
+  g_string_free (expected, TRUE);
+
+  g_object_unref (transport);
+  g_object_add_weak_pointer (G_OBJECT (channel), (gpointer *)&channel);
+  g_object_unref (channel);
+  g_assert (channel == NULL);
+  g_clear_object (&web_server);
+
+  g_free (tr->problem);
+  g_slice_free (TestResult, tr);
+}
+
 static void
 test_parse_keep_alive (void)
 {
@@ -865,11 +1054,14 @@ main (int argc,
 
   g_test_add ("/http-stream/http-stream2", TestGeneral, NULL,
               setup_general, test_http_stream2, teardown_general);
+  g_test_add ("/http-stream/pool", TestGeneral, NULL,
+              setup_general, test_pool, teardown_general);
   g_test_add ("/http-stream/cannot-connect", TestGeneral, NULL,
               setup_general, test_cannot_connect, teardown_general);
 
   g_test_add_func  ("/http-stream/parse_keepalive", test_parse_keep_alive);
   g_test_add_func  ("/http-stream/http_chunked", test_http_chunked);
+  g_test_add_func  ("/http-stream/small_chunks", test_http_small_chunks);
 
   g_test_add ("/http-stream/tls/basic", TestTls, NULL,
               setup_tls, test_tls_basic, teardown_tls);
@@ -0,0 +1,238 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2016 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitjournal.h"
+#include "mock-transport.h"
+
+#include "common/cockpittest.h"
+#include "common/cockpitjson.h"
+
+#include <glib/gstdio.h>
+
+#include <string.h>
+#include <unistd.h>
+
+#define TIMEOUT 30
+
+/*
+ * There's no journal with known contents to read here, so these open
+ * an empty journal directory, and check the channel around that.
+ */
+
+typedef struct {
+  MockTransport *transport;
+  CockpitChannel *channel;
+  gchar *directory;
+  gboolean channel_closed;
+} TestCase;
+
+static void
+on_channel_close (CockpitChannel *channel,
+                  const gchar *problem,
+                  gpointer user_data)
+{
+  TestCase *tc = user_data;
+  g_assert (tc->channel_closed == FALSE);
+  tc->channel_closed = TRUE;
+}
+
+static void
+setup (TestCase *tc,
+       gconstpointer data)
+{
+  alarm (TIMEOUT);
+
+  tc->transport = mock_transport_new ();
+  tc->directory = g_dir_make_tmp ("test-journal.XXXXXX", NULL);
+  g_assert (tc->directory != NULL);
+}
+
+static void
+teardown (TestCase *tc,
+          gconstpointer data)
+{
+  cockpit_assert_expected ();
+
+  if (tc->channel)
+    {
+      g_object_add_weak_pointer (G_OBJECT (tc->channel), (gpointer *)&tc->channel);
+      g_object_unref (tc->channel);
+      g_assert (tc->channel == NULL);
+    }
+
+  g_object_unref (tc->transport);
+  g_rmdir (tc->directory);
+  g_free (tc->directory);
+
+  alarm (0);
+}
+
+static void
+open_channel (TestCase *tc,
+              JsonObject *options)
+{
+  json_object_set_string_member (options, "payload", "journal1");
+  if (!json_object_has_member (options, "directory"))
+    json_object_set_string_member (options, "directory", tc->directory);
+
+  tc->channel = g_object_new (COCKPIT_TYPE_JOURNAL,
+                              "transport", tc->transport,
+                              "id", "1234",
+                              "options", options,
+                              NULL);
+
+  json_object_unref (options);
+
+  tc->channel_closed = FALSE;
+  g_signal_connect (tc->channel, "closed", G_CALLBACK (on_channel_close), tc);
+  cockpit_channel_prepare (tc->channel);
+}
+
+static JsonObject *
+recv_control (TestCase *tc)
+{
+  JsonObject *control;
+
+  while ((control = mock_transport_pop_control (tc->transport)) == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  return control;
+}
+
+static void
+test_empty (TestCase *tc,
+            gconstpointer data)
+{
+  JsonObject *options;
+  JsonObject *control;
+
+  options = json_object_new ();
+  json_object_set_boolean_member (options, "follow", FALSE);
+  open_channel (tc, options);
+
+  control = recv_control (tc);
+  g_assert_cmpstr (json_object_get_string_member (control, "command"), ==, "ready");
+  control = recv_control (tc);
+  g_assert_cmpstr (json_object_get_string_member (control, "command"), ==, "done");
+  control = recv_control (tc);
+  g_assert_cmpstr (json_object_get_string_member (control, "command"), ==, "close");
+  g_assert (json_object_get_member (control, "problem") == NULL);
+
+  g_assert (tc->channel_closed);
+  g_assert (mock_transport_pop_channel (tc->transport, "1234") == NULL);
+}
+
+static void
+test_follow (TestCase *tc,
+             gconstpointer data)
+{
+  JsonObject *options;
+  JsonObject *control;
+  gint i;
+
+  options = json_object_new ();
+  json_object_set_int_member (options, "count", 10);
+  open_channel (tc, options);
+
+  control = recv_control (tc);
+  g_assert_cmpstr (json_object_get_string_member (control, "command"), ==, "ready");
+
+  /* Nothing to read, and it keeps waiting for more */
+  for (i = 0; i < 10; i++)
+    g_main_context_iteration (NULL, FALSE);
+  g_assert (!tc->channel_closed);
+  g_assert (mock_transport_pop_control (tc->transport) == NULL);
+
+  cockpit_channel_close (tc->channel, NULL);
+  g_assert (tc->channel_closed);
+}
+
+static void
+test_reverse (TestCase *tc,
+              gconstpointer data)
+{
+  JsonObject *options;
+  JsonObject *control;
+
+  /* Reverse never follows */
+  options = json_object_new ();
+  json_object_set_boolean_member (options, "reverse", TRUE);
+  json_object_set_int_member (options, "count", 5);
+  open_channel (tc, options);
+
+  control = recv_control (tc);
+  g_assert_cmpstr (json_object_get_string_member (control, "command"), ==, "ready");
+  control = recv_control (tc);
+  g_assert_cmpstr (json_object_get_string_member (control, "command"), ==, "done");
+
+  while (!tc->channel_closed)
+    g_main_context_iteration (NULL, TRUE);
+}
+
+static void
+test_bad_option (TestCase *tc,
+                 gconstpointer data)
+{
+  const gchar *member = data;
+  JsonObject *options;
+  JsonObject *control;
+  JsonArray *fields;
+
+  cockpit_expect_warning ("*invalid*option for journal1 channel*");
+
+  options = json_object_new ();
+  if (g_str_equal (member, "fields"))
+    {
+      fields = json_array_new ();
+      json_array_add_string_element (fields, "A=B");
+      json_object_set_array_member (options, "fields", fields);
+    }
+  else
+    json_object_set_int_member (options, member, -5);
+  open_channel (tc, options);
+
+  control = recv_control (tc);
+  g_assert_cmpstr (json_object_get_string_member (control, "command"), ==, "close");
+  g_assert_cmpstr (json_object_get_string_member (control, "problem"), ==, "protocol-error");
+  g_assert (tc->channel_closed);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  cockpit_test_init (&argc, &argv);
+
+  g_test_add ("/journal/empty", TestCase, NULL,
+              setup, test_empty, teardown);
+  g_test_add ("/journal/follow", TestCase, NULL,
+              setup, test_follow, teardown);
+  g_test_add ("/journal/reverse", TestCase, NULL,
+              setup, test_reverse, teardown);
+  g_test_add ("/journal/bad-count", TestCase, "count",
+              setup, test_bad_option, teardown);
+  g_test_add ("/journal/bad-batch", TestCase, "batch",
+              setup, test_bad_option, teardown);
+  g_test_add ("/journal/bad-fields", TestCase, "fields",
+              setup, test_bad_option, teardown);
+
+  return g_test_run ();
+}
@@ -19,15 +19,26 @@
 
 #include "config.h"
 #include <math.h>
+#include <string.h>
 
 #include "cockpitmetrics.h"
 #include "mock-transport.h"
 
 #include "cockpitinternalmetrics.h"
+#include "cockpitcgroupsamples.h"
+#include "cockpitmetricsring.h"
+#include "cockpitsampleset.h"
 
+#include "common/cockpitpipetransport.h"
 #include "common/cockpittest.h"
 #include "common/cockpitjson.h"
 
+#include <glib/gstdio.h>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
 typedef struct {
   MockTransport *transport;
   CockpitMetrics *channel;
@@ -591,6 +602,1176 @@ test_not_supported (void)
   g_free (problem);
 }
 
+static void
+test_self_source (void)
+{
+  MockTransport *transport;
+  CockpitMetrics *channel;
+  JsonObject *options;
+  JsonObject *meta;
+  JsonArray *metrics;
+  JsonArray *instances;
+  GBytes *msg = NULL;
+  gboolean found = FALSE;
+  guint i;
+
+  transport = mock_transport_new ();
+  g_signal_connect (transport, "closed", G_CALLBACK (on_transport_closed), NULL);
+  options = json_obj ("{ 'source': 'self',"
+                      "  'metrics': [ { 'name': 'bridge.channel.open' } ],"
+                      "  'interval': 100"
+                      "}");
+  channel = g_object_new (cockpit_internal_metrics_get_type (),
+                          "transport", transport,
+                          "id", "1234",
+                          "options", options,
+                          NULL);
+  json_object_unref (options);
+
+  while (msg == NULL)
+    {
+      g_main_context_iteration (NULL, TRUE);
+      msg = mock_transport_pop_channel (transport, "1234");
+    }
+
+  /* This channel has no payload type of its own */
+  meta = cockpit_json_parse_bytes (msg, NULL);
+  g_assert (meta != NULL);
+  metrics = json_object_get_array_member (meta, "metrics");
+  g_assert_cmpstr (json_object_get_string_member (json_array_get_object_element (metrics, 0), "name"),
+                   ==, "bridge.channel.open");
+  instances = json_object_get_array_member (json_array_get_object_element (metrics, 0), "instances");
+  for (i = 0; i < json_array_get_length (instances); i++)
+    {
+      if (g_str_equal (json_array_get_string_element (instances, i), "unknown"))
+        found = TRUE;
+    }
+  g_assert (found);
+  json_object_unref (meta);
+
+  g_object_add_weak_pointer (G_OBJECT (channel), (gpointer *)&channel);
+  g_object_unref (channel);
+  g_assert (channel == NULL);
+
+  g_object_unref (transport);
+}
+
+static void
+test_self_twice (void)
+{
+  MockTransport *transport;
+  CockpitMetrics *channel;
+  JsonObject *options;
+  JsonObject *meta;
+  JsonArray *metrics;
+  JsonArray *first;
+  JsonArray *second;
+  GBytes *msg = NULL;
+  guint i;
+
+  transport = mock_transport_new ();
+  g_signal_connect (transport, "closed", G_CALLBACK (on_transport_closed), NULL);
+  options = json_obj ("{ 'source': 'self',"
+                      "  'metrics': [ { 'name': 'bridge.channel.opened' },"
+                      "               { 'name': 'bridge.channel.opened', 'derive': 'rate' } ],"
+                      "  'interval': 100"
+                      "}");
+  channel = g_object_new (cockpit_internal_metrics_get_type (),
+                          "transport", transport,
+                          "id", "1234",
+                          "options", options,
+                          NULL);
+  json_object_unref (options);
+
+  while (msg == NULL)
+    {
+      g_main_context_iteration (NULL, TRUE);
+      msg = mock_transport_pop_channel (transport, "1234");
+    }
+
+  /* Each gets the same instances, even though they come from one sample */
+  meta = cockpit_json_parse_bytes (msg, NULL);
+  g_assert (meta != NULL);
+  metrics = json_object_get_array_member (meta, "metrics");
+  g_assert_cmpuint (json_array_get_length (metrics), ==, 2);
+  first = json_object_get_array_member (json_array_get_object_element (metrics, 0), "instances");
+  second = json_object_get_array_member (json_array_get_object_element (metrics, 1), "instances");
+  g_assert_cmpuint (json_array_get_length (first), >, 0);
+  g_assert_cmpuint (json_array_get_length (first), ==, json_array_get_length (second));
+  for (i = 0; i < json_array_get_length (first); i++)
+    {
+      g_assert_cmpstr (json_array_get_string_element (first, i), ==,
+                       json_array_get_string_element (second, i));
+    }
+  json_object_unref (meta);
+
+  g_object_add_weak_pointer (G_OBJECT (channel), (gpointer *)&channel);
+  g_object_unref (channel);
+  g_assert (channel == NULL);
+
+  g_object_unref (transport);
+}
+
+static gboolean
+on_recv_push_frame (CockpitTransport *transport,
+                    const gchar *channel,
+                    GBytes *payload,
+                    gpointer user_data)
+{
+  GPtrArray *frames = user_data;
+  const gchar *command;
+  const gchar *inner;
+  JsonObject *options;
+
+  if (!channel)
+    {
+      g_assert (cockpit_transport_parse_command (payload, &command, &inner, &options));
+      g_ptr_array_add (frames, g_strdup (command));
+      json_object_unref (options);
+    }
+  else if (((const gchar *)g_bytes_get_data (payload, NULL))[0] == '{')
+    {
+      g_ptr_array_add (frames, g_strdup ("meta"));
+    }
+  else
+    {
+      g_ptr_array_add (frames, g_strdup ("data"));
+    }
+
+  return TRUE;
+}
+
+static void
+test_self_join_hub (void)
+{
+  MockTransport *transport;
+  CockpitTransport *second;
+  CockpitTransport *reader;
+  CockpitMetrics *channel1;
+  CockpitMetrics *channel2;
+  JsonObject *options;
+  GPtrArray *frames;
+  GBytes *msg = NULL;
+  gint fds[2];
+  gint idle[2];
+  gint out;
+
+  transport = mock_transport_new ();
+  g_signal_connect (transport, "closed", G_CALLBACK (on_transport_closed), NULL);
+  options = json_obj ("{ 'source': 'self',"
+                      "  'metrics': [ { 'name': 'bridge.channel.open' } ],"
+                      "  'interval': 100"
+                      "}");
+  channel1 = g_object_new (cockpit_internal_metrics_get_type (),
+                           "transport", transport,
+                           "id", "1234",
+                           "options", options,
+                           NULL);
+
+  /* Until the hub has a sample set to backfill with */
+  while (msg == NULL || ((const gchar *)g_bytes_get_data (msg, NULL))[0] == '{')
+    {
+      g_main_context_iteration (NULL, TRUE);
+      msg = mock_transport_pop_channel (transport, "1234");
+    }
+
+  /* The second channel goes over a pipe, which keeps all frames in order */
+  if (pipe (fds) < 0 || pipe (idle) < 0)
+    g_assert_not_reached ();
+  out = dup (2);
+  g_assert (out >= 0);
+
+  second = cockpit_pipe_transport_new_fds ("second", idle[0], fds[1]);
+  reader = cockpit_pipe_transport_new_fds ("reader", fds[0], out);
+  frames = g_ptr_array_new_with_free_func (g_free);
+  g_signal_connect (reader, "recv", G_CALLBACK (on_recv_push_frame), frames);
+
+  channel2 = g_object_new (cockpit_internal_metrics_get_type (),
+                           "transport", second,
+                           "id", "5678",
+                           "options", options,
+                           NULL);
+  json_object_unref (options);
+
+  while (frames->len < 3)
+    g_main_context_iteration (NULL, TRUE);
+
+  /* The backfill only follows once the channel is ready */
+  g_assert_cmpstr (frames->pdata[0], ==, "ready");
+  g_assert_cmpstr (frames->pdata[1], ==, "meta");
+  g_assert_cmpstr (frames->pdata[2], ==, "data");
+
+  g_object_add_weak_pointer (G_OBJECT (channel2), (gpointer *)&channel2);
+  g_object_unref (channel2);
+  g_assert (channel2 == NULL);
+
+  g_object_add_weak_pointer (G_OBJECT (channel1), (gpointer *)&channel1);
+  g_object_unref (channel1);
+  g_assert (channel1 == NULL);
+
+  g_ptr_array_free (frames, TRUE);
+  g_object_unref (second);
+  g_object_unref (reader);
+  close (idle[1]);
+  g_object_unref (transport);
+}
+
+static void
+collect_cgroups (CockpitSamples *samples,
+                 guint flags)
+{
+  cockpit_cgroup_samples (samples);
+}
+
+static gboolean
+on_collected_set_flag (gpointer user_data)
+{
+  gboolean *flag = user_data;
+  *flag = TRUE;
+  return FALSE;
+}
+
+static void
+on_filtered_sample (guint key,
+                    const gchar *metric,
+                    const gchar *instance,
+                    gint64 value,
+                    gpointer user_data)
+{
+  GString *seen = user_data;
+  if (g_str_equal (metric, "cgroup.memory.usage"))
+    g_string_append_printf (seen, "%s=%" G_GINT64_FORMAT " ", instance, value);
+}
+
+static void
+test_instance_filter (void)
+{
+  const gchar *saved_root = cockpit_cgroup_unified_root;
+  CockpitSampleSet *set;
+  GHashTable *filter;
+  GString *seen;
+  gboolean done = FALSE;
+  gchar *root;
+  gchar *path;
+  const gchar *names[] = { "a", "b", NULL };
+  gint i;
+
+  /* A fake unified cgroup hierarchy with two cgroups */
+  root = g_dir_make_tmp ("test-metrics.XXXXXX", NULL);
+  g_assert (root != NULL);
+  path = g_build_filename (root, "cgroup.controllers", NULL);
+  g_assert (g_file_set_contents (path, "memory\n", -1, NULL));
+  g_free (path);
+  for (i = 0; names[i]; i++)
+    {
+      path = g_build_filename (root, names[i], NULL);
+      g_assert (g_mkdir (path, 0700) == 0);
+      g_free (path);
+      path = g_build_filename (root, names[i], "memory.current", NULL);
+      g_assert (g_file_set_contents (path, i == 0 ? "1000\n" : "2000\n", -1, NULL));
+      g_free (path);
+    }
+
+  cockpit_cgroup_unified_root = root;
+
+  /* The sampler never reads the cgroups that aren't wanted */
+  filter = g_hash_table_new (g_str_hash, g_str_equal);
+  g_hash_table_add (filter, "a");
+  set = cockpit_sample_set_new ();
+  cockpit_sample_set_filter (set, filter, FALSE);
+  g_hash_table_unref (filter);
+
+  cockpit_sample_set_collect (set, collect_cgroups, 0, on_collected_set_flag, &done);
+  while (!done)
+    g_main_context_iteration (NULL, TRUE);
+
+  seen = g_string_new ("");
+  cockpit_sample_set_foreach (set, on_filtered_sample, seen);
+  g_assert_cmpstr (seen->str, ==, "a=1000 ");
+  g_string_free (seen, TRUE);
+  g_object_unref (set);
+
+  cockpit_cgroup_unified_root = saved_root;
+
+  for (i = 0; names[i]; i++)
+    {
+      path = g_build_filename (root, names[i], "memory.current", NULL);
+      g_assert (g_unlink (path) == 0);
+      g_free (path);
+      path = g_build_filename (root, names[i], NULL);
+      g_assert (g_rmdir (path) == 0);
+      g_free (path);
+    }
+  path = g_build_filename (root, "cgroup.controllers", NULL);
+  g_assert (g_unlink (path) == 0);
+  g_free (path);
+  g_assert (g_rmdir (root) == 0);
+  g_free (root);
+}
+
+/*
+ * A fake unified cgroup hierarchy. Files are rewritten in place,
+ * like the kernel does, since the sampler keeps them open.
+ */
+
+static gchar *
+cgroup_tree_new (void)
+{
+  gchar *root;
+  gchar *path;
+
+  root = g_dir_make_tmp ("test-metrics.XXXXXX", NULL);
+  g_assert (root != NULL);
+  path = g_build_filename (root, "cgroup.controllers", NULL);
+  g_assert (g_file_set_contents (path, "cpu io memory\n", -1, NULL));
+  g_free (path);
+
+  return root;
+}
+
+static void
+cgroup_tree_free (gchar *root)
+{
+  gchar *quoted;
+  gchar *command;
+
+  quoted = g_shell_quote (root);
+  command = g_strdup_printf ("rm -rf %s", quoted);
+  g_assert (system (command) == 0);
+  g_free (command);
+  g_free (quoted);
+  g_free (root);
+}
+
+static void
+cgroup_tree_mkdir (const gchar *root,
+                   const gchar *cgroup)
+{
+  gchar *path;
+
+  path = g_build_filename (root, cgroup, NULL);
+  g_assert (g_mkdir_with_parents (path, 0700) == 0);
+  g_free (path);
+}
+
+static void
+cgroup_tree_write (const gchar *root,
+                   const gchar *cgroup,
+                   const gchar *file,
+                   const gchar *contents)
+{
+  gchar *path;
+  gsize length;
+  gint fd;
+
+  path = g_build_filename (root, cgroup, file, NULL);
+  fd = open (path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  g_assert (fd >= 0);
+  length = strlen (contents);
+  g_assert (write (fd, contents, length) == (gssize)length);
+  close (fd);
+  g_free (path);
+}
+
+static void
+on_cgroup_sample (guint key,
+                  const gchar *metric,
+                  const gchar *instance,
+                  gint64 value,
+                  gpointer user_data)
+{
+  GHashTable *seen = user_data;
+  gint64 *copy;
+
+  if (!instance || !g_str_has_prefix (metric, "cgroup."))
+    return;
+
+  copy = g_new (gint64, 1);
+  *copy = value;
+  g_hash_table_replace (seen, g_strdup_printf ("%s %s", metric, instance), copy);
+}
+
+static GHashTable *
+sample_cgroup_tree (const gchar *root)
+{
+  const gchar *saved_root = cockpit_cgroup_unified_root;
+  CockpitSampleSet *set;
+  GHashTable *seen;
+  gboolean done = FALSE;
+
+  cockpit_cgroup_unified_root = root;
+
+  set = cockpit_sample_set_new ();
+  cockpit_sample_set_collect (set, collect_cgroups, 0, on_collected_set_flag, &done);
+  while (!done)
+    g_main_context_iteration (NULL, TRUE);
+
+  seen = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  cockpit_sample_set_foreach (set, on_cgroup_sample, seen);
+  g_object_unref (set);
+
+  cockpit_cgroup_unified_root = saved_root;
+  return seen;
+}
+
+static gint64
+lookup_cgroup_sample (GHashTable *seen,
+                      const gchar *metric,
+                      const gchar *instance)
+{
+  gint64 *value;
+  gchar *key;
+
+  key = g_strdup_printf ("%s %s", metric, instance);
+  value = g_hash_table_lookup (seen, key);
+  g_free (key);
+
+  return value ? *value : -1;
+}
+
+static void
+test_cgroup_unified_stat (void)
+{
+  GHashTable *seen;
+  gchar *root;
+
+  root = cgroup_tree_new ();
+
+  cgroup_tree_mkdir (root, "x");
+  cgroup_tree_write (root, "x", "memory.current", "1000\n");
+  cgroup_tree_write (root, "x", "memory.max", "max\n");
+  cgroup_tree_write (root, "x", "memory.swap.current", "10\n");
+  cgroup_tree_write (root, "x", "memory.swap.max", "max\n");
+  cgroup_tree_write (root, "x", "cpu.stat", "usage_usec 123000\nuser_usec 100000\nsystem_usec 23000\n");
+  cgroup_tree_write (root, "x", "cpu.weight", "50\n");
+  cgroup_tree_write (root, "x", "io.stat",
+                     "8:0 rbytes=4096 wbytes=1024 rios=1 wios=1 dbytes=0 dios=0\n"
+                     "8:16 rbytes=100 wbytes=200 rios=1 wios=1 dbytes=0 dios=0\n");
+
+  /* Without the cpu and io controllers enabled */
+  cgroup_tree_mkdir (root, "x/y");
+  cgroup_tree_write (root, "x/y", "memory.current", "2000\n");
+  cgroup_tree_write (root, "x/y", "memory.max", "4000\n");
+
+  seen = sample_cgroup_tree (root);
+
+  g_assert_cmpint (lookup_cgroup_sample (seen, "cgroup.memory.usage", "x"), ==, 1000);
+  g_assert_cmpint (lookup_cgroup_sample (seen, "cgroup.memory.limit", "x"), ==, 0);
+  g_assert_cmpint (lookup_cgroup_sample (seen, "cgroup.memory.sw-usage", "x"), ==, 1010);
+  g_assert_cmpint (lookup_cgroup_sample (seen, "cgroup.memory.sw-limit", "x"), ==, 0);
+  g_assert_cmpint (lookup_cgroup_sample (seen, "cgroup.cpu.usage", "x"), ==, 123);
+  g_assert_cmpint (lookup_cgroup_sample (seen, "cgroup.cpu.shares", "x"), ==, 512);
+  g_assert_cmpint (lookup_cgroup_sample (seen, "cgroup.io.read", "x"), ==, 4196);
+  g_assert_cmpint (lookup_cgroup_sample (seen, "cgroup.io.written", "x"), ==, 1224);
+
+  g_assert_cmpint (lookup_cgroup_sample (seen, "cgroup.memory.usage", "x/y"), ==, 2000);
+  g_assert_cmpint (lookup_cgroup_sample (seen, "cgroup.memory.limit", "x/y"), ==, 4000);
+  g_assert_cmpint (lookup_cgroup_sample (seen, "cgroup.memory.sw-usage", "x/y"), ==, -1);
+  g_assert_cmpint (lookup_cgroup_sample (seen, "cgroup.cpu.usage", "x/y"), ==, -1);
+  g_assert_cmpint (lookup_cgroup_sample (seen, "cgroup.cpu.shares", "x/y"), ==, -1);
+  g_assert_cmpint (lookup_cgroup_sample (seen, "cgroup.io.read", "x/y"), ==, -1);
+  g_assert_cmpint (lookup_cgroup_sample (seen, "cgroup.io.written", "x/y"), ==, -1);
+  g_hash_table_unref (seen);
+
+  /* Files that are kept open are read again */
+  cgroup_tree_write (root, "x", "cpu.stat", "usage_usec 456000\n");
+  cgroup_tree_write (root, "x", "io.stat", "8:0 rbytes=8192 wbytes=2048 rios=2 wios=2 dbytes=0 dios=0\n");
+
+  seen = sample_cgroup_tree (root);
+  g_assert_cmpint (lookup_cgroup_sample (seen, "cgroup.cpu.usage", "x"), ==, 456);
+  g_assert_cmpint (lookup_cgroup_sample (seen, "cgroup.io.read", "x"), ==, 8192);
+  g_assert_cmpint (lookup_cgroup_sample (seen, "cgroup.io.written", "x"), ==, 2048);
+  g_hash_table_unref (seen);
+
+  cgroup_tree_free (root);
+}
+
+static void
+test_cgroup_unified_rewalk (void)
+{
+  GHashTable *seen;
+  gchar *path;
+  gchar *root;
+
+  root = cgroup_tree_new ();
+
+  cgroup_tree_mkdir (root, "a");
+  cgroup_tree_write (root, "a", "cpu.stat", "usage_usec 1000\n");
+
+  seen = sample_cgroup_tree (root);
+  g_assert_cmpint (lookup_cgroup_sample (seen, "cgroup.cpu.usage", "a"), ==, 1);
+  g_assert_cmpint (lookup_cgroup_sample (seen, "cgroup.cpu.usage", "b"), ==, -1);
+  g_hash_table_unref (seen);
+
+  /* New cgroups are picked up */
+  cgroup_tree_mkdir (root, "b");
+  cgroup_tree_write (root, "b", "cpu.stat", "usage_usec 2000\n");
+
+  seen = sample_cgroup_tree (root);
+  g_assert_cmpint (lookup_cgroup_sample (seen, "cgroup.cpu.usage", "a"), ==, 1);
+  g_assert_cmpint (lookup_cgroup_sample (seen, "cgroup.cpu.usage", "b"), ==, 2);
+  g_hash_table_unref (seen);
+
+  /* Also below ones already seen */
+  cgroup_tree_mkdir (root, "a/c");
+  cgroup_tree_write (root, "a/c", "cpu.stat", "usage_usec 3000\n");
+
+  seen = sample_cgroup_tree (root);
+  g_assert_cmpint (lookup_cgroup_sample (seen, "cgroup.cpu.usage", "a/c"), ==, 3);
+  g_hash_table_unref (seen);
+
+  /* And removed ones are forgotten */
+  path = g_build_filename (root, "b", "cpu.stat", NULL);
+  g_assert (g_unlink (path) == 0);
+  g_free (path);
+  path = g_build_filename (root, "b", NULL);
+  g_assert (g_rmdir (path) == 0);
+  g_free (path);
+
+  seen = sample_cgroup_tree (root);
+  g_assert_cmpint (lookup_cgroup_sample (seen, "cgroup.cpu.usage", "a"), ==, 1);
+  g_assert_cmpint (lookup_cgroup_sample (seen, "cgroup.cpu.usage", "b"), ==, -1);
+  g_assert_cmpint (lookup_cgroup_sample (seen, "cgroup.cpu.usage", "a/c"), ==, 3);
+  g_hash_table_unref (seen);
+
+  cgroup_tree_free (root);
+}
+
+static guint
+count_open_fds (void)
+{
+  GDir *dir;
+  guint count = 0;
+
+  dir = g_dir_open ("/proc/self/fd", 0, NULL);
+  g_assert (dir != NULL);
+  while (g_dir_read_name (dir))
+    count++;
+  g_dir_close (dir);
+
+  return count;
+}
+
+static void
+test_cgroup_unified_fd_budget (void)
+{
+  GHashTable *seen;
+  gchar *usage;
+  gchar *name;
+  gchar *root;
+  guint before;
+  gint i;
+
+  /* Three files each, more than the sampler keeps open */
+  root = cgroup_tree_new ();
+  for (i = 0; i < 300; i++)
+    {
+      name = g_strdup_printf ("cg%d", i);
+      usage = g_strdup_printf ("usage_usec %d000\n", i);
+      cgroup_tree_mkdir (root, name);
+      cgroup_tree_write (root, name, "memory.current", "1000\n");
+      cgroup_tree_write (root, name, "cpu.stat", usage);
+      cgroup_tree_write (root, name, "io.stat", "8:0 rbytes=1 wbytes=2\n");
+      g_free (usage);
+      g_free (name);
+    }
+
+  /* All of them open would be 900 */
+  before = count_open_fds ();
+  seen = sample_cgroup_tree (root);
+  g_assert_cmpuint (count_open_fds (), <, before + 600);
+  g_hash_table_unref (seen);
+
+  /* Those that didn't fit are opened each time, and read just the same */
+  for (i = 0; i < 300; i++)
+    {
+      name = g_strdup_printf ("cg%d", i);
+      usage = g_strdup_printf ("usage_usec %d000\n", i * 2);
+      cgroup_tree_write (root, name, "cpu.stat", usage);
+      g_free (usage);
+      g_free (name);
+    }
+
+  seen = sample_cgroup_tree (root);
+  for (i = 0; i < 300; i++)
+    {
+      name = g_strdup_printf ("cg%d", i);
+      g_assert_cmpint (lookup_cgroup_sample (seen, "cgroup.memory.usage", name), ==, 1000);
+      g_assert_cmpint (lookup_cgroup_sample (seen, "cgroup.cpu.usage", name), ==, i * 2);
+      g_assert_cmpint (lookup_cgroup_sample (seen, "cgroup.io.read", name), ==, 1);
+      g_assert_cmpint (lookup_cgroup_sample (seen, "cgroup.io.written", name), ==, 2);
+      g_free (name);
+    }
+  g_assert_cmpuint (count_open_fds (), <, before + 600);
+  g_hash_table_unref (seen);
+
+  cgroup_tree_free (root);
+}
+
+static gboolean
+on_timeout_set_flag (gpointer user_data)
+{
+  gboolean *flag = user_data;
+  *flag = TRUE;
+  return FALSE;
+}
+
+static void
+test_pause (void)
+{
+  const gchar *pause = "{ \"command\": \"pause\", \"channel\": \"1234\" }";
+  const gchar *resume = "{ \"command\": \"resume\", \"channel\": \"1234\" }";
+  MockTransport *transport;
+  CockpitMetrics *channel;
+  JsonObject *options;
+  GBytes *command;
+  GBytes *msg = NULL;
+  gboolean waited = FALSE;
+
+  transport = mock_transport_new ();
+  g_signal_connect (transport, "closed", G_CALLBACK (on_transport_closed), NULL);
+  options = json_obj ("{ 'source': 'self',"
+                      "  'metrics': [ { 'name': 'bridge.channel.open' } ],"
+                      "  'interval': 50"
+                      "}");
+  channel = g_object_new (cockpit_internal_metrics_get_type (),
+                          "transport", transport,
+                          "id", "1234",
+                          "options", options,
+                          NULL);
+  json_object_unref (options);
+
+  while (msg == NULL)
+    {
+      g_main_context_iteration (NULL, TRUE);
+      msg = mock_transport_pop_channel (transport, "1234");
+    }
+  g_assert (((const gchar *)g_bytes_get_data (msg, NULL))[0] == '{');
+
+  command = g_bytes_new_static (pause, strlen (pause));
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (transport), NULL, command);
+  g_bytes_unref (command);
+  while (mock_transport_pop_channel (transport, "1234"))
+    ;
+
+  /* Nothing is sent while paused */
+  g_timeout_add (200, on_timeout_set_flag, &waited);
+  while (!waited)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert (mock_transport_pop_channel (transport, "1234") == NULL);
+
+  /* And a new meta message comes first after resuming */
+  command = g_bytes_new_static (resume, strlen (resume));
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (transport), NULL, command);
+  g_bytes_unref (command);
+
+  msg = NULL;
+  while (msg == NULL)
+    {
+      g_main_context_iteration (NULL, TRUE);
+      msg = mock_transport_pop_channel (transport, "1234");
+    }
+  g_assert (((const gchar *)g_bytes_get_data (msg, NULL))[0] == '{');
+
+  g_object_add_weak_pointer (G_OBJECT (channel), (gpointer *)&channel);
+  g_object_unref (channel);
+  g_assert (channel == NULL);
+
+  g_object_unref (transport);
+}
+
+static void
+test_self_not_internal (void)
+{
+  MockTransport *transport;
+  CockpitMetrics *channel;
+  gchar *problem = NULL;
+  JsonObject *options;
+
+  cockpit_expect_message ("*unknown internal metric*");
+
+  transport = mock_transport_new ();
+  g_signal_connect (transport, "closed", G_CALLBACK (on_transport_closed), NULL);
+  options = json_obj ("{ 'source': 'self', 'metrics': [ { 'name': 'memory.used' } ] }");
+  channel = g_object_new (cockpit_internal_metrics_get_type (),
+                          "transport", transport,
+                          "id", "1234",
+                          "options", options,
+                          NULL);
+  json_object_unref (options);
+  g_signal_connect (channel, "closed", G_CALLBACK (on_close_get_problem), &problem);
+
+  while (problem == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_cmpstr (problem, ==, "not-supported");
+
+  g_object_unref (channel);
+  g_object_unref (transport);
+  g_free (problem);
+}
+
+typedef struct {
+  gint64 stamps[4];
+  gint count;
+  guint id;
+} Ticks;
+
+static void
+on_metronome_tick (gint64 timestamp,
+                   gpointer user_data)
+{
+  Ticks *ticks = user_data;
+
+  g_assert_cmpint (ticks->count, <, G_N_ELEMENTS (ticks->stamps));
+  ticks->stamps[ticks->count++] = timestamp;
+
+  /* Removing itself while being called */
+  if (ticks->count == G_N_ELEMENTS (ticks->stamps))
+    {
+      cockpit_metronome_remove (ticks->id);
+      ticks->id = 0;
+    }
+}
+
+static void
+test_metronome (void)
+{
+  Ticks one = { { 0, }, 0, 0 };
+  Ticks two = { { 0, }, 0, 0 };
+  Ticks slow = { { 0, }, 0, 0 };
+  guint i;
+
+  one.id = cockpit_metronome_add (50, on_metronome_tick, &one);
+  slow.id = cockpit_metronome_add (100, on_metronome_tick, &slow);
+
+  while (one.count < 1)
+    g_main_context_iteration (NULL, TRUE);
+  two.id = cockpit_metronome_add (50, on_metronome_tick, &two);
+
+  while (one.id || two.id)
+    g_main_context_iteration (NULL, TRUE);
+
+  /* Ticks fall on multiples of the interval, and are shared */
+  for (i = 0; i < G_N_ELEMENTS (one.stamps); i++)
+    g_assert_cmpint (one.stamps[i] % 50, ==, 0);
+  for (i = 0; i + 1 < G_N_ELEMENTS (two.stamps); i++)
+    g_assert_cmpint (two.stamps[i], ==, one.stamps[i + 1]);
+
+  /* So harmonic intervals tick together */
+  for (i = 0; i < slow.count; i++)
+    g_assert_cmpint (slow.stamps[i] % 100, ==, 0);
+
+  if (slow.id)
+    cockpit_metronome_remove (slow.id);
+}
+
+static void
+test_binary_format (void)
+{
+  MockTransport *transport;
+  CockpitMetrics *channel;
+  JsonObject *options;
+  JsonObject *meta;
+  GBytes *msg;
+
+  transport = mock_transport_new ();
+  g_signal_connect (transport, "closed", G_CALLBACK (on_transport_closed), NULL);
+  options = json_obj ("{ 'format': 'binary', 'binary': 'raw' }");
+  channel = g_object_new (mock_metrics_get_type (),
+                          "transport", transport,
+                          "id", "1234",
+                          "options", options,
+                          NULL);
+  json_object_unref (options);
+
+  /* Let the channel prepare */
+  while (g_main_context_iteration (NULL, FALSE));
+
+  cockpit_metrics_set_interpolate (channel, FALSE);
+
+  meta = json_obj ("{ 'metrics': [ { 'name': 'foo' },"
+                   "               { 'name': 'bar' }"
+                   "             ],"
+                   "  'interval': 1000"
+                   "}");
+  cockpit_metrics_send_meta (channel, meta, FALSE);
+  json_object_unref (meta);
+
+  msg = mock_transport_pop_channel (transport, "1234");
+  g_assert (msg != NULL);
+  g_assert_cmpint (((const gchar *)g_bytes_get_data (msg, NULL))[0], ==, '{');
+
+  double **buffer = cockpit_metrics_get_data_buffer (channel);
+  buffer[0][0] = 1.0;
+  buffer[1][0] = 2.5;
+  cockpit_metrics_send_data (channel, 0);
+  buffer = cockpit_metrics_get_data_buffer (channel);
+  buffer[0][0] = 1.0;
+  buffer[1][0] = 2.5;
+  cockpit_metrics_send_data (channel, 1000);
+  cockpit_metrics_flush_data (channel);
+
+  /* Two points in time in one message, no compression */
+  msg = mock_transport_pop_channel (transport, "1234");
+  g_assert (msg != NULL);
+  cockpit_assert_bytes_eq (msg, "\0\0\0\0"
+                           "\x00\x00\x80\x3f" "\x00\x00\x20\x40"
+                           "\x00\x00\x80\x3f" "\x00\x00\x20\x40", 20);
+
+  g_object_add_weak_pointer (G_OBJECT (channel), (gpointer *)&channel);
+  g_object_unref (channel);
+  g_assert (channel == NULL);
+
+  g_object_unref (transport);
+}
+
+static void
+send_triggered (CockpitMetrics *channel,
+                gint64 timestamp,
+                double foo,
+                double bar)
+{
+  double **buffer = cockpit_metrics_get_data_buffer (channel);
+  buffer[0][0] = foo;
+  buffer[1][0] = bar;
+  cockpit_metrics_send_data (channel, timestamp);
+  cockpit_metrics_flush_data (channel);
+}
+
+static void
+assert_triggered_meta (MockTransport *transport,
+                       gint64 timestamp)
+{
+  JsonObject *meta;
+  GBytes *msg;
+
+  msg = mock_transport_pop_channel (transport, "1234");
+  g_assert (msg != NULL);
+  meta = cockpit_json_parse_bytes (msg, NULL);
+  g_assert (meta != NULL);
+  g_assert_cmpint (json_object_get_int_member (meta, "timestamp"), ==, timestamp);
+  json_object_unref (meta);
+}
+
+static void
+test_triggered (void)
+{
+  MockTransport *transport;
+  CockpitMetrics *channel;
+  JsonObject *options;
+  JsonObject *meta;
+  GBytes *msg;
+
+  transport = mock_transport_new ();
+  g_signal_connect (transport, "closed", G_CALLBACK (on_transport_closed), NULL);
+  options = json_obj ("{ 'deliver': 'triggered', 'heartbeat': 3000,"
+                      "  'metrics': [ { 'name': 'foo', 'threshold': 50 },"
+                      "               { 'name': 'bar', 'change': 10 }"
+                      "             ]"
+                      "}");
+  channel = g_object_new (mock_metrics_get_type (),
+                          "transport", transport,
+                          "id", "1234",
+                          "options", options,
+                          NULL);
+  json_object_unref (options);
+
+  /* Let the channel prepare */
+  while (g_main_context_iteration (NULL, FALSE));
+
+  cockpit_metrics_set_interpolate (channel, FALSE);
+
+  meta = json_obj ("{ 'metrics': [ { 'name': 'foo' },"
+                   "               { 'name': 'bar' }"
+                   "             ],"
+                   "  'interval': 1000"
+                   "}");
+  cockpit_metrics_send_meta (channel, meta, FALSE);
+  json_object_unref (meta);
+  msg = mock_transport_pop_channel (transport, "1234");
+  g_assert (msg != NULL);
+
+  /* The first frame is always sent */
+  send_triggered (channel, 0, 10.0, 100.0);
+  msg = mock_transport_pop_channel (transport, "1234");
+  cockpit_assert_bytes_eq (msg, "[[10,100]]", -1);
+
+  /* Below the threshold, and less than the change */
+  send_triggered (channel, 1000, 20.0, 105.0);
+  g_assert (mock_transport_pop_channel (transport, "1234") == NULL);
+
+  /* Crossing the threshold, after a gap */
+  send_triggered (channel, 2000, 60.0, 105.0);
+  assert_triggered_meta (transport, 2000);
+  msg = mock_transport_pop_channel (transport, "1234");
+  cockpit_assert_bytes_eq (msg, "[[60,105]]", -1);
+
+  /* Changed by more than 10 percent, not compressed */
+  send_triggered (channel, 3000, 60.0, 120.0);
+  msg = mock_transport_pop_channel (transport, "1234");
+  cockpit_assert_bytes_eq (msg, "[[60,120]]", -1);
+
+  send_triggered (channel, 4000, 60.0, 120.0);
+  send_triggered (channel, 5000, 60.0, 120.0);
+  g_assert (mock_transport_pop_channel (transport, "1234") == NULL);
+
+  /* The heartbeat */
+  send_triggered (channel, 6000, 60.0, 120.0);
+  assert_triggered_meta (transport, 6000);
+  msg = mock_transport_pop_channel (transport, "1234");
+  cockpit_assert_bytes_eq (msg, "[[60,120]]", -1);
+
+  g_object_add_weak_pointer (G_OBJECT (channel), (gpointer *)&channel);
+  g_object_unref (channel);
+  g_assert (channel == NULL);
+
+  g_object_unref (transport);
+}
+
+static void
+write_ring_row (CockpitMetricsRing *ring,
+                gint64 timestamp,
+                gint n,
+                ...)
+{
+  va_list ap;
+
+  va_start (ap, n);
+  cockpit_metrics_ring_begin_row (ring, timestamp);
+  for (gint i = 0; i < n; i++)
+    cockpit_metrics_ring_set_value (ring, i, va_arg (ap, double));
+  cockpit_metrics_ring_commit_row (ring);
+  va_end (ap);
+}
+
+static void
+test_ring (void)
+{
+  CockpitMetricsRing *writer;
+  CockpitMetricsRing *reader;
+  const gchar *metric;
+  const gchar *instance;
+  GError *error = NULL;
+  guint64 first, end;
+  gchar *directory;
+  gchar *path;
+
+  directory = g_dir_make_tmp ("test-metrics.XXXXXX", &error);
+  g_assert_no_error (error);
+  path = g_build_filename (directory, "ring", NULL);
+
+  writer = cockpit_metrics_ring_create (path, 1000, 3, 2, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (cockpit_metrics_ring_add_column (writer, "memory.used", NULL), ==, 0);
+  g_assert_cmpint (cockpit_metrics_ring_add_column (writer, "memory.used", NULL), ==, 0);
+
+  write_ring_row (writer, 1000, 1, 10.0);
+
+  /* Rows from before a column have no values for it */
+  g_assert_cmpint (cockpit_metrics_ring_add_column (writer, "block.device.read", "sda"), ==, 1);
+  g_assert_cmpint (cockpit_metrics_ring_add_column (writer, "block.device.read", "sdb"), ==, -1);
+  write_ring_row (writer, 2000, 2, 20.0, 200.0);
+  write_ring_row (writer, 3000, 2, 30.0, 300.0);
+
+  reader = cockpit_metrics_ring_open (path, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (cockpit_metrics_ring_get_interval (reader), ==, 1000);
+  g_assert_cmpint (cockpit_metrics_ring_get_n_columns (reader), ==, 2);
+  cockpit_metrics_ring_get_column (reader, 1, &metric, &instance);
+  g_assert_cmpstr (metric, ==, "block.device.read");
+  g_assert_cmpstr (instance, ==, "sda");
+
+  cockpit_metrics_ring_get_rows (reader, &first, &end);
+  g_assert_cmpuint (first, ==, 0);
+  g_assert_cmpuint (end, ==, 3);
+  g_assert (isnan (cockpit_metrics_ring_get_value (reader, 0, 1)));
+  g_assert_cmpfloat (cockpit_metrics_ring_get_value (reader, 2, 1), ==, 300.0);
+
+  /* The oldest row goes first, readers see it straight away */
+  write_ring_row (writer, 4000, 2, 40.0, 400.0);
+  cockpit_metrics_ring_get_rows (reader, &first, &end);
+  g_assert_cmpuint (first, ==, 1);
+  g_assert_cmpuint (end, ==, 4);
+  g_assert_cmpint (cockpit_metrics_ring_get_timestamp (reader, 0), ==, 0);
+  g_assert_cmpint (cockpit_metrics_ring_get_timestamp (reader, 3), ==, 4000);
+  g_assert_cmpfloat (cockpit_metrics_ring_get_value (reader, 3, 0), ==, 40.0);
+
+  g_assert_cmpuint (cockpit_metrics_ring_seek (reader, 0), ==, 1);
+  g_assert_cmpuint (cockpit_metrics_ring_seek (reader, 2500), ==, 2);
+  g_assert_cmpuint (cockpit_metrics_ring_seek (reader, 3000), ==, 2);
+  g_assert_cmpuint (cockpit_metrics_ring_seek (reader, 5000), ==, 4);
+
+  /* Only one writer at a time */
+  g_assert (cockpit_metrics_ring_create (path, 1000, 3, 2, &error) == NULL);
+  g_assert (error != NULL);
+  g_clear_error (&error);
+
+  /* And a new one carries on where the old one stopped */
+  cockpit_metrics_ring_free (writer);
+  writer = cockpit_metrics_ring_create (path, 1000, 3, 2, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (cockpit_metrics_ring_add_column (writer, "block.device.read", "sda"), ==, 1);
+  write_ring_row (writer, 5000, 2, 50.0, 500.0);
+  cockpit_metrics_ring_get_rows (reader, &first, &end);
+  g_assert_cmpuint (end, ==, 5);
+  cockpit_metrics_ring_free (writer);
+
+  /* A new layout replaces the file, the old reader keeps what it had */
+  writer = cockpit_metrics_ring_create (path, 2000, 10, 4, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (cockpit_metrics_ring_add_column (writer, "memory.used", NULL), ==, 0);
+  write_ring_row (writer, 6000, 1, 60.0);
+
+  cockpit_metrics_ring_get_rows (reader, &first, &end);
+  g_assert_cmpuint (end, ==, 5);
+  g_assert_cmpint (cockpit_metrics_ring_get_interval (reader), ==, 1000);
+  g_assert_cmpfloat (cockpit_metrics_ring_get_value (reader, 4, 1), ==, 500.0);
+  cockpit_metrics_ring_free (reader);
+
+  reader = cockpit_metrics_ring_open (path, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (cockpit_metrics_ring_get_interval (reader), ==, 2000);
+  cockpit_metrics_ring_get_rows (reader, &first, &end);
+  g_assert_cmpuint (first, ==, 0);
+  g_assert_cmpuint (end, ==, 1);
+  g_assert_cmpfloat (cockpit_metrics_ring_get_value (reader, 0, 0), ==, 60.0);
+
+  cockpit_metrics_ring_free (writer);
+  cockpit_metrics_ring_free (reader);
+
+  g_unlink (path);
+  g_rmdir (directory);
+  g_free (directory);
+  g_free (path);
+}
+
+static GBytes *
+pop_history (MockTransport *transport)
+{
+  GBytes *msg;
+  while ((msg = mock_transport_pop_channel (transport, "1234")) == NULL)
+    g_main_context_iteration (NULL, TRUE);
+  return msg;
+}
+
+static void
+assert_history_data (MockTransport *transport,
+                     const gchar *json)
+{
+  GError *error = NULL;
+  JsonNode *node;
+  GBytes *msg;
+
+  msg = pop_history (transport);
+  node = cockpit_json_parse (g_bytes_get_data (msg, NULL), g_bytes_get_size (msg), &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (json_node_get_node_type (node), ==, JSON_NODE_ARRAY);
+  cockpit_assert_json_eq (json_node_get_array (node), json);
+  json_node_free (node);
+}
+
+static void
+test_history (void)
+{
+  const gchar *original = cockpit_internal_metrics_ring_file;
+  CockpitMetricsRing *ring;
+  MockTransport *transport;
+  CockpitMetrics *channel;
+  JsonObject *options;
+  JsonObject *meta;
+  GError *error = NULL;
+  gchar *problem = NULL;
+  gchar *directory;
+  gchar *path;
+
+  directory = g_dir_make_tmp ("test-metrics.XXXXXX", &error);
+  g_assert_no_error (error);
+  path = g_build_filename (directory, "ring", NULL);
+
+  ring = cockpit_metrics_ring_create (path, 1000, 10, 4, &error);
+  g_assert_no_error (error);
+  cockpit_metrics_ring_add_column (ring, "memory.used", NULL);
+  cockpit_metrics_ring_add_column (ring, "block.device.read", "sda");
+  write_ring_row (ring, 1000, 2, 10.0, 100.0);
+  write_ring_row (ring, 2000, 2, 20.0, 200.0);
+  write_ring_row (ring, 3000, 2, 30.0, 300.0);
+  write_ring_row (ring, 9000, 2, 90.0, 900.0);
+  cockpit_internal_metrics_ring_file = path;
+
+  transport = mock_transport_new ();
+  g_signal_connect (transport, "closed", G_CALLBACK (on_transport_closed), NULL);
+  options = json_obj ("{ 'source': 'history',"
+                      "  'metrics': [ { 'name': 'memory.used' },"
+                      "               { 'name': 'block.device.read' } ],"
+                      "  'timestamp': 1500,"
+                      "  'interval': 1000"
+                      "}");
+  channel = g_object_new (cockpit_internal_metrics_get_type (),
+                          "transport", transport,
+                          "id", "1234",
+                          "options", options,
+                          NULL);
+  json_object_unref (options);
+  g_signal_connect (channel, "closed", G_CALLBACK (on_close_get_problem), &problem);
+
+  meta = cockpit_json_parse_bytes (pop_history (transport), NULL);
+  g_assert (meta != NULL);
+  g_assert_cmpint (json_object_get_int_member (meta, "timestamp"), ==, 2000);
+  g_assert_cmpint (json_object_get_int_member (meta, "interval"), ==, 1000);
+  json_object_unref (meta);
+  assert_history_data (transport, "[[20,[200]],[30,[300]]]");
+
+  /* Nothing recorded for a while, so a new meta */
+  meta = cockpit_json_parse_bytes (pop_history (transport), NULL);
+  g_assert (meta != NULL);
+  g_assert_cmpint (json_object_get_int_member (meta, "timestamp"), ==, 9000);
+  json_object_unref (meta);
+  assert_history_data (transport, "[[90,[900]]]");
+
+  while (problem == NULL)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_cmpstr (problem, ==, "");
+  g_free (problem);
+  problem = NULL;
+
+  g_object_add_weak_pointer (G_OBJECT (channel), (gpointer *)&channel);
+  g_object_unref (channel);
+  g_assert (channel == NULL);
+
+  /* Without a file there's no history */
+  cockpit_metrics_ring_free (ring);
+  g_unlink (path);
+
+  cockpit_expect_message ("*couldn't read metrics history*");
+  options = json_obj ("{ 'source': 'history',"
+                      "  'metrics': [ { 'name': 'memory.used' } ]"
+                      "}");
+  channel = g_object_new (cockpit_internal_metrics_get_type (),
+                          "transport", transport,
+                          "id", "1234",
+                          "options", options,
+                          NULL);
+  json_object_unref (options);
+  g_signal_connect (channel, "closed", G_CALLBACK (on_close_get_problem), &problem);
+
+  while (problem == NULL)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_cmpstr (problem, ==, "not-found");
+  g_free (problem);
+
+  g_object_add_weak_pointer (G_OBJECT (channel), (gpointer *)&channel);
+  g_object_unref (channel);
+  g_assert (channel == NULL);
+
+  g_object_unref (transport);
+
+  cockpit_internal_metrics_ring_file = original;
+  g_rmdir (directory);
+  g_free (directory);
+  g_free (path);
+}
+
 int
 main (int argc,
       char *argv[])
@@ -613,7 +1794,21 @@ main (int argc,
   g_test_add ("/metrics/dynamic-instances", TestCase, NULL,
               setup, test_dynamic_instances, teardown);
 
+  g_test_add_func ("/metrics/instance-filter", test_instance_filter);
+  g_test_add_func ("/metrics/cgroup-unified-stat", test_cgroup_unified_stat);
+  g_test_add_func ("/metrics/cgroup-unified-rewalk", test_cgroup_unified_rewalk);
+  g_test_add_func ("/metrics/cgroup-unified-fd-budget", test_cgroup_unified_fd_budget);
   g_test_add_func ("/metrics/not-supported", test_not_supported);
+  g_test_add_func ("/metrics/binary-format", test_binary_format);
+  g_test_add_func ("/metrics/triggered", test_triggered);
+  g_test_add_func ("/metrics/metronome", test_metronome);
+  g_test_add_func ("/metrics/self-source", test_self_source);
+  g_test_add_func ("/metrics/self-twice", test_self_twice);
+  g_test_add_func ("/metrics/self-join-hub", test_self_join_hub);
+  g_test_add_func ("/metrics/pause", test_pause);
+  g_test_add_func ("/metrics/self-not-internal", test_self_not_internal);
+  g_test_add_func ("/metrics/ring", test_ring);
+  g_test_add_func ("/metrics/history", test_history);
 
   return g_test_run ();
 }
@@ -27,12 +27,17 @@
 
 #include "common/cockpitjson.h"
 #include "common/cockpittest.h"
+#include "common/cockpitwebresponse.h"
 
+#include <glib/gstdio.h>
 #include <string.h>
 
 extern const gchar **cockpit_bridge_data_dirs;
 extern const gchar *cockpit_bridge_local_address;
 extern gint cockpit_bridge_packages_port;
+extern const gchar *cockpit_bridge_packages_index;
+
+static gchar *cache_home;
 
 typedef struct {
   CockpitPackages *packages;
@@ -47,6 +52,7 @@ typedef struct {
   const gchar *path;
   const gchar *accept[8];
   const gchar *expect;
+  const gchar *encoding;
   gboolean cacheable;
 } Fixture;
 
@@ -69,30 +75,18 @@ on_transport_closed (CockpitTransport *transport,
   g_assert_not_reached ();
 }
 
-static void
-setup (TestCase *tc,
-       gconstpointer data)
+static CockpitChannel *
+start_request (TestCase *tc,
+               const Fixture *fixture,
+               const gchar *id)
 {
-  const Fixture *fixture = data;
+  CockpitChannel *channel;
   JsonObject *options;
   JsonObject *headers;
-  const gchar *control;
+  gchar *control;
   gchar *accept;
   GBytes *bytes;
 
-  g_assert (fixture != NULL);
-
-  if (fixture->expect)
-    cockpit_expect_warning (fixture->expect);
-
-  if (fixture->datadirs[0])
-    cockpit_bridge_data_dirs = (const gchar **)fixture->datadirs;
-
-  tc->packages = cockpit_packages_new ();
-
-  tc->transport = mock_transport_new ();
-  g_signal_connect (tc->transport, "closed", G_CALLBACK (on_transport_closed), NULL);
-
   options = json_object_new ();
   json_object_set_int_member (options, "port", cockpit_bridge_packages_port);
   json_object_set_string_member (options, "payload", "http-stream1");
@@ -108,23 +102,52 @@ setup (TestCase *tc,
     }
   if (!fixture->cacheable)
     json_object_set_string_member (headers, "Pragma", "no-cache");
+  if (fixture->encoding)
+    {
+      /* Only passed on by binary streams, like cockpit-ws does */
+      json_object_set_string_member (headers, "Accept-Encoding", fixture->encoding);
+      json_object_set_string_member (options, "binary", "raw");
+    }
   json_object_set_object_member (options, "headers", headers);
 
-  tc->channel = g_object_new (COCKPIT_TYPE_HTTP_STREAM,
-                              "transport", tc->transport,
-                              "id", "444",
-                              "options", options,
-                              NULL);
+  channel = g_object_new (COCKPIT_TYPE_HTTP_STREAM,
+                          "transport", tc->transport,
+                          "id", id,
+                          "options", options,
+                          NULL);
 
   json_object_unref (options);
 
   /* Tell HTTP we have no more data to send */
-  control = "{\"command\": \"done\", \"channel\": \"444\"}";
-  bytes = g_bytes_new_static (control, strlen (control));
+  control = g_strdup_printf ("{\"command\": \"done\", \"channel\": \"%s\"}", id);
+  bytes = g_bytes_new_take (control, strlen (control));
   cockpit_transport_emit_recv (COCKPIT_TRANSPORT (tc->transport), NULL, bytes);
   g_bytes_unref (bytes);
 
-  g_signal_connect (tc->channel, "closed", G_CALLBACK (on_channel_close), tc);
+  g_signal_connect (channel, "closed", G_CALLBACK (on_channel_close), tc);
+  return channel;
+}
+
+static void
+setup (TestCase *tc,
+       gconstpointer data)
+{
+  const Fixture *fixture = data;
+
+  g_assert (fixture != NULL);
+
+  if (fixture->expect)
+    cockpit_expect_warning (fixture->expect);
+
+  if (fixture->datadirs[0])
+    cockpit_bridge_data_dirs = (const gchar **)fixture->datadirs;
+
+  tc->packages = cockpit_packages_new ();
+
+  tc->transport = mock_transport_new ();
+  g_signal_connect (tc->transport, "closed", G_CALLBACK (on_transport_closed), NULL);
+
+  tc->channel = start_request (tc, fixture, "444");
 }
 
 static void
@@ -170,6 +193,45 @@ test_simple (TestCase *tc,
   g_bytes_unref (data);
 }
 
+static const Fixture fixture_repeat = {
+  .datadirs = { SRCDIR "/src/bridge/mock-resource/system", NULL },
+  .path = "/test/sub/file.ext",
+  .cacheable = TRUE,
+};
+
+static void
+test_repeat (TestCase *tc,
+             gconstpointer fixture)
+{
+  CockpitChannel *channel;
+  GBytes *first;
+  GBytes *second;
+  guint count;
+
+  g_assert (cockpit_packages_get_checksum (tc->packages) != NULL);
+
+  while (tc->closed == FALSE)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_cmpstr (tc->problem, ==, NULL);
+  first = mock_transport_combine_output (tc->transport, "444", &count);
+  g_assert_cmpuint (count, ==, 2);
+
+  /* The second time the resource comes from memory, with the same result */
+  tc->closed = FALSE;
+  channel = start_request (tc, fixture, "445");
+  while (tc->closed == FALSE)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_cmpstr (tc->problem, ==, NULL);
+  second = mock_transport_combine_output (tc->transport, "445", &count);
+  g_assert_cmpuint (count, ==, 2);
+
+  g_assert (g_bytes_equal (first, second));
+
+  g_bytes_unref (first);
+  g_bytes_unref (second);
+  g_object_unref (channel);
+}
+
 static const Fixture fixture_pig = {
   .path = "/another/test.html",
   .accept = { "pig" },
@@ -303,6 +365,74 @@ test_listing (TestCase *tc,
   json_node_free (node);
 }
 
+static const Fixture fixture_listing_gzip = {
+  .path = "/manifests.json",
+  .encoding = "gzip, deflate",
+};
+
+static void
+test_listing_gzip (TestCase *tc,
+                   gconstpointer fixture)
+{
+  CockpitChannel *second;
+  JsonObject *object;
+  GError *error = NULL;
+  GBytes *message;
+  GBytes *compressed;
+  GBytes *bytes;
+
+  g_assert (fixture == &fixture_listing_gzip);
+
+  while (tc->closed == FALSE)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_cmpstr (tc->problem, ==, NULL);
+
+  message = mock_transport_pop_channel (tc->transport, "444");
+  object = cockpit_json_parse_bytes (message, &error);
+  g_assert_no_error (error);
+  cockpit_assert_json_eq (object,
+                          "{\"status\":200,\"reason\":\"OK\",\"headers\":{\"Cache-Control\":\"no-cache, no-store\","
+                          "\"Content-Type\":\"application/json\",\"Content-Encoding\":\"gzip\",\"Vary\":\"Accept-Encoding\"}}");
+  json_object_unref (object);
+
+  compressed = mock_transport_combine_output (tc->transport, "444", NULL);
+  bytes = cockpit_web_response_gunzip (compressed, &error);
+  g_assert_no_error (error);
+
+  object = cockpit_json_parse_bytes (bytes, &error);
+  g_assert_no_error (error);
+  cockpit_assert_json_eq (object,
+                          "{"
+                          " \"another\": {"
+                          "  \"name\" : \"another\","
+                          "  \"description\" : \"another\""
+                          " },"
+                          " \"second\": {"
+                          "  \"description\": \"second dummy description\""
+                          " },"
+                          " \"test\": {"
+                          "   \"description\" : \"dummy\""
+                          " }"
+                          "}");
+  json_object_unref (object);
+  g_bytes_unref (bytes);
+
+  /* The second request gets the same compressed bytes */
+  tc->closed = FALSE;
+  second = start_request (tc, fixture, "555");
+  while (tc->closed == FALSE)
+    g_main_context_iteration (NULL, TRUE);
+
+  message = mock_transport_pop_channel (tc->transport, "555");
+  g_assert (message != NULL);
+  bytes = mock_transport_combine_output (tc->transport, "555", NULL);
+  g_assert (g_bytes_equal (bytes, compressed));
+  g_bytes_unref (bytes);
+  g_bytes_unref (compressed);
+
+  g_object_unref (second);
+}
+
 static const Fixture fixture_not_found = {
   .path = "/test/sub/not-found",
 };
@@ -536,19 +666,119 @@ test_resolve_not_found (TestCase *tc,
   g_assert (path == NULL);
 }
 
+static void
+test_checksum_cache (void)
+{
+  const gchar *datadirs[] = { SRCDIR "/src/bridge/mock-resource/system", NULL };
+  CockpitPackages *packages;
+  gchar *checksum;
+  gchar *cache;
+
+  cockpit_bridge_data_dirs = datadirs;
+
+  /* The second time round the digests come from the cache */
+  packages = cockpit_packages_new ();
+  checksum = g_strdup (cockpit_packages_get_checksum (packages));
+  g_assert (checksum != NULL);
+  cockpit_packages_free (packages);
+
+  cache = g_build_filename (g_get_user_cache_dir (), "cockpit", "package-digests", NULL);
+  g_assert (g_file_test (cache, G_FILE_TEST_IS_REGULAR));
+
+  packages = cockpit_packages_new ();
+  g_assert_cmpstr (cockpit_packages_get_checksum (packages), ==, checksum);
+  cockpit_packages_free (packages);
+
+  /* And a broken cache is ignored */
+  g_assert (g_file_set_contents (cache, "garbage\n\tmore\tgarbage\n", -1, NULL));
+  packages = cockpit_packages_new ();
+  g_assert_cmpstr (cockpit_packages_get_checksum (packages), ==, checksum);
+  cockpit_packages_free (packages);
+
+  cockpit_bridge_data_dirs = NULL;
+  g_free (checksum);
+  g_free (cache);
+}
+
+static void
+test_index (void)
+{
+  const gchar *datadirs[] = { SRCDIR "/src/bridge/mock-resource/system", NULL };
+  const gchar *otherdirs[] = { SRCDIR "/src/bridge/mock-resource/system", SRCDIR "/src/bridge/mock-resource/nonexistent", NULL };
+  CockpitPackages *packages;
+  GError *error = NULL;
+  JsonObject *index;
+  gchar *checksum;
+  gchar *contents;
+  gchar *path;
+  gsize length;
+
+  cockpit_bridge_data_dirs = datadirs;
+
+  packages = cockpit_packages_new ();
+  checksum = g_strdup (cockpit_packages_get_checksum (packages));
+  g_assert (checksum != NULL);
+  cockpit_packages_free (packages);
+
+  g_assert (cockpit_packages_write_index (&error));
+  g_assert_no_error (error);
+
+  /* Mark the index, to be sure it's what the listing comes from */
+  g_assert (g_file_get_contents (cockpit_bridge_packages_index, &contents, &length, NULL));
+  index = cockpit_json_parse_object (contents, length, &error);
+  g_assert_no_error (error);
+  g_free (contents);
+  g_assert_cmpstr (json_object_get_string_member (index, "checksum"), ==, checksum);
+  json_object_set_string_member (index, "checksum", "marked");
+  contents = cockpit_json_write_object (index, &length);
+  g_assert (g_file_set_contents (cockpit_bridge_packages_index, contents, length, NULL));
+  json_object_unref (index);
+  g_free (contents);
+
+  packages = cockpit_packages_new ();
+  g_assert_cmpstr (cockpit_packages_get_checksum (packages), ==, "marked");
+  path = cockpit_packages_resolve (packages, "test", "/sub/file.ext", NULL);
+  g_assert_cmpstr (SRCDIR "/src/bridge/mock-resource/system/cockpit/test/sub/file.ext", ==, path);
+  g_free (path);
+  cockpit_packages_free (packages);
+
+  /* Not used for other directories */
+  cockpit_bridge_data_dirs = otherdirs;
+  packages = cockpit_packages_new ();
+  g_assert_cmpstr (cockpit_packages_get_checksum (packages), !=, "marked");
+  cockpit_packages_free (packages);
+
+  cockpit_bridge_data_dirs = NULL;
+  g_unlink (cockpit_bridge_packages_index);
+  g_free (checksum);
+}
+
 int
 main (int argc,
       char *argv[])
 {
+  gchar *index;
+  gchar *path;
+  gint ret;
+
   g_setenv ("XDG_DATA_DIRS", SRCDIR "/src/bridge/mock-resource/system", TRUE);
   g_setenv ("XDG_DATA_HOME", SRCDIR "/src/bridge/mock-resource/home", TRUE);
 
+  /* Don't touch the real package digest cache */
+  cache_home = g_dir_make_tmp ("test-packages-XXXXXX", NULL);
+  g_assert (cache_home != NULL);
+  g_setenv ("XDG_CACHE_HOME", cache_home, TRUE);
+  index = g_build_filename (cache_home, "packages-index.json", NULL);
+  cockpit_bridge_packages_index = index;
+
   cockpit_bridge_local_address = "127.0.0.1";
 
   cockpit_test_init (&argc, &argv);
 
   g_test_add ("/packages/simple", TestCase, &fixture_simple,
               setup, test_simple, teardown);
+  g_test_add ("/packages/repeat", TestCase, &fixture_repeat,
+              setup, test_repeat, teardown);
   g_test_add ("/packages/localized-translated", TestCase, &fixture_pig,
               setup, test_localized_translated, teardown);
   g_test_add ("/packages/localized-unknown", TestCase, &fixture_unknown,
@@ -557,6 +787,8 @@ main (int argc,
               setup, test_large, teardown);
   g_test_add ("/packages/listing", TestCase, &fixture_listing,
               setup, test_listing, teardown);
+  g_test_add ("/packages/listing-gzip", TestCase, &fixture_listing_gzip,
+              setup, test_listing_gzip, teardown);
   g_test_add ("/packages/not-found", TestCase, &fixture_not_found,
               setup, test_not_found, teardown);
   g_test_add ("/packages/unknown-package", TestCase, &fixture_unknown_package,
@@ -587,5 +819,21 @@ main (int argc,
   g_test_add ("/packages/resolve/not-found", TestCase, NULL,
               setup_basic, test_resolve_not_found, teardown_basic);
 
-  return g_test_run ();
+  g_test_add_func ("/packages/checksum-cache", test_checksum_cache);
+  g_test_add_func ("/packages/index", test_index);
+
+  ret = g_test_run ();
+
+  path = g_build_filename (cache_home, "cockpit", "package-digests", NULL);
+  g_unlink (path);
+  g_free (path);
+  path = g_build_filename (cache_home, "cockpit", NULL);
+  g_rmdir (path);
+  g_free (path);
+  g_unlink (index);
+  g_free (index);
+  g_rmdir (cache_home);
+  g_free (cache_home);
+
+  return ret;
 }
@@ -69,6 +69,27 @@ init_mock_archives (void)
   g_assert (pmiPutValue ("mock.late", NULL, "32") >= 0);
   g_assert (pmiWrite (5, 0) >= 0);
   g_assert (pmiEnd () >= 0);
+
+  /* A counter that goes up by 10 a second, with one spike of 100 */
+  g_assert (system ("rm -rf mock-counter-archive && mkdir mock-counter-archive") == 0);
+
+  g_assert (pmiStart ("mock-counter-archive/0", 0) >= 0);
+  g_assert (pmiAddMetric ("mock.counter", PM_ID_NULL,
+                          PM_TYPE_U32, PM_INDOM_NULL, PM_SEM_COUNTER,
+                          pmiUnits (0, 0, 0, 0, 0, 0)) >= 0);
+  g_assert (pmiPutValue ("mock.counter", NULL, "0") >= 0);
+  g_assert (pmiWrite (0, 0) >= 0);
+  g_assert (pmiPutValue ("mock.counter", NULL, "10") >= 0);
+  g_assert (pmiWrite (1, 0) >= 0);
+  g_assert (pmiPutValue ("mock.counter", NULL, "20") >= 0);
+  g_assert (pmiWrite (2, 0) >= 0);
+  g_assert (pmiPutValue ("mock.counter", NULL, "30") >= 0);
+  g_assert (pmiWrite (3, 0) >= 0);
+  g_assert (pmiPutValue ("mock.counter", NULL, "130") >= 0);
+  g_assert (pmiWrite (4, 0) >= 0);
+  g_assert (pmiPutValue ("mock.counter", NULL, "140") >= 0);
+  g_assert (pmiWrite (5, 0) >= 0);
+  g_assert (pmiEnd () >= 0);
 }
 
 typedef struct AtTeardown {
@@ -356,6 +377,37 @@ test_metrics_archive_directory_late_metric (TestCase *tc,
   json_object_unref (options);
 }
 
+static void
+test_metrics_archive_aggregate_rate (TestCase *tc,
+                                     gconstpointer data)
+{
+  const gchar *aggregate = data;
+  JsonObject *meta;
+  JsonObject *options = json_obj("{ 'source': '" BUILDDIR "/mock-counter-archive/0',"
+                                 "  'metrics': [ { 'name': 'mock.counter', 'derive': 'rate' } ],"
+                                 "  'interval': 3000,"
+                                 "  'resolution': 1000"
+                                 "}");
+
+  json_object_set_string_member (options, "aggregate", aggregate);
+  setup_metrics_channel_json (tc, options);
+
+  /* Values are already derived, so the meta has no "derive" */
+  meta = recv_json_object (tc);
+  cockpit_assert_json_eq (json_object_get_array_member (meta, "metrics"),
+                          "[ { 'name': 'mock.counter', 'units': '', 'semantics': 'counter' } ]");
+
+  /* The second interval has rates of 10, 100 and 10 */
+  if (g_str_equal (aggregate, "max"))
+    assert_sample (tc, "[[10],[100]]");
+  else if (g_str_equal (aggregate, "min"))
+    assert_sample (tc, "[[10],[10]]");
+  else
+    assert_sample (tc, "[[10],[40]]");
+
+  json_object_unref (options);
+}
+
 int
 main (int argc,
       char *argv[])
@@ -379,6 +431,12 @@ main (int argc,
               setup, test_metrics_archive_directory_timestamp, teardown);
   g_test_add ("/metrics/archive-directory-late-metric", TestCase, NULL,
               setup, test_metrics_archive_directory_late_metric, teardown);
+  g_test_add ("/metrics/archive-aggregate-rate/max", TestCase, "max",
+              setup, test_metrics_archive_aggregate_rate, teardown);
+  g_test_add ("/metrics/archive-aggregate-rate/min", TestCase, "min",
+              setup, test_metrics_archive_aggregate_rate, teardown);
+  g_test_add ("/metrics/archive-aggregate-rate/avg", TestCase, "avg",
+              setup, test_metrics_archive_aggregate_rate, teardown);
 
   return g_test_run ();
 }
@@ -21,6 +21,7 @@
 #include "config.h"
 
 #include "cockpitpipechannel.h"
+#include "cockpitspawnpool.h"
 
 #include "mock-transport.h"
 
@@ -32,6 +33,7 @@
 #include <glib/gstdio.h>
 #include <gio/gunixsocketaddress.h>
 
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <errno.h>
 #include <string.h>
@@ -246,6 +248,28 @@ test_echo (TestCase *tc,
   g_bytes_unref (payload);
 }
 
+static void
+test_echo_pause_utf8 (TestCase *tc,
+                      gconstpointer unused)
+{
+  GBytes *payload;
+  GBytes *sent = NULL;
+
+  /* The stream stops in the middle of a character */
+  payload = g_bytes_new_static ("caf\303", 4);
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (tc->transport), "548", payload);
+  g_bytes_unref (payload);
+
+  while ((sent = mock_transport_pop_channel (tc->transport, "548")) == NULL)
+    g_main_context_iteration (NULL, TRUE);
+  cockpit_assert_bytes_eq (sent, "caf", 3);
+
+  /* The held back byte doesn't wait for more forever */
+  while ((sent = mock_transport_pop_channel (tc->transport, "548")) == NULL)
+    g_main_context_iteration (NULL, TRUE);
+  cockpit_assert_bytes_eq (sent, "\357\277\275", 3);
+}
+
 static void
 test_shutdown (TestCase *tc,
                gconstpointer unused)
@@ -445,6 +469,104 @@ test_spawn_environ (void)
   g_object_unref (transport);
 }
 
+static void
+test_spawn_nice (void)
+{
+  MockTransport *transport;
+  CockpitChannel *channel;
+  gchar *problem = NULL;
+  JsonObject *options;
+  JsonArray *array;
+  GString *string;
+  gconstpointer data;
+  gchar *expected;
+  gsize len;
+  GBytes *sent;
+
+  transport = g_object_new (mock_transport_get_type (), NULL);
+
+  options = json_object_new ();
+
+  array = json_array_new ();
+  json_array_add_string_element (array, "/bin/sh");
+  json_array_add_string_element (array, "-c");
+  json_array_add_string_element (array, "nice");
+  json_object_set_array_member (options, "spawn", array);
+  json_object_set_int_member (options, "nice", 5);
+  json_object_set_string_member (options, "payload", "stream");
+
+  channel = g_object_new (COCKPIT_TYPE_PIPE_CHANNEL,
+                          "options", options,
+                          "id", "548",
+                          "transport", transport,
+                          NULL);
+  g_signal_connect (channel, "closed", G_CALLBACK (on_closed_get_problem), &problem);
+  json_object_unref (options);
+
+  string = g_string_new ("");
+  while (!problem)
+    {
+      g_main_context_iteration (NULL, TRUE);
+      sent = mock_transport_pop_channel (transport, "548");
+      if (sent)
+        {
+          data = g_bytes_get_data (sent, &len);
+          g_string_append_len (string, data, len);
+        }
+    }
+
+  g_assert_cmpstr (problem, ==, "");
+  g_free (problem);
+
+  expected = g_strdup_printf ("%d\n", MIN (getpriority (PRIO_PROCESS, 0) + 5, 19));
+  g_assert_cmpstr (string->str, ==, expected);
+  g_string_free (string, TRUE);
+  g_free (expected);
+
+  g_object_unref (channel);
+  g_object_unref (transport);
+}
+
+static void
+test_spawn_invalid_nice (void)
+{
+  MockTransport *transport;
+  CockpitChannel *channel;
+  gchar *problem = NULL;
+  JsonObject *options;
+  JsonArray *array;
+
+  cockpit_expect_warning ("*invalid \"ionice\" option*");
+
+  transport = g_object_new (mock_transport_get_type (), NULL);
+
+  options = json_object_new ();
+  array = json_array_new ();
+  json_array_add_string_element (array, "true");
+  json_object_set_array_member (options, "spawn", array);
+  json_object_set_string_member (options, "ionice", "realtime");
+  json_object_set_string_member (options, "payload", "stream");
+
+  channel = g_object_new (COCKPIT_TYPE_PIPE_CHANNEL,
+                          "options", options,
+                          "id", "548",
+                          "transport", transport,
+                          NULL);
+  g_signal_connect (channel, "closed", G_CALLBACK (on_closed_get_problem), &problem);
+  json_object_unref (options);
+
+  while (!problem)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_cmpstr (problem, ==, "protocol-error");
+  g_free (problem);
+
+  g_object_unref (channel);
+  g_object_unref (transport);
+
+  cockpit_assert_expected ();
+}
+
 static void
 test_spawn_status (void)
 {
@@ -710,6 +832,322 @@ test_fail_access_denied (void)
   cockpit_assert_expected ();
 }
 
+static void
+test_spawn_pty_coalesce (void)
+{
+  MockTransport *transport;
+  CockpitChannel *channel;
+  gchar *problem = NULL;
+  JsonObject *options;
+  JsonArray *array;
+  GPtrArray *messages;
+  GBytes *sent;
+  gconstpointer data;
+  gsize len;
+
+  transport = g_object_new (mock_transport_get_type (), NULL);
+
+  options = json_object_new ();
+  array = json_array_new ();
+  json_array_add_string_element (array, "/bin/sh");
+  json_array_add_string_element (array, "-c");
+  json_array_add_string_element (array, "echo one; sleep 0.2; echo two; sleep 0.2; echo three");
+  json_object_set_array_member (options, "spawn", array);
+  json_object_set_string_member (options, "payload", "stream");
+  json_object_set_boolean_member (options, "pty", TRUE);
+  json_object_set_int_member (options, "coalesce", 2000);
+
+  channel = g_object_new (COCKPIT_TYPE_PIPE_CHANNEL,
+                          "options", options,
+                          "id", "548",
+                          "transport", transport,
+                          NULL);
+  g_signal_connect (channel, "closed", G_CALLBACK (on_closed_get_problem), &problem);
+  json_object_unref (options);
+
+  messages = g_ptr_array_new_with_free_func (g_free);
+  while (!problem)
+    {
+      g_main_context_iteration (NULL, TRUE);
+      sent = mock_transport_pop_channel (transport, "548");
+      if (sent)
+        {
+          data = g_bytes_get_data (sent, &len);
+          g_ptr_array_add (messages, g_strndup (data, len));
+        }
+    }
+
+  /* The first output goes right away, the rest is held back together */
+  g_assert_cmpuint (messages->len, ==, 2);
+  g_assert_cmpstr (messages->pdata[0], ==, "one\r\n");
+  g_assert_cmpstr (messages->pdata[1], ==, "two\r\nthree\r\n");
+  g_ptr_array_free (messages, TRUE);
+
+  g_assert_cmpstr (problem, ==, "");
+  g_object_unref (channel);
+
+  g_free (problem);
+  g_object_unref (transport);
+}
+
+static void
+test_spawn_hidden (void)
+{
+  MockTransport *transport;
+  CockpitChannel *channel;
+  gchar *problem = NULL;
+  JsonObject *options;
+  JsonArray *array;
+  JsonObject *control;
+
+  transport = g_object_new (mock_transport_get_type (), NULL);
+
+  options = json_object_new ();
+  array = json_array_new ();
+  json_array_add_string_element (array, "/bin/sh");
+  json_array_add_string_element (array, "-c");
+  json_array_add_string_element (array, "echo hidden; exit 3");
+  json_object_set_array_member (options, "spawn", array);
+  json_object_set_string_member (options, "payload", "stream");
+  json_object_set_boolean_member (options, "visible", FALSE);
+
+  channel = g_object_new (COCKPIT_TYPE_PIPE_CHANNEL,
+                          "options", options,
+                          "id", "548",
+                          "transport", transport,
+                          NULL);
+  g_signal_connect (channel, "closed", G_CALLBACK (on_closed_get_problem), &problem);
+  json_object_unref (options);
+
+  while (!problem)
+    g_main_context_iteration (NULL, TRUE);
+
+  /* Output was dropped, but the process ran to its end */
+  g_assert (mock_transport_pop_channel (transport, "548") == NULL);
+  control = mock_transport_pop_control (transport);
+  expect_control_message (control, "ready", "548", NULL);
+  control = mock_transport_pop_control (transport);
+  expect_control_message (control, "done", "548", NULL);
+  control = mock_transport_pop_control (transport);
+  expect_control_message (control, "close", "548", "problem", NULL, NULL);
+  g_assert_cmpint (json_object_get_int_member (control, "exit-status"), ==, 3);
+
+  g_assert_cmpstr (problem, ==, "");
+  g_object_unref (channel);
+
+  g_free (problem);
+  g_object_unref (transport);
+}
+
+static void
+send_pool_request (MockTransport *transport,
+                   const gchar *id,
+                   const gchar *err,
+                   ...)
+{
+  JsonObject *request;
+  JsonArray *array;
+  const gchar *arg;
+  GBytes *bytes;
+  va_list va;
+
+  request = json_object_new ();
+  json_object_set_string_member (request, "id", id);
+  if (err)
+    json_object_set_string_member (request, "err", err);
+
+  array = json_array_new ();
+  va_start (va, err);
+  while ((arg = va_arg (va, const gchar *)) != NULL)
+    json_array_add_string_element (array, arg);
+  va_end (va);
+  json_object_set_array_member (request, "spawn", array);
+
+  bytes = cockpit_json_write_bytes (request);
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (transport), "548", bytes);
+  g_bytes_unref (bytes);
+  json_object_unref (request);
+}
+
+static JsonObject *
+recv_pool_result (MockTransport *transport)
+{
+  JsonObject *result;
+  GError *error = NULL;
+  GBytes *bytes;
+
+  while ((bytes = mock_transport_pop_channel (transport, "548")) == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  result = cockpit_json_parse_bytes (bytes, &error);
+  g_assert_no_error (error);
+  return result;
+}
+
+static void
+test_spawn_pool (void)
+{
+  MockTransport *transport;
+  CockpitChannel *channel;
+  gchar *problem = NULL;
+  JsonObject *options;
+  const gchar *done = "{ \"command\": \"done\", \"channel\": \"548\" }";
+  JsonObject *result;
+  JsonObject *control;
+  GBytes *bytes;
+
+  transport = g_object_new (mock_transport_get_type (), NULL);
+
+  options = json_object_new ();
+  json_object_set_string_member (options, "payload", "spawn-pool1");
+
+  channel = g_object_new (COCKPIT_TYPE_SPAWN_POOL,
+                          "options", options,
+                          "id", "548",
+                          "transport", transport,
+                          NULL);
+  g_signal_connect (channel, "closed", G_CALLBACK (on_closed_get_problem), &problem);
+  json_object_unref (options);
+
+  /* Queue them all at once, quoting must survive the shell */
+  send_pool_request (transport, "one", NULL, "printf", "%s", "it's \"$HOME\"\nhere", NULL);
+  send_pool_request (transport, "two", NULL, "/bin/sh", "-c", "exit 5", NULL);
+  send_pool_request (transport, "three", "out", "/bin/sh", "-c", "echo oops >&2", NULL);
+  send_pool_request (transport, "four", NULL, "cd", "/", NULL);
+
+  result = recv_pool_result (transport);
+  g_assert_cmpstr (json_object_get_string_member (result, "id"), ==, "one");
+  g_assert_cmpint (json_object_get_int_member (result, "exit-status"), ==, 0);
+  g_assert_cmpstr (json_object_get_string_member (result, "output"), ==, "it's \"$HOME\"\nhere");
+  json_object_unref (result);
+
+  result = recv_pool_result (transport);
+  g_assert_cmpstr (json_object_get_string_member (result, "id"), ==, "two");
+  g_assert_cmpint (json_object_get_int_member (result, "exit-status"), ==, 5);
+  g_assert_cmpstr (json_object_get_string_member (result, "output"), ==, "");
+  json_object_unref (result);
+
+  result = recv_pool_result (transport);
+  g_assert_cmpstr (json_object_get_string_member (result, "id"), ==, "three");
+  g_assert_cmpint (json_object_get_int_member (result, "exit-status"), ==, 0);
+  g_assert_cmpstr (json_object_get_string_member (result, "output"), ==, "oops\n");
+  json_object_unref (result);
+
+  /* Runs in a subshell, doesn't affect the next command */
+  result = recv_pool_result (transport);
+  g_assert_cmpstr (json_object_get_string_member (result, "id"), ==, "four");
+  g_assert_cmpint (json_object_get_int_member (result, "exit-status"), ==, 0);
+  json_object_unref (result);
+
+  /* The shell is still there once the queue has drained */
+  send_pool_request (transport, "five", NULL, "/bin/sh", "-c", "echo $$", NULL);
+  result = recv_pool_result (transport);
+  g_assert_cmpstr (json_object_get_string_member (result, "id"), ==, "five");
+  g_assert_cmpint (json_object_get_int_member (result, "exit-status"), ==, 0);
+  json_object_unref (result);
+
+  bytes = g_bytes_new_static (done, strlen (done));
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (transport), NULL, bytes);
+  g_bytes_unref (bytes);
+
+  while (!problem)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_cmpstr (problem, ==, "");
+
+  control = mock_transport_pop_control (transport);
+  expect_control_message (control, "ready", "548", NULL);
+  control = mock_transport_pop_control (transport);
+  expect_control_message (control, "done", "548", NULL);
+  control = mock_transport_pop_control (transport);
+  expect_control_message (control, "close", "548", "problem", NULL, NULL);
+
+  g_free (problem);
+  g_object_unref (channel);
+  g_object_unref (transport);
+}
+
+static void
+test_spawn_pool_output (void)
+{
+  MockTransport *transport;
+  CockpitChannel *channel;
+  JsonObject *options;
+  JsonObject *result;
+  GBytes *bytes;
+  gsize saved;
+
+  saved = cockpit_spawn_pool_output_maximum;
+  cockpit_spawn_pool_output_maximum = 1024;
+
+  transport = g_object_new (mock_transport_get_type (), NULL);
+
+  options = json_object_new ();
+  json_object_set_string_member (options, "payload", "spawn-pool1");
+
+  channel = g_object_new (COCKPIT_TYPE_SPAWN_POOL,
+                          "options", options,
+                          "id", "548",
+                          "transport", transport,
+                          NULL);
+  json_object_unref (options);
+
+  send_pool_request (transport, "big", NULL, "/bin/sh", "-c", "yes | head -c 100000", NULL);
+  send_pool_request (transport, "nul", NULL, "printf", "one\\000two\\000", NULL);
+
+  /* Fails, but the rest of its output doesn't end up in the next reply */
+  result = recv_pool_result (transport);
+  g_assert_cmpstr (json_object_get_string_member (result, "id"), ==, "big");
+  g_assert_cmpstr (json_object_get_string_member (result, "problem"), ==, "too-large");
+  g_assert (!json_object_has_member (result, "output"));
+  json_object_unref (result);
+
+  /* Nul bytes don't cut the output short */
+  while ((bytes = mock_transport_pop_channel (transport, "548")) == NULL)
+    g_main_context_iteration (NULL, TRUE);
+  cockpit_assert_bytes_eq (bytes, "{\"id\":\"nul\",\"exit-status\":0,\"output\":\"one\\u0000two\\u0000\"}", -1);
+
+  g_object_unref (channel);
+  g_object_unref (transport);
+
+  cockpit_spawn_pool_output_maximum = saved;
+}
+
+static void
+test_spawn_pool_invalid (void)
+{
+  MockTransport *transport;
+  CockpitChannel *channel;
+  gchar *problem = NULL;
+  JsonObject *options;
+
+  cockpit_expect_warning ("*invalid or missing \"spawn\" field*");
+
+  transport = g_object_new (mock_transport_get_type (), NULL);
+
+  options = json_object_new ();
+  json_object_set_string_member (options, "payload", "spawn-pool1");
+
+  channel = g_object_new (COCKPIT_TYPE_SPAWN_POOL,
+                          "options", options,
+                          "id", "548",
+                          "transport", transport,
+                          NULL);
+  g_signal_connect (channel, "closed", G_CALLBACK (on_closed_get_problem), &problem);
+  json_object_unref (options);
+
+  send_pool_request (transport, "one", NULL, NULL);
+
+  while (!problem)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_cmpstr (problem, ==, "protocol-error");
+
+  g_free (problem);
+  g_object_unref (channel);
+  g_object_unref (transport);
+
+  cockpit_assert_expected ();
+}
+
 int
 main (int argc,
       char *argv[])
@@ -718,6 +1156,8 @@ main (int argc,
 
   g_test_add ("/pipe-channel/echo", TestCase, NULL,
               setup_channel, test_echo, teardown);
+  g_test_add ("/pipe-channel/echo-pause-utf8", TestCase, NULL,
+              setup_channel, test_echo_pause_utf8, teardown);
   g_test_add ("/pipe-channel/shutdown", TestCase, NULL,
               setup_channel, test_shutdown, teardown);
   g_test_add ("/pipe-channel/close-normal", TestCase, NULL,
@@ -733,7 +1173,15 @@ main (int argc,
   g_test_add_func ("/pipe-channel/spawn/simple", test_spawn_simple);
   g_test_add_func ("/pipe-channel/spawn/status", test_spawn_status);
   g_test_add_func ("/pipe-channel/spawn/environ", test_spawn_environ);
+  g_test_add_func ("/pipe-channel/spawn/nice", test_spawn_nice);
+  g_test_add_func ("/pipe-channel/spawn/invalid-nice", test_spawn_invalid_nice);
   g_test_add_func ("/pipe-channel/spawn/pty", test_spawn_pty);
+  g_test_add_func ("/pipe-channel/spawn/pty-coalesce", test_spawn_pty_coalesce);
+  g_test_add_func ("/pipe-channel/spawn/hidden", test_spawn_hidden);
+
+  g_test_add_func ("/pipe-channel/spawn-pool/simple", test_spawn_pool);
+  g_test_add_func ("/pipe-channel/spawn-pool/invalid", test_spawn_pool_invalid);
+  g_test_add_func ("/pipe-channel/spawn-pool/output", test_spawn_pool_output);
 
   g_test_add_func ("/pipe-channel/fail/not-found", test_fail_not_found);
   g_test_add_func ("/pipe-channel/fail/access-denied", test_fail_access_denied);
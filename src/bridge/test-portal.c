@@ -270,6 +270,27 @@ mock_portal_fail_new (MockTransport *transport,
                        NULL);
 }
 
+static CockpitPortal *
+mock_portal_prewarm_new (MockTransport *transport,
+                         CockpitPortalFilter filter,
+                         const gchar *arg)
+{
+  static const char *mock_argv[] = {
+    BUILDDIR "/mock-bridge", NULL, NULL
+  };
+
+  static const gchar **good[] = { mock_argv, NULL };
+
+  mock_argv[1] = arg;
+
+  return g_object_new (COCKPIT_TYPE_PORTAL,
+                       "transport", transport,
+                       "filter", filter,
+                       "argvs", good,
+                       "init-member", "superuser",
+                       NULL);
+}
+
 static void
 emit_string (TestCase *tc,
              const gchar *channel,
@@ -385,6 +406,52 @@ test_fallback (TestCase *tc,
   g_object_unref (portal);
 }
 
+static gboolean
+on_timeout_set_flag (gpointer user_data)
+{
+  gboolean *flag = user_data;
+  *flag = TRUE;
+  return FALSE;
+}
+
+static void
+test_prewarm_idle (TestCase *tc,
+                   gconstpointer unused)
+{
+  CockpitPortal *portal;
+  gboolean waited;
+  GBytes *sent;
+
+  portal = mock_portal_prewarm_new (tc->transport, mock_filter_upper, "--upper");
+
+  emit_string (tc, NULL, "{\"command\": \"init\", \"version\": 1,"
+               " \"superuser\": { \"prewarm\": true, \"idle-timeout\": 1 } }");
+
+  emit_string (tc, NULL, "{\"command\": \"open\", \"channel\": \"a\", \"payload\": \"upper\"}");
+  emit_string (tc, "a", "oh marmalade");
+
+  while ((sent = mock_transport_pop_channel (tc->transport, "a")) == NULL)
+    g_main_context_iteration (NULL, TRUE);
+  cockpit_assert_bytes_eq (sent, "OH MARMALADE", -1);
+
+  /* Closing the last channel lets the other bridge go idle */
+  emit_string (tc, NULL, "{\"command\": \"close\", \"channel\": \"a\"}");
+  waited = FALSE;
+  g_timeout_add (1500, on_timeout_set_flag, &waited);
+  while (!waited)
+    g_main_context_iteration (NULL, TRUE);
+
+  /* A new channel starts it again */
+  emit_string (tc, NULL, "{\"command\": \"open\", \"channel\": \"b\", \"payload\": \"upper\"}");
+  emit_string (tc, "b", "marmalade again");
+
+  while ((sent = mock_transport_pop_channel (tc->transport, "b")) == NULL)
+    g_main_context_iteration (NULL, TRUE);
+  cockpit_assert_bytes_eq (sent, "MARMALADE AGAIN", -1);
+
+  g_object_unref (portal);
+}
+
 int
 main (int argc,
       char *argv[])
@@ -399,6 +466,8 @@ main (int argc,
               setup, test_fail, teardown);
   g_test_add ("/portal/fallback", TestCase, NULL,
               setup, test_fallback, teardown);
+  g_test_add ("/portal/prewarm-idle", TestCase, NULL,
+              setup, test_prewarm_idle, teardown);
 
   return g_test_run ();
 }
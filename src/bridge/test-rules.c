@@ -253,6 +253,62 @@ test_add_ref_remove (TestCase *test,
   g_assert (cockpit_dbus_rules_remove (test->rules, "/booo", FALSE, NULL, NULL, NULL) == FALSE);
 }
 
+static void
+test_many (TestCase *test,
+           gconstpointer fixture)
+{
+  gchar *path;
+  gint i;
+
+  for (i = 0; i < 1000; i++)
+    {
+      path = g_strdup_printf ("/many/%d", i);
+      cockpit_dbus_rules_add (test->rules, path, FALSE, "org.Many", NULL, NULL);
+      g_free (path);
+    }
+
+  cockpit_dbus_rules_add (test->rules, "/many", TRUE, NULL, "OnlyMember", NULL);
+  cockpit_dbus_rules_add (test->rules, "/other", TRUE, "org.Other", "Signal", NULL);
+  cockpit_dbus_rules_add (test->rules, "/other/deep", FALSE, "org.Deep", NULL, "arg");
+
+  g_assert (cockpit_dbus_rules_match (test->rules, "/many/5", "org.Many", "Changed", NULL) == TRUE);
+  g_assert (cockpit_dbus_rules_match (test->rules, "/many/999", "org.Many", NULL, NULL) == TRUE);
+  g_assert (cockpit_dbus_rules_match (test->rules, "/many/5", "org.Not", "Changed", NULL) == FALSE);
+  g_assert (cockpit_dbus_rules_match (test->rules, "/many/1000", "org.Many", "Changed", NULL) == FALSE);
+
+  /* Through the namespace rule with only a member */
+  g_assert (cockpit_dbus_rules_match (test->rules, "/many/1000", "org.Not", "OnlyMember", NULL) == TRUE);
+  g_assert (cockpit_dbus_rules_match (test->rules, "/many", "org.Not", "OnlyMember", NULL) == TRUE);
+  g_assert (cockpit_dbus_rules_match (test->rules, "/manyx", "org.Not", "OnlyMember", NULL) == FALSE);
+  g_assert (cockpit_dbus_rules_match (test->rules, "/many/1000", NULL, "OnlyMember", NULL) == TRUE);
+
+  g_assert (cockpit_dbus_rules_match (test->rules, "/other/a/b/c", "org.Other", "Signal", NULL) == TRUE);
+  g_assert (cockpit_dbus_rules_match (test->rules, "/other/a/b/c", "org.Other", "NotSignal", NULL) == FALSE);
+  g_assert (cockpit_dbus_rules_match (test->rules, "/other/deep", "org.Deep", "Any", "arg") == TRUE);
+  g_assert (cockpit_dbus_rules_match (test->rules, "/other/deep", "org.Deep", "Any", "other") == FALSE);
+  g_assert (cockpit_dbus_rules_match (test->rules, "/other/deep", "org.Deep", "Any", NULL) == FALSE);
+
+  cockpit_dbus_rules_remove (test->rules, "/many", TRUE, NULL, "OnlyMember", NULL);
+  g_assert (cockpit_dbus_rules_match (test->rules, "/many/1000", "org.Not", "OnlyMember", NULL) == FALSE);
+  g_assert (cockpit_dbus_rules_match (test->rules, "/many/5", "org.Many", "OnlyMember", NULL) == TRUE);
+}
+
+static void
+test_need_arg0 (TestCase *test,
+                gconstpointer fixture)
+{
+  g_assert (cockpit_dbus_rules_need_arg0 (test->rules) == FALSE);
+
+  cockpit_dbus_rules_add (test->rules, "/otree", TRUE, "org.Interface", "Signal", NULL);
+  g_assert (cockpit_dbus_rules_need_arg0 (test->rules) == FALSE);
+
+  cockpit_dbus_rules_add (test->rules, "/scruffy", FALSE, NULL, NULL, "arg");
+  g_assert (cockpit_dbus_rules_need_arg0 (test->rules) == TRUE);
+
+  cockpit_dbus_rules_remove (test->rules, "/scruffy", FALSE, NULL, NULL, "arg");
+  g_assert (cockpit_dbus_rules_need_arg0 (test->rules) == FALSE);
+}
+
 int
 main (int argc,
       char *argv[])
@@ -273,6 +329,10 @@ main (int argc,
               setup, test_null_path, teardown);
   g_test_add ("/rules/add-ref-remove", TestCase, empty_rules,
               setup, test_add_ref_remove, teardown);
+  g_test_add ("/rules/many", TestCase, empty_rules,
+              setup, test_many, teardown);
+  g_test_add ("/rules/need-arg0", TestCase, empty_rules,
+              setup, test_need_arg0, teardown);
 
   return g_test_run ();
 }
@@ -209,6 +209,126 @@ test_bad_origin (TestCase *test,
   g_free (problem);
 }
 
+typedef struct {
+  GSocketService *service;
+  MockTransport *transport;
+  guint port;
+  gchar *origin;
+  gchar *url;
+  gint accepted;
+} TestSpare;
+
+static gboolean
+on_spare_incoming (GSocketService *service,
+                   GSocketConnection *connection,
+                   GObject *source_object,
+                   gpointer user_data)
+{
+  const gchar *origins[] = { NULL, NULL };
+  TestSpare *test = user_data;
+  WebSocketConnection *ws;
+
+  test->accepted++;
+
+  /* Reads the handshake from the stream, whenever it comes */
+  origins[0] = test->origin;
+  ws = web_socket_server_new_for_stream (test->url, (const gchar **)origins, NULL,
+                                         G_IO_STREAM (connection), NULL, NULL);
+  g_signal_connect (ws, "message", G_CALLBACK (on_socket_message), NULL);
+  g_signal_connect (ws, "close", G_CALLBACK (g_object_unref), NULL);
+  return TRUE;
+}
+
+static void
+setup_spare (TestSpare *test,
+             gconstpointer data)
+{
+  GError *error = NULL;
+
+  test->service = g_socket_service_new ();
+  test->port = g_socket_listener_add_any_inet_port (G_SOCKET_LISTENER (test->service), NULL, &error);
+  g_assert_no_error (error);
+  g_signal_connect (test->service, "incoming", G_CALLBACK (on_spare_incoming), test);
+  g_socket_service_start (test->service);
+
+  test->transport = mock_transport_new ();
+  test->origin = g_strdup_printf ("http://localhost:%u", test->port);
+  test->url = g_strdup_printf ("ws://localhost:%u/socket", test->port);
+}
+
+static void
+teardown_spare (TestSpare *test,
+                gconstpointer data)
+{
+  g_socket_service_stop (test->service);
+  g_socket_listener_close (G_SOCKET_LISTENER (test->service));
+  g_object_unref (test->service);
+  g_object_unref (test->transport);
+
+  g_free (test->origin);
+  g_free (test->url);
+  cockpit_assert_expected ();
+}
+
+static CockpitChannel *
+open_spare (TestSpare *test,
+            const gchar *id)
+{
+  CockpitChannel *channel;
+  JsonObject *options;
+  GBytes *bytes;
+  GBytes *recv;
+
+  options = json_object_new ();
+  json_object_set_int_member (options, "port", test->port);
+  json_object_set_string_member (options, "payload", "websocket-stream1");
+  json_object_set_string_member (options, "path", "/socket");
+  json_object_set_string_member (options, "connection", "spares");
+
+  channel = g_object_new (COCKPIT_TYPE_WEB_SOCKET_STREAM,
+                          "transport", test->transport,
+                          "id", id,
+                          "options", options,
+                          NULL);
+  json_object_unref (options);
+
+  bytes = g_bytes_new ("Message", 7);
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (test->transport), id, bytes);
+  g_bytes_unref (bytes);
+
+  while ((recv = mock_transport_pop_channel (test->transport, id)) == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  cockpit_assert_bytes_eq (recv, "MESSAGE", 7);
+  return channel;
+}
+
+static void
+test_spare (TestSpare *test,
+            gconstpointer data)
+{
+  CockpitChannel *channel;
+
+  /* One connection for the channel, and a spare */
+  channel = open_spare (test, "501");
+  while (test->accepted < 2)
+    g_main_context_iteration (NULL, TRUE);
+  while (g_main_context_iteration (NULL, FALSE));
+
+  cockpit_channel_close (channel, NULL);
+  g_object_unref (channel);
+
+  /* Nothing can connect anymore, so this must use the spare */
+  g_socket_service_stop (test->service);
+  g_socket_listener_close (G_SOCKET_LISTENER (test->service));
+
+  channel = open_spare (test, "502");
+  g_assert_cmpint (test->accepted, ==, 2);
+
+  cockpit_channel_close (channel, NULL);
+  g_object_unref (channel);
+}
+
 typedef struct {
   GTlsCertificate *certificate;
   MockTransport *transport;
@@ -367,6 +487,8 @@ main (int argc,
               setup, test_basic, teardown);
   g_test_add ("/websocket-stream/test_bad_origin", TestCase, NULL,
               setup, test_bad_origin, teardown);
+  g_test_add ("/websocket-stream/spare", TestSpare, NULL,
+              setup_spare, test_spare, teardown_spare);
   g_test_add ("/websocket/tls/authority-good", TestTls, fixture_tls_authority_good,
               setup_tls, test_tls_authority_good, teardown_tls);
   g_test_add ("/websocket/tls/authority-bad", TestTls, fixture_tls_authority_bad,
@@ -0,0 +1,222 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2016 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitjson.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Times cockpit_json_parse() against parsing with JsonParser and
+ * copying the tree, which is how cockpit_json_parse() used to work,
+ * and then cockpit_json_write() on the same messages.
+ * The messages are typical of what goes over a transport, or are read
+ * one per line from a file of captured traffic.
+ *
+ * This is not run as part of 'make check'.
+ */
+
+static gint opt_count = 100000;
+static gchar *opt_file = NULL;
+
+static const gchar *samples[] = {
+  "{\"command\":\"open\",\"channel\":\"1:3\",\"payload\":\"dbus-json3\",\"bus\":\"system\","
+    "\"name\":\"org.freedesktop.systemd1\",\"host\":\"localhost\",\"superuser\":\"try\"}",
+  "{\"call\":[\"/org/freedesktop/systemd1\",\"org.freedesktop.DBus.Properties\",\"GetAll\","
+    "[\"org.freedesktop.systemd1.Manager\"]],\"id\":\"7\"}",
+  "{\"notify\":{\"/org/freedesktop/systemd1/unit/sshd_2eservice\":{"
+    "\"org.freedesktop.systemd1.Unit\":{\"ActiveState\":\"active\",\"SubState\":\"running\","
+    "\"ActiveEnterTimestamp\":1466613091455454,\"Conditions\":[],\"Description\":\"OpenSSH server daemon\","
+    "\"Names\":[\"sshd.service\"],\"Requires\":[\"system.slice\",\"sysinit.target\"]}}}}",
+  "{\"reply\":[[{\"Version\":{\"t\":\"s\",\"v\":\"229\"},\"NNames\":{\"t\":\"u\",\"v\":211},"
+    "\"Environment\":{\"t\":\"as\",\"v\":[\"LANG=en_US.UTF-8\",\"PATH=/usr/local/sbin:/usr/bin\"]}}]],\"id\":\"7\"}",
+  "[[5.25,12.5,0.75,null,[1024,2048,4096]],[5.5,12,0.5,null,[1024,2048,4097]]]",
+  "{\"command\":\"ping\"}",
+  "{\"command\":\"close\",\"channel\":\"1:3\",\"problem\":\"not-found\",\"message\":\"No such file or directory\"}",
+  NULL,
+};
+
+static JsonNode *
+parse_with_parser (const gchar *data,
+                   gssize length,
+                   GError **error)
+{
+  static JsonParser *parser = NULL;
+  JsonNode *root;
+  JsonNode *ret = NULL;
+
+  if (!parser)
+    parser = json_parser_new ();
+
+  if (json_parser_load_from_data (parser, data, length, error))
+    {
+      root = json_parser_get_root (parser);
+      if (root)
+        {
+          ret = json_node_copy (root);
+          if (JSON_NODE_HOLDS_OBJECT (root))
+            json_node_take_object (root, json_object_new ());
+          else if (JSON_NODE_HOLDS_ARRAY (root))
+            json_node_take_array (root, json_array_new ());
+        }
+    }
+
+  return ret;
+}
+
+static void
+bench_parse (const gchar *name,
+             JsonNode * (* parse) (const gchar *, gssize, GError **),
+             GPtrArray *messages)
+{
+  GError *error = NULL;
+  JsonNode *node;
+  gsize bytes = 0;
+  gint64 start;
+  gdouble elapsed;
+  const gchar *data;
+  gint i;
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < opt_count; i++)
+    {
+      data = messages->pdata[i % messages->len];
+      node = parse (data, -1, &error);
+      if (!node)
+        g_error ("bench-json: couldn't parse message: %s", error ? error->message : data);
+      json_node_free (node);
+      bytes += strlen (data);
+    }
+  elapsed = g_get_monotonic_time () - start;
+
+  printf ("%s: %.0f ns/message, %.2f MB/sec\n", name,
+          (elapsed * 1000) / opt_count,
+          ((gdouble)bytes / (1024 * 1024)) / (elapsed / G_USEC_PER_SEC));
+}
+
+static void
+bench_write (GPtrArray *messages)
+{
+  GPtrArray *nodes;
+  gsize bytes = 0;
+  gsize length;
+  gint64 start;
+  gdouble elapsed;
+  gchar *data;
+  guint j;
+  gint i;
+
+  nodes = g_ptr_array_new_with_free_func ((GDestroyNotify)json_node_free);
+  for (j = 0; j < messages->len; j++)
+    g_ptr_array_add (nodes, cockpit_json_parse (messages->pdata[j], -1, NULL));
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < opt_count; i++)
+    {
+      data = cockpit_json_write (nodes->pdata[i % nodes->len], &length);
+      bytes += length;
+      g_free (data);
+    }
+  elapsed = g_get_monotonic_time () - start;
+
+  printf ("cockpit-write: %.0f ns/message, %.2f MB/sec\n",
+          (elapsed * 1000) / opt_count,
+          ((gdouble)bytes / (1024 * 1024)) / (elapsed / G_USEC_PER_SEC));
+
+  g_ptr_array_free (nodes, TRUE);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  GOptionContext *context;
+  GError *error = NULL;
+  GPtrArray *messages;
+  gchar *contents = NULL;
+  gchar **lines = NULL;
+  gint i;
+
+  static GOptionEntry entries[] = {
+    { "count", 'n', 0, G_OPTION_ARG_INT, &opt_count, "Number of messages to parse", "count" },
+    { "file", 'f', 0, G_OPTION_ARG_FILENAME, &opt_file, "Captured messages, one per line", "file" },
+    { NULL }
+  };
+
+  g_type_init ();
+
+  context = g_option_context_new (NULL);
+  g_option_context_add_main_entries (context, entries, NULL);
+  g_option_context_set_description (context, "Measure cockpit JSON parsing\n");
+
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("bench-json: %s\n", error->message);
+      g_error_free (error);
+      return 2;
+    }
+
+  g_option_context_free (context);
+
+  if (opt_count < 1)
+    {
+      g_printerr ("bench-json: invalid arguments\n");
+      return 2;
+    }
+
+  messages = g_ptr_array_new ();
+  if (opt_file)
+    {
+      if (!g_file_get_contents (opt_file, &contents, NULL, &error))
+        {
+          g_printerr ("bench-json: %s\n", error->message);
+          g_error_free (error);
+          return 1;
+        }
+      lines = g_strsplit (contents, "\n", -1);
+      for (i = 0; lines[i] != NULL; i++)
+        {
+          if (lines[i][0])
+            g_ptr_array_add (messages, lines[i]);
+        }
+    }
+  else
+    {
+      for (i = 0; samples[i] != NULL; i++)
+        g_ptr_array_add (messages, (gpointer)samples[i]);
+    }
+
+  if (messages->len == 0)
+    {
+      g_printerr ("bench-json: no messages to parse\n");
+      return 1;
+    }
+
+  bench_parse ("json-parser", parse_with_parser, messages);
+  bench_parse ("cockpit-json", cockpit_json_parse, messages);
+  bench_write (messages);
+
+  g_ptr_array_free (messages, TRUE);
+  g_strfreev (lines);
+  g_free (contents);
+  g_free (opt_file);
+  return 0;
+}
@@ -0,0 +1,123 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2016 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitpipe.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Spawns short lived commands one after another through cockpit_pipe_spawn(),
+ * optionally after growing the process to a given size first, and reports
+ * how many spawns per second complete. Use --fork to compare with the
+ * glib fork() based path.
+ *
+ * This is not run as part of 'make check'.
+ */
+
+extern gboolean cockpit_pipe_fast_spawn;
+
+static gint opt_count = 1000;
+static gint opt_rss = 0;
+static gboolean opt_fork = FALSE;
+
+static void
+on_close (CockpitPipe *pipe,
+          const gchar *problem,
+          gpointer user_data)
+{
+  gboolean *closed = user_data;
+  if (problem)
+    g_printerr ("bench-spawn: command failed: %s\n", problem);
+  *closed = TRUE;
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  const gchar *command[] = { "/bin/true", NULL };
+  GOptionContext *context;
+  GError *error = NULL;
+  CockpitPipe *pipe;
+  gboolean closed;
+  gchar *ballast = NULL;
+  gint64 start;
+  gdouble elapsed;
+  gint i;
+
+  static GOptionEntry entries[] = {
+    { "count", 'n', 0, G_OPTION_ARG_INT, &opt_count, "Number of commands to spawn", "count" },
+    { "rss", 'r', 0, G_OPTION_ARG_INT, &opt_rss, "Grow the process by this much memory first", "megabytes" },
+    { "fork", 'f', 0, G_OPTION_ARG_NONE, &opt_fork, "Use the fork() based path", NULL },
+    { NULL }
+  };
+
+  signal (SIGPIPE, SIG_IGN);
+  g_type_init ();
+
+  context = g_option_context_new (NULL);
+  g_option_context_add_main_entries (context, entries, NULL);
+  g_option_context_set_description (context, "Measure how fast cockpit spawns processes\n");
+
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("bench-spawn: %s\n", error->message);
+      g_error_free (error);
+      return 2;
+    }
+
+  g_option_context_free (context);
+
+  if (opt_count < 1 || opt_rss < 0)
+    {
+      g_printerr ("bench-spawn: invalid arguments\n");
+      return 2;
+    }
+
+  /* Touch every page, so it counts towards the resident size */
+  if (opt_rss > 0)
+    {
+      ballast = g_malloc ((gsize)opt_rss * 1024 * 1024);
+      memset (ballast, 'x', (gsize)opt_rss * 1024 * 1024);
+    }
+
+  cockpit_pipe_fast_spawn = !opt_fork;
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < opt_count; i++)
+    {
+      closed = FALSE;
+      pipe = cockpit_pipe_spawn (command, NULL, NULL, COCKPIT_PIPE_FLAGS_NONE);
+      g_signal_connect (pipe, "close", G_CALLBACK (on_close), &closed);
+      while (!closed)
+        g_main_context_iteration (NULL, TRUE);
+      g_object_unref (pipe);
+    }
+  elapsed = (g_get_monotonic_time () - start) / 1000000.0;
+
+  printf ("spawn: %d commands with %d MB resident, %s: %.0f spawns/s\n",
+          opt_count, opt_rss, opt_fork ? "fork" : "clone", opt_count / elapsed);
+
+  g_free (ballast);
+  return 0;
+}
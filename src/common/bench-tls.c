@@ -0,0 +1,241 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2016 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitcertificate.h"
+
+#include <glib/gstdio.h>
+
+#include <sys/socket.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Generates a self-signed certificate of each key type the way
+ * remotectl does, and times full TLS handshakes against each one,
+ * between a client and server over a socketpair. Both ends are in
+ * this process, so the figures include the client's work too, but
+ * the server's signature is what differs between the key types.
+ *
+ * This is not run as part of 'make check'.
+ */
+
+static gint opt_count = 500;
+static gchar *opt_key_types = NULL;
+
+typedef struct {
+  gint pending;
+  GError *error;
+} Handshake;
+
+static void
+on_handshake (GObject *source,
+              GAsyncResult *result,
+              gpointer user_data)
+{
+  Handshake *hs = user_data;
+  GError *error = NULL;
+
+  if (!g_tls_connection_handshake_finish (G_TLS_CONNECTION (source), result, &error))
+    {
+      if (hs->error)
+        g_error_free (error);
+      else
+        hs->error = error;
+    }
+  hs->pending--;
+}
+
+static gboolean
+handshake_once (GTlsCertificate *certificate,
+                GError **error)
+{
+  Handshake hs = { 2, NULL };
+  GSocketConnection *conns[2];
+  GIOStream *client;
+  GIOStream *server;
+  GSocket *socket;
+  int fds[2];
+  gint i;
+
+  if (socketpair (PF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    g_error ("couldn't create socketpair");
+
+  for (i = 0; i < 2; i++)
+    {
+      socket = g_socket_new_from_fd (fds[i], error);
+      g_assert (socket != NULL);
+      conns[i] = g_socket_connection_factory_create_connection (socket);
+      g_object_unref (socket);
+    }
+
+  server = g_tls_server_connection_new (G_IO_STREAM (conns[0]), certificate, error);
+  g_assert (server != NULL);
+  client = g_tls_client_connection_new (G_IO_STREAM (conns[1]), NULL, error);
+  g_assert (client != NULL);
+  g_tls_client_connection_set_validation_flags (G_TLS_CLIENT_CONNECTION (client), 0);
+
+  g_tls_connection_handshake_async (G_TLS_CONNECTION (server), G_PRIORITY_DEFAULT,
+                                    NULL, on_handshake, &hs);
+  g_tls_connection_handshake_async (G_TLS_CONNECTION (client), G_PRIORITY_DEFAULT,
+                                    NULL, on_handshake, &hs);
+  while (hs.pending > 0)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_object_unref (client);
+  g_object_unref (server);
+  g_object_unref (conns[0]);
+  g_object_unref (conns[1]);
+
+  if (hs.error)
+    {
+      g_propagate_error (error, hs.error);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gint64
+cpu_time (void)
+{
+  struct timespec ts;
+
+  if (clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &ts) < 0)
+    return 0;
+  return (gint64)ts.tv_sec * G_USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+static void
+bench_key_type (const gchar *directory,
+                const gchar *key_type)
+{
+  GTlsCertificate *certificate;
+  GError *error = NULL;
+  gint64 start;
+  gint64 cpu;
+  gchar *path;
+  gint i;
+
+  path = g_strdup_printf ("%s/%s.cert", directory, key_type);
+
+  if (!cockpit_certificate_generate (path, key_type, &error))
+    {
+      printf ("%-8s couldn't generate certificate: %s\n", key_type, error->message);
+      goto out;
+    }
+
+  certificate = cockpit_certificate_load (path, &error);
+  if (!certificate)
+    {
+      printf ("%-8s couldn't load certificate: %s\n", key_type, error->message);
+      goto out;
+    }
+
+  /* One to warm up, and to check this works at all */
+  if (!handshake_once (certificate, &error))
+    {
+      printf ("%-8s handshake failed: %s\n", key_type, error->message);
+      g_object_unref (certificate);
+      goto out;
+    }
+
+  start = g_get_monotonic_time ();
+  cpu = cpu_time ();
+
+  for (i = 0; i < opt_count; i++)
+    {
+      if (!handshake_once (certificate, &error))
+        g_error ("handshake failed: %s", error->message);
+    }
+
+  cpu = cpu_time () - cpu;
+  start = MAX (g_get_monotonic_time () - start, 1);
+
+  printf ("%-8s %8.0f handshakes/sec, %6.2f ms cpu each\n", key_type,
+          (gdouble)opt_count * G_USEC_PER_SEC / start,
+          (gdouble)cpu / opt_count / 1000);
+
+  g_object_unref (certificate);
+
+out:
+  g_clear_error (&error);
+  g_unlink (path);
+  g_free (path);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  GOptionContext *context;
+  GError *error = NULL;
+  gchar *directory;
+  gchar **key_types;
+  gint i;
+
+  static GOptionEntry entries[] = {
+    { "count", 'n', 0, G_OPTION_ARG_INT, &opt_count, "Number of handshakes for each key type", "count" },
+    { "key-types", 'k', 0, G_OPTION_ARG_STRING, &opt_key_types,
+      "Comma separated key types to compare", "rsa,ecdsa,ed25519" },
+    { NULL }
+  };
+
+  g_type_init ();
+
+  context = g_option_context_new (NULL);
+  g_option_context_add_main_entries (context, entries, NULL);
+  g_option_context_set_description (context, "Compare TLS handshakes with self-signed certificates\n");
+
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("bench-tls: %s\n", error->message);
+      g_error_free (error);
+      return 2;
+    }
+
+  g_option_context_free (context);
+
+  if (opt_count < 1)
+    {
+      g_printerr ("bench-tls: invalid arguments\n");
+      return 2;
+    }
+
+  directory = g_dir_make_tmp ("bench-tls.XXXXXX", &error);
+  if (!directory)
+    {
+      g_printerr ("bench-tls: %s\n", error->message);
+      g_error_free (error);
+      return 1;
+    }
+
+  key_types = g_strsplit (opt_key_types ? opt_key_types : "rsa,ecdsa,ed25519", ",", -1);
+  for (i = 0; key_types[i] != NULL; i++)
+    bench_key_type (directory, key_types[i]);
+
+  g_rmdir (directory);
+  g_free (directory);
+  g_strfreev (key_types);
+  g_free (opt_key_types);
+  return 0;
+}
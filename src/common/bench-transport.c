@@ -0,0 +1,292 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2016 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitpipetransport.h"
+#include "cockpittransport.h"
+
+#include <sys/socket.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Pumps messages through a pair of CockpitPipeTransport connected
+ * over a socketpair, and reports throughput and per message latency.
+ * Also times the frame and command parsers on their own.
+ *
+ * This is not run as part of 'make check'.
+ */
+
+static gint opt_count = 100000;
+static gint opt_size = 64;
+static gint opt_channels = 1;
+static gint opt_window = 64;
+static gboolean opt_binary = FALSE;
+
+typedef struct {
+  CockpitTransport *sender;
+  CockpitTransport *receiver;
+  gchar **channels;
+  guint8 *buffer;
+  gint sent;
+  gint received;
+  gint64 *latencies;
+  gboolean closed;
+} Bench;
+
+static void
+send_one (Bench *bench)
+{
+  GBytes *payload;
+  gint64 when;
+
+  when = g_get_monotonic_time ();
+  memcpy (bench->buffer, &when, sizeof (when));
+  payload = g_bytes_new (bench->buffer, opt_size);
+  cockpit_transport_send (bench->sender, bench->channels[bench->sent % opt_channels], payload);
+  g_bytes_unref (payload);
+  bench->sent++;
+}
+
+static gboolean
+on_recv (CockpitTransport *transport,
+         const gchar *channel,
+         GBytes *payload,
+         gpointer user_data)
+{
+  Bench *bench = user_data;
+  gint64 when;
+
+  g_assert (g_bytes_get_size (payload) == opt_size);
+  memcpy (&when, g_bytes_get_data (payload, NULL), sizeof (when));
+  bench->latencies[bench->received++] = g_get_monotonic_time () - when;
+
+  if (bench->sent < opt_count)
+    send_one (bench);
+
+  return TRUE;
+}
+
+static void
+on_closed (CockpitTransport *transport,
+           const gchar *problem,
+           gpointer user_data)
+{
+  Bench *bench = user_data;
+  if (problem)
+    g_printerr ("bench-transport: transport closed: %s\n", problem);
+  bench->closed = TRUE;
+}
+
+static int
+compare_latency (gconstpointer a,
+                 gconstpointer b)
+{
+  const gint64 *la = a;
+  const gint64 *lb = b;
+  return (*la > *lb) - (*la < *lb);
+}
+
+static void
+bench_transport (void)
+{
+  Bench bench = { NULL, };
+  gint64 start;
+  gdouble elapsed;
+  int sv[2];
+  gint i;
+
+  if (socketpair (PF_LOCAL, SOCK_STREAM, 0, sv) < 0)
+    g_error ("couldn't create socketpair: %s", g_strerror (errno));
+
+  bench.sender = cockpit_pipe_transport_new_fds ("sender", sv[0], dup (sv[0]));
+  bench.receiver = cockpit_pipe_transport_new_fds ("receiver", sv[1], dup (sv[1]));
+  if (opt_binary)
+    cockpit_pipe_transport_set_binary_framing (COCKPIT_PIPE_TRANSPORT (bench.sender), TRUE);
+
+  g_signal_connect (bench.receiver, "recv", G_CALLBACK (on_recv), &bench);
+  g_signal_connect (bench.sender, "closed", G_CALLBACK (on_closed), &bench);
+  g_signal_connect (bench.receiver, "closed", G_CALLBACK (on_closed), &bench);
+
+  bench.channels = g_new0 (gchar *, opt_channels + 1);
+  for (i = 0; i < opt_channels; i++)
+    bench.channels[i] = g_strdup_printf ("%d", i + 1);
+
+  bench.buffer = g_malloc0 (opt_size);
+  memset (bench.buffer, 'x', opt_size);
+  bench.latencies = g_new0 (gint64, opt_count);
+
+  start = g_get_monotonic_time ();
+
+  for (i = 0; i < opt_window && bench.sent < opt_count; i++)
+    send_one (&bench);
+
+  while (bench.received < opt_count && !bench.closed)
+    g_main_context_iteration (NULL, TRUE);
+
+  elapsed = (gdouble)(g_get_monotonic_time () - start) / G_USEC_PER_SEC;
+
+  qsort (bench.latencies, bench.received, sizeof (gint64), compare_latency);
+
+  printf ("transport: %d messages of %d bytes over %d channels, %s framing\n",
+          bench.received, opt_size, opt_channels, opt_binary ? "binary" : "decimal");
+  printf ("  %.0f msgs/sec, %.2f MB/sec\n",
+          bench.received / elapsed,
+          ((gdouble)bench.received * opt_size) / elapsed / (1024 * 1024));
+  if (bench.received > 0)
+    {
+      printf ("  latency p50: %" G_GINT64_FORMAT " us, p99: %" G_GINT64_FORMAT " us\n",
+              bench.latencies[(bench.received * 50) / 100],
+              bench.latencies[(bench.received * 99) / 100]);
+    }
+
+  g_object_unref (bench.sender);
+  g_object_unref (bench.receiver);
+  g_strfreev (bench.channels);
+  g_free (bench.latencies);
+  g_free (bench.buffer);
+}
+
+static void
+bench_parse_frame (void)
+{
+  GBytes *message;
+  GBytes *payload;
+  gchar *channel;
+  guint8 *data;
+  gint64 start;
+  gdouble elapsed;
+  gint i;
+
+  data = g_malloc (opt_size + 5);
+  memcpy (data, "1234\n", 5);
+  memset (data + 5, 'x', opt_size);
+  message = g_bytes_new_take (data, opt_size + 5);
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < opt_count; i++)
+    {
+      payload = cockpit_transport_parse_frame (message, &channel);
+      g_bytes_unref (payload);
+      g_free (channel);
+    }
+  elapsed = g_get_monotonic_time () - start;
+
+  printf ("parse-frame: %.0f ns/op\n", (elapsed * 1000) / opt_count);
+  g_bytes_unref (message);
+}
+
+static void
+bench_parse_command (void)
+{
+  const gchar *input = "{ \"command\": \"open\", \"channel\": \"1234\", "
+                       "\"payload\": \"dbus-json3\", \"bus\": \"system\", "
+                       "\"name\": \"org.freedesktop.systemd1\" }";
+  const gchar *command;
+  const gchar *channel;
+  JsonObject *options;
+  GBytes *message;
+  gint64 start;
+  gdouble elapsed;
+  gint i;
+
+  message = g_bytes_new_static (input, strlen (input));
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < opt_count; i++)
+    {
+      if (!cockpit_transport_parse_command (message, &command, &channel, &options))
+        g_assert_not_reached ();
+      json_object_unref (options);
+    }
+  elapsed = g_get_monotonic_time () - start;
+
+  printf ("parse-command: %.0f ns/op\n", (elapsed * 1000) / opt_count);
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < opt_count; i++)
+    {
+      gchar *scanned_command;
+      gchar *scanned_channel;
+
+      if (!cockpit_transport_scan_command (message, &scanned_command, &scanned_channel))
+        g_assert_not_reached ();
+      g_free (scanned_command);
+      g_free (scanned_channel);
+    }
+  elapsed = g_get_monotonic_time () - start;
+
+  printf ("scan-command: %.0f ns/op\n", (elapsed * 1000) / opt_count);
+  g_bytes_unref (message);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  GOptionContext *context;
+  GError *error = NULL;
+
+  static GOptionEntry entries[] = {
+    { "count", 'n', 0, G_OPTION_ARG_INT, &opt_count, "Number of messages to send", "count" },
+    { "size", 's', 0, G_OPTION_ARG_INT, &opt_size, "Size of each message payload", "bytes" },
+    { "channels", 'c', 0, G_OPTION_ARG_INT, &opt_channels, "Number of channels to spread messages over", "count" },
+    { "window", 'w', 0, G_OPTION_ARG_INT, &opt_window, "Messages in flight at once", "count" },
+    { "binary", 'b', 0, G_OPTION_ARG_NONE, &opt_binary, "Use binary framing", NULL },
+    { NULL }
+  };
+
+  signal (SIGPIPE, SIG_IGN);
+  g_type_init ();
+
+  context = g_option_context_new (NULL);
+  g_option_context_add_main_entries (context, entries, NULL);
+  g_option_context_set_description (context, "Measure cockpit transport throughput\n");
+
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("bench-transport: %s\n", error->message);
+      g_error_free (error);
+      return 2;
+    }
+
+  g_option_context_free (context);
+
+  if (opt_count < 1 || opt_channels < 1 || opt_window < 1)
+    {
+      g_printerr ("bench-transport: invalid arguments\n");
+      return 2;
+    }
+
+  /* Room for the timestamp */
+  if (opt_size < sizeof (gint64))
+    opt_size = (gint)sizeof (gint64);
+
+  bench_parse_frame ();
+  bench_parse_command ();
+  bench_transport ();
+
+  return 0;
+}
@@ -0,0 +1,178 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2016 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitbase64.h"
+
+/*
+ * These produce and accept exactly what g_base64_encode_step() and
+ * g_base64_decode_step() do for a whole buffer, but work on groups
+ * of three bytes or four characters at a time rather than going
+ * through the per byte state machine.
+ */
+
+static const gchar ENCODE[] =
+  "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+#define XX 0xff /* Invalid, skipped */
+#define PP 0xfe /* Padding */
+
+static const guint8 DECODE[256] = {
+  XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+  XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+  XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, 62, XX, XX, XX, 63,
+  52, 53, 54, 55, 56, 57, 58, 59, 60, 61, XX, XX, XX, PP, XX, XX,
+  XX,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+  15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, XX, XX, XX, XX, XX,
+  XX, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+  41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, XX, XX, XX, XX, XX,
+  XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+  XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+  XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+  XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+  XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+  XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+  XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+  XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+};
+
+/**
+ * cockpit_base64_encode:
+ * @data: the data to encode
+ * @length: length of the data
+ * @out: output buffer of COCKPIT_BASE64_ENCODED_MAX(length) bytes
+ *
+ * Encode @data as base64 without line breaks. The output is
+ * not null terminated.
+ *
+ * Returns: the number of characters written to @out
+ */
+gsize
+cockpit_base64_encode (gconstpointer data,
+                       gsize length,
+                       gchar *out)
+{
+  const guint8 *in = data;
+  const guint8 *end = in + length;
+  gchar *outptr = out;
+  guint32 v;
+
+  while (end - in >= 3)
+    {
+      v = (in[0] << 16) | (in[1] << 8) | in[2];
+      outptr[0] = ENCODE[(v >> 18) & 0x3f];
+      outptr[1] = ENCODE[(v >> 12) & 0x3f];
+      outptr[2] = ENCODE[(v >> 6) & 0x3f];
+      outptr[3] = ENCODE[v & 0x3f];
+      outptr += 4;
+      in += 3;
+    }
+
+  if (end - in == 2)
+    {
+      v = (in[0] << 16) | (in[1] << 8);
+      outptr[0] = ENCODE[(v >> 18) & 0x3f];
+      outptr[1] = ENCODE[(v >> 12) & 0x3f];
+      outptr[2] = ENCODE[(v >> 6) & 0x3f];
+      outptr[3] = '=';
+      outptr += 4;
+    }
+  else if (end - in == 1)
+    {
+      v = in[0] << 16;
+      outptr[0] = ENCODE[(v >> 18) & 0x3f];
+      outptr[1] = ENCODE[(v >> 12) & 0x3f];
+      outptr[2] = '=';
+      outptr[3] = '=';
+      outptr += 4;
+    }
+
+  return outptr - out;
+}
+
+/**
+ * cockpit_base64_decode:
+ * @data: the base64 characters
+ * @length: number of characters
+ * @out: output buffer of COCKPIT_BASE64_DECODED_MAX(length) bytes
+ *
+ * Decode base64 data. As with g_base64_decode_step() characters
+ * outside of the base64 alphabet are skipped. The output is never
+ * ahead of the input, so @out may be the same as @data to decode
+ * in place.
+ *
+ * Returns: the number of bytes written to @out
+ */
+gsize
+cockpit_base64_decode (const gchar *data,
+                       gsize length,
+                       guchar *out)
+{
+  const guint8 *in = (const guint8 *)data;
+  const guint8 *end = in + length;
+  guchar *outptr = out;
+  guint8 a, b, c, d;
+  guint8 last[2] = { 0, 0 };
+  guint32 v = 0;
+  guint8 rank;
+  gint i = 0;
+
+  /* Whole groups of four valid characters without padding */
+  while (end - in >= 4)
+    {
+      a = DECODE[in[0]];
+      b = DECODE[in[1]];
+      c = DECODE[in[2]];
+      d = DECODE[in[3]];
+      if ((a | b | c | d) & 0xc0)
+        break;
+      v = (a << 18) | (b << 12) | (c << 6) | d;
+      outptr[0] = v >> 16;
+      outptr[1] = v >> 8;
+      outptr[2] = v;
+      outptr += 3;
+      in += 4;
+    }
+
+  /* Anything else, one character at a time */
+  v = 0;
+  while (in < end)
+    {
+      rank = DECODE[*in];
+      if (rank != XX)
+        {
+          last[1] = last[0];
+          last[0] = *in;
+          v = (v << 6) | (rank == PP ? 0 : rank);
+          if (++i == 4)
+            {
+              *outptr++ = v >> 16;
+              if (last[1] != '=')
+                *outptr++ = v >> 8;
+              if (last[0] != '=')
+                *outptr++ = v;
+              i = 0;
+            }
+        }
+      in++;
+    }
+
+  return outptr - out;
+}
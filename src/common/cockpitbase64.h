@@ -0,0 +1,41 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2016 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __COCKPIT_BASE64_H__
+#define __COCKPIT_BASE64_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define          COCKPIT_BASE64_ENCODED_MAX(n)  ((((n) + 2) / 3) * 4)
+
+#define          COCKPIT_BASE64_DECODED_MAX(n)  (((n) / 4) * 3 + 3)
+
+gsize            cockpit_base64_encode         (gconstpointer data,
+                                                gsize length,
+                                                gchar *out);
+
+gsize            cockpit_base64_decode         (const gchar *data,
+                                                gsize length,
+                                                guchar *out);
+
+G_END_DECLS
+
+#endif
@@ -31,6 +31,13 @@ gchar *             cockpit_certificate_locate   (gboolean create_if_necessary,
 GTlsCertificate *   cockpit_certificate_load     (const gchar *path,
                                                   GError **error);
 
+gboolean            cockpit_certificate_generate (const gchar *path,
+                                                  const gchar *key_type,
+                                                  GError **error);
+
+/* Key type of the certificate that cockpit_certificate_locate() generates */
+extern const gchar *cockpit_certificate_key_type;
+
 G_END_DECLS
 
 #endif /* __COCKPIT_CERTIFICATE_H__ */
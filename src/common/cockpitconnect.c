@@ -67,10 +67,174 @@ cockpit_connectable_unref (gpointer data)
     }
 }
 
+/*
+ * Resolved addresses of host names are cached, so that channels which
+ * connect to the same place over and over don't resolve it every time.
+ * GResolver doesn't tell us the TTL of the records, so entries expire
+ * after a fixed time. Host names that don't exist are cached for a
+ * shorter time.
+ */
+
+/* Overridable from tests, in seconds */
+guint cockpit_connect_cache_ttl = 30;
+guint cockpit_connect_negative_ttl = 5;
+
+/* Milliseconds before also trying the next address */
+guint cockpit_connect_attempt_delay = 250;
+
+#define CACHE_MAX_ENTRIES 256
+
+typedef struct {
+  GList *addresses;
+  GError *error;
+  gint64 expires;
+} CacheEntry;
+
+G_LOCK_DEFINE_STATIC (cache);
+static GHashTable *cache = NULL;
+
+static void
+cache_entry_free (gpointer data)
+{
+  CacheEntry *entry = data;
+  g_list_free_full (entry->addresses, g_object_unref);
+  g_clear_error (&entry->error);
+  g_free (entry);
+}
+
+static gchar *
+cache_key_for_address (GSocketConnectable *address)
+{
+  GNetworkAddress *network;
+  const gchar *hostname;
+
+  if (!G_IS_NETWORK_ADDRESS (address))
+    return NULL;
+
+  network = G_NETWORK_ADDRESS (address);
+  hostname = g_network_address_get_hostname (network);
+
+  /* Nothing to resolve */
+  if (!hostname || g_hostname_is_ip_address (hostname))
+    return NULL;
+
+  return g_strdup_printf ("%s:%u", hostname, (guint)g_network_address_get_port (network));
+}
+
+static gboolean
+cache_lookup (const gchar *key,
+              GList **addresses,
+              GError **error)
+{
+  CacheEntry *entry;
+  gboolean ret = FALSE;
+
+  G_LOCK (cache);
+
+  entry = cache ? g_hash_table_lookup (cache, key) : NULL;
+  if (entry && entry->expires <= g_get_monotonic_time ())
+    {
+      g_hash_table_remove (cache, key);
+      entry = NULL;
+    }
+
+  if (entry)
+    {
+      if (entry->error)
+        g_propagate_error (error, g_error_copy (entry->error));
+      else
+        *addresses = g_list_copy_deep (entry->addresses, (GCopyFunc)g_object_ref, NULL);
+      ret = TRUE;
+    }
+
+  G_UNLOCK (cache);
+  return ret;
+}
+
+static gboolean
+remove_expired (gpointer key,
+                gpointer value,
+                gpointer user_data)
+{
+  CacheEntry *entry = value;
+  gint64 *now = user_data;
+  return entry->expires <= *now;
+}
+
+static void
+cache_store (const gchar *key,
+             GList *addresses,
+             const GError *error)
+{
+  CacheEntry *entry;
+  gint64 now;
+  guint ttl;
+
+  ttl = error ? cockpit_connect_negative_ttl : cockpit_connect_cache_ttl;
+  if (ttl == 0)
+    return;
+
+  now = g_get_monotonic_time ();
+
+  G_LOCK (cache);
+
+  if (!cache)
+    cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, cache_entry_free);
+
+  if (g_hash_table_size (cache) >= CACHE_MAX_ENTRIES)
+    {
+      g_hash_table_foreach_remove (cache, remove_expired, &now);
+      if (g_hash_table_size (cache) >= CACHE_MAX_ENTRIES)
+        g_hash_table_remove_all (cache);
+    }
+
+  entry = g_new0 (CacheEntry, 1);
+  entry->expires = now + ttl * G_USEC_PER_SEC;
+  if (error)
+    entry->error = g_error_copy (error);
+  else
+    entry->addresses = g_list_copy_deep (addresses, (GCopyFunc)g_object_ref, NULL);
+  g_hash_table_replace (cache, g_strdup (key), entry);
+
+  G_UNLOCK (cache);
+}
+
+static void
+cache_remove (const gchar *key)
+{
+  G_LOCK (cache);
+  if (cache)
+    g_hash_table_remove (cache, key);
+  G_UNLOCK (cache);
+}
+
+/**
+ * cockpit_connect_cache_clear:
+ *
+ * Forget all cached host name resolutions.
+ */
+void
+cockpit_connect_cache_clear (void)
+{
+  G_LOCK (cache);
+  if (cache)
+    g_hash_table_remove_all (cache);
+  G_UNLOCK (cache);
+}
+
 typedef struct {
   CockpitConnectable *connectable;
   GSocketAddressEnumerator *enumerator;
   GCancellable *cancellable;
+  gulong cancel_sig;
+  GCancellable *attempts;
+  gchar *cache_key;
+  gboolean cached;
+  GList *resolved;
+  GQueue addresses;
+  guint pending;
+  guint delay_timeout;
+  gboolean complete;
   GIOStream *io;
   GError *error;
 } ConnectStream;
@@ -82,8 +246,18 @@ connect_stream_free (gpointer data)
   if (cs->connectable)
     cockpit_connectable_unref (cs->connectable);
   if (cs->cancellable)
-    g_object_unref (cs->cancellable);
-  g_object_unref (cs->enumerator);
+    {
+      g_cancellable_disconnect (cs->cancellable, cs->cancel_sig);
+      g_object_unref (cs->cancellable);
+    }
+  g_object_unref (cs->attempts);
+  if (cs->enumerator)
+    g_object_unref (cs->enumerator);
+  g_assert (cs->delay_timeout == 0);
+  while (!g_queue_is_empty (&cs->addresses))
+    g_object_unref (g_queue_pop_head (&cs->addresses));
+  g_list_free_full (cs->resolved, g_object_unref);
+  g_free (cs->cache_key);
   g_clear_error (&cs->error);
   if (cs->io)
     g_object_unref (cs->io);
@@ -91,9 +265,49 @@ connect_stream_free (gpointer data)
 }
 
 static void
-on_address_next (GObject *object,
-                 GAsyncResult *result,
-                 gpointer user_data);
+on_cancelled (GCancellable *cancellable,
+              gpointer user_data)
+{
+  g_cancellable_cancel (user_data);
+}
+
+static void
+connect_complete (GSimpleAsyncResult *simple)
+{
+  ConnectStream *cs = g_simple_async_result_get_op_res_gpointer (simple);
+
+  if (cs->complete)
+    return;
+
+  cs->complete = TRUE;
+  if (cs->delay_timeout)
+    {
+      g_source_remove (cs->delay_timeout);
+      cs->delay_timeout = 0;
+    }
+
+  /* The host may have moved, don't keep trying the same addresses */
+  if (!cs->io && cs->cached && !g_cancellable_is_cancelled (cs->attempts))
+    cache_remove (cs->cache_key);
+
+  /* Stop any other attempts still in flight */
+  g_cancellable_cancel (cs->attempts);
+
+  g_simple_async_result_complete_in_idle (simple);
+}
+
+static void start_attempt (GSimpleAsyncResult *simple);
+
+static gboolean
+on_attempt_delay (gpointer user_data)
+{
+  GSimpleAsyncResult *simple = G_SIMPLE_ASYNC_RESULT (user_data);
+  ConnectStream *cs = g_simple_async_result_get_op_res_gpointer (simple);
+
+  cs->delay_timeout = 0;
+  start_attempt (simple);
+  return FALSE;
+}
 
 static void
 on_socket_connect (GObject *object,
@@ -107,16 +321,27 @@ on_socket_connect (GObject *object,
 
   g_socket_connection_connect_finish (G_SOCKET_CONNECTION (object), result, &error);
 
-  g_debug ("%s: connected", connectable->name);
+  g_assert (cs->pending > 0);
+  cs->pending--;
 
-  if (error)
+  if (cs->complete)
+    {
+      /* Another attempt won */
+      g_clear_error (&error);
+    }
+  else if (error)
     {
       g_debug ("%s: couldn't connect: %s", connectable->name, error->message);
       g_clear_error (&cs->error);
       cs->error = error;
 
-      g_socket_address_enumerator_next_async (cs->enumerator, cs->cancellable,
-                                              on_address_next, g_object_ref (simple));
+      /* Don't wait for the delay, move on to the next address now */
+      if (cs->delay_timeout)
+        {
+          g_source_remove (cs->delay_timeout);
+          cs->delay_timeout = 0;
+        }
+      start_attempt (simple);
     }
   else
     {
@@ -153,19 +378,22 @@ on_socket_connect (GObject *object,
           cs->io = g_object_ref (object);
         }
 
-      g_simple_async_result_complete (simple);
+      connect_complete (simple);
     }
 
   g_object_unref (object);
   g_object_unref (simple);
 }
 
+/*
+ * Try the next address. If it doesn't connect quickly, the next one
+ * after that is tried in parallel, and whichever connects first is used.
+ * Since addresses alternate between families, this way a broken IPv6
+ * route doesn't hold up connecting over IPv4, or the other way around.
+ */
 static void
-on_address_next (GObject *object,
-                 GAsyncResult *result,
-                 gpointer user_data)
+start_attempt (GSimpleAsyncResult *simple)
 {
-  GSimpleAsyncResult *simple = G_SIMPLE_ASYNC_RESULT (user_data);
   ConnectStream *cs = g_simple_async_result_get_op_res_gpointer (simple);
   CockpitConnectable *connectable = cs->connectable;
   GSocketConnection *connection;
@@ -173,18 +401,10 @@ on_address_next (GObject *object,
   GError *error = NULL;
   GSocket *sock;
 
-  address = g_socket_address_enumerator_next_finish (G_SOCKET_ADDRESS_ENUMERATOR (object),
-                                                     result, &error);
-
-  if (error)
-    {
-      g_debug ("%s: couldn't resolve: %s", connectable->name, error->message);
-      g_clear_error (&cs->error);
-      cs->error = error;
-      g_simple_async_result_complete (simple);
-    }
-  else if (address)
+  while (!cs->complete && !g_queue_is_empty (&cs->addresses) &&
+         !g_cancellable_is_cancelled (cs->attempts))
     {
+      address = g_queue_pop_head (&cs->addresses);
       sock = g_socket_new (g_socket_address_get_family (address), G_SOCKET_TYPE_STREAM, 0, &error);
       if (sock)
         {
@@ -193,26 +413,106 @@ on_address_next (GObject *object,
           connection = g_socket_connection_factory_create_connection (sock);
           g_object_unref (sock);
 
-          g_socket_connection_connect_async (connection, address, cs->cancellable,
+          cs->pending++;
+          g_socket_connection_connect_async (connection, address, cs->attempts,
                                              on_socket_connect, g_object_ref (simple));
-        }
+          g_object_unref (address);
 
-      if (error)
-        {
-          g_debug ("%s: couldn't open socket: %s", connectable->name, error->message);
-          g_clear_error (&cs->error);
-          cs->error = error;
-          g_simple_async_result_complete (simple);
+          if (!g_queue_is_empty (&cs->addresses) && cockpit_connect_attempt_delay > 0)
+            {
+              g_assert (cs->delay_timeout == 0);
+              cs->delay_timeout = g_timeout_add_full (G_PRIORITY_DEFAULT, cockpit_connect_attempt_delay,
+                                                      on_attempt_delay, g_object_ref (simple),
+                                                      g_object_unref);
+            }
+          return;
         }
+
+      g_debug ("%s: couldn't open socket: %s", connectable->name, error->message);
+      g_clear_error (&cs->error);
+      cs->error = error;
+      error = NULL;
       g_object_unref (address);
     }
-  else
+
+  if (cs->pending == 0)
+    {
+      if (!cs->error && !g_cancellable_set_error_if_cancelled (cs->attempts, &cs->error))
+        g_message ("%s: no addresses found", connectable->name);
+      connect_complete (simple);
+    }
+}
+
+/* Alternate between address families, starting with the first one */
+static void
+queue_addresses (ConnectStream *cs,
+                 GList *addresses)
+{
+  GQueue first = G_QUEUE_INIT;
+  GQueue other = G_QUEUE_INIT;
+  GSocketFamily family = G_SOCKET_FAMILY_INVALID;
+  GSocketAddress *address;
+  GList *l;
+
+  for (l = addresses; l != NULL; l = g_list_next (l))
     {
-      if (!cs->error)
-          g_message ("%s: no addresses found", connectable->name);
-      g_simple_async_result_complete (simple);
+      address = l->data;
+      if (family == G_SOCKET_FAMILY_INVALID)
+        family = g_socket_address_get_family (address);
+      if (g_socket_address_get_family (address) == family)
+        g_queue_push_tail (&first, g_object_ref (address));
+      else
+        g_queue_push_tail (&other, g_object_ref (address));
     }
 
+  while (!g_queue_is_empty (&first) || !g_queue_is_empty (&other))
+    {
+      if (!g_queue_is_empty (&first))
+        g_queue_push_tail (&cs->addresses, g_queue_pop_head (&first));
+      if (!g_queue_is_empty (&other))
+        g_queue_push_tail (&cs->addresses, g_queue_pop_head (&other));
+    }
+}
+
+static void
+on_address_next (GObject *object,
+                 GAsyncResult *result,
+                 gpointer user_data)
+{
+  GSimpleAsyncResult *simple = G_SIMPLE_ASYNC_RESULT (user_data);
+  ConnectStream *cs = g_simple_async_result_get_op_res_gpointer (simple);
+  CockpitConnectable *connectable = cs->connectable;
+  GSocketAddress *address;
+  GError *error = NULL;
+
+  address = g_socket_address_enumerator_next_finish (G_SOCKET_ADDRESS_ENUMERATOR (object),
+                                                     result, &error);
+
+  if (error)
+    {
+      g_debug ("%s: couldn't resolve: %s", connectable->name, error->message);
+      if (cs->cache_key && !cs->resolved &&
+          g_error_matches (error, G_RESOLVER_ERROR, G_RESOLVER_ERROR_NOT_FOUND))
+        cache_store (cs->cache_key, NULL, error);
+      g_clear_error (&cs->error);
+      cs->error = error;
+    }
+  else if (address)
+    {
+      /* Collect all the addresses before connecting to any */
+      cs->resolved = g_list_prepend (cs->resolved, address);
+      g_socket_address_enumerator_next_async (cs->enumerator, cs->cancellable,
+                                              on_address_next, simple);
+      return;
+    }
+
+  cs->resolved = g_list_reverse (cs->resolved);
+  if (cs->cache_key && cs->resolved && !error)
+    cache_store (cs->cache_key, cs->resolved, NULL);
+
+  queue_addresses (cs, cs->resolved);
+  start_attempt (simple);
+
   g_object_unref (simple);
 }
 
@@ -237,6 +537,8 @@ cockpit_connect_stream_full (CockpitConnectable *connectable,
                              gpointer user_data)
 {
   GSimpleAsyncResult *simple;
+  GList *addresses = NULL;
+  GError *error = NULL;
   ConnectStream *cs;
 
   g_return_if_fail (connectable != NULL);
@@ -246,16 +548,44 @@ cockpit_connect_stream_full (CockpitConnectable *connectable,
   simple = g_simple_async_result_new (NULL, callback, user_data, cockpit_connect_stream);
   cs = g_new0 (ConnectStream, 1);
   cs->connectable = cockpit_connectable_ref (connectable);
-  cs->cancellable = cancellable ? g_object_ref (cancellable) : NULL;
-  cs->enumerator = g_socket_connectable_enumerate (connectable->address);
+  cs->attempts = g_cancellable_new ();
+  if (cancellable)
+    {
+      cs->cancellable = g_object_ref (cancellable);
+      cs->cancel_sig = g_cancellable_connect (cancellable, G_CALLBACK (on_cancelled),
+                                              cs->attempts, NULL);
+    }
+  cs->cache_key = cache_key_for_address (connectable->address);
   g_simple_async_result_set_op_res_gpointer (simple, cs, connect_stream_free);
 
-  g_socket_address_enumerator_next_async (cs->enumerator, NULL,
-                                          on_address_next, g_object_ref (simple));
+  if (cs->cache_key && cache_lookup (cs->cache_key, &addresses, &error))
+    {
+      g_debug ("%s: using cached addresses for %s", cs->connectable->name, cs->cache_key);
+
+      if (error)
+        {
+          cs->error = error;
+          connect_complete (simple);
+        }
+      else
+        {
+          cs->cached = TRUE;
+          queue_addresses (cs, addresses);
+          g_list_free_full (addresses, g_object_unref);
+          start_attempt (simple);
+        }
+    }
+  else
+    {
+      cs->enumerator = g_socket_connectable_enumerate (connectable->address);
+      g_socket_address_enumerator_next_async (cs->enumerator, NULL,
+                                              on_address_next, g_object_ref (simple));
+    }
 
   g_object_unref (simple);
 }
 
+
 GIOStream *
 cockpit_connect_stream_finish (GAsyncResult *result,
                                GError **error)
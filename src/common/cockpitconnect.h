@@ -57,6 +57,8 @@ void                    cockpit_connect_stream_full   (CockpitConnectable *conne
 GIOStream *             cockpit_connect_stream_finish (GAsyncResult *result,
                                                        GError **error);
 
+void                    cockpit_connect_cache_clear   (void);
+
 G_END_DECLS
 
 #endif /* __COCKPIT_STREAM_H__ */
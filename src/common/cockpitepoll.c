@@ -0,0 +1,511 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2016 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitepoll.h"
+
+#include "cockpitunixfd.h"
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+#include <errno.h>
+#include <unistd.h>
+
+/*
+ * A drop in for cockpit_unix_fd_source_new(), for processes that watch
+ * many file descriptors. Each of those sources normally adds its fd to
+ * the glib poll, which then goes through all of them on every iteration.
+ * These sources instead share one epoll instance per main context, and
+ * only its fd is polled. A driver source checks the epoll instance once
+ * per iteration, and marks which sources are ready.
+ *
+ * The epoll instance is level triggered, so these sources behave just
+ * like poll() based ones: if a callback doesn't read everything, it is
+ * called again on the next iteration.
+ *
+ * The watched fd is added to the epoll instance the first time the source
+ * is prepared, that is once it's attached. It must be removed again with
+ * cockpit_epoll_source_destroy() before the fd is closed. Where epoll can't
+ * watch the fd, such as for regular files, the source falls back to
+ * polling the fd like any other. Sources destroyed some other way, such
+ * as by returning FALSE from their callback, stop being watched the next
+ * time their fd is reported.
+ */
+
+/* Run before the sources marked ready */
+#define DRIVER_PRIORITY  G_PRIORITY_HIGH
+
+#define MAX_EVENTS       64
+
+typedef struct {
+  GSource source;
+  GPollFD pollfd;
+  GHashTable *entries;
+  guint64 generation;
+  gboolean collected;
+  guint users;
+} CockpitEpollDriver;
+
+/* Sources for the same fd share one epoll registration */
+typedef struct {
+  gint fd;
+  guint32 events;
+  gboolean added;
+  GList *sources;
+} CockpitEpollEntry;
+
+typedef struct {
+  GSource source;
+  GPollFD pollfd;
+  GIOCondition condition;
+  GIOCondition revents;
+  guint64 generation;
+  CockpitEpollDriver *driver;
+  gboolean fallback;
+} CockpitEpollSource;
+
+G_LOCK_DEFINE_STATIC (drivers);
+static GHashTable *drivers = NULL;
+static guint source_count = 0;
+
+#ifdef __linux__
+
+static guint32
+condition_to_epoll (GIOCondition condition)
+{
+  guint32 events = 0;
+  if (condition & G_IO_IN)
+    events |= EPOLLIN;
+  if (condition & G_IO_OUT)
+    events |= EPOLLOUT;
+  if (condition & G_IO_PRI)
+    events |= EPOLLPRI;
+  return events;
+}
+
+static GIOCondition
+epoll_to_condition (guint32 events)
+{
+  GIOCondition condition = 0;
+  if (events & EPOLLIN)
+    condition |= G_IO_IN;
+  if (events & EPOLLOUT)
+    condition |= G_IO_OUT;
+  if (events & EPOLLPRI)
+    condition |= G_IO_PRI;
+  if (events & EPOLLERR)
+    condition |= G_IO_ERR;
+  if (events & EPOLLHUP)
+    condition |= G_IO_HUP;
+  return condition;
+}
+
+static gint entry_sync (CockpitEpollDriver *driver,
+                        CockpitEpollEntry *entry);
+
+static void
+driver_collect (CockpitEpollDriver *driver)
+{
+  struct epoll_event events[MAX_EVENTS];
+  CockpitEpollEntry *entry;
+  CockpitEpollSource *es;
+  GList *l;
+  gint n, i;
+
+  if (driver->collected)
+    return;
+  driver->collected = TRUE;
+
+  if (!(driver->pollfd.revents & G_IO_IN))
+    return;
+
+  n = epoll_wait (driver->pollfd.fd, events, MAX_EVENTS, 0);
+  if (n < 0)
+    {
+      if (errno != EINTR && errno != EAGAIN)
+        g_warning ("couldn't check epoll events: %s", g_strerror (errno));
+      return;
+    }
+
+  /* More than MAX_EVENTS show up again on the next iteration */
+  for (i = 0; i < n; i++)
+    {
+      entry = g_hash_table_lookup (driver->entries, GINT_TO_POINTER (events[i].data.fd));
+      if (!entry)
+        continue;
+      for (l = entry->sources; l != NULL; l = g_list_next (l))
+        {
+          es = l->data;
+          es->revents = epoll_to_condition (events[i].events);
+          es->generation = driver->generation;
+        }
+
+      /* Don't keep reporting fds nobody dispatches anymore */
+      if (entry_sync (driver, entry) < 0)
+        g_warning ("couldn't change epoll events: %s", g_strerror (errno));
+    }
+}
+
+static gboolean
+driver_prepare (GSource *source,
+                gint *timeout)
+{
+  CockpitEpollDriver *driver = (CockpitEpollDriver *)source;
+
+  /* A new iteration, nothing from previous ones counts anymore */
+  driver->generation++;
+  driver->collected = FALSE;
+  driver->pollfd.revents = 0;
+  *timeout = -1;
+  return FALSE;
+}
+
+static gboolean
+driver_check (GSource *source)
+{
+  driver_collect ((CockpitEpollDriver *)source);
+  return FALSE;
+}
+
+static gboolean
+driver_dispatch (GSource *source,
+                 GSourceFunc callback,
+                 gpointer user_data)
+{
+  return TRUE;
+}
+
+static void
+driver_finalize (GSource *source)
+{
+  CockpitEpollDriver *driver = (CockpitEpollDriver *)source;
+  g_hash_table_destroy (driver->entries);
+  close (driver->pollfd.fd);
+}
+
+static GSourceFuncs driver_funcs = {
+  driver_prepare,
+  driver_check,
+  driver_dispatch,
+  driver_finalize,
+};
+
+static void
+entry_free (gpointer data)
+{
+  CockpitEpollEntry *entry = data;
+  g_list_free (entry->sources);
+  g_free (entry);
+}
+
+static CockpitEpollDriver *
+driver_ref_for_context (GMainContext *context)
+{
+  CockpitEpollDriver *driver;
+  GSource *source;
+  gint epfd;
+
+  G_LOCK (drivers);
+
+  if (!drivers)
+    drivers = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+  driver = g_hash_table_lookup (drivers, context);
+  if (!driver)
+    {
+      epfd = epoll_create1 (EPOLL_CLOEXEC);
+      if (epfd < 0)
+        {
+          g_warning ("couldn't create epoll instance: %s", g_strerror (errno));
+        }
+      else
+        {
+          source = g_source_new (&driver_funcs, sizeof (CockpitEpollDriver));
+          g_source_set_name (source, "epoll-driver");
+          g_source_set_priority (source, DRIVER_PRIORITY);
+          driver = (CockpitEpollDriver *)source;
+          driver->entries = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, entry_free);
+          driver->pollfd.fd = epfd;
+          driver->pollfd.events = G_IO_IN;
+          g_source_add_poll (source, &driver->pollfd);
+          g_source_attach (source, context);
+          g_hash_table_insert (drivers, context, driver);
+        }
+    }
+
+  if (driver)
+    driver->users++;
+
+  G_UNLOCK (drivers);
+  return driver;
+}
+
+static void
+driver_unref (CockpitEpollDriver *driver,
+              GMainContext *context)
+{
+  G_LOCK (drivers);
+
+  g_assert (driver->users > 0);
+  driver->users--;
+  if (driver->users == 0)
+    {
+      g_hash_table_remove (drivers, context);
+      g_source_destroy ((GSource *)driver);
+      g_source_unref ((GSource *)driver);
+    }
+
+  G_UNLOCK (drivers);
+}
+
+static gint
+entry_sync (CockpitEpollDriver *driver,
+            CockpitEpollEntry *entry)
+{
+  struct epoll_event event = { 0, };
+  GSource *source;
+  gboolean live = FALSE;
+  gint op;
+  GList *l;
+
+  event.events = 0;
+  for (l = entry->sources; l != NULL; l = g_list_next (l))
+    {
+      source = l->data;
+      if (g_source_is_destroyed (source))
+        continue;
+      event.events |= condition_to_epoll (((CockpitEpollSource *)source)->condition);
+      live = TRUE;
+    }
+  event.data.fd = entry->fd;
+
+  if (!live)
+    {
+      if (!entry->added)
+        return 0;
+      entry->added = FALSE;
+      if (epoll_ctl (driver->pollfd.fd, EPOLL_CTL_DEL, entry->fd, NULL) < 0 && errno != EBADF)
+        return -1;
+      return 0;
+    }
+
+  if (entry->added && entry->events == event.events)
+    return 0;
+
+  op = entry->added ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+  if (epoll_ctl (driver->pollfd.fd, op, entry->fd, &event) < 0)
+    return -1;
+
+  entry->added = TRUE;
+  entry->events = event.events;
+  return 0;
+}
+
+static void
+source_register (CockpitEpollSource *es)
+{
+  GSource *source = (GSource *)es;
+  CockpitEpollEntry *entry;
+  CockpitEpollDriver *driver;
+  GMainContext *context;
+  gint fd = es->pollfd.fd;
+
+  context = g_source_get_context (source);
+  driver = driver_ref_for_context (context);
+  if (!driver)
+    goto fallback;
+
+  entry = g_hash_table_lookup (driver->entries, GINT_TO_POINTER (fd));
+  if (!entry)
+    {
+      entry = g_new0 (CockpitEpollEntry, 1);
+      entry->fd = fd;
+      g_hash_table_insert (driver->entries, GINT_TO_POINTER (fd), entry);
+    }
+
+  entry->sources = g_list_prepend (entry->sources, es);
+  if (entry_sync (driver, entry) < 0)
+    {
+      /* Such as EPERM for regular files, which are always ready anyway */
+      if (errno != EPERM)
+        g_warning ("couldn't add fd to epoll: %s", g_strerror (errno));
+      entry->sources = g_list_remove (entry->sources, es);
+      if (!entry->sources)
+        g_hash_table_remove (driver->entries, GINT_TO_POINTER (fd));
+      driver_unref (driver, context);
+      goto fallback;
+    }
+
+  es->driver = driver;
+  return;
+
+fallback:
+  es->fallback = TRUE;
+  g_source_add_poll (source, &es->pollfd);
+}
+
+static void
+source_unregister (CockpitEpollSource *es)
+{
+  CockpitEpollDriver *driver = es->driver;
+  CockpitEpollEntry *entry;
+  gint fd = es->pollfd.fd;
+
+  if (!driver)
+    return;
+
+  es->driver = NULL;
+
+  entry = g_hash_table_lookup (driver->entries, GINT_TO_POINTER (fd));
+  g_return_if_fail (entry != NULL);
+
+  entry->sources = g_list_remove (entry->sources, es);
+  if (entry_sync (driver, entry) < 0)
+    g_warning ("couldn't change epoll events: %s", g_strerror (errno));
+  if (!entry->sources)
+    g_hash_table_remove (driver->entries, GINT_TO_POINTER (fd));
+
+  driver_unref (driver, g_source_get_context ((GSource *)driver));
+}
+
+#else /* !__linux__ */
+
+static void
+source_register (CockpitEpollSource *es)
+{
+  es->fallback = TRUE;
+  g_source_add_poll ((GSource *)es, &es->pollfd);
+}
+
+static void
+source_unregister (CockpitEpollSource *es)
+{
+}
+
+#endif /* __linux__ */
+
+static gboolean
+epoll_source_prepare (GSource *source,
+                      gint *timeout)
+{
+  CockpitEpollSource *es = (CockpitEpollSource *)source;
+
+  if (!es->driver && !es->fallback)
+    source_register (es);
+
+  es->pollfd.revents = 0;
+  *timeout = -1;
+  return FALSE;
+}
+
+static gboolean
+epoll_source_check (GSource *source)
+{
+  CockpitEpollSource *es = (CockpitEpollSource *)source;
+
+  if (es->fallback)
+    {
+      es->revents = es->pollfd.revents;
+      return (es->revents & es->condition) != 0;
+    }
+
+#ifdef __linux__
+  /* Usually the driver already did this, unless it's later in line */
+  if (es->driver)
+    driver_collect (es->driver);
+#endif
+
+  return es->driver && es->generation == es->driver->generation &&
+         (es->revents & es->condition) != 0;
+}
+
+static gboolean
+epoll_source_dispatch (GSource *source,
+                       GSourceFunc callback,
+                       gpointer user_data)
+{
+  CockpitUnixFdFunc func = (CockpitUnixFdFunc)callback;
+  CockpitEpollSource *es = (CockpitEpollSource *)source;
+  GIOCondition revents;
+
+  /* Only once per readiness */
+  revents = es->revents & es->condition;
+  es->revents = 0;
+
+  return (* func) (es->pollfd.fd, revents, user_data);
+}
+
+static void
+epoll_source_finalize (GSource *source)
+{
+  source_unregister ((CockpitEpollSource *)source);
+  g_atomic_int_add (&source_count, -1);
+}
+
+static GSourceFuncs epoll_source_funcs = {
+  epoll_source_prepare,
+  epoll_source_check,
+  epoll_source_dispatch,
+  epoll_source_finalize,
+};
+
+GSource *
+cockpit_epoll_source_new (gint fd,
+                          GIOCondition condition)
+{
+  CockpitEpollSource *es;
+  GSource *source;
+
+  condition |= G_IO_HUP | G_IO_ERR | G_IO_NVAL;
+
+  source = g_source_new (&epoll_source_funcs, sizeof (CockpitEpollSource));
+  es = (CockpitEpollSource *)source;
+  es->pollfd.fd = fd;
+  es->pollfd.events = condition;
+  es->condition = condition;
+
+  g_atomic_int_inc (&source_count);
+  return source;
+}
+
+/**
+ * cockpit_epoll_source_destroy:
+ * @source: a source from cockpit_epoll_source_new()
+ *
+ * Stop watching the fd and destroy the source. Also works on other
+ * sources, which are just destroyed. Call this before closing the fd, as
+ * an epoll instance can outlive the closing of one fd for its file.
+ */
+void
+cockpit_epoll_source_destroy (GSource *source)
+{
+  if (source->source_funcs == &epoll_source_funcs)
+    source_unregister ((CockpitEpollSource *)source);
+  g_source_destroy (source);
+}
+
+/* For tests: how many sources currently exist */
+guint
+cockpit_epoll_source_count (void)
+{
+  return g_atomic_int_get (&source_count);
+}
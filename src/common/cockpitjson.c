@@ -21,6 +21,7 @@
 
 #include "cockpitjson.h"
 
+#include <errno.h>
 #include <math.h>
 #include <string.h>
 
@@ -52,6 +53,34 @@ cockpit_json_get_int (JsonObject *object,
     }
 }
 
+gboolean
+cockpit_json_get_double (JsonObject *object,
+                         const gchar *name,
+                         gdouble defawlt,
+                         gdouble *value)
+{
+  JsonNode *node;
+
+  node = json_object_get_member (object, name);
+  if (!node)
+    {
+      if (value)
+        *value = defawlt;
+      return TRUE;
+    }
+  else if (json_node_get_value_type (node) == G_TYPE_INT64 ||
+           json_node_get_value_type (node) == G_TYPE_DOUBLE)
+    {
+      if (value)
+        *value = json_node_get_double (node);
+      return TRUE;
+    }
+  else
+    {
+      return FALSE;
+    }
+}
+
 gboolean
 cockpit_json_get_bool (JsonObject *object,
                        const gchar *name,
@@ -454,6 +483,760 @@ cockpit_json_int_equal (gconstpointer v1,
   return *((const guint64 *)v1) == *((const guint64 *)v2);
 }
 
+/*
+ * A tokenizer over JSON text that never allocates or builds nodes. Each
+ * function reads one token at scan->pos and moves past it. On invalid
+ * text it returns FALSE and scan->pos is left somewhere within the token.
+ * The JsonNode parser below, the control message scanner in the transport
+ * and the D-Bus argument parser are built on it.
+ */
+
+/**
+ * cockpit_json_scan_init:
+ * @scan: the scanner to initialize
+ * @data: JSON text, need not be nul terminated
+ * @length: length of @data
+ *
+ * Start scanning @data from its beginning.
+ */
+void
+cockpit_json_scan_init (CockpitJsonScan *scan,
+                        const gchar *data,
+                        gsize length)
+{
+  scan->pos = data;
+  scan->end = data + length;
+}
+
+/**
+ * cockpit_json_scan_space:
+ * @scan: a scanner
+ *
+ * Skip any white space.
+ */
+void
+cockpit_json_scan_space (CockpitJsonScan *scan)
+{
+  while (scan->pos < scan->end)
+    {
+      switch (*(scan->pos))
+        {
+        case ' ':
+        case '\t':
+        case '\n':
+        case '\r':
+          scan->pos++;
+          break;
+        default:
+          return;
+        }
+    }
+}
+
+/**
+ * cockpit_json_scan_peek:
+ * @scan: a scanner
+ *
+ * Skip any white space and look at what comes next.
+ *
+ * Returns: the next character, or nul at the end
+ */
+gchar
+cockpit_json_scan_peek (CockpitJsonScan *scan)
+{
+  cockpit_json_scan_space (scan);
+  return scan->pos < scan->end ? *(scan->pos) : '\0';
+}
+
+/**
+ * cockpit_json_scan_char:
+ * @scan: a scanner
+ * @ch: punctuation to expect
+ *
+ * Skip any white space, and then @ch if it comes next.
+ *
+ * Returns: whether @ch came next
+ */
+gboolean
+cockpit_json_scan_char (CockpitJsonScan *scan,
+                        gchar ch)
+{
+  if (cockpit_json_scan_peek (scan) != ch)
+    return FALSE;
+  scan->pos++;
+  return TRUE;
+}
+
+/**
+ * cockpit_json_scan_word:
+ * @scan: a scanner
+ * @word: "true", "false" or "null"
+ *
+ * Read @word if it is what comes next.
+ *
+ * Returns: whether @word came next
+ */
+gboolean
+cockpit_json_scan_word (CockpitJsonScan *scan,
+                        const gchar *word)
+{
+  gsize length = strlen (word);
+
+  if ((gsize)(scan->end - scan->pos) < length ||
+      memcmp (scan->pos, word, length) != 0)
+    return FALSE;
+  scan->pos += length;
+  return TRUE;
+}
+
+/**
+ * cockpit_json_scan_number:
+ * @scan: a scanner
+ * @is_double: optional location to return whether it had a fraction or exponent
+ *
+ * Read a number, without converting it. On failure @scan is not moved.
+ *
+ * Returns: whether a valid number came next
+ */
+gboolean
+cockpit_json_scan_number (CockpitJsonScan *scan,
+                          gboolean *is_double)
+{
+  const gchar *p = scan->pos;
+  gboolean dbl = FALSE;
+
+  if (p < scan->end && *p == '-')
+    p++;
+  if (p < scan->end && *p == '0')
+    {
+      p++;
+    }
+  else if (p < scan->end && *p >= '1' && *p <= '9')
+    {
+      while (p < scan->end && g_ascii_isdigit (*p))
+        p++;
+    }
+  else
+    {
+      return FALSE;
+    }
+
+  if (p < scan->end && *p == '.')
+    {
+      p++;
+      dbl = TRUE;
+      if (p == scan->end || !g_ascii_isdigit (*p))
+        return FALSE;
+      while (p < scan->end && g_ascii_isdigit (*p))
+        p++;
+    }
+
+  if (p < scan->end && (*p == 'e' || *p == 'E'))
+    {
+      p++;
+      dbl = TRUE;
+      if (p < scan->end && (*p == '+' || *p == '-'))
+        p++;
+      if (p == scan->end || !g_ascii_isdigit (*p))
+        return FALSE;
+      while (p < scan->end && g_ascii_isdigit (*p))
+        p++;
+    }
+
+  scan->pos = p;
+  if (is_double)
+    *is_double = dbl;
+  return TRUE;
+}
+
+/**
+ * cockpit_json_scan_chars:
+ * @scan: a scanner within a string
+ *
+ * Skip the run of characters in a string that stand for themselves.
+ * This stops at the closing quote, a backslash, a control character
+ * or the end.
+ *
+ * Returns: where the run started
+ */
+const gchar *
+cockpit_json_scan_chars (CockpitJsonScan *scan)
+{
+  const gchar *start = scan->pos;
+  guchar c;
+
+  while (scan->pos < scan->end)
+    {
+      c = *(scan->pos);
+      if (c == '"' || c == '\\' || c < 0x20)
+        break;
+      scan->pos++;
+    }
+
+  return start;
+}
+
+static gint
+scan_hex4 (CockpitJsonScan *scan)
+{
+  gint value = 0;
+  gint digit;
+  gint i;
+
+  if (scan->end - scan->pos < 4)
+    return -1;
+
+  for (i = 0; i < 4; i++)
+    {
+      digit = g_ascii_xdigit_value (scan->pos[i]);
+      if (digit < 0)
+        return -1;
+      value = (value << 4) | digit;
+    }
+
+  scan->pos += 4;
+  return value;
+}
+
+/**
+ * cockpit_json_scan_escape:
+ * @scan: a scanner at a backslash within a string
+ * @uc: optional location to return the character
+ *
+ * Read an escape sequence. A surrogate pair makes up one character,
+ * a lone surrogate is invalid.
+ *
+ * Returns: whether the escape was valid
+ */
+gboolean
+cockpit_json_scan_escape (CockpitJsonScan *scan,
+                          gunichar *uc)
+{
+  gunichar ch;
+  gint code;
+  gint low;
+
+  if (scan->end - scan->pos < 2 || *(scan->pos) != '\\')
+    return FALSE;
+
+  scan->pos++;
+  switch (*(scan->pos)++)
+    {
+    case '"':
+      ch = '"';
+      break;
+    case '\\':
+      ch = '\\';
+      break;
+    case '/':
+      ch = '/';
+      break;
+    case 'b':
+      ch = '\b';
+      break;
+    case 'f':
+      ch = '\f';
+      break;
+    case 'n':
+      ch = '\n';
+      break;
+    case 'r':
+      ch = '\r';
+      break;
+    case 't':
+      ch = '\t';
+      break;
+    case 'u':
+      code = scan_hex4 (scan);
+      if (code < 0)
+        return FALSE;
+      ch = code;
+
+      /* A surrogate pair encodes a character outside the BMP */
+      if (ch >= 0xDC00 && ch <= 0xDFFF)
+        return FALSE;
+      if (ch >= 0xD800 && ch <= 0xDBFF)
+        {
+          if (scan->end - scan->pos < 2 || scan->pos[0] != '\\' || scan->pos[1] != 'u')
+            return FALSE;
+          scan->pos += 2;
+          low = scan_hex4 (scan);
+          if (low < 0xDC00 || low > 0xDFFF)
+            return FALSE;
+          ch = 0x10000 + ((ch - 0xD800) << 10) + (low - 0xDC00);
+        }
+      break;
+    default:
+      return FALSE;
+    }
+
+  if (uc)
+    *uc = ch;
+  return TRUE;
+}
+
+/**
+ * cockpit_json_scan_string:
+ * @scan: a scanner at the opening quote of a string
+ * @value: optional location to return the text between the quotes
+ * @length: optional location to return the length of @value
+ * @escaped: optional location to return whether @value has escapes
+ *
+ * Read a string, checking its escapes, without unescaping it.
+ *
+ * Returns: whether a valid string came next
+ */
+gboolean
+cockpit_json_scan_string (CockpitJsonScan *scan,
+                          const gchar **value,
+                          gsize *length,
+                          gboolean *escaped)
+{
+  gboolean any = FALSE;
+  const gchar *start;
+
+  if (scan->pos == scan->end || *(scan->pos) != '"')
+    return FALSE;
+  start = ++scan->pos;
+
+  for (;;)
+    {
+      cockpit_json_scan_chars (scan);
+      if (scan->pos == scan->end)
+        return FALSE;
+      if (*(scan->pos) == '"')
+        break;
+      if (!cockpit_json_scan_escape (scan, NULL))
+        return FALSE;
+      any = TRUE;
+    }
+
+  if (value)
+    *value = start;
+  if (length)
+    *length = scan->pos - start;
+  if (escaped)
+    *escaped = any;
+  scan->pos++;
+  return TRUE;
+}
+
+/**
+ * cockpit_json_scan_skip:
+ * @scan: a scanner
+ * @depth: how many levels of objects and arrays to allow
+ *
+ * Skip any white space and a whole value, checking its structure.
+ *
+ * Returns: whether a valid value came next
+ */
+gboolean
+cockpit_json_scan_skip (CockpitJsonScan *scan,
+                        gint depth)
+{
+  gchar close;
+
+  switch (cockpit_json_scan_peek (scan))
+    {
+    case '"':
+      return cockpit_json_scan_string (scan, NULL, NULL, NULL);
+    case 't':
+      return cockpit_json_scan_word (scan, "true");
+    case 'f':
+      return cockpit_json_scan_word (scan, "false");
+    case 'n':
+      return cockpit_json_scan_word (scan, "null");
+    case '{':
+      close = '}';
+      break;
+    case '[':
+      close = ']';
+      break;
+    default:
+      return cockpit_json_scan_number (scan, NULL);
+    }
+
+  if (depth <= 0)
+    return FALSE;
+
+  scan->pos++;
+  if (cockpit_json_scan_char (scan, close))
+    return TRUE;
+
+  do
+    {
+      if (close == '}')
+        {
+          if (cockpit_json_scan_peek (scan) != '"' ||
+              !cockpit_json_scan_string (scan, NULL, NULL, NULL) ||
+              !cockpit_json_scan_char (scan, ':'))
+            return FALSE;
+        }
+      if (!cockpit_json_scan_skip (scan, depth - 1))
+        return FALSE;
+    }
+  while (cockpit_json_scan_char (scan, ','));
+
+  return cockpit_json_scan_char (scan, close);
+}
+
+/*
+ * A single pass parser that builds the JsonNode tree as it reads the
+ * data. Strings are unescaped into a scratch buffer and copied once into
+ * their node. JsonParser builds its own tree, which we then had to copy.
+ *
+ * Numbers follow JsonParser: without a fraction or exponent they are
+ * integers, and integers too large for a gint64 wrap around as they do
+ * there, which is what the D-Bus code expects for uint64 values.
+ */
+
+/* Deeper than this is surely not something we sent */
+#define JSON_MAX_DEPTH 1024
+
+typedef struct {
+  const gchar *data;
+  CockpitJsonScan scan;
+  GString *scratch;
+  gint depth;
+  GError **error;
+} JsonReader;
+
+static JsonNode *   read_value    (JsonReader *reader);
+
+static void
+scratch_free (gpointer data)
+{
+  g_string_free (data, TRUE);
+}
+
+static void
+read_error (JsonReader *reader,
+            gint code,
+            const gchar *message)
+{
+  if (reader->error && *(reader->error) == NULL)
+    {
+      g_set_error (reader->error, JSON_PARSER_ERROR, code,
+                   "JSON data has %s at offset %" G_GSIZE_FORMAT,
+                   message, (gsize)(reader->scan.pos - reader->data));
+    }
+}
+
+/* Leaves the unescaped string in reader->scratch */
+static gboolean
+read_string (JsonReader *reader)
+{
+  CockpitJsonScan *scan = &reader->scan;
+  const gchar *start;
+  gunichar uc;
+
+  g_assert (*(scan->pos) == '"');
+  scan->pos++;
+
+  g_string_set_size (reader->scratch, 0);
+
+  for (;;)
+    {
+      /* Copy runs of plain characters in one go */
+      start = cockpit_json_scan_chars (scan);
+      g_string_append_len (reader->scratch, start, scan->pos - start);
+
+      if (scan->pos == scan->end)
+        {
+          read_error (reader, JSON_PARSER_ERROR_PARSE, "an unterminated string");
+          return FALSE;
+        }
+
+      if (*(scan->pos) == '"')
+        {
+          scan->pos++;
+          return TRUE;
+        }
+
+      if (*(scan->pos) != '\\')
+        {
+          read_error (reader, JSON_PARSER_ERROR_PARSE, "a control character in a string");
+          return FALSE;
+        }
+
+      if (!cockpit_json_scan_escape (scan, &uc))
+        {
+          read_error (reader, JSON_PARSER_ERROR_PARSE, "an invalid escape in a string");
+          return FALSE;
+        }
+
+      g_string_append_unichar (reader->scratch, uc);
+    }
+}
+
+static JsonNode *
+read_number (JsonReader *reader)
+{
+  gboolean is_double;
+  gboolean negative;
+  const gchar *start;
+  gchar buffer[64];
+  gchar *string;
+  guint64 number;
+  JsonNode *node;
+  gsize length;
+  gchar *end;
+
+  start = reader->scan.pos;
+  if (!cockpit_json_scan_number (&reader->scan, &is_double))
+    {
+      read_error (reader, JSON_PARSER_ERROR_PARSE, "an invalid number");
+      return NULL;
+    }
+  negative = (*start == '-');
+
+  /* The data need not be null terminated */
+  length = reader->scan.pos - start;
+  if (length < sizeof (buffer))
+    {
+      memcpy (buffer, start, length);
+      buffer[length] = '\0';
+      string = buffer;
+    }
+  else
+    {
+      string = g_strndup (start, length);
+    }
+
+  node = json_node_new (JSON_NODE_VALUE);
+  if (!is_double)
+    {
+      errno = 0;
+      number = g_ascii_strtoull (string + (negative ? 1 : 0), &end, 10);
+
+      /*
+       * Integers up to G_MAXUINT64 wrap around into a gint64, as json-glib
+       * always did, and as uint64 D-Bus values expect. Anything larger, or
+       * smaller than G_MININT64, becomes a double.
+       */
+      if (errno == ERANGE || (negative && number > (guint64)G_MAXINT64 + 1))
+        is_double = TRUE;
+      else if (negative && number > 0)
+        json_node_set_int (node, -(gint64)(number - 1) - 1);
+      else
+        json_node_set_int (node, (gint64)number);
+    }
+  if (is_double)
+    json_node_set_double (node, g_ascii_strtod (string, &end));
+
+  if (string != buffer)
+    g_free (string);
+  return node;
+}
+
+static JsonNode *
+read_word (JsonReader *reader)
+{
+  JsonNode *node;
+
+  if (cockpit_json_scan_word (&reader->scan, "null"))
+    return json_node_new (JSON_NODE_NULL);
+
+  if (cockpit_json_scan_word (&reader->scan, "true"))
+    {
+      node = json_node_new (JSON_NODE_VALUE);
+      json_node_set_boolean (node, TRUE);
+      return node;
+    }
+
+  if (cockpit_json_scan_word (&reader->scan, "false"))
+    {
+      node = json_node_new (JSON_NODE_VALUE);
+      json_node_set_boolean (node, FALSE);
+      return node;
+    }
+
+  read_error (reader, JSON_PARSER_ERROR_INVALID_BAREWORD, "an invalid bare word");
+  return NULL;
+}
+
+static JsonNode *
+read_array (JsonReader *reader)
+{
+  JsonArray *array;
+  JsonNode *element;
+  JsonNode *node;
+
+  g_assert (*(reader->scan.pos) == '[');
+  reader->scan.pos++;
+
+  array = json_array_new ();
+  node = json_node_new (JSON_NODE_ARRAY);
+  json_node_take_array (node, array);
+
+  cockpit_json_scan_space (&reader->scan);
+  if (reader->scan.pos < reader->scan.end && *(reader->scan.pos) == ']')
+    {
+      reader->scan.pos++;
+      return node;
+    }
+
+  for (;;)
+    {
+      element = read_value (reader);
+      if (!element)
+        goto fail;
+      json_array_add_element (array, element);
+
+      cockpit_json_scan_space (&reader->scan);
+      if (reader->scan.pos == reader->scan.end)
+        {
+          read_error (reader, JSON_PARSER_ERROR_PARSE, "an unterminated array");
+          goto fail;
+        }
+      else if (*(reader->scan.pos) == ']')
+        {
+          reader->scan.pos++;
+          return node;
+        }
+      else if (*(reader->scan.pos) != ',')
+        {
+          read_error (reader, JSON_PARSER_ERROR_MISSING_COMMA, "a missing comma in an array");
+          goto fail;
+        }
+
+      reader->scan.pos++;
+      cockpit_json_scan_space (&reader->scan);
+      if (reader->scan.pos < reader->scan.end && *(reader->scan.pos) == ']')
+        {
+          read_error (reader, JSON_PARSER_ERROR_TRAILING_COMMA, "a trailing comma in an array");
+          goto fail;
+        }
+    }
+
+fail:
+  json_node_free (node);
+  return NULL;
+}
+
+static JsonNode *
+read_object (JsonReader *reader)
+{
+  JsonObject *object;
+  JsonNode *member;
+  JsonNode *node;
+  gchar *name;
+
+  g_assert (*(reader->scan.pos) == '{');
+  reader->scan.pos++;
+
+  object = json_object_new ();
+  node = json_node_new (JSON_NODE_OBJECT);
+  json_node_take_object (node, object);
+
+  cockpit_json_scan_space (&reader->scan);
+  if (reader->scan.pos < reader->scan.end && *(reader->scan.pos) == '}')
+    {
+      reader->scan.pos++;
+      return node;
+    }
+
+  for (;;)
+    {
+      if (reader->scan.pos == reader->scan.end || *(reader->scan.pos) != '"')
+        {
+          read_error (reader, JSON_PARSER_ERROR_PARSE, "a missing member name in an object");
+          goto fail;
+        }
+      if (!read_string (reader))
+        goto fail;
+
+      cockpit_json_scan_space (&reader->scan);
+      if (reader->scan.pos == reader->scan.end || *(reader->scan.pos) != ':')
+        {
+          read_error (reader, JSON_PARSER_ERROR_MISSING_COLON, "a missing colon in an object");
+          goto fail;
+        }
+      reader->scan.pos++;
+
+      /* The scratch buffer is reused for the value */
+      name = g_strndup (reader->scratch->str, reader->scratch->len);
+      member = read_value (reader);
+      if (member)
+        json_object_set_member (object, name, member);
+      g_free (name);
+      if (!member)
+        goto fail;
+
+      cockpit_json_scan_space (&reader->scan);
+      if (reader->scan.pos == reader->scan.end)
+        {
+          read_error (reader, JSON_PARSER_ERROR_PARSE, "an unterminated object");
+          goto fail;
+        }
+      else if (*(reader->scan.pos) == '}')
+        {
+          reader->scan.pos++;
+          return node;
+        }
+      else if (*(reader->scan.pos) != ',')
+        {
+          read_error (reader, JSON_PARSER_ERROR_MISSING_COMMA, "a missing comma in an object");
+          goto fail;
+        }
+
+      reader->scan.pos++;
+      cockpit_json_scan_space (&reader->scan);
+      if (reader->scan.pos < reader->scan.end && *(reader->scan.pos) == '}')
+        {
+          read_error (reader, JSON_PARSER_ERROR_TRAILING_COMMA, "a trailing comma in an object");
+          goto fail;
+        }
+    }
+
+fail:
+  json_node_free (node);
+  return NULL;
+}
+
+static JsonNode *
+read_value (JsonReader *reader)
+{
+  JsonNode *node;
+
+  cockpit_json_scan_space (&reader->scan);
+  if (reader->scan.pos == reader->scan.end)
+    {
+      read_error (reader, JSON_PARSER_ERROR_PARSE, "a missing value");
+      return NULL;
+    }
+
+  switch (*(reader->scan.pos))
+    {
+    case '{':
+    case '[':
+      if (reader->depth >= JSON_MAX_DEPTH)
+        {
+          read_error (reader, JSON_PARSER_ERROR_PARSE, "too much nesting");
+          return NULL;
+        }
+      reader->depth++;
+      if (*(reader->scan.pos) == '{')
+        node = read_object (reader);
+      else
+        node = read_array (reader);
+      reader->depth--;
+      return node;
+    case '"':
+      if (!read_string (reader))
+        return NULL;
+      node = json_node_new (JSON_NODE_VALUE);
+      json_node_set_string (node, reader->scratch->str);
+      return node;
+    case '-':
+    case '0': case '1': case '2': case '3': case '4':
+    case '5': case '6': case '7': case '8': case '9':
+      return read_number (reader);
+    default:
+      return read_word (reader);
+    }
+}
+
 /**
  * cockpit_json_parse:
  * @data: string data to parse
@@ -469,65 +1252,58 @@ cockpit_json_parse (const gchar *data,
                     gssize length,
                     GError **error)
 {
-  static GPrivate cached_parser = G_PRIVATE_INIT (g_object_unref);
-  JsonParser *parser;
-  JsonNode *root;
+  static GPrivate cached_scratch = G_PRIVATE_INIT (scratch_free);
+  JsonReader reader;
   JsonNode *ret;
 
-  parser = g_private_get (&cached_parser);
-  if (parser == NULL)
-    {
-      parser = json_parser_new ();
-      g_private_set (&cached_parser, parser);
-    }
+  if (length < 0)
+    length = strlen (data);
 
-  /*
-   * HACK: Workaround for the fact that json-glib did not utf-8
-   * validate its data until 0.99.2
-   */
-#ifdef COCKPIT_JSON_GLIB_NEED_UTF8_VALIDATE
   if (!g_utf8_validate (data, length, NULL))
     {
-      GError *local_error = NULL;
-      g_set_error_literal (&local_error, JSON_PARSER_ERROR,
+      g_set_error_literal (error, JSON_PARSER_ERROR,
                            JSON_PARSER_ERROR_INVALID_DATA,
                            "JSON data must be UTF-8 encoded");
-      g_signal_emit_by_name (parser, "error", 0, error);
-      g_propagate_error (error, local_error);
       return NULL;
     }
-#endif
 
+  reader.data = data;
+  cockpit_json_scan_init (&reader.scan, data, length);
+  reader.depth = 0;
+  reader.error = error;
+
+  /* Reused between parses, as the parser object used to be */
+  reader.scratch = g_private_get (&cached_scratch);
+  if (!reader.scratch)
+    {
+      reader.scratch = g_string_sized_new (256);
+      g_private_set (&cached_scratch, reader.scratch);
+    }
+
+  cockpit_json_scan_space (&reader.scan);
+  if (reader.scan.pos == reader.scan.end)
+    {
+      g_set_error (error, JSON_PARSER_ERROR, JSON_PARSER_ERROR_PARSE,
+                   "JSON data was empty");
+      return NULL;
+    }
 
-  if (json_parser_load_from_data (parser, data, length, error))
+  ret = read_value (&reader);
+  if (ret)
     {
-      root = json_parser_get_root (parser);
-      if (root == NULL)
+      cockpit_json_scan_space (&reader.scan);
+      if (reader.scan.pos != reader.scan.end)
         {
-          g_set_error (error, JSON_PARSER_ERROR, JSON_PARSER_ERROR_PARSE,
-                       "JSON data was empty");
+          read_error (&reader, JSON_PARSER_ERROR_PARSE, "unexpected data after the end");
+          json_node_free (ret);
           ret = NULL;
         }
-      else
-        {
-          ret = json_node_copy (root);
-
-          /*
-           * HACK: JsonParser doesn't give us a way to clear the parser
-           * and remove memory sitting around until the next parse, so
-           * we clear it like this.
-           *
-           * https://bugzilla.gnome.org/show_bug.cgi?id=728951
-           */
-          if (JSON_NODE_HOLDS_OBJECT (root))
-            json_node_take_object (root, json_object_new ());
-          else if (JSON_NODE_HOLDS_ARRAY (root))
-            json_node_take_array (root, json_array_new ());
-        }
     }
-  else
+
+  /* Don't hang on to the memory of a large string */
+  if (reader.scratch->allocated_len > 64 * 1024)
     {
-      ret = NULL;
+      g_private_replace (&cached_scratch, g_string_sized_new (256));
     }
 
   return ret;
@@ -633,105 +1409,165 @@ cockpit_json_write_object (JsonObject *object,
 }
 
 /*
- * HACK: JsonGenerator is completely borked, so we've copied it\
- * here until we can rely on a fixed version.
+ * Written directly into one buffer. The JsonGenerator in older
+ * json-glib versions can't be relied on:
  *
  * https://bugzilla.gnome.org/show_bug.cgi?id=727593
  */
 
-static gchar *dump_value  (const gchar   *name,
-                           JsonNode      *node,
-                           gsize         *length);
-static gchar *dump_array  (const gchar   *name,
-                           JsonArray     *array,
-                           gsize         *length);
-static gchar *dump_object (const gchar   *name,
-                           JsonObject    *object,
-                           gsize         *length);
-
-static gchar *
-json_strescape (const gchar *str)
+/*
+ * How each byte is written in a string: 0 means as is, 'u' as a \u00XX
+ * escape, and anything else as a backslash followed by that character.
+ * The 1 for the nul byte stops the scan.
+ */
+static const gchar escape_table[256] = {
+    1, 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'b', 't', 'n', 'u', 'f', 'r', 'u', 'u',
+  'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+    0,   0, '"',   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0, '\\',   0,   0,   0,
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0, 'u',
+  /* 0x80 to 0xff are parts of UTF-8 sequences, and copied as is */
+};
+
+static void
+append_escaped (GString *output,
+                const gchar *str)
 {
-  const gchar *p;
-  const gchar *end;
-  GString *output;
-  gsize len;
+  const guchar *p = (const guchar *)str;
+  const guchar *run;
+  gchar escape;
 
-  len = strlen (str);
-  end = str + len;
-  output = g_string_sized_new (len);
-
-  for (p = str; p < end; p++)
+  for (;;)
     {
-      if (*p == '\\' || *p == '"')
+      /* Copy the longest run that needs no escaping in one go */
+      run = p;
+      while (escape_table[*p] == 0)
+        p++;
+      if (p != run)
+        g_string_append_len (output, (const gchar *)run, p - run);
+
+      if (*p == '\0')
+        break;
+
+      escape = escape_table[*p];
+      if (escape == 'u')
+        {
+          g_string_append_printf (output, "\\u%04x", (guint)*p);
+        }
+      else
         {
           g_string_append_c (output, '\\');
-          g_string_append_c (output, *p);
+          g_string_append_c (output, escape);
         }
-      else if ((*p > 0 && *p < 0x1f) || *p == 0x7f)
+      p++;
+    }
+}
+
+/* As above, but ends at @length, and a nul byte is part of the string */
+static void
+append_escaped_len (GString *output,
+                    const gchar *str,
+                    gsize length)
+{
+  const guchar *p = (const guchar *)str;
+  const guchar *end = p + length;
+  const guchar *run;
+  gchar escape;
+
+  while (p < end)
+    {
+      run = p;
+      while (p < end && escape_table[*p] == 0)
+        p++;
+      if (p != run)
+        g_string_append_len (output, (const gchar *)run, p - run);
+
+      if (p == end)
+        break;
+
+      escape = escape_table[*p];
+      if (escape == 'u' || *p == '\0')
         {
-          switch (*p)
-            {
-            case '\b':
-              g_string_append (output, "\\b");
-              break;
-            case '\f':
-              g_string_append (output, "\\f");
-              break;
-            case '\n':
-              g_string_append (output, "\\n");
-              break;
-            case '\r':
-              g_string_append (output, "\\r");
-              break;
-            case '\t':
-              g_string_append (output, "\\t");
-              break;
-            default:
-              g_string_append_printf (output, "\\u00%02x", (guint)*p);
-              break;
-            }
+          g_string_append_printf (output, "\\u%04x", (guint)*p);
         }
       else
         {
-          g_string_append_c (output, *p);
+          g_string_append_c (output, '\\');
+          g_string_append_c (output, escape);
         }
+      p++;
     }
+}
 
-  return g_string_free (output, FALSE);
+static void
+append_double (GString *buffer,
+               gdouble d)
+{
+  gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
+
+  if (fpclassify (d) == FP_NAN || fpclassify (d) == FP_INFINITE)
+    {
+      g_string_append (buffer, "null");
+      return;
+    }
+
+  /*
+   * Use the shortest form that reads back as the same value. Most
+   * doubles are covered by 15 digits, and 17 are always enough.
+   */
+  g_ascii_formatd (buf, sizeof (buf), "%.15g", d);
+  if (g_ascii_strtod (buf, NULL) != d)
+    {
+      g_ascii_formatd (buf, sizeof (buf), "%.16g", d);
+      if (g_ascii_strtod (buf, NULL) != d)
+        g_ascii_dtostr (buf, sizeof (buf), d);
+    }
+
+  g_string_append (buffer, buf);
 }
 
-static gchar *
-dump_value (const gchar   *name,
-            JsonNode      *node,
-            gsize         *length)
+static void
+append_int (GString *buffer,
+            gint64 value)
 {
-  GString *buffer;
-  GType type;
+  gchar buf[24];
+  gchar *p = buf + sizeof (buf);
+  guint64 u;
+
+  u = value < 0 ? -(guint64)value : (guint64)value;
+  do
+    {
+      *(--p) = '0' + (u % 10);
+      u /= 10;
+    }
+  while (u);
 
-  buffer = g_string_new ("");
+  if (value < 0)
+    *(--p) = '-';
 
-  if (name)
-    g_string_append_printf (buffer, "\"%s\":", name);
+  g_string_append_len (buffer, p, (buf + sizeof (buf)) - p);
+}
+
+static void write_node (GString *buffer,
+                        JsonNode *node);
+
+static void
+write_value (GString *buffer,
+             JsonNode *node)
+{
+  GType type;
 
   type = json_node_get_value_type (node);
   if (type == G_TYPE_INT64)
     {
-      g_string_append_printf (buffer, "%" G_GINT64_FORMAT, json_node_get_int (node));
+      append_int (buffer, json_node_get_int (node));
     }
   else if (type == G_TYPE_DOUBLE)
     {
-      gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
-      gdouble d = json_node_get_double (node);
-
-      if (fpclassify (d) == FP_NAN || fpclassify (d) == FP_INFINITE)
-        {
-          g_string_append (buffer, "null");
-        }
-      else
-        {
-          g_string_append (buffer, g_ascii_dtostr (buf, sizeof (buf), d));
-        }
+      append_double (buffer, json_node_get_double (node));
     }
   else if (type == G_TYPE_BOOLEAN)
     {
@@ -739,147 +1575,86 @@ dump_value (const gchar   *name,
     }
   else if (type == G_TYPE_STRING)
     {
-        gchar *tmp;
-
-        tmp = json_strescape (json_node_get_string (node));
-        g_string_append_c (buffer, '"');
-        g_string_append (buffer, tmp);
-        g_string_append_c (buffer, '"');
-
-        g_free (tmp);
+      g_string_append_c (buffer, '"');
+      append_escaped (buffer, json_node_get_string (node));
+      g_string_append_c (buffer, '"');
     }
   else
     {
-      g_return_val_if_reached (NULL);
+      g_return_if_reached ();
     }
-
-  if (length)
-    *length = buffer->len;
-
-  return g_string_free (buffer, FALSE);
 }
 
-static gchar *
-dump_array (const gchar   *name,
-            JsonArray     *array,
-            gsize         *length)
+static void
+write_array (GString *buffer,
+             JsonArray *array)
 {
-  guint array_len = json_array_get_length (array);
+  guint length = json_array_get_length (array);
   guint i;
-  GString *buffer;
-
-  buffer = g_string_new ("");
-
-  if (name)
-    g_string_append_printf (buffer, "\"%s\":", name);
 
   g_string_append_c (buffer, '[');
-
-  for (i = 0; i < array_len; i++)
+  for (i = 0; i < length; i++)
     {
-      JsonNode *cur = json_array_get_element (array, i);
-      gchar *value;
-
-      switch (JSON_NODE_TYPE (cur))
-        {
-        case JSON_NODE_NULL:
-          g_string_append (buffer, "null");
-          break;
-
-        case JSON_NODE_VALUE:
-          value = dump_value (NULL, cur, NULL);
-          g_string_append (buffer, value);
-          g_free (value);
-          break;
-
-        case JSON_NODE_ARRAY:
-          value = dump_array (NULL, json_node_get_array (cur), NULL);
-          g_string_append (buffer, value);
-          g_free (value);
-          break;
-
-        case JSON_NODE_OBJECT:
-          value = dump_object (NULL, json_node_get_object (cur), NULL);
-          g_string_append (buffer, value);
-          g_free (value);
-          break;
-        }
-
-      if ((i + 1) != array_len)
+      if (i > 0)
         g_string_append_c (buffer, ',');
+      write_node (buffer, json_array_get_element (array, i));
     }
-
   g_string_append_c (buffer, ']');
-
-  if (length)
-    *length = buffer->len;
-
-  return g_string_free (buffer, FALSE);
 }
 
-static gchar *
-dump_object (const gchar   *name,
-             JsonObject    *object,
-             gsize         *length)
-{
-  GList *members, *l;
+typedef struct {
   GString *buffer;
+  gboolean first;
+} WriteMembers;
+
+static void
+write_member (JsonObject *object,
+              const gchar *member_name,
+              JsonNode *member_node,
+              gpointer user_data)
+{
+  WriteMembers *wm = user_data;
 
-  buffer = g_string_new ("");
+  if (!wm->first)
+    g_string_append_c (wm->buffer, ',');
+  wm->first = FALSE;
 
-  if (name)
-    g_string_append_printf (buffer, "\"%s\":", name);
+  g_string_append_c (wm->buffer, '"');
+  append_escaped (wm->buffer, member_name);
+  g_string_append (wm->buffer, "\":");
+  write_node (wm->buffer, member_node);
+}
 
-  g_string_append_c (buffer, '{');
+static void
+write_object (GString *buffer,
+              JsonObject *object)
+{
+  WriteMembers wm = { buffer, TRUE };
 
-  members = json_object_get_members (object);
+  g_string_append_c (buffer, '{');
+  json_object_foreach_member (object, write_member, &wm);
+  g_string_append_c (buffer, '}');
+}
 
-  for (l = members; l != NULL; l = l->next)
+static void
+write_node (GString *buffer,
+            JsonNode *node)
+{
+  switch (JSON_NODE_TYPE (node))
     {
-      const gchar *member_name = l->data;
-      gchar *escaped_name = json_strescape (member_name);
-      JsonNode *cur = json_object_get_member (object, member_name);
-      gchar *value;
-
-      switch (JSON_NODE_TYPE (cur))
-        {
-        case JSON_NODE_NULL:
-          g_string_append_printf (buffer, "\"%s\":null", escaped_name);
-          break;
-
-        case JSON_NODE_VALUE:
-          value = dump_value (escaped_name, cur, NULL);
-          g_string_append (buffer, value);
-          g_free (value);
-          break;
-
-        case JSON_NODE_ARRAY:
-          value = dump_array (escaped_name, json_node_get_array (cur), NULL);
-          g_string_append (buffer, value);
-          g_free (value);
-          break;
-
-        case JSON_NODE_OBJECT:
-          value = dump_object (escaped_name, json_node_get_object (cur), NULL);
-          g_string_append (buffer, value);
-          g_free (value);
-          break;
-        }
-
-      if (l->next != NULL)
-        g_string_append_c (buffer, ',');
-
-      g_free (escaped_name);
+    case JSON_NODE_NULL:
+      g_string_append (buffer, "null");
+      break;
+    case JSON_NODE_VALUE:
+      write_value (buffer, node);
+      break;
+    case JSON_NODE_ARRAY:
+      write_array (buffer, json_node_get_array (node));
+      break;
+    case JSON_NODE_OBJECT:
+      write_object (buffer, json_node_get_object (node));
+      break;
     }
-
-  g_list_free (members);
-
-  g_string_append_c (buffer, '}');
-
-  if (length)
-    *length = buffer->len;
-
-  return g_string_free (buffer, FALSE);
 }
 
 /**
@@ -895,7 +1670,7 @@ gchar *
 cockpit_json_write (JsonNode *node,
                     gsize *length)
 {
-  gchar *retval = NULL;
+  GString *buffer;
 
   if (!node)
     {
@@ -904,26 +1679,61 @@ cockpit_json_write (JsonNode *node,
       return NULL;
     }
 
-  switch (JSON_NODE_TYPE (node))
-    {
-    case JSON_NODE_ARRAY:
-      retval = dump_array (NULL, json_node_get_array (node), length);
-      break;
+  buffer = g_string_sized_new (128);
+  write_node (buffer, node);
 
-    case JSON_NODE_OBJECT:
-      retval = dump_object (NULL, json_node_get_object (node), length);
-      break;
+  if (length)
+    *length = buffer->len;
+  return g_string_free (buffer, FALSE);
+}
 
-    case JSON_NODE_NULL:
-      retval = g_strdup ("null");
-      if (length)
-        *length = 4;
-      break;
+/**
+ * cockpit_json_append_string:
+ * @buffer: the buffer to append to
+ * @str: the string to encode
+ *
+ * Append a string to @buffer as a quoted JSON string, escaped
+ * the same way as cockpit_json_write() does.
+ */
+void
+cockpit_json_append_string (GString *buffer,
+                            const gchar *str)
+{
+  g_string_append_c (buffer, '"');
+  append_escaped (buffer, str);
+  g_string_append_c (buffer, '"');
+}
 
-    case JSON_NODE_VALUE:
-      retval = dump_value (NULL, node, length);
-      break;
-    }
+/**
+ * cockpit_json_append_string_len:
+ * @buffer: the buffer to append to
+ * @str: the UTF-8 string to encode
+ * @length: the length of @str in bytes
+ *
+ * Like cockpit_json_append_string(), but @str may contain nul
+ * bytes, which are written as \u0000 escapes.
+ */
+void
+cockpit_json_append_string_len (GString *buffer,
+                                const gchar *str,
+                                gsize length)
+{
+  g_string_append_c (buffer, '"');
+  append_escaped_len (buffer, str, length);
+  g_string_append_c (buffer, '"');
+}
 
-  return retval;
+/**
+ * cockpit_json_append_double:
+ * @buffer: the buffer to append to
+ * @value: the number to encode
+ *
+ * Append a JSON number to @buffer, formatted the same way as
+ * cockpit_json_write() does. NaN and infinity become null.
+ */
+void
+cockpit_json_append_double (GString *buffer,
+                            gdouble value)
+{
+  append_double (buffer, value);
 }
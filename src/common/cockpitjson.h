@@ -28,7 +28,6 @@ G_BEGIN_DECLS
 
 #if !JSON_CHECK_VERSION(0, 99, 2)
 #define JSON_PARSER_ERROR_INVALID_DATA 700
-#define COCKPIT_JSON_GLIB_NEED_UTF8_VALIDATE 1
 #endif
 
 JsonNode *     cockpit_json_parse             (const char *data,
@@ -50,6 +49,16 @@ gchar *        cockpit_json_write_object      (JsonObject *object,
 
 GBytes *       cockpit_json_write_bytes       (JsonObject *object);
 
+void           cockpit_json_append_string     (GString *buffer,
+                                               const gchar *str);
+
+void           cockpit_json_append_string_len (GString *buffer,
+                                               const gchar *str,
+                                               gsize length);
+
+void           cockpit_json_append_double     (GString *buffer,
+                                               gdouble value);
+
 gboolean       cockpit_json_equal             (JsonNode *previous,
                                                JsonNode *current);
 
@@ -61,6 +70,11 @@ gboolean       cockpit_json_get_int           (JsonObject *object,
                                                gint64 defawlt,
                                                gint64 *value);
 
+gboolean       cockpit_json_get_double        (JsonObject *object,
+                                               const gchar *member,
+                                               gdouble defawlt,
+                                               gdouble *value);
+
 gboolean       cockpit_json_get_bool          (JsonObject *object,
                                                const gchar *member,
                                                gboolean defawlt,
@@ -95,4 +109,39 @@ guint          cockpit_json_int_hash          (gconstpointer v);
 gboolean       cockpit_json_int_equal         (gconstpointer v1,
                                                gconstpointer v2);
 
+typedef struct {
+  const gchar *pos;
+  const gchar *end;
+} CockpitJsonScan;
+
+void           cockpit_json_scan_init         (CockpitJsonScan *scan,
+                                               const gchar *data,
+                                               gsize length);
+
+void           cockpit_json_scan_space        (CockpitJsonScan *scan);
+
+gchar          cockpit_json_scan_peek         (CockpitJsonScan *scan);
+
+gboolean       cockpit_json_scan_char         (CockpitJsonScan *scan,
+                                               gchar ch);
+
+gboolean       cockpit_json_scan_word         (CockpitJsonScan *scan,
+                                               const gchar *word);
+
+gboolean       cockpit_json_scan_number       (CockpitJsonScan *scan,
+                                               gboolean *is_double);
+
+const gchar *  cockpit_json_scan_chars        (CockpitJsonScan *scan);
+
+gboolean       cockpit_json_scan_escape       (CockpitJsonScan *scan,
+                                               gunichar *uc);
+
+gboolean       cockpit_json_scan_string       (CockpitJsonScan *scan,
+                                               const gchar **value,
+                                               gsize *length,
+                                               gboolean *escaped);
+
+gboolean       cockpit_json_scan_skip         (CockpitJsonScan *scan,
+                                               gint depth);
+
 #endif /* COCKPIT_JSON_H__ */
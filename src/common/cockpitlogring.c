@@ -0,0 +1,174 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2016 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitlogring.h"
+
+#include "cockpitlog.h"
+
+#include <string.h>
+
+/*
+ * Tracepoints for the paths that every message takes, where a g_debug()
+ * would cost a format call even with debug messages off, and would flood
+ * the journal with them on. Each record is a timestamp, which tracepoint,
+ * a name such as that of the pipe, and a value such as a byte count. The
+ * last COCKPIT_LOG_RING_SIZE of them are kept in a ring, and written out
+ * to the log on demand, with SIGUSR2 in cockpit-ws and the bridge.
+ *
+ * Recording takes a slot with an atomic add, so any thread can record
+ * without a lock. Each slot has the sequence number it was filled for,
+ * set last, so a slot that's being written or was written over while
+ * reading it is skipped rather than reported torn.
+ */
+
+typedef struct {
+  volatile gint sequence;
+  guint point;
+  gint64 when;
+  gint64 value;
+  gchar name[COCKPIT_LOG_RING_NAME_MAX];
+} LogRecord;
+
+static const gchar *point_names[COCKPIT_N_LOG_RING_POINTS] = {
+  "pipe-read",
+  "pipe-wrote",
+  "pipe-partial",
+  "pipe-urgent",
+  "pipe-spliced",
+  "pipe-corked",
+  "pipe-empty",
+  "transport-received",
+  "transport-truncated",
+  "transport-queued",
+  "transport-ahead",
+  "transport-spliced",
+  "transport-frame",
+};
+
+G_STATIC_ASSERT ((COCKPIT_LOG_RING_SIZE & (COCKPIT_LOG_RING_SIZE - 1)) == 0);
+
+static LogRecord ring[COCKPIT_LOG_RING_SIZE];
+static volatile gint ring_next = 0;
+
+/**
+ * cockpit_log_ring_record:
+ * @point: which tracepoint
+ * @name: a name, such as that of the pipe, or NULL
+ * @value: a value, such as a number of bytes
+ *
+ * Record a tracepoint in the ring. Only the first part of a long
+ * @name is kept.
+ */
+void
+cockpit_log_ring_record (CockpitLogRingPoint point,
+                         const gchar *name,
+                         gint64 value)
+{
+  LogRecord *record;
+  gsize len = 0;
+  guint sequence;
+
+  g_return_if_fail (point < COCKPIT_N_LOG_RING_POINTS);
+
+  sequence = g_atomic_int_add (&ring_next, 1);
+  record = ring + (sequence & (COCKPIT_LOG_RING_SIZE - 1));
+
+  /* Nothing reads this slot until the sequence is set again */
+  g_atomic_int_set (&record->sequence, 0);
+
+  record->point = point;
+  record->when = g_get_monotonic_time ();
+  record->value = value;
+  if (name)
+    {
+      len = strnlen (name, COCKPIT_LOG_RING_NAME_MAX - 1);
+      memcpy (record->name, name, len);
+    }
+  record->name[len] = '\0';
+
+  g_atomic_int_set (&record->sequence, sequence + 1);
+}
+
+/**
+ * cockpit_log_ring_foreach:
+ * @func: called for each record
+ * @user_data: passed to @func
+ *
+ * Call @func with each record in the ring, oldest first. Records
+ * being written at the same time are skipped.
+ */
+void
+cockpit_log_ring_foreach (CockpitLogRingFunc func,
+                          gpointer user_data)
+{
+  LogRecord *record;
+  LogRecord copy;
+  guint next;
+  guint i;
+
+  next = g_atomic_int_get (&ring_next);
+  i = next > COCKPIT_LOG_RING_SIZE ? next - COCKPIT_LOG_RING_SIZE : 0;
+
+  for (; i != next; i++)
+    {
+      record = ring + (i & (COCKPIT_LOG_RING_SIZE - 1));
+      if ((guint)g_atomic_int_get (&record->sequence) != i + 1)
+        continue;
+
+      copy = *record;
+
+      /* Make sure it wasn't written over while copying */
+      if ((guint)g_atomic_int_get (&record->sequence) != i + 1 ||
+          copy.point >= COCKPIT_N_LOG_RING_POINTS)
+        continue;
+
+      copy.name[COCKPIT_LOG_RING_NAME_MAX - 1] = '\0';
+      func (copy.when, point_names[copy.point], copy.name, copy.value, user_data);
+    }
+}
+
+static void
+on_dump_record (gint64 when,
+                const gchar *point,
+                const gchar *name,
+                gint64 value,
+                gpointer user_data)
+{
+  gint64 *now = user_data;
+
+  g_info ("trace: -%" G_GINT64_FORMAT "us %s %s %" G_GINT64_FORMAT,
+          *now - when, point, name[0] ? name : "-", value);
+}
+
+/**
+ * cockpit_log_ring_dump:
+ *
+ * Write the records in the ring to the log, oldest first, each
+ * with how long ago it was recorded.
+ */
+void
+cockpit_log_ring_dump (void)
+{
+  gint64 now = g_get_monotonic_time ();
+
+  g_info ("trace: dumping the last %d tracepoints", COCKPIT_LOG_RING_SIZE);
+  cockpit_log_ring_foreach (on_dump_record, &now);
+}
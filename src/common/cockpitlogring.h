@@ -0,0 +1,66 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2016 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __COCKPIT_LOG_RING_H__
+#define __COCKPIT_LOG_RING_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef enum {
+  COCKPIT_LOG_RING_PIPE_READ,
+  COCKPIT_LOG_RING_PIPE_WROTE,
+  COCKPIT_LOG_RING_PIPE_PARTIAL,
+  COCKPIT_LOG_RING_PIPE_URGENT,
+  COCKPIT_LOG_RING_PIPE_SPLICED,
+  COCKPIT_LOG_RING_PIPE_CORKED,
+  COCKPIT_LOG_RING_PIPE_EMPTY,
+  COCKPIT_LOG_RING_TRANSPORT_RECEIVED,
+  COCKPIT_LOG_RING_TRANSPORT_TRUNCATED,
+  COCKPIT_LOG_RING_TRANSPORT_QUEUED,
+  COCKPIT_LOG_RING_TRANSPORT_AHEAD,
+  COCKPIT_LOG_RING_TRANSPORT_SPLICED,
+  COCKPIT_LOG_RING_TRANSPORT_FRAME,
+
+  COCKPIT_N_LOG_RING_POINTS
+} CockpitLogRingPoint;
+
+/* The most records kept, and how much of a name is */
+#define COCKPIT_LOG_RING_SIZE      1024
+#define COCKPIT_LOG_RING_NAME_MAX  24
+
+typedef void      (* CockpitLogRingFunc)        (gint64 when,
+                                                 const gchar *point,
+                                                 const gchar *name,
+                                                 gint64 value,
+                                                 gpointer user_data);
+
+void                 cockpit_log_ring_record    (CockpitLogRingPoint point,
+                                                 const gchar *name,
+                                                 gint64 value);
+
+void                 cockpit_log_ring_foreach   (CockpitLogRingFunc func,
+                                                 gpointer user_data);
+
+void                 cockpit_log_ring_dump      (void);
+
+G_END_DECLS
+
+#endif /* __COCKPIT_LOG_RING_H__ */
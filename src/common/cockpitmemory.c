@@ -21,7 +21,13 @@
 
 #include "cockpitmemory.h"
 
+#include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
 int      cockpit_secmem_drain = 0;
 
@@ -63,3 +69,155 @@ cockpit_secclear (gpointer data,
       *(vp++) = 0xAA;
     }
 }
+
+/*
+ * Long running processes keep the heap they grew to, even after the
+ * channels or sessions that needed it are gone. When things have been
+ * quiet for a while, ask malloc to give free memory back to the
+ * kernel. Reporters estimate the big users of memory at that point,
+ * such as the D-Bus caches, and these are kept in the global stats.
+ */
+
+/* Seconds without anything closing before we trim */
+guint cockpit_memory_idle_delay = 10;
+
+typedef struct {
+  CockpitStat stat;
+  CockpitMemoryFunc func;
+  gpointer user_data;
+} MemoryReporter;
+
+static GList *reporters;
+static guint idle_timeout;
+
+void
+cockpit_memory_add_reporter (CockpitStat stat,
+                             CockpitMemoryFunc func,
+                             gpointer user_data)
+{
+  MemoryReporter *reporter;
+
+  g_return_if_fail (func != NULL);
+
+  reporter = g_new0 (MemoryReporter, 1);
+  reporter->stat = stat;
+  reporter->func = func;
+  reporter->user_data = user_data;
+  reporters = g_list_prepend (reporters, reporter);
+}
+
+void
+cockpit_memory_remove_reporter (CockpitMemoryFunc func,
+                                gpointer user_data)
+{
+  MemoryReporter *reporter;
+  GList *l;
+
+  for (l = reporters; l != NULL; l = g_list_next (l))
+    {
+      reporter = l->data;
+      if (reporter->func == func && reporter->user_data == user_data)
+        {
+          reporters = g_list_delete_link (reporters, l);
+          g_free (reporter);
+          return;
+        }
+    }
+}
+
+/**
+ * cockpit_memory_rss:
+ *
+ * The resident memory of this process. This may be called from
+ * any thread.
+ *
+ * Returns: the size in bytes, or -1 if it couldn't be read
+ */
+gssize
+cockpit_memory_rss (void)
+{
+  unsigned long pages = 0;
+  int ret = 0;
+  FILE *file;
+
+  file = fopen ("/proc/self/statm", "re");
+  if (!file)
+    return -1;
+
+  ret = fscanf (file, "%*u %lu", &pages);
+  fclose (file);
+
+  if (ret != 1)
+    return -1;
+
+  return (gssize)pages * sysconf (_SC_PAGESIZE);
+}
+
+/**
+ * cockpit_memory_trim:
+ *
+ * Update the COCKPIT_STAT_MEMORY_* estimates from the reporters, and release free heap
+ * memory back to the kernel. How much that gave back is added to
+ * COCKPIT_STAT_MEMORY_TRIMMED.
+ *
+ * The memory that GSlice keeps in its magazines can't be released
+ * with its API. Set G_SLICE=always-malloc to have those allocations
+ * trimmed here too.
+ */
+void
+cockpit_memory_trim (void)
+{
+  gssize totals[COCKPIT_N_STATS] = { 0, };
+  MemoryReporter *reporter;
+  GList *l;
+#ifdef __GLIBC__
+  gssize before;
+  gssize after;
+#endif
+
+  for (l = reporters; l != NULL; l = g_list_next (l))
+    {
+      reporter = l->data;
+      totals[reporter->stat] += reporter->func (reporter->user_data);
+    }
+
+  /* Set even when there are no reporters, so they go back to zero */
+  cockpit_stats_set (NULL, COCKPIT_STAT_MEMORY_DBUS_CACHE, totals[COCKPIT_STAT_MEMORY_DBUS_CACHE]);
+  cockpit_stats_set (NULL, COCKPIT_STAT_MEMORY_PACKAGES, totals[COCKPIT_STAT_MEMORY_PACKAGES]);
+
+#ifdef __GLIBC__
+  before = cockpit_memory_rss ();
+  malloc_trim (0);
+  after = cockpit_memory_rss ();
+
+  if (before > after && after >= 0)
+    {
+      g_debug ("trimmed %" G_GSSIZE_FORMAT " bytes of memory", before - after);
+      cockpit_stats_add (NULL, COCKPIT_STAT_MEMORY_TRIMMED, before - after);
+    }
+#endif
+}
+
+static gboolean
+on_idle_timeout (gpointer user_data)
+{
+  idle_timeout = 0;
+  cockpit_memory_trim ();
+  return FALSE;
+}
+
+/**
+ * cockpit_memory_idle:
+ *
+ * Called when something that held on to memory went away, such as
+ * a channel or a session. Once nothing else has gone away for
+ * cockpit_memory_idle_delay seconds, cockpit_memory_trim() is run
+ * from the main loop.
+ */
+void
+cockpit_memory_idle (void)
+{
+  if (idle_timeout)
+    g_source_remove (idle_timeout);
+  idle_timeout = g_timeout_add_seconds (cockpit_memory_idle_delay, on_idle_timeout, NULL);
+}
@@ -20,6 +20,8 @@
 #ifndef __COCKPIT_MEMORY_H__
 #define __COCKPIT_MEMORY_H__
 
+#include "cockpitstats.h"
+
 #include <glib.h>
 #include <glib-object.h>
 
@@ -28,6 +30,23 @@ G_BEGIN_DECLS
 void     cockpit_secclear                (gpointer data,
                                           gssize length);
 
+typedef gsize (* CockpitMemoryFunc)      (gpointer user_data);
+
+void     cockpit_memory_add_reporter     (CockpitStat stat,
+                                          CockpitMemoryFunc func,
+                                          gpointer user_data);
+
+void     cockpit_memory_remove_reporter  (CockpitMemoryFunc func,
+                                          gpointer user_data);
+
+gssize   cockpit_memory_rss              (void);
+
+void     cockpit_memory_trim             (void);
+
+void     cockpit_memory_idle             (void);
+
+extern guint cockpit_memory_idle_delay;
+
 #define DEFINE_CLEANUP_FUNCTION(Type, name, func) \
   static inline void name (void *v) \
   { \
@@ -20,6 +20,9 @@
 #include "config.h"
 
 #include "cockpitpipe.h"
+#include "cockpitepoll.h"
+#include "cockpitlogring.h"
+#include "cockpitstats.h"
 #include "cockpitunixfd.h"
 
 #include <glib-unix.h>
@@ -30,6 +33,7 @@
 
 #include <dirent.h>
 #include <errno.h>
+#include <limits.h>
 #include <pty.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -38,6 +42,19 @@
 
 #ifdef __linux
 #include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#endif
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+#if defined(__linux) && defined(SPLICE_F_MOVE) && defined(F_SETPIPE_SZ)
+#define HAVE_SPLICE 1
 #endif
 
 /**
@@ -59,9 +76,36 @@ enum {
   PROP_ERR_FD,
   PROP_PID,
   PROP_PROBLEM,
-  PROP_READ_SIZE
+  PROP_READ_SIZE,
+  PROP_ADAPTIVE_READ,
+  PROP_CORK,
+  PROP_PIPE_SIZE
 };
 
+/* The largest single read in adaptive mode */
+#define ADAPTIVE_READ_MAX     (256 * 1024)
+
+/* Bytes read in adaptive mode before going back to the main loop */
+#define ADAPTIVE_READ_BUDGET  (1024 * 1024)
+
+/* Maximum number of blocks gathered into a single writev() */
+#define OUTPUT_IOV_MAX        MIN (IOV_MAX, 256)
+
+/* Writes smaller than this are coalesced when corked */
+#define CORK_BLOCK_MAX        (4 * 1024)
+
+/* The most we coalesce before queuing the corked data */
+#define CORK_BUFFER_MAX       (64 * 1024)
+
+/* Size we ask for the kernel pipe that holds spliced data */
+#define SPLICE_PIPE_SIZE      (256 * 1024)
+
+/*
+ * The most stderr we keep in memory for COCKPIT_PIPE_STDERR_TO_MEMORY.
+ * Half of it holds the start of the output, and half the most recent.
+ */
+gsize cockpit_pipe_stderr_maximum = 64 * 1024;
+
 struct _CockpitPipePrivate {
   gchar *name;
   GMainContext *context;
@@ -83,15 +127,53 @@ struct _CockpitPipePrivate {
   GQueue *out_queue;
   gsize out_partial;
 
+  /*
+   * Urgent blocks go out ahead of out_queue, but only where its data
+   * is at one of the boundaries the writer marked. The offsets count
+   * the bytes ever written to out_queue, including corked and spliced.
+   */
+  GQueue *out_urgent;
+  gsize urgent_partial;
+  guint64 out_total;
+  guint64 out_written;
+  GArray *out_boundaries;
+  guint boundary_head;
+  gboolean cork;
+  GByteArray *cork_buffer;
+  GSource *cork_source;
+
+  /*
+   * Spliced data waits in a kernel pipe rather than in out_queue.
+   * Each block of it is a zero length placeholder in out_queue, its
+   * length is in out_spliced.
+   */
+  int splice_fds[2];
+  gsize splice_size;
+  gsize splice_pending;
+  GQueue *out_spliced;
+  GBytes *splice_block;
+
   int in_fd;
   GSource *in_source;
   GByteArray *in_buffer;
+  gboolean in_throttled;
+  gint in_priority;
+  CockpitPipeSpliceFunc in_splice;
+  gpointer in_splice_data;
 
   int err_fd;
   GSource *err_source;
   GByteArray *err_buffer;
+  guint8 *err_tail;
+  gsize err_tail_size;
+  gsize err_tail_pos;
+  gsize err_tail_len;
+  guint64 err_dropped;
 
   int read_size;
+  int pipe_size;
+  gboolean adaptive_read;
+  int read_current;
 };
 
 typedef struct {
@@ -104,6 +186,8 @@ static guint cockpit_pipe_sig_close;
 
 static void  cockpit_close_later (CockpitPipe *self);
 
+static void  flush_cork          (CockpitPipe *self);
+
 static void  set_problem_from_errno (CockpitPipe *self,
                                      const gchar *message,
                                      int errn);
@@ -117,19 +201,37 @@ cockpit_pipe_init (CockpitPipe *self)
   self->priv->in_buffer = g_byte_array_new ();
   self->priv->in_fd = -1;
   self->priv->out_queue = g_queue_new ();
+  self->priv->out_urgent = g_queue_new ();
+  self->priv->out_boundaries = g_array_new (FALSE, FALSE, sizeof (guint64));
   self->priv->out_fd = -1;
+  self->priv->out_spliced = g_queue_new ();
+  self->priv->splice_fds[0] = self->priv->splice_fds[1] = -1;
   self->priv->err_fd = -1;
   self->priv->status = -1;
   self->priv->read_size = 1024;
+  self->priv->in_priority = G_PRIORITY_DEFAULT;
 
   self->priv->context = g_main_context_ref_thread_default ();
 }
 
+/* Overridable from tests and benchmarks */
+gboolean cockpit_pipe_use_epoll = FALSE;
+
+static GSource *
+pipe_fd_source_new (gint fd,
+                    GIOCondition condition)
+{
+  if (cockpit_pipe_use_epoll)
+    return cockpit_epoll_source_new (fd, condition);
+  else
+    return cockpit_unix_fd_source_new (fd, condition);
+}
+
 static void
 stop_output (CockpitPipe *self)
 {
   g_assert (self->priv->out_source != NULL);
-  g_source_destroy (self->priv->out_source);
+  cockpit_epoll_source_destroy (self->priv->out_source);
   g_source_unref (self->priv->out_source);
   self->priv->out_source = NULL;
 }
@@ -138,20 +240,51 @@ static void
 stop_input (CockpitPipe *self)
 {
   g_assert (self->priv->in_source != NULL);
-  g_source_destroy (self->priv->in_source);
+  cockpit_epoll_source_destroy (self->priv->in_source);
   g_source_unref (self->priv->in_source);
   self->priv->in_source = NULL;
 }
 
+static gboolean dispatch_input (gint fd,
+                                GIOCondition cond,
+                                gpointer user_data);
+
+static void
+start_input (CockpitPipe *self)
+{
+  g_assert (self->priv->in_source == NULL);
+  self->priv->in_source = pipe_fd_source_new (self->priv->in_fd, G_IO_IN);
+  g_source_set_name (self->priv->in_source, "pipe-input");
+  g_source_set_priority (self->priv->in_source, self->priv->in_priority);
+  g_source_set_callback (self->priv->in_source, (GSourceFunc)dispatch_input, self, NULL);
+  g_source_attach (self->priv->in_source, self->priv->context);
+}
+
 static void
 stop_error (CockpitPipe *self)
 {
   g_assert (self->priv->err_source != NULL);
-  g_source_destroy (self->priv->err_source);
+  cockpit_epoll_source_destroy (self->priv->err_source);
   g_source_unref (self->priv->err_source);
   self->priv->err_source = NULL;
 }
 
+static void
+stop_cork (CockpitPipe *self)
+{
+  if (self->priv->cork_source)
+    {
+      g_source_destroy (self->priv->cork_source);
+      g_source_unref (self->priv->cork_source);
+      self->priv->cork_source = NULL;
+    }
+  if (self->priv->cork_buffer)
+    {
+      g_byte_array_unref (self->priv->cork_buffer);
+      self->priv->cork_buffer = NULL;
+    }
+}
+
 static void
 close_immediately (CockpitPipe *self,
                    const gchar *problem)
@@ -173,10 +306,12 @@ close_immediately (CockpitPipe *self,
 
   if (self->priv->in_source)
     stop_input (self);
+  self->priv->in_throttled = FALSE;
   if (self->priv->out_source)
     stop_output (self);
   if (self->priv->err_source)
     stop_error (self);
+  stop_cork (self);
 
   if (self->priv->in_fd != -1)
     {
@@ -193,7 +328,13 @@ close_immediately (CockpitPipe *self,
       close (self->priv->err_fd);
       self->priv->err_fd = -1;
     }
-
+  if (self->priv->splice_fds[0] != -1)
+    {
+      close (self->priv->splice_fds[0]);
+      close (self->priv->splice_fds[1]);
+      self->priv->splice_fds[0] = self->priv->splice_fds[1] = -1;
+      self->priv->splice_pending = 0;
+    }
 
   if (problem && self->priv->pid && !self->priv->exited)
     {
@@ -214,7 +355,9 @@ close_maybe (CockpitPipe *self)
 {
   if (!self->priv->closed)
     {
-      if (!self->priv->in_source && !self->priv->out_source && !self->priv->err_source)
+      if (!self->priv->in_source && !self->priv->in_throttled &&
+          !self->priv->out_source && !self->priv->err_source &&
+          !self->priv->cork_buffer)
         {
           g_debug ("%s: input and output done", self->priv->name);
           close_immediately (self, NULL);
@@ -253,45 +396,113 @@ on_child_reap (GPid pid,
     g_signal_emit (self, cockpit_pipe_sig_close, 0, self->priv->problem);
 }
 
+/*
+ * In adaptive mode the read size grows while reads fill the
+ * buffer, and shrinks back towards CockpitPipe:read-size when idle.
+ */
+static void
+adapt_read_size (CockpitPipe *self,
+                 gsize size,
+                 gssize ret)
+{
+  if (ret == size)
+    self->priv->read_current = MIN (size * 2, MAX (ADAPTIVE_READ_MAX, self->priv->read_size));
+  else if (ret < size / 4)
+    self->priv->read_current = MAX (size / 2, self->priv->read_size);
+}
+
 static gboolean
 dispatch_input (gint fd,
                 GIOCondition cond,
                 gpointer user_data)
 {
   CockpitPipe *self = (CockpitPipe *)user_data;
+  gboolean spliced = FALSE;
   gssize ret = 0;
+  gsize total = 0;
+  gsize size;
   gsize len;
   gboolean eof;
 
   g_return_val_if_fail (self->priv->in_source, FALSE);
   len = self->priv->in_buffer->len;
 
+  /*
+   * The splice function moves data on without it ever being read
+   * here. It can decline, and then we read as usual. Only when the
+   * buffer is empty, so that data stays in order.
+   */
+  if (cond != G_IO_HUP && self->priv->in_splice && len == 0)
+    {
+      ret = (self->priv->in_splice) (self, self->priv->in_fd, self->priv->in_splice_data);
+      if (ret > 0)
+        return TRUE;
+      else if (ret == 0)
+        spliced = TRUE;
+      else if (errno == EAGAIN || errno == EINTR)
+        return TRUE;
+      else if (errno != ENOTSUP)
+        {
+          set_problem_from_errno (self, "couldn't read", errno);
+          close_immediately (self, NULL); /* problem already set */
+          return FALSE;
+        }
+    }
+
   /*
    * Enable clean shutdown by not reading when we just get
    * G_IO_HUP. Note that when we get G_IO_ERR we do want to read
    * just so we can get the appropriate detailed error message.
    */
-  if (cond != G_IO_HUP)
+  if (cond != G_IO_HUP && !spliced)
     {
-      g_debug ("%s: reading input", self->priv->name);
-
-      g_byte_array_set_size (self->priv->in_buffer, len + self->priv->read_size);
-      ret = read (self->priv->in_fd, self->priv->in_buffer->data + len, self->priv->read_size);
-      if (ret < 0)
+      cockpit_log_ring_record (COCKPIT_LOG_RING_PIPE_READ, self->priv->name, self->priv->read_size);
+
+      /*
+       * In adaptive mode, keep reading until the fd would block, hits
+       * the end, or we have read our budget for this main loop iteration.
+       * The whole batch is then delivered in one read signal.
+       */
+      for (;;)
         {
-          g_byte_array_set_size (self->priv->in_buffer, len);
-          if (errno != EAGAIN && errno != EINTR)
+          size = self->priv->read_size;
+          if (self->priv->adaptive_read)
+            size = MAX (self->priv->read_current, self->priv->read_size);
+
+          g_byte_array_set_size (self->priv->in_buffer, len + size);
+          ret = read (self->priv->in_fd, self->priv->in_buffer->data + len, size);
+          if (ret < 0)
             {
-              set_problem_from_errno (self, "couldn't read", errno);
-              close_immediately (self, NULL); /* problem already set */
-              return FALSE;
+              g_byte_array_set_size (self->priv->in_buffer, len);
+
+              /* Deliver what we have, any error is picked up next time */
+              if (total > 0)
+                break;
+
+              if (errno != EAGAIN && errno != EINTR)
+                {
+                  set_problem_from_errno (self, "couldn't read", errno);
+                  close_immediately (self, NULL); /* problem already set */
+                  return FALSE;
+                }
+              if (self->priv->adaptive_read)
+                adapt_read_size (self, size, 0);
+              return TRUE;
             }
-          return TRUE;
+
+          g_byte_array_set_size (self->priv->in_buffer, len + ret);
+          len += ret;
+          total += ret;
+
+          if (ret == 0 || !self->priv->adaptive_read)
+            break;
+
+          adapt_read_size (self, size, ret);
+          if (total >= ADAPTIVE_READ_BUDGET)
+            break;
         }
     }
 
-  g_byte_array_set_size (self->priv->in_buffer, len + ret);
-
   if (ret == 0)
     {
       g_debug ("%s: end of input", self->priv->name);
@@ -310,18 +521,71 @@ dispatch_input (gint fd,
   return TRUE;
 }
 
+static void
+append_error (CockpitPipe *self,
+              const guint8 *data,
+              gsize length)
+{
+  GByteArray *head = self->priv->err_buffer;
+  gsize head_size;
+  gsize block;
+
+  /* The first half of the limit goes in the buffer as is */
+  head_size = cockpit_pipe_stderr_maximum / 2;
+  if (head->len < head_size)
+    {
+      block = MIN (length, head_size - head->len);
+      g_byte_array_append (head, data, block);
+      data += block;
+      length -= block;
+    }
+
+  if (length == 0)
+    return;
+
+  /* The rest goes in a ring, overwriting the oldest */
+  if (!self->priv->err_tail)
+    {
+      self->priv->err_tail_size = MAX (cockpit_pipe_stderr_maximum - head_size, 1);
+      self->priv->err_tail = g_malloc (self->priv->err_tail_size);
+    }
+
+  if (length > self->priv->err_tail_size)
+    {
+      self->priv->err_dropped += length - self->priv->err_tail_size;
+      data += length - self->priv->err_tail_size;
+      length = self->priv->err_tail_size;
+    }
+
+  if (self->priv->err_tail_len + length > self->priv->err_tail_size)
+    {
+      block = self->priv->err_tail_len + length - self->priv->err_tail_size;
+      self->priv->err_dropped += block;
+      self->priv->err_tail_len -= block;
+    }
+
+  while (length > 0)
+    {
+      block = MIN (length, self->priv->err_tail_size - self->priv->err_tail_pos);
+      memcpy (self->priv->err_tail + self->priv->err_tail_pos, data, block);
+      self->priv->err_tail_pos = (self->priv->err_tail_pos + block) % self->priv->err_tail_size;
+      self->priv->err_tail_len += block;
+      data += block;
+      length -= block;
+    }
+}
+
 static gboolean
 dispatch_error (gint fd,
                 GIOCondition cond,
                 gpointer user_data)
 {
   CockpitPipe *self = (CockpitPipe *)user_data;
+  guint8 data[1024];
   gssize ret = 0;
-  gsize len;
   gboolean eof;
 
   g_return_val_if_fail (self->priv->err_source, FALSE);
-  len = self->priv->err_buffer->len;
 
   /*
    * Enable clean shutdown by not reading when we just get
@@ -332,11 +596,9 @@ dispatch_error (gint fd,
     {
       g_debug ("%s: reading error", self->priv->name);
 
-      g_byte_array_set_size (self->priv->err_buffer, len + 1024);
-      ret = read (self->priv->err_fd, self->priv->err_buffer->data + len, 1024);
+      ret = read (self->priv->err_fd, data, sizeof (data));
       if (ret < 0)
         {
-          g_byte_array_set_size (self->priv->err_buffer, len);
           if (errno != EAGAIN && errno != EINTR)
             {
               g_warning ("%s: couldn't read error: %s", self->priv->name, g_strerror (errno));
@@ -347,7 +609,8 @@ dispatch_error (gint fd,
         }
     }
 
-  g_byte_array_set_size (self->priv->err_buffer, len + ret);
+  if (ret > 0)
+    append_error (self, data, ret);
 
   if (ret == 0)
     {
@@ -379,11 +642,12 @@ close_output (CockpitPipe *self)
           if (errno == ENOTSOCK)
             {
               g_debug ("%s: not a socket, closing entirely", self->priv->name);
-              close (self->priv->out_fd);
 
+              /* Stop watching the fd before it goes away */
               if (self->priv->in_fd == self->priv->out_fd)
                 {
                   self->priv->in_fd = -1;
+                  self->priv->in_throttled = FALSE;
                   if (self->priv->in_source)
                     {
                       g_debug ("%s: and closing input because same fd", self->priv->name);
@@ -391,6 +655,8 @@ close_output (CockpitPipe *self)
                     }
                 }
 
+              close (self->priv->out_fd);
+
               self->priv->out_fd = -1;
             }
           else
@@ -462,14 +728,131 @@ dispatch_connect (CockpitPipe *self)
   return TRUE;
 }
 
+static void
+dequeue_block (GQueue *queue)
+{
+  GBytes *block;
+
+  block = g_queue_pop_head (queue);
+  cockpit_stats_add (NULL, COCKPIT_STAT_PIPE_QUEUED, -1);
+  cockpit_stats_add (NULL, COCKPIT_STAT_PIPE_QUEUED_BYTES, -(gssize)g_bytes_get_size (block));
+  g_bytes_unref (block);
+}
+
+static void
+dequeue_output (CockpitPipe *self)
+{
+  dequeue_block (self->priv->out_queue);
+}
+
+/*
+ * Returns the next marked boundary at or after what was written
+ * so far, or zero when there isn't one.
+ */
+static guint64
+next_boundary (CockpitPipe *self)
+{
+  GArray *boundaries = self->priv->out_boundaries;
+  guint64 boundary;
+
+  while (self->priv->boundary_head < boundaries->len)
+    {
+      boundary = g_array_index (boundaries, guint64, self->priv->boundary_head);
+      if (boundary >= self->priv->out_written)
+        return boundary;
+      self->priv->boundary_head++;
+    }
+
+  g_array_set_size (boundaries, 0);
+  self->priv->boundary_head = 0;
+  return 0;
+}
+
+static gboolean
+output_at_boundary (CockpitPipe *self)
+{
+  if (g_queue_is_empty (self->priv->out_queue))
+    return TRUE;
+  return next_boundary (self) == self->priv->out_written;
+}
+
+static gboolean
+dispatch_urgent (CockpitPipe *self,
+                 gssize *written)
+{
+  struct iovec iov[OUTPUT_IOV_MAX];
+  gsize partial;
+  gssize ret;
+  gint i, count;
+  GList *l;
+
+  partial = self->priv->urgent_partial;
+  for (l = self->priv->out_urgent->head, i = 0;
+       i < G_N_ELEMENTS (iov) && l != NULL;
+       i++, l = g_list_next (l))
+    {
+      iov[i].iov_base = (gpointer)g_bytes_get_data (l->data, &iov[i].iov_len);
+      if (partial)
+        {
+          g_assert (partial < iov[i].iov_len);
+          iov[i].iov_len -= partial;
+          iov[i].iov_base = ((gchar *)iov[i].iov_base) + partial;
+          partial = 0;
+        }
+    }
+  count = i;
+
+  ret = writev (self->priv->out_fd, iov, count);
+  *written = ret;
+  if (ret < 0)
+    return FALSE;
+
+  cockpit_stats_add (NULL, COCKPIT_STAT_PIPE_WRITTEN, ret);
+  for (i = 0; ret > 0 && i < count; i++)
+    {
+      if (ret >= iov[i].iov_len)
+        {
+          cockpit_log_ring_record (COCKPIT_LOG_RING_PIPE_URGENT, self->priv->name, iov[i].iov_len);
+          dequeue_block (self->priv->out_urgent);
+          self->priv->urgent_partial = 0;
+          ret -= iov[i].iov_len;
+        }
+      else
+        {
+          self->priv->urgent_partial += ret;
+          ret = 0;
+        }
+    }
+
+  return TRUE;
+}
+
+static gssize
+write_spliced (CockpitPipe *self,
+               gsize length)
+{
+#ifdef HAVE_SPLICE
+  return splice (self->priv->splice_fds[0], NULL, self->priv->out_fd, NULL,
+                 length, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+#else
+  g_assert_not_reached ();
+  return -1;
+#endif
+}
+
 static gboolean
 dispatch_output (gint fd,
                  GIOCondition cond,
                  gpointer user_data)
 {
   CockpitPipe *self = (CockpitPipe *)user_data;
-  struct iovec iov[4];
+  struct iovec iov[OUTPUT_IOV_MAX];
+  gboolean capped = FALSE;
+  gboolean spliced;
+  guint64 limit = 0;
   gsize partial;
+  gsize remaining = 0;
+  gsize length = 0;
   gssize ret;
   gint i, count;
   GList *l;
@@ -480,6 +863,38 @@ dispatch_output (gint fd,
 
   g_return_val_if_fail (self->priv->out_source, FALSE);
 
+  /* Urgent blocks are written whole, so once started they're finished first */
+  if (self->priv->out_urgent->head)
+    {
+      if (self->priv->urgent_partial > 0 || output_at_boundary (self))
+        {
+          spliced = FALSE;
+          count = 0;
+          if (!dispatch_urgent (self, &ret))
+            goto written;
+          goto done;
+        }
+
+      /* Otherwise only write up to the next boundary */
+      limit = next_boundary (self);
+      if (limit > 0)
+        limit -= self->priv->out_written;
+    }
+
+  /* Spliced blocks are written on their own, straight from the kernel pipe */
+  l = self->priv->out_queue->head;
+  spliced = (l != NULL && g_bytes_get_size (l->data) == 0);
+  if (spliced)
+    {
+      remaining = GPOINTER_TO_SIZE (g_queue_peek_head (self->priv->out_spliced)) - self->priv->out_partial;
+      length = remaining;
+      if (limit > 0 && length > limit)
+        length = limit;
+      count = 1;
+      ret = write_spliced (self, length);
+      goto written;
+    }
+
   /* Note we fall through when nothing to write */
   partial = self->priv->out_partial;
   for (l = self->priv->out_queue->head, i = 0;
@@ -487,6 +902,8 @@ dispatch_output (gint fd,
       i++, l = g_list_next (l))
     {
       iov[i].iov_base = (gpointer)g_bytes_get_data (l->data, &iov[i].iov_len);
+      if (iov[i].iov_len == 0)
+        break;
 
       if (partial)
         {
@@ -495,6 +912,19 @@ dispatch_output (gint fd,
           iov[i].iov_base = ((gchar *)iov[i].iov_base) + partial;
           partial = 0;
         }
+
+      if (limit > 0)
+        {
+          if (iov[i].iov_len >= limit)
+            {
+              capped = (iov[i].iov_len > limit);
+              iov[i].iov_len = limit;
+              limit = 0;
+              i++;
+              break;
+            }
+          limit -= iov[i].iov_len;
+        }
     }
   count = i;
 
@@ -502,6 +932,8 @@ dispatch_output (gint fd,
     ret = 0;
   else
     ret = writev (self->priv->out_fd, iov, count);
+
+written:
   if (ret < 0)
     {
       if (errno != EAGAIN && errno != EINTR)
@@ -521,28 +953,48 @@ dispatch_output (gint fd,
     }
 
   /* Figure out what was written */
-  for (i = 0; ret > 0 && i < count; i++)
+  cockpit_stats_add (NULL, COCKPIT_STAT_PIPE_WRITTEN, ret);
+  self->priv->out_written += ret;
+  if (spliced)
     {
-      if (ret >= iov[i].iov_len)
+      g_assert (ret <= length);
+      self->priv->splice_pending -= ret;
+      if (ret == remaining)
         {
-          g_debug ("%s: wrote %d bytes", self->priv->name, (int)iov[i].iov_len);
-          g_bytes_unref (g_queue_pop_head (self->priv->out_queue));
+          cockpit_log_ring_record (COCKPIT_LOG_RING_PIPE_SPLICED, self->priv->name, ret);
+          dequeue_output (self);
+          g_queue_pop_head (self->priv->out_spliced);
           self->priv->out_partial = 0;
-          ret -= iov[i].iov_len;
         }
       else
         {
-          g_debug ("%s: partial write %d of %d bytes", self->priv->name,
-                   (int)ret, (int)iov[i].iov_len);
           self->priv->out_partial += ret;
+        }
+    }
+
+  for (i = 0; !spliced && ret > 0 && i < count; i++)
+    {
+      /* A block cut short at a boundary isn't done yet */
+      if (ret >= iov[i].iov_len && !(capped && i == count - 1))
+        {
+          cockpit_log_ring_record (COCKPIT_LOG_RING_PIPE_WROTE, self->priv->name, iov[i].iov_len);
+          dequeue_output (self);
+          self->priv->out_partial = 0;
+          ret -= iov[i].iov_len;
+        }
+      else
+        {
+          cockpit_log_ring_record (COCKPIT_LOG_RING_PIPE_PARTIAL, self->priv->name, ret);
+          self->priv->out_partial += MIN (ret, iov[i].iov_len);
           ret = 0;
         }
     }
 
-  if (self->priv->out_queue->head)
+done:
+  if (self->priv->out_queue->head || self->priv->out_urgent->head)
     return TRUE;
 
-  g_debug ("%s: output queue empty", self->priv->name);
+  cockpit_log_ring_record (COCKPIT_LOG_RING_PIPE_EMPTY, self->priv->name, 0);
 
   /* If all messages are done, then stop polling out fd */
   stop_output (self);
@@ -559,12 +1011,23 @@ static void
 start_output (CockpitPipe *self)
 {
   g_assert (self->priv->out_source == NULL);
-  self->priv->out_source = cockpit_unix_fd_source_new (self->priv->out_fd, G_IO_OUT);
+  self->priv->out_source = pipe_fd_source_new (self->priv->out_fd, G_IO_OUT);
   g_source_set_name (self->priv->out_source, "pipe-output");
   g_source_set_callback (self->priv->out_source, (GSourceFunc)dispatch_output, self, NULL);
   g_source_attach (self->priv->out_source, self->priv->context);
 }
 
+static void
+set_pipe_size (CockpitPipe *self,
+               int fd)
+{
+#ifdef F_SETPIPE_SZ
+  /* Best effort, fails for sockets or over the per user limit */
+  if (fcntl (fd, F_SETPIPE_SZ, self->priv->pipe_size) < 0)
+    g_debug ("%s: couldn't set pipe size: %s", self->priv->name, g_strerror (errno));
+#endif
+}
+
 static void
 cockpit_pipe_constructed (GObject *object)
 {
@@ -573,6 +1036,14 @@ cockpit_pipe_constructed (GObject *object)
 
   G_OBJECT_CLASS (cockpit_pipe_parent_class)->constructed (object);
 
+  if (self->priv->pipe_size > 0)
+    {
+      if (self->priv->in_fd >= 0)
+        set_pipe_size (self, self->priv->in_fd);
+      if (self->priv->out_fd >= 0 && self->priv->out_fd != self->priv->in_fd)
+        set_pipe_size (self, self->priv->out_fd);
+    }
+
   if (self->priv->in_fd >= 0)
     {
       if (!g_unix_set_fd_nonblocking (self->priv->in_fd, TRUE, &error))
@@ -582,10 +1053,7 @@ cockpit_pipe_constructed (GObject *object)
           g_clear_error (&error);
         }
 
-      self->priv->in_source = cockpit_unix_fd_source_new (self->priv->in_fd, G_IO_IN);
-      g_source_set_name (self->priv->in_source, "pipe-input");
-      g_source_set_callback (self->priv->in_source, (GSourceFunc)dispatch_input, self, NULL);
-      g_source_attach (self->priv->in_source, self->priv->context);
+      start_input (self);
     }
 
   if (self->priv->out_fd >= 0)
@@ -609,7 +1077,7 @@ cockpit_pipe_constructed (GObject *object)
         }
 
       self->priv->err_buffer = g_byte_array_new ();
-      self->priv->err_source = cockpit_unix_fd_source_new (self->priv->err_fd, G_IO_IN);
+      self->priv->err_source = pipe_fd_source_new (self->priv->err_fd, G_IO_IN);
       g_source_set_name (self->priv->err_source, "pipe-error");
       g_source_set_callback (self->priv->err_source, (GSourceFunc)dispatch_error, self, NULL);
       g_source_attach (self->priv->err_source, self->priv->context);
@@ -658,6 +1126,17 @@ cockpit_pipe_set_property (GObject *obj,
       case PROP_READ_SIZE:
         self->priv->read_size = g_value_get_int (value);
         break;
+      case PROP_PIPE_SIZE:
+        self->priv->pipe_size = g_value_get_int (value);
+        break;
+      case PROP_ADAPTIVE_READ:
+        self->priv->adaptive_read = g_value_get_boolean (value);
+        break;
+      case PROP_CORK:
+        self->priv->cork = g_value_get_boolean (value);
+        if (!self->priv->cork)
+          flush_cork (self);
+        break;
       case PROP_PROBLEM:
         self->priv->problem = g_value_dup_string (value);
         if (self->priv->problem)
@@ -697,6 +1176,15 @@ cockpit_pipe_get_property (GObject *obj,
     case PROP_READ_SIZE:
       g_value_set_int (value, self->priv->read_size);
       break;
+    case PROP_PIPE_SIZE:
+      g_value_set_int (value, self->priv->pipe_size);
+      break;
+    case PROP_ADAPTIVE_READ:
+      g_value_set_boolean (value, self->priv->adaptive_read);
+      break;
+    case PROP_CORK:
+      g_value_set_boolean (value, self->priv->cork);
+      break;
     case PROP_PROBLEM:
       g_value_set_string (value, self->priv->problem);
       break;
@@ -720,8 +1208,12 @@ cockpit_pipe_dispose (GObject *object)
   if (!self->priv->closed)
     close_immediately (self, "terminated");
 
+  stop_cork (self);
   while (self->priv->out_queue->head)
-    g_bytes_unref (g_queue_pop_head (self->priv->out_queue));
+    dequeue_output (self);
+  while (self->priv->out_urgent->head)
+    dequeue_block (self->priv->out_urgent);
+  g_queue_clear (self->priv->out_spliced);
 
   G_OBJECT_CLASS (cockpit_pipe_parent_class)->dispose (object);
 }
@@ -749,7 +1241,13 @@ cockpit_pipe_finalize (GObject *object)
   g_byte_array_unref (self->priv->in_buffer);
   if (self->priv->err_buffer)
     g_byte_array_unref (self->priv->err_buffer);
+  g_free (self->priv->err_tail);
   g_queue_free (self->priv->out_queue);
+  g_queue_free (self->priv->out_urgent);
+  g_array_free (self->priv->out_boundaries, TRUE);
+  g_queue_free (self->priv->out_spliced);
+  if (self->priv->splice_block)
+    g_bytes_unref (self->priv->splice_block);
   g_free (self->priv->problem);
   g_free (self->priv->name);
 
@@ -770,6 +1268,9 @@ cockpit_pipe_class_init (CockpitPipeClass *klass)
   gobject_class->dispose = cockpit_pipe_dispose;
   gobject_class->finalize = cockpit_pipe_finalize;
 
+  if (g_strcmp0 (g_getenv ("COCKPIT_PIPE_EPOLL"), "1") == 0)
+    cockpit_pipe_use_epoll = TRUE;
+
   /**
    * CockpitPipe:in-fd:
    *
@@ -841,6 +1342,41 @@ cockpit_pipe_class_init (CockpitPipeClass *klass)
                 g_param_spec_int ("read-size", "read-size", "read-size", 1024, G_MAXINT, 1024,
                                   G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS));
 
+  /**
+   * CockpitPipe:pipe-size:
+   *
+   * Ask the kernel for pipe buffers of this size on the file
+   * descriptors, so that more data moves with each read and write.
+   * Zero leaves them at the default.
+   */
+  g_object_class_install_property (gobject_class, PROP_PIPE_SIZE,
+                g_param_spec_int ("pipe-size", "pipe-size", "pipe-size", 0, G_MAXINT, 0,
+                                  G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * CockpitPipe:adaptive-read:
+   *
+   * Read until the input would block, growing the read size under
+   * sustained load, and emit the CockpitPipe::read signal once for
+   * the whole batch. CockpitPipe:read-size is the smallest read.
+   *
+   * Don't use this for packet based file descriptors where each
+   * read is expected to be a complete message.
+   */
+  g_object_class_install_property (gobject_class, PROP_ADAPTIVE_READ,
+                g_param_spec_boolean ("adaptive-read", "adaptive-read", "adaptive-read", FALSE,
+                                      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * CockpitPipe:cork:
+   *
+   * Coalesce small writes into a single block, which is queued
+   * once the main loop runs, or when a larger write comes along.
+   */
+  g_object_class_install_property (gobject_class, PROP_CORK,
+                g_param_spec_boolean ("cork", "cork", "cork", FALSE,
+                                      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
   /**
    * CockpitPipe::read:
    * @buffer: a GByteArray of the read data
@@ -879,6 +1415,86 @@ cockpit_pipe_class_init (CockpitPipeClass *klass)
   g_type_class_add_private (klass, sizeof (CockpitPipePrivate));
 }
 
+static void
+queue_output (CockpitPipe *self,
+              GQueue *queue,
+              GBytes *data)
+{
+  g_queue_push_tail (queue, g_bytes_ref (data));
+  cockpit_stats_add (NULL, COCKPIT_STAT_PIPE_QUEUED, 1);
+  cockpit_stats_add (NULL, COCKPIT_STAT_PIPE_QUEUED_BYTES, g_bytes_get_size (data));
+
+  if (!self->priv->out_source && self->priv->out_fd >= 0)
+    {
+      start_output (self);
+    }
+}
+
+static void
+flush_cork (CockpitPipe *self)
+{
+  GBytes *bytes;
+
+  if (self->priv->cork_source)
+    {
+      g_source_destroy (self->priv->cork_source);
+      g_source_unref (self->priv->cork_source);
+      self->priv->cork_source = NULL;
+    }
+
+  if (self->priv->cork_buffer)
+    {
+      bytes = g_byte_array_free_to_bytes (self->priv->cork_buffer);
+      self->priv->cork_buffer = NULL;
+      cockpit_log_ring_record (COCKPIT_LOG_RING_PIPE_CORKED, self->priv->name, g_bytes_get_size (bytes));
+      queue_output (self, self->priv->out_queue, bytes);
+      g_bytes_unref (bytes);
+    }
+}
+
+static gboolean
+on_cork_flush (gpointer user_data)
+{
+  CockpitPipe *self = user_data;
+
+  /* Main loop holds a reference to the source while dispatching */
+  g_source_unref (self->priv->cork_source);
+  self->priv->cork_source = NULL;
+
+  flush_cork (self);
+  return FALSE;
+}
+
+static gboolean
+write_corked (CockpitPipe *self,
+              GBytes *data)
+{
+  gconstpointer block;
+  gsize length;
+
+  block = g_bytes_get_data (data, &length);
+  if (length >= CORK_BLOCK_MAX)
+    return FALSE;
+
+  if (self->priv->cork_buffer && self->priv->cork_buffer->len + length > CORK_BUFFER_MAX)
+    flush_cork (self);
+
+  if (!self->priv->cork_buffer)
+    self->priv->cork_buffer = g_byte_array_sized_new (CORK_BLOCK_MAX);
+  g_byte_array_append (self->priv->cork_buffer, block, length);
+
+  if (!self->priv->cork_source)
+    {
+      self->priv->cork_source = g_idle_source_new ();
+      g_source_set_priority (self->priv->cork_source, G_PRIORITY_DEFAULT);
+      g_source_set_name (self->priv->cork_source, "pipe-cork");
+      g_source_set_callback (self->priv->cork_source, on_cork_flush, self, NULL);
+      g_source_attach (self->priv->cork_source, self->priv->context);
+    }
+
+  return TRUE;
+}
+
 /**
  * cockpit_pipe_write:
  * @self: the pipe
@@ -932,13 +1548,17 @@ _cockpit_pipe_write (CockpitPipe *self,
       return;
     }
 
-  g_queue_push_tail (self->priv->out_queue, g_bytes_ref (data));
+  self->priv->out_total += g_bytes_get_size (data);
 
-  if (!self->priv->out_source && self->priv->out_fd >= 0)
+  if (self->priv->cork)
     {
-      start_output (self);
+      if (write_corked (self, data))
+        return;
+      flush_cork (self);
     }
 
+  queue_output (self, self->priv->out_queue, data);
+
   /*
    * If this becomes thread-safe, then something like this is needed:
    * g_main_context_wakeup (g_source_get_context (self->priv->source));
@@ -967,8 +1587,13 @@ cockpit_pipe_close (CockpitPipe *self,
   self->priv->closing = TRUE;
 
   if (problem)
+    {
       close_immediately (self, problem);
-  else if (g_queue_is_empty (self->priv->out_queue))
+      return;
+    }
+
+  flush_cork (self);
+  if (g_queue_is_empty (self->priv->out_queue) && g_queue_is_empty (self->priv->out_urgent))
     close_output (self);
 }
 
@@ -1068,6 +1693,13 @@ calculate_spawn_flags (const gchar **env,
   GSpawnFlags flags = G_SPAWN_DO_NOT_REAP_CHILD;
   gboolean path_flag = FALSE;
 
+  /*
+   * spawn_setup() takes care of the descriptors, faster than glib does.
+   * But only with close_range(), the fallback isn't safe after fork().
+   */
+  if (cockpit_unix_fd_can_cloexec_all ())
+    flags |= G_SPAWN_LEAVE_DESCRIPTORS_OPEN;
+
   for (; env && env[0]; env++)
     {
       if (g_str_has_prefix (env[0], "PATH="))
@@ -1097,10 +1729,375 @@ spawn_setup (gpointer data)
   prctl (PR_SET_PDEATHSIG, SIGHUP);
 #endif
 
+  /* The bridge may ignore SIGPIPE, but commands expect the default */
+  signal (SIGPIPE, SIG_DFL);
+
   if (flags & COCKPIT_PIPE_STDERR_TO_STDOUT)
     dup2 (1, 2);
+
+  /* Answered before the fork, by calculate_spawn_flags() */
+  if (cockpit_unix_fd_can_cloexec_all () && cockpit_unix_fd_cloexec_all (3) < 0)
+    {
+      /* No g_printerr() here, it may allocate */
+      static const char message[] = "couldn't close file descriptors\n";
+      ssize_t unused = write (2, message, sizeof (message) - 1);
+      (void)unused;
+      _exit (127);
+    }
+}
+
+/* Overridable from tests and benchmarks */
+gboolean cockpit_pipe_fast_spawn = TRUE;
+
+/* As in cockpitunixfd.c */
+#if defined(__linux) && !defined(__NR_close_range) && !defined(__alpha__)
+#define __NR_close_range 436
+#endif
+
+#ifndef CLOSE_RANGE_CLOEXEC
+#define CLOSE_RANGE_CLOEXEC (1U << 2)
+#endif
+
+#if defined(__linux) && defined(__NR_close_range)
+#define HAVE_FAST_SPAWN 1
+
+/*
+ * The fast path spawns with clone (CLONE_VM | CLONE_VFORK), so the
+ * memory of a large bridge isn't copied, nor its page tables, for every
+ * short command. The child shares our memory until it calls exec, so
+ * it may only make plain system calls. Everything that allocates, like
+ * searching $PATH, is done beforehand. The child tells us how far it
+ * got through the shared FastSpawn.
+ *
+ * This relies on close_range() to mark descriptors close on exec. On
+ * older kernels the child reports that, and we fall back to glib.
+ */
+
+typedef struct {
+  const gchar *program;
+  gchar **argv;
+  gchar **sh_argv;
+  gchar **envp;
+  const gchar *directory;
+  int fds[3];
+  gboolean stderr_to_stdout;
+  sigset_t mask;
+
+  /* Written by the child */
+  int stage;
+  int error;
+} FastSpawn;
+
+enum {
+  STAGE_NONE,
+  STAGE_SETUP,
+  STAGE_CLOEXEC,
+  STAGE_CHDIR,
+  STAGE_EXEC,
+};
+
+#define FAST_SPAWN_STACK (64 * 1024)
+
+static int
+fast_spawn_child (void *data)
+{
+  FastSpawn *fs = data;
+  struct sigaction sa;
+  int i;
+
+  /* Our handlers must not run here, they'd be acting on the parent's memory */
+  for (i = 1; i < NSIG; i++)
+    {
+      if (sigaction (i, NULL, &sa) == 0 &&
+          sa.sa_handler != SIG_IGN && sa.sa_handler != SIG_DFL)
+        {
+          sa.sa_handler = SIG_DFL;
+          sa.sa_flags = 0;
+          sigemptyset (&sa.sa_mask);
+          sigaction (i, &sa, NULL);
+        }
+    }
+
+  /* The bridge may ignore SIGPIPE, but commands expect the default */
+  sa.sa_handler = SIG_DFL;
+  sa.sa_flags = 0;
+  sigemptyset (&sa.sa_mask);
+  sigaction (SIGPIPE, &sa, NULL);
+
+  fs->stage = STAGE_SETUP;
+
+  /* Send this signal to all direct child processes, when bridge dies */
+  prctl (PR_SET_PDEATHSIG, SIGHUP);
+
+  for (i = 0; i < 3; i++)
+    {
+      if (fs->fds[i] >= 0 && dup2 (fs->fds[i], i) < 0)
+        goto fail;
+    }
+
+  if (fs->stderr_to_stdout && dup2 (1, 2) < 0)
+    goto fail;
+
+  fs->stage = STAGE_CLOEXEC;
+  if (syscall (__NR_close_range, 3, ~0U, CLOSE_RANGE_CLOEXEC) < 0)
+    goto fail;
+
+  if (fs->directory)
+    {
+      fs->stage = STAGE_CHDIR;
+      if (chdir (fs->directory) < 0)
+        goto fail;
+    }
+
+  sigprocmask (SIG_SETMASK, &fs->mask, NULL);
+
+  fs->stage = STAGE_EXEC;
+  execve (fs->program, fs->argv, fs->envp);
+
+  /* As execvp() does, a script without a #! line is run by the shell */
+  if (errno == ENOEXEC)
+    execve ("/bin/sh", fs->sh_argv, fs->envp);
+
+fail:
+  fs->error = errno;
+  _exit (127);
+}
+
+static gchar *
+find_program (const gchar *name,
+              const gchar **env)
+{
+  const gchar *path = NULL;
+  gchar **dirs;
+  gchar *program = NULL;
+  gint i;
+
+  /* The same rules as calculate_spawn_flags() asks glib for */
+  if (strchr (name, '/'))
+    return g_strdup (name);
+
+  if (env)
+    path = g_environ_getenv ((gchar **)env, "PATH");
+  if (!path)
+    path = g_getenv ("PATH");
+  if (!path)
+    path = "/bin:/usr/bin";
+
+  dirs = g_strsplit (path, ":", -1);
+  for (i = 0; !program && dirs[i] != NULL; i++)
+    {
+      program = g_build_filename (dirs[i][0] ? dirs[i] : ".", name, NULL);
+      if (!g_file_test (program, G_FILE_TEST_IS_EXECUTABLE) ||
+          g_file_test (program, G_FILE_TEST_IS_DIR))
+        {
+          g_free (program);
+          program = NULL;
+        }
+    }
+
+  g_strfreev (dirs);
+  return program;
+}
+
+static int
+pipe_above_stdio (int fds[2])
+{
+  int fd;
+  int i;
+
+  if (pipe2 (fds, O_CLOEXEC) < 0)
+    return -1;
+
+  /* So the child's dup2() calls can't trample each other */
+  for (i = 0; i < 2; i++)
+    {
+      if (fds[i] < 3)
+        {
+          fd = fcntl (fds[i], F_DUPFD_CLOEXEC, 3);
+          close (fds[i]);
+          fds[i] = fd;
+        }
+    }
+
+  if (fds[0] < 0 || fds[1] < 0)
+    {
+      if (fds[0] >= 0)
+        close (fds[0]);
+      if (fds[1] >= 0)
+        close (fds[1]);
+      return -1;
+    }
+
+  return 0;
+}
+
+static void
+close_fds (int *fds,
+           gint count)
+{
+  gint i;
+
+  for (i = 0; i < count; i++)
+    {
+      if (fds[i] >= 0)
+        close (fds[i]);
+      fds[i] = -1;
+    }
+}
+
+/*
+ * Returns FALSE when the fast path isn't available and glib should be
+ * used. Otherwise either the child was spawned, or @error is set.
+ */
+static gboolean
+fast_spawn (const gchar **argv,
+            const gchar **env,
+            const gchar *directory,
+            CockpitPipeFlags flags,
+            GPid *pid,
+            int *in_fd,
+            int *out_fd,
+            int *err_fd,
+            GError **error)
+{
+  static gboolean unavailable = FALSE;
+  int child_fds[3] = { -1, -1, -1 };
+  int parent_fds[3] = { -1, -1, -1 };
+  int fds[2];
+  FastSpawn fs;
+  sigset_t all;
+  gchar *stack;
+  gint code;
+  gint argc;
+  pid_t child;
+
+  if (unavailable)
+    return FALSE;
+
+  memset (&fs, 0, sizeof (fs));
+  fs.program = find_program (argv[0], env);
+  if (!fs.program)
+    {
+      g_set_error (error, G_SPAWN_ERROR, G_SPAWN_ERROR_NOENT,
+                   "Failed to execute child process \"%s\" (%s)", argv[0], g_strerror (ENOENT));
+      return TRUE;
+    }
+
+  if (pipe_above_stdio (fds) < 0)
+    goto fork_failed;
+  child_fds[0] = fds[0];
+  parent_fds[0] = fds[1];
+
+  if (pipe_above_stdio (fds) < 0)
+    goto fork_failed;
+  parent_fds[1] = fds[0];
+  child_fds[1] = fds[1];
+
+  if (err_fd)
+    {
+      if (pipe_above_stdio (fds) < 0)
+        goto fork_failed;
+      parent_fds[2] = fds[0];
+      child_fds[2] = fds[1];
+    }
+  else if (flags & COCKPIT_PIPE_STDERR_TO_NULL)
+    {
+      child_fds[2] = open ("/dev/null", O_WRONLY | O_CLOEXEC);
+      if (child_fds[2] < 0)
+        goto fork_failed;
+    }
+
+  memcpy (fs.fds, child_fds, sizeof (fs.fds));
+  fs.argv = (gchar **)argv;
+  fs.envp = env ? (gchar **)env : environ;
+
+  /* Prepared here, the child can't allocate */
+  argc = g_strv_length ((gchar **)argv);
+  fs.sh_argv = g_new (gchar *, argc + 2);
+  fs.sh_argv[0] = "/bin/sh";
+  fs.sh_argv[1] = (gchar *)fs.program;
+  memcpy (fs.sh_argv + 2, argv + 1, sizeof (gchar *) * argc);
+  fs.directory = directory;
+  fs.stderr_to_stdout = (flags & COCKPIT_PIPE_STDERR_TO_STDOUT) ? TRUE : FALSE;
+
+  /* Signals stay blocked until the child no longer shares our memory */
+  stack = g_malloc (FAST_SPAWN_STACK);
+  sigfillset (&all);
+  pthread_sigmask (SIG_SETMASK, &all, &fs.mask);
+
+  child = clone (fast_spawn_child, stack + FAST_SPAWN_STACK,
+                 CLONE_VM | CLONE_VFORK | SIGCHLD, &fs);
+  code = errno;
+
+  pthread_sigmask (SIG_SETMASK, &fs.mask, NULL);
+  g_free (fs.sh_argv);
+  g_free (stack);
+  close_fds (child_fds, 3);
+
+  if (child < 0)
+    {
+      errno = code;
+      goto fork_failed;
+    }
+
+  if (fs.error)
+    {
+      /* The child has exited, collect it */
+      while (waitpid (child, NULL, 0) < 0 && errno == EINTR);
+      close_fds (parent_fds, 3);
+
+      if (fs.stage == STAGE_CLOEXEC)
+        {
+          g_debug ("couldn't use close_range(), spawning with fork: %s", g_strerror (fs.error));
+          unavailable = TRUE;
+          g_free ((gchar *)fs.program);
+          return FALSE;
+        }
+      else if (fs.stage == STAGE_CHDIR)
+        {
+          g_set_error (error, G_SPAWN_ERROR, G_SPAWN_ERROR_CHDIR,
+                       "Failed to change to directory \"%s\" (%s)", directory, g_strerror (fs.error));
+        }
+      else
+        {
+          if (fs.stage != STAGE_EXEC)
+            code = G_SPAWN_ERROR_FAILED;
+          else if (fs.error == ENOENT || fs.error == ENOTDIR)
+            code = G_SPAWN_ERROR_NOENT;
+          else if (fs.error == EACCES)
+            code = G_SPAWN_ERROR_ACCES;
+          else if (fs.error == EPERM)
+            code = G_SPAWN_ERROR_PERM;
+          else
+            code = G_SPAWN_ERROR_FAILED;
+          g_set_error (error, G_SPAWN_ERROR, code,
+                       "Failed to execute child process \"%s\" (%s)", argv[0], g_strerror (fs.error));
+        }
+    }
+  else
+    {
+      *pid = child;
+      *in_fd = parent_fds[0];
+      *out_fd = parent_fds[1];
+      if (err_fd)
+        *err_fd = parent_fds[2];
+    }
+
+  g_free ((gchar *)fs.program);
+  return TRUE;
+
+fork_failed:
+  code = errno;
+  close_fds (child_fds, 3);
+  close_fds (parent_fds, 3);
+  g_set_error (error, G_SPAWN_ERROR, G_SPAWN_ERROR_FORK,
+               "Failed to fork (%s)", g_strerror (code));
+  g_free ((gchar *)fs.program);
+  return TRUE;
 }
 
+#endif /* HAVE_FAST_SPAWN */
+
 /**
  * cockpit_pipe_spawn:
  * @argv: null terminated string array of command arguments
@@ -1140,10 +2137,17 @@ cockpit_pipe_spawn (const gchar **argv,
   if (flags & COCKPIT_PIPE_STDERR_TO_MEMORY)
     with_stderr = &session_stderr;
 
-  g_spawn_async_with_pipes (directory, (gchar **)argv, (gchar **)env,
-                            calculate_spawn_flags (env, flags),
-                            spawn_setup, GINT_TO_POINTER (flags),
-                            &pid, &session_stdin, &session_stdout, with_stderr, &error);
+#ifdef HAVE_FAST_SPAWN
+  if (!cockpit_pipe_fast_spawn ||
+      !fast_spawn (argv, env, directory, flags, &pid,
+                   &session_stdin, &session_stdout, with_stderr, &error))
+#endif
+    {
+      g_spawn_async_with_pipes (directory, (gchar **)argv, (gchar **)env,
+                                calculate_spawn_flags (env, flags),
+                                spawn_setup, GINT_TO_POINTER (flags),
+                                &pid, &session_stdin, &session_stdout, with_stderr, &error);
+    }
 
   name = g_path_get_basename (argv[0]);
   if (name == NULL)
@@ -1307,6 +2311,251 @@ cockpit_pipe_get_name (CockpitPipe *self)
   return self->priv->name;
 }
 
+/**
+ * cockpit_pipe_throttle:
+ * @self: a pipe
+ * @throttle: whether to stop reading
+ *
+ * Stop reading input from the pipe, for example while whatever
+ * the input is passed on to is backed up. Reading starts again
+ * when this is called with @throttle set to %FALSE.
+ *
+ * This has no effect once the input has reached its end. A clean
+ * close waits for the end of input, and so completes only once
+ * reading resumes. Closing with a problem happens right away.
+ */
+void
+cockpit_pipe_throttle (CockpitPipe *self,
+                       gboolean throttle)
+{
+  g_return_if_fail (COCKPIT_IS_PIPE (self));
+
+  if (throttle && self->priv->in_source)
+    {
+      g_debug ("%s: throttling input", self->priv->name);
+      stop_input (self);
+      self->priv->in_throttled = TRUE;
+    }
+  else if (!throttle && self->priv->in_throttled)
+    {
+      g_debug ("%s: resuming input", self->priv->name);
+      self->priv->in_throttled = FALSE;
+      start_input (self);
+    }
+}
+
+/**
+ * cockpit_pipe_set_priority:
+ * @self: a pipe
+ * @priority: main loop priority, such as %G_PRIORITY_DEFAULT
+ *
+ * Change the priority at which input is read from the pipe. With a
+ * lower priority than other sources, input is only read once nothing
+ * more important is ready. Output is not affected.
+ */
+void
+cockpit_pipe_set_priority (CockpitPipe *self,
+                           gint priority)
+{
+  g_return_if_fail (COCKPIT_IS_PIPE (self));
+
+  self->priv->in_priority = priority;
+  if (self->priv->in_source)
+    g_source_set_priority (self->priv->in_source, priority);
+}
+
+/**
+ * cockpit_pipe_splice_input:
+ * @self: a pipe
+ * @func: function that moves input onwards, or %NULL
+ * @user_data: data for @func
+ *
+ * Have @func move data from the input file descriptor each time it
+ * becomes readable, rather than reading it into the buffer. Like
+ * read() @func returns the number of bytes it moved, zero at the end
+ * of input, or -1 with errno set. When errno is ENOTSUP the data is
+ * read into the buffer as usual this time around.
+ */
+void
+cockpit_pipe_splice_input (CockpitPipe *self,
+                           CockpitPipeSpliceFunc func,
+                           gpointer user_data)
+{
+  g_return_if_fail (COCKPIT_IS_PIPE (self));
+  self->priv->in_splice = func;
+  self->priv->in_splice_data = user_data;
+}
+
+/**
+ * cockpit_pipe_splice_from:
+ * @self: a pipe
+ * @fd: a file descriptor to read from
+ * @max: the most bytes to move
+ *
+ * Move up to @max bytes from @fd into a kernel pipe that belongs
+ * to @self, without copying them through user space. If this
+ * returns a positive number of bytes, they must then be queued
+ * with cockpit_pipe_write_splice(), optionally after other data
+ * written with cockpit_pipe_write().
+ *
+ * Returns: the number of bytes moved, zero at the end of @fd, or -1
+ *     with errno set. errno is ENOTSUP if splicing isn't possible
+ *     right now, and the data should be read and written instead.
+ */
+gssize
+cockpit_pipe_splice_from (CockpitPipe *self,
+                          gint fd,
+                          gsize max)
+{
+#ifdef HAVE_SPLICE
+  gssize ret;
+  gint size;
+
+  g_return_val_if_fail (COCKPIT_IS_PIPE (self), -1);
+
+  if (self->priv->closed || self->priv->closing || self->priv->out_fd < 0)
+    {
+      errno = ENOTSUP;
+      return -1;
+    }
+
+  if (self->priv->splice_fds[0] < 0)
+    {
+      if (pipe2 (self->priv->splice_fds, O_CLOEXEC | O_NONBLOCK) < 0)
+        {
+          self->priv->splice_fds[0] = self->priv->splice_fds[1] = -1;
+          errno = ENOTSUP;
+          return -1;
+        }
+
+      /* A bigger pipe is best effort, the default is fine too */
+      size = fcntl (self->priv->splice_fds[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+      if (size < 0)
+        size = fcntl (self->priv->splice_fds[1], F_GETPIPE_SZ);
+      self->priv->splice_size = size > 0 ? size : 64 * 1024;
+      self->priv->splice_pending = 0;
+    }
+
+  /* When the kernel pipe is full, fall back to queueing as usual */
+  g_assert (self->priv->splice_pending <= self->priv->splice_size);
+  max = MIN (max, self->priv->splice_size - self->priv->splice_pending);
+  if (max == 0)
+    {
+      errno = ENOTSUP;
+      return -1;
+    }
+
+  ret = splice (fd, NULL, self->priv->splice_fds[1], NULL, max,
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  if (ret < 0 && errno == EINVAL)
+    errno = ENOTSUP;
+  if (ret > 0)
+    self->priv->splice_pending += ret;
+  return ret;
+#else
+  errno = ENOTSUP;
+  return -1;
+#endif
+}
+
+/**
+ * cockpit_pipe_write_splice:
+ * @self: a pipe
+ * @length: number of bytes
+ *
+ * Queue @length bytes moved by cockpit_pipe_splice_from() to be
+ * written, after all the data queued so far.
+ */
+void
+cockpit_pipe_write_splice (CockpitPipe *self,
+                           gsize length)
+{
+  g_return_if_fail (COCKPIT_IS_PIPE (self));
+  g_return_if_fail (self->priv->splice_fds[0] >= 0);
+  g_return_if_fail (length > 0);
+
+  flush_cork (self);
+
+  if (!self->priv->splice_block)
+    self->priv->splice_block = g_bytes_new_static ("", 0);
+  self->priv->out_total += length;
+  g_queue_push_tail (self->priv->out_spliced, GSIZE_TO_POINTER (length));
+  queue_output (self, self->priv->out_queue, self->priv->splice_block);
+}
+
+/**
+ * cockpit_pipe_write_urgent:
+ * @self: a pipe
+ * @data: the data to write
+ *
+ * Queue @data to be written ahead of what was queued with
+ * cockpit_pipe_write() and cockpit_pipe_write_splice(). It only goes
+ * out where that data is at a boundary marked with
+ * cockpit_pipe_mark_boundary(), or when nothing else is queued, so
+ * @data should be a whole unit, such as a frame, of its own.
+ * Urgent data is written in the order it was queued.
+ */
+void
+cockpit_pipe_write_urgent (CockpitPipe *self,
+                           GBytes *data)
+{
+  g_return_if_fail (COCKPIT_IS_PIPE (self));
+  g_return_if_fail (!self->priv->closed);
+
+  if (g_bytes_get_size (data) == 0)
+    return;
+
+  queue_output (self, self->priv->out_urgent, data);
+}
+
+/**
+ * cockpit_pipe_mark_boundary:
+ * @self: a pipe
+ *
+ * Mark the end of what was written so far as a place where urgent
+ * data may be written in between.
+ *
+ * Returns: the offset of the boundary, for cockpit_pipe_is_written()
+ */
+guint64
+cockpit_pipe_mark_boundary (CockpitPipe *self)
+{
+  GArray *boundaries;
+
+  g_return_val_if_fail (COCKPIT_IS_PIPE (self), 0);
+
+  /* Forget boundaries that were written already */
+  boundaries = self->priv->out_boundaries;
+  next_boundary (self);
+  if (self->priv->boundary_head > 64)
+    {
+      g_array_remove_range (boundaries, 0, self->priv->boundary_head);
+      self->priv->boundary_head = 0;
+    }
+
+  if (boundaries->len == 0 ||
+      g_array_index (boundaries, guint64, boundaries->len - 1) != self->priv->out_total)
+    g_array_append_val (boundaries, self->priv->out_total);
+
+  return self->priv->out_total;
+}
+
+/**
+ * cockpit_pipe_is_written:
+ * @self: a pipe
+ * @offset: an offset from cockpit_pipe_mark_boundary()
+ *
+ * Returns: TRUE once all the data queued before the boundary at
+ *     @offset has been written, apart from urgent data
+ */
+gboolean
+cockpit_pipe_is_written (CockpitPipe *self,
+                         guint64 offset)
+{
+  g_return_val_if_fail (COCKPIT_IS_PIPE (self), FALSE);
+  return self->priv->out_written >= offset;
+}
+
 /**
  * cockpit_pipe_get_buffer:
  * @self: a pipe
@@ -1325,11 +2574,52 @@ cockpit_pipe_get_buffer (CockpitPipe *self)
   return self->priv->in_buffer;
 }
 
+/**
+ * cockpit_pipe_get_stderr:
+ * @self: a pipe
+ *
+ * Get the stderr collected for a pipe spawned with
+ * COCKPIT_PIPE_STDERR_TO_MEMORY, or %NULL for other pipes.
+ *
+ * Only cockpit_pipe_stderr_maximum bytes are kept. When there was
+ * more than that, the start and the end of the output are returned,
+ * with a line in between saying how much was left out.
+ *
+ * Returns: (transfer none): the buffer
+ */
 GByteArray *
 cockpit_pipe_get_stderr (CockpitPipe *self)
 {
+  GByteArray *buffer;
+  gchar *line;
+  gsize start;
+  gsize block;
+
   g_return_val_if_fail (COCKPIT_IS_PIPE (self), NULL);
-  return self->priv->err_buffer;
+
+  buffer = self->priv->err_buffer;
+  if (!buffer || self->priv->err_tail_len == 0)
+    return buffer;
+
+  if (self->priv->err_dropped)
+    {
+      line = g_strdup_printf ("\n... %" G_GUINT64_FORMAT " bytes dropped ...\n",
+                              self->priv->err_dropped);
+      g_byte_array_append (buffer, (guint8 *)line, strlen (line));
+      g_free (line);
+    }
+
+  /* Unwind the ring onto the end of the buffer, oldest first */
+  start = (self->priv->err_tail_pos + self->priv->err_tail_size -
+           self->priv->err_tail_len) % self->priv->err_tail_size;
+  block = MIN (self->priv->err_tail_len, self->priv->err_tail_size - start);
+  g_byte_array_append (buffer, self->priv->err_tail + start, block);
+  g_byte_array_append (buffer, self->priv->err_tail, self->priv->err_tail_len - block);
+
+  self->priv->err_tail_len = 0;
+  self->priv->err_tail_pos = 0;
+  self->priv->err_dropped = 0;
+  return buffer;
 }
 
 /**
@@ -31,6 +31,8 @@ typedef enum {
   COCKPIT_PIPE_STDERR_TO_MEMORY = 1 << 3,
 } CockpitPipeFlags;
 
+extern gsize cockpit_pipe_stderr_maximum;
+
 #define COCKPIT_TYPE_PIPE         (cockpit_pipe_get_type ())
 #define COCKPIT_PIPE(o)           (G_TYPE_CHECK_INSTANCE_CAST ((o), COCKPIT_TYPE_PIPE, CockpitPipe))
 #define COCKPIT_IS_PIPE(o)        (G_TYPE_CHECK_INSTANCE_TYPE ((o), COCKPIT_TYPE_PIPE))
@@ -41,6 +43,10 @@ typedef struct _CockpitPipe        CockpitPipe;
 typedef struct _CockpitPipeClass   CockpitPipeClass;
 typedef struct _CockpitPipePrivate CockpitPipePrivate;
 
+typedef gssize (* CockpitPipeSpliceFunc) (CockpitPipe *pipe,
+                                          gint fd,
+                                          gpointer user_data);
+
 struct _CockpitPipe {
   GObject parent_instance;
   CockpitPipePrivate *priv;
@@ -85,6 +91,14 @@ void               _cockpit_pipe_write        (CockpitPipe *self,
                                               const gchar *caller,
                                               gint line);
 
+void               cockpit_pipe_write_urgent  (CockpitPipe *self,
+                                              GBytes *data);
+
+guint64            cockpit_pipe_mark_boundary (CockpitPipe *self);
+
+gboolean           cockpit_pipe_is_written    (CockpitPipe *self,
+                                              guint64 offset);
+
 void               cockpit_pipe_close        (CockpitPipe *self,
                                               const gchar *problem);
 
@@ -92,6 +106,23 @@ gint               cockpit_pipe_exit_status  (CockpitPipe *self);
 
 const gchar *      cockpit_pipe_get_name     (CockpitPipe *self);
 
+void               cockpit_pipe_throttle     (CockpitPipe *self,
+                                              gboolean throttle);
+
+void               cockpit_pipe_set_priority (CockpitPipe *self,
+                                              gint priority);
+
+void               cockpit_pipe_splice_input (CockpitPipe *self,
+                                              CockpitPipeSpliceFunc func,
+                                              gpointer user_data);
+
+gssize             cockpit_pipe_splice_from  (CockpitPipe *self,
+                                              gint fd,
+                                              gsize max);
+
+void               cockpit_pipe_write_splice (CockpitPipe *self,
+                                              gsize length);
+
 GByteArray *       cockpit_pipe_get_buffer   (CockpitPipe *self);
 
 GByteArray *       cockpit_pipe_get_stderr   (CockpitPipe *self);
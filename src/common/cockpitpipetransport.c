@@ -23,6 +23,10 @@
 
 #include "cockpitpipe.h"
 
+#include "common/cockpitjson.h"
+#include "common/cockpitlogring.h"
+#include "common/cockpitprobes.h"
+
 #include <glib-unix.h>
 
 #include <sys/socket.h>
@@ -40,15 +44,44 @@
  * A #CockpitTransport implementation that shuttles data over a
  * #CockpitPipe. See doc/protocol.md for information on how the
  * framing looks ... including the MSB length prefix.
+ *
+ * Once the peer has advertised support in its "init" message, frames
+ * are sent with a fixed size binary header instead. Incoming frames of
+ * either kind are always accepted.
+ *
+ * Small frames of a channel, and control messages, go out ahead of
+ * bulk data queued in other channels, as long as nothing of their own
+ * channel is still queued. So a "close" or a small DBus call isn't
+ * held up behind a large upload, but each channel stays in order.
  */
 
+/* Largest frame that can go ahead of queued data, and how much has to be queued */
+#define URGENT_FRAME_MAX 8192
+#define URGENT_QUEUED_MIN (64 * 1024)
+
 struct _CockpitPipeTransport {
   CockpitTransport parent_instance;
   gchar *name;
   CockpitPipe *pipe;
   gboolean closed;
+  gboolean binary;
   gulong read_sig;
   gulong close_sig;
+
+  /*
+   * Where the last frame of each channel queued in order ends. Nothing
+   * goes ahead of the barrier, the last frame whose channel isn't known,
+   * such as a frame sent as is or a "kill" control message.
+   */
+  GHashTable *queued;
+  guint64 queued_end;
+  guint64 barrier;
+
+  /* The frame being emitted, for cockpit_pipe_transport_peek_frame() */
+  GBytes *frames;
+  GBytes *frame_payload;
+  gsize frame_offset;
+  gsize frame_length;
 };
 
 struct _CockpitPipeTransportClass {
@@ -66,7 +99,30 @@ G_DEFINE_TYPE (CockpitPipeTransport, cockpit_pipe_transport, COCKPIT_TYPE_TRANSP
 static void
 cockpit_pipe_transport_init (CockpitPipeTransport *self)
 {
+  self->queued = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+}
+
+static void
+emit_frame (CockpitPipeTransport *self,
+            GBytes *frames,
+            gsize offset,
+            guint32 size,
+            gint channel_len)
+{
+  GBytes *payload;
+  gchar *channel = NULL;
 
+  payload = cockpit_transport_frame_payload (frames, offset, size, channel_len, TRUE, &channel);
+  if (payload)
+    {
+      cockpit_log_ring_record (COCKPIT_LOG_RING_TRANSPORT_RECEIVED, self->name, size);
+      COCKPIT_PROBE3 (frame_recv, self->name, channel, g_bytes_get_size (payload));
+      self->frame_payload = payload;
+      cockpit_transport_emit_recv ((CockpitTransport *)self, channel, payload);
+      self->frame_payload = NULL;
+      g_bytes_unref (payload);
+      g_free (channel);
+    }
 }
 
 static void
@@ -76,65 +132,51 @@ on_pipe_read (CockpitPipe *pipe,
               gpointer user_data)
 {
   CockpitPipeTransport *self = COCKPIT_PIPE_TRANSPORT (user_data);
-  GBytes *message;
-  GBytes *payload;
-  gchar *channel;
-  guint32 i, size;
-  gchar *data;
+  gboolean invalid = FALSE;
+  GBytes *frames;
+  const gchar *data;
+  gsize length;
+  gsize pos;
+  gssize prefix;
+  guint32 size;
+  gint channel_len;
 
   g_object_ref (self);
 
-  for (;;)
+  /* The frames are handed out as slices of the one block */
+  frames = cockpit_transport_read_frames (input, &invalid);
+  if (frames)
     {
-      size = 0;
-      data = (gchar *)input->data;
-      for (i = 0; i < input->len; i++)
+      data = g_bytes_get_data (frames, &length);
+      for (pos = 0; pos < length; pos += prefix + size)
         {
-          /* Check invalid characters, prevent integer overflow, limit max length */
-          if (i > 7 || data[i] < '0' || data[i] > '9')
-            break;
-          size *= 10;
-          size += data[i] - '0';
+          prefix = cockpit_transport_parse_header (data + pos, length - pos, &size, &channel_len);
+          g_assert (prefix > 0);
+          self->frames = frames;
+          self->frame_offset = pos;
+          self->frame_length = prefix + size;
+          emit_frame (self, frames, pos + prefix, size, channel_len);
+          self->frames = NULL;
         }
 
-      if (i == input->len)
-        {
-          if (!end_of_data)
-            g_debug ("%s: want more data", self->name);
-          break;
-        }
-
-      if (data[i] != '\n')
-        {
-          g_warning ("%s: incorrect protocol: received invalid length prefix", self->name);
-          cockpit_pipe_close (pipe, "protocol-error");
-          break;
-        }
-
-      if (input->len < i + 1 + size)
-        {
-          g_debug ("%s: want more data 2", self->name);
-          break;
-        }
-
-      message = cockpit_pipe_consume (input, i + 1, size, 0);
-      payload = cockpit_transport_parse_frame (message, &channel);
-      if (payload)
-        {
-          g_debug ("%s: received a %d byte payload", self->name, (int)size);
-          cockpit_transport_emit_recv ((CockpitTransport *)self, channel, payload);
-          g_bytes_unref (payload);
-          g_free (channel);
-        }
-      g_bytes_unref (message);
+      g_bytes_unref (frames);
+    }
+  else if (!end_of_data && !invalid)
+    {
+      g_debug ("%s: want more data", self->name);
     }
 
-  if (end_of_data)
+  if (invalid)
+    {
+      g_warning ("%s: incorrect protocol: received invalid length prefix", self->name);
+      cockpit_pipe_close (pipe, "protocol-error");
+    }
+  else if (end_of_data)
     {
       /* Received a partial message */
       if (input->len > 0)
         {
-          g_debug ("%s: received truncated %d byte frame", self->name, input->len);
+          cockpit_log_ring_record (COCKPIT_LOG_RING_TRANSPORT_TRUNCATED, self->name, input->len);
           cockpit_pipe_close (pipe, "disconnected");
         }
     }
@@ -209,6 +251,13 @@ cockpit_pipe_transport_constructed (GObject *object)
 
   g_return_if_fail (self->pipe != NULL);
   g_object_get (self->pipe, "name", &self->name, NULL);
+
+  /*
+   * Our framing doesn't care how the input arrives, so read in large
+   * batches. And coalesce the many small frame prefixes and messages.
+   */
+  g_object_set (self->pipe, "adaptive-read", TRUE, "cork", TRUE, NULL);
+
   self->read_sig = g_signal_connect (self->pipe, "read", G_CALLBACK (on_pipe_read), self);
   self->close_sig = g_signal_connect (self->pipe, "close", G_CALLBACK (on_pipe_close), self);
 }
@@ -262,22 +311,117 @@ cockpit_pipe_transport_finalize (GObject *object)
   g_signal_handler_disconnect (self->pipe, self->read_sig);
   g_signal_handler_disconnect (self->pipe, self->close_sig);
 
+  g_hash_table_destroy (self->queued);
   g_free (self->name);
   g_clear_object (&self->pipe);
 
   G_OBJECT_CLASS (cockpit_pipe_transport_parent_class)->finalize (object);
 }
 
+static GBytes *
+binary_header (const gchar *channel_id,
+               gsize channel_len,
+               gsize payload_len)
+{
+  guint8 *header;
+  guint32 be;
+
+  be = GUINT32_TO_BE ((guint32)(channel_len + payload_len) | COCKPIT_TRANSPORT_BINARY_FLAG);
+  header = g_malloc (COCKPIT_TRANSPORT_BINARY_HEADER_LEN + channel_len);
+  memcpy (header, &be, sizeof (be));
+  header[4] = channel_len;
+  memcpy (header + COCKPIT_TRANSPORT_BINARY_HEADER_LEN, channel_id, channel_len);
+  return g_bytes_new_take (header, COCKPIT_TRANSPORT_BINARY_HEADER_LEN + channel_len);
+}
+
+static void
+queued_in_order (CockpitPipeTransport *self,
+                 const gchar *key)
+{
+  GHashTableIter iter;
+  guint64 *end;
+
+  self->queued_end = cockpit_pipe_mark_boundary (self->pipe);
+  if (!key)
+    {
+      self->barrier = self->queued_end;
+      return;
+    }
+
+  /* Forget about channels whose frames have all gone */
+  if (g_hash_table_size (self->queued) > 64)
+    {
+      g_hash_table_iter_init (&iter, self->queued);
+      while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&end))
+        {
+          if (cockpit_pipe_is_written (self->pipe, *end))
+            g_hash_table_iter_remove (&iter);
+        }
+    }
+
+  end = g_new (guint64, 1);
+  *end = self->queued_end;
+  g_hash_table_replace (self->queued, g_strdup (key), end);
+}
+
+static gboolean
+can_go_ahead (CockpitPipeTransport *self,
+              const gchar *key)
+{
+  guint64 *end;
+
+  if (!cockpit_pipe_is_written (self->pipe, self->barrier))
+    return FALSE;
+
+  end = g_hash_table_lookup (self->queued, key);
+  if (!end)
+    return TRUE;
+  if (!cockpit_pipe_is_written (self->pipe, *end))
+    return FALSE;
+
+  g_hash_table_remove (self->queued, key);
+  return TRUE;
+}
+
+/*
+ * Returns the channel a frame belongs to, or NULL when it has to stay in
+ * order with everything. A control message about no channel in particular,
+ * like "kill" or "logout", can affect any of them.
+ */
+static gchar *
+frame_channel (const gchar *channel_id,
+               GBytes *payload)
+{
+  JsonObject *object;
+  const gchar *channel;
+  gchar *ret;
+
+  if (channel_id)
+    return g_strdup (channel_id);
+
+  object = cockpit_json_parse_bytes (payload, NULL);
+  if (!object)
+    return NULL;
+  if (!cockpit_json_get_string (object, "channel", NULL, &channel))
+    channel = NULL;
+  ret = g_strdup (channel);
+  json_object_unref (object);
+
+  return ret;
+}
+
 static void
 cockpit_pipe_transport_send (CockpitTransport *transport,
                              const gchar *channel_id,
                              GBytes *payload)
 {
   CockpitPipeTransport *self = COCKPIT_PIPE_TRANSPORT (transport);
+  GByteArray *frame;
   GBytes *prefix;
   gchar *prefix_str;
   gsize payload_len;
   gsize channel_len;
+  gchar *key = NULL;
 
   if (self->closed)
     {
@@ -287,17 +431,90 @@ cockpit_pipe_transport_send (CockpitTransport *transport,
 
   channel_len = channel_id ? strlen (channel_id) : 0;
   payload_len = g_bytes_get_size (payload);
+  COCKPIT_PROBE3 (frame_send, self->name, channel_id, payload_len);
 
-  prefix_str = g_strdup_printf ("%" G_GSIZE_FORMAT "\n%s\n",
-                                channel_len + 1 + payload_len,
-                                channel_id ? channel_id : "");
-  prefix = g_bytes_new_take (prefix_str, strlen (prefix_str));
+  if (self->binary && channel_len <= G_MAXUINT8 &&
+      channel_len + payload_len <= COCKPIT_TRANSPORT_MAX_FRAME)
+    {
+      prefix = binary_header (channel_id, channel_len, payload_len);
+    }
+  else
+    {
+      prefix_str = g_strdup_printf ("%" G_GSIZE_FORMAT "\n%s\n",
+                                    channel_len + 1 + payload_len,
+                                    channel_id ? channel_id : "");
+      prefix = g_bytes_new_take (prefix_str, strlen (prefix_str));
+    }
+
+  /* When little is queued it'll all be written soon anyway */
+  if (payload_len <= URGENT_FRAME_MAX && self->queued_end > URGENT_QUEUED_MIN &&
+      !cockpit_pipe_is_written (self->pipe, self->queued_end - URGENT_QUEUED_MIN))
+    {
+      key = frame_channel (channel_id, payload);
+      if (key && can_go_ahead (self, key))
+        {
+          frame = g_byte_array_sized_new (g_bytes_get_size (prefix) + payload_len);
+          g_byte_array_append (frame, g_bytes_get_data (prefix, NULL), g_bytes_get_size (prefix));
+          g_byte_array_append (frame, g_bytes_get_data (payload, NULL), payload_len);
+          g_bytes_unref (prefix);
+          prefix = g_byte_array_free_to_bytes (frame);
+          cockpit_pipe_write_urgent (self->pipe, prefix);
+          g_bytes_unref (prefix);
+          g_free (key);
+
+          cockpit_log_ring_record (COCKPIT_LOG_RING_TRANSPORT_AHEAD, self->name, payload_len);
+          return;
+        }
+    }
 
   cockpit_pipe_write (self->pipe, prefix);
   cockpit_pipe_write (self->pipe, payload);
   g_bytes_unref (prefix);
 
-  g_debug ("%s: queued %" G_GSIZE_FORMAT " byte payload", self->name, payload_len);
+  if (!key)
+    key = g_strdup (channel_id);
+  queued_in_order (self, key);
+  g_free (key);
+
+  cockpit_log_ring_record (COCKPIT_LOG_RING_TRANSPORT_QUEUED, self->name, payload_len);
+}
+
+/*
+ * Only binary frames carry their length up front in a form that is
+ * cheap to write once the payload has been spliced.
+ */
+static gssize
+cockpit_pipe_transport_splice (CockpitTransport *transport,
+                               const gchar *channel_id,
+                               gint fd,
+                               gsize max)
+{
+  CockpitPipeTransport *self = COCKPIT_PIPE_TRANSPORT (transport);
+  GBytes *prefix;
+  gsize channel_len;
+  gssize ret;
+
+  channel_len = channel_id ? strlen (channel_id) : 0;
+  if (self->closed || !self->binary || channel_len == 0 || channel_len > G_MAXUINT8)
+    {
+      errno = ENOTSUP;
+      return -1;
+    }
+
+  max = MIN (max, COCKPIT_TRANSPORT_MAX_FRAME - channel_len);
+  ret = cockpit_pipe_splice_from (self->pipe, fd, max);
+  if (ret <= 0)
+    return ret;
+
+  prefix = binary_header (channel_id, channel_len, ret);
+  cockpit_pipe_write (self->pipe, prefix);
+  cockpit_pipe_write_splice (self->pipe, ret);
+  g_bytes_unref (prefix);
+  queued_in_order (self, channel_id);
+
+  COCKPIT_PROBE3 (frame_send, self->name, channel_id, ret);
+  cockpit_log_ring_record (COCKPIT_LOG_RING_TRANSPORT_SPLICED, self->name, ret);
+  return ret;
 }
 
 static void
@@ -308,6 +525,22 @@ cockpit_pipe_transport_close (CockpitTransport *transport,
   cockpit_pipe_close (self->pipe, problem);
 }
 
+static void
+cockpit_pipe_transport_pressure (CockpitTransport *transport,
+                                 gboolean pressure)
+{
+  CockpitPipeTransport *self = COCKPIT_PIPE_TRANSPORT (transport);
+  cockpit_pipe_throttle (self->pipe, pressure);
+}
+
+static void
+cockpit_pipe_transport_priority (CockpitTransport *transport,
+                                 gint priority)
+{
+  CockpitPipeTransport *self = COCKPIT_PIPE_TRANSPORT (transport);
+  cockpit_pipe_set_priority (self->pipe, priority);
+}
+
 static void
 cockpit_pipe_transport_class_init (CockpitPipeTransportClass *klass)
 {
@@ -316,6 +549,9 @@ cockpit_pipe_transport_class_init (CockpitPipeTransportClass *klass)
 
   transport_class->send = cockpit_pipe_transport_send;
   transport_class->close = cockpit_pipe_transport_close;
+  transport_class->pressure = cockpit_pipe_transport_pressure;
+  transport_class->priority = cockpit_pipe_transport_priority;
+  transport_class->splice = cockpit_pipe_transport_splice;
 
   gobject_class->constructed = cockpit_pipe_transport_constructed;
   gobject_class->get_property = cockpit_pipe_transport_get_property;
@@ -378,3 +614,126 @@ cockpit_pipe_transport_get_pipe (CockpitPipeTransport *self)
   g_return_val_if_fail (COCKPIT_IS_PIPE_TRANSPORT (self), NULL);
   return self->pipe;
 }
+
+/**
+ * cockpit_pipe_transport_set_binary_framing:
+ * @self: a pipe transport
+ * @binary: whether to send binary frames
+ *
+ * Send messages with a fixed size binary header rather than the
+ * decimal length prefix. Only do this when the peer has said that
+ * it understands binary frames. Received frames may always be of
+ * either kind.
+ */
+void
+cockpit_pipe_transport_set_binary_framing (CockpitPipeTransport *self,
+                                           gboolean binary)
+{
+  g_return_if_fail (COCKPIT_IS_PIPE_TRANSPORT (self));
+  self->binary = binary;
+}
+
+/**
+ * cockpit_pipe_transport_peek_frame:
+ * @transport: a transport
+ * @payload: the payload being received
+ * @binary: location to return whether it has a binary header
+ *
+ * While @transport is emitting @payload as it was received, get the
+ * whole frame it came in, header and all. This is a slice of what was
+ * read, and isn't copied.
+ *
+ * Returns: (transfer full): the frame, or NULL if not a pipe transport
+ *     or @payload wasn't just read by it
+ */
+GBytes *
+cockpit_pipe_transport_peek_frame (CockpitTransport *transport,
+                                   GBytes *payload,
+                                   gboolean *binary)
+{
+  CockpitPipeTransport *self;
+  const gchar *data;
+
+  g_return_val_if_fail (COCKPIT_IS_TRANSPORT (transport), NULL);
+
+  if (!COCKPIT_IS_PIPE_TRANSPORT (transport))
+    return NULL;
+
+  self = COCKPIT_PIPE_TRANSPORT (transport);
+  if (!self->frames || !payload || self->frame_payload != payload)
+    return NULL;
+
+  data = g_bytes_get_data (self->frames, NULL);
+  if (binary)
+    *binary = (data[self->frame_offset] & 0x80) ? TRUE : FALSE;
+  return g_bytes_new_from_bytes (self->frames, self->frame_offset, self->frame_length);
+}
+
+/**
+ * cockpit_pipe_transport_send_frame:
+ * @transport: a transport
+ * @frame: a whole frame, as from cockpit_pipe_transport_peek_frame()
+ * @binary: whether it has a binary header
+ *
+ * Send a frame as is. Text frames can always be sent, binary frames
+ * only when the peer has said it understands them.
+ *
+ * Returns: FALSE if not a pipe transport or it can't send the frame
+ */
+gboolean
+cockpit_pipe_transport_send_frame (CockpitTransport *transport,
+                                   GBytes *frame,
+                                   gboolean binary)
+{
+  CockpitPipeTransport *self;
+
+  g_return_val_if_fail (COCKPIT_IS_TRANSPORT (transport), FALSE);
+
+  if (!COCKPIT_IS_PIPE_TRANSPORT (transport))
+    return FALSE;
+
+  self = COCKPIT_PIPE_TRANSPORT (transport);
+  if (binary && !self->binary)
+    return FALSE;
+
+  if (self->closed)
+    {
+      g_debug ("dropping frame on closed transport");
+      return TRUE;
+    }
+
+  cockpit_pipe_write (self->pipe, frame);
+  queued_in_order (self, NULL);
+  COCKPIT_PROBE3 (frame_send, self->name, NULL, g_bytes_get_size (frame));
+  cockpit_log_ring_record (COCKPIT_LOG_RING_TRANSPORT_FRAME, self->name, g_bytes_get_size (frame));
+  return TRUE;
+}
+
+/**
+ * cockpit_pipe_transport_negotiate:
+ * @transport: a transport
+ * @init: the "init" message received from the peer
+ *
+ * If @transport is a pipe transport and the peer advertised a
+ * "framing" it understands, then switch to it.
+ */
+void
+cockpit_pipe_transport_negotiate (CockpitTransport *transport,
+                                  JsonObject *init)
+{
+  const gchar *framing;
+
+  g_return_if_fail (COCKPIT_IS_TRANSPORT (transport));
+
+  if (!COCKPIT_IS_PIPE_TRANSPORT (transport))
+    return;
+
+  if (!cockpit_json_get_string (init, "framing", NULL, &framing))
+    framing = NULL;
+
+  if (g_strcmp0 (framing, "binary") == 0)
+    {
+      g_debug ("%s: peer accepts binary framing", COCKPIT_PIPE_TRANSPORT (transport)->name);
+      cockpit_pipe_transport_set_binary_framing (COCKPIT_PIPE_TRANSPORT (transport), TRUE);
+    }
+}
@@ -46,6 +46,20 @@ CockpitTransport * cockpit_pipe_transport_new_fds    (const gchar *name,
 
 CockpitPipe *      cockpit_pipe_transport_get_pipe   (CockpitPipeTransport *self);
 
+void               cockpit_pipe_transport_set_binary_framing (CockpitPipeTransport *self,
+                                                              gboolean binary);
+
+void               cockpit_pipe_transport_negotiate  (CockpitTransport *transport,
+                                                      JsonObject *init);
+
+GBytes *           cockpit_pipe_transport_peek_frame (CockpitTransport *transport,
+                                                      GBytes *payload,
+                                                      gboolean *binary);
+
+gboolean           cockpit_pipe_transport_send_frame (CockpitTransport *transport,
+                                                      GBytes *frame,
+                                                      gboolean binary);
+
 G_END_DECLS
 
 #endif /* __COCKPIT_PIPE_TRANSPORT_H__ */
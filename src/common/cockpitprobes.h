@@ -0,0 +1,48 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2016 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __COCKPIT_PROBES_H__
+#define __COCKPIT_PROBES_H__
+
+/*
+ * Static tracepoints for bpftrace, perf and systemtap. These are in the
+ * "cockpit" provider, for example usdt:cockpit-bridge:cockpit:channel_open.
+ * When sys/sdt.h isn't available at build time, they compile to nothing.
+ *
+ * Their names and arguments are how they're found from outside, so should
+ * not change once added. Strings are passed as pointers, and may be NULL.
+ */
+
+#ifdef HAVE_SYS_SDT_H
+
+#include <sys/sdt.h>
+
+#define COCKPIT_PROBE1(name, a)         DTRACE_PROBE1 (cockpit, name, a)
+#define COCKPIT_PROBE2(name, a, b)      DTRACE_PROBE2 (cockpit, name, a, b)
+#define COCKPIT_PROBE3(name, a, b, c)   DTRACE_PROBE3 (cockpit, name, a, b, c)
+
+#else
+
+#define COCKPIT_PROBE1(name, a)         G_STMT_START { } G_STMT_END
+#define COCKPIT_PROBE2(name, a, b)      G_STMT_START { } G_STMT_END
+#define COCKPIT_PROBE3(name, a, b, c)   G_STMT_START { } G_STMT_END
+
+#endif /* HAVE_SYS_SDT_H */
+
+#endif /* __COCKPIT_PROBES_H__ */
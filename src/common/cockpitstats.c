@@ -0,0 +1,283 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2016 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitstats.h"
+
+#include <string.h>
+
+/*
+ * Counters and gauges about the process itself, such as how many
+ * channels of each type are open and how long D-Bus calls take.
+ * The bridge reports them as "self" metrics, and cockpit-ws on its
+ * /metrics page.
+ *
+ * Each instance keeps an array of values, and is looked up once, for
+ * example when a channel is opened. After that updates are a single
+ * atomic add, so they're cheap enough for the message paths. The
+ * values are read from the sampler thread of the internal metrics.
+ *
+ * Instances are never freed. There's one for each channel payload type
+ * and one global one, so there are only ever a handful. In cockpit-ws the
+ * payload types come from the browser, so past a limit further instances
+ * all share one called "other".
+ *
+ * Channel groups, the "group" open option, have instances of their own,
+ * kept apart from the payload types since the names can be the same.
+ * The same limit applies to them.
+ */
+
+struct _CockpitStats {
+  gchar *instance;
+  volatile gssize values[COCKPIT_N_STATS];
+};
+
+const gchar *cockpit_stats_bucket_names[COCKPIT_STATS_BUCKETS] = {
+  "1ms", "10ms", "100ms", "1s", "more"
+};
+
+#define MAX_INSTANCES 64
+
+G_LOCK_DEFINE_STATIC (registry);
+static GPtrArray *all_stats;
+static GPtrArray *all_groups;
+static CockpitStats global_stats;
+
+static CockpitStats *
+find_instance (GPtrArray *array,
+               const gchar *instance)
+{
+  CockpitStats *stats;
+  guint i;
+
+  for (i = 0; i < array->len; i++)
+    {
+      stats = array->pdata[i];
+      if (g_str_equal (stats->instance, instance))
+        return stats;
+    }
+
+  return NULL;
+}
+
+static CockpitStats *
+lookup_instance (GPtrArray **array,
+                 const gchar *instance)
+{
+  CockpitStats *stats;
+
+  G_LOCK (registry);
+
+  if (!*array)
+    *array = g_ptr_array_new ();
+
+  stats = find_instance (*array, instance);
+  if (!stats && (*array)->len >= MAX_INSTANCES)
+    {
+      instance = "other";
+      stats = find_instance (*array, instance);
+    }
+
+  if (!stats)
+    {
+      stats = g_new0 (CockpitStats, 1);
+      stats->instance = g_strdup (instance);
+      g_ptr_array_add (*array, stats);
+    }
+
+  G_UNLOCK (registry);
+  return stats;
+}
+
+/**
+ * cockpit_stats_lookup:
+ * @instance: the instance name, or NULL
+ *
+ * Find or create the stats for an instance, such as a channel
+ * payload type. A NULL @instance means the global stats.
+ *
+ * Returns: (transfer none): the stats, valid for the life of the process
+ */
+CockpitStats *
+cockpit_stats_lookup (const gchar *instance)
+{
+  if (instance == NULL)
+    return &global_stats;
+
+  return lookup_instance (&all_stats, instance);
+}
+
+/**
+ * cockpit_stats_lookup_group:
+ * @group: the channel group
+ *
+ * Find or create the stats for a channel group. Only the
+ * COCKPIT_STAT_GROUP_* values of these are used.
+ *
+ * Returns: (transfer none): the stats, valid for the life of the process
+ */
+CockpitStats *
+cockpit_stats_lookup_group (const gchar *group)
+{
+  g_return_val_if_fail (group != NULL, NULL);
+
+  return lookup_instance (&all_groups, group);
+}
+
+/**
+ * cockpit_stats_add:
+ * @stats: the stats, or NULL for the global ones
+ * @stat: which value
+ * @value: amount to add, may be negative
+ *
+ * Add to a counter or gauge.
+ */
+void
+cockpit_stats_add (CockpitStats *stats,
+                   CockpitStat stat,
+                   gssize value)
+{
+  g_return_if_fail (stat < COCKPIT_N_STATS);
+
+  if (!stats)
+    stats = &global_stats;
+  g_atomic_pointer_add (&stats->values[stat], value);
+}
+
+/**
+ * cockpit_stats_set:
+ * @stats: the stats, or NULL for the global ones
+ * @stat: which value
+ * @value: the new value
+ *
+ * Set a gauge that's measured rather than counted.
+ */
+void
+cockpit_stats_set (CockpitStats *stats,
+                   CockpitStat stat,
+                   gssize value)
+{
+  g_return_if_fail (stat < COCKPIT_N_STATS);
+
+  if (!stats)
+    stats = &global_stats;
+  g_atomic_pointer_set (&stats->values[stat], value);
+}
+
+/**
+ * cockpit_stats_time:
+ * @stats: the stats, or NULL for the global ones
+ * @histogram: the first value of the histogram
+ * @usec: how long something took, in microseconds
+ *
+ * Count @usec in the right bucket of a latency histogram, and add
+ * it to the histogram's sum.
+ */
+void
+cockpit_stats_time (CockpitStats *stats,
+                    CockpitStat histogram,
+                    gint64 usec)
+{
+  gint64 limit = 1000;
+  guint bucket;
+
+  for (bucket = 0; bucket < COCKPIT_STATS_BUCKETS - 1; bucket++)
+    {
+      if (usec < limit)
+        break;
+      limit *= 10;
+    }
+
+  cockpit_stats_add (stats, histogram + bucket, 1);
+  cockpit_stats_add (stats, histogram + COCKPIT_STATS_BUCKETS, usec);
+}
+
+static void
+read_values (CockpitStats *stats,
+             gssize *values)
+{
+  guint i;
+
+  for (i = 0; i < COCKPIT_N_STATS; i++)
+    values[i] = (gssize)g_atomic_pointer_get (&stats->values[i]);
+}
+
+static void
+foreach_instance (GPtrArray **array,
+                  CockpitStatsFunc func,
+                  gpointer user_data)
+{
+  gssize values[COCKPIT_N_STATS];
+  GPtrArray *snapshot;
+  CockpitStats *stats;
+  guint i;
+
+  /* The instances are never freed, so only the array needs the lock */
+  snapshot = g_ptr_array_new ();
+  G_LOCK (registry);
+  for (i = 0; *array && i < (*array)->len; i++)
+    g_ptr_array_add (snapshot, (*array)->pdata[i]);
+  G_UNLOCK (registry);
+
+  for (i = 0; i < snapshot->len; i++)
+    {
+      stats = snapshot->pdata[i];
+      read_values (stats, values);
+      func (stats->instance, values, user_data);
+    }
+
+  g_ptr_array_free (snapshot, TRUE);
+}
+
+/**
+ * cockpit_stats_foreach:
+ * @func: called for each instance
+ * @user_data: passed to @func
+ *
+ * Call @func with a snapshot of the values of each instance. The
+ * global stats come first, with a NULL instance. This may be called
+ * from any thread.
+ */
+void
+cockpit_stats_foreach (CockpitStatsFunc func,
+                       gpointer user_data)
+{
+  gssize values[COCKPIT_N_STATS];
+
+  read_values (&global_stats, values);
+  func (NULL, values, user_data);
+
+  foreach_instance (&all_stats, func, user_data);
+}
+
+/**
+ * cockpit_stats_foreach_group:
+ * @func: called for each channel group
+ * @user_data: passed to @func
+ *
+ * Call @func with a snapshot of the values of each channel group.
+ * This may be called from any thread.
+ */
+void
+cockpit_stats_foreach_group (CockpitStatsFunc func,
+                             gpointer user_data)
+{
+  foreach_instance (&all_groups, func, user_data);
+}
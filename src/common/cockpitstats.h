@@ -0,0 +1,111 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2016 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __COCKPIT_STATS_H__
+#define __COCKPIT_STATS_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Buckets of a latency histogram: under 1ms, 10ms, 100ms, 1s and the rest */
+#define COCKPIT_STATS_BUCKETS 5
+
+/* A histogram is its buckets followed by the sum in microseconds */
+#define COCKPIT_STATS_HISTOGRAM (COCKPIT_STATS_BUCKETS + 1)
+
+typedef enum {
+  /* Per channel payload type */
+  COCKPIT_STAT_CHANNEL_OPEN,
+  COCKPIT_STAT_CHANNEL_OPENED,
+  COCKPIT_STAT_CHANNEL_MESSAGES,
+  COCKPIT_STAT_CHANNEL_BYTES,
+  COCKPIT_STAT_CHANNEL_READY_TIME,
+
+  /* Per channel group */
+  COCKPIT_STAT_GROUP_CHANNELS,
+  COCKPIT_STAT_GROUP_BYTES_IN,
+  COCKPIT_STAT_GROUP_BYTES_OUT,
+  COCKPIT_STAT_GROUP_QUEUED,
+
+  /* Global */
+  COCKPIT_STAT_PIPE_QUEUED,
+  COCKPIT_STAT_PIPE_WRITTEN,
+  COCKPIT_STAT_DBUS_CALLS,
+  COCKPIT_STAT_DBUS_LATENCY,
+  COCKPIT_STAT_DBUS_LATENCY_LAST = COCKPIT_STAT_DBUS_LATENCY + COCKPIT_STATS_HISTOGRAM - 1,
+  COCKPIT_STAT_METRICS_SAMPLES,
+  COCKPIT_STAT_PIPE_QUEUED_BYTES,
+  COCKPIT_STAT_MEMORY_DBUS_CACHE,
+  COCKPIT_STAT_MEMORY_PACKAGES,
+  COCKPIT_STAT_MEMORY_TRIMMED,
+
+  /* Global in cockpit-ws */
+  COCKPIT_STAT_WS_SESSIONS,
+  COCKPIT_STAT_WS_SOCKETS,
+  COCKPIT_STAT_WS_QUEUED,
+  COCKPIT_STAT_WS_BYTES_IN,
+  COCKPIT_STAT_WS_BYTES_OUT,
+  COCKPIT_STAT_WS_TLS_HANDSHAKES,
+  COCKPIT_STAT_WS_TLS_FAILURES,
+  COCKPIT_STAT_WS_LOGIN_LATENCY,
+  COCKPIT_STAT_WS_LOGIN_LATENCY_LAST = COCKPIT_STAT_WS_LOGIN_LATENCY + COCKPIT_STATS_HISTOGRAM - 1,
+  COCKPIT_STAT_WS_SSH_CONNECT,
+  COCKPIT_STAT_WS_SSH_CONNECT_LAST = COCKPIT_STAT_WS_SSH_CONNECT + COCKPIT_STATS_HISTOGRAM - 1,
+  COCKPIT_STAT_WS_SSH_AUTH,
+  COCKPIT_STAT_WS_SSH_AUTH_LAST = COCKPIT_STAT_WS_SSH_AUTH + COCKPIT_STATS_HISTOGRAM - 1,
+  COCKPIT_STAT_WS_SSH_SESSION,
+  COCKPIT_STAT_WS_SSH_SESSION_LAST = COCKPIT_STAT_WS_SSH_SESSION + COCKPIT_STATS_HISTOGRAM - 1,
+
+  COCKPIT_N_STATS
+} CockpitStat;
+
+typedef struct _CockpitStats CockpitStats;
+
+typedef void      (* CockpitStatsFunc)          (const gchar *instance,
+                                                 const gssize *values,
+                                                 gpointer user_data);
+
+CockpitStats *       cockpit_stats_lookup       (const gchar *instance);
+
+CockpitStats *       cockpit_stats_lookup_group (const gchar *group);
+
+void                 cockpit_stats_add          (CockpitStats *stats,
+                                                 CockpitStat stat,
+                                                 gssize value);
+
+void                 cockpit_stats_set          (CockpitStats *stats,
+                                                 CockpitStat stat,
+                                                 gssize value);
+
+void                 cockpit_stats_time         (CockpitStats *stats,
+                                                 CockpitStat histogram,
+                                                 gint64 usec);
+
+void                 cockpit_stats_foreach      (CockpitStatsFunc func,
+                                                 gpointer user_data);
+
+void                 cockpit_stats_foreach_group (CockpitStatsFunc func,
+                                                  gpointer user_data);
+
+extern const gchar * cockpit_stats_bucket_names[COCKPIT_STATS_BUCKETS];
+
+G_END_DECLS
+
+#endif /* __COCKPIT_STATS_H__ */
@@ -0,0 +1,430 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2016 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpittimerwheel.h"
+
+/*
+ * A timer wheel for the many timeouts that cockpit-ws keeps, one or
+ * more for each request, session and login. Each of those would
+ * otherwise be its own GSource, and glib keeps all the sources of a
+ * context in one list that's walked on every iteration of the loop.
+ *
+ * Timers have a resolution of a second, like g_timeout_add_seconds().
+ * There are three levels of 64 slots: one slot per second for the
+ * next minute, one per 64 seconds, and one per 4096 seconds. Adding
+ * and removing a timer is a list operation in a slot. When the slots
+ * of a level have all gone by, the next slot of the level above is
+ * spread out over the one below. Timers further out than the wheel
+ * reaches wait in its last slot, and are put back each time around.
+ *
+ * Each GMainContext gets one GSource for all of its timers. It only
+ * wakes up when a timer is due, or when the slots of the first level
+ * have gone by. Like most of the code here, a context's timers must
+ * only be used from the thread that runs it.
+ */
+
+#define WHEEL_BITS    6
+#define WHEEL_SIZE    (1 << WHEEL_BITS)
+#define WHEEL_MASK    (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS  3
+
+/* Overridable from tests, seconds added to the clock */
+gint64 cockpit_timer_wheel_offset = 0;
+
+typedef struct {
+  GSource source;
+  GMainContext *context;
+  gint64 current;
+  guint count;
+  guint level_count[WHEEL_LEVELS];
+  GList *slots[WHEEL_LEVELS][WHEEL_SIZE];
+} TimerWheel;
+
+typedef struct {
+  guint tag;
+  guint seconds;
+  gint64 expires;
+  GSourceFunc func;
+  gpointer user_data;
+  TimerWheel *wheel;
+  gint level;
+  GList **head;
+  GList *link;
+  gboolean dispatching;
+  gboolean removed;
+} Timer;
+
+static GHashTable *wheels;
+static GHashTable *timers;
+static guint last_tag;
+
+static gint64
+current_second (void)
+{
+  return g_get_monotonic_time () / G_USEC_PER_SEC + cockpit_timer_wheel_offset;
+}
+
+static void
+insert_timer (TimerWheel *wheel,
+              Timer *timer)
+{
+  gint64 expires;
+  gint64 delta;
+  gint level;
+
+  /* When cascading, a timer can be due right now */
+  if (timer->expires < wheel->current)
+    timer->expires = wheel->current;
+
+  expires = timer->expires;
+  delta = expires - wheel->current;
+
+  if (delta < WHEEL_SIZE)
+    {
+      level = 0;
+    }
+  else if (delta < (WHEEL_SIZE << WHEEL_BITS))
+    {
+      level = 1;
+    }
+  else
+    {
+      level = 2;
+      if (delta >= ((gint64)WHEEL_SIZE << (2 * WHEEL_BITS)))
+        expires = wheel->current + ((gint64)WHEEL_SIZE << (2 * WHEEL_BITS)) - 1;
+    }
+
+  timer->level = level;
+  timer->head = &wheel->slots[level][(expires >> (level * WHEEL_BITS)) & WHEEL_MASK];
+  *timer->head = g_list_prepend (*timer->head, timer);
+  timer->link = *timer->head;
+  wheel->level_count[level]++;
+  wheel->count++;
+}
+
+static void
+unlink_timer (TimerWheel *wheel,
+              Timer *timer)
+{
+  if (!timer->head)
+    return;
+
+  *timer->head = g_list_delete_link (*timer->head, timer->link);
+  timer->head = NULL;
+  timer->link = NULL;
+  wheel->level_count[timer->level]--;
+  wheel->count--;
+}
+
+static void
+cascade_slot (TimerWheel *wheel,
+              gint level,
+              gint index)
+{
+  GList *slot;
+  Timer *timer;
+
+  slot = wheel->slots[level][index];
+  wheel->slots[level][index] = NULL;
+
+  while (slot)
+    {
+      timer = slot->data;
+      slot = g_list_delete_link (slot, slot);
+      wheel->level_count[level]--;
+      wheel->count--;
+      timer->head = NULL;
+      timer->link = NULL;
+      insert_timer (wheel, timer);
+    }
+}
+
+static void
+advance_wheel (TimerWheel *wheel)
+{
+  wheel->current++;
+
+  if ((wheel->current & WHEEL_MASK) != 0)
+    return;
+
+  if (((wheel->current >> WHEEL_BITS) & WHEEL_MASK) == 0)
+    cascade_slot (wheel, 2, (wheel->current >> (2 * WHEEL_BITS)) & WHEEL_MASK);
+  cascade_slot (wheel, 1, (wheel->current >> WHEEL_BITS) & WHEEL_MASK);
+}
+
+/* The next second when something happens, either a timer or a cascade */
+static gint64
+next_second (TimerWheel *wheel)
+{
+  gint64 wrap;
+  gint i;
+
+  wrap = (wheel->current | WHEEL_MASK) + 1;
+  if (wheel->level_count[0] == 0)
+    return wrap;
+
+  for (i = 1; i < WHEEL_SIZE; i++)
+    {
+      if (wheel->current + i >= wrap)
+        break;
+      if (wheel->slots[0][(wheel->current + i) & WHEEL_MASK])
+        return wheel->current + i;
+    }
+
+  return wrap;
+}
+
+static gboolean
+wheel_prepare (GSource *source,
+               gint *timeout)
+{
+  TimerWheel *wheel = (TimerWheel *)source;
+  gint64 now;
+  gint64 next;
+
+  if (wheel->count == 0)
+    {
+      *timeout = -1;
+      return FALSE;
+    }
+
+  now = g_get_monotonic_time () + cockpit_timer_wheel_offset * G_USEC_PER_SEC;
+  next = next_second (wheel) * G_USEC_PER_SEC;
+
+  if (next <= now)
+    {
+      *timeout = 0;
+      return TRUE;
+    }
+
+  *timeout = MIN ((next - now + 999) / 1000, G_MAXINT);
+  return FALSE;
+}
+
+static gboolean
+wheel_check (GSource *source)
+{
+  gint timeout;
+  return wheel_prepare (source, &timeout);
+}
+
+static void
+free_timer (Timer *timer)
+{
+  g_free (timer);
+}
+
+static gboolean
+wheel_dispatch (GSource *source,
+                GSourceFunc unused,
+                gpointer user_data)
+{
+  TimerWheel *wheel = (TimerWheel *)source;
+  gboolean again;
+  Timer *timer;
+  GList *due;
+  GList *l;
+  gint64 now;
+
+  now = current_second ();
+
+  while (wheel->count > 0 && wheel->current < now)
+    {
+      advance_wheel (wheel);
+
+      /* Removing one of these from a callback finds it here */
+      due = wheel->slots[0][wheel->current & WHEEL_MASK];
+      wheel->slots[0][wheel->current & WHEEL_MASK] = NULL;
+      for (l = due; l != NULL; l = g_list_next (l))
+        ((Timer *)l->data)->head = &due;
+
+      while (due)
+        {
+          timer = due->data;
+          unlink_timer (wheel, timer);
+
+          timer->dispatching = TRUE;
+          again = (timer->func) (timer->user_data);
+          timer->dispatching = FALSE;
+
+          if (timer->removed)
+            {
+              free_timer (timer);
+            }
+          else if (again)
+            {
+              timer->expires = wheel->current + MAX (timer->seconds, 1);
+              insert_timer (wheel, timer);
+            }
+          else
+            {
+              g_hash_table_remove (timers, GUINT_TO_POINTER (timer->tag));
+              free_timer (timer);
+            }
+        }
+    }
+
+  return TRUE;
+}
+
+static void
+wheel_finalize (GSource *source)
+{
+  TimerWheel *wheel = (TimerWheel *)source;
+  GHashTableIter iter;
+  Timer *timer;
+
+  /* The context went away, and the timers with it */
+  g_hash_table_iter_init (&iter, timers);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&timer))
+    {
+      if (timer->wheel == wheel)
+        {
+          unlink_timer (wheel, timer);
+          g_hash_table_iter_remove (&iter);
+          if (timer->dispatching)
+            timer->removed = TRUE;
+          else
+            free_timer (timer);
+        }
+    }
+
+  g_hash_table_remove (wheels, wheel->context);
+}
+
+static GSourceFuncs wheel_funcs = {
+  wheel_prepare,
+  wheel_check,
+  wheel_dispatch,
+  wheel_finalize,
+};
+
+static TimerWheel *
+lookup_wheel (GMainContext *context)
+{
+  TimerWheel *wheel;
+  GSource *source;
+
+  if (!context)
+    context = g_main_context_default ();
+
+  if (!wheels)
+    {
+      wheels = g_hash_table_new (g_direct_hash, g_direct_equal);
+      timers = g_hash_table_new (g_direct_hash, g_direct_equal);
+    }
+
+  wheel = g_hash_table_lookup (wheels, context);
+  if (!wheel)
+    {
+      source = g_source_new (&wheel_funcs, sizeof (TimerWheel));
+      g_source_set_name (source, "timer-wheel");
+      wheel = (TimerWheel *)source;
+      wheel->context = context;
+      wheel->current = current_second ();
+      g_hash_table_insert (wheels, context, wheel);
+
+      /* The context owns the wheel */
+      g_source_attach (source, context);
+      g_source_unref (source);
+    }
+
+  return wheel;
+}
+
+/**
+ * cockpit_timer_wheel_add_seconds:
+ * @context: the context to dispatch in, or NULL for the default one
+ * @seconds: the timeout in seconds
+ * @func: called when the timer fires
+ * @user_data: passed to @func
+ *
+ * Like g_timeout_add_seconds(), except many of these timers share one
+ * source in @context. @func is called again every @seconds for as
+ * long as it returns %TRUE.
+ *
+ * Returns: a tag for cockpit_timer_wheel_remove(), never zero
+ */
+guint
+cockpit_timer_wheel_add_seconds (GMainContext *context,
+                                 guint seconds,
+                                 GSourceFunc func,
+                                 gpointer user_data)
+{
+  TimerWheel *wheel;
+  Timer *timer;
+
+  g_return_val_if_fail (func != NULL, 0);
+
+  wheel = lookup_wheel (context);
+
+  /* An empty wheel doesn't need to go through the seconds it missed */
+  if (wheel->count == 0)
+    wheel->current = current_second ();
+
+  timer = g_new0 (Timer, 1);
+  do
+    timer->tag = ++last_tag;
+  while (timer->tag == 0 || g_hash_table_lookup (timers, GUINT_TO_POINTER (timer->tag)));
+
+  timer->seconds = seconds;
+  timer->func = func;
+  timer->user_data = user_data;
+  timer->wheel = wheel;
+
+  /* As with glib, never early, but up to a second late */
+  timer->expires = current_second () + seconds + 1;
+  insert_timer (wheel, timer);
+
+  g_hash_table_insert (timers, GUINT_TO_POINTER (timer->tag), timer);
+  return timer->tag;
+}
+
+/**
+ * cockpit_timer_wheel_remove:
+ * @tag: a tag from cockpit_timer_wheel_add_seconds()
+ *
+ * Stop a timer. This may be called from the timer's own callback.
+ *
+ * Returns: %TRUE if the timer was found
+ */
+gboolean
+cockpit_timer_wheel_remove (guint tag)
+{
+  Timer *timer;
+
+  if (!timers)
+    return FALSE;
+
+  timer = g_hash_table_lookup (timers, GUINT_TO_POINTER (tag));
+  if (!timer)
+    return FALSE;
+
+  g_hash_table_remove (timers, GUINT_TO_POINTER (tag));
+  unlink_timer (timer->wheel, timer);
+
+  if (timer->dispatching)
+    timer->removed = TRUE;
+  else
+    free_timer (timer);
+
+  return TRUE;
+}
@@ -0,0 +1,38 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2016 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __COCKPIT_TIMER_WHEEL_H__
+#define __COCKPIT_TIMER_WHEEL_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+guint           cockpit_timer_wheel_add_seconds   (GMainContext *context,
+                                                   guint seconds,
+                                                   GSourceFunc func,
+                                                   gpointer user_data);
+
+gboolean        cockpit_timer_wheel_remove        (guint tag);
+
+extern gint64   cockpit_timer_wheel_offset;
+
+G_END_DECLS
+
+#endif /* __COCKPIT_TIMER_WHEEL_H__ */
@@ -0,0 +1,150 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2016 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpittrace.h"
+
+/*
+ * Timestamps of the points a traced channel's messages pass through,
+ * such as being received by cockpit-ws or sent by the bridge. They're
+ * kept in a ring, so a long running channel only keeps the most recent
+ * events, and are taken out with the "trace" control command.
+ *
+ * The SSH transport marks events from its I/O thread, so a trace has
+ * a lock. Points are static strings and aren't copied.
+ */
+
+typedef struct {
+  const gchar *point;
+  gint64 when;
+} TraceEvent;
+
+struct _CockpitTrace {
+  gint refs;
+  GMutex lock;
+  guint start;
+  guint count;
+  TraceEvent events[COCKPIT_TRACE_SIZE];
+};
+
+CockpitTrace *
+cockpit_trace_new (void)
+{
+  CockpitTrace *trace = g_new0 (CockpitTrace, 1);
+  trace->refs = 1;
+  g_mutex_init (&trace->lock);
+  return trace;
+}
+
+CockpitTrace *
+cockpit_trace_ref (CockpitTrace *trace)
+{
+  g_return_val_if_fail (trace != NULL, NULL);
+  g_atomic_int_inc (&trace->refs);
+  return trace;
+}
+
+void
+cockpit_trace_unref (gpointer data)
+{
+  CockpitTrace *trace = data;
+
+  g_return_if_fail (trace != NULL);
+
+  if (g_atomic_int_dec_and_test (&trace->refs))
+    {
+      g_mutex_clear (&trace->lock);
+      g_free (trace);
+    }
+}
+
+/**
+ * cockpit_trace_mark:
+ * @trace: the trace
+ * @point: a static string naming where the message is
+ *
+ * Record that a message passed @point just now.
+ */
+void
+cockpit_trace_mark (CockpitTrace *trace,
+                    const gchar *point)
+{
+  TraceEvent *event;
+  gint64 when;
+
+  g_return_if_fail (trace != NULL);
+
+  when = g_get_monotonic_time ();
+
+  g_mutex_lock (&trace->lock);
+  if (trace->count < COCKPIT_TRACE_SIZE)
+    {
+      event = trace->events + (trace->start + trace->count) % COCKPIT_TRACE_SIZE;
+      trace->count++;
+    }
+  else
+    {
+      event = trace->events + trace->start;
+      trace->start = (trace->start + 1) % COCKPIT_TRACE_SIZE;
+    }
+  event->point = point;
+  event->when = when;
+  g_mutex_unlock (&trace->lock);
+}
+
+/**
+ * cockpit_trace_take:
+ * @trace: the trace
+ * @events: array to add events to
+ *
+ * Move the recorded events into @events, oldest first. Each is a
+ * two element array with the point and the monotonic time in
+ * microseconds.
+ *
+ * Returns: the number of events added
+ */
+guint
+cockpit_trace_take (CockpitTrace *trace,
+                    JsonArray *events)
+{
+  TraceEvent *event;
+  JsonArray *pair;
+  guint count;
+  guint i;
+
+  g_return_val_if_fail (trace != NULL, 0);
+  g_return_val_if_fail (events != NULL, 0);
+
+  g_mutex_lock (&trace->lock);
+  for (i = 0; i < trace->count; i++)
+    {
+      event = trace->events + (trace->start + i) % COCKPIT_TRACE_SIZE;
+      pair = json_array_sized_new (2);
+      json_array_add_string_element (pair, event->point);
+      json_array_add_int_element (pair, event->when);
+      json_array_add_array_element (events, pair);
+    }
+  count = trace->count;
+  trace->start = 0;
+  trace->count = 0;
+  g_mutex_unlock (&trace->lock);
+
+  return count;
+}
@@ -0,0 +1,46 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2016 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __COCKPIT_TRACE_H__
+#define __COCKPIT_TRACE_H__
+
+#include <json-glib/json-glib.h>
+
+G_BEGIN_DECLS
+
+/* The most events a trace holds, older ones are dropped */
+#define COCKPIT_TRACE_SIZE 1024
+
+typedef struct _CockpitTrace CockpitTrace;
+
+CockpitTrace *     cockpit_trace_new          (void);
+
+CockpitTrace *     cockpit_trace_ref          (CockpitTrace *trace);
+
+void               cockpit_trace_unref        (gpointer trace);
+
+void               cockpit_trace_mark         (CockpitTrace *trace,
+                                               const gchar *point);
+
+guint              cockpit_trace_take         (CockpitTrace *trace,
+                                               JsonArray *events);
+
+G_END_DECLS
+
+#endif /* __COCKPIT_TRACE_H__ */
@@ -22,7 +22,9 @@
 #include "cockpittransport.h"
 
 #include "common/cockpitjson.h"
+#include "common/cockpitpipe.h"
 
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -131,6 +133,41 @@ cockpit_transport_send (CockpitTransport *transport,
   klass->send (transport, channel, data);
 }
 
+/**
+ * cockpit_transport_splice:
+ * @transport: a transport
+ * @channel: the channel to send on
+ * @fd: file descriptor to take the payload from
+ * @max: the longest payload to send
+ *
+ * Send up to @max bytes that can be read from @fd as a message on
+ * @channel, without them being copied through user space. Only
+ * some transports can do this, and only some of the time.
+ *
+ * Returns: the number of bytes sent, zero at the end of @fd, or -1
+ *     with errno set. errno is ENOTSUP when the transport can't splice
+ *     right now, and the data should be read and sent instead.
+ */
+gssize
+cockpit_transport_splice (CockpitTransport *transport,
+                          const gchar *channel,
+                          gint fd,
+                          gsize max)
+{
+  CockpitTransportClass *klass;
+
+  g_return_val_if_fail (COCKPIT_IS_TRANSPORT (transport), -1);
+
+  klass = COCKPIT_TRANSPORT_GET_CLASS (transport);
+  if (!klass->splice)
+    {
+      errno = ENOTSUP;
+      return -1;
+    }
+
+  return klass->splice (transport, channel, fd, max);
+}
+
 void
 cockpit_transport_close (CockpitTransport *transport,
                          const gchar *problem)
@@ -144,6 +181,208 @@ cockpit_transport_close (CockpitTransport *transport,
   klass->close (transport, problem);
 }
 
+/*
+ * Channels on a transport can be routed through one table, which
+ * hands each message to its channel with a hash table lookup. When
+ * each channel connects its own signal handlers instead, every message
+ * invokes a handler for each open channel.
+ */
+
+typedef struct {
+  CockpitTransportRecvFunc recv;
+  CockpitTransportControlFunc control;
+  gpointer user_data;
+} CockpitTransportRoute;
+
+typedef struct {
+  GHashTable *routes;
+  gulong recv_sig;
+  gulong control_sig;
+} CockpitTransportRouter;
+
+static const gchar *router_key = "cockpit-transport-router";
+
+static gboolean
+on_router_recv (CockpitTransport *transport,
+                const gchar *channel,
+                GBytes *payload,
+                gpointer user_data)
+{
+  CockpitTransportRouter *router = user_data;
+  CockpitTransportRoute *route;
+
+  if (!channel)
+    return FALSE;
+
+  route = g_hash_table_lookup (router->routes, channel);
+  if (!route || !route->recv)
+    return FALSE;
+
+  return (route->recv) (transport, channel, payload, route->user_data);
+}
+
+static gboolean
+on_router_control (CockpitTransport *transport,
+                   const char *command,
+                   const gchar *channel,
+                   JsonObject *options,
+                   GBytes *payload,
+                   gpointer user_data)
+{
+  CockpitTransportRouter *router = user_data;
+  CockpitTransportRoute *route;
+
+  if (!channel)
+    return FALSE;
+
+  route = g_hash_table_lookup (router->routes, channel);
+  if (!route || !route->control)
+    return FALSE;
+
+  return (route->control) (transport, command, channel, options, payload, route->user_data);
+}
+
+static void
+route_free (gpointer data)
+{
+  g_slice_free (CockpitTransportRoute, data);
+}
+
+static void
+router_free (gpointer data)
+{
+  CockpitTransportRouter *router = data;
+
+  /* The transport is going away, and its signal handlers with it */
+  g_hash_table_destroy (router->routes);
+  g_slice_free (CockpitTransportRouter, router);
+}
+
+/**
+ * cockpit_transport_route:
+ * @transport: a transport
+ * @channel: the channel to route
+ * @recv: called for messages on the channel, or NULL
+ * @control: called for control messages about the channel, or NULL
+ * @user_data: passed to the callbacks
+ *
+ * Deliver the messages for @channel to @recv and @control. This is
+ * like connecting to the "recv" and "control" signals and checking
+ * the channel, but costs the same however many channels are open.
+ * The callbacks return TRUE when they handled the message, as signal
+ * handlers would.
+ *
+ * The same @user_data can route its channel again with different
+ * callbacks. Otherwise the first route for a channel stays in place.
+ *
+ * Returns: FALSE if @channel is already routed elsewhere
+ */
+gboolean
+cockpit_transport_route (CockpitTransport *transport,
+                         const gchar *channel,
+                         CockpitTransportRecvFunc recv,
+                         CockpitTransportControlFunc control,
+                         gpointer user_data)
+{
+  CockpitTransportRouter *router;
+  CockpitTransportRoute *route;
+
+  g_return_val_if_fail (COCKPIT_IS_TRANSPORT (transport), FALSE);
+  g_return_val_if_fail (channel != NULL, FALSE);
+
+  router = g_object_get_data (G_OBJECT (transport), router_key);
+  if (!router)
+    {
+      router = g_slice_new0 (CockpitTransportRouter);
+      router->routes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, route_free);
+      router->recv_sig = g_signal_connect (transport, "recv", G_CALLBACK (on_router_recv), router);
+      router->control_sig = g_signal_connect (transport, "control", G_CALLBACK (on_router_control), router);
+      g_object_set_data_full (G_OBJECT (transport), router_key, router, router_free);
+    }
+
+  route = g_hash_table_lookup (router->routes, channel);
+  if (route && route->user_data != user_data)
+    {
+      g_debug ("%s: channel is already routed on transport", channel);
+      return FALSE;
+    }
+
+  if (!route)
+    {
+      route = g_slice_new0 (CockpitTransportRoute);
+      g_hash_table_insert (router->routes, g_strdup (channel), route);
+    }
+
+  route->recv = recv;
+  route->control = control;
+  route->user_data = user_data;
+  return TRUE;
+}
+
+/**
+ * cockpit_transport_unroute:
+ * @transport: a transport
+ * @channel: the channel to stop routing
+ * @user_data: the same as passed to cockpit_transport_route()
+ *
+ * Stop delivering messages for @channel that were routed with
+ * cockpit_transport_route(). Nothing happens if the channel is
+ * routed for a different @user_data.
+ */
+void
+cockpit_transport_unroute (CockpitTransport *transport,
+                           const gchar *channel,
+                           gpointer user_data)
+{
+  CockpitTransportRouter *router;
+  CockpitTransportRoute *route;
+
+  g_return_if_fail (COCKPIT_IS_TRANSPORT (transport));
+  g_return_if_fail (channel != NULL);
+
+  router = g_object_get_data (G_OBJECT (transport), router_key);
+  if (!router)
+    return;
+
+  route = g_hash_table_lookup (router->routes, channel);
+  if (route && route->user_data == user_data)
+    g_hash_table_remove (router->routes, channel);
+}
+
+/*
+ * Transports that can't hold off reading their input just
+ * carry on, and so don't implement the vfunc.
+ */
+void
+cockpit_transport_pressure (CockpitTransport *transport,
+                            gboolean pressure)
+{
+  CockpitTransportClass *klass;
+
+  g_return_if_fail (COCKPIT_IS_TRANSPORT (transport));
+
+  klass = COCKPIT_TRANSPORT_GET_CLASS (transport);
+  if (klass->pressure)
+    klass->pressure (transport, pressure);
+}
+
+/*
+ * Lets a busy transport yield to everything else in the main loop.
+ * Transports that don't implement the vfunc keep their priority.
+ */
+void
+cockpit_transport_set_priority (CockpitTransport *transport,
+                                gint priority)
+{
+  CockpitTransportClass *klass;
+
+  g_return_if_fail (COCKPIT_IS_TRANSPORT (transport));
+
+  klass = COCKPIT_TRANSPORT_GET_CLASS (transport);
+  if (klass->priority)
+    klass->priority (transport, priority);
+}
+
 void
 cockpit_transport_emit_recv (CockpitTransport *transport,
                              const gchar *channel,
@@ -210,6 +449,178 @@ parse_frame (GBytes *message,
   return g_bytes_new_from_bytes (message, channel_len, length - channel_len);
 }
 
+/**
+ * cockpit_transport_parse_header:
+ * @data: received data
+ * @length: length of @data
+ * @size: location to return the frame size
+ * @channel_len: location to return the channel length
+ *
+ * Parse the length prefix of a frame. For binary frames @channel_len
+ * is set to the length of the channel id, otherwise it is set to -1.
+ *
+ * Returns: the length of the header, zero if more data is needed,
+ *          or -1 if the header is invalid.
+ */
+gssize
+cockpit_transport_parse_header (const gchar *data,
+                                gsize length,
+                                guint32 *size,
+                                gint *channel_len)
+{
+  guint32 be;
+  gsize i;
+
+  *size = 0;
+  *channel_len = -1;
+
+  if (length > 0 && (data[0] & 0x80))
+    {
+      if (length < COCKPIT_TRANSPORT_BINARY_HEADER_LEN)
+        return 0;
+      memcpy (&be, data, sizeof (be));
+      *size = GUINT32_FROM_BE (be) & ~COCKPIT_TRANSPORT_BINARY_FLAG;
+      *channel_len = (guint8)data[4];
+      if (*size > COCKPIT_TRANSPORT_MAX_FRAME || *channel_len > *size)
+        return -1;
+      return COCKPIT_TRANSPORT_BINARY_HEADER_LEN;
+    }
+
+  for (i = 0; i < length; i++)
+    {
+      /* Check invalid characters, prevent integer overflow, limit max length */
+      if (i > 7 || data[i] < '0' || data[i] > '9')
+        break;
+      *size *= 10;
+      *size += data[i] - '0';
+    }
+
+  if (i == length)
+    return 0;
+  if (data[i] != '\n')
+    return -1;
+  return i + 1;
+}
+
+/**
+ * cockpit_transport_read_frames:
+ * @input: received data
+ * @invalid: set if an invalid frame header follows
+ *
+ * Take the complete frames at the start of @input. The data is not
+ * copied, only a trailing partial frame is put back into @input.
+ * Walk the returned block with cockpit_transport_parse_header() and
+ * cockpit_transport_frame_payload().
+ *
+ * Returns: (transfer full): the complete frames, or NULL if none
+ */
+GBytes *
+cockpit_transport_read_frames (GByteArray *input,
+                               gboolean *invalid)
+{
+  const gchar *data;
+  GBytes *block;
+  GBytes *frames;
+  gsize offset;
+  gsize length;
+  gssize prefix;
+  guint32 size;
+  gint channel_len;
+
+  *invalid = FALSE;
+
+  data = (const gchar *)input->data;
+  for (offset = 0; ; offset += prefix + size)
+    {
+      prefix = cockpit_transport_parse_header (data + offset, input->len - offset,
+                                               &size, &channel_len);
+      if (prefix < 0)
+        *invalid = TRUE;
+      if (prefix <= 0 || input->len - offset < prefix + size)
+        break;
+    }
+
+  if (offset == 0)
+    return NULL;
+
+  block = cockpit_pipe_consume (input, 0, input->len, 0);
+  data = g_bytes_get_data (block, &length);
+  if (offset == length)
+    return block;
+
+  g_byte_array_append (input, (const guint8 *)data + offset, length - offset);
+  frames = g_bytes_new_from_bytes (block, 0, offset);
+  g_bytes_unref (block);
+  return frames;
+}
+
+/**
+ * cockpit_transport_frame_payload:
+ * @frames: block from cockpit_transport_read_frames()
+ * @offset: offset of the frame after its header
+ * @size: size from the header
+ * @channel_len: channel length from the header
+ * @expect: whether to complain about invalid frames
+ * @channel: location to return the channel
+ *
+ * Split one frame of the block into a channel and payload,
+ * like cockpit_transport_parse_frame().
+ *
+ * Returns: (transfer full): the payload or NULL.
+ */
+GBytes *
+cockpit_transport_frame_payload (GBytes *frames,
+                                 gsize offset,
+                                 guint32 size,
+                                 gint channel_len,
+                                 gboolean expect,
+                                 gchar **channel)
+{
+  const gchar *data;
+  const gchar *line;
+
+  *channel = NULL;
+  data = (const gchar *)g_bytes_get_data (frames, NULL) + offset;
+
+  /*
+   * Find the channel in place, rather than making a GBytes for the whole
+   * frame first. The payload is then the only allocation besides the
+   * channel id.
+   */
+  if (channel_len < 0)
+    {
+      line = memchr (data, '\n', size);
+      if (!line)
+        {
+          if (expect)
+            g_message ("received invalid message without channel prefix");
+          return NULL;
+        }
+      channel_len = line - data;
+      if (memchr (data, '\0', channel_len) != NULL)
+        {
+          if (expect)
+            g_message ("received massage with invalid channel prefix");
+          return NULL;
+        }
+      if (channel_len)
+        *channel = g_strndup (data, channel_len);
+      return g_bytes_new_from_bytes (frames, offset + channel_len + 1, size - channel_len - 1);
+    }
+
+  /* The binary header already told us where the channel ends */
+  if (memchr (data, '\0', channel_len) != NULL)
+    {
+      if (expect)
+        g_message ("received message with invalid channel prefix");
+      return NULL;
+    }
+
+  if (channel_len)
+    *channel = g_strndup (data, channel_len);
+  return g_bytes_new_from_bytes (frames, offset + channel_len, size - channel_len);
+}
+
 /**
  * cockpit_transport_parse_frame:
  * @message: message to parse
@@ -308,6 +719,114 @@ out:
   return ret;
 }
 
+/* Nested values are checked for structure and skipped, this deep */
+#define SCAN_MAX_DEPTH 1024
+
+/**
+ * cockpit_transport_scan_command:
+ * @payload: command JSON payload to scan
+ * @command: location to return the command
+ * @channel: location to return the channel
+ *
+ * Read the "command" and "channel" out of a control message without
+ * parsing it into a JsonObject. This is meant for relaying control
+ * messages whose options aren't looked at.
+ *
+ * Only plain messages are handled: if the message isn't a valid JSON
+ * object, or "command" or "channel" aren't strings without escapes,
+ * this returns FALSE and no warning is printed. Callers should then
+ * use cockpit_transport_parse_command(), which reports the problem.
+ *
+ * Both returned strings should be freed, @channel is NULL for a
+ * missing channel.
+ *
+ * Returns: whether the command could be scanned
+ */
+gboolean
+cockpit_transport_scan_command (GBytes *payload,
+                                gchar **command,
+                                gchar **channel)
+{
+  CockpitJsonScan scan;
+  const gchar *key;
+  const gchar *value;
+  const gchar *data;
+  const gchar *found_command = NULL;
+  const gchar *found_channel = NULL;
+  gsize command_len = 0;
+  gsize channel_len = 0;
+  gsize key_len;
+  gsize value_len;
+  gboolean is_command;
+  gboolean is_channel;
+  gboolean escaped;
+  gsize length;
+
+  g_return_val_if_fail (payload != NULL, FALSE);
+  g_return_val_if_fail (command != NULL, FALSE);
+  g_return_val_if_fail (channel != NULL, FALSE);
+
+  data = g_bytes_get_data (payload, &length);
+  if (length == 0 || !g_utf8_validate (data, length, NULL))
+    return FALSE;
+
+  /* Only the top level members are looked at, nothing is built */
+  cockpit_json_scan_init (&scan, data, length);
+  if (!cockpit_json_scan_char (&scan, '{'))
+    return FALSE;
+  if (cockpit_json_scan_peek (&scan) == '}')
+    return FALSE; /* No command */
+
+  do
+    {
+      if (cockpit_json_scan_peek (&scan) != '"' ||
+          !cockpit_json_scan_string (&scan, &key, &key_len, &escaped) || escaped ||
+          !cockpit_json_scan_char (&scan, ':'))
+        return FALSE;
+
+      is_command = (key_len == 7 && memcmp (key, "command", 7) == 0);
+      is_channel = (key_len == 7 && memcmp (key, "channel", 7) == 0);
+
+      if (is_command || is_channel)
+        {
+          if (cockpit_json_scan_peek (&scan) != '"' ||
+              !cockpit_json_scan_string (&scan, &value, &value_len, &escaped) || escaped)
+            return FALSE;
+          if (is_command)
+            {
+              found_command = value;
+              command_len = value_len;
+            }
+          else
+            {
+              found_channel = value;
+              channel_len = value_len;
+            }
+        }
+      else if (!cockpit_json_scan_skip (&scan, SCAN_MAX_DEPTH - 1))
+        {
+          return FALSE;
+        }
+    }
+  while (cockpit_json_scan_char (&scan, ','));
+
+  if (!cockpit_json_scan_char (&scan, '}'))
+    return FALSE;
+  cockpit_json_scan_space (&scan);
+  if (scan.pos != scan.end)
+    return FALSE;
+
+  /* Same rules as cockpit_transport_parse_command() */
+  if (!found_command || command_len == 0)
+    return FALSE;
+  if (found_channel && (channel_len == 0 || memchr (found_channel, '\n', channel_len)))
+    return FALSE;
+
+  *command = g_strndup (found_command, command_len);
+  *channel = found_channel ? g_strndup (found_channel, channel_len) : NULL;
+  return TRUE;
+}
+
 static JsonObject *
 build_json_va (const gchar *name,
                va_list va)
@@ -342,21 +861,50 @@ cockpit_transport_build_json (const gchar *name,
   return object;
 }
 
+/**
+ * cockpit_transport_build_control:
+ * @name: the first member name
+ *
+ * Build a control message out of pairs of member names and string
+ * values, terminated by a NULL name. Members with a NULL value are left
+ * out. The message is written directly, without a JsonObject, since
+ * this is how most control messages are sent.
+ *
+ * The names must all be different.
+ *
+ * Returns: (transfer full): the encoded message
+ */
 GBytes *
 cockpit_transport_build_control (const gchar *name,
                                  ...)
 {
-  JsonObject *object;
-  GBytes *message;
+  const gchar *value;
+  GString *buffer;
+  gsize length;
   va_list va;
 
+  buffer = g_string_sized_new (64);
+  g_string_append_c (buffer, '{');
+
   va_start (va, name);
-  object = build_json_va (name, va);
+  while (name)
+    {
+      value = va_arg (va, const gchar *);
+      if (value)
+        {
+          if (buffer->len > 1)
+            g_string_append_c (buffer, ',');
+          cockpit_json_append_string (buffer, name);
+          g_string_append_c (buffer, ':');
+          cockpit_json_append_string (buffer, value);
+        }
+      name = va_arg (va, const gchar *);
+    }
   va_end (va);
 
-  message = cockpit_json_write_bytes (object);
-  json_object_unref (object);
-  return message;
+  g_string_append_c (buffer, '}');
+  length = buffer->len;
+  return g_bytes_new_take (g_string_free (buffer, FALSE), length);
 }
 
 
@@ -25,6 +25,15 @@
 
 G_BEGIN_DECLS
 
+/* Binary frames have this bit set in a 32-bit big endian length */
+#define COCKPIT_TRANSPORT_BINARY_FLAG       0x80000000
+
+/* Length and then single byte channel length */
+#define COCKPIT_TRANSPORT_BINARY_HEADER_LEN 5
+
+/* Same limit as 8 decimal digits */
+#define COCKPIT_TRANSPORT_MAX_FRAME         99999999
+
 #define COCKPIT_TYPE_TRANSPORT            (cockpit_transport_get_type ())
 #define COCKPIT_TRANSPORT(o)              (G_TYPE_CHECK_INSTANCE_CAST ((o), COCKPIT_TYPE_TRANSPORT, CockpitTransport))
 #define COCKPIT_IS_TRANSPORT(o)           (G_TYPE_CHECK_INSTANCE_TYPE ((o), COCKPIT_TYPE_TRANSPORT))
@@ -72,17 +81,73 @@ struct _CockpitTransportClass
 
   void        (* close)       (CockpitTransport *transport,
                                const gchar *problem);
+
+  /*
+   * Called when whatever receives messages from the transport is
+   * backed up, and again when it has caught up. Optional.
+   */
+  void        (* pressure)    (CockpitTransport *transport,
+                               gboolean pressure);
+
+  /*
+   * Called to send data from a file descriptor as a message without
+   * copying it. Optional, see cockpit_transport_splice().
+   */
+  gssize      (* splice)      (CockpitTransport *transport,
+                               const gchar *channel,
+                               gint fd,
+                               gsize max);
+
+  /*
+   * Called to change the main loop priority at which messages
+   * are received. Optional.
+   */
+  void        (* priority)    (CockpitTransport *transport,
+                               gint priority);
 };
 
+typedef gboolean (* CockpitTransportRecvFunc)    (CockpitTransport *transport,
+                                                  const gchar *channel,
+                                                  GBytes *payload,
+                                                  gpointer user_data);
+
+typedef gboolean (* CockpitTransportControlFunc) (CockpitTransport *transport,
+                                                  const char *command,
+                                                  const gchar *channel,
+                                                  JsonObject *options,
+                                                  GBytes *payload,
+                                                  gpointer user_data);
+
 GType       cockpit_transport_get_type       (void) G_GNUC_CONST;
 
 void        cockpit_transport_send           (CockpitTransport *transport,
                                               const gchar *channel,
                                               GBytes *data);
 
+gssize      cockpit_transport_splice         (CockpitTransport *transport,
+                                              const gchar *channel,
+                                              gint fd,
+                                              gsize max);
+
 void        cockpit_transport_close          (CockpitTransport *transport,
                                               const gchar *problem);
 
+void        cockpit_transport_pressure       (CockpitTransport *transport,
+                                              gboolean pressure);
+
+void        cockpit_transport_set_priority   (CockpitTransport *transport,
+                                              gint priority);
+
+gboolean    cockpit_transport_route          (CockpitTransport *transport,
+                                              const gchar *channel,
+                                              CockpitTransportRecvFunc recv,
+                                              CockpitTransportControlFunc control,
+                                              gpointer user_data);
+
+void        cockpit_transport_unroute        (CockpitTransport *transport,
+                                              const gchar *channel,
+                                              gpointer user_data);
+
 void        cockpit_transport_emit_recv      (CockpitTransport *transport,
                                               const gchar *channel,
                                               GBytes *data);
@@ -93,6 +158,21 @@ void        cockpit_transport_emit_closed    (CockpitTransport *transport,
 GBytes *    cockpit_transport_parse_frame    (GBytes *message,
                                               gchar **channel);
 
+gssize      cockpit_transport_parse_header   (const gchar *data,
+                                              gsize length,
+                                              guint32 *size,
+                                              gint *channel_len);
+
+GBytes *    cockpit_transport_read_frames    (GByteArray *input,
+                                              gboolean *invalid);
+
+GBytes *    cockpit_transport_frame_payload  (GBytes *frames,
+                                              gsize offset,
+                                              guint32 size,
+                                              gint channel_len,
+                                              gboolean expect,
+                                              gchar **channel);
+
 GBytes *    cockpit_transport_maybe_frame    (GBytes *message,
                                               gchar **channel);
 
@@ -101,6 +181,10 @@ gboolean    cockpit_transport_parse_command  (GBytes *payload,
                                               const gchar **channel,
                                               JsonObject **options);
 
+gboolean    cockpit_transport_scan_command   (GBytes *payload,
+                                              gchar **command,
+                                              gchar **channel);
+
 JsonObject *cockpit_transport_build_json     (const gchar *name,
                                               ...) G_GNUC_NULL_TERMINATED;
 
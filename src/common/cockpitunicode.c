@@ -21,6 +21,70 @@
 
 #include "cockpitunicode.h"
 
+#include <string.h>
+
+#define ONES   ((gsize)-1 / 0xff)
+#define HIGHS  (ONES * 0x80)
+
+/*
+ * Same result as g_utf8_validate(), but skips through runs of ASCII
+ * a word at a time. Multi-byte characters never contain ASCII bytes,
+ * so each run of non-ASCII bytes can be handed off to glib on its own.
+ */
+static gboolean
+utf8_validate (const gchar *data,
+               gsize length,
+               const gchar **end)
+{
+  const guchar *p = (const guchar *)data;
+  const guchar *e = p + length;
+  const guchar *run;
+  const gchar *stop;
+  gsize v;
+
+  while (p < e)
+    {
+      /* Runs of ASCII, a word at a time once aligned */
+      while (p < e && *p < 0x80)
+        {
+          if (*p == 0)
+            goto invalid;
+          p++;
+          if (((gsize)p & (sizeof (gsize) - 1)) == 0)
+            {
+              while ((gsize)(e - p) >= sizeof (gsize))
+                {
+                  memcpy (&v, p, sizeof (v));
+                  if ((v & HIGHS) || ((v - ONES) & ~v & HIGHS))
+                    break;
+                  p += sizeof (gsize);
+                }
+            }
+        }
+
+      if (p == e)
+        break;
+
+      /* A run of non-ASCII bytes */
+      run = p;
+      while (p < e && *p >= 0x80)
+        p++;
+
+      if (!g_utf8_validate ((const gchar *)run, p - run, &stop))
+        {
+          p = (const guchar *)stop;
+          goto invalid;
+        }
+    }
+
+  *end = (const gchar *)p;
+  return TRUE;
+
+invalid:
+  *end = (const gchar *)p;
+  return FALSE;
+}
+
 GBytes *
 cockpit_unicode_force_utf8 (GBytes *input)
 {
@@ -30,7 +94,7 @@ cockpit_unicode_force_utf8 (GBytes *input)
   GString *string;
 
   data = g_bytes_get_data (input, &length);
-  if (g_utf8_validate (data, length, &end))
+  if (utf8_validate (data, length, &end))
     return g_bytes_ref (input);
 
   string = g_string_sized_new (length + 16);
@@ -45,7 +109,7 @@ cockpit_unicode_force_utf8 (GBytes *input)
       length -= (end - data) + 1;
       data = end + 1;
     }
-  while (!g_utf8_validate (data, length, &end));
+  while (!utf8_validate (data, length, &end));
 
   if (length)
     g_string_append_len (string, data, length);
@@ -53,3 +117,44 @@ cockpit_unicode_force_utf8 (GBytes *input)
   return g_string_free_to_bytes (string);
 }
 
+/**
+ * cockpit_unicode_incomplete_tail:
+ * @data: the data
+ * @length: length of the data
+ *
+ * Look for a multi-byte UTF-8 character that has been cut off
+ * at the end of @data, such as when a stream is read in blocks.
+ *
+ * Returns: the number of trailing bytes, between 0 and 3, that
+ *          begin a character but don't complete it
+ */
+gsize
+cockpit_unicode_incomplete_tail (const gchar *data,
+                                 gsize length)
+{
+  const guchar *p = (const guchar *)data;
+  gsize need;
+  gsize i;
+
+  for (i = 1; i <= 3 && i <= length; i++)
+    {
+      /* Continuation byte */
+      if ((p[length - i] & 0xc0) == 0x80)
+        continue;
+
+      if (p[length - i] >= 0xf8)
+        return 0;
+      else if (p[length - i] >= 0xf0)
+        need = 4;
+      else if (p[length - i] >= 0xe0)
+        need = 3;
+      else if (p[length - i] >= 0xc0)
+        need = 2;
+      else
+        return 0;
+
+      return need > i ? i : 0;
+    }
+
+  return 0;
+}
@@ -26,6 +26,9 @@ G_BEGIN_DECLS
 
 GBytes *      cockpit_unicode_force_utf8    (GBytes *input);
 
+gsize         cockpit_unicode_incomplete_tail (const gchar *data,
+                                               gsize length);
+
 G_END_DECLS
 
 #endif /* __COCKPIT_UNICODE_H__ */
@@ -24,12 +24,26 @@
 #include <glib-unix.h>
 
 #include <sys/resource.h>
+#include <sys/syscall.h>
 
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <unistd.h>
 
+/*
+ * close_range() is Linux 5.9 and later, and CLOSE_RANGE_CLOEXEC 5.11.
+ * Newer syscalls have the same number on all architectures but alpha.
+ */
+#if defined(__linux__) && !defined(__NR_close_range) && !defined(__alpha__)
+#define __NR_close_range 436
+#endif
+
+#ifndef CLOSE_RANGE_CLOEXEC
+#define CLOSE_RANGE_CLOEXEC (1U << 2)
+#endif
+
 typedef struct {
     GSource source;
     GPollFD pollfd;
@@ -212,6 +226,53 @@ fdwalk (int (*cb)(void *data, int fd), void *data)
 
 #endif /* HAVE_FDWALK */
 
+/*
+ * Returns zero when done. Otherwise the kernel doesn't support it, or
+ * it's blocked, and the caller should fall back to walking the fds.
+ */
+static int
+close_range_except (int from,
+                    int except,
+                    unsigned int flags)
+{
+#ifdef __NR_close_range
+  if (from < 0)
+    from = 0;
+
+  if (except >= from)
+    {
+      if (except > from && syscall (__NR_close_range, from, except - 1, flags) < 0)
+        return -1;
+      return syscall (__NR_close_range, except + 1, ~0U, flags);
+    }
+
+  return syscall (__NR_close_range, from, ~0U, flags);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+static int
+cloexecfd (void *data,
+           gint fd)
+{
+  int *from = data;
+  int flags;
+
+  if (fd >= *from)
+    {
+      flags = fcntl (fd, F_GETFD);
+      if (flags >= 0 && !(flags & FD_CLOEXEC))
+        {
+          if (fcntl (fd, F_SETFD, flags | FD_CLOEXEC) < 0)
+            return -1;
+        }
+    }
+
+  return 0;
+}
+
 /**
  * cockpit_unix_fd_close_all:
  * @from: minimum FD to close, or -1
@@ -229,5 +290,63 @@ cockpit_unix_fd_close_all (int from,
                            int except)
 {
   CloseAll ca = { from, except };
+
+  if (close_range_except (from, except, 0) == 0)
+    return 0;
+
   return fdwalk (closefd, &ca);
 }
+
+/**
+ * cockpit_unix_fd_cloexec_all:
+ * @from: minimum FD to mark, or -1
+ *
+ * Mark all open file descriptors starting from @from to be
+ * closed on exec(). Unlike cockpit_unix_fd_close_all() this
+ * leaves alone descriptors that are needed until exec(), such as
+ * the one g_spawn_async() reports exec errors on.
+ *
+ * Without CLOSE_RANGE_CLOEXEC this walks /proc/self/fd, which
+ * allocates, so it isn't safe between fork() and exec(). Check
+ * cockpit_unix_fd_can_cloexec_all() first, before forking.
+ *
+ * Will set errno if a failure happens.
+ *
+ * Returns: zero if successful, -1 if not
+ */
+int
+cockpit_unix_fd_cloexec_all (int from)
+{
+  if (close_range_except (from, -1, CLOSE_RANGE_CLOEXEC) == 0)
+    return 0;
+
+  return fdwalk (cloexecfd, &from);
+}
+
+/**
+ * cockpit_unix_fd_can_cloexec_all:
+ *
+ * Whether cockpit_unix_fd_cloexec_all() is a single close_range()
+ * system call here, which makes it safe to use in a child process
+ * between fork() and exec(). The answer is cached, so call this
+ * once before forking.
+ *
+ * Returns: TRUE if the kernel supports CLOSE_RANGE_CLOEXEC
+ */
+gboolean
+cockpit_unix_fd_can_cloexec_all (void)
+{
+  static gint supported = -1;
+
+  if (supported < 0)
+    {
+#ifdef __NR_close_range
+      /* A range past any open descriptor, so this changes nothing */
+      supported = syscall (__NR_close_range, ~0U, ~0U, CLOSE_RANGE_CLOEXEC) == 0;
+#else
+      supported = 0;
+#endif
+    }
+
+  return supported;
+}
@@ -48,6 +48,10 @@ GSource *   cockpit_unix_fd_source_new    (gint fd,
 int         cockpit_unix_fd_close_all     (int from,
                                            int except);
 
+int         cockpit_unix_fd_cloexec_all   (int from);
+
+gboolean    cockpit_unix_fd_can_cloexec_all (void);
+
 G_END_DECLS
 
 #endif /* __COCKPIT_UNIX_FD_H__ */
@@ -0,0 +1,243 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2016 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitwebcompress.h"
+
+#include <gio/gio.h>
+
+#include <string.h>
+
+/* Output is produced in blocks of this size */
+#define COMPRESS_BLOCK_SIZE (16 * 1024)
+
+/**
+ * CockpitWebCompress
+ *
+ * This is a CockpitWebFilter which compresses the data going through
+ * it, for the "gzip" or "deflate" content encodings. Each pushed block
+ * is flushed, so that streamed data isn't held back, and the stream is
+ * ended when the response completes.
+ */
+struct _CockpitWebCompress {
+  GObject parent;
+  GConverter *converter;
+  gboolean finished;
+};
+
+typedef struct _CockpitWebCompressClass {
+  GObjectClass parent_class;
+} CockpitWebCompressClass;
+
+static void cockpit_web_filter_compress_iface (CockpitWebFilterIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (CockpitWebCompress, cockpit_web_compress, G_TYPE_OBJECT,
+                         G_IMPLEMENT_INTERFACE (COCKPIT_TYPE_WEB_FILTER, cockpit_web_filter_compress_iface)
+)
+
+static void
+cockpit_web_compress_init (CockpitWebCompress *self)
+{
+
+}
+
+static void
+cockpit_web_compress_finalize (GObject *object)
+{
+  CockpitWebCompress *self = COCKPIT_WEB_COMPRESS (object);
+
+  g_object_unref (self->converter);
+
+  G_OBJECT_CLASS (cockpit_web_compress_parent_class)->finalize (object);
+}
+
+static void
+cockpit_web_compress_class_init (CockpitWebCompressClass *klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+  gobject_class->finalize = cockpit_web_compress_finalize;
+}
+
+static void
+compress_convert (CockpitWebCompress *self,
+                  const guint8 *data,
+                  gsize length,
+                  GConverterFlags flags,
+                  void (* function) (gpointer, GBytes *),
+                  gpointer func_data)
+{
+  GConverterResult result;
+  GError *error = NULL;
+  GBytes *bytes;
+  guint8 *out;
+  gsize read;
+  gsize written;
+
+  if (self->finished)
+    return;
+
+  for (;;)
+    {
+      out = g_malloc (COMPRESS_BLOCK_SIZE);
+      result = g_converter_convert (self->converter, data, length, out, COMPRESS_BLOCK_SIZE,
+                                    flags, &read, &written, &error);
+
+      if (result == G_CONVERTER_ERROR)
+        {
+          g_free (out);
+
+          /* The output block was full, come around again */
+          if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NO_SPACE))
+            {
+              g_clear_error (&error);
+              continue;
+            }
+
+          g_critical ("couldn't compress web response: %s", error->message);
+          g_error_free (error);
+          self->finished = TRUE;
+          return;
+        }
+
+      if (written > 0)
+        {
+          bytes = g_bytes_new_take (out, written);
+          function (func_data, bytes);
+          g_bytes_unref (bytes);
+        }
+      else
+        {
+          g_free (out);
+        }
+
+      data += read;
+      length -= read;
+
+      if (result == G_CONVERTER_FINISHED)
+        {
+          self->finished = TRUE;
+          return;
+        }
+
+      if (length == 0 && result == G_CONVERTER_FLUSHED)
+        return;
+    }
+}
+
+static void
+cockpit_web_compress_push (CockpitWebFilter *filter,
+                           GBytes *block,
+                           void (* function) (gpointer, GBytes *),
+                           gpointer func_data)
+{
+  CockpitWebCompress *self = (CockpitWebCompress *)filter;
+  gconstpointer data;
+  gsize length;
+
+  data = g_bytes_get_data (block, &length);
+  if (length == 0)
+    return;
+
+  compress_convert (self, data, length, G_CONVERTER_FLUSH, function, func_data);
+}
+
+static void
+cockpit_web_compress_finish (CockpitWebFilter *filter,
+                             void (* function) (gpointer, GBytes *),
+                             gpointer func_data)
+{
+  CockpitWebCompress *self = (CockpitWebCompress *)filter;
+  compress_convert (self, NULL, 0, G_CONVERTER_INPUT_AT_END, function, func_data);
+}
+
+static void
+cockpit_web_filter_compress_iface (CockpitWebFilterIface *iface)
+{
+  iface->push = cockpit_web_compress_push;
+  iface->finish = cockpit_web_compress_finish;
+}
+
+/**
+ * cockpit_web_compress_new:
+ * @encoding: either "gzip" or "deflate"
+ * @level: zlib compression level, 1 to 9, or -1 for the default
+ *
+ * Create a new CockpitWebFilter which compresses a response. The
+ * caller sets the Content-Encoding header.
+ *
+ * Returns: A new CockpitWebFilter
+ */
+CockpitWebFilter *
+cockpit_web_compress_new (const gchar *encoding,
+                          gint level)
+{
+  CockpitWebCompress *self;
+  GZlibCompressorFormat format;
+
+  g_return_val_if_fail (encoding != NULL, NULL);
+
+  if (g_str_equal (encoding, "gzip"))
+    format = G_ZLIB_COMPRESSOR_FORMAT_GZIP;
+  else if (g_str_equal (encoding, "deflate"))
+    format = G_ZLIB_COMPRESSOR_FORMAT_ZLIB;
+  else
+    g_return_val_if_reached (NULL);
+
+  self = g_object_new (COCKPIT_TYPE_WEB_COMPRESS, NULL);
+  self->converter = G_CONVERTER (g_zlib_compressor_new (format, CLAMP (level, -1, 9)));
+
+  return COCKPIT_WEB_FILTER (self);
+}
+
+/**
+ * cockpit_web_compress_type:
+ * @content_type: a Content-Type header value or NULL
+ *
+ * Returns: whether responses of this type are worth compressing
+ */
+gboolean
+cockpit_web_compress_type (const gchar *content_type)
+{
+  static const gchar *types[] = {
+    "application/javascript",
+    "application/json",
+    "application/xml",
+    "image/svg+xml",
+    NULL
+  };
+
+  gsize length;
+  gint i;
+
+  if (!content_type)
+    return FALSE;
+
+  if (g_ascii_strncasecmp (content_type, "text/", 5) == 0)
+    return TRUE;
+
+  length = strcspn (content_type, "; ");
+  for (i = 0; types[i] != NULL; i++)
+    {
+      if (strlen (types[i]) == length && g_ascii_strncasecmp (content_type, types[i], length) == 0)
+        return TRUE;
+    }
+
+  return FALSE;
+}
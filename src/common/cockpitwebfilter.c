@@ -62,3 +62,27 @@ cockpit_web_filter_push (CockpitWebFilter *filter,
   g_assert (iface->push);
   (iface->push) (filter, queue, function, data);
 }
+
+/**
+ * cockpit_web_filter_finish:
+ * @filter: filter to finish
+ * @function: filter calls this function with bytes generated
+ * @data: value to pass to function
+ *
+ * Called once after the last block was pushed, so that a filter
+ * can send any data it still holds. Filters that don't hold data
+ * don't need to implement this.
+ */
+void
+cockpit_web_filter_finish (CockpitWebFilter *filter,
+                           void (* function) (gpointer, GBytes *),
+                           gpointer data)
+{
+  CockpitWebFilterIface *iface;
+
+  iface = COCKPIT_WEB_FILTER_GET_IFACE (filter);
+  g_return_if_fail (iface != NULL);
+
+  if (iface->finish)
+    (iface->finish) (filter, function, data);
+}
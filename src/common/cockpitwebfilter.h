@@ -39,6 +39,10 @@ struct _CockpitWebFilterIface {
                                   GBytes *block,
                                   void (* function) (gpointer, GBytes *),
                                   gpointer data);
+
+  void       (* finish)          (CockpitWebFilter *filter,
+                                  void (* function) (gpointer, GBytes *),
+                                  gpointer data);
 };
 
 GType               cockpit_web_filter_get_type     (void) G_GNUC_CONST;
@@ -48,6 +52,10 @@ void                cockpit_web_filter_push         (CockpitWebFilter *filter,
                                                      void (* function) (gpointer, GBytes *),
                                                      gpointer data);
 
+void                cockpit_web_filter_finish       (CockpitWebFilter *filter,
+                                                     void (* function) (gpointer, GBytes *),
+                                                     gpointer data);
+
 G_END_DECLS
 
 #endif /* COCKPIT_WEB_FILTER_H__ */
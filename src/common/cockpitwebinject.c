@@ -89,7 +89,7 @@ cockpit_web_inject_push (CockpitWebFilter *filter,
                          gpointer func_data)
 {
   CockpitWebInject *self = (CockpitWebInject *)filter;
-  const gchar *mark, *data, *pos = NULL;
+  const gchar *mark, *data, *end, *pos = NULL;
   gsize mark_len, data_len, at;
   GBytes *bytes;
   gsize written;
@@ -101,6 +101,13 @@ cockpit_web_inject_push (CockpitWebFilter *filter,
   if (data_len == 0)
     return;
 
+  /* Nothing more to look for, the rest passes straight through */
+  if (self->injected >= self->maximum)
+    {
+      function (func_data, block);
+      return;
+    }
+
   written = at = 0;
 
   /* look at our partial matches first
@@ -174,15 +181,21 @@ cockpit_web_inject_push (CockpitWebFilter *filter,
       }
   }
 
-  /* if we haven't reached our max number of injections, look for partial matches at the end */
-  partial_len = mark_len - 1;
-  if (partial_len > data_len)
-    partial_len = data_len;
-  while (partial_len > 0)
+  /*
+   * If we haven't reached our max number of injections, look for partial
+   * matches at the end. Only where the first character of the marker is.
+   */
+  if (self->injected < self->maximum)
     {
-      if (memcmp (mark, data + data_len - partial_len, partial_len) == 0)
-        g_array_index (self->partial_matches, gboolean, partial_len) = TRUE;
-      partial_len--;
+      end = data + data_len;
+      pos = end - MIN (mark_len - 1, data_len);
+      while ((pos = memchr (pos, mark[0], end - pos)) != NULL)
+        {
+          partial_len = end - pos;
+          if (memcmp (mark, pos, partial_len) == 0)
+            g_array_index (self->partial_matches, gboolean, partial_len) = TRUE;
+          pos++;
+        }
     }
 }
 
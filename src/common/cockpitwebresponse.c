@@ -31,15 +31,33 @@
 #include "common/cockpiterror.h"
 #include "common/cockpittemplate.h"
 
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 /**
  * Certain processes may want to have a non-default error page.
  */
 const gchar *cockpit_web_failure_resource = NULL;
 
+/* Total size of the static files kept mapped between requests */
+gsize cockpit_web_response_file_cache = 16 * 1024 * 1024;
+
+/* Blocks smaller than this are copied together, with their chunk framing */
+#define GATHER_BLOCK_MAX  (4 * 1024)
+
+/* The most we gather before queuing it */
+#define GATHER_BUFFER_MAX (64 * 1024)
+
+/* Maximum number of queued blocks sent in one sendmsg() */
+#define OUTPUT_IOV_MAX    64
+
 static const gchar default_failure_template[] =
   "<html><head><title>@@message@@</title></head><body>@@message@@</body></html>\n";
 
@@ -70,6 +88,14 @@ struct _CockpitWebResponse {
   gsize partial_offset;
   GSource *source;
 
+  /* Small blocks not yet queued, see queue_block() */
+  GByteArray *gather;
+
+  /* A file sent with sendfile() after the queue */
+  gint file_fd;
+  off_t file_offset;
+  off_t file_end;
+
   /* Status flags */
   guint count;
   gboolean complete;
@@ -93,6 +119,7 @@ static void
 cockpit_web_response_init (CockpitWebResponse *self)
 {
   self->queue = g_queue_new ();
+  self->file_fd = -1;
   self->cache_type = COCKPIT_WEB_RESPONSE_CACHE_UNSET;
 }
 
@@ -156,6 +183,10 @@ cockpit_web_response_finalize (GObject *object)
   g_assert (self->io == NULL);
   g_assert (self->out == NULL);
   g_queue_free_full (self->queue, (GDestroyNotify)g_bytes_unref);
+  if (self->gather)
+    g_byte_array_unref (self->gather);
+  if (self->file_fd >= 0)
+    close (self->file_fd);
 
   G_OBJECT_CLASS (cockpit_web_response_parent_class)->finalize (object);
 }
@@ -324,34 +355,146 @@ on_output_flushed (GObject *stream,
   g_object_unref (self);
 }
 
+static gboolean
+on_file_output (CockpitWebResponse *self)
+{
+  GSocket *socket;
+  GError *error;
+  ssize_t count;
+  gint errn;
+
+  socket = g_socket_connection_get_socket (G_SOCKET_CONNECTION (self->io));
+  count = sendfile (g_socket_get_fd (socket), self->file_fd, &self->file_offset,
+                    self->file_end - self->file_offset);
+
+  if (count < 0)
+    {
+      errn = errno;
+      if (errn == EAGAIN || errn == EINTR)
+        return TRUE;
+
+      error = g_error_new_literal (G_IO_ERROR, g_io_error_from_errno (errn), g_strerror (errn));
+      if (!cockpit_web_should_suppress_output_error (self->logname, error))
+        g_message ("%s: couldn't send web output: %s", self->logname, error->message);
+      g_error_free (error);
+
+      self->failed = TRUE;
+      cockpit_web_response_done (self);
+      return FALSE;
+    }
+
+  /* The file was truncated after we sent its length */
+  if (count == 0)
+    {
+      g_message ("%s: file became shorter while sending", self->logname);
+      self->failed = TRUE;
+      cockpit_web_response_done (self);
+      return FALSE;
+    }
+
+  g_debug ("%s: sent %d bytes from file", self->logname, (int)count);
+  if (self->file_offset >= self->file_end)
+    {
+      close (self->file_fd);
+      self->file_fd = -1;
+    }
+
+  return TRUE;
+}
+
+static void
+flush_gather (CockpitWebResponse *self)
+{
+  GByteArray *gather = self->gather;
+
+  if (gather && gather->len > 0)
+    {
+      self->gather = NULL;
+      g_queue_push_tail (self->queue, g_byte_array_free_to_bytes (gather));
+    }
+}
+
+/*
+ * On a plain socket, send several queued blocks with a single
+ * sendmsg(), much like on_file_output() uses sendfile(). Streams
+ * such as TLS connections write one block at a time.
+ */
+static gssize
+write_queue (CockpitWebResponse *self,
+             GError **error)
+{
+  struct iovec iov[OUTPUT_IOV_MAX];
+  struct msghdr msg = { 0, };
+  const guint8 *data;
+  GSocket *socket;
+  GBytes *block;
+  GList *l;
+  gsize len;
+  gssize count;
+  gint errn;
+  gint n = 0;
+
+  if (!G_IS_SOCKET_CONNECTION (self->io) || g_queue_get_length (self->queue) < 2)
+    {
+      block = g_queue_peek_head (self->queue);
+      data = g_bytes_get_data (block, &len);
+      g_assert (len == 0 || self->partial_offset < len);
+      if (len == 0)
+        return 0;
+      return g_pollable_output_stream_write_nonblocking (self->out, data + self->partial_offset,
+                                                         len - self->partial_offset, NULL, error);
+    }
+
+  for (l = self->queue->head; l != NULL && n < OUTPUT_IOV_MAX; l = g_list_next (l))
+    {
+      data = g_bytes_get_data (l->data, &len);
+      if (n == 0)
+        {
+          data += self->partial_offset;
+          len -= self->partial_offset;
+        }
+      if (len == 0)
+        continue;
+      iov[n].iov_base = (gpointer)data;
+      iov[n].iov_len = len;
+      n++;
+    }
+
+  if (n == 0)
+    return 0;
+
+  msg.msg_iov = iov;
+  msg.msg_iovlen = n;
+
+  socket = g_socket_connection_get_socket (G_SOCKET_CONNECTION (self->io));
+  count = sendmsg (g_socket_get_fd (socket), &msg, MSG_NOSIGNAL);
+  if (count < 0)
+    {
+      errn = errno;
+      if (errn == EINTR)
+        errn = EAGAIN;
+      g_set_error_literal (error, G_IO_ERROR, g_io_error_from_errno (errn), g_strerror (errn));
+    }
+
+  return count;
+}
+
 static gboolean
 on_response_output (GObject *pollable,
                     gpointer user_data)
 {
   CockpitWebResponse *self = user_data;
   GError *error = NULL;
-  const guint8 *data;
   GBytes *block;
   gssize count;
   gsize len;
 
+  flush_gather (self);
+
   block = g_queue_peek_head (self->queue);
   if (block)
     {
-      data = g_bytes_get_data (block, &len);
-      g_assert (len == 0 || self->partial_offset < len);
-      data += self->partial_offset;
-      len -= self->partial_offset;
-
-      if (len > 0)
-        {
-          count = g_pollable_output_stream_write_nonblocking (self->out, data, len,
-                                                              NULL, &error);
-        }
-      else
-        {
-          count = 0;
-        }
+      count = write_queue (self, &error);
 
       if (count < 0)
         {
@@ -371,21 +514,30 @@ on_response_output (GObject *pollable,
           return FALSE;
         }
 
-      if (count == len)
+      g_debug ("%s: sent %d bytes", self->logname, (int)count);
+
+      /* Drop the blocks that were sent completely, including empty ones */
+      while ((block = g_queue_peek_head (self->queue)) != NULL)
         {
-          g_debug ("%s: sent %d bytes", self->logname, (int)len);
+          len = g_bytes_get_size (block) - self->partial_offset;
+          if ((gsize)count < len)
+            {
+              self->partial_offset += count;
+              break;
+            }
+
+          count -= len;
           self->partial_offset = 0;
           g_queue_pop_head (self->queue);
           g_bytes_unref (block);
         }
-      else
-        {
-          g_debug ("%s: sent %d partial", self->logname, (int)count);
-          g_assert (count < len);
-          self->partial_offset += count;
-        }
+
       return TRUE;
     }
+  else if (self->file_fd >= 0)
+    {
+      return on_file_output (self);
+    }
   else
     {
       g_source_destroy (self->source);
@@ -403,20 +555,64 @@ on_response_output (GObject *pollable,
     }
 }
 
+static void
+start_output (CockpitWebResponse *self)
+{
+  if (!self->source)
+    {
+      self->source = g_pollable_output_stream_create_source (self->out, NULL);
+      g_source_set_callback (self->source, (GSourceFunc)on_response_output, self, NULL);
+      g_source_attach (self->source, NULL);
+    }
+}
+
 static void
 queue_bytes (CockpitWebResponse *self,
              GBytes *block)
 {
-  g_queue_push_tail (self->queue, g_bytes_ref (block));
+  g_return_if_fail (self->file_fd < 0);
 
+  flush_gather (self);
+  g_queue_push_tail (self->queue, g_bytes_ref (block));
   self->count++;
+  start_output (self);
+}
 
-  if (!self->source)
+/*
+ * Large files on plain sockets are sent with sendfile() from the page
+ * cache, instead of being written from userspace. That's not possible
+ * through TLS, or when filters or chunked encoding change the data.
+ */
+static gboolean
+queue_file (CockpitWebResponse *self,
+            const gchar *path,
+            gsize length)
+{
+  struct stat st;
+  gint fd;
+
+  if (length < 64 * 1024 || self->failed || self->filters || self->chunked ||
+      !G_IS_SOCKET_CONNECTION (self->io))
+    return FALSE;
+
+  fd = open (path, O_RDONLY | O_CLOEXEC | O_NOCTTY);
+  if (fd < 0)
+    return FALSE;
+
+  /* Must be the same content that the length was sent for */
+  if (fstat (fd, &st) < 0 || !S_ISREG (st.st_mode) || (gsize)st.st_size != length)
     {
-      self->source = g_pollable_output_stream_create_source (self->out, NULL);
-      g_source_set_callback (self->source, (GSourceFunc)on_response_output, self, NULL);
-      g_source_attach (self->source, NULL);
+      close (fd);
+      return FALSE;
     }
+
+  g_debug ("%s: queued file of %d bytes", self->logname, (int)length);
+  self->file_fd = fd;
+  self->file_offset = 0;
+  self->file_end = length;
+  self->count++;
+  start_output (self);
+  return TRUE;
 }
 
 static void
@@ -424,8 +620,10 @@ queue_block (CockpitWebResponse *self,
              GBytes *block)
 {
   gsize length = g_bytes_get_size (block);
+  gchar header[24];
+  gconstpointer data;
   GBytes *bytes;
-  gchar *data;
+  gint n;
 
   /*
    * We cannot queue chunks of length zero. Besides being silly, this
@@ -437,15 +635,41 @@ queue_block (CockpitWebResponse *self,
 
   g_debug ("%s: queued %d bytes", self->logname, (int)length);
 
-  if (!self->chunked)
+  /* Required for chunked transfer encoding. */
+  n = 0;
+  if (self->chunked)
+    n = g_snprintf (header, sizeof (header), "%x\r\n", (unsigned int)length);
+
+  /*
+   * Small blocks, such as relayed channel data, are copied together
+   * with their framing, and queued when the output runs. Larger ones
+   * are queued as they are and sent with their framing in one go.
+   */
+  if (length <= GATHER_BLOCK_MAX)
+    {
+      g_return_if_fail (self->file_fd < 0);
+
+      if (!self->gather)
+        self->gather = g_byte_array_sized_new (GATHER_BUFFER_MAX / 4);
+
+      data = g_bytes_get_data (block, NULL);
+      g_byte_array_append (self->gather, (const guint8 *)header, n);
+      g_byte_array_append (self->gather, data, length);
+      if (self->chunked)
+        g_byte_array_append (self->gather, (const guint8 *)"\r\n", 2);
+
+      self->count++;
+      if (self->gather->len >= GATHER_BUFFER_MAX)
+        flush_gather (self);
+      start_output (self);
+    }
+  else if (!self->chunked)
     {
       queue_bytes (self, block);
     }
   else
     {
-      /* Required for chunked transfer encoding. */
-      data = g_strdup_printf ("%x\r\n", (unsigned int)length);
-      bytes = g_bytes_new_take (data, strlen (data));
+      bytes = g_bytes_new (header, n);
       queue_bytes (self, bytes);
       g_bytes_unref (bytes);
 
@@ -536,7 +760,9 @@ cockpit_web_response_queue (CockpitWebResponse *self,
 void
 cockpit_web_response_complete (CockpitWebResponse *self)
 {
+  QueueStep qn;
   GBytes *bytes;
+  GList *l;
 
   g_return_if_fail (COCKPIT_IS_WEB_RESPONSE (self));
   g_return_if_fail (self->complete == FALSE);
@@ -544,6 +770,14 @@ cockpit_web_response_complete (CockpitWebResponse *self)
   if (self->failed)
     return;
 
+  /* Filters may still hold data, each one's output goes through the next */
+  for (l = self->filters; l != NULL; l = g_list_next (l))
+    {
+      qn.response = self;
+      qn.filters = l->next;
+      cockpit_web_filter_finish (l->data, queue_filter, &qn);
+    }
+
   /* Hold a reference until cockpit_web_response_done() */
   g_object_ref (self);
   self->complete = TRUE;
@@ -1130,6 +1364,96 @@ path_has_prefix (const gchar *path,
   return FALSE;
 }
 
+/*
+ * Static files are served often, and rarely change. Keep the most
+ * recently served ones mapped, and only stat them on each request.
+ */
+typedef struct {
+  gchar *path;
+  GBytes *body;
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  time_t mtime;
+  GList link;
+} CachedFile;
+
+static GHashTable *file_cache = NULL;
+static GQueue file_cache_lru = G_QUEUE_INIT;
+static gsize file_cache_used = 0;
+
+static void
+cached_file_free (gpointer data)
+{
+  CachedFile *cached = data;
+  g_queue_unlink (&file_cache_lru, &cached->link);
+  file_cache_used -= g_bytes_get_size (cached->body);
+  g_bytes_unref (cached->body);
+  g_free (cached->path);
+  g_slice_free (CachedFile, cached);
+}
+
+static GBytes *
+file_cache_lookup (const gchar *path,
+                   struct stat *st)
+{
+  CachedFile *cached;
+
+  if (!file_cache)
+    return NULL;
+
+  cached = g_hash_table_lookup (file_cache, path);
+  if (!cached)
+    return NULL;
+
+  if (cached->dev != st->st_dev || cached->ino != st->st_ino ||
+      cached->size != st->st_size || cached->mtime != st->st_mtime)
+    {
+      g_hash_table_remove (file_cache, path);
+      return NULL;
+    }
+
+  g_queue_unlink (&file_cache_lru, &cached->link);
+  g_queue_push_head_link (&file_cache_lru, &cached->link);
+  return g_bytes_ref (cached->body);
+}
+
+static void
+file_cache_insert (const gchar *path,
+                   struct stat *st,
+                   GBytes *body)
+{
+  CachedFile *cached;
+  gsize size;
+
+  /* Don't let one large file push out everything else */
+  size = g_bytes_get_size (body);
+  if (size > cockpit_web_response_file_cache / 4)
+    return;
+
+  if (!file_cache)
+    file_cache = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, cached_file_free);
+
+  cached = g_slice_new0 (CachedFile);
+  cached->path = g_strdup (path);
+  cached->body = g_bytes_ref (body);
+  cached->dev = st->st_dev;
+  cached->ino = st->st_ino;
+  cached->size = st->st_size;
+  cached->mtime = st->st_mtime;
+  cached->link.data = cached;
+
+  g_hash_table_replace (file_cache, cached->path, cached);
+  g_queue_push_head_link (&file_cache_lru, &cached->link);
+  file_cache_used += size;
+
+  while (file_cache_used > cockpit_web_response_file_cache)
+    {
+      cached = g_queue_peek_tail (&file_cache_lru);
+      g_hash_table_remove (file_cache, cached->path);
+    }
+}
+
 /**
  * cockpit_web_response_file:
  * @response: the response
@@ -1149,6 +1473,8 @@ cockpit_web_response_file (CockpitWebResponse *response,
   gchar *path = NULL;
   GMappedFile *file = NULL;
   const gchar *root;
+  struct stat st;
+  gboolean have_st;
   GBytes *body;
 
   g_return_if_fail (COCKPIT_IS_WEB_RESPONSE (response));
@@ -1178,7 +1504,8 @@ again:
   g_free (path);
   path = g_build_filename (root, unescaped, NULL);
 
-  if (g_file_test (path, G_FILE_TEST_IS_DIR))
+  have_st = (stat (path, &st) == 0);
+  if (have_st && S_ISDIR (st.st_mode))
     {
       cockpit_web_response_error (response, 403, NULL, "Directory Listing Denied");
       goto out;
@@ -1187,6 +1514,14 @@ again:
   /* As a double check of above behavior */
   g_assert (path_has_prefix (path, root));
 
+  body = NULL;
+  if (have_st)
+    body = file_cache_lookup (path, &st);
+  else if (file_cache)
+    g_hash_table_remove (file_cache, path);
+  if (body)
+    goto serve;
+
   g_clear_error (&error);
   file = g_mapped_file_new (path, FALSE, &error);
   if (file == NULL)
@@ -1213,7 +1548,10 @@ again:
     }
 
   body = g_mapped_file_get_bytes (file);
+  if (have_st && S_ISREG (st.st_mode))
+    file_cache_insert (path, &st, body);
 
+serve:
   /*
    * The default Content-Security-Policy for .html files allows
    * the site to have inline <script> and <style> tags. This code
@@ -1229,7 +1567,8 @@ again:
                                 csp_header, "default-src 'self' 'unsafe-inline'; connect-src 'self' ws: wss:",
                                 NULL);
 
-  if (cockpit_web_response_queue (response, body))
+  if (queue_file (response, path, g_bytes_get_size (body)) ||
+      cockpit_web_response_queue (response, body))
     cockpit_web_response_complete (response);
 
   g_bytes_unref (body);
@@ -1364,6 +1703,61 @@ cockpit_web_response_gunzip (GBytes *bytes,
     }
 }
 
+/**
+ * cockpit_web_response_gzip:
+ * @bytes: the bytes to compress
+ * @error: place to put an error
+ *
+ * Perform gzip compression on the @bytes.
+ *
+ * Returns: the compressed bytes, caller owns return value.
+ */
+GBytes *
+cockpit_web_response_gzip (GBytes *bytes,
+                           GError **error)
+{
+  GConverter *converter;
+  GConverterResult result;
+  const guint8 *in;
+  gsize inl, outl, size, read, written;
+  GByteArray *out;
+
+  converter = G_CONVERTER (g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP, -1));
+
+  in = g_bytes_get_data (bytes, &inl);
+  out = g_byte_array_new ();
+
+  do
+    {
+      /* Always room for the gzip header and trailer */
+      size = MAX (inl, 4096);
+      outl = out->len;
+      g_byte_array_set_size (out, outl + size);
+
+      result = g_converter_convert (converter, in, inl, out->data + outl, size,
+                                    G_CONVERTER_INPUT_AT_END, &read, &written, error);
+      if (result == G_CONVERTER_ERROR)
+        break;
+
+      g_byte_array_set_size (out, outl + written);
+      in += read;
+      inl -= read;
+    }
+  while (result != G_CONVERTER_FINISHED);
+
+  g_object_unref (converter);
+
+  if (result != G_CONVERTER_FINISHED)
+    {
+      g_byte_array_unref (out);
+      return NULL;
+    }
+  else
+    {
+      return g_byte_array_free_to_bytes (out);
+    }
+}
+
 static const gchar *
 find_extension (const gchar *path)
 {
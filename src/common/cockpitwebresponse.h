@@ -50,6 +50,8 @@ extern const gchar *  cockpit_web_exception_escape_root;
 
 extern const gchar *  cockpit_web_failure_resource;
 
+extern gsize          cockpit_web_response_file_cache;
+
 GType                 cockpit_web_response_get_type      (void) G_GNUC_CONST;
 
 CockpitWebResponse *  cockpit_web_response_new           (GIOStream *io,
@@ -113,6 +115,9 @@ void                  cockpit_web_response_file          (CockpitWebResponse *re
 GBytes *              cockpit_web_response_gunzip        (GBytes *bytes,
                                                           GError **error);
 
+GBytes *              cockpit_web_response_gzip          (GBytes *bytes,
+                                                          GError **error);
+
 GBytes *              cockpit_web_response_negotiation   (const gchar *path,
                                                           GHashTable *existing,
                                                           const gchar *language,
@@ -23,6 +23,8 @@
 
 #include "cockpithash.h"
 #include "cockpitmemory.h"
+#include "cockpitstats.h"
+#include "cockpittimerwheel.h"
 #include "cockpitwebresponse.h"
 
 #include "websocket/websocket.h"
@@ -41,6 +43,7 @@ gboolean cockpit_webserver_want_certificate = FALSE;
 
 guint cockpit_webserver_request_timeout = 30;
 gsize cockpit_webserver_request_maximum = 4096;
+guint cockpit_webserver_handshake_threads = 4;
 
 typedef struct _CockpitWebServerClass CockpitWebServerClass;
 
@@ -59,6 +62,8 @@ struct _CockpitWebServer {
   GSocketService *socket_service;
   GMainContext *main_context;
   GHashTable *requests;
+  GHashTable *pipelined;
+  GThreadPool *handshakes;
 };
 
 struct _CockpitWebServerClass {
@@ -89,6 +94,7 @@ enum
 
 static gint sig_handle_stream = 0;
 static gint sig_handle_resource = 0;
+static gint sig_handle_upload = 0;
 
 static void cockpit_request_free (gpointer data);
 
@@ -108,6 +114,8 @@ cockpit_web_server_init (CockpitWebServer *server)
 {
   server->requests = g_hash_table_new_full (g_direct_hash, g_direct_equal,
                                             cockpit_request_free, NULL);
+  server->pipelined = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                             NULL, (GDestroyNotify)g_bytes_unref);
   server->main_context = g_main_context_ref_thread_default ();
   server->ssl_exception_prefix = g_string_new ("");
   server->redirect_tls = TRUE;
@@ -143,6 +151,9 @@ cockpit_web_server_finalize (GObject *object)
   g_clear_object (&server->certificate);
   g_strfreev (server->document_roots);
   g_hash_table_destroy (server->requests);
+  g_hash_table_destroy (server->pipelined);
+  if (server->handshakes)
+    g_thread_pool_free (server->handshakes, FALSE, TRUE);
   if (server->main_context)
     g_main_context_unref (server->main_context);
   g_string_free (server->ssl_exception_prefix, TRUE);
@@ -301,9 +312,14 @@ on_web_response_done (CockpitWebResponse *response,
 
   io = cockpit_web_response_get_stream (response);
   if (reusable)
-    cockpit_request_start (self, io, FALSE);
+    {
+      cockpit_request_start (self, io, FALSE);
+    }
   else
-    close_io_stream (io);
+    {
+      g_hash_table_remove (self->pipelined, io);
+      close_io_stream (io);
+    }
 }
 
 static gboolean
@@ -332,6 +348,13 @@ cockpit_web_server_default_handle_stream (CockpitWebServer *self,
   g_signal_connect_data (response, "done", G_CALLBACK (on_web_response_done),
                          g_object_ref (self), (GClosureNotify)g_object_unref, 0);
 
+  /* Requests pipelined behind this one are picked up once it's done */
+  if (input->len > 0)
+    {
+      g_hash_table_replace (self->pipelined, io_stream,
+                            g_bytes_new (input->data, input->len));
+    }
+
   /*
    * If the path has more than one component, then we search
    * for handlers registered under the detail like this:
@@ -467,6 +490,26 @@ cockpit_web_server_class_init (CockpitWebServerClass *klass)
                                       G_TYPE_STRING,
                                       G_TYPE_HASH_TABLE,
                                       COCKPIT_TYPE_WEB_RESPONSE);
+
+  /*
+   * A POST or PUT with a body is handed over as soon as its headers are
+   * in, and the handler reads the body from the stream, after what's in
+   * the input buffer. Nothing handles these by default.
+   */
+  sig_handle_upload = g_signal_new ("handle-upload",
+                                    G_OBJECT_CLASS_TYPE (klass),
+                                    G_SIGNAL_RUN_LAST,
+                                    0, /* class offset */
+                                    g_signal_accumulator_true_handled,
+                                    NULL, /* accu_data */
+                                    g_cclosure_marshal_generic,
+                                    G_TYPE_BOOLEAN,
+                                    5,
+                                    G_TYPE_STRING,
+                                    G_TYPE_STRING,
+                                    G_TYPE_IO_STREAM,
+                                    G_TYPE_HASH_TABLE,
+                                    G_TYPE_BYTE_ARRAY);
 }
 
 CockpitWebServer *
@@ -589,11 +632,10 @@ sort_qvalue (gconstpointer a,
   return lb->qvalue < la->qvalue ? -1 : 1;
 }
 
-gchar **
-cockpit_web_server_parse_languages (GHashTable *headers,
-                                    const gchar *defawlt)
+static gchar **
+parse_languages (const gchar *accept,
+                 const gchar *defawlt)
 {
-  const gchar *accept;
   Language *lang;
   GPtrArray *langs;
   GPtrArray *ret;
@@ -613,8 +655,6 @@ cockpit_web_server_parse_languages (GHashTable *headers,
       g_ptr_array_add (langs, lang);
     }
 
-  accept = g_hash_table_lookup (headers, "Accept-Language");
-
   /* First build up an array we can sort */
   accept = copy = g_strdup (accept);
 
@@ -682,6 +722,95 @@ cockpit_web_server_parse_languages (GHashTable *headers,
   return (gchar **)g_ptr_array_free (ret, FALSE);
 }
 
+/*
+ * Browsers send the same Accept-Language header with every request,
+ * so keep the most recently parsed ones. Long headers aren't kept, so
+ * that a client can't fill the cache with junk.
+ */
+#define LANGUAGES_CACHE_MAX     64
+#define LANGUAGES_HEADER_MAX    256
+
+typedef struct {
+  gchar *key;
+  gchar **languages;
+  GList link;
+} CachedLanguages;
+
+G_LOCK_DEFINE_STATIC (languages_cache);
+static GHashTable *languages_cache = NULL;
+static GQueue languages_lru = G_QUEUE_INIT;
+
+static void
+cached_languages_free (gpointer data)
+{
+  CachedLanguages *cached = data;
+  g_queue_unlink (&languages_lru, &cached->link);
+  g_strfreev (cached->languages);
+  g_free (cached->key);
+  g_slice_free (CachedLanguages, cached);
+}
+
+/**
+ * cockpit_web_server_parse_languages:
+ * @headers: a table of HTTP headers
+ * @defawlt: a language to add with a low qvalue, or NULL
+ *
+ * Parse the Accept-Language header into languages in order of
+ * preference, followed by their base languages.
+ *
+ * Returns: a newly allocated array of languages, free with g_strfreev()
+ */
+gchar **
+cockpit_web_server_parse_languages (GHashTable *headers,
+                                    const gchar *defawlt)
+{
+  CachedLanguages *cached;
+  const gchar *accept;
+  gchar **languages;
+  gchar *key;
+
+  accept = g_hash_table_lookup (headers, "Accept-Language");
+  if (accept && strlen (accept) > LANGUAGES_HEADER_MAX)
+    return parse_languages (accept, defawlt);
+
+  /* The default can't contain a newline, and no header is not the same as empty */
+  key = g_strconcat (defawlt ? defawlt : "", accept ? "\n" : "", accept, NULL);
+
+  G_LOCK (languages_cache);
+
+  cached = languages_cache ? g_hash_table_lookup (languages_cache, key) : NULL;
+  if (cached)
+    {
+      g_queue_unlink (&languages_lru, &cached->link);
+      g_queue_push_head_link (&languages_lru, &cached->link);
+      languages = g_strdupv (cached->languages);
+      g_free (key);
+    }
+  else
+    {
+      languages = parse_languages (accept, defawlt);
+
+      if (!languages_cache)
+        languages_cache = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, cached_languages_free);
+
+      cached = g_slice_new0 (CachedLanguages);
+      cached->key = key;
+      cached->languages = g_strdupv (languages);
+      cached->link.data = cached;
+      g_hash_table_replace (languages_cache, cached->key, cached);
+      g_queue_push_head_link (&languages_lru, &cached->link);
+
+      while (g_queue_get_length (&languages_lru) > LANGUAGES_CACHE_MAX)
+        {
+          cached = g_queue_peek_tail (&languages_lru);
+          g_hash_table_remove (languages_cache, cached->key);
+        }
+    }
+
+  G_UNLOCK (languages_cache);
+  return languages;
+}
+
 /**
  * cockpit_web_server_parse_encoding:
  * @headers: a table of HTTP headers
@@ -757,6 +886,8 @@ cockpit_web_server_parse_encoding (GHashTable *headers,
 
 /* ---------------------------------------------------------------------------------------------------- */
 
+typedef struct _Handshake Handshake;
+
 typedef struct {
   int state;
   GIOStream *io;
@@ -765,18 +896,31 @@ typedef struct {
   CockpitWebServer *web_server;
   gboolean eof_okay;
   GSource *source;
-  GSource *timeout;
+  guint timeout;
+  Handshake *handshake;
+  gsize checked;
 } CockpitRequest;
 
+/* A TLS handshake running in the thread pool, owned by the pool */
+struct _Handshake {
+  CockpitRequest *request;
+  GIOStream *io;
+  GCancellable *cancellable;
+  GMainContext *main_context;
+  GError *error;
+};
+
 static void
 cockpit_request_free (gpointer data)
 {
   CockpitRequest *request = data;
-  if (request->timeout)
+  if (request->handshake)
     {
-      g_source_destroy (request->timeout);
-      g_source_unref (request->timeout);
+      request->handshake->request = NULL;
+      g_cancellable_cancel (request->handshake->cancellable);
     }
+  if (request->timeout)
+    cockpit_timer_wheel_remove (request->timeout);
   if (request->source)
     {
       g_source_destroy (request->source);
@@ -888,6 +1032,57 @@ process_request (CockpitRequest *request,
     g_critical ("no handler responded to request: %s", path);
 }
 
+static void
+process_upload (CockpitRequest *request,
+                const gchar *method,
+                const gchar *path,
+                GHashTable *headers)
+{
+  gboolean claimed = FALSE;
+
+  g_signal_emit (request->web_server,
+                 sig_handle_upload, 0,
+                 method,
+                 path,
+                 request->io,
+                 headers,
+                 request->buffer,
+                 &claimed);
+
+  /* The body is still on its way, so the connection can't be reused */
+  if (!claimed)
+    {
+      g_debug ("no handler for %s request: %s", method, path);
+      g_hash_table_replace (headers, g_strdup ("Connection"), g_strdup ("close"));
+      request->delayed_reply = 413;
+      process_delayed_reply (request, path, headers);
+    }
+}
+
+/*
+ * Look for the empty line after the headers, continuing where the last
+ * look stopped. Until it arrives there's nothing worth parsing.
+ */
+static gboolean
+have_request_headers (CockpitRequest *request)
+{
+  const guint8 *data = request->buffer->data;
+  gsize len = request->buffer->len;
+  gsize i;
+
+  for (i = request->checked; i < len; i++)
+    {
+      if (data[i] != '\n')
+        continue;
+      if ((i >= 1 && data[i - 1] == '\n') ||
+          (i >= 2 && data[i - 1] == '\r' && data[i - 2] == '\n'))
+        return TRUE;
+    }
+
+  request->checked = len;
+  return FALSE;
+}
+
 static gboolean
 parse_and_process_request (CockpitRequest *request)
 {
@@ -900,6 +1095,7 @@ parse_and_process_request (CockpitRequest *request)
   gssize off1;
   gssize off2;
   guint64 length;
+  gint delayed;
 
   /* The hard input limit, we just terminate the connection */
   if (request->buffer->len > cockpit_webserver_request_maximum * 2)
@@ -908,6 +1104,12 @@ parse_and_process_request (CockpitRequest *request)
       goto out;
     }
 
+  if (!have_request_headers (request))
+    {
+      again = TRUE;
+      goto out;
+    }
+
   off1 = web_socket_util_parse_req_line ((const gchar *)request->buffer->data,
                                          request->buffer->len,
                                          &method,
@@ -939,6 +1141,9 @@ parse_and_process_request (CockpitRequest *request)
       goto out;
     }
 
+  /* Anything already wrong with the request, before looking at its body */
+  delayed = request->delayed_reply;
+
   /* If we get a Content-Length then verify it is zero */
   length = 0;
   str = g_hash_table_lookup (headers, "Content-Length");
@@ -961,6 +1166,16 @@ parse_and_process_request (CockpitRequest *request)
         }
     }
 
+  /* An upload doesn't wait for its body, that's for the handler to read */
+  str = g_hash_table_lookup (headers, "Host");
+  if (length != 0 && delayed == 0 && str && !g_str_equal (str, "") &&
+      (g_str_equal (method, "POST") || g_str_equal (method, "PUT")))
+    {
+      g_byte_array_remove_range (request->buffer, 0, off1 + off2);
+      process_upload (request, method, path, headers);
+      goto out;
+    }
+
   /* Not enough data yet */
   if (request->buffer->len < off1 + off2 + length)
     {
@@ -1100,6 +1315,91 @@ on_accept_certificate (GTlsConnection *conn,
   return TRUE;
 }
 
+static void
+handshake_free (Handshake *handshake)
+{
+  g_object_unref (handshake->io);
+  g_object_unref (handshake->cancellable);
+  g_main_context_unref (handshake->main_context);
+  g_clear_error (&handshake->error);
+  g_slice_free (Handshake, handshake);
+}
+
+static gboolean
+on_handshake_done (gpointer user_data)
+{
+  Handshake *handshake = user_data;
+  CockpitRequest *request = handshake->request;
+
+  cockpit_stats_add (NULL, COCKPIT_STAT_WS_TLS_HANDSHAKES, 1);
+  if (handshake->error)
+    cockpit_stats_add (NULL, COCKPIT_STAT_WS_TLS_FAILURES, 1);
+
+  /* Unless the request went away in the meantime */
+  if (request)
+    {
+      request->handshake = NULL;
+      if (handshake->error)
+        {
+          if (!should_suppress_request_error (handshake->error))
+            g_message ("couldn't handshake TLS connection: %s", handshake->error->message);
+          cockpit_request_finish (request);
+        }
+      else
+        {
+          start_request_input (request);
+        }
+    }
+
+  handshake_free (handshake);
+  return FALSE;
+}
+
+static void
+handshake_thread (gpointer data,
+                  gpointer user_data)
+{
+  Handshake *handshake = data;
+  GSource *source;
+
+  g_tls_connection_handshake (G_TLS_CONNECTION (handshake->io),
+                              handshake->cancellable, &handshake->error);
+
+  source = g_idle_source_new ();
+  g_source_set_priority (source, G_PRIORITY_DEFAULT);
+  g_source_set_callback (source, on_handshake_done, handshake, NULL);
+  g_source_attach (source, handshake->main_context);
+  g_source_unref (source);
+}
+
+/*
+ * The RSA and key exchange work of a handshake is expensive. For a burst
+ * of connections it would hold up everything else on the main loop, so
+ * handshakes are done in a few threads, and the request continues here.
+ */
+static void
+start_handshake (CockpitRequest *request)
+{
+  CockpitWebServer *self = request->web_server;
+  Handshake *handshake;
+
+  if (!self->handshakes)
+    {
+      self->handshakes = g_thread_pool_new (handshake_thread, NULL,
+                                            cockpit_webserver_handshake_threads,
+                                            FALSE, NULL);
+    }
+
+  handshake = g_slice_new0 (Handshake);
+  handshake->request = request;
+  handshake->io = g_object_ref (request->io);
+  handshake->cancellable = g_cancellable_new ();
+  handshake->main_context = g_main_context_ref (self->main_context);
+  request->handshake = handshake;
+
+  g_thread_pool_push (self->handshakes, handshake, NULL);
+}
+
 static gboolean
 on_socket_input (GSocket *socket,
                  GIOCondition condition,
@@ -1168,6 +1468,11 @@ on_socket_input (GSocket *socket,
 
   if (is_tls)
     {
+      /*
+       * Session resumption is up to the GTlsBackend, GIO has no API for
+       * server side session caches or ticket keys. Keeping connections
+       * alive between requests is what saves us handshakes.
+       */
       tls_stream = g_tls_server_connection_new (request->io,
                                                 request->web_server->certificate,
                                                 &error);
@@ -1193,7 +1498,10 @@ on_socket_input (GSocket *socket,
       request->delayed_reply = 301;
     }
 
-  start_request_input (request);
+  if (is_tls && cockpit_webserver_handshake_threads > 0)
+    start_handshake (request);
+  else
+    start_request_input (request);
 
   /* No longer run *this* source */
   return FALSE;
@@ -1220,6 +1528,7 @@ cockpit_request_start (CockpitWebServer *self,
   CockpitRequest *request;
   gboolean input = TRUE;
   GSocket *socket;
+  GBytes *pipelined;
 
   request = g_new0 (CockpitRequest, 1);
   request->web_server = self;
@@ -1229,9 +1538,9 @@ cockpit_request_start (CockpitWebServer *self,
   /* Right before a request, EOF is not unexpected */
   request->eof_okay = TRUE;
 
-  request->timeout = g_timeout_source_new_seconds (cockpit_webserver_request_timeout);
-  g_source_set_callback (request->timeout, on_request_timeout, request, NULL);
-  g_source_attach (request->timeout, self->main_context);
+  request->timeout = cockpit_timer_wheel_add_seconds (self->main_context,
+                                                      cockpit_webserver_request_timeout,
+                                                      on_request_timeout, request);
 
   if (first)
     {
@@ -1255,6 +1564,20 @@ cockpit_request_start (CockpitWebServer *self,
   /* Owns the request */
   g_hash_table_add (self->requests, request);
 
+  /* Requests that already arrived behind the previous one */
+  pipelined = g_hash_table_lookup (self->pipelined, io);
+  if (pipelined)
+    {
+      g_byte_array_append (request->buffer, g_bytes_get_data (pipelined, NULL),
+                           g_bytes_get_size (pipelined));
+      g_hash_table_remove (self->pipelined, io);
+      request->eof_okay = FALSE;
+
+      /* Finished with the request, unless more data is needed */
+      if (!parse_and_process_request (request))
+        return;
+    }
+
   if (input)
     start_request_input (request);
 }
@@ -32,6 +32,7 @@ typedef struct _CockpitWebServer CockpitWebServer;
 
 extern guint cockpit_webserver_request_timeout;
 extern gsize cockpit_webserver_request_maximum;
+extern guint cockpit_webserver_handshake_threads;
 
 GType              cockpit_web_server_get_type      (void) G_GNUC_CONST;
 
@@ -0,0 +1,148 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2016 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitbase64.h"
+
+#include "cockpittest.h"
+
+#include <glib.h>
+
+#include <string.h>
+
+typedef struct {
+  const gchar *data;
+  const gchar *encoded;
+} Fixture;
+
+static const Fixture fixtures[] = {
+  { "", "" },
+  { "f", "Zg==" },
+  { "fo", "Zm8=" },
+  { "foo", "Zm9v" },
+  { "foob", "Zm9vYg==" },
+  { "fooba", "Zm9vYmE=" },
+  { "foobar", "Zm9vYmFy" },
+};
+
+static void
+test_encode (gconstpointer data)
+{
+  const Fixture *fixture = data;
+  gchar *encoded;
+  gsize length;
+
+  length = strlen (fixture->data);
+  encoded = g_malloc (COCKPIT_BASE64_ENCODED_MAX (length) + 1);
+  length = cockpit_base64_encode (fixture->data, length, encoded);
+  encoded[length] = '\0';
+
+  g_assert_cmpstr (encoded, ==, fixture->encoded);
+  g_free (encoded);
+}
+
+static void
+test_decode (gconstpointer data)
+{
+  const Fixture *fixture = data;
+  guchar *decoded;
+  gsize length;
+
+  length = strlen (fixture->encoded);
+  decoded = g_malloc (COCKPIT_BASE64_DECODED_MAX (length) + 1);
+  length = cockpit_base64_decode (fixture->encoded, length, decoded);
+  decoded[length] = '\0';
+
+  g_assert_cmpstr ((gchar *)decoded, ==, fixture->data);
+  g_free (decoded);
+}
+
+static void
+test_decode_inplace (void)
+{
+  gchar *data;
+  gsize length;
+
+  /* Invalid characters are skipped like g_base64_decode_step() */
+  data = g_strdup ("bWFy\nbWFs YWRl!");
+  length = cockpit_base64_decode (data, strlen (data), (guchar *)data);
+  data[length] = '\0';
+
+  g_assert_cmpstr (data, ==, "marmalade");
+  g_free (data);
+}
+
+static void
+test_compare_glib (void)
+{
+  guchar input[1024];
+  gchar *expected;
+  gchar *encoded;
+  guchar *decoded;
+  gsize length;
+  gsize len;
+
+  for (len = 0; len < sizeof (input); len++)
+    input[len] = g_random_int_range (0, 256);
+
+  for (len = 0; len < sizeof (input); len += 7)
+    {
+      expected = g_base64_encode (input, len);
+      encoded = g_malloc (COCKPIT_BASE64_ENCODED_MAX (len) + 1);
+      length = cockpit_base64_encode (input, len, encoded);
+      encoded[length] = '\0';
+      g_assert_cmpstr (encoded, ==, expected);
+
+      decoded = g_malloc (COCKPIT_BASE64_DECODED_MAX (length));
+      length = cockpit_base64_decode (encoded, length, decoded);
+      g_assert_cmpuint (length, ==, len);
+      g_assert (memcmp (decoded, input, len) == 0);
+
+      g_free (expected);
+      g_free (encoded);
+      g_free (decoded);
+    }
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  gchar *name;
+  gint i;
+
+  cockpit_test_init (&argc, &argv);
+
+  for (i = 0; i < G_N_ELEMENTS (fixtures); i++)
+    {
+      name = g_strdup_printf ("/base64/encode/%d", i);
+      g_test_add_data_func (name, fixtures + i, test_encode);
+      g_free (name);
+
+      name = g_strdup_printf ("/base64/decode/%d", i);
+      g_test_add_data_func (name, fixtures + i, test_decode);
+      g_free (name);
+    }
+
+  g_test_add_func ("/base64/decode-inplace", test_decode_inplace);
+  g_test_add_func ("/base64/compare-glib", test_compare_glib);
+
+  return g_test_run ();
+}
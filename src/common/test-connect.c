@@ -39,6 +39,144 @@
  * Mock
  */
 
+extern guint cockpit_connect_attempt_delay;
+
+/*
+ * Resolves "mock.example.com" to the IPv6 and IPv4 loopback addresses, and
+ * counts how often it was asked to. Nothing else exists.
+ */
+
+typedef struct {
+  GResolver parent;
+  gint lookups;
+} MockResolver;
+
+typedef GResolverClass MockResolverClass;
+
+GType mock_resolver_get_type (void) G_GNUC_CONST;
+
+G_DEFINE_TYPE (MockResolver, mock_resolver, G_TYPE_RESOLVER);
+
+static void
+mock_resolver_init (MockResolver *self)
+{
+
+}
+
+static GList *
+mock_lookup (MockResolver *self,
+             const gchar *hostname,
+             GSocketFamily family,
+             GError **error)
+{
+  GList *addresses = NULL;
+
+  self->lookups++;
+
+  if (!g_str_equal (hostname, "mock.example.com"))
+    {
+      g_set_error (error, G_RESOLVER_ERROR, G_RESOLVER_ERROR_NOT_FOUND,
+                   "Mock host not found: %s", hostname);
+      return NULL;
+    }
+
+  if (family != G_SOCKET_FAMILY_IPV6)
+    addresses = g_list_prepend (addresses, g_inet_address_new_loopback (G_SOCKET_FAMILY_IPV4));
+  if (family != G_SOCKET_FAMILY_IPV4)
+    addresses = g_list_prepend (addresses, g_inet_address_new_loopback (G_SOCKET_FAMILY_IPV6));
+  return addresses;
+}
+
+static GList *
+mock_resolver_lookup_by_name (GResolver *resolver,
+                              const gchar *hostname,
+                              GCancellable *cancellable,
+                              GError **error)
+{
+  return mock_lookup ((MockResolver *)resolver, hostname, G_SOCKET_FAMILY_INVALID, error);
+}
+
+static void
+mock_lookup_async (GResolver *resolver,
+                   const gchar *hostname,
+                   GSocketFamily family,
+                   GAsyncReadyCallback callback,
+                   gpointer user_data)
+{
+  GSimpleAsyncResult *simple;
+  GError *error = NULL;
+  GList *addresses;
+
+  simple = g_simple_async_result_new (G_OBJECT (resolver), callback, user_data, mock_lookup_async);
+  addresses = mock_lookup ((MockResolver *)resolver, hostname, family, &error);
+  if (error)
+    g_simple_async_result_take_error (simple, error);
+  else
+    g_simple_async_result_set_op_res_gpointer (simple, addresses, (GDestroyNotify)g_resolver_free_addresses);
+  g_simple_async_result_complete_in_idle (simple);
+  g_object_unref (simple);
+}
+
+static GList *
+mock_lookup_finish (GResolver *resolver,
+                    GAsyncResult *result,
+                    GError **error)
+{
+  GSimpleAsyncResult *simple = G_SIMPLE_ASYNC_RESULT (result);
+  GList *addresses;
+
+  if (g_simple_async_result_propagate_error (simple, error))
+    return NULL;
+
+  addresses = g_simple_async_result_get_op_res_gpointer (simple);
+  return g_list_copy_deep (addresses, (GCopyFunc)g_object_ref, NULL);
+}
+
+static void
+mock_resolver_lookup_by_name_async (GResolver *resolver,
+                                    const gchar *hostname,
+                                    GCancellable *cancellable,
+                                    GAsyncReadyCallback callback,
+                                    gpointer user_data)
+{
+  mock_lookup_async (resolver, hostname, G_SOCKET_FAMILY_INVALID, callback, user_data);
+}
+
+#if GLIB_CHECK_VERSION(2,60,0)
+
+/* Newer GNetworkAddress looks up each family separately */
+static void
+mock_resolver_lookup_by_name_with_flags_async (GResolver *resolver,
+                                               const gchar *hostname,
+                                               GResolverNameLookupFlags flags,
+                                               GCancellable *cancellable,
+                                               GAsyncReadyCallback callback,
+                                               gpointer user_data)
+{
+  GSocketFamily family = G_SOCKET_FAMILY_INVALID;
+
+  if (flags & G_RESOLVER_NAME_LOOKUP_FLAGS_IPV4_ONLY)
+    family = G_SOCKET_FAMILY_IPV4;
+  else if (flags & G_RESOLVER_NAME_LOOKUP_FLAGS_IPV6_ONLY)
+    family = G_SOCKET_FAMILY_IPV6;
+
+  mock_lookup_async (resolver, hostname, family, callback, user_data);
+}
+
+#endif
+
+static void
+mock_resolver_class_init (MockResolverClass *klass)
+{
+  klass->lookup_by_name = mock_resolver_lookup_by_name;
+  klass->lookup_by_name_async = mock_resolver_lookup_by_name_async;
+  klass->lookup_by_name_finish = mock_lookup_finish;
+#if GLIB_CHECK_VERSION(2,60,0)
+  klass->lookup_by_name_with_flags_async = mock_resolver_lookup_by_name_with_flags_async;
+  klass->lookup_by_name_with_flags_finish = mock_lookup_finish;
+#endif
+}
+
 /* ----------------------------------------------------------------------------
  * Tests
  */
@@ -233,6 +371,148 @@ test_connect_loopback (TestConnect *tc,
   g_object_unref (io);
 }
 
+static GIOStream *
+connect_and_wait (GSocketConnectable *address,
+                  GError **error)
+{
+  GAsyncResult *result = NULL;
+  GIOStream *io;
+
+  cockpit_connect_stream (address, NULL, on_ready_get_result, &result);
+  while (result == NULL)
+    g_main_context_iteration (NULL, TRUE);
+  io = cockpit_connect_stream_finish (result, error);
+  g_object_unref (result);
+  return io;
+}
+
+static void
+test_resolve_cache (TestConnect *tc,
+                    gconstpointer user_data)
+{
+  MockResolver *resolver;
+  GResolver *original;
+  GSocketConnectable *address;
+  GError *error = NULL;
+  GIOStream *io;
+  gint lookups;
+
+  original = g_resolver_get_default ();
+  resolver = g_object_new (mock_resolver_get_type (), NULL);
+  g_resolver_set_default (G_RESOLVER (resolver));
+  cockpit_connect_cache_clear ();
+
+  /* Resolves to IPv6 first, but only IPv4 is listening */
+  address = g_network_address_new ("mock.example.com", tc->port);
+
+  io = connect_and_wait (address, &error);
+  g_assert_no_error (error);
+  g_assert (io != NULL);
+  g_object_unref (io);
+
+  lookups = resolver->lookups;
+  g_assert_cmpint (lookups, >, 0);
+
+  io = connect_and_wait (address, &error);
+  g_assert_no_error (error);
+  g_assert (io != NULL);
+  g_object_unref (io);
+
+  /* Came from the cache */
+  g_assert_cmpint (resolver->lookups, ==, lookups);
+
+  cockpit_connect_cache_clear ();
+
+  io = connect_and_wait (address, &error);
+  g_assert_no_error (error);
+  g_assert (io != NULL);
+  g_object_unref (io);
+
+  g_assert_cmpint (resolver->lookups, >, lookups);
+
+  g_object_unref (address);
+  cockpit_connect_cache_clear ();
+  g_resolver_set_default (original);
+  g_object_unref (original);
+  g_object_unref (resolver);
+}
+
+static void
+test_resolve_negative (void)
+{
+  MockResolver *resolver;
+  GResolver *original;
+  GSocketConnectable *address;
+  GError *error = NULL;
+  GIOStream *io;
+  gint lookups;
+
+  original = g_resolver_get_default ();
+  resolver = g_object_new (mock_resolver_get_type (), NULL);
+  g_resolver_set_default (G_RESOLVER (resolver));
+  cockpit_connect_cache_clear ();
+
+  address = g_network_address_new ("missing.example.com", 80);
+
+  io = connect_and_wait (address, &error);
+  g_assert (io == NULL);
+  g_assert_error (error, G_RESOLVER_ERROR, G_RESOLVER_ERROR_NOT_FOUND);
+  g_clear_error (&error);
+
+  lookups = resolver->lookups;
+  g_assert_cmpint (lookups, >, 0);
+
+  /* Not found again, without asking the resolver */
+  io = connect_and_wait (address, &error);
+  g_assert (io == NULL);
+  g_assert_error (error, G_RESOLVER_ERROR, G_RESOLVER_ERROR_NOT_FOUND);
+  g_clear_error (&error);
+
+  g_assert_cmpint (resolver->lookups, ==, lookups);
+
+  g_object_unref (address);
+  cockpit_connect_cache_clear ();
+  g_resolver_set_default (original);
+  g_object_unref (original);
+  g_object_unref (resolver);
+}
+
+static void
+test_attempt_delay (TestConnect *tc,
+                    gconstpointer user_data)
+{
+  CockpitConnectable connectable = { 0 };
+  GAsyncResult *result = NULL;
+  GError *error = NULL;
+  GIOStream *io;
+
+  if (tc->skip_ipv6_loopback)
+    {
+      cockpit_test_skip ("no loopback for ipv6 found");
+      return;
+    }
+
+  /* Both families are tried at nearly the same time, one of them connects */
+  cockpit_connect_attempt_delay = 1;
+
+  connectable.address = cockpit_loopback_new (tc->port);
+  cockpit_connect_stream_full (&connectable, NULL, on_ready_get_result, &result);
+  g_object_unref (connectable.address);
+
+  while (result == NULL)
+    g_main_context_iteration (NULL, TRUE);
+  io = cockpit_connect_stream_finish (result, &error);
+  g_assert_no_error (error);
+  g_object_unref (result);
+  g_assert (io != NULL);
+
+  while (tc->conn_sock == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_object_unref (io);
+  cockpit_connect_attempt_delay = 250;
+}
+
 static void
 test_fail_not_found (void)
 {
@@ -306,6 +586,14 @@ main (int argc,
   g_test_add ("/connect/loopback-ipv6", TestConnect, GINT_TO_POINTER (G_SOCKET_FAMILY_IPV6),
               setup_connect, test_connect_loopback, teardown_connect);
 
+  g_test_add ("/connect/attempt-delay-ipv4", TestConnect, GINT_TO_POINTER (G_SOCKET_FAMILY_IPV4),
+              setup_connect, test_attempt_delay, teardown_connect);
+  g_test_add ("/connect/attempt-delay-ipv6", TestConnect, GINT_TO_POINTER (G_SOCKET_FAMILY_IPV6),
+              setup_connect, test_attempt_delay, teardown_connect);
+  g_test_add ("/connect/resolve-cache", TestConnect, NULL,
+              setup_connect, test_resolve_cache, teardown_connect);
+  g_test_add_func ("/connect/resolve-negative", test_resolve_negative);
+
   g_test_add_func ("/connect/not-found", test_fail_not_found);
   g_test_add_func ("/connect/access-denied", test_fail_access_denied);
 
@@ -0,0 +1,336 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2016 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitepoll.h"
+#include "cockpitpipe.h"
+
+#include "cockpittest.h"
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+extern gboolean cockpit_pipe_use_epoll;
+
+typedef struct {
+  int fds[2];
+} TestCase;
+
+static void
+setup (TestCase *tc,
+       gconstpointer data)
+{
+  if (pipe (tc->fds) < 0)
+    g_assert_not_reached ();
+}
+
+static void
+teardown (TestCase *tc,
+          gconstpointer data)
+{
+  if (tc->fds[0] >= 0)
+    close (tc->fds[0]);
+  if (tc->fds[1] >= 0)
+    close (tc->fds[1]);
+
+  while (g_main_context_iteration (NULL, FALSE));
+  g_assert_cmpuint (cockpit_epoll_source_count (), ==, 0);
+}
+
+static gboolean
+on_ready_read (gint fd,
+               GIOCondition cond,
+               gpointer user_data)
+{
+  gint *count = user_data;
+  gchar buf[1];
+
+  g_assert (cond & G_IO_IN);
+  g_assert_cmpint (read (fd, buf, 1), ==, 1);
+  (*count)++;
+  return TRUE;
+}
+
+static GSource *
+attach_source (gint fd,
+               GIOCondition cond,
+               gint priority,
+               gpointer func,
+               gpointer data)
+{
+  GSource *source = cockpit_epoll_source_new (fd, cond);
+  g_source_set_priority (source, priority);
+  g_source_set_callback (source, (GSourceFunc)func, data, NULL);
+  g_source_attach (source, NULL);
+  return source;
+}
+
+static void
+test_readable (TestCase *tc,
+               gconstpointer data)
+{
+  GSource *source;
+  gint count = 0;
+
+  source = attach_source (tc->fds[0], G_IO_IN, G_PRIORITY_DEFAULT, on_ready_read, &count);
+
+  while (g_main_context_iteration (NULL, FALSE));
+  g_assert_cmpint (count, ==, 0);
+
+  /* Level triggered: one byte per dispatch, until it's all read */
+  g_assert_cmpint (write (tc->fds[1], "abc", 3), ==, 3);
+  while (count < 3)
+    g_main_context_iteration (NULL, TRUE);
+
+  while (g_main_context_iteration (NULL, FALSE));
+  g_assert_cmpint (count, ==, 3);
+
+  cockpit_epoll_source_destroy (source);
+  g_source_unref (source);
+}
+
+static gboolean
+on_ready_order (gint fd,
+                GIOCondition cond,
+                gpointer user_data)
+{
+  GString *order = user_data;
+  gchar buf[1];
+
+  g_assert_cmpint (read (fd, buf, 1), ==, 1);
+  g_string_append_c (order, buf[0]);
+  return TRUE;
+}
+
+static void
+test_priority (TestCase *tc,
+               gconstpointer data)
+{
+  GString *order = g_string_new ("");
+  GSource *low, *high;
+  int other[2];
+
+  if (pipe (other) < 0)
+    g_assert_not_reached ();
+
+  low = attach_source (tc->fds[0], G_IO_IN, G_PRIORITY_LOW, on_ready_order, order);
+  high = attach_source (other[0], G_IO_IN, G_PRIORITY_DEFAULT, on_ready_order, order);
+
+  g_assert_cmpint (write (tc->fds[1], "ll", 2), ==, 2);
+  g_assert_cmpint (write (other[1], "hh", 2), ==, 2);
+
+  while (order->len < 4)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_cmpstr (order->str, ==, "hhll");
+
+  cockpit_epoll_source_destroy (low);
+  g_source_unref (low);
+  cockpit_epoll_source_destroy (high);
+  g_source_unref (high);
+  close (other[0]);
+  close (other[1]);
+  g_string_free (order, TRUE);
+}
+
+static gboolean
+on_ready_fail (gint fd,
+               GIOCondition cond,
+               gpointer user_data)
+{
+  g_assert_not_reached ();
+  return FALSE;
+}
+
+static void
+test_destroy_close (TestCase *tc,
+                    gconstpointer data)
+{
+  GSource *source;
+  int fd;
+
+  source = attach_source (tc->fds[0], G_IO_IN, G_PRIORITY_DEFAULT, on_ready_fail, NULL);
+  while (g_main_context_iteration (NULL, FALSE));
+
+  /* Keep the file open through a dup, epoll would still report it */
+  fd = dup (tc->fds[0]);
+  cockpit_epoll_source_destroy (source);
+  g_source_unref (source);
+  close (tc->fds[0]);
+  tc->fds[0] = -1;
+
+  g_assert_cmpint (write (tc->fds[1], "x", 1), ==, 1);
+  while (g_main_context_iteration (NULL, FALSE));
+
+  close (fd);
+}
+
+static gboolean
+on_ready_write (gint fd,
+                GIOCondition cond,
+                gpointer user_data)
+{
+  gint *count = user_data;
+
+  g_assert (cond & G_IO_OUT);
+  (*count)++;
+  return FALSE;
+}
+
+static void
+test_same_fd (TestCase *tc,
+              gconstpointer data)
+{
+  GSource *reader, *writer;
+  gint reads = 0;
+  gint writes = 0;
+  int sv[2];
+
+  if (socketpair (AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+    g_assert_not_reached ();
+
+  /* Both watch the same fd, which has one epoll registration */
+  reader = attach_source (sv[0], G_IO_IN, G_PRIORITY_DEFAULT, on_ready_read, &reads);
+  writer = attach_source (sv[0], G_IO_OUT, G_PRIORITY_DEFAULT, on_ready_write, &writes);
+
+  while (writes == 0)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_cmpint (reads, ==, 0);
+
+  /* The writer is gone, the reader still works */
+  g_assert_cmpint (write (sv[1], "z", 1), ==, 1);
+  while (reads == 0)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_cmpint (writes, ==, 1);
+
+  cockpit_epoll_source_destroy (reader);
+  g_source_unref (reader);
+  g_source_unref (writer);
+  close (sv[0]);
+  close (sv[1]);
+}
+
+static void
+test_regular_file (TestCase *tc,
+                   gconstpointer data)
+{
+  GSource *source;
+  gchar *path;
+  gint count = 0;
+  int fd;
+
+  path = g_build_filename (g_get_tmp_dir (), "test-epoll.XXXXXX", NULL);
+  fd = g_mkstemp (path);
+  g_assert (fd >= 0);
+  g_assert_cmpint (write (fd, "ab", 2), ==, 2);
+  g_assert_cmpint (lseek (fd, 0, SEEK_SET), ==, 0);
+
+  /* epoll can't watch regular files, the source polls instead */
+  source = attach_source (fd, G_IO_IN, G_PRIORITY_DEFAULT, on_ready_read, &count);
+  while (count < 2)
+    g_main_context_iteration (NULL, TRUE);
+
+  cockpit_epoll_source_destroy (source);
+  g_source_unref (source);
+  close (fd);
+  g_unlink (path);
+  g_free (path);
+}
+
+static void
+on_pipe_read (CockpitPipe *pipe,
+              GByteArray *buffer,
+              gboolean end_of_data,
+              gpointer user_data)
+{
+  GString *received = user_data;
+  g_string_append_len (received, (gchar *)buffer->data, buffer->len);
+  cockpit_pipe_skip (buffer, buffer->len);
+}
+
+static void
+on_pipe_close (CockpitPipe *pipe,
+               const gchar *problem,
+               gpointer user_data)
+{
+  gboolean *closed = user_data;
+  g_assert_cmpstr (problem, ==, NULL);
+  *closed = TRUE;
+}
+
+static void
+test_pipe_echo (void)
+{
+  const gchar *argv[] = { "/bin/cat", NULL };
+  GString *received = g_string_new ("");
+  gboolean closed = FALSE;
+  CockpitPipe *pipe;
+  GBytes *bytes;
+
+  cockpit_pipe_use_epoll = TRUE;
+
+  pipe = cockpit_pipe_spawn (argv, NULL, NULL, COCKPIT_PIPE_FLAGS_NONE);
+  g_signal_connect (pipe, "read", G_CALLBACK (on_pipe_read), received);
+  g_signal_connect (pipe, "close", G_CALLBACK (on_pipe_close), &closed);
+
+  bytes = g_bytes_new_static ("the quick brown fox", 19);
+  cockpit_pipe_write (pipe, bytes);
+  g_bytes_unref (bytes);
+  cockpit_pipe_close (pipe, NULL);
+
+  while (!closed)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_cmpstr (received->str, ==, "the quick brown fox");
+
+  g_object_unref (pipe);
+  g_string_free (received, TRUE);
+  cockpit_pipe_use_epoll = FALSE;
+
+  while (g_main_context_iteration (NULL, FALSE));
+  g_assert_cmpuint (cockpit_epoll_source_count (), ==, 0);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  cockpit_test_init (&argc, &argv);
+
+  g_test_add ("/epoll/readable", TestCase, NULL,
+              setup, test_readable, teardown);
+  g_test_add ("/epoll/priority", TestCase, NULL,
+              setup, test_priority, teardown);
+  g_test_add ("/epoll/destroy-close", TestCase, NULL,
+              setup, test_destroy_close, teardown);
+  g_test_add ("/epoll/same-fd", TestCase, NULL,
+              setup, test_same_fd, teardown);
+  g_test_add ("/epoll/regular-file", TestCase, NULL,
+              setup, test_regular_file, teardown);
+
+  g_test_add_func ("/epoll/pipe-echo", test_pipe_echo);
+
+  return g_test_run ();
+}
@@ -116,6 +116,28 @@ test_get_int (TestCase *tc,
   g_assert (ret == FALSE);
 }
 
+static void
+test_get_double (TestCase *tc,
+                 gconstpointer data)
+{
+  gboolean ret;
+  gdouble value;
+
+  ret = cockpit_json_get_double (tc->root, "number", 0, &value);
+  g_assert (ret == TRUE);
+  g_assert_cmpfloat (value, ==, 55);
+
+  ret = cockpit_json_get_double (tc->root, "unknown", 6.5, &value);
+  g_assert (ret == TRUE);
+  g_assert_cmpfloat (value, ==, 6.5);
+
+  ret = cockpit_json_get_double (tc->root, "string", 6.5, &value);
+  g_assert (ret == FALSE);
+
+  ret = cockpit_json_get_double (tc->root, "string", 6.5, NULL);
+  g_assert (ret == FALSE);
+}
+
 static void
 test_get_bool (TestCase *tc,
                gconstpointer data)
@@ -337,6 +359,119 @@ test_parser_empty (void)
   g_assert (node == NULL);
 }
 
+typedef struct {
+    const gchar *name;
+    const gchar *input;
+    const gchar *expect;
+    gint error;
+} FixtureParse;
+
+static const FixtureParse parse_fixtures[] = {
+  { "nested", "{\"a\": [1, -2, true, false, null, {}], \"b\": {\"c\": []}}",
+    "{\"a\":[1,-2,true,false,null,{}],\"b\":{\"c\":[]}}", -1 },
+  { "escapes", "[\"\\\" \\\\ \\/ \\b \\f \\n \\r \\t\"]",
+    "[\"\\\" \\\\ / \\b \\f \\n \\r \\t\"]", -1 },
+  { "unicode", "[\"\\u00e9\\u20ac\\ud83d\\ude00\"]", "[\"\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80\"]", -1 },
+  { "duplicate", "{\"a\": 1, \"a\": 2}", "{\"a\":2}", -1 },
+  { "large-int", "[9223372036854775807, -9223372036854775807]",
+    "[9223372036854775807,-9223372036854775807]", -1 },
+  { "trailing-comma-array", "[1, 2,]", NULL, JSON_PARSER_ERROR_TRAILING_COMMA },
+  { "trailing-comma-object", "{\"a\": 1,}", NULL, JSON_PARSER_ERROR_TRAILING_COMMA },
+  { "missing-comma", "[1 2]", NULL, JSON_PARSER_ERROR_MISSING_COMMA },
+  { "missing-colon", "{\"a\" 1}", NULL, JSON_PARSER_ERROR_MISSING_COLON },
+  { "bareword", "[nothing]", NULL, JSON_PARSER_ERROR_INVALID_BAREWORD },
+  { "unterminated", "{\"a\": [1", NULL, JSON_PARSER_ERROR_PARSE },
+  { "unterminated-string", "\"abc", NULL, JSON_PARSER_ERROR_PARSE },
+  { "bad-escape", "\"\\x\"", NULL, JSON_PARSER_ERROR_PARSE },
+  { "lone-surrogate", "\"\\ud83d\"", NULL, JSON_PARSER_ERROR_PARSE },
+  { "control-char", "\"a\nb\"", NULL, JSON_PARSER_ERROR_PARSE },
+  { "bad-number", "[01]", NULL, JSON_PARSER_ERROR_MISSING_COMMA },
+  { "bad-fraction", "[1.]", NULL, JSON_PARSER_ERROR_PARSE },
+  { "trailing-data", "{} {}", NULL, JSON_PARSER_ERROR_PARSE },
+  { "member-name", "{1: 2}", NULL, JSON_PARSER_ERROR_PARSE },
+};
+
+static void
+test_parse (gconstpointer data)
+{
+  const FixtureParse *fixture = data;
+  GError *error = NULL;
+  JsonNode *node;
+  gchar *output;
+
+  node = cockpit_json_parse (fixture->input, -1, &error);
+  if (fixture->error < 0)
+    {
+      g_assert_no_error (error);
+      g_assert (node != NULL);
+      output = cockpit_json_write (node, NULL);
+      g_assert_cmpstr (output, ==, fixture->expect);
+      g_free (output);
+      json_node_free (node);
+    }
+  else
+    {
+      g_assert (node == NULL);
+      g_assert_error (error, JSON_PARSER_ERROR, fixture->error);
+      g_error_free (error);
+    }
+}
+
+static void
+test_parse_numbers (void)
+{
+  GError *error = NULL;
+  JsonArray *array;
+  JsonNode *node;
+
+  node = cockpit_json_parse ("[55, 1.5, -2e3, 0.25E+1, 18446744073709551615, 1e400]", -1, &error);
+  g_assert_no_error (error);
+  array = json_node_get_array (node);
+
+  g_assert_cmpint (json_node_get_value_type (json_array_get_element (array, 0)), ==, G_TYPE_INT64);
+  g_assert_cmpint (json_array_get_int_element (array, 0), ==, 55);
+  g_assert_cmpint (json_node_get_value_type (json_array_get_element (array, 1)), ==, G_TYPE_DOUBLE);
+  g_assert_cmpfloat (json_array_get_double_element (array, 1), ==, 1.5);
+  g_assert_cmpfloat (json_array_get_double_element (array, 2), ==, -2000.0);
+  g_assert_cmpfloat (json_array_get_double_element (array, 3), ==, 2.5);
+
+  /* Integers too large for gint64 wrap around, as uint64 D-Bus values expect */
+  g_assert_cmpuint ((guint64)json_array_get_int_element (array, 4), ==, G_MAXUINT64);
+
+  g_assert_cmpint (json_node_get_value_type (json_array_get_element (array, 5)), ==, G_TYPE_DOUBLE);
+  json_node_free (node);
+
+  /* Both ends of gint64, and just past them */
+  node = cockpit_json_parse ("[9223372036854775807, 9223372036854775808, 18446744073709551616,"
+                             " -9223372036854775808, -9223372036854775809, -18446744073709551615, -0]",
+                             -1, &error);
+  g_assert_no_error (error);
+  array = json_node_get_array (node);
+
+  g_assert_cmpint (json_array_get_int_element (array, 0), ==, G_MAXINT64);
+  g_assert_cmpint (json_node_get_value_type (json_array_get_element (array, 1)), ==, G_TYPE_INT64);
+  g_assert_cmpuint ((guint64)json_array_get_int_element (array, 1), ==, (guint64)G_MAXINT64 + 1);
+  g_assert_cmpint (json_node_get_value_type (json_array_get_element (array, 2)), ==, G_TYPE_DOUBLE);
+  g_assert_cmpfloat (json_array_get_double_element (array, 2), ==, 18446744073709551616.0);
+
+  g_assert_cmpint (json_node_get_value_type (json_array_get_element (array, 3)), ==, G_TYPE_INT64);
+  g_assert_cmpint (json_array_get_int_element (array, 3), ==, G_MININT64);
+  g_assert_cmpint (json_node_get_value_type (json_array_get_element (array, 4)), ==, G_TYPE_DOUBLE);
+  g_assert_cmpfloat (json_array_get_double_element (array, 4), ==, -9223372036854775809.0);
+  g_assert_cmpint (json_node_get_value_type (json_array_get_element (array, 5)), ==, G_TYPE_DOUBLE);
+  g_assert_cmpfloat (json_array_get_double_element (array, 5), ==, -18446744073709551615.0);
+
+  g_assert_cmpint (json_node_get_value_type (json_array_get_element (array, 6)), ==, G_TYPE_INT64);
+  g_assert_cmpint (json_array_get_int_element (array, 6), ==, 0);
+  json_node_free (node);
+
+  /* Data need not be null terminated */
+  node = cockpit_json_parse ("12345", 3, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (json_node_get_int (node), ==, 123);
+  json_node_free (node);
+}
+
 typedef struct {
     const gchar *name;
     gboolean equal;
@@ -451,6 +586,8 @@ static const FixtureString string_fixtures[] = {
   { "a\nxc", "\"a\\nxc\"" },
   { "a\\xc", "\"a\\\\xc\"" },
   { "Barney B\303\244r", "\"Barney B\303\244r\"" },
+  { "a\x1f\"\tb", "\"a\\u001f\\\"\\tb\"" },
+  { "", "\"\"" },
 };
 
 static void
@@ -469,6 +606,35 @@ test_string_encode (gconstpointer data)
   json_node_free (node);
 }
 
+static void
+test_string_append (gconstpointer data)
+{
+  const FixtureString *fixture = data;
+  GString *buffer;
+
+  buffer = g_string_new ("x");
+  cockpit_json_append_string (buffer, fixture->str);
+  g_assert_cmpstr (buffer->str + 1, ==, fixture->expect);
+  g_string_free (buffer, TRUE);
+
+  /* The same, when the length is given */
+  buffer = g_string_new ("x");
+  cockpit_json_append_string_len (buffer, fixture->str, strlen (fixture->str));
+  g_assert_cmpstr (buffer->str + 1, ==, fixture->expect);
+  g_string_free (buffer, TRUE);
+}
+
+static void
+test_string_append_nul (void)
+{
+  GString *buffer;
+
+  buffer = g_string_new ("");
+  cockpit_json_append_string_len (buffer, "one\0two\n\0", 9);
+  g_assert_cmpstr (buffer->str, ==, "\"one\\u0000two\\n\\u0000\"");
+  g_string_free (buffer, TRUE);
+}
+
 static const gchar *patch_data =
  "{"
   "   \"string\": \"value\","
@@ -613,6 +779,107 @@ test_write_infinite_nan (void)
   g_free (string);
 }
 
+static void
+test_write_numbers (void)
+{
+  JsonArray *array;
+  JsonNode *node;
+  gchar *string;
+
+  array = json_array_new ();
+  json_array_add_double_element (array, 0.1);
+  json_array_add_double_element (array, 1.0 / 3.0);
+  json_array_add_double_element (array, -2.5e-8);
+  json_array_add_double_element (array, 1e300);
+  json_array_add_int_element (array, 0);
+  json_array_add_int_element (array, -42);
+  json_array_add_int_element (array, G_MAXINT64);
+  json_array_add_int_element (array, G_MININT64);
+
+  node = json_node_new (JSON_NODE_ARRAY);
+  json_node_take_array (node, array);
+  string = cockpit_json_write (node, NULL);
+
+  g_assert_cmpstr (string, ==, "[0.1,0.3333333333333333,-2.5e-08,1e+300,0,-42,"
+                   "9223372036854775807,-9223372036854775808]");
+
+  json_node_free (node);
+  g_free (string);
+}
+
+static void
+test_append_double (void)
+{
+  GString *buffer;
+
+  buffer = g_string_new ("");
+  cockpit_json_append_double (buffer, 3.0);
+  g_string_append_c (buffer, ',');
+  cockpit_json_append_double (buffer, 0.5);
+  g_string_append_c (buffer, ',');
+  cockpit_json_append_double (buffer, 1.0/0.0);
+  g_string_append_c (buffer, ',');
+  cockpit_json_append_double (buffer, sqrt (-1));
+
+  g_assert_cmpstr (buffer->str, ==, "3,0.5,null,null");
+  g_string_free (buffer, TRUE);
+}
+
+static gboolean
+scan_skip_all (const gchar *data,
+               gint depth)
+{
+  CockpitJsonScan scan;
+
+  cockpit_json_scan_init (&scan, data, strlen (data));
+  if (!cockpit_json_scan_skip (&scan, depth))
+    return FALSE;
+  cockpit_json_scan_space (&scan);
+  return scan.pos == scan.end;
+}
+
+static void
+test_scan_skip (void)
+{
+  g_assert (scan_skip_all (" { \"a\" : [1, -2.5e3, true, null], \"b\": {} } ", 2));
+  g_assert (scan_skip_all ("\"\\ud83d\\ude00\"", 0));
+  g_assert (scan_skip_all ("[[[]]]", 3));
+
+  g_assert (!scan_skip_all ("[[[]]]", 2));
+  g_assert (!scan_skip_all ("{\"a\" 1}", 2));
+  g_assert (!scan_skip_all ("[1,]", 2));
+  g_assert (!scan_skip_all ("01", 0));
+  g_assert (!scan_skip_all ("\"truncated", 0));
+  g_assert (!scan_skip_all ("\"\\ud83d\"", 0));
+  g_assert (!scan_skip_all ("\"\\x\"", 0));
+  g_assert (!scan_skip_all ("tru", 0));
+}
+
+static void
+test_scan_string (void)
+{
+  CockpitJsonScan scan;
+  const gchar *data = "\"one\" \"t\\nwo\"";
+  const gchar *value;
+  gboolean escaped;
+  gsize length;
+
+  cockpit_json_scan_init (&scan, data, strlen (data));
+
+  g_assert (cockpit_json_scan_string (&scan, &value, &length, &escaped));
+  g_assert_cmpuint (length, ==, 3);
+  g_assert (memcmp (value, "one", 3) == 0);
+  g_assert (!escaped);
+
+  g_assert_cmpint (cockpit_json_scan_peek (&scan), ==, '"');
+  g_assert (cockpit_json_scan_string (&scan, &value, &length, &escaped));
+  g_assert_cmpuint (length, ==, 5);
+  g_assert (memcmp (value, "t\\nwo", 5) == 0);
+  g_assert (escaped);
+
+  g_assert_cmpint (cockpit_json_scan_peek (&scan), ==, '\0');
+}
+
 int
 main (int argc,
       char *argv[])
@@ -632,6 +899,8 @@ main (int argc,
               setup, test_get_string, teardown);
   g_test_add ("/json/get-int", TestCase, NULL,
               setup, test_get_int, teardown);
+  g_test_add ("/json/get-double", TestCase, NULL,
+              setup, test_get_double, teardown);
   g_test_add ("/json/get-bool", TestCase, NULL,
               setup, test_get_bool, teardown);
   g_test_add ("/json/get-null", TestCase, NULL,
@@ -645,6 +914,14 @@ main (int argc,
 
   g_test_add_func ("/json/parser-trims", test_parser_trims);
   g_test_add_func ("/json/parser-empty", test_parser_empty);
+  g_test_add_func ("/json/parse-numbers", test_parse_numbers);
+
+  for (i = 0; i < G_N_ELEMENTS (parse_fixtures); i++)
+    {
+      name = g_strdup_printf ("/json/parse/%s", parse_fixtures[i].name);
+      g_test_add_data_func (name, parse_fixtures + i, test_parse);
+      g_free (name);
+    }
 
   for (i = 0; i < G_N_ELEMENTS (equal_fixtures); i++)
     {
@@ -658,9 +935,13 @@ main (int argc,
       escaped = g_strcanon (g_strdup (string_fixtures[i].str), COCKPIT_TEST_CHARS, '_');
       name = g_strdup_printf ("/json/string/%s%d", escaped, i);
       g_test_add_data_func (name, string_fixtures + i, test_string_encode);
+      g_free (name);
+      name = g_strdup_printf ("/json/append-string/%s%d", escaped, i);
+      g_test_add_data_func (name, string_fixtures + i, test_string_append);
       g_free (escaped);
       g_free (name);
     }
+  g_test_add_func ("/json/append-string/nul", test_string_append_nul);
 
   for (i = 0; i < G_N_ELEMENTS (patch_fixtures); i++)
     {
@@ -670,6 +951,10 @@ main (int argc,
     }
 
   g_test_add_func ("/json/write/infinite-nan", test_write_infinite_nan);
+  g_test_add_func ("/json/write/numbers", test_write_numbers);
+  g_test_add_func ("/json/append-double", test_append_double);
+  g_test_add_func ("/json/scan-skip", test_scan_skip);
+  g_test_add_func ("/json/scan-string", test_scan_string);
 
 
   return g_test_run ();
@@ -0,0 +1,152 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2016 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitlogring.h"
+
+#include "cockpittest.h"
+
+#include <glib.h>
+#include <string.h>
+
+typedef struct {
+  const gchar *name;
+  GPtrArray *points;
+  GArray *values;
+  gint64 last;
+} Collected;
+
+static void
+on_record (gint64 when,
+           const gchar *point,
+           const gchar *name,
+           gint64 value,
+           gpointer user_data)
+{
+  Collected *col = user_data;
+
+  /* Oldest first */
+  g_assert_cmpint (when, >=, col->last);
+  col->last = when;
+
+  if (g_str_equal (name, col->name))
+    {
+      g_ptr_array_add (col->points, (gpointer)point);
+      g_array_append_val (col->values, value);
+    }
+}
+
+static void
+collect (Collected *col,
+         const gchar *name)
+{
+  col->name = name;
+  col->points = g_ptr_array_new ();
+  col->values = g_array_new (FALSE, FALSE, sizeof (gint64));
+  col->last = 0;
+  cockpit_log_ring_foreach (on_record, col);
+}
+
+static void
+collected_clear (Collected *col)
+{
+  g_ptr_array_free (col->points, TRUE);
+  g_array_free (col->values, TRUE);
+}
+
+static void
+test_record (void)
+{
+  Collected col;
+
+  cockpit_log_ring_record (COCKPIT_LOG_RING_PIPE_WROTE, "test-record", 5);
+  cockpit_log_ring_record (COCKPIT_LOG_RING_TRANSPORT_QUEUED, "test-record", 6);
+  cockpit_log_ring_record (COCKPIT_LOG_RING_PIPE_WROTE, "test-other", 7);
+  cockpit_log_ring_record (COCKPIT_LOG_RING_PIPE_PARTIAL, "test-record", -1);
+
+  collect (&col, "test-record");
+  g_assert_cmpuint (col.points->len, ==, 3);
+  g_assert_cmpstr (col.points->pdata[0], ==, "pipe-wrote");
+  g_assert_cmpstr (col.points->pdata[1], ==, "transport-queued");
+  g_assert_cmpstr (col.points->pdata[2], ==, "pipe-partial");
+  g_assert_cmpint (g_array_index (col.values, gint64, 0), ==, 5);
+  g_assert_cmpint (g_array_index (col.values, gint64, 1), ==, 6);
+  g_assert_cmpint (g_array_index (col.values, gint64, 2), ==, -1);
+  collected_clear (&col);
+}
+
+static void
+test_name (void)
+{
+  Collected col;
+  gchar *name;
+
+  /* Long names are cut short, NULL is an empty name */
+  name = g_strnfill (COCKPIT_LOG_RING_NAME_MAX * 2, 'x');
+  cockpit_log_ring_record (COCKPIT_LOG_RING_PIPE_READ, name, 1);
+  cockpit_log_ring_record (COCKPIT_LOG_RING_PIPE_READ, NULL, 2);
+
+  name[COCKPIT_LOG_RING_NAME_MAX - 1] = '\0';
+  collect (&col, name);
+  g_assert_cmpuint (col.values->len, >=, 1);
+  g_assert_cmpint (g_array_index (col.values, gint64, col.values->len - 1), ==, 1);
+  collected_clear (&col);
+
+  collect (&col, "");
+  g_assert_cmpuint (col.values->len, >=, 1);
+  g_assert_cmpint (g_array_index (col.values, gint64, col.values->len - 1), ==, 2);
+  collected_clear (&col);
+
+  g_free (name);
+}
+
+static void
+test_wrap (void)
+{
+  Collected col;
+  gint i;
+
+  /* Only the newest records are kept, in order */
+  for (i = 0; i < COCKPIT_LOG_RING_SIZE + 100; i++)
+    cockpit_log_ring_record (COCKPIT_LOG_RING_TRANSPORT_FRAME, "test-wrap", i);
+
+  collect (&col, "test-wrap");
+  g_assert_cmpuint (col.values->len, ==, COCKPIT_LOG_RING_SIZE);
+  for (i = 0; i < COCKPIT_LOG_RING_SIZE; i++)
+    g_assert_cmpint (g_array_index (col.values, gint64, i), ==, i + 100);
+  collected_clear (&col);
+
+  collect (&col, "test-record");
+  g_assert_cmpuint (col.values->len, ==, 0);
+  collected_clear (&col);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  cockpit_test_init (&argc, &argv);
+
+  g_test_add_func ("/logring/record", test_record);
+  g_test_add_func ("/logring/name", test_name);
+  g_test_add_func ("/logring/wrap", test_wrap);
+
+  return g_test_run ();
+}
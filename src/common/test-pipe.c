@@ -25,11 +25,19 @@
 
 #include <glib.h>
 #include <glib/gstdio.h>
+#include <glib-unix.h>
 #include <gio/gunixsocketaddress.h>
 
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/uio.h>
 #include <sys/wait.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <string.h>
+#include <unistd.h>
+
+extern gboolean cockpit_pipe_fast_spawn;
 
 /* ----------------------------------------------------------------------------
  * Mock
@@ -237,6 +245,76 @@ test_echo_queue (TestCase *tc,
   g_assert (memcmp (echo_pipe->received->data, "onetwo", 6) == 0);
 }
 
+static void
+test_echo_corked (TestCase *tc,
+                  gconstpointer data)
+{
+  MockEchoPipe *echo_pipe = (MockEchoPipe *)tc->pipe;
+  GBytes *sent;
+  gchar *large;
+
+  g_object_set (tc->pipe, "cork", TRUE, NULL);
+
+  sent = g_bytes_new_static ("one", 3);
+  cockpit_pipe_write (tc->pipe, sent);
+  g_bytes_unref (sent);
+  sent = g_bytes_new_static ("two", 3);
+  cockpit_pipe_write (tc->pipe, sent);
+  g_bytes_unref (sent);
+
+  /* Too large to be corked, but must be written after the above */
+  large = g_strnfill (8 * 1024, '!');
+  sent = g_bytes_new_take (large, 8 * 1024);
+  cockpit_pipe_write (tc->pipe, sent);
+  g_bytes_unref (sent);
+
+  sent = g_bytes_new_static ("three", 5);
+  cockpit_pipe_write (tc->pipe, sent);
+  g_bytes_unref (sent);
+
+  /* Only closes after above are sent */
+  cockpit_pipe_close (tc->pipe, NULL);
+
+  while (!echo_pipe->closed)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_cmpint (echo_pipe->received->len, ==, 6 + 8 * 1024 + 5);
+  g_assert (memcmp (echo_pipe->received->data, "onetwo!", 7) == 0);
+  g_assert (memcmp (echo_pipe->received->data + 6 + 8 * 1024 - 1, "!three", 6) == 0);
+}
+
+static void
+test_echo_urgent (TestCase *tc,
+                  gconstpointer data)
+{
+  MockEchoPipe *echo_pipe = (MockEchoPipe *)tc->pipe;
+  GBytes *sent;
+
+  sent = g_bytes_new_static ("one", 3);
+  cockpit_pipe_write (tc->pipe, sent);
+  g_bytes_unref (sent);
+  g_assert_cmpuint (cockpit_pipe_mark_boundary (tc->pipe), ==, 3);
+  sent = g_bytes_new_static ("two", 3);
+  cockpit_pipe_write (tc->pipe, sent);
+  g_bytes_unref (sent);
+  g_assert_cmpuint (cockpit_pipe_mark_boundary (tc->pipe), ==, 6);
+
+  /* Goes ahead, but only at the first boundary */
+  sent = g_bytes_new_static ("URGENT", 6);
+  cockpit_pipe_write_urgent (tc->pipe, sent);
+  g_bytes_unref (sent);
+  g_assert (!cockpit_pipe_is_written (tc->pipe, 3));
+
+  cockpit_pipe_close (tc->pipe, NULL);
+
+  while (!echo_pipe->closed)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert (cockpit_pipe_is_written (tc->pipe, 6));
+  g_assert_cmpint (echo_pipe->received->len, ==, 12);
+  g_assert (memcmp (echo_pipe->received->data, "oneURGENTtwo", 12) == 0);
+}
+
 static const TestFixture fixture_no_timeout = {
     .no_timeout = TRUE
 };
@@ -548,6 +626,210 @@ test_read_combined (void)
   g_object_unref (echo_pipe);
 }
 
+static void
+on_read_count (CockpitPipe *pipe,
+               GByteArray *buffer,
+               gboolean eof,
+               gpointer user_data)
+{
+  gint *count = user_data;
+  if (buffer->len > 0)
+    (*count)++;
+}
+
+static void
+test_read_adaptive (void)
+{
+  MockEchoPipe *echo_pipe;
+  gchar *data;
+  gint count = 0;
+  gint fds[2];
+  int out;
+
+  if (socketpair (PF_LOCAL, SOCK_STREAM, 0, fds) < 0)
+    g_assert_not_reached ();
+
+  out = dup (2);
+  g_assert (out >= 0);
+
+  echo_pipe = g_object_new (mock_echo_pipe_get_type (),
+                            "name", "test",
+                            "in-fd", fds[0],
+                            "out-fd", out,
+                            "adaptive-read", TRUE,
+                            NULL);
+  g_signal_connect (echo_pipe, "read", G_CALLBACK (on_read_count), &count);
+
+  /* Many times more than a single read-size */
+  data = g_strnfill (64 * 1024, 'x');
+  g_assert_cmpint (write (fds[1], data, 64 * 1024), ==, 64 * 1024);
+  g_free (data);
+
+  while (echo_pipe->received->len < 64 * 1024)
+    g_main_context_iteration (NULL, TRUE);
+
+  /* All that was available was delivered in one batch */
+  g_assert_cmpint (echo_pipe->received->len, ==, 64 * 1024);
+  g_assert_cmpint (count, ==, 1);
+
+  close (fds[1]);
+  g_object_unref (echo_pipe);
+}
+
+static void
+test_read_throttle (void)
+{
+  MockEchoPipe *echo_pipe;
+  gint fds[2];
+  int out;
+
+  if (socketpair (PF_LOCAL, SOCK_STREAM, 0, fds) < 0)
+    g_assert_not_reached ();
+
+  out = dup (2);
+  g_assert (out >= 0);
+
+  echo_pipe = g_object_new (mock_echo_pipe_get_type (),
+                            "name", "test",
+                            "in-fd", fds[0],
+                            "out-fd", out,
+                            NULL);
+
+  g_assert_cmpint (write (fds[1], "one", 3), ==, 3);
+  while (echo_pipe->received->len < 3)
+    g_main_context_iteration (NULL, TRUE);
+
+  /* Nothing more is read while throttled */
+  cockpit_pipe_throttle (COCKPIT_PIPE (echo_pipe), TRUE);
+  g_assert_cmpint (write (fds[1], "two", 3), ==, 3);
+  while (g_main_context_iteration (NULL, FALSE));
+  g_assert_cmpint (echo_pipe->received->len, ==, 3);
+
+  /* And the data is still there afterwards */
+  cockpit_pipe_throttle (COCKPIT_PIPE (echo_pipe), FALSE);
+  while (echo_pipe->received->len < 6)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert (memcmp (echo_pipe->received->data, "onetwo", 6) == 0);
+
+  /* Closing with a problem doesn't wait for input */
+  cockpit_pipe_throttle (COCKPIT_PIPE (echo_pipe), TRUE);
+  cockpit_pipe_close (COCKPIT_PIPE (echo_pipe), "terminated");
+  g_assert (echo_pipe->closed);
+  g_assert_cmpstr (echo_pipe->problem, ==, "terminated");
+
+  close (fds[1]);
+  g_object_unref (echo_pipe);
+}
+
+static gboolean
+on_idle_count (gpointer user_data)
+{
+  gint *count = user_data;
+  (*count)++;
+  return *count < 10;
+}
+
+static void
+test_read_priority (void)
+{
+  MockEchoPipe *echo_pipe;
+  gint count = 0;
+  gint fds[2];
+  int out;
+
+  if (socketpair (PF_LOCAL, SOCK_STREAM, 0, fds) < 0)
+    g_assert_not_reached ();
+
+  out = dup (2);
+  g_assert (out >= 0);
+
+  echo_pipe = g_object_new (mock_echo_pipe_get_type (),
+                            "name", "test",
+                            "in-fd", fds[0],
+                            "out-fd", out,
+                            NULL);
+
+  cockpit_pipe_set_priority (COCKPIT_PIPE (echo_pipe), G_PRIORITY_LOW);
+  g_assert_cmpint (write (fds[1], "one", 3), ==, 3);
+
+  /* Input waits while a source with higher priority is ready */
+  g_idle_add_full (G_PRIORITY_DEFAULT, on_idle_count, &count, NULL);
+  while (echo_pipe->received->len < 3)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_cmpint (count, ==, 10);
+
+  close (fds[1]);
+  g_object_unref (echo_pipe);
+}
+
+#ifdef __linux
+
+static gssize
+on_splice_chunk (CockpitPipe *pipe,
+                 gint fd,
+                 gpointer user_data)
+{
+  CockpitPipe *out = user_data;
+  GBytes *prefix;
+  gssize ret;
+
+  ret = cockpit_pipe_splice_from (out, fd, 4);
+  if (ret > 0)
+    {
+      prefix = g_bytes_new_static ("<", 1);
+      cockpit_pipe_write (out, prefix);
+      cockpit_pipe_write_splice (out, ret);
+      g_bytes_unref (prefix);
+    }
+  return ret;
+}
+
+static void
+test_splice (void)
+{
+  CockpitPipe *in;
+  CockpitPipe *out;
+  GString *string;
+  gchar buffer[64];
+  gint count = 0;
+  gint a[2];
+  gint b[2];
+  gssize ret;
+
+  if (socketpair (PF_LOCAL, SOCK_STREAM, 0, a) < 0 ||
+      socketpair (PF_LOCAL, SOCK_STREAM, 0, b) < 0)
+    g_assert_not_reached ();
+
+  in = g_object_new (COCKPIT_TYPE_PIPE, "name", "in", "in-fd", a[0], NULL);
+  out = g_object_new (COCKPIT_TYPE_PIPE, "name", "out", "out-fd", b[0], NULL);
+  cockpit_pipe_splice_input (in, on_splice_chunk, out);
+  g_signal_connect (in, "read", G_CALLBACK (on_read_count), &count);
+
+  g_assert_cmpint (write (a[1], "abcdefghij", 10), ==, 10);
+
+  /* Framed in chunks, in order, and never read into the buffer */
+  string = g_string_new ("");
+  while (string->len < 13)
+    {
+      ret = recv (b[1], buffer, sizeof (buffer), MSG_DONTWAIT);
+      if (ret > 0)
+        g_string_append_len (string, buffer, ret);
+      else
+        g_main_context_iteration (NULL, TRUE);
+    }
+
+  g_assert_cmpstr (string->str, ==, "<abcd<efgh<ij");
+  g_assert_cmpint (count, ==, 0);
+  g_string_free (string, TRUE);
+
+  close (a[1]);
+  close (b[1]);
+  g_object_unref (in);
+  g_object_unref (out);
+}
+
+#endif /* __linux */
+
 static void
 test_consume_entire (void)
 {
@@ -645,6 +927,34 @@ test_properties (void)
   g_object_unref (tpipe);
 }
 
+static void
+test_pipe_size (void)
+{
+  CockpitPipe *tpipe;
+  int fds[2];
+
+  if (pipe(fds) < 0)
+    g_assert_not_reached ();
+
+#ifdef F_GETPIPE_SZ
+  g_assert_cmpint (fcntl (fds[0], F_GETPIPE_SZ), <, 256 * 1024);
+#endif
+
+  tpipe = g_object_new (mock_echo_pipe_get_type (),
+                       "name", "testo",
+                       "in-fd", fds[0],
+                       "out-fd", fds[1],
+                       "pipe-size", 256 * 1024,
+                       NULL);
+
+#ifdef F_GETPIPE_SZ
+  /* Both ends are the same pipe, the kernel may grant more */
+  g_assert_cmpint (fcntl (fds[0], F_GETPIPE_SZ), >=, 256 * 1024);
+#endif
+
+  g_object_unref (tpipe);
+}
+
 static void
 on_close_get_flag (CockpitPipe *pipe,
                    const gchar *problem,
@@ -693,6 +1003,41 @@ test_spawn_and_read (void)
   g_object_unref (pipe);
 }
 
+static void
+test_spawn_close_fds (void)
+{
+  gboolean closed = FALSE;
+  GByteArray *buffer;
+  CockpitPipe *pipe;
+  gchar *command;
+  int fds[2];
+
+  const gchar *argv[] = { "/bin/sh", "-c", NULL, NULL };
+
+  /* Not marked close on exec */
+  if (!g_unix_open_pipe (fds, 0, NULL))
+    g_assert_not_reached ();
+
+  command = g_strdup_printf ("if { true >&%d; } 2>/dev/null; then echo leaked; else echo closed; fi", fds[1]);
+  argv[2] = command;
+
+  pipe = cockpit_pipe_spawn (argv, NULL, NULL, COCKPIT_PIPE_FLAGS_NONE);
+  g_assert (pipe != NULL);
+  g_signal_connect (pipe, "close", G_CALLBACK (on_close_get_flag), &closed);
+
+  while (closed == FALSE)
+    g_main_context_iteration (NULL, TRUE);
+
+  buffer = cockpit_pipe_get_buffer (pipe);
+  g_byte_array_append (buffer, (const guint8 *)"\0", 1);
+  g_assert_cmpstr ((gchar *)buffer->data, ==, "closed\n");
+
+  g_object_unref (pipe);
+  g_free (command);
+  close (fds[0]);
+  close (fds[1]);
+}
+
 static void
 test_spawn_and_write (void)
 {
@@ -740,6 +1085,135 @@ test_spawn_and_fail (void)
   g_object_unref (pipe);
 }
 
+static void
+test_spawn_directory (gconstpointer data)
+{
+  gboolean closed = FALSE;
+  GByteArray *buffer;
+  CockpitPipe *pipe;
+
+  const gchar *argv[] = { "pwd", NULL };
+  const gchar *env[] = { "PATH=/bin:/usr/bin", NULL, };
+
+  /* Both the fast path and the glib one */
+  cockpit_pipe_fast_spawn = GPOINTER_TO_INT (data);
+
+  pipe = cockpit_pipe_spawn (argv, env, "/", COCKPIT_PIPE_STDERR_TO_STDOUT);
+  g_assert (pipe != NULL);
+  g_signal_connect (pipe, "close", G_CALLBACK (on_close_get_flag), &closed);
+
+  while (closed == FALSE)
+    g_main_context_iteration (NULL, TRUE);
+
+  buffer = cockpit_pipe_get_buffer (pipe);
+  g_byte_array_append (buffer, (const guint8 *)"\0", 1);
+  g_assert_cmpstr ((gchar *)buffer->data, ==, "/\n");
+
+  g_object_unref (pipe);
+  cockpit_pipe_fast_spawn = TRUE;
+}
+
+static void
+test_spawn_sigpipe (gconstpointer data)
+{
+  gboolean closed = FALSE;
+  GByteArray *buffer;
+  CockpitPipe *pipe;
+  gchar **lines;
+  guint64 ignored = 0;
+  gint i;
+
+  const gchar *argv[] = { "grep", "^SigIgn:", "/proc/self/status", NULL };
+
+  cockpit_pipe_fast_spawn = GPOINTER_TO_INT (data);
+  signal (SIGPIPE, SIG_IGN);
+
+  pipe = cockpit_pipe_spawn (argv, NULL, NULL, COCKPIT_PIPE_FLAGS_NONE);
+  g_assert (pipe != NULL);
+  g_signal_connect (pipe, "close", G_CALLBACK (on_close_get_flag), &closed);
+
+  while (closed == FALSE)
+    g_main_context_iteration (NULL, TRUE);
+
+  buffer = cockpit_pipe_get_buffer (pipe);
+  g_byte_array_append (buffer, (const guint8 *)"\0", 1);
+  lines = g_strsplit ((gchar *)buffer->data, "\t", -1);
+  for (i = 0; lines[i] != NULL; i++)
+    ignored = g_ascii_strtoull (lines[i], NULL, 16);
+  g_strfreev (lines);
+
+  g_assert ((ignored & (1ULL << (SIGPIPE - 1))) == 0);
+
+  g_object_unref (pipe);
+  signal (SIGPIPE, SIG_DFL);
+  cockpit_pipe_fast_spawn = TRUE;
+}
+
+static void
+test_spawn_script (gconstpointer data)
+{
+  gboolean closed = FALSE;
+  GByteArray *buffer;
+  CockpitPipe *pipe;
+  GError *error = NULL;
+  gchar *directory;
+  gchar *script;
+
+  const gchar *argv[] = { NULL, "one", "two", NULL };
+
+  cockpit_pipe_fast_spawn = GPOINTER_TO_INT (data);
+
+  directory = g_dir_make_tmp ("test-pipe.XXXXXX", &error);
+  g_assert_no_error (error);
+
+  /* No #! line, so execve() can't run it */
+  script = g_build_filename (directory, "script", NULL);
+  g_file_set_contents (script, "echo \"$@\"\n", -1, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (chmod (script, 0755), ==, 0);
+  argv[0] = script;
+
+  pipe = cockpit_pipe_spawn (argv, NULL, NULL, COCKPIT_PIPE_FLAGS_NONE);
+  g_assert (pipe != NULL);
+  g_signal_connect (pipe, "close", G_CALLBACK (on_close_get_flag), &closed);
+
+  while (closed == FALSE)
+    g_main_context_iteration (NULL, TRUE);
+
+  buffer = cockpit_pipe_get_buffer (pipe);
+  g_byte_array_append (buffer, (const guint8 *)"\0", 1);
+  g_assert_cmpstr ((gchar *)buffer->data, ==, "one two\n");
+
+  g_object_unref (pipe);
+  g_unlink (script);
+  g_rmdir (directory);
+  g_free (script);
+  g_free (directory);
+  cockpit_pipe_fast_spawn = TRUE;
+}
+
+static void
+test_spawn_bad_directory (void)
+{
+  gchar *problem = NULL;
+  CockpitPipe *pipe;
+
+  const gchar *argv[] = { "/bin/true", NULL };
+
+  cockpit_expect_message ("*couldn't run /bin/true*");
+
+  pipe = cockpit_pipe_spawn (argv, NULL, "/non-existant", COCKPIT_PIPE_FLAGS_NONE);
+  g_assert (pipe != NULL);
+  g_signal_connect (pipe, "close", G_CALLBACK (on_close_get_problem), &problem);
+
+  while (problem == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_cmpstr (problem, ==, "internal-error");
+  g_free (problem);
+  g_object_unref (pipe);
+}
+
 static void
 test_spawn_close_terminate (TestCase *tc,
                             gconstpointer unused)
@@ -823,6 +1297,36 @@ test_spawn_and_buffer_stderr (void)
   g_object_unref (pipe);
 }
 
+static void
+test_spawn_and_limit_stderr (void)
+{
+  gboolean closed = FALSE;
+  GByteArray *buffer;
+  CockpitPipe *pipe;
+  gsize previous;
+
+  const gchar *argv[] = { "/bin/sh", "-c", "printf 0123456789 >&2; printf abcdefghijklmnopqrstuvwxyz >&2", NULL };
+
+  previous = cockpit_pipe_stderr_maximum;
+  cockpit_pipe_stderr_maximum = 16;
+
+  pipe = cockpit_pipe_spawn (argv, NULL, NULL, COCKPIT_PIPE_STDERR_TO_MEMORY);
+  g_assert (pipe != NULL);
+  g_signal_connect (pipe, "close", G_CALLBACK (on_close_get_flag), &closed);
+
+  while (closed == FALSE)
+    g_main_context_iteration (NULL, TRUE);
+
+  buffer = cockpit_pipe_get_stderr (pipe);
+  g_assert (buffer != NULL);
+
+  g_byte_array_append (buffer, (const guint8 *)"\0", 1);
+  g_assert_cmpstr ((gchar *)buffer->data, ==, "01234567\n... 20 bytes dropped ...\nstuvwxyz");
+
+  g_object_unref (pipe);
+  cockpit_pipe_stderr_maximum = previous;
+}
+
 static void
 test_pty_shell (void)
 {
@@ -1128,6 +1632,7 @@ main (int argc,
   g_test_add_func ("/pipe/buffer/skip", test_buffer_skip);
 
   g_test_add_func ("/pipe/properties", test_properties);
+  g_test_add_func ("/pipe/pipe-size", test_pipe_size);
 
   /*
    * Fixture data is the GType name of the pipe class
@@ -1140,6 +1645,10 @@ main (int argc,
               setup_simple, test_echo_and_close, teardown);
   g_test_add ("/pipe/echo-queue", TestCase, NULL,
               setup_simple, test_echo_queue, teardown);
+  g_test_add ("/pipe/echo-corked", TestCase, NULL,
+              setup_simple, test_echo_corked, teardown);
+  g_test_add ("/pipe/echo-urgent", TestCase, NULL,
+              setup_simple, test_echo_urgent, teardown);
   g_test_add ("/pipe/echo-large", TestCase, &fixture_no_timeout,
               setup_simple, test_echo_large, teardown);
   g_test_add ("/pipe/close-problem", TestCase, NULL,
@@ -1161,11 +1670,26 @@ main (int argc,
   g_test_add_func ("/pipe/read-error", test_read_error);
   g_test_add_func ("/pipe/write-error", test_write_error);
   g_test_add_func ("/pipe/read-combined", test_read_combined);
+  g_test_add_func ("/pipe/read-adaptive", test_read_adaptive);
+  g_test_add_func ("/pipe/read-throttle", test_read_throttle);
+  g_test_add_func ("/pipe/read-priority", test_read_priority);
+#ifdef __linux
+  g_test_add_func ("/pipe/splice", test_splice);
+#endif
 
   g_test_add_func ("/pipe/spawn/and-read", test_spawn_and_read);
   g_test_add_func ("/pipe/spawn/and-write", test_spawn_and_write);
   g_test_add_func ("/pipe/spawn/and-fail", test_spawn_and_fail);
+  g_test_add_func ("/pipe/spawn/close-fds", test_spawn_close_fds);
   g_test_add_func ("/pipe/spawn/buffer-stderr", test_spawn_and_buffer_stderr);
+  g_test_add_func ("/pipe/spawn/limit-stderr", test_spawn_and_limit_stderr);
+  g_test_add_data_func ("/pipe/spawn/directory", GINT_TO_POINTER (TRUE), test_spawn_directory);
+  g_test_add_data_func ("/pipe/spawn/directory-fork", GINT_TO_POINTER (FALSE), test_spawn_directory);
+  g_test_add_func ("/pipe/spawn/bad-directory", test_spawn_bad_directory);
+  g_test_add_data_func ("/pipe/spawn/sigpipe", GINT_TO_POINTER (TRUE), test_spawn_sigpipe);
+  g_test_add_data_func ("/pipe/spawn/sigpipe-fork", GINT_TO_POINTER (FALSE), test_spawn_sigpipe);
+  g_test_add_data_func ("/pipe/spawn/script", GINT_TO_POINTER (TRUE), test_spawn_script);
+  g_test_add_data_func ("/pipe/spawn/script-fork", GINT_TO_POINTER (FALSE), test_spawn_script);
 
   g_test_add ("/pipe/spawn/close-clean", TestCase, NULL,
               setup_timeout, test_spawn_close_clean, teardown);
@@ -0,0 +1,219 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2016 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitmemory.h"
+#include "cockpitstats.h"
+
+#include "cockpittest.h"
+
+#include <glib.h>
+#include <string.h>
+
+typedef struct {
+  const gchar *instance;
+  gboolean found;
+  gssize values[COCKPIT_N_STATS];
+} Snapshot;
+
+static void
+on_stats (const gchar *instance,
+          const gssize *values,
+          gpointer user_data)
+{
+  Snapshot *snap = user_data;
+
+  if (g_strcmp0 (instance, snap->instance) == 0)
+    {
+      g_assert (!snap->found);
+      snap->found = TRUE;
+      memcpy (snap->values, values, sizeof (snap->values));
+    }
+}
+
+static void
+take_snapshot (Snapshot *snap,
+               const gchar *instance)
+{
+  memset (snap, 0, sizeof (Snapshot));
+  snap->instance = instance;
+  cockpit_stats_foreach (on_stats, snap);
+  g_assert (snap->found);
+}
+
+static void
+test_lookup (void)
+{
+  CockpitStats *one;
+
+  one = cockpit_stats_lookup ("test-lookup");
+  g_assert (one != NULL);
+  g_assert (cockpit_stats_lookup ("test-lookup") == one);
+  g_assert (cockpit_stats_lookup ("test-other") != one);
+  g_assert (cockpit_stats_lookup (NULL) != one);
+}
+
+static void
+test_limit (void)
+{
+  CockpitStats *other;
+  gchar *name;
+  guint i;
+
+  /* Past the limit, new instances are all the same one */
+  for (i = 0; i < 100; i++)
+    {
+      name = g_strdup_printf ("test-limit-%u", i);
+      cockpit_stats_lookup (name);
+      g_free (name);
+    }
+
+  other = cockpit_stats_lookup ("test-limit-more");
+  g_assert (other == cockpit_stats_lookup ("other"));
+  g_assert (other == cockpit_stats_lookup ("test-limit-yet-more"));
+  g_assert (cockpit_stats_lookup ("test-limit-0") != other);
+}
+
+static void
+test_add (void)
+{
+  CockpitStats *stats;
+  Snapshot before;
+  Snapshot after;
+
+  stats = cockpit_stats_lookup ("test-add");
+  cockpit_stats_add (stats, COCKPIT_STAT_CHANNEL_OPEN, 3);
+  cockpit_stats_add (stats, COCKPIT_STAT_CHANNEL_OPEN, -1);
+  cockpit_stats_add (stats, COCKPIT_STAT_CHANNEL_BYTES, 1024);
+
+  take_snapshot (&after, "test-add");
+  g_assert_cmpint (after.values[COCKPIT_STAT_CHANNEL_OPEN], ==, 2);
+  g_assert_cmpint (after.values[COCKPIT_STAT_CHANNEL_BYTES], ==, 1024);
+  g_assert_cmpint (after.values[COCKPIT_STAT_CHANNEL_MESSAGES], ==, 0);
+
+  /* NULL means the global ones */
+  take_snapshot (&before, NULL);
+  cockpit_stats_add (NULL, COCKPIT_STAT_DBUS_CALLS, 5);
+  take_snapshot (&after, NULL);
+  g_assert_cmpint (after.values[COCKPIT_STAT_DBUS_CALLS] - before.values[COCKPIT_STAT_DBUS_CALLS], ==, 5);
+}
+
+static void
+test_group (void)
+{
+  CockpitStats *stats;
+  Snapshot snap;
+
+  /* Groups don't share instances with payload types */
+  stats = cockpit_stats_lookup_group ("test-group");
+  g_assert (stats != NULL);
+  g_assert (cockpit_stats_lookup_group ("test-group") == stats);
+  g_assert (cockpit_stats_lookup ("test-group") != stats);
+
+  cockpit_stats_add (stats, COCKPIT_STAT_GROUP_CHANNELS, 2);
+  cockpit_stats_add (stats, COCKPIT_STAT_GROUP_BYTES_IN, 10);
+  cockpit_stats_add (stats, COCKPIT_STAT_GROUP_BYTES_OUT, 20);
+
+  memset (&snap, 0, sizeof (Snapshot));
+  snap.instance = "test-group";
+  cockpit_stats_foreach_group (on_stats, &snap);
+  g_assert (snap.found);
+  g_assert_cmpint (snap.values[COCKPIT_STAT_GROUP_CHANNELS], ==, 2);
+  g_assert_cmpint (snap.values[COCKPIT_STAT_GROUP_BYTES_IN], ==, 10);
+  g_assert_cmpint (snap.values[COCKPIT_STAT_GROUP_BYTES_OUT], ==, 20);
+  g_assert_cmpint (snap.values[COCKPIT_STAT_GROUP_QUEUED], ==, 0);
+
+  /* And the payload type of the same name is untouched */
+  take_snapshot (&snap, "test-group");
+  g_assert_cmpint (snap.values[COCKPIT_STAT_GROUP_CHANNELS], ==, 0);
+}
+
+static void
+test_time (void)
+{
+  CockpitStats *stats;
+  Snapshot snap;
+
+  stats = cockpit_stats_lookup ("test-time");
+  cockpit_stats_time (stats, COCKPIT_STAT_DBUS_LATENCY, 0);
+  cockpit_stats_time (stats, COCKPIT_STAT_DBUS_LATENCY, 999);
+  cockpit_stats_time (stats, COCKPIT_STAT_DBUS_LATENCY, 1000);
+  cockpit_stats_time (stats, COCKPIT_STAT_DBUS_LATENCY, 150 * 1000);
+  cockpit_stats_time (stats, COCKPIT_STAT_DBUS_LATENCY, G_USEC_PER_SEC * 60);
+
+  take_snapshot (&snap, "test-time");
+  g_assert_cmpint (snap.values[COCKPIT_STAT_DBUS_LATENCY + 0], ==, 2);
+  g_assert_cmpint (snap.values[COCKPIT_STAT_DBUS_LATENCY + 1], ==, 1);
+  g_assert_cmpint (snap.values[COCKPIT_STAT_DBUS_LATENCY + 2], ==, 0);
+  g_assert_cmpint (snap.values[COCKPIT_STAT_DBUS_LATENCY + 3], ==, 1);
+  g_assert_cmpint (snap.values[COCKPIT_STAT_DBUS_LATENCY + 4], ==, 1);
+  g_assert_cmpint (snap.values[COCKPIT_STAT_DBUS_LATENCY + COCKPIT_STATS_BUCKETS], ==,
+                   999 + 1000 + 150 * 1000 + G_USEC_PER_SEC * 60);
+}
+
+static gsize
+report_memory (gpointer user_data)
+{
+  return GPOINTER_TO_SIZE (user_data);
+}
+
+static void
+test_memory (void)
+{
+  Snapshot snap;
+
+  g_assert_cmpint (cockpit_memory_rss (), >, 0);
+
+  cockpit_memory_add_reporter (COCKPIT_STAT_MEMORY_DBUS_CACHE, report_memory, GSIZE_TO_POINTER (100));
+  cockpit_memory_add_reporter (COCKPIT_STAT_MEMORY_DBUS_CACHE, report_memory, GSIZE_TO_POINTER (20));
+  cockpit_memory_add_reporter (COCKPIT_STAT_MEMORY_PACKAGES, report_memory, GSIZE_TO_POINTER (3));
+  cockpit_memory_trim ();
+
+  take_snapshot (&snap, NULL);
+  g_assert_cmpint (snap.values[COCKPIT_STAT_MEMORY_DBUS_CACHE], ==, 120);
+  g_assert_cmpint (snap.values[COCKPIT_STAT_MEMORY_PACKAGES], ==, 3);
+
+  cockpit_memory_remove_reporter (report_memory, GSIZE_TO_POINTER (100));
+  cockpit_memory_remove_reporter (report_memory, GSIZE_TO_POINTER (3));
+  cockpit_memory_trim ();
+
+  take_snapshot (&snap, NULL);
+  g_assert_cmpint (snap.values[COCKPIT_STAT_MEMORY_DBUS_CACHE], ==, 20);
+  g_assert_cmpint (snap.values[COCKPIT_STAT_MEMORY_PACKAGES], ==, 0);
+  g_assert_cmpint (snap.values[COCKPIT_STAT_MEMORY_TRIMMED], >=, 0);
+
+  cockpit_memory_remove_reporter (report_memory, GSIZE_TO_POINTER (20));
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  cockpit_test_init (&argc, &argv);
+
+  g_test_add_func ("/stats/lookup", test_lookup);
+  g_test_add_func ("/stats/add", test_add);
+  g_test_add_func ("/stats/time", test_time);
+  g_test_add_func ("/stats/group", test_group);
+  g_test_add_func ("/stats/limit", test_limit);
+  g_test_add_func ("/stats/memory", test_memory);
+
+  return g_test_run ();
+}
@@ -0,0 +1,188 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2016 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpittimerwheel.h"
+
+#include "cockpittest.h"
+
+#include <glib.h>
+
+static gboolean
+on_timer_count (gpointer user_data)
+{
+  gint *count = user_data;
+  (*count)++;
+  return FALSE;
+}
+
+static gboolean
+on_timer_repeat (gpointer user_data)
+{
+  gint *count = user_data;
+  (*count)++;
+  return *count < 3;
+}
+
+static guint self_tag;
+
+static gboolean
+on_timer_remove_self (gpointer user_data)
+{
+  gint *count = user_data;
+  (*count)++;
+  g_assert (cockpit_timer_wheel_remove (self_tag));
+  return TRUE;
+}
+
+static void
+advance (gint64 seconds)
+{
+  cockpit_timer_wheel_offset += seconds;
+  while (g_main_context_iteration (NULL, FALSE));
+}
+
+static void
+test_fire (void)
+{
+  gint soon = 0;
+  gint later = 0;
+  gint hours = 0;
+  gint days = 0;
+  gint removed = 0;
+  guint tag;
+
+  cockpit_timer_wheel_add_seconds (NULL, 5, on_timer_count, &soon);
+  cockpit_timer_wheel_add_seconds (NULL, 100, on_timer_count, &later);
+  cockpit_timer_wheel_add_seconds (NULL, 5000, on_timer_count, &hours);
+  cockpit_timer_wheel_add_seconds (NULL, 400000, on_timer_count, &days);
+  tag = cockpit_timer_wheel_add_seconds (NULL, 5, on_timer_count, &removed);
+  g_assert_cmpuint (tag, !=, 0);
+
+  g_assert (cockpit_timer_wheel_remove (tag));
+  g_assert (!cockpit_timer_wheel_remove (tag));
+
+  advance (3);
+  g_assert_cmpint (soon, ==, 0);
+
+  advance (3);
+  g_assert_cmpint (soon, ==, 1);
+  g_assert_cmpint (later, ==, 0);
+
+  advance (100);
+  g_assert_cmpint (later, ==, 1);
+  g_assert_cmpint (hours, ==, 0);
+
+  advance (5000);
+  g_assert_cmpint (hours, ==, 1);
+  g_assert_cmpint (days, ==, 0);
+
+  advance (300000);
+  g_assert_cmpint (days, ==, 0);
+
+  advance (100000);
+  g_assert_cmpint (days, ==, 1);
+
+  g_assert_cmpint (soon, ==, 1);
+  g_assert_cmpint (removed, ==, 0);
+}
+
+static void
+test_repeat (void)
+{
+  gint count = 0;
+
+  cockpit_timer_wheel_add_seconds (NULL, 10, on_timer_repeat, &count);
+
+  advance (11);
+  g_assert_cmpint (count, ==, 1);
+  advance (11);
+  g_assert_cmpint (count, ==, 2);
+  advance (11);
+  g_assert_cmpint (count, ==, 3);
+
+  /* Returned FALSE the third time */
+  advance (11);
+  g_assert_cmpint (count, ==, 3);
+}
+
+static void
+test_remove_self (void)
+{
+  gint count = 0;
+
+  self_tag = cockpit_timer_wheel_add_seconds (NULL, 1, on_timer_remove_self, &count);
+
+  advance (2);
+  g_assert_cmpint (count, ==, 1);
+  advance (2);
+  g_assert_cmpint (count, ==, 1);
+  g_assert (!cockpit_timer_wheel_remove (self_tag));
+}
+
+static void
+test_real_time (void)
+{
+  gint count = 0;
+
+  /* Without moving the clock, this needs the wheel to wake up by itself */
+  cockpit_timer_wheel_add_seconds (NULL, 0, on_timer_count, &count);
+  while (count == 0)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_cmpint (count, ==, 1);
+}
+
+static void
+test_context (void)
+{
+  GMainContext *context;
+  gint count = 0;
+
+  context = g_main_context_new ();
+  cockpit_timer_wheel_add_seconds (context, 1, on_timer_count, &count);
+
+  /* The default context doesn't run it */
+  advance (2);
+  g_assert_cmpint (count, ==, 0);
+
+  while (g_main_context_iteration (context, FALSE));
+  g_assert_cmpint (count, ==, 1);
+
+  /* Timers still waiting go away with their context */
+  cockpit_timer_wheel_add_seconds (context, 1, on_timer_count, &count);
+  g_main_context_unref (context);
+  advance (2);
+  g_assert_cmpint (count, ==, 1);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  cockpit_test_init (&argc, &argv);
+
+  g_test_add_func ("/timer-wheel/fire", test_fire);
+  g_test_add_func ("/timer-wheel/repeat", test_repeat);
+  g_test_add_func ("/timer-wheel/remove-self", test_remove_self);
+  g_test_add_func ("/timer-wheel/real-time", test_real_time);
+  g_test_add_func ("/timer-wheel/context", test_context);
+
+  return g_test_run ();
+}
@@ -0,0 +1,120 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2016 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpittrace.h"
+
+#include "cockpittest.h"
+
+#include <glib.h>
+
+static const gchar *
+event_point (JsonArray *events,
+             guint index)
+{
+  return json_array_get_string_element (json_array_get_array_element (events, index), 0);
+}
+
+static gint64
+event_when (JsonArray *events,
+            guint index)
+{
+  return json_array_get_int_element (json_array_get_array_element (events, index), 1);
+}
+
+static void
+test_mark (void)
+{
+  CockpitTrace *trace;
+  JsonArray *events;
+
+  trace = cockpit_trace_new ();
+  cockpit_trace_mark (trace, "first");
+  cockpit_trace_mark (trace, "second");
+
+  events = json_array_new ();
+  g_assert_cmpuint (cockpit_trace_take (trace, events), ==, 2);
+  g_assert_cmpuint (json_array_get_length (events), ==, 2);
+  g_assert_cmpstr (event_point (events, 0), ==, "first");
+  g_assert_cmpstr (event_point (events, 1), ==, "second");
+  g_assert_cmpint (event_when (events, 0), <=, event_when (events, 1));
+  g_assert_cmpint (event_when (events, 1), <=, g_get_monotonic_time ());
+
+  /* Taking the events clears them */
+  g_assert_cmpuint (cockpit_trace_take (trace, events), ==, 0);
+  g_assert_cmpuint (json_array_get_length (events), ==, 2);
+
+  json_array_unref (events);
+  cockpit_trace_unref (trace);
+}
+
+static void
+test_overflow (void)
+{
+  CockpitTrace *trace;
+  JsonArray *events;
+  guint i;
+
+  trace = cockpit_trace_new ();
+  cockpit_trace_mark (trace, "dropped");
+  for (i = 0; i < COCKPIT_TRACE_SIZE - 1; i++)
+    cockpit_trace_mark (trace, "kept");
+  cockpit_trace_mark (trace, "last");
+
+  events = json_array_new ();
+  g_assert_cmpuint (cockpit_trace_take (trace, events), ==, COCKPIT_TRACE_SIZE);
+  g_assert_cmpstr (event_point (events, 0), ==, "kept");
+  g_assert_cmpstr (event_point (events, COCKPIT_TRACE_SIZE - 1), ==, "last");
+  json_array_unref (events);
+
+  /* And it starts again from the beginning */
+  cockpit_trace_mark (trace, "again");
+  events = json_array_new ();
+  g_assert_cmpuint (cockpit_trace_take (trace, events), ==, 1);
+  g_assert_cmpstr (event_point (events, 0), ==, "again");
+  json_array_unref (events);
+
+  cockpit_trace_unref (trace);
+}
+
+static void
+test_ref (void)
+{
+  CockpitTrace *trace;
+
+  trace = cockpit_trace_new ();
+  g_assert (cockpit_trace_ref (trace) == trace);
+  cockpit_trace_unref (trace);
+  cockpit_trace_mark (trace, "still-alive");
+  cockpit_trace_unref (trace);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  cockpit_test_init (&argc, &argv);
+
+  g_test_add_func ("/trace/mark", test_mark);
+  g_test_add_func ("/trace/overflow", test_overflow);
+  g_test_add_func ("/trace/ref", test_ref);
+
+  return g_test_run ();
+}
@@ -28,7 +28,9 @@
 #include "websocket/websocket.h"
 
 #include <glib.h>
+#include <glib-unix.h>
 
+#include <errno.h>
 #include <string.h>
 
 #include <sys/types.h>
@@ -213,6 +215,37 @@ test_echo_queue (TestCase *tc,
   WAIT_UNTIL (state == 2 && closed == TRUE);
 }
 
+static void
+test_echo_binary (TestCase *tc,
+                  gconstpointer data)
+{
+  JsonObject *init;
+  GBytes *received = NULL;
+  GBytes *sent;
+
+  init = cockpit_transport_build_json ("command", "init", "framing", "binary", NULL);
+  cockpit_pipe_transport_negotiate (tc->transport, init);
+  json_object_unref (init);
+
+  g_signal_connect (tc->transport, "recv", G_CALLBACK (on_recv_get_payload), &received);
+
+  sent = g_bytes_new_static ("the message", 11);
+  cockpit_transport_send (tc->transport, "546", sent);
+  WAIT_UNTIL (received != NULL);
+  g_assert (g_bytes_equal (received, sent));
+  g_bytes_unref (sent);
+  g_bytes_unref (received);
+  received = NULL;
+
+  sent = g_bytes_new_take (g_strnfill (100 * 1000, '?'), 100 * 1000);
+  cockpit_transport_send (tc->transport, "546", sent);
+  WAIT_UNTIL (received != NULL);
+  g_assert (g_bytes_equal (received, sent));
+  g_bytes_unref (sent);
+  g_bytes_unref (received);
+  received = NULL;
+}
+
 static void
 test_echo_large (TestCase *tc,
                  gconstpointer data)
@@ -402,6 +435,339 @@ test_read_combined (void)
   g_object_unref (transport);
 }
 
+static void
+test_read_binary (void)
+{
+  CockpitTransport *transport;
+  struct iovec iov[4];
+  gint state = 0;
+  gint fds[2];
+  gint out;
+
+  if (pipe(fds) < 0)
+    g_assert_not_reached ();
+
+  out = dup (2);
+  g_assert (out >= 0);
+
+  /* Pass in a read end of the pipe */
+  transport = cockpit_pipe_transport_new_fds ("test", fds[0], out);
+  g_signal_connect (transport, "recv", G_CALLBACK (on_recv_multiple), &state);
+
+  /* A binary frame followed by a normal one */
+  iov[0].iov_base = "\x80\x00\x00\x04\x01";
+  iov[0].iov_len = 5;
+  iov[1].iov_base = "9one";
+  iov[1].iov_len = 4;
+  iov[2].iov_base = "5\n";
+  iov[2].iov_len = 2;
+  iov[3].iov_base = "9\ntwo";
+  iov[3].iov_len = 5;
+  g_assert_cmpint (writev (fds[1], iov, 4), ==, 16);
+
+  WAIT_UNTIL (state == 2);
+
+  close (fds[1]);
+  g_object_unref (transport);
+}
+
+typedef struct {
+  CockpitTransport *other;
+  GBytes *other_payload;
+  gint state;
+} PassThrough;
+
+static gboolean
+on_recv_pass_through (CockpitTransport *transport,
+                      const gchar *channel,
+                      GBytes *message,
+                      gpointer user_data)
+{
+  PassThrough *pt = user_data;
+  gboolean binary = FALSE;
+  GBytes *frame;
+
+  /* Only for what it received */
+  g_assert (cockpit_pipe_transport_peek_frame (transport, pt->other_payload, &binary) == NULL);
+
+  frame = cockpit_pipe_transport_peek_frame (transport, message, &binary);
+  g_assert (frame != NULL);
+
+  if (pt->state == 0)
+    {
+      /* The other side didn't say it understands binary frames */
+      g_assert (binary == TRUE);
+      cockpit_assert_bytes_eq (frame, "\x80\x00\x00\x04\x01" "9one", 9);
+      g_assert (!cockpit_pipe_transport_send_frame (pt->other, frame, binary));
+    }
+  else
+    {
+      g_assert (binary == FALSE);
+      cockpit_assert_bytes_eq (frame, "5\n9\ntwo", 7);
+      g_assert (cockpit_pipe_transport_send_frame (pt->other, frame, binary));
+    }
+
+  g_bytes_unref (frame);
+  pt->state++;
+  return TRUE;
+}
+
+static void
+test_pass_through (void)
+{
+  CockpitTransport *transport;
+  PassThrough pt = { NULL, NULL, 0 };
+  struct iovec iov[4];
+  gchar buffer[16];
+  gssize len = 0;
+  gssize ret;
+  gint fds[2];
+  gint other[2];
+  gint idle[2];
+  gint out;
+
+  if (pipe (fds) < 0 || pipe (other) < 0 || pipe (idle) < 0)
+    g_assert_not_reached ();
+
+  out = dup (2);
+  g_assert (out >= 0);
+
+  transport = cockpit_pipe_transport_new_fds ("test", fds[0], out);
+  pt.other = cockpit_pipe_transport_new_fds ("other", idle[0], other[1]);
+  g_signal_connect (transport, "recv", G_CALLBACK (on_recv_pass_through), &pt);
+
+  /* Nothing being received right now */
+  pt.other_payload = g_bytes_new_static ("one", 3);
+  g_assert (cockpit_pipe_transport_peek_frame (transport, pt.other_payload, NULL) == NULL);
+
+  iov[0].iov_base = "\x80\x00\x00\x04\x01";
+  iov[0].iov_len = 5;
+  iov[1].iov_base = "9one";
+  iov[1].iov_len = 4;
+  iov[2].iov_base = "5\n";
+  iov[2].iov_len = 2;
+  iov[3].iov_base = "9\ntwo";
+  iov[3].iov_len = 5;
+  g_assert_cmpint (writev (fds[1], iov, 4), ==, 16);
+
+  WAIT_UNTIL (pt.state == 2);
+
+  g_unix_set_fd_nonblocking (other[0], TRUE, NULL);
+  while (len < 7)
+    {
+      g_main_context_iteration (NULL, FALSE);
+      ret = read (other[0], buffer + len, sizeof (buffer) - len);
+      if (ret < 0)
+        g_assert_cmpint (errno, ==, EAGAIN);
+      else
+        len += ret;
+    }
+
+  cockpit_assert_data_eq (buffer, len, "5\n9\ntwo", 7);
+
+  close (fds[1]);
+  close (other[0]);
+  close (idle[1]);
+  g_bytes_unref (pt.other_payload);
+  g_object_unref (pt.other);
+  g_object_unref (transport);
+}
+
+typedef struct {
+  gint recv;
+  gint control;
+} RouteCount;
+
+static gboolean
+on_route_recv (CockpitTransport *transport,
+               const gchar *channel,
+               GBytes *payload,
+               gpointer user_data)
+{
+  RouteCount *count = user_data;
+  count->recv++;
+  return TRUE;
+}
+
+static gboolean
+on_route_control (CockpitTransport *transport,
+                  const char *command,
+                  const gchar *channel,
+                  JsonObject *options,
+                  GBytes *payload,
+                  gpointer user_data)
+{
+  RouteCount *count = user_data;
+  g_assert_cmpstr (command, ==, "done");
+  count->control++;
+  return TRUE;
+}
+
+static void
+test_route (void)
+{
+  CockpitTransport *transport;
+  RouteCount one = { 0, 0 };
+  RouteCount two = { 0, 0 };
+  GBytes *control;
+  GBytes *payload;
+  gint fds[2];
+  gint out;
+
+  if (pipe(fds) < 0)
+    g_assert_not_reached ();
+
+  out = dup (2);
+  g_assert (out >= 0);
+
+  transport = cockpit_pipe_transport_new_fds ("test", fds[0], out);
+
+  g_assert (cockpit_transport_route (transport, "one", on_route_recv, on_route_control, &one));
+  g_assert (cockpit_transport_route (transport, "two", on_route_recv, on_route_control, &two));
+
+  /* Someone else can't take over a channel */
+  g_assert (!cockpit_transport_route (transport, "one", on_route_recv, NULL, &two));
+
+  payload = g_bytes_new_static ("payload", 7);
+  cockpit_transport_emit_recv (transport, "one", payload);
+  cockpit_transport_emit_recv (transport, "two", payload);
+  cockpit_transport_emit_recv (transport, "two", payload);
+  cockpit_transport_emit_recv (transport, "three", payload);
+
+  control = cockpit_transport_build_control ("command", "done", "channel", "two", NULL);
+  cockpit_transport_emit_recv (transport, NULL, control);
+  g_bytes_unref (control);
+
+  g_assert_cmpint (one.recv, ==, 1);
+  g_assert_cmpint (one.control, ==, 0);
+  g_assert_cmpint (two.recv, ==, 2);
+  g_assert_cmpint (two.control, ==, 1);
+
+  /* Only the owner can remove a route */
+  cockpit_transport_unroute (transport, "one", &two);
+  cockpit_transport_emit_recv (transport, "one", payload);
+  g_assert_cmpint (one.recv, ==, 2);
+
+  cockpit_transport_unroute (transport, "one", &one);
+  cockpit_transport_emit_recv (transport, "one", payload);
+  g_assert_cmpint (one.recv, ==, 2);
+
+  g_bytes_unref (payload);
+  close (fds[1]);
+  g_object_unref (transport);
+}
+
+static gboolean
+on_control_push_command (CockpitTransport *transport,
+                         const gchar *command,
+                         const gchar *channel,
+                         JsonObject *options,
+                         GBytes *payload,
+                         gpointer user_data)
+{
+  GPtrArray *commands = user_data;
+  g_ptr_array_add (commands, g_strdup (command));
+  return TRUE;
+}
+
+static void
+send_filler (CockpitTransport *transport,
+             const gchar *channel,
+             gsize length)
+{
+  GBytes *payload;
+
+  payload = g_bytes_new_take (g_strnfill (length, 'x'), length);
+  cockpit_transport_send (transport, channel, payload);
+  g_bytes_unref (payload);
+}
+
+static void
+test_control_in_order (void)
+{
+  CockpitTransport *transport;
+  CockpitTransport *reader;
+  GPtrArray *commands;
+  GBytes *control;
+  gint fds[2];
+  gint idle[2];
+  gint out;
+
+  /* Nothing reads the pipe yet, so the writes stop once it is full */
+  if (pipe (fds) < 0 || pipe (idle) < 0)
+    g_assert_not_reached ();
+
+  transport = cockpit_pipe_transport_new_fds ("writer", idle[0], fds[1]);
+
+  /* A barrier, then an "open" queued in order behind it and bulk data */
+  send_filler (transport, "bulk", 32 * 1024);
+  control = cockpit_transport_build_control ("command", "ping", NULL);
+  cockpit_transport_send (transport, NULL, control);
+  g_bytes_unref (control);
+  send_filler (transport, "bulk", 128 * 1024);
+  control = cockpit_transport_build_control ("command", "open", "channel", "x", NULL);
+  cockpit_transport_send (transport, NULL, control);
+  g_bytes_unref (control);
+  send_filler (transport, "bulk", 128 * 1024);
+
+  /* Write until the pipe is full, well past the barrier but not the "open" */
+  while (g_main_context_iteration (NULL, FALSE));
+
+  /* Affects channel "x", so mustn't get there before its "open" */
+  control = g_bytes_new_static ("{\"command\":\"kill\",\"channels\":[\"x\"]}", 35);
+  cockpit_transport_send (transport, NULL, control);
+  g_bytes_unref (control);
+
+  out = dup (2);
+  g_assert (out >= 0);
+
+  commands = g_ptr_array_new_with_free_func (g_free);
+  reader = cockpit_pipe_transport_new_fds ("reader", fds[0], out);
+  g_signal_connect (reader, "control", G_CALLBACK (on_control_push_command), commands);
+
+  WAIT_UNTIL (commands->len == 3);
+  g_assert_cmpstr (commands->pdata[0], ==, "ping");
+  g_assert_cmpstr (commands->pdata[1], ==, "open");
+  g_assert_cmpstr (commands->pdata[2], ==, "kill");
+
+  g_ptr_array_free (commands, TRUE);
+  g_object_unref (transport);
+  g_object_unref (reader);
+  close (idle[1]);
+}
+
+static void
+test_read_partial (void)
+{
+  CockpitTransport *transport;
+  gint state = 0;
+  gint fds[2];
+  gint out;
+
+  if (pipe(fds) < 0)
+    g_assert_not_reached ();
+
+  out = dup (2);
+  g_assert (out >= 0);
+
+  /* Pass in a read end of the pipe */
+  transport = cockpit_pipe_transport_new_fds ("test", fds[0], out);
+  g_signal_connect (transport, "recv", G_CALLBACK (on_recv_multiple), &state);
+
+  /* One complete message followed by part of another */
+  g_assert_cmpint (write (fds[1], "5\n9\none5\n9\nt", 13), ==, 13);
+
+  WAIT_UNTIL (state == 1);
+
+  /* And the remainder of the second message */
+  g_assert_cmpint (write (fds[1], "wo", 2), ==, 2);
+
+  WAIT_UNTIL (state == 2);
+
+  close (fds[1]);
+  g_object_unref (transport);
+}
+
 static void
 test_read_truncated (void)
 {
@@ -537,6 +903,79 @@ test_parse_frame_maybe (void)
   g_free (channel);
 }
 
+static void
+test_read_frames (void)
+{
+  const gchar input[] = "5\n4\none" "\x80\x00\x00\x04\x01" "5two" "8\n4\nth";
+  gboolean invalid = TRUE;
+  const gchar *data;
+  GByteArray *buffer;
+  GBytes *frames;
+  GBytes *payload;
+  gchar *channel;
+  gsize length;
+  gssize prefix;
+  guint32 size;
+  gint channel_len;
+
+  buffer = g_byte_array_new ();
+  g_byte_array_append (buffer, (const guint8 *)input, sizeof (input) - 1);
+
+  frames = cockpit_transport_read_frames (buffer, &invalid);
+  g_assert (invalid == FALSE);
+  g_assert (frames != NULL);
+
+  /* The partial frame stays behind */
+  g_assert_cmpuint (buffer->len, ==, 5);
+  g_assert (memcmp (buffer->data, "8\n4\nth", 5) == 0);
+
+  data = g_bytes_get_data (frames, &length);
+  g_assert_cmpuint (length, ==, 16);
+
+  prefix = cockpit_transport_parse_header (data, length, &size, &channel_len);
+  g_assert_cmpint (prefix, ==, 2);
+  g_assert_cmpuint (size, ==, 5);
+  g_assert_cmpint (channel_len, ==, -1);
+  payload = cockpit_transport_frame_payload (frames, prefix, size, channel_len, TRUE, &channel);
+  g_assert_cmpstr (channel, ==, "4");
+  g_assert_cmpuint (g_bytes_get_size (payload), ==, 3);
+  g_assert (memcmp (g_bytes_get_data (payload, NULL), "one", 3) == 0);
+  g_bytes_unref (payload);
+  g_free (channel);
+
+  data += prefix + size;
+  length -= prefix + size;
+  prefix = cockpit_transport_parse_header (data, length, &size, &channel_len);
+  g_assert_cmpint (prefix, ==, 5);
+  g_assert_cmpuint (size, ==, 4);
+  g_assert_cmpint (channel_len, ==, 1);
+  payload = cockpit_transport_frame_payload (frames, 7 + prefix, size, channel_len, TRUE, &channel);
+  g_assert_cmpstr (channel, ==, "5");
+  g_assert_cmpuint (g_bytes_get_size (payload), ==, 3);
+  g_assert (memcmp (g_bytes_get_data (payload, NULL), "two", 3) == 0);
+  g_bytes_unref (payload);
+  g_free (channel);
+
+  g_bytes_unref (frames);
+
+  /* Nothing complete yet */
+  frames = cockpit_transport_read_frames (buffer, &invalid);
+  g_assert (frames == NULL);
+  g_assert (invalid == FALSE);
+  g_assert_cmpuint (buffer->len, ==, 5);
+
+  g_byte_array_append (buffer, (const guint8 *)"reex", 4);
+  g_byte_array_append (buffer, (const guint8 *)"bad", 3);
+  frames = cockpit_transport_read_frames (buffer, &invalid);
+  g_assert (frames != NULL);
+  g_assert (invalid == TRUE);
+  g_assert_cmpuint (g_bytes_get_size (frames), ==, 10);
+  g_assert_cmpuint (buffer->len, ==, 3);
+  g_bytes_unref (frames);
+
+  g_byte_array_unref (buffer);
+}
+
 static void
 test_parse_command (void)
 {
@@ -636,6 +1075,84 @@ test_parse_command_bad (gconstpointer input)
   cockpit_assert_expected ();
 }
 
+static void
+test_build_control (void)
+{
+  GBytes *message;
+
+  message = cockpit_transport_build_control ("command", "ping", NULL);
+  cockpit_assert_bytes_eq (message, "{\"command\":\"ping\"}", -1);
+  g_bytes_unref (message);
+
+  message = cockpit_transport_build_control ("command", "close", "channel", "5",
+                                             "problem", NULL, "message", "a \"b\"\n", NULL);
+  cockpit_assert_bytes_eq (message, "{\"command\":\"close\",\"channel\":\"5\","
+                           "\"message\":\"a \\\"b\\\"\\n\"}", -1);
+  g_bytes_unref (message);
+
+  message = cockpit_transport_build_control ("command", NULL, "channel", "5", NULL);
+  cockpit_assert_bytes_eq (message, "{\"channel\":\"5\"}", -1);
+  g_bytes_unref (message);
+}
+
+typedef struct {
+  const char *name;
+  const char *json;
+  const char *command;
+  const char *channel;
+} ScanFixture;
+
+static const ScanFixture scan_command_payloads[] = {
+    { "normal", "{ \"command\": \"close\", \"channel\": \"5\", \"problem\": \"oops\" }", "close", "5" },
+    { "no-channel", "{\"command\":\"ping\"}", "ping", NULL },
+    { "nested", "{ \"channel\": \"a\", \"x\": { \"command\": \"no\", \"y\": [1, -2.5e3, true, null, \"\\u00e9\"] }, "
+                "\"command\": \"options\" }", "options", "a" },
+    { "last-wins", "{ \"command\": \"one\", \"command\": \"two\" }", "two", NULL },
+    { "escaped-command", "{ \"command\": \"cl\\u006fse\" }", NULL, NULL },
+    { "escaped-key", "{ \"comm\\u0061nd\": \"close\" }", NULL, NULL },
+    { "number-channel", "{ \"command\": \"test\", \"channel\": 0 }", NULL, NULL },
+    { "empty-command", "{ \"command\": \"\" }", NULL, NULL },
+    { "no-command", "{ \"channel\": \"5\" }", NULL, NULL },
+    { "empty-object", "{ }", NULL, NULL },
+    { "not-an-object", "[ \"command\" ]", NULL, NULL },
+    { "newline-channel", "{ \"command\": \"test\", \"channel\": \"blah\nline\" }", NULL, NULL },
+    { "trailing-comma", "{ \"command\": \"test\", }", NULL, NULL },
+    { "trailing-data", "{ \"command\": \"test\" } x", NULL, NULL },
+    { "truncated", "{ \"command\": \"test\", \"x\": [1, 2", NULL, NULL },
+    { "bad-number", "{ \"command\": \"test\", \"x\": 1.2.3 }", NULL, NULL },
+    { "bad-word", "{ \"command\": \"test\", \"x\": nope }", NULL, NULL },
+    { "bad-escape", "{ \"command\": \"test\", \"x\": \"\\q\" }", NULL, NULL },
+    { "bad-utf8", "{ \"command\": \"test\", \"x\": \"\xff\" }", NULL, NULL },
+};
+
+static void
+test_scan_command (gconstpointer data)
+{
+  const ScanFixture *fixture = data;
+  GBytes *message;
+  gchar *command = NULL;
+  gchar *channel = NULL;
+  gboolean ret;
+
+  message = g_bytes_new_static (fixture->json, strlen (fixture->json));
+  ret = cockpit_transport_scan_command (message, &command, &channel);
+  g_bytes_unref (message);
+
+  if (fixture->command)
+    {
+      g_assert (ret == TRUE);
+      g_assert_cmpstr (command, ==, fixture->command);
+      g_assert_cmpstr (channel, ==, fixture->channel);
+    }
+  else
+    {
+      g_assert (ret == FALSE);
+    }
+
+  g_free (command);
+  g_free (channel);
+}
+
 int
 main (int argc,
       char *argv[])
@@ -647,6 +1164,7 @@ main (int argc,
   g_test_add_func ("/transport/parse-frame/ok", test_parse_frame);
   g_test_add_func ("/transport/parse-frame/bad", test_parse_frame_bad);
   g_test_add_func ("/transport/parse-frame/maybe", test_parse_frame_maybe);
+  g_test_add_func ("/transport/read-frames", test_read_frames);
 
   g_test_add_func ("/transport/parse-command/normal", test_parse_command);
   g_test_add_func ("/transport/parse-command/no-channel", test_parse_command_no_channel);
@@ -659,6 +1177,15 @@ main (int argc,
       g_free (name);
     }
 
+  g_test_add_func ("/transport/build-control", test_build_control);
+
+  for (i = 0; i < G_N_ELEMENTS (scan_command_payloads); i++)
+    {
+      gchar *name = g_strdup_printf ("/transport/scan-command/%s", scan_command_payloads[i].name);
+      g_test_add_data_func (name, scan_command_payloads + i, test_scan_command);
+      g_free (name);
+    }
+
   g_test_add ("/transport/properties", TestCase, NULL,
               setup_no_child, test_properties, teardown_transport);
 
@@ -674,6 +1201,9 @@ main (int argc,
   g_test_add ("/transport/echo-queue/no-child", TestCase,
               NULL, setup_no_child,
               test_echo_queue, teardown_transport);
+  g_test_add ("/transport/echo-binary", TestCase,
+              NULL, setup_no_child,
+              test_echo_binary, teardown_transport);
   g_test_add ("/transport/echo-large/child", TestCase,
               "cat", setup_with_child,
               test_echo_large, teardown_transport);
@@ -695,6 +1225,11 @@ main (int argc,
   g_test_add_func ("/transport/read-error", test_read_error);
   g_test_add_func ("/transport/write-error", test_write_error);
   g_test_add_func ("/transport/read-combined", test_read_combined);
+  g_test_add_func ("/transport/read-partial", test_read_partial);
+  g_test_add_func ("/transport/route", test_route);
+  g_test_add_func ("/transport/control-in-order", test_control_in_order);
+  g_test_add_func ("/transport/read-binary", test_read_binary);
+  g_test_add_func ("/transport/pass-through", test_pass_through);
   g_test_add_func ("/transport/read-truncated", test_read_truncated);
   g_test_add_func ("/transport/read-incorrect", test_incorrect_protocol);
 
@@ -61,8 +61,26 @@ static const Fixture fixtures[] = {
   { "this is \303 invalid", "this is \357\277\275 invalid" },
   { "this is invalid \303", "this is invalid \357\277\275" },
   { "\303 this is \303 invalid \303", "\357\277\275 this is \357\277\275 invalid \357\277\275" },
+  { "a longer ascii string that spans several words", NULL },
+  { "a longer ascii string \303\244\303\266 then \344\275\240\345\245\275 text", NULL },
+  { "a longer ascii string with an \344\275 invalid run", "a longer ascii string with an \357\277\275\357\277\275 invalid run" },
+  { "a longer ascii string with trailing \344\275", "a longer ascii string with trailing \357\277\275\357\277\275" },
 };
 
+static void
+test_incomplete_tail (void)
+{
+  g_assert_cmpuint (cockpit_unicode_incomplete_tail ("", 0), ==, 0);
+  g_assert_cmpuint (cockpit_unicode_incomplete_tail ("ascii", 5), ==, 0);
+  g_assert_cmpuint (cockpit_unicode_incomplete_tail ("complete \303\244", 11), ==, 0);
+  g_assert_cmpuint (cockpit_unicode_incomplete_tail ("complete \344\275\240", 12), ==, 0);
+  g_assert_cmpuint (cockpit_unicode_incomplete_tail ("split \303", 7), ==, 1);
+  g_assert_cmpuint (cockpit_unicode_incomplete_tail ("split \344\275", 8), ==, 2);
+  g_assert_cmpuint (cockpit_unicode_incomplete_tail ("split \360\237\230", 9), ==, 3);
+  g_assert_cmpuint (cockpit_unicode_incomplete_tail ("\275\275\275", 3), ==, 0);
+  g_assert_cmpuint (cockpit_unicode_incomplete_tail ("bad \370", 5), ==, 0);
+}
+
 int
 main (int argc,
       char *argv[])
@@ -84,5 +102,7 @@ main (int argc,
       g_free (name);
     }
 
+  g_test_add_func ("/unicode/incomplete-tail", test_incomplete_tail);
+
   return g_test_run ();
 }
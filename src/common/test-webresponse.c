@@ -19,6 +19,7 @@
 
 #include "config.h"
 
+#include "cockpitwebcompress.h"
 #include "cockpitwebinject.h"
 #include "cockpitwebresponse.h"
 #include "cockpitwebserver.h"
@@ -31,8 +32,11 @@
 
 #include <glib/gstdio.h>
 
+#include <sys/socket.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 static gchar *srcdir;
 
@@ -306,6 +310,78 @@ test_file_breakout_non_existant (TestCase *tc,
   free (root);
 }
 
+static gchar *
+serve_file (const gchar *path,
+            const gchar **roots)
+{
+  CockpitWebResponse *response;
+  GOutputStream *output;
+  GInputStream *input;
+  gboolean done = FALSE;
+  GIOStream *io;
+  gchar *data;
+
+  input = g_memory_input_stream_new ();
+  output = g_memory_output_stream_new (NULL, 0, g_realloc, g_free);
+  io = mock_io_stream_new (input, output);
+  g_object_unref (input);
+
+  response = cockpit_web_response_new (io, path, NULL, NULL);
+  g_signal_connect (response, "done", G_CALLBACK (on_response_done), &done);
+  g_object_unref (io);
+
+  cockpit_web_response_file (response, NULL, roots);
+  while (!done)
+    g_main_context_iteration (NULL, TRUE);
+
+  data = g_strndup (g_memory_output_stream_get_data (G_MEMORY_OUTPUT_STREAM (output)),
+                    g_memory_output_stream_get_data_size (G_MEMORY_OUTPUT_STREAM (output)));
+  g_object_unref (response);
+  g_object_unref (output);
+  return data;
+}
+
+static void
+test_file_changed (void)
+{
+  gchar templ[] = "/tmp/test-cache.XXXXXX";
+  const gchar *roots[] = { NULL, NULL };
+  GError *error = NULL;
+  gchar *filename;
+  gchar *resp;
+
+  if (!g_mkdtemp (templ))
+    g_assert_not_reached ();
+  roots[0] = templ;
+  filename = g_build_filename (templ, "file.txt", NULL);
+
+  g_file_set_contents (filename, "first", -1, &error);
+  g_assert_no_error (error);
+  resp = serve_file ("/file.txt", roots);
+  cockpit_assert_strmatch (resp, "HTTP/1.1 200*first");
+  g_free (resp);
+
+  /* Served again from the cache */
+  resp = serve_file ("/file.txt", roots);
+  cockpit_assert_strmatch (resp, "HTTP/1.1 200*first");
+  g_free (resp);
+
+  /* Replaced on disk, so the cache must not be used */
+  g_file_set_contents (filename, "second time", -1, &error);
+  g_assert_no_error (error);
+  resp = serve_file ("/file.txt", roots);
+  cockpit_assert_strmatch (resp, "HTTP/1.1 200*second time");
+  g_free (resp);
+
+  g_unlink (filename);
+  resp = serve_file ("/file.txt", roots);
+  cockpit_assert_strmatch (resp, "HTTP/1.1 404*");
+  g_free (resp);
+
+  g_rmdir (templ);
+  g_free (filename);
+}
+
 static const TestFixture content_type_fixture = {
   .path = "/pkg/shell/index.html"
 };
@@ -551,6 +627,78 @@ test_chunked_zero_length (TestCase *tc,
                    "37\r\ninspecting journals and starting and stopping services.\r\n0\r\n\r\n");
 }
 
+static void
+test_chunked_socket (void)
+{
+  CockpitWebResponse *response;
+  gboolean response_done = FALSE;
+  GSocketConnection *connection;
+  GString *expected;
+  GString *received;
+  GSocket *socket;
+  GBytes *content;
+  GError *error = NULL;
+  gchar *large;
+  gchar buffer[4096];
+  gssize count;
+  gint i;
+  int fds[2];
+
+  if (socketpair (PF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    g_assert_not_reached ();
+
+  socket = g_socket_new_from_fd (fds[0], &error);
+  g_assert_no_error (error);
+  connection = g_socket_connection_factory_create_connection (socket);
+  g_object_unref (socket);
+
+  response = cockpit_web_response_new (G_IO_STREAM (connection), NULL, NULL, NULL);
+  g_signal_connect (response, "done", G_CALLBACK (on_response_done), &response_done);
+  g_object_unref (connection);
+
+  expected = g_string_new ("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n");
+  cockpit_web_response_headers (response, 200, "OK", -1, NULL);
+
+  /* Many small blocks, and a large one between them sent as it is */
+  large = g_strnfill (20000, 'x');
+  for (i = 0; i < 100; i++)
+    {
+      if (i == 50)
+        {
+          content = g_bytes_new_static (large, 20000);
+          g_string_append_printf (expected, "4e20\r\n%s\r\n", large);
+        }
+      else
+        {
+          content = g_bytes_new_static ("block", 5);
+          g_string_append (expected, "5\r\nblock\r\n");
+        }
+      cockpit_web_response_queue (response, content);
+      g_bytes_unref (content);
+    }
+  g_string_append (expected, "0\r\n\r\n");
+  cockpit_web_response_complete (response);
+
+  received = g_string_new ("");
+  while (!response_done || received->len < expected->len)
+    {
+      g_main_context_iteration (NULL, FALSE);
+      count = recv (fds[1], buffer, sizeof (buffer), MSG_DONTWAIT);
+      if (count < 0)
+        g_assert_cmpint (errno, ==, EAGAIN);
+      else
+        g_string_append_len (received, buffer, count);
+    }
+
+  g_assert_cmpstr (received->str, ==, expected->str);
+
+  g_object_unref (response);
+  g_string_free (expected, TRUE);
+  g_string_free (received, TRUE);
+  g_free (large);
+  close (fds[1]);
+}
+
 static GBytes *
 bytes_static (const gchar *data)
 {
@@ -647,6 +795,45 @@ test_web_filter_multiple (TestCase *tc,
                    "0\r\n\r\n");
 }
 
+static void
+test_web_filter_repeated (TestCase *tc,
+                          gconstpointer data)
+{
+  const gchar *blocks[] = { "xa", "aa", "ab", "aab" };
+  CockpitWebFilter *filter;
+  const gchar *resp;
+  GBytes *inject;
+  GBytes *block;
+  gint i;
+
+  /* The start of the marker repeats across the block boundaries */
+  inject = bytes_static ("!");
+  filter = cockpit_web_inject_new ("aab", inject, 1);
+  cockpit_web_response_add_filter (tc->response, filter);
+  g_object_unref (filter);
+  g_bytes_unref (inject);
+
+  cockpit_web_response_headers (tc->response, 200, "OK", -1, NULL);
+
+  for (i = 0; i < G_N_ELEMENTS (blocks); i++)
+    {
+      block = bytes_static (blocks[i]);
+      g_assert (cockpit_web_response_queue (tc->response, block) == TRUE);
+      g_bytes_unref (block);
+    }
+
+  cockpit_web_response_complete (tc->response);
+
+  resp = output_as_string (tc);
+  g_assert_cmpstr (resp, ==, "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+                   "2\r\nxa\r\n"
+                   "2\r\naa\r\n"
+                   "2\r\nab\r\n"
+                   "1\r\n!\r\n"
+                   "3\r\naab\r\n"
+                   "0\r\n\r\n");
+}
+
 static void
 test_web_filter_split (TestCase *tc,
                        gconstpointer data)
@@ -842,6 +1029,91 @@ on_response_done_not_resuable (CockpitWebResponse *response,
   g_assert (reusable == FALSE);
 }
 
+static void
+test_web_filter_compress (TestCase *tc,
+                          gconstpointer data)
+{
+  CockpitWebFilter *filter;
+  GError *error = NULL;
+  GByteArray *body;
+  GBytes *content;
+  GBytes *bytes;
+  const gchar *resp;
+  const gchar *pos;
+  gchar *end;
+  gsize length;
+  gsize size;
+
+  filter = cockpit_web_compress_new ("gzip", 6);
+  cockpit_web_response_add_filter (tc->response, filter);
+  g_object_unref (filter);
+
+  cockpit_web_response_headers (tc->response, 200, "OK", -1, "Content-Encoding", "gzip", NULL);
+
+  content = bytes_static ("Cockpit is perfect for new sysadmins, ");
+  cockpit_web_response_queue (tc->response, content);
+  g_bytes_unref (content);
+
+  content = bytes_static ("allowing them to easily perform simple tasks such as storage administration, ");
+  cockpit_web_response_queue (tc->response, content);
+  g_bytes_unref (content);
+
+  content = bytes_static ("inspecting journals and starting and stopping services.");
+  cockpit_web_response_queue (tc->response, content);
+  g_bytes_unref (content);
+
+  cockpit_web_response_complete (tc->response);
+
+  /* The headers are text, but the body contains nul bytes */
+  output_as_string (tc);
+  g_assert_cmpint (cockpit_web_response_get_state (tc->response), ==, COCKPIT_WEB_RESPONSE_SENT);
+  resp = g_memory_output_stream_get_data (G_MEMORY_OUTPUT_STREAM (tc->output));
+  length = g_memory_output_stream_get_data_size (G_MEMORY_OUTPUT_STREAM (tc->output));
+
+  pos = strstr (resp, "\r\n\r\n");
+  g_assert (pos != NULL);
+  g_assert (g_str_has_prefix (resp, "HTTP/1.1 200 OK\r\n"));
+  g_assert (strstr (resp, "Transfer-Encoding: chunked\r\n") < pos);
+
+  /* Undo the chunked framing, each input block was flushed as its own chunk */
+  body = g_byte_array_new ();
+  for (pos += 4; ; pos = end + size + 2)
+    {
+      size = g_ascii_strtoull (pos, &end, 16);
+      g_assert (g_str_has_prefix (end, "\r\n"));
+      end += 2;
+      if (size == 0)
+        break;
+      g_byte_array_append (body, (guint8 *)end, size);
+      g_assert (g_str_has_prefix (end + size, "\r\n"));
+    }
+  g_assert_cmpint (end + 2 - resp, ==, length);
+  g_assert (g_str_has_prefix (end, "\r\n"));
+
+  content = g_byte_array_free_to_bytes (body);
+  bytes = cockpit_web_response_gunzip (content, &error);
+  g_assert_no_error (error);
+  g_bytes_unref (content);
+
+  cockpit_assert_bytes_eq (bytes, "Cockpit is perfect for new sysadmins, "
+                           "allowing them to easily perform simple tasks such as storage administration, "
+                           "inspecting journals and starting and stopping services.", -1);
+  g_bytes_unref (bytes);
+}
+
+static void
+test_compress_type (void)
+{
+  g_assert (cockpit_web_compress_type ("text/html"));
+  g_assert (cockpit_web_compress_type ("text/css; charset=utf-8"));
+  g_assert (cockpit_web_compress_type ("application/javascript"));
+  g_assert (cockpit_web_compress_type ("application/json"));
+  g_assert (cockpit_web_compress_type ("image/svg+xml"));
+  g_assert (!cockpit_web_compress_type ("image/png"));
+  g_assert (!cockpit_web_compress_type ("application/octet-stream"));
+  g_assert (!cockpit_web_compress_type (NULL));
+}
+
 static void
 test_abort (TestCase *tc,
             gconstpointer data)
@@ -1253,6 +1525,7 @@ main (int argc,
               setup, test_file_breakout_denied, teardown);
   g_test_add ("/web-response/file/breakout-non-existant", TestCase, NULL,
               setup, test_file_breakout_non_existant, teardown);
+  g_test_add_func ("/web-response/file/changed", test_file_changed);
   g_test_add ("/web-response/content-type", TestCase, &content_type_fixture,
               setup, test_content_type, teardown);
   g_test_add ("/web-response/content-encoding", TestCase, NULL,
@@ -1263,6 +1536,7 @@ main (int argc,
               setup, test_chunked_transfer_encoding, teardown);
   g_test_add ("/web-response/chunked-zero-length", TestCase, NULL,
               setup, test_chunked_zero_length, teardown);
+  g_test_add_func ("/web-response/chunked-socket", test_chunked_socket);
   g_test_add ("/web-response/abort", TestCase, NULL,
               setup, test_abort, teardown);
   g_test_add ("/web-response/connection-close", TestCase, &fixture_connection_close,
@@ -1283,12 +1557,17 @@ main (int argc,
               setup, test_web_filter_multiple, teardown);
   g_test_add ("/web-response/filter/passthrough", TestCase, NULL,
               setup, test_web_filter_passthrough, teardown);
+  g_test_add ("/web-response/filter/repeated", TestCase, NULL,
+              setup, test_web_filter_repeated, teardown);
   g_test_add ("/web-response/filter/split", TestCase, NULL,
               setup, test_web_filter_split, teardown);
   g_test_add ("/web-response/filter/shift", TestCase, NULL,
               setup, test_web_filter_shift, teardown);
   g_test_add ("/web-response/filter/shift_three", TestCase, NULL,
               setup, test_web_filter_shift_three, teardown);
+  g_test_add ("/web-response/filter/compress", TestCase, NULL,
+              setup, test_web_filter_compress, teardown);
+  g_test_add_func ("/web-response/compress-type", test_compress_type);
 
   g_test_add ("/web-response/path/pop", TestPlain, NULL,
               setup_plain, test_pop_path, teardown_plain);
@@ -27,6 +27,8 @@
 #include "websocket/websocket.h"
 #include "websocket/websocketprivate.h"
 
+#include <glib/gstdio.h>
+
 #include <string.h>
 
 typedef struct {
@@ -280,6 +282,45 @@ test_languages_order (void)
   g_hash_table_unref (table);
 }
 
+static void
+test_languages_cached (void)
+{
+  GHashTable *table = cockpit_web_server_new_table ();
+  gchar **first;
+  gchar **second;
+  gchar *string;
+
+  g_hash_table_insert (table, g_strdup ("Accept-Language"), g_strdup ("de-de, fr;q=0.5"));
+
+  /* Each caller gets its own copy */
+  first = cockpit_web_server_parse_languages (table, NULL);
+  second = cockpit_web_server_parse_languages (table, NULL);
+  g_assert (first != second);
+  string = g_strjoinv (", ", second);
+  g_assert_cmpstr (string, ==, "de-de, fr, de");
+  g_free (string);
+  g_strfreev (first);
+  g_strfreev (second);
+
+  /* Different defaults are cached apart */
+  first = cockpit_web_server_parse_languages (table, "pig");
+  string = g_strjoinv (", ", first);
+  g_assert_cmpstr (string, ==, "de-de, fr, pig, de");
+  g_free (string);
+  g_strfreev (first);
+
+  /* An empty header isn't the same as none */
+  g_hash_table_replace (table, g_strdup ("Accept-Language"), g_strdup (""));
+  first = cockpit_web_server_parse_languages (table, "pig");
+  g_hash_table_remove (table, "Accept-Language");
+  second = cockpit_web_server_parse_languages (table, "pig");
+  g_assert_cmpuint (g_strv_length (first), ==, g_strv_length (second) + 1);
+  g_strfreev (first);
+  g_strfreev (second);
+
+  g_hash_table_unref (table);
+}
+
 static void
 test_encoding_simple (void)
 {
@@ -534,6 +575,128 @@ test_webserver_noredirect_override (TestCase *tc,
   g_free (resp);
 }
 
+static void
+test_webserver_pipelined (TestCase *tc,
+                          gconstpointer data)
+{
+  gchar *resp;
+
+  /* Both requests arrive together, the second closes the connection */
+  resp = perform_http_request (tc->localport,
+                               "GET /pkg/shell/index.html HTTP/1.1\r\nHost:test\r\n\r\n"
+                               "GET /pkg/shell/index.html HTTP/1.1\r\nHost:test\r\nConnection: close\r\n\r\n",
+                               NULL);
+  cockpit_assert_strmatch (resp, "HTTP/* 200 *\r\n*HTTP/* 200 *\r\n*");
+  g_free (resp);
+}
+
+static void
+test_webserver_large_file (void)
+{
+  gchar templ[] = "/tmp/test-large.XXXXXX";
+  const gchar *roots[] = { NULL, NULL };
+  CockpitWebServer *server;
+  GError *error = NULL;
+  gchar *filename;
+  gchar *hostport;
+  GString *content;
+  gchar *resp;
+  gsize length;
+  gint port;
+  gint i;
+
+  if (!g_mkdtemp (templ))
+    g_assert_not_reached ();
+  roots[0] = templ;
+
+  /* Big enough to be sent straight from the file */
+  content = g_string_new ("");
+  for (i = 0; i < 50000; i++)
+    g_string_append_printf (content, "%d\n", i);
+  filename = g_build_filename (templ, "large.txt", NULL);
+  g_file_set_contents (filename, content->str, content->len, &error);
+  g_assert_no_error (error);
+
+  server = cockpit_web_server_new (0, NULL, roots, NULL, &error);
+  g_assert_no_error (error);
+  g_object_get (server, "port", &port, NULL);
+  hostport = g_strdup_printf ("localhost:%d", port);
+
+  resp = perform_http_request (hostport, "GET /large.txt HTTP/1.0\r\nHost:test\r\n\r\n", &length);
+  cockpit_assert_strmatch (resp, "HTTP/* 200 *\r\n*");
+  g_assert_cmpuint (length, >, content->len);
+  g_assert (memcmp (resp + length - content->len, content->str, content->len) == 0);
+  g_free (resp);
+
+  g_object_unref (server);
+  g_free (hostport);
+  g_unlink (filename);
+  g_rmdir (templ);
+  g_free (filename);
+  g_string_free (content, TRUE);
+}
+
+static void
+test_webserver_tls (TestCase *tc,
+                    gconstpointer data)
+{
+  const gchar *request = "GET /pkg/shell/index.html HTTP/1.0\r\nHost:test\r\n\r\n";
+  GSocketConnection *conns[3];
+  GSocketClient *client;
+  GAsyncResult *result;
+  GInputStream *input;
+  GError *error = NULL;
+  gchar buffer[1024];
+  GString *reply;
+  gssize ret;
+  gint i;
+
+  client = g_socket_client_new ();
+  g_socket_client_set_tls (client, TRUE);
+  g_socket_client_set_tls_validation_flags (client, 0);
+
+  /* Several handshakes at once, they complete off the main loop */
+  for (i = 0; i < G_N_ELEMENTS (conns); i++)
+    {
+      result = NULL;
+      g_socket_client_connect_to_host_async (client, tc->localport, 1, NULL, on_ready_get_result, &result);
+      while (result == NULL)
+        g_main_context_iteration (NULL, TRUE);
+      conns[i] = g_socket_client_connect_to_host_finish (client, result, &error);
+      g_object_unref (result);
+      g_assert_no_error (error);
+    }
+
+  for (i = 0; i < G_N_ELEMENTS (conns); i++)
+    {
+      g_output_stream_write_all (g_io_stream_get_output_stream (G_IO_STREAM (conns[i])),
+                                 request, strlen (request), NULL, NULL, &error);
+      g_assert_no_error (error);
+
+      reply = g_string_new ("");
+      input = g_io_stream_get_input_stream (G_IO_STREAM (conns[i]));
+      do
+        {
+          result = NULL;
+          g_input_stream_read_async (input, buffer, sizeof (buffer), G_PRIORITY_DEFAULT,
+                                     NULL, on_ready_get_result, &result);
+          while (result == NULL)
+            g_main_context_iteration (NULL, TRUE);
+          ret = g_input_stream_read_finish (input, result, &error);
+          g_object_unref (result);
+          g_assert_no_error (error);
+          g_string_append_len (reply, buffer, ret);
+        }
+      while (ret > 0);
+
+      cockpit_assert_strmatch (reply->str, "HTTP/* 200 *\r\n*");
+      g_string_free (reply, TRUE);
+      g_object_unref (conns[i]);
+    }
+
+  g_object_unref (client);
+}
+
 static gboolean
 on_oh_resource (CockpitWebServer *server,
                 const gchar *path,
@@ -717,6 +880,7 @@ main (int argc,
   g_test_add_func ("/web-server/languages/cookie", test_languages_cookie);
   g_test_add_func ("/web-server/languages/no-header", test_languages_no_header);
   g_test_add_func ("/web-server/languages/order", test_languages_order);
+  g_test_add_func ("/web-server/languages/cached", test_languages_cached);
 
   g_test_add_func ("/web-server/encoding/simple", test_encoding_simple);
   g_test_add_func ("/web-server/encoding/no-header", test_encoding_no_header);
@@ -741,6 +905,11 @@ main (int argc,
               setup, test_webserver_noredirect_exception, teardown);
   g_test_add ("/web-server/no-redirect-override", TestCase, &fixture_with_cert,
               setup, test_webserver_noredirect_override, teardown);
+  g_test_add_func ("/web-server/large-file", test_webserver_large_file);
+  g_test_add ("/web-server/pipelined", TestCase, NULL,
+              setup, test_webserver_pipelined, teardown);
+  g_test_add ("/web-server/tls", TestCase, &fixture_with_cert,
+              setup, test_webserver_tls, teardown);
 
   g_test_add ("/web-server/handle-resource", TestCase, NULL,
               setup, test_handle_resource, teardown);
@@ -41,6 +41,8 @@
 #include <syslog.h>
 #include <unistd.h>
 #include <pwd.h>
+#include <poll.h>
+#include <time.h>
 
 #include <security/pam_modules.h>
 
@@ -102,6 +104,7 @@ static const char *agent_vars[] = {
 
 typedef int (* line_cb) (char *line, void *arg);
 int pam_ssh_add_verbose_mode = 0;
+int pam_ssh_add_timeout = 30;
 pam_ssh_add_logger pam_ssh_add_log_handler = NULL;
 
 #ifndef message_handler
@@ -274,9 +277,60 @@ fdwalk (int (*cb)(void *data, int fd),
 
 #endif /* HAVE_FDWALK */
 
+static void
+deadline_after (struct timespec *deadline,
+                int seconds)
+{
+  clock_gettime (CLOCK_MONOTONIC, deadline);
+  deadline->tv_sec += seconds;
+}
+
+static long
+msec_between (const struct timespec *from,
+              const struct timespec *to)
+{
+  return (to->tv_sec - from->tv_sec) * 1000L +
+         (to->tv_nsec - from->tv_nsec) / 1000000L;
+}
+
+static long
+msec_since (const struct timespec *start)
+{
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return msec_between (start, &now);
+}
+
+/* Returns 0 and sets ETIMEDOUT when nothing arrives before the deadline */
+static int
+wait_readable (int fd,
+               const struct timespec *deadline)
+{
+  struct pollfd pfd = { fd, POLLIN, 0 };
+  struct timespec now;
+  long timeout;
+  int r;
+
+  if (!deadline)
+    return 1;
+
+  for (;;)
+    {
+      clock_gettime (CLOCK_MONOTONIC, &now);
+      timeout = msec_between (&now, deadline);
+      r = poll (&pfd, 1, timeout < 0 ? 0 : timeout);
+      if (r < 0 && errno == EINTR)
+        continue;
+      if (r == 0)
+        errno = ETIMEDOUT;
+      return r;
+    }
+}
+
 static char *
 read_string (int fd,
-             int consume)
+             int consume,
+             const struct timespec *deadline)
 {
   /* We only accept a max of 8K */
   #define MAX_LENGTH 8192
@@ -298,6 +352,14 @@ read_string (int fd,
       memset (n + len, 0, BLOCK);
       ret = n;
 
+      if (wait_readable (fd, deadline) <= 0)
+        {
+          r = errno;
+          free (ret);
+          errno = r;
+          return NULL;
+        }
+
       r = read (fd, ret + len, BLOCK-1);
       if (r < 0)
         {
@@ -599,10 +661,15 @@ pam_ssh_add_load (struct passwd *pwd,
 
   pid_t pid;
   int success = 0;
+  int timed_out = 0;
   int force_stderr_debug = 1;
 
+  struct timespec start, deadline;
   siginfo_t result;
 
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  deadline_after (&deadline, pam_ssh_add_timeout);
+
   ignore_signals (&defsact, &oldsact, &ignpipe, &oldpipe);
 
   assert (pwd);
@@ -640,7 +707,13 @@ pam_ssh_add_load (struct passwd *pwd,
   for (;;)
     {
       /* ssh-add asks for password on stderr */
-      char *outerr = read_string (errp[READ_END], 0);
+      char *outerr = read_string (errp[READ_END], 0,
+                                  pam_ssh_add_timeout > 0 ? &deadline : NULL);
+      if (outerr == NULL && errno == ETIMEDOUT)
+        {
+          timed_out = 1;
+          break;
+        }
       if (outerr == NULL || outerr[0] == '\0')
         {
           free (outerr);
@@ -668,6 +741,14 @@ pam_ssh_add_load (struct passwd *pwd,
       free (outerr);
     }
 
+  /*
+   * Don't hold up the login any longer. Keys that were already added
+   * stay in the agent. The child is the leader of its own session, so
+   * this gets ssh-add even if the shell didn't exec it.
+   */
+  if (timed_out)
+    kill (-pid, SIGKILL);
+
   /* Wait for the initial process to exit */
   if (waitid (P_PID, pid, &result, WEXITED) < 0)
     {
@@ -675,6 +756,15 @@ pam_ssh_add_load (struct passwd *pwd,
       goto done;
     }
 
+  debug ("ssh-add took %ld ms", msec_since (&start));
+
+  if (timed_out)
+    {
+      message ("Timed out adding keys after %d seconds", pam_ssh_add_timeout);
+      success = 1;
+      goto done;
+    }
+
   success = result.si_code == CLD_EXITED && result.si_status == 0;
   /* Failure from process */
   if (!success)
@@ -734,9 +824,19 @@ pam_ssh_add_start_agent (struct passwd *pwd,
   int success = 0;
   int i = 0;
 
+  struct timespec start, deadline;
+  const struct timespec *until = NULL;
+
   char *save_vars[N_ELEMENTS (agent_vars)] = { NULL, };
 
   assert (pwd);
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  if (pam_ssh_add_timeout > 0)
+    {
+      deadline_after (&deadline, pam_ssh_add_timeout);
+      until = &deadline;
+    }
+
   xdg_runtime = get_optional_env ("XDG_RUNTIME_DIR",
                                   xdg_runtime_overide);
   if (!build_environment (env,
@@ -769,11 +869,14 @@ pam_ssh_add_start_agent (struct passwd *pwd,
   inp[READ_END] = outp[WRITE_END] = errp[WRITE_END] = -1;
 
   /* Read any stdout and stderr data */
-  output = read_string (outp[READ_END], 1);
-  outerr = read_string (errp[READ_END], 0);
+  output = read_string (outp[READ_END], 1, until);
+  if (output)
+    outerr = read_string (errp[READ_END], 0, until);
   if (!output || !outerr)
     {
       error ("couldn't read data from ssh-agent: %m");
+      kill (-pid, SIGKILL);
+      waitid (P_PID, pid, &result, WEXITED);
       goto done;
     }
 
@@ -784,6 +887,8 @@ pam_ssh_add_start_agent (struct passwd *pwd,
       goto done;
     }
 
+  debug ("ssh-agent took %ld ms to start", msec_since (&start));
+
   success = result.si_code == CLD_EXITED && result.si_status == 0;
 
   if (outerr && outerr[0])
@@ -846,6 +951,7 @@ parse_args (int argc,
   int i;
 
   pam_ssh_add_verbose_mode = 0;
+  pam_ssh_add_timeout = 30;
 
   /* Parse the arguments */
   for (i = 0; i < argc; i++)
@@ -854,6 +960,10 @@ parse_args (int argc,
         {
           pam_ssh_add_verbose_mode = 1;
         }
+      else if (strncmp (argv[i], "timeout=", 8) == 0)
+        {
+          pam_ssh_add_timeout = atoi (argv[i] + 8);
+        }
       else
         {
           message ("invalid option: %s", argv[i]);
@@ -29,6 +29,7 @@ extern const char *pam_ssh_agent_arg;
 extern const char *pam_ssh_add_program;
 extern const char *pam_ssh_add_arg;
 extern int pam_ssh_add_verbose_mode;
+extern int pam_ssh_add_timeout;
 
 typedef void (*pam_ssh_add_logger) (int level, const char *data);
 extern pam_ssh_add_logger pam_ssh_add_log_handler;
@@ -32,6 +32,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
 
 static int unexpected_message;
@@ -392,6 +393,30 @@ test_key_environment (void *data)
   free (home_expect);
 }
 
+static Fixture keys_slow_fixture = {
+  .ssh_add_arg = "slow",
+  .password = "foobar",
+};
+
+static void
+test_keys_timeout (void *data)
+{
+  Fixture *fix = data;
+  time_t start;
+  int ret;
+
+  pam_ssh_add_timeout = 1;
+  start = time (NULL);
+
+  expect_message ("Timed out adding keys after 1 seconds");
+  ret = pam_ssh_add_load (fix->pw, "mock-socket", fix->password);
+
+  assert_num_eq (1, ret);
+  assert (time (NULL) - start < 10);
+
+  pam_ssh_add_timeout = 30;
+}
+
 int
 main (int argc,
       char *argv[])
@@ -415,6 +440,8 @@ main (int argc,
             "/pam-ssh-add/add-key-bad-password");
   re_testx (test_keys, &keys_password_fixture,
             "/pam-ssh-add/add-key-password");
+  re_testx (test_keys_timeout, &keys_slow_fixture,
+            "/pam-ssh-add/add-key-timeout");
 
   re_testx (test_environment, &environment_fixture,
             "/pam-ssh-add/environment");
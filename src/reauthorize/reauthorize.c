@@ -801,25 +801,18 @@ reauthorize_user (const char *challenge,
   return 0;
 }
 
-int
-reauthorize_crypt1 (const char *challenge,
-                    const char *password,
-                    char **response)
+static int
+parse_crypt1 (const char *challenge,
+              char **nonce,
+              char **salt)
 {
-  struct crypt_data *cd = NULL;
-  char *nonce = NULL;
-  char *salt = NULL;
   const char *npos;
   const char *spos;
-  char *secret;
-  char *resp;
-  int ret;
 
   if (strncmp (challenge, "crypt1:", 7) != 0)
     {
       message ("reauthorize challenge is not a crypt1");
-      ret = -EINVAL;
-      goto out;
+      return -EINVAL;
     }
   challenge += 7;
 
@@ -833,29 +826,71 @@ reauthorize_crypt1 (const char *challenge,
 
   if (npos == NULL || spos == NULL)
     {
-      ret = -EINVAL;
       message ("couldn't parse reauthorize challenge");
-      goto out;
+      return -EINVAL;
     }
 
-  nonce = strndup (npos, spos - npos);
-  salt = strdup (spos + 1);
-  if (!nonce || !salt)
+  *nonce = strndup (npos, spos - npos);
+  *salt = strdup (spos + 1);
+  if (!*nonce || !*salt)
     {
-      ret = -ENOMEM;
+      free (*nonce);
+      free (*salt);
       message ("couldn't allocate memory for challenge fields");
-      goto out;
+      return -ENOMEM;
     }
 
-  if (parse_salt (nonce) < 0 ||
-      parse_salt (salt) < 0)
+  if (parse_salt (*nonce) < 0 ||
+      parse_salt (*salt) < 0)
     {
+      free (*nonce);
+      free (*salt);
       message ("reauthorize challenge has bad nonce or salt");
-      ret = -EINVAL;
-      goto out;
+      return -EINVAL;
     }
 
-  cd = calloc (2, sizeof (struct crypt_data));
+  return 0;
+}
+
+/*
+ * This is what a response is made of:
+ *
+ * response = "crypt1:" crypt(crypt(password, salt), nonce)
+ *
+ * The salt is that of the user's password and stays the same from
+ * one challenge to the next, while the nonce is new each time. So
+ * the inner secret can be kept by the caller for a while, and used
+ * to answer further challenges with half the work.
+ */
+
+int
+reauthorize_crypt1_salt (const char *challenge,
+                         char **salt)
+{
+  char *nonce = NULL;
+  int ret;
+
+  ret = parse_crypt1 (challenge, &nonce, salt);
+  free (nonce);
+  return ret;
+}
+
+int
+reauthorize_crypt1_secret (const char *challenge,
+                           const char *password,
+                           char **secret)
+{
+  struct crypt_data *cd = NULL;
+  char *nonce = NULL;
+  char *salt = NULL;
+  char *result;
+  int ret;
+
+  ret = parse_crypt1 (challenge, &nonce, &salt);
+  if (ret < 0)
+    return ret;
+
+  cd = calloc (1, sizeof (struct crypt_data));
   if (cd == NULL)
     {
       message ("couldn't allocate crypt data");
@@ -863,21 +898,56 @@ reauthorize_crypt1 (const char *challenge,
       goto out;
     }
 
-  /*
-   * This is what we're generating here:
-   *
-   * response = "crypt1:" crypt(crypt(password, salt), nonce)
-   */
-
-  secret = crypt_r (password, salt, cd + 0);
-  if (secret == NULL)
+  result = crypt_r (password, salt, cd);
+  if (result == NULL)
     {
       ret = -errno;
       message ("couldn't hash password via crypt: %m");
       goto out;
     }
 
-  resp = crypt_r (secret, nonce, cd + 1);
+  *secret = strdup (result);
+  if (*secret == NULL)
+    {
+      ret = -ENOMEM;
+      message ("couldn't allocate secret");
+      goto out;
+    }
+
+  ret = 0;
+
+out:
+  free (nonce);
+  free (salt);
+  secfree (cd, sizeof (struct crypt_data));
+
+  return ret;
+}
+
+int
+reauthorize_crypt1_respond (const char *challenge,
+                            const char *secret,
+                            char **response)
+{
+  struct crypt_data *cd = NULL;
+  char *nonce = NULL;
+  char *salt = NULL;
+  char *resp;
+  int ret;
+
+  ret = parse_crypt1 (challenge, &nonce, &salt);
+  if (ret < 0)
+    return ret;
+
+  cd = calloc (1, sizeof (struct crypt_data));
+  if (cd == NULL)
+    {
+      message ("couldn't allocate crypt data");
+      ret = -ENOMEM;
+      goto out;
+    }
+
+  resp = crypt_r (secret, nonce, cd);
   if (resp == NULL)
     {
       ret = -errno;
@@ -897,7 +967,23 @@ reauthorize_crypt1 (const char *challenge,
 out:
   free (nonce);
   free (salt);
-  secfree (cd, sizeof (struct crypt_data) * 2);
+  secfree (cd, sizeof (struct crypt_data));
 
   return ret;
 }
+
+int
+reauthorize_crypt1 (const char *challenge,
+                    const char *password,
+                    char **response)
+{
+  char *secret = NULL;
+  int ret;
+
+  ret = reauthorize_crypt1_secret (challenge, password, &secret);
+  if (ret == 0)
+    ret = reauthorize_crypt1_respond (challenge, secret, response);
+
+  secfree (secret, -1);
+  return ret;
+}
@@ -45,6 +45,17 @@ int     reauthorize_crypt1     (const char *challenge,
                                 const char *password,
                                 char **response);
 
+int     reauthorize_crypt1_salt    (const char *challenge,
+                                    char **salt);
+
+int     reauthorize_crypt1_secret  (const char *challenge,
+                                    const char *password,
+                                    char **secret);
+
+int     reauthorize_crypt1_respond (const char *challenge,
+                                    const char *secret,
+                                    char **response);
+
 void    reauthorize_logger     (void (* func) (const char *),
                                 int verbose);
 
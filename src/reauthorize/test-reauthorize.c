@@ -282,6 +282,31 @@ test_crypt1 (void *data)
     }
 }
 
+static void
+test_crypt1_secret (void)
+{
+  const char *challenge = "crypt1:75:$1$0123456789abcdef$:$1$0123456789abcdef$";
+  const char *other = "crypt1:75:$1$fedcba9876543210$:$1$0123456789abcdef$";
+  char *response;
+  char *secret;
+  char *salt;
+
+  assert_num_eq (reauthorize_crypt1_salt (challenge, &salt), 0);
+  assert_str_eq (salt, "$1$0123456789abcdef$");
+  free (salt);
+
+  /* The same secret answers another challenge with the same salt */
+  assert_num_eq (reauthorize_crypt1_secret (challenge, "password", &secret), 0);
+  assert_num_eq (reauthorize_crypt1_respond (challenge, secret, &response), 0);
+  assert_str_eq (response, "crypt1:$1$01234567$mmR7jVZhYpBJ6s6uTlnIR0");
+  free (response);
+
+  assert_num_eq (reauthorize_crypt1_respond (other, secret, &response), 0);
+  assert_str_cmp (response, !=, "crypt1:$1$01234567$mmR7jVZhYpBJ6s6uTlnIR0");
+  free (response);
+  free (secret);
+}
+
 static void
 test_password_success (void)
 {
@@ -363,6 +388,8 @@ main (int argc,
     re_testx (test_crypt1, crypt1_fixtures + i,
               "/reauthorize/crypt1/%s", crypt1_fixtures[i].challenge);
 
+  re_test (test_crypt1_secret, "/reauthorize/crypt1-secret");
+
   re_test (test_password_success, "/pamreauth/password-success");
   re_test (test_password_bad, "/pamreauth/password-bad");
   re_test (test_password_no_prepare, "/pamreauth/password-no-prepare");
@@ -163,6 +163,7 @@ cockpit_remotectl_certificate (int argc,
   gchar *selinux = NULL;
   gchar *group = NULL;
   gchar *user = NULL;
+  gchar *key_type = NULL;
   int ret = 1;
 
   const GOptionEntry options[] = {
@@ -174,6 +175,8 @@ cockpit_remotectl_certificate (int argc,
       "The unix group that should read the certificate", "group" },
     { "selinux-type", 0, 0, G_OPTION_ARG_STRING, &selinux,
       "The SELinux security context type for the certificate", "selinux" },
+    { "key-type", 0, 0, G_OPTION_ARG_STRING, &key_type,
+      "The key type of a generated certificate: ecdsa, rsa or ed25519", "type" },
     { G_OPTION_REMAINING, 0, G_OPTION_FLAG_HIDDEN, G_OPTION_ARG_CALLBACK,
       cockpit_remotectl_no_arguments, NULL, NULL },
     { NULL },
@@ -192,6 +195,8 @@ cockpit_remotectl_certificate (int argc,
   else
     {
       g_set_prgname ("remotectl");
+      if (key_type)
+        cockpit_certificate_key_type = key_type;
       if (ensure)
         ret = ensure_certificate (user, group, selinux);
       else
@@ -203,5 +208,6 @@ cockpit_remotectl_certificate (int argc,
   g_free (selinux);
   g_free (group);
   g_free (user);
+  g_free (key_type);
   return ret;
 }
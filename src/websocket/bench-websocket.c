@@ -0,0 +1,326 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2016 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "websocket.h"
+#include "websocketprivate.h"
+
+#include <sys/socket.h>
+
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Times unmasking of client frames, against the plain byte at a time
+ * loop, for a few payload sizes and alignments.
+ *
+ * Then pumps messages between a client and server connected over a
+ * socketpair, in each direction, so both the masking and unmasking
+ * sides are measured. This can be done over TLS, with compression
+ * or with fragmentation.
+ *
+ * This is not run as part of 'make check'.
+ */
+
+static gint opt_count = 10000;
+static gint opt_size = 0;
+static gint opt_messages = 2000;
+static gint opt_fragment = 0;
+static gboolean opt_tls = FALSE;
+static gboolean opt_deflate = FALSE;
+static gchar *opt_cert = NULL;
+
+/* Messages in flight at once */
+#define PUMP_WINDOW 32
+
+static void
+xor_bytewise (const guint8 *mask,
+              guint8 *data,
+              gsize len)
+{
+  gsize n;
+
+  for (n = 0; n < len; n++)
+    data[n] ^= mask[n & 3];
+}
+
+static void
+bench_mask (gsize size,
+            gsize offset)
+{
+  const guint8 mask[4] = { 0x12, 0x34, 0x56, 0x78 };
+  guint8 *buffer;
+  gint64 start;
+  gdouble bytewise;
+  gdouble current;
+  gint i;
+
+  buffer = g_malloc0 (size + offset);
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < opt_count; i++)
+    xor_bytewise (mask, buffer + offset, size);
+  bytewise = MAX (g_get_monotonic_time () - start, 1);
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < opt_count; i++)
+    _web_socket_xor_mask_rfc6455 (mask, buffer + offset, buffer + offset, size);
+  current = MAX (g_get_monotonic_time () - start, 1);
+
+  /* Microseconds in, MB/sec out */
+  printf ("mask %7" G_GSIZE_FORMAT " bytes at +%" G_GSIZE_FORMAT ": "
+          "bytewise %8.1f MB/sec, current %8.1f MB/sec\n", size, offset,
+          ((gdouble)size * opt_count) / bytewise,
+          ((gdouble)size * opt_count) / current);
+
+  g_free (buffer);
+}
+
+typedef struct {
+  WebSocketConnection *sender;
+  WebSocketConnection *receiver;
+  GBytes *payload;
+  gint sent;
+  gint received;
+  gboolean closed;
+} Pump;
+
+static void
+on_pump_message (WebSocketConnection *ws,
+                 WebSocketDataType type,
+                 GBytes *message,
+                 gpointer user_data)
+{
+  Pump *pump = user_data;
+
+  g_assert_cmpuint (g_bytes_get_size (message), ==, g_bytes_get_size (pump->payload));
+  pump->received++;
+  if (pump->sent < opt_messages)
+    {
+      web_socket_connection_send (pump->sender, WEB_SOCKET_DATA_BINARY, NULL, pump->payload);
+      pump->sent++;
+    }
+}
+
+static void
+on_pump_close (WebSocketConnection *ws,
+               gpointer user_data)
+{
+  Pump *pump = user_data;
+  pump->closed = TRUE;
+}
+
+static gboolean
+on_pump_error (WebSocketConnection *ws,
+               GError *error,
+               gpointer user_data)
+{
+  g_printerr ("bench-websocket: %s\n", error->message);
+  return TRUE;
+}
+
+static void
+create_stream_pair (GIOStream **client,
+                    GIOStream **server)
+{
+  GTlsCertificate *certificate;
+  GError *error = NULL;
+  GSocket *socket;
+  GIOStream *io;
+  int fds[2];
+
+  if (socketpair (PF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    g_error ("couldn't create socketpair");
+
+  socket = g_socket_new_from_fd (fds[0], &error);
+  g_assert_no_error (error);
+  *client = G_IO_STREAM (g_socket_connection_factory_create_connection (socket));
+  g_object_unref (socket);
+
+  socket = g_socket_new_from_fd (fds[1], &error);
+  g_assert_no_error (error);
+  *server = G_IO_STREAM (g_socket_connection_factory_create_connection (socket));
+  g_object_unref (socket);
+
+  if (!opt_tls)
+    return;
+
+  certificate = g_tls_certificate_new_from_file (opt_cert, &error);
+  if (!certificate)
+    g_error ("couldn't load certificate: %s", error->message);
+
+  io = g_tls_server_connection_new (*server, certificate, &error);
+  g_assert_no_error (error);
+  g_object_unref (*server);
+  *server = io;
+  g_object_unref (certificate);
+
+  io = g_tls_client_connection_new (*client, NULL, &error);
+  g_assert_no_error (error);
+  g_tls_client_connection_set_validation_flags (G_TLS_CLIENT_CONNECTION (io), 0);
+  g_object_unref (*client);
+  *client = io;
+}
+
+static void
+bench_pump (gsize size,
+            gboolean from_client)
+{
+  WebSocketConnection *client;
+  WebSocketConnection *server;
+  GIOStream *ioc;
+  GIOStream *ios;
+  Pump pump = { NULL, };
+  gint64 start;
+  gdouble elapsed;
+  guint8 *data;
+  gsize n;
+
+  create_stream_pair (&ioc, &ios);
+  server = web_socket_server_new_for_stream ("ws://localhost/unix", NULL, NULL, ios, NULL, NULL);
+  client = web_socket_client_new_for_stream ("ws://localhost/unix", NULL, NULL, ioc);
+  g_object_unref (ioc);
+  g_object_unref (ios);
+
+  if (opt_deflate)
+    {
+      web_socket_connection_set_deflate (server, 128, FALSE);
+      web_socket_connection_set_deflate (client, 0, FALSE);
+    }
+  if (opt_fragment > 0)
+    {
+      web_socket_connection_set_fragment_size (client, opt_fragment);
+      web_socket_connection_set_fragment_size (server, opt_fragment);
+    }
+
+  while (web_socket_connection_get_ready_state (client) == WEB_SOCKET_STATE_CONNECTING ||
+         web_socket_connection_get_ready_state (server) == WEB_SOCKET_STATE_CONNECTING)
+    g_main_context_iteration (NULL, TRUE);
+
+  /* Somewhat compressible, like most of what goes over a cockpit WebSocket */
+  data = g_malloc (size);
+  for (n = 0; n < size; n++)
+    data[n] = "cockpit-websocket-bench"[(n * 7 + n / 64) % 23];
+  pump.payload = g_bytes_new_take (data, size);
+
+  pump.sender = from_client ? client : server;
+  pump.receiver = from_client ? server : client;
+  g_signal_connect (pump.receiver, "message", G_CALLBACK (on_pump_message), &pump);
+  g_signal_connect (client, "close", G_CALLBACK (on_pump_close), &pump);
+  g_signal_connect (server, "close", G_CALLBACK (on_pump_close), &pump);
+  g_signal_connect (client, "error", G_CALLBACK (on_pump_error), &pump);
+  g_signal_connect (server, "error", G_CALLBACK (on_pump_error), &pump);
+
+  start = g_get_monotonic_time ();
+
+  for (n = 0; n < PUMP_WINDOW && pump.sent < opt_messages; n++)
+    {
+      web_socket_connection_send (pump.sender, WEB_SOCKET_DATA_BINARY, NULL, pump.payload);
+      pump.sent++;
+    }
+
+  while (pump.received < opt_messages && !pump.closed)
+    g_main_context_iteration (NULL, TRUE);
+
+  elapsed = (gdouble)MAX (g_get_monotonic_time () - start, 1) / G_USEC_PER_SEC;
+
+  printf ("%s %7" G_GSIZE_FORMAT " bytes%s%s: %8.0f msgs/sec, %8.1f MB/sec\n",
+          from_client ? "client->server" : "server->client", size,
+          opt_tls ? ", tls" : "", opt_deflate ? ", deflate" : "",
+          pump.received / elapsed,
+          ((gdouble)pump.received * size) / elapsed / (1024 * 1024));
+
+  g_signal_handlers_disconnect_by_data (client, &pump);
+  g_signal_handlers_disconnect_by_data (server, &pump);
+  g_object_unref (client);
+  g_object_unref (server);
+  g_bytes_unref (pump.payload);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  GOptionContext *context;
+  GError *error = NULL;
+  gsize sizes[] = { 16, 125, 1024, 64 * 1024 };
+  gsize i;
+
+  static GOptionEntry entries[] = {
+    { "count", 'n', 0, G_OPTION_ARG_INT, &opt_count, "Number of times to unmask each payload", "count" },
+    { "size", 's', 0, G_OPTION_ARG_INT, &opt_size, "Only time a payload of this size", "bytes" },
+    { "messages", 'm', 0, G_OPTION_ARG_INT, &opt_messages, "Number of messages to send between peers", "count" },
+    { "tls", 0, 0, G_OPTION_ARG_NONE, &opt_tls, "Send messages over TLS", NULL },
+    { "cert", 0, 0, G_OPTION_ARG_FILENAME, &opt_cert, "Certificate and key for TLS", "file" },
+    { "deflate", 0, 0, G_OPTION_ARG_NONE, &opt_deflate, "Compress messages", NULL },
+    { "fragment", 0, 0, G_OPTION_ARG_INT, &opt_fragment, "Fragment messages into frames of this size", "bytes" },
+    { NULL }
+  };
+
+#if !GLIB_CHECK_VERSION(2,36,0)
+  g_type_init ();
+#endif
+
+  context = g_option_context_new (NULL);
+  g_option_context_add_main_entries (context, entries, NULL);
+  g_option_context_set_description (context, "Measure WebSocket unmasking and message speed\n");
+
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("bench-websocket: %s\n", error->message);
+      g_error_free (error);
+      return 2;
+    }
+
+  g_option_context_free (context);
+
+  if (opt_count < 1 || opt_size < 0 || opt_messages < 1 || opt_fragment < 0)
+    {
+      g_printerr ("bench-websocket: invalid arguments\n");
+      return 2;
+    }
+
+  if (!opt_cert)
+    opt_cert = g_strdup (SRCDIR "/src/ws/mock_cert");
+
+  if (opt_size > 0)
+    {
+      bench_mask (opt_size, 0);
+      bench_mask (opt_size, 3);
+      bench_pump (opt_size, TRUE);
+      bench_pump (opt_size, FALSE);
+    }
+  else
+    {
+      for (i = 0; i < G_N_ELEMENTS (sizes); i++)
+        {
+          bench_mask (sizes[i], 0);
+          bench_mask (sizes[i], 3);
+        }
+      for (i = 0; i < G_N_ELEMENTS (sizes); i++)
+        {
+          bench_pump (sizes[i], TRUE);
+          bench_pump (sizes[i], FALSE);
+        }
+    }
+
+  g_free (opt_cert);
+  return 0;
+}
@@ -35,6 +35,7 @@ typedef struct {
 typedef struct {
   WebSocketFlavor flavor;
   const gchar *flavor_name;
+  gboolean deflate;
 } FlavorFixture;
 
 static void
@@ -348,10 +349,16 @@ test_parse_headers_not_enough (void)
       "Header2:  field\r\n"
       "Head3:  Anothe";
 
+  GHashTable *headers = NULL;
   gssize ret;
 
   ret = web_socket_util_parse_headers (input, strlen (input), NULL);
   g_assert_cmpint (ret, ==, 0);
+
+  /* Nothing is returned until all the headers are there */
+  ret = web_socket_util_parse_headers (input, strlen (input), &headers);
+  g_assert_cmpint (ret, ==, 0);
+  g_assert (headers == NULL);
 }
 
 static void
@@ -434,6 +441,41 @@ test_header_empty (void)
   g_hash_table_unref (headers);
 }
 
+static void
+test_xor_mask (void)
+{
+  const guint8 mask[4] = { 0x12, 0x34, 0x56, 0x78 };
+  guint8 buffer[128];
+  guint8 expect[128];
+  gsize offset;
+  gsize len;
+  gsize n;
+
+  /* Every alignment and length around the word and vector sizes */
+  for (offset = 0; offset < 16; offset++)
+    {
+      for (len = 0; len + offset <= sizeof (buffer); len++)
+        {
+          for (n = 0; n < sizeof (buffer); n++)
+            buffer[n] = expect[n] = (guint8)(n * 7);
+          for (n = 0; n < len; n++)
+            expect[offset + n] ^= mask[n & 3];
+
+          _web_socket_xor_mask_rfc6455 (mask, buffer + offset, buffer + offset, len);
+          g_assert (memcmp (buffer, expect, sizeof (buffer)) == 0);
+
+          /* And moving the data down a byte while unmasking */
+          if (offset > 0)
+            {
+              for (n = 0; n < sizeof (buffer); n++)
+                buffer[n] = (guint8)(n * 7);
+              _web_socket_xor_mask_rfc6455 (mask, buffer + offset, buffer + offset - 1, len);
+              g_assert (memcmp (buffer + offset - 1, expect + offset, len) == 0);
+            }
+        }
+    }
+}
+
 static void
 create_iostream_pair (GIOStream **io1,
                       GIOStream **io2)
@@ -506,6 +548,11 @@ setup_pair (Test *test,
 
   test->server = web_socket_server_new_for_stream ("ws://localhost/unix", NULL, NULL, ios, NULL, NULL);
   test->client = client_new_for_stream_and_flavor (ioc, fixture->flavor);
+  if (fixture->deflate)
+    {
+      web_socket_connection_set_deflate (test->server, 128, FALSE);
+      web_socket_connection_set_deflate (test->client, 0, FALSE);
+    }
 
   g_signal_connect (test->server, "error", G_CALLBACK (on_error_not_reached), NULL);
 
@@ -670,6 +717,247 @@ test_send_big_packets (Test *test,
   g_bytes_unref (received);
 }
 
+static void
+on_message_collect (WebSocketConnection *ws,
+                    WebSocketDataType type,
+                    GBytes *message,
+                    gpointer user_data)
+{
+  GPtrArray *received = user_data;
+  g_ptr_array_add (received, g_bytes_ref (message));
+}
+
+static void
+test_send_burst (Test *test,
+                 gconstpointer data)
+{
+  GBytes *prefix;
+  GBytes *payload;
+  GPtrArray *received;
+  gsize budget;
+  gchar *expect;
+  gchar *text;
+  gint i;
+
+  received = g_ptr_array_new_with_free_func ((GDestroyNotify)g_bytes_unref);
+  g_signal_connect (test->client, "message", G_CALLBACK (on_message_collect), received);
+
+  WAIT_UNTIL (web_socket_connection_get_ready_state (test->server) != WEB_SOCKET_STATE_CONNECTING);
+  g_assert_cmpint (web_socket_connection_get_ready_state (test->server), ==, WEB_SOCKET_STATE_OPEN);
+
+  /* A tiny budget should still send a frame at a time */
+  budget = _web_socket_output_budget;
+  _web_socket_output_budget = 1;
+
+  prefix = g_bytes_new_static ("burst ", 6);
+  for (i = 0; i < 500; i++)
+    {
+      /* Then the default budget gathers the rest */
+      if (i == 250)
+        {
+          WAIT_UNTIL (received->len == 250);
+          _web_socket_output_budget = budget;
+        }
+
+      text = g_strdup_printf ("%d", i);
+      payload = g_bytes_new_take (text, strlen (text));
+      web_socket_connection_send (test->server, WEB_SOCKET_DATA_TEXT, prefix, payload);
+      g_bytes_unref (payload);
+    }
+  g_bytes_unref (prefix);
+
+  WAIT_UNTIL (received->len == 500);
+
+  for (i = 0; i < 500; i++)
+    {
+      expect = g_strdup_printf ("burst %d", i);
+      g_assert_cmpstr (g_bytes_get_data (received->pdata[i], NULL), ==, expect);
+      g_free (expect);
+    }
+
+  g_ptr_array_free (received, TRUE);
+}
+
+static void
+test_send_priority (Test *test,
+                    gconstpointer data)
+{
+  GPtrArray *received;
+  GBytes *payload;
+  gchar *text;
+  gint interactive = -1;
+  gint control = -1;
+  guint i;
+
+  received = g_ptr_array_new_with_free_func ((GDestroyNotify)g_bytes_unref);
+  g_signal_connect (test->client, "message", G_CALLBACK (on_message_collect), received);
+
+  WAIT_UNTIL (web_socket_connection_get_ready_state (test->server) != WEB_SOCKET_STATE_CONNECTING);
+  g_assert_cmpint (web_socket_connection_get_ready_state (test->server), ==, WEB_SOCKET_STATE_OPEN);
+
+  /* Lots of bulk, then one of each of the others */
+  text = g_strnfill (64 * 1024, 'b');
+  payload = g_bytes_new_take (text, strlen (text));
+  for (i = 0; i < 20; i++)
+    web_socket_connection_send_full (test->server, WEB_SOCKET_DATA_TEXT, NULL, payload,
+                                     WEB_SOCKET_PRIORITY_BULK);
+  g_bytes_unref (payload);
+
+  payload = g_bytes_new_static ("interactive", 11);
+  web_socket_connection_send (test->server, WEB_SOCKET_DATA_TEXT, NULL, payload);
+  g_bytes_unref (payload);
+
+  payload = g_bytes_new_static ("control", 7);
+  web_socket_connection_send_full (test->server, WEB_SOCKET_DATA_TEXT, NULL, payload,
+                                   WEB_SOCKET_PRIORITY_CONTROL);
+  g_bytes_unref (payload);
+
+  WAIT_UNTIL (received->len == 22);
+
+  for (i = 0; i < received->len; i++)
+    {
+      text = (gchar *)g_bytes_get_data (received->pdata[i], NULL);
+      if (g_str_equal (text, "interactive"))
+        interactive = i;
+      else if (g_str_equal (text, "control"))
+        control = i;
+    }
+
+  /* Neither waited for all the bulk to go */
+  g_assert_cmpint (control, >=, 0);
+  g_assert_cmpint (control, <, 3);
+  g_assert_cmpint (interactive, >=, 0);
+  g_assert_cmpint (interactive, <, 5);
+
+  g_ptr_array_free (received, TRUE);
+}
+
+static void
+test_send_fragmented (Test *test,
+                      gconstpointer data)
+{
+  GPtrArray *to_server;
+  GPtrArray *to_client;
+  GBytes *prefix;
+  GBytes *payload;
+  GString *expect;
+  const gchar *text;
+  gsize len;
+  gint i;
+
+  to_server = g_ptr_array_new_with_free_func ((GDestroyNotify)g_bytes_unref);
+  g_signal_connect (test->server, "message", G_CALLBACK (on_message_collect), to_server);
+  to_client = g_ptr_array_new_with_free_func ((GDestroyNotify)g_bytes_unref);
+  g_signal_connect (test->client, "message", G_CALLBACK (on_message_collect), to_client);
+
+  WAIT_UNTIL (web_socket_connection_get_ready_state (test->client) != WEB_SOCKET_STATE_CONNECTING);
+  g_assert_cmpint (web_socket_connection_get_ready_state (test->client), ==, WEB_SOCKET_STATE_OPEN);
+
+  web_socket_connection_set_fragment_size (test->client, 100);
+  web_socket_connection_set_fragment_size (test->server, 100);
+
+  /* Multibyte characters land on the fragment boundaries */
+  expect = g_string_new ("");
+  for (i = 0; i < 1000; i++)
+    g_string_append (expect, "\xc3\xbc");
+
+  prefix = g_bytes_new_static ("prefix\n", 7);
+  payload = g_bytes_new_static (expect->str, expect->len);
+  web_socket_connection_send (test->client, WEB_SOCKET_DATA_TEXT, prefix, payload);
+  web_socket_connection_send (test->server, WEB_SOCKET_DATA_TEXT, NULL, payload);
+  g_bytes_unref (payload);
+  g_bytes_unref (prefix);
+
+  WAIT_UNTIL (to_server->len == 1 && to_client->len == 1);
+
+  text = g_bytes_get_data (to_client->pdata[0], &len);
+  g_assert_cmpuint (len, ==, expect->len);
+  g_assert (memcmp (text, expect->str, len) == 0);
+
+  g_string_prepend (expect, "prefix\n");
+  text = g_bytes_get_data (to_server->pdata[0], &len);
+  g_assert_cmpuint (len, ==, expect->len);
+  g_assert (memcmp (text, expect->str, len) == 0);
+
+  g_string_free (expect, TRUE);
+  g_ptr_array_free (to_server, TRUE);
+  g_ptr_array_free (to_client, TRUE);
+}
+
+static void
+on_notify_count (GObject *object,
+                 GParamSpec *pspec,
+                 gpointer user_data)
+{
+  gint *count = user_data;
+  (*count)++;
+}
+
+static void
+test_buffered_amount (Test *test,
+                      gconstpointer data)
+{
+  GBytes *payload;
+  gint notified = 0;
+  gchar *text;
+
+  WAIT_UNTIL (web_socket_connection_get_ready_state (test->server) != WEB_SOCKET_STATE_CONNECTING);
+  g_assert_cmpint (web_socket_connection_get_ready_state (test->server), ==, WEB_SOCKET_STATE_OPEN);
+
+  g_signal_connect (test->server, "notify::buffered-amount",
+                    G_CALLBACK (on_notify_count), &notified);
+
+  text = g_strnfill (256 * 1024, 'x');
+  payload = g_bytes_new_take (text, strlen (text));
+  web_socket_connection_send (test->server, WEB_SOCKET_DATA_TEXT, NULL, payload);
+  g_bytes_unref (payload);
+
+  /* Queued, and then drained, with notifications both ways */
+  g_assert_cmpint (notified, ==, 1);
+  WAIT_UNTIL (web_socket_connection_get_buffered_amount (test->server) == 0);
+  g_assert_cmpint (notified, >=, 2);
+}
+
+static void
+test_receive_retained (Test *test,
+                       gconstpointer data)
+{
+  GPtrArray *received;
+  GBytes *payload;
+  const gchar *text;
+  gchar *expect;
+  gsize len;
+  gint i;
+
+  received = g_ptr_array_new_with_free_func ((GDestroyNotify)g_bytes_unref);
+  g_signal_connect (test->server, "message", G_CALLBACK (on_message_collect), received);
+
+  WAIT_UNTIL (web_socket_connection_get_ready_state (test->client) != WEB_SOCKET_STATE_CONNECTING);
+  g_assert_cmpint (web_socket_connection_get_ready_state (test->client), ==, WEB_SOCKET_STATE_OPEN);
+
+  /* Many of these arrive in one read and are held past it */
+  for (i = 0; i < 500; i++)
+    {
+      expect = g_strdup_printf ("retained %d", i);
+      payload = g_bytes_new_take (expect, strlen (expect));
+      web_socket_connection_send (test->client, WEB_SOCKET_DATA_TEXT, NULL, payload);
+      g_bytes_unref (payload);
+    }
+
+  WAIT_UNTIL (received->len == 500);
+
+  for (i = 0; i < 500; i++)
+    {
+      expect = g_strdup_printf ("retained %d", i);
+      text = g_bytes_get_data (received->pdata[i], &len);
+      g_assert_cmpuint (len, ==, strlen (expect));
+      g_assert_cmpstr (text, ==, expect);
+      g_free (expect);
+    }
+
+  g_ptr_array_free (received, TRUE);
+}
+
 static void
 test_send_prefixed (Test *test,
                     gconstpointer data)
@@ -1098,6 +1386,116 @@ test_receive_fragmented (void)
   g_object_unref (io_b);
 }
 
+static void
+test_deflate_negotiate (void)
+{
+  WebSocketConnection *server;
+  GIOStream *io_a;
+  GIOStream *io_b;
+  gchar *response;
+  guint logid;
+
+  logid = g_log_set_handler (G_LOG_DOMAIN, G_LOG_LEVEL_MESSAGE, null_log_handler, NULL);
+
+  /* The handshake only runs once the main loop does */
+  create_iostream_pair (&io_a, &io_b);
+  server = web_socket_server_new_for_stream ("ws://localhost/unix", NULL, NULL, io_a, NULL, NULL);
+
+  /* Off unless asked for */
+  g_assert (_web_socket_connection_choose_deflate (server, "permessage-deflate") == NULL);
+  web_socket_connection_set_deflate (server, 128, FALSE);
+
+  g_assert (_web_socket_connection_choose_deflate (server, NULL) == NULL);
+  g_assert (_web_socket_connection_choose_deflate (server, "x-webkit-deflate-frame") == NULL);
+  g_assert (_web_socket_connection_choose_deflate (server, "permessage-deflate; unknown") == NULL);
+  g_assert (_web_socket_connection_choose_deflate (server, "permessage-deflate; server_max_window_bits") == NULL);
+  g_assert (_web_socket_connection_choose_deflate (server, "permessage-deflate; server_max_window_bits=16") == NULL);
+  g_assert (_web_socket_connection_choose_deflate (server, "permessage-deflate; server_max_window_bits=10") == NULL);
+  g_assert (_web_socket_connection_choose_deflate (server, "permessage-deflate; server_no_context_takeover=1") == NULL);
+  g_assert (_web_socket_connection_choose_deflate (server,
+                "permessage-deflate; client_no_context_takeover; client_no_context_takeover") == NULL);
+
+  response = _web_socket_connection_choose_deflate (server, "permessage-deflate");
+  g_assert_cmpstr (response, ==, "permessage-deflate");
+  g_free (response);
+
+  response = _web_socket_connection_choose_deflate (server, "permessage-deflate; client_max_window_bits");
+  g_assert_cmpstr (response, ==, "permessage-deflate");
+  g_free (response);
+
+  /* Falls back to the second offer */
+  response = _web_socket_connection_choose_deflate (server,
+                 "permessage-deflate; server_max_window_bits=10, "
+                 "permessage-deflate; server_no_context_takeover; client_no_context_takeover");
+  g_assert_cmpstr (response, ==, "permessage-deflate; server_no_context_takeover; client_no_context_takeover");
+  g_free (response);
+
+  response = _web_socket_connection_choose_deflate (server, "permessage-deflate; server_max_window_bits=\"15\"");
+  g_assert_cmpstr (response, ==, "permessage-deflate; server_max_window_bits=15");
+  g_free (response);
+
+  /* Asking for no context takeover applies to both directions */
+  web_socket_connection_set_deflate (server, 64, TRUE);
+  response = _web_socket_connection_choose_deflate (server, "permessage-deflate");
+  g_assert_cmpstr (response, ==, "permessage-deflate; server_no_context_takeover; client_no_context_takeover");
+  g_free (response);
+
+  web_socket_connection_set_deflate (server, -1, FALSE);
+  g_assert (_web_socket_connection_choose_deflate (server, "permessage-deflate") == NULL);
+
+  g_object_unref (server);
+  g_object_unref (io_a);
+  g_object_unref (io_b);
+
+  g_log_remove_handler (G_LOG_DOMAIN, logid);
+}
+
+static void
+test_deflate_context_takeover (void)
+{
+  WebSocketConnection *client;
+  WebSocketConnection *server;
+  GBytes *received = NULL;
+  GBytes *sent;
+  GIOStream *io_a;
+  GIOStream *io_b;
+  gint i;
+
+  create_iostream_pair (&io_a, &io_b);
+  server = web_socket_server_new_for_stream ("ws://localhost/unix", NULL, NULL, io_a, NULL, NULL);
+  client = web_socket_client_new_for_stream ("ws://localhost/unix", NULL, NULL, io_b);
+  web_socket_connection_set_deflate (server, 0, TRUE);
+  web_socket_connection_set_deflate (client, 0, FALSE);
+
+  g_signal_connect (client, "error", G_CALLBACK (on_error_not_reached), NULL);
+  g_signal_connect (server, "error", G_CALLBACK (on_error_not_reached), NULL);
+  g_signal_connect (client, "message", G_CALLBACK (on_text_message), &received);
+  g_signal_connect (server, "message", G_CALLBACK (on_text_message), &received);
+
+  WAIT_UNTIL (web_socket_connection_get_ready_state (client) != WEB_SOCKET_STATE_CONNECTING);
+  g_assert_cmpint (web_socket_connection_get_ready_state (client), ==, WEB_SOCKET_STATE_OPEN);
+  g_assert_cmpstr (g_hash_table_lookup (web_socket_client_get_headers (WEB_SOCKET_CLIENT (client)),
+                                        "Sec-WebSocket-Extensions"), ==,
+                   "permessage-deflate; server_no_context_takeover; client_no_context_takeover");
+
+  /* The same message several times in both directions */
+  sent = g_bytes_new_static ("the quick brown fox jumps over the lazy dog", 43);
+  for (i = 0; i < 6; i++)
+    {
+      web_socket_connection_send (i % 2 ? client : server, WEB_SOCKET_DATA_TEXT, NULL, sent);
+      WAIT_UNTIL (received != NULL);
+      g_assert (g_bytes_equal (sent, received));
+      g_bytes_unref (received);
+      received = NULL;
+    }
+  g_bytes_unref (sent);
+
+  g_object_unref (client);
+  g_object_unref (server);
+  g_object_unref (io_a);
+  g_object_unref (io_b);
+}
+
 static gpointer
 client_thread (gpointer data)
 {
@@ -1414,6 +1812,7 @@ main (int argc,
   FlavorFixture fixtures[] = {
       { WEB_SOCKET_FLAVOR_RFC6455, "rfc6455" },
       { WEB_SOCKET_FLAVOR_HIXIE76, "hixie76" },
+      { WEB_SOCKET_FLAVOR_RFC6455, "rfc6455-deflate", TRUE },
   };
 
   struct {
@@ -1425,6 +1824,11 @@ main (int argc,
       { test_send_server_to_client, "send-server-to-client" },
       { test_send_big_packets, "send-big-packets" },
       { test_send_prefixed, "send-prefixed" },
+      { test_send_burst, "send-burst" },
+      { test_receive_retained, "receive-retained" },
+      { test_buffered_amount, "buffered-amount" },
+      { test_send_priority, "send-priority" },
+      { test_send_fragmented, "send-fragmented" },
       { test_send_bad_data, "send-bad-data" },
       { test_protocol_negotiate, "protocol-negotiate" },
       { test_protocol_mismatch, "protocol-mismatch" },
@@ -1468,6 +1872,7 @@ main (int argc,
   g_test_add_func ("/web-socket/header-equals", test_header_equals);
   g_test_add_func ("/web-socket/header-contains", test_header_contains);
   g_test_add_func ("/web-socket/header-empty", test_header_empty);
+  g_test_add_func ("/web-socket/xor-mask", test_xor_mask);
 
   for (i = 0; i < G_N_ELEMENTS (fixtures); i++)
     {
@@ -1484,6 +1889,8 @@ main (int argc,
     g_test_add_func ("/web-socket/close-after-timeout", test_close_after_timeout);
   g_test_add_func ("/web-socket/receive-fragmented", test_receive_fragmented);
   g_test_add_func ("/web-socket/handshake-with-buffer-headers", test_handshake_with_buffer_and_headers);
+  g_test_add_func ("/web-socket/deflate-negotiate", test_deflate_negotiate);
+  g_test_add_func ("/web-socket/deflate-context-takeover", test_deflate_context_takeover);
 
   g_test_add ("/web-socket/message-after-closing", Test, fixtures,
               setup_pair, test_message_after_closing, teardown);
@@ -288,73 +288,90 @@ web_socket_util_new_headers (void)
  * Return value: zero if truncated, negative if fails, or number of
  *               characters parsed
  */
+static const gchar *
+strip_header_value (const gchar *beg,
+                    const gchar **end)
+{
+  while (beg < *end && g_ascii_isspace (beg[0]))
+    beg++;
+  while (*end > beg && g_ascii_isspace ((*end)[-1]))
+    (*end)--;
+  return beg;
+}
+
 gssize
 web_socket_util_parse_headers (const gchar *data,
                                gsize length,
                                GHashTable **headers)
 {
   GHashTable *parsed_headers;
+  const gchar *name_end;
+  const gchar *value_end;
+  const gchar *name;
+  const gchar *value;
   const gchar *line;
   const gchar *colon;
-  gsize consumed = 0;
-  gboolean end = FALSE;
-  gsize line_len;
-  gchar *name;
-  gchar *value;
+  const gchar *pos;
+  gsize remaining;
+  gssize consumed = 0;
 
-  parsed_headers = web_socket_util_new_headers ();
-
-  while (!end)
+  /*
+   * Check that all the headers are present and valid before allocating
+   * anything. Callers call this again each time more data arrives, and
+   * some only want to know how long the headers are.
+   */
+  pos = data;
+  remaining = length;
+  for (;;)
     {
-      line = memchr (data, '\n', length);
+      line = memchr (pos, '\n', remaining);
 
       /* No line ending: need more data */
       if (line == NULL)
-        {
-          consumed = 0;
-          break;
-        }
+        return 0;
 
       line++;
-      line_len = (line - data);
 
       /* An empty line, all done */
-      if ((data[0] == '\r' && data[1] == '\n') || data[0] == '\n')
+      if ((pos[0] == '\r' && pos[1] == '\n') || pos[0] == '\n')
         {
-          end = TRUE;
+          consumed = line - data;
+          break;
         }
 
-      /* A header line */
-      else
+      colon = memchr (pos, ':', line - pos);
+      if (!colon)
         {
-          colon = memchr (data, ':', length);
-          if (!colon || colon >= line)
-            {
-              g_message ("received invalid header line: %.*s", (gint)line_len, data);
-              consumed = -1;
-              break;
-            }
-
-          name = g_strndup (data, colon - data);
-          g_strstrip (name);
-          value = g_strndup (colon + 1, line - (colon + 1));
-          g_strstrip (value);
-          g_hash_table_insert (parsed_headers, name, value);
+          g_message ("received invalid header line: %.*s", (gint)(line - pos), pos);
+          return -1;
         }
 
-      consumed += line_len;
-      data += line_len;
-      length -= line_len;
+      remaining -= line - pos;
+      pos = line;
     }
 
-  if (consumed > 0)
+  if (!headers)
+    return consumed;
+
+  parsed_headers = web_socket_util_new_headers ();
+
+  for (pos = data; pos < data + consumed; pos = line)
     {
-      if (headers)
-          *headers = g_hash_table_ref (parsed_headers);
+      line = memchr (pos, '\n', (data + consumed) - pos) + 1;
+      colon = memchr (pos, ':', line - pos);
+      if (!colon)
+        break;
+
+      name_end = colon;
+      name = strip_header_value (pos, &name_end);
+      value_end = line;
+      value = strip_header_value (colon + 1, &value_end);
+
+      g_hash_table_insert (parsed_headers, g_strndup (name, name_end - name),
+                           g_strndup (value, value_end - value));
     }
 
-  g_hash_table_unref (parsed_headers);
-
+  *headers = parsed_headers;
   return consumed;
 }
 
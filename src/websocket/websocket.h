@@ -65,6 +65,17 @@ typedef enum {
   WEB_SOCKET_CLOSE_TLS_HANDSHAKE = 1015,
 } WebSocketCloseCodes;
 
+/*
+ * Messages of a higher priority go out ahead of lower ones already
+ * queued. Control messages always go first, and the other two share
+ * what's left, with interactive messages getting the larger part.
+ */
+typedef enum {
+  WEB_SOCKET_PRIORITY_CONTROL = 0,
+  WEB_SOCKET_PRIORITY_INTERACTIVE = 1,
+  WEB_SOCKET_PRIORITY_BULK = 2,
+} WebSocketPriority;
+
 typedef enum {
   WEB_SOCKET_STATE_CONNECTING = 0,
   WEB_SOCKET_STATE_OPEN = 1,
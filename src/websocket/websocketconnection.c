@@ -22,8 +22,18 @@
 #include "websocket.h"
 #include "websocketprivate.h"
 
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <errno.h>
 #include <string.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 /*
  * SECTION:websocketconnection
  * @title: WebSocketConnection
@@ -97,9 +107,44 @@ enum {
 
 static guint signals[NUM_SIGNALS] = { 0, };
 
+/*
+ * Messages for every frame sent and received. These are only formatted
+ * when debug messages for this domain are enabled, which is decided once.
+ */
+static gboolean
+frame_debug_enabled (void)
+{
+  static gsize initialized = 0;
+  static gboolean enabled = FALSE;
+  const gchar *domains;
+
+  if (g_once_init_enter (&initialized))
+    {
+      domains = g_getenv ("G_MESSAGES_DEBUG");
+      enabled = domains && (strstr (domains, "all") || strstr (domains, G_LOG_DOMAIN));
+      g_once_init_leave (&initialized, 1);
+    }
+
+  return enabled;
+}
+
+#define frame_debug(...) \
+  G_STMT_START { if (G_UNLIKELY (frame_debug_enabled ())) g_debug (__VA_ARGS__); } G_STMT_END
+
+/*
+ * A frame is written out as the header followed by the prefix and
+ * payload, these are refs to the caller's data rather than copies.
+ */
+typedef struct _SharedInput SharedInput;
+
 typedef struct {
-  GBytes *data;
+  guint8 header[14];
+  gsize header_len;
+  GBytes *prefix;
+  GBytes *payload;
   gboolean last;
+  gboolean more;
+  gsize len;
   gsize sent;
   gsize amount;
 } Frame;
@@ -138,18 +183,58 @@ struct _WebSocketConnectionPrivate
   GPollableInputStream *input;
   GSource *input_source;
   GByteArray *incoming;
+  gsize incoming_offset;
+  SharedInput *incoming_shared;
+  gsize read_size;
 
   GPollableOutputStream *output;
   GSource *output_source;
   GQueue outgoing;
+  gsize buffered_amount;
+
+  /* Frames waiting to be scheduled onto outgoing, by priority */
+  GQueue pending[3];
+  gsize deficit[3];
+  WebSocketPriority turn;
+
+  /* Set while the rest of a fragmented message is still pending */
+  gboolean continuing;
+  WebSocketPriority continued;
+  gsize fragment_size;
+
+  /* Set when we can sendmsg() directly on the socket */
+  gint output_fd;
 
   /* Current message being assembled */
   guint8 message_opcode;
+  gboolean message_compressed;
   GByteArray *message_data;
+
+  /* permessage-deflate, the converters are set once negotiated */
+  gint deflate_threshold;
+  gboolean deflate_no_context_takeover;
+  GConverter *deflate;
+  GConverter *inflate;
+  gboolean deflate_reset;
 };
 
 #define MAX_PAYLOAD   128 * 1024
 
+#define DEFLATE_CHUNK 4096
+
+/* Reads grow between these sizes under sustained input */
+#define INPUT_READ_MIN   (16 * 1024)
+#define INPUT_READ_MAX   (256 * 1024)
+
+/* Room for the header, prefix and payload of 16 frames */
+#define OUTPUT_IOV_MAX 48
+
+/* Bytes each of the shared priorities may send per turn */
+#define INTERACTIVE_QUANTUM (64 * 1024)
+#define BULK_QUANTUM (16 * 1024)
+
+gsize _web_socket_output_budget = 64 * 1024;
+
 G_DEFINE_ABSTRACT_TYPE (WebSocketConnection, web_socket_connection, G_TYPE_OBJECT);
 
 static void
@@ -158,21 +243,34 @@ frame_free (gpointer data)
   Frame *frame = data;
   if (frame)
     {
-      g_bytes_unref (frame->data);
+      if (frame->prefix)
+        g_bytes_unref (frame->prefix);
+      g_bytes_unref (frame->payload);
       g_slice_free (Frame, frame);
     }
 }
 
+static void   queue_frame   (WebSocketConnection *self,
+                             WebSocketQueueFlags flags,
+                             Frame *frame);
+
 static void
 web_socket_connection_init (WebSocketConnection *self)
 {
   WebSocketConnectionPrivate *pv;
+  guint i;
 
   pv = self->pv = G_TYPE_INSTANCE_GET_PRIVATE (self, WEB_SOCKET_TYPE_CONNECTION,
                                                WebSocketConnectionPrivate);
 
   g_queue_init (&pv->outgoing);
+  for (i = 0; i < G_N_ELEMENTS (pv->pending); i++)
+    g_queue_init (&pv->pending[i]);
+  pv->turn = WEB_SOCKET_PRIORITY_INTERACTIVE;
   pv->main_context = g_main_context_ref_thread_default ();
+  pv->deflate_threshold = -1;
+  pv->output_fd = -1;
+  pv->read_size = INPUT_READ_MIN;
 }
 
 static void
@@ -338,20 +436,160 @@ close_io_after_timeout (WebSocketConnection *self)
   g_source_attach (pv->close_timeout, pv->main_context);
 }
 
-static void
-xor_with_mask_rfc6455 (const guint8 *mask,
-                       guint8 *data,
-                       gsize len)
+/*
+ * The @dest may be the same as @src, or come before it, in which case
+ * the data moves down as it is unmasked. The @mask may overlap either.
+ */
+void
+_web_socket_xor_mask_rfc6455 (const guint8 *mask,
+                              const guint8 *src,
+                              guint8 *dest,
+                              gsize len)
+{
+  guint8 shifted[16];
+  guint8 key[4];
+  guint64 word;
+  guint64 mask64;
+  gsize n = 0;
+  gint i;
+
+  g_assert (dest <= src);
+  memcpy (key, mask, sizeof (key));
+
+  /* Single bytes up until the data is word aligned */
+  while (n < len && ((gsize)(src + n) & 7) != 0)
+    {
+      dest[n] = src[n] ^ key[n & 3];
+      n++;
+    }
+
+  if (len - n >= 8)
+    {
+      /* The mask as it lines up with the data from here on */
+      for (i = 0; i < 16; i++)
+        shifted[i] = key[(n + i) & 3];
+
+#if defined(__SSE2__)
+      {
+        __m128i vmask = _mm_loadu_si128 ((const __m128i *)shifted);
+        for (; n + 16 <= len; n += 16)
+          {
+            __m128i value = _mm_loadu_si128 ((const __m128i *)(src + n));
+            _mm_storeu_si128 ((__m128i *)(dest + n), _mm_xor_si128 (value, vmask));
+          }
+      }
+#elif defined(__ARM_NEON)
+      {
+        uint8x16_t vmask = vld1q_u8 (shifted);
+        for (; n + 16 <= len; n += 16)
+          vst1q_u8 (dest + n, veorq_u8 (vld1q_u8 (src + n), vmask));
+      }
+#endif
+
+      /* Steps of 16 keep both the alignment and the mask phase */
+      memcpy (&mask64, shifted, sizeof (mask64));
+      for (; n + 8 <= len; n += 8)
+        {
+          memcpy (&word, src + n, sizeof (word));
+          word ^= mask64;
+          memcpy (dest + n, &word, sizeof (word));
+        }
+    }
+
+  /* And whatever is left over */
+  for (; n < len; n++)
+    dest[n] = src[n] ^ key[n & 3];
+}
+
+static GConverterResult
+convert_all (GConverter *converter,
+             const guint8 *data,
+             gsize len,
+             GConverterFlags flags,
+             GByteArray *out,
+             gsize max_len,
+             GError **error)
 {
-  gsize n;
+  GConverterResult res;
+  gsize bytes_read;
+  gsize bytes_written;
+  gsize offset;
+  gsize avail;
+
+  for (;;)
+    {
+      /* Without a flush, we're done as soon as the input is consumed */
+      if (len == 0 && !(flags & G_CONVERTER_FLUSH))
+        return G_CONVERTER_CONVERTED;
+
+      /* Grow the output geometrically */
+      avail = MAX (MAX (len, out->len), DEFLATE_CHUNK);
+      if (max_len > 0)
+        avail = MIN (avail, (max_len + 1) - out->len);
+
+      offset = out->len;
+      g_byte_array_set_size (out, offset + avail);
+      bytes_read = bytes_written = 0;
+      res = g_converter_convert (converter, data, len, out->data + offset, avail,
+                                 flags, &bytes_read, &bytes_written, error);
+      g_byte_array_set_size (out, offset + bytes_written);
+
+      if (res == G_CONVERTER_ERROR)
+        return res;
+
+      if (max_len > 0 && out->len > max_len)
+        {
+          g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NO_SPACE,
+                               "Decompressed message is too large");
+          return G_CONVERTER_ERROR;
+        }
+
+      data += bytes_read;
+      len -= bytes_read;
+
+      if (res == G_CONVERTER_FLUSHED || res == G_CONVERTER_FINISHED)
+        return res;
+    }
+}
+
+static GByteArray *
+deflate_message (WebSocketConnection *self,
+                 const guint8 *prefix,
+                 gsize prefix_len,
+                 const guint8 *payload,
+                 gsize payload_len)
+{
+  WebSocketConnectionPrivate *pv = self->pv;
+  GError *error = NULL;
+  GByteArray *bytes;
+
+  bytes = g_byte_array_sized_new ((prefix_len + payload_len) / 2 + 16);
+
+  if (convert_all (pv->deflate, prefix, prefix_len, G_CONVERTER_NO_FLAGS, bytes, 0, &error) == G_CONVERTER_ERROR ||
+      convert_all (pv->deflate, payload, payload_len, G_CONVERTER_FLUSH, bytes, 0, &error) == G_CONVERTER_ERROR)
+    {
+      /* The peer hasn't seen any of this, so starting over is safe */
+      g_message ("couldn't compress WebSocket message: %s", error->message);
+      g_error_free (error);
+      g_converter_reset (pv->deflate);
+      g_byte_array_unref (bytes);
+      return NULL;
+    }
+
+  /* RFC 7692: strip the empty block that the sync flush appends */
+  g_assert (bytes->len >= 4);
+  g_assert (memcmp (bytes->data + bytes->len - 4, "\x00\x00\xff\xff", 4) == 0);
+  g_byte_array_set_size (bytes, bytes->len - 4);
 
-  /* Do the masking */
-  for (n = 0; n < len; n++)
-    data[n] ^= mask[n & 3];
+  if (pv->deflate_reset)
+    g_converter_reset (pv->deflate);
+
+  return bytes;
 }
 
 static void
 send_text_hixie76 (WebSocketConnection *self,
+                   WebSocketQueueFlags flags,
                    const guint8 *prefix,
                    gsize prefix_len,
                    const guint8 *payload,
@@ -370,36 +608,113 @@ send_text_hixie76 (WebSocketConnection *self,
   g_byte_array_append (bytes, &bff, 1);
 
   frame_len = bytes->len;
-  _web_socket_connection_queue (self, WEB_SOCKET_QUEUE_NORMAL,
+  _web_socket_connection_queue (self, flags,
                                 g_byte_array_free (bytes, FALSE), frame_len, payload_len);
-  g_debug ("queued hixie76 text frame of len %u", (guint) frame_len);
+  frame_debug ("queued hixie76 text frame of len %u", (guint) frame_len);
+}
+
+static GByteArray *
+join_message (GBytes *prefix,
+              gsize prefix_len,
+              GBytes *payload,
+              gsize payload_len)
+{
+  GByteArray *bytes;
+
+  bytes = g_byte_array_sized_new (prefix_len + payload_len);
+  if (prefix)
+    g_byte_array_append (bytes, g_bytes_get_data (prefix, NULL), prefix_len);
+  g_byte_array_append (bytes, g_bytes_get_data (payload, NULL), payload_len);
+  return bytes;
+}
+
+static void
+frame_header_rfc6455 (Frame *frame,
+                      guint8 first,
+                      guint64 size)
+{
+  guint8 *outer = frame->header;
+
+  outer[0] = first;
+  if (size < 126)
+    {
+      outer[1] = (0xFF & size); /* mask | 7-bit-len */
+      frame->header_len = 2;
+    }
+  else if (size < 65536)
+    {
+      outer[1] = 126; /* mask | 16-bit-len */
+      outer[2] = (size >> 8) & 0xFF;
+      outer[3] = (size >> 0) & 0xFF;
+      frame->header_len = 4;
+    }
+  else
+    {
+      outer[1] = 127; /* mask | 64-bit-len */
+      outer[2] = (size >> 56) & 0xFF;
+      outer[3] = (size >> 48) & 0xFF;
+      outer[4] = (size >> 40) & 0xFF;
+      outer[5] = (size >> 32) & 0xFF;
+      outer[6] = (size >> 24) & 0xFF;
+      outer[7] = (size >> 16) & 0xFF;
+      outer[8] = (size >> 8) & 0xFF;
+      outer[9] = (size >> 0) & 0xFF;
+      frame->header_len = 10;
+    }
+}
+
+static GBytes *
+slice_bytes (GBytes *bytes,
+             gsize offset,
+             gsize len)
+{
+  if (offset == 0 && len == g_bytes_get_size (bytes))
+    return g_bytes_ref (bytes);
+  return g_bytes_new_from_bytes (bytes, offset, len);
+}
+
+static guint8
+message_byte (GBytes *prefix,
+              gsize prefix_len,
+              GBytes *payload,
+              gsize offset)
+{
+  if (offset < prefix_len)
+    return ((const guint8 *)g_bytes_get_data (prefix, NULL))[offset];
+  return ((const guint8 *)g_bytes_get_data (payload, NULL))[offset - prefix_len];
 }
 
 static void
 send_prefixed_message_rfc6455 (WebSocketConnection *self,
                                WebSocketQueueFlags flags,
                                guint8 opcode,
-                               const guint8 *prefix,
-                               gsize prefix_len,
-                               const guint8 *payload,
-                               gsize payload_len)
+                               GBytes *prefix,
+                               GBytes *payload)
 {
+  WebSocketConnectionPrivate *pv = self->pv;
+  GByteArray *bytes = NULL;
+  gboolean compressed = FALSE;
+  gsize prefix_len = 0;
+  gsize payload_len;
   gsize amount;
-  GByteArray *bytes;
-  gsize frame_len;
-  guint8 *outer;
-  guint8 *mask = 0;
-  guint8 *at;
+  gsize accounted;
+  Frame *frame;
+  guint8 first;
+  guint8 *mask;
+  gsize offset;
+  gsize size;
+  gsize skip;
+  gsize part;
+  gsize max;
   gsize len;
-  guint64 size;
+
+  if (prefix)
+    prefix_len = g_bytes_get_size (prefix);
+  payload_len = g_bytes_get_size (payload);
 
   len = payload_len + prefix_len;
   amount = len;
 
-  bytes = g_byte_array_sized_new (14 + len);
-  outer = bytes->data;
-  outer[0] = 0x80 | opcode;
-
   /* If control message, truncate payload */
   if (opcode & 0x08)
     {
@@ -410,62 +725,116 @@ send_prefixed_message_rfc6455 (WebSocketConnection *self,
               prefix_len = 125;
           payload_len = 125 - prefix_len;
           len = 125;
+          bytes = join_message (prefix, prefix_len, payload, payload_len);
         }
 
       /* Buffered amount of bytes is zero for control messages */
       amount = 0;
     }
 
-  size = len;
-  if (size < 126)
+  /* Control messages are never compressed */
+  else if (pv->deflate && len >= (gsize)pv->deflate_threshold)
     {
-      outer[1] = (0xFF & size); /* mask | 7-bit-len */
-      bytes->len = 2;
+      bytes = deflate_message (self,
+                               prefix ? g_bytes_get_data (prefix, NULL) : NULL, prefix_len,
+                               g_bytes_get_data (payload, NULL), payload_len);
+      if (bytes)
+        {
+          compressed = TRUE;
+          len = bytes->len;
+        }
     }
-  else if (size < 65536)
+
+  /* Data that had to change on the way out replaces prefix and payload */
+  if (bytes)
     {
-      outer[1] = 126; /* mask | 16-bit-len */
-      outer[2] = (size >> 8) & 0xFF;
-      outer[3] = (size >> 0) & 0xFF;
-      bytes->len = 4;
+      g_assert (bytes->len == len);
+      payload = g_byte_array_free_to_bytes (bytes);
+      prefix = NULL;
+      prefix_len = 0;
     }
   else
     {
-      outer[1] = 127; /* mask | 64-bit-len */
-      outer[2] = (size >> 56) & 0xFF;
-      outer[3] = (size >> 48) & 0xFF;
-      outer[4] = (size >> 40) & 0xFF;
-      outer[5] = (size >> 32) & 0xFF;
-      outer[6] = (size >> 24) & 0xFF;
-      outer[7] = (size >> 16) & 0xFF;
-      outer[8] = (size >> 8) & 0xFF;
-      outer[9] = (size >> 0) & 0xFF;
-      bytes->len = 10;
+      g_bytes_ref (payload);
     }
 
   /*
-   * The server side doesn't need to mask, so we don't. There's
-   * probably a client somewhere that's not expecting it.
+   * Large data messages go out as fragments, so that control frames such
+   * as pongs and close can be sent between them. Control frames themselves
+   * can't be fragmented.
    */
-  if (!self->pv->server_side)
+  max = len;
+  if (!(opcode & 0x08) && pv->fragment_size > 0 && len > pv->fragment_size)
+    max = pv->fragment_size;
+
+  offset = 0;
+  accounted = 0;
+  do
     {
-      outer[1] |= 0x80;
-      mask = outer + bytes->len;
-      * ((guint32 *)mask) = g_random_int ();
-      bytes->len += 4;
-    }
+      size = MIN (max, len - offset);
 
-  at = bytes->data + bytes->len;
-  g_byte_array_append (bytes, prefix, prefix_len);
-  g_byte_array_append (bytes, payload, payload_len);
+      /* Don't split a character, each text fragment is checked to be UTF-8 */
+      if (opcode == 0x01 && !compressed)
+        {
+          while (size > 1 && offset + size < len &&
+                 (message_byte (prefix, prefix_len, payload, offset + size) & 0xC0) == 0x80)
+            size--;
+        }
 
-  if (!self->pv->server_side)
-    xor_with_mask_rfc6455 (mask, at, len);
+      /* Only the first fragment has the opcode and RSV1, the last has FIN */
+      first = 0x00;
+      if (offset == 0)
+        first = opcode | (compressed ? 0x40 : 0x00);
+      if (offset + size == len)
+        first |= 0x80;
 
-  frame_len = bytes->len;
-  _web_socket_connection_queue (self, flags, g_byte_array_free (bytes, FALSE),
-                                frame_len, amount);
-  g_debug ("queued rfc6455 %d frame of len %u", (gint)opcode, (guint)frame_len);
+      frame = g_slice_new0 (Frame);
+      frame_header_rfc6455 (frame, first, size);
+      frame->more = (offset + size < len);
+
+      /* This fragment's part of the prefix, then of the payload */
+      part = 0;
+      if (offset < prefix_len)
+        {
+          part = MIN (size, prefix_len - offset);
+          frame->prefix = slice_bytes (prefix, offset, part);
+        }
+      skip = offset > prefix_len ? offset - prefix_len : 0;
+      frame->payload = slice_bytes (payload, skip, size - part);
+
+      /*
+       * The server side doesn't need to mask, so we don't. There's
+       * probably a client somewhere that's not expecting it.
+       */
+      if (!pv->server_side)
+        {
+          frame->header[1] |= 0x80;
+          mask = frame->header + frame->header_len;
+          * ((guint32 *)mask) = g_random_int ();
+          frame->header_len += 4;
+
+          bytes = join_message (frame->prefix, part, frame->payload, size - part);
+          _web_socket_xor_mask_rfc6455 (mask, bytes->data, bytes->data, size);
+          if (frame->prefix)
+            g_bytes_unref (frame->prefix);
+          frame->prefix = NULL;
+          g_bytes_unref (frame->payload);
+          frame->payload = g_byte_array_free_to_bytes (bytes);
+        }
+
+      /* Compressed fragments don't match the amount, the last one evens it out */
+      frame->amount = frame->more ? MIN (size, amount - accounted) : amount - accounted;
+      accounted += frame->amount;
+
+      frame->len = frame->header_len + size;
+      queue_frame (self, flags, frame);
+      frame_debug ("queued rfc6455 %d frame of len %u", (gint)opcode, (guint)frame->len);
+
+      offset += size;
+    }
+  while (offset < len);
+
+  g_bytes_unref (payload);
 }
 
 static void
@@ -475,7 +844,12 @@ send_message_rfc6455 (WebSocketConnection *self,
                       const guint8 *payload,
                       gsize payload_len)
 {
-  return send_prefixed_message_rfc6455 (self, flags, opcode, NULL, 0, payload, payload_len);
+  GBytes *bytes;
+
+  /* These are small control messages */
+  bytes = g_bytes_new (payload, payload_len);
+  send_prefixed_message_rfc6455 (self, flags, opcode, NULL, bytes);
+  g_bytes_unref (bytes);
 }
 
 static void
@@ -747,17 +1121,140 @@ receive_ping_rfc6455 (WebSocketConnection *self,
   send_message_rfc6455 (self, WEB_SOCKET_QUEUE_URGENT, 0x0A, data, len);
 }
 
+/*
+ * Messages delivered in place are views on the incoming buffer. Each one
+ * holds a ref on this, and on the buffer through it.
+ */
+struct _SharedInput {
+  gint refs;
+  GByteArray *buffer;
+};
+
+static SharedInput *
+shared_input_ref (SharedInput *shared)
+{
+  g_atomic_int_inc (&shared->refs);
+  return shared;
+}
+
+static void
+shared_input_unref (gpointer data)
+{
+  SharedInput *shared = data;
+  if (g_atomic_int_dec_and_test (&shared->refs))
+    {
+      g_byte_array_unref (shared->buffer);
+      g_slice_free (SharedInput, shared);
+    }
+}
+
+static GBytes *
+incoming_view (WebSocketConnection *self,
+               gconstpointer data,
+               gsize len)
+{
+  WebSocketConnectionPrivate *pv = self->pv;
+
+  if (!pv->incoming_shared)
+    {
+      pv->incoming_shared = g_slice_new (SharedInput);
+      pv->incoming_shared->refs = 1;
+      pv->incoming_shared->buffer = g_byte_array_ref (pv->incoming);
+    }
+
+  return g_bytes_new_with_free_func (data, len, shared_input_unref,
+                                     shared_input_ref (pv->incoming_shared));
+}
+
+/*
+ * Drop the frames processed so far. If any message views are still held
+ * then the buffer has to stay as it is, so the unprocessed remainder moves
+ * to a new one instead. That remainder is usually small or empty.
+ */
+static void
+compact_incoming (WebSocketConnection *self)
+{
+  WebSocketConnectionPrivate *pv = self->pv;
+  GByteArray *buffer;
+  gsize remains;
+
+  if (pv->incoming_shared)
+    {
+      if (g_atomic_int_get (&pv->incoming_shared->refs) > 1)
+        {
+          remains = pv->incoming->len - pv->incoming_offset;
+          buffer = g_byte_array_sized_new (MAX (remains, 1024));
+          g_byte_array_append (buffer, pv->incoming->data + pv->incoming_offset, remains);
+          g_byte_array_unref (pv->incoming);
+          pv->incoming = buffer;
+          pv->incoming_offset = 0;
+        }
+      shared_input_unref (pv->incoming_shared);
+      pv->incoming_shared = NULL;
+    }
+
+  if (pv->incoming_offset > 0)
+    {
+      g_byte_array_remove_range (pv->incoming, 0, pv->incoming_offset);
+      pv->incoming_offset = 0;
+    }
+}
+
+static GByteArray *
+inflate_message (WebSocketConnection *self,
+                 GByteArray *message)
+{
+  WebSocketConnectionPrivate *pv = self->pv;
+  GError *error = NULL;
+  GConverterResult res;
+  GByteArray *bytes;
+
+  bytes = g_byte_array_sized_new (message->len * 4 + 1);
+
+  /* RFC 7692: put back the empty block the peer stripped */
+  g_byte_array_append (message, (guint8 *)"\x00\x00\xff\xff", 4);
+  res = convert_all (pv->inflate, message->data, message->len,
+                     G_CONVERTER_FLUSH, bytes, MAX_PAYLOAD, &error);
+
+  if (res == G_CONVERTER_ERROR)
+    {
+      if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NO_SPACE))
+        {
+          too_big_error_and_close (self, bytes->len);
+        }
+      else
+        {
+          g_message ("received invalid compressed data: %s", error->message);
+          bad_data_error_and_close (self);
+        }
+      g_error_free (error);
+      g_byte_array_unref (bytes);
+      return NULL;
+    }
+
+  /* A final deflate block ends the stream, start a new one */
+  if (res == G_CONVERTER_FINISHED)
+    g_converter_reset (pv->inflate);
+
+  return bytes;
+}
+
 static void
 process_contents_rfc6455 (WebSocketConnection *self,
                           gboolean control,
                           gboolean fin,
+                          gboolean compressed,
                           guint8 opcode,
                           gconstpointer payload,
-                          gsize payload_len)
+                          gsize payload_len,
+                          gboolean terminated)
 {
   WebSocketConnectionPrivate *pv = self->pv;
+  GByteArray *inflated;
   GBytes *message;
 
+  WEB_SOCKET_PROBE2 (websocket_frame_in, opcode, payload_len);
+
   if (control)
     {
       /* Control frames must never be fragmented */
@@ -768,7 +1265,15 @@ process_contents_rfc6455 (WebSocketConnection *self,
           return;
         }
 
-      g_debug ("received control frame %d with %d payload", (int)opcode, (int)payload_len);
+      /* Nor compressed */
+      if (compressed)
+        {
+          g_message ("received compressed control frame");
+          protocol_error_and_close (self);
+          return;
+        }
+
+      frame_debug ("received control frame %d with %d payload", (int)opcode, (int)payload_len);
 
       switch (opcode)
         {
@@ -794,6 +1299,14 @@ process_contents_rfc6455 (WebSocketConnection *self,
   /* A message frame */
   else
     {
+      /* Only the first frame of a message may say it's compressed */
+      if (compressed && (!pv->inflate || !opcode))
+        {
+          g_message ("received unexpected compressed frame");
+          protocol_error_and_close (self);
+          return;
+        }
+
       /* Initial fragment of a message */
       if (!fin && opcode)
         {
@@ -803,7 +1316,7 @@ process_contents_rfc6455 (WebSocketConnection *self,
               protocol_error_and_close (self);
               return;
             }
-          g_debug ("received inital fragment frame %d with %d payload", (int)opcode, (int)payload_len);
+          frame_debug ("received inital fragment frame %d with %d payload", (int)opcode, (int)payload_len);
         }
 
       /* Middle fragment of a message */
@@ -815,7 +1328,7 @@ process_contents_rfc6455 (WebSocketConnection *self,
               protocol_error_and_close (self);
               return;
             }
-          g_debug ("received middle fragment frame with %d payload", (int)payload_len);
+          frame_debug ("received middle fragment frame with %d payload", (int)payload_len);
         }
 
       /* Last fragment of a message */
@@ -827,7 +1340,7 @@ process_contents_rfc6455 (WebSocketConnection *self,
               protocol_error_and_close (self);
               return;
             }
-          g_debug ("received last fragment frame with %d payload", (int)payload_len);
+          frame_debug ("received last fragment frame with %d payload", (int)payload_len);
         }
 
       /* An unfragmented message */
@@ -840,19 +1353,40 @@ process_contents_rfc6455 (WebSocketConnection *self,
               protocol_error_and_close (self);
               return;
             }
-          g_debug ("received frame %d with %d payload", (int)opcode, (int)payload_len);
+          frame_debug ("received frame %d with %d payload", (int)opcode, (int)payload_len);
+
+          /* Hand out the payload where it sits in the incoming buffer */
+          if (terminated && !compressed && (opcode == 0x01 || opcode == 0x02))
+            {
+              if (opcode == 0x01 && !g_utf8_validate ((gchar *)payload, payload_len, NULL))
+                {
+                  g_message ("received invalid non-UTF8 text data");
+                  bad_data_error_and_close (self);
+                  return;
+                }
+
+              message = incoming_view (self, payload, payload_len);
+              frame_debug ("message: delivering %d with %d length in place",
+                           (int)opcode, (int)payload_len);
+              g_signal_emit (self, signals[MESSAGE], 0, (int)opcode, message);
+              g_bytes_unref (message);
+              return;
+            }
         }
 
       if (opcode)
         {
           pv->message_opcode = opcode;
+          pv->message_compressed = compressed;
           pv->message_data = g_byte_array_sized_new (payload_len);
         }
 
       switch (pv->message_opcode)
         {
         case 0x01:
-          if (!g_utf8_validate ((gchar *)payload, payload_len, NULL))
+          /* Compressed text is validated once inflated below */
+          if (!pv->message_compressed &&
+              !g_utf8_validate ((gchar *)payload, payload_len, NULL))
             {
               g_message ("received invalid non-UTF8 text data");
 
@@ -876,6 +1410,29 @@ process_contents_rfc6455 (WebSocketConnection *self,
       /* Actually deliver the message? */
       if (fin)
         {
+          if (pv->message_compressed)
+            {
+              inflated = inflate_message (self, pv->message_data);
+              g_byte_array_unref (pv->message_data);
+              pv->message_data = inflated;
+              pv->message_compressed = FALSE;
+
+              if (inflated && pv->message_opcode == 0x01 &&
+                  !g_utf8_validate ((gchar *)inflated->data, inflated->len, NULL))
+                {
+                  g_message ("received invalid non-UTF8 text data");
+                  g_byte_array_unref (pv->message_data);
+                  pv->message_data = NULL;
+                  bad_data_error_and_close (self);
+                }
+
+              if (!pv->message_data)
+                {
+                  pv->message_opcode = 0;
+                  return;
+                }
+            }
+
           /* Always null terminate, as a convenience */
           g_byte_array_append (pv->message_data, (guchar *)"\0", 1);
 
@@ -886,8 +1443,8 @@ process_contents_rfc6455 (WebSocketConnection *self,
           message = g_byte_array_free_to_bytes (pv->message_data);
           pv->message_data = NULL;
           pv->message_opcode = 0;
-          g_debug ("message: delivering %d with %d length",
-                   (int)opcode, (int)g_bytes_get_size (message));
+          frame_debug ("message: delivering %d with %d length",
+                       (int)opcode, (int)g_bytes_get_size (message));
           g_signal_emit (self, signals[MESSAGE], 0, (int)opcode, message);
           g_bytes_unref (message);
         }
@@ -903,18 +1460,22 @@ process_frame_rfc6455 (WebSocketConnection *self)
   guint8 *mask;
   gboolean fin;
   gboolean control;
+  gboolean compressed;
   gboolean masked;
+  gboolean terminated = FALSE;
   guint8 opcode;
   gsize len;
   gsize at;
 
-  len = self->pv->incoming->len;
+  /* Frames already processed are skipped rather than removed */
+  len = self->pv->incoming->len - self->pv->incoming_offset;
   if (len < 2)
     return FALSE; /* need more data */
 
-  header = self->pv->incoming->data;
+  header = self->pv->incoming->data + self->pv->incoming_offset;
   fin = ((header[0] & 0x80) != 0);
   control = header[0] & 0x08;
+  compressed = ((header[0] & 0x40) != 0); /* RSV1 */
   opcode = header[0] & 0x0f;
   masked = ((header[1] & 0x80) != 0);
 
@@ -967,17 +1528,25 @@ process_frame_rfc6455 (WebSocketConnection *self)
       if (len < at + payload_len)
         return FALSE; /* need more data */
 
-      xor_with_mask_rfc6455 (mask, payload, payload_len);
+      /*
+       * Unmask into place one byte lower, over the end of the mask. That
+       * leaves room to null terminate the payload where it sits.
+       */
+      _web_socket_xor_mask_rfc6455 (mask, payload, payload - 1, payload_len);
+      payload--;
+      payload[payload_len] = '\0';
+      terminated = TRUE;
     }
 
   /*
    * Note that now that we've unmasked, we've modified the buffer, we can
    * only return below via discarding or processing the message
    */
-  process_contents_rfc6455 (self, control, fin, opcode, payload, payload_len);
+  process_contents_rfc6455 (self, control, fin, compressed, opcode,
+                            payload, payload_len, terminated);
 
   /* Move past the parsed frame */
-  g_byte_array_remove_range (self->pv->incoming, 0, at + payload_len);
+  self->pv->incoming_offset += at + payload_len;
   return TRUE;
 }
 
@@ -988,12 +1557,13 @@ process_text_hixie76 (WebSocketConnection *self,
 {
   GBytes *message;
 
-  g_debug ("received hixie76 text frame with %d payload", (int)len);
+  WEB_SOCKET_PROBE2 (websocket_frame_in, WEB_SOCKET_DATA_TEXT, len);
+  frame_debug ("received hixie76 text frame with %d payload", (int)len);
   if (g_utf8_validate (data, len, NULL))
     {
       /* Guarantee that messages are null-terminated (outside of len) */
       message = g_bytes_new_take (g_strndup (data, len), len);
-      g_debug ("message: delivering text message with %d length", (int)len);
+      frame_debug ("message: delivering text message with %d length", (int)len);
       g_signal_emit (self, signals[MESSAGE], 0, (int)WEB_SOCKET_DATA_TEXT, message);
       g_bytes_unref (message);
     }
@@ -1008,17 +1578,21 @@ static gboolean
 process_frame_hixie76 (WebSocketConnection *self)
 {
   WebSocketConnectionPrivate *pv = self->pv;
+  guint8 *data;
   guint8 *end;
+  gsize avail;
   gsize len;
 
-  if (pv->incoming->len < 2)
+  data = pv->incoming->data + pv->incoming_offset;
+  avail = pv->incoming->len - pv->incoming_offset;
+  if (avail < 2)
     return FALSE; /* need more data */
 
-  switch (pv->incoming->data[0])
+  switch (data[0])
     {
     /* a close frame */
     case 0xFF:
-      if (pv->incoming->data[1] != 0x00)
+      if (data[1] != 0x00)
         {
           g_message ("received invalid close frame");
           protocol_error_and_close_full (self, TRUE);
@@ -1028,24 +1602,24 @@ process_frame_hixie76 (WebSocketConnection *self)
           g_debug ("received hixie76 close frame");
           receive_close_hixie76 (self);
         }
-      g_byte_array_remove_range (pv->incoming, 0, 2);
+      pv->incoming_offset += 2;
       break;
 
     /* a text frame */
     case 0x00:
-      end = memchr (pv->incoming->data, 0xff, pv->incoming->len);
+      end = memchr (data, 0xff, avail);
       if (end == NULL)
         {
-          if (pv->incoming->len > MAX_PAYLOAD)
-            too_big_error_and_close (self, pv->incoming->len);
+          if (avail > MAX_PAYLOAD)
+            too_big_error_and_close (self, avail);
           return FALSE; /* need more data */
         }
-      len = (end - pv->incoming->data) - 1;
+      len = (end - data) - 1;
       if (pv->close_received)
           g_message ("received message after close was received");
       else
-          process_text_hixie76 (self, (gchar *)pv->incoming->data + 1, len);
-      g_byte_array_remove_range (pv->incoming, 0, len + 2);
+          process_text_hixie76 (self, (gchar *)data + 1, len);
+      pv->incoming_offset += len + 2;
       break;
 
     /* an invalid frame */
@@ -1089,6 +1663,9 @@ process_incoming (WebSocketConnection *self)
             g_assert_not_reached ();
         }
       while (more);
+
+      /* Now drop all the processed frames at once */
+      compact_incoming (self);
     }
 }
 
@@ -1100,17 +1677,18 @@ on_web_socket_input (GObject *pollable_stream,
   WebSocketConnectionPrivate *pv = self->pv;
   GError *error = NULL;
   gboolean end = FALSE;
+  gsize total = 0;
   gssize count;
   gsize len;
 
   do
     {
       len = pv->incoming->len;
-      g_byte_array_set_size (pv->incoming, len + 1024);
+      g_byte_array_set_size (pv->incoming, len + pv->read_size);
 
       count = g_pollable_input_stream_read_nonblocking (pv->input,
                                                         pv->incoming->data + len,
-                                                        1024, NULL, &error);
+                                                        pv->read_size, NULL, &error);
 
       if (count < 0)
         {
@@ -1121,6 +1699,7 @@ on_web_socket_input (GObject *pollable_stream,
             }
           else
             {
+              pv->incoming->len = len;
               _web_socket_connection_error_and_close (self, error, TRUE);
               return TRUE;
             }
@@ -1131,9 +1710,18 @@ on_web_socket_input (GObject *pollable_stream,
         }
 
       pv->incoming->len = len + count;
+      total += count;
+
+      /* Filled the whole read, so there's probably more waiting */
+      if ((gsize)count == pv->read_size && pv->read_size < INPUT_READ_MAX)
+        pv->read_size *= 2;
     }
   while (count > 0);
 
+  /* And back down again once input slows */
+  if (total < pv->read_size / 4 && pv->read_size > INPUT_READ_MIN)
+    pv->read_size /= 2;
+
   process_incoming (self);
 
   if (end)
@@ -1176,6 +1764,259 @@ start_input (WebSocketConnection *self)
   g_source_attach (pv->input_source, pv->main_context);
 }
 
+static gint
+gather_frame (Frame *frame,
+              struct iovec *iov)
+{
+  const guint8 *data[3];
+  gsize lens[3];
+  gsize skip;
+  gint i, n;
+
+  data[0] = frame->header;
+  lens[0] = frame->header_len;
+  data[1] = NULL;
+  lens[1] = 0;
+  if (frame->prefix)
+    data[1] = g_bytes_get_data (frame->prefix, &lens[1]);
+  data[2] = g_bytes_get_data (frame->payload, &lens[2]);
+
+  /* Skip over what was already sent */
+  skip = frame->sent;
+  for (i = 0, n = 0; i < 3; i++)
+    {
+      if (skip >= lens[i])
+        {
+          skip -= lens[i];
+          continue;
+        }
+      iov[n].iov_base = (gpointer)(data[i] + skip);
+      iov[n].iov_len = lens[i] - skip;
+      skip = 0;
+      n++;
+    }
+
+  return n;
+}
+
+static gssize
+send_frames_vectored (WebSocketConnection *self,
+                      GError **error)
+{
+  WebSocketConnectionPrivate *pv = self->pv;
+  struct iovec iov[OUTPUT_IOV_MAX];
+  struct msghdr msg;
+  Frame *frame;
+  gsize total = 0;
+  gssize count;
+  gint errsv;
+  GList *l;
+  gint n = 0;
+
+  /* The head frame always goes, others as long as they fit */
+  for (l = pv->outgoing.head; l != NULL; l = g_list_next (l))
+    {
+      frame = l->data;
+      if (n > 0 && (n + 3 > OUTPUT_IOV_MAX ||
+                    total + (frame->len - frame->sent) > _web_socket_output_budget))
+        break;
+
+      n += gather_frame (frame, iov + n);
+      total += frame->len - frame->sent;
+
+      if (frame->last)
+        break;
+    }
+
+  memset (&msg, 0, sizeof (msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = n;
+
+  count = sendmsg (pv->output_fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+  if (count < 0)
+    {
+      errsv = errno;
+      if (errsv == EINTR)
+        errsv = EAGAIN;
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                   "Error sending data: %s", g_strerror (errsv));
+    }
+
+  return count;
+}
+
+static void
+flatten_frame (Frame *frame)
+{
+  GByteArray *bytes;
+
+  if (frame->header_len == 0 && frame->prefix == NULL)
+    return;
+
+  g_assert (frame->sent == 0);
+
+  bytes = g_byte_array_sized_new (frame->len);
+  g_byte_array_append (bytes, frame->header, frame->header_len);
+  if (frame->prefix)
+    {
+      g_byte_array_append (bytes, g_bytes_get_data (frame->prefix, NULL),
+                           g_bytes_get_size (frame->prefix));
+      g_bytes_unref (frame->prefix);
+      frame->prefix = NULL;
+    }
+  g_byte_array_append (bytes, g_bytes_get_data (frame->payload, NULL),
+                       g_bytes_get_size (frame->payload));
+  g_bytes_unref (frame->payload);
+  frame->payload = g_byte_array_free_to_bytes (bytes);
+  frame->header_len = 0;
+}
+
+/*
+ * Merge the frames that follow an unsent head frame into it, for as
+ * long as they fit in the output budget. They then go out in one write.
+ */
+static void
+coalesce_frames (WebSocketConnection *self)
+{
+  WebSocketConnectionPrivate *pv = self->pv;
+  GByteArray *bytes = NULL;
+  struct iovec iov[3];
+  Frame *head;
+  Frame *next;
+  gint i, n;
+
+  head = g_queue_peek_head (&pv->outgoing);
+  flatten_frame (head);
+
+  if (head->sent > 0)
+    return;
+
+  while (!head->last)
+    {
+      next = g_queue_peek_nth (&pv->outgoing, 1);
+      if (!next || head->len + next->len > _web_socket_output_budget)
+        break;
+
+      if (!bytes)
+        {
+          bytes = g_byte_array_sized_new (head->len + next->len);
+          g_byte_array_append (bytes, g_bytes_get_data (head->payload, NULL), head->len);
+        }
+
+      n = gather_frame (next, iov);
+      for (i = 0; i < n; i++)
+        g_byte_array_append (bytes, iov[i].iov_base, iov[i].iov_len);
+
+      head->len += next->len;
+      head->amount += next->amount;
+      head->last = next->last;
+
+      g_queue_pop_nth (&pv->outgoing, 1);
+      frame_free (next);
+    }
+
+  if (bytes)
+    {
+      g_bytes_unref (head->payload);
+      head->payload = g_byte_array_free_to_bytes (bytes);
+    }
+}
+
+static void
+next_turn (WebSocketConnection *self,
+           WebSocketPriority turn)
+{
+  WebSocketConnectionPrivate *pv = self->pv;
+  pv->turn = turn;
+  pv->deficit[turn] += (turn == WEB_SOCKET_PRIORITY_BULK) ? BULK_QUANTUM : INTERACTIVE_QUANTUM;
+}
+
+/*
+ * Move frames from the pending priority queues onto the outgoing queue,
+ * until about an output budget is waiting to be written, or all of them
+ * when @all is set. Control frames go first. Interactive and bulk frames
+ * take turns, each sending up to its quantum per turn, so that neither
+ * waits behind all of the other. Once a fragmented message is started,
+ * the rest of it goes before anything else.
+ */
+static void
+schedule_frames (WebSocketConnection *self,
+                 gboolean all)
+{
+  WebSocketConnectionPrivate *pv = self->pv;
+  WebSocketPriority priority;
+  WebSocketPriority other;
+  GQueue *queue;
+  gsize queued = 0;
+  Frame *frame;
+  GList *l;
+
+  for (l = pv->outgoing.head; l != NULL; l = g_list_next (l))
+    {
+      frame = l->data;
+      queued += frame->len - frame->sent;
+    }
+
+  while (all || queued < _web_socket_output_budget)
+    {
+      /* Nothing may come between the fragments of a message */
+      if (pv->continuing)
+        {
+          priority = pv->continued;
+          frame = g_queue_pop_head (&pv->pending[priority]);
+          g_assert (frame != NULL);
+          if (priority != WEB_SOCKET_PRIORITY_CONTROL)
+            pv->deficit[priority] -= MIN (frame->len, pv->deficit[priority]);
+        }
+      else
+        {
+          priority = WEB_SOCKET_PRIORITY_CONTROL;
+          frame = g_queue_pop_head (&pv->pending[priority]);
+        }
+
+      if (!frame)
+        {
+          priority = pv->turn;
+          queue = &pv->pending[pv->turn];
+          other = (pv->turn == WEB_SOCKET_PRIORITY_BULK) ?
+                  WEB_SOCKET_PRIORITY_INTERACTIVE : WEB_SOCKET_PRIORITY_BULK;
+
+          frame = g_queue_peek_head (queue);
+          if (!frame)
+            {
+              pv->deficit[pv->turn] = 0;
+              if (g_queue_is_empty (&pv->pending[other]))
+                break;
+              next_turn (self, other);
+              continue;
+            }
+
+          /* Wait for the next turn, unless nothing else is waiting */
+          if (g_queue_is_empty (&pv->pending[other]))
+            {
+              pv->deficit[pv->turn] = 0;
+            }
+          else if (frame->len > pv->deficit[pv->turn])
+            {
+              next_turn (self, other);
+              continue;
+            }
+          else
+            {
+              pv->deficit[pv->turn] -= frame->len;
+            }
+
+          g_queue_pop_head (queue);
+        }
+
+      pv->continuing = frame->more;
+      pv->continued = priority;
+
+      g_queue_push_tail (&pv->outgoing, frame);
+      queued += frame->len;
+    }
+}
+
 static gboolean
 on_web_socket_output (GObject *pollable_stream,
                       gpointer user_data)
@@ -1187,7 +2028,9 @@ on_web_socket_output (GObject *pollable_stream,
   Frame *frame;
   gssize count;
   gsize len;
+  gsize amount;
 
+  schedule_frames (self, FALSE);
   frame = g_queue_peek_head (&pv->outgoing);
 
   /* No more frames to send */
@@ -1197,14 +2040,26 @@ on_web_socket_output (GObject *pollable_stream,
       return TRUE;
     }
 
-  data = g_bytes_get_data (frame->data, &len);
-  g_assert (len > 0);
-  g_assert (len > frame->sent);
+  g_assert (frame->len > 0);
+  g_assert (frame->len > frame->sent);
 
-  count = g_pollable_output_stream_write_nonblocking (pv->output,
-                                                      data + frame->sent,
-                                                      len - frame->sent,
-                                                      NULL, &error);
+  if (pv->output_fd >= 0)
+    {
+      count = send_frames_vectored (self, &error);
+    }
+  else
+    {
+      /*
+       * Other streams, TLS in particular, get one write per wakeup. Writing
+       * the parts separately would mean a TLS record each.
+       */
+      coalesce_frames (self);
+      data = g_bytes_get_data (frame->payload, NULL);
+      count = g_pollable_output_stream_write_nonblocking (pv->output,
+                                                          data + frame->sent,
+                                                          frame->len - frame->sent,
+                                                          NULL, &error);
+    }
 
   if (count < 0)
     {
@@ -1220,14 +2075,24 @@ on_web_socket_output (GObject *pollable_stream,
         }
     }
 
-  frame->sent += count;
-  if (frame->sent >= len)
+  /* Account for what was written, which may span several frames */
+  amount = pv->buffered_amount;
+  while ((frame = g_queue_peek_head (&pv->outgoing)) != NULL)
     {
-      g_debug ("sent frame");
+      len = MIN ((gsize)count, frame->len - frame->sent);
+      frame->sent += len;
+      count -= len;
+
+      if (frame->sent < frame->len)
+        break;
+
+      frame_debug ("sent frame");
       g_queue_pop_head (&pv->outgoing);
+      pv->buffered_amount -= frame->amount;
 
       if (frame->last)
         {
+          frame_free (frame);
           if (pv->server_side)
             {
               close_io_stream (self);
@@ -1237,10 +2102,18 @@ on_web_socket_output (GObject *pollable_stream,
               shutdown_wr_io_stream (self);
               close_io_after_timeout (self);
             }
+          break;
         }
+
       frame_free (frame);
+      if (count == 0)
+        break;
     }
 
+  /* Let callers holding off on sending know there's more room */
+  if (pv->buffered_amount != amount)
+    g_object_notify (G_OBJECT (self), "buffered-amount");
+
   return TRUE;
 }
 
@@ -1258,26 +2131,24 @@ start_output (WebSocketConnection *self)
   g_source_attach (pv->output_source, pv->main_context);
 }
 
-void
-_web_socket_connection_queue (WebSocketConnection *self,
-                              WebSocketQueueFlags flags,
-                              gpointer data,
-                              gsize len,
-                              gsize amount)
+static void
+queue_frame (WebSocketConnection *self,
+             WebSocketQueueFlags flags,
+             Frame *frame)
 {
   WebSocketConnectionPrivate *pv = self->pv;
-  Frame *frame;
   Frame *prev;
 
-  g_return_if_fail (WEB_SOCKET_IS_CONNECTION (self));
   g_return_if_fail (pv->close_sent == FALSE);
-  g_return_if_fail (data != NULL);
-  g_return_if_fail (len > 0);
 
-  frame = g_slice_new0 (Frame);
-  frame->data = g_bytes_new_take (data, len);
-  frame->amount = amount;
+  WEB_SOCKET_PROBE2 (websocket_frame_out, frame->len, frame->amount);
+
   frame->last = (flags & WEB_SOCKET_QUEUE_LAST) ? TRUE : FALSE;
+  pv->buffered_amount += frame->amount;
+
+  /* Nothing goes after the last frame */
+  if (frame->last)
+    schedule_frames (self, TRUE);
 
   /* If urgent put at front of queue */
   if (flags & WEB_SOCKET_QUEUE_URGENT)
@@ -1299,14 +2170,46 @@ _web_socket_connection_queue (WebSocketConnection *self,
           g_queue_push_head (&pv->outgoing, frame);
         }
     }
-  else
+  else if (frame->last)
     {
       g_queue_push_tail (&pv->outgoing, frame);
     }
+  else if (flags & WEB_SOCKET_QUEUE_CONTROL)
+    {
+      g_queue_push_tail (&pv->pending[WEB_SOCKET_PRIORITY_CONTROL], frame);
+    }
+  else if (flags & WEB_SOCKET_QUEUE_BULK)
+    {
+      g_queue_push_tail (&pv->pending[WEB_SOCKET_PRIORITY_BULK], frame);
+    }
+  else
+    {
+      g_queue_push_tail (&pv->pending[WEB_SOCKET_PRIORITY_INTERACTIVE], frame);
+    }
 
   start_output (self);
 }
 
+void
+_web_socket_connection_queue (WebSocketConnection *self,
+                              WebSocketQueueFlags flags,
+                              gpointer data,
+                              gsize len,
+                              gsize amount)
+{
+  Frame *frame;
+
+  g_return_if_fail (WEB_SOCKET_IS_CONNECTION (self));
+  g_return_if_fail (data != NULL);
+  g_return_if_fail (len > 0);
+
+  frame = g_slice_new0 (Frame);
+  frame->payload = g_bytes_new_take (data, len);
+  frame->len = len;
+  frame->amount = amount;
+  queue_frame (self, flags, frame);
+}
+
 static gboolean
 check_streams (WebSocketConnection *self)
 {
@@ -1376,6 +2279,9 @@ _web_socket_connection_take_io_stream (WebSocketConnection *self,
   if (G_IS_POLLABLE_OUTPUT_STREAM (os))
     pv->output = G_POLLABLE_OUTPUT_STREAM (os);
 
+  if (G_IS_SOCKET_CONNECTION (io_stream))
+    pv->output_fd = g_socket_get_fd (g_socket_connection_get_socket (G_SOCKET_CONNECTION (io_stream)));
+
   pv->io_open = TRUE;
   g_object_notify (G_OBJECT (self), "io-stream");
 
@@ -1503,10 +2409,17 @@ web_socket_connection_finalize (GObject *object)
 
   g_main_context_unref (pv->main_context);
 
+  if (pv->incoming_shared)
+    shared_input_unref (pv->incoming_shared);
   if (pv->incoming)
-    g_byte_array_free (pv->incoming, TRUE);
+    g_byte_array_unref (pv->incoming);
   while (!g_queue_is_empty (&pv->outgoing))
     frame_free (g_queue_pop_head (&pv->outgoing));
+  for (i = 0; i < G_N_ELEMENTS (pv->pending); i++)
+    {
+      while (!g_queue_is_empty (&pv->pending[i]))
+        frame_free (g_queue_pop_head (&pv->pending[i]));
+    }
 
   g_clear_object (&pv->io_stream);
   g_assert (!pv->input_source);
@@ -1519,6 +2432,8 @@ web_socket_connection_finalize (GObject *object)
     g_source_unref (pv->start_idle);
   if (pv->message_data)
     g_byte_array_free (pv->message_data, TRUE);
+  g_clear_object (&pv->deflate);
+  g_clear_object (&pv->inflate);
 
   G_OBJECT_CLASS (web_socket_connection_parent_class)->finalize (object);
 }
@@ -1768,19 +2683,8 @@ web_socket_connection_get_ready_state (WebSocketConnection *self)
 gsize
 web_socket_connection_get_buffered_amount (WebSocketConnection *self)
 {
-  gsize amount = 0;
-  Frame *frame;
-  GList *l;
-
   g_return_val_if_fail (WEB_SOCKET_IS_CONNECTION (self), 0);
-
-  for (l = self->pv->outgoing.head; l != NULL; l = g_list_next (l))
-    {
-      frame = l->data;
-      amount += frame->amount;
-    }
-
-  return amount;
+  return self->pv->buffered_amount;
 }
 
 /**
@@ -1854,6 +2758,9 @@ web_socket_connection_get_close_data (WebSocketConnection *self)
  *
  * The optional @prefix can be a canned header to be prefixed to the message.
  * It can be specified as a separate argument for efficiency.
+ *
+ * The message is sent with %WEB_SOCKET_PRIORITY_INTERACTIVE, see
+ * web_socket_connection_send_full().
  */
 void
 web_socket_connection_send (WebSocketConnection *self,
@@ -1861,6 +2768,31 @@ web_socket_connection_send (WebSocketConnection *self,
                             GBytes *prefix,
                             GBytes *message)
 {
+  web_socket_connection_send_full (self, type, prefix, message,
+                                   WEB_SOCKET_PRIORITY_INTERACTIVE);
+}
+
+/**
+ * web_socket_connection_send_full:
+ * @self: the WebSocket
+ * @type: the data type of message
+ * @prefix: (allow-none): an optional prefix prepended to the message
+ * @message: the message contents
+ * @priority: the priority to send the message with
+ *
+ * Send a message to the peer, like web_socket_connection_send().
+ *
+ * Messages of the same @priority are sent in order. Messages of a higher
+ * @priority may be sent before others that were queued earlier.
+ */
+void
+web_socket_connection_send_full (WebSocketConnection *self,
+                                 WebSocketDataType type,
+                                 GBytes *prefix,
+                                 GBytes *message,
+                                 WebSocketPriority priority)
+{
+  WebSocketQueueFlags flags = WEB_SOCKET_QUEUE_NORMAL;
   gconstpointer pref = NULL;
   gsize prefix_len = 0;
   gconstpointer payload;
@@ -1907,11 +2839,15 @@ web_socket_connection_send (WebSocketConnection *self,
       return;
     }
 
+  if (priority == WEB_SOCKET_PRIORITY_CONTROL)
+    flags = WEB_SOCKET_QUEUE_CONTROL;
+  else if (priority == WEB_SOCKET_PRIORITY_BULK)
+    flags = WEB_SOCKET_QUEUE_BULK;
+
   if (self->pv->flavor == WEB_SOCKET_FLAVOR_HIXIE76)
-    send_text_hixie76 (self, pref, prefix_len, payload, payload_len);
+    send_text_hixie76 (self, flags, pref, prefix_len, payload, payload_len);
   else if (self->pv->flavor == WEB_SOCKET_FLAVOR_RFC6455)
-    send_prefixed_message_rfc6455 (self, WEB_SOCKET_QUEUE_NORMAL, opcode,
-                                   pref, prefix_len, payload, payload_len);
+    send_prefixed_message_rfc6455 (self, flags, opcode, prefix, message);
   else
     g_assert_not_reached ();
 
@@ -1953,6 +2889,9 @@ web_socket_connection_close (WebSocketConnection *self,
 
   if (self->pv->flavor != WEB_SOCKET_FLAVOR_UNKNOWN)
     {
+      /* The close goes after everything already sent */
+      schedule_frames (self, TRUE);
+
       flags = 0;
       if (self->pv->server_side && self->pv->close_received)
         flags |= WEB_SOCKET_QUEUE_LAST;
@@ -2028,6 +2967,256 @@ _web_socket_connection_choose_protocol (WebSocketConnection *self,
   return chosen;
 }
 
+typedef struct {
+  gboolean server_no_context_takeover;
+  gboolean client_no_context_takeover;
+  gint server_max_window_bits;
+  gint client_max_window_bits;
+} DeflateParams;
+
+static gint
+parse_window_bits (const gchar *value)
+{
+  gchar *end = NULL;
+  gint64 bits;
+
+  if (value == NULL)
+    return -1; /* present without a value */
+
+  bits = g_ascii_strtoll (value, &end, 10);
+  if (!value[0] || !end || end[0] || bits < 8 || bits > 15)
+    return 0;
+  return (gint)bits;
+}
+
+static gboolean
+parse_deflate_extension (const gchar *extension,
+                         DeflateParams *params)
+{
+  gboolean ret = FALSE;
+  gchar **parts;
+  gchar *name;
+  gchar *value;
+  gsize len;
+  gint i;
+
+  memset (params, 0, sizeof (DeflateParams));
+
+  parts = g_strsplit (extension, ";", -1);
+  if (!parts[0] || !g_str_equal (g_strstrip (parts[0]), "permessage-deflate"))
+    goto out;
+
+  for (i = 1; parts[i] != NULL; i++)
+    {
+      name = g_strstrip (parts[i]);
+      value = strchr (name, '=');
+      if (value)
+        {
+          *(value++) = '\0';
+          g_strchomp (name);
+          value = g_strstrip (value);
+
+          /* Values may be quoted */
+          len = strlen (value);
+          if (len >= 2 && value[0] == '"' && value[len - 1] == '"')
+            {
+              value[len - 1] = '\0';
+              value++;
+            }
+        }
+
+      /* Each parameter may only be present once */
+      if (g_str_equal (name, "server_no_context_takeover") &&
+          !value && !params->server_no_context_takeover)
+        params->server_no_context_takeover = TRUE;
+      else if (g_str_equal (name, "client_no_context_takeover") &&
+               !value && !params->client_no_context_takeover)
+        params->client_no_context_takeover = TRUE;
+      else if (g_str_equal (name, "server_max_window_bits") &&
+               !params->server_max_window_bits)
+        {
+          /* This one always needs a value */
+          params->server_max_window_bits = value ? parse_window_bits (value) : 0;
+          if (params->server_max_window_bits <= 0)
+            goto out;
+        }
+      else if (g_str_equal (name, "client_max_window_bits") &&
+               !params->client_max_window_bits)
+        {
+          params->client_max_window_bits = parse_window_bits (value);
+          if (params->client_max_window_bits == 0)
+            goto out;
+        }
+      else
+        goto out;
+    }
+
+  ret = TRUE;
+
+out:
+  g_strfreev (parts);
+  return ret;
+}
+
+static void
+setup_deflate (WebSocketConnection *self,
+               gboolean no_context_takeover)
+{
+  WebSocketConnectionPrivate *pv = self->pv;
+
+  g_clear_object (&pv->deflate);
+  g_clear_object (&pv->inflate);
+
+  /* Raw deflate, as RFC 7692 has no zlib header or trailer */
+  pv->deflate = G_CONVERTER (g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW, -1));
+  pv->inflate = G_CONVERTER (g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW));
+  pv->deflate_reset = no_context_takeover;
+}
+
+/*
+ * Called on the server with the client's Sec-WebSocket-Extensions header.
+ * Returns the value for the response header, or NULL if no extension
+ * was agreed on.
+ *
+ * GZlibCompressor always uses a 15 bit window, so we decline offers
+ * that ask us to use a smaller one. The window the peer compresses with
+ * doesn't matter, a 15 bit inflater can handle any of them.
+ */
+gchar *
+_web_socket_connection_choose_deflate (WebSocketConnection *self,
+                                       const gchar *value)
+{
+  WebSocketConnectionPrivate *pv = self->pv;
+  DeflateParams params;
+  gchar *response = NULL;
+  gboolean server_reset;
+  gboolean client_reset;
+  gchar **offers;
+  gint i;
+
+  g_return_val_if_fail (pv->handshake_done == FALSE, NULL);
+
+  if (!value || pv->deflate_threshold < 0)
+    return NULL;
+
+  offers = g_strsplit (value, ",", -1);
+  for (i = 0; offers[i] != NULL; i++)
+    {
+      if (!parse_deflate_extension (offers[i], &params))
+        continue;
+      if (params.server_max_window_bits > 0 && params.server_max_window_bits < 15)
+        continue;
+
+      /* We're allowed to add these even if the client didn't ask */
+      server_reset = params.server_no_context_takeover || pv->deflate_no_context_takeover;
+      client_reset = params.client_no_context_takeover || pv->deflate_no_context_takeover;
+
+      response = g_strdup_printf ("permessage-deflate%s%s%s",
+                                  server_reset ? "; server_no_context_takeover" : "",
+                                  client_reset ? "; client_no_context_takeover" : "",
+                                  params.server_max_window_bits ? "; server_max_window_bits=15" : "");
+      setup_deflate (self, server_reset);
+      g_debug ("agreed on extension: %s", response);
+      break;
+    }
+  g_strfreev (offers);
+
+  return response;
+}
+
+/*
+ * Called on the client to build the Sec-WebSocket-Extensions request
+ * header, or NULL if compression is disabled.
+ */
+gchar *
+_web_socket_connection_offer_deflate (WebSocketConnection *self)
+{
+  WebSocketConnectionPrivate *pv = self->pv;
+
+  if (pv->deflate_threshold < 0)
+    return NULL;
+
+  return g_strdup_printf ("permessage-deflate; client_max_window_bits%s",
+                          pv->deflate_no_context_takeover ?
+                              "; client_no_context_takeover; server_no_context_takeover" : "");
+}
+
+/*
+ * Called on the client with the server's Sec-WebSocket-Extensions
+ * response header. Returns FALSE if the response can't be accepted.
+ */
+gboolean
+_web_socket_connection_accept_deflate (WebSocketConnection *self,
+                                       const gchar *value)
+{
+  WebSocketConnectionPrivate *pv = self->pv;
+  DeflateParams params;
+
+  g_return_val_if_fail (pv->handshake_done == FALSE, FALSE);
+
+  if (!value || !value[0])
+    return TRUE;
+
+  if (pv->deflate_threshold < 0 || strchr (value, ',') ||
+      !parse_deflate_extension (value, &params) ||
+      (params.client_max_window_bits > 0 && params.client_max_window_bits < 15))
+    {
+      g_message ("received invalid or unsupported Sec-WebSocket-Extensions: %s", value);
+      return FALSE;
+    }
+
+  setup_deflate (self, params.client_no_context_takeover || pv->deflate_no_context_takeover);
+  g_debug ("agreed on extension: %s", value);
+  return TRUE;
+}
+
+/**
+ * web_socket_connection_set_deflate:
+ * @self: the WebSocket
+ * @threshold: minimum message size to compress, or -1 to disable
+ * @no_context_takeover: whether to reset the compression state between messages
+ *
+ * Configure the permessage-deflate extension. This must be called before
+ * the handshake takes place, which happens when the main loop runs.
+ *
+ * Messages shorter than @threshold are sent uncompressed. Turning on
+ * @no_context_takeover costs compression ratio, but the peer can then
+ * release its state between messages. Compression is off by default,
+ * for both servers and clients.
+ */
+void
+web_socket_connection_set_deflate (WebSocketConnection *self,
+                                   gint threshold,
+                                   gboolean no_context_takeover)
+{
+  g_return_if_fail (WEB_SOCKET_IS_CONNECTION (self));
+  g_return_if_fail (self->pv->handshake_done == FALSE);
+
+  self->pv->deflate_threshold = threshold < 0 ? -1 : threshold;
+  self->pv->deflate_no_context_takeover = no_context_takeover;
+}
+
+/**
+ * web_socket_connection_set_fragment_size:
+ * @self: the WebSocket
+ * @size: largest frame to send for a message, or zero
+ *
+ * Split messages larger than @size into fragments of at most @size
+ * bytes. Control frames, such as the reply to a ping, can then be sent
+ * without waiting for all of a large message to be written. Messages
+ * are never split when @size is zero, which is the default for clients.
+ *
+ * Only affects messages sent afterwards, and only on
+ * %WEB_SOCKET_FLAVOR_RFC6455 connections.
+ */
+void
+web_socket_connection_set_fragment_size (WebSocketConnection *self,
+                                         gsize size)
+{
+  g_return_if_fail (WEB_SOCKET_IS_CONNECTION (self));
+  self->pv->fragment_size = size;
+}
+
 /**
  * web_socket_connection_get_flavor:
  * @self: the WebSocket
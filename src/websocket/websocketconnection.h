@@ -90,12 +90,25 @@ void            web_socket_connection_send                (WebSocketConnection *
                                                            GBytes *prefix,
                                                            GBytes *payload);
 
+void            web_socket_connection_send_full           (WebSocketConnection *self,
+                                                           WebSocketDataType type,
+                                                           GBytes *prefix,
+                                                           GBytes *payload,
+                                                           WebSocketPriority priority);
+
 void            web_socket_connection_close               (WebSocketConnection *self,
                                                            gushort code,
                                                            const gchar *data);
 
 WebSocketFlavor web_socket_connection_get_flavor          (WebSocketConnection *self);
 
+void            web_socket_connection_set_deflate         (WebSocketConnection *self,
+                                                           gint threshold,
+                                                           gboolean no_context_takeover);
+
+void            web_socket_connection_set_fragment_size   (WebSocketConnection *self,
+                                                           gsize size);
+
 G_END_DECLS
 
 #endif /* __WEB_SOCKET_CONNECTION_H__ */
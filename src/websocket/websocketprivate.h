@@ -22,6 +22,17 @@
 
 #include <gio/gio.h>
 
+/*
+ * Static tracepoints, in the same "cockpit" provider as the rest of
+ * cockpit, but kept here so this library needs nothing from the rest.
+ */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define WEB_SOCKET_PROBE2(name, a, b)   DTRACE_PROBE2 (cockpit, name, a, b)
+#else
+#define WEB_SOCKET_PROBE2(name, a, b)   G_STMT_START { } G_STMT_END
+#endif
+
 G_BEGIN_DECLS
 
 gboolean     _web_socket_util_parse_url         (const gchar *url,
@@ -41,10 +52,15 @@ gboolean     _web_socket_util_header_contains   (GHashTable *headers,
 gboolean     _web_socket_util_header_empty      (GHashTable *headers,
                                                  const gchar *name);
 
+/* Most bytes gathered from queued frames into one write */
+extern gsize     _web_socket_output_budget;
+
 typedef enum {
   WEB_SOCKET_QUEUE_NORMAL = 0,
   WEB_SOCKET_QUEUE_URGENT = 1 << 0,
   WEB_SOCKET_QUEUE_LAST = 1 << 1,
+  WEB_SOCKET_QUEUE_CONTROL = 1 << 2,
+  WEB_SOCKET_QUEUE_BULK = 1 << 3,
 } WebSocketQueueFlags;
 
 void             _web_socket_connection_queue             (WebSocketConnection *conn,
@@ -75,8 +91,21 @@ gboolean         _web_socket_connection_choose_protocol   (WebSocketConnection *
                                                            const gchar **protocols,
                                                            const gchar *value);
 
+gchar *          _web_socket_connection_choose_deflate    (WebSocketConnection *self,
+                                                           const gchar *value);
+
+gchar *          _web_socket_connection_offer_deflate     (WebSocketConnection *self);
+
+gboolean         _web_socket_connection_accept_deflate    (WebSocketConnection *self,
+                                                           const gchar *value);
+
 gchar *          _web_socket_complete_accept_key_rfc6455  (const gchar *key);
 
+void             _web_socket_xor_mask_rfc6455             (const guint8 *mask,
+                                                           const guint8 *src,
+                                                           guint8 *dest,
+                                                           gsize len);
+
 guint8 *         _web_socket_complete_challenge_hixie76   (guint number_1,
                                                            guint number_2,
                                                            guint8 challenge[16]);
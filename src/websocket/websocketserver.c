@@ -52,7 +52,8 @@ G_DEFINE_TYPE (WebSocketServer, web_socket_server, WEB_SOCKET_TYPE_CONNECTION);
 static void
 web_socket_server_init (WebSocketServer *self)
 {
-
+  /* Keep large messages from holding up pongs and close */
+  web_socket_connection_set_fragment_size (WEB_SOCKET_CONNECTION (self), 64 * 1024);
 }
 
 static void
@@ -294,6 +295,7 @@ respond_handshake_rfc6455 (WebSocketServer *self,
   const gchar *protocol;
   const gchar *origin;
   const gchar *host;
+  gchar *extensions;
   gchar *accept_key;
   gchar *key;
   GString *handshake;
@@ -371,6 +373,11 @@ respond_handshake_rfc6455 (WebSocketServer *self,
   if (protocol)
     g_string_append_printf (handshake, "Sec-WebSocket-Protocol: %s\r\n", protocol);
 
+  extensions = _web_socket_connection_choose_deflate (conn, g_hash_table_lookup (headers, "Sec-WebSocket-Extensions"));
+  if (extensions)
+    g_string_append_printf (handshake, "Sec-WebSocket-Extensions: %s\r\n", extensions);
+  g_free (extensions);
+
   g_string_append (handshake, "\r\n");
 
   len = handshake->len;
@@ -0,0 +1,206 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2016 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitauth.h"
+
+#include "common/cockpitconf.h"
+#include "websocket/websocket.h"
+
+#include <glib/gstdio.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Logs in over and over through a spawn-login-with-header auth command,
+ * and reports how long each login takes from the request until its
+ * result is parsed. This is the round trip over the auth pipe that
+ * cockpit-ws does with cockpit-session for every login.
+ *
+ * This is not run as part of 'make check'.
+ */
+
+static gint opt_count = 100;
+static gint opt_prespawn = 0;
+static gchar *opt_command = NULL;
+
+static void
+on_ready_get_result (GObject *source,
+                     GAsyncResult *result,
+                     gpointer user_data)
+{
+  GAsyncResult **retval = user_data;
+  *retval = g_object_ref (result);
+}
+
+static int
+compare_time (gconstpointer a,
+              gconstpointer b)
+{
+  const gint64 *ta = a;
+  const gint64 *tb = b;
+  return (*ta > *tb) - (*ta < *tb);
+}
+
+static gboolean
+bench_login (CockpitAuth *auth,
+             gint64 *elapsed)
+{
+  GAsyncResult *result = NULL;
+  JsonObject *response;
+  GError *error = NULL;
+  GHashTable *headers;
+  gint64 start;
+
+  headers = web_socket_util_new_headers ();
+  g_hash_table_insert (headers, g_strdup ("Authorization"), g_strdup ("benchscheme success"));
+
+  start = g_get_monotonic_time ();
+  cockpit_auth_login_async (auth, "/cockpit", headers, NULL, on_ready_get_result, &result);
+  g_hash_table_unref (headers);
+
+  while (result == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  headers = web_socket_util_new_headers ();
+  response = cockpit_auth_login_finish (auth, result, 0, headers, &error);
+  *elapsed = g_get_monotonic_time () - start;
+
+  g_hash_table_unref (headers);
+  g_object_unref (result);
+
+  if (!response)
+    {
+      g_printerr ("bench-login: %s\n", error->message);
+      g_error_free (error);
+      return FALSE;
+    }
+
+  json_object_unref (response);
+  return TRUE;
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  GOptionContext *context;
+  CockpitAuth *auth;
+  GError *error = NULL;
+  gchar *config;
+  gchar *contents;
+  gint64 *times;
+  gint64 total = 0;
+  gint done = 0;
+  gint fd;
+  gint i;
+
+  static GOptionEntry entries[] = {
+    { "count", 'n', 0, G_OPTION_ARG_INT, &opt_count, "Number of times to log in", "count" },
+    { "prespawn", 'p', 0, G_OPTION_ARG_INT, &opt_prespawn, "Auth processes to start ahead of time", "count" },
+    { "command", 'c', 0, G_OPTION_ARG_FILENAME, &opt_command, "The auth command to log in with", "path" },
+    { NULL }
+  };
+
+  signal (SIGPIPE, SIG_IGN);
+  g_type_init ();
+
+  context = g_option_context_new (NULL);
+  g_option_context_add_main_entries (context, entries, NULL);
+  g_option_context_set_description (context, "Measure how long a login takes over the auth pipe\n");
+
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("bench-login: %s\n", error->message);
+      g_error_free (error);
+      return 2;
+    }
+
+  g_option_context_free (context);
+
+  if (opt_count < 1 || opt_prespawn < 0)
+    {
+      g_printerr ("bench-login: invalid arguments\n");
+      return 2;
+    }
+
+  if (!opt_command)
+    opt_command = g_strdup (BUILDDIR "/mock-auth-command");
+
+  config = g_build_filename (g_get_tmp_dir (), "bench-login.XXXXXX", NULL);
+  fd = g_mkstemp (config);
+  if (fd < 0)
+    {
+      g_printerr ("bench-login: couldn't create config: %s\n", g_strerror (errno));
+      return 1;
+    }
+  close (fd);
+
+  contents = g_strdup_printf ("[benchscheme]\n"
+                              "action = spawn-login-with-header\n"
+                              "command = %s\n"
+                              "prespawn = %d\n",
+                              opt_command, opt_prespawn);
+  if (!g_file_set_contents (config, contents, -1, &error))
+    {
+      g_printerr ("bench-login: %s\n", error->message);
+      g_error_free (error);
+      return 1;
+    }
+  g_free (contents);
+
+  cockpit_config_file = config;
+  auth = cockpit_auth_new (FALSE);
+
+  times = g_new0 (gint64, opt_count);
+  for (i = 0; i < opt_count; i++)
+    {
+      if (!bench_login (auth, times + done))
+        break;
+      total += times[done];
+      done++;
+    }
+
+  g_object_unref (auth);
+  g_unlink (config);
+  g_free (config);
+
+  if (done == 0)
+    {
+      g_printerr ("bench-login: %s never logged in\n", opt_command);
+      return 1;
+    }
+
+  qsort (times, done, sizeof (gint64), compare_time);
+
+  printf ("login: %s, %d runs, %d prespawned\n", opt_command, done, opt_prespawn);
+  printf ("  request to result min: %.1f ms, p50: %.1f ms, mean: %.1f ms, max: %.1f ms\n",
+          times[0] / 1000.0, times[done / 2] / 1000.0,
+          (total / done) / 1000.0, times[done - 1] / 1000.0);
+
+  g_free (times);
+  g_free (opt_command);
+  return 0;
+}
@@ -35,6 +35,8 @@
 #include "common/cockpitpipe.h"
 #include "common/cockpitpipetransport.h"
 #include "common/cockpitmemory.h"
+#include "common/cockpitstats.h"
+#include "common/cockpittimerwheel.h"
 #include "common/cockpitunixfd.h"
 #include "common/cockpitsystem.h"
 #include "common/cockpitwebserver.h"
@@ -88,6 +90,30 @@ typedef struct {
   gulong destroy_sig;
 } CockpitAuthenticated;
 
+/*
+ * Cookies are looked up on every request, including static resources,
+ * so they're keyed by the base64 value the browser sends back. The
+ * comparison doesn't stop at the first differing byte.
+ */
+static gboolean
+cookie_equal (gconstpointer v1,
+              gconstpointer v2)
+{
+  const guchar *a = v1;
+  const guchar *b = v2;
+  gsize len = strlen (v1);
+  guchar diff = 0;
+  gsize i;
+
+  if (len != strlen (v2))
+    return FALSE;
+
+  for (i = 0; i < len; i++)
+    diff |= a[i] ^ b[i];
+
+  return diff == 0;
+}
+
 static void
 cockpit_authenticated_destroy (CockpitAuthenticated *authenticated)
 {
@@ -111,7 +137,7 @@ cockpit_authenticated_free (gpointer data)
   GObject *object;
 
   if (authenticated->timeout_tag)
-    g_source_remove (authenticated->timeout_tag);
+    cockpit_timer_wheel_remove (authenticated->timeout_tag);
 
   g_free (authenticated->cookie);
   cockpit_creds_poison (authenticated->creds);
@@ -221,10 +247,16 @@ cockpit_auth_finalize (GObject *object)
 {
   CockpitAuth *self = COCKPIT_AUTH (object);
   if (self->timeout_tag)
-    g_source_remove (self->timeout_tag);
+    cockpit_timer_wheel_remove (self->timeout_tag);
   g_bytes_unref (self->key);
   g_hash_table_destroy (self->authenticated);
   g_hash_table_destroy (self->authentication_pending);
+  g_hash_table_destroy (self->prespawned);
+  if (self->login_queue_tag)
+    g_source_remove (self->login_queue_tag);
+  g_assert (g_queue_is_empty (self->login_queue));
+  g_queue_free (self->login_queue);
+  g_hash_table_destroy (self->login_buckets);
   G_OBJECT_CLASS (cockpit_auth_parent_class)->finalize (object);
 }
 
@@ -251,19 +283,25 @@ cockpit_auth_init (CockpitAuth *self)
   if (!self->key)
     g_error ("couldn't read random key, startup aborted");
 
-  self->authenticated = g_hash_table_new_full (g_str_hash, g_str_equal,
+  self->authenticated = g_hash_table_new_full (g_str_hash, cookie_equal,
                                                NULL, cockpit_authenticated_free);
 
   self->authentication_pending = g_hash_table_new_full (g_str_hash, g_str_equal,
                                                         NULL, auth_data_unref);
 
-  self->timeout_tag = g_timeout_add_seconds (cockpit_ws_process_idle,
-                                             on_process_timeout, self);
+  self->prespawned = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                            g_free, prespawned_queue_free);
+
+  self->timeout_tag = cockpit_timer_wheel_add_seconds (NULL, cockpit_ws_process_idle,
+                                                       on_process_timeout, self);
 
   self->startups = 0;
   self->max_startups = max_startups;
   self->max_startups_begin = max_startups;
   self->max_startups_rate = 100;
+
+  self->login_queue = g_queue_new ();
+  self->login_buckets = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
 }
 
 gchar *
@@ -533,6 +571,273 @@ spawn_child_setup (gpointer data)
   close (auth_fd);
 }
 
+static gboolean
+spawn_login_process (const gchar **argv,
+                     gint child_pd,
+                     GPid *pid,
+                     gint *in,
+                     gint *out,
+                     GError **error)
+{
+  g_debug ("spawning %s", argv[0]);
+
+  return g_spawn_async_with_pipes (NULL, (gchar **) argv, NULL,
+                                   G_SPAWN_DO_NOT_REAP_CHILD | G_SPAWN_LEAVE_DESCRIPTORS_OPEN,
+                                   spawn_child_setup, GINT_TO_POINTER (child_pd),
+                                   pid, in, out, NULL, error);
+}
+
+static CockpitAuthPipe *
+new_spawn_auth_pipe (CockpitAuth *self,
+                     const gchar *type,
+                     const gchar *id,
+                     const gchar *command)
+{
+  return g_object_new (COCKPIT_TYPE_AUTH_PIPE,
+                       "pipe-timeout", timeout_option ("timeout", type,
+                                                       cockpit_ws_auth_process_timeout),
+                       "idle-timeout", timeout_option ("response-timeout", type,
+                                                       cockpit_ws_auth_response_timeout),
+                       "id", id,
+                       "logname", command,
+                       NULL);
+}
+
+/* ------------------------------------------------------------------------
+ * Login commands spawned ahead of time
+ *
+ * Starting cockpit-session and getting it ready takes a while, which
+ * adds up when many users log in at once. When a type has a prespawn
+ * option, that many commands are kept waiting on their auth pipe,
+ * without arguments. They receive "type\nremote-peer\n" in front of
+ * the first auth message instead.
+ */
+
+#define MAX_PRESPAWN 16
+
+typedef struct {
+  CockpitAuth *auth;
+  gchar *type;
+  CockpitAuthPipe *auth_pipe;
+  GPid process_pid;
+  gint process_in;
+  gint process_out;
+  gulong close_sig;
+} Prespawned;
+
+typedef struct {
+  CockpitAuth *auth;
+  gchar *type;
+} PrespawnRefill;
+
+static void
+prespawned_free (gpointer data)
+{
+  Prespawned *ps = data;
+
+  if (ps->close_sig)
+    g_signal_handler_disconnect (ps->auth_pipe, ps->close_sig);
+  if (ps->auth_pipe)
+    {
+      cockpit_auth_pipe_close (ps->auth_pipe, NULL);
+      g_object_unref (ps->auth_pipe);
+    }
+
+  if (ps->process_in != -1)
+    close (ps->process_in);
+  if (ps->process_out != -1)
+    close (ps->process_out);
+
+  if (ps->process_pid != 0)
+    {
+      g_child_watch_add (ps->process_pid, (GChildWatchFunc)g_spawn_close_pid, NULL);
+      kill (ps->process_pid, SIGTERM);
+    }
+
+  g_free (ps->type);
+  g_free (ps);
+}
+
+static void
+prespawned_queue_free (gpointer data)
+{
+  g_queue_free_full (data, prespawned_free);
+}
+
+static guint
+prespawn_option (const gchar *type)
+{
+  const gchar *conf = type_option (type, "prespawn", NULL);
+  guint64 value;
+
+  if (!conf)
+    return 0;
+
+  value = g_ascii_strtoull (conf, NULL, 10);
+  if (value > MAX_PRESPAWN)
+    {
+      g_message ("Invalid %s prespawn value '%s', setting to %u", type, conf, MAX_PRESPAWN);
+      value = MAX_PRESPAWN;
+    }
+
+  return value;
+}
+
+static void
+on_prespawned_close (CockpitAuthPipe *auth_pipe,
+                     GError *error,
+                     gpointer user_data)
+{
+  Prespawned *ps = user_data;
+  GQueue *queue;
+
+  g_debug ("%s: prespawned login process went away", ps->type);
+
+  queue = g_hash_table_lookup (ps->auth->prespawned, ps->type);
+  if (queue)
+    g_queue_remove (queue, ps);
+
+  g_signal_handler_disconnect (auth_pipe, ps->close_sig);
+  ps->close_sig = 0;
+  prespawned_free (ps);
+}
+
+static void
+prespawn_logins (CockpitAuth *self,
+                 const gchar *type)
+{
+  const gchar *argv[] = { NULL, NULL };
+  GError *error = NULL;
+  Prespawned *ps;
+  GQueue *queue;
+  gint child_pd;
+  guint want;
+  gchar *id;
+
+  want = prespawn_option (type);
+  if (want == 0)
+    return;
+
+  queue = g_hash_table_lookup (self->prespawned, type);
+  if (!queue)
+    {
+      queue = g_queue_new ();
+      g_hash_table_insert (self->prespawned, g_strdup (type), queue);
+    }
+
+  argv[0] = type_option (type, "command", cockpit_ws_session_program);
+
+  while (g_queue_get_length (queue) < want)
+    {
+      ps = g_new0 (Prespawned, 1);
+      ps->auth = self;
+      ps->type = g_strdup (type);
+      ps->process_in = -1;
+      ps->process_out = -1;
+
+      id = cockpit_auth_nonce (self);
+      ps->auth_pipe = new_spawn_auth_pipe (self, type, id, argv[0]);
+      g_free (id);
+
+      child_pd = cockpit_auth_pipe_steal_fd (ps->auth_pipe);
+      if (!spawn_login_process (argv, child_pd, &ps->process_pid,
+                                &ps->process_in, &ps->process_out, &error))
+        {
+          g_warning ("failed to prespawn %s: %s", argv[0], error->message);
+          g_error_free (error);
+          close (child_pd);
+          prespawned_free (ps);
+          break;
+        }
+
+      /* Child process end of pipe */
+      close (child_pd);
+
+      ps->close_sig = g_signal_connect (ps->auth_pipe, "close",
+                                        G_CALLBACK (on_prespawned_close), ps);
+      g_queue_push_tail (queue, ps);
+    }
+}
+
+static gboolean
+on_prespawn_refill (gpointer user_data)
+{
+  PrespawnRefill *refill = user_data;
+  prespawn_logins (refill->auth, refill->type);
+  return FALSE;
+}
+
+static void
+prespawn_refill_free (gpointer user_data)
+{
+  PrespawnRefill *refill = user_data;
+  g_object_unref (refill->auth);
+  g_free (refill->type);
+  g_free (refill);
+}
+
+static void
+prespawn_refill_later (CockpitAuth *self,
+                       const gchar *type)
+{
+  PrespawnRefill *refill;
+
+  if (prespawn_option (type) == 0)
+    return;
+
+  refill = g_new0 (PrespawnRefill, 1);
+  refill->auth = g_object_ref (self);
+  refill->type = g_strdup (type);
+  g_idle_add_full (G_PRIORITY_LOW, on_prespawn_refill, refill, prespawn_refill_free);
+}
+
+static Prespawned *
+take_prespawned (CockpitAuth *self,
+                 const gchar *type)
+{
+  Prespawned *ps = NULL;
+  GQueue *queue;
+
+  queue = g_hash_table_lookup (self->prespawned, type);
+  if (queue)
+    ps = g_queue_pop_head (queue);
+
+  prespawn_refill_later (self, type);
+
+  if (ps)
+    {
+      g_signal_handler_disconnect (ps->auth_pipe, ps->close_sig);
+      ps->close_sig = 0;
+    }
+
+  return ps;
+}
+
+static GBytes *
+build_prespawned_input (const gchar *type,
+                        const gchar *remote_peer,
+                        GBytes *input)
+{
+  GByteArray *buffer;
+  gconstpointer data;
+  gsize length;
+  gchar *header;
+
+  header = g_strdup_printf ("%s\n%s\n", type, remote_peer ? remote_peer : "");
+  buffer = g_byte_array_new ();
+  g_byte_array_append (buffer, (guint8 *)header, strlen (header));
+  g_free (header);
+
+  /* Same as cockpit_auth_pipe_answer() does for empty input */
+  data = g_bytes_get_data (input, &length);
+  if (length > 0)
+    g_byte_array_append (buffer, data, length);
+  else
+    g_byte_array_append (buffer, (guint8 *)"", 1);
+
+  return g_byte_array_free_to_bytes (buffer);
+}
+
 
 static void
 build_gssapi_output_header (GHashTable *headers,
@@ -803,7 +1108,10 @@ cockpit_auth_spawn_login_async (CockpitAuth *self,
   GSimpleAsyncResult *result;
   SpawnLoginData *sl;
   AuthData *ad = NULL;
-  gint child_pd;
+  Prespawned *ps = NULL;
+  GBytes *bytes;
+  gboolean spawned;
+  gint child_pd = -1;
 
   GBytes *input = NULL;
   const gchar *command;
@@ -827,22 +1135,26 @@ cockpit_auth_spawn_login_async (CockpitAuth *self,
 
   if (input && application)
     {
+      ps = take_prespawned (self, type);
+
       ad = g_new0 (AuthData, 1);
       ad->refs = 1;
-      ad->id = cockpit_auth_nonce (self);
       ad->pending_result = NULL;
       ad->response_data = NULL;
       ad->tag = cockpit_auth_spawn_login_async;
       ad->destroy_func = spawn_login_data_free;
       ad->user_data = NULL;
-      ad->auth_pipe = g_object_new (COCKPIT_TYPE_AUTH_PIPE,
-                                    "pipe-timeout", timeout_option ("timeout", type,
-                                                                    cockpit_ws_auth_process_timeout),
-                                    "idle-timeout", timeout_option ("response-timeout", type,
-                                                                    cockpit_ws_auth_response_timeout),
-                                    "id", ad->id,
-                                    "logname", command,
-                                    NULL);
+      if (ps)
+        {
+          ad->auth_pipe = ps->auth_pipe;
+          ps->auth_pipe = NULL;
+          ad->id = g_strdup (cockpit_auth_pipe_get_id (ad->auth_pipe));
+        }
+      else
+        {
+          ad->id = cockpit_auth_nonce (self);
+          ad->auth_pipe = new_spawn_auth_pipe (self, type, ad->id, command);
+        }
 
       sl = g_new0 (SpawnLoginData, 1);
       sl->remote_peer = g_strdup (remote_peer);
@@ -855,16 +1167,28 @@ cockpit_auth_spawn_login_async (CockpitAuth *self,
 
       ad->user_data = sl;
 
-      child_pd = cockpit_auth_pipe_steal_fd (ad->auth_pipe);
       g_simple_async_result_set_op_res_gpointer (result,
                                                  auth_data_ref (ad), auth_data_unref);
 
-      g_debug ("spawning %s", argv[0]);
+      if (ps)
+        {
+          g_debug ("using prespawned %s", argv[0]);
+          sl->process_pid = ps->process_pid;
+          sl->process_in = ps->process_in;
+          sl->process_out = ps->process_out;
+          ps->process_pid = 0;
+          ps->process_in = -1;
+          ps->process_out = -1;
+          spawned = TRUE;
+        }
+      else
+        {
+          child_pd = cockpit_auth_pipe_steal_fd (ad->auth_pipe);
+          spawned = spawn_login_process (argv, child_pd, &sl->process_pid,
+                                         &sl->process_in, &sl->process_out, &error);
+        }
 
-      if (g_spawn_async_with_pipes (NULL, (gchar **) argv, NULL,
-                                     G_SPAWN_DO_NOT_REAP_CHILD | G_SPAWN_LEAVE_DESCRIPTORS_OPEN,
-                                     spawn_child_setup, GINT_TO_POINTER (child_pd),
-                                     &sl->process_pid, &sl->process_in, &sl->process_out, NULL, &error))
+      if (spawned)
         {
           auth_data_add_pending_result (ad, result);
           g_signal_connect (ad->auth_pipe, "message",
@@ -873,7 +1197,16 @@ cockpit_auth_spawn_login_async (CockpitAuth *self,
           g_signal_connect (ad->auth_pipe, "close",
                             G_CALLBACK (on_spawn_auth_pipe_close),
                             ad);
-          cockpit_auth_pipe_answer (ad->auth_pipe, input);
+          if (ps)
+            {
+              bytes = build_prespawned_input (type, remote_peer, input);
+              cockpit_auth_pipe_answer (ad->auth_pipe, bytes);
+              g_bytes_unref (bytes);
+            }
+          else
+            {
+              cockpit_auth_pipe_answer (ad->auth_pipe, input);
+            }
         }
       else
         {
@@ -886,7 +1219,10 @@ cockpit_auth_spawn_login_async (CockpitAuth *self,
         }
 
       /* Child process end of pipe */
-      close (child_pd);
+      if (ps)
+        prespawned_free (ps);
+      else
+        close (child_pd);
     }
   else
     {
@@ -939,6 +1275,7 @@ cockpit_auth_spawn_login_finish (CockpitAuth *self,
                                "pid", sl->process_pid,
                                "in-fd", sl->process_out,
                                "out-fd", sl->process_in,
+                               "pipe-size", (gint)self->local_pipe_size,
                                NULL);
           sl->process_pid = 0;
           sl->process_out = -1;
@@ -1472,27 +1809,12 @@ cockpit_auth_class_init (CockpitAuthClass *klass)
                               0, NULL, NULL, NULL, G_TYPE_NONE, 0);
 }
 
-static char *
-base64_decode_string (const char *enc)
-{
-  if (enc == NULL)
-    return NULL;
-
-  char *dec = g_strdup (enc);
-  gsize len;
-  g_base64_decode_inplace (dec, &len);
-  dec[len] = '\0';
-  return dec;
-}
-
 static CockpitAuthenticated *
 authenticated_for_headers (CockpitAuth *self,
                            const gchar *path,
                            GHashTable *in_headers)
 {
-  gchar *cookie = NULL;
   gchar *raw = NULL;
-  const char *prefix = "v=2;k=";
   CockpitAuthenticated *ret = NULL;
   const gchar *application;
   gchar *memory = NULL;
@@ -1507,15 +1829,9 @@ authenticated_for_headers (CockpitAuth *self,
   raw = cockpit_web_server_parse_cookie (in_headers, application);
   if (raw)
     {
-      cookie = base64_decode_string (raw);
-      if (cookie != NULL)
-        {
-          if (g_str_has_prefix (cookie, prefix))
-            ret = g_hash_table_lookup (self->authenticated, cookie);
-          else
-            g_debug ("invalid or unsupported cookie: %s", cookie);
-          g_free (cookie);
-        }
+      ret = g_hash_table_lookup (self->authenticated, raw);
+      if (!ret)
+        g_debug ("invalid or unknown cookie");
       g_free (raw);
     }
 
@@ -1585,6 +1901,156 @@ can_start_auth (CockpitAuth *self)
   return (r < p) ? FALSE : TRUE;
 }
 
+/*
+ * Logins that MaxStartups lets through wait in a queue until they're
+ * admitted. At most login_concurrency of them run at once, and each
+ * remote peer has a token bucket refilled at login_rate per second.
+ * A peer that's out of tokens doesn't hold up logins from others.
+ */
+
+typedef struct {
+  gdouble tokens;
+  gint64 when;
+} LoginBucket;
+
+typedef struct {
+  CockpitAuth *auth;
+  gchar *path;
+  GHashTable *headers;
+  gchar *remote_peer;
+  GAsyncReadyCallback callback;
+  gpointer user_data;
+  gint64 queued;
+} QueuedLogin;
+
+#define MAX_LOGIN_BUCKETS 1024
+
+static void
+queued_login_free (QueuedLogin *ql)
+{
+  g_object_unref (ql->auth);
+  g_free (ql->path);
+  g_hash_table_unref (ql->headers);
+  g_free (ql->remote_peer);
+  g_free (ql);
+}
+
+static gboolean
+bucket_is_full (gpointer key,
+                gpointer value,
+                gpointer user_data)
+{
+  CockpitAuth *self = user_data;
+  LoginBucket *bucket = value;
+  gint64 now = g_get_monotonic_time ();
+  return bucket->tokens + (now - bucket->when) * self->login_rate / G_USEC_PER_SEC >= self->login_burst;
+}
+
+/* Returns zero if a token was taken, otherwise milliseconds until one is available */
+static guint
+login_bucket_take (CockpitAuth *self,
+                   const gchar *remote_peer)
+{
+  LoginBucket *bucket;
+  gint64 now;
+
+  if (self->login_rate <= 0)
+    return 0;
+
+  if (!remote_peer)
+    remote_peer = "";
+
+  now = g_get_monotonic_time ();
+  bucket = g_hash_table_lookup (self->login_buckets, remote_peer);
+  if (!bucket)
+    {
+      if (g_hash_table_size (self->login_buckets) >= MAX_LOGIN_BUCKETS)
+        g_hash_table_foreach_remove (self->login_buckets, bucket_is_full, self);
+
+      bucket = g_new0 (LoginBucket, 1);
+      bucket->tokens = self->login_burst;
+      bucket->when = now;
+      g_hash_table_insert (self->login_buckets, g_strdup (remote_peer), bucket);
+    }
+
+  bucket->tokens += (now - bucket->when) * self->login_rate / G_USEC_PER_SEC;
+  bucket->tokens = MIN (bucket->tokens, self->login_burst);
+  bucket->when = now;
+
+  if (bucket->tokens >= 1.0)
+    {
+      bucket->tokens -= 1.0;
+      return 0;
+    }
+
+  return (guint)((1.0 - bucket->tokens) * 1000 / self->login_rate) + 1;
+}
+
+static void dispatch_logins (CockpitAuth *self);
+
+static gboolean
+on_login_queue_timeout (gpointer user_data)
+{
+  CockpitAuth *self = user_data;
+  self->login_queue_tag = 0;
+  dispatch_logins (self);
+  return FALSE;
+}
+
+static void
+on_login_ready (GObject *source,
+                GAsyncResult *result,
+                gpointer user_data)
+{
+  QueuedLogin *ql = user_data;
+  CockpitAuth *self = ql->auth;
+
+  g_assert (self->login_running > 0);
+  self->login_running--;
+
+  /* Includes any time spent waiting for a turn */
+  cockpit_stats_time (NULL, COCKPIT_STAT_WS_LOGIN_LATENCY, g_get_monotonic_time () - ql->queued);
+
+  ql->callback (source, result, ql->user_data);
+  dispatch_logins (self);
+  queued_login_free (ql);
+}
+
+static void
+dispatch_logins (CockpitAuth *self)
+{
+  CockpitAuthClass *klass = COCKPIT_AUTH_GET_CLASS (self);
+  QueuedLogin *ql;
+  GList *l, *next;
+  guint delay;
+  guint wait = 0;
+
+  for (l = self->login_queue->head; l != NULL; l = next)
+    {
+      next = l->next;
+      ql = l->data;
+
+      if (self->login_concurrency && self->login_running >= self->login_concurrency)
+        break;
+
+      delay = login_bucket_take (self, ql->remote_peer);
+      if (delay > 0)
+        {
+          if (wait == 0 || delay < wait)
+            wait = delay;
+          continue;
+        }
+
+      g_queue_delete_link (self->login_queue, l);
+      self->login_running++;
+
+      klass->login_async (self, ql->path, ql->headers, ql->remote_peer, on_login_ready, ql);
+    }
+
+  if (wait && !self->login_queue_tag)
+    self->login_queue_tag = g_timeout_add (wait, on_login_queue_timeout, self);
+}
+
 void
 cockpit_auth_login_async (CockpitAuth *self,
                           const gchar *path,
@@ -1595,13 +2061,46 @@ cockpit_auth_login_async (CockpitAuth *self,
 {
   CockpitAuthClass *klass = COCKPIT_AUTH_GET_CLASS (self);
   GSimpleAsyncResult *result = NULL;
+  GHashTableIter iter;
+  gpointer key, value;
+  QueuedLogin *ql;
 
   g_return_if_fail (klass->login_async != NULL);
 
   self->startups++;
   if (can_start_auth (self))
     {
-      klass->login_async (self, path, headers, remote_peer, callback, user_data);
+      ql = g_new0 (QueuedLogin, 1);
+      ql->auth = g_object_ref (self);
+      ql->path = g_strdup (path);
+      ql->remote_peer = g_strdup (remote_peer);
+      ql->callback = callback;
+      ql->user_data = user_data;
+      ql->queued = g_get_monotonic_time ();
+
+      /*
+       * The caller's headers may not stay around while queued. The
+       * Authorization header is moved rather than copied, so that it's
+       * still cleared from memory when stolen by the login.
+       */
+      ql->headers = cockpit_web_server_new_table ();
+      g_hash_table_iter_init (&iter, headers);
+      while (g_hash_table_iter_next (&iter, &key, &value))
+        {
+          if (g_ascii_strcasecmp (key, "Authorization") != 0)
+            g_hash_table_insert (ql->headers, g_strdup (key), g_strdup (value));
+        }
+      if (g_hash_table_lookup_extended (headers, "Authorization", &key, &value))
+        {
+          g_hash_table_steal (headers, "Authorization");
+          g_hash_table_insert (ql->headers, key, value);
+        }
+
+      g_queue_push_tail (self->login_queue, ql);
+      dispatch_logins (self);
+
+      if (!g_queue_is_empty (self->login_queue))
+        g_debug ("%u logins waiting to start", g_queue_get_length (self->login_queue));
     }
   else
     {
@@ -1640,7 +2139,7 @@ on_web_service_idling (CockpitWebService *service,
   CockpitAuthenticated *authenticated = data;
 
   if (authenticated->timeout_tag)
-    g_source_remove (authenticated->timeout_tag);
+    cockpit_timer_wheel_remove (authenticated->timeout_tag);
 
   g_debug ("%s: login is idle", cockpit_creds_get_user (authenticated->creds));
 
@@ -1648,19 +2147,20 @@ on_web_service_idling (CockpitWebService *service,
    * The minimum amount of time before a request uses this new web service,
    * otherwise it will just go away.
    */
-  authenticated->timeout_tag = g_timeout_add_seconds (cockpit_ws_service_idle,
-                                                      on_authenticated_timeout,
-                                                      authenticated);
+  authenticated->timeout_tag = cockpit_timer_wheel_add_seconds (NULL, cockpit_ws_service_idle,
+                                                                on_authenticated_timeout,
+                                                                authenticated);
 
   /*
    * Also reset the timer which checks whether anything is going on in the
    * entire process or not.
    */
   if (authenticated->auth->timeout_tag)
-    g_source_remove (authenticated->auth->timeout_tag);
+    cockpit_timer_wheel_remove (authenticated->auth->timeout_tag);
 
-  authenticated->auth->timeout_tag = g_timeout_add_seconds (cockpit_ws_process_idle,
-                                                            on_process_timeout, authenticated->auth);
+  authenticated->auth->timeout_tag = cockpit_timer_wheel_add_seconds (NULL, cockpit_ws_process_idle,
+                                                                      on_process_timeout,
+                                                                      authenticated->auth);
 }
 
 static void
@@ -1683,7 +2183,7 @@ cockpit_auth_login_finish (CockpitAuth *self,
   CockpitTransport *transport = NULL;
   JsonObject *prompt_data = NULL;
   CockpitCreds *creds;
-  gchar *cookie_b64 = NULL;
+  gchar *cookie;
   gchar *header;
   gchar *id;
 
@@ -1697,7 +2197,9 @@ cockpit_auth_login_finish (CockpitAuth *self,
 
   id = cockpit_auth_nonce (self);
   authenticated = g_new0 (CockpitAuthenticated, 1);
-  authenticated->cookie = g_strdup_printf ("v=2;k=%s", id);
+  cookie = g_strdup_printf ("v=2;k=%s", id);
+  authenticated->cookie = g_base64_encode ((guint8 *)cookie, strlen (cookie));
+  g_free (cookie);
   authenticated->creds = creds;
   authenticated->service = cockpit_web_service_new (creds, transport);
   authenticated->auth = self;
@@ -1727,11 +2229,9 @@ cockpit_auth_login_finish (CockpitAuth *self,
   if (out_headers)
     {
       gboolean force_secure = !(flags & COCKPIT_AUTH_COOKIE_INSECURE);
-      cookie_b64 = g_base64_encode ((guint8 *)authenticated->cookie, strlen (authenticated->cookie));
       header = g_strdup_printf ("%s=%s; Path=/; %s HttpOnly",
                                 cockpit_creds_get_application (creds),
-                                cookie_b64, force_secure ? " Secure;" : "");
-      g_free (cookie_b64);
+                                authenticated->cookie, force_secure ? " Secure;" : "");
       g_hash_table_insert (out_headers, g_strdup ("Set-Cookie"), header);
     }
 
@@ -1745,6 +2245,7 @@ cockpit_auth_new (gboolean login_loopback)
 {
   CockpitAuth *self = g_object_new (COCKPIT_TYPE_AUTH, NULL);
   const gchar *max_startups_conf;
+  const gchar *conf;
   gint count = 0;
 
   self->login_loopback = login_loopback;
@@ -1784,6 +2285,32 @@ cockpit_auth_new (gboolean login_loopback)
         }
     }
 
+  conf = cockpit_conf_string ("WebService", "LoginConcurrency");
+  if (conf)
+    self->login_concurrency = (guint)g_ascii_strtoull (conf, NULL, 10);
+
+  conf = cockpit_conf_string ("WebService", "LoginRate");
+  if (conf)
+    {
+      count = sscanf (conf, "%lf:%lf", &self->login_rate, &self->login_burst);
+      if (count == 1)
+        self->login_burst = MAX (self->login_rate, 1.0);
+      if (count < 1 || self->login_rate <= 0 || self->login_burst < 1)
+        {
+          g_warning ("Illegal LoginRate spec: %s. Not limiting login rate", conf);
+          self->login_rate = 0;
+          self->login_burst = 0;
+        }
+    }
+
+  conf = cockpit_conf_string ("WebService", "LocalPipeSize");
+  if (conf)
+    self->local_pipe_size = (guint)MIN (g_ascii_strtoull (conf, NULL, 10), G_MAXINT);
+
+  /* The types that cockpit-session knows about, others start on first use */
+  prespawn_refill_later (self, "basic");
+  prespawn_refill_later (self, "negotiate");
+
   return self;
 }
 
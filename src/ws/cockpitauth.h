@@ -49,6 +49,7 @@ struct _CockpitAuth
   GBytes *key;
   GHashTable *authenticated;
   GHashTable *authentication_pending;
+  GHashTable *prespawned;
   guint64 nonce_seed;
   gboolean login_loopback;
   gulong timeout_tag;
@@ -56,6 +57,18 @@ struct _CockpitAuth
   guint max_startups;
   guint max_startups_begin;
   guint max_startups_rate;
+
+  /* Admission of logins, see cockpit_auth_login_async() */
+  GQueue *login_queue;
+  guint login_running;
+  guint login_concurrency;
+  GHashTable *login_buckets;
+  gdouble login_rate;
+  gdouble login_burst;
+  guint login_queue_tag;
+
+  /* Kernel pipe buffer size for local sessions, or zero */
+  guint local_pipe_size;
 };
 
 struct _CockpitAuthClass
@@ -0,0 +1,334 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2016 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitbroadcast.h"
+
+#include "common/cockpitjson.h"
+#include "common/cockpittransport.h"
+#include "common/cockpitunicode.h"
+
+#include <string.h>
+
+/*
+ * Runs the same channel on many hosts. cockpit-ws opens an internal
+ * channel to at most "concurrency" hosts at a time, and the next ones
+ * as those close. What the hosts send comes back in batches, each a
+ * JSON array of entries tagged with the host they came from, so that
+ * a hundred hosts don't mean a hundred WebSocket messages at a time.
+ */
+
+/* Bytes held back before a batch goes out, and how long at most */
+gsize cockpit_broadcast_batch_size = 64 * 1024;
+guint cockpit_broadcast_latency = 100;
+
+typedef struct {
+  gchar *name;
+  gboolean started;
+  gboolean closed;
+} BroadcastHost;
+
+struct _CockpitBroadcast {
+  gchar *channel;
+  BroadcastHost *hosts;
+  guint n_hosts;
+  guint concurrency;
+  guint n_started;
+  guint n_running;
+  guint n_closed;
+  gboolean ready;
+
+  /* Entries not sent yet, without the outer brackets */
+  GString *batch;
+  guint flush_timeout;
+
+  CockpitBroadcastFunc send;
+  gpointer user_data;
+};
+
+CockpitBroadcast *
+cockpit_broadcast_new (const gchar *channel,
+                       const gchar **hosts,
+                       guint concurrency,
+                       CockpitBroadcastFunc send,
+                       gpointer user_data)
+{
+  CockpitBroadcast *self;
+  guint i;
+
+  g_return_val_if_fail (channel != NULL, NULL);
+  g_return_val_if_fail (hosts != NULL, NULL);
+  g_return_val_if_fail (concurrency > 0, NULL);
+  g_return_val_if_fail (send != NULL, NULL);
+
+  self = g_new0 (CockpitBroadcast, 1);
+  self->channel = g_strdup (channel);
+  self->n_hosts = g_strv_length ((gchar **)hosts);
+  self->hosts = g_new0 (BroadcastHost, self->n_hosts);
+  for (i = 0; i < self->n_hosts; i++)
+    self->hosts[i].name = g_strdup (hosts[i]);
+  self->concurrency = concurrency;
+  self->batch = g_string_new ("");
+  self->send = send;
+  self->user_data = user_data;
+  return self;
+}
+
+void
+cockpit_broadcast_free (CockpitBroadcast *self)
+{
+  guint i;
+
+  if (!self)
+    return;
+
+  if (self->flush_timeout)
+    g_source_remove (self->flush_timeout);
+  for (i = 0; i < self->n_hosts; i++)
+    g_free (self->hosts[i].name);
+  g_free (self->hosts);
+  g_string_free (self->batch, TRUE);
+  g_free (self->channel);
+  g_free (self);
+}
+
+/**
+ * cockpit_broadcast_next:
+ * @self: a broadcast
+ *
+ * Picks the next host to open a channel to, if there's room for
+ * another one to run.
+ *
+ * Returns: index of the host, or -1 when none should be opened now
+ */
+gint
+cockpit_broadcast_next (CockpitBroadcast *self)
+{
+  g_return_val_if_fail (self != NULL, -1);
+
+  if (self->n_started == self->n_hosts || self->n_running >= self->concurrency)
+    return -1;
+
+  self->hosts[self->n_started].started = TRUE;
+  self->n_running++;
+  return self->n_started++;
+}
+
+/**
+ * cockpit_broadcast_pending:
+ * @self: a broadcast
+ *
+ * Returns: TRUE while some hosts haven't been opened yet
+ */
+gboolean
+cockpit_broadcast_pending (CockpitBroadcast *self)
+{
+  g_return_val_if_fail (self != NULL, FALSE);
+  return self->n_started < self->n_hosts;
+}
+
+static void
+broadcast_flush (CockpitBroadcast *self)
+{
+  GString *frame;
+  GBytes *payload;
+
+  if (self->flush_timeout)
+    {
+      g_source_remove (self->flush_timeout);
+      self->flush_timeout = 0;
+    }
+
+  if (self->batch->len == 0)
+    return;
+
+  frame = g_string_sized_new (self->batch->len + 2);
+  g_string_append_c (frame, '[');
+  g_string_append_len (frame, self->batch->str, self->batch->len);
+  g_string_append_c (frame, ']');
+  g_string_truncate (self->batch, 0);
+
+  payload = g_string_free_to_bytes (frame);
+  (self->send) (self->channel, payload, self->user_data);
+  g_bytes_unref (payload);
+}
+
+static gboolean
+on_flush_timeout (gpointer user_data)
+{
+  CockpitBroadcast *self = user_data;
+
+  self->flush_timeout = 0;
+  broadcast_flush (self);
+  return FALSE;
+}
+
+static void
+broadcast_queued (CockpitBroadcast *self)
+{
+  if (self->batch->len >= cockpit_broadcast_batch_size)
+    broadcast_flush (self);
+  else if (!self->flush_timeout)
+    self->flush_timeout = g_timeout_add (cockpit_broadcast_latency, on_flush_timeout, self);
+}
+
+static void
+broadcast_begin_entry (CockpitBroadcast *self,
+                       BroadcastHost *host)
+{
+  if (self->batch->len > 0)
+    g_string_append_c (self->batch, ',');
+  g_string_append (self->batch, "{\"host\":");
+  cockpit_json_append_string (self->batch, host->name);
+}
+
+static void
+broadcast_mark_ready (CockpitBroadcast *self)
+{
+  GBytes *payload;
+
+  /* Ready as soon as any host is */
+  if (self->ready)
+    return;
+
+  self->ready = TRUE;
+  payload = cockpit_transport_build_control ("command", "ready", "channel", self->channel, NULL);
+  (self->send) (NULL, payload, self->user_data);
+  g_bytes_unref (payload);
+}
+
+/**
+ * cockpit_broadcast_recv:
+ * @self: a broadcast
+ * @host: index of the host in the hosts passed to cockpit_broadcast_new()
+ * @payload: a message from that host's channel
+ *
+ * The message is added to the current batch as a "data" entry.
+ */
+void
+cockpit_broadcast_recv (CockpitBroadcast *self,
+                        guint host,
+                        GBytes *payload)
+{
+  BroadcastHost *bh;
+  GBytes *validated;
+  const gchar *text;
+  gchar *data;
+  gsize length;
+
+  g_return_if_fail (self != NULL);
+  g_return_if_fail (host < self->n_hosts);
+
+  bh = self->hosts + host;
+  if (bh->closed)
+    return;
+
+  broadcast_mark_ready (self);
+
+  validated = cockpit_unicode_force_utf8 (payload);
+  text = g_bytes_get_data (validated, &length);
+  data = g_strndup (text, length);
+  g_bytes_unref (validated);
+
+  broadcast_begin_entry (self, bh);
+  g_string_append (self->batch, ",\"data\":");
+  cockpit_json_append_string (self->batch, data);
+  g_string_append_c (self->batch, '}');
+  g_free (data);
+
+  broadcast_queued (self);
+}
+
+void
+cockpit_broadcast_ready (CockpitBroadcast *self,
+                         guint host)
+{
+  g_return_if_fail (self != NULL);
+  g_return_if_fail (host < self->n_hosts);
+
+  if (!self->hosts[host].closed)
+    broadcast_mark_ready (self);
+}
+
+/**
+ * cockpit_broadcast_close:
+ * @self: a broadcast
+ * @host: index of the host whose channel closed
+ * @options: the "close" message of that channel, or NULL
+ *
+ * A "close" entry with the fields of the message, such as "problem"
+ * or "exit-status", goes after what the host sent. Call
+ * cockpit_broadcast_next() afterwards to start the hosts that were
+ * waiting for room.
+ *
+ * Returns: TRUE when all the hosts have closed, and the last batch
+ *          was sent
+ */
+gboolean
+cockpit_broadcast_close (CockpitBroadcast *self,
+                         guint host,
+                         JsonObject *options)
+{
+  BroadcastHost *bh;
+  JsonObject *object;
+  GList *members, *l;
+  gchar *data;
+
+  g_return_val_if_fail (self != NULL, FALSE);
+  g_return_val_if_fail (host < self->n_hosts, FALSE);
+
+  bh = self->hosts + host;
+  if (bh->closed)
+    return self->n_closed == self->n_hosts;
+
+  bh->closed = TRUE;
+  self->n_closed++;
+  if (bh->started)
+    self->n_running--;
+
+  object = json_object_new ();
+  if (options)
+    {
+      members = json_object_get_members (options);
+      for (l = members; l != NULL; l = g_list_next (l))
+        {
+          if (!g_str_equal (l->data, "command") && !g_str_equal (l->data, "channel"))
+            json_object_set_member (object, l->data, json_node_copy (json_object_get_member (options, l->data)));
+        }
+      g_list_free (members);
+    }
+  data = cockpit_json_write_object (object, NULL);
+  json_object_unref (object);
+
+  broadcast_begin_entry (self, bh);
+  g_string_append (self->batch, ",\"close\":");
+  g_string_append (self->batch, data);
+  g_string_append_c (self->batch, '}');
+  g_free (data);
+
+  if (self->n_closed == self->n_hosts)
+    {
+      broadcast_flush (self);
+      return TRUE;
+    }
+
+  broadcast_queued (self);
+  return FALSE;
+}
@@ -0,0 +1,63 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2016 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __COCKPIT_BROADCAST_H__
+#define __COCKPIT_BROADCAST_H__
+
+#include <json-glib/json-glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _CockpitBroadcast CockpitBroadcast;
+
+/* Called with a NULL channel for control messages */
+typedef void                (* CockpitBroadcastFunc)          (const gchar *channel,
+                                                               GBytes *payload,
+                                                               gpointer user_data);
+
+extern gsize                   cockpit_broadcast_batch_size;
+
+extern guint                   cockpit_broadcast_latency;
+
+CockpitBroadcast *          cockpit_broadcast_new             (const gchar *channel,
+                                                               const gchar **hosts,
+                                                               guint concurrency,
+                                                               CockpitBroadcastFunc send,
+                                                               gpointer user_data);
+
+void                        cockpit_broadcast_free            (CockpitBroadcast *self);
+
+gint                        cockpit_broadcast_next            (CockpitBroadcast *self);
+
+gboolean                    cockpit_broadcast_pending         (CockpitBroadcast *self);
+
+void                        cockpit_broadcast_recv            (CockpitBroadcast *self,
+                                                               guint host,
+                                                               GBytes *payload);
+
+void                        cockpit_broadcast_ready           (CockpitBroadcast *self,
+                                                               guint host);
+
+gboolean                    cockpit_broadcast_close           (CockpitBroadcast *self,
+                                                               guint host,
+                                                               JsonObject *options);
+
+G_END_DECLS
+
+#endif /* __COCKPIT_BROADCAST_H__ */
@@ -20,12 +20,130 @@
 #include "config.h"
 
 #include "cockpitchannelresponse.h"
+#include "cockpitws.h"
 
+#include "common/cockpitwebcompress.h"
 #include "common/cockpitwebinject.h"
 #include "common/cockpitwebserver.h"
 
 #include <string.h>
 
+/* Compression of responses, level 0 is off. Overridable from tests */
+gint cockpit_ws_compress_level = 0;
+gsize cockpit_ws_compress_threshold = 1024;
+
+/* Package resources kept by checksum, in bytes, 0 is off. Overridable from tests */
+gsize cockpit_ws_resource_cache_size = 8 * 1024 * 1024;
+
+/*
+ * A resource under a checksum never changes, so once one has been
+ * fetched through a bridge it can be served again without asking.
+ * The key includes the user name: the checksum is what a bridge says
+ * about itself, and one user's hosts mustn't get to answer for
+ * another user's. The bridge may answer with a gzip compressed file
+ * depending on Accept-Encoding, so that goes in the key too.
+ */
+
+typedef struct {
+  gchar *key;
+  gchar *reason;
+  GHashTable *headers;
+  GBytes *body;
+  GList *link;
+} CachedResource;
+
+static GHashTable *cached_resources;
+static GQueue cached_order = G_QUEUE_INIT;
+static gsize cached_size;
+
+static void
+cached_resource_free (gpointer data)
+{
+  CachedResource *cached = data;
+
+  cached_size -= g_bytes_get_size (cached->body);
+  g_queue_delete_link (&cached_order, cached->link);
+  g_hash_table_unref (cached->headers);
+  g_bytes_unref (cached->body);
+  g_free (cached->reason);
+  g_free (cached->key);
+  g_free (cached);
+}
+
+static gchar *
+cached_resource_key (CockpitWebService *service,
+                     GHashTable *in_headers,
+                     const gchar *etag,
+                     const gchar *path)
+{
+  CockpitCreds *creds;
+  const gchar *encoding;
+
+  if (cockpit_ws_resource_cache_size == 0)
+    return NULL;
+
+  creds = cockpit_web_service_get_creds (service);
+  if (!creds)
+    return NULL;
+
+  encoding = g_hash_table_lookup (in_headers, "Accept-Encoding");
+  return g_strdup_printf ("%s\n%s\n%s\n%s", cockpit_creds_get_user (creds),
+                          etag, path, encoding ? encoding : "");
+}
+
+static CachedResource *
+cached_resource_lookup (const gchar *key)
+{
+  CachedResource *cached;
+
+  if (!cached_resources)
+    return NULL;
+
+  cached = g_hash_table_lookup (cached_resources, key);
+  if (cached)
+    {
+      /* Most recently used go last */
+      g_queue_unlink (&cached_order, cached->link);
+      g_queue_push_tail_link (&cached_order, cached->link);
+    }
+
+  return cached;
+}
+
+static void
+cached_resource_store (gchar *key,
+                       const gchar *reason,
+                       GHashTable *headers,
+                       GBytes *body)
+{
+  CachedResource *cached;
+
+  if (!cached_resources)
+    {
+      cached_resources = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                NULL, cached_resource_free);
+    }
+
+  cached = g_new0 (CachedResource, 1);
+  cached->key = key;
+  cached->reason = g_strdup (reason);
+  cached->headers = g_hash_table_ref (headers);
+  cached->body = g_bytes_ref (body);
+  cached->link = g_list_alloc ();
+  cached->link->data = cached;
+
+  g_queue_push_tail_link (&cached_order, cached->link);
+  cached_size += g_bytes_get_size (body);
+  g_hash_table_replace (cached_resources, cached->key, cached);
+
+  /* Drop the least recently used ones until it fits */
+  while (cached_size > cockpit_ws_resource_cache_size && cached_order.head)
+    {
+      cached = cached_order.head->data;
+      g_hash_table_remove (cached_resources, cached->key);
+    }
+}
+
 typedef struct {
   CockpitWebService *service;
   gchar *base_path;
@@ -97,7 +215,29 @@ cockpit_channel_inject_perform (CockpitChannelInject *inject,
   g_object_unref (filter);
 }
 
+/*
+ * The body of an upload is read from the connection a chunk at a time,
+ * and each chunk goes into the channel as a payload. When the bridge
+ * acks them, no more than a channel window is ever in flight, so a
+ * fast client can't fill our memory while the bridge is slow to write.
+ */
+#define UPLOAD_CHUNK (64 * 1024)
+
+typedef struct _CockpitChannelResponse CockpitChannelResponse;
+
 typedef struct {
+  /* Cleared once the response is closed during a read */
+  CockpitChannelResponse *chesp;
+  GInputStream *input;
+  GCancellable *cancellable;
+  guint64 remaining;
+  gint64 unacked;
+  gboolean acks;
+  gboolean reading;
+  guint8 buffer[UPLOAD_CHUNK];
+} CockpitChannelUpload;
+
+struct _CockpitChannelResponse {
   const gchar *logname;
   gchar *channel;
   JsonObject *open;
@@ -106,13 +246,26 @@ typedef struct {
   GHashTable *headers;
 
   CockpitTransport *transport;
-  gulong transport_recv;
-  gulong transport_control;
+  CockpitTransportControlFunc transport_control;
   gulong transport_closed;
 
   /* Set when injecting data into response */
   CockpitChannelInject *inject;
-} CockpitChannelResponse;
+
+  /* The encoding the client accepts, and the length if known */
+  const gchar *compress;
+  gint64 length;
+  gboolean vary_cookie;
+
+  /* Set while the response is collected for the resource cache */
+  gchar *cache_key;
+  gchar *cache_reason;
+  GHashTable *cache_headers;
+  GByteArray *cache_body;
+
+  /* Set while a request body is sent into the channel */
+  CockpitChannelUpload *upload;
+};
 
 static gboolean
 redirect_to_checksum_path (CockpitWebService *service,
@@ -151,6 +304,155 @@ redirect_to_checksum_path (CockpitWebService *service,
   return ret;
 }
 
+static const gchar *
+accepted_compression (GHashTable *in_headers)
+{
+  if (cockpit_ws_compress_level > 0 && g_hash_table_lookup (in_headers, "Accept-Encoding"))
+    {
+      if (cockpit_web_server_parse_encoding (in_headers, "gzip"))
+        return "gzip";
+      else if (cockpit_web_server_parse_encoding (in_headers, "deflate"))
+        return "deflate";
+    }
+
+  return NULL;
+}
+
+static void
+maybe_compress (CockpitWebResponse *response,
+                GHashTable *headers,
+                const gchar *compress,
+                gint64 length,
+                gboolean vary_cookie,
+                guint status)
+{
+  CockpitWebFilter *filter;
+  const gchar *content_type;
+  const gchar *vary;
+
+  if (!compress || status != 200 ||
+      g_hash_table_lookup (headers, "Content-Encoding"))
+    return;
+
+  /* Small responses aren't worth it */
+  if (length >= 0 && (guint64)length < cockpit_ws_compress_threshold)
+    return;
+
+  content_type = g_hash_table_lookup (headers, "Content-Type");
+  if (!content_type)
+    content_type = cockpit_web_response_content_type (cockpit_web_response_get_path (response));
+  if (!cockpit_web_compress_type (content_type))
+    return;
+
+  /* Goes last, after anything injected */
+  filter = cockpit_web_compress_new (compress, cockpit_ws_compress_level);
+  cockpit_web_response_add_filter (response, filter);
+  g_object_unref (filter);
+
+  g_hash_table_replace (headers, g_strdup ("Content-Encoding"), g_strdup (compress));
+
+  /* Setting Vary here replaces the one that goes with private caching */
+  vary = g_hash_table_lookup (headers, "Vary");
+  if (vary)
+    g_hash_table_replace (headers, g_strdup ("Vary"), g_strdup_printf ("%s, Accept-Encoding", vary));
+  else if (vary_cookie)
+    g_hash_table_replace (headers, g_strdup ("Vary"), g_strdup ("Cookie, Accept-Encoding"));
+  else
+    g_hash_table_replace (headers, g_strdup ("Vary"), g_strdup ("Accept-Encoding"));
+}
+
+static GHashTable *
+copy_headers (GHashTable *headers)
+{
+  GHashTable *copy;
+  GHashTableIter iter;
+  gpointer key;
+  gpointer value;
+
+  copy = cockpit_web_server_new_table ();
+  g_hash_table_iter_init (&iter, headers);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    g_hash_table_insert (copy, g_strdup (key), g_strdup (value));
+
+  return copy;
+}
+
+static void
+cache_abandon (CockpitChannelResponse *chesp)
+{
+  g_free (chesp->cache_key);
+  chesp->cache_key = NULL;
+  g_free (chesp->cache_reason);
+  chesp->cache_reason = NULL;
+  if (chesp->cache_headers)
+    g_hash_table_unref (chesp->cache_headers);
+  chesp->cache_headers = NULL;
+  if (chesp->cache_body)
+    g_byte_array_unref (chesp->cache_body);
+  chesp->cache_body = NULL;
+}
+
+static void
+cache_collect (CockpitChannelResponse *chesp,
+               GBytes *payload)
+{
+  gsize size = g_bytes_get_size (payload);
+
+  if (!chesp->cache_body)
+    return;
+
+  /* Don't let one large resource push out all the others */
+  if (chesp->cache_body->len + size > cockpit_ws_resource_cache_size / 4)
+    {
+      cache_abandon (chesp);
+      return;
+    }
+
+  g_byte_array_append (chesp->cache_body, g_bytes_get_data (payload, NULL), size);
+}
+
+static void
+cache_finish (CockpitChannelResponse *chesp)
+{
+  GBytes *body;
+
+  if (!chesp->cache_body)
+    return;
+
+  body = g_byte_array_free_to_bytes (chesp->cache_body);
+  chesp->cache_body = NULL;
+
+  cached_resource_store (chesp->cache_key, chesp->cache_reason, chesp->cache_headers, body);
+  chesp->cache_key = NULL;
+
+  g_bytes_unref (body);
+  cache_abandon (chesp);
+}
+
+static gboolean
+serve_cached (CockpitWebResponse *response,
+              const gchar *key,
+              const gchar *compress)
+{
+  CachedResource *cached;
+  GHashTable *headers;
+
+  cached = cached_resource_lookup (key);
+  if (!cached)
+    return FALSE;
+
+  g_debug ("%s: serving from resource cache", cockpit_web_response_get_path (response));
+
+  headers = copy_headers (cached->headers);
+  maybe_compress (response, headers, compress, g_bytes_get_size (cached->body), FALSE, 200);
+  cockpit_web_response_headers_full (response, 200, cached->reason, -1, headers);
+  if (cockpit_web_response_queue (response, cached->body))
+    cockpit_web_response_complete (response);
+  g_hash_table_unref (headers);
+
+  return TRUE;
+}
+
 static gboolean
 ensure_headers (CockpitChannelResponse *chesp,
                 guint status,
@@ -160,6 +462,21 @@ ensure_headers (CockpitChannelResponse *chesp,
     {
       if (chesp->inject)
         cockpit_channel_inject_perform (chesp->inject, chesp->response, chesp->transport);
+
+      /* Only plain successful responses are kept, as they were before compression */
+      if (chesp->cache_key && status == 200)
+        {
+          chesp->cache_reason = g_strdup (reason);
+          chesp->cache_headers = copy_headers (chesp->headers);
+          chesp->cache_body = g_byte_array_new ();
+        }
+      else
+        {
+          cache_abandon (chesp);
+        }
+
+      maybe_compress (chesp->response, chesp->headers, chesp->compress,
+                      chesp->length, chesp->vary_cookie, status);
       cockpit_web_response_headers_full (chesp->response, status, reason, -1, chesp->headers);
       return TRUE;
     }
@@ -167,6 +484,45 @@ ensure_headers (CockpitChannelResponse *chesp,
   return FALSE;
 }
 
+static void
+send_control (CockpitChannelResponse *chesp,
+              const gchar *command,
+              const gchar *problem)
+{
+  GBytes *bytes;
+
+  bytes = cockpit_transport_build_control ("command", command, "channel", chesp->channel,
+                                           "problem", problem, NULL);
+  cockpit_transport_send (chesp->transport, NULL, bytes);
+  g_bytes_unref (bytes);
+}
+
+static void
+cockpit_channel_upload_free (CockpitChannelUpload *upload)
+{
+  g_object_unref (upload->input);
+  g_object_unref (upload->cancellable);
+  g_free (upload);
+}
+
+/* A read in progress owns the upload until it completes */
+static void
+upload_abandon (CockpitChannelResponse *chesp)
+{
+  CockpitChannelUpload *upload = chesp->upload;
+
+  if (!upload)
+    return;
+
+  chesp->upload = NULL;
+  upload->chesp = NULL;
+
+  if (upload->reading)
+    g_cancellable_cancel (upload->cancellable);
+  else
+    cockpit_channel_upload_free (upload);
+}
+
 static void
 cockpit_channel_response_close (CockpitChannelResponse *chesp,
                                 const gchar *problem)
@@ -174,9 +530,9 @@ cockpit_channel_response_close (CockpitChannelResponse *chesp,
   CockpitWebResponding state;
 
   /* Ensure no more signals arrive about our response */
-  g_signal_handler_disconnect (chesp->transport, chesp->transport_recv);
-  g_signal_handler_disconnect (chesp->transport, chesp->transport_control);
+  cockpit_transport_unroute (chesp->transport, chesp->channel, chesp);
   g_signal_handler_disconnect (chesp->transport, chesp->transport_closed);
+  upload_abandon (chesp);
 
   /* The web response should not yet be complete */
   state = cockpit_web_response_get_state (chesp->response);
@@ -234,11 +590,93 @@ cockpit_channel_response_close (CockpitChannelResponse *chesp,
   g_object_unref (chesp->transport);
   g_hash_table_unref (chesp->headers);
   cockpit_channel_inject_free (chesp->inject);
+  cache_abandon (chesp);
   json_object_unref (chesp->open);
   g_free (chesp->channel);
   g_free (chesp);
 }
 
+static void
+upload_send (CockpitChannelResponse *chesp,
+             gconstpointer data,
+             gsize length)
+{
+  GBytes *bytes;
+
+  bytes = g_bytes_new (data, length);
+  cockpit_transport_send (chesp->transport, chesp->channel, bytes);
+  g_bytes_unref (bytes);
+
+  chesp->upload->remaining -= length;
+  chesp->upload->unacked += length;
+}
+
+static void upload_next (CockpitChannelResponse *chesp);
+
+static void
+on_upload_read (GObject *source,
+                GAsyncResult *result,
+                gpointer user_data)
+{
+  CockpitChannelUpload *upload = user_data;
+  CockpitChannelResponse *chesp = upload->chesp;
+  GError *error = NULL;
+  gssize count;
+
+  upload->reading = FALSE;
+  count = g_input_stream_read_finish (G_INPUT_STREAM (source), result, &error);
+
+  /* The response was closed while reading */
+  if (!chesp)
+    {
+      g_clear_error (&error);
+      cockpit_channel_upload_free (upload);
+      return;
+    }
+
+  if (count <= 0)
+    {
+      if (error)
+        g_message ("%s: couldn't read upload: %s", chesp->logname, error->message);
+      else
+        g_message ("%s: upload was truncated", chesp->logname);
+      g_clear_error (&error);
+      send_control (chesp, "close", "disconnected");
+      cockpit_channel_response_close (chesp, "disconnected");
+      return;
+    }
+
+  upload_send (chesp, upload->buffer, count);
+  upload_next (chesp);
+}
+
+static void
+upload_next (CockpitChannelResponse *chesp)
+{
+  CockpitChannelUpload *upload = chesp->upload;
+
+  if (upload->reading)
+    return;
+
+  if (upload->remaining == 0)
+    {
+      g_debug ("%s: sent upload into external channel", chesp->logname);
+      send_control (chesp, "done", NULL);
+      upload_abandon (chesp);
+      return;
+    }
+
+  /* Wait for the bridge to catch up */
+  if (upload->acks && upload->unacked >= cockpit_ws_channel_window)
+    return;
+
+  upload->reading = TRUE;
+  g_input_stream_read_async (upload->input, upload->buffer,
+                             MIN (upload->remaining, sizeof (upload->buffer)),
+                             G_PRIORITY_DEFAULT, upload->cancellable,
+                             on_upload_read, upload);
+}
+
 static gboolean
 on_transport_recv (CockpitTransport *transport,
                    const gchar *channel,
@@ -248,6 +686,7 @@ on_transport_recv (CockpitTransport *transport,
   if (channel && g_str_equal (channel, chesp->channel))
     {
       ensure_headers (chesp, 200, "OK");
+      cache_collect (chesp, payload);
       cockpit_web_response_queue (chesp->response, payload);
       return TRUE;
     }
@@ -261,16 +700,24 @@ object_to_headers (JsonObject *object,
                    JsonNode *node,
                    gpointer user_data)
 {
-  GHashTable *headers = user_data;
+  CockpitChannelResponse *chesp = user_data;
   const gchar *value = json_node_get_string (node);
+  gchar *end;
 
   g_return_if_fail (value != NULL);
 
-  if (g_ascii_strcasecmp (header, "Content-Length") == 0 ||
-      g_ascii_strcasecmp (header, "Connection") == 0)
+  if (g_ascii_strcasecmp (header, "Content-Length") == 0)
+    {
+      chesp->length = g_ascii_strtoll (value, &end, 10);
+      if (end == value || chesp->length < 0)
+        chesp->length = -1;
+      return;
+    }
+
+  if (g_ascii_strcasecmp (header, "Connection") == 0)
     return;
 
-  g_hash_table_insert (headers, g_strdup (header), g_strdup (value));
+  g_hash_table_insert (chesp->headers, g_strdup (header), g_strdup (value));
 }
 
 static gboolean
@@ -296,7 +743,7 @@ parse_httpstream_response (CockpitChannelResponse *chesp,
           g_warning ("%s: received invalid httpstream headers", chesp->logname);
           return FALSE;
         }
-      json_object_foreach_member (json_node_get_object (node), object_to_headers, chesp->headers);
+      json_object_foreach_member (json_node_get_object (node), object_to_headers, chesp);
     }
 
   return TRUE;
@@ -319,8 +766,9 @@ on_httpstream_recv (CockpitTransport *transport,
   g_return_val_if_fail (cockpit_web_response_get_state (chesp->response) == COCKPIT_WEB_RESPONSE_READY, FALSE);
 
   /* First response payload message is meta data, then switch to actual data */
-  g_signal_handler_disconnect (chesp->transport, chesp->transport_recv);
-  chesp->transport_recv = g_signal_connect (chesp->transport, "recv", G_CALLBACK (on_transport_recv), chesp);
+  cockpit_transport_route (chesp->transport, chesp->channel,
+                           (CockpitTransportRecvFunc)on_transport_recv,
+                           chesp->transport_control, chesp);
 
   object = cockpit_json_parse_bytes (payload, &error);
   if (error)
@@ -354,6 +802,7 @@ on_transport_control (CockpitTransport *transport,
                       CockpitChannelResponse *chesp)
 {
   const gchar *problem = NULL;
+  gint64 bytes;
 
   if (!channel || !g_str_equal (channel, chesp->channel))
     return FALSE; /* not handled */
@@ -361,6 +810,7 @@ on_transport_control (CockpitTransport *transport,
   if (g_str_equal (command, "done"))
     {
       ensure_headers (chesp, 200, "OK");
+      cache_finish (chesp);
       cockpit_web_response_complete (chesp->response);
       return TRUE;
     }
@@ -373,6 +823,14 @@ on_transport_control (CockpitTransport *transport,
         }
       cockpit_channel_response_close (chesp, problem);
     }
+  else if (g_str_equal (command, "ack"))
+    {
+      if (chesp->upload && cockpit_json_get_int (options, "bytes", 0, &bytes) && bytes > 0)
+        {
+          chesp->upload->unacked = MAX (chesp->upload->unacked - bytes, 0);
+          upload_next (chesp);
+        }
+    }
   else
     {
       /* Ignore other control messages */
@@ -430,8 +888,8 @@ cockpit_channel_response_create (CockpitWebService *service,
                                  JsonObject *open)
 {
   CockpitChannelResponse *chesp;
+  CockpitTransportRecvFunc recv;
   const gchar *payload;
-  JsonObject *done;
   GBytes *bytes;
 
   payload = json_object_get_string_member (open, "payload");
@@ -441,6 +899,7 @@ cockpit_channel_response_create (CockpitWebService *service,
   chesp->transport = g_object_ref (transport);
   chesp->headers = g_hash_table_ref (headers);
   chesp->channel = cockpit_web_service_unique_channel (service);
+  chesp->length = -1;
   chesp->open = json_object_ref (open);
 
   if (!cockpit_json_get_string (open, "path", chesp->channel, &chesp->logname))
@@ -451,15 +910,18 @@ cockpit_channel_response_create (CockpitWebService *service,
 
   /* Special handling for http-stream1, splice in headers, handle injection */
   if (g_strcmp0 (payload, "http-stream1") == 0)
-    chesp->transport_recv = g_signal_connect (transport, "recv", G_CALLBACK (on_httpstream_recv), chesp);
+    recv = (CockpitTransportRecvFunc)on_httpstream_recv;
   else
-    chesp->transport_recv = g_signal_connect (transport, "recv", G_CALLBACK (on_transport_recv), chesp);
+    recv = (CockpitTransportRecvFunc)on_transport_recv;
 
   /* Special handling for http-stream2, splice in headers, handle injection */
   if (g_strcmp0 (payload, "http-stream2") == 0)
-    chesp->transport_control = g_signal_connect (transport, "control", G_CALLBACK (on_httpstream_control), chesp);
+    chesp->transport_control = (CockpitTransportControlFunc)on_httpstream_control;
   else
-    chesp->transport_control = g_signal_connect (transport, "control", G_CALLBACK (on_transport_control), chesp);
+    chesp->transport_control = (CockpitTransportControlFunc)on_transport_control;
+
+  /* The channel id is unique, so this always succeeds */
+  cockpit_transport_route (transport, chesp->channel, recv, chesp->transport_control, chesp);
 
   chesp->transport_closed = g_signal_connect (transport, "closed", G_CALLBACK (on_transport_closed), chesp);
 
@@ -467,12 +929,6 @@ cockpit_channel_response_create (CockpitWebService *service,
   cockpit_transport_send (transport, NULL, bytes);
   g_bytes_unref (bytes);
 
-  done = cockpit_transport_build_json ("command", "done", "channel", chesp->channel, NULL);
-  bytes = cockpit_json_write_bytes (done);
-  json_object_unref (done);
-  cockpit_transport_send (transport, NULL, bytes);
-  g_bytes_unref (bytes);
-
   return chesp;
 }
 
@@ -558,6 +1014,7 @@ cockpit_channel_response_serve (CockpitWebService *service,
   const gchar *host = NULL;
   const gchar *pragma;
   gchar *quoted_etag = NULL;
+  gchar *cache_key = NULL;
   GHashTable *out_headers = NULL;
   gchar *val = NULL;
   gboolean handled = FALSE;
@@ -597,6 +1054,17 @@ cockpit_channel_response_serve (CockpitWebService *service,
     }
 
   cockpit_web_response_set_cache_type (response, cache_type);
+
+  if (quoted_etag)
+    {
+      cache_key = cached_resource_key (service, in_headers, quoted_etag, path);
+      if (cache_key && serve_cached (response, cache_key, accepted_compression (in_headers)))
+        {
+          handled = TRUE;
+          goto out;
+        }
+    }
+
   object = cockpit_transport_build_json ("command", "open",
                                          "payload", "http-stream1",
                                          "internal", "packages",
@@ -679,16 +1147,25 @@ cockpit_channel_response_serve (CockpitWebService *service,
   chesp = cockpit_channel_response_create (service, response, transport,
                                            cockpit_web_response_get_path (response),
                                            out_headers, object);
+  send_control (chesp, "done", NULL);
 
   if (!where)
     chesp->inject = cockpit_channel_inject_new (service, path);
 
+  chesp->compress = accepted_compression (in_headers);
+  if (chesp->compress)
+    chesp->vary_cookie = (cache_type == COCKPIT_WEB_RESPONSE_CACHE_PRIVATE);
+
+  chesp->cache_key = cache_key;
+  cache_key = NULL;
+
   handled = TRUE;
 
 out:
   if (object)
     json_object_unref (object);
   g_free (quoted_etag);
+  g_free (cache_key);
   if (out_headers)
     g_hash_table_unref (out_headers);
   g_free (channel);
@@ -697,13 +1174,12 @@ out:
     cockpit_web_response_error (response, 404, NULL, NULL);
 }
 
-void
-cockpit_channel_response_open (CockpitWebService *service,
-                               GHashTable *in_headers,
-                               CockpitWebResponse *response,
-                               JsonObject *open)
+static GHashTable *
+prepare_external (CockpitWebService *service,
+                  CockpitWebResponse *response,
+                  JsonObject *open,
+                  CockpitTransport **transport)
 {
-  CockpitTransport *transport;
   WebSocketDataType data_type;
   GHashTable *headers;
   const gchar *content_type;
@@ -713,14 +1189,14 @@ cockpit_channel_response_open (CockpitWebService *service,
   if (!cockpit_web_service_parse_external (open, &content_type, &content_disposition, NULL))
     {
       cockpit_web_response_error (response, 400, NULL, "Bad channel request");
-      return;
+      return NULL;
     }
 
-  transport = cockpit_web_service_ensure_transport (service, open);
-  if (!transport)
+  *transport = cockpit_web_service_ensure_transport (service, open);
+  if (!*transport)
     {
       cockpit_web_response_error (response, 502, NULL, "Failed to open channel transport");
-      return;
+      return NULL;
     }
 
   headers = cockpit_web_server_new_table ();
@@ -734,7 +1210,7 @@ cockpit_channel_response_open (CockpitWebService *service,
   if (!content_type)
     {
       if (!cockpit_web_service_parse_binary (open, &data_type))
-        g_return_if_reached ();
+        g_return_val_if_reached (headers);
       if (data_type == WEB_SOCKET_DATA_TEXT)
         content_type = "text/plain";
       else
@@ -745,6 +1221,79 @@ cockpit_channel_response_open (CockpitWebService *service,
   /* We shouldn't need to send this part further */
   json_object_remove_member (open, "external");
 
-  cockpit_channel_response_create (service, response, transport, NULL, headers, open);
+  return headers;
+}
+
+void
+cockpit_channel_response_open (CockpitWebService *service,
+                               GHashTable *in_headers,
+                               CockpitWebResponse *response,
+                               JsonObject *open)
+{
+  CockpitChannelResponse *chesp;
+  CockpitTransport *transport;
+  GHashTable *headers;
+
+  headers = prepare_external (service, response, open, &transport);
+  if (!headers)
+    return;
+
+  chesp = cockpit_channel_response_create (service, response, transport, NULL, headers, open);
+  send_control (chesp, "done", NULL);
   g_hash_table_unref (headers);
 }
+
+void
+cockpit_channel_response_upload (CockpitWebService *service,
+                                 const gchar *method,
+                                 GHashTable *in_headers,
+                                 CockpitWebResponse *response,
+                                 GIOStream *io_stream,
+                                 GByteArray *input,
+                                 JsonObject *open)
+{
+  CockpitChannelResponse *chesp;
+  CockpitChannelUpload *upload;
+  CockpitTransport *transport;
+  GHashTable *headers;
+  const gchar *payload;
+  const gchar *value;
+  guint64 length;
+  gboolean acks;
+
+  /* The web server checked this is a valid number */
+  value = g_hash_table_lookup (in_headers, "Content-Length");
+  length = value ? g_ascii_strtoull (value, NULL, 10) : 0;
+
+  headers = prepare_external (service, response, open, &transport);
+  if (!headers)
+    return;
+
+  /* An HTTP request in the channel is made with the same method */
+  if (!cockpit_json_get_string (open, "payload", NULL, &payload))
+    payload = NULL;
+  if (g_strcmp0 (payload, "http-stream2") == 0 && !json_object_has_member (open, "method"))
+    json_object_set_string_member (open, "method", method);
+
+  /* Without acks from the bridge, the body is sent as fast as it's read */
+  acks = cockpit_ws_channel_window > 0 && cockpit_web_service_get_send_acks (service, transport);
+  if (acks)
+    json_object_set_string_member (open, "send-acks", "bytes");
+
+  chesp = cockpit_channel_response_create (service, response, transport, NULL, headers, open);
+  g_hash_table_unref (headers);
+
+  upload = g_new0 (CockpitChannelUpload, 1);
+  upload->chesp = chesp;
+  upload->input = g_object_ref (g_io_stream_get_input_stream (io_stream));
+  upload->cancellable = g_cancellable_new ();
+  upload->remaining = length;
+  upload->acks = acks;
+  chesp->upload = upload;
+
+  /* Whatever of the body was read along with the headers */
+  if (input->len > 0)
+    upload_send (chesp, input->data, MIN (input->len, length));
+
+  upload_next (chesp);
+}
@@ -36,6 +36,14 @@ void             cockpit_channel_response_open        (CockpitWebService *servic
                                                        CockpitWebResponse *response,
                                                        JsonObject *open);
 
+void             cockpit_channel_response_upload      (CockpitWebService *service,
+                                                       const gchar *method,
+                                                       GHashTable *headers,
+                                                       CockpitWebResponse *response,
+                                                       GIOStream *io_stream,
+                                                       GByteArray *input,
+                                                       JsonObject *open);
+
 G_END_DECLS
 
 #endif /* __COCKPIT_CHANNEL_RESPONSE_H__ */
@@ -38,8 +38,6 @@ typedef struct {
   /* The bridge side of things */
   CockpitTransport *transport;
   JsonObject *open;
-  gulong transport_recv;
-  gulong transport_control;
   gulong transport_closed;
 } CockpitChannelSocket;
 
@@ -102,11 +100,10 @@ cockpit_channel_socket_close (CockpitChannelSocket *chock,
 {
   gushort code;
 
+  cockpit_transport_unroute (chock->transport, chock->channel, chock);
+  g_signal_handler_disconnect (chock->transport, chock->transport_closed);
   g_free (chock->channel);
 
-  g_signal_handler_disconnect (chock->transport, chock->transport_recv);
-  g_signal_handler_disconnect (chock->transport, chock->transport_control);
-  g_signal_handler_disconnect (chock->transport, chock->transport_closed);
   json_object_unref (chock->open);
   g_object_unref (chock->transport);
 
@@ -237,8 +234,9 @@ cockpit_channel_socket_open (CockpitWebService *service,
   chock->socket_close = g_signal_connect (chock->socket, "close", G_CALLBACK (on_socket_close), chock);
 
   chock->transport = g_object_ref (transport);
-  chock->transport_recv = g_signal_connect (chock->transport, "recv", G_CALLBACK (on_transport_recv), chock);
-  chock->transport_control = g_signal_connect (chock->transport, "control", G_CALLBACK (on_transport_control), chock);
+  cockpit_transport_route (chock->transport, chock->channel,
+                           (CockpitTransportRecvFunc)on_transport_recv,
+                           (CockpitTransportControlFunc)on_transport_control, chock);
   chock->transport_closed = g_signal_connect (chock->transport, "closed", G_CALLBACK (on_transport_closed), chock);
 
 out:
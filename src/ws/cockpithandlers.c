@@ -29,6 +29,8 @@
 #include "common/cockpitconf.h"
 #include "common/cockpitjson.h"
 #include "common/cockpitenums.h"
+#include "common/cockpitmemory.h"
+#include "common/cockpitstats.h"
 #include "common/cockpitwebinject.h"
 
 #include "websocket/websocket.h"
@@ -38,35 +40,48 @@
 #include <gio/gio.h>
 #include <glib/gi18n-lib.h>
 
+#include <sys/stat.h>
 #include <string.h>
 
 /* For overriding during tests */
 const gchar *cockpit_ws_shell_component = "/shell/index.html";
 
+/*
+ * New authenticated sockets per second, and how many may arrive at once.
+ * When every browser tab reconnects at the same time, each one would
+ * start its bridges and open its channels again. Sockets over the limit
+ * are told to come back later. Zero rate means no limit.
+ */
+guint cockpit_ws_socket_rate = 20;
+guint cockpit_ws_socket_burst = 100;
+
 static void
-on_web_socket_noauth (WebSocketConnection *connection,
-                      gpointer data)
+on_web_socket_refused (WebSocketConnection *connection,
+                       JsonObject *init)
 {
+  const gchar *problem = NULL;
   GBytes *payload;
   GBytes *prefix;
 
-  g_debug ("closing unauthenticated web socket");
+  cockpit_json_get_string (init, "problem", NULL, &problem);
+  g_debug ("closing web socket: %s", problem);
 
-  payload = cockpit_transport_build_control ("command", "init", "problem", "no-session", NULL);
+  payload = cockpit_json_write_bytes (init);
   prefix = g_bytes_new_static ("\n", 1);
 
   web_socket_connection_send (connection, WEB_SOCKET_DATA_TEXT, prefix, payload);
-  web_socket_connection_close (connection, WEB_SOCKET_CLOSE_GOING_AWAY, "no-session");
+  web_socket_connection_close (connection, WEB_SOCKET_CLOSE_GOING_AWAY, problem);
 
   g_bytes_unref (prefix);
   g_bytes_unref (payload);
 }
 
 static void
-handle_noauth_socket (GIOStream *io_stream,
-                      const gchar *path,
-                      GHashTable *headers,
-                      GByteArray *input_buffer)
+handle_refused_socket (GIOStream *io_stream,
+                       const gchar *path,
+                       GHashTable *headers,
+                       GByteArray *input_buffer,
+                       JsonObject *init)
 {
   WebSocketConnection *connection;
   gchar *application;
@@ -75,12 +90,42 @@ handle_noauth_socket (GIOStream *io_stream,
   connection = cockpit_web_service_create_socket (NULL, application, io_stream, headers, input_buffer);
   g_free (application);
 
-  g_signal_connect (connection, "open", G_CALLBACK (on_web_socket_noauth), NULL);
+  g_signal_connect_data (connection, "open", G_CALLBACK (on_web_socket_refused),
+                         json_object_ref (init), (GClosureNotify)json_object_unref, 0);
 
   /* Unreferences connection when it closes */
   g_signal_connect (connection, "close", G_CALLBACK (g_object_unref), NULL);
 }
 
+/*
+ * Returns zero when the socket can go ahead, or otherwise the number
+ * of seconds until the token bucket has room again.
+ */
+static guint
+admit_socket (CockpitHandlerData *ws)
+{
+  gint64 now;
+
+  if (cockpit_ws_socket_rate == 0)
+    return 0;
+
+  now = g_get_monotonic_time ();
+  if (ws->socket_refilled == 0)
+    ws->socket_tokens = cockpit_ws_socket_burst;
+  else
+    ws->socket_tokens += (gdouble)(now - ws->socket_refilled) * cockpit_ws_socket_rate / G_USEC_PER_SEC;
+  ws->socket_tokens = MIN (ws->socket_tokens, MAX (cockpit_ws_socket_burst, 1));
+  ws->socket_refilled = now;
+
+  if (ws->socket_tokens >= 1)
+    {
+      ws->socket_tokens -= 1;
+      return 0;
+    }
+
+  return (guint)((1 - ws->socket_tokens) / cockpit_ws_socket_rate) + 1;
+}
+
 /* Called by @server when handling HTTP requests to /cockpit/socket */
 gboolean
 cockpit_handler_socket (CockpitWebServer *server,
@@ -92,6 +137,8 @@ cockpit_handler_socket (CockpitWebServer *server,
 {
   CockpitWebService *service = NULL;
   const gchar *segment = NULL;
+  JsonObject *init;
+  guint retry;
 
   /*
    * Socket requests should come in on /cockpit/socket or /cockpit+app/socket.
@@ -110,38 +157,54 @@ cockpit_handler_socket (CockpitWebServer *server,
     service = cockpit_auth_check_cookie (ws->auth, path, headers);
   if (service)
     {
-      cockpit_web_service_socket (service, path, io_stream, headers, input);
+      retry = admit_socket (ws);
+      if (retry == 0)
+        {
+          cockpit_web_service_socket (service, path, io_stream, headers, input);
+        }
+      else
+        {
+          /* The retry hint is in seconds, browsers add their own jitter */
+          init = cockpit_transport_build_json ("command", "init", "problem", "busy", NULL);
+          json_object_set_int_member (init, "retry", retry);
+          handle_refused_socket (io_stream, path, headers, input, init);
+          json_object_unref (init);
+        }
       g_object_unref (service);
     }
   else
     {
-      handle_noauth_socket (io_stream, path, headers, input);
+      init = cockpit_transport_build_json ("command", "init", "problem", "no-session", NULL);
+      handle_refused_socket (io_stream, path, headers, input, init);
+      json_object_unref (init);
     }
 
   return TRUE;
 }
 
-gboolean
-cockpit_handler_external (CockpitWebServer *server,
-                          const gchar *path,
-                          GIOStream *io_stream,
-                          GHashTable *headers,
-                          GByteArray *input,
-                          CockpitHandlerData *ws)
+/*
+ * Returns FALSE if the path isn't an external channel of an
+ * authenticated user. Otherwise @open is the channel's open
+ * message, or NULL if that was invalid.
+ */
+static gboolean
+parse_external_path (CockpitHandlerData *ws,
+                     const gchar *path,
+                     GHashTable *headers,
+                     CockpitWebService **service,
+                     JsonObject **open)
 {
-  CockpitWebResponse *response = NULL;
-  CockpitWebService *service = NULL;
   const gchar *segment = NULL;
-  JsonObject *open = NULL;
   const gchar *query = NULL;
   CockpitCreds *creds;
   const gchar *expected;
-  const gchar *upgrade;
   guchar *decoded;
   GBytes *bytes;
   gsize length;
   gsize seglen;
 
+  *open = NULL;
+
   /* The path must start with /cockpit+xxx/channel/csrftoken? or similar */
   if (path && path[0])
     segment = strchr (path + 1, '/');
@@ -152,11 +215,11 @@ cockpit_handler_external (CockpitWebServer *server,
   segment += 9;
 
   /* Make sure we are authenticated, otherwise 404 */
-  service = cockpit_auth_check_cookie (ws->auth, path, headers);
-  if (!service)
+  *service = cockpit_auth_check_cookie (ws->auth, path, headers);
+  if (!*service)
     return FALSE;
 
-  creds = cockpit_web_service_get_creds (service);
+  creds = cockpit_web_service_get_creds (*service);
   g_return_val_if_fail (creds != NULL, FALSE);
 
   expected = cockpit_creds_get_csrf_token (creds);
@@ -179,6 +242,8 @@ cockpit_handler_external (CockpitWebServer *server,
   if (strlen (expected) != seglen || memcmp (expected, segment, seglen) != 0)
     {
       g_message ("invalid csrf token");
+      g_object_unref (*service);
+      *service = NULL;
       return FALSE;
     }
 
@@ -186,14 +251,33 @@ cockpit_handler_external (CockpitWebServer *server,
   if (decoded)
     {
       bytes = g_bytes_new_take (decoded, length);
-      if (!cockpit_transport_parse_command (bytes, NULL, NULL, &open))
+      if (!cockpit_transport_parse_command (bytes, NULL, NULL, open))
         {
-          open = NULL;
+          *open = NULL;
           g_message ("invalid external channel query");
         }
       g_bytes_unref (bytes);
     }
 
+  return TRUE;
+}
+
+gboolean
+cockpit_handler_external (CockpitWebServer *server,
+                          const gchar *path,
+                          GIOStream *io_stream,
+                          GHashTable *headers,
+                          GByteArray *input,
+                          CockpitHandlerData *ws)
+{
+  CockpitWebResponse *response = NULL;
+  CockpitWebService *service = NULL;
+  JsonObject *open = NULL;
+  const gchar *upgrade;
+
+  if (!parse_external_path (ws, path, headers, &service, &open))
+    return FALSE;
+
   if (!open)
     {
       response = cockpit_web_response_new (io_stream, path, NULL, headers);
@@ -221,6 +305,46 @@ cockpit_handler_external (CockpitWebServer *server,
   return TRUE;
 }
 
+/*
+ * The body of a POST or PUT to an external channel is sent into the
+ * channel as it's read, rather than read into memory first.
+ */
+gboolean
+cockpit_handler_upload (CockpitWebServer *server,
+                        const gchar *method,
+                        const gchar *path,
+                        GIOStream *io_stream,
+                        GHashTable *headers,
+                        GByteArray *input,
+                        CockpitHandlerData *ws)
+{
+  CockpitWebResponse *response;
+  CockpitWebService *service = NULL;
+  JsonObject *open = NULL;
+
+  if (!parse_external_path (ws, path, headers, &service, &open))
+    return FALSE;
+
+  /* The rest of the body might not be read, so never reuse the connection */
+  g_hash_table_replace (headers, g_strdup ("Connection"), g_strdup ("close"));
+  response = cockpit_web_response_new (io_stream, path, NULL, headers);
+
+  if (!open)
+    {
+      cockpit_web_response_error (response, 400, NULL, NULL);
+    }
+  else
+    {
+      cockpit_channel_response_upload (service, method, headers, response, io_stream, input, open);
+      json_object_unref (open);
+    }
+
+  g_object_unref (response);
+  g_object_unref (service);
+
+  return TRUE;
+}
+
 
 static void
 add_oauth_to_environment (JsonObject *environment)
@@ -288,22 +412,135 @@ build_environment (GHashTable *os_release)
   return g_byte_array_free_to_bytes (buffer);
 }
 
+/*
+ * The login page is what most requests without a cookie get. Keep it
+ * with its environment already injected, and only expand it again when
+ * login.html or the environment change.
+ */
+static struct {
+  gchar *path;
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  time_t mtime;
+  GBytes *environment;
+  GBytes *body;
+} login_page;
+
+static void
+collect_block (gpointer data,
+               GBytes *block)
+{
+  GByteArray *buffer = data;
+  gconstpointer bytes;
+  gsize length;
+
+  bytes = g_bytes_get_data (block, &length);
+  g_byte_array_append (buffer, bytes, length);
+}
+
+static GBytes *
+expand_login_html (const gchar **roots,
+                   GBytes *environment)
+{
+  static const gchar *marker = "<head>";
+  CockpitWebFilter *filter;
+  GMappedFile *file;
+  GByteArray *buffer;
+  GBytes *bytes;
+  gchar *path = NULL;
+  struct stat st;
+  gint i;
+
+  for (i = 0; roots && roots[i]; i++)
+    {
+      g_free (path);
+      path = g_build_filename (roots[i], "login.html", NULL);
+      if (stat (path, &st) == 0)
+        break;
+    }
+
+  /* Not found or not a regular file, serve it the usual way */
+  if (!roots || !roots[i] || !S_ISREG (st.st_mode))
+    {
+      g_free (path);
+      return NULL;
+    }
+
+  if (login_page.body && g_str_equal (login_page.path, path) &&
+      login_page.dev == st.st_dev && login_page.ino == st.st_ino &&
+      login_page.size == st.st_size && login_page.mtime == st.st_mtime &&
+      g_bytes_equal (login_page.environment, environment))
+    {
+      g_free (path);
+      return g_bytes_ref (login_page.body);
+    }
+
+  file = g_mapped_file_new (path, FALSE, NULL);
+  if (!file)
+    {
+      g_free (path);
+      return NULL;
+    }
+
+  buffer = g_byte_array_new ();
+  filter = cockpit_web_inject_new (marker, environment, 1);
+  bytes = g_mapped_file_get_bytes (file);
+  cockpit_web_filter_push (filter, bytes, collect_block, buffer);
+  g_bytes_unref (bytes);
+  g_object_unref (filter);
+  g_mapped_file_unref (file);
+
+  g_free (login_page.path);
+  if (login_page.environment)
+    g_bytes_unref (login_page.environment);
+  if (login_page.body)
+    g_bytes_unref (login_page.body);
+
+  login_page.path = path;
+  login_page.dev = st.st_dev;
+  login_page.ino = st.st_ino;
+  login_page.size = st.st_size;
+  login_page.mtime = st.st_mtime;
+  login_page.environment = g_bytes_ref (environment);
+  login_page.body = g_byte_array_free_to_bytes (buffer);
+
+  return g_bytes_ref (login_page.body);
+}
+
 static void
 send_login_html (CockpitWebResponse *response,
                  CockpitHandlerData *ws)
 {
   static const gchar *marker = "<head>";
   CockpitWebFilter *filter;
+  GHashTable *headers;
   GBytes *environment;
+  GBytes *body;
 
   environment = build_environment (ws->os_release);
-  filter = cockpit_web_inject_new (marker, environment, 1);
-  g_bytes_unref (environment);
-
-  cockpit_web_response_add_filter (response, filter);
   cockpit_web_response_set_cache_type (response, COCKPIT_WEB_RESPONSE_NO_CACHE);
-  cockpit_web_response_file (response, "/login.html", ws->static_roots);
-  g_object_unref (filter);
+
+  body = expand_login_html (ws->static_roots, environment);
+  if (body)
+    {
+      headers = cockpit_web_server_new_table ();
+      g_hash_table_insert (headers, g_strdup ("Content-Type"), g_strdup ("text/html"));
+      g_hash_table_insert (headers, g_strdup ("Content-Security-Policy"),
+                           g_strdup ("default-src 'self' 'unsafe-inline'; connect-src 'self' ws: wss:"));
+      cockpit_web_response_content (response, headers, body, NULL);
+      g_hash_table_unref (headers);
+      g_bytes_unref (body);
+    }
+  else
+    {
+      filter = cockpit_web_inject_new (marker, environment, 1);
+      cockpit_web_response_add_filter (response, filter);
+      cockpit_web_response_file (response, "/login.html", ws->static_roots);
+      g_object_unref (filter);
+    }
+
+  g_bytes_unref (environment);
 }
 
 static gchar *
@@ -612,3 +849,228 @@ cockpit_handler_ping (CockpitWebServer *server,
 
   return TRUE;
 }
+
+/*
+ * The /metrics page, in the Prometheus text format. The values are
+ * read from cockpitstats, where they're kept up to date with atomic
+ * adds while cockpit-ws does its work.
+ */
+
+/* Written for each channel "group", with the group as a label */
+static const struct {
+  const gchar *name;
+  const gchar *type;
+  const gchar *help;
+  CockpitStat stat;
+} group_metrics[] = {
+  { "cockpit_ws_group_channels", "gauge",
+    "Open channels of each channel group", COCKPIT_STAT_GROUP_CHANNELS },
+  { "cockpit_ws_group_received_bytes_total", "counter",
+    "Bytes received from browsers for each channel group", COCKPIT_STAT_GROUP_BYTES_IN },
+  { "cockpit_ws_group_sent_bytes_total", "counter",
+    "Bytes relayed to browsers for each channel group", COCKPIT_STAT_GROUP_BYTES_OUT },
+  { "cockpit_ws_group_queued_bytes", "gauge",
+    "Bytes of each channel group waiting to be sent on WebSocket connections", COCKPIT_STAT_GROUP_QUEUED },
+};
+
+typedef struct {
+  GString *out;
+  GString *channels;
+  GString *opened;
+  GString *groups[G_N_ELEMENTS (group_metrics)];
+} MetricsWriter;
+
+static void
+append_metric (GString *out,
+               const gchar *name,
+               const gchar *type,
+               const gchar *help,
+               gssize value)
+{
+  g_string_append_printf (out, "# HELP %s %s\n# TYPE %s %s\n%s %" G_GSSIZE_FORMAT "\n",
+                          name, help, name, type, name, value);
+}
+
+static void
+append_histogram (GString *out,
+                  const gchar *name,
+                  const gchar *help,
+                  const gssize *values)
+{
+  static const gchar *limits[COCKPIT_STATS_BUCKETS] = { "0.001", "0.01", "0.1", "1", "+Inf" };
+  gchar buffer[G_ASCII_DTOSTR_BUF_SIZE];
+  gssize count = 0;
+  guint i;
+
+  g_string_append_printf (out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+
+  /* Our buckets are separate, Prometheus wants them to add up */
+  for (i = 0; i < COCKPIT_STATS_BUCKETS; i++)
+    {
+      count += values[i];
+      g_string_append_printf (out, "%s_bucket{le=\"%s\"} %" G_GSSIZE_FORMAT "\n",
+                              name, limits[i], count);
+    }
+
+  g_ascii_formatd (buffer, sizeof (buffer), "%.6f",
+                   (gdouble)values[COCKPIT_STATS_BUCKETS] / G_USEC_PER_SEC);
+  g_string_append_printf (out, "%s_sum %s\n%s_count %" G_GSSIZE_FORMAT "\n",
+                          name, buffer, name, count);
+}
+
+static void
+append_label (GString *out,
+              const gchar *name,
+              const gchar *value)
+{
+  g_string_append_printf (out, "{%s=\"", name);
+  for (; *value; value++)
+    {
+      if (*value == '\\' || *value == '"')
+        g_string_append_c (out, '\\');
+      if (*value == '\n')
+        g_string_append (out, "\\n");
+      else
+        g_string_append_c (out, *value);
+    }
+  g_string_append (out, "\"}");
+}
+
+static void
+on_metrics_stats (const gchar *instance,
+                  const gssize *values,
+                  gpointer user_data)
+{
+  MetricsWriter *writer = user_data;
+  GString *out = writer->out;
+
+  /* Channel stats per payload type are collected and written last */
+  if (instance)
+    {
+      g_string_append (writer->channels, "cockpit_ws_channels");
+      append_label (writer->channels, "payload", instance);
+      g_string_append_printf (writer->channels, " %" G_GSSIZE_FORMAT "\n",
+                              values[COCKPIT_STAT_CHANNEL_OPEN]);
+      g_string_append (writer->opened, "cockpit_ws_channels_opened_total");
+      append_label (writer->opened, "payload", instance);
+      g_string_append_printf (writer->opened, " %" G_GSSIZE_FORMAT "\n",
+                              values[COCKPIT_STAT_CHANNEL_OPENED]);
+      return;
+    }
+
+  append_metric (out, "cockpit_ws_sessions", "gauge",
+                 "Sessions with a bridge, local or over SSH",
+                 values[COCKPIT_STAT_WS_SESSIONS]);
+  append_metric (out, "cockpit_ws_websockets", "gauge",
+                 "WebSocket connections from browsers",
+                 values[COCKPIT_STAT_WS_SOCKETS]);
+  append_metric (out, "cockpit_ws_queued_bytes", "gauge",
+                 "Bytes waiting to be sent on WebSocket connections",
+                 values[COCKPIT_STAT_WS_QUEUED]);
+  append_metric (out, "cockpit_ws_received_bytes_total", "counter",
+                 "Bytes received in WebSocket messages",
+                 values[COCKPIT_STAT_WS_BYTES_IN]);
+  append_metric (out, "cockpit_ws_sent_bytes_total", "counter",
+                 "Bytes relayed to WebSocket connections",
+                 values[COCKPIT_STAT_WS_BYTES_OUT]);
+  append_metric (out, "cockpit_ws_resident_memory_bytes", "gauge",
+                 "Resident memory of cockpit-ws",
+                 cockpit_memory_rss ());
+  append_metric (out, "cockpit_ws_trimmed_memory_bytes_total", "counter",
+                 "Memory given back to the system after sessions closed",
+                 values[COCKPIT_STAT_MEMORY_TRIMMED]);
+  append_metric (out, "cockpit_ws_pipe_queued_bytes", "gauge",
+                 "Bytes waiting to be written to bridges and other pipes",
+                 values[COCKPIT_STAT_PIPE_QUEUED_BYTES]);
+  append_metric (out, "cockpit_ws_tls_handshakes_total", "counter",
+                 "TLS handshakes",
+                 values[COCKPIT_STAT_WS_TLS_HANDSHAKES]);
+  append_metric (out, "cockpit_ws_tls_handshake_failures_total", "counter",
+                 "TLS handshakes that failed",
+                 values[COCKPIT_STAT_WS_TLS_FAILURES]);
+  append_histogram (out, "cockpit_ws_login_seconds",
+                    "Time taken by logins, including waiting for a turn",
+                    values + COCKPIT_STAT_WS_LOGIN_LATENCY);
+  append_histogram (out, "cockpit_ws_ssh_connect_seconds",
+                    "Time taken to connect to SSH hosts and exchange keys",
+                    values + COCKPIT_STAT_WS_SSH_CONNECT);
+  append_histogram (out, "cockpit_ws_ssh_auth_seconds",
+                    "Time taken to authenticate to SSH hosts",
+                    values + COCKPIT_STAT_WS_SSH_AUTH);
+  append_histogram (out, "cockpit_ws_ssh_session_seconds",
+                    "Time taken to start the bridge on SSH hosts",
+                    values + COCKPIT_STAT_WS_SSH_SESSION);
+}
+
+static void
+on_metrics_group (const gchar *group,
+                  const gssize *values,
+                  gpointer user_data)
+{
+  MetricsWriter *writer = user_data;
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (group_metrics); i++)
+    {
+      g_string_append (writer->groups[i], group_metrics[i].name);
+      append_label (writer->groups[i], "group", group);
+      g_string_append_printf (writer->groups[i], " %" G_GSSIZE_FORMAT "\n",
+                              values[group_metrics[i].stat]);
+    }
+}
+
+gboolean
+cockpit_handler_metrics (CockpitWebServer *server,
+                         const gchar *path,
+                         GHashTable *headers,
+                         CockpitWebResponse *response,
+                         CockpitHandlerData *ws)
+{
+  MetricsWriter writer;
+  GHashTable *out_headers;
+  GBytes *content;
+  gsize length;
+  guint i;
+
+  writer.out = g_string_sized_new (4096);
+  writer.channels = g_string_new ("");
+  writer.opened = g_string_new ("");
+  for (i = 0; i < G_N_ELEMENTS (group_metrics); i++)
+    writer.groups[i] = g_string_new ("");
+
+  cockpit_stats_foreach (on_metrics_stats, &writer);
+  cockpit_stats_foreach_group (on_metrics_group, &writer);
+
+  g_string_append (writer.out, "# HELP cockpit_ws_channels Open channels\n"
+                   "# TYPE cockpit_ws_channels gauge\n");
+  g_string_append_len (writer.out, writer.channels->str, writer.channels->len);
+  g_string_append (writer.out, "# HELP cockpit_ws_channels_opened_total Channels opened\n"
+                   "# TYPE cockpit_ws_channels_opened_total counter\n");
+  g_string_append_len (writer.out, writer.opened->str, writer.opened->len);
+
+  for (i = 0; i < G_N_ELEMENTS (group_metrics); i++)
+    {
+      g_string_append_printf (writer.out, "# HELP %s %s\n# TYPE %s %s\n",
+                              group_metrics[i].name, group_metrics[i].help,
+                              group_metrics[i].name, group_metrics[i].type);
+      g_string_append_len (writer.out, writer.groups[i]->str, writer.groups[i]->len);
+      g_string_free (writer.groups[i], TRUE);
+    }
+
+  g_string_free (writer.channels, TRUE);
+  g_string_free (writer.opened, TRUE);
+
+  out_headers = cockpit_web_server_new_table ();
+  g_hash_table_insert (out_headers, g_strdup ("Content-Type"),
+                       g_strdup ("text/plain; version=0.0.4"));
+  g_hash_table_insert (out_headers, g_strdup ("Cache-Control"), g_strdup ("no-cache"));
+
+  length = writer.out->len;
+  content = g_bytes_new_take (g_string_free (writer.out, FALSE), length);
+  cockpit_web_response_content (response, out_headers, content, NULL);
+
+  g_bytes_unref (content);
+  g_hash_table_unref (out_headers);
+
+  return TRUE;
+}
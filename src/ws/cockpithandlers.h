@@ -31,6 +31,10 @@ typedef struct {
   CockpitAuth *auth;
   const gchar **static_roots;
   GHashTable *os_release;
+
+  /* Token bucket for admitting authenticated sockets */
+  gdouble socket_tokens;
+  gint64 socket_refilled;
 } CockpitHandlerData;
 
 gboolean       cockpit_handler_socket            (CockpitWebServer *server,
@@ -47,6 +51,14 @@ gboolean       cockpit_handler_external          (CockpitWebServer *server,
                                                   GByteArray *input,
                                                   CockpitHandlerData *data);
 
+gboolean       cockpit_handler_upload            (CockpitWebServer *server,
+                                                  const gchar *method,
+                                                  const gchar *path,
+                                                  GIOStream *io_stream,
+                                                  GHashTable *headers,
+                                                  GByteArray *input,
+                                                  CockpitHandlerData *data);
+
 gboolean       cockpit_handler_root              (CockpitWebServer *server,
                                                   const gchar *path,
                                                   GHashTable *headers,
@@ -65,4 +77,10 @@ gboolean       cockpit_handler_ping              (CockpitWebServer *server,
                                                   CockpitWebResponse *response,
                                                   CockpitHandlerData *ws);
 
+gboolean       cockpit_handler_metrics           (CockpitWebServer *server,
+                                                  const gchar *path,
+                                                  GHashTable *headers,
+                                                  CockpitWebResponse *response,
+                                                  CockpitHandlerData *ws);
+
 #endif /* __COCKPIT_HANDLERS_H__ */
@@ -0,0 +1,255 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2016 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitknownhosts.h"
+
+#include <glib/gstdio.h>
+
+#include <string.h>
+
+/*
+ * A parsed copy of a known_hosts file. Connecting to many hosts would
+ * otherwise have libssh reread and reparse the entire file each time.
+ *
+ * The index maps "keytype base64" to an array of the host fields that
+ * key is listed with. It's reloaded when the file changes on disk. Hashed
+ * host names and @cert-authority or @revoked markers aren't understood
+ * here: hashed lines are skipped, and a file with markers is never used
+ * to answer. In both cases the caller falls back to libssh.
+ */
+
+G_LOCK_DEFINE_STATIC (known_hosts);
+
+static gchar *loaded_file;
+static GHashTable *loaded_index;
+static gboolean loaded_usable;
+static dev_t loaded_dev;
+static ino_t loaded_ino;
+static off_t loaded_size;
+static time_t loaded_mtime;
+
+static void
+unload_known_hosts (void)
+{
+  if (loaded_index)
+    g_hash_table_destroy (loaded_index);
+  loaded_index = NULL;
+  g_free (loaded_file);
+  loaded_file = NULL;
+  loaded_usable = FALSE;
+}
+
+static void
+free_hosts (gpointer data)
+{
+  g_ptr_array_free (data, TRUE);
+}
+
+static GHashTable *
+parse_known_hosts (const gchar *contents,
+                   gboolean *usable)
+{
+  GHashTable *index;
+  GPtrArray *hosts;
+  gchar **lines;
+  gchar **parts;
+  gchar *key;
+  gchar *line;
+  gint i;
+
+  index = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, free_hosts);
+  *usable = TRUE;
+
+  lines = g_strsplit (contents, "\n", -1);
+  for (i = 0; lines[i] != NULL; i++)
+    {
+      line = g_strstrip (lines[i]);
+      if (line[0] == '\0' || line[0] == '#')
+        continue;
+
+      if (line[0] == '@')
+        {
+          *usable = FALSE;
+          break;
+        }
+
+      /* Hashed host names */
+      if (line[0] == '|')
+        continue;
+
+      parts = g_strsplit_set (line, " \t", -1);
+      if (g_strv_length (parts) >= 3 && parts[0][0] && parts[1][0] && parts[2][0])
+        {
+          key = g_strdup_printf ("%s %s", parts[1], parts[2]);
+          hosts = g_hash_table_lookup (index, key);
+          if (!hosts)
+            {
+              hosts = g_ptr_array_new_with_free_func (g_free);
+              g_hash_table_insert (index, key, hosts);
+            }
+          else
+            {
+              g_free (key);
+            }
+          g_ptr_array_add (hosts, g_ascii_strdown (parts[0], -1));
+        }
+      g_strfreev (parts);
+    }
+
+  g_strfreev (lines);
+  return index;
+}
+
+static gboolean
+load_known_hosts (const gchar *filename)
+{
+  GError *error = NULL;
+  gchar *contents;
+  struct stat sb;
+
+  if (g_stat (filename, &sb) < 0)
+    {
+      unload_known_hosts ();
+      return FALSE;
+    }
+
+  if (loaded_index && g_strcmp0 (filename, loaded_file) == 0 &&
+      sb.st_dev == loaded_dev && sb.st_ino == loaded_ino &&
+      sb.st_size == loaded_size && sb.st_mtime == loaded_mtime)
+    return TRUE;
+
+  unload_known_hosts ();
+
+  if (!g_file_get_contents (filename, &contents, NULL, &error))
+    {
+      g_debug ("couldn't read known hosts: %s", error->message);
+      g_error_free (error);
+      return FALSE;
+    }
+
+  loaded_index = parse_known_hosts (contents, &loaded_usable);
+  loaded_file = g_strdup (filename);
+  loaded_dev = sb.st_dev;
+  loaded_ino = sb.st_ino;
+  loaded_size = sb.st_size;
+  loaded_mtime = sb.st_mtime;
+  g_free (contents);
+
+  g_debug ("loaded known hosts: %s", filename);
+  return TRUE;
+}
+
+/* Same rules as OpenSSH: a matching negated pattern always loses */
+static gboolean
+match_host_field (const gchar *field,
+                  const gchar *host)
+{
+  gboolean matched = FALSE;
+  gchar **patterns;
+  const gchar *pattern;
+  gint i;
+
+  patterns = g_strsplit (field, ",", -1);
+  for (i = 0; patterns[i] != NULL; i++)
+    {
+      pattern = patterns[i];
+      if (pattern[0] == '!')
+        {
+          if (g_pattern_match_simple (pattern + 1, host))
+            {
+              matched = FALSE;
+              break;
+            }
+        }
+      else if (g_pattern_match_simple (pattern, host))
+        {
+          matched = TRUE;
+        }
+    }
+
+  g_strfreev (patterns);
+  return matched;
+}
+
+/**
+ * cockpit_known_hosts_contains:
+ * @filename: the known_hosts file
+ * @line: a known hosts line like "host keytype base64"
+ *
+ * Check whether the known hosts file lists this host with this exact key.
+ * This may be called from any thread.
+ *
+ * Returns: TRUE if found, FALSE if not or if the file can't be used. Callers
+ *          should then ask libssh to find out why.
+ */
+gboolean
+cockpit_known_hosts_contains (const gchar *filename,
+                              const gchar *line)
+{
+  gboolean ret = FALSE;
+  GPtrArray *hosts;
+  const gchar *key;
+  gchar *host;
+  guint i;
+
+  g_return_val_if_fail (filename != NULL, FALSE);
+  g_return_val_if_fail (line != NULL, FALSE);
+
+  key = strchr (line, ' ');
+  if (!key)
+    return FALSE;
+
+  host = g_ascii_strdown (line, key - line);
+  key++;
+
+  G_LOCK (known_hosts);
+
+  if (load_known_hosts (filename) && loaded_usable)
+    {
+      hosts = g_hash_table_lookup (loaded_index, key);
+      for (i = 0; hosts && i < hosts->len; i++)
+        {
+          if (match_host_field (hosts->pdata[i], host))
+            {
+              ret = TRUE;
+              break;
+            }
+        }
+    }
+
+  G_UNLOCK (known_hosts);
+
+  g_free (host);
+  return ret;
+}
+
+/**
+ * cockpit_known_hosts_cleanup:
+ *
+ * Drop the parsed known hosts file.
+ */
+void
+cockpit_known_hosts_cleanup (void)
+{
+  G_LOCK (known_hosts);
+  unload_known_hosts ();
+  G_UNLOCK (known_hosts);
+}
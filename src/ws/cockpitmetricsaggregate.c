@@ -0,0 +1,464 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2016 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitmetricsaggregate.h"
+
+#include "common/cockpitjson.h"
+#include "common/cockpittransport.h"
+
+#include <string.h>
+
+/*
+ * Combines the "metrics1" channels of several hosts into one. Each
+ * host's 'meta' messages are passed on with a "host" field, and its
+ * points in time are held back until the other hosts have sent theirs
+ * for the same time, or half an interval has passed. Then all of them
+ * go out in one 'data' message, with one array of points for each
+ * host. The points are passed on as the bridge compressed them, and
+ * never dropped, so the client decompresses each host's points just
+ * like those of a channel of its own.
+ */
+
+typedef struct {
+  gchar *name;
+  GString *pending;      /* Points not sent yet, without the outer brackets */
+  gint64 next;           /* Time of the host's next point */
+  gint64 interval;       /* Zero until the first 'meta' message */
+  gboolean ready;
+  gboolean closed;
+} AggregateHost;
+
+struct _CockpitMetricsAggregate {
+  gchar *channel;
+  AggregateHost *hosts;
+  guint n_hosts;
+  guint n_ready;
+  guint n_closed;
+  guint n_failed;
+  gchar *problem;
+
+  /* Time of the newest point waiting to be sent */
+  gint64 tick;
+  gint64 interval;
+  guint flush_timeout;
+
+  CockpitMetricsAggregateFunc send;
+  gpointer user_data;
+};
+
+CockpitMetricsAggregate *
+cockpit_metrics_aggregate_new (const gchar *channel,
+                               const gchar **hosts,
+                               CockpitMetricsAggregateFunc send,
+                               gpointer user_data)
+{
+  CockpitMetricsAggregate *self;
+  guint i;
+
+  g_return_val_if_fail (channel != NULL, NULL);
+  g_return_val_if_fail (hosts != NULL, NULL);
+  g_return_val_if_fail (send != NULL, NULL);
+
+  self = g_new0 (CockpitMetricsAggregate, 1);
+  self->channel = g_strdup (channel);
+  self->n_hosts = g_strv_length ((gchar **)hosts);
+  self->hosts = g_new0 (AggregateHost, self->n_hosts);
+  for (i = 0; i < self->n_hosts; i++)
+    {
+      self->hosts[i].name = g_strdup (hosts[i]);
+      self->hosts[i].pending = g_string_new ("");
+    }
+  self->send = send;
+  self->user_data = user_data;
+  return self;
+}
+
+void
+cockpit_metrics_aggregate_free (CockpitMetricsAggregate *self)
+{
+  guint i;
+
+  if (!self)
+    return;
+
+  if (self->flush_timeout)
+    g_source_remove (self->flush_timeout);
+  for (i = 0; i < self->n_hosts; i++)
+    {
+      g_free (self->hosts[i].name);
+      g_string_free (self->hosts[i].pending, TRUE);
+    }
+  g_free (self->hosts);
+  g_free (self->problem);
+  g_free (self->channel);
+  g_free (self);
+}
+
+static void
+aggregate_flush (CockpitMetricsAggregate *self)
+{
+  GString *frame;
+  gsize length;
+  GBytes *payload;
+  guint i;
+
+  if (self->flush_timeout)
+    {
+      g_source_remove (self->flush_timeout);
+      self->flush_timeout = 0;
+    }
+
+  length = 0;
+  for (i = 0; i < self->n_hosts; i++)
+    length += self->hosts[i].pending->len;
+  if (length == 0)
+    return;
+
+  frame = g_string_sized_new (length + self->n_hosts * 3 + 2);
+  g_string_append_c (frame, '[');
+  for (i = 0; i < self->n_hosts; i++)
+    {
+      if (i > 0)
+        g_string_append_c (frame, ',');
+      g_string_append_c (frame, '[');
+      g_string_append_len (frame, self->hosts[i].pending->str, self->hosts[i].pending->len);
+      g_string_append_c (frame, ']');
+      g_string_truncate (self->hosts[i].pending, 0);
+    }
+  g_string_append_c (frame, ']');
+
+  payload = g_string_free_to_bytes (frame);
+  (self->send) (self->channel, payload, self->user_data);
+  g_bytes_unref (payload);
+}
+
+static gboolean
+on_flush_timeout (gpointer user_data)
+{
+  CockpitMetricsAggregate *self = user_data;
+
+  /* Whoever is late ends up in the next frame */
+  self->flush_timeout = 0;
+  aggregate_flush (self);
+  return FALSE;
+}
+
+static void
+aggregate_maybe_flush (CockpitMetricsAggregate *self)
+{
+  AggregateHost *host;
+  gboolean pending = FALSE;
+  gboolean waiting = FALSE;
+  guint i;
+
+  for (i = 0; i < self->n_hosts; i++)
+    {
+      host = self->hosts + i;
+      if (host->pending->len > 0)
+        pending = TRUE;
+
+      /* Hosts that haven't started yet aren't waited for */
+      if (host->closed || host->interval == 0)
+        continue;
+
+      /* Samples within half an interval count as the same time */
+      if (host->next - host->interval < self->tick - host->interval / 2)
+        waiting = TRUE;
+    }
+
+  if (!pending)
+    return;
+
+  if (!waiting)
+    aggregate_flush (self);
+  else if (!self->flush_timeout)
+    self->flush_timeout = g_timeout_add (MAX (self->interval / 2, 1), on_flush_timeout, self);
+}
+
+/*
+ * Counts the points in time in a 'data' message. These only contain
+ * arrays, numbers, null and false, so the nesting is all that needs
+ * to be followed. Returns -1 when it's not a JSON array.
+ */
+static gint
+count_points (const gchar *data,
+              gsize length)
+{
+  gboolean empty = TRUE;
+  gint depth = 0;
+  gint count = 0;
+  gsize i;
+
+  if (length < 2 || data[0] != '[' || data[length - 1] != ']')
+    return -1;
+
+  for (i = 0; i < length; i++)
+    {
+      switch (data[i])
+        {
+        case '[':
+          depth++;
+          if (depth == 2)
+            empty = FALSE;
+          break;
+        case ']':
+          depth--;
+          if (depth == 0 && i != length - 1)
+            return -1;
+          break;
+        case ',':
+          if (depth == 1)
+            count++;
+          break;
+        case ' ':
+        case '\t':
+        case '\r':
+        case '\n':
+          break;
+        default:
+          if (depth == 1)
+            empty = FALSE;
+          break;
+        }
+    }
+
+  if (depth != 0)
+    return -1;
+  return empty ? 0 : count + 1;
+}
+
+static gboolean
+aggregate_meta (CockpitMetricsAggregate *self,
+                AggregateHost *host,
+                GBytes *payload)
+{
+  GError *error = NULL;
+  JsonObject *object;
+  gint64 timestamp;
+  gint64 interval;
+  GBytes *bytes;
+
+  object = cockpit_json_parse_bytes (payload, &error);
+  if (!object)
+    {
+      g_message ("%s: received invalid metrics meta message: %s", host->name, error->message);
+      g_error_free (error);
+      return FALSE;
+    }
+
+  if (!cockpit_json_get_int (object, "timestamp", 0, &timestamp) ||
+      !cockpit_json_get_int (object, "interval", 0, &interval) ||
+      interval <= 0)
+    {
+      g_message ("%s: received metrics meta message without a valid timestamp and interval", host->name);
+      json_object_unref (object);
+      return FALSE;
+    }
+
+  /* Points described by the previous 'meta' go out before the new one */
+  aggregate_flush (self);
+
+  host->next = timestamp;
+  host->interval = interval;
+  self->interval = interval;
+
+  json_object_set_string_member (object, "host", host->name);
+  bytes = cockpit_json_write_bytes (object);
+  json_object_unref (object);
+
+  (self->send) (self->channel, bytes, self->user_data);
+  g_bytes_unref (bytes);
+  return TRUE;
+}
+
+/**
+ * cockpit_metrics_aggregate_recv:
+ * @self: an aggregate
+ * @host: index of the host in the hosts passed to cockpit_metrics_aggregate_new()
+ * @payload: a message from that host's channel
+ *
+ * Returns: FALSE if the message wasn't a valid JSON 'meta' or 'data' message
+ */
+gboolean
+cockpit_metrics_aggregate_recv (CockpitMetricsAggregate *self,
+                                guint host,
+                                GBytes *payload)
+{
+  AggregateHost *ah;
+  const gchar *data;
+  gsize length;
+  gint count;
+  gint64 newest;
+
+  g_return_val_if_fail (self != NULL, FALSE);
+  g_return_val_if_fail (host < self->n_hosts, FALSE);
+
+  ah = self->hosts + host;
+  if (ah->closed)
+    return TRUE;
+
+  data = g_bytes_get_data (payload, &length);
+  while (length > 0 && g_ascii_isspace (data[0]))
+    {
+      data++;
+      length--;
+    }
+  while (length > 0 && g_ascii_isspace (data[length - 1]))
+    length--;
+
+  if (length > 0 && data[0] == '{')
+    return aggregate_meta (self, ah, payload);
+
+  count = count_points (data, length);
+  if (count < 0)
+    {
+      g_message ("%s: received invalid metrics data message", ah->name);
+      return FALSE;
+    }
+  else if (ah->interval == 0)
+    {
+      g_message ("%s: received metrics data before meta message", ah->name);
+      return FALSE;
+    }
+  else if (count == 0)
+    {
+      return TRUE;
+    }
+
+  if (ah->pending->len > 0)
+    g_string_append_c (ah->pending, ',');
+  g_string_append_len (ah->pending, data + 1, length - 2);
+
+  ah->next += count * ah->interval;
+  newest = ah->next - ah->interval;
+  if (newest > self->tick)
+    self->tick = newest;
+
+  aggregate_maybe_flush (self);
+  return TRUE;
+}
+
+static void
+aggregate_mark_ready (CockpitMetricsAggregate *self,
+                      AggregateHost *host)
+{
+  GBytes *payload;
+
+  if (host->ready)
+    return;
+
+  host->ready = TRUE;
+  self->n_ready++;
+
+  /* Ready once every host is either ready or gone */
+  if (self->n_ready == self->n_hosts && self->n_closed < self->n_hosts)
+    {
+      payload = cockpit_transport_build_control ("command", "ready", "channel", self->channel, NULL);
+      (self->send) (NULL, payload, self->user_data);
+      g_bytes_unref (payload);
+    }
+}
+
+void
+cockpit_metrics_aggregate_ready (CockpitMetricsAggregate *self,
+                                 guint host)
+{
+  g_return_if_fail (self != NULL);
+  g_return_if_fail (host < self->n_hosts);
+
+  if (!self->hosts[host].closed)
+    aggregate_mark_ready (self, self->hosts + host);
+}
+
+/**
+ * cockpit_metrics_aggregate_close:
+ * @self: an aggregate
+ * @host: index of the host whose channel closed
+ * @problem: why it closed, or NULL
+ *
+ * Whatever is held back is sent first, and then the client is
+ * told which host went away.
+ *
+ * Returns: TRUE when all the hosts have closed
+ */
+gboolean
+cockpit_metrics_aggregate_close (CockpitMetricsAggregate *self,
+                                 guint host,
+                                 const gchar *problem)
+{
+  AggregateHost *ah;
+  JsonObject *object;
+  GBytes *payload;
+
+  g_return_val_if_fail (self != NULL, FALSE);
+  g_return_val_if_fail (host < self->n_hosts, FALSE);
+
+  ah = self->hosts + host;
+  if (ah->closed)
+    return self->n_closed == self->n_hosts;
+
+  ah->closed = TRUE;
+  self->n_closed++;
+  if (problem)
+    {
+      self->n_failed++;
+      g_free (self->problem);
+      self->problem = g_strdup (problem);
+    }
+
+  if (self->n_closed == self->n_hosts)
+    {
+      aggregate_flush (self);
+      return TRUE;
+    }
+
+  object = json_object_new ();
+  json_object_set_string_member (object, "host", ah->name);
+  if (problem)
+    json_object_set_string_member (object, "problem", problem);
+  payload = cockpit_json_write_bytes (object);
+  json_object_unref (object);
+
+  /* Goes after any of its points */
+  aggregate_flush (self);
+  (self->send) (self->channel, payload, self->user_data);
+  g_bytes_unref (payload);
+
+  aggregate_mark_ready (self, ah);
+  return FALSE;
+}
+
+/**
+ * cockpit_metrics_aggregate_get_problem:
+ * @self: an aggregate
+ *
+ * Returns: the problem the aggregate channel closes with, once all
+ *          hosts have closed: the last one's, when none closed cleanly
+ */
+const gchar *
+cockpit_metrics_aggregate_get_problem (CockpitMetricsAggregate *self)
+{
+  g_return_val_if_fail (self != NULL, NULL);
+
+  if (self->n_failed < self->n_hosts)
+    return NULL;
+  return self->problem;
+}
@@ -0,0 +1,56 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2016 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __COCKPIT_METRICS_AGGREGATE_H__
+#define __COCKPIT_METRICS_AGGREGATE_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _CockpitMetricsAggregate CockpitMetricsAggregate;
+
+/* Called with a NULL channel for control messages */
+typedef void                (* CockpitMetricsAggregateFunc)        (const gchar *channel,
+                                                                    GBytes *payload,
+                                                                    gpointer user_data);
+
+CockpitMetricsAggregate *   cockpit_metrics_aggregate_new          (const gchar *channel,
+                                                                    const gchar **hosts,
+                                                                    CockpitMetricsAggregateFunc send,
+                                                                    gpointer user_data);
+
+void                        cockpit_metrics_aggregate_free         (CockpitMetricsAggregate *self);
+
+gboolean                    cockpit_metrics_aggregate_recv         (CockpitMetricsAggregate *self,
+                                                                    guint host,
+                                                                    GBytes *payload);
+
+void                        cockpit_metrics_aggregate_ready        (CockpitMetricsAggregate *self,
+                                                                    guint host);
+
+gboolean                    cockpit_metrics_aggregate_close        (CockpitMetricsAggregate *self,
+                                                                    guint host,
+                                                                    const gchar *problem);
+
+const gchar *               cockpit_metrics_aggregate_get_problem  (CockpitMetricsAggregate *self);
+
+G_END_DECLS
+
+#endif /* __COCKPIT_METRICS_AGGREGATE_H__ */
@@ -26,21 +26,32 @@
 #define G_LOG_DOMAIN "cockpit-protocol"
 
 #include "cockpitauthpipe.h"
+#include "cockpitknownhosts.h"
 #include "cockpitsshtransport.h"
 #include "cockpitsshagent.h"
 
+#include "common/cockpitconf.h"
 #include "common/cockpitjson.h"
 #include "common/cockpitpipe.h"
+#include "common/cockpitprobes.h"
+#include "common/cockpitstats.h"
 
 #include <libssh/libssh.h>
 #include <libssh/callbacks.h>
 
 #include <glib/gstdio.h>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+#endif
+
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 
+/* At most this many connect threads run at once, others wait their turn */
+guint cockpit_ssh_connect_threads = 8;
+
 /**
  * CockpitSshTransport:
  *
@@ -48,6 +59,10 @@
  * ssh connection to an ssh server. Note this is the client side
  * of an SSH connection.  See doc/protocol.md for information on how the
  * framing looks ... including the MSB length prefix.
+ *
+ * With the "io-thread" property set, the libssh I/O and crypto for the
+ * transport run in a thread of their own once connected. Received messages
+ * are relayed to the main thread, where the transport signals are emitted.
  */
 
 /* ----------------------------------------------------------------------------
@@ -90,6 +105,9 @@ typedef struct {
   /* When connect is done this flag is cleared */
   gint *connecting;
 
+  /* When the connect was requested, for logging */
+  gint64 queued;
+
   int auth_fd;
 
 } CockpitSshData;
@@ -247,6 +265,47 @@ out:
   return line;
 }
 
+/*
+ * Builds the same line that ssh_write_knownhost() would, without a
+ * temporary file. ECDSA keys are left to libssh, since libssh 0.6 names
+ * them differently in ssh_key_type_to_char().
+ */
+static gchar *
+build_knownhosts_line (ssh_session session,
+                       ssh_key key)
+{
+  enum ssh_keytypes_e type;
+  unsigned int port = 0;
+  char *host = NULL;
+  char *base64 = NULL;
+  gchar *lower = NULL;
+  gchar *line = NULL;
+
+  type = ssh_key_type (key);
+  if (type != SSH_KEYTYPE_RSA && type != SSH_KEYTYPE_DSS)
+    return get_knownhosts_line (session);
+
+  if (ssh_options_get (session, SSH_OPTIONS_HOST, &host) != SSH_OK ||
+      ssh_options_get_port (session, &port) != SSH_OK ||
+      ssh_pki_export_pubkey_base64 (key, &base64) != SSH_OK)
+    {
+      g_warning ("Couldn't build knownhosts line: %s", ssh_get_error (session));
+      goto out;
+    }
+
+  lower = g_ascii_strdown (host, -1);
+  if (port == 22)
+    line = g_strdup_printf ("%s %s %s", lower, ssh_key_type_to_char (type), base64);
+  else
+    line = g_strdup_printf ("[%s]:%u %s %s", lower, port, ssh_key_type_to_char (type), base64);
+
+out:
+  ssh_string_free_char (host);
+  ssh_string_free_char (base64);
+  g_free (lower);
+  return line;
+}
+
 static const gchar *
 verify_knownhost (CockpitSshData *data)
 {
@@ -257,16 +316,16 @@ verify_knownhost (CockpitSshData *data)
   int state;
   gsize len;
 
-  data->host_key = get_knownhosts_line (data->session);
-  if (data->host_key == NULL)
+  if (ssh_get_publickey (data->session, &key) != SSH_OK)
     {
+      g_warning ("Couldn't look up ssh host key");
       ret = "internal-error";
       goto done;
     }
 
-  if (ssh_get_publickey (data->session, &key) != SSH_OK)
+  data->host_key = build_knownhosts_line (data->session, key);
+  if (data->host_key == NULL)
     {
-      g_warning ("Couldn't look up ssh host key");
       ret = "internal-error";
       goto done;
     }
@@ -308,8 +367,15 @@ verify_knownhost (CockpitSshData *data)
             g_message ("%s: host key did not match expected", data->logname);
         }
     }
+  else if (data->knownhosts_file &&
+           cockpit_known_hosts_contains (data->knownhosts_file, data->host_key))
+    {
+      g_debug ("%s: verified host key", data->logname);
+      ret = NULL; /* success */
+    }
   else
     {
+      /* libssh tells apart a changed key from an unknown one */
       if (ssh_options_set (data->session, SSH_OPTIONS_KNOWNHOSTS, data->knownhosts_file) != SSH_OK)
         {
           g_warning ("Couldn't set knownhosts file location");
@@ -807,10 +873,31 @@ out:
   return problem;
 }
 
+static gint
+elapsed_msec (gint64 *since)
+{
+  gint64 now = g_get_monotonic_time ();
+  gint msec = (now - *since) / 1000;
+  *since = now;
+  return msec;
+}
+
+/* Counts how long a phase of connecting took, and starts the next one */
+static void
+time_phase (CockpitStat histogram,
+            gint64 *since)
+{
+  gint64 now = g_get_monotonic_time ();
+  cockpit_stats_time (NULL, histogram, now - *since);
+  *since = now;
+}
+
 static const gchar *
 cockpit_ssh_connect (CockpitSshData *data)
 {
   const gchar *problem;
+  gint64 phase;
+  gint64 when;
   int rc;
 
   /*
@@ -818,6 +905,11 @@ cockpit_ssh_connect (CockpitSshData *data)
    * connection attempt was cancelled.
    */
 
+  when = data->queued;
+  g_debug ("%s: waited %d ms to connect", data->logname, elapsed_msec (&when));
+
+  /* This resolves the host, connects and does the key exchange */
+  phase = g_get_monotonic_time ();
   rc = ssh_connect (data->session);
   if (rc != SSH_OK)
     {
@@ -827,7 +919,8 @@ cockpit_ssh_connect (CockpitSshData *data)
       return "no-host";
     }
 
-  g_debug ("%s: connected", data->logname);
+  g_debug ("%s: connected in %d ms", data->logname, elapsed_msec (&when));
+  time_phase (COCKPIT_STAT_WS_SSH_CONNECT, &phase);
 
   if (!data->ignore_key)
     {
@@ -836,11 +929,16 @@ cockpit_ssh_connect (CockpitSshData *data)
         return problem;
     }
 
+  phase = g_get_monotonic_time ();
+
   /* The problem returned when auth failure */
   problem = cockpit_ssh_authenticate (data);
   if (problem != NULL)
     return problem;
 
+  g_debug ("%s: authenticated in %d ms", data->logname, elapsed_msec (&when));
+  time_phase (COCKPIT_STAT_WS_SSH_AUTH, &phase);
+
   data->channel = ssh_channel_new (data->session);
   g_return_val_if_fail (data->channel != NULL, NULL);
 
@@ -862,7 +960,8 @@ cockpit_ssh_connect (CockpitSshData *data)
       return "internal-error";
     }
 
-  g_debug ("%s: opened channel", data->logname);
+  g_debug ("%s: opened channel in %d ms", data->logname, elapsed_msec (&when));
+  time_phase (COCKPIT_STAT_WS_SSH_SESSION, &phase);
 
   /* Success */
   return NULL;
@@ -920,6 +1019,7 @@ enum {
   PROP_IGNORE_KEY,
   PROP_AGENT,
   PROP_AUTH_PIPE,
+  PROP_IO_THREAD,
 };
 
 struct _CockpitSshTransport {
@@ -930,6 +1030,7 @@ struct _CockpitSshTransport {
 
   /* Connecting happens in a thread */
   GThread *connect_thread;
+  CockpitSshData *connect_queued;
   gint connecting;
   gint connect_fd;
   gboolean result_emitted;
@@ -944,7 +1045,8 @@ struct _CockpitSshTransport {
   CockpitAuthPipe *auth_pipe;
 
   GSource *io;
-  gboolean closing;
+  gint priority;
+  gint closing;
   gboolean closed;
   guint timeout_close;
   const gchar *problem;
@@ -957,6 +1059,7 @@ struct _CockpitSshTransport {
   gboolean send_eof;
   gboolean sent_eof;
   gboolean sent_close;
+  guint64 bytes_sent;
 
   /* Input */
   GByteArray *buffer;
@@ -965,12 +1068,35 @@ struct _CockpitSshTransport {
   gboolean received_eof;
   gboolean received_close;
   gboolean received_exit;
+  guint64 bytes_received;
 
   /* Error Data */
   GString *errbuf;
   gboolean not_cockpit;
+
+  /* Optionally the libssh I/O happens in its own thread */
+  gboolean threaded;
+  GThread *io_thread;
+  GMainContext *io_context;
+  GSource *io_source;
+  gint io_stop;
+
+  /* Shared with the I/O thread, protected by io_lock */
+  GMutex io_lock;
+  GQueue *incoming;
+  gboolean io_done;
+  const gchar *io_problem;
+
+  /* Traced channels, and queued payloads of theirs, also under io_lock */
+  GHashTable *traces;
+  GHashTable *traced_blocks;
 };
 
+typedef struct {
+  gchar *channel;
+  GBytes *payload;
+} CockpitSshMessage;
+
 struct _CockpitSshTransportClass {
   CockpitTransportClass parent_class;
 };
@@ -980,6 +1106,76 @@ static void close_immediately (CockpitSshTransport *self,
 
 G_DEFINE_TYPE (CockpitSshTransport, cockpit_ssh_transport, COCKPIT_TYPE_TRANSPORT);
 
+static void
+cockpit_ssh_message_free (gpointer data)
+{
+  CockpitSshMessage *message = data;
+  g_free (message->channel);
+  g_bytes_unref (message->payload);
+  g_free (message);
+}
+
+/*
+ * Called where libssh I/O happens. In threaded mode that's the I/O
+ * thread, and the main thread does the actual closing.
+ */
+static void
+close_io (CockpitSshTransport *self,
+          const gchar *problem)
+{
+  if (!self->threaded)
+    {
+      close_immediately (self, problem);
+      return;
+    }
+
+  g_mutex_lock (&self->io_lock);
+  if (!self->io_done)
+    {
+      self->io_done = TRUE;
+      self->io_problem = problem;
+    }
+  g_mutex_unlock (&self->io_lock);
+
+  g_main_context_wakeup (self->data->context);
+}
+
+static void
+emit_recv (CockpitSshTransport *self,
+           const gchar *channel,
+           GBytes *payload)
+{
+  CockpitSshMessage *message;
+  CockpitTrace *trace;
+
+  COCKPIT_PROBE3 (frame_recv, self->logname, channel, g_bytes_get_size (payload));
+
+  if (self->traces && channel)
+    {
+      g_mutex_lock (&self->io_lock);
+      trace = g_hash_table_lookup (self->traces, channel);
+      if (trace)
+        cockpit_trace_mark (trace, "ssh-read");
+      g_mutex_unlock (&self->io_lock);
+    }
+
+  if (!self->threaded)
+    {
+      cockpit_transport_emit_recv ((CockpitTransport *)self, channel, payload);
+      return;
+    }
+
+  message = g_new0 (CockpitSshMessage, 1);
+  message->channel = g_strdup (channel);
+  message->payload = g_bytes_ref (payload);
+
+  g_mutex_lock (&self->io_lock);
+  g_queue_push_tail (self->incoming, message);
+  g_mutex_unlock (&self->io_lock);
+
+  g_main_context_wakeup (self->data->context);
+}
+
 static gboolean
 on_timeout_close (gpointer data)
 {
@@ -987,7 +1183,7 @@ on_timeout_close (gpointer data)
   self->timeout_close = 0;
 
   g_debug ("%s: forcing close after timeout", self->logname);
-  close_immediately (self, NULL);
+  close_io (self, NULL);
 
   return FALSE;
 }
@@ -996,7 +1192,9 @@ static gboolean
 close_maybe (CockpitSshTransport *self,
              gint session_io_status)
 {
-  if (self->closed)
+  GSource *source;
+
+  if (self->closed || self->io_done)
     return TRUE;
 
   if (!self->sent_close || !self->received_close)
@@ -1009,7 +1207,7 @@ close_maybe (CockpitSshTransport *self,
    */
   if (self->received_exit && !(session_io_status & SSH_WRITE_PENDING))
     {
-      close_immediately (self, NULL);
+      close_io (self, NULL);
       return TRUE;
     }
 
@@ -1018,7 +1216,12 @@ close_maybe (CockpitSshTransport *self,
    * exit signal and or drain its buffers. Otherwise force.
    */
   if (!self->timeout_close)
-    self->timeout_close = g_timeout_add_seconds (3, on_timeout_close, self);
+    {
+      source = g_timeout_source_new_seconds (3);
+      g_source_set_callback (source, on_timeout_close, self, NULL);
+      self->timeout_close = g_source_attach (source, self->io_context);
+      g_source_unref (source);
+    }
 
   return FALSE;
 }
@@ -1042,6 +1245,7 @@ on_channel_data (ssh_session session,
   else
     {
       g_debug ("%s: received %d bytes", self->logname, (int)len);
+      self->bytes_received += len;
       if (self->not_cockpit)
         g_string_append_len (self->errbuf, data, len);
       else
@@ -1185,6 +1389,10 @@ cockpit_ssh_transport_init (CockpitSshTransport *self)
   self->errbuf = g_string_sized_new (64);
   self->queue = g_queue_new ();
 
+  g_mutex_init (&self->io_lock);
+  self->incoming = g_queue_new ();
+  self->priority = G_PRIORITY_DEFAULT;
+
   memcpy (&self->channel_cbs, &channel_cbs, sizeof (channel_cbs));
   self->channel_cbs.userdata = self;
   ssh_callbacks_init (&self->channel_cbs);
@@ -1192,12 +1400,111 @@ cockpit_ssh_transport_init (CockpitSshTransport *self)
   self->event = ssh_event_new ();
 }
 
+/*
+ * Transports waiting for a connect thread, only touched from the
+ * main thread.
+ */
+static GQueue connect_queue = G_QUEUE_INIT;
+static guint connect_running = 0;
+
+static void
+start_connect_thread (CockpitSshTransport *self)
+{
+  CockpitSshData *data = self->connect_queued;
+
+  self->connect_queued = NULL;
+  connect_running++;
+
+  self->connect_thread = g_thread_new ("ssh-transport-connect",
+                                       cockpit_ssh_connect_thread, data);
+}
+
+static void
+queue_connect (CockpitSshTransport *self,
+               CockpitSshData *data)
+{
+  data->queued = g_get_monotonic_time ();
+  self->connect_queued = data;
+
+  if (connect_running < cockpit_ssh_connect_threads)
+    {
+      start_connect_thread (self);
+    }
+  else
+    {
+      g_debug ("%s: waiting for a connect thread", self->logname);
+      g_queue_push_tail (&connect_queue, self);
+    }
+}
+
+static CockpitSshData *
+finish_connect (CockpitSshTransport *self)
+{
+  CockpitSshTransport *next;
+  GThread *thread;
+
+  if (self->connect_queued)
+    {
+      /* Never got a thread */
+      g_queue_remove (&connect_queue, self);
+      self->data = self->connect_queued;
+      self->connect_queued = NULL;
+    }
+  else
+    {
+      thread = self->connect_thread;
+      self->connect_thread = NULL;
+      self->data = g_thread_join (thread);
+      g_assert (connect_running > 0);
+      connect_running--;
+
+      /* Let the next one in line connect */
+      next = g_queue_pop_head (&connect_queue);
+      if (next)
+        start_connect_thread (next);
+    }
+
+  return self->data;
+}
+
+static void
+stop_io_thread (CockpitSshTransport *self)
+{
+  GSource *source;
+
+  if (!self->io_thread)
+    return;
+
+  g_atomic_int_set (&self->io_stop, 1);
+  g_main_context_wakeup (self->io_context);
+  g_thread_join (self->io_thread);
+  self->io_thread = NULL;
+
+  /* The close timeout was attached to the I/O context */
+  if (self->timeout_close)
+    {
+      source = g_main_context_find_source_by_id (self->io_context, self->timeout_close);
+      if (source)
+        g_source_destroy (source);
+      self->timeout_close = 0;
+    }
+
+  g_source_destroy (self->io_source);
+  g_source_unref (self->io_source);
+  self->io_source = NULL;
+
+  g_main_context_unref (self->io_context);
+  self->io_context = NULL;
+}
+
 static void
 close_immediately (CockpitSshTransport *self,
                    const gchar *problem)
 {
   GSource *source;
-  GThread *thread;
+
+  /* Everything below touches the ssh session */
+  stop_io_thread (self);
 
   if (self->timeout_close)
     {
@@ -1210,17 +1517,15 @@ close_immediately (CockpitSshTransport *self,
 
   self->closed = TRUE;
 
-  if (self->connect_thread)
+  if (self->connect_thread || self->connect_queued)
     {
-      thread = self->connect_thread;
-      self->connect_thread = NULL;
-
       /* This causes thread to fail */
       g_atomic_int_set (&self->connecting, 0);
-      close (self->connect_fd);
+      if (self->connect_thread)
+        close (self->connect_fd);
       self->connect_fd = -1;
       g_assert (self->data == NULL);
-      self->data = g_thread_join (thread);
+      finish_connect (self);
     }
 
   g_assert (self->data != NULL);
@@ -1249,6 +1554,8 @@ close_immediately (CockpitSshTransport *self,
 
   g_debug ("%s: closing io%s%s", self->logname,
            problem ? ": " : "", problem ? problem : "");
+  g_debug ("%s: sent %" G_GUINT64_FORMAT " bytes, received %" G_GUINT64_FORMAT " bytes",
+           self->logname, self->bytes_sent, self->bytes_received);
 
   if (self->io)
     {
@@ -1303,92 +1610,91 @@ drain_error_buffer (CockpitSshTransport *self)
     }
 }
 
+static void
+not_cockpit_output (CockpitSshTransport *self,
+                    const gchar *data,
+                    gsize length)
+{
+  /*
+   * So we may be talking to a process that's not cockpit-bridge. How does
+   * that happen? ssh always executes commands inside of a shell ... and
+   * bash prints its 'cockpit-bridge: not found' message on stdout (!)
+   *
+   * So we degrade gracefully in this case, and start to treat output as
+   * error output.
+   */
+  g_string_append_len (self->errbuf, data, length);
+  g_string_append_len (self->errbuf, (gchar *)self->buffer->data, self->buffer->len);
+  cockpit_pipe_skip (self->buffer, self->buffer->len);
+  self->not_cockpit = TRUE;
+}
+
 static void
 drain_output_buffer (CockpitSshTransport *self)
 {
-  GBytes *message;
+  gboolean invalid = FALSE;
+  GBytes *frames;
   GBytes *payload;
   gchar *channel;
-  guint32 size, i;
-  gchar *data;
-
-  for (;;)
+  const gchar *data;
+  gsize length;
+  gsize pos;
+  gssize prefix;
+  guint32 size;
+  gint channel_len;
+
+  /* The frames are handed out as slices of the one block */
+  frames = cockpit_transport_read_frames (self->buffer, &invalid);
+  if (frames)
     {
-      size = 0;
-      data = (gchar *)self->buffer->data;
-      for (i = 0; i < self->buffer->len; i++)
+      data = g_bytes_get_data (frames, &length);
+      for (pos = 0; pos < length; pos += prefix + size)
         {
-          /* Check invalid characters, prevent integer overflow, limit max length */
-          if (i > 7 || data[i] < '0' || data[i] > '9')
-            break;
-          size *= 10;
-          size += data[i] - '0';
-        }
-
-      if (i == self->buffer->len)
-        {
-          if (!self->received_eof)
-            g_debug ("%s: want len have %d", self->logname, (int)self->buffer->len);
-          break;
-        }
+          prefix = cockpit_transport_parse_header (data + pos, length - pos, &size, &channel_len);
+          g_assert (prefix > 0);
 
-      /*
-       * So we may be talking to a process that's not cockpit-bridge. How does
-       * that happen? ssh always executes commands inside of a shell ... and
-       * bash prints its 'cockpit-bridge: not found' message on stdout (!)
-       *
-       * So we degrade gracefully in this case, and start to treat output as
-       * error output.
-       */
-      if (data[i] != '\n')
-        {
-          if (self->received_frame)
+          payload = cockpit_transport_frame_payload (frames, pos + prefix, size, channel_len,
+                                                     self->received_frame, &channel);
+          if (payload)
             {
-              g_message ("%s: incorrect protocol: received invalid length prefix", self->logname);
-              close_immediately (self, "protocol-error");
+              g_debug ("%s: received a %d byte payload", self->logname, (int)g_bytes_get_size (payload));
+              self->received_frame = TRUE;
+              emit_recv (self, channel, payload);
+              g_bytes_unref (payload);
+              g_free (channel);
+            }
+          else if (self->received_frame)
+            {
+              close_io (self, "protocol-error");
+              invalid = FALSE;
+              break;
             }
           else
             {
-              g_string_append_len (self->errbuf, (gchar *)self->buffer->data, self->buffer->len);
-              cockpit_pipe_skip (self->buffer, self->buffer->len);
-              self->not_cockpit = TRUE;
+              not_cockpit_output (self, data + pos, length - pos);
+              invalid = FALSE;
+              break;
             }
-          break;
         }
 
-      if (self->buffer->len < i + 1 + size)
-        {
-          g_debug ("%s: want %d have %d", self->logname,
-                   (int)(size + sizeof (size)), (int)self->buffer->len);
-          break;
-        }
+      g_bytes_unref (frames);
+    }
+  else if (!invalid && !self->received_eof)
+    {
+      g_debug ("%s: want more data, have %d", self->logname, (int)self->buffer->len);
+    }
 
-      message = cockpit_pipe_consume (self->buffer, i + 1, size, 0);
+  if (invalid)
+    {
       if (self->received_frame)
-        payload = cockpit_transport_parse_frame (message, &channel);
-      else
-        payload = cockpit_transport_maybe_frame (message, &channel);
-      if (payload)
         {
-          g_debug ("%s: received a %d byte payload", self->logname, (int)g_bytes_get_size (payload));
-          self->received_frame = TRUE;
-          cockpit_transport_emit_recv ((CockpitTransport *)self, channel, payload);
-          g_bytes_unref (payload);
-          g_free (channel);
-        }
-      else if (self->received_frame)
-        {
-          close_immediately (self, "protocol-error");
-          break;
+          g_message ("%s: incorrect protocol: received invalid length prefix", self->logname);
+          close_io (self, "protocol-error");
         }
       else
         {
-          g_string_append_len (self->errbuf, (gchar *)self->buffer->data, self->buffer->len);
-          cockpit_pipe_skip (self->buffer, self->buffer->len);
-          self->not_cockpit = TRUE;
-          break;
+          not_cockpit_output (self, NULL, 0);
         }
-      g_bytes_unref (message);
     }
 
   if (self->received_eof)
@@ -1397,7 +1703,7 @@ drain_output_buffer (CockpitSshTransport *self)
       if (self->buffer->len > 0)
         {
           g_debug ("%s: received truncated %d byte frame", self->logname, (int)self->buffer->len);
-          close_immediately (self, "disconnected");
+          close_io (self, "disconnected");
         }
     }
 }
@@ -1427,7 +1733,7 @@ dispatch_close (CockpitSshTransport *self)
         {
           g_warning ("%s: couldn't send close: %s", self->logname,
                      ssh_get_error (self->data->session));
-          close_immediately (self, "internal-error");
+          close_io (self, "internal-error");
         }
       break;
     }
@@ -1458,7 +1764,7 @@ dispatch_eof (CockpitSshTransport *self)
         {
           g_warning ("%s: couldn't send eof: %s", self->logname,
                      ssh_get_error (self->data->session));
-          close_immediately (self, "internal-error");
+          close_io (self, "internal-error");
         }
       break;
     }
@@ -1467,6 +1773,7 @@ dispatch_eof (CockpitSshTransport *self)
 static gboolean
 dispatch_queue (CockpitSshTransport *self)
 {
+  CockpitTrace *trace;
   GBytes *block;
   const guchar *data;
   const gchar *msg;
@@ -1481,7 +1788,9 @@ dispatch_queue (CockpitSshTransport *self)
 
   for (;;)
     {
+      g_mutex_lock (&self->io_lock);
       block = g_queue_peek_head (self->queue);
+      g_mutex_unlock (&self->io_lock);
       if (!block)
         return FALSE;
 
@@ -1501,20 +1810,32 @@ dispatch_queue (CockpitSshTransport *self)
           else if (ssh_msg_is_disconnected (msg))
             {
               g_message ("%s: couldn't write: %s", self->logname, msg);
-              close_immediately (self, "terminated");
+              close_io (self, "terminated");
             }
           else
             {
               g_warning ("%s: couldn't write: %s", self->logname, msg);
-              close_immediately (self, "internal-error");
+              close_io (self, "internal-error");
             }
           break;
         }
 
+      self->bytes_sent += rc;
       if (rc == want)
         {
           g_debug ("%s: wrote %d bytes", self->logname, rc);
+          g_mutex_lock (&self->io_lock);
           g_queue_pop_head (self->queue);
+          if (self->traced_blocks)
+            {
+              trace = g_hash_table_lookup (self->traced_blocks, block);
+              if (trace)
+                {
+                  cockpit_trace_mark (trace, "ssh-written");
+                  g_hash_table_remove (self->traced_blocks, block);
+                }
+            }
+          g_mutex_unlock (&self->io_lock);
           g_bytes_unref (block);
           self->partial = 0;
         }
@@ -1538,68 +1859,30 @@ typedef struct {
 } CockpitSshSource;
 
 static gboolean
-cockpit_ssh_source_check (GSource *source)
+cockpit_ssh_io_check (GSource *source)
 {
   CockpitSshSource *cs = (CockpitSshSource *)source;
   return cs->transport->drain_buffer || (cs->pfd.events & cs->pfd.revents) != 0;
 }
 
 static gboolean
-cockpit_ssh_source_prepare (GSource *source,
-                            gint *timeout)
+cockpit_ssh_io_prepare (GSource *source,
+                        gint *timeout)
 {
   CockpitSshSource *cs = (CockpitSshSource *)source;
   CockpitSshTransport *self = cs->transport;
-  GThread *thread;
+  gboolean queued;
   gint status;
 
   *timeout = 1;
 
-  /* Connecting, check if done */
-  if (G_UNLIKELY (!self->data))
+  /* Waiting for the main thread to close us */
+  if (self->io_done)
     {
-      if (g_atomic_int_get (&self->connecting))
-        return FALSE;
-
-      g_object_ref (self);
-
-      /* Get the result from connecting thread */
-      thread = self->connect_thread;
-      self->connect_fd = -1;
-      self->connect_thread = NULL;
-      self->data = g_thread_join (thread);
-      g_assert (self->data != NULL);
-
-      if (self->agent)
-        cockpit_ssh_agent_close (self->agent);
-
-      if (self->auth_pipe)
-        cockpit_auth_pipe_close (self->auth_pipe, self->data->problem);
-
-      if (!self->result_emitted)
-        {
-          self->result_emitted = TRUE;
-          g_signal_emit_by_name (self, "result", self->data->problem);
-        }
-
-      if (self->data->problem)
-        {
-          close_immediately (self, self->data->problem);
-          g_object_unref (self);
-          return FALSE;
-        }
-
-      g_object_unref (self);
-
-      ssh_event_add_session (self->event, self->data->session);
-      ssh_set_channel_callbacks (self->data->channel, &self->channel_cbs);
-
-      /* Start watching the fd */
-      ssh_set_blocking (self->data->session, 0);
-      cs->pfd.fd = ssh_get_fd (self->data->session);
-      g_source_add_poll (source, &cs->pfd);
-
-      g_debug ("%s: starting io", self->logname);
+      *timeout = -1;
+      cs->pfd.events = 0;
+      self->drain_buffer = FALSE;
+      return FALSE;
     }
 
   status = ssh_get_status (self->data->session);
@@ -1616,6 +1899,10 @@ cockpit_ssh_source_prepare (GSource *source,
   if (close_maybe (self, status))
     return FALSE;
 
+  g_mutex_lock (&self->io_lock);
+  queued = !g_queue_is_empty (self->queue);
+  g_mutex_unlock (&self->io_lock);
+
   cs->pfd.revents = 0;
   cs->pfd.events = G_IO_IN | G_IO_ERR | G_IO_NVAL | G_IO_HUP;
 
@@ -1624,11 +1911,11 @@ cockpit_ssh_source_prepare (GSource *source,
     cs->pfd.events |= G_IO_OUT;
 
   /* We have something in our queue: want to write */
-  else if (!g_queue_is_empty (self->queue))
+  else if (queued)
     cs->pfd.events |= G_IO_OUT;
 
   /* We are closing and need to send eof: want to write */
-  else if (self->closing && !self->sent_eof)
+  else if (g_atomic_int_get (&self->closing) && !self->sent_eof)
     cs->pfd.events |= G_IO_OUT;
 
   /* Need to reply to an EOF or close */
@@ -1636,13 +1923,13 @@ cockpit_ssh_source_prepare (GSource *source,
       (self->received_close && !self->sent_close))
     cs->pfd.events |= G_IO_OUT;
 
-  return cockpit_ssh_source_check (source);
+  return cockpit_ssh_io_check (source);
 }
 
 static gboolean
-cockpit_ssh_source_dispatch (GSource *source,
-                             GSourceFunc callback,
-                             gpointer user_data)
+cockpit_ssh_io_dispatch (GSource *source,
+                         GSourceFunc callback,
+                         gpointer user_data)
 {
   CockpitSshSource *cs = (CockpitSshSource *)source;
   CockpitSshTransport *self = cs->transport;
@@ -1654,8 +1941,6 @@ cockpit_ssh_source_dispatch (GSource *source,
   g_return_val_if_fail ((cond & G_IO_NVAL) == 0, FALSE);
   g_assert (self->data != NULL);
 
-  g_object_ref (self);
-
   if (self->drain_buffer)
     {
       self->drain_buffer = 0;
@@ -1696,12 +1981,12 @@ cockpit_ssh_source_dispatch (GSource *source,
       if (ssh_msg_is_disconnected (msg))
         {
           g_debug ("%s: failed to process channel: %s", self->logname, msg);
-          close_immediately (self, "terminated");
+          close_io (self, "terminated");
         }
       else
         {
           g_message ("%s: failed to process channel: %s", self->logname, msg);
-          close_immediately (self, "internal-error");
+          close_io (self, "internal-error");
         }
       goto out;
     default:
@@ -1713,7 +1998,7 @@ cockpit_ssh_source_dispatch (GSource *source,
   if (cond & G_IO_ERR)
     {
       g_message ("%s: error reading from ssh", self->logname);
-      close_immediately (self, "disconnected");
+      close_io (self, "disconnected");
       goto out;
     }
 
@@ -1726,7 +2011,7 @@ cockpit_ssh_source_dispatch (GSource *source,
 
   if (cond & G_IO_OUT)
     {
-      if (!dispatch_queue (self) && self->closing && !self->sent_eof)
+      if (!dispatch_queue (self) && g_atomic_int_get (&self->closing) && !self->sent_eof)
         dispatch_eof (self);
       if (self->received_eof && self->sent_eof && !self->sent_close)
         dispatch_close (self);
@@ -1735,10 +2020,243 @@ cockpit_ssh_source_dispatch (GSource *source,
     }
 
 out:
+  return ret;
+}
+
+static gpointer
+cockpit_ssh_io_thread (gpointer user_data)
+{
+  CockpitSshTransport *self = user_data;
+
+  g_main_context_push_thread_default (self->io_context);
+  while (!g_atomic_int_get (&self->io_stop))
+    g_main_context_iteration (self->io_context, TRUE);
+  g_main_context_pop_thread_default (self->io_context);
+
+  return NULL;
+}
+
+static void
+start_io_thread (CockpitSshTransport *self)
+{
+  CockpitSshSource *cs;
+
+  static GSourceFuncs source_funcs = {
+    cockpit_ssh_io_prepare,
+    cockpit_ssh_io_check,
+    cockpit_ssh_io_dispatch,
+    NULL,
+  };
+
+  self->io_context = g_main_context_new ();
+  self->io_source = g_source_new (&source_funcs, sizeof (CockpitSshSource));
+  cs = (CockpitSshSource *)self->io_source;
+  cs->transport = self;
+  cs->pfd.fd = ssh_get_fd (self->data->session);
+  g_source_add_poll (self->io_source, &cs->pfd);
+  g_source_attach (self->io_source, self->io_context);
+
+  self->io_thread = g_thread_new ("ssh-transport-io", cockpit_ssh_io_thread, self);
+}
+
+static gboolean
+relay_pending (CockpitSshTransport *self)
+{
+  gboolean ret;
+
+  g_mutex_lock (&self->io_lock);
+  ret = self->io_done || !g_queue_is_empty (self->incoming);
+  g_mutex_unlock (&self->io_lock);
+
+  return ret;
+}
+
+static void
+relay_incoming (CockpitSshTransport *self)
+{
+  CockpitSshMessage *message;
+  const gchar *problem;
+  GQueue *messages;
+  gboolean done;
+
+  g_mutex_lock (&self->io_lock);
+  messages = self->incoming;
+  self->incoming = g_queue_new ();
+  done = self->io_done;
+  problem = self->io_problem;
+  g_mutex_unlock (&self->io_lock);
+
+  g_object_ref (self);
+
+  while ((message = g_queue_pop_head (messages)) != NULL)
+    {
+      if (!self->closed)
+        cockpit_transport_emit_recv ((CockpitTransport *)self, message->channel, message->payload);
+      cockpit_ssh_message_free (message);
+    }
+  g_queue_free (messages);
+
+  if (done)
+    close_immediately (self, problem);
+
   g_object_unref (self);
+}
+
+static gboolean
+cockpit_ssh_source_check (GSource *source)
+{
+  CockpitSshSource *cs = (CockpitSshSource *)source;
+
+  if (cs->transport->io_thread)
+    return relay_pending (cs->transport);
+
+  return cockpit_ssh_io_check (source);
+}
+
+static gboolean
+cockpit_ssh_source_prepare (GSource *source,
+                            gint *timeout)
+{
+  CockpitSshSource *cs = (CockpitSshSource *)source;
+  CockpitSshTransport *self = cs->transport;
+
+  *timeout = 1;
+
+  /* Connecting, check if done */
+  if (G_UNLIKELY (!self->data))
+    {
+      if (g_atomic_int_get (&self->connecting))
+        return FALSE;
+
+      g_object_ref (self);
+
+      /* Get the result from connecting thread */
+      self->connect_fd = -1;
+      finish_connect (self);
+      g_assert (self->data != NULL);
+
+      if (self->agent)
+        cockpit_ssh_agent_close (self->agent);
+
+      if (self->auth_pipe)
+        cockpit_auth_pipe_close (self->auth_pipe, self->data->problem);
+
+      if (!self->result_emitted)
+        {
+          self->result_emitted = TRUE;
+          g_signal_emit_by_name (self, "result", self->data->problem);
+        }
+
+      if (self->data->problem)
+        {
+          close_immediately (self, self->data->problem);
+          g_object_unref (self);
+          return FALSE;
+        }
+
+      g_object_unref (self);
+
+      /* Closed by a result handler */
+      if (self->closed)
+        return FALSE;
+
+      ssh_event_add_session (self->event, self->data->session);
+      ssh_set_channel_callbacks (self->data->channel, &self->channel_cbs);
+
+      /* Start watching the fd */
+      ssh_set_blocking (self->data->session, 0);
+      if (self->threaded)
+        {
+          start_io_thread (self);
+        }
+      else
+        {
+          cs->pfd.fd = ssh_get_fd (self->data->session);
+          g_source_add_poll (source, &cs->pfd);
+        }
+
+      g_debug ("%s: starting io%s", self->logname, self->threaded ? " thread" : "");
+    }
+
+  /* Only relaying what the I/O thread received */
+  if (self->io_thread)
+    {
+      *timeout = -1;
+      return relay_pending (self);
+    }
+
+  return cockpit_ssh_io_prepare (source, timeout);
+}
+
+static gboolean
+cockpit_ssh_source_dispatch (GSource *source,
+                             GSourceFunc callback,
+                             gpointer user_data)
+{
+  CockpitSshSource *cs = (CockpitSshSource *)source;
+  CockpitSshTransport *self = cs->transport;
+  gboolean ret;
+
+  if (self->io_thread)
+    {
+      relay_incoming (self);
+      return TRUE;
+    }
+
+  /* Not in the I/O thread, which must never drop the last reference */
+  g_object_ref (self);
+  ret = cockpit_ssh_io_dispatch (source, callback, user_data);
+  g_object_unref (self);
+
   return ret;
 }
 
+static gboolean
+have_aes_instructions (void)
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid (1, &eax, &ebx, &ecx, &edx))
+    return FALSE;
+  return (ecx & bit_AES) ? TRUE : FALSE;
+#else
+  return FALSE;
+#endif
+}
+
+static void
+setup_ssh_options (CockpitSshTransport *self)
+{
+  const gchar *ciphers;
+
+  /*
+   * libssh leaves compression off, which is a poor fit for chatty text
+   * streams like the journal. Ciphers that libssh doesn't know about are
+   * dropped from the list when it is set.
+   */
+  if (cockpit_conf_bool ("Ssh-Login", "Compression", FALSE))
+    {
+      if (ssh_options_set (self->data->session, SSH_OPTIONS_COMPRESSION, "yes") != SSH_OK)
+        g_warning ("%s: couldn't enable ssh compression", self->logname);
+    }
+
+  ciphers = cockpit_conf_string ("Ssh-Login", "Ciphers");
+  if (g_strcmp0 (ciphers, "auto") == 0)
+    {
+      if (have_aes_instructions ())
+        ciphers = "aes128-gcm@openssh.com,aes256-gcm@openssh.com,chacha20-poly1305@openssh.com,aes128-ctr,aes256-ctr";
+      else
+        ciphers = "chacha20-poly1305@openssh.com,aes128-gcm@openssh.com,aes256-gcm@openssh.com,aes128-ctr,aes256-ctr";
+    }
+
+  if (ciphers)
+    {
+      if (ssh_options_set (self->data->session, SSH_OPTIONS_CIPHERS_C_S, ciphers) != SSH_OK ||
+          ssh_options_set (self->data->session, SSH_OPTIONS_CIPHERS_S_C, ciphers) != SSH_OK)
+        g_warning ("%s: couldn't set ssh ciphers: %s", self->logname, ciphers);
+    }
+}
+
 static void
 cockpit_ssh_transport_constructed (GObject *object)
 {
@@ -1758,6 +2276,8 @@ cockpit_ssh_transport_constructed (GObject *object)
   g_warn_if_fail (ssh_options_set (self->data->session, SSH_OPTIONS_USER,
                                    cockpit_creds_get_user (self->data->creds)) == 0);
 
+  setup_ssh_options (self);
+
 #ifdef HAVE_SSH_SET_AGENT_SOCKET
   if (self->agent)
     {
@@ -1775,6 +2295,7 @@ cockpit_ssh_transport_constructed (GObject *object)
 
   self->io = g_source_new (&source_funcs, sizeof (CockpitSshSource));
   ((CockpitSshSource *)self->io)->transport = self;
+  g_source_set_priority (self->io, self->priority);
   g_source_attach (self->io, self->data->context);
 
   /* Setup for connect thread */
@@ -1784,8 +2305,7 @@ cockpit_ssh_transport_constructed (GObject *object)
   data = self->data;
   self->data = NULL;
 
-  self->connect_thread = g_thread_new ("ssh-transport-connect",
-                                       cockpit_ssh_connect_thread, data);
+  queue_connect (self, data);
 
   g_debug ("%s: constructed", self->logname);
 }
@@ -1842,6 +2362,9 @@ cockpit_ssh_transport_set_property (GObject *obj,
     case PROP_IGNORE_KEY:
       self->data->ignore_key = g_value_get_boolean (value);
       break;
+    case PROP_IO_THREAD:
+      self->threaded = g_value_get_boolean (value);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (obj, prop_id, pspec);
       break;
@@ -1903,10 +2426,17 @@ cockpit_ssh_transport_finalize (GObject *object)
   g_free (self->logname);
 
   g_queue_free_full (self->queue, (GDestroyNotify)g_bytes_unref);
+  g_queue_free_full (self->incoming, cockpit_ssh_message_free);
+  if (self->traces)
+    g_hash_table_unref (self->traces);
+  if (self->traced_blocks)
+    g_hash_table_unref (self->traced_blocks);
+  g_mutex_clear (&self->io_lock);
   g_byte_array_free (self->buffer, TRUE);
   g_string_free (self->errbuf, TRUE);
 
   g_assert (self->io == NULL);
+  g_assert (self->io_thread == NULL);
 
   G_OBJECT_CLASS (cockpit_ssh_transport_parent_class)->finalize (object);
 }
@@ -1917,6 +2447,7 @@ cockpit_ssh_transport_send (CockpitTransport *transport,
                             GBytes *payload)
 {
   CockpitSshTransport *self = COCKPIT_SSH_TRANSPORT (transport);
+  CockpitTrace *trace = NULL;
   gchar *prefix;
   gsize channel_len;
   gsize payload_len;
@@ -1926,14 +2457,32 @@ cockpit_ssh_transport_send (CockpitTransport *transport,
 
   channel_len = channel ? strlen (channel) : 0;
   payload_len = g_bytes_get_size (payload);
+  COCKPIT_PROBE3 (frame_send, self->logname, channel, payload_len);
 
   prefix = g_strdup_printf ("%" G_GSIZE_FORMAT "\n%s\n",
                                 channel_len + 1 + payload_len,
                                 channel ? channel : "");
   length = strlen (prefix);
 
+  g_mutex_lock (&self->io_lock);
   g_queue_push_tail (self->queue, g_bytes_new_take (prefix, length));
-  g_queue_push_tail (self->queue, g_bytes_ref (payload));
+  if (self->traces && channel)
+    trace = g_hash_table_lookup (self->traces, channel);
+  if (trace)
+    {
+      /* A block of its own, so that it's told apart when written */
+      payload = g_bytes_new_from_bytes (payload, 0, payload_len);
+      g_hash_table_replace (self->traced_blocks, payload, cockpit_trace_ref (trace));
+    }
+  else
+    {
+      g_bytes_ref (payload);
+    }
+  g_queue_push_tail (self->queue, payload);
+  g_mutex_unlock (&self->io_lock);
+
+  if (self->io_thread)
+    g_main_context_wakeup (self->io_context);
 
   g_debug ("%s: queued %" G_GSIZE_FORMAT " byte payload", self->logname, payload_len);
 }
@@ -1944,10 +2493,27 @@ cockpit_ssh_transport_close (CockpitTransport *transport,
 {
   CockpitSshTransport *self = COCKPIT_SSH_TRANSPORT (transport);
 
-  self->closing = TRUE;
+  g_atomic_int_set (&self->closing, TRUE);
 
   if (problem)
     close_immediately (self, problem);
+  else if (self->io_thread)
+    g_main_context_wakeup (self->io_context);
+}
+
+/*
+ * The same source both reads and writes in the main thread, so this
+ * changes the priority of both.
+ */
+static void
+cockpit_ssh_transport_priority (CockpitTransport *transport,
+                                gint priority)
+{
+  CockpitSshTransport *self = COCKPIT_SSH_TRANSPORT (transport);
+
+  self->priority = priority;
+  if (self->io)
+    g_source_set_priority (self->io, priority);
 }
 
 static void
@@ -1959,6 +2525,7 @@ cockpit_ssh_transport_class_init (CockpitSshTransportClass *klass)
 
   transport_class->send = cockpit_ssh_transport_send;
   transport_class->close = cockpit_ssh_transport_close;
+  transport_class->priority = cockpit_ssh_transport_priority;
 
   env = g_getenv ("G_MESSAGES_DEBUG");
   if (env && strstr (env, "libssh"))
@@ -1998,6 +2565,10 @@ cockpit_ssh_transport_class_init (CockpitSshTransportClass *klass)
          g_param_spec_boolean ("ignore-key", NULL, NULL, FALSE,
                                G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS));
 
+  g_object_class_install_property (object_class, PROP_IO_THREAD,
+         g_param_spec_boolean ("io-thread", NULL, NULL, FALSE,
+                               G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS));
+
   g_object_class_install_property (object_class, PROP_CREDS,
          g_param_spec_boxed ("creds", NULL, NULL, COCKPIT_TYPE_CREDS,
                              G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS));
@@ -2110,3 +2681,39 @@ cockpit_ssh_transport_get_auth_method_results (CockpitSshTransport *self)
 
   return self->data->auth_results;
 }
+
+/**
+ * cockpit_ssh_transport_trace:
+ * @self: the transport
+ * @channel: a channel id
+ * @trace: (allow-none): the channel's trace, or NULL to stop
+ *
+ * Mark payloads of @channel in @trace when they're written to
+ * and read from the SSH connection.
+ */
+void
+cockpit_ssh_transport_trace (CockpitSshTransport *self,
+                             const gchar *channel,
+                             CockpitTrace *trace)
+{
+  g_return_if_fail (COCKPIT_IS_SSH_TRANSPORT (self));
+  g_return_if_fail (channel != NULL);
+
+  g_mutex_lock (&self->io_lock);
+  if (trace)
+    {
+      if (!self->traces)
+        {
+          self->traces = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                g_free, cockpit_trace_unref);
+          self->traced_blocks = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                                       NULL, cockpit_trace_unref);
+        }
+      g_hash_table_replace (self->traces, g_strdup (channel), cockpit_trace_ref (trace));
+    }
+  else if (self->traces)
+    {
+      g_hash_table_remove (self->traces, channel);
+    }
+  g_mutex_unlock (&self->io_lock);
+}
@@ -20,12 +20,15 @@
 #ifndef __COCKPIT_SSH_TRANSPORT_H__
 #define __COCKPIT_SSH_TRANSPORT_H__
 
+#include "common/cockpittrace.h"
 #include "common/cockpittransport.h"
 
 #include "cockpitcreds.h"
 
 G_BEGIN_DECLS
 
+extern guint cockpit_ssh_connect_threads;
+
 #define COCKPIT_TYPE_SSH_TRANSPORT         (cockpit_ssh_transport_get_type ())
 #define COCKPIT_SSH_TRANSPORT(o)           (G_TYPE_CHECK_INSTANCE_CAST ((o), COCKPIT_TYPE_SSH_TRANSPORT, CockpitSshTransport))
 #define COCKPIT_IS_SSH_TRANSPORT(k)        (G_TYPE_CHECK_INSTANCE_TYPE ((k), COCKPIT_TYPE_SSH_TRANSPORT))
@@ -45,6 +48,10 @@ const gchar *       cockpit_ssh_transport_get_host_fingerprint  (CockpitSshTrans
 
 GHashTable *        cockpit_ssh_transport_get_auth_method_results (CockpitSshTransport *self);
 
+void                cockpit_ssh_transport_trace                 (CockpitSshTransport *self,
+                                                                 const gchar *channel,
+                                                                 CockpitTrace *trace);
+
 G_END_DECLS
 
 #endif /* __COCKPIT_SSH_TRANSPORT_H__ */
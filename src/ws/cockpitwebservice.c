@@ -30,12 +30,19 @@
 #include "common/cockpitconf.h"
 #include "common/cockpitjson.h"
 #include "common/cockpitlog.h"
+#include "common/cockpitmemory.h"
 #include "common/cockpitpipetransport.h"
+#include "common/cockpitstats.h"
+#include "common/cockpitsystem.h"
+#include "common/cockpittimerwheel.h"
+#include "common/cockpittrace.h"
 #include "common/cockpitwebinject.h"
 #include "common/cockpitwebresponse.h"
 #include "common/cockpitwebserver.h"
 
 #include "cockpitauth.h"
+#include "cockpitbroadcast.h"
+#include "cockpitmetricsaggregate.h"
 #include "cockpitws.h"
 
 #include "cockpitsshagent.h"
@@ -63,8 +70,41 @@ gint cockpit_ws_specific_ssh_port = 0;
 
 guint cockpit_ws_ping_interval = 5;
 
+/* Seconds a session without channels stays open, see SessionIdleTimeout */
 gint cockpit_ws_session_timeout = 30;
 
+/* Most sessions without channels kept open, over all logins */
+guint cockpit_ws_max_idle_sessions = 64;
+
+/* Bytes per second from a session over which it yields to other sessions */
+gsize cockpit_ws_busy_session_rate = 2 * 1024 * 1024;
+
+/* Bytes of browser input kept for the broadcast hosts not opened yet */
+gsize cockpit_ws_broadcast_input_maximum = 1024 * 1024;
+
+/* Buffered on a web socket before sessions stop being read, and resume */
+gsize cockpit_ws_pressure_high = 4 * 1024 * 1024;
+gsize cockpit_ws_pressure_low = 1024 * 1024;
+
+/* Bytes a bridge may send on a channel before we acknowledge them */
+gint cockpit_ws_channel_window = 1024 * 1024;
+
+/* Buffered on web sockets for one channel group before its channels aren't acknowledged */
+gsize cockpit_ws_group_queue_maximum = 2 * 1024 * 1024;
+
+/* Seconds the inner part of a crypt1 reauthorize response is kept for */
+guint cockpit_ws_authorize_cache_timeout = 300;
+
+/* Most hosts from the Preconnect setting opened at login */
+guint cockpit_ws_max_preconnect = 4;
+
+/* Seconds a dropped socket can be resumed in, and how much of what it sent is kept */
+guint cockpit_ws_resume_timeout = 30;
+gsize cockpit_ws_resume_buffer = 256 * 1024;
+
+/* Whether WebSocket messages may be compressed, see cockpit_web_service_create_socket() */
+gboolean cockpit_ws_websocket_compression = FALSE;
+
 /* ----------------------------------------------------------------------------
  * CockpitSession
  */
@@ -75,15 +115,31 @@ typedef struct
   gboolean primary;
   gboolean private;
   GHashTable *channels;
+  GHashTable *unacked;
   CockpitTransport *transport;
   gboolean sent_done;
   guint timeout;
+  GList *idle_link;
+  gint64 rate_start;
+  gsize rate_bytes;
+  gboolean busy;
   CockpitCreds *creds;
   gboolean init_received;
+  gboolean can_kill;
+  gboolean can_ack;
   gulong control_sig;
   gulong recv_sig;
   gulong closed_sig;
   gchar *checksum;
+  gchar *target;
+
+  /* How many sockets have it throttled, see throttle_session() */
+  guint pressure_holders;
+
+  /* The inner part of recent crypt1 responses, see start_authorize() */
+  char *authorize_salt;
+  char *authorize_secret;
+  gint64 authorize_expires;
 } CockpitSession;
 
 typedef struct
@@ -91,9 +147,33 @@ typedef struct
   GHashTable *by_host;
   GHashTable *by_channel;
   GHashTable *by_transport;
+
+  /* Indexes of sessions, so that lookups don't scan all of them */
+  GHashTable *by_target;
+  GHashTable *by_checksum;
 } CockpitSessions;
 
+/* Sessions without channels of all web services, least recently used first */
+static GQueue idle_sessions = G_QUEUE_INIT;
+
+static void
+cockpit_session_mark_busy (CockpitSession *session)
+{
+  if (session->timeout)
+    {
+      cockpit_timer_wheel_remove (session->timeout);
+      session->timeout = 0;
+    }
+  if (session->idle_link)
+    {
+      g_queue_delete_link (&idle_sessions, session->idle_link);
+      session->idle_link = NULL;
+    }
+}
+
 /* Should only called as a hash table GDestroyNotify */
+static void forget_authorize (CockpitSession *session);
+
 static void
 cockpit_session_free (gpointer data)
 {
@@ -101,9 +181,9 @@ cockpit_session_free (gpointer data)
 
   g_debug ("%s: freeing session", session->host);
 
-  if (session->timeout)
-    g_source_remove (session->timeout);
+  cockpit_session_mark_busy (session);
   g_hash_table_unref (session->channels);
+  g_hash_table_unref (session->unacked);
   if (session->control_sig)
     g_signal_handler_disconnect (session->transport, session->control_sig);
   if (session->recv_sig)
@@ -112,9 +192,21 @@ cockpit_session_free (gpointer data)
     g_signal_handler_disconnect (session->transport, session->closed_sig);
   g_object_unref (session->transport);
   cockpit_creds_unref (session->creds);
+  forget_authorize (session);
   g_free (session->checksum);
+  g_free (session->target);
   g_free (session->host);
   g_free (session);
+
+  cockpit_stats_add (NULL, COCKPIT_STAT_WS_SESSIONS, -1);
+  cockpit_memory_idle ();
+}
+
+/* Values in session->channels, a channel is open until it's removed */
+static void
+release_channel_stats (gpointer data)
+{
+  cockpit_stats_add (data, COCKPIT_STAT_CHANNEL_OPEN, -1);
 }
 
 static void
@@ -122,6 +214,8 @@ cockpit_sessions_init (CockpitSessions *sessions)
 {
   sessions->by_channel = g_hash_table_new (g_str_hash, g_str_equal);
   sessions->by_host = g_hash_table_new (g_str_hash, g_str_equal);
+  sessions->by_target = g_hash_table_new (g_str_hash, g_str_equal);
+  sessions->by_checksum = g_hash_table_new (g_str_hash, g_str_equal);
 
   /* This owns the session */
   sessions->by_transport = g_hash_table_new_full (g_direct_hash, g_direct_equal,
@@ -149,6 +243,58 @@ cockpit_session_by_host (CockpitSessions *sessions,
   return g_hash_table_lookup (sessions->by_host, host);
 }
 
+inline static CockpitSession *
+cockpit_session_by_target (CockpitSessions *sessions,
+                           const gchar *target)
+{
+  return g_hash_table_lookup (sessions->by_target, target);
+}
+
+inline static CockpitSession *
+cockpit_session_by_checksum (CockpitSessions *sessions,
+                             const gchar *checksum)
+{
+  return g_hash_table_lookup (sessions->by_checksum, checksum);
+}
+
+static void
+cockpit_session_unindex_checksum (CockpitSessions *sessions,
+                                  CockpitSession *session)
+{
+  CockpitSession *other;
+  GHashTableIter iter;
+
+  if (!session->checksum || cockpit_session_by_checksum (sessions, session->checksum) != session)
+    return;
+
+  g_hash_table_remove (sessions->by_checksum, session->checksum);
+
+  /* Several hosts can have the same checksum, index another one */
+  g_hash_table_iter_init (&iter, sessions->by_transport);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&other))
+    {
+      if (other != session && other->checksum && g_str_equal (other->checksum, session->checksum))
+        {
+          g_hash_table_insert (sessions->by_checksum, other->checksum, other);
+          break;
+        }
+    }
+}
+
+static void
+cockpit_session_set_checksum (CockpitSessions *sessions,
+                              CockpitSession *session,
+                              const gchar *checksum)
+{
+  cockpit_session_unindex_checksum (sessions, session);
+
+  g_free (session->checksum);
+  session->checksum = g_strdup (checksum);
+
+  if (checksum && !cockpit_session_by_checksum (sessions, checksum))
+    g_hash_table_insert (sessions->by_checksum, session->checksum, session);
+}
+
 static gboolean
 on_timeout_cleanup_session (gpointer user_data)
 {
@@ -169,6 +315,66 @@ on_timeout_cleanup_session (gpointer user_data)
   return FALSE;
 }
 
+/*
+ * Sessions without channels are kept open for a while, so that going back
+ * to a host doesn't have to start a bridge or connect over SSH again. Keep
+ * at most cockpit_ws_max_idle_sessions of them, and close the ones that
+ * have been idle the longest when there are more.
+ */
+static void
+cockpit_session_mark_idle (CockpitSession *session)
+{
+  CockpitSession *coldest;
+
+  cockpit_session_mark_busy (session);
+  session->timeout = cockpit_timer_wheel_add_seconds (NULL, cockpit_ws_session_timeout,
+                                                      on_timeout_cleanup_session, session);
+  g_queue_push_tail (&idle_sessions, session);
+  session->idle_link = idle_sessions.tail;
+
+  while (cockpit_ws_max_idle_sessions > 0 &&
+         g_queue_get_length (&idle_sessions) > cockpit_ws_max_idle_sessions)
+    {
+      coldest = g_queue_pop_head (&idle_sessions);
+      coldest->idle_link = NULL;
+
+      /* As above, on_session_closed() takes it from here */
+      g_debug ("%s: closing session idle the longest", coldest->host);
+      cockpit_transport_close (coldest->transport, "timeout");
+    }
+}
+
+/*
+ * All sessions of all users are read in the one main loop. So that a
+ * session which sends a lot, such as a page streaming a large file,
+ * doesn't hold up everyone else, its messages are only read when nothing
+ * else is ready once it goes over cockpit_ws_busy_session_rate. This is
+ * checked about once a second, and undone when it calms down again.
+ */
+static void
+cockpit_session_count_rate (CockpitSession *session,
+                            gsize length)
+{
+  gint64 now = g_get_monotonic_time ();
+  gboolean busy;
+
+  session->rate_bytes += length;
+  if (now - session->rate_start < G_USEC_PER_SEC)
+    return;
+
+  busy = ((gdouble)session->rate_bytes * G_USEC_PER_SEC) / (now - session->rate_start) >
+         cockpit_ws_busy_session_rate;
+  if (busy != session->busy)
+    {
+      g_debug ("%s: session %s", session->host, busy ? "is busy, reading it last" : "is no longer busy");
+      cockpit_transport_set_priority (session->transport, busy ? G_PRIORITY_LOW : G_PRIORITY_DEFAULT);
+      session->busy = busy;
+    }
+
+  session->rate_start = now;
+  session->rate_bytes = 0;
+}
+
 static void
 cockpit_session_remove_channel (CockpitSessions *sessions,
                                 CockpitSession *session,
@@ -178,6 +384,7 @@ cockpit_session_remove_channel (CockpitSessions *sessions,
 
   g_hash_table_remove (sessions->by_channel, channel);
   g_hash_table_remove (session->channels, channel);
+  g_hash_table_remove (session->unacked, channel);
 
   if (g_hash_table_size (session->channels) == 0 && !session->primary)
     {
@@ -186,8 +393,7 @@ cockpit_session_remove_channel (CockpitSessions *sessions,
        * of them being that way.
        */
       g_debug ("%s: removed last channel %s for session", session->host, channel);
-      session->timeout = g_timeout_add_seconds (cockpit_ws_session_timeout,
-                                                on_timeout_cleanup_session, session);
+      cockpit_session_mark_idle (session);
     }
   else
     {
@@ -198,45 +404,105 @@ cockpit_session_remove_channel (CockpitSessions *sessions,
 static void
 cockpit_session_add_channel (CockpitSessions *sessions,
                              CockpitSession *session,
-                             const gchar *channel)
+                             const gchar *channel,
+                             const gchar *payload)
 {
+  CockpitStats *stats;
   gchar *chan;
 
+  stats = cockpit_stats_lookup (payload ? payload : "unknown");
+  cockpit_stats_add (stats, COCKPIT_STAT_CHANNEL_OPEN, 1);
+  cockpit_stats_add (stats, COCKPIT_STAT_CHANNEL_OPENED, 1);
+
   chan = g_strdup (channel);
   g_hash_table_insert (sessions->by_channel, chan, session);
-  g_hash_table_add (session->channels, chan);
+  g_hash_table_insert (session->channels, chan, stats);
+  g_hash_table_replace (session->unacked, g_strdup (channel), g_new0 (gsize, 1));
 
   g_debug ("%s: added channel %s to session", session->host, channel);
 
-  if (session->timeout)
+  cockpit_session_mark_busy (session);
+}
+
+/* Acknowledge what the bridge sent on a channel since the last time */
+static void
+cockpit_session_send_ack (CockpitSession *session,
+                          const gchar *channel)
+{
+  JsonObject *object;
+  GBytes *message;
+  gsize *unacked;
+
+  unacked = g_hash_table_lookup (session->unacked, channel);
+  if (!unacked || *unacked == 0 || session->sent_done)
+    return;
+
+  object = cockpit_transport_build_json ("command", "ack", "channel", channel, NULL);
+  json_object_set_int_member (object, "bytes", *unacked);
+  message = cockpit_json_write_bytes (object);
+  json_object_unref (object);
+
+  cockpit_transport_send (session->transport, NULL, message);
+  g_bytes_unref (message);
+  *unacked = 0;
+}
+
+/*
+ * Options for the privileged bridge that the bridge starts, from the
+ * SuperuserPrewarm and SuperuserIdleTimeout settings.
+ */
+static JsonObject *
+build_superuser_options (void)
+{
+  JsonObject *object = NULL;
+  const gchar *conf;
+
+  if (cockpit_conf_bool ("WebService", "SuperuserPrewarm", FALSE))
     {
-      g_source_remove (session->timeout);
-      session->timeout = 0;
+      object = json_object_new ();
+      json_object_set_boolean_member (object, "prewarm", TRUE);
+    }
+
+  conf = cockpit_conf_string ("WebService", "SuperuserIdleTimeout");
+  if (conf)
+    {
+      if (!object)
+        object = json_object_new ();
+      json_object_set_int_member (object, "idle-timeout", g_ascii_strtoull (conf, NULL, 10));
     }
+
+  return object;
 }
 
 static CockpitSession *
 cockpit_session_track (CockpitSessions *sessions,
                        const gchar *host,
                        gboolean private,
+                       const gchar *target,
                        CockpitCreds *creds,
                        CockpitTransport *transport)
 {
   CockpitSession *session;
+  JsonObject *superuser;
   JsonObject *object;
   GBytes *command;
 
   g_debug ("%s: new session", host);
+  cockpit_stats_add (NULL, COCKPIT_STAT_WS_SESSIONS, 1);
 
   session = g_new0 (CockpitSession, 1);
-  session->channels = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  session->channels = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, release_channel_stats);
+  session->unacked = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
   session->transport = g_object_ref (transport);
   session->host = g_strdup (host);
   session->private = private;
+  session->target = g_strdup (target);
   session->creds = cockpit_creds_ref (creds);
 
   if (!private)
     g_hash_table_insert (sessions->by_host, session->host, session);
+  if (session->target && !cockpit_session_by_target (sessions, session->target))
+    g_hash_table_insert (sessions->by_target, session->target, session);
 
   /* This owns the session */
   g_hash_table_insert (sessions->by_transport, transport, session);
@@ -245,6 +511,11 @@ cockpit_session_track (CockpitSessions *sessions,
   object = cockpit_transport_build_json ("command", "init", NULL);
   json_object_set_int_member (object, "version", 1);
   json_object_set_string_member (object, "host", host);
+  if (COCKPIT_IS_PIPE_TRANSPORT (transport))
+    json_object_set_string_member (object, "framing", "binary");
+  superuser = build_superuser_options ();
+  if (superuser)
+    json_object_set_object_member (object, "superuser", superuser);
   command = cockpit_json_write_bytes (object);
   json_object_unref (object);
 
@@ -267,9 +538,13 @@ cockpit_session_destroy (CockpitSessions *sessions,
   while (g_hash_table_iter_next (&iter, (gpointer *)&chan, NULL))
     g_hash_table_remove (sessions->by_channel, chan);
   g_hash_table_remove_all (session->channels);
+  g_hash_table_remove_all (session->unacked);
 
   if (!session->private)
     g_hash_table_remove (sessions->by_host, session->host);
+  if (session->target && cockpit_session_by_target (sessions, session->target) == session)
+    g_hash_table_remove (sessions->by_target, session->target);
+  cockpit_session_unindex_checksum (sessions, session);
 
   /* This owns the session */
   g_hash_table_remove (sessions->by_transport, session->transport);
@@ -280,32 +555,319 @@ cockpit_sessions_cleanup (CockpitSessions *sessions)
 {
   g_hash_table_destroy (sessions->by_channel);
   g_hash_table_destroy (sessions->by_host);
+  g_hash_table_destroy (sessions->by_target);
+  g_hash_table_destroy (sessions->by_checksum);
   g_hash_table_destroy (sessions->by_transport);
 }
 
+/* ----------------------------------------------------------------------------
+ * Channel Groups
+ */
+
+/*
+ * Channels opened with the same "group", usually those of one page, are
+ * accounted together. What a group has queued is its share of the data
+ * buffered on the web sockets it sends to, which goes down in proportion
+ * as each socket's buffer drains. Past cockpit_ws_group_queue_maximum the
+ * group's channels are no longer acknowledged, so the bridges stop sending
+ * on them once their window is full, until the group is down to half of
+ * that. Other channels on the same sessions and sockets carry on.
+ */
+
+typedef struct _CockpitGroups CockpitGroups;
+
+typedef struct {
+  gint refs;
+  gchar *name;
+  guint channels;
+  gsize queued;
+  gboolean over;
+  GHashTable *held;
+  CockpitStats *stats;
+  CockpitGroups *groups;
+} CockpitGroup;
+
+struct _CockpitGroups {
+  GHashTable *by_name;
+  GHashTable *by_channel;
+  CockpitSessions *sessions;
+};
+
+static CockpitGroup *
+cockpit_group_ref (CockpitGroup *group)
+{
+  group->refs++;
+  return group;
+}
+
+static void
+cockpit_group_unref (gpointer data)
+{
+  CockpitGroup *group = data;
+
+  if (--group->refs > 0)
+    return;
+
+  g_hash_table_remove (group->groups->by_name, group->name);
+  g_hash_table_destroy (group->held);
+  g_free (group->name);
+  g_free (group);
+}
+
+static void
+cockpit_groups_init (CockpitGroups *groups,
+                     CockpitSessions *sessions)
+{
+  groups->sessions = sessions;
+  groups->by_name = g_hash_table_new (g_str_hash, g_str_equal);
+
+  /* This owns the groups, along with the sockets they're queued on */
+  groups->by_channel = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, cockpit_group_unref);
+}
+
+static void
+cockpit_groups_cleanup (CockpitGroups *groups)
+{
+  g_hash_table_destroy (groups->by_channel);
+  g_hash_table_destroy (groups->by_name);
+}
+
+inline static CockpitGroup *
+cockpit_groups_lookup_by_channel (CockpitGroups *groups,
+                                  const gchar *channel)
+{
+  if (g_hash_table_size (groups->by_channel) == 0)
+    return NULL;
+  return g_hash_table_lookup (groups->by_channel, channel);
+}
+
+static void
+cockpit_groups_add_channel (CockpitGroups *groups,
+                            const gchar *channel,
+                            const gchar *name)
+{
+  CockpitGroup *group;
+
+  group = g_hash_table_lookup (groups->by_name, name);
+  if (group)
+    {
+      cockpit_group_ref (group);
+    }
+  else
+    {
+      group = g_new0 (CockpitGroup, 1);
+      group->refs = 1;
+      group->name = g_strdup (name);
+      group->held = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+      group->stats = cockpit_stats_lookup_group (name);
+      group->groups = groups;
+      g_hash_table_insert (groups->by_name, group->name, group);
+    }
+
+  group->channels++;
+  cockpit_stats_add (group->stats, COCKPIT_STAT_GROUP_CHANNELS, 1);
+  g_hash_table_replace (groups->by_channel, g_strdup (channel), group);
+}
+
+static void
+cockpit_groups_remove_channel (CockpitGroups *groups,
+                               const gchar *channel)
+{
+  CockpitGroup *group;
+
+  group = cockpit_groups_lookup_by_channel (groups, channel);
+  if (!group)
+    return;
+
+  g_hash_table_remove (group->held, channel);
+  group->channels--;
+  cockpit_stats_add (group->stats, COCKPIT_STAT_GROUP_CHANNELS, -1);
+  g_hash_table_remove (groups->by_channel, channel);
+}
+
+static void
+cockpit_group_queue (CockpitGroup *group,
+                     gsize amount)
+{
+  group->queued += amount;
+  cockpit_stats_add (group->stats, COCKPIT_STAT_GROUP_QUEUED, amount);
+
+  if (!group->over && cockpit_ws_group_queue_maximum > 0 &&
+      group->queued > cockpit_ws_group_queue_maximum)
+    {
+      g_debug ("group %s: queued too much, holding acknowledgements", group->name);
+      group->over = TRUE;
+    }
+}
+
+static void
+cockpit_group_drain (CockpitGroup *group,
+                     gsize amount)
+{
+  CockpitSession *session;
+  GHashTableIter iter;
+  const gchar *channel;
+
+  amount = MIN (amount, group->queued);
+  group->queued -= amount;
+  cockpit_stats_add (group->stats, COCKPIT_STAT_GROUP_QUEUED, -(gssize)amount);
+
+  if (group->over && group->queued <= cockpit_ws_group_queue_maximum / 2)
+    {
+      g_debug ("group %s: acknowledging held channels", group->name);
+      group->over = FALSE;
+
+      g_hash_table_iter_init (&iter, group->held);
+      while (g_hash_table_iter_next (&iter, (gpointer *)&channel, NULL))
+        {
+          session = cockpit_session_by_channel (group->groups->sessions, channel);
+          if (session)
+            cockpit_session_send_ack (session, channel);
+        }
+      g_hash_table_remove_all (group->held);
+    }
+}
+
+/* Whether acknowledgements for the channel wait for the group to drain */
+static gboolean
+cockpit_group_hold_ack (CockpitGroup *group,
+                        const gchar *channel)
+{
+  if (!group->over)
+    return FALSE;
+
+  if (!g_hash_table_contains (group->held, channel))
+    g_hash_table_add (group->held, g_strdup (channel));
+  return TRUE;
+}
+
 /* ----------------------------------------------------------------------------
  * Web Socket Info
  */
 
+/*
+ * When a socket's connection drops without a close handshake, as when
+ * the network goes away for a moment, its channels are kept for a while.
+ * The browser can then resume the socket on a new connection with the
+ * token it was given in "init". Both sides count the messages they've
+ * received, and the messages sent recently are kept so the ones the
+ * other side missed can be sent again.
+ */
+
+typedef struct {
+  WebSocketDataType data_type;
+  GBytes *prefix;
+  GBytes *payload;
+} ReplayMessage;
+
 typedef struct {
   gchar *id;
   WebSocketConnection *connection;
   GHashTable *channels;
+  GHashTable *prefixes;
+  GHashTable *priorities;
+  GHashTable *throttled;
   gboolean init_received;
+  gboolean closing;
+  gsize queued;
+
+  /* The share of the queued bytes of each CockpitGroup */
+  GHashTable *groups;
+
+  /* Resuming the socket on another connection */
+  CockpitWebService *service;
+  CockpitSessions *sessions;
+  gchar *resume;
+  guint resume_timeout;
+  guint64 sent;
+  guint64 received;
+  GQueue replay;
+  gsize replay_size;
 } CockpitSocket;
 
 typedef struct {
   GHashTable *by_channel;
   GHashTable *by_connection;
+  GHashTable *by_resume;
   guint next_socket_id;
 } CockpitSockets;
 
+static void
+replay_message_free (gpointer data)
+{
+  ReplayMessage *message = data;
+  g_bytes_unref (message->prefix);
+  g_bytes_unref (message->payload);
+  g_slice_free (ReplayMessage, message);
+}
+
+static void
+cockpit_socket_release (CockpitSocket *socket)
+{
+  GHashTableIter iter;
+  CockpitTransport *transport;
+
+  CockpitSession *session;
+
+  g_hash_table_iter_init (&iter, socket->throttled);
+  while (g_hash_table_iter_next (&iter, (gpointer *)&transport, NULL))
+    {
+      /* Other sockets may still need the session held back */
+      session = socket->sessions ? cockpit_session_by_transport (socket->sessions, transport) : NULL;
+      if (session && session->pressure_holders > 0 && --session->pressure_holders > 0)
+        continue;
+      cockpit_transport_pressure (transport, FALSE);
+    }
+  g_hash_table_remove_all (socket->throttled);
+}
+
+/* The groups' shares go down in proportion with what's still queued */
+static void
+cockpit_socket_drain_groups (CockpitSocket *socket,
+                             gsize queued)
+{
+  GHashTableIter iter;
+  CockpitGroup *group;
+  gpointer value;
+  gsize share;
+  gsize left;
+
+  g_hash_table_iter_init (&iter, socket->groups);
+  while (g_hash_table_iter_next (&iter, (gpointer *)&group, &value))
+    {
+      share = GPOINTER_TO_SIZE (value);
+      left = 0;
+      if (queued > 0 && socket->queued > 0)
+        left = (gsize)((gdouble)share * queued / socket->queued);
+      left = MIN (left, share);
+
+      cockpit_group_drain (group, share - left);
+      if (left == 0)
+        g_hash_table_iter_remove (&iter);
+      else
+        g_hash_table_iter_replace (&iter, GSIZE_TO_POINTER (left));
+    }
+}
+
 static void
 cockpit_socket_free (gpointer data)
 {
   CockpitSocket *socket = data;
+  cockpit_socket_release (socket);
+  g_hash_table_unref (socket->throttled);
   g_hash_table_unref (socket->channels);
+  g_hash_table_unref (socket->prefixes);
+  g_hash_table_unref (socket->priorities);
+  cockpit_socket_drain_groups (socket, 0);
+  g_hash_table_unref (socket->groups);
   g_object_unref (socket->connection);
+  cockpit_stats_add (NULL, COCKPIT_STAT_WS_QUEUED, -(gssize)socket->queued);
+  cockpit_stats_add (NULL, COCKPIT_STAT_WS_SOCKETS, -1);
+  if (socket->resume_timeout)
+    cockpit_timer_wheel_remove (socket->resume_timeout);
+  while (!g_queue_is_empty (&socket->replay))
+    replay_message_free (g_queue_pop_head (&socket->replay));
+  g_free (socket->resume);
   g_free (socket->id);
   g_free (socket);
 }
@@ -316,6 +878,7 @@ cockpit_sockets_init (CockpitSockets *sockets)
   sockets->next_socket_id = 1;
 
   sockets->by_channel = g_hash_table_new (g_str_hash, g_str_equal);
+  sockets->by_resume = g_hash_table_new (g_str_hash, g_str_equal);
 
   /* This owns the socket */
   sockets->by_connection = g_hash_table_new_full (g_direct_hash, g_direct_equal,
@@ -344,58 +907,180 @@ cockpit_socket_remove_channel (CockpitSockets *sockets,
   g_debug ("%s remove channel %s for socket", socket->id, channel);
   g_hash_table_remove (sockets->by_channel, channel);
   g_hash_table_remove (socket->channels, channel);
+  g_hash_table_remove (socket->prefixes, channel);
+  g_hash_table_remove (socket->priorities, channel);
 }
 
 static void
 cockpit_socket_add_channel (CockpitSockets *sockets,
                             CockpitSocket *socket,
                             const gchar *channel,
-                            WebSocketDataType data_type)
+                            WebSocketDataType data_type,
+                            WebSocketPriority priority)
 {
   gchar *chan;
+  gchar *prefix;
 
   chan = g_strdup (channel);
   g_hash_table_insert (sockets->by_channel, chan, socket);
   g_hash_table_replace (socket->channels, chan, GINT_TO_POINTER (data_type));
 
+  /* Each message sent on the channel gets this prepended */
+  prefix = g_strdup_printf ("%s\n", channel);
+  g_hash_table_replace (socket->prefixes, g_strdup (channel),
+                        g_bytes_new_take (prefix, strlen (prefix)));
+  g_hash_table_replace (socket->priorities, g_strdup (channel), GINT_TO_POINTER (priority));
+
   g_debug ("%s added channel %s to socket", socket->id, channel);
 }
 
-static CockpitSocket *
-cockpit_socket_track (CockpitSockets *sockets,
-                      WebSocketConnection *connection)
+/*
+ * Control messages about a channel must not overtake its data, so
+ * they're sent with the channel's priority rather than as control.
+ */
+static WebSocketPriority
+cockpit_socket_priority (CockpitSocket *socket,
+                         const gchar *channel)
 {
-  CockpitSocket *socket;
-
-  socket = g_new0 (CockpitSocket, 1);
-  socket->id = g_strdup_printf ("%u:", sockets->next_socket_id++);
-  socket->connection = g_object_ref (connection);
-  socket->channels = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
-
-  g_debug ("%s new socket", socket->id);
+  gpointer value;
 
-  /* This owns the session */
-  g_hash_table_insert (sockets->by_connection, connection, socket);
+  if (g_hash_table_lookup_extended (socket->priorities, channel, NULL, &value))
+    return GPOINTER_TO_INT (value);
+  return WEB_SOCKET_PRIORITY_CONTROL;
+}
 
-  return socket;
+/* Whether messages can be sent, or kept for when the socket resumes */
+static gboolean
+cockpit_socket_is_open (CockpitSocket *socket)
+{
+  return socket->resume_timeout != 0 ||
+         web_socket_connection_get_ready_state (socket->connection) == WEB_SOCKET_STATE_OPEN;
 }
 
 static void
-cockpit_socket_destroy (CockpitSockets *sockets,
-                        CockpitSocket *socket)
+cockpit_socket_remember (CockpitSocket *socket,
+                         WebSocketDataType data_type,
+                         GBytes *prefix,
+                         GBytes *payload)
 {
-  GHashTableIter iter;
-  const gchar *chan;
-
-  g_debug ("%s destroy socket", socket->id);
+  ReplayMessage *message;
 
-  g_hash_table_iter_init (&iter, socket->channels);
-  while (g_hash_table_iter_next (&iter, (gpointer *)&chan, NULL))
-    g_hash_table_remove (sockets->by_channel, chan);
-  g_hash_table_remove_all (socket->channels);
+  message = g_slice_new (ReplayMessage);
+  message->data_type = data_type;
+  message->prefix = g_bytes_ref (prefix);
+  message->payload = g_bytes_ref (payload);
+  g_queue_push_tail (&socket->replay, message);
+  socket->replay_size += g_bytes_get_size (prefix) + g_bytes_get_size (payload);
 
-  /* This owns the socket */
-  g_hash_table_remove (sockets->by_connection, socket->connection);
+  while (socket->replay_size > cockpit_ws_resume_buffer && socket->replay.length > 1)
+    {
+      message = g_queue_pop_head (&socket->replay);
+      socket->replay_size -= g_bytes_get_size (message->prefix) + g_bytes_get_size (message->payload);
+      replay_message_free (message);
+    }
+}
+
+/* The queued gauge is kept up to date with each socket's buffered amount */
+static void
+cockpit_socket_update_queued (CockpitSocket *socket)
+{
+  gsize queued;
+
+  queued = web_socket_connection_get_buffered_amount (socket->connection);
+  cockpit_stats_add (NULL, COCKPIT_STAT_WS_QUEUED, (gssize)queued - (gssize)socket->queued);
+  if (queued < socket->queued && g_hash_table_size (socket->groups) > 0)
+    cockpit_socket_drain_groups (socket, queued);
+  socket->queued = queued;
+}
+
+/* Count what was just relayed for a channel group as its share */
+static void
+cockpit_socket_queue_group (CockpitSocket *socket,
+                            CockpitGroup *group,
+                            gsize amount)
+{
+  gpointer value;
+
+  if (web_socket_connection_get_ready_state (socket->connection) != WEB_SOCKET_STATE_OPEN)
+    return;
+
+  if (g_hash_table_lookup_extended (socket->groups, group, NULL, &value))
+    g_hash_table_replace (socket->groups, group, GSIZE_TO_POINTER (GPOINTER_TO_SIZE (value) + amount));
+  else
+    g_hash_table_insert (socket->groups, cockpit_group_ref (group), GSIZE_TO_POINTER (amount));
+
+  cockpit_group_queue (group, amount);
+}
+
+static void
+cockpit_socket_relay (CockpitSocket *socket,
+                      WebSocketDataType data_type,
+                      GBytes *prefix,
+                      GBytes *payload,
+                      WebSocketPriority priority)
+{
+  socket->sent++;
+  if (socket->resume)
+    cockpit_socket_remember (socket, data_type, prefix, payload);
+
+  /* Kept until the socket resumes */
+  if (web_socket_connection_get_ready_state (socket->connection) != WEB_SOCKET_STATE_OPEN)
+    return;
+
+  web_socket_connection_send_full (socket->connection, data_type, prefix, payload, priority);
+  cockpit_stats_add (NULL, COCKPIT_STAT_WS_BYTES_OUT,
+                     g_bytes_get_size (prefix) + g_bytes_get_size (payload));
+  cockpit_socket_update_queued (socket);
+}
+
+static CockpitSocket *
+cockpit_socket_track (CockpitSockets *sockets,
+                      WebSocketConnection *connection)
+{
+  CockpitSocket *socket;
+
+  socket = g_new0 (CockpitSocket, 1);
+  socket->id = g_strdup_printf ("%u:", sockets->next_socket_id++);
+  socket->connection = g_object_ref (connection);
+  socket->channels = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  socket->prefixes = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                            g_free, (GDestroyNotify)g_bytes_unref);
+  socket->priorities = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  socket->groups = g_hash_table_new_full (g_direct_hash, g_direct_equal, cockpit_group_unref, NULL);
+  socket->throttled = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                             g_object_unref, NULL);
+
+  g_debug ("%s new socket", socket->id);
+  cockpit_stats_add (NULL, COCKPIT_STAT_WS_SOCKETS, 1);
+
+  /* This owns the session */
+  g_hash_table_insert (sockets->by_connection, connection, socket);
+
+  return socket;
+}
+
+static void
+cockpit_socket_destroy (CockpitSockets *sockets,
+                        CockpitSocket *socket)
+{
+  GHashTableIter iter;
+  const gchar *chan;
+
+  g_debug ("%s destroy socket", socket->id);
+
+  if (socket->resume)
+    g_hash_table_remove (sockets->by_resume, socket->resume);
+
+  g_hash_table_iter_init (&iter, socket->channels);
+  while (g_hash_table_iter_next (&iter, (gpointer *)&chan, NULL))
+    g_hash_table_remove (sockets->by_channel, chan);
+  g_hash_table_remove_all (socket->channels);
+  g_hash_table_remove_all (socket->prefixes);
+  g_hash_table_remove_all (socket->priorities);
+  cockpit_socket_release (socket);
+
+  /* This owns the socket */
+  g_hash_table_remove (sockets->by_connection, socket->connection);
 }
 
 static void
@@ -416,11 +1101,105 @@ cockpit_sockets_close (CockpitSockets *sockets,
     }
 }
 
+/* Moves each socket over to the other's connection */
+static void
+cockpit_sockets_swap (CockpitSockets *sockets,
+                      CockpitSocket *one,
+                      CockpitSocket *two)
+{
+  WebSocketConnection *connection;
+
+  g_hash_table_steal (sockets->by_connection, one->connection);
+  g_hash_table_steal (sockets->by_connection, two->connection);
+
+  connection = one->connection;
+  one->connection = two->connection;
+  two->connection = connection;
+
+  g_hash_table_insert (sockets->by_connection, one->connection, one);
+  g_hash_table_insert (sockets->by_connection, two->connection, two);
+
+  cockpit_socket_update_queued (one);
+  cockpit_socket_update_queued (two);
+}
+
 static void
 cockpit_sockets_cleanup (CockpitSockets *sockets)
 {
   g_hash_table_destroy (sockets->by_connection);
   g_hash_table_destroy (sockets->by_channel);
+  g_hash_table_destroy (sockets->by_resume);
+}
+
+/* ----------------------------------------------------------------------------
+ * Aggregated metrics and broadcast channels
+ */
+
+/* Broadcast hosts opened at once by default, and at most */
+#define BROADCAST_CONCURRENCY 8
+#define BROADCAST_MAX_CONCURRENCY 64
+
+/* Data, or a control command when there is no data */
+typedef struct {
+  gchar *command;
+  GBytes *data;
+} BroadcastInput;
+
+static void
+broadcast_input_free (gpointer data)
+{
+  BroadcastInput *input = data;
+  g_free (input->command);
+  if (input->data)
+    g_bytes_unref (input->data);
+  g_free (input);
+}
+
+/*
+ * A "metrics1" channel opened with "hosts". It opens an internal
+ * channel to each of the hosts, and combines what they send.
+ *
+ * Any other channel opened with "hosts" is a broadcast. It runs the
+ * same channel on each of the hosts, a few at a time, and sends back
+ * what they send in batches.
+ */
+typedef struct {
+  CockpitWebService *service;
+  gchar *channel;
+  CockpitMetricsAggregate *aggregate;
+  CockpitBroadcast *broadcast;
+
+  /* The options each host is opened with, apart from "channel" and "host" */
+  JsonObject *open;
+  gchar **hosts;
+
+  /* The internal channel of each host, NULL before it opened and once it closed */
+  gchar **subs;
+  guint n_subs;
+
+  /* What the browser sent, replayed to broadcast hosts as they open */
+  GQueue input;
+  gsize input_size;
+} AggregateChannel;
+
+static void
+aggregate_channel_free (gpointer data)
+{
+  AggregateChannel *ac = data;
+  BroadcastInput *input;
+  guint i;
+
+  cockpit_metrics_aggregate_free (ac->aggregate);
+  cockpit_broadcast_free (ac->broadcast);
+  for (i = 0; i < ac->n_subs; i++)
+    g_free (ac->subs[i]);
+  while ((input = g_queue_pop_head (&ac->input)))
+    broadcast_input_free (input);
+  g_free (ac->subs);
+  g_strfreev (ac->hosts);
+  json_object_unref (ac->open);
+  g_free (ac->channel);
+  g_free (ac);
 }
 
 /* ----------------------------------------------------------------------------
@@ -438,7 +1217,12 @@ struct _CockpitWebService {
   guint ping_timeout;
   gint callers;
   guint next_internal_id;
-  GHashTable *channel_groups;
+  CockpitGroups groups;
+  GHashTable *traces;
+
+  /* AggregateChannel by its channel, and by each of its internal ones */
+  GHashTable *aggregates;
+  GHashTable *aggregate_subs;
 };
 
 typedef struct {
@@ -455,8 +1239,10 @@ cockpit_web_service_dispose (GObject *object)
 {
   CockpitWebService *self = COCKPIT_WEB_SERVICE (object);
   CockpitSession *session;
+  CockpitSocket *socket;
   GHashTableIter iter;
   gboolean emit = FALSE;
+  GList *list = NULL, *l;
 
   if (!self->closing)
     {
@@ -467,6 +1253,26 @@ cockpit_web_service_dispose (GObject *object)
 
   cockpit_sockets_close (&self->sockets, NULL);
 
+  /* Nothing can resume now */
+  g_hash_table_iter_init (&iter, self->sockets.by_connection);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&socket))
+    {
+      if (socket->resume_timeout)
+        list = g_list_prepend (list, socket);
+    }
+  for (l = list; l != NULL; l = g_list_next (l))
+    {
+      socket = l->data;
+      cockpit_timer_wheel_remove (socket->resume_timeout);
+      socket->resume_timeout = 0;
+      cockpit_socket_destroy (&self->sockets, socket);
+      caller_end (self);
+    }
+  g_list_free (list);
+
+  g_hash_table_remove_all (self->aggregate_subs);
+  g_hash_table_remove_all (self->aggregates);
+
   g_hash_table_iter_init (&iter, self->sessions.by_transport);
   while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&session))
     {
@@ -488,13 +1294,17 @@ cockpit_web_service_finalize (GObject *object)
 {
   CockpitWebService *self = COCKPIT_WEB_SERVICE (object);
 
-  cockpit_sessions_cleanup (&self->sessions);
+  /* Sockets release their sessions, so go first */
   cockpit_sockets_cleanup (&self->sockets);
+  cockpit_sessions_cleanup (&self->sessions);
   g_bytes_unref (self->control_prefix);
   cockpit_creds_unref (self->creds);
   if (self->ping_timeout)
-    g_source_remove (self->ping_timeout);
-  g_hash_table_destroy (self->channel_groups);
+    cockpit_timer_wheel_remove (self->ping_timeout);
+  g_hash_table_destroy (self->traces);
+  g_hash_table_destroy (self->aggregate_subs);
+  g_hash_table_destroy (self->aggregates);
+  cockpit_groups_cleanup (&self->groups);
 
   G_OBJECT_CLASS (cockpit_web_service_parent_class)->finalize (object);
 }
@@ -532,21 +1342,319 @@ outbound_protocol_error (CockpitWebService *self,
   cockpit_transport_close (transport, problem);
 }
 
+static inline void
+trace_mark (CockpitWebService *self,
+            const gchar *channel,
+            const gchar *point)
+{
+  CockpitTrace *trace;
+
+  if (g_hash_table_size (self->traces) > 0)
+    {
+      trace = g_hash_table_lookup (self->traces, channel);
+      if (trace)
+        cockpit_trace_mark (trace, point);
+    }
+}
+
 static gboolean
 process_close (CockpitWebService *self,
                CockpitSocket *socket,
                CockpitSession *session,
                const gchar *channel)
 {
+  if (session && COCKPIT_IS_SSH_TRANSPORT (session->transport) &&
+      g_hash_table_contains (self->traces, channel))
+    cockpit_ssh_transport_trace (COCKPIT_SSH_TRANSPORT (session->transport), channel, NULL);
   if (session)
     cockpit_session_remove_channel (&self->sessions, session, channel);
   if (socket)
     cockpit_socket_remove_channel (&self->sockets, socket, channel);
-  g_hash_table_remove (self->channel_groups, channel);
+  cockpit_groups_remove_channel (&self->groups, channel);
+  g_hash_table_remove (self->traces, channel);
 
   return TRUE;
 }
 
+static AggregateChannel *
+lookup_aggregate_sub (CockpitWebService *self,
+                      const gchar *channel,
+                      guint *host)
+{
+  AggregateChannel *ac;
+  gpointer key;
+  guint i;
+
+  if (g_hash_table_size (self->aggregate_subs) == 0 ||
+      !g_hash_table_lookup_extended (self->aggregate_subs, channel, &key, (gpointer *)&ac))
+    return NULL;
+
+  /* The key is the string in ac->subs */
+  for (i = 0; i < ac->n_subs; i++)
+    {
+      if (ac->subs[i] == key)
+        {
+          *host = i;
+          return ac;
+        }
+    }
+
+  g_return_val_if_reached (NULL);
+}
+
+static void
+send_aggregate (const gchar *channel,
+                GBytes *payload,
+                gpointer user_data)
+{
+  AggregateChannel *ac = user_data;
+  CockpitWebService *self = ac->service;
+  CockpitSocket *socket;
+  GBytes *prefix;
+
+  socket = cockpit_socket_lookup_by_channel (&self->sockets, ac->channel);
+  if (!socket || !cockpit_socket_is_open (socket))
+    return;
+
+  if (channel)
+    prefix = g_hash_table_lookup (socket->prefixes, channel);
+  else
+    prefix = self->control_prefix;
+  g_return_if_fail (prefix != NULL);
+
+  cockpit_socket_relay (socket, WEB_SOCKET_DATA_TEXT, prefix, payload,
+                        cockpit_socket_priority (socket, ac->channel));
+}
+
+/* Closes the internal channels that are left, and forgets the aggregate */
+static void
+process_aggregate_close (CockpitWebService *self,
+                         CockpitSocket *socket,
+                         AggregateChannel *ac,
+                         const gchar *problem)
+{
+  CockpitSession *session;
+  GBytes *payload;
+  guint i;
+
+  for (i = 0; i < ac->n_subs; i++)
+    {
+      if (!ac->subs[i])
+        continue;
+
+      session = cockpit_session_by_channel (&self->sessions, ac->subs[i]);
+      if (session)
+        {
+          if (!session->sent_done)
+            {
+              payload = cockpit_transport_build_control ("command", "close",
+                                                         "channel", ac->subs[i],
+                                                         "problem", problem,
+                                                         NULL);
+              cockpit_transport_send (session->transport, NULL, payload);
+              g_bytes_unref (payload);
+            }
+          cockpit_session_remove_channel (&self->sessions, session, ac->subs[i]);
+        }
+      g_hash_table_remove (self->aggregate_subs, ac->subs[i]);
+    }
+
+  process_close (self, socket, NULL, ac->channel);
+  g_hash_table_remove (self->aggregates, ac->channel);
+}
+
+static void open_aggregate_sub (CockpitWebService *self,
+                                AggregateChannel *ac,
+                                guint host);
+
+static gboolean
+broadcast_closed (AggregateChannel *ac,
+                  guint host,
+                  const gchar *problem,
+                  JsonObject *options)
+{
+  JsonObject *object = NULL;
+  gboolean ret;
+
+  if (!options && problem)
+    {
+      object = json_object_new ();
+      json_object_set_string_member (object, "problem", problem);
+      options = object;
+    }
+
+  ret = cockpit_broadcast_close (ac->broadcast, host, options);
+
+  if (object)
+    json_object_unref (object);
+  return ret;
+}
+
+/* One host's channel closed, the aggregate closes with the last one */
+static void
+process_aggregate_sub_close (CockpitWebService *self,
+                             CockpitSession *session,
+                             AggregateChannel *ac,
+                             guint host,
+                             const gchar *problem,
+                             JsonObject *options)
+{
+  CockpitSocket *socket;
+  GBytes *payload;
+  gchar *sub;
+  gint next;
+
+  sub = ac->subs[host];
+  ac->subs[host] = NULL;
+  g_hash_table_remove (self->aggregate_subs, sub);
+  if (session)
+    cockpit_session_remove_channel (&self->sessions, session, sub);
+  g_free (sub);
+
+  if (ac->broadcast)
+    {
+      if (!broadcast_closed (ac, host, problem, options))
+        {
+          /* Make room for the hosts that are waiting */
+          while ((next = cockpit_broadcast_next (ac->broadcast)) >= 0)
+            open_aggregate_sub (self, ac, next);
+          return;
+        }
+
+      /* How each host did was in the last batch */
+      problem = NULL;
+    }
+  else
+    {
+      if (!cockpit_metrics_aggregate_close (ac->aggregate, host, problem))
+        return;
+      problem = cockpit_metrics_aggregate_get_problem (ac->aggregate);
+    }
+
+  socket = cockpit_socket_lookup_by_channel (&self->sockets, ac->channel);
+  if (socket && cockpit_socket_is_open (socket))
+    {
+      payload = cockpit_transport_build_control ("command", "close",
+                                                 "channel", ac->channel,
+                                                 "problem", problem,
+                                                 NULL);
+      cockpit_socket_relay (socket, WEB_SOCKET_DATA_TEXT, self->control_prefix, payload,
+                            cockpit_socket_priority (socket, ac->channel));
+      g_bytes_unref (payload);
+    }
+
+  process_aggregate_close (self, socket, ac, NULL);
+}
+
+static gboolean
+process_aggregate_sub_control (CockpitWebService *self,
+                               CockpitSession *session,
+                               const gchar *command,
+                               const gchar *channel,
+                               JsonObject *options)
+{
+  AggregateChannel *ac;
+  const gchar *problem;
+  guint host;
+
+  ac = lookup_aggregate_sub (self, channel, &host);
+  g_return_val_if_fail (ac != NULL, FALSE);
+
+  if (g_str_equal (command, "ready"))
+    {
+      if (ac->broadcast)
+        cockpit_broadcast_ready (ac->broadcast, host);
+      else
+        cockpit_metrics_aggregate_ready (ac->aggregate, host);
+    }
+  else if (g_str_equal (command, "close"))
+    {
+      if (!cockpit_json_get_string (options, "problem", NULL, &problem))
+        problem = NULL;
+      process_aggregate_sub_close (self, session, ac, host, problem, options);
+    }
+
+  /* Anything else, such as "progress", is about one host only */
+  return TRUE;
+}
+
+static void
+send_aggregate_input (CockpitWebService *self,
+                      const gchar *sub,
+                      BroadcastInput *input)
+{
+  CockpitSession *session;
+  GBytes *payload;
+
+  session = cockpit_session_by_channel (&self->sessions, sub);
+  if (!session || session->sent_done)
+    return;
+
+  if (input->data)
+    {
+      cockpit_transport_send (session->transport, sub, input->data);
+    }
+  else
+    {
+      payload = cockpit_transport_build_control ("command", input->command, "channel", sub, NULL);
+      cockpit_transport_send (session->transport, NULL, payload);
+      g_bytes_unref (payload);
+    }
+}
+
+/*
+ * Control messages from the browser, such as "pause", go to every host,
+ * and a broadcast passes on its data too. Both are kept for the hosts
+ * of a broadcast that haven't been opened yet.
+ */
+static void
+relay_aggregate_input (CockpitWebService *self,
+                       AggregateChannel *ac,
+                       const gchar *command,
+                       GBytes *data)
+{
+  BroadcastInput input = { (gchar *)command, data };
+  BroadcastInput *recorded;
+  CockpitSocket *socket;
+  GBytes *payload;
+  guint i;
+
+  for (i = 0; i < ac->n_subs; i++)
+    {
+      if (ac->subs[i])
+        send_aggregate_input (self, ac->subs[i], &input);
+    }
+
+  if (!ac->broadcast || !cockpit_broadcast_pending (ac->broadcast))
+    return;
+
+  if (data)
+    ac->input_size += g_bytes_get_size (data);
+  if (ac->input_size > cockpit_ws_broadcast_input_maximum)
+    {
+      g_message ("%s: too much input to keep for broadcast hosts not open yet", ac->channel);
+      socket = cockpit_socket_lookup_by_channel (&self->sockets, ac->channel);
+      if (socket && cockpit_socket_is_open (socket))
+        {
+          payload = cockpit_transport_build_control ("command", "close",
+                                                     "channel", ac->channel,
+                                                     "problem", "protocol-error",
+                                                     NULL);
+          cockpit_socket_relay (socket, WEB_SOCKET_DATA_TEXT, self->control_prefix, payload,
+                                cockpit_socket_priority (socket, ac->channel));
+          g_bytes_unref (payload);
+        }
+      process_aggregate_close (self, socket, ac, "protocol-error");
+      return;
+    }
+
+  recorded = g_new0 (BroadcastInput, 1);
+  recorded->command = g_strdup (command);
+  if (data)
+    recorded->data = g_bytes_ref (data);
+  g_queue_push_tail (&ac->input, recorded);
+}
+
 static gboolean
 process_and_relay_close (CockpitWebService *self,
                          CockpitSocket *socket,
@@ -554,8 +1662,16 @@ process_and_relay_close (CockpitWebService *self,
                          GBytes *payload)
 {
   CockpitSession *session;
+  AggregateChannel *ac;
   gboolean valid;
 
+  ac = g_hash_table_lookup (self->aggregates, channel);
+  if (ac)
+    {
+      process_aggregate_close (self, socket, ac, NULL);
+      return TRUE;
+    }
+
   session = cockpit_session_by_channel (&self->sessions, channel);
   valid = process_close (self, socket, session, channel);
   if (valid && session && !session->sent_done)
@@ -565,71 +1681,291 @@ process_and_relay_close (CockpitWebService *self,
 }
 
 static gboolean
-process_kill (CockpitWebService *self,
-              CockpitSocket *socket,
-              JsonObject *options)
+process_kill (CockpitWebService *self,
+              CockpitSocket *socket,
+              JsonObject *options)
+{
+  CockpitSession *session;
+  GHashTableIter iter;
+  gpointer channel;
+  const gchar *host;
+  const gchar *group;
+  WebSocketPriority priority;
+  CockpitGroup *cg;
+  GHashTable *kills = NULL;
+  JsonObject *object;
+  JsonArray *array;
+  GBytes *payload;
+  GList *list, *l;
+
+  if (!cockpit_json_get_string (options, "host", NULL, &host) ||
+      !cockpit_json_get_string (options, "group", NULL, &group))
+    {
+      g_warning ("%s: received invalid kill command", socket->id);
+      return FALSE;
+    }
+
+  list = NULL;
+  g_hash_table_iter_init (&iter, socket->channels);
+  while (g_hash_table_iter_next (&iter, &channel, NULL))
+    {
+      if (host)
+        {
+          session = cockpit_session_by_channel (&self->sessions, channel);
+          if (!session || !g_str_equal (host, session->host))
+            continue;
+        }
+      if (group)
+        {
+          cg = cockpit_groups_lookup_by_channel (&self->groups, channel);
+          if (!cg || !g_str_equal (cg->name, group))
+            continue;
+        }
+
+      list = g_list_prepend (list, g_strdup (channel));
+    }
+
+  for (l = list; l != NULL; l = g_list_next (l))
+    {
+      channel = l->data;
+
+      g_debug ("%s killing channel: %s", socket->id, (gchar *)channel);
+
+      /* Send a close message to both parties */
+      payload = cockpit_transport_build_control ("command", "close",
+                                                 "channel", (gchar *)channel,
+                                                 "problem", "terminated",
+                                                 NULL);
+      priority = cockpit_socket_priority (socket, channel);
+
+      session = NULL;
+      if (!g_hash_table_lookup (self->aggregates, channel))
+        session = cockpit_session_by_channel (&self->sessions, channel);
+
+      /* A bridge that can is told about all its channels at once, below */
+      if (session && session->can_kill && !session->sent_done)
+        {
+          if (!kills)
+            kills = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+                                           (GDestroyNotify)json_array_unref);
+          array = g_hash_table_lookup (kills, session);
+          if (!array)
+            {
+              array = json_array_new ();
+              g_hash_table_insert (kills, session, array);
+            }
+          json_array_add_string_element (array, channel);
+          process_close (self, socket, session, channel);
+        }
+      else
+        {
+          g_warn_if_fail (process_and_relay_close (self, socket, channel, payload));
+        }
+
+      if (cockpit_socket_is_open (socket))
+        {
+              cockpit_socket_relay (socket,
+                                    WEB_SOCKET_DATA_TEXT,
+                                    self->control_prefix,
+                                    payload,
+                                    priority);
+        }
+
+      g_bytes_unref (payload);
+
+      g_free (channel);
+    }
+
+  g_list_free (list);
+
+  if (kills)
+    {
+      g_hash_table_iter_init (&iter, kills);
+      while (g_hash_table_iter_next (&iter, (gpointer *)&session, (gpointer *)&array))
+        {
+          object = json_object_new ();
+          json_object_set_string_member (object, "command", "kill");
+          json_object_set_array_member (object, "channels", json_array_ref (array));
+          json_object_set_string_member (object, "problem", "terminated");
+          payload = cockpit_json_write_bytes (object);
+          json_object_unref (object);
+
+          g_debug ("%s: killing %u channels", session->host, json_array_get_length (array));
+          cockpit_transport_send (session->transport, NULL, payload);
+          g_bytes_unref (payload);
+        }
+      g_hash_table_destroy (kills);
+    }
+
+  return TRUE;
+}
+
+/*
+ * Answering a crypt1 challenge takes two rounds of crypt(), which with
+ * the usual password hashes is slow enough to hold up everything else
+ * on the main loop. So it's done in a thread, and the reply is sent from
+ * the main loop. The inner round only depends on the password and its
+ * salt, so it's kept in the session for a while, and further challenges,
+ * such as each time a superuser bridge starts, only need the outer round.
+ * The nonce is new for each challenge, so each still needs an answer.
+ */
+
+typedef struct {
+  CockpitWebService *service;
+  CockpitTransport *transport;
+  GMainContext *main_context;
+  gchar *host;
+  gchar *cookie;
+  gchar *challenge;
+  gchar *password;
+  char *salt;
+  char *secret;
+  gboolean cached;
+  char *response;
+  int rc;
+} Authorize;
+
+static void
+authorize_free (Authorize *auth)
+{
+  g_object_unref (auth->service);
+  g_object_unref (auth->transport);
+  g_main_context_unref (auth->main_context);
+  g_free (auth->host);
+  g_free (auth->cookie);
+  g_free (auth->challenge);
+  if (auth->password)
+    cockpit_secclear (auth->password, -1);
+  g_free (auth->password);
+  free (auth->salt);
+  if (auth->secret)
+    cockpit_secclear (auth->secret, -1);
+  free (auth->secret);
+  free (auth->response);
+  g_slice_free (Authorize, auth);
+}
+
+static void
+send_authorize_reply (CockpitSession *session,
+                      const gchar *cookie,
+                      const gchar *response)
+{
+  GBytes *payload;
+
+  if (session->sent_done)
+    return;
+
+  payload = cockpit_transport_build_control ("command", "authorize",
+                                             "cookie", cookie,
+                                             "response", response ? response : "",
+                                             NULL);
+  cockpit_transport_send (session->transport, NULL, payload);
+  g_bytes_unref (payload);
+}
+
+static void
+forget_authorize (CockpitSession *session)
+{
+  if (session->authorize_secret)
+    cockpit_secclear (session->authorize_secret, -1);
+  free (session->authorize_secret);
+  free (session->authorize_salt);
+  session->authorize_secret = NULL;
+  session->authorize_salt = NULL;
+  session->authorize_expires = 0;
+}
+
+static gboolean
+on_authorize_done (gpointer data)
 {
+  Authorize *auth = data;
   CockpitSession *session;
-  GHashTableIter iter;
-  gpointer channel;
-  const gchar *host;
-  const gchar *group;
-  GBytes *payload;
-  GList *list, *l;
 
-  if (!cockpit_json_get_string (options, "host", NULL, &host) ||
-      !cockpit_json_get_string (options, "group", NULL, &group))
-    {
-      g_warning ("%s: received invalid kill command", socket->id);
-      return FALSE;
-    }
+  if (auth->rc < 0)
+    g_warning ("%s: failed to reauthorize crypt1 challenge", auth->host);
 
-  list = NULL;
-  g_hash_table_iter_init (&iter, socket->channels);
-  while (g_hash_table_iter_next (&iter, &channel, NULL))
+  /* The session may have gone away while in the thread */
+  session = cockpit_session_by_transport (&auth->service->sessions, auth->transport);
+  if (session)
     {
-      if (host)
-        {
-          session = cockpit_session_by_channel (&self->sessions, channel);
-          if (!session || !g_str_equal (host, session->host))
-            continue;
-        }
-      if (group)
+      if (auth->rc == 0 && !auth->cached && cockpit_ws_authorize_cache_timeout > 0)
         {
-          if (g_strcmp0 (g_hash_table_lookup (self->channel_groups, channel), group) != 0)
-            continue;
+          forget_authorize (session);
+          session->authorize_salt = auth->salt;
+          session->authorize_secret = auth->secret;
+          session->authorize_expires = g_get_monotonic_time () +
+              (gint64)cockpit_ws_authorize_cache_timeout * G_USEC_PER_SEC;
+          auth->salt = auth->secret = NULL;
         }
-
-      list = g_list_prepend (list, g_strdup (channel));
+      send_authorize_reply (session, auth->cookie, auth->response);
     }
 
-  for (l = list; l != NULL; l = g_list_next (l))
-    {
-      channel = l->data;
+  authorize_free (auth);
+  return FALSE;
+}
 
-      g_debug ("%s killing channel: %s", socket->id, (gchar *)channel);
+static void
+authorize_thread (gpointer data,
+                  gpointer unused)
+{
+  Authorize *auth = data;
+  GSource *source;
+
+  auth->rc = 0;
+  if (!auth->secret)
+    auth->rc = reauthorize_crypt1_secret (auth->challenge, auth->password, &auth->secret);
+  if (auth->rc == 0)
+    auth->rc = reauthorize_crypt1_respond (auth->challenge, auth->secret, &auth->response);
+
+  source = g_idle_source_new ();
+  g_source_set_priority (source, G_PRIORITY_DEFAULT);
+  g_source_set_callback (source, on_authorize_done, auth, NULL);
+  g_source_attach (source, auth->main_context);
+  g_source_unref (source);
+}
 
-      /* Send a close message to both parties */
-      payload = cockpit_transport_build_control ("command", "close",
-                                                 "channel", (gchar *)channel,
-                                                 "problem", "terminated",
-                                                 NULL);
-      g_warn_if_fail (process_and_relay_close (self, socket, channel, payload));
-      if (web_socket_connection_get_ready_state (socket->connection) == WEB_SOCKET_STATE_OPEN)
-        {
-              web_socket_connection_send (socket->connection,
-                                          WEB_SOCKET_DATA_TEXT,
-                                          self->control_prefix,
-                                          payload);
-        }
+static void
+start_authorize (CockpitWebService *self,
+                 CockpitSession *session,
+                 const gchar *cookie,
+                 const gchar *challenge,
+                 const gchar *password)
+{
+  static GThreadPool *pool = NULL;
+  Authorize *auth;
 
-      g_bytes_unref (payload);
+  auth = g_slice_new0 (Authorize);
+  auth->service = g_object_ref (self);
+  auth->transport = g_object_ref (session->transport);
+  auth->main_context = g_main_context_ref_thread_default ();
+  auth->host = g_strdup (session->host);
+  auth->cookie = g_strdup (cookie);
+  auth->challenge = g_strdup (challenge);
 
-      g_free (channel);
+  if (reauthorize_crypt1_salt (challenge, &auth->salt) < 0)
+    {
+      g_warning ("%s: failed to reauthorize crypt1 challenge", session->host);
+      send_authorize_reply (session, cookie, NULL);
+      authorize_free (auth);
+      return;
     }
 
-  g_list_free (list);
-  return TRUE;
+  if (session->authorize_expires <= g_get_monotonic_time () ||
+      g_strcmp0 (session->authorize_salt, auth->salt) != 0)
+    forget_authorize (session);
+
+  if (session->authorize_secret)
+    {
+      g_debug ("%s: answering crypt1 challenge with the recent secret", session->host);
+      auth->secret = strdup (session->authorize_secret);
+      auth->cached = TRUE;
+    }
+  if (!auth->secret)
+    auth->password = g_strdup (password);
+
+  if (!pool)
+    pool = g_thread_pool_new (authorize_thread, NULL, 2, FALSE, NULL);
+  g_thread_pool_push (pool, auth, NULL);
 }
 
 static gboolean
@@ -638,15 +1974,12 @@ process_authorize (CockpitWebService *self,
                    JsonObject *options)
 {
   const gchar *cookie = NULL;
-  GBytes *payload;
   const gchar *host;
   char *user = NULL;
   char *type = NULL;
-  char *response = NULL;
   const gchar *challenge;
   const gchar *password;
   gboolean ret = FALSE;
-  int rc;
 
   host = session->host;
 
@@ -660,6 +1993,8 @@ process_authorize (CockpitWebService *self,
       goto out;
     }
 
+  ret = TRUE;
+
   if (!g_str_equal (cockpit_creds_get_user (session->creds), user))
     {
       g_warning ("%s: received authorize command for wrong user: %s", host, user);
@@ -673,9 +2008,9 @@ process_authorize (CockpitWebService *self,
         }
       else
         {
-          rc = reauthorize_crypt1 (challenge, password, &response);
-          if (rc < 0)
-            g_warning ("%s: failed to reauthorize crypt1 challenge", host);
+          /* Replies once done */
+          start_authorize (self, session, cookie, challenge, password);
+          goto out;
         }
     }
 
@@ -687,21 +2022,11 @@ process_authorize (CockpitWebService *self,
    * user has it open, he/she is authorized.
    */
 
-  if (!session->sent_done)
-    {
-      payload = cockpit_transport_build_control ("command", "authorize",
-                                                 "cookie", cookie,
-                                                 "response", response ? response : "",
-                                                 NULL);
-      cockpit_transport_send (session->transport, NULL, payload);
-      g_bytes_unref (payload);
-    }
-  ret = TRUE;
+  send_authorize_reply (session, cookie, NULL);
 
 out:
   free (user);
   free (type);
-  free (response);
   return ret;
 }
 
@@ -711,7 +2036,9 @@ process_session_init (CockpitWebService *self,
                       JsonObject *options)
 {
   const gchar *checksum;
+  gchar **capabilities;
   gint64 version;
+  gint i;
 
   if (!cockpit_json_get_int (options, "version", -1, &version))
     {
@@ -723,6 +2050,7 @@ process_session_init (CockpitWebService *self,
     {
       g_debug ("%s: received init message", session->host);
       session->init_received = TRUE;
+      cockpit_pipe_transport_negotiate (session->transport, options);
     }
   else
     {
@@ -734,12 +2062,50 @@ process_session_init (CockpitWebService *self,
   if (!cockpit_json_get_string (options, "checksum", NULL, &checksum))
     checksum = NULL;
 
-  g_free (session->checksum);
-  session->checksum = g_strdup (checksum);
+  cockpit_session_set_checksum (&self->sessions, session, checksum);
+
+  /* Older bridges don't know the "kill" command, or acknowledging payload */
+  if (cockpit_json_get_strv (options, "capabilities", NULL, &capabilities) && capabilities)
+    {
+      for (i = 0; capabilities[i] != NULL; i++)
+        {
+          if (g_str_equal (capabilities[i], "kill"))
+            session->can_kill = TRUE;
+          else if (g_str_equal (capabilities[i], "send-acks"))
+            session->can_ack = TRUE;
+        }
+      g_free (capabilities);
+    }
 
   return NULL;
 }
 
+/*
+ * The bridge answers a "trace" command with its events, and the
+ * events of cockpit-ws and the SSH connection are added on the way.
+ */
+static GBytes *
+build_trace_reply (CockpitWebService *self,
+                   const gchar *channel,
+                   JsonObject *options)
+{
+  CockpitTrace *trace;
+  JsonArray *events;
+
+  trace = g_hash_table_lookup (self->traces, channel);
+  if (!trace)
+    return NULL;
+
+  if (!cockpit_json_get_array (options, "events", NULL, &events) || !events)
+    {
+      events = json_array_new ();
+      json_object_set_array_member (options, "events", events);
+    }
+
+  cockpit_trace_take (trace, events);
+  return cockpit_json_write_bytes (options);
+}
+
 static gboolean
 on_session_control (CockpitTransport *transport,
                     const gchar *command,
@@ -752,8 +2118,11 @@ on_session_control (CockpitTransport *transport,
   CockpitWebService *self = user_data;
   CockpitSession *session = NULL;
   CockpitSocket *socket = NULL;
+  WebSocketPriority priority = WEB_SOCKET_PRIORITY_CONTROL;
+  GBytes *traced = NULL;
   gboolean valid = FALSE;
   gboolean forward;
+  guint host;
 
   if (!channel)
     {
@@ -781,6 +2150,12 @@ on_session_control (CockpitTransport *transport,
         {
           valid = TRUE;
         }
+      else if (g_strcmp0 (command, "killed") == 0)
+        {
+          /* The channels were forgotten when the "kill" was sent */
+          g_debug ("%s: killed channels", session->host);
+          valid = TRUE;
+        }
       else
         {
           g_debug ("received a %s unknown control command", command);
@@ -790,6 +2165,8 @@ on_session_control (CockpitTransport *transport,
   else
     {
       socket = cockpit_socket_lookup_by_channel (&self->sockets, channel);
+      if (socket)
+        priority = cockpit_socket_priority (socket, channel);
 
       /* Usually all control messages with a channel are forwarded */
       forward = TRUE;
@@ -812,6 +2189,12 @@ on_session_control (CockpitTransport *transport,
           g_warning ("received a command with wrong channel %s from session", channel);
           valid = FALSE;
         }
+      else if (lookup_aggregate_sub (self, channel, &host))
+        {
+          /* The aggregate speaks for its hosts */
+          valid = process_aggregate_sub_control (self, session, command, channel, options);
+          forward = FALSE;
+        }
       else if (g_strcmp0 (command, "close") == 0)
         {
           valid = process_close (self, socket, session, channel);
@@ -824,10 +2207,14 @@ on_session_control (CockpitTransport *transport,
       if (forward)
         {
           /* Forward this message to the right websocket */
-          if (socket && web_socket_connection_get_ready_state (socket->connection) == WEB_SOCKET_STATE_OPEN)
+          if (socket && cockpit_socket_is_open (socket))
             {
-              web_socket_connection_send (socket->connection, WEB_SOCKET_DATA_TEXT,
-                                          self->control_prefix, payload);
+              if (valid && g_strcmp0 (command, "trace") == 0)
+                traced = build_trace_reply (self, channel, options);
+              cockpit_socket_relay (socket, WEB_SOCKET_DATA_TEXT,
+                                    self->control_prefix, traced ? traced : payload, priority);
+              if (traced)
+                g_bytes_unref (traced);
             }
         }
     }
@@ -840,6 +2227,82 @@ on_session_control (CockpitTransport *transport,
   return TRUE; /* handled */
 }
 
+/*
+ * Channels are opened with a "window", and the bridge waits for these
+ * before sending more than that. Acknowledging as messages are passed
+ * on means a channel can't get further ahead than the window. If the
+ * web socket itself backs up, the session isn't read, and so nothing
+ * is acknowledged either.
+ */
+static void
+acknowledge_payload (CockpitSession *session,
+                     CockpitGroup *group,
+                     const gchar *channel,
+                     GBytes *payload)
+{
+  gsize *unacked;
+
+  unacked = g_hash_table_lookup (session->unacked, channel);
+  if (!unacked)
+    return;
+
+  *unacked += g_bytes_get_size (payload);
+  if (*unacked < cockpit_ws_channel_window / 2)
+    return;
+
+  /* Until the group has drained enough */
+  if (group && cockpit_group_hold_ack (group, channel))
+    return;
+
+  cockpit_session_send_ack (session, channel);
+}
+
+/* Stop reading from the session while the browser catches up */
+static void
+throttle_session (CockpitSocket *socket,
+                  CockpitSession *session)
+{
+  if (web_socket_connection_get_buffered_amount (socket->connection) > cockpit_ws_pressure_high &&
+      !g_hash_table_lookup (socket->throttled, session->transport))
+    {
+      g_debug ("%s: throttling session %s", socket->id, session->host);
+      g_hash_table_add (socket->throttled, g_object_ref (session->transport));
+      if (session->pressure_holders++ == 0)
+        cockpit_transport_pressure (session->transport, TRUE);
+    }
+}
+
+static gboolean
+relay_aggregate_payload (CockpitWebService *self,
+                         CockpitSession *session,
+                         AggregateChannel *ac,
+                         guint host,
+                         GBytes *payload)
+{
+  CockpitSocket *socket;
+  GBytes *message;
+
+  if (ac->broadcast)
+    cockpit_broadcast_recv (ac->broadcast, host, payload);
+  else if (!cockpit_metrics_aggregate_recv (ac->aggregate, host, payload))
+    {
+      /* Only that host's part of the aggregate goes away */
+      message = cockpit_transport_build_control ("command", "close",
+                                                 "channel", ac->subs[host],
+                                                 "problem", "protocol-error",
+                                                 NULL);
+      cockpit_transport_send (session->transport, NULL, message);
+      g_bytes_unref (message);
+      process_aggregate_sub_close (self, session, ac, host, "protocol-error", NULL);
+      return TRUE;
+    }
+
+  socket = cockpit_socket_lookup_by_channel (&self->sockets, ac->channel);
+  if (socket)
+    throttle_session (socket, session);
+  return TRUE;
+}
+
 static gboolean
 on_session_recv (CockpitTransport *transport,
                  const gchar *channel,
@@ -848,10 +2311,13 @@ on_session_recv (CockpitTransport *transport,
 {
   CockpitWebService *self = user_data;
   WebSocketDataType data_type;
+  WebSocketPriority priority;
   CockpitSession *session;
   CockpitSocket *socket;
-  gchar *string;
+  CockpitGroup *group;
+  AggregateChannel *ac;
   GBytes *prefix;
+  guint host;
 
   if (!channel)
     return FALSE;
@@ -870,15 +2336,30 @@ on_session_recv (CockpitTransport *transport,
       return FALSE;
     }
 
+  group = cockpit_groups_lookup_by_channel (&self->groups, channel);
+  if (group)
+    cockpit_stats_add (group->stats, COCKPIT_STAT_GROUP_BYTES_OUT, g_bytes_get_size (payload));
+
+  acknowledge_payload (session, group, channel, payload);
+  cockpit_session_count_rate (session, g_bytes_get_size (payload));
+
+  ac = lookup_aggregate_sub (self, channel, &host);
+  if (ac)
+    return relay_aggregate_payload (self, session, ac, host, payload);
+
   /* Forward the message to the right socket */
   socket = cockpit_socket_lookup_by_channel (&self->sockets, channel);
-  if (socket && web_socket_connection_get_ready_state (socket->connection) == WEB_SOCKET_STATE_OPEN)
+  if (socket && cockpit_socket_is_open (socket))
     {
-      string = g_strdup_printf ("%s\n", channel);
-      prefix = g_bytes_new_take (string, strlen (string));
+      prefix = g_hash_table_lookup (socket->prefixes, channel);
+      g_return_val_if_fail (prefix != NULL, FALSE);
       data_type = GPOINTER_TO_INT (g_hash_table_lookup (socket->channels, channel));
-      web_socket_connection_send (socket->connection, data_type, prefix, payload);
-      g_bytes_unref (prefix);
+      priority = cockpit_socket_priority (socket, channel);
+      trace_mark (self, channel, "ws-sent");
+      cockpit_socket_relay (socket, data_type, prefix, payload, priority);
+      if (group)
+        cockpit_socket_queue_group (socket, group, g_bytes_get_size (prefix) + g_bytes_get_size (payload));
+      throttle_session (socket, session);
       return TRUE;
     }
 
@@ -900,6 +2381,9 @@ on_session_closed (CockpitTransport *transport,
   const gchar *fp = NULL;
   GBytes *payload;
   JsonObject *object = NULL;
+  AggregateChannel *ac;
+  GList *subs = NULL, *l;
+  guint host;
 
   GHashTableIter auth_iter;
   GHashTable *auth_method_results = NULL; // owned by ssh transport
@@ -939,10 +2423,16 @@ on_session_closed (CockpitTransport *transport,
       g_hash_table_iter_init (&iter, session->channels);
       while (!primary && g_hash_table_iter_next (&iter, (gpointer *)&channel, NULL))
         {
+          if (lookup_aggregate_sub (self, channel, &host))
+            {
+              subs = g_list_prepend (subs, g_strdup (channel));
+              continue;
+            }
+
           socket = cockpit_socket_lookup_by_channel (&self->sockets, channel);
           if (socket)
             {
-              if (web_socket_connection_get_ready_state (socket->connection) == WEB_SOCKET_STATE_OPEN)
+              if (cockpit_socket_is_open (socket))
                 {
                   object = cockpit_transport_build_json ("command", "close",
                                                          "channel", channel,
@@ -962,13 +2452,24 @@ on_session_closed (CockpitTransport *transport,
 
                   payload = cockpit_json_write_bytes (object);
                   json_object_unref (object);
-                  web_socket_connection_send (socket->connection, WEB_SOCKET_DATA_TEXT,
-                                              self->control_prefix, payload);
+                  cockpit_socket_relay (socket, WEB_SOCKET_DATA_TEXT,
+                                        self->control_prefix, payload,
+                                        cockpit_socket_priority (socket, channel));
                   g_bytes_unref (payload);
                 }
             }
         }
 
+      /* Closing one of these can close others in the same aggregate */
+      session->sent_done = TRUE;
+      for (l = subs; l != NULL; l = g_list_next (l))
+        {
+          ac = lookup_aggregate_sub (self, l->data, &host);
+          if (ac)
+            process_aggregate_sub_close (self, NULL, ac, host, problem, NULL);
+        }
+      g_list_free_full (subs, g_free);
+
       cockpit_session_destroy (&self->sessions, session);
 
       if (auth_json)
@@ -1057,6 +2558,7 @@ lookup_or_open_session (CockpitWebService *self,
   CockpitCreds *creds = NULL;
   gchar *hostname = NULL;
   gchar *username = NULL;
+  gchar *target = NULL;
   gint port;
 
   const gchar *host_key = NULL;
@@ -1118,6 +2620,21 @@ lookup_or_open_session (CockpitWebService *self,
       else if (username && password != NULL)
         new_creds = TRUE;
 
+      /*
+       * The same host may be spelled differently, for example with
+       * the logged in user or the default port. Those share a session.
+       */
+      if (!private && !new_creds)
+        {
+          target = g_strdup_printf ("%s@%s:%d", creds_user, hostname, port);
+          session = cockpit_session_by_target (&self->sessions, target);
+          if (session)
+            g_debug ("%s: sharing session with %s", host, session->host);
+        }
+    }
+
+  if (!session)
+    {
       if (new_creds)
         {
           creds = cockpit_creds_new (specific_user != NULL ? specific_user : username,
@@ -1162,9 +2679,10 @@ lookup_or_open_session (CockpitWebService *self,
                                 "known-hosts", cockpit_ws_known_hosts,
                                 "host-key", host_key,
                                 "agent", agent,
+                                "io-thread", cockpit_conf_bool ("WebService", "SshThreads", FALSE),
                                 NULL);
 
-      session = cockpit_session_track (&self->sessions, host, private, creds, transport);
+      session = cockpit_session_track (&self->sessions, host, private, target, creds, transport);
       session->control_sig = g_signal_connect_after (transport, "control", G_CALLBACK (on_session_control), self);
       session->recv_sig = g_signal_connect_after (transport, "recv", G_CALLBACK (on_session_recv), self);
       session->closed_sig = g_signal_connect_after (transport, "closed", G_CALLBACK (on_session_closed), self);
@@ -1174,10 +2692,12 @@ lookup_or_open_session (CockpitWebService *self,
         g_object_unref (agent);
 
       cockpit_creds_unref (creds);
-      g_free (hostname);
-      g_free (username);
     }
 
+  g_free (target);
+  g_free (hostname);
+  g_free (username);
+
   json_object_remove_member (options, "host");
   json_object_remove_member (options, "user");
   json_object_remove_member (options, "password");
@@ -1187,6 +2707,33 @@ lookup_or_open_session (CockpitWebService *self,
   return session;
 }
 
+static void
+preconnect_sessions (CockpitWebService *self)
+{
+  CockpitSession *session;
+  const gchar **hosts;
+  JsonObject *options;
+  guint count = 0;
+  gint i;
+
+  hosts = cockpit_conf_strv ("WebService", "Preconnect", ' ');
+  for (i = 0; hosts && hosts[i] != NULL && count < cockpit_ws_max_preconnect; i++)
+    {
+      if (hosts[i][0] == '\0' || cockpit_session_by_host (&self->sessions, hosts[i]))
+        continue;
+
+      options = json_object_new ();
+      json_object_set_string_member (options, "host", hosts[i]);
+      session = lookup_or_open_session (self, options);
+      json_object_unref (options);
+
+      /* Close it again if no channel shows up in time */
+      g_debug ("%s: preconnected session", session->host);
+      cockpit_session_mark_idle (session);
+      count++;
+    }
+}
+
 gboolean
 cockpit_web_service_parse_binary (JsonObject *options,
                                   WebSocketDataType *data_type)
@@ -1206,6 +2753,28 @@ cockpit_web_service_parse_binary (JsonObject *options,
   return TRUE;
 }
 
+static gboolean
+parse_priority (JsonObject *options,
+                WebSocketPriority *priority)
+{
+  const gchar *value;
+
+  if (!cockpit_json_get_string (options, "priority", NULL, &value))
+    value = "";
+
+  if (value == NULL || g_str_equal (value, "interactive"))
+    *priority = WEB_SOCKET_PRIORITY_INTERACTIVE;
+  else if (g_str_equal (value, "bulk"))
+    *priority = WEB_SOCKET_PRIORITY_BULK;
+  else
+    {
+      g_warning ("invalid \"priority\" option");
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
 gboolean
 cockpit_web_service_parse_external (JsonObject *options,
                                     const gchar **content_type,
@@ -1216,63 +2785,221 @@ cockpit_web_service_parse_external (JsonObject *options,
   const gchar *value;
   JsonNode *node;
 
-  g_return_val_if_fail (options != NULL, FALSE);
+  g_return_val_if_fail (options != NULL, FALSE);
+
+  if (!cockpit_json_get_string (options, "channel", NULL, &value) || value != NULL)
+    {
+      g_message ("don't specify \"channel\" on external channel");
+      return FALSE;
+    }
+  if (!cockpit_json_get_string (options, "command", NULL, &value) || value != NULL)
+    {
+      g_message ("don't specify \"command\" on external channel");
+      return FALSE;
+    }
+
+  node = json_object_get_member (options, "external");
+  if (node == NULL)
+    {
+      if (content_disposition)
+        *content_disposition = NULL;
+      if (content_type)
+        *content_type = NULL;
+      if (protocols)
+        *protocols = NULL;
+      return TRUE;
+    }
+
+  if (!JSON_NODE_HOLDS_OBJECT (node))
+    {
+      g_message ("invalid \"external\" option");
+      return FALSE;
+    }
+
+  external = json_node_get_object (node);
+
+  if (!cockpit_json_get_string (external, "content-disposition", NULL, &value) ||
+      (value && !cockpit_web_response_is_header_value (value)))
+    {
+      g_message ("invalid \"content-disposition\" external option");
+      return FALSE;
+    }
+  if (content_disposition)
+    *content_disposition = value;
+
+  if (!cockpit_json_get_string (external, "content-type", NULL, &value) ||
+      (value && !cockpit_web_response_is_header_value (value)))
+    {
+      g_message ("invalid \"content-type\" external option");
+      return FALSE;
+    }
+  if (content_type)
+    *content_type = value;
+
+  if (!cockpit_json_get_strv (external, "protocols", NULL, protocols))
+    {
+      g_message ("invalid \"protocols\" external option");
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static JsonObject *
+copy_open_options (JsonObject *options)
+{
+  JsonObject *open;
+  GList *members, *l;
+
+  /* Each host gets the same options, but only one host */
+  open = json_object_new ();
+  members = json_object_get_members (options);
+  for (l = members; l != NULL; l = g_list_next (l))
+    {
+      if (!g_str_equal (l->data, "hosts") && !g_str_equal (l->data, "concurrency") &&
+          !g_str_equal (l->data, "channel") && !g_str_equal (l->data, "host"))
+        json_object_set_member (open, l->data, json_node_copy (json_object_get_member (options, l->data)));
+    }
+  g_list_free (members);
+
+  return open;
+}
+
+static void
+open_aggregate_sub (CockpitWebService *self,
+                    AggregateChannel *ac,
+                    guint host)
+{
+  CockpitSession *session;
+  const gchar *type;
+  JsonObject *open;
+  GBytes *payload;
+  GList *l;
+
+  g_return_if_fail (ac->subs[host] == NULL);
+
+  ac->subs[host] = cockpit_web_service_unique_channel (self);
+  g_hash_table_insert (self->aggregate_subs, ac->subs[host], ac);
+
+  open = copy_open_options (ac->open);
+  json_object_set_string_member (open, "channel", ac->subs[host]);
+  json_object_set_string_member (open, "host", ac->hosts[host]);
+
+  if (!cockpit_json_get_string (open, "payload", NULL, &type))
+    type = NULL;
+
+  session = lookup_or_open_session (self, open);
+  cockpit_session_add_channel (&self->sessions, session, ac->subs[host], type);
+
+  if (!session->sent_done)
+    {
+      if (cockpit_ws_channel_window > 0)
+        json_object_set_int_member (open, "window", cockpit_ws_channel_window);
+      payload = cockpit_json_write_bytes (open);
+      cockpit_transport_send (session->transport, NULL, payload);
+      g_bytes_unref (payload);
+
+      /* A broadcast host that opens late catches up on the input */
+      for (l = ac->input.head; l != NULL; l = g_list_next (l))
+        send_aggregate_input (self, ac->subs[host], l->data);
+    }
+
+  json_object_unref (open);
+}
+
+static AggregateChannel *
+aggregate_channel_new (CockpitWebService *self,
+                       const gchar *channel,
+                       JsonObject *options,
+                       gchar **hosts)
+{
+  AggregateChannel *ac;
+
+  ac = g_new0 (AggregateChannel, 1);
+  ac->service = self;
+  ac->channel = g_strdup (channel);
+  ac->open = copy_open_options (options);
+  ac->hosts = g_strdupv (hosts);
+  ac->n_subs = g_strv_length (hosts);
+  ac->subs = g_new0 (gchar *, ac->n_subs);
+  g_queue_init (&ac->input);
+  g_hash_table_insert (self->aggregates, ac->channel, ac);
+
+  return ac;
+}
 
-  if (!cockpit_json_get_string (options, "channel", NULL, &value) || value != NULL)
+static gboolean
+process_aggregate_open (CockpitWebService *self,
+                        const gchar *channel,
+                        JsonObject *options)
+{
+  AggregateChannel *ac;
+  const gchar *format;
+  gchar **hosts;
+  guint i;
+
+  if (!cockpit_json_get_strv (options, "hosts", NULL, &hosts) || !hosts || !hosts[0])
     {
-      g_message ("don't specify \"channel\" on external channel");
+      g_warning ("received metrics1 open command with invalid hosts");
+      g_free (hosts);
       return FALSE;
     }
-  if (!cockpit_json_get_string (options, "command", NULL, &value) || value != NULL)
+  if (!cockpit_json_get_string (options, "format", NULL, &format) ||
+      g_strcmp0 (format, "binary") == 0)
     {
-      g_message ("don't specify \"command\" on external channel");
+      g_warning ("metrics1 channels with hosts only support the json format");
+      g_free (hosts);
       return FALSE;
     }
 
-  node = json_object_get_member (options, "external");
-  if (node == NULL)
-    {
-      if (content_disposition)
-        *content_disposition = NULL;
-      if (content_type)
-        *content_type = NULL;
-      if (protocols)
-        *protocols = NULL;
-      return TRUE;
-    }
+  ac = aggregate_channel_new (self, channel, options, hosts);
+  ac->aggregate = cockpit_metrics_aggregate_new (channel, (const gchar **)hosts, send_aggregate, ac);
 
-  if (!JSON_NODE_HOLDS_OBJECT (node))
-    {
-      g_message ("invalid \"external\" option");
-      return FALSE;
-    }
+  for (i = 0; i < ac->n_subs; i++)
+    open_aggregate_sub (self, ac, i);
 
-  external = json_node_get_object (node);
+  g_free (hosts);
+  return TRUE;
+}
 
-  if (!cockpit_json_get_string (external, "content-disposition", NULL, &value) ||
-      (value && !cockpit_web_response_is_header_value (value)))
+static gboolean
+process_broadcast_open (CockpitWebService *self,
+                        const gchar *channel,
+                        JsonObject *options,
+                        WebSocketDataType data_type)
+{
+  AggregateChannel *ac;
+  gint64 concurrency;
+  gchar **hosts;
+  gint next;
+
+  if (!cockpit_json_get_strv (options, "hosts", NULL, &hosts) || !hosts || !hosts[0])
     {
-      g_message ("invalid \"content-disposition\" external option");
+      g_warning ("received open command with invalid hosts");
+      g_free (hosts);
       return FALSE;
     }
-  if (content_disposition)
-    *content_disposition = value;
-
-  if (!cockpit_json_get_string (external, "content-type", NULL, &value) ||
-      (value && !cockpit_web_response_is_header_value (value)))
+  if (!cockpit_json_get_int (options, "concurrency", BROADCAST_CONCURRENCY, &concurrency) ||
+      concurrency < 1 || concurrency > BROADCAST_MAX_CONCURRENCY)
     {
-      g_message ("invalid \"content-type\" external option");
+      g_warning ("received open command with invalid concurrency");
+      g_free (hosts);
       return FALSE;
     }
-  if (content_type)
-    *content_type = value;
-
-  if (!cockpit_json_get_strv (external, "protocols", NULL, protocols))
+  if (data_type != WEB_SOCKET_DATA_TEXT)
     {
-      g_message ("invalid \"protocols\" external option");
+      g_warning ("channels with hosts can't be binary");
+      g_free (hosts);
       return FALSE;
     }
 
+  ac = aggregate_channel_new (self, channel, options, hosts);
+  ac->broadcast = cockpit_broadcast_new (channel, (const gchar **)hosts, concurrency, send_aggregate, ac);
+
+  while ((next = cockpit_broadcast_next (ac->broadcast)) >= 0)
+    open_aggregate_sub (self, ac, next);
+
+  g_free (hosts);
   return TRUE;
 }
 
@@ -1283,8 +3010,12 @@ process_and_relay_open (CockpitWebService *self,
                         JsonObject *options)
 {
   WebSocketDataType data_type = WEB_SOCKET_DATA_TEXT;
+  WebSocketPriority priority = WEB_SOCKET_PRIORITY_INTERACTIVE;
   CockpitSession *session = NULL;
   const gchar *group;
+  CockpitTrace *trace;
+  const gchar *type;
+  gboolean traced;
   GBytes *payload;
 
   if (self->closing)
@@ -1293,7 +3024,8 @@ process_and_relay_open (CockpitWebService *self,
       return TRUE;
     }
 
-  if (cockpit_session_by_channel (&self->sessions, channel))
+  if (cockpit_session_by_channel (&self->sessions, channel) ||
+      g_hash_table_lookup (self->aggregates, channel))
     {
       g_warning ("cannot open a channel %s with the same id as another channel", channel);
       return FALSE;
@@ -1305,19 +3037,63 @@ process_and_relay_open (CockpitWebService *self,
       return FALSE;
     }
 
+  /* The bridge complains about a bad payload, this is only for the stats */
+  if (!cockpit_json_get_string (options, "payload", NULL, &type))
+    type = NULL;
+  if (!cockpit_json_get_bool (options, "trace", FALSE, &traced))
+    {
+      g_warning ("received open command with invalid trace option");
+      return FALSE;
+    }
+
   if (!cockpit_web_service_parse_binary (options, &data_type))
     return FALSE;
+  if (!parse_priority (options, &priority))
+    return FALSE;
+
+  /*
+   * Metrics of several hosts are combined here, rather than in the browser,
+   * and other channels with several hosts are broadcast to them.
+   */
+  if (json_object_has_member (options, "hosts"))
+    {
+      if (g_strcmp0 (type, "metrics1") == 0)
+        {
+          if (!process_aggregate_open (self, channel, options))
+            return FALSE;
+        }
+      else if (!process_broadcast_open (self, channel, options, data_type))
+        {
+          return FALSE;
+        }
+      if (socket)
+        cockpit_socket_add_channel (&self->sockets, socket, channel, data_type, priority);
+      if (group)
+        cockpit_groups_add_channel (&self->groups, channel, group);
+      return TRUE;
+    }
 
   session = lookup_or_open_session (self, options);
 
-  cockpit_session_add_channel (&self->sessions, session, channel);
+  cockpit_session_add_channel (&self->sessions, session, channel, type);
   if (socket)
-    cockpit_socket_add_channel (&self->sockets, socket, channel, data_type);
+    cockpit_socket_add_channel (&self->sockets, socket, channel, data_type, priority);
   if (group)
-    g_hash_table_insert (self->channel_groups, g_strdup (channel), g_strdup (group));
+    cockpit_groups_add_channel (&self->groups, channel, group);
+
+  if (traced)
+    {
+      trace = cockpit_trace_new ();
+      cockpit_trace_mark (trace, "ws-open");
+      if (COCKPIT_IS_SSH_TRANSPORT (session->transport))
+        cockpit_ssh_transport_trace (COCKPIT_SSH_TRANSPORT (session->transport), channel, trace);
+      g_hash_table_replace (self->traces, g_strdup (channel), trace);
+    }
 
   if (!session->sent_done)
     {
+      if (cockpit_ws_channel_window > 0)
+        json_object_set_int_member (options, "window", cockpit_ws_channel_window);
       payload = cockpit_json_write_bytes (options);
       cockpit_transport_send (session->transport, NULL, payload);
       g_bytes_unref (payload);
@@ -1358,11 +3134,102 @@ process_logout (CockpitWebService *self,
   return TRUE;
 }
 
+static const gchar *
+resume_socket (CockpitWebService *self,
+               CockpitSocket *socket,
+               const gchar *token,
+               JsonObject *options)
+{
+  WebSocketConnection *connection;
+  ReplayMessage *message;
+  CockpitSocket *old;
+  GBytes *payload;
+  gint64 received;
+  guint64 seq;
+  GList *l;
+
+  if (!cockpit_json_get_int (options, "received", -1, &received) || received < 0)
+    {
+      g_warning ("invalid received field in init message");
+      return "protocol-error";
+    }
+
+  old = g_hash_table_lookup (self->sockets.by_resume, token);
+  if (!old || old == socket)
+    {
+      g_debug ("no web socket to resume");
+      return "disconnected";
+    }
+
+  /* Only what's still in the replay buffer can be sent again */
+  seq = old->sent - old->replay.length;
+  if ((guint64)received > old->sent || (guint64)received < seq)
+    {
+      g_message ("%s: can't resume web socket, too many messages were missed", old->id);
+      return "disconnected";
+    }
+
+  g_debug ("%s resuming socket at %" G_GINT64_FORMAT " of %" G_GUINT64_FORMAT,
+           old->id, received, old->sent);
+
+  if (socket->resume)
+    {
+      g_hash_table_remove (self->sockets.by_resume, socket->resume);
+      g_free (socket->resume);
+      socket->resume = NULL;
+    }
+
+  if (old->resume_timeout)
+    {
+      cockpit_timer_wheel_remove (old->resume_timeout);
+      old->resume_timeout = 0;
+    }
+
+  old->closing = FALSE;
+  old->init_received = TRUE;
+  cockpit_sockets_swap (&self->sockets, old, socket);
+  connection = old->connection;
+
+  payload = cockpit_transport_build_control ("command", "resume",
+                                             "received", old->received,
+                                             NULL);
+  web_socket_connection_send_full (connection, WEB_SOCKET_DATA_TEXT, self->control_prefix,
+                                   payload, WEB_SOCKET_PRIORITY_CONTROL);
+  g_bytes_unref (payload);
+
+  /* Ahead of anything else that's sent from now on */
+  for (l = old->replay.head; l != NULL; l = g_list_next (l))
+    {
+      message = l->data;
+      if (++seq <= (guint64)received)
+        continue;
+      web_socket_connection_send_full (connection, message->data_type, message->prefix,
+                                       message->payload, WEB_SOCKET_PRIORITY_CONTROL);
+      cockpit_stats_add (NULL, COCKPIT_STAT_WS_BYTES_OUT,
+                         g_bytes_get_size (message->prefix) + g_bytes_get_size (message->payload));
+    }
+  cockpit_socket_update_queued (old);
+
+  /* The connection the socket had before is done with */
+  if (web_socket_connection_get_ready_state (socket->connection) == WEB_SOCKET_STATE_CLOSED)
+    {
+      cockpit_socket_destroy (&self->sockets, socket);
+      caller_end (self);
+    }
+  else if (web_socket_connection_get_ready_state (socket->connection) < WEB_SOCKET_STATE_CLOSING)
+    {
+      web_socket_connection_close (socket->connection, WEB_SOCKET_CLOSE_GOING_AWAY, "resumed");
+    }
+
+  return NULL;
+}
+
 static const gchar *
 process_socket_init (CockpitWebService *self,
                      CockpitSocket *socket,
                      JsonObject *options)
 {
+  const gchar *token;
   gint64 version;
 
   if (!cockpit_json_get_int (options, "version", -1, &version))
@@ -1371,7 +3238,17 @@ process_socket_init (CockpitWebService *self,
       return "protocol-error";
     }
 
-  if (version == 1)
+  if (!cockpit_json_get_string (options, "resume", NULL, &token))
+    {
+      g_warning ("invalid resume field in init message");
+      return "protocol-error";
+    }
+
+  if (version == 1 && token)
+    {
+      return resume_socket (self, socket, token, options);
+    }
+  else if (version == 1)
     {
       g_debug ("received web socket init message");
       socket->init_received = TRUE;
@@ -1398,12 +3275,63 @@ inbound_protocol_error (CockpitWebService *self,
   if (web_socket_connection_get_ready_state (connection) == WEB_SOCKET_STATE_OPEN)
     {
       payload = cockpit_transport_build_control ("command", "close", "problem", problem, NULL);
-      web_socket_connection_send (connection, WEB_SOCKET_DATA_TEXT, self->control_prefix, payload);
+      web_socket_connection_send_full (connection, WEB_SOCKET_DATA_TEXT, self->control_prefix,
+                                       payload, WEB_SOCKET_PRIORITY_CONTROL);
       g_bytes_unref (payload);
       web_socket_connection_close (connection, WEB_SOCKET_CLOSE_SERVER_ERROR, problem);
     }
 }
 
+/*
+ * Handles the inbound commands that are passed on to a session without
+ * looking at their options. Returns FALSE if @command isn't one of these.
+ */
+static gboolean
+relay_inbound_command (CockpitWebService *self,
+                       CockpitSocket *socket,
+                       const gchar *command,
+                       const gchar *channel,
+                       GBytes *payload,
+                       gboolean *valid)
+{
+  CockpitSession *session;
+  AggregateChannel *ac;
+
+  if (g_strcmp0 (command, "close") == 0)
+    {
+      if (channel == NULL)
+        {
+          g_warning ("got close command without a channel");
+          *valid = FALSE;
+        }
+      else
+        {
+          *valid = process_and_relay_close (self, socket, channel, payload);
+        }
+      return TRUE;
+    }
+
+  if (channel == NULL || g_strcmp0 (command, "open") == 0 ||
+      g_strcmp0 (command, "kill") == 0 || g_strcmp0 (command, "init") == 0 ||
+      g_strcmp0 (command, "logout") == 0)
+    return FALSE;
+
+  /* Relay anything with a channel by default */
+  session = cockpit_session_by_channel (&self->sessions, channel);
+  if (session)
+    {
+      if (!session->sent_done)
+        cockpit_transport_send (session->transport, NULL, payload);
+    }
+  else if ((ac = g_hash_table_lookup (self->aggregates, channel)) != NULL)
+    relay_aggregate_input (self, ac, command, NULL);
+  else
+    g_debug ("dropping control message with unknown channel %s", channel);
+
+  *valid = TRUE;
+  return TRUE;
+}
+
 static void
 dispatch_inbound_command (CockpitWebService *self,
                           CockpitSocket *socket,
@@ -1416,6 +3344,24 @@ dispatch_inbound_command (CockpitWebService *self,
   gboolean valid = FALSE;
   CockpitSession *session = NULL;
   GHashTableIter iter;
+  gchar *scanned_command;
+  gchar *scanned_channel;
+  gboolean relayed;
+
+  /*
+   * Most control messages are relayed as is, so try to avoid parsing
+   * them. Only fall back to a full parse for those we need to look into.
+   */
+  if (socket->init_received &&
+      cockpit_transport_scan_command (payload, &scanned_command, &scanned_channel))
+    {
+      relayed = relay_inbound_command (self, socket, scanned_command,
+                                       scanned_channel, payload, &valid);
+      g_free (scanned_command);
+      g_free (scanned_channel);
+      if (relayed)
+        goto out;
+    }
 
   valid = cockpit_transport_parse_command (payload, &command, &channel, &options);
   if (!valid)
@@ -1455,34 +3401,14 @@ dispatch_inbound_command (CockpitWebService *self,
             }
         }
     }
-  else if (g_strcmp0 (command, "close") == 0)
-    {
-      if (channel == NULL)
-        {
-          g_warning ("got close command without a channel");
-          valid = FALSE;
-        }
-      else
-        {
-          valid = process_and_relay_close (self, socket, channel, payload);
-        }
-    }
   else if (g_strcmp0 (command, "kill") == 0)
     {
       /* This command is never forwarded */
       valid = process_kill (self, socket, options);
     }
-  else if (channel)
+  else
     {
-      /* Relay anything with a channel by default */
-      session = cockpit_session_by_channel (&self->sessions, channel);
-      if (session)
-        {
-          if (!session->sent_done)
-            cockpit_transport_send (session->transport, NULL, payload);
-        }
-      else
-        g_debug ("dropping control message with unknown channel %s", channel);
+      relay_inbound_command (self, socket, command, channel, payload, &valid);
     }
 
 out:
@@ -1500,12 +3426,17 @@ on_web_socket_message (WebSocketConnection *connection,
 {
   CockpitSession *session;
   CockpitSocket *socket;
+  CockpitGroup *group;
+  AggregateChannel *ac;
   GBytes *payload;
   gchar *channel;
 
   socket = cockpit_socket_lookup_by_connection (&self->sockets, connection);
   g_return_if_fail (socket != NULL);
 
+  cockpit_stats_add (NULL, COCKPIT_STAT_WS_BYTES_IN, g_bytes_get_size (message));
+  socket->received++;
+
   payload = cockpit_transport_parse_frame (message, &channel);
   if (!payload)
     return;
@@ -1519,12 +3450,21 @@ on_web_socket_message (WebSocketConnection *connection,
   /* An actual payload message */
   else if (!self->closing)
     {
+      group = cockpit_groups_lookup_by_channel (&self->groups, channel);
+      if (group)
+        cockpit_stats_add (group->stats, COCKPIT_STAT_GROUP_BYTES_IN, g_bytes_get_size (payload));
+
       session = cockpit_session_by_channel (&self->sessions, channel);
       if (session)
         {
+          trace_mark (self, channel, "ws-received");
           if (!session->sent_done)
             cockpit_transport_send (session->transport, channel, payload);
         }
+      else if ((ac = g_hash_table_lookup (self->aggregates, channel)) != NULL && ac->broadcast)
+        {
+          relay_aggregate_input (self, ac, NULL, payload);
+        }
       else
         {
           g_debug ("received message for unknown channel %s", channel);
@@ -1535,6 +3475,28 @@ on_web_socket_message (WebSocketConnection *connection,
   g_bytes_unref (payload);
 }
 
+static gchar *
+generate_resume_token (void)
+{
+  const guint8 *data;
+  GString *string;
+  GBytes *nonce;
+  gsize length;
+  gsize i;
+
+  nonce = cockpit_system_random_nonce (16);
+  if (!nonce)
+    return NULL;
+
+  data = g_bytes_get_data (nonce, &length);
+  string = g_string_sized_new (length * 2);
+  for (i = 0; i < length; i++)
+    g_string_append_printf (string, "%02x", (guint)data[i]);
+  g_bytes_unref (nonce);
+
+  return g_string_free (string, FALSE);
+}
+
 static void
 on_web_socket_open (WebSocketConnection *connection,
                     CockpitWebService *self)
@@ -1559,6 +3521,14 @@ on_web_socket_open (WebSocketConnection *connection,
   json_object_set_string_member (object, "host", "localhost");
   json_object_set_string_member (object, "csrf-token", cockpit_creds_get_csrf_token (self->creds));
 
+  if (cockpit_ws_resume_timeout > 0)
+    socket->resume = generate_resume_token ();
+  if (socket->resume)
+    {
+      g_hash_table_insert (self->sockets.by_resume, socket->resume, socket);
+      json_object_set_string_member (object, "resume", socket->resume);
+    }
+
   capabilities = json_array_new ();
   json_array_add_string_element (capabilities, "ssh");
   json_array_add_string_element (capabilities, "connection-string");
@@ -1579,33 +3549,56 @@ on_web_socket_open (WebSocketConnection *connection,
   command = cockpit_json_write_bytes (object);
   json_object_unref (object);
 
-  web_socket_connection_send (connection, WEB_SOCKET_DATA_TEXT, self->control_prefix, command);
+  cockpit_socket_relay (socket, WEB_SOCKET_DATA_TEXT, self->control_prefix,
+                        command, WEB_SOCKET_PRIORITY_CONTROL);
   g_bytes_unref (command);
 
   g_signal_connect (connection, "message",
                     G_CALLBACK (on_web_socket_message), self);
 }
 
-static gboolean
-on_web_socket_closing (WebSocketConnection *connection,
-                       CockpitWebService *self)
+static void
+on_web_socket_buffered (WebSocketConnection *connection,
+                        GParamSpec *pspec,
+                        CockpitWebService *self)
+{
+  CockpitSocket *socket;
+
+  socket = cockpit_socket_lookup_by_connection (&self->sockets, connection);
+  if (!socket)
+    return;
+
+  cockpit_socket_update_queued (socket);
+  if (g_hash_table_size (socket->throttled) == 0)
+    return;
+
+  if (web_socket_connection_get_buffered_amount (connection) <= cockpit_ws_pressure_low)
+    {
+      g_debug ("%s: resuming throttled sessions", socket->id);
+      cockpit_socket_release (socket);
+    }
+}
+
+/* Close any channels that were opened by this web socket */
+static void
+close_socket_channels (CockpitWebService *self,
+                       CockpitSocket *closed)
 {
   CockpitSession *session;
   CockpitSocket *socket;
+  AggregateChannel *ac;
   GHashTable *snapshot;
   GHashTableIter iter;
   const gchar *channel;
   GBytes *payload;
+  GList *list = NULL, *l;
 
-  g_debug ("web socket closing");
-
-  /* Close any channels that were opened by this web socket */
   snapshot = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
   g_hash_table_iter_init (&iter, self->sessions.by_channel);
   while (g_hash_table_iter_next (&iter, (gpointer *)&channel, (gpointer *)&session))
     {
       socket = cockpit_socket_lookup_by_channel (&self->sockets, channel);
-      if (socket && socket->connection == connection)
+      if (socket == closed)
         g_hash_table_insert (snapshot, g_strdup (channel), session);
     }
 
@@ -1621,9 +3614,57 @@ on_web_socket_closing (WebSocketConnection *connection,
     }
   g_hash_table_destroy (snapshot);
 
+  g_hash_table_iter_init (&iter, self->aggregates);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&ac))
+    {
+      socket = cockpit_socket_lookup_by_channel (&self->sockets, ac->channel);
+      if (socket == closed)
+        list = g_list_prepend (list, ac);
+    }
+
+  for (l = list; l != NULL; l = g_list_next (l))
+    {
+      ac = l->data;
+      process_aggregate_close (self, closed, ac, "disconnected");
+    }
+  g_list_free (list);
+}
+
+static gboolean
+on_web_socket_closing (WebSocketConnection *connection,
+                       CockpitWebService *self)
+{
+  CockpitSocket *socket;
+
+  g_debug ("web socket closing");
+
+  socket = cockpit_socket_lookup_by_connection (&self->sockets, connection);
+  if (socket)
+    {
+      /* Closed on purpose, so never resumed */
+      socket->closing = TRUE;
+      close_socket_channels (self, socket);
+    }
+
   return TRUE;
 }
 
+static gboolean
+on_resume_timeout (gpointer user_data)
+{
+  CockpitSocket *socket = user_data;
+  CockpitWebService *self = socket->service;
+
+  g_debug ("%s socket was not resumed", socket->id);
+  socket->resume_timeout = 0;
+
+  close_socket_channels (self, socket);
+  cockpit_socket_destroy (&self->sockets, socket);
+
+  caller_end (self);
+  return FALSE;
+}
+
 static void
 on_web_socket_close (WebSocketConnection *connection,
                      CockpitWebService *self)
@@ -1637,10 +3678,21 @@ on_web_socket_close (WebSocketConnection *connection,
   g_signal_handlers_disconnect_by_func (connection, on_web_socket_open, self);
   g_signal_handlers_disconnect_by_func (connection, on_web_socket_closing, self);
   g_signal_handlers_disconnect_by_func (connection, on_web_socket_close, self);
+  g_signal_handlers_disconnect_by_func (connection, on_web_socket_buffered, self);
 
   socket = cockpit_socket_lookup_by_connection (&self->sockets, connection);
   g_return_if_fail (socket != NULL);
 
+  /* Dropped without closing, the browser may be back in a moment */
+  if (socket->resume && socket->init_received && !socket->closing &&
+      !self->closing && cockpit_ws_resume_timeout > 0)
+    {
+      g_debug ("%s keeping socket for %u seconds", socket->id, cockpit_ws_resume_timeout);
+      socket->resume_timeout = cockpit_timer_wheel_add_seconds (NULL, cockpit_ws_resume_timeout,
+                                                                on_resume_timeout, socket);
+      return;
+    }
+
   cockpit_socket_destroy (&self->sockets, socket);
 
   caller_end (self);
@@ -1649,21 +3701,23 @@ on_web_socket_close (WebSocketConnection *connection,
 static gboolean
 on_ping_time (gpointer user_data)
 {
+  static GBytes *payload = NULL;
   CockpitWebService *self = user_data;
   WebSocketConnection *connection;
   GHashTableIter iter;
-  GBytes *payload;
 
-  payload = cockpit_transport_build_control ("command", "ping", NULL);
+  /* Every ping is the same, so only build it once */
+  if (!payload)
+    payload = cockpit_transport_build_control ("command", "ping", NULL);
 
   g_hash_table_iter_init (&iter, self->sockets.by_connection);
   while (g_hash_table_iter_next (&iter, (gpointer *)&connection, NULL))
     {
       if (web_socket_connection_get_ready_state (connection) == WEB_SOCKET_STATE_OPEN)
-        web_socket_connection_send (connection, WEB_SOCKET_DATA_TEXT, self->control_prefix, payload);
+        web_socket_connection_send_full (connection, WEB_SOCKET_DATA_TEXT, self->control_prefix,
+                                         payload, WEB_SOCKET_PRIORITY_CONTROL);
     }
 
-  g_bytes_unref (payload);
   return TRUE;
 }
 
@@ -1673,8 +3727,13 @@ cockpit_web_service_init (CockpitWebService *self)
   self->control_prefix = g_bytes_new_static ("\n", 1);
   cockpit_sessions_init (&self->sessions);
   cockpit_sockets_init (&self->sockets);
-  self->ping_timeout = g_timeout_add_seconds (cockpit_ws_ping_interval, on_ping_time, self);
-  self->channel_groups = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  self->ping_timeout = cockpit_timer_wheel_add_seconds (NULL, cockpit_ws_ping_interval, on_ping_time, self);
+  cockpit_groups_init (&self->groups, &self->sessions);
+  self->traces = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, cockpit_trace_unref);
+
+  /* The AggregateChannel owns the keys of both */
+  self->aggregates = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, aggregate_channel_free);
+  self->aggregate_subs = g_hash_table_new (g_str_hash, g_str_equal);
 }
 
 static void
@@ -1717,13 +3776,15 @@ cockpit_web_service_new (CockpitCreds *creds,
   if (transport)
     {
       /* Any failures happen asyncronously */
-      session = cockpit_session_track (&self->sessions, "localhost", FALSE, creds, transport);
+      session = cockpit_session_track (&self->sessions, "localhost", FALSE, NULL, creds, transport);
       session->control_sig = g_signal_connect_after (transport, "control", G_CALLBACK (on_session_control), self);
       session->recv_sig = g_signal_connect_after (transport, "recv", G_CALLBACK (on_session_recv), self);
       session->closed_sig = g_signal_connect_after (transport, "closed", G_CALLBACK (on_session_closed), self);
       session->primary = TRUE;
     }
 
+  preconnect_sessions (self);
+
   return self;
 }
 
@@ -1768,6 +3829,15 @@ cockpit_web_service_create_socket (const gchar **protocols,
 
   connection = web_socket_server_new_for_stream (url, origins, protocols,
                                                  io_stream, headers, input_buffer);
+
+  /*
+   * Compressing secrets next to data an attacker can influence lets them
+   * guess the secrets from the size of the frames. So this is opt-in,
+   * and the compression state is never kept from one message to the next.
+   * Small messages aren't worth the framing overhead.
+   */
+  if (cockpit_ws_websocket_compression)
+    web_socket_connection_set_deflate (connection, 128, TRUE);
   g_free (allocated);
   g_free (url);
   g_free (origin);
@@ -1795,14 +3865,18 @@ cockpit_web_service_socket (CockpitWebService *self,
 {
   const gchar *protocols[] = { "cockpit1", NULL };
   WebSocketConnection *connection;
+  CockpitSocket *socket;
 
   connection = cockpit_web_service_create_socket (protocols, path, io_stream, headers, input_buffer);
 
   g_signal_connect (connection, "open", G_CALLBACK (on_web_socket_open), self);
   g_signal_connect (connection, "closing", G_CALLBACK (on_web_socket_closing), self);
   g_signal_connect (connection, "close", G_CALLBACK (on_web_socket_close), self);
+  g_signal_connect (connection, "notify::buffered-amount", G_CALLBACK (on_web_socket_buffered), self);
 
-  cockpit_socket_track (&self->sockets, connection);
+  socket = cockpit_socket_track (&self->sockets, connection);
+  socket->service = self;
+  socket->sessions = &self->sessions;
   g_object_unref (connection);
 
   caller_begin (self);
@@ -1869,6 +3943,23 @@ cockpit_web_service_get_host (CockpitWebService *self,
   return session ? session->host : NULL;
 }
 
+/*
+ * Whether the bridge will honour a "send-acks" open option. Until its
+ * "init" arrives this isn't known, and the answer is FALSE.
+ */
+gboolean
+cockpit_web_service_get_send_acks (CockpitWebService *self,
+                                   CockpitTransport *transport)
+{
+  CockpitSession *session;
+
+  g_return_val_if_fail (COCKPIT_IS_WEB_SERVICE (self), FALSE);
+  g_return_val_if_fail (COCKPIT_IS_TRANSPORT (transport), FALSE);
+
+  session = cockpit_session_by_transport (&self->sessions, transport);
+  return session ? session->can_ack : FALSE;
+}
+
 CockpitTransport *
 cockpit_web_service_ensure_transport (CockpitWebService *self,
                                       JsonObject *open)
@@ -1889,22 +3980,15 @@ cockpit_web_service_find_transport (CockpitWebService *self,
                                     const gchar *checksum)
 {
   CockpitSession *session;
-  GHashTableIter iter;
 
   g_return_val_if_fail (COCKPIT_IS_WEB_SERVICE (self), NULL);
   g_return_val_if_fail (checksum != NULL, NULL);
 
   /* Always check localhost first */
-  session = g_hash_table_lookup (self->sessions.by_host, "localhost");
+  session = cockpit_session_by_host (&self->sessions, "localhost");
   if (session && session->checksum && g_str_equal (session->checksum, checksum))
     return session->transport;
 
-  g_hash_table_iter_init (&iter, self->sessions.by_transport);
-  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&session))
-    {
-      if (session->checksum && g_str_equal (session->checksum, checksum))
-        return session->transport;
-    }
-
-  return NULL;
+  session = cockpit_session_by_checksum (&self->sessions, checksum);
+  return session ? session->transport : NULL;
 }
@@ -73,6 +73,9 @@ const gchar *           cockpit_web_service_get_checksum     (CockpitWebService
 const gchar *           cockpit_web_service_get_host         (CockpitWebService *self,
                                                               CockpitTransport *transport);
 
+gboolean                cockpit_web_service_get_send_acks    (CockpitWebService *self,
+                                                              CockpitTransport *transport);
+
 gboolean                cockpit_web_service_parse_binary     (JsonObject *open,
                                                               WebSocketDataType *type);
 
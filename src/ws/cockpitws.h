@@ -34,14 +34,35 @@ extern const gchar *cockpit_ws_default_host_header;
 extern gint cockpit_ws_specific_ssh_port;
 extern guint cockpit_ws_ping_interval;
 extern gint cockpit_ws_session_timeout;
+extern gsize cockpit_ws_pressure_high;
+extern gsize cockpit_ws_pressure_low;
+extern gint cockpit_ws_channel_window;
+extern guint cockpit_ws_max_preconnect;
+extern guint cockpit_ws_resume_timeout;
+extern gsize cockpit_ws_resume_buffer;
+extern guint cockpit_ws_max_idle_sessions;
+extern gsize cockpit_ws_busy_session_rate;
+extern gsize cockpit_ws_broadcast_input_maximum;
+extern gsize cockpit_ws_group_queue_maximum;
+extern guint cockpit_ws_authorize_cache_timeout;
 extern guint cockpit_ws_auth_process_timeout;
 extern guint cockpit_ws_auth_response_timeout;
+extern gboolean cockpit_ws_websocket_compression;
 
 /* From cockpitauth.c */
 extern guint cockpit_ws_service_idle;
 extern guint cockpit_ws_process_idle;
 extern const gchar *cockpit_ws_max_startups;
 
+/* From cockpithandlers.c */
+extern guint cockpit_ws_socket_rate;
+extern guint cockpit_ws_socket_burst;
+
+/* From cockpitchannelresponse.c */
+extern gint cockpit_ws_compress_level;
+extern gsize cockpit_ws_compress_threshold;
+extern gsize cockpit_ws_resource_cache_size;
+
 G_END_DECLS
 
 #endif /* __COCKPIT_WS_H__ */
@@ -0,0 +1,935 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2016 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "common/cockpitjson.h"
+#include "common/cockpittransport.h"
+
+#include "websocket/websocket.h"
+
+#include <json-glib/json-glib.h>
+
+#include <dirent.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Simulates many browsers using cockpit-ws at the same time. Each user
+ * logs in, opens a WebSocket and the kind of channels a page opens:
+ * metrics1 from the internal source, a dbus-json3 channel with a watch
+ * on systemd and a method call now and then, and a stream running cat
+ * which echoes lines back.
+ *
+ * With --echo each user also opens an echo channel and sends it messages
+ * of the given size. Those only go through cockpit-ws and the bridge's
+ * channel code, and so measure the relay on its own.
+ *
+ * Every few seconds it reports throughput, the round trip latency of
+ * the calls and echoes, how long logins took, and the CPU and memory
+ * used by cockpit-ws and cockpit-bridge processes on this machine.
+ *
+ * This is not run as part of 'make check'. It needs a running cockpit
+ * and a user to log in as, with the password in $LOAD_PASSWORD:
+ *
+ *   $ LOAD_PASSWORD=foobar ./load-ws --user=admin --users=200 https://localhost:9090
+ */
+
+static gint opt_users = 50;
+static gint opt_ramp = 20;
+static gint opt_duration = 60;
+static gint opt_interval = 5;
+static gint opt_period = 1000;
+static gint opt_echo = 0;
+static gchar *opt_user = NULL;
+
+static const gchar *password;
+static gchar *http_url;
+static gchar *socket_url;
+static gchar *origin;
+static gchar *host_port;
+static gboolean secure;
+
+static const gchar *processes[] = { "cockpit-ws", "cockpit-bridge", NULL };
+
+typedef struct {
+  guint64 messages;
+  guint64 bytes;
+  GArray *latencies;
+  GArray *logins;
+} LoadStats;
+
+typedef struct {
+  guint64 ticks;
+  guint64 rss;
+  gint count;
+} ProcessUsage;
+
+typedef struct {
+  guint id;
+  gint64 started;
+  GSocketConnection *http;
+  gchar *request;
+  gsize written;
+  GByteArray *response;
+  guchar buffer[4096];
+  gchar *cookie;
+  WebSocketConnection *ws;
+  GString *echoed;
+  GHashTable *calls;
+  guint next_call;
+  guint tick;
+  gboolean opened;
+} LoadUser;
+
+/* Since the last report, and for the whole run */
+static LoadStats interval;
+static LoadStats total;
+
+static gint logging_in;
+static gint connected;
+static gint failed;
+static gint closed;
+
+static GPtrArray *users;
+static GMainLoop *loop;
+static gint64 last_report;
+static ProcessUsage last_usage[G_N_ELEMENTS (processes)];
+
+static void
+stats_reset (LoadStats *stats)
+{
+  stats->messages = 0;
+  stats->bytes = 0;
+  g_array_set_size (stats->latencies, 0);
+  g_array_set_size (stats->logins, 0);
+}
+
+static void
+stats_latency (gboolean login,
+               gint64 usec)
+{
+  g_array_append_val (login ? interval.logins : interval.latencies, usec);
+  g_array_append_val (login ? total.logins : total.latencies, usec);
+}
+
+static void
+load_user_fail (LoadUser *user,
+                const gchar *what,
+                GError *error)
+{
+  g_printerr ("load-ws: user %u: %s%s%s\n", user->id, what,
+              error ? ": " : "", error ? error->message : "");
+  if (error)
+    g_error_free (error);
+
+  g_clear_object (&user->http);
+  logging_in--;
+  failed++;
+}
+
+/* ----------------------------------------------------------------------------
+ * Talking on the WebSocket
+ */
+
+static void
+send_text (LoadUser *user,
+           const gchar *channel,
+           const gchar *text)
+{
+  GBytes *prefix;
+  GBytes *payload;
+  gchar *header;
+
+  header = g_strdup_printf ("%s\n", channel ? channel : "");
+  prefix = g_bytes_new_take (header, strlen (header));
+  payload = g_bytes_new (text, strlen (text));
+  web_socket_connection_send (user->ws, WEB_SOCKET_DATA_TEXT, prefix, payload);
+  g_bytes_unref (prefix);
+  g_bytes_unref (payload);
+}
+
+/* Remember when a D-Bus request was sent, the reply has the same id */
+static void
+stamp_call (LoadUser *user,
+            gchar *id)
+{
+  gint64 *sent = g_new (gint64, 1);
+  *sent = g_get_monotonic_time ();
+  g_hash_table_replace (user->calls, id, sent);
+}
+
+static void
+send_call (LoadUser *user)
+{
+  gchar *id;
+  gchar *text;
+
+  id = g_strdup_printf ("%u", user->next_call++);
+  text = g_strdup_printf ("{ \"call\": [ \"/org/freedesktop/systemd1\", \"org.freedesktop.DBus.Peer\","
+                          " \"Ping\", [ ] ], \"id\": \"%s\" }", id);
+  stamp_call (user, id);
+  send_text (user, "d", text);
+  g_free (text);
+}
+
+static gboolean
+on_user_tick (gpointer data)
+{
+  LoadUser *user = data;
+  gchar *line;
+
+  if (web_socket_connection_get_ready_state (user->ws) != WEB_SOCKET_STATE_OPEN)
+    return TRUE;
+
+  send_call (user);
+
+  line = g_strdup_printf ("%" G_GINT64_FORMAT "\n", g_get_monotonic_time ());
+  send_text (user, "s", line);
+  g_free (line);
+
+  if (opt_echo > 0)
+    {
+      /* The time it was sent, padded out to the size asked for */
+      line = g_strdup_printf ("%-*" G_GINT64_FORMAT, opt_echo, g_get_monotonic_time ());
+      send_text (user, "e", line);
+      g_free (line);
+    }
+
+  return TRUE;
+}
+
+static void
+open_channels (LoadUser *user)
+{
+  send_text (user, NULL, "{ \"command\": \"init\", \"version\": 1 }");
+
+  send_text (user, NULL, "{ \"command\": \"open\", \"channel\": \"m\", \"payload\": \"metrics1\","
+             " \"source\": \"internal\", \"interval\": 1000, \"metrics\": ["
+             " { \"name\": \"cpu.basic.user\", \"derive\": \"rate\" },"
+             " { \"name\": \"memory.used\" },"
+             " { \"name\": \"network.interface.rx\", \"derive\": \"rate\" } ] }");
+
+  send_text (user, NULL, "{ \"command\": \"open\", \"channel\": \"d\", \"payload\": \"dbus-json3\","
+             " \"bus\": \"system\", \"name\": \"org.freedesktop.systemd1\" }");
+  stamp_call (user, g_strdup ("watch"));
+  send_text (user, "d", "{ \"watch\": { \"path_namespace\": \"/org/freedesktop/systemd1/unit\" },"
+             " \"id\": \"watch\" }");
+
+  send_text (user, NULL, "{ \"command\": \"open\", \"channel\": \"s\", \"payload\": \"stream\","
+             " \"spawn\": [ \"cat\" ] }");
+
+  if (opt_echo > 0)
+    send_text (user, NULL, "{ \"command\": \"open\", \"channel\": \"e\", \"payload\": \"echo\" }");
+
+  user->tick = g_timeout_add (opt_period, on_user_tick, user);
+}
+
+static void
+on_control (LoadUser *user,
+            GBytes *payload)
+{
+  const gchar *command;
+  const gchar *channel;
+  const gchar *problem;
+  JsonObject *object;
+
+  object = cockpit_json_parse_bytes (payload, NULL);
+  if (!object)
+    return;
+
+  if (!cockpit_json_get_string (object, "command", NULL, &command))
+    command = NULL;
+
+  if (g_strcmp0 (command, "init") == 0)
+    {
+      open_channels (user);
+    }
+  else if (g_strcmp0 (command, "close") == 0)
+    {
+      if (!cockpit_json_get_string (object, "channel", NULL, &channel))
+        channel = NULL;
+      if (!cockpit_json_get_string (object, "problem", NULL, &problem))
+        problem = NULL;
+      if (problem)
+        g_printerr ("load-ws: user %u: channel %s closed: %s\n", user->id, channel, problem);
+    }
+
+  json_object_unref (object);
+}
+
+static void
+on_dbus_reply (LoadUser *user,
+               GBytes *payload)
+{
+  JsonObject *object;
+  const gchar *id;
+  gint64 *sent;
+
+  object = cockpit_json_parse_bytes (payload, NULL);
+  if (!object)
+    return;
+
+  if (cockpit_json_get_string (object, "id", NULL, &id) && id)
+    {
+      sent = g_hash_table_lookup (user->calls, id);
+      if (sent)
+        {
+          stats_latency (FALSE, g_get_monotonic_time () - *sent);
+          g_hash_table_remove (user->calls, id);
+        }
+    }
+
+  json_object_unref (object);
+}
+
+static void
+on_stream_echo (LoadUser *user,
+                GBytes *payload)
+{
+  gint64 now = g_get_monotonic_time ();
+  gchar *line;
+  gchar *end;
+  gint64 sent;
+
+  /* cat may join or split lines, so they're put back together here */
+  g_string_append_len (user->echoed, g_bytes_get_data (payload, NULL), g_bytes_get_size (payload));
+
+  line = user->echoed->str;
+  while ((end = memchr (line, '\n', user->echoed->str + user->echoed->len - line)) != NULL)
+    {
+      *end = '\0';
+      sent = g_ascii_strtoll (line, NULL, 10);
+      if (sent > 0 && sent <= now)
+        stats_latency (FALSE, now - sent);
+      line = end + 1;
+    }
+
+  g_string_erase (user->echoed, 0, line - user->echoed->str);
+}
+
+static void
+on_echo (LoadUser *user,
+         GBytes *payload)
+{
+  gint64 now = g_get_monotonic_time ();
+  gchar *text;
+  gint64 sent;
+
+  /* The echo channel sends each message back whole */
+  text = g_strndup (g_bytes_get_data (payload, NULL), MIN (g_bytes_get_size (payload), 32));
+  sent = g_ascii_strtoll (text, NULL, 10);
+  if (sent > 0 && sent <= now)
+    stats_latency (FALSE, now - sent);
+  g_free (text);
+}
+
+static void
+on_web_socket_message (WebSocketConnection *ws,
+                       WebSocketDataType type,
+                       GBytes *message,
+                       gpointer data)
+{
+  LoadUser *user = data;
+  GBytes *payload;
+  gchar *channel;
+
+  interval.messages++;
+  interval.bytes += g_bytes_get_size (message);
+  total.messages++;
+  total.bytes += g_bytes_get_size (message);
+
+  payload = cockpit_transport_parse_frame (message, &channel);
+  if (!payload)
+    return;
+
+  if (!channel)
+    on_control (user, payload);
+  else if (g_str_equal (channel, "d"))
+    on_dbus_reply (user, payload);
+  else if (g_str_equal (channel, "s"))
+    on_stream_echo (user, payload);
+  else if (g_str_equal (channel, "e"))
+    on_echo (user, payload);
+
+  g_free (channel);
+  g_bytes_unref (payload);
+}
+
+static void
+on_web_socket_open (WebSocketConnection *ws,
+                    gpointer data)
+{
+  LoadUser *user = data;
+
+  user->opened = TRUE;
+  logging_in--;
+  connected++;
+  stats_latency (TRUE, g_get_monotonic_time () - user->started);
+}
+
+static void
+on_web_socket_close (WebSocketConnection *ws,
+                     gpointer data)
+{
+  LoadUser *user = data;
+  gushort code;
+
+  if (user->tick)
+    g_source_remove (user->tick);
+  user->tick = 0;
+
+  code = web_socket_connection_get_close_code (ws);
+  if (code != WEB_SOCKET_CLOSE_NORMAL && code != WEB_SOCKET_CLOSE_GOING_AWAY)
+    {
+      g_printerr ("load-ws: user %u: closed: %d %s\n", user->id, code,
+                  web_socket_connection_get_close_data (ws));
+    }
+
+  if (user->opened)
+    {
+      connected--;
+      closed++;
+    }
+  else
+    {
+      logging_in--;
+      failed++;
+    }
+}
+
+static void
+on_socket_connected (GObject *source,
+                     GAsyncResult *result,
+                     gpointer data)
+{
+  LoadUser *user = data;
+  const gchar *protocols[] = { "cockpit1", NULL };
+  GSocketConnection *connection;
+  GError *error = NULL;
+
+  connection = g_socket_client_connect_to_uri_finish (G_SOCKET_CLIENT (source), result, &error);
+  if (!connection)
+    {
+      load_user_fail (user, "couldn't connect WebSocket", error);
+      return;
+    }
+
+  user->ws = web_socket_client_new_for_stream (socket_url, origin, protocols,
+                                               G_IO_STREAM (connection));
+  web_socket_client_include_header (WEB_SOCKET_CLIENT (user->ws), "Cookie", user->cookie);
+  g_signal_connect (user->ws, "open", G_CALLBACK (on_web_socket_open), user);
+  g_signal_connect (user->ws, "message", G_CALLBACK (on_web_socket_message), user);
+  g_signal_connect (user->ws, "close", G_CALLBACK (on_web_socket_close), user);
+
+  g_object_unref (connection);
+}
+
+/* ----------------------------------------------------------------------------
+ * Logging in
+ */
+
+static GSocketClient *
+new_socket_client (void)
+{
+  GSocketClient *client;
+
+  client = g_socket_client_new ();
+  if (secure)
+    {
+      /* Test machines have self-signed certificates */
+      g_socket_client_set_tls (client, TRUE);
+      g_socket_client_set_tls_validation_flags (client, 0);
+    }
+
+  return client;
+}
+
+static gchar *
+parse_cookie (const gchar *headers)
+{
+  const gchar *line;
+  const gchar *end;
+
+  for (line = headers; line != NULL; line = strstr (line, "\r\n"))
+    {
+      if (line[0] == '\r')
+        line += 2;
+      if (g_ascii_strncasecmp (line, "Set-Cookie:", 11) == 0)
+        {
+          line += 11;
+          while (*line == ' ')
+            line++;
+          end = line + strcspn (line, ";\r\n");
+          return g_strndup (line, end - line);
+        }
+    }
+
+  return NULL;
+}
+
+static void read_login_response (LoadUser *user);
+
+static void
+on_login_read (GObject *source,
+               GAsyncResult *result,
+               gpointer data)
+{
+  LoadUser *user = data;
+  GSocketClient *client;
+  GError *error = NULL;
+  const gchar *headers;
+  gssize ret;
+
+  ret = g_input_stream_read_finish (G_INPUT_STREAM (source), result, &error);
+  if (ret < 0)
+    {
+      load_user_fail (user, "couldn't read login response", error);
+      return;
+    }
+  else if (ret == 0)
+    {
+      load_user_fail (user, "login response was truncated", NULL);
+      return;
+    }
+
+  g_byte_array_append (user->response, user->buffer, ret);
+
+  headers = (const gchar *)user->response->data;
+  if (!g_strstr_len (headers, user->response->len, "\r\n\r\n"))
+    {
+      read_login_response (user);
+      return;
+    }
+
+  g_byte_array_append (user->response, (const guint8 *)"", 1);
+  if (!g_str_has_prefix (headers, "HTTP/1.1 200 ") && !g_str_has_prefix (headers, "HTTP/1.0 200 "))
+    {
+      load_user_fail (user, "login failed", NULL);
+      return;
+    }
+
+  user->cookie = parse_cookie (headers);
+  if (!user->cookie)
+    {
+      load_user_fail (user, "login response had no cookie", NULL);
+      return;
+    }
+
+  g_io_stream_close (G_IO_STREAM (user->http), NULL, NULL);
+  g_clear_object (&user->http);
+
+  client = new_socket_client ();
+  g_socket_client_connect_to_uri_async (client, socket_url, 9090, NULL, on_socket_connected, user);
+  g_object_unref (client);
+}
+
+static void
+read_login_response (LoadUser *user)
+{
+  g_input_stream_read_async (g_io_stream_get_input_stream (G_IO_STREAM (user->http)),
+                             user->buffer, sizeof (user->buffer), G_PRIORITY_DEFAULT,
+                             NULL, on_login_read, user);
+}
+
+static void write_login_request (LoadUser *user);
+
+static void
+on_login_written (GObject *source,
+                  GAsyncResult *result,
+                  gpointer data)
+{
+  LoadUser *user = data;
+  GError *error = NULL;
+  gssize ret;
+
+  ret = g_output_stream_write_finish (G_OUTPUT_STREAM (source), result, &error);
+  if (ret < 0)
+    {
+      load_user_fail (user, "couldn't send login request", error);
+      return;
+    }
+
+  user->written += ret;
+  if (user->written < strlen (user->request))
+    write_login_request (user);
+  else
+    read_login_response (user);
+}
+
+static void
+write_login_request (LoadUser *user)
+{
+  g_output_stream_write_async (g_io_stream_get_output_stream (G_IO_STREAM (user->http)),
+                               user->request + user->written,
+                               strlen (user->request) - user->written,
+                               G_PRIORITY_DEFAULT, NULL, on_login_written, user);
+}
+
+static void
+on_login_connected (GObject *source,
+                    GAsyncResult *result,
+                    gpointer data)
+{
+  LoadUser *user = data;
+  GError *error = NULL;
+  gchar *credentials;
+  gchar *encoded;
+
+  user->http = g_socket_client_connect_to_uri_finish (G_SOCKET_CLIENT (source), result, &error);
+  if (!user->http)
+    {
+      load_user_fail (user, "couldn't connect", error);
+      return;
+    }
+
+  credentials = g_strdup_printf ("%s:%s", opt_user, password);
+  encoded = g_base64_encode ((const guchar *)credentials, strlen (credentials));
+  memset (credentials, 0, strlen (credentials));
+  g_free (credentials);
+
+  user->request = g_strdup_printf ("GET /cockpit/login HTTP/1.1\r\n"
+                                   "Host: %s\r\n"
+                                   "Authorization: Basic %s\r\n"
+                                   "Connection: close\r\n"
+                                   "\r\n", host_port, encoded);
+  g_free (encoded);
+
+  write_login_request (user);
+}
+
+static gboolean
+on_start_user (gpointer unused)
+{
+  GSocketClient *client;
+  LoadUser *user;
+
+  user = g_new0 (LoadUser, 1);
+  user->id = users->len + 1;
+  user->started = g_get_monotonic_time ();
+  user->response = g_byte_array_new ();
+  user->echoed = g_string_new ("");
+  user->calls = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  g_ptr_array_add (users, user);
+
+  logging_in++;
+
+  client = new_socket_client ();
+  g_socket_client_connect_to_uri_async (client, http_url, 9090, NULL, on_login_connected, user);
+  g_object_unref (client);
+
+  return users->len < opt_users;
+}
+
+static void
+load_user_free (gpointer data)
+{
+  LoadUser *user = data;
+
+  if (user->tick)
+    g_source_remove (user->tick);
+  if (user->ws)
+    {
+      g_signal_handlers_disconnect_by_data (user->ws, user);
+      g_object_unref (user->ws);
+    }
+  g_clear_object (&user->http);
+  g_byte_array_free (user->response, TRUE);
+  g_string_free (user->echoed, TRUE);
+  g_hash_table_unref (user->calls);
+  g_free (user->request);
+  g_free (user->cookie);
+  g_free (user);
+}
+
+/* ----------------------------------------------------------------------------
+ * Reporting
+ */
+
+static gboolean
+read_process (const gchar *pid,
+              const gchar *name,
+              ProcessUsage *usage)
+{
+  gchar *contents = NULL;
+  gchar *path;
+  gchar **fields = NULL;
+  gchar *line;
+  gboolean ret = FALSE;
+
+  path = g_strdup_printf ("/proc/%s/comm", pid);
+  if (!g_file_get_contents (path, &contents, NULL, NULL))
+    goto out;
+  g_strchomp (contents);
+  if (!g_str_equal (contents, name))
+    goto out;
+
+  /* The fields after the command name, which may contain spaces */
+  g_free (path);
+  g_free (contents);
+  path = g_strdup_printf ("/proc/%s/stat", pid);
+  if (!g_file_get_contents (path, &contents, NULL, NULL))
+    goto out;
+  line = strrchr (contents, ')');
+  if (!line)
+    goto out;
+  fields = g_strsplit (line + 2, " ", -1);
+  if (g_strv_length (fields) < 22)
+    goto out;
+
+  /* utime and stime, then rss in pages */
+  usage->ticks += g_ascii_strtoull (fields[11], NULL, 10) + g_ascii_strtoull (fields[12], NULL, 10);
+  usage->rss += g_ascii_strtoull (fields[21], NULL, 10) * sysconf (_SC_PAGESIZE);
+  usage->count++;
+  ret = TRUE;
+
+out:
+  g_strfreev (fields);
+  g_free (contents);
+  g_free (path);
+  return ret;
+}
+
+static void
+read_usage (ProcessUsage *usage)
+{
+  struct dirent *ent;
+  DIR *dir;
+  guint i;
+
+  memset (usage, 0, sizeof (ProcessUsage) * G_N_ELEMENTS (processes));
+
+  dir = opendir ("/proc");
+  if (!dir)
+    return;
+
+  while ((ent = readdir (dir)) != NULL)
+    {
+      if (!g_ascii_isdigit (ent->d_name[0]))
+        continue;
+      for (i = 0; processes[i] != NULL; i++)
+        {
+          if (read_process (ent->d_name, processes[i], usage + i))
+            break;
+        }
+    }
+
+  closedir (dir);
+}
+
+static int
+compare_latency (gconstpointer a,
+                 gconstpointer b)
+{
+  const gint64 *la = a;
+  const gint64 *lb = b;
+  return (*la > *lb) - (*la < *lb);
+}
+
+static void
+print_percentiles (const gchar *what,
+                   GArray *array)
+{
+  gint64 *values;
+  guint len;
+
+  len = array->len;
+  if (len == 0)
+    return;
+
+  g_array_sort (array, compare_latency);
+  values = (gint64 *)array->data;
+  printf ("  %s p50: %.1f ms, p90: %.1f ms, p99: %.1f ms, max: %.1f ms\n", what,
+          values[(len * 50) / 100] / 1000.0, values[(len * 90) / 100] / 1000.0,
+          values[(len * 99) / 100] / 1000.0, values[len - 1] / 1000.0);
+}
+
+static void
+report (LoadStats *stats,
+        gdouble elapsed)
+{
+  ProcessUsage usage[G_N_ELEMENTS (processes)];
+  guint i;
+
+  printf ("%d users connected, %d logging in, %d failed, %d closed\n",
+          connected, logging_in, failed, closed);
+  printf ("  %.0f msgs/sec, %.1f KB/sec\n",
+          stats->messages / elapsed, stats->bytes / elapsed / 1024);
+  print_percentiles ("round trip", stats->latencies);
+  print_percentiles ("login", stats->logins);
+
+  /* The process usage always covers the last interval */
+  read_usage (usage);
+  elapsed = (g_get_monotonic_time () - last_report) / (gdouble)G_USEC_PER_SEC;
+  for (i = 0; processes[i] != NULL; i++)
+    {
+      if (usage[i].count == 0)
+        continue;
+      printf ("  %s: %d processes, %.1f%% cpu, %.1f MB rss\n", processes[i], usage[i].count,
+              (usage[i].ticks - MIN (usage[i].ticks, last_usage[i].ticks)) * 100.0 /
+              sysconf (_SC_CLK_TCK) / elapsed, usage[i].rss / (1024.0 * 1024.0));
+    }
+  memcpy (last_usage, usage, sizeof (usage));
+  last_report = g_get_monotonic_time ();
+
+  fflush (stdout);
+}
+
+static gboolean
+on_report (gpointer unused)
+{
+  report (&interval, (g_get_monotonic_time () - last_report) / (gdouble)G_USEC_PER_SEC);
+  stats_reset (&interval);
+  return TRUE;
+}
+
+static gboolean
+on_finished (gpointer unused)
+{
+  g_main_loop_quit (loop);
+  return FALSE;
+}
+
+static gboolean
+parse_url (const gchar *url)
+{
+  gchar *scheme;
+  const gchar *start;
+  const gchar *end;
+
+  scheme = g_uri_parse_scheme (url);
+  if (g_strcmp0 (scheme, "https") == 0)
+    secure = TRUE;
+  else if (g_strcmp0 (scheme, "http") != 0)
+    {
+      g_free (scheme);
+      return FALSE;
+    }
+
+  start = url + strlen (scheme) + 3;
+  end = start + strcspn (start, "/");
+  host_port = g_strndup (start, end - start);
+  if (!host_port[0])
+    {
+      g_free (scheme);
+      return FALSE;
+    }
+
+  http_url = g_strdup_printf ("%s://%s", scheme, host_port);
+  socket_url = g_strdup_printf ("%s://%s/cockpit/socket", secure ? "wss" : "ws", host_port);
+  origin = g_strdup (http_url);
+
+  g_free (scheme);
+  return TRUE;
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  GOptionContext *context;
+  GError *error = NULL;
+  gint64 start;
+
+  static GOptionEntry entries[] = {
+    { "users", 'u', 0, G_OPTION_ARG_INT, &opt_users, "Number of simulated browsers", "count" },
+    { "user", 0, 0, G_OPTION_ARG_STRING, &opt_user, "User to log in as", "name" },
+    { "ramp", 'r', 0, G_OPTION_ARG_INT, &opt_ramp, "Milliseconds between starting users", "msec" },
+    { "duration", 'd', 0, G_OPTION_ARG_INT, &opt_duration, "Seconds to run for", "seconds" },
+    { "interval", 'i', 0, G_OPTION_ARG_INT, &opt_interval, "Seconds between reports", "seconds" },
+    { "period", 'p', 0, G_OPTION_ARG_INT, &opt_period, "Milliseconds between each user's calls", "msec" },
+    { "echo", 'e', 0, G_OPTION_ARG_INT, &opt_echo, "Also send messages of this size to an echo channel", "bytes" },
+    { NULL }
+  };
+
+  signal (SIGPIPE, SIG_IGN);
+
+  context = g_option_context_new ("URL");
+  g_option_context_add_main_entries (context, entries, NULL);
+  g_option_context_set_description (context, "Simulate many browsers using cockpit-ws.\n"
+                                    "The password is read from $LOAD_PASSWORD.\n");
+
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("load-ws: %s\n", error->message);
+      g_error_free (error);
+      return 2;
+    }
+
+  g_option_context_free (context);
+
+  if (argc != 2 || !parse_url (argv[1]))
+    {
+      g_printerr ("load-ws: specify the http or https url of cockpit\n");
+      return 2;
+    }
+
+  if (opt_users < 1 || opt_ramp < 0 || opt_duration < 1 || opt_interval < 1 || opt_period < 1 ||
+      opt_echo < 0)
+    {
+      g_printerr ("load-ws: invalid options\n");
+      return 2;
+    }
+
+  password = g_getenv ("LOAD_PASSWORD");
+  if (!password)
+    {
+      g_printerr ("load-ws: set $LOAD_PASSWORD to the password to log in with\n");
+      return 2;
+    }
+
+  if (!opt_user)
+    opt_user = g_strdup (g_get_user_name ());
+
+  interval.latencies = g_array_new (FALSE, FALSE, sizeof (gint64));
+  interval.logins = g_array_new (FALSE, FALSE, sizeof (gint64));
+  total.latencies = g_array_new (FALSE, FALSE, sizeof (gint64));
+  total.logins = g_array_new (FALSE, FALSE, sizeof (gint64));
+  users = g_ptr_array_new_with_free_func (load_user_free);
+  loop = g_main_loop_new (NULL, FALSE);
+
+  start = last_report = g_get_monotonic_time ();
+  read_usage (last_usage);
+
+  g_timeout_add (MAX (opt_ramp, 1), on_start_user, NULL);
+  g_timeout_add_seconds (opt_interval, on_report, NULL);
+  g_timeout_add_seconds (opt_duration, on_finished, NULL);
+
+  g_main_loop_run (loop);
+
+  printf ("\ntotal: %u users in %d seconds\n", users->len, opt_duration);
+  report (&total, (g_get_monotonic_time () - start) / (gdouble)G_USEC_PER_SEC);
+
+  g_ptr_array_free (users, TRUE);
+  g_main_loop_unref (loop);
+  g_array_free (interval.latencies, TRUE);
+  g_array_free (interval.logins, TRUE);
+  g_array_free (total.latencies, TRUE);
+  g_array_free (total.logins, TRUE);
+  g_free (http_url);
+  g_free (socket_url);
+  g_free (origin);
+  g_free (host_port);
+  g_free (opt_user);
+
+  return 0;
+}
@@ -33,6 +33,7 @@
 #include "common/cockpitcertificate.h"
 #include "common/cockpitconf.h"
 #include "common/cockpitlog.h"
+#include "common/cockpitlogring.h"
 #include "common/cockpitmemory.h"
 #include "common/cockpitsystem.h"
 #include "common/cockpittest.h"
@@ -106,6 +107,13 @@ calculate_static_roots (GHashTable *os_release)
   return roots;
 }
 
+static gboolean
+on_signal_dump (gpointer data)
+{
+  cockpit_log_ring_dump ();
+  return TRUE;
+}
+
 int
 main (int argc,
       char *argv[])
@@ -120,6 +128,8 @@ main (int argc,
   gchar **roots = NULL;
   gchar *cert_path = NULL;
   GMainLoop *loop = NULL;
+  const gchar *conf;
+  guint sig_usr2 = 0;
 
   signal (SIGPIPE, SIG_IGN);
   g_setenv ("GSETTINGS_BACKEND", "memory", TRUE);
@@ -189,6 +199,53 @@ main (int argc,
 
   cockpit_web_server_set_redirect_tls (server, !cockpit_conf_bool ("WebService", "AllowUnencrypted", FALSE));
 
+  /* How long and how many connections to hosts stay open when not in use */
+  conf = cockpit_conf_string ("WebService", "SessionIdleTimeout");
+  if (conf && g_ascii_strtoull (conf, NULL, 10) > 0)
+    cockpit_ws_session_timeout = (gint)MIN (g_ascii_strtoull (conf, NULL, 10), G_MAXINT);
+  conf = cockpit_conf_string ("WebService", "MaxIdleSessions");
+  if (conf)
+    cockpit_ws_max_idle_sessions = (guint)MIN (g_ascii_strtoull (conf, NULL, 10), G_MAXUINT);
+
+  conf = cockpit_conf_string ("WebService", "SocketRate");
+  if (conf)
+    cockpit_ws_socket_rate = (guint)MIN (g_ascii_strtoull (conf, NULL, 10), G_MAXUINT);
+  conf = cockpit_conf_string ("WebService", "SocketBurst");
+  if (conf)
+    cockpit_ws_socket_burst = (guint)MIN (g_ascii_strtoull (conf, NULL, 10), G_MAXUINT);
+
+  /* How long a dropped WebSocket can be picked up again, and what's kept for it */
+  conf = cockpit_conf_string ("WebService", "ResumeTimeout");
+  if (conf)
+    cockpit_ws_resume_timeout = (guint)MIN (g_ascii_strtoull (conf, NULL, 10), G_MAXUINT);
+  conf = cockpit_conf_string ("WebService", "ResumeBuffer");
+  if (conf)
+    cockpit_ws_resume_buffer = (gsize)g_ascii_strtoull (conf, NULL, 10);
+
+  /* What the channels of one group, usually a page, may have queued */
+  conf = cockpit_conf_string ("WebService", "GroupQueueMaximum");
+  if (conf)
+    cockpit_ws_group_queue_maximum = (gsize)g_ascii_strtoull (conf, NULL, 10);
+
+  /* How long a session answers reauthorize challenges with a kept secret */
+  conf = cockpit_conf_string ("WebService", "AuthorizeCacheTimeout");
+  if (conf)
+    cockpit_ws_authorize_cache_timeout = (guint)g_ascii_strtoull (conf, NULL, 10);
+
+  /* Compression of pages and other responses relayed from the bridge */
+  conf = cockpit_conf_string ("WebService", "CompressionLevel");
+  if (conf)
+    cockpit_ws_compress_level = (gint)MIN (g_ascii_strtoull (conf, NULL, 10), 9);
+  conf = cockpit_conf_string ("WebService", "CompressionThreshold");
+  if (conf)
+    cockpit_ws_compress_threshold = (gsize)g_ascii_strtoull (conf, NULL, 10);
+  cockpit_ws_websocket_compression = cockpit_conf_bool ("WebService", "WebSocketCompression", FALSE);
+
+  /* Package resources from bridges, kept by their checksum */
+  conf = cockpit_conf_string ("WebService", "ResourceCacheSize");
+  if (conf)
+    cockpit_ws_resource_cache_size = (gsize)g_ascii_strtoull (conf, NULL, 10);
+
   if (cockpit_web_server_get_socket_activated (server))
     g_signal_connect_swapped (data.auth, "idling", G_CALLBACK (g_main_loop_quit), loop);
 
@@ -199,12 +256,21 @@ main (int argc,
   /* External channels, ignore stuff they shouldn't handle */
   g_signal_connect (server, "handle-stream",
                     G_CALLBACK (cockpit_handler_external), &data);
+  g_signal_connect (server, "handle-upload",
+                    G_CALLBACK (cockpit_handler_upload), &data);
 
   /* Don't redirect to TLS for /ping */
   g_object_set (server, "ssl-exception-prefix", "/ping", NULL);
   g_signal_connect (server, "handle-resource::/ping",
                     G_CALLBACK (cockpit_handler_ping), &data);
 
+  /* Scraped by monitoring, only when asked for */
+  if (cockpit_conf_bool ("WebService", "Metrics", FALSE))
+    {
+      g_signal_connect (server, "handle-resource::/metrics",
+                        G_CALLBACK (cockpit_handler_metrics), &data);
+    }
+
   /* Files that cannot be cache-forever, because of well known names */
   g_signal_connect (server, "handle-resource::/favicon.ico",
                     G_CALLBACK (cockpit_handler_root), &data);
@@ -221,11 +287,16 @@ main (int argc,
   signal (SIGSEGV, cockpit_test_signal_backtrace);
 #endif
 
+  /* Write out the recent tracepoints on demand */
+  sig_usr2 = g_unix_signal_add (SIGUSR2, on_signal_dump, NULL);
+
   g_main_loop_run (loop);
 
   ret = 0;
 
 out:
+  if (sig_usr2)
+    g_source_remove (sig_usr2);
   if (loop)
     g_main_loop_unref (loop);
   if (local_error)
@@ -99,8 +99,21 @@ main (int argc,
 {
   int success = 0;
   char *data = NULL;
+  char *line;
 
   data = read_seqpacket_message (AUTH_FD);
+
+  /* Prespawned, the arguments come first */
+  if (argc == 1)
+    {
+      line = strchr (data, '\n');
+      if (line)
+        line = strchr (line + 1, '\n');
+      if (!line)
+        errx (2, "invalid arguments");
+      memmove (data, line + 1, strlen (line + 1) + 1);
+    }
+
   if (strcmp (data, "failslow") == 0)
     {
       sleep (2);
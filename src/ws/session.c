@@ -36,6 +36,7 @@
 #include <sys/signal.h>
 #include <sys/stat.h>
 #include <sys/resource.h>
+#include <sys/syscall.h>
 #include <dirent.h>
 #include <sched.h>
 #include <utmp.h>
@@ -58,6 +59,11 @@
 #define EX 127
 #define DEFAULT_PATH "/usr/local/sbin:/usr/local/bin:/usr/sbin:/usr/bin:/sbin:/bin"
 
+/* Same as in common/cockpitunixfd.c, which we don't link against */
+#if defined(__linux__) && !defined(__NR_close_range) && !defined(__alpha__)
+#define __NR_close_range 436
+#endif
+
 static struct passwd *pwd;
 const char *rhost;
 static pid_t child;
@@ -66,6 +72,8 @@ static char *auth_delimiter = "";
 static char *auth_msg = NULL;
 static size_t auth_msg_size = 0;
 static FILE *authf = NULL;
+static char *first_message = NULL;
+static size_t first_length = 0;
 
 #if DEBUG_SESSION
 #define debug(fmt, ...) (fprintf (stderr, "cockpit-session: " fmt "\n", ##__VA_ARGS__))
@@ -79,9 +87,39 @@ read_seqpacket_message (int fd,
                         size_t *out_len)
 {
   char *buf = NULL;
+  size_t size;
   int r;
 
-  buf = realloc (buf, MAX_AUTH_BUFFER + 1);
+  /* Arrived along with the arguments, see read_prespawned_arguments() */
+  if (first_message)
+    {
+      buf = first_message;
+      first_message = NULL;
+      if (out_len)
+        *out_len = first_length;
+      return buf;
+    }
+
+  /*
+   * Wait for the message and find out how long it is without taking
+   * it, so that the buffer only needs to be allocated once.
+   */
+  for (;;)
+    {
+      r = recv (fd, NULL, 0, MSG_PEEK | MSG_TRUNC);
+      if (r < 0 && (errno == EAGAIN || errno == EINTR))
+        continue;
+      break;
+    }
+
+  if (r == 0)
+    return NULL;
+  else if (r < 0 || r > MAX_AUTH_BUFFER)
+    size = MAX_AUTH_BUFFER;
+  else
+    size = r;
+
+  buf = malloc (size + 1);
   if (!buf)
     errx (EX, "couldn't allocate memory for %s", what);
 
@@ -90,7 +128,7 @@ read_seqpacket_message (int fd,
    */
   for (;;)
     {
-      r = read (fd, buf, MAX_AUTH_BUFFER);
+      r = read (fd, buf, size);
       if (r < 0)
         {
           if (errno == EAGAIN)
@@ -109,10 +147,6 @@ read_seqpacket_message (int fd,
     return NULL;
   }
 
-  buf = realloc (buf, r + 1);
-  if (!buf)
-    errx (EX, "couldn't reallocate memory for %s", what);
-
   buf[r] = '\0';
   if (out_len)
     *out_len = r;
@@ -943,6 +977,18 @@ fdwalk (int (*cb)(void *data, int fd),
 
 #endif /* HAVE_FDWALK */
 
+static int
+close_all (int from)
+{
+#ifdef __NR_close_range
+  /* Much faster with a large fd limit and no /proc */
+  if (syscall (__NR_close_range, from, ~0U, 0) == 0)
+    return 0;
+#endif
+
+  return fdwalk (closefd, &from);
+}
+
 static int
 session (char **env)
 {
@@ -996,7 +1042,7 @@ fork_session (char **env)
       debug ("dropped privileges");
 
       from = 3;
-      if (fdwalk (closefd, &from) < 0)
+      if (close_all (from) < 0)
         {
           warnx ("couldn't close all file descirptors");
           _exit (42);
@@ -1052,6 +1098,48 @@ save_environment (void)
   env_saved[j] = NULL;
 }
 
+/*
+ * When spawned ahead of time cockpit-ws doesn't know our arguments
+ * yet, and sends "type\nrhost\n" in front of the first auth message.
+ */
+static const char *
+read_prespawned_arguments (void)
+{
+  char *message;
+  char *auth;
+  char *line;
+  size_t len;
+
+  message = read_seqpacket_message (AUTH_FD, "arguments", &len);
+  if (message == NULL)
+    {
+      debug ("cockpit-ws went away before using prespawned session");
+      exit (0);
+    }
+
+  auth = message;
+  line = memchr (message, '\n', len);
+  if (line == NULL)
+    errx (2, "invalid arguments to cockpit-session");
+  *line = '\0';
+
+  rhost = line + 1;
+  line = memchr (rhost, '\n', len - (rhost - message));
+  if (line == NULL)
+    errx (2, "invalid arguments to cockpit-session");
+  *line = '\0';
+  line++;
+
+  first_length = len - (line - message);
+  first_message = malloc (first_length + 1);
+  if (first_message == NULL)
+    errx (EX, "couldn't allocate memory for auth message");
+  memcpy (first_message, line, first_length);
+  first_message[first_length] = '\0';
+
+  return auth;
+}
+
 int
 main (int argc,
       char **argv)
@@ -1067,7 +1155,7 @@ main (int argc,
   if (isatty (0))
     errx (2, "this command is not meant to be run from the console");
 
-  if (argc != 3)
+  if (argc != 1 && argc != 3)
     errx (2, "invalid arguments to cockpit-session");
 
   /* Cleanup the umask */
@@ -1097,8 +1185,15 @@ main (int argc,
   if (flags < 0 || fcntl (AUTH_FD, F_SETFD, flags | FD_CLOEXEC))
     err (1, "couldn't set auth fd flags");
 
-  auth = argv[1];
-  rhost = argv[2];
+  if (argc == 1)
+    {
+      auth = read_prespawned_arguments ();
+    }
+  else
+    {
+      auth = argv[1];
+      rhost = argv[2];
+    }
 
   signal (SIGALRM, SIG_DFL);
   signal (SIGQUIT, SIG_DFL);
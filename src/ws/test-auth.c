@@ -155,6 +155,54 @@ test_userpass_cookie_check (Test *test,
   json_object_unref (response);
 }
 
+static void
+test_cookie_check_perf (Test *test,
+                        gconstpointer data)
+{
+  GAsyncResult *result = NULL;
+  CockpitWebService *service;
+  JsonObject *response = NULL;
+  GError *error = NULL;
+  GHashTable *headers;
+  gdouble elapsed;
+  const gint count = 100000;
+  gint i;
+
+  if (!g_test_perf ())
+    return;
+
+  headers = mock_auth_basic_header ("me", "this is the password");
+  cockpit_auth_login_async (test->auth, "/cockpit/", headers, NULL, on_ready_get_result, &result);
+  g_hash_table_unref (headers);
+
+  while (result == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  headers = web_socket_util_new_headers ();
+  response = cockpit_auth_login_finish (test->auth, result, 0, headers, &error);
+  g_object_unref (result);
+  g_assert_no_error (error);
+  g_assert (response != NULL);
+
+  include_cookie_as_if_client (headers, headers);
+
+  g_test_timer_start ();
+  for (i = 0; i < count; i++)
+    {
+      service = cockpit_auth_check_cookie (test->auth, "/cockpit", headers);
+      g_assert (service != NULL);
+      g_object_unref (service);
+    }
+  elapsed = g_test_timer_elapsed ();
+
+  g_test_minimized_result (elapsed * 1000000.0 / count,
+                           "cookie check: %.3f microseconds per request",
+                           elapsed * 1000000.0 / count);
+
+  g_hash_table_destroy (headers);
+  json_object_unref (response);
+}
+
 static void
 test_userpass_bad (Test *test,
                    gconstpointer data)
@@ -383,6 +431,93 @@ test_max_startups (Test *test,
   g_hash_table_destroy (headers_slow);
 }
 
+static void
+start_login (Test *test,
+             const gchar *authorization,
+             const gchar *remote_peer,
+             GAsyncResult **result)
+{
+  GHashTable *headers;
+
+  headers = web_socket_util_new_headers ();
+  g_hash_table_insert (headers, g_strdup ("Authorization"), g_strdup (authorization));
+  cockpit_auth_login_async (test->auth, "/cockpit", headers, remote_peer, on_ready_get_result, result);
+  g_hash_table_unref (headers);
+}
+
+static void
+finish_login_failed (Test *test,
+                     GAsyncResult **result)
+{
+  JsonObject *response;
+  GError *error = NULL;
+
+  while (*result == NULL)
+    g_main_context_iteration (NULL, TRUE);
+  response = cockpit_auth_login_finish (test->auth, *result, 0, NULL, &error);
+  g_object_unref (*result);
+  *result = NULL;
+
+  g_assert (response == NULL);
+  g_assert_cmpstr ("Authentication failed", ==, error->message);
+  g_clear_error (&error);
+}
+
+static void
+test_login_concurrency (Test *test,
+                        gconstpointer data)
+{
+  GAsyncResult *result1 = NULL;
+  GAsyncResult *result2 = NULL;
+  GAsyncResult *result3 = NULL;
+
+  test->auth->max_startups = 0;
+  test->auth->login_concurrency = 1;
+
+  start_login (test, "testscheme failslow", NULL, &result1);
+  start_login (test, "testscheme fail", NULL, &result2);
+  start_login (test, "testscheme fail", NULL, &result3);
+
+  /* Others wait rather than being dropped */
+  g_assert_cmpuint (test->auth->login_running, ==, 1);
+  g_assert_cmpuint (g_queue_get_length (test->auth->login_queue), ==, 2);
+
+  finish_login_failed (test, &result1);
+  finish_login_failed (test, &result2);
+  finish_login_failed (test, &result3);
+
+  g_assert_cmpuint (test->auth->login_running, ==, 0);
+  g_assert (g_queue_is_empty (test->auth->login_queue));
+}
+
+static void
+test_login_rate (Test *test,
+                 gconstpointer data)
+{
+  GAsyncResult *result1 = NULL;
+  GAsyncResult *result2 = NULL;
+  GAsyncResult *result3 = NULL;
+
+  test->auth->max_startups = 0;
+  test->auth->login_rate = 5;
+  test->auth->login_burst = 1;
+
+  start_login (test, "testscheme fail", "10.1.1.1", &result1);
+  start_login (test, "testscheme fail", "10.1.1.1", &result2);
+
+  /* A different peer isn't held up */
+  start_login (test, "testscheme fail", "10.2.2.2", &result3);
+
+  g_assert_cmpuint (test->auth->login_running, ==, 2);
+  g_assert_cmpuint (g_queue_get_length (test->auth->login_queue), ==, 1);
+
+  finish_login_failed (test, &result1);
+  finish_login_failed (test, &result3);
+  finish_login_failed (test, &result2);
+
+  g_assert (g_queue_is_empty (test->auth->login_queue));
+}
+
 typedef struct {
   const gchar *header;
   const gchar *error_message;
@@ -504,6 +639,40 @@ test_custom_success (Test *test,
   g_object_unref (service);
 }
 
+static guint
+prespawned_count (Test *test,
+                  const gchar *type)
+{
+  GQueue *queue = g_hash_table_lookup (test->auth->prespawned, type);
+  return queue ? g_queue_get_length (queue) : 0;
+}
+
+static void
+test_prespawn (Test *test,
+               gconstpointer data)
+{
+  /* The first login spawns its own, and prespawns for later ones */
+  g_assert_cmpuint (prespawned_count (test, "prespawnscheme"), ==, 0);
+  test_custom_success (test, data);
+
+  while (prespawned_count (test, "prespawnscheme") < 2)
+    g_main_context_iteration (NULL, TRUE);
+
+  test_custom_success (test, data);
+  g_assert_cmpuint (prespawned_count (test, "prespawnscheme"), ==, 1);
+
+  while (prespawned_count (test, "prespawnscheme") < 2)
+    g_main_context_iteration (NULL, TRUE);
+
+  test_custom_success (test, data);
+}
+
+static const SuccessFixture fixture_prespawn = {
+  .warning = NULL,
+  .data = NULL,
+  .header = "prespawnscheme success"
+};
+
 static const SuccessFixture fixture_no_data = {
   .warning = NULL,
   .data = NULL,
@@ -997,6 +1166,7 @@ main (int argc,
   cockpit_test_init (&argc, &argv);
 
   g_test_add ("/auth/userpass-header-check", Test, NULL, setup, test_userpass_cookie_check, teardown);
+  g_test_add ("/auth/cookie-check-perf", Test, NULL, setup, test_cookie_check_perf, teardown);
   g_test_add ("/auth/userpass-bad", Test, NULL, setup, test_userpass_bad, teardown);
   g_test_add ("/auth/userpass-emptypass", Test, NULL, setup, test_userpass_emptypass, teardown);
   g_test_add ("/auth/headers-bad", Test, NULL, setup, test_headers_bad, teardown);
@@ -1004,6 +1174,8 @@ main (int argc,
   g_test_add ("/auth/process-timeout", Test, NULL, setup, test_process_timeout, teardown);
   g_test_add ("/auth/custom-success", Test, &fixture_no_data,
               setup_normal, test_custom_success, teardown_normal);
+  g_test_add ("/auth/custom-prespawn", Test, &fixture_prespawn,
+              setup_normal, test_prespawn, teardown_normal);
   g_test_add ("/auth/custom-success-bad-data", Test, &fixture_bad_data,
               setup_normal, test_custom_success, teardown_normal);
   g_test_add ("/auth/custom-success-with-data", Test, &fixture_data,
@@ -1034,6 +1206,10 @@ main (int argc,
               setup_normal, test_multi_step_fail, teardown_normal);
   g_test_add ("/auth/fail-multi-step-timeout", Test, &fixture_fail_step_timeout,
               setup_normal, test_multi_step_fail, teardown_normal);
+  g_test_add ("/auth/login-concurrency", Test, NULL,
+              setup_normal, test_login_concurrency, teardown_normal);
+  g_test_add ("/auth/login-rate", Test, NULL,
+              setup_normal, test_login_rate, teardown_normal);
   g_test_add ("/auth/max-startups", Test, NULL,
               setup_normal, test_max_startups, teardown_normal);
   g_test_add ("/auth/max-startups-normal", Test, &fixture_normal,
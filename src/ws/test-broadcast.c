@@ -0,0 +1,214 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2016 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitbroadcast.h"
+
+#include "common/cockpitjson.h"
+#include "common/cockpittest.h"
+
+#include <string.h>
+
+typedef struct {
+  CockpitBroadcast *broadcast;
+  GQueue sent;
+  GQueue control;
+} TestCase;
+
+static void
+on_send (const gchar *channel,
+         GBytes *payload,
+         gpointer user_data)
+{
+  TestCase *tc = user_data;
+
+  if (channel)
+    {
+      g_assert_cmpstr (channel, ==, "bc");
+      g_queue_push_tail (&tc->sent, g_bytes_ref (payload));
+    }
+  else
+    {
+      g_queue_push_tail (&tc->control, g_bytes_ref (payload));
+    }
+}
+
+static void
+setup (TestCase *tc,
+       gconstpointer data)
+{
+  const gchar *hosts[] = { "one", "two", "three", NULL };
+
+  g_queue_init (&tc->sent);
+  g_queue_init (&tc->control);
+  tc->broadcast = cockpit_broadcast_new ("bc", hosts, 2, on_send, tc);
+}
+
+static void
+teardown (TestCase *tc,
+          gconstpointer data)
+{
+  GBytes *bytes;
+
+  cockpit_broadcast_free (tc->broadcast);
+
+  while ((bytes = g_queue_pop_head (&tc->sent)))
+    g_bytes_unref (bytes);
+  while ((bytes = g_queue_pop_head (&tc->control)))
+    g_bytes_unref (bytes);
+
+  cockpit_assert_expected ();
+}
+
+static void
+recv_string (TestCase *tc,
+             guint host,
+             const gchar *string)
+{
+  GBytes *bytes;
+
+  bytes = g_bytes_new (string, strlen (string));
+  cockpit_broadcast_recv (tc->broadcast, host, bytes);
+  g_bytes_unref (bytes);
+}
+
+static gboolean
+close_json (TestCase *tc,
+            guint host,
+            const gchar *json)
+{
+  JsonObject *options;
+  gboolean ret;
+
+  options = cockpit_json_parse_object (json, -1, NULL);
+  g_assert (options != NULL);
+  ret = cockpit_broadcast_close (tc->broadcast, host, options);
+  json_object_unref (options);
+
+  return ret;
+}
+
+static void
+assert_sent (TestCase *tc,
+             const gchar *expected)
+{
+  GBytes *bytes;
+
+  bytes = g_queue_pop_head (&tc->sent);
+  g_assert (bytes != NULL);
+  cockpit_assert_bytes_eq (bytes, expected, -1);
+  g_bytes_unref (bytes);
+}
+
+static void
+test_concurrency (TestCase *tc,
+                  gconstpointer data)
+{
+  /* Only two at a time */
+  g_assert_cmpint (cockpit_broadcast_next (tc->broadcast), ==, 0);
+  g_assert_cmpint (cockpit_broadcast_next (tc->broadcast), ==, 1);
+  g_assert_cmpint (cockpit_broadcast_next (tc->broadcast), ==, -1);
+  g_assert (cockpit_broadcast_pending (tc->broadcast));
+
+  g_assert (!close_json (tc, 1, "{\"command\":\"close\",\"channel\":\"x\"}"));
+  g_assert_cmpint (cockpit_broadcast_next (tc->broadcast), ==, 2);
+  g_assert_cmpint (cockpit_broadcast_next (tc->broadcast), ==, -1);
+  g_assert (!cockpit_broadcast_pending (tc->broadcast));
+
+  g_assert (!close_json (tc, 0, "{}"));
+  g_assert (close_json (tc, 2, "{}"));
+  assert_sent (tc, "[{\"host\":\"two\",\"close\":{}},{\"host\":\"one\",\"close\":{}},"
+                   "{\"host\":\"three\",\"close\":{}}]");
+  g_assert (g_queue_is_empty (&tc->sent));
+}
+
+static void
+test_batch (TestCase *tc,
+            gconstpointer data)
+{
+  JsonObject *object;
+  GBytes *bytes;
+
+  g_assert_cmpint (cockpit_broadcast_next (tc->broadcast), ==, 0);
+  g_assert_cmpint (cockpit_broadcast_next (tc->broadcast), ==, 1);
+
+  /* Ready with the first host */
+  cockpit_broadcast_ready (tc->broadcast, 1);
+  bytes = g_queue_pop_head (&tc->control);
+  object = cockpit_json_parse_bytes (bytes, NULL);
+  cockpit_assert_json_eq (object, "{\"command\":\"ready\",\"channel\":\"bc\"}");
+  json_object_unref (object);
+  g_bytes_unref (bytes);
+  cockpit_broadcast_ready (tc->broadcast, 0);
+  g_assert (g_queue_is_empty (&tc->control));
+
+  /* Held back until the latency passes */
+  recv_string (tc, 0, "one\n");
+  recv_string (tc, 1, "\"two\"");
+  g_assert (g_queue_is_empty (&tc->sent));
+  while (g_queue_is_empty (&tc->sent))
+    g_main_context_iteration (NULL, TRUE);
+  assert_sent (tc, "[{\"host\":\"one\",\"data\":\"one\\n\"},{\"host\":\"two\",\"data\":\"\\\"two\\\"\"}]");
+
+  /* The close goes after the data, with the fields of the close message */
+  recv_string (tc, 1, "more");
+  g_assert (!close_json (tc, 1, "{\"command\":\"close\",\"channel\":\"x\",\"exit-status\":3}"));
+  while (g_queue_is_empty (&tc->sent))
+    g_main_context_iteration (NULL, TRUE);
+  assert_sent (tc, "[{\"host\":\"two\",\"data\":\"more\"},{\"host\":\"two\",\"close\":{\"exit-status\":3}}]");
+
+  /* Nothing from a closed host */
+  recv_string (tc, 1, "late");
+  g_assert (g_queue_is_empty (&tc->sent));
+}
+
+static void
+test_batch_size (TestCase *tc,
+                 gconstpointer data)
+{
+  gsize previous = cockpit_broadcast_batch_size;
+
+  cockpit_broadcast_batch_size = 40;
+  g_assert_cmpint (cockpit_broadcast_next (tc->broadcast), ==, 0);
+
+  /* A full batch goes out right away */
+  recv_string (tc, 0, "abc");
+  g_assert (g_queue_is_empty (&tc->sent));
+  recv_string (tc, 0, "def");
+  assert_sent (tc, "[{\"host\":\"one\",\"data\":\"abc\"},{\"host\":\"one\",\"data\":\"def\"}]");
+
+  cockpit_broadcast_batch_size = previous;
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  cockpit_test_init (&argc, &argv);
+
+  g_test_add ("/broadcast/concurrency", TestCase, NULL,
+              setup, test_concurrency, teardown);
+  g_test_add ("/broadcast/batch", TestCase, NULL,
+              setup, test_batch, teardown);
+  g_test_add ("/broadcast/batch-size", TestCase, NULL,
+              setup, test_batch_size, teardown);
+
+  return g_test_run ();
+}
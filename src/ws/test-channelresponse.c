@@ -434,6 +434,68 @@ test_resource_checksum (TestResourceCase *tc,
   g_object_unref (response);
 }
 
+static void
+test_resource_checksum_cached (TestResourceCase *tc,
+                               gconstpointer data)
+{
+  CockpitWebResponse *response;
+  GInputStream *input;
+  GOutputStream *output;
+  GError *error = NULL;
+  GIOStream *io;
+  GBytes *bytes;
+
+  g_assert (data == &checksum_fixture);
+
+  request_checksum (tc);
+
+  /* The first time through the bridge */
+  input = g_memory_input_stream_new_from_data ("", 0, NULL);
+  output = g_memory_output_stream_new (NULL, 0, g_realloc, g_free);
+  io = mock_io_stream_new (input, output);
+  g_object_unref (input);
+
+  response = cockpit_web_response_new (io, "/unused", NULL, NULL);
+  cockpit_channel_response_serve (tc->service, tc->headers, response,
+                                "$386257ed81a663cdd7ee12633056dee18d60ddca",
+                                "/test/sub/file.ext");
+
+  while (cockpit_web_response_get_state (response) != COCKPIT_WEB_RESPONSE_SENT)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_object_unref (response);
+  g_object_unref (output);
+  g_object_unref (io);
+
+  /* The second time it's complete right away, without a channel */
+  response = cockpit_web_response_new (tc->io, "/unused", NULL, NULL);
+  cockpit_channel_response_serve (tc->service, tc->headers, response,
+                                "$386257ed81a663cdd7ee12633056dee18d60ddca",
+                                "/test/sub/file.ext");
+
+  g_assert_cmpint (cockpit_web_response_get_state (response), >=, COCKPIT_WEB_RESPONSE_COMPLETE);
+
+  while (cockpit_web_response_get_state (response) != COCKPIT_WEB_RESPONSE_SENT)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_output_stream_close (G_OUTPUT_STREAM (tc->output), NULL, &error);
+  g_assert_no_error (error);
+
+  bytes = g_memory_output_stream_steal_as_bytes (tc->output);
+  cockpit_assert_bytes_eq (bytes,
+                           "HTTP/1.1 200 OK\r\n"
+                           "ETag: \"$386257ed81a663cdd7ee12633056dee18d60ddca-c\"\r\n"
+                           "Transfer-Encoding: chunked\r\n"
+                           "Cache-Control: max-age=31556926, public\r\n"
+                           "\r\n"
+                           "32\r\n"
+                           "These are the contents of file.ext\nOh marmalaaade\n"
+                           "\r\n"
+                           "0\r\n\r\n", -1);
+  g_bytes_unref (bytes);
+  g_object_unref (response);
+}
+
 static void
 test_resource_redirect_checksum (TestResourceCase *tc,
                                  gconstpointer data)
@@ -787,6 +849,60 @@ test_resource_gzip_encoding (TestResourceCase *tc,
   g_object_unref (response);
 }
 
+static void
+test_upload_echo (TestResourceCase *tc,
+                  gconstpointer data)
+{
+  CockpitWebResponse *response;
+  GOutputStream *output;
+  GInputStream *input;
+  GByteArray *buffer;
+  JsonObject *open;
+  GIOStream *io;
+  GBytes *bytes;
+  gchar *body;
+  gchar *string;
+
+  /* Part of the body was read along with the headers, the rest is still to come */
+  input = g_memory_input_stream_new_from_data ("the rest of the body", -1, NULL);
+  output = g_memory_output_stream_new (NULL, 0, g_realloc, g_free);
+  io = mock_io_stream_new (input, output);
+  g_object_unref (input);
+
+  buffer = g_byte_array_new ();
+  g_byte_array_append (buffer, (const guint8 *)"first part and ", 15);
+  g_hash_table_insert (tc->headers, g_strdup ("Content-Length"), g_strdup ("35"));
+
+  open = json_object_new ();
+  json_object_set_string_member (open, "payload", "echo");
+  json_object_set_object_member (open, "external", json_object_new ());
+
+  response = cockpit_web_response_new (io, "/unused", NULL, NULL);
+  cockpit_channel_response_upload (tc->service, "POST", tc->headers, response, io, buffer, open);
+
+  while (cockpit_web_response_get_state (response) != COCKPIT_WEB_RESPONSE_SENT)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_output_stream_close (output, NULL, NULL);
+  bytes = g_memory_output_stream_steal_as_bytes (G_MEMORY_OUTPUT_STREAM (output));
+  string = g_strndup (g_bytes_get_data (bytes, NULL), g_bytes_get_size (bytes));
+
+  g_assert (g_str_has_prefix (string, "HTTP/1.1 200 OK\r\n"));
+  g_assert (strstr (string, "Content-Type: application/octet-stream\r\n") != NULL);
+
+  /* The echo comes back in however many chunks, but all of it, in order */
+  body = strstr (string, "first part and ");
+  g_assert (body != NULL);
+  g_assert (strstr (body, "the rest of the body") != NULL);
+
+  g_free (string);
+  g_bytes_unref (bytes);
+  json_object_unref (open);
+  g_byte_array_unref (buffer);
+  g_object_unref (response);
+  g_object_unref (output);
+  g_object_unref (io);
+}
 
 static gboolean
 on_hack_raise_sigchld (gpointer user_data)
@@ -829,6 +945,8 @@ main (int argc,
               setup_resource, test_resource_failure, teardown_resource);
   g_test_add ("/web-channel/resource/checksum", TestResourceCase, &checksum_fixture,
               setup_resource, test_resource_checksum, teardown_resource);
+  g_test_add ("/web-channel/resource/checksum-cached", TestResourceCase, &checksum_fixture,
+              setup_resource, test_resource_checksum_cached, teardown_resource);
   g_test_add ("/web-channel/resource/redirect-checksum", TestResourceCase, &checksum_fixture,
               setup_resource, test_resource_redirect_checksum, teardown_resource);
   g_test_add ("/web-channel/resource/not-modified", TestResourceCase, &checksum_fixture,
@@ -849,5 +967,8 @@ main (int argc,
   g_test_add ("/web-channel/resource/gzip-encoding", TestResourceCase, NULL,
               setup_resource, test_resource_gzip_encoding, teardown_resource);
 
+  g_test_add ("/web-channel/upload/echo", TestResourceCase, NULL,
+              setup_resource, test_upload_echo, teardown_resource);
+
   return g_test_run ();
 }
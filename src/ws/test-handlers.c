@@ -25,10 +25,13 @@
 #include "cockpitws.h"
 
 #include "common/cockpitconf.h"
+#include "common/cockpitstats.h"
 #include "common/cockpittest.h"
 #include "common/mock-io-stream.h"
 #include "common/cockpitwebserver.h"
 
+#include "websocket/websocket.h"
+
 #include <glib.h>
 
 #include <limits.h>
@@ -360,6 +363,36 @@ test_ping (Test *test,
                            "\"cockpit\"*");
 }
 
+static void
+test_metrics (Test *test,
+              gconstpointer path)
+{
+  const gchar *output;
+  gboolean ret;
+
+  cockpit_stats_add (cockpit_stats_lookup ("test\"payload"), COCKPIT_STAT_CHANNEL_OPEN, 2);
+  cockpit_stats_add (cockpit_stats_lookup_group ("test-group"), COCKPIT_STAT_GROUP_QUEUED, 7);
+  cockpit_stats_time (NULL, COCKPIT_STAT_WS_LOGIN_LATENCY, 5000);
+
+  ret = cockpit_handler_metrics (test->server, path, test->headers, test->response, &test->data);
+
+  g_assert (ret == TRUE);
+
+  output = output_as_string (test);
+  cockpit_assert_strmatch (output,
+                           "HTTP/1.1 200 OK\r\n*"
+                           "Content-Type: text/plain; version=0.0.4\r\n*"
+                           "# TYPE cockpit_ws_sessions gauge\n*"
+                           "# TYPE cockpit_ws_resident_memory_bytes gauge\n*"
+                           "cockpit_ws_login_seconds_bucket{le=\"0.01\"} 1\n*"
+                           "cockpit_ws_login_seconds_bucket{le=\"+Inf\"} 1\n"
+                           "cockpit_ws_login_seconds_sum 0.005000\n"
+                           "cockpit_ws_login_seconds_count 1\n*"
+                           "cockpit_ws_channels{payload=\"test\\\"payload\"} 2\n*"
+                           "# TYPE cockpit_ws_group_queued_bytes gauge\n*"
+                           "cockpit_ws_group_queued_bytes{group=\"test-group\"} 7\n*");
+}
+
 typedef struct {
   const gchar *path;
   const gchar *auth;
@@ -487,6 +520,59 @@ test_resource_checksum (Test *test,
   test_default (test, data);
 }
 
+static gchar *
+serve_default (Test *test,
+               const gchar *path)
+{
+  CockpitWebResponse *response;
+  gboolean response_done = FALSE;
+  GInputStream *input;
+  GOutputStream *output;
+  GIOStream *io;
+  gchar *string;
+
+  output = g_memory_output_stream_new (NULL, 0, g_realloc, g_free);
+  input = g_memory_input_stream_new ();
+  io = mock_io_stream_new (input, output);
+  response = cockpit_web_response_new (io, path, NULL, NULL);
+  g_signal_connect (response, "done", G_CALLBACK (on_web_response_done_set_flag), &response_done);
+  g_assert (cockpit_handler_default (test->server, path, test->headers, response, &test->data));
+
+  while (!response_done)
+    g_main_context_iteration (NULL, TRUE);
+
+  string = g_strndup (g_memory_output_stream_get_data (G_MEMORY_OUTPUT_STREAM (output)),
+                      g_memory_output_stream_get_data_size (G_MEMORY_OUTPUT_STREAM (output)));
+
+  g_object_unref (output);
+  g_object_unref (input);
+  g_object_unref (io);
+  g_object_unref (response);
+  return string;
+}
+
+static void
+test_login_cached (Test *test,
+                   gconstpointer data)
+{
+  gchar *first;
+  gchar *second;
+
+  /* The second one comes from memory, and must be the same */
+  first = serve_default (test, "/system/host");
+  second = serve_default (test, "/system/host");
+
+  cockpit_assert_strmatch (first, "HTTP/1.1 200*"
+                           "Content-Security-Policy: default-src 'self' 'unsafe-inline';*"
+                           "Content-Length: *"
+                           "<head>*var environment = {*"
+                           "show_login()*");
+  g_assert_cmpstr (first, ==, second);
+
+  g_free (first);
+  g_free (second);
+}
+
 
 static const DefaultFixture fixture_shell_index = {
   .path = "/",
@@ -729,6 +815,128 @@ test_socket_unauthenticated (void)
   g_object_unref (io_b);
 }
 
+static GHashTable *
+read_client_handshake (GIOStream *io)
+{
+  GPollableInputStream *input;
+  GHashTable *headers = NULL;
+  GError *error = NULL;
+  GByteArray *buffer;
+  gchar data[1024];
+  gssize offset;
+  gssize ret;
+
+  /* Parse the request headers like the web server does */
+  input = G_POLLABLE_INPUT_STREAM (g_io_stream_get_input_stream (io));
+  buffer = g_byte_array_new ();
+  while (!headers)
+    {
+      ret = g_pollable_input_stream_read_nonblocking (input, data, sizeof (data), NULL, &error);
+      if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK))
+        {
+          g_clear_error (&error);
+          g_main_context_iteration (NULL, FALSE);
+          continue;
+        }
+
+      g_assert_no_error (error);
+      g_assert_cmpint (ret, >, 0);
+      g_byte_array_append (buffer, (guint8 *)data, ret);
+
+      offset = web_socket_util_parse_req_line ((const gchar *)buffer->data, buffer->len, NULL, NULL);
+      g_assert_cmpint (offset, >=, 0);
+      if (offset > 0)
+        {
+          g_assert_cmpint (web_socket_util_parse_headers ((const gchar *)buffer->data + offset,
+                                                          buffer->len - offset, &headers), >=, 0);
+        }
+    }
+
+  g_byte_array_unref (buffer);
+  return headers;
+}
+
+static void
+test_socket_busy (Test *test,
+                  gconstpointer path)
+{
+  WebSocketConnection *client;
+  GAsyncResult *result = NULL;
+  GBytes *received = NULL;
+  GIOStream *io_a, *io_b;
+  GError *error = NULL;
+  GHashTable *headers;
+  JsonObject *response;
+  GBytes *payload;
+  const gchar *problem;
+  const gchar *command;
+  const gchar *unused;
+  gchar *channel;
+  JsonObject *options;
+  gint64 retry;
+
+  /* Log in, for an authenticated socket */
+  headers = mock_auth_basic_header (g_get_user_name (), PASSWORD);
+  cockpit_auth_login_async (test->auth, path, headers, NULL, on_ready_get_result, &result);
+  g_hash_table_unref (headers);
+  while (result == NULL)
+    g_main_context_iteration (NULL, TRUE);
+  response = cockpit_auth_login_finish (test->auth, result, 0, test->headers, &error);
+  g_object_unref (result);
+  g_assert_no_error (error);
+  json_object_unref (response);
+
+  /* No tokens left in the bucket */
+  test->data.socket_tokens = 0;
+  test->data.socket_refilled = g_get_monotonic_time ();
+
+  make_io_streams (&io_a, &io_b);
+
+  client = g_object_new (WEB_SOCKET_TYPE_CLIENT,
+                         "url", "ws://127.0.0.1/cockpit/socket",
+                         "origin", "http://127.0.0.1",
+                         "io-stream", io_a,
+                         NULL);
+
+  g_signal_connect (client, "error", G_CALLBACK (on_error_not_reached), NULL);
+  g_signal_connect (client, "message", G_CALLBACK (on_message_get_bytes), &received);
+
+  cockpit_ws_default_host_header = "127.0.0.1";
+
+  headers = read_client_handshake (io_b);
+  include_cookie_as_if_client (test->headers, headers);
+
+  g_assert (cockpit_handler_socket (test->server, "/cockpit/socket", io_b, headers, NULL, &test->data));
+  g_hash_table_unref (headers);
+
+  /* Told to come back later, and closed */
+  while (web_socket_connection_get_ready_state (client) != WEB_SOCKET_STATE_CLOSED)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert (received != NULL);
+  payload = cockpit_transport_parse_frame (received, &channel);
+  g_assert (payload != NULL);
+  g_assert (channel == NULL);
+  g_bytes_unref (received);
+
+  g_assert (cockpit_transport_parse_command (payload, &command, &unused, &options));
+  g_bytes_unref (payload);
+
+  g_assert_cmpstr (command, ==, "init");
+  g_assert (cockpit_json_get_string (options, "problem", NULL, &problem));
+  g_assert_cmpstr (problem, ==, "busy");
+  g_assert (cockpit_json_get_int (options, "retry", 0, &retry));
+  g_assert_cmpint (retry, >=, 1);
+  json_object_unref (options);
+
+  g_object_unref (client);
+
+  while (g_main_context_iteration (NULL, FALSE));
+
+  g_object_unref (io_a);
+  g_object_unref (io_b);
+}
+
 int
 main (int argc,
       char *argv[])
@@ -753,6 +961,8 @@ main (int argc,
 
   g_test_add ("/handlers/ping", Test, "/ping",
               setup, test_ping, teardown);
+  g_test_add ("/handlers/metrics", Test, "/metrics",
+              setup, test_metrics, teardown);
 
   g_test_add ("/handlers/shell/index", Test, &fixture_shell_index,
               setup_default, test_default, teardown_default);
@@ -770,6 +980,8 @@ main (int argc,
               setup_default, test_default, teardown_default);
   g_test_add ("/handlers/shell/login", Test, &fixture_shell_login,
               setup_default, test_default, teardown_default);
+  g_test_add ("/handlers/shell/login-cached", Test, &fixture_shell_login,
+              setup_default, test_login_cached, teardown_default);
 
   g_test_add ("/handlers/resource/checksum", Test, &fixture_resource_checksum,
               setup_default, test_resource_checksum, teardown_default);
@@ -800,6 +1012,8 @@ main (int argc,
               setup, test_favicon_ico, teardown);
 
   g_test_add_func ("/handlers/noauth", test_socket_unauthenticated);
+  g_test_add ("/handlers/socket-busy", Test, "/cockpit/login",
+              setup, test_socket_busy, teardown);
 
   return g_test_run ();
 }
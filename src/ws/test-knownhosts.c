@@ -0,0 +1,150 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2015 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "ws/cockpitknownhosts.h"
+
+#include "common/cockpittest.h"
+
+#include <glib/gstdio.h>
+
+#include <utime.h>
+
+typedef struct {
+  gchar *directory;
+  gchar *filename;
+} TestCase;
+
+static void
+setup (TestCase *tc,
+       gconstpointer data)
+{
+  tc->directory = g_dir_make_tmp ("cockpit-known-hosts.XXXXXX", NULL);
+  g_assert (tc->directory != NULL);
+  tc->filename = g_build_filename (tc->directory, "known_hosts", NULL);
+}
+
+static void
+teardown (TestCase *tc,
+          gconstpointer data)
+{
+  cockpit_known_hosts_cleanup ();
+  g_unlink (tc->filename);
+  g_rmdir (tc->directory);
+  g_free (tc->filename);
+  g_free (tc->directory);
+
+  cockpit_assert_expected ();
+}
+
+static void
+write_known_hosts (TestCase *tc,
+                   const gchar *contents,
+                   time_t mtime)
+{
+  struct utimbuf times = { mtime, mtime };
+
+  g_assert (g_file_set_contents (tc->filename, contents, -1, NULL));
+  g_assert_cmpint (utime (tc->filename, &times), ==, 0);
+}
+
+static void
+test_exact (TestCase *tc,
+            gconstpointer data)
+{
+  write_known_hosts (tc,
+                     "# comment\n"
+                     "\n"
+                     "server1,10.0.0.1 ssh-rsa AAAAone\n"
+                     "[server2]:2222 ssh-rsa AAAAtwo\n",
+                     1000);
+
+  g_assert (cockpit_known_hosts_contains (tc->filename, "server1 ssh-rsa AAAAone"));
+  g_assert (cockpit_known_hosts_contains (tc->filename, "10.0.0.1 ssh-rsa AAAAone"));
+  g_assert (cockpit_known_hosts_contains (tc->filename, "SERVER1 ssh-rsa AAAAone"));
+  g_assert (cockpit_known_hosts_contains (tc->filename, "[server2]:2222 ssh-rsa AAAAtwo"));
+
+  g_assert (!cockpit_known_hosts_contains (tc->filename, "server1 ssh-rsa AAAAtwo"));
+  g_assert (!cockpit_known_hosts_contains (tc->filename, "server2 ssh-rsa AAAAtwo"));
+  g_assert (!cockpit_known_hosts_contains (tc->filename, "server3 ssh-rsa AAAAone"));
+  g_assert (!cockpit_known_hosts_contains (tc->filename, "bad"));
+}
+
+static void
+test_patterns (TestCase *tc,
+               gconstpointer data)
+{
+  write_known_hosts (tc,
+                     "[localhost]:*,[127.0.0.1]:* ssh-rsa AAAAlocal\n"
+                     "*.example.com,!bad.example.com ssh-dss AAAAexample\n",
+                     1000);
+
+  g_assert (cockpit_known_hosts_contains (tc->filename, "[127.0.0.1]:2222 ssh-rsa AAAAlocal"));
+  g_assert (cockpit_known_hosts_contains (tc->filename, "host.example.com ssh-dss AAAAexample"));
+  g_assert (!cockpit_known_hosts_contains (tc->filename, "bad.example.com ssh-dss AAAAexample"));
+  g_assert (!cockpit_known_hosts_contains (tc->filename, "example.org ssh-dss AAAAexample"));
+}
+
+static void
+test_markers (TestCase *tc,
+              gconstpointer data)
+{
+  write_known_hosts (tc,
+                     "server1 ssh-rsa AAAAone\n"
+                     "@revoked * ssh-rsa AAAAone\n",
+                     1000);
+
+  /* Not understood, left to libssh */
+  g_assert (!cockpit_known_hosts_contains (tc->filename, "server1 ssh-rsa AAAAone"));
+}
+
+static void
+test_reload (TestCase *tc,
+             gconstpointer data)
+{
+  write_known_hosts (tc, "server1 ssh-rsa AAAAone\n", 1000);
+  g_assert (cockpit_known_hosts_contains (tc->filename, "server1 ssh-rsa AAAAone"));
+  g_assert (!cockpit_known_hosts_contains (tc->filename, "server1 ssh-rsa AAAAtwo"));
+
+  write_known_hosts (tc, "server1 ssh-rsa AAAAtwo\n", 2000);
+  g_assert (!cockpit_known_hosts_contains (tc->filename, "server1 ssh-rsa AAAAone"));
+  g_assert (cockpit_known_hosts_contains (tc->filename, "server1 ssh-rsa AAAAtwo"));
+
+  g_unlink (tc->filename);
+  g_assert (!cockpit_known_hosts_contains (tc->filename, "server1 ssh-rsa AAAAtwo"));
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  cockpit_test_init (&argc, &argv);
+
+  g_test_add ("/known-hosts/exact", TestCase, NULL,
+              setup, test_exact, teardown);
+  g_test_add ("/known-hosts/patterns", TestCase, NULL,
+              setup, test_patterns, teardown);
+  g_test_add ("/known-hosts/markers", TestCase, NULL,
+              setup, test_markers, teardown);
+  g_test_add ("/known-hosts/reload", TestCase, NULL,
+              setup, test_reload, teardown);
+
+  return g_test_run ();
+}
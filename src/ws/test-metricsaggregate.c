@@ -0,0 +1,272 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2016 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitmetricsaggregate.h"
+
+#include "common/cockpitjson.h"
+#include "common/cockpittest.h"
+
+#include <string.h>
+
+typedef struct {
+  CockpitMetricsAggregate *aggregate;
+  GQueue sent;
+  GQueue control;
+} TestCase;
+
+static void
+on_send (const gchar *channel,
+         GBytes *payload,
+         gpointer user_data)
+{
+  TestCase *tc = user_data;
+
+  if (channel)
+    {
+      g_assert_cmpstr (channel, ==, "agg");
+      g_queue_push_tail (&tc->sent, g_bytes_ref (payload));
+    }
+  else
+    {
+      g_queue_push_tail (&tc->control, g_bytes_ref (payload));
+    }
+}
+
+static void
+setup (TestCase *tc,
+       gconstpointer data)
+{
+  const gchar *hosts[] = { "one", "two", NULL };
+
+  g_queue_init (&tc->sent);
+  g_queue_init (&tc->control);
+  tc->aggregate = cockpit_metrics_aggregate_new ("agg", hosts, on_send, tc);
+}
+
+static void
+teardown (TestCase *tc,
+          gconstpointer data)
+{
+  GBytes *bytes;
+
+  cockpit_metrics_aggregate_free (tc->aggregate);
+
+  while ((bytes = g_queue_pop_head (&tc->sent)))
+    g_bytes_unref (bytes);
+  while ((bytes = g_queue_pop_head (&tc->control)))
+    g_bytes_unref (bytes);
+
+  cockpit_assert_expected ();
+}
+
+static gboolean
+recv_string (TestCase *tc,
+             guint host,
+             const gchar *string)
+{
+  GBytes *bytes;
+  gboolean ret;
+
+  bytes = g_bytes_new (string, strlen (string));
+  ret = cockpit_metrics_aggregate_recv (tc->aggregate, host, bytes);
+  g_bytes_unref (bytes);
+
+  return ret;
+}
+
+static void
+assert_sent (TestCase *tc,
+             const gchar *expected)
+{
+  GBytes *bytes;
+
+  bytes = g_queue_pop_head (&tc->sent);
+  g_assert (bytes != NULL);
+  cockpit_assert_bytes_eq (bytes, expected, -1);
+  g_bytes_unref (bytes);
+}
+
+static void
+assert_sent_json (TestCase *tc,
+                  const gchar *expected)
+{
+  JsonObject *object;
+  GBytes *bytes;
+
+  bytes = g_queue_pop_head (&tc->sent);
+  g_assert (bytes != NULL);
+  object = cockpit_json_parse_bytes (bytes, NULL);
+  g_assert (object != NULL);
+  cockpit_assert_json_eq (object, expected);
+  json_object_unref (object);
+  g_bytes_unref (bytes);
+}
+
+static void
+send_metas (TestCase *tc)
+{
+  g_assert (recv_string (tc, 0, "{\"timestamp\":10000,\"interval\":100,\"metrics\":[]}"));
+  assert_sent_json (tc, "{\"timestamp\":10000,\"interval\":100,\"metrics\":[],\"host\":\"one\"}");
+  g_assert (recv_string (tc, 1, "{\"timestamp\":10000,\"interval\":100,\"metrics\":[]}"));
+  assert_sent_json (tc, "{\"timestamp\":10000,\"interval\":100,\"metrics\":[],\"host\":\"two\"}");
+}
+
+static void
+test_combine (TestCase *tc,
+              gconstpointer data)
+{
+  send_metas (tc);
+
+  /* Nothing goes out until both hosts have sent the same time */
+  g_assert (recv_string (tc, 0, "[[1,[2,3]]]"));
+  g_assert (g_queue_is_empty (&tc->sent));
+  g_assert (recv_string (tc, 1, "[[4,[]]]"));
+  assert_sent (tc, "[[[1,[2,3]]],[[4,[]]]]");
+
+  /* Several points from one host stay together */
+  g_assert (recv_string (tc, 1, "[[5],[null]]"));
+  g_assert (recv_string (tc, 0, "[[6],[7]]"));
+  assert_sent (tc, "[[[6],[7]],[[5],[null]]]");
+
+  g_assert (g_queue_is_empty (&tc->sent));
+}
+
+static void
+test_late (TestCase *tc,
+           gconstpointer data)
+{
+  send_metas (tc);
+
+  /* The second host is late, so the first goes out alone */
+  g_assert (recv_string (tc, 0, "[[1]]"));
+  while (g_queue_is_empty (&tc->sent))
+    g_main_context_iteration (NULL, TRUE);
+  assert_sent (tc, "[[[1]],[]]");
+
+  /* And then the late one catches up on its own */
+  g_assert (recv_string (tc, 1, "[[2]]"));
+  assert_sent (tc, "[[],[[2]]]");
+
+  /* Back in step */
+  g_assert (recv_string (tc, 1, "[[3]]"));
+  g_assert (recv_string (tc, 0, "[[4]]"));
+  assert_sent (tc, "[[[4]],[[3]]]");
+}
+
+static void
+test_meta_flushes (TestCase *tc,
+                   gconstpointer data)
+{
+  send_metas (tc);
+
+  g_assert (recv_string (tc, 0, "[[1]]"));
+  g_assert (recv_string (tc, 1, "{\"timestamp\":10000,\"interval\":100,\"metrics\":[]}"));
+  assert_sent (tc, "[[[1]],[]]");
+  assert_sent_json (tc, "{\"timestamp\":10000,\"interval\":100,\"metrics\":[],\"host\":\"two\"}");
+}
+
+static void
+test_ready_close (TestCase *tc,
+                  gconstpointer data)
+{
+  JsonObject *object;
+  GBytes *bytes;
+
+  send_metas (tc);
+
+  cockpit_metrics_aggregate_ready (tc->aggregate, 0);
+  g_assert (g_queue_is_empty (&tc->control));
+  cockpit_metrics_aggregate_ready (tc->aggregate, 1);
+  bytes = g_queue_pop_head (&tc->control);
+  object = cockpit_json_parse_bytes (bytes, NULL);
+  cockpit_assert_json_eq (object, "{\"command\":\"ready\",\"channel\":\"agg\"}");
+  json_object_unref (object);
+  g_bytes_unref (bytes);
+
+  /* What the closed host sent goes out before it's reported */
+  g_assert (recv_string (tc, 0, "[[1]]"));
+  g_assert (!cockpit_metrics_aggregate_close (tc->aggregate, 0, "no-host"));
+  assert_sent (tc, "[[[1]],[]]");
+  assert_sent_json (tc, "{\"host\":\"one\",\"problem\":\"no-host\"}");
+
+  /* Closed hosts aren't waited for */
+  g_assert (recv_string (tc, 1, "[[2]]"));
+  assert_sent (tc, "[[],[[2]]]");
+
+  g_assert (cockpit_metrics_aggregate_close (tc->aggregate, 1, NULL));
+  g_assert_cmpstr (cockpit_metrics_aggregate_get_problem (tc->aggregate), ==, NULL);
+  g_assert (g_queue_is_empty (&tc->sent));
+  g_assert (g_queue_is_empty (&tc->control));
+}
+
+static void
+test_all_failed (TestCase *tc,
+                 gconstpointer data)
+{
+  g_assert (!cockpit_metrics_aggregate_close (tc->aggregate, 1, "terminated"));
+  assert_sent_json (tc, "{\"host\":\"two\",\"problem\":\"terminated\"}");
+  g_assert (cockpit_metrics_aggregate_close (tc->aggregate, 0, "no-host"));
+  g_assert_cmpstr (cockpit_metrics_aggregate_get_problem (tc->aggregate), ==, "no-host");
+
+  /* Never became ready */
+  g_assert (g_queue_is_empty (&tc->control));
+}
+
+static void
+test_invalid (TestCase *tc,
+              gconstpointer data)
+{
+  cockpit_expect_message ("one: received metrics data before meta message");
+  g_assert (!recv_string (tc, 0, "[[1]]"));
+
+  send_metas (tc);
+
+  cockpit_expect_message ("one: received invalid metrics data message");
+  g_assert (!recv_string (tc, 0, "[[1]"));
+  cockpit_expect_message ("two: received invalid metrics data message");
+  g_assert (!recv_string (tc, 1, "x"));
+  cockpit_expect_message ("two: received metrics meta message without a valid timestamp and interval");
+  g_assert (!recv_string (tc, 1, "{\"interval\":0}"));
+
+  g_assert (g_queue_is_empty (&tc->sent));
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  cockpit_test_init (&argc, &argv);
+
+  g_test_add ("/metrics-aggregate/combine", TestCase, NULL,
+              setup, test_combine, teardown);
+  g_test_add ("/metrics-aggregate/late", TestCase, NULL,
+              setup, test_late, teardown);
+  g_test_add ("/metrics-aggregate/meta-flushes", TestCase, NULL,
+              setup, test_meta_flushes, teardown);
+  g_test_add ("/metrics-aggregate/ready-close", TestCase, NULL,
+              setup, test_ready_close, teardown);
+  g_test_add ("/metrics-aggregate/all-failed", TestCase, NULL,
+              setup, test_all_failed, teardown);
+  g_test_add ("/metrics-aggregate/invalid", TestCase, NULL,
+              setup, test_invalid, teardown);
+
+  return g_test_run ();
+}
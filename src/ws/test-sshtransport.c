@@ -87,6 +87,7 @@ typedef struct {
 
     gboolean no_password;
     gboolean ignore_key;
+    gboolean io_thread;
     int ssh_log_level;
 
     gboolean use_auth_pipe;
@@ -262,6 +263,7 @@ setup_transport (TestCase *tc,
                                 "creds", creds,
                                 "host-key", expect_knownhosts,
                                 "ignore-key", ignore_key,
+                                "io-thread", fixture->io_thread,
                                 NULL);
 
   cockpit_creds_unref (creds);
@@ -360,6 +362,16 @@ static const TestFixture fixture_cat = {
   .ssh_command = "cat"
 };
 
+static const TestFixture fixture_mock_echo_thread = {
+  .ssh_command = BUILDDIR "/mock-echo",
+  .io_thread = TRUE,
+};
+
+static const TestFixture fixture_cat_thread = {
+  .ssh_command = "cat",
+  .io_thread = TRUE,
+};
+
 static void
 test_echo_and_close (TestCase *tc,
                      gconstpointer data)
@@ -1028,6 +1040,44 @@ test_close_while_connecting (TestCase *tc,
   g_free (problem);
 }
 
+static void
+test_connect_queue (TestCase *tc,
+                    gconstpointer data)
+{
+  CockpitTransport *waiting;
+  CockpitTransport *later;
+  CockpitCreds *creds;
+  gchar *problem = NULL;
+
+  /* The transport from setup already has the only thread */
+  cockpit_ssh_connect_threads = 1;
+
+  creds = cockpit_creds_new ("user", "cockpit", COCKPIT_CRED_PASSWORD, "unused password", NULL);
+  waiting = cockpit_ssh_transport_new ("localhost", 65533, creds);
+  later = cockpit_ssh_transport_new ("localhost", 65533, creds);
+  cockpit_creds_unref (creds);
+
+  /* Closing while waiting for a thread happens right away */
+  g_signal_connect (waiting, "closed", G_CALLBACK (on_closed_get_problem), &problem);
+  cockpit_transport_close (waiting, "special-problem");
+  g_assert_cmpstr (problem, ==, "special-problem");
+  g_object_unref (waiting);
+  g_free (problem);
+  problem = NULL;
+
+  /* The other one connects once the first one is done */
+  cockpit_expect_message ("*couldn't connect*");
+  g_signal_connect (later, "closed", G_CALLBACK (on_closed_get_problem), &problem);
+  while (problem == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_cmpstr (problem, ==, "no-host");
+  g_object_unref (later);
+  g_free (problem);
+
+  cockpit_ssh_connect_threads = 8;
+}
+
 #ifdef HAVE_SSH_SET_AGENT_SOCKET
 
 
@@ -1136,6 +1186,12 @@ main (int argc,
               setup_transport, test_echo_queue, teardown);
   g_test_add ("/ssh-transport/echo-large", TestCase, &fixture_cat,
               setup_transport, test_echo_large, teardown);
+  g_test_add ("/ssh-transport/io-thread/echo-message", TestCase, &fixture_mock_echo_thread,
+              setup_transport, test_echo_and_close, teardown);
+  g_test_add ("/ssh-transport/io-thread/echo-large", TestCase, &fixture_cat_thread,
+              setup_transport, test_echo_large, teardown);
+  g_test_add ("/ssh-transport/io-thread/close-problem", TestCase, &fixture_cat_thread,
+              setup_transport, test_close_problem, teardown);
 
   g_test_add ("/ssh-transport/close-problem", TestCase, &fixture_cat,
               setup_transport, test_close_problem, teardown);
@@ -1184,6 +1240,8 @@ main (int argc,
   g_test_add ("/ssh-transport/close-while-connecting", TestCase, &fixture_cat,
               setup_transport, test_close_while_connecting, teardown);
   g_test_add_func ("/ssh-transport/cannot-connect", test_cannot_connect);
+  g_test_add ("/ssh-transport/connect-queue", TestCase, &fixture_cat,
+              setup_transport, test_connect_queue, teardown);
 
   g_test_add ("/ssh-transport/unknown-hostkey", TestCase, &fixture_unknown_hostkey,
               setup_transport, test_unknown_hostkey, teardown);
@@ -32,6 +32,8 @@
 #include "common/cockpitwebserver.h"
 #include "common/cockpitconf.h"
 
+#include "bridge/mock-transport.h"
+
 #include "websocket/websocket.h"
 
 #include <glib.h>
@@ -296,6 +298,7 @@ teardown_for_socket (TestCase *test,
 
   /* Reset this if changed by a test */
   cockpit_ws_session_timeout = 30;
+  cockpit_ws_max_idle_sessions = 64;
 
   cockpit_assert_expected ();
   alarm (0);
@@ -1030,6 +1033,43 @@ test_host_port (TestCase *test,
   g_free (host);
 }
 
+static void
+test_host_shared (TestCase *test,
+                  gconstpointer data)
+{
+  CockpitWebService *service;
+  CockpitTransport *transport;
+  JsonObject *options;
+  gchar *hosts[3];
+  guint i;
+
+  /* Other ways of saying the same user, host and port */
+  hosts[0] = g_strdup_printf ("%s@127.0.0.1", g_get_user_name ());
+  hosts[1] = g_strdup_printf ("127.0.0.1:%d", (gint)test->ssh_port);
+  hosts[2] = g_strdup_printf ("%s@127.0.0.1:%d", g_get_user_name (), (gint)test->ssh_port);
+
+  service = cockpit_web_service_new (test->creds, NULL);
+
+  options = json_object_new ();
+  json_object_set_string_member (options, "host", "127.0.0.1");
+  transport = cockpit_web_service_ensure_transport (service, options);
+  json_object_unref (options);
+  g_assert (transport != NULL);
+
+  for (i = 0; i < G_N_ELEMENTS (hosts); i++)
+    {
+      options = json_object_new ();
+      json_object_set_string_member (options, "host", hosts[i]);
+      g_assert (cockpit_web_service_ensure_transport (service, options) == transport);
+      json_object_unref (options);
+      g_free (hosts[i]);
+    }
+
+  g_object_add_weak_pointer (G_OBJECT (service), (gpointer *)&service);
+  g_object_unref (service);
+  WAIT_UNTIL (service == NULL);
+}
+
 static void
 test_specified_creds_fail (TestCase *test,
                            gconstpointer data)
@@ -1670,6 +1710,89 @@ test_timeout_session (TestCase *test,
   close_client_and_stop_web_service (test, ws, service);
 }
 
+static void
+on_closed_set_flag (CockpitTransport *transport,
+                    const gchar *problem,
+                    gpointer data)
+{
+  gboolean *flag = data;
+  g_assert (*flag == FALSE);
+  *flag = TRUE;
+}
+
+static void
+test_preconnect (TestCase *test,
+                 gconstpointer data)
+{
+  CockpitWebService *service;
+  CockpitTransport *transport;
+  JsonObject *options;
+  gboolean closed = FALSE;
+
+  cockpit_ws_session_timeout = 1;
+  cockpit_config_file = SRCDIR "/src/ws/mock-preconnect.conf";
+
+  service = cockpit_web_service_new (test->creds, NULL);
+
+  /* Looking the host up doesn't add a channel to the session */
+  options = json_object_new ();
+  json_object_set_string_member (options, "host", "localhost");
+  transport = cockpit_web_service_ensure_transport (service, options);
+  json_object_unref (options);
+  g_assert (transport != NULL);
+
+  /* An unused preconnected session gets closed */
+  g_signal_connect (transport, "closed", G_CALLBACK (on_closed_set_flag), &closed);
+  WAIT_UNTIL (closed == TRUE);
+
+  g_object_add_weak_pointer (G_OBJECT (service), (gpointer *)&service);
+  g_object_unref (service);
+  WAIT_UNTIL (service == NULL);
+  cockpit_conf_cleanup ();
+}
+
+static void
+test_idle_sessions_limit (TestCase *test,
+                          gconstpointer data)
+{
+  CockpitWebService *service1;
+  CockpitWebService *service2;
+  CockpitTransport *transport;
+  JsonObject *options;
+  gboolean closed1 = FALSE;
+  gboolean closed2 = FALSE;
+
+  cockpit_ws_max_idle_sessions = 1;
+  cockpit_config_file = SRCDIR "/src/ws/mock-preconnect.conf";
+
+  options = json_object_new ();
+  json_object_set_string_member (options, "host", "localhost");
+
+  service1 = cockpit_web_service_new (test->creds, NULL);
+  transport = cockpit_web_service_ensure_transport (service1, options);
+  g_assert (transport != NULL);
+  g_signal_connect (transport, "closed", G_CALLBACK (on_closed_set_flag), &closed1);
+
+  /* The limit is for all logins, so the older idle session gets closed */
+  service2 = cockpit_web_service_new (test->creds, NULL);
+  transport = cockpit_web_service_ensure_transport (service2, options);
+  g_assert (transport != NULL);
+  g_signal_connect (transport, "closed", G_CALLBACK (on_closed_set_flag), &closed2);
+
+  WAIT_UNTIL (closed1 == TRUE);
+  g_assert (closed2 == FALSE);
+
+  json_object_unref (options);
+
+  g_object_add_weak_pointer (G_OBJECT (service1), (gpointer *)&service1);
+  g_object_unref (service1);
+  WAIT_UNTIL (service1 == NULL);
+  g_object_add_weak_pointer (G_OBJECT (service2), (gpointer *)&service2);
+  g_object_unref (service2);
+  WAIT_UNTIL (service2 == NULL);
+  cockpit_conf_cleanup ();
+}
+
 static void
 on_idling_set_flag (CockpitWebService *service,
                     gpointer data)
@@ -1780,6 +1903,293 @@ test_dispose (TestCase *test,
   g_object_unref (client);
 }
 
+static void
+on_message_push (WebSocketConnection *ws,
+                 WebSocketDataType type,
+                 GBytes *message,
+                 gpointer user_data)
+{
+  GPtrArray *received = user_data;
+  g_ptr_array_add (received, g_bytes_ref (message));
+}
+
+static JsonObject *
+parse_control_message (GBytes *message)
+{
+  const gchar *command;
+  const gchar *channel;
+  JsonObject *options;
+  gchar *outer_channel;
+  GBytes *payload;
+
+  payload = cockpit_transport_parse_frame (message, &outer_channel);
+  g_assert (payload != NULL);
+  if (outer_channel)
+    {
+      g_free (outer_channel);
+      g_bytes_unref (payload);
+      return NULL;
+    }
+
+  g_assert (cockpit_transport_parse_command (payload, &command, &channel, &options));
+  g_bytes_unref (payload);
+  return options;
+}
+
+static void
+test_resume (TestCase *test,
+             gconstpointer data)
+{
+  WebSocketConnection *ws;
+  WebSocketConnection *client;
+  CockpitWebService *service;
+  GPtrArray *received;
+  JsonObject *options;
+  const gchar *command;
+  const gchar *value;
+  gchar *token;
+  gint64 count;
+  GBytes *sent;
+  guint i;
+
+  received = g_ptr_array_new_with_free_func ((GDestroyNotify)g_bytes_unref);
+  sent = g_bytes_new_static ("4\ntest", 6);
+
+  /* Sends a "test" message in channel "4" and waits for the echo */
+  start_web_service_and_connect_client (test, data, &ws, &service);
+  g_signal_connect (ws, "message", G_CALLBACK (on_message_push), received);
+  WAIT_UNTIL (received->len > 0 && g_bytes_equal (received->pdata[received->len - 1], sent));
+
+  options = parse_control_message (received->pdata[0]);
+  g_assert (options != NULL);
+  g_assert (cockpit_json_get_string (options, "resume", NULL, &value));
+  g_assert (value != NULL);
+  token = g_strdup (value);
+  json_object_unref (options);
+
+  /* The network goes away without either side closing */
+  cockpit_expect_log ("WebSocket", G_LOG_LEVEL_MESSAGE, "connection unexpectedly closed*");
+  cockpit_expect_log ("WebSocket", G_LOG_LEVEL_MESSAGE, "connection unexpectedly closed*");
+  g_signal_handlers_disconnect_by_func (ws, on_error_not_reached, NULL);
+  g_socket_shutdown (g_socket_connection_get_socket (G_SOCKET_CONNECTION (test->io_a)), TRUE, TRUE, NULL);
+  WAIT_UNTIL (web_socket_connection_get_ready_state (ws) == WEB_SOCKET_STATE_CLOSED);
+  g_object_unref (ws);
+
+  /* Still busy, with the socket waiting to resume */
+  g_assert (!cockpit_web_service_get_idling (service));
+
+  teardown_io_streams (test, data);
+  setup_io_streams (test, data);
+
+  client = g_object_new (WEB_SOCKET_TYPE_CLIENT,
+                         "url", "ws://127.0.0.1/unused",
+                         "origin", "http://127.0.0.1",
+                         "io-stream", test->io_a,
+                         NULL);
+  g_signal_connect (client, "error", G_CALLBACK (on_error_not_reached), NULL);
+  cockpit_web_service_socket (service, "/unused", test->io_b, NULL, NULL);
+  WAIT_UNTIL (web_socket_connection_get_ready_state (client) != WEB_SOCKET_STATE_CONNECTING);
+  g_assert (web_socket_connection_get_ready_state (client) == WEB_SOCKET_STATE_OPEN);
+
+  /* Pretend only the "init" arrived, so the rest gets sent again */
+  g_ptr_array_set_size (received, 0);
+  g_signal_connect (client, "message", G_CALLBACK (on_message_push), received);
+  send_control_message (client, "init", NULL, "resume", token,
+                        BUILD_INTS, "version", 1, "received", 1, NULL);
+  WAIT_UNTIL (received->len > 0 && g_bytes_equal (received->pdata[received->len - 1], sent));
+
+  /* A fresh "init", then the "resume" before anything replayed */
+  options = parse_control_message (received->pdata[0]);
+  g_assert (cockpit_json_get_string (options, "command", NULL, &command));
+  g_assert_cmpstr (command, ==, "init");
+  json_object_unref (options);
+
+  options = parse_control_message (received->pdata[1]);
+  g_assert (cockpit_json_get_string (options, "command", NULL, &command));
+  g_assert_cmpstr (command, ==, "resume");
+  g_assert (cockpit_json_get_int (options, "received", -1, &count));
+  g_assert_cmpint (count, ==, 3);
+  json_object_unref (options);
+
+  for (i = 2; i < received->len - 1; i++)
+    g_assert (!g_bytes_equal (received->pdata[i], sent));
+
+  /* The channel carries on as before */
+  g_ptr_array_set_size (received, 0);
+  web_socket_connection_send (client, WEB_SOCKET_DATA_TEXT, NULL, sent);
+  WAIT_UNTIL (received->len > 0 && g_bytes_equal (received->pdata[received->len - 1], sent));
+
+  g_free (token);
+  g_bytes_unref (sent);
+  g_ptr_array_free (received, TRUE);
+  close_client_and_stop_web_service (test, client, service);
+}
+
+static void
+test_resume_unknown (TestCase *test,
+                     gconstpointer data)
+{
+  WebSocketConnection *ws;
+  CockpitWebService *service;
+  GBytes *received = NULL;
+
+  start_web_service_and_create_client (test, data, &ws, &service);
+  WAIT_UNTIL (web_socket_connection_get_ready_state (ws) != WEB_SOCKET_STATE_CONNECTING);
+  g_assert (web_socket_connection_get_ready_state (ws) == WEB_SOCKET_STATE_OPEN);
+
+  cockpit_expect_log ("WebSocket", G_LOG_LEVEL_MESSAGE, "connection unexpectedly closed*");
+
+  /* Nothing to resume with this token */
+  g_signal_connect (ws, "message", G_CALLBACK (on_message_get_bytes), &received);
+  send_control_message (ws, "init", NULL, "resume", "0123456789abcdef",
+                        BUILD_INTS, "version", 1, "received", 0, NULL);
+
+  WAIT_UNTIL (received != NULL);
+  expect_control_message (received, "init", NULL, NULL);
+  g_bytes_unref (received);
+  received = NULL;
+
+  WAIT_UNTIL (received != NULL);
+  expect_control_message (received, "close", NULL, "problem", "disconnected", NULL);
+  g_bytes_unref (received);
+  received = NULL;
+
+  close_client_and_stop_web_service (test, ws, service);
+}
+
+static WebSocketConnection *
+connect_pressure_client (CockpitWebService *service,
+                         GIOStream *io_client,
+                         GIOStream *io_server,
+                         const gchar *channel,
+                         GPtrArray *received)
+{
+  WebSocketConnection *client;
+
+  client = g_object_new (WEB_SOCKET_TYPE_CLIENT,
+                         "url", "ws://127.0.0.1/unused",
+                         "origin", "http://127.0.0.1",
+                         "io-stream", io_client,
+                         NULL);
+  g_signal_connect (client, "error", G_CALLBACK (on_error_not_reached), NULL);
+  g_signal_connect (client, "message", G_CALLBACK (on_message_push), received);
+  cockpit_web_service_socket (service, "/unused", io_server, NULL, NULL);
+  WAIT_UNTIL (web_socket_connection_get_ready_state (client) != WEB_SOCKET_STATE_CONNECTING);
+  g_assert (web_socket_connection_get_ready_state (client) == WEB_SOCKET_STATE_OPEN);
+
+  send_control_message (client, "init", NULL, BUILD_INTS, "version", 1, NULL);
+  send_control_message (client, "open", channel, "payload", "stream", NULL);
+  return client;
+}
+
+static void
+test_pressure_shared (TestCase *test,
+                      gconstpointer data)
+{
+  WebSocketConnection *client_a;
+  WebSocketConnection *client_b;
+  CockpitWebService *service;
+  MockTransport *transport;
+  JsonObject *control;
+  GIOStream *io_c, *io_d;
+  GPtrArray *received_a;
+  GPtrArray *received_b;
+  GSocket *socket1, *socket2;
+  GError *error = NULL;
+  GBytes *payload;
+  GBytes *small;
+  gsize saved_high;
+  gsize saved_low;
+  gchar *large;
+  guint opened;
+  int fds[2];
+  guint i;
+
+  saved_high = cockpit_ws_pressure_high;
+  saved_low = cockpit_ws_pressure_low;
+  cockpit_ws_pressure_high = 0;
+  cockpit_ws_pressure_low = 0;
+  cockpit_ws_default_host_header = "127.0.0.1";
+
+  /* A second pair of streams for the other socket */
+  if (socketpair (PF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    g_assert_not_reached ();
+  socket1 = g_socket_new_from_fd (fds[0], &error);
+  g_assert_no_error (error);
+  socket2 = g_socket_new_from_fd (fds[1], &error);
+  g_assert_no_error (error);
+  io_c = G_IO_STREAM (g_socket_connection_factory_create_connection (socket1));
+  io_d = G_IO_STREAM (g_socket_connection_factory_create_connection (socket2));
+  g_object_unref (socket1);
+  g_object_unref (socket2);
+
+  transport = mock_transport_new ();
+  service = cockpit_web_service_new (test->creds, COCKPIT_TRANSPORT (transport));
+
+  payload = g_bytes_new_static ("{\"command\":\"init\",\"version\":1}", 32);
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (transport), NULL, payload);
+  g_bytes_unref (payload);
+
+  received_a = g_ptr_array_new_with_free_func ((GDestroyNotify)g_bytes_unref);
+  received_b = g_ptr_array_new_with_free_func ((GDestroyNotify)g_bytes_unref);
+
+  /* Both sockets talk to the same session */
+  client_a = connect_pressure_client (service, test->io_a, test->io_b, "a", received_a);
+  client_b = connect_pressure_client (service, io_c, io_d, "b", received_b);
+
+  opened = 0;
+  while (opened < 2)
+    {
+      control = mock_transport_pop_control (transport);
+      if (control)
+        {
+          if (g_str_equal (json_object_get_string_member (control, "command"), "open"))
+            opened++;
+        }
+      else
+        {
+          g_main_context_iteration (NULL, TRUE);
+        }
+    }
+
+  /* A little for one socket, more than the kernel buffers for the other */
+  payload = g_bytes_new_static ("small", 5);
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (transport), "a", payload);
+  g_bytes_unref (payload);
+
+  large = g_strnfill (64 * 1024, 'x');
+  payload = g_bytes_new_take (large, 64 * 1024);
+  for (i = 0; i < 64; i++)
+    cockpit_transport_emit_recv (COCKPIT_TRANSPORT (transport), "b", payload);
+  g_bytes_unref (payload);
+
+  g_assert (transport->pressure);
+
+  /* The first socket draining doesn't resume the session for the other */
+  small = g_bytes_new_static ("a\nsmall", 7);
+  WAIT_UNTIL (received_a->len > 0 && g_bytes_equal (received_a->pdata[received_a->len - 1], small));
+  g_assert (transport->pressure);
+  g_bytes_unref (small);
+
+  /* Only once both have caught up */
+  WAIT_UNTIL (!transport->pressure);
+  WAIT_UNTIL (received_b->len > 64);
+
+  cockpit_ws_pressure_high = saved_high;
+  cockpit_ws_pressure_low = saved_low;
+
+  web_socket_connection_close (client_b, 0, NULL);
+  WAIT_UNTIL (web_socket_connection_get_ready_state (client_b) == WEB_SOCKET_STATE_CLOSED);
+  g_object_unref (client_b);
+  g_object_unref (io_c);
+  g_object_unref (io_d);
+
+  g_ptr_array_free (received_a, TRUE);
+  g_ptr_array_free (received_b, TRUE);
+  close_client_and_stop_web_service (test, client_a, service);
+  g_object_unref (transport);
+}
+
 static void
 test_logout (TestCase *test,
              gconstpointer data)
@@ -2026,14 +2436,26 @@ main (int argc,
               &fixture_rfc6455, setup_for_socket_spec,
               test_host_port, teardown_for_socket);
 
+  g_test_add ("/web-service/host-shared", TestCase, NULL,
+              setup_for_socket, test_host_shared, teardown_for_socket);
   g_test_add ("/web-service/timeout-session", TestCase, NULL,
               setup_for_socket, test_timeout_session, teardown_for_socket);
+  g_test_add ("/web-service/preconnect", TestCase, NULL,
+              setup_for_socket, test_preconnect, teardown_for_socket);
+  g_test_add ("/web-service/idle-sessions-limit", TestCase, NULL,
+              setup_for_socket, test_idle_sessions_limit, teardown_for_socket);
   g_test_add ("/web-service/idling-signal", TestCase, NULL,
               setup_for_socket, test_idling, teardown_for_socket);
   g_test_add ("/web-service/force-dispose", TestCase, NULL,
               setup_for_socket, test_dispose, teardown_for_socket);
   g_test_add ("/web-service/logout", TestCase, NULL,
               setup_for_socket, test_logout, teardown_for_socket);
+  g_test_add ("/web-service/resume", TestCase, NULL,
+              setup_for_socket, test_resume, teardown_for_socket);
+  g_test_add ("/web-service/resume-unknown", TestCase, NULL,
+              setup_for_socket, test_resume_unknown, teardown_for_socket);
+  g_test_add ("/web-service/pressure-shared", TestCase, NULL,
+              setup_for_socket, test_pressure_shared, teardown_for_socket);
 
   g_test_add_func ("/web-service/parse-external/success", test_parse_external);
   for (i = 0; i < G_N_ELEMENTS (external_failure_fixtures); i++)
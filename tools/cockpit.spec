@@ -73,6 +73,7 @@ BuildRequires: systemd-devel
 BuildRequires: polkit
 BuildRequires: pcp-libs-devel
 BuildRequires: gdb
+BuildRequires: systemtap-sdt-devel
 
 %if %{defined gitcommit}
 BuildRequires: krb5-server
@@ -295,6 +296,8 @@ cat subscriptions.list sosreport.list networkmanager.list >> shell.list
 %doc %{_mandir}/man1/cockpit-bridge.1.gz
 %{_bindir}/cockpit-bridge
 %attr(4755, -, -) %{_libexecdir}/cockpit-polkit
+%{_libexecdir}/cockpit-recorder
+%{_unitdir}/cockpit-recorder.service
 %{_libdir}/security/pam_reauthorize.so
 
 %files doc